@@ -45,6 +45,11 @@ typedef void (*arm_write8_fn_t)(void* user_data, uint32_t address, uint8_t data)
 typedef uint32_t (*arm_coproc_read_fn_t)(void* user_data, int coproc,int opcode,int Cn, int Cm,int Cp);
 typedef void (*arm_coproc_write_fn_t)(void* user_data, int coproc,int opcode,int Cn, int Cm,int Cp, uint32_t data);
 typedef void (*arm_trigger_breakpoint_fn_t)(void* user_data);
+// Returns true if the SWI was emulated and the BIOS handler should be skipped
+typedef bool (*arm_software_interrupt_fn_t)(void* user_data, uint32_t swi_number);
+// Returns a host pointer to words 32 bit words of side effect free memory at address after charging 
+// their bus cycles (and noting the writes), or NULL if the LDM/STM has to use the per register path
+typedef uint32_t* (*arm_block_ptr_fn_t)(void* user_data, uint32_t address, uint32_t words, bool write);
 
 
 #define ARM_DEBUG_BRANCH_RING_SIZE 32
@@ -52,7 +57,13 @@ typedef void (*arm_trigger_breakpoint_fn_t)(void* user_data);
 typedef struct {
   // Registers
   /*
-  0-15: R0-R15
+  0-15: R0-R15 of the current mode
+  16: CPSR
+  17-31: Banked registers, the slots of the current mode hold the user mode copies instead
+  32-36: SPSRs
+  Mode changes swap the banks (see arm7_set_cpsr) so accesses never have to look up the mode.
+  arm7_get_registers/arm7_set_registers convert from and to the canonical layout:
+  0-15: R0-R15 (user bank)
   16: CPSR
   17-23: R8_fiq-R14_fiq
   24-25: R13_irq-R14_irq
@@ -65,22 +76,18 @@ typedef struct {
   35: SPSR_abt
   36: SPSR_und
   */
-
-  uint32_t debug_branch_ring[ARM_DEBUG_BRANCH_RING_SIZE];
-  uint32_t debug_branch_ring_offset;
-  uint32_t debug_swi_ring[ARM_DEBUG_SWI_RING_SIZE];
-  uint32_t debug_swi_ring_times[ARM_DEBUG_SWI_RING_SIZE];
-  uint32_t debug_swi_ring_offset;
+  uint32_t registers[37];
+  // Flags of the last S data processing op, only stored into the CPSR when something reads them
+  uint8_t lazy_flags; // ARM_LAZY_FLAGS_*
+  uint32_t lazy_flags_a;
+  uint32_t lazy_flags_b;
+  uint64_t lazy_flags_result;
   uint32_t prefetch_pc;
-  uint32_t step_instructions;//Instructions to step before triggering a breakpoint
   uint32_t prefetch_opcode[5]; 
   uint32_t i_cycles;//Executed i-cycles minus 1
   bool next_fetch_sequential;
-  uint32_t registers[37];
   uint64_t executed_instructions;
-  bool print_instructions;
   void* user_data;
-  FILE* log_cmp_file;
   arm_read32_fn_t     read32;
   arm_read16_fn_t     read16;
   arm_read32_seq_fn_t read32_seq;
@@ -92,6 +99,8 @@ typedef struct {
   arm_coproc_read_fn_t coprocessor_read;
   arm_coproc_write_fn_t coprocessor_write;
   arm_trigger_breakpoint_fn_t trigger_breakpoint; 
+  arm_software_interrupt_fn_t software_interrupt; // Optional high level BIOS, NULL runs every SWI through the BIOS
+  arm_block_ptr_fn_t block_ptr; // Optional, lets block transfers to plain RAM complete in a single step
   bool wait_for_interrupt; 
   uint32_t irq_table_address; 
   uint32_t phased_opcode; 
@@ -105,8 +114,41 @@ typedef struct {
     uint32_t cycle;
     uint32_t num_regs;
   }block;
+  // Optional breakpoints and watchpoints (NULL when none are set). Owned by the user, not part of the CPU state.
+  sb_watch_table_t* watch;
+  // Optional PC sampling profiler (NULL when disabled). Owned by the user.
+  sb_pc_profile_t* pc_profile;
+  // Optional execution trace (NULL when disabled). Owned by the user.
+  sb_exec_trace_t* exec_trace;
+  // Debugger state, kept after everything the interpreter touches per instruction
+  uint32_t step_instructions;//Instructions to step before triggering a breakpoint
+  bool print_instructions;
+  FILE* log_cmp_file;
+  uint32_t debug_branch_ring[ARM_DEBUG_BRANCH_RING_SIZE];
+  uint32_t debug_branch_ring_offset;
+  uint32_t debug_swi_ring[ARM_DEBUG_SWI_RING_SIZE];
+  uint32_t debug_swi_ring_times[ARM_DEBUG_SWI_RING_SIZE];
+  uint32_t debug_swi_ring_offset;
 } arm7_t;     
 
+// Called by the memory callbacks of the user for CPU accesses
+static FORCE_INLINE void arm7_watch_access(arm7_t* cpu, uint32_t address, uint32_t size, int type){
+  if(SB_UNLIKELY(cpu->watch)&&sb_watch_access(cpu->watch,address,size,type)){
+    if(cpu->trigger_breakpoint)cpu->trigger_breakpoint(cpu->user_data);
+  }
+}
+// Called by the write callbacks of the user for CPU stores
+static FORCE_INLINE void arm7_trace_write(arm7_t* cpu, uint32_t address, uint32_t size, uint32_t value){
+  if(SB_UNLIKELY(cpu->exec_trace))sb_exec_trace_write(cpu->exec_trace,address,size,value);
+}
+// Returns true if an execute breakpoint holds the CPU before the next instruction
+static FORCE_INLINE bool arm7_watch_exec(arm7_t* cpu){
+  if(SB_LIKELY(!cpu->watch)||!sb_watch_exec(cpu->watch,cpu->registers[PC]))return false;
+  if(cpu->trigger_breakpoint)cpu->trigger_breakpoint(cpu->user_data);
+  cpu->i_cycles+=1;
+  return true;
+}
+
 typedef void (*arm7_handler_t)(arm7_t *cpu, uint32_t opcode);
 typedef struct{
 	arm7_handler_t handler;
@@ -114,6 +156,28 @@ typedef struct{
 	char bitfield[33];
 }arm7_instruction_t;
 
+// Idle loop detection: a short backwards loop whose iterations leave every register unchanged 
+// and don't cause side effects (tracked by the user through a counter) can't make progress until 
+// an external event happens, so the user may fast forward to that event.  
+#define ARM_IDLE_LOOP_MAX_BYTES 32
+#define ARM_IDLE_LOOP_CONFIRM_ITERATIONS 2
+typedef struct{
+  uint32_t loop_pc;      // Branch target of the loop being watched
+  uint32_t side_effects; // User side effect counter at the last loop head
+  uint32_t registers[37];
+  uint32_t matches;
+  bool idle;
+  // Branch target of a loop known to only wait for events (ie. from a game profile) whose registers
+  // may change between iterations, like a timeout counter. 0 for none
+  uint32_t hint_pc;
+}arm7_idle_loop_t;
+
+// Which CPSR flags are pending on lazy_flags_result: none, NZ (logical ops) or NZCV of a-b/a+b
+#define ARM_LAZY_FLAGS_NONE  0
+#define ARM_LAZY_FLAGS_LOGIC 1
+#define ARM_LAZY_FLAGS_SUB   2
+#define ARM_LAZY_FLAGS_ADD   3
+
 #define ARM_PHASED_NONE      0 
 #define ARM_PHASED_FILL_PIPE 1
 #define ARM_PHASED_BLOCK_TRANSFER 2
@@ -130,6 +194,16 @@ static void arm7_exec_instruction(arm7_t* cpu);
 static void arm7_get_disasm(arm7_t * cpu, uint32_t mem_address, char* out_disasm, size_t out_size);
 // Used to send an interrupt to the emulated CPU. The n'th set bit triggers the n'th interrupt
 static void arm7_process_interrupts(arm7_t* cpu);
+// Reads the CPSR with any pending flags applied
+static FORCE_INLINE uint32_t arm7_get_cpsr(arm7_t* cpu);
+// Writes the CPSR, switching the register bank if the mode changes
+static FORCE_INLINE void arm7_set_cpsr(arm7_t* cpu, uint32_t cpsr);
+// Copies the registers from or to the canonical banked layout used by save states
+static void arm7_get_registers(arm7_t* cpu, uint32_t* registers);
+static void arm7_set_registers(arm7_t* cpu, const uint32_t* registers);
+// Must be called after every executed instruction with the PC it started at. Returns true while the
+// CPU sits in a loop that can be skipped, users should clear loop->idle after skipping forward. 
+static FORCE_INLINE bool arm7_idle_loop_update(arm7_idle_loop_t* loop, arm7_t* cpu, uint32_t pc_before, uint32_t side_effects);
 ///////////////////////////////////////////
 // Functions for Internal Implementation //
 ///////////////////////////////////////////
@@ -197,6 +271,7 @@ static FORCE_INLINE uint32_t arm7_reg_read(arm7_t*cpu, unsigned reg);
 static FORCE_INLINE uint32_t arm7_reg_read_r15_adj(arm7_t*cpu, unsigned reg, int r15_off);
 static FORCE_INLINE void arm7_reg_write(arm7_t*cpu, unsigned reg, uint32_t value);
 static FORCE_INLINE unsigned arm7_reg_index(arm7_t* cpu, unsigned reg);
+static FORCE_INLINE unsigned arm7_banked_reg_index(arm7_t* cpu, unsigned reg);
 static int arm_lookup_arm_instruction_class(const arm7_instruction_t*instruction_table, uint32_t opcode_key);
 static int arm_lookup_thumb_instruction_class(const arm7_instruction_t*instruction_table,uint32_t opcode_key);
 static FORCE_INLINE uint32_t arm7_shift(arm7_t* arm, uint32_t opcode, uint64_t value, uint32_t shift_value, int* carry);
@@ -422,7 +497,9 @@ static const char* arm9_disasm_lookup_table[4096] = { 0 };
 static const char* arm7t_disasm_lookup_table[256] = { 0 };
 static const char* arm9t_disasm_lookup_table[256] = { 0 };
 
-static FORCE_INLINE unsigned arm7_reg_index(arm7_t* cpu, unsigned reg){
+// Canonical slot of reg in the current mode. Since the current bank is swapped into R0-R15, for 
+// R8-R14 this is where the user mode copy lives while a privileged mode is active
+static FORCE_INLINE unsigned arm7_banked_reg_index(arm7_t* cpu, unsigned reg){
   if(SB_LIKELY(reg<8))return reg;
   int mode = cpu->registers[CPSR]&0xf;
 
@@ -451,11 +528,81 @@ static FORCE_INLINE unsigned arm7_reg_index(arm7_t* cpu, unsigned reg){
   printf("Undefined ARM mode: %d\n",mode);
   return 0;
 }
+static FORCE_INLINE void arm7_flush_lazy_flags(arm7_t* cpu){
+  if(SB_LIKELY(cpu->lazy_flags==ARM_LAZY_FLAGS_NONE))return;
+  uint64_t result = cpu->lazy_flags_result;
+  uint32_t a = cpu->lazy_flags_a, b = cpu->lazy_flags_b;
+  uint32_t cpsr = cpu->registers[CPSR];
+  bool N = ARM7_BFE(result,31,1);
+  bool Z = (result&0xffffffff)==0;
+  bool C = ARM7_BFE(cpsr,29,1);
+  bool V = ARM7_BFE(cpsr,28,1);
+  if(cpu->lazy_flags==ARM_LAZY_FLAGS_SUB){
+    C = !ARM7_BFE(result,32,1);
+    // if (a has a different sign as b and result has a differnt sign to a)
+    V = (((a ^ b) & (a ^ result)) >> 31)&1;
+  }else if(cpu->lazy_flags==ARM_LAZY_FLAGS_ADD){
+    C = ARM7_BFE(result,32,1);
+    // if (a has the same sign as b and result has a different sign to a)
+    V = (((a ^ ~b) & (a ^ result)) >> 31)&1;
+  }
+  cpsr&= 0x0fffffff;
+  cpsr|= (N?1:0)<<31;   
+  cpsr|= (Z?1:0)<<30;
+  cpsr|= (C?1:0)<<29; 
+  cpsr|= (V?1:0)<<28;
+  cpu->registers[CPSR] = cpsr;
+  cpu->lazy_flags = ARM_LAZY_FLAGS_NONE;
+}
+static FORCE_INLINE uint32_t arm7_get_cpsr(arm7_t* cpu){
+  arm7_flush_lazy_flags(cpu);
+  return cpu->registers[CPSR];
+}
+static FORCE_INLINE unsigned arm7_reg_index(arm7_t* cpu, unsigned reg){
+  if(SB_LIKELY(reg<16))return reg;
+  arm7_flush_lazy_flags(cpu);
+  return arm7_banked_reg_index(cpu,reg);
+}
+// Swaps the banked registers of mode with the user mode copies, applying it twice is a no-op
+static FORCE_INLINE void arm7_swap_register_bank(uint32_t* registers, uint32_t mode){
+  // First banked register and its slot for each mode (R8_fiq is 17)
+  const static uint8_t first_reg[16]={15, 8,13,13,15,15,15,13,15,15,15,13,15,15,15,15};
+  const static uint8_t bank_slot[16]={ 0,17,R13_irq,R13_svc,0,0,0,R13_abt,0,0,0,R13_und,0,0,0,0};
+  int first = first_reg[mode&0xf];
+  for(int r=first;r<15;++r){
+    uint32_t* banked = registers+bank_slot[mode&0xf]+r-first;
+    uint32_t t = registers[r];
+    registers[r] = *banked;
+    *banked = t;
+  }
+}
+static FORCE_INLINE void arm7_set_cpsr(arm7_t* cpu, uint32_t cpsr){
+  // The new value replaces any pending flags
+  cpu->lazy_flags = ARM_LAZY_FLAGS_NONE;
+  uint32_t old_cpsr = cpu->registers[CPSR];
+  if(SB_UNLIKELY((old_cpsr^cpsr)&0xf)){
+    arm7_swap_register_bank(cpu->registers,old_cpsr);
+    arm7_swap_register_bank(cpu->registers,cpsr);
+  }
+  cpu->registers[CPSR] = cpsr;
+}
+static void arm7_get_registers(arm7_t* cpu, uint32_t* registers){
+  arm7_flush_lazy_flags(cpu);
+  memcpy(registers,cpu->registers,sizeof(cpu->registers));
+  arm7_swap_register_bank(registers,registers[CPSR]);
+}
+static void arm7_set_registers(arm7_t* cpu, const uint32_t* registers){
+  memcpy(cpu->registers,registers,sizeof(cpu->registers));
+  arm7_swap_register_bank(cpu->registers,cpu->registers[CPSR]);
+}
 static FORCE_INLINE void arm7_reg_write(arm7_t*cpu, unsigned reg, uint32_t value){
-  cpu->registers[arm7_reg_index(cpu,reg)] = value;
+  if(SB_LIKELY(reg<16)){cpu->registers[reg] = value;return;}
+  unsigned index = arm7_banked_reg_index(cpu,reg);
+  if(index==CPSR)arm7_set_cpsr(cpu,value);
+  else cpu->registers[index] = value;
 } 
 static FORCE_INLINE void arm9_reg_write_r15_thumb(arm7_t*cpu, unsigned reg, uint32_t value){
-  cpu->registers[arm7_reg_index(cpu,reg)] = value;
+  cpu->registers[reg] = value;
   if(SB_UNLIKELY(reg==PC))arm7_set_thumb_bit(cpu,value&1);
 } 
 static FORCE_INLINE uint32_t arm7_reg_read(arm7_t*cpu, unsigned reg){
@@ -557,7 +704,10 @@ static int arm_lookup_thumb_instruction_class(const arm7_instruction_t*instructi
   } 
   return matched_class; 
 }
-static arm7_t arm7_init(void* user_data){
+// The lookup tables are shared by every core instance and only built once
+static bool arm7_lookup_tables_ready = false;
+static void arm7_init_lookup_tables(){
+  if(arm7_lookup_tables_ready)return;
   // Generate ARM lookup table
 	for(int i=0;i<4096;++i){
      int inst_class = arm_lookup_arm_instruction_class(arm7_instruction_classes,i);
@@ -581,6 +731,10 @@ static arm7_t arm7_init(void* user_data){
     arm9t_lookup_table[i]=inst_class==-1 ? NULL: arm9t_instruction_classes[inst_class].handler;
     arm9t_disasm_lookup_table[i]=inst_class==-1? NULL: arm9t_instruction_classes[inst_class].name;
   }
+  arm7_lookup_tables_ready = true;
+}
+static arm7_t arm7_init(void* user_data){
+  arm7_init_lookup_tables();
   arm7_t arm = {.user_data = user_data};
   arm.prefetch_pc=-1;
   arm.phase=0;
@@ -595,19 +749,17 @@ static FORCE_INLINE void arm7_set_thumb_bit(arm7_t* cpu, bool value){
 }
 static FORCE_INLINE void arm7_process_interrupts(arm7_t* cpu){
   cpu->wait_for_interrupt=false;
-  uint32_t cpsr = cpu->registers[CPSR];
+  uint32_t cpsr = arm7_get_cpsr(cpu);
   bool I = ARM7_BFE(cpsr,7,1);
   if(I==0&&cpu->phased_op_id==0){
     if(SB_UNLIKELY(cpu->log_cmp_file))return;
     //Interrupts are enabled when I ==0
     bool thumb = arm7_get_thumb_bit(cpu);
-    cpu->registers[R14_irq] = cpu->registers[PC]+4;
+    //Update mode to IRQ and disable interrupts(set I bit)
+    arm7_set_cpsr(cpu,(cpsr&0xffffffE0)| 0x12|0x80);
+    cpu->registers[LR] = cpu->registers[PC]+4;
     cpu->registers[PC] = cpu->irq_table_address+ 0x18; 
     cpu->registers[SPSR_irq] = cpsr;
-    //Update mode to IRQ
-    cpu->registers[CPSR] = (cpsr&0xffffffE0)| 0x12;
-    //Disable interrupts(set I bit)
-    cpu->registers[CPSR] |= 1<<7;
     cpu->i_cycles+=1;
     arm7_set_thumb_bit(cpu,false); 
     cpu->phased_op_id = ARM_PHASED_FILL_PIPE;
@@ -675,32 +827,37 @@ static void arm9_get_disasm(arm7_t * cpu, uint32_t mem_address, char* out_disasm
   return; 
 }
 static FORCE_INLINE bool arm7_check_cond_code(arm7_t *cpu, uint32_t opcode){
+  // Bit n of each entry is set if the condition passes for the NZCV nibble n (CPSR bits 28-31)
+  static const uint16_t cond_table[16]={
+    0xf0f0, 0x0f0f, 0xcccc, 0x3333, // EQ NE CS CC
+    0xff00, 0x00ff, 0xaaaa, 0x5555, // MI PL VS VC
+    0x0c0c, 0xf3f3, 0xaa55, 0x55aa, // HI LS GE LT
+    0x0a05, 0xf5fa, 0xffff, 0xffff, // GT LE AL NV
+  };
   uint32_t cond_code = ARM7_BFE(opcode,28,4);
   if(SB_LIKELY(cond_code==0xE))return true;
-  uint32_t cpsr = cpu->registers[CPSR];
-  bool N = ARM7_BFE(cpsr,31,1);
-  bool Z = ARM7_BFE(cpsr,30,1);
-  bool C = ARM7_BFE(cpsr,29,1);
-  bool V = ARM7_BFE(cpsr,28,1);
-  switch(cond_code){
-    case 0x0: return Z;            //EQ: Equal
-    case 0x1: return !Z;           //NE: !Equal
-    case 0x2: return C;            //CS: Unsigned >=
-    case 0x3: return !C;           //CC: Unsigned <
-    case 0x4: return N;            //MI: Negative
-    case 0x5: return !N;           //PL: Positive or Zero
-    case 0x6: return V;            //VS: Overflow
-    case 0x7: return !V;           //VC: No Overflow
-    case 0x8: return C && !Z;      //HI: Unsigned >
-    case 0x9: return !C || Z;      //LS: Unsigned <=
-    case 0xA: return N==V;         //GE: Signed >=
-    case 0xB: return N!=V;         //LT: Signed <  
-    case 0xC: return !Z&&(N==V);   //GT: Signed >  
-    case 0xD: return Z||(N!=V);    //LE: Signed <= 
-    case 0xE: return true;
-    case 0xF: return true;
-  };
-  return false; 
+  return (cond_table[cond_code]>>(arm7_get_cpsr(cpu)>>28))&1;
+}
+static FORCE_INLINE bool arm7_idle_loop_update(arm7_idle_loop_t* loop, arm7_t* cpu, uint32_t pc_before, uint32_t side_effects){
+  uint32_t pc = cpu->registers[PC];
+  if(SB_LIKELY(pc>=pc_before||pc_before-pc>ARM_IDLE_LOOP_MAX_BYTES)){
+    // Leaving the watched loop ends the idle state
+    if(SB_UNLIKELY(loop->idle)&&(pc<loop->loop_pc||pc-loop->loop_pc>ARM_IDLE_LOOP_MAX_BYTES))loop->idle=false;
+    return loop->idle;
+  }
+  // Taken backwards branch, compare this iteration against the previous one
+  arm7_flush_lazy_flags(cpu);
+  if(loop->loop_pc==pc&&loop->side_effects==side_effects&&
+     (pc==loop->hint_pc||memcmp(loop->registers,cpu->registers,sizeof(loop->registers))==0)){
+    if(loop->matches<ARM_IDLE_LOOP_CONFIRM_ITERATIONS)loop->matches++;
+  }else{
+    loop->loop_pc = pc;
+    loop->side_effects = side_effects;
+    memcpy(loop->registers,cpu->registers,sizeof(loop->registers));
+    loop->matches = 0;
+  }
+  loop->idle = loop->matches>=ARM_IDLE_LOOP_CONFIRM_ITERATIONS;
+  return loop->idle;
 }
 static void arm_check_log_file(arm7_t*cpu){
   bool thumb = arm7_get_thumb_bit(cpu);
@@ -834,6 +991,9 @@ static FORCE_INLINE void arm7_exec_instruction(arm7_t* cpu){
       cpu->i_cycles+=1; 
       return;
     }
+    if(SB_UNLIKELY(arm7_watch_exec(cpu)))return;
+    if(SB_UNLIKELY(cpu->pc_profile))sb_pc_profile_tick(cpu->pc_profile,cpu->registers[PC]);
+    if(SB_UNLIKELY(cpu->exec_trace))sb_exec_trace_pc(cpu->exec_trace,cpu->registers[PC]);
     if(SB_UNLIKELY(cpu->log_cmp_file)){
       arm_check_log_file(cpu);
     }
@@ -903,6 +1063,9 @@ static void arm9_exec_instruction(arm7_t* cpu){
       cpu->i_cycles+=1; 
       return;
     }
+    if(SB_UNLIKELY(arm7_watch_exec(cpu)))return;
+    if(SB_UNLIKELY(cpu->pc_profile))sb_pc_profile_tick(cpu->pc_profile,cpu->registers[PC]);
+    if(SB_UNLIKELY(cpu->exec_trace))sb_exec_trace_pc(cpu->exec_trace,cpu->registers[PC]);
     
     if(SB_UNLIKELY(cpu->log_cmp_file)){
       arm_check_log_file(cpu);
@@ -997,7 +1160,7 @@ static FORCE_INLINE uint32_t arm7_shift(arm7_t* arm, uint32_t opcode, uint64_t v
       break; 
     case 3: 
       if(shift_value==0){
-        uint32_t cpsr=arm->registers[CPSR];
+        uint32_t cpsr=arm7_get_cpsr(arm);
         int C = ARM7_BFE(cpsr,29,1); 
         //Rotate Extended (RRX)
         *carry = ARM7_BFE(value,0,1); value = (value>>1)|(C<<31);
@@ -1052,9 +1215,9 @@ static FORCE_INLINE void arm7_data_processing(arm7_t* cpu, uint32_t opcode){
     /*SUB*/ case 2:  arm7_reg_write(cpu,Rd, result = Rn-Rm);     break;
     /*RSB*/ case 3:  arm7_reg_write(cpu,Rd, result = Rm-Rn);     break;
     /*ADD*/ case 4:  arm7_reg_write(cpu,Rd, result = Rn+Rm);     break;
-    /*ADC*/ case 5:  arm7_reg_write(cpu,Rd, result = Rn+Rm+ARM7_BFE(cpu->registers[CPSR],29,1));   break;
-    /*SBC*/ case 6:  arm7_reg_write(cpu,Rd, result = Rn-Rm+ARM7_BFE(cpu->registers[CPSR],29,1)-1); break;
-    /*RSC*/ case 7:  arm7_reg_write(cpu,Rd, result = Rm-Rn+ARM7_BFE(cpu->registers[CPSR],29,1)-1); break;
+    /*ADC*/ case 5:  arm7_reg_write(cpu,Rd, result = Rn+Rm+ARM7_BFE(arm7_get_cpsr(cpu),29,1));   break;
+    /*SBC*/ case 6:  arm7_reg_write(cpu,Rd, result = Rn-Rm+ARM7_BFE(arm7_get_cpsr(cpu),29,1)-1); break;
+    /*RSC*/ case 7:  arm7_reg_write(cpu,Rd, result = Rm-Rn+ARM7_BFE(arm7_get_cpsr(cpu),29,1)-1); break;
     /*TST*/ case 8:  result = Rn&Rm;     break;
     /*TEQ*/ case 9:  result = Rn^Rm;     break;
     /*CMP*/ case 10: result = Rn-Rm;     break;
@@ -1067,60 +1230,54 @@ static FORCE_INLINE void arm7_data_processing(arm7_t* cpu, uint32_t opcode){
   //Update flags
   if(S){
     //Rd is not valid for TST, TEQ, CMP, or CMN
-    {
-      uint32_t cpsr=cpu->registers[CPSR];
-      bool C = ARM7_BFE(cpsr,29,1);
-      bool N = ARM7_BFE(result,31,1);
-      bool Z = (result&0xffffffff)==0;
-      bool V = ARM7_BFE(cpsr,28,1);
-
-      switch(op){ 
-      // Logical Ops flags
-      /*AND*/ case 0:
-      /*EOR*/ case 1: 
-      /*TST*/ case 8: 
-      /*TEQ*/ case 9: 
-      /*ORR*/ case 12:
-      /*MOV*/ case 13:
-      /*BIC*/ case 14:
-      /*MVN*/ case 15: C = barrel_shifter_carry==-1? C: barrel_shifter_carry; break;
-
-      /*SUB*/ case 2: 
-      /*SBC*/ case 6:  
-      /*CMP*/ case 10: 
-        C = !ARM7_BFE(result,32,1);
-        // if (Rn has a different sign as Rm and result has a differnt sign to Rn)
-        V = (((Rn ^ Rm) & (Rn ^ result)) >> 31)&1;
-        break;
-
-      /*RSB*/ case 3: 
-      /*RSC*/ case 7: 
-        C = !ARM7_BFE(result,32,1);
-        // if (Rm has a different sign as Rn and result has a differnt sign to Rm)
-        V = (((Rm ^ Rn) & (Rm ^ result)) >> 31)&1;
-        break;
-
-      /*ADD*/ case 4:
-      /*ADC*/ case 5:
-      /*CMN*/ case 11: 
-        C = ARM7_BFE(result,32,1);
-        // if (Rm has the same sign as Rn and result has a different sign to Rm)
-        V = (((Rm ^ ~Rn) & (Rm ^ result)) >> 31)&1;
-        break;
-      }
-      cpsr&= 0x0fffffff;
-      cpsr|= (N?1:0)<<31;   
-      cpsr|= (Z?1:0)<<30;
-      cpsr|= (C?1:0)<<29; 
-      cpsr|= (V?1:0)<<28;
-      cpu->registers[CPSR] = cpsr;
+    switch(op){ 
+    // Logical Ops flags
+    /*AND*/ case 0:
+    /*EOR*/ case 1: 
+    /*TST*/ case 8: 
+    /*TEQ*/ case 9: 
+    /*ORR*/ case 12:
+    /*MOV*/ case 13:
+    /*BIC*/ case 14:
+    /*MVN*/ case 15:
+      // C and V are kept from earlier ops so those need to be applied first
+      if(barrel_shifter_carry!=-1){
+        uint32_t cpsr = arm7_get_cpsr(cpu)&~(1u<<29);
+        cpu->registers[CPSR] = cpsr|((barrel_shifter_carry?1u:0u)<<29);
+      }else arm7_flush_lazy_flags(cpu);
+      cpu->lazy_flags = ARM_LAZY_FLAGS_LOGIC;
+      break;
+
+    /*SUB*/ case 2: 
+    /*SBC*/ case 6:  
+    /*CMP*/ case 10: 
+      cpu->lazy_flags = ARM_LAZY_FLAGS_SUB;
+      cpu->lazy_flags_a = Rn;
+      cpu->lazy_flags_b = Rm;
+      break;
+
+    /*RSB*/ case 3: 
+    /*RSC*/ case 7: 
+      cpu->lazy_flags = ARM_LAZY_FLAGS_SUB;
+      cpu->lazy_flags_a = Rm;
+      cpu->lazy_flags_b = Rn;
+      break;
+
+    /*ADD*/ case 4:
+    /*ADC*/ case 5:
+    /*CMN*/ case 11: 
+      cpu->lazy_flags = ARM_LAZY_FLAGS_ADD;
+      cpu->lazy_flags_a = Rm;
+      cpu->lazy_flags_b = Rn;
+      break;
     }
+    cpu->lazy_flags_result = result;
     if(Rd==15){
       // When Rd is R15 and the S flag is set the result of the operation is placed in R15 
       // and the SPSR corresponding to the current mode is moved to the CPSR. This allows
       // state changes which atomically restore both PC and CPSR. This form of instruction
       // should not be used in User mode.
-      cpu->registers[CPSR] = arm7_reg_read(cpu,SPSR);
+      arm7_set_cpsr(cpu,arm7_reg_read(cpu,SPSR));
     }
   }
 }
@@ -1143,7 +1300,7 @@ static FORCE_INLINE void arm7_multiply(arm7_t* cpu, uint32_t opcode){
   arm7_reg_write(cpu,Rd,result);
 
   if(S){
-    uint32_t cpsr = cpu->registers[CPSR];
+    uint32_t cpsr = arm7_get_cpsr(cpu);
     bool N = ARM7_BFE(result,31,1);
     bool Z = (result&0xffffffff)==0;
     bool C = ARM7_BFE(cpsr,29,1);
@@ -1243,7 +1400,7 @@ static FORCE_INLINE void arm7_multiply_long(arm7_t* cpu, uint32_t opcode){
   arm7_reg_write(cpu,RdLo,result&0xffffffff);
 
   if(S){
-    uint32_t cpsr = cpu->registers[CPSR];
+    uint32_t cpsr = arm7_get_cpsr(cpu);
     bool N = ARM7_BFE(result,63,1);
     bool Z = result==0;
     bool C = ARM7_BFE(cpsr,29,1);
@@ -1447,14 +1604,14 @@ static FORCE_INLINE void arm9_double_word_transfer(arm7_t* cpu, uint32_t opcode)
 }
 static FORCE_INLINE void arm7_undefined(arm7_t* cpu, uint32_t opcode){
   bool thumb = arm7_get_thumb_bit(cpu);
-  cpu->registers[R14_und] = cpu->registers[PC]-(thumb?0:4);
+  uint32_t cpsr = arm7_get_cpsr(cpu);
+  //Update mode to undefined and block irqs
+  arm7_set_cpsr(cpu,(cpsr&0xffffffE0)| 0x1b|0x80);
+  cpu->registers[LR] = cpu->registers[PC]-(thumb?0:4);
   cpu->registers[PC] = cpu->irq_table_address+0x4; 
-  uint32_t cpsr = cpu->registers[CPSR];
   cpu->registers[SPSR_und] = cpsr;
-  //Update mode to supervisor and block irqs
-  cpu->registers[CPSR] = (cpsr&0xffffffE0)| 0x1b|0x80;
   arm7_set_thumb_bit(cpu,false);
-  printf("Unhandled Instruction Class (arm7_undefined) Opcode: %x PC:%08x\n",opcode, cpu->registers[R14_und]);
+  printf("Unhandled Instruction Class (arm7_undefined) Opcode: %x PC:%08x\n",opcode, cpu->registers[LR]);
   cpu->i_cycles+=1;
 }
 static FORCE_INLINE void arm9_clz(arm7_t* cpu, uint32_t opcode){
@@ -1489,6 +1646,27 @@ static FORCE_INLINE void arm9_qadd_qsub(arm7_t* cpu, uint32_t opcode){
   cpu->registers[CPSR]|= Q<<27;
   arm7_reg_write(cpu,Rd,result);
 }
+// Runs the whole register list of a LDM/STM at once against a host pointer from cpu->block_ptr.
+// R15 is left to the phased path since it refills the pipeline and may restore the CPSR
+static FORCE_INLINE bool arm7_fast_block_transfer(arm7_t* cpu, uint32_t reglist, int Rn, bool L, bool w, bool user_bank_transfer, bool arm9){
+  if(!cpu->block_ptr||!reglist||(reglist&(1<<15))||cpu->watch||cpu->exec_trace)return false;
+  int num_regs = 0;
+  for(int i=0;i<15;++i)num_regs+=ARM7_BFE(reglist,i,1);
+  uint32_t* mem = cpu->block_ptr(cpu->user_data,cpu->block.addr&~3,num_regs,!L);
+  if(!mem)return false;
+  int cycle = 0;
+  for(int i=0;i<15;++i){
+    if(ARM7_BFE(reglist,i,1)==0)continue;
+    int reg_index = user_bank_transfer ? arm7_banked_reg_index(cpu,i) : i;
+    // Same writeback order as the phased path: ARMv4 writes back before the first load, ARMv5 after it
+    if(!L)*mem = cpu->registers[reg_index];
+    if(!arm9&&++cycle==1&&w)arm7_reg_write(cpu,Rn,cpu->block.base_addr);
+    if(L)cpu->registers[reg_index] = *mem;
+    if(arm9&&++cycle==1&&w)arm7_reg_write(cpu,Rn,cpu->block.base_addr);
+    ++mem;
+  }
+  return true;
+}
 static FORCE_INLINE void arm7_block_transfer(arm7_t* cpu, uint32_t opcode){
   int P = ARM7_BFE(opcode,24,1);
   int U = ARM7_BFE(opcode,23,1);
@@ -1552,6 +1730,7 @@ static FORCE_INLINE void arm7_block_transfer(arm7_t* cpu, uint32_t opcode){
     
   }
   bool user_bank_transfer = S && (!L || !SB_BFE(reglist,15,1));
+  if(cpu->phase==0&&arm7_fast_block_transfer(cpu,reglist,Rn,L,w,user_bank_transfer,false))cpu->phase=16;
 
   for(int i=cpu->phase;i<16;++i){
     //Writeback happens on second cycle
@@ -1560,7 +1739,7 @@ static FORCE_INLINE void arm7_block_transfer(arm7_t* cpu, uint32_t opcode){
     if(ARM7_BFE(reglist,i,1)==0)continue;  
 
     // When S is set the registers are read from the user bank
-    int reg_index = user_bank_transfer ? i : arm7_reg_index(cpu,i);
+    int reg_index = user_bank_transfer ? arm7_banked_reg_index(cpu,i) : i;
     //Store happens before writeback 
     int a = cpu->block.addr;
     //Inexplicablly SRAM accesses are not DWORD aligned. GBA suite memory test can be used to verify this. 
@@ -1575,6 +1754,8 @@ static FORCE_INLINE void arm7_block_transfer(arm7_t* cpu, uint32_t opcode){
     // R15 is stored at PC+12
    if(L){
       int bank = ARM7_BFE(a,24,8);
+      // Sequential reads are also used for fetches so only block transfers are watched
+      arm7_watch_access(cpu,a,4,SB_WATCH_READ);
       cpu->registers[reg_index]=cpu->read32_seq(cpu->user_data, a,bank==cpu->block.last_bank);
       cpu->block.last_bank=bank;
    }
@@ -1584,7 +1765,7 @@ static FORCE_INLINE void arm7_block_transfer(arm7_t* cpu, uint32_t opcode){
     // If the instruction is a LDM then SPSR_<mode> is transferred to CPSR at
     // the same time as R15 is loaded.
     if(L&& S&& i==15){
-      cpu->registers[CPSR] = arm7_reg_read(cpu,SPSR);
+      arm7_set_cpsr(cpu,arm7_reg_read(cpu,SPSR));
     }
     cpu->phased_op_id=ARM_PHASED_BLOCK_TRANSFER;
     cpu->phased_opcode=opcode;
@@ -1655,6 +1836,7 @@ static FORCE_INLINE void arm9_block_transfer(arm7_t* cpu, uint32_t opcode){
   }
 
   bool user_bank_transfer = S && (!L || !SB_BFE(reglist,15,1));
+  if(cpu->phase==0&&arm7_fast_block_transfer(cpu,reglist,Rn,L,w,user_bank_transfer,true))cpu->phase=16;
   for(int i=cpu->phase;i<16;++i){
     //Writeback happens on second cycle
     //Todo, does post increment force writeback? 
@@ -1662,7 +1844,7 @@ static FORCE_INLINE void arm9_block_transfer(arm7_t* cpu, uint32_t opcode){
     if(ARM7_BFE(reglist,i,1)==0)continue;  
 
     // When S is set the registers are read from the user bank
-    int reg_index = user_bank_transfer ? i : arm7_reg_index(cpu,i);
+    int reg_index = user_bank_transfer ? arm7_banked_reg_index(cpu,i) : i;
     //Store happens before writeback 
     int a = cpu->block.addr;
     if(!L) cpu->write32(cpu->user_data, a,cpu->registers[reg_index] + (i==15?cpu->block.r15_off:0));
@@ -1670,6 +1852,8 @@ static FORCE_INLINE void arm9_block_transfer(arm7_t* cpu, uint32_t opcode){
     // R15 is stored at PC+12
    if(L){
       int bank = ARM7_BFE(a,24,8);
+      // Sequential reads are also used for fetches so only block transfers are watched
+      arm7_watch_access(cpu,a,4,SB_WATCH_READ);
       cpu->registers[reg_index]=cpu->read32_seq(cpu->user_data, a,bank==cpu->block.last_bank);
       cpu->block.last_bank=bank;
       if(PC==reg_index)arm7_set_thumb_bit(cpu,cpu->registers[PC]&1);
@@ -1683,7 +1867,7 @@ static FORCE_INLINE void arm9_block_transfer(arm7_t* cpu, uint32_t opcode){
     // If the instruction is a LDM then SPSR_<mode> is transferred to CPSR at
     // the same time as R15 is loaded.
     if(L&& S&& i==15){
-      cpu->registers[CPSR] = arm7_reg_read(cpu,SPSR);
+      arm7_set_cpsr(cpu,arm7_reg_read(cpu,SPSR));
     }
     cpu->phased_op_id=ARM_PHASED_BLOCK_TRANSFER;
     cpu->phased_opcode=opcode;
@@ -1762,13 +1946,6 @@ static FORCE_INLINE void arm7_coproc_reg_transfer(arm7_t* cpu, uint32_t opcode){
   }
 }
 static FORCE_INLINE void arm7_software_interrupt(arm7_t* cpu, uint32_t opcode){
-  bool thumb = arm7_get_thumb_bit(cpu);
-  cpu->registers[R14_svc] = cpu->registers[PC];
-  cpu->registers[PC] = cpu->irq_table_address+0x8; 
-  uint32_t cpsr = cpu->registers[CPSR];
-  cpu->registers[SPSR_svc] = cpsr;
-  //Update mode to supervisor and block irqs
-  cpu->registers[CPSR] = (cpsr&0xffffffE0)| 0x13|0x80;
   uint32_t swi_number = SB_BFE(opcode,0,24);
   if(arm7_get_thumb_bit(cpu))swi_number = SB_BFE(opcode,0,8);
   int id = -1;
@@ -1781,6 +1958,13 @@ static FORCE_INLINE void arm7_software_interrupt(arm7_t* cpu, uint32_t opcode){
   }
   cpu->debug_swi_ring[id]= swi_number; 
   cpu->debug_swi_ring_times[id]++; 
+  if(cpu->software_interrupt&&cpu->software_interrupt(cpu->user_data,swi_number))return;
+  uint32_t cpsr = arm7_get_cpsr(cpu);
+  //Update mode to supervisor and block irqs
+  arm7_set_cpsr(cpu,(cpsr&0xffffffE0)| 0x13|0x80);
+  cpu->registers[LR] = cpu->registers[PC];
+  cpu->registers[PC] = cpu->irq_table_address+0x8; 
+  cpu->registers[SPSR_svc] = cpsr;
   arm7_set_thumb_bit(cpu,false);
 }
 
@@ -2264,12 +2448,12 @@ static FORCE_INLINE void arm7t_long_branch_link(arm7_t* cpu, uint32_t opcode){
 }
 static FORCE_INLINE void arm7t_unknown(arm7_t* cpu, uint32_t opcode){
   bool thumb = arm7_get_thumb_bit(cpu);
-  cpu->registers[R14_und] = cpu->registers[PC]-(thumb?0:4);
+  uint32_t cpsr = arm7_get_cpsr(cpu);
+  //Update mode to undefined and block irqs
+  arm7_set_cpsr(cpu,(cpsr&0xffffffE0)| 0x1b|0x80);
+  cpu->registers[LR] = cpu->registers[PC]-(thumb?0:4);
   cpu->registers[PC] = cpu->irq_table_address+0x4; 
-  uint32_t cpsr = cpu->registers[CPSR];
   cpu->registers[SPSR_und] = cpsr;
-  //Update mode to supervisor and block irqs
-  cpu->registers[CPSR] = (cpsr&0xffffffE0)| 0x1b|0x80;
   arm7_set_thumb_bit(cpu,false);
   printf("Unhandled Thumb Instruction Class: (arm7t_unknown) Opcode %x\n",opcode);
   printf("PC: %08x\n",cpu->registers[PC]);
@@ -2,12 +2,15 @@
 #include "https.hpp"
 #include "sokol_gfx.h"
 #include "stb_image.h"
+#include "xxhash.h"
 #include <algorithm>
 #include <atomic>
 #include <mutex>
 #include <string>
+#include <cstring>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 [[noreturn]] void atlas_error(const char* message) {
@@ -34,6 +37,133 @@ std::vector<atlas_map_t*> atlas_maps;
 std::mutex to_delete_mutex;
 std::vector<sg_image> images_to_delete;
 
+extern "C" const char* se_get_pref_path();
+extern "C" FILE* se_fopen_mkdir(const char* fpath, char* mode);
+
+// Downloaded images are kept decoded on disk as image_cache/<XXH3 of the url>.rgba in the pref path,
+// so later sessions skip both the download and the decode. image_cache/index.bin lists the entries
+// (hash and file size) so the cache can be measured and cleared without listing the directory.
+struct disk_image_header_t {
+    char magic[8];
+    uint32_t width, height;
+};
+constexpr char disk_image_magic[8] = {'S', 'K', 'Y', 'I', 'M', 'G', '1', '\0'};
+
+struct disk_cache_entry_t {
+    uint64_t hash;
+    uint64_t size;
+};
+
+std::mutex disk_cache_mutex;
+bool disk_cache_loaded = false;
+std::unordered_map<uint64_t, uint64_t> disk_cache_entries;
+std::atomic_uint64_t disk_cache_bytes = {0};
+
+static std::string disk_cache_dir() {
+    std::string path = se_get_pref_path();
+    if (!path.empty() && path.back() != '/' && path.back() != '\\') {
+        path += '/';
+    }
+    return path + "image_cache/";
+}
+
+static std::string disk_cache_path(uint64_t hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.rgba", (unsigned long long)hash);
+    return disk_cache_dir() + name;
+}
+
+// Must be called with disk_cache_mutex held
+static void load_disk_cache_index() {
+    if (disk_cache_loaded) {
+        return;
+    }
+
+    disk_cache_loaded = true;
+    FILE* f = fopen((disk_cache_dir() + "index.bin").c_str(), "rb");
+    if (!f) {
+        return;
+    }
+
+    disk_cache_entry_t entry;
+    while (fread(&entry, sizeof(entry), 1, f) == 1) {
+        if (disk_cache_entries.find(entry.hash) == disk_cache_entries.end()) {
+            disk_cache_entries[entry.hash] = entry.size;
+            disk_cache_bytes += entry.size;
+        }
+    }
+    fclose(f);
+}
+
+static cached_image_t* load_from_disk_cache(const std::string& url) {
+    uint64_t hash = XXH3_64bits(url.data(), url.size());
+    {
+        std::unique_lock<std::mutex> lock(disk_cache_mutex);
+        load_disk_cache_index();
+        if (disk_cache_entries.find(hash) == disk_cache_entries.end()) {
+            return nullptr;
+        }
+    }
+
+    FILE* f = fopen(disk_cache_path(hash).c_str(), "rb");
+    if (!f) {
+        return nullptr;
+    }
+
+    cached_image_t* cached_image = nullptr;
+    disk_image_header_t header;
+    if (fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, disk_image_magic, sizeof(header.magic)) == 0 &&
+        header.width && header.height && header.width <= 4096 && header.height <= 4096) {
+        size_t size = (size_t)header.width * header.height * 4;
+        uint8_t* data = (uint8_t*)malloc(size);
+        if (data && fread(data, 1, size, f) == size) {
+            cached_image = new cached_image_t();
+            cached_image->data = data;
+            cached_image->width = header.width;
+            cached_image->height = header.height;
+        } else {
+            free(data);
+        }
+    }
+    fclose(f);
+    return cached_image;
+}
+
+static void store_in_disk_cache(const std::string& url, const cached_image_t* cached_image) {
+    uint64_t hash = XXH3_64bits(url.data(), url.size());
+    std::unique_lock<std::mutex> lock(disk_cache_mutex);
+    load_disk_cache_index();
+    if (disk_cache_entries.find(hash) != disk_cache_entries.end()) {
+        return;
+    }
+
+    FILE* f = se_fopen_mkdir(disk_cache_path(hash).c_str(), (char*)"wb");
+    if (!f) {
+        return;
+    }
+
+    disk_image_header_t header;
+    memcpy(header.magic, disk_image_magic, sizeof(header.magic));
+    header.width = cached_image->width;
+    header.height = cached_image->height;
+    size_t size = (size_t)header.width * header.height * 4;
+    bool success = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(cached_image->data, 1, size, f) == size;
+    fclose(f);
+    if (!success) {
+        remove(disk_cache_path(hash).c_str());
+        return;
+    }
+
+    disk_cache_entry_t entry = {hash, sizeof(header) + size};
+    FILE* index = fopen((disk_cache_dir() + "index.bin").c_str(), "ab");
+    if (index) {
+        fwrite(&entry, sizeof(entry), 1, index);
+        fclose(index);
+    }
+    disk_cache_entries[hash] = entry.size;
+    disk_cache_bytes += entry.size;
+}
+
 struct atlas_t {
     atlas_t(atlas_map_t* map, uint32_t tile_width, uint32_t tile_height);
     ~atlas_t();
@@ -42,6 +172,14 @@ struct atlas_t {
     void upload();
 
 private:
+    struct placed_tile_t {
+        atlas_tile_t* tile;
+        uint32_t x, y;
+    };
+
+    bool allocate(uint32_t& x, uint32_t& y);
+    void grow();
+    void set_uvs(const placed_tile_t& placed);
     void copy_to_data(atlas_tile_t* tile, cached_image_t* image);
 
     atlas_map_t* map;
@@ -50,9 +188,12 @@ private:
     std::mutex mutex;
     sg_image atlas_image;
     uint32_t atlas_dimension;
-    uint32_t offset_x, offset_y;
+    // Tiles are packed left to right on shelves of one tile height, the x cursor of each shelf is
+    // kept so growing the atlas only widens the shelves instead of re-packing every tile
+    std::vector<uint32_t> shelf_x;
     std::vector<uint8_t> data;
-    std::vector<std::string> image_urls;
+    std::vector<placed_tile_t> tiles;
+    std::unordered_set<std::string> image_urls;
     bool dirty;   // new data needs to be uploaded to the GPU
     bool resized; // atlas needs to be destroyed and created at new size
 
@@ -104,8 +245,6 @@ private:
 
 atlas_t::atlas_t(atlas_map_t* map, uint32_t tile_width, uint32_t tile_height) : map(map), tile_width(tile_width), tile_height(tile_height) {
     atlas_image.id = SG_INVALID_ID;
-    offset_x = 0;
-    offset_y = 0;
     dirty = false;
     resized = false;
     atlas_dimension = 16;
@@ -123,6 +262,52 @@ atlas_t::~atlas_t() {
     images_to_delete.push_back(atlas_image);
 }
 
+bool atlas_t::allocate(uint32_t& x, uint32_t& y) {
+    for (size_t i = 0; i < shelf_x.size(); i++) {
+        if (shelf_x[i] + tile_width + padding <= atlas_dimension) {
+            x = shelf_x[i];
+            y = i * (tile_height + padding);
+            shelf_x[i] += tile_width + padding;
+            return true;
+        }
+    }
+
+    uint32_t shelf_y = shelf_x.size() * (tile_height + padding);
+    if (shelf_y + tile_height + padding > atlas_dimension || tile_width + padding > atlas_dimension) {
+        return false;
+    }
+
+    x = 0;
+    y = shelf_y;
+    shelf_x.push_back(tile_width + padding);
+    return true;
+}
+
+// Doubles the atlas, the tiles keep their pixel positions so only the UVs change
+void atlas_t::grow() {
+    uint32_t old_dimension = atlas_dimension;
+    atlas_dimension *= 2;
+    resized = true;
+
+    std::vector<uint8_t> new_data(atlas_dimension * atlas_dimension * 4);
+    for (uint32_t y = 0; y < old_dimension; y++) {
+        memcpy(&new_data[y * atlas_dimension * 4], &data[y * old_dimension * 4], old_dimension * 4);
+    }
+    data.swap(new_data);
+
+    for (const placed_tile_t& placed : tiles) {
+        set_uvs(placed);
+        placed.tile->atlas_id = SG_INVALID_ID; // old image is no longer valid
+    }
+}
+
+void atlas_t::set_uvs(const placed_tile_t& placed) {
+    placed.tile->x1 = (float)placed.x / atlas_dimension;
+    placed.tile->y1 = (float)placed.y / atlas_dimension;
+    placed.tile->x2 = (float)(placed.x + tile_width) / atlas_dimension;
+    placed.tile->y2 = (float)(placed.y + tile_height) / atlas_dimension;
+}
+
 void atlas_t::copy_to_data(atlas_tile_t* tile, cached_image_t* cached_image) {
     if (tile == nullptr) {
         atlas_error("Tile is null");
@@ -136,73 +321,30 @@ void atlas_t::copy_to_data(atlas_tile_t* tile, cached_image_t* cached_image) {
         atlas_error("Image dimensions do not match atlas tile dimensions");
     }
 
-    dirty = true;
-
-    uint32_t tile_offset_x = offset_x;
-    uint32_t tile_offset_y = offset_y;
-
-    offset_x += tile_width + padding;
-    if (offset_x + tile_width > atlas_dimension) {
-        offset_x = 0;
-        offset_y += tile_height + padding;
+    placed_tile_t placed = {tile, 0, 0};
+    while (!allocate(placed.x, placed.y)) {
+        grow();
     }
 
-    for (int y = 0; y < tile_height; y++) {
-        for (int x = 0; x < tile_width; x++) {
-            uint32_t atlas_offset = ((tile_offset_x + x) * 4) + (((tile_offset_y + y) * atlas_dimension) * 4);
-            uint32_t tile_offset = x * 4 + (y * 4 * tile_width);
+    dirty = true;
 
-            data[atlas_offset + 0] = cached_image->data[tile_offset + 0];
-            data[atlas_offset + 1] = cached_image->data[tile_offset + 1];
-            data[atlas_offset + 2] = cached_image->data[tile_offset + 2];
-            data[atlas_offset + 3] = cached_image->data[tile_offset + 3];
-        }
+    for (uint32_t y = 0; y < tile_height; y++) {
+        uint8_t* dst = &data[(placed.x + (placed.y + y) * atlas_dimension) * 4];
+        memcpy(dst, cached_image->data + y * tile_width * 4, tile_width * 4);
     }
 
+    tiles.push_back(placed);
     tile->atlas_id = atlas_image.id;
-    tile->x1 = (float)tile_offset_x / atlas_dimension;
-    tile->y1 = (float)tile_offset_y / atlas_dimension;
-    tile->x2 = (float)(tile_offset_x + tile_width) / atlas_dimension;
-    tile->y2 = (float)(tile_offset_y + tile_height) / atlas_dimension;
+    set_uvs(placed);
 }
 
 void atlas_t::add_tile(const std::string& url, atlas_tile_t* tile, cached_image_t* cached_image) {
     std::unique_lock<std::mutex> lock(mutex);
 
-    if (std::find(image_urls.begin(), image_urls.end(), url) != image_urls.end()) {
+    if (!image_urls.insert(url).second) {
         atlas_error("Image already added to atlas");
     }
 
-    image_urls.push_back(url);
-
-    // These are the dimensions that would occur after adding a tile
-    uint32_t minimum_x = offset_x + tile_width + padding;
-    uint32_t minimum_y = offset_y + tile_height + padding;
-
-    // If the atlas is too small, resize it
-    if (minimum_x > atlas_dimension || minimum_y > atlas_dimension) {
-        resized = true;
-        atlas_dimension *= 2;
-
-        std::vector<uint8_t> new_data;
-        new_data.resize(atlas_dimension * atlas_dimension * 4);
-        data.swap(new_data);
-
-        offset_x = 0;
-        offset_y = 0;
-
-        std::unique_lock<std::mutex> lock(image_cache_mutex);
-        for (auto& image_url : image_urls) {
-            atlas_tile_t* old_tile = map->total_tiles[image_url];
-            cached_image_t* old_cached_image = image_cache[image_url];
-            copy_to_data(old_tile, old_cached_image);
-            old_tile->atlas_id = SG_INVALID_ID; // old tile is no longer valid
-        }
-    }
-
-    float current_x = offset_x;
-    float current_y = offset_y;
-
     copy_to_data(tile, cached_image);
 }
 
@@ -237,9 +379,8 @@ void atlas_t::upload() {
 
         atlas_image = sg_make_image(desc);
 
-        for (auto& image_url : image_urls) {
-            atlas_tile_t* tile = map->total_tiles[image_url];
-            tile->atlas_id = atlas_image.id;
+        for (const placed_tile_t& placed : tiles) {
+            placed.tile->atlas_id = atlas_image.id;
         }
     }
 
@@ -281,6 +422,20 @@ atlas_tile_t* atlas_map_t::add_tile_from_url(const char* url) {
     atlas_tile_t* tile = new atlas_tile_t();
     total_tiles[url_str] = tile;
 
+    if (https_cache_enabled()) {
+        cached_image_t* cached_image = load_from_disk_cache(url_str);
+        if (cached_image) {
+            {
+                std::unique_lock<std::mutex> lock(image_cache_mutex);
+                image_cache[url_str] = cached_image;
+            }
+
+            atlas_t* atlas = get_atlas(cached_image->width, cached_image->height);
+            atlas->add_tile(url_str, tile, cached_image);
+            return tile;
+        }
+    }
+
     requests++;
     lock.unlock();
 
@@ -307,13 +462,17 @@ atlas_tile_t* atlas_map_t::add_tile_from_url(const char* url) {
                 image_cache[url_str] = cached_image;
             }
 
+            if (https_cache_enabled()) {
+                store_in_disk_cache(url_str, cached_image);
+            }
+
             std::unique_lock<std::mutex> lock(atlases_mutex);
             atlas_t* atlas = get_atlas(cached_image->width, cached_image->height);
             atlas->add_tile(url_str, tile, cached_image);
         }
 
         requests--;
-    }, true /* do cache these images */);
+    }, false /* cached decoded by the atlas instead */);
 
     return tile;
 }
@@ -456,4 +615,19 @@ uint32_t atlas_get_tile_id(atlas_tile_t* tile) {
 
 atlas_uvs_t atlas_get_tile_uvs(atlas_tile_t* tile) {
     return {tile->x1, tile->y1, tile->x2, tile->y2};
-}
\ No newline at end of file
+}
+
+uint64_t atlas_disk_cache_size() {
+    return disk_cache_bytes;
+}
+
+void atlas_clear_disk_cache() {
+    std::unique_lock<std::mutex> lock(disk_cache_mutex);
+    load_disk_cache_index();
+    for (auto& pair : disk_cache_entries) {
+        remove(disk_cache_path(pair.first).c_str());
+    }
+    remove((disk_cache_dir() + "index.bin").c_str());
+    disk_cache_entries.clear();
+    disk_cache_bytes = 0;
+}
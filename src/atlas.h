@@ -30,6 +30,10 @@ struct atlas_tile_t* atlas_add_tile_from_path(struct atlas_map_t* map, const cha
 // or if there are new tiles to add, or if some atlases need to be cleaned up
 void atlas_upload_all();
 
+// Size of the on disk cache of decoded downloaded images, which is used while the download cache is enabled
+uint64_t atlas_disk_cache_size();
+void atlas_clear_disk_cache();
+
 uint32_t atlas_get_tile_id(struct atlas_tile_t* tile);
 struct atlas_uvs_t atlas_get_tile_uvs(struct atlas_tile_t* tile);
 
@@ -68,6 +68,8 @@ struct cloud_drive_t
     std::condition_variable cv;
     int outstanding_requests = 0;
     bool scheduled_deletion = false;
+    // Requests waiting on a token refresh that is already in flight
+    std::vector<std::function<void(cloud_drive_t*)>> refresh_waiters;
 
     void inc()
     {
@@ -426,11 +428,18 @@ void google_cloud_drive_download(cloud_drive_t* drive, const std::string& filena
                          }, false);
 }
 
+// Follows nextPageToken so drives with more files than fit in one page are fully listed
 void google_cloud_drive_get_files(cloud_drive_t* drive,
-                                  std::function<void(cloud_drive_t*)> callback)
+                                  std::function<void(cloud_drive_t*)> callback,
+                                  const std::string& page_token = "")
 {
+    std::string url = "https://www.googleapis.com/drive/v3/files?pageSize=1000&fields=nextPageToken,files(id,name,mimeType)";
+    if (!page_token.empty())
+    {
+        url += "&pageToken=" + page_token;
+    }
     drive->inc();
-    return https_request(http_request_e::GET, "https://www.googleapis.com/drive/v3/files", "",
+    return https_request(http_request_e::GET, url, "",
                          {{"Authorization", "Bearer " + drive->access_token}},
                          [drive, callback](const std::vector<uint8_t>& data) {
                             if (!nlohmann::json::accept(data))
@@ -467,7 +476,14 @@ void google_cloud_drive_get_files(cloud_drive_t* drive,
                                 return;
                              }
 
-                             callback(drive);
+                             if (response.find("nextPageToken") != response.end())
+                             {
+                                google_cloud_drive_get_files(drive, callback, response["nextPageToken"].get<std::string>());
+                             }
+                             else
+                             {
+                                callback(drive);
+                             }
                              drive->dec();
                          }, false);
 }
@@ -796,6 +812,41 @@ void cloud_drive_logout(cloud_drive_t* drive, void (*callback)())
 #endif
 }
 
+// Runs the callback once the access token is valid. Requests issued while the token is expired share
+// a single refresh instead of each starting their own
+void google_with_fresh_token(cloud_drive_t* drive, std::function<void(cloud_drive_t*)> callback)
+{
+    if (time(NULL) <= drive->expire_timestamp - 60)
+    {
+        return callback(drive);
+    }
+    if (drive->access_token.empty())
+    {
+        printf("[cloud] failed to use refresh token\n");
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(drive->request_mutex);
+        drive->refresh_waiters.push_back(callback);
+        if (drive->refresh_waiters.size() > 1)
+        {
+            return;
+        }
+    }
+    google_use_refresh_token(drive, [](cloud_drive_t* drive) {
+        std::vector<std::function<void(cloud_drive_t*)>> waiters;
+        {
+            std::unique_lock<std::mutex> lock(drive->request_mutex);
+            waiters.swap(drive->refresh_waiters);
+        }
+        for (auto& waiter : waiters)
+        {
+            waiter(drive);
+        }
+    });
+}
+
+// These only queue requests on the shared https executor so they don't need a thread of their own
 void cloud_drive_upload(cloud_drive_t* drive, const char* filename, const char* parent, const char* mime_type,
                         void* data, size_t size, void (*cleanup_callback)(void*, void*),
                         void* userdata)
@@ -807,35 +858,12 @@ void cloud_drive_upload(cloud_drive_t* drive, const char* filename, const char*
     std::string name(filename);
     std::string sparent(parent);
     std::string mime(mime_type);
-#ifndef EMSCRIPTEN
-    std::thread upload_thread([drive, name, sparent, mime, data, size, cleanup_callback, userdata] {
-#endif
-        if (time(NULL) > drive->expire_timestamp - 60)
-        {
-            if (drive->access_token.empty())
-            {
-                printf("[cloud] failed to use refresh token\n");
-                return;
-            }
-            google_use_refresh_token(
-                drive, [name, sparent, mime, data, size, cleanup_callback, userdata](cloud_drive_t* drive) {
-                    google_cloud_drive_upload(drive, name, sparent, mime, data, size,
-                                              [cleanup_callback, data, userdata](cloud_drive_t*) {
-                                                  cleanup_callback(userdata, data);
-                                              });
-                });
-        }
-        else
-        {
-            google_cloud_drive_upload(drive, name, sparent, mime, data, size,
-                                      [cleanup_callback, data, userdata](cloud_drive_t*) {
-                                          cleanup_callback(userdata, data);
-                                      });
-        }
-#ifndef EMSCRIPTEN
+    google_with_fresh_token(drive, [name, sparent, mime, data, size, cleanup_callback, userdata](cloud_drive_t* drive) {
+        google_cloud_drive_upload(drive, name, sparent, mime, data, size,
+                                  [cleanup_callback, data, userdata](cloud_drive_t*) {
+                                      cleanup_callback(userdata, data);
+                                  });
     });
-    upload_thread.detach();
-#endif
 }
 
 void cloud_drive_download(cloud_drive_t* drive, const char* filename,
@@ -847,28 +875,9 @@ void cloud_drive_download(cloud_drive_t* drive, const char* filename,
     }
     std::string name(filename);
     std::function<void(void*, void*, size_t)> fcallback = callback;
-#ifndef EMSCRIPTEN
-    std::thread download_thread([drive, name, fcallback, userdata] {
-#endif
-        if (time(NULL) > drive->expire_timestamp - 60)
-        {
-            if (drive->access_token.empty())
-            {
-                printf("[cloud] failed to use refresh token\n");
-                return;
-            }
-            google_use_refresh_token(drive, [name, fcallback, userdata](cloud_drive_t* drive) {
-                google_cloud_drive_download(drive, name, fcallback, userdata);
-            });
-        }
-        else
-        {
-            google_cloud_drive_download(drive, name, fcallback, userdata);
-        }
-#ifndef EMSCRIPTEN
+    google_with_fresh_token(drive, [name, fcallback, userdata](cloud_drive_t* drive) {
+        google_cloud_drive_download(drive, name, fcallback, userdata);
     });
-    download_thread.detach();
-#endif
 }
 
 void cloud_drive_sync(cloud_drive_t* drive, void(*callback)())
@@ -878,16 +887,11 @@ void cloud_drive_sync(cloud_drive_t* drive, void(*callback)())
         return;
     }
     std::function<void()> fcallback = callback;
-#ifndef EMSCRIPTEN
-    std::thread sync_thread([drive, fcallback] {
-#endif
+    google_with_fresh_token(drive, [fcallback](cloud_drive_t* drive) {
         google_cloud_drive_get_files(drive, [fcallback](cloud_drive_t*) {
             fcallback();
         });
-#ifndef EMSCRIPTEN
     });
-    sync_thread.detach();
-#endif
 }
 
 cloud_user_info_t cloud_drive_get_user_info(cloud_drive_t* drive)
@@ -905,6 +909,12 @@ cloud_user_info_t cloud_drive_get_user_info(cloud_drive_t* drive)
     return info;
 }
 
+bool cloud_drive_file_exists(cloud_drive_t* drive, const char* filename)
+{
+    std::lock_guard<std::mutex> lock(drive->file_mutex);
+    return drive->files.find(filename) != drive->files.end();
+}
+
 uint64_t cloud_drive_hash(const char* input, size_t input_size)
 {
     return XXH64(input, input_size, 0);
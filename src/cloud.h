@@ -34,6 +34,9 @@ void cloud_drive_download(cloud_drive_t* cloud_drive, const char* filename, void
 // Redownload the file map from the cloud.
 void cloud_drive_sync(cloud_drive_t* cloud_drive, void(*callback)());
 
+// Whether the file is in the file map, without making a request.
+bool cloud_drive_file_exists(cloud_drive_t* cloud_drive, const char* filename);
+
 // Has lifetime equal to the cloud drive instance.
 cloud_user_info_t cloud_drive_get_user_info(cloud_drive_t* cloud_drive);
 
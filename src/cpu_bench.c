@@ -0,0 +1,442 @@
+/*****************************************************************************
+ *
+ *   SkyEmu CPU interpreter micro benchmarks
+ *
+ *   Runs synthetic instruction streams through the ARM7/ARM9 interpreters on a
+ *   flat memory stub and through sb_tick with a generated ROM, reporting the
+ *   host time per emulated instruction.
+ *
+ *   Usage: skyemu_cpu_bench [--instructions N] [filter]
+ *
+**/
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared.h"
+#include "sb_types.h"
+#include "arm7.h"
+#include "gb.h"
+
+// Frontend hook of the cores, the benchmarks always boot without a BIOS
+bool se_load_bios_file(const char* name, const char* base_path, const char* file_name, uint8_t* data, size_t data_size){
+  return false;
+}
+
+static uint64_t bench_now_ns(){
+  struct timespec ts;
+  timespec_get(&ts,TIME_UTC);
+  return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+
+/////////////////////
+// ARM7/ARM9 Cores //
+/////////////////////
+
+// Code runs from 0, data lives at BENCH_ARM_DATA and the stack grows down from BENCH_ARM_STACK
+#define BENCH_ARM_MEM_SIZE (64*1024)
+#define BENCH_ARM_DATA 0x8000
+#define BENCH_ARM_STACK 0xF000
+typedef struct{
+  arm7_t cpu;
+  uint8_t mem[BENCH_ARM_MEM_SIZE];
+}bench_arm_t;
+
+static FORCE_INLINE uint8_t* bench_arm_ptr(void* user_data, uint32_t address){
+  return ((bench_arm_t*)user_data)->mem+(address&(BENCH_ARM_MEM_SIZE-1));
+}
+static uint32_t bench_arm_read32(void* user_data, uint32_t address){
+  uint32_t v;
+  memcpy(&v,bench_arm_ptr(user_data,address&~3),4);
+  return v;
+}
+static uint32_t bench_arm_read16(void* user_data, uint32_t address){
+  uint16_t v;
+  memcpy(&v,bench_arm_ptr(user_data,address&~1),2);
+  return v;
+}
+static uint32_t bench_arm_read32_seq(void* user_data, uint32_t address, bool is_sequential){return bench_arm_read32(user_data,address);}
+static uint32_t bench_arm_read16_seq(void* user_data, uint32_t address, bool is_sequential){return bench_arm_read16(user_data,address);}
+static uint8_t bench_arm_read8(void* user_data, uint32_t address){return *bench_arm_ptr(user_data,address);}
+static void bench_arm_write32(void* user_data, uint32_t address, uint32_t data){memcpy(bench_arm_ptr(user_data,address&~3),&data,4);}
+static void bench_arm_write16(void* user_data, uint32_t address, uint16_t data){memcpy(bench_arm_ptr(user_data,address&~1),&data,2);}
+static void bench_arm_write8(void* user_data, uint32_t address, uint8_t data){*bench_arm_ptr(user_data,address) = data;}
+static uint32_t* bench_arm_block_ptr(void* user_data, uint32_t address, uint32_t words, bool write){
+  address&=BENCH_ARM_MEM_SIZE-1;
+  if(address+words*4>BENCH_ARM_MEM_SIZE||address<BENCH_ARM_DATA)return NULL;
+  return (uint32_t*)bench_arm_ptr(user_data,address);
+}
+static uint32_t bench_arm_coproc_read(void* user_data, int coproc, int opcode, int Cn, int Cm, int Cp){return 0;}
+static void bench_arm_coproc_write(void* user_data, int coproc, int opcode, int Cn, int Cm, int Cp, uint32_t data){}
+
+// Streams are loops: the body is followed by a branch back to its start
+typedef struct{
+  uint8_t* mem;
+  uint32_t pc;
+}bench_emitter_t;
+static void bench_emit32(bench_emitter_t* e, uint32_t op){memcpy(e->mem+e->pc,&op,4);e->pc+=4;}
+static void bench_emit16(bench_emitter_t* e, uint16_t op){memcpy(e->mem+e->pc,&op,2);e->pc+=2;}
+static void bench_emit_arm_branch(bench_emitter_t* e, uint32_t cond_op, uint32_t target){
+  bench_emit32(e,cond_op|(((target-(e->pc+8))>>2)&0xffffff));
+}
+static void bench_emit_thumb_branch(bench_emitter_t* e, uint32_t target){
+  bench_emit16(e,0xE000|(((target-(e->pc+4))>>1)&0x7ff));
+}
+static void bench_emit_thumb_bl(bench_emitter_t* e, uint32_t target){
+  uint32_t offset = (target-(e->pc+4))>>1;
+  bench_emit16(e,0xF000|((offset>>11)&0x7ff));
+  bench_emit16(e,0xF800|(offset&0x7ff));
+}
+
+static void bench_arm_alu(bench_emitter_t* e){
+  bench_emit32(e,0xE0800001); // ADD r0,r0,r1
+  bench_emit32(e,0xE2422001); // SUB r2,r2,#1
+  bench_emit32(e,0xE0233180); // EOR r3,r3,r0,LSL #3
+  bench_emit32(e,0xE1844532); // ORR r4,r4,r2,LSR r5
+  bench_emit32(e,0xE21050FF); // ANDS r5,r0,#0xff
+  bench_emit32(e,0xE1B063E3); // MOVS r6,r3,ROR #7
+  bench_emit32(e,0xE0A77006); // ADC r7,r7,r6
+  bench_emit32(e,0xE0090290); // MUL r9,r0,r2
+  bench_emit_arm_branch(e,0xEA000000,0);
+}
+static void bench_arm_load_store(bench_emitter_t* e){
+  bench_emit32(e,0xE5980000); // LDR r0,[r8]
+  bench_emit32(e,0xE5880004); // STR r0,[r8,#4]
+  bench_emit32(e,0xE5D81001); // LDRB r1,[r8,#1]
+  bench_emit32(e,0xE5C81009); // STRB r1,[r8,#9]
+  bench_emit32(e,0xE1D820B2); // LDRH r2,[r8,#2]
+  bench_emit32(e,0xE1C820BA); // STRH r2,[r8,#10]
+  bench_emit32(e,0xE798300A); // LDR r3,[r8,r10]
+  bench_emit32(e,0xE788300A); // STR r3,[r8,r10]
+  bench_emit_arm_branch(e,0xEA000000,0);
+}
+static void bench_arm_block_transfer(bench_emitter_t* e){
+  bench_emit32(e,0xE88800FF); // STMIA r8,{r0-r7}
+  bench_emit32(e,0xE89800FF); // LDMIA r8,{r0-r7}
+  bench_emit32(e,0xE92D40F0); // STMDB sp!,{r4-r7,lr}
+  bench_emit32(e,0xE8BD40F0); // LDMIA sp!,{r4-r7,lr}
+  bench_emit_arm_branch(e,0xEA000000,0);
+}
+static void bench_arm_branch(bench_emitter_t* e){
+  for(int i=0;i<4;++i)bench_emit32(e,0xEAFFFFFF); // B to the next instruction
+  uint32_t call = e->pc;
+  e->pc+=8;
+  bench_emit32(e,0xE12FFF1E); // BX lr
+  uint32_t end = e->pc;
+  e->pc = call;
+  bench_emit_arm_branch(e,0xEB000000,call+8); // BL to the BX lr
+  bench_emit_arm_branch(e,0xEA000000,0);
+  e->pc = end;
+}
+static void bench_arm_conditional(bench_emitter_t* e){
+  bench_emit32(e,0xE1500001); // CMP r0,r1
+  bench_emit32(e,0x02822001); // ADDEQ r2,r2,#1
+  bench_emit32(e,0x12833001); // ADDNE r3,r3,#1
+  bench_emit32(e,0xC3A04001); // MOVGT r4,#1
+  bench_emit32(e,0xD3A04002); // MOVLE r4,#2
+  bench_emit32(e,0x22455001); // SUBCS r5,r5,#1
+  bench_emit32(e,0x32466001); // SUBCC r6,r6,#1
+  bench_emit32(e,0xE2900003); // ADDS r0,r0,#3
+  bench_emit32(e,0xE3100001); // TST r0,#1
+  bench_emit32(e,0x42877001); // ADDMI r7,r7,#1
+  bench_emit32(e,0x52877002); // ADDPL r7,r7,#2
+  bench_emit32(e,0x0A000000); // BEQ over the next instruction
+  bench_emit32(e,0xE2899001); // ADD r9,r9,#1
+  bench_emit_arm_branch(e,0xEA000000,0);
+}
+static void bench_thumb_alu(bench_emitter_t* e){
+  bench_emit16(e,0x1840); // ADD r0,r0,r1
+  bench_emit16(e,0x3A01); // SUB r2,#1
+  bench_emit16(e,0x00C3); // LSL r3,r0,#3
+  bench_emit16(e,0x405C); // EOR r4,r3
+  bench_emit16(e,0x257F); // MOV r5,#0x7f
+  bench_emit16(e,0x4005); // AND r5,r0
+  bench_emit16(e,0x432E); // ORR r6,r5
+  bench_emit16(e,0x4347); // MUL r7,r0
+  bench_emit16(e,0x4288); // CMP r0,r1
+  bench_emit_thumb_branch(e,0);
+}
+static void bench_thumb_load_store(bench_emitter_t* e){
+  bench_emit16(e,0x6808); // LDR r0,[r1]
+  bench_emit16(e,0x6048); // STR r0,[r1,#4]
+  bench_emit16(e,0x784A); // LDRB r2,[r1,#1]
+  bench_emit16(e,0x724A); // STRB r2,[r1,#9]
+  bench_emit16(e,0x884B); // LDRH r3,[r1,#2]
+  bench_emit16(e,0x814B); // STRH r3,[r1,#10]
+  bench_emit16(e,0xB4F0); // PUSH {r4-r7}
+  bench_emit16(e,0xBCF0); // POP {r4-r7}
+  bench_emit_thumb_branch(e,0);
+}
+static void bench_thumb_branch(bench_emitter_t* e){
+  bench_emit16(e,0xE7FF); // B to the next instruction
+  bench_emit16(e,0x4288); // CMP r0,r1
+  bench_emit16(e,0xD0FF); // BEQ to the next instruction
+  bench_emit16(e,0xD1FF); // BNE to the next instruction
+  uint32_t call = e->pc;
+  e->pc+=6;
+  bench_emit16(e,0x4770); // BX lr
+  uint32_t end = e->pc;
+  e->pc = call;
+  bench_emit_thumb_bl(e,call+6);
+  bench_emit_thumb_branch(e,0);
+  e->pc = end;
+}
+
+typedef struct{
+  const char* name;
+  void (*emit)(bench_emitter_t* e);
+  bool thumb;
+}bench_arm_stream_t;
+static const bench_arm_stream_t bench_arm_streams[]={
+  {"alu",bench_arm_alu,false},
+  {"load_store",bench_arm_load_store,false},
+  {"ldm_stm",bench_arm_block_transfer,false},
+  {"branch",bench_arm_branch,false},
+  {"conditional",bench_arm_conditional,false},
+  {"thumb_alu",bench_thumb_alu,true},
+  {"thumb_load_store",bench_thumb_load_store,true},
+  {"thumb_branch",bench_thumb_branch,true},
+};
+
+// Returns ns per executed instruction, pipeline refills after branches count towards the branch
+static double bench_run_arm(const bench_arm_stream_t* stream, bool arm9, uint64_t instructions){
+  bench_arm_t* b = (bench_arm_t*)calloc(1,sizeof(bench_arm_t));
+  if(!b){
+    printf("Out of memory\n");
+    exit(1);
+  }
+  bench_emitter_t e = {b->mem,0};
+  stream->emit(&e);
+  for(int i=0;i<256;++i)b->mem[BENCH_ARM_DATA+i]=i*37;
+
+  b->cpu = arm7_init(b);
+  b->cpu.read8 = bench_arm_read8;
+  b->cpu.read16 = bench_arm_read16;
+  b->cpu.read32 = bench_arm_read32;
+  b->cpu.read16_seq = bench_arm_read16_seq;
+  b->cpu.read32_seq = bench_arm_read32_seq;
+  b->cpu.write8 = bench_arm_write8;
+  b->cpu.write16 = bench_arm_write16;
+  b->cpu.write32 = bench_arm_write32;
+  b->cpu.block_ptr = bench_arm_block_ptr;
+  b->cpu.coprocessor_read = bench_arm_coproc_read;
+  b->cpu.coprocessor_write = bench_arm_coproc_write;
+  // System mode with IRQs and FIQs masked
+  arm7_set_cpsr(&b->cpu,0xDF|(stream->thumb?0x20:0));
+  for(int r=0;r<8;++r)b->cpu.registers[r]=r*0x01010101u+1;
+  if(stream->thumb)b->cpu.registers[1]=BENCH_ARM_DATA;
+  b->cpu.registers[8]=BENCH_ARM_DATA;
+  b->cpu.registers[10]=0x10;
+  b->cpu.registers[13]=BENCH_ARM_STACK;
+  b->cpu.registers[PC]=0;
+
+  void (*exec)(arm7_t*) = arm9? arm9_exec_instruction: arm7_exec_instruction;
+  // Warm up the caches
+  for(int i=0;i<10000;++i)exec(&b->cpu);
+  uint64_t executed = 0;
+  uint64_t start = bench_now_ns();
+  while(executed<instructions){
+    for(int i=0;i<1024;++i){
+      executed+=b->cpu.phased_op_id==ARM_PHASED_NONE;
+      exec(&b->cpu);
+    }
+  }
+  uint64_t elapsed = bench_now_ns()-start;
+  // A stream that ran off its loop would be timing whatever the zeroed memory decodes to
+  if(b->cpu.registers[PC]>e.pc+8)printf("%s left its loop (PC=%08x)\n",stream->name,b->cpu.registers[PC]);
+  free(b);
+  return (double)elapsed/executed;
+}
+
+//////////////
+// SM83 Core //
+//////////////
+
+// The generated ROM boots straight into BENCH_GB_CODE, turns the LCD off so no frame ever finishes
+// and then runs the stream loop. sb_tick runs step_instructions instructions unless a frame worth of
+// cycles passes first, which the streams never reach within BENCH_GB_TICK_INSTRUCTIONS.
+#define BENCH_GB_CODE 0x150
+#define BENCH_GB_TICK_INSTRUCTIONS 2048
+typedef struct{
+  uint8_t* rom;
+  uint32_t pc;
+}bench_gb_emitter_t;
+static void bench_gb_emit(bench_gb_emitter_t* e, int bytes, ...){
+  va_list args;
+  va_start(args,bytes);
+  for(int i=0;i<bytes;++i)e->rom[e->pc++]=va_arg(args,int);
+  va_end(args);
+}
+static void bench_gb_emit_loop(bench_gb_emitter_t* e, uint32_t start){
+  bench_gb_emit(e,2,0x18,(int)(start-(e->pc+2))&0xff); // JR start
+}
+
+static void bench_sm83_alu(bench_gb_emitter_t* e){
+  uint32_t start = e->pc;
+  bench_gb_emit(e,13,
+    0x80,       // ADD A,B
+    0x91,       // SUB C
+    0xAA,       // XOR D
+    0xE6,0x7F,  // AND 0x7f
+    0xB3,       // OR E
+    0x04,       // INC B
+    0x0D,       // DEC C
+    0x07,       // RLCA
+    0x8C,       // ADC A,H
+    0xBD,       // CP L
+    0x19,       // ADD HL,DE
+    0x3C);      // INC A
+  bench_gb_emit_loop(e,start);
+}
+static void bench_sm83_load_store(bench_gb_emitter_t* e){
+  uint32_t start = e->pc;
+  bench_gb_emit(e,18,
+    0x7E,            // LD A,(HL)
+    0x22,            // LD (HL+),A
+    0x46,            // LD B,(HL)
+    0x32,            // LD (HL-),A
+    0xEA,0x10,0xC0,  // LD (0xc010),A
+    0xFA,0x10,0xC0,  // LD A,(0xc010)
+    0xE0,0x80,       // LDH (0x80),A
+    0xF0,0x80,       // LDH A,(0x80)
+    0x02,            // LD (BC),A
+    0x0A,            // LD A,(BC)
+    0xC5,            // PUSH BC
+    0xD1);           // POP DE
+  bench_gb_emit_loop(e,start);
+}
+static void bench_sm83_branch(bench_gb_emitter_t* e){
+  uint32_t start = e->pc;
+  for(int i=0;i<3;++i)bench_gb_emit(e,2,0x18,0x00); // JR to the next instruction
+  uint32_t sub = e->pc+3+3+2;
+  bench_gb_emit(e,3,0xCD,sub&0xff,sub>>8);            // CALL sub
+  bench_gb_emit(e,3,0xC3,(e->pc+3)&0xff,(e->pc+3)>>8); // JP to the next instruction
+  bench_gb_emit_loop(e,start);
+  bench_gb_emit(e,1,0xC9);                            // sub: RET
+}
+static void bench_sm83_conditional(bench_gb_emitter_t* e){
+  uint32_t start = e->pc;
+  bench_gb_emit(e,10,
+    0xB8,       // CP B
+    0x28,0x00,  // JR Z,+0
+    0x20,0x00,  // JR NZ,+0
+    0x3C,       // INC A
+    0x38,0x00,  // JR C,+0
+    0x30,0x00); // JR NC,+0
+  uint32_t sub = e->pc+3+3+2;
+  bench_gb_emit(e,3,0xC4,sub&0xff,sub>>8); // CALL NZ,sub
+  bench_gb_emit(e,3,0xCC,sub&0xff,sub>>8); // CALL Z,sub
+  bench_gb_emit_loop(e,start);
+  bench_gb_emit(e,1,0xC9);                 // sub: RET
+}
+static void bench_sm83_cb(bench_gb_emitter_t* e){
+  uint32_t start = e->pc;
+  bench_gb_emit(e,12,
+    0xCB,0x7F,  // BIT 7,A
+    0xCB,0xD8,  // SET 3,B
+    0xCB,0x98,  // RES 3,B
+    0xCB,0x11,  // RL C
+    0xCB,0x3A,  // SRL D
+    0xCB,0x33); // SWAP E
+  bench_gb_emit_loop(e,start);
+}
+
+typedef struct{
+  const char* name;
+  void (*emit)(bench_gb_emitter_t* e);
+}bench_gb_stream_t;
+static const bench_gb_stream_t bench_gb_streams[]={
+  {"alu",bench_sm83_alu},
+  {"load_store",bench_sm83_load_store},
+  {"branch",bench_sm83_branch},
+  {"conditional",bench_sm83_conditional},
+  {"cb_prefix",bench_sm83_cb},
+};
+
+static double bench_run_gb(const bench_gb_stream_t* stream, bool batched, uint64_t instructions){
+  sb_emu_state_t* emu = (sb_emu_state_t*)calloc(1,sizeof(sb_emu_state_t));
+  sb_gb_t* gb = (sb_gb_t*)calloc(1,sizeof(sb_gb_t));
+  gb_scratch_t* scratch = (gb_scratch_t*)calloc(1,sizeof(gb_scratch_t));
+  uint8_t* rom = (uint8_t*)calloc(1,32*1024);
+  if(!emu||!gb||!scratch||!rom){
+    printf("Out of memory\n");
+    exit(1);
+  }
+  bench_gb_emitter_t e = {rom,0x100};
+  bench_gb_emit(&e,4,0x00,0xC3,BENCH_GB_CODE&0xff,BENCH_GB_CODE>>8); // NOP, JP BENCH_GB_CODE
+  e.pc = BENCH_GB_CODE;
+  bench_gb_emit(&e,12,
+    0xAF,            // XOR A
+    0xE0,0x40,       // LDH (LCDC),A
+    0x21,0x00,0xC0,  // LD HL,0xc000
+    0x01,0x20,0xC0,  // LD BC,0xc020
+    0x31,0xFE,0xDF); // LD SP,0xdffe
+  stream->emit(&e);
+
+  emu->rom_data = rom;
+  emu->rom_size = 32*1024;
+  strncpy(emu->rom_path,"skyemu_cpu_bench.gb",SB_FILE_PATH_SIZE-1);
+  emu->force_dmg_mode = true;
+  emu->cpu_batch_exec = batched;
+  if(!sb_load_rom(emu,gb,scratch)){
+    printf("Failed to load the generated GB ROM\n");
+    exit(1);
+  }
+  emu->step_instructions = BENCH_GB_TICK_INSTRUCTIONS;
+  sb_tick(emu,gb,scratch);
+  uint64_t executed = 0;
+  uint64_t start = bench_now_ns();
+  while(executed<instructions){
+    emu->step_instructions = BENCH_GB_TICK_INSTRUCTIONS;
+    sb_tick(emu,gb,scratch);
+    executed+=BENCH_GB_TICK_INSTRUCTIONS;
+  }
+  uint64_t elapsed = bench_now_ns()-start;
+  if(gb->cpu.pc<BENCH_GB_CODE||gb->cpu.pc>=e.pc)printf("sm83 %s left its loop (PC=%04x)\n",stream->name,gb->cpu.pc);
+  free(rom);
+  free(scratch);
+  free(gb);
+  free(emu);
+  return (double)elapsed/executed;
+}
+
+static bool bench_selected(const char* filter, const char* name){
+  return !filter||strstr(name,filter);
+}
+static void bench_report(const char* name, double ns){
+  printf("%-32s %8.2f ns/instr %8.1f MIPS\n",name,ns,ns>0?1e3/ns:0.);
+}
+
+int main(int argc, char** argv){
+  uint64_t instructions = 20*1000*1000;
+  const char* filter = NULL;
+  for(int i=1;i<argc;++i){
+    if(strcmp(argv[i],"--instructions")==0&&i+1<argc)instructions = strtoull(argv[++i],NULL,10);
+    else if(argv[i][0]=='-'){
+      printf("Usage: %s [--instructions N] [filter]\n",argv[0]);
+      return 1;
+    }else filter = argv[i];
+  }
+  if(!instructions)instructions = 1;
+  arm7_init_lookup_tables();
+  char name[64];
+  for(int i=0;i<sizeof(bench_arm_streams)/sizeof(bench_arm_streams[0]);++i){
+    const bench_arm_stream_t* s = bench_arm_streams+i;
+    for(int arm9=0;arm9<2;++arm9){
+      snprintf(name,sizeof(name),"%s/%s",arm9?"arm9":"arm7",s->name);
+      if(bench_selected(filter,name))bench_report(name,bench_run_arm(s,arm9,instructions));
+    }
+  }
+  for(int i=0;i<sizeof(bench_gb_streams)/sizeof(bench_gb_streams[0]);++i){
+    const bench_gb_stream_t* s = bench_gb_streams+i;
+    for(int batched=0;batched<2;++batched){
+      snprintf(name,sizeof(name),"sm83/%s%s",s->name,batched?"/batched":"");
+      if(bench_selected(filter,name))bench_report(name,bench_run_gb(s,batched,instructions));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+/*****************************************************************************
+ *
+ *   SkyEmu event log decoder
+ *
+ *   Prints the core events recorded with "Record Event Log" in the stats
+ *   panel (see sb_event_log_t) as text, one event per line prefixed with the
+ *   emulated clock.
+ *
+ *   Usage: skyemu_event_log_decode [--type NAME]... events.seev
+ *   NAME is one of io7, io9, gx, vertex, gc_cmd, gc_read, gc_data, dma.
+ *   Without --type every event is printed.
+ *
+**/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sb_types.h"
+
+static const char* decode_type_names[SB_EVENT_COUNT]={"io7","io9","gx","vertex","gc_cmd","gc_read","gc_data","dma"};
+
+static void decode_print(const sb_event_record_t* r){
+  const uint32_t* d = r->data;
+  printf("%12llu ",(unsigned long long)r->clock);
+  switch(r->type){
+    case SB_EVENT_IO7:
+    case SB_EVENT_IO9:
+      printf("%s %s %08x %08x\n",r->type==SB_EVENT_IO7?"IO7":"IO9",d[2]?"W":"R",d[0],d[1]);
+      break;
+    case SB_EVENT_GX_CMD:
+      printf("GPU CMD: %02x param: %08x mv_stack: %d proj_stack: %d\n",d[0],d[3],(int)d[1],(int)d[2]);
+      break;
+    case SB_EVENT_GX_VERTEX:
+      printf("Vertex {%d %d %d}\n",(int)d[0],(int)d[1],(int)d[2]);
+      break;
+    case SB_EVENT_GC_CMD:
+      printf("GCBUS CMD: %02x %02x %02x%02x %02x%02x %02x%02x\n",d[0]>>24,(d[0]>>16)&0xff,(d[0]>>8)&0xff,d[0]&0xff,
+             d[1]>>24,(d[1]>>16)&0xff,(d[1]>>8)&0xff,d[1]&0xff);
+      break;
+    case SB_EVENT_GC_READ:
+      printf("Encrypted Read: 0x%08x transfer_size: %08x\n",d[0],d[1]);
+      break;
+    case SB_EVENT_GC_DATA:
+      printf("Data: %08x\n",d[0]);
+      break;
+    case SB_EVENT_DMA:
+      printf("DMA[%d][%d]: Src: 0x%08x DST: 0x%08x Cnt:%d mode: %d\n",d[0]&0xff,(d[0]>>8)&0xff,d[1],d[2],(int)d[3],d[0]>>16);
+      break;
+    default:
+      printf("Unknown event %u\n",r->type);
+      break;
+  }
+}
+
+int main(int argc, char** argv){
+  const char* path = NULL;
+  uint32_t types = 0;
+  bool usage = false;
+  for(int i=1;i<argc;++i){
+    if(strcmp(argv[i],"--type")==0&&i+1<argc){
+      const char* name = argv[++i];
+      int t = 0;
+      while(t<SB_EVENT_COUNT&&strcmp(name,decode_type_names[t])!=0)++t;
+      if(t==SB_EVENT_COUNT){
+        printf("Unknown event type %s\n",name);
+        usage = true;
+      }else types|=1u<<t;
+    }else if(argv[i][0]=='-'||path)usage = true;
+    else path = argv[i];
+  }
+  if(usage||!path){
+    printf("Usage: %s [--type NAME]... events.seev\n",argv[0]);
+    printf("Types:");
+    for(int t=0;t<SB_EVENT_COUNT;++t)printf(" %s",decode_type_names[t]);
+    printf("\n");
+    return 1;
+  }
+  if(!types)types = ~0u;
+  FILE* f = fopen(path,"rb");
+  if(!f){
+    printf("Failed to open %s\n",path);
+    return 1;
+  }
+  sb_event_log_file_header_t header;
+  bool ok = fread(&header,sizeof(header),1,f)==1&&memcmp(header.magic,SB_EVENT_LOG_MAGIC,sizeof(header.magic))==0;
+  ok = ok&&header.version==SB_EVENT_LOG_VERSION&&header.record_size==sizeof(sb_event_record_t);
+  if(!ok){
+    printf("%s is not an event log\n",path);
+    fclose(f);
+    return 1;
+  }
+  static sb_event_record_t records[4096];
+  uint64_t decoded = 0;
+  while(decoded<header.num_records){
+    uint64_t left = header.num_records-decoded;
+    size_t n = fread(records,sizeof(records[0]),left<4096?(size_t)left:4096,f);
+    if(!n)break;
+    for(size_t i=0;i<n;++i){
+      bool known = records[i].type<SB_EVENT_COUNT;
+      if(known? (types>>records[i].type)&1: types==~0u)decode_print(records+i);
+    }
+    decoded+=n;
+  }
+  fclose(f);
+  if(decoded!=header.num_records)printf("The log ends after %llu of %llu events\n",(unsigned long long)decoded,(unsigned long long)header.num_records);
+  if(header.dropped)printf("%llu events were dropped while recording\n",(unsigned long long)header.dropped);
+  return decoded==header.num_records? 0: 2;
+}
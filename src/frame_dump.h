@@ -0,0 +1,372 @@
+#ifndef SE_FRAME_DUMP_H
+#define SE_FRAME_DUMP_H 1
+
+#include "sb_types.h"
+#include "gba.h"
+#include "nds.h"
+#include "xxhash.h"
+
+// Frame dumps hold the state the renderers read at each video sync point (see sb_video_capture_t)
+// so frames can be rendered again without the CPUs, DMAs or the rest of the system:
+//  GBA: IO, palette, VRAM, OAM and the PPU state at the start of every line and of its HBlank.
+//       The replay composites each line with the state at its HBlank, so unlike the emulator
+//       stores made in the middle of a line apply to the whole line.
+//  NDS: the polygon/vertex RAM, VRAM, its bank mapping and IO of every rasterized 3D buffer swap.
+// Each sync point only stores the chunks that changed since the previous one. The regions are
+// stored with the layout of the build that captured them, replays check that the sizes match.
+// The hash of every frame is the one the capturing build replayed, so renderer changes that
+// alter the output are caught.
+#define SB_FRAME_DUMP_MAGIC 0x44464553u // "SEFD"
+#define SB_FRAME_DUMP_VERSION 1
+#define SB_FRAME_DUMP_MAX_REGIONS 8
+#define SB_FRAME_DUMP_CHUNK_SIZE 64
+// Records following the header, each starts with its uint32_t tag
+#define SB_FRAME_DUMP_SYNC 1      // int32_t point: render up to it, the writes that follow are its state
+#define SB_FRAME_DUMP_WRITE 2     // uint32_t region, offset, size followed by size bytes
+#define SB_FRAME_DUMP_FRAME_END 3 // uint64_t hash of the frame
+#define SB_FRAME_DUMP_GBA_FRAME_CLOCKS 280896
+typedef struct{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t system;
+  uint32_t num_regions;
+  uint32_t region_size[SB_FRAME_DUMP_MAX_REGIONS];
+  uint32_t num_frames;
+}sb_frame_dump_header_t;
+
+// Memories of the core that make up the dump of system, returns the number of regions
+static int sb_frame_dump_regions(int system, void* core, uint8_t** region, uint32_t* size){
+  int n = 0;
+  #define SB_FRAME_DUMP_REGION(ptr,sz) do{region[n]=(uint8_t*)(ptr);size[n]=(sz);++n;}while(0)
+  if(system==SYSTEM_GBA){
+    gba_t* gba = (gba_t*)core;
+    SB_FRAME_DUMP_REGION(gba->mem.io,sizeof(gba->mem.io));
+    SB_FRAME_DUMP_REGION(gba->mem.palette,sizeof(gba->mem.palette));
+    SB_FRAME_DUMP_REGION(gba->mem.vram,sizeof(gba->mem.vram));
+    SB_FRAME_DUMP_REGION(gba->mem.oam,sizeof(gba->mem.oam));
+    SB_FRAME_DUMP_REGION(&gba->ppu,sizeof(gba->ppu));
+    // Sprites and windows of a line are composited during the HBlank of the previous one
+    SB_FRAME_DUMP_REGION(gba->first_target_buffer,sizeof(gba->first_target_buffer));
+    SB_FRAME_DUMP_REGION(gba->second_target_buffer,sizeof(gba->second_target_buffer));
+    SB_FRAME_DUMP_REGION(gba->window,sizeof(gba->window));
+  }else if(system==SYSTEM_NDS){
+    nds_t* nds = (nds_t*)core;
+    SB_FRAME_DUMP_REGION(nds->gpu.render_queue,sizeof(nds_gpu_render_queue_t));
+    SB_FRAME_DUMP_REGION(nds->mem.vram,sizeof(nds->mem.vram));
+    SB_FRAME_DUMP_REGION(nds->mem.vram_bank_map,sizeof(nds->mem.vram_bank_map));
+    SB_FRAME_DUMP_REGION(nds->mem.io,sizeof(nds->mem.io));
+    SB_FRAME_DUMP_REGION(&nds->gpu.tex_cache_generation,sizeof(nds->gpu.tex_cache_generation));
+  }
+  #undef SB_FRAME_DUMP_REGION
+  return n;
+}
+static uint64_t sb_frame_dump_hash(int system, void* core){
+  if(system==SYSTEM_GBA)return XXH3_64bits(((gba_t*)core)->framebuffer,GBA_LCD_W*GBA_LCD_H*4);
+  if(system==SYSTEM_NDS)return XXH3_64bits(((nds_t*)core)->framebuffer_3d,NDS_LCD_W*NDS_LCD_H*4);
+  return 0;
+}
+
+//////////////
+// Capture //
+//////////////
+
+typedef struct{
+  sb_frame_dump_header_t header;
+  uint8_t* region[SB_FRAME_DUMP_MAX_REGIONS];  // Live memory of the core
+  uint8_t* shadow[SB_FRAME_DUMP_MAX_REGIONS];  // Contents as of the last sync point
+  uint8_t* data; // Header followed by the records
+  size_t size, capacity;
+  size_t complete_size; // Size up to the end of the last complete frame
+  uint32_t max_frames;
+  bool frame_open;
+  bool failed;
+}sb_frame_dump_t;
+
+static void sb_frame_dump_append(sb_frame_dump_t* d, const void* data, size_t size){
+  if(d->failed)return;
+  if(d->size+size>d->capacity){
+    size_t capacity = d->capacity? d->capacity*2: 1024*1024;
+    while(capacity<d->size+size)capacity*=2;
+    uint8_t* new_data = (uint8_t*)realloc(d->data,capacity);
+    if(!new_data){
+      printf("Out of memory capturing the frame dump\n");
+      d->failed = true;
+      return;
+    }
+    d->data = new_data;
+    d->capacity = capacity;
+  }
+  memcpy(d->data+d->size,data,size);
+  d->size+=size;
+}
+static void sb_frame_dump_append_u32(sb_frame_dump_t* d, uint32_t v){sb_frame_dump_append(d,&v,sizeof(v));}
+static void sb_frame_dump_end_frame(sb_frame_dump_t* d){
+  uint64_t hash = 0; // Filled in by sb_frame_dump_finish
+  sb_frame_dump_append_u32(d,SB_FRAME_DUMP_FRAME_END);
+  sb_frame_dump_append(d,&hash,sizeof(hash));
+  d->complete_size = d->size;
+  d->header.num_frames++;
+  d->frame_open = false;
+}
+// Stores the chunks of every region that changed since the last sync point
+static void sb_frame_dump_write_changes(sb_frame_dump_t* d){
+  for(uint32_t r=0;r<d->header.num_regions;++r){
+    uint8_t* live = d->region[r];
+    uint8_t* shadow = d->shadow[r];
+    uint32_t size = d->header.region_size[r];
+    uint32_t offset = 0;
+    while(offset<size){
+      uint32_t chunk = size-offset<SB_FRAME_DUMP_CHUNK_SIZE? size-offset: SB_FRAME_DUMP_CHUNK_SIZE;
+      if(memcmp(live+offset,shadow+offset,chunk)==0){offset+=chunk;continue;}
+      uint32_t start = offset;
+      while(offset<size){
+        chunk = size-offset<SB_FRAME_DUMP_CHUNK_SIZE? size-offset: SB_FRAME_DUMP_CHUNK_SIZE;
+        if(memcmp(live+offset,shadow+offset,chunk)==0)break;
+        offset+=chunk;
+      }
+      uint32_t record[4]={SB_FRAME_DUMP_WRITE,r,start,offset-start};
+      sb_frame_dump_append(d,record,sizeof(record));
+      sb_frame_dump_append(d,live+start,offset-start);
+      memcpy(shadow+start,live+start,offset-start);
+    }
+  }
+}
+// sb_video_capture_t.sync of the capture, user_data is the sb_frame_dump_t
+static void sb_frame_dump_sync(void* user_data, int point){
+  sb_frame_dump_t* d = (sb_frame_dump_t*)user_data;
+  if(d->failed||d->header.num_frames>=d->max_frames)return;
+  if(d->header.system==SYSTEM_GBA){
+    // GBA frames start at the first line so the replay renders whole frames
+    if(point==0&&d->frame_open)sb_frame_dump_end_frame(d);
+    if(d->header.num_frames>=d->max_frames)return;
+    if(point!=0&&!d->frame_open)return;
+  }
+  d->frame_open = true;
+  sb_frame_dump_append_u32(d,SB_FRAME_DUMP_SYNC);
+  sb_frame_dump_append(d,&point,sizeof(point));
+  sb_frame_dump_write_changes(d);
+  if(point==SB_VIDEO_SYNC_NDS_3D_SWAP)sb_frame_dump_end_frame(d);
+}
+// Captures up to max_frames frames of the core once sb_frame_dump_sync is registered as its
+// emu->video_capture
+static bool sb_frame_dump_init(sb_frame_dump_t* d, int system, void* core, uint32_t max_frames){
+  memset(d,0,sizeof(*d));
+  d->header.magic = SB_FRAME_DUMP_MAGIC;
+  d->header.version = SB_FRAME_DUMP_VERSION;
+  d->header.system = system;
+  d->header.num_regions = sb_frame_dump_regions(system,core,d->region,d->header.region_size);
+  d->max_frames = max_frames;
+  if(!d->header.num_regions){
+    printf("Frame dumps are only supported for GBA and NDS\n");
+    return false;
+  }
+  for(uint32_t r=0;r<d->header.num_regions;++r){
+    // Replays start from zeroed memory
+    d->shadow[r] = (uint8_t*)calloc(1,d->header.region_size[r]);
+    if(!d->shadow[r])d->failed = true;
+  }
+  sb_frame_dump_append(d,&d->header,sizeof(d->header));
+  d->complete_size = d->size;
+  return !d->failed;
+}
+static void sb_frame_dump_free(sb_frame_dump_t* d){
+  for(uint32_t r=0;r<SB_FRAME_DUMP_MAX_REGIONS;++r)free(d->shadow[r]);
+  free(d->data);
+  memset(d,0,sizeof(*d));
+}
+
+/////////////
+// Replay //
+/////////////
+
+typedef struct{
+  sb_frame_dump_header_t header;
+  uint8_t* data; // Records, points in the dump passed to sb_frame_dump_replay_init
+  size_t size;
+  size_t cursor;
+  int32_t point; // Last sync point of the current frame
+  uint8_t* region[SB_FRAME_DUMP_MAX_REGIONS];
+  uint32_t region_size[SB_FRAME_DUMP_MAX_REGIONS];
+  // Standalone core the frames are rendered with
+  gba_t* gba;
+  nds_t* nds;
+  uint8_t* framebuffer;
+  uint32_t* depth;
+  sb_sprite_bins_t* sprite_bins;
+  nds_gpu_render_queue_t* render_queue;
+  nds_tex_cache_t* tex_cache;
+  uint8_t* halo;
+}sb_frame_dump_replay_t;
+
+static void sb_frame_dump_replay_free(sb_frame_dump_replay_t* r){
+  free(r->gba);
+  free(r->nds);
+  free(r->framebuffer);
+  free(r->depth);
+  free(r->sprite_bins);
+  free(r->render_queue);
+  free(r->tex_cache);
+  free(r->halo);
+  memset(r,0,sizeof(*r));
+}
+// Restarts the replay from the first frame
+static void sb_frame_dump_replay_rewind(sb_frame_dump_replay_t* r){
+  for(uint32_t i=0;i<r->header.num_regions;++i)memset(r->region[i],0,r->region_size[i]);
+  if(r->sprite_bins)r->sprite_bins->dirty = true;
+  if(r->framebuffer)memset(r->framebuffer,0,r->header.system==SYSTEM_GBA? GBA_LCD_W*GBA_LCD_H*4: NDS_LCD_W*NDS_LCD_H*4);
+  // Decoded textures of the previous pass would be reused since the generation starts over
+  if(r->tex_cache)r->tex_cache->full = true;
+  r->cursor = 0;
+}
+// job_dispatch (optional) renders the NDS 3D bands in parallel. dump must outlive the replay,
+// the frame hashes in it are updated by sb_frame_dump_replay_frame when update_hashes is set.
+static bool sb_frame_dump_replay_init(sb_frame_dump_replay_t* r, uint8_t* dump, size_t size, sb_job_dispatch_t job_dispatch){
+  memset(r,0,sizeof(*r));
+  if(size<sizeof(sb_frame_dump_header_t)){
+    printf("Frame dump is truncated\n");
+    return false;
+  }
+  memcpy(&r->header,dump,sizeof(r->header));
+  if(r->header.magic!=SB_FRAME_DUMP_MAGIC||r->header.version!=SB_FRAME_DUMP_VERSION){
+    printf("Not a version %d frame dump\n",SB_FRAME_DUMP_VERSION);
+    return false;
+  }
+  r->data = dump+sizeof(sb_frame_dump_header_t);
+  r->size = size-sizeof(sb_frame_dump_header_t);
+  void* core = NULL;
+  bool ok = true;
+  if(r->header.system==SYSTEM_GBA){
+    r->gba = (gba_t*)calloc(1,sizeof(gba_t));
+    r->framebuffer = (uint8_t*)calloc(1,GBA_LCD_W*GBA_LCD_H*4);
+    r->sprite_bins = (sb_sprite_bins_t*)calloc(1,sizeof(sb_sprite_bins_t));
+    ok = r->gba&&r->framebuffer&&r->sprite_bins;
+    if(ok){
+      r->gba->framebuffer = r->framebuffer;
+      r->gba->mem.sprite_bins = r->sprite_bins;
+      core = r->gba;
+    }
+  }else if(r->header.system==SYSTEM_NDS){
+    r->nds = (nds_t*)calloc(1,sizeof(nds_t));
+    r->framebuffer = (uint8_t*)calloc(1,NDS_LCD_W*NDS_LCD_H*4);
+    r->depth = (uint32_t*)calloc(NDS_LCD_W*NDS_LCD_H,sizeof(uint32_t));
+    r->render_queue = (nds_gpu_render_queue_t*)calloc(1,sizeof(nds_gpu_render_queue_t));
+    r->tex_cache = (nds_tex_cache_t*)calloc(1,sizeof(nds_tex_cache_t));
+    r->halo = (uint8_t*)calloc(NDS_GPU_RENDER_BANDS*2,NDS_LCD_W*4);
+    ok = r->nds&&r->framebuffer&&r->depth&&r->render_queue&&r->tex_cache&&r->halo;
+    if(ok){
+      r->nds->framebuffer_3d = r->framebuffer;
+      r->nds->framebuffer_3d_depth = r->depth;
+      r->nds->framebuffer_3d_halo = r->halo;
+      r->nds->gpu.render_queue = r->render_queue;
+      r->nds->gpu.tex_cache = r->tex_cache;
+      r->nds->gpu.job_dispatch = job_dispatch;
+      core = r->nds;
+    }
+  }else{
+    printf("Frame dump of unsupported system %u\n",r->header.system);
+    return false;
+  }
+  if(!ok){
+    printf("Out of memory setting up the frame dump replay\n");
+    sb_frame_dump_replay_free(r);
+    return false;
+  }
+  uint32_t num_regions = sb_frame_dump_regions(r->header.system,core,r->region,r->region_size);
+  bool layout_matches = num_regions==r->header.num_regions;
+  for(uint32_t i=0;i<num_regions&&layout_matches;++i)layout_matches = r->region_size[i]==r->header.region_size[i];
+  if(!layout_matches){
+    printf("Frame dump was captured by a build with a different video state layout\n");
+    sb_frame_dump_replay_free(r);
+    return false;
+  }
+  sb_frame_dump_replay_rewind(r);
+  return true;
+}
+// Removes the next record field from the dump, returns false if it is truncated
+static FORCE_INLINE bool sb_frame_dump_read(sb_frame_dump_replay_t* r, void* out, size_t size){
+  if(r->size-r->cursor<size)return false;
+  memcpy(out,r->data+r->cursor,size);
+  r->cursor+=size;
+  return true;
+}
+// Runs the GBA PPU over the clocks between the last sync point and point
+static void sb_frame_dump_replay_gba_to(sb_frame_dump_replay_t* r, int32_t point){
+  gba_t* gba = r->gba;
+  int ticks = point-r->point;
+  int t = 0;
+  // Same fast forward as gba_scheduler_advance
+  while(t<ticks){
+    int skip = gba->ppu.fast_forward_ticks;
+    if(skip>ticks-t)skip = ticks-t;
+    gba->ppu.fast_forward_ticks-=skip;
+    t+=skip;
+    if(t==ticks)break;
+    gba_tick_ppu(gba,true);
+    ++t;
+  }
+  r->point = point;
+}
+// Renders the next frame of the dump. Returns false at the end of the dump or if it is corrupt.
+// With update_hashes the stored hash is replaced by the one of the replay instead of compared.
+static bool sb_frame_dump_replay_frame(sb_frame_dump_replay_t* r, uint64_t* hash, bool* hash_matches, bool update_hashes){
+  bool gba = r->header.system==SYSTEM_GBA;
+  r->point = -1;
+  uint32_t tag;
+  while(sb_frame_dump_read(r,&tag,sizeof(tag))){
+    if(tag==SB_FRAME_DUMP_SYNC){
+      int32_t point;
+      if(!sb_frame_dump_read(r,&point,sizeof(point)))break;
+      if(gba){
+        if(point<0||point>=SB_FRAME_DUMP_GBA_FRAME_CLOCKS||point<r->point)break;
+        if(r->point>=0)sb_frame_dump_replay_gba_to(r,point);
+      }
+      r->point = point;
+    }else if(tag==SB_FRAME_DUMP_WRITE){
+      uint32_t w[3];
+      if(!sb_frame_dump_read(r,w,sizeof(w)))break;
+      if(w[0]>=r->header.num_regions||w[1]>r->region_size[w[0]]||w[2]>r->region_size[w[0]]-w[1])break;
+      // Which pixels the capturing emulator had already composited is up to its stores, the
+      // replay composites every line once at HBlank with the state of that sync point
+      gba_ppu_t ppu = gba? r->gba->ppu: (gba_ppu_t){0};
+      if(!sb_frame_dump_read(r,r->region[w[0]]+w[1],w[2]))break;
+      if(gba&&r->region[w[0]]==r->gba->mem.oam)r->sprite_bins->dirty = true;
+      if(gba&&r->region[w[0]]==(uint8_t*)&r->gba->ppu){
+        r->gba->ppu.line_render_pending = ppu.line_render_pending;
+        r->gba->ppu.line_render_x = ppu.line_render_x;
+        r->gba->ppu.line_render_y = ppu.line_render_y;
+      }
+    }else if(tag==SB_FRAME_DUMP_FRAME_END){
+      if(r->size-r->cursor<sizeof(uint64_t))break;
+      if(gba){
+        if(r->point<0)break;
+        sb_frame_dump_replay_gba_to(r,SB_FRAME_DUMP_GBA_FRAME_CLOCKS);
+      }else nds_gpu_rasterize(r->nds);
+      void* core = gba? (void*)r->gba: (void*)r->nds;
+      uint64_t h = sb_frame_dump_hash(r->header.system,core);
+      uint64_t expected;
+      memcpy(&expected,r->data+r->cursor,sizeof(expected));
+      if(update_hashes)memcpy(r->data+r->cursor,&h,sizeof(h));
+      r->cursor+=sizeof(uint64_t);
+      if(hash)*hash = h;
+      if(hash_matches)*hash_matches = update_hashes||h==expected;
+      return true;
+    }else break;
+  }
+  if(r->cursor!=r->size)printf("Frame dump is corrupt at offset %zu\n",r->cursor+sizeof(sb_frame_dump_header_t));
+  return false;
+}
+// Drops the incomplete last frame and stores the replayed hash of every frame
+static bool sb_frame_dump_finish(sb_frame_dump_t* d){
+  if(d->failed)return false;
+  d->size = d->complete_size;
+  d->frame_open = false;
+  memcpy(d->data,&d->header,sizeof(d->header));
+  sb_frame_dump_replay_t r;
+  if(!sb_frame_dump_replay_init(&r,d->data,d->size,NULL))return false;
+  uint32_t frames = 0;
+  while(sb_frame_dump_replay_frame(&r,NULL,NULL,true))++frames;
+  sb_frame_dump_replay_free(&r);
+  return frames==d->header.num_frames;
+}
+
+#endif
@@ -298,6 +298,13 @@ typedef struct {
 typedef struct {
   uint8_t data[65536];
   uint8_t wram[SB_WRAM_NUM_BANKS*SB_WRAM_BANK_SIZE];
+  // Set when JOYP, KEY0, KEY1 or the BIOS bank is written so batched stepping knows to refresh its cached state
+  bool cpu_io_dirty;
+  // Byte offset of each 256 byte page from the core (from cart.data for ROM pages), or -1 if the
+  // access needs the full address decode. Offsets keep the tables valid across save states.
+  // Rebuilt by sb_update_page_table whenever the banking changes
+  int32_t read_page[256];
+  int32_t write_page[256];
 } sb_gb_mem_t;
 
 typedef struct {
@@ -335,6 +342,8 @@ typedef struct{
   bool finished_frame;
   int sprite_index;
   bool render_frame;
+  // Pixels of the current line are drawn lazily in spans, render_x is the next one to draw
+  int render_x;
 } sb_lcd_ppu_t;
 typedef struct{
   bool in_hblank; 
@@ -385,9 +394,12 @@ typedef struct{
   sb_frame_sequencer_t sequencer;
   uint32_t wave_sample_offset;
   uint32_t wave_freq_timer; 
+  // Cycles the APU hasn't been advanced by yet and how many have to pass before the next sample is due
+  uint32_t pending_cycles;
+  uint32_t sample_due_cycles;
 }sb_audio_t;
 typedef struct{
-  uint32_t ticks_to_complete; 
+  int32_t ticks_to_complete; 
   bool last_active;
 }sb_serial_t;
 typedef struct{
@@ -414,6 +426,12 @@ typedef struct{
   uint16_t latched_day; 
   bool has_rtc; 
 }sb_rtc_t;
+// Colors of the 64 color ids of a span, kept until one of the registers, palettes or settings in key changes
+typedef struct{
+  uint8_t key[5+4*3+SB_PPU_BG_COLOR_PALETTES+SB_PPU_SPRITE_COLOR_PALETTES];
+  bool valid;
+  uint8_t rgb[64][3];
+}sb_gb_palette_lut_t;
 
 typedef struct {
   sb_gb_cartridge_t cart;
@@ -429,13 +447,26 @@ typedef struct {
   int model; 
   uint8_t dmg_palette[4*3];
   uint8_t* bios; 
-} sb_gb_t;  
+  sb_gb_palette_lut_t* palette_lut;
+  sb_perf_counters_t perf;
+} sb_gb_t;
+// Rewind granularity of sb_gb_t, sorted by offset
+static inline const sb_rewind_region_t* sb_rewind_regions(int* num_regions){
+  static const sb_rewind_region_t regions[]={
+    SB_REWIND_REGION(sb_gb_t,lcd.vram,128),
+    SB_REWIND_REGION(sb_gb_t,perf,SB_REWIND_SKIP),
+  };
+  *num_regions = sizeof(regions)/sizeof(regions[0]);
+  return regions;
+}  
 
 typedef struct{
   uint8_t framebuffer[SB_LCD_H*SB_LCD_W*4];
   uint8_t bios[2304];
+  sb_gb_palette_lut_t palette_lut;
  } gb_scratch_t; 
 
+static void sb_update_page_table(sb_gb_t* gb);
 // Return offset to bess structure
 static uint32_t sb_save_best_effort_state(sb_gb_t* gb){
   sb_gb_bess_info_t bess;
@@ -484,6 +515,7 @@ static bool sb_load_best_effort_state(sb_gb_t* gb, uint8_t *save_state_data, uin
   gb->cart.mapped_ram_bank = bess->mapped_ram_bank;
   gb->cart.mapped_rom_bank = bess->mapped_rom_bank;
   gb->cart.bank_mode = bess->cart_bank_mode;
+  sb_update_page_table(gb);
 
   return true; 
 }
@@ -495,11 +527,12 @@ typedef void (*sb_opcode_impl_t)(sb_gb_t*,int op1,int op2, int op1_enum, int op2
 
 uint32_t sb_lookup_tile(sb_gb_t* gb, int px, int py, int tile_base, int data_mode);
 void sb_lookup_palette_color(sb_gb_t*gb,int color_id, int*r, int *g, int *b);
-static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, double delta_time,int cycles);
+static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, int cycles);
+static FORCE_INLINE void sb_audio_catch_up(sb_gb_t *gb);
 static void sb_tick_frame_seq(sb_gb_t*gb,sb_frame_sequencer_t* seq);
 static void sb_process_audio_writes(sb_gb_t* gb); 
 static bool sb_run_ar_cheat(sb_gb_t* gb, const uint32_t* buffer, uint32_t size);
-void sb_draw_pixel(sb_emu_state_t*emu,sb_gb_t* gb, int x, int y);
+static void sb_ppu_catch_up(sb_gb_t* gb);
 
 static FORCE_INLINE uint8_t sb_read8_io(sb_gb_t*gb, int addr){return gb->mem.data[addr];}
 static FORCE_INLINE void sb_store8_io(sb_gb_t*gb, int addr, int value){gb->mem.data[addr]=value;}
@@ -560,6 +593,48 @@ static FORCE_INLINE uint8_t sb_read8_direct(sb_gb_t *gb, int addr) {
   }
   return gb->mem.data[addr];
 }
+static void sb_update_page_table(sb_gb_t* gb){
+  int32_t* read = gb->mem.read_page;
+  int32_t* write = gb->mem.write_page;
+  const int32_t slow = -1;
+  for(int p=0;p<256;++p)read[p]=write[p]=slow;
+  // The wrap can only be applied per bank when the ROM size is a multiple of the bank size
+  if(gb->cart.rom_size>0&&gb->cart.rom_size%0x4000==0){
+    int bank0 = 0;
+    int bankn = gb->cart.mapped_rom_bank<<14;
+    if(gb->cart.mbc_type==SB_MBC_MBC1){
+      if(gb->cart.bank_mode)bank0|=SB_BFE(gb->cart.mapped_ram_bank,0,2)<<19;
+      bankn|=SB_BFE(gb->cart.mapped_ram_bank,0,2)<<19;
+    }
+    bank0%=gb->cart.rom_size;
+    bankn%=gb->cart.rom_size;
+    bool bios_mapped = !sb_read8_io(gb,SB_IO_BIOS_BANK);
+    for(int p=0x00;p<0x40;++p){
+      if(bios_mapped&&(p==0x00||(p>=0x02&&p<0x09)))continue;
+      read[p]=bank0+(p<<8);
+    }
+    for(int p=0x40;p<0x80;++p)read[p]=bankn+((p-0x40)<<8);
+  }
+  int32_t vram = (uint8_t*)gb->lcd.vram-(uint8_t*)gb+(sb_read8_io(gb,SB_IO_GBC_VBK)%SB_VRAM_NUM_BANKS)*SB_VRAM_BANK_SIZE;
+  for(int p=0x80;p<0xa0;++p)read[p]=vram+((p-0x80)<<8);
+  // Cart RAM writes stay on the slow path since they have to mark the save as dirty
+  bool ram_mapped = gb->cart.ram_write_enable&&gb->cart.ram_size%256==0&&gb->cart.ram_size&&
+                    !(gb->rtc.has_rtc&&gb->cart.mbc_type==SB_MBC_MBC3&&gb->cart.mapped_ram_bank>=0x08&&gb->cart.mapped_ram_bank<=0x0C);
+  if(ram_mapped){
+    int32_t ram = (uint8_t*)gb->cart.ram_data-(uint8_t*)gb;
+    int bank = gb->cart.mapped_ram_bank<<13;
+    if(gb->cart.mbc_type==SB_MBC_MBC1)bank = gb->cart.bank_mode? SB_BFE(gb->cart.mapped_ram_bank,0,2)<<13: 0;
+    for(int p=0xa0;p<0xc0;++p)read[p]=ram+(bank|((p-0xa0)<<8))%gb->cart.ram_size;
+  }
+  int wram_bank = gb->mem.data[SB_IO_GBC_SVBK]%SB_WRAM_NUM_BANKS;
+  if(wram_bank==0)wram_bank = 1;
+  int32_t data = (uint8_t*)gb->mem.data-(uint8_t*)gb;
+  int32_t wram = (uint8_t*)gb->mem.wram-(uint8_t*)gb+wram_bank*0x1000;
+  for(int p=0xc0;p<0xd0;++p)read[p]=write[p]=data+(p<<8);
+  for(int p=0xd0;p<0xe0;++p)read[p]=write[p]=wram+((p-0xd0)<<8);
+  //Echo RAM always mirrors the unbanked copy
+  for(int p=0xe0;p<0xfe;++p)read[p]=write[p]=data+((p-0x20)<<8);
+}
 bool sb_gbc_enable(sb_gb_t*gb){
   return (gb->mem.data[SB_IO_GBC_KEY0]!=0x4||!gb->mem.data[SB_IO_BIOS_BANK])&&gb->model==SB_GBC;
 }
@@ -593,10 +668,16 @@ uint8_t sb_io_or_mask(sb_gb_t* gb, int addr){
   return 0; 
 }
 uint8_t sb_read8(sb_gb_t *gb, int addr) {
+  if(SB_LIKELY(addr>=0&&addr<0xff00)){
+    int32_t off = gb->mem.read_page[addr>>8];
+    if(SB_LIKELY(off>=0))return (addr<0x8000? gb->cart.data: (uint8_t*)gb)[off+(addr&0xff)];
+    return sb_read8_direct(gb,addr);
+  }
   //if(addr == 0xff44)return 0x90;
   //if(addr == 0xff80)gb->cpu.trigger_breakpoint=true;
   //Only high ram is accessible during oam_dma
   if(addr >=0xff00){
+    if(addr<0xff80||addr==0xffff)SB_PERF_COUNT(&gb->perf,SB_COUNTER_MMIO,1);
     if(addr == SB_IO_GBC_BCPS){
       uint8_t bcps = sb_read8_io(gb, SB_IO_GBC_BCPS);
       return bcps|(1<<6)|sb_io_or_mask(gb,addr);
@@ -614,6 +695,7 @@ uint8_t sb_read8(sb_gb_t *gb, int addr) {
     }else if(addr>=SB_IO_AUD3_WAVE_BASE&&addr<SB_IO_AUD3_WAVE_BASE+16){
       bool wave_active = SB_BFE(sb_read8_io(gb,SB_IO_SOUND_ON_OFF),2,1);
       if(wave_active){
+        sb_audio_catch_up(gb);
         return gb->audio.curr_wave_data;
       }
     }
@@ -656,7 +738,15 @@ static FORCE_INLINE void sb_store8_direct(sb_gb_t *gb, int addr, int value) {
   gb->mem.data[addr]=value;
 }
 void sb_store8(sb_gb_t *gb, int addr, int value) {
+  if(SB_LIKELY(addr>=0&&addr<0xff00)){
+    int32_t off = gb->mem.write_page[addr>>8];
+    if(SB_LIKELY(off>=0)){((uint8_t*)gb)[off+(addr&0xff)]=value;return;}
+  }
+  // Pixels up to the current dot have to be drawn with the old values of anything the PPU reads
+  if((addr>=0x8000&&addr<=0x9fff)||(addr>=SB_IO_LCD_CTRL&&addr<=SB_IO_GBC_KEY0)||addr==SB_IO_BIOS_BANK||
+     addr==SB_IO_GBC_BCPD||addr==SB_IO_GBC_OCPD)sb_ppu_catch_up(gb);
   if(addr>=0xff00){
+    if(addr<0xff80||addr==0xffff)SB_PERF_COUNT(&gb->perf,SB_COUNTER_MMIO,1);
     if(!sb_gbc_enable(gb) &&addr>=0xff4C&&addr<=0xff7f&&addr!=SB_IO_BIOS_BANK)return;
     if(addr == SB_IO_DMA_SRC_LO ||addr == SB_IO_DMA_DST_LO){
       value&=~0xf;
@@ -707,6 +797,8 @@ void sb_store8(sb_gb_t *gb, int addr, int value) {
     }else if(addr == SB_IO_SERIAL_BYTE){
       printf("%c",(char)value);
     }else if(addr>=SB_IO_AUD1_TONE_SWEEP&&addr<SB_IO_AUD3_WAVE_BASE+16){
+      // The elapsed cycles have to be run with the old register values
+      sb_audio_catch_up(gb);
       sb_frame_sequencer_t *seq = &gb->audio.sequencer;
       int i = (addr-SB_IO_AUD1_LENGTH_DUTY)/5;
       if(addr==SB_IO_SOUND_ON_OFF){
@@ -746,13 +838,19 @@ void sb_store8(sb_gb_t *gb, int addr, int value) {
       sb_process_audio_writes(gb);
       return;
     }else if(addr==SB_IO_BIOS_BANK){value|= sb_read8_io(gb,SB_IO_BIOS_BANK);
+      gb->mem.cpu_io_dirty=true;
     }else if(addr==SB_IO_GBC_KEY0){if(sb_read8_io(gb,SB_IO_BIOS_BANK))return;
+      gb->mem.cpu_io_dirty=true;
     }else if(addr==SB_IO_GBC_SPEED_SWITCH){
       value&=0x1;
       value|=sb_read8_io(gb,SB_IO_GBC_SPEED_SWITCH)&0xfe;
+      gb->mem.cpu_io_dirty=true;
+    }else if(addr==SB_IO_JOYPAD){
+      gb->mem.cpu_io_dirty=true;
     }
   }else if(addr >= 0x0000 && addr <=0x1fff){
     gb->cart.ram_write_enable = (value&0xf)==0xA;
+    sb_update_page_table(gb);
     return;
   }else if(addr >= 0x2000 && addr <=0x3fff){
     //MBC3 rombank select
@@ -768,6 +866,7 @@ void sb_store8(sb_gb_t *gb, int addr, int value) {
         }else gb->cart.mapped_rom_bank=(gb->cart.mapped_rom_bank&0x100)|value;
       break;
     }    
+    sb_update_page_table(gb);
     return;
   }else if(addr >= 0x4000 && addr <=0x5fff){
     gb->cart.rumble = false;
@@ -778,6 +877,7 @@ void sb_store8(sb_gb_t *gb, int addr, int value) {
       if(gb->cart.mbc_type!=SB_MBC_MBC3)value %= (gb->cart.ram_size/0x2000);
     }else value%=4;
     gb->cart.mapped_ram_bank = value;
+    sb_update_page_table(gb);
     return;
   }else if (addr>=0xfe00 && addr<=0xfe9f ){
     //OAM cannot be written to in mode 2 and 3
@@ -786,6 +886,7 @@ void sb_store8(sb_gb_t *gb, int addr, int value) {
   } else if(addr>=0x6000&&addr<=0x7fff){
     if(gb->cart.mbc_type==SB_MBC_MBC1){
       gb->cart.bank_mode = SB_BFE(value,0,1);
+      sb_update_page_table(gb);
     }
     if(gb->cart.mbc_type==SB_MBC_MBC3&&gb->rtc.has_rtc&&SB_BFE(value,0,1)){
       gb->rtc.latched_sec = gb->rtc.sec;
@@ -799,6 +900,7 @@ void sb_store8(sb_gb_t *gb, int addr, int value) {
     if(stat>=3) return;            
   }
   sb_store8_direct(gb,addr,value);
+  if(addr==SB_IO_GBC_VBK||addr==SB_IO_GBC_SVBK||addr==SB_IO_BIOS_BANK)sb_update_page_table(gb);
 }
 void sb_store16(sb_gb_t *gb, int addr, unsigned int value) {
   sb_store8(gb,addr,value&0xff);
@@ -823,6 +925,7 @@ void sb_update_joypad_io_reg(sb_emu_state_t* state, sb_gb_t*gb){
   // Bit 1 - P11 Input: Left  or B        (0=Pressed) (Read Only)
   // Bit 0 - P10 Input: Right or A        (0=Pressed) (Read Only)
 
+  if(state->late_input)sb_latch_late_input(state->late_input,&state->joy);
   uint8_t data_dir =    ((!(state->joy.inputs[SE_KEY_DOWN]>0.3))<<3)|
                         ((!(state->joy.inputs[SE_KEY_UP]>0.3))<<2)  |
                         ((!(state->joy.inputs[SE_KEY_LEFT]>0.3))<<1)|
@@ -869,6 +972,7 @@ static FORCE_INLINE void sb_update_lcd(sb_emu_state_t*emu,sb_gb_t* gb){
     gb->lcd.wy_eq_ly = false;
     gb->lcd.in_hblank=true;
     gb->lcd.window_active=false;
+    gb->lcd.render_x=0;
     sb_store8_io(gb, SB_IO_LCD_STAT,stat&~3);
     ly = 0;
   }else{
@@ -894,6 +998,7 @@ static FORCE_INLINE void sb_update_lcd(sb_emu_state_t*emu,sb_gb_t* gb){
 
       if(gb->lcd.window_active)gb->lcd.curr_window_scanline+=1;
       gb->lcd.window_active=false;
+      gb->lcd.render_x=0;
       int old_ly = ly;
       ly+=1;
       gb->lcd.curr_scanline += 1;
@@ -909,25 +1014,22 @@ static FORCE_INLINE void sb_update_lcd(sb_emu_state_t*emu,sb_gb_t* gb){
     }
     if(ly >= SB_LCD_H) {mode = 1;}    
     if(gb->lcd.render_frame){
-      if(mode==2){
-        int clock_num = gb->lcd.scanline_cycles;
-        if(clock_num==0){
-          for(int i=0;i<SB_SPRITES_PER_SCANLINE;++i)gb->lcd.render_sprites[i]=-1;
-          gb->lcd.sprite_index = 0; 
-        }
-        if(clock_num%2){
-          uint8_t y = gb->lcd.curr_scanline;
-          const int num_sprites= 40;
-          int oam_table_offset = 0xfe00;
-          uint8_t ctrl = sb_read8_io(gb, SB_IO_LCD_CTRL);
-          bool draw_sprite = SB_BFE(ctrl,1,1)==1;
-          bool sprite8x16  = SB_BFE(ctrl,2,1)==1;
-          int sprite_h = sprite8x16 ? 16: 8;
-          int sprite_id = clock_num/2;
+      // The sprites of the line are picked in one go on the last dot of mode 2
+      if(mode==2&&gb->lcd.scanline_cycles==mode2_clks-1){
+        for(int i=0;i<SB_SPRITES_PER_SCANLINE;++i)gb->lcd.render_sprites[i]=-1;
+        gb->lcd.sprite_index = 0; 
+        uint8_t y = gb->lcd.curr_scanline;
+        const int num_sprites= 40;
+        int oam_table_offset = 0xfe00;
+        uint8_t ctrl = sb_read8_io(gb, SB_IO_LCD_CTRL);
+        bool draw_sprite = SB_BFE(ctrl,1,1)==1;
+        bool sprite8x16  = SB_BFE(ctrl,2,1)==1;
+        int sprite_h = sprite8x16 ? 16: 8;
+        for(int sprite_id=0;sprite_id<num_sprites&&draw_sprite;++sprite_id){
           int sprite_base = oam_table_offset+sprite_id*4;
           int yc = (int)sb_read8_io(gb, sprite_base+0)-16;
           int xc = (int)sb_read8_io(gb, sprite_base+1)-16;
-          if(yc<=y && yc+sprite_h>y&& gb->lcd.sprite_index<SB_SPRITES_PER_SCANLINE&&sprite_id<num_sprites&&draw_sprite){
+          if(yc<=y && yc+sprite_h>y&& gb->lcd.sprite_index<SB_SPRITES_PER_SCANLINE){
             gb->lcd.render_sprites[gb->lcd.sprite_index]=sprite_id;
             for(int i=0;i<4;++i){
               gb->lcd.render_sprites_data[gb->lcd.sprite_index][i]=sb_read8_io(gb, sprite_base+i);
@@ -942,9 +1044,7 @@ static FORCE_INLINE void sb_update_lcd(sb_emu_state_t*emu,sb_gb_t* gb){
         //Zen Intergalactic Ninja, Speedy Gonzales, and the Warriors of Might and Magic are also very sensitive
         //to the behavior of this window. 
         if(ly==wy&&window_enable) gb->lcd.wy_eq_ly = true;
-        if(x<SB_LCD_W&&x>=0){
-          sb_draw_pixel(emu,gb,x,gb->lcd.curr_scanline);
-        }
+        if(x==SB_LCD_W-1)sb_ppu_catch_up(gb);
       }
     }
     if(ly==153&& gb->lcd.scanline_cycles>=4){ly = 0;}
@@ -1071,11 +1171,66 @@ void sb_lookup_palette_color(sb_gb_t*gb,int color_id, int*r, int *g, int *b){
     *b = tb*8;
   }
 }
-void sb_draw_pixel(sb_emu_state_t*emu,sb_gb_t* gb, int x, int y){
+// Colors of all 64 color ids, only looked up again when the palette state differs from the last span
+static const sb_gb_palette_lut_t* sb_palette_lut(sb_gb_t* gb){
+  sb_gb_palette_lut_t* lut = gb->palette_lut;
+  uint8_t key[sizeof(lut->key)];
+  key[0]=gb->model;
+  key[1]=sb_gbc_enable(gb);
+  key[2]=sb_read8_io(gb, SB_IO_PPU_BGP);
+  key[3]=sb_read8_io(gb, SB_IO_PPU_OBP0);
+  key[4]=sb_read8_io(gb, SB_IO_PPU_OBP1);
+  memcpy(key+5,gb->dmg_palette,sizeof(gb->dmg_palette));
+  memcpy(key+5+sizeof(gb->dmg_palette),gb->lcd.color_palettes,sizeof(gb->lcd.color_palettes));
+  if(lut->valid&&memcmp(key,lut->key,sizeof(key))==0)return lut;
+  for(int i=0;i<64;++i){
+    int r=0,g=0,b=0;
+    sb_lookup_palette_color(gb,i,&r,&g,&b);
+    lut->rgb[i][0]=r; lut->rgb[i][1]=g; lut->rgb[i][2]=b;
+  }
+  memcpy(lut->key,key,sizeof(key));
+  lut->valid = true;
+  return lut;
+}
+// Spreads the bits of a bitplane byte over the bytes of a word, byte i gets bit 7-i (or bit i when flipped)
+static FORCE_INLINE uint64_t sb_spread_tile_bits(uint8_t b, bool flip){
+  if(flip){
+    uint64_t x = (b*0x0101010101010101ull)&0x8040201008040201ull;
+    return ((x+0x7f7f7f7f7f7f7f7full)>>7)&0x0101010101010101ull;
+  }
+  return ((b*0x8040201008040201ull)>>7)&0x0101010101010101ull;
+}
+// Deinterleaves the two bitplanes of a tile row into 8 color ids, one per byte with the leftmost pixel in byte 0
+static FORCE_INLINE uint64_t sb_decode_tile_row(uint8_t data1, uint8_t data2, bool h_flip){
+  return sb_spread_tile_bits(data1,h_flip)|(sb_spread_tile_bits(data2,h_flip)<<1);
+}
+// Same as sb_lookup_tile for a whole tile row, returns the color ids and puts the palette/priority bits in attr_bits
+static FORCE_INLINE uint64_t sb_fetch_tile_row(sb_gb_t* gb, int px, int py, int tile_base, int data_mode, uint32_t* attr_bits, bool gbc_mode){
+  int tile_offset = (((px&0xff)/8)+((py&0xff)/8)*32)&0x3ff;
+  int tile_id = sb_read_vram(gb, tile_base+tile_offset,0);
+  int pixel_in_tile_y = (py%8);
+  int tile_d_vram_bank = 0;
+  bool h_flip = false;
+  *attr_bits = SB_BACKG_PALETTE<<2;
+  if(gbc_mode){
+    uint8_t attr = sb_read_vram(gb, tile_base+tile_offset,1);
+    if(SB_BFE(attr,6,1))pixel_in_tile_y = 7-pixel_in_tile_y;
+    h_flip = SB_BFE(attr,5,1);
+    tile_d_vram_bank = SB_BFE(attr,3,1);
+    *attr_bits = (SB_BFE(attr,0,3)<<2)|(SB_BFE(attr,7,1)<<8);
+  }
+  int byte_tile_data_off = data_mode==0? 0x8000 + 0x1000 + ((int)((int8_t)(tile_id)))*16
+                                       : 0x8000 + ((int)((uint8_t)(tile_id)))*16;
+  byte_tile_data_off+=pixel_in_tile_y*2;
+  return sb_decode_tile_row(sb_read_vram(gb, byte_tile_data_off,tile_d_vram_bank),
+                            sb_read_vram(gb, byte_tile_data_off+1,tile_d_vram_bank),h_flip);
+}
+// Draws pixels [x0,x1) of line y, the registers are constant over the span since writes to them catch up first.
+// Always inlined with a constant gbc_mode so the DMG and GBC variants below have no mode checks in the pixel loop
+static FORCE_INLINE void sb_draw_scanline_span_impl(sb_gb_t* gb, int y, int x0, int x1, bool gbc_mode){
   uint8_t ctrl = sb_read8_io(gb, SB_IO_LCD_CTRL);
   bool draw_bg_win     = SB_BFE(ctrl,0,1)==1;
   bool master_priority = true;
-  bool gbc_mode = sb_gbc_enable(gb);
   if(gbc_mode){
     // This bit has a different meaning in GBC mode
     master_priority = draw_bg_win;
@@ -1085,93 +1240,130 @@ void sb_draw_pixel(sb_emu_state_t*emu,sb_gb_t* gb, int x, int y){
   bool sprite8x16  = SB_BFE(ctrl,2,1)==1;
   int bg_tile_map_base      = SB_BFE(ctrl,3,1)==1 ? 0x9c00 : 0x9800;
   int bg_win_tile_data_mode = SB_BFE(ctrl,4,1)==1;
-  bool window_enable        = SB_BFE(ctrl,5,1)==1;
   int win_tile_map_base     = SB_BFE(ctrl,6,1)==1 ? 0x9c00 : 0x9800;
 
-  int oam_table_offset = 0xfe00;
   int wx = sb_read8_io(gb, SB_IO_LCD_WX)-7;
-  int wy = sb_read8_io(gb, SB_IO_LCD_WY);
   int sx = sb_read8_io(gb, SB_IO_LCD_SX);
   int sy = sb_read8_io(gb, SB_IO_LCD_SY);
 
-  // HW only draws first 10 sprites that touch a scanline
-  const int bytes_per_tile = 2*8;
-  int color_id=0;
-
-  bool background_priority= false;
-  gb->lcd.window_active|= gb->lcd.latched_window_enable&&gb->lcd.wy_eq_ly&&x>=wx;
-  if(draw_bg_win){
-    if(gb->lcd.window_active){
-      int px = x-wx;
+  // Sprite rows are decoded once per span
+  uint64_t sprite_rows[SB_SPRITES_PER_SCANLINE];
+  int sprite_x[SB_SPRITES_PER_SCANLINE], sprite_prior[SB_SPRITES_PER_SCANLINE], sprite_palette[SB_SPRITES_PER_SCANLINE];
+  bool sprite_bg_on_top[SB_SPRITES_PER_SCANLINE];
+  int num_sprites = draw_sprite? gb->lcd.sprite_index: 0;
+  for(int i=0;i<num_sprites;++i){
+    int xc = gb->lcd.render_sprites_data[i][1]-8;
+    int yc = gb->lcd.render_sprites_data[i][0]-16;
+    int y_sprite = y-yc;
+    int tile = gb->lcd.render_sprites_data[i][2];
+    int attr = gb->lcd.render_sprites_data[i][3];
+    int tile_d_vram_bank = 0;
+    int palette = SB_BFE(attr,4,1)!=0?SB_OBJ1_PALETTE:SB_OBJ0_PALETTE;
+    if(gbc_mode){
+      tile_d_vram_bank = SB_BFE(attr, 3,1);
+      palette = SB_BFE(attr, 0,3)+8;
+    }
+    if(sprite8x16)tile &=0xfe;
+    if(SB_BFE(attr,6,1))y_sprite = (sprite8x16? 15 : 7)-y_sprite;
+    int byte_tile_data_off = 0x8000 + (((uint8_t)(tile))*16) + y_sprite*2;
+    sprite_rows[i] = sb_decode_tile_row(sb_read_vram(gb, byte_tile_data_off,tile_d_vram_bank),
+                                        sb_read_vram(gb, byte_tile_data_off+1,tile_d_vram_bank),SB_BFE(attr,5,1));
+    sprite_x[i] = xc;
+    sprite_prior[i] = gbc_mode? 0 : xc;
+    sprite_palette[i] = palette;
+    sprite_bg_on_top[i] = SB_BFE(attr,7,1);
+  }
+  // Every color id the span can produce, the palettes can't change within it
+  const uint8_t (*rgb)[3] = sb_palette_lut(gb)->rgb;
+
+  int row_key = -1;
+  uint64_t row = 0;
+  uint32_t row_attr = 0;
+  for(int x=x0;x<x1;++x){
+    int color_id=0;
+    gb->lcd.window_active|= gb->lcd.latched_window_enable&&gb->lcd.wy_eq_ly&&x>=wx;
+    if(draw_bg_win){
+      int px = -1, py = 0, base = 0, key = 0;
+      if(gb->lcd.window_active){
+        if(x-wx>=0){
+          px = x-wx;
+          py = gb->lcd.curr_window_scanline;
+          base = win_tile_map_base;
+          key = 256;
+        }
+      }else{
+        px = x+ sx;
+        py = y+ sy;
+        base = bg_tile_map_base;
+      }
       if(px>=0){
-        int py = gb->lcd.curr_window_scanline;
-        color_id = sb_lookup_tile(gb,px,py,win_tile_map_base,bg_win_tile_data_mode);
+        key|= (px&0xff)/8;
+        if(key!=row_key){
+          row = sb_fetch_tile_row(gb,px,py,base,bg_win_tile_data_mode,&row_attr,gbc_mode);
+          row_key = key;
+        }
+        color_id = ((row>>((px&7)*8))&0x3)|row_attr;
       }
-    }else{
-      int px = x+ sx;
-      int py = y+ sy;
-      color_id = sb_lookup_tile(gb,px,py,bg_tile_map_base,bg_win_tile_data_mode);
     }
-  }
-  if(draw_sprite){
     int prior_sprite = 256;
-    for(int i=0;i<gb->lcd.sprite_index;++i){
-      int sprite = gb->lcd.render_sprites[i];
-      int xc = gb->lcd.render_sprites_data[i][1]-8;
-
-      int x_sprite = 7-(x-xc);
-      int prior = sb_gbc_enable(gb)?0 : xc;
+    for(int i=0;i<num_sprites;++i){
+      int dx = x-sprite_x[i];
+      int prior = sprite_prior[i];
       //Check if the sprite is hit
-      if(prior_sprite<=prior||x_sprite>=8 || x_sprite<0) continue;
-
-      int yc = gb->lcd.render_sprites_data[i][0]-16;
-      int y_sprite = y-yc;
-
-      int tile = gb->lcd.render_sprites_data[i][2];
-      int attr = gb->lcd.render_sprites_data[i][3];
-      int tile_d_vram_bank = 0;
-      int tile_sprite_palette =0;
-
-      int palette = SB_BFE(attr,4,1)!=0?SB_OBJ1_PALETTE:SB_OBJ0_PALETTE;
-      if(gbc_mode){
-        tile_d_vram_bank = SB_BFE(attr, 3,1);
-        palette = SB_BFE(attr, 0,3)+8;
-      }
-      if(sprite8x16)tile &=0xfe;
-
-      bool x_flip = SB_BFE(attr,5,1);
-      bool y_flip = SB_BFE(attr,6,1);
-      bool bg_win_on_top = SB_BFE(attr,7,1);
-
-      if(x_flip)x_sprite = 7-x_sprite;
-      if(y_flip)y_sprite = (sprite8x16? 15 : 7)-y_sprite;
-
-      int byte_tile_data_off = 0x8000 + (((uint8_t)(tile))*bytes_per_tile);
-      byte_tile_data_off+=y_sprite*2;
-
-      uint8_t data1 = sb_read_vram(gb, byte_tile_data_off,tile_d_vram_bank);
-      uint8_t data2 = sb_read_vram(gb, byte_tile_data_off+1,tile_d_vram_bank);
-
-      int cid = (SB_BFE(data1,x_sprite,1)+SB_BFE(data2,x_sprite,1)*2);
-      if((bg_win_on_top||(SB_BFE(color_id,8,1)))&&master_priority){
+      if(prior_sprite<=prior||dx>=8 || dx<0) continue;
+      int cid = (sprite_rows[i]>>(dx*8))&0x3;
+      int palette = sprite_palette[i];
+      if((sprite_bg_on_top[i]||(SB_BFE(color_id,8,1)))&&master_priority){
         if((color_id&0x3)==0&&cid!=0){color_id = cid | (palette<<2); prior_sprite =prior;}
       }else if(cid!=0){color_id = cid | (palette<<2); prior_sprite=prior;}
     }
+    const uint8_t* c = rgb[SB_BFE(color_id,0,6)];
+    int p =(x+(y)*SB_LCD_W)*4;
+    gb->lcd.framebuffer[p+0] = c[0];
+    gb->lcd.framebuffer[p+1] = c[1];
+    gb->lcd.framebuffer[p+2] = c[2];
   }
-  int r=0,g=0,b=0;
-  sb_lookup_palette_color(gb,color_id,&r,&g,&b);
-
-  float ghost_coef = 0.5;
-  if(gb->model != SB_GB)ghost_coef= 0.2;
-  ghost_coef*=emu->screen_ghosting_strength;
-  int p =(x+(y)*SB_LCD_W)*4;
-  gb->lcd.framebuffer[p+0] = r*(1.0-ghost_coef)+gb->lcd.framebuffer[p+0]*ghost_coef+0.5;
-  gb->lcd.framebuffer[p+1] = g*(1.0-ghost_coef)+gb->lcd.framebuffer[p+1]*ghost_coef+0.5;
-  gb->lcd.framebuffer[p+2] = b*(1.0-ghost_coef)+gb->lcd.framebuffer[p+2]*ghost_coef+0.5;
-
+}
+static void sb_draw_scanline_span_dmg(sb_gb_t* gb, int y, int x0, int x1){sb_draw_scanline_span_impl(gb,y,x0,x1,false);}
+static void sb_draw_scanline_span_gbc(sb_gb_t* gb, int y, int x0, int x1){sb_draw_scanline_span_impl(gb,y,x0,x1,true);}
+// Draws the pixels of the current line that the per dot PPU would have output by now
+static void sb_ppu_catch_up(sb_gb_t* gb){
+  if(!gb->lcd.render_frame||gb->lcd.curr_scanline>=SB_LCD_H)return;
+  // Pixel x is output on dot x+88
+  int x_end = (int)gb->lcd.scanline_cycles-88+1;
+  if(x_end>SB_LCD_W)x_end=SB_LCD_W;
+  if(x_end<=gb->lcd.render_x)return;
+  uint8_t ctrl = sb_read8_io(gb, SB_IO_LCD_CTRL);
+  if(!SB_BFE(ctrl,7,1))return;
+  // Batched stepping may have skipped the dots that would have set this
+  if(gb->lcd.curr_scanline==sb_read8_io(gb, SB_IO_LCD_WY)&&SB_BFE(ctrl,5,1))gb->lcd.wy_eq_ly = true;
+  if(sb_gbc_enable(gb))sb_draw_scanline_span_gbc(gb,gb->lcd.curr_scanline,gb->lcd.render_x,x_end);
+  else sb_draw_scanline_span_dmg(gb,gb->lcd.curr_scanline,gb->lcd.render_x,x_end);
+  gb->lcd.render_x = x_end;
 }
 
+// Number of values v in [lo,hi] with v%period==phase (period is a power of two, lo>=1)
+static FORCE_INLINE uint32_t sb_count_phase_hits(uint32_t lo, uint32_t hi, uint32_t period, uint32_t phase){
+  if(hi<lo)return 0;
+  return (hi-phase+period)/period-(lo-1-phase+period)/period;
+}
+static void sb_tick_tima(sb_gb_t* gb){
+  uint8_t d = sb_read8_io(gb, SB_IO_TIMA);
+  // Trigger timer interrupt
+  if(d == 255){
+    uint8_t i_flag = sb_read8_io(gb, SB_IO_INTER_F);
+    i_flag |= 1<<2;
+    sb_store8_io(gb, SB_IO_INTER_F, i_flag);
+    d = sb_read8_io(gb,SB_IO_TMA);
+  }else d +=1;
+  sb_store8_io(gb, SB_IO_TIMA, d);
+}
+// The divider only counts up, so instead of stepping every clock the TIMA increments (falling
+// edges of the selected divider bit) and frame sequencer steps (rising edges) are counted.
+// Only the first clock compares against the edge state of the last call since TAC or the
+// speed may have changed in between.
 void sb_update_timers(sb_gb_t* gb, int delta_clocks, bool double_speed){
+  if(delta_clocks<=0){sb_store8_io(gb, SB_IO_DIV, SB_BFE(gb->timers.total_clock_ticks,8,8));return;}
   uint8_t tac = sb_read8_io(gb, SB_IO_TAC);
   bool tima_enable = SB_BFE(tac, 2, 1);
   int clk_sel = SB_BFE(tac, 0, 2);
@@ -1184,29 +1376,22 @@ void sb_update_timers(sb_gb_t* gb, int delta_clocks, bool double_speed){
     case 3: tma_bit = 7;break; //16Khz
   }
   int seq_bit = double_speed?13:12;
-  for(int i=0;i<delta_clocks;++i){
-    uint16_t curr = gb->timers.total_clock_ticks;
-    uint16_t next = curr+1;
-    gb->timers.total_clock_ticks=next;
-    bool tick_tima = SB_BFE(curr,tma_bit,1)&tima_enable;
-    bool tick_seq = SB_BFE(curr,seq_bit,1);
-    if(tick_tima==false&&gb->timers.last_tick_tima==true){
-      uint8_t d = sb_read8_io(gb, SB_IO_TIMA);
-      // Trigger timer interrupt
-      if(d == 255){
-        uint8_t i_flag = sb_read8_io(gb, SB_IO_INTER_F);
-        i_flag |= 1<<2;
-        sb_store8_io(gb, SB_IO_INTER_F, i_flag);
-        d = sb_read8_io(gb,SB_IO_TMA);
-      }else d +=1;
-      sb_store8_io(gb, SB_IO_TIMA, d);
-    }
-    if(tick_seq&&!gb->timers.last_tick_seq){
-      sb_tick_frame_seq(gb,&gb->audio.sequencer);
-    }
-    gb->timers.last_tick_seq = tick_seq;
-    gb->timers.last_tick_tima = tick_tima;
-  }
+  uint32_t start = gb->timers.total_clock_ticks;
+  bool tick_tima = SB_BFE(start,tma_bit,1)&tima_enable;
+  bool tick_seq = SB_BFE(start,seq_bit,1);
+  uint32_t tima_ticks = tick_tima==false&&gb->timers.last_tick_tima==true;
+  uint32_t seq_ticks = tick_seq&&!gb->timers.last_tick_seq;
+
+  // Clocks 1 to delta_clocks-1 see the divider values start+1 to last
+  uint32_t last = start+delta_clocks-1;
+  if(tima_enable)tima_ticks+=sb_count_phase_hits(start+1,last,2u<<tma_bit,0);
+  seq_ticks+=sb_count_phase_hits(start+1,last,2u<<seq_bit,1u<<seq_bit);
+
+  for(uint32_t i=0;i<tima_ticks;++i)sb_tick_tima(gb);
+  for(uint32_t i=0;i<seq_ticks;++i)sb_tick_frame_seq(gb,&gb->audio.sequencer);
+  gb->timers.total_clock_ticks=(start+delta_clocks)&0xffff;
+  gb->timers.last_tick_tima = SB_BFE(last,tma_bit,1)&tima_enable;
+  gb->timers.last_tick_seq = SB_BFE(last,seq_bit,1);
   sb_store8_io(gb, SB_IO_DIV, SB_BFE(gb->timers.total_clock_ticks,8,8));
 }
 int sb_update_dma(sb_gb_t *gb){
@@ -1227,8 +1412,19 @@ int sb_update_dma(sb_gb_t *gb){
     bool hdma_mode = gb->dma.hdma;
     if(!hdma_mode||(gb->dma.in_hblank==false&&gb->lcd.in_hblank==true&&gb->lcd.curr_scanline<SB_LCD_H-1))
     {
+      uint8_t vbank = sb_read8_io(gb,SB_IO_GBC_VBK)%SB_VRAM_NUM_BANKS;
       while(len>=0){
-        for(int i=0;i<16;++i){
+        int32_t src_off = dma_src<0xff00? gb->mem.read_page[dma_src>>8]: -1;
+        if(src_off>=0&&dma_dst<0xa000){
+          // Blocks are 16 byte aligned so they never cross a page, copy them straight between the banks
+          const uint8_t* src = (dma_src<0x8000? gb->cart.data: (uint8_t*)gb)+src_off+(dma_src&0xff);
+          sb_ppu_catch_up(gb);
+          memcpy(gb->lcd.vram+vbank*SB_VRAM_BANK_SIZE+dma_dst-0x8000,src,16);
+          gb->dma.bytes_transferred+=16;
+          dma_src+=16;
+          dma_dst+=16;
+          bytes_transferred+=16;
+        }else for(int i=0;i<16;++i){
           int off = gb->dma.bytes_transferred++;
           if(dma_src>0xffff){len=0;break;}
           uint8_t data = sb_read8(gb,dma_src);
@@ -1258,6 +1454,7 @@ int sb_update_dma(sb_gb_t *gb){
     }
     gb->dma.in_hblank = gb->lcd.in_hblank;
     delta_cycles+= bytes_transferred/2;
+    SB_PERF_COUNT(&gb->perf,SB_COUNTER_DMA_BYTES,bytes_transferred);
   }
   return delta_cycles;
 }
@@ -1271,29 +1468,46 @@ void sb_update_oam_dma(sb_gb_t* gb, int delta_cycles){
   // region as echo ram for dma source
   if(dma_src==0xfe00)dma_src=0xde00;
   else if(dma_src==0xff00)dma_src=0xdf00;
-  for(int i=0;i<delta_cycles;i++){
-    if(gb->dma.oam_dma_activate_fifo){
-      if(gb->dma.oam_dma_activate_fifo&1){
-        gb->dma.oam_dma_active=true;
-        gb->dma.oam_bytes_transferred=0; 
-      }
-      gb->dma.oam_dma_activate_fifo>>=1;
+  // The activation delay is stepped a cycle at a time, one byte is copied per cycle after it
+  int i=0;
+  for(;i<delta_cycles&&gb->dma.oam_dma_activate_fifo;i++){
+    if(gb->dma.oam_dma_activate_fifo&1){
+      gb->dma.oam_dma_active=true;
+      gb->dma.oam_bytes_transferred=0; 
     }
+    gb->dma.oam_dma_activate_fifo>>=1;
     if(gb->dma.oam_dma_active){
       if(gb->dma.oam_bytes_transferred<0xA0){
         uint8_t data = sb_read8_direct(gb,dma_src+gb->dma.oam_bytes_transferred);
         sb_store8_direct(gb,dma_dst+gb->dma.oam_bytes_transferred,data);
         gb->dma.oam_bytes_transferred++;
+        SB_PERF_COUNT(&gb->perf,SB_COUNTER_DMA_BYTES,1);
       }
       if(gb->dma.oam_bytes_transferred>=0xA0)gb->dma.oam_dma_active=false;
     }
   }
+  if(i<delta_cycles&&gb->dma.oam_dma_active){
+    int transferred = gb->dma.oam_bytes_transferred;
+    int bytes = delta_cycles-i;
+    if(bytes>0xA0-transferred)bytes = 0xA0-transferred;
+    // The source is page aligned so the whole transfer comes from one page
+    int32_t src_off = gb->mem.read_page[dma_src>>8];
+    if(src_off>=0){
+      const uint8_t* src = (dma_src<0x8000? gb->cart.data: (uint8_t*)gb)+src_off+transferred;
+      memcpy(gb->mem.data+dma_dst+transferred,src,bytes);
+    }else{
+      for(int b=0;b<bytes;++b)sb_store8_direct(gb,dma_dst+transferred+b,sb_read8_direct(gb,dma_src+transferred+b));
+    }
+    gb->dma.oam_bytes_transferred+=bytes;
+    SB_PERF_COUNT(&gb->perf,SB_COUNTER_DMA_BYTES,bytes);
+    if(gb->dma.oam_bytes_transferred>=0xA0)gb->dma.oam_dma_active=false;
+  }
 
 }
-static FORCE_INLINE void sb_tick_sio(sb_gb_t* gb, int delta_cycles){
-  //Just a stub for now;
+static FORCE_INLINE void sb_tick_sio(sb_emu_state_t* emu, sb_gb_t* gb, int delta_cycles){
   uint8_t siocnt= sb_read8_io(gb,SB_IO_SERIAL_CTRL);
   bool active = SB_BFE(siocnt,7,1);
+  sb_link_port_t* port = emu->link? emu->link->port+emu->link_port: NULL;
   if(active){
     if(gb->serial.last_active==false){
       gb->serial.last_active =true;
@@ -1303,29 +1517,86 @@ static FORCE_INLINE void sb_tick_sio(sb_gb_t* gb, int delta_cycles){
     }
     bool internal_clock = SB_BFE(siocnt,0,1);
     if(internal_clock)gb->serial.ticks_to_complete-=delta_cycles;
-    if(gb->serial.ticks_to_complete<=0){
+    bool complete = false;
+    uint8_t data = 0xff;
+    if(port){
+      port->send = sb_read8_io(gb,SB_IO_SERIAL_BYTE);
+      // The slave waits for the master's clock however long it takes
+      if(!internal_clock)port->ready = true;
+      else if(gb->serial.ticks_to_complete<=0&&!port->done){
+        bool first_try = !port->ready;
+        port->ready = true;
+        if(sb_link_try_transfer(emu->link,emu->link_port,SB_LINK_NORMAL)||first_try)emu->link_yield = true;
+      }
+      if(port->done){
+        port->done = false;
+        complete = true;
+        data = port->recv;
+      }
+    }else complete = gb->serial.ticks_to_complete<=0;
+    if(complete){
       siocnt&=0x7f;
       sb_store8_io(gb,SB_IO_SERIAL_CTRL,siocnt);
-      sb_store8_io(gb,SB_IO_SERIAL_BYTE,0xff);
+      sb_store8_io(gb,SB_IO_SERIAL_BYTE,data);
       uint8_t i_flag = sb_read8_io(gb,SB_IO_INTER_F);
       i_flag |= (1<<3);
       sb_store8_io(gb,SB_IO_INTER_F,i_flag);
       active =false;
     }
-  }
+  }else if(port)port->ready = false;
   gb->serial.last_active =active; 
 }
+// Returns how many dots after the last one only advance scanline_cycles in sb_update_lcd, 
+// i.e. no mode, line, interrupt or rendering work is due. 
+static FORCE_INLINE int sb_lcd_quiet_dots(sb_gb_t* gb){
+  uint8_t ctrl = sb_read8_io(gb, SB_IO_LCD_CTRL);
+  // A disabled LCD stores the same state every dot
+  if(!SB_BFE(ctrl,7,1))return INT32_MAX;
+  const int mode2_clks= 80;
+  const int mode3_clks = SB_LCD_W;
+  const int scanline_dots = 456;
+  // Pixels are drawn up to 8 dots into mode 0, the line is flushed on its last pixel
+  const int render_end = mode2_clks+mode3_clks+8;
+  int c = gb->lcd.scanline_cycles;
+  bool rendering = gb->lcd.render_frame&&gb->lcd.curr_scanline<SB_LCD_H;
+  int next_boundary = scanline_dots;
+  // LY reads as 0 from the 4th dot of line 153
+  if(c<4)next_boundary=4;
+  else if(rendering&&c<mode2_clks-1)next_boundary=mode2_clks-1;
+  else if(c<mode2_clks)next_boundary=mode2_clks;
+  else if(c<mode2_clks+mode3_clks)next_boundary=mode2_clks+mode3_clks;
+  else if(rendering&&c<render_end-1)next_boundary=render_end-1;
+  else if(c<render_end)next_boundary=render_end;
+  int dots = next_boundary-1-c;
+  return dots<0?0:dots;
+}
+static FORCE_INLINE void sb_update_lcd_batched(sb_emu_state_t*emu,sb_gb_t* gb, int cycles){
+  while(cycles>0){
+    sb_update_lcd(emu,gb);
+    --cycles;
+    int skip = sb_lcd_quiet_dots(gb);
+    if(skip>cycles)skip=cycles;
+    if(SB_BFE(sb_read8_io(gb, SB_IO_LCD_CTRL),7,1))gb->lcd.scanline_cycles+=skip;
+    cycles-=skip;
+  }
+}
 void sb_tick_components(sb_emu_state_t* emu, sb_gb_t* gb, int cycles){
   unsigned speed = sb_read8_io(gb,SB_IO_GBC_SPEED_SWITCH);
   bool double_speed = SB_BFE(speed, 7, 1)&&sb_gbc_enable(gb);
   sb_update_oam_dma(gb,(double_speed?2:1)*cycles);
-  for(int i=0;i<cycles;++i){
-    sb_update_lcd(emu,gb);
+  SB_PROFILE_BEGIN(emu,SB_PROFILE_PPU,4);
+  if(emu->cpu_batch_exec)sb_update_lcd_batched(emu,gb,cycles);
+  else{
+    for(int i=0;i<cycles;++i){
+      sb_update_lcd(emu,gb);
+    }
   }
+  SB_PROFILE_END(emu,SB_PROFILE_PPU,4);
   sb_update_timers(gb,(double_speed?2:1)*cycles, double_speed);
-  sb_tick_sio(gb,cycles);
-  double delta_t = ((double)cycles)/(4*1024*1024);
-  sb_process_audio(gb,emu,delta_t,cycles);
+  sb_tick_sio(emu,gb,cycles);
+  SB_PROFILE_BEGIN(emu,SB_PROFILE_AUDIO,4);
+  sb_process_audio(gb,emu,cycles);
+  SB_PROFILE_END(emu,SB_PROFILE_AUDIO,4);
 }
 void gb_tick_rtc(sb_gb_t*gb){
   time_t time_secs= time(NULL);
@@ -1340,10 +1611,13 @@ void sb_ptrs_init(sb_gb_t* gb, gb_scratch_t* scratch, uint8_t* rom_data) {
   gb->lcd.framebuffer = scratch->framebuffer; 
   gb->cart.data = rom_data; 
   gb->bios = scratch->bios;
+  gb->palette_lut = &scratch->palette_lut;
 }
 
 void sb_tick(sb_emu_state_t* emu, sb_gb_t* gb,gb_scratch_t* scratch){
   sb_ptrs_init(gb, scratch, emu->rom_data);
+  // Cheap enough to redo every frame and covers states written by older builds
+  sb_update_page_table(gb);
   int instructions_to_execute = emu->step_instructions;
   if(instructions_to_execute==0)instructions_to_execute=70224/2;
   int frames_to_draw = 1;
@@ -1353,18 +1627,29 @@ void sb_tick(sb_emu_state_t* emu, sb_gb_t* gb,gb_scratch_t* scratch){
   gb->lcd.finished_frame =false;
   gb->lcd.render_frame = emu->render_frame;
   gb_tick_rtc(gb);
+  // In batched mode the joypad, speed switch and GBC mode state only change on register writes
+  bool batched = emu->cpu_batch_exec;
+  gb->mem.cpu_io_dirty = true;
+  unsigned speed = 0;
+  bool gbc_mode = false;
   for(int i=0;i<instructions_to_execute;++i){
     bool double_speed = false;
-    sb_update_joypad_io_reg(emu, gb);
+    if(!batched||gb->mem.cpu_io_dirty){
+      sb_update_joypad_io_reg(emu, gb);
+      speed = sb_read8_io(gb,SB_IO_GBC_SPEED_SWITCH);
+      gbc_mode = sb_gbc_enable(gb);
+      gb->mem.cpu_io_dirty = false;
+    }
+    SB_PROFILE_BEGIN(emu,SB_PROFILE_DMA,4);
     int dma_delta_cycles = sb_update_dma(gb);
+    SB_PROFILE_END(emu,SB_PROFILE_DMA,4);
     int cpu_delta_cycles = 0;
     if(dma_delta_cycles==0){
       cpu_delta_cycles=4;
       int pc = gb->cpu.pc;
       unsigned op = sb_read8(gb,gb->cpu.pc);
       bool request_speed_switch= false;
-      if(sb_gbc_enable(gb)){
-        unsigned speed = sb_read8_io(gb,SB_IO_GBC_SPEED_SWITCH);
+      if(gbc_mode){
         double_speed = SB_BFE(speed, 7, 1);
         request_speed_switch = SB_BFE(speed, 0, 1);
       }
@@ -1409,12 +1694,9 @@ void sb_tick(sb_emu_state_t* emu, sb_gb_t* gb,gb_scratch_t* scratch){
         gb->cpu.pc+=inst.length;
         if(gb->cpu.halt_bug)gb->cpu.pc--;
         gb->cpu.halt_bug = false;
-        int operand1 = sb_load_operand(gb,inst.op_src1);
-        int operand2 = sb_load_operand(gb,inst.op_src2);
-
-        unsigned pc_before_inst = gb->cpu.pc;
         gb->cpu.prefix_op = false;
-        inst.impl(gb, operand1, operand2,inst.op_src1,inst.op_src2, inst.flag_mask);
+        sb_execute_instr(gb,op);
+        SB_PERF_COUNT(&gb->perf,SB_COUNTER_INSTRUCTIONS,1);
         if(gb->cpu.prefix_op==true)i--;
 
         if(gb->cpu.wait_for_interrupt){
@@ -1431,6 +1713,7 @@ void sb_tick(sb_emu_state_t* emu, sb_gb_t* gb,gb_scratch_t* scratch){
       }else if(call_interrupt==false&&gb->cpu.wait_for_interrupt==true && request_speed_switch){
         gb->cpu.wait_for_interrupt = false;
         sb_store8_io(gb,SB_IO_GBC_SPEED_SWITCH,double_speed? 0x00: 0x80);
+        gb->mem.cpu_io_dirty = true;
         cpu_delta_cycles=0;
       }
       if(trigger_interrupt!=-1)gb->cpu.wait_for_interrupt=false;
@@ -1458,9 +1741,11 @@ void sb_tick(sb_emu_state_t* emu, sb_gb_t* gb,gb_scratch_t* scratch){
     }
     if(gb->lcd.finished_frame){break;}
     if(total_cylces>=70224&&emu->step_instructions==0)break;
+    if(SB_UNLIKELY(emu->link_yield))break;
     emu->step_instructions=0;
   }
-  emu->joy.rumble = (double)rumble_cycles/(double)total_cylces;
+  if(total_cylces)emu->joy.rumble = (double)rumble_cycles/(double)total_cylces;
+  sb_profile_collect(&emu->profile,&gb->perf);
 }
 float compute_vol_env_slope(uint8_t d){
   int dir = SB_BFE(d,3,1);
@@ -1573,7 +1858,8 @@ static bool sb_load_rom(sb_emu_state_t* emu,sb_gb_t* gb, gb_scratch_t* scratch){
   }
   gb->cart.mapped_rom_bank=1;
   size_t bytes =0;
-  uint8_t*data = sb_load_file_data(emu->save_file_path, &bytes);
+  // An empty path keeps the save in memory only (headless library, benchmarks)
+  uint8_t*data = emu->save_file_path[0]? sb_load_file_data(emu->save_file_path, &bytes): NULL;
   if(data){
     if(bytes!=gb->cart.ram_size){
       printf("Warning save file size(%zu) doesn't match size expected(%d) for the cartridge type", bytes, gb->cart.ram_size);
@@ -1584,28 +1870,28 @@ static bool sb_load_rom(sb_emu_state_t* emu,sb_gb_t* gb, gb_scratch_t* scratch){
     memcpy(gb->cart.ram_data, data, bytes);
     sb_free_file_data(data);
   }else{
-    printf("Could not find save file: %s\n",emu->save_file_path);
+    if(emu->save_file_path[0])printf("Could not find save file: %s\n",emu->save_file_path);
     memset(gb->cart.ram_data,0,MAX_CARTRIDGE_RAM);
   }
   bool loaded_bios = false; 
   if(gb->model==SB_GB){
     if(!emu->force_dmg_mode){
-      if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "cgb_boot.bin", scratch->bios,2304);
-      if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "gbc_bios.bin", scratch->bios,2304);
-      if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "cgb0_boot.bin", scratch->bios,2304);
-      if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "cgb_agb_boot.bin", scratch->bios,2304);
+      if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "cgb_boot.bin", scratch->bios,2304);
+      if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "gbc_bios.bin", scratch->bios,2304);
+      if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "cgb0_boot.bin", scratch->bios,2304);
+      if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "cgb_agb_boot.bin", scratch->bios,2304);
       if(loaded_bios){
         gb->model=SB_GBC;
       }
     }
-    if(!loaded_bios) loaded_bios= se_load_bios_file("DMG BOOT", emu->save_file_path, "dmg_rom.bin", scratch->bios,256);
-    if(!loaded_bios) loaded_bios= se_load_bios_file("DMG BOOT", emu->save_file_path, "dmg0_rom.bin", scratch->bios,256);
-    if(!loaded_bios) loaded_bios= se_load_bios_file("DMG BOOT", emu->save_file_path, "gb_bios.bin", scratch->bios,256);
+    if(!loaded_bios) loaded_bios= sb_load_bios_file(emu,"DMG BOOT", emu->save_file_path, "dmg_rom.bin", scratch->bios,256);
+    if(!loaded_bios) loaded_bios= sb_load_bios_file(emu,"DMG BOOT", emu->save_file_path, "dmg0_rom.bin", scratch->bios,256);
+    if(!loaded_bios) loaded_bios= sb_load_bios_file(emu,"DMG BOOT", emu->save_file_path, "gb_bios.bin", scratch->bios,256);
   }else if(gb->model==SB_GBC){
-    if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "cgb_boot.bin", scratch->bios,2304);
-    if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "gbc_bios.bin", scratch->bios,2304);
-    if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "cgb0_boot.bin", scratch->bios,2304);
-    if(!loaded_bios)loaded_bios= se_load_bios_file("GBC BOOT", emu->save_file_path, "cgb_agb_boot.bin", scratch->bios,2304);
+    if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "cgb_boot.bin", scratch->bios,2304);
+    if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "gbc_bios.bin", scratch->bios,2304);
+    if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "cgb0_boot.bin", scratch->bios,2304);
+    if(!loaded_bios)loaded_bios= sb_load_bios_file(emu,"GBC BOOT", emu->save_file_path, "cgb_agb_boot.bin", scratch->bios,2304);
   }
   if(loaded_bios){
     gb->cpu.pc = 0; 
@@ -1658,6 +1944,7 @@ static bool sb_load_rom(sb_emu_state_t* emu,sb_gb_t* gb, gb_scratch_t* scratch){
     gb->mem.data[0xFF4B] = 0x00; // WX
     gb->mem.data[0xFFFF] = 0x00; // IE
   }
+  sb_update_page_table(gb);
   
   return true; 
 }
@@ -1864,11 +2151,17 @@ static bool sb_run_ar_cheat(sb_gb_t* gb, const uint32_t* buffer, uint32_t size){
 
   return true;
 }
-static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, double delta_time, int cycles){
-
+// Advances the wave channel and the simulated time over the pending cycles. Nothing else depends 
+// on time between samples, so this is all register writes and wave RAM reads need.
+static FORCE_INLINE void sb_audio_catch_up(sb_gb_t *gb){
   sb_audio_t* audio = &gb->audio;
   sb_frame_sequencer_t* seq = &audio->sequencer;
+  int cycles = audio->pending_cycles;
+  if(!cycles)return;
+  audio->pending_cycles = 0;
+  audio->sample_due_cycles = audio->sample_due_cycles>cycles? audio->sample_due_cycles-cycles: 0;
 
+  double delta_time = ((double)cycles)/(4*1024*1024);
   if(delta_time>1.0/60.)delta_time = 1.0/60.;
   audio->current_sim_time +=delta_time;
   #ifdef GBA_AUDIO
@@ -1892,11 +2185,37 @@ static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, doubl
     audio->curr_wave_sample = ((dat>>offset)&0xf);
   }
   audio->wave_freq_timer=freq_tim;
+}
+// Cycles until the simulated time reaches the next sample
+static uint32_t sb_audio_cycles_to_next_sample(sb_audio_t* audio){
+  double dt = audio->current_sample_generated_time-audio->current_sim_time;
+  return dt>0? (uint32_t)(dt*(4*1024*1024))+1: 0;
+}
+// The APU is only run when a sample is due, the cycles in between are accumulated and applied in 
+// one step by sb_audio_catch_up (or earlier when the registers are accessed)
+static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, int cycles){
+  sb_audio_t* audio = &gb->audio;
+  sb_frame_sequencer_t* seq = &audio->sequencer;
+  audio->pending_cycles+=cycles;
+  if(audio->pending_cycles<audio->sample_due_cycles)return;
+  sb_audio_catch_up(gb);
 
   audio->current_sample_generated_time -= (int)(audio->current_sim_time);
   audio->current_sim_time -= (int)(audio->current_sim_time);
 
-  if(audio->current_sample_generated_time >audio->current_sim_time)return; 
+  if(audio->current_sample_generated_time >audio->current_sim_time){
+    audio->sample_due_cycles = sb_audio_cycles_to_next_sample(audio);
+    return; 
+  }
+  if(emu->audio_disabled){
+    // Nothing between samples is register visible, so the APU only wakes up for large batches
+    double sample_delta_t = 1.0/SE_AUDIO_SAMPLE_RATE;
+    audio->current_sample_generated_time+=ceil((audio->current_sim_time-audio->current_sample_generated_time)/sample_delta_t)*sample_delta_t;
+    audio->sample_due_cycles = 16384;
+    return;
+  }
+  // Stays at 0 so samples start right away when the APU is enabled again
+  audio->sample_due_cycles = 0;
 
   int nrf_52 = sb_read8_io(gb,SB_IO_SOUND_ON_OFF)&0xf0;
 
@@ -2053,10 +2372,7 @@ static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, doubl
     audio->capacitor_l = (sample_volume_l-out_l)*0.996;
     audio->capacitor_r = (sample_volume_r-out_r)*0.996;
     // Quantization
-    unsigned write_entry0 = (emu->audio_ring_buff.write_ptr++)%SB_AUDIO_RING_BUFFER_SIZE;
-    unsigned write_entry1 = (emu->audio_ring_buff.write_ptr++)%SB_AUDIO_RING_BUFFER_SIZE;
-
-    emu->audio_ring_buff.data[write_entry0] = out_l*32760;
-    emu->audio_ring_buff.data[write_entry1] = out_r*32760;
+    sb_ring_buffer_push_stereo(&emu->audio_ring_buff,out_l*32760,out_r*32760);
   }
+  audio->sample_due_cycles = sb_audio_cycles_to_next_sample(audio);
 }
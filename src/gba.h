@@ -16,6 +16,12 @@
 #define GBA_LCD_H 160
 #define GBA_SWAPCHAIN_SIZE 4 
 #define GBA_AUDIO_DMA_ACTIVATE_THRESHOLD 12
+// Direct Sound FIFO pops that can wait for the mixer, power of 2
+#define GBA_AUDIO_FIFO_LOG_SIZE 64
+// Longest slice handed to the mixer at once, stays below its 1/60s clamp
+#define GBA_AUDIO_MAX_PENDING_TICKS 65536
+// Default SOUNDBIAS mixing rate, resampled to SE_AUDIO_SAMPLE_RATE on output
+#define GBA_AUDIO_SAMPLE_RATE 32768
 
 //////////////////////////////////////////////////////////////////////////////////////////
 // MMIO Register listing from GBATEK (https://problemkaputt.de/gbatek.htm#gbamemorymap) //
@@ -621,27 +627,37 @@ mmio_reg_t gba_io_reg_desc[]={
 #define GBA_REQ_READ  0x40
 #define GBA_REQ_WRITE 0x80
 
+// Direct host pointers for 4KB pages of the 0x00000000-0x0FFFFFFF address space. 
+// NULL pages (BIOS, MMIO, palette, OAM, the bitmap mode VRAM mirror, backup and partial ROM pages) 
+// take the slow path in gba_dword_lookup. ROM pages are tagged so writes to them also take it. 
+#define GBA_PAGE_SHIFT 12
+#define GBA_PAGE_SIZE (1<<GBA_PAGE_SHIFT)
+#define GBA_NUM_PAGES (0x10000000>>GBA_PAGE_SHIFT)
+#define GBA_PAGE_ROM 1
+typedef struct{
+  uint8_t* pages[GBA_NUM_PAGES];
+  // Inputs the table was generated from, it is rebuilt when any of them change
+  void* gba;
+  uint8_t* cart_rom;
+  uint32_t rom_size;
+}gba_page_table_t;
+
 typedef struct {     
+  // Small state used by every access comes before the memory arrays
+  gba_page_table_t *page_table;
   uint8_t *bios;
-  uint8_t wram0[256*1024];
-  uint8_t wram1[32*1024];
-  uint8_t io[1024];
-  uint8_t palette[1024];
-  uint8_t vram[128*1024];
-  uint8_t oam[1024];
   uint8_t *cart_rom;
-  uint8_t cart_backup[128*1024];
-  uint8_t flash_chip_id[4];
   uint32_t openbus_word;
   uint32_t eeprom_word; 
   uint32_t eeprom_addr; 
+  // rtc.total_clocks_ticked value at which a programmed EEPROM block reports ready again
+  uint64_t eeprom_ready_clock;
   uint32_t prefetch_en; 
   uint32_t prefetch_size; 
   uint32_t requests;
   uint32_t bios_word;
   uint32_t sram_word;
   uint32_t mmio_word;
-  uint8_t wait_state_table[16*4];
   // Tracks the place of the squashable pipeline bubble that enters the pipeline after a single cycle data read
   // Each bit represents one clock cycle in time with bit 0 meaning the current cycle of the last stage of the 
   // CPU pipeline and larger bits indicating future cycles. 
@@ -650,9 +666,26 @@ typedef struct {
   // Some complexity is introduced because this bubble may be squashed by upstream push back. This is modelled by 
   // extra shift rights for the multicycling of the various stages. 
   uint32_t pipeline_bubble_shift_register;
+  // Bumped by stores and timer reads so the idle loop detector can tell if a loop has side effects
+  uint32_t idle_loop_side_effects;
+  sb_late_input_t* late_input;
+  sb_sprite_bins_t *sprite_bins;
+  // Only set while gba_tick runs and a frame dump is captured
+  sb_video_capture_t* video_capture;
+  uint8_t flash_chip_id[4];
+  uint8_t wait_state_table[16*4];
   // Lookup tables to accelerate MMIO masking / Open bus behavior
   uint32_t mmio_data_mask_lookup[256];
   uint8_t  mmio_reg_valid_lookup[256];
+  // gba_mmio_write_handler_t for each register, GBA_MMIO_WRITE_PLAIN ones are stored without dispatch
+  uint8_t  mmio_write_handler_lookup[256];
+  uint8_t wram0[256*1024];
+  uint8_t wram1[32*1024];
+  uint8_t io[1024];
+  uint8_t palette[1024];
+  uint8_t vram[128*1024];
+  uint8_t oam[1024];
+  uint8_t cart_backup[128*1024];
   uint8_t mmio_debug_access_buffer[16*1024];
 } gba_mem_t;
 
@@ -693,8 +726,12 @@ typedef struct{
   }aff[2];
   uint16_t dispcnt_pipeline[3];
   int fast_forward_ticks;
-  float ghosting_strength;
   uint32_t mosaic_y_counter;
+  // Visible pixels are composited lazily, either when the line reaches HBlank or when a store
+  // that could affect them (IO, palette, VRAM, OAM) happens mid line. 
+  bool line_render_pending;
+  int line_render_x; 
+  int line_render_y; 
 }gba_ppu_t;
 typedef struct{
   bool last_enable; 
@@ -740,6 +777,20 @@ typedef struct{
   float capacitor_l,capacitor_r;
   gba_frame_sequencer_t sequencer;
   uint32_t audio_clock; 
+  sb_resampler_t resampler;
+  // FIFO heads as heard by the mixer. Pops are stamped with the audio clock and only reach
+  // the mixer when it generates the samples after them, so it can run in slices.
+  int8_t fifo_output[2];
+  struct{
+    uint32_t clock[GBA_AUDIO_FIFO_LOG_SIZE];
+    int8_t value[GBA_AUDIO_FIFO_LOG_SIZE];
+    uint8_t read_ptr;
+    uint8_t write_ptr;
+  }fifo_log[2];
+  // Cycles not mixed yet, flushed once a sample is due or before anything can observe the audio state
+  uint32_t pending_ticks;
+  uint32_t ticks_to_next_sample;
+  sb_emu_state_t* emu; // Only set while gba_tick runs
 }gba_audio_t; 
 typedef struct{
   uint32_t serial_state;
@@ -796,39 +847,62 @@ typedef struct{
   uint8_t last_clk;
 }gba_solar_sensor_t;
 typedef struct gba_t{
-  gba_mem_t mem;
+  // Scheduling state touched on every tick, padded out to a cache line so the CPU follows it
+  // and the large memories only start after the per instruction working set
+  union{
+    struct{
+      uint32_t timer_ticks_before_event;
+      uint32_t deferred_timer_ticks;
+      uint32_t global_timer;
+      int active_if_pipe_stages; 
+      int last_cpu_tick;
+      int residual_dma_ticks; 
+      // Some HW has up to a 4 cycle delay before its IF propagates. 
+      // This array acts as a FIFO to keep track of that. 
+      uint16_t pipelined_if[5];
+      //There is a 2 cycle penalty when the CPU takes over from the DMA
+      bool last_transaction_dma; 
+      bool activate_dmas; 
+      bool dma_wait_ppu;
+      bool prev_key_interrupt;
+      bool stop_mode; 
+      bool frame_in_progress;
+      bool pause_after_frame; 
+    };
+    uint8_t hot_padding[SB_CACHE_LINE_SIZE];
+  };
   arm7_t cpu;
+  gba_timer_t timers[4];
+  gba_dma_t dma[4]; 
+  uint8_t *framebuffer;
+  gba_audio_t audio;
   gba_cartridge_t cart;
-  gba_ppu_t ppu;
   gba_rtc_t rtc;
-  gba_dma_t dma[4]; 
   gba_sio_t sio; 
-  gba_bess_info_t bess;
-  //There is a 2 cycle penalty when the CPU takes over from the DMA
-  bool last_transaction_dma; 
-  bool activate_dmas; 
-  bool dma_wait_ppu;
-  gba_timer_t timers[4];
-  uint32_t timer_ticks_before_event;
-  uint32_t deferred_timer_ticks;
-  uint32_t global_timer;
-  gba_audio_t audio;
-  bool prev_key_interrupt;
+  gba_solar_sensor_t solar_sensor;
+  // Large memories and the video state
+  gba_mem_t mem;
+  gba_ppu_t ppu;
   uint32_t first_target_buffer[GBA_LCD_W];
   uint32_t second_target_buffer[GBA_LCD_W];
   uint8_t window[GBA_LCD_W];
-  uint8_t *framebuffer;
-  // Some HW has up to a 4 cycle delay before its IF propagates. 
-  // This array acts as a FIFO to keep track of that. 
-  uint16_t pipelined_if[5];
-  int active_if_pipe_stages; 
-  int last_cpu_tick;
-  int residual_dma_ticks; 
-  bool stop_mode; 
-  bool frame_in_progress;
-  bool pause_after_frame; 
-  gba_solar_sensor_t solar_sensor;
+  sb_window_spans_t window_spans;
+  gba_bess_info_t bess;
+  sb_perf_counters_t perf;
 } gba_t; 
+_Static_assert(sizeof(((gba_t*)0)->hot_padding)>=offsetof(gba_t,pause_after_frame)+sizeof(bool), "gba_t scheduling state outgrew its cache line");
+// Rewind granularity of gba_t, sorted by offset
+static inline const sb_rewind_region_t* gba_rewind_regions(int* num_regions){
+  static const sb_rewind_region_t regions[]={
+    {0,offsetof(gba_t,mem.wram0),32},
+    SB_REWIND_REGION(gba_t,mem.io,32),
+    SB_REWIND_REGION(gba_t,mem.vram,128),
+    SB_REWIND_REGION(gba_t,mem.mmio_debug_access_buffer,SB_REWIND_SKIP),
+    SB_REWIND_REGION(gba_t,perf,SB_REWIND_SKIP),
+  };
+  *num_regions = sizeof(regions)/sizeof(regions[0]);
+  return regions;
+}
 
 typedef struct{
   uint8_t framebuffer[GBA_LCD_W*GBA_LCD_H*4];
@@ -836,10 +910,14 @@ typedef struct{
   FILE * log_cmp_file; 
   bool skip_bios_intro;
   char save_file_path[SB_FILE_PATH_SIZE];  
+  gba_page_table_t page_table;
+  sb_sprite_bins_t sprite_bins;
+  arm7_idle_loop_t idle_loop;
 }gba_scratch_t;
 static void gba_process_audio_writes(gba_t* gba);
 static uint8_t gba_audio_process_byte_write(gba_t *gba, uint32_t addr, uint8_t value);
 static bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size);
+static bool gba_compile_ar_cheat(const uint32_t* buffer, uint32_t size, uint32_t* compiled);
 static FORCE_INLINE void gba_recompute_waitstate_table(gba_t* gba,uint16_t waitcnt);
 static FORCE_INLINE uint32_t gba_read32(gba_t*gba, unsigned baddr);
 static FORCE_INLINE void gba_store32(gba_t*gba, unsigned baddr, uint32_t data);
@@ -847,7 +925,7 @@ static FORCE_INLINE void gba_store32(gba_t*gba, unsigned baddr, uint32_t data);
 //Returns offset into savestate where bess info can be found
 static uint32_t gba_save_best_effort_state(gba_t* gba){
   gba->bess.bess_version = 1; 
-  for(int i=0;i<37;++i)gba->bess.cpu_registers[i]=gba->cpu.registers[i];
+  arm7_get_registers(&gba->cpu,gba->bess.cpu_registers);
   
   gba->bess.wram0_seg = ((uint8_t*)gba->mem.wram0)-(uint8_t*)gba;
   gba->bess.wram1_seg = ((uint8_t*)gba->mem.wram1)-(uint8_t*)gba;
@@ -870,7 +948,7 @@ static bool gba_load_best_effort_state(gba_t* gba,uint8_t *save_state_data, uint
   if(bess->vram_seg+sizeof(gba->mem.vram) > size) return false;  
   if(bess->oam_seg+sizeof(gba->mem.oam) > size) return false;  
   if(bess->cart_backup_seg+sizeof(gba->mem.cart_backup) > size) return false; 
-  for(int i=0;i<37;++i)gba->cpu.registers[i]=bess->cpu_registers[i];
+  arm7_set_registers(&gba->cpu,bess->cpu_registers);
   memcpy(gba->mem.wram0,save_state_data+bess->wram0_seg,sizeof(gba->mem.wram0));
   memcpy(gba->mem.wram1,save_state_data+bess->wram1_seg,sizeof(gba->mem.wram1));
   memcpy(gba->mem.io,save_state_data+bess->io_seg,sizeof(gba->mem.io));
@@ -906,7 +984,14 @@ static FORCE_INLINE sb_debug_mmio_access_t gba_debug_mmio_access(gba_t*gba, unsi
 
 static void gba_tick_keypad(sb_joy_t*joy, gba_t* gba); 
 static FORCE_INLINE void gba_tick_timers(gba_t* gba);
+static FORCE_INLINE void gba_ppu_catch_up(gba_t* gba);
+static void gba_flush_audio(gba_t* gba);
 static void gba_compute_timers(gba_t* gba); 
+// Called before stores to IO, palette, VRAM and OAM so the PPU sees them at the right pixel
+static FORCE_INLINE void gba_ppu_note_write(gba_t* gba, unsigned baddr){
+  gba_ppu_catch_up(gba);
+  if(baddr>=GBA_OAM&&gba->mem.sprite_bins)gba->mem.sprite_bins->dirty=true;
+}
 static void FORCE_INLINE gba_send_interrupt(gba_t*gba,int delay,int if_bit);
 // Returns a pointer to the data backing the baddr (when not DWORD aligned, it
 // ignores the lowest 2 bits. 
@@ -1175,6 +1260,8 @@ static void gba_process_solar_sensor(gba_t*gba){
   }
 }
 static FORCE_INLINE void gba_store32(gba_t*gba, unsigned baddr, uint32_t data){
+  if(baddr>=0x04000000&&baddr<0x08000000)gba_ppu_note_write(gba,baddr);
+  gba->mem.idle_loop_side_effects++;
   if(baddr>=0x08000000){
     //Mask is 0xfe to catch the sram mirror at 0x0f and 0x0e
     if((baddr&0xfe000000)==0xE000000){gba_process_backup_write(gba,baddr,data>>((baddr&3)*8));return;}
@@ -1192,6 +1279,8 @@ static FORCE_INLINE void gba_store32(gba_t*gba, unsigned baddr, uint32_t data){
   *val= data;
 }
 static FORCE_INLINE void gba_store16(gba_t*gba, unsigned baddr, uint32_t data){
+  if(baddr>=0x04000000&&baddr<0x08000000)gba_ppu_note_write(gba,baddr);
+  gba->mem.idle_loop_side_effects++;
   if(baddr>=0x08000000){
     //Mask is 0xfe to catch the sram mirror at 0x0f and 0x0e
     if((baddr&0xfe000000)==0xE000000){
@@ -1213,6 +1302,8 @@ static FORCE_INLINE void gba_store16(gba_t*gba, unsigned baddr, uint32_t data){
   ((uint16_t*)val)[offset]=data; 
 }
 static FORCE_INLINE void gba_store8(gba_t*gba, unsigned baddr, uint32_t data){
+  if(baddr>=0x04000000&&baddr<0x08000000)gba_ppu_note_write(gba,baddr);
+  gba->mem.idle_loop_side_effects++;
   if(baddr>=0x05000000){
     // 8 bit stores to palette mirror across 8 bit halves
     if((baddr&0xff000000)==0x5000000){gba_store16(gba,baddr&~1,(data&0xff)*0x0101); return; }
@@ -1227,6 +1318,7 @@ static FORCE_INLINE void gba_store8(gba_t*gba, unsigned baddr, uint32_t data){
   ((uint8_t*)val)[offset]=data; 
 } 
 static FORCE_INLINE void gba_store8_debug(gba_t*gba, unsigned baddr, uint32_t data){
+  if(baddr>=0x04000000&&baddr<0x08000000)gba_ppu_note_write(gba,baddr);
   if(baddr>=0x05000000){
     // 8 bit stores to palette mirror across 8 bit halves
     if((baddr&0xff000000)==0x5000000){gba_store16(gba,baddr&~1,(data&0xff)*0x0101); return; }
@@ -1316,43 +1408,40 @@ static FORCE_INLINE void gba_recompute_waitstate_table(gba_t* gba,uint16_t waitc
   waitcnt&=(1<<15); // Force cartridge to report as GBA cart
   gba_io_store16(gba,GBA_WAITCNT,waitcnt);
 }
+// The prefetch buffer is modeled by prefetch_size, the cycles the gamepak bus has been free to fill it
+// since the last ROM access. Only ROM accesses look at it, every other access just adds its duration.
 static FORCE_INLINE void gba_compute_access_cycles(gba_t *gba, uint32_t address,int request_size/*0: 1B,1: 2B,3: 4B*/){
   int bank = SB_BFE(address,24,4);
-  bool prefetch_en= gba->mem.prefetch_en;
-  if(SB_UNLIKELY(!prefetch_en)){
+  if(SB_UNLIKELY(!gba->mem.prefetch_en)){
     if(gba->cpu.i_cycles)request_size|=1;
     if(request_size&1)gba->cpu.next_fetch_sequential =false;
     gba->mem.prefetch_size = 0;
+    gba->mem.requests+=gba->mem.wait_state_table[bank*4+request_size];
+    return;
   }
   uint32_t wait = gba->mem.wait_state_table[bank*4+request_size];
-  if(SB_LIKELY(prefetch_en)){    
-    gba->mem.prefetch_size+=gba->cpu.i_cycles;
-    if(bank>=0x08&&bank<=0x0D){
-      if(SB_UNLIKELY(request_size&1)){
-        uint32_t pc = gba->cpu.prefetch_pc;    
-        if(pc>=0x08000000){
-          // Check if the bubble made it to the execute stage before being squashed, 
-          // and apply the bubble cycle if it was not squashed. 
-          // Note, only a single pipeline bubble is tracked using this infrastructure. 
-          int pc_bank = SB_BFE(pc,24,4);
-          int prefetch_cycles = gba->mem.wait_state_table[pc_bank*4]; 
-          int prefetch_phase = (gba->mem.prefetch_size)%prefetch_cycles;
-          if(gba->mem.prefetch_size>gba->cpu.i_cycles&&prefetch_phase==prefetch_cycles-1)wait+=1;
-        }
-        //Non sequential->reset prefetch buffer
-        gba->mem.prefetch_size = 0;
-        gba->cpu.next_fetch_sequential =false;
-      }else{
-        //Sequential fetch from prefetch buffer based on available wait states
-        if(gba->mem.prefetch_size>=wait){
-          gba->mem.prefetch_size-=wait-1; 
-          wait = 1; 
-        }else{
-          wait -= gba->mem.prefetch_size;
-          gba->mem.prefetch_size=0;
-        }
-      }
-    }else gba->mem.prefetch_size+=wait; 
+  uint32_t elapsed = gba->mem.prefetch_size+gba->cpu.i_cycles;
+  if(bank<0x08||bank>0x0D)gba->mem.prefetch_size = elapsed+wait;
+  else if(SB_UNLIKELY(request_size&1)){
+    uint32_t pc = gba->cpu.prefetch_pc;    
+    if(pc>=0x08000000&&elapsed>gba->cpu.i_cycles){
+      // Check if the bubble made it to the execute stage before being squashed, 
+      // and apply the bubble cycle if it was not squashed. 
+      // Note, only a single pipeline bubble is tracked using this infrastructure. 
+      uint32_t prefetch_cycles = gba->mem.wait_state_table[SB_BFE(pc,24,4)*4]; 
+      uint32_t prefetch_phase = elapsed<prefetch_cycles? elapsed: elapsed%prefetch_cycles;
+      if(prefetch_phase==prefetch_cycles-1)wait+=1;
+    }
+    //Non sequential->reset prefetch buffer
+    gba->mem.prefetch_size = 0;
+    gba->cpu.next_fetch_sequential =false;
+  }else if(elapsed>=wait){
+    //Sequential fetch from prefetch buffer based on available wait states
+    gba->mem.prefetch_size = elapsed-wait+1;
+    wait = 1; 
+  }else{
+    wait -= elapsed;
+    gba->mem.prefetch_size=0;
   }
   gba->mem.requests+=wait;
 }
@@ -1365,11 +1454,13 @@ static FORCE_INLINE void gba_process_mmio_read(gba_t *gba, uint32_t address);
 
 // Memory IO functions for the emulated CPU                  
 static FORCE_INLINE uint32_t arm7_read32(void* user_data, uint32_t address){
+  arm7_watch_access(&((gba_t*)user_data)->cpu,address,4,SB_WATCH_READ);
   gba_compute_access_cycles((gba_t*)user_data,address,3);
   uint32_t value = gba_read32((gba_t*)user_data,address);
   return value;
 }
 static FORCE_INLINE uint32_t arm7_read16(void* user_data, uint32_t address){
+  arm7_watch_access(&((gba_t*)user_data)->cpu,address,2,SB_WATCH_READ);
   gba_compute_access_cycles((gba_t*)user_data,address,1);
   uint16_t value = gba_read16((gba_t*)user_data,address);
   return value;
@@ -1382,6 +1473,24 @@ static FORCE_INLINE uint32_t arm7_read16_seq(void* user_data, uint32_t address,
   gba_compute_access_cycles((gba_t*)user_data,address,seq?0:1);
   return gba_read16((gba_t*)user_data,address);
 }
+// LDM/STM fast path for the work RAMs. Only taken when no DMA or PPU/timer event can happen 
+// before the transfer ends, since those could otherwise have run between two registers
+static uint32_t* arm7_block_ptr(void* user_data, uint32_t address, uint32_t words, bool write){
+  gba_t* gba = (gba_t*)user_data;
+  int bank = SB_BFE(address,24,8);
+  uint8_t* mem = NULL;
+  if(bank==0x02&&(address&(256*1024-1))+words*4<=256*1024)mem = gba->mem.wram0+(address&(256*1024-1));
+  else if(bank==0x03&&(address&(32*1024-1))+words*4<=32*1024)mem = gba->mem.wram1+(address&(32*1024-1));
+  if(!mem||gba->activate_dmas)return NULL;
+  int nonseq = gba->mem.wait_state_table[bank*4+3];
+  int seq = write? nonseq: gba->mem.wait_state_table[bank*4+2];
+  int cycles = nonseq+seq*(words-1);
+  if(cycles>=gba->ppu.fast_forward_ticks||cycles>=(int)(gba->timer_ticks_before_event-gba->deferred_timer_ticks))return NULL;
+  // The work RAMs aren't behind the prefetcher so this matches charging every access on its own
+  for(uint32_t i=0;i<words;++i)gba_compute_access_cycles(gba,address+i*4,(write||i==0)?3:2);
+  if(write)gba->mem.idle_loop_side_effects++;
+  return (uint32_t*)mem;
+}
 void gba_cpu_breakpoint(void* user_data){
   gba_t * gba = (gba_t*)user_data;
   gba->frame_in_progress=false; 
@@ -1390,8 +1499,24 @@ void gba_cpu_breakpoint(void* user_data){
 }
 //Used to process special behavior triggered by MMIO write
 static bool gba_process_mmio_write(gba_t *gba, uint32_t address, uint32_t data, int req_size_bytes);
+// Dispatch for IO registers with write side effects, indexes gba_mmio_write_handlers
+typedef enum{
+  GBA_MMIO_WRITE_PLAIN,
+  GBA_MMIO_WRITE_IE,
+  GBA_MMIO_WRITE_SOUNDCNT,
+  GBA_MMIO_WRITE_TIMER,
+  GBA_MMIO_WRITE_POSTFLG,
+  GBA_MMIO_WRITE_BG_AFFINE,
+  GBA_MMIO_WRITE_DMA,
+  GBA_MMIO_WRITE_WAITCNT,
+  GBA_MMIO_WRITE_KEYINPUT,
+  GBA_MMIO_WRITE_SOUND,
+  GBA_MMIO_WRITE_WAVE_RAM,
+  GBA_MMIO_WRITE_NUM_HANDLERS
+}gba_mmio_write_handler_t;
 
 static FORCE_INLINE uint8_t arm7_read8(void* user_data, uint32_t address){
+  arm7_watch_access(&((gba_t*)user_data)->cpu,address,1,SB_WATCH_READ);
   gba_compute_access_cycles((gba_t*)user_data,address,1);
   return gba_read8((gba_t*)user_data,address);
 }
@@ -1408,14 +1533,20 @@ static FORCE_INLINE void gba_dma_write16(gba_t* gba, uint32_t address, uint16_t
   gba_store16(gba,address,data);
 }
 static FORCE_INLINE void arm7_write32(void* user_data, uint32_t address, uint32_t data){
+  arm7_watch_access(&((gba_t*)user_data)->cpu,address,4,SB_WATCH_WRITE);
+  arm7_trace_write(&((gba_t*)user_data)->cpu,address,4,data);
   gba_compute_access_cycles((gba_t*)user_data,address,3); 
   gba_dma_write32((gba_t*)user_data,address,data);
 }
 static FORCE_INLINE void arm7_write16(void* user_data, uint32_t address, uint16_t data){
+  arm7_watch_access(&((gba_t*)user_data)->cpu,address,2,SB_WATCH_WRITE);
+  arm7_trace_write(&((gba_t*)user_data)->cpu,address,2,data);
   gba_compute_access_cycles((gba_t*)user_data,address,1); 
   gba_dma_write16((gba_t*)user_data,address,data);
 }
 static FORCE_INLINE void arm7_write8(void* user_data, uint32_t address, uint8_t data)  {
+  arm7_watch_access(&((gba_t*)user_data)->cpu,address,1,SB_WATCH_WRITE);
+  arm7_trace_write(&((gba_t*)user_data)->cpu,address,1,data);
   gba_compute_access_cycles((gba_t*)user_data,address,1); 
   if((address&0xfffff000)==0x04000000){
     if(gba_process_mmio_write((gba_t*)user_data,address,data,1))return; 
@@ -1425,8 +1556,51 @@ static FORCE_INLINE void arm7_write8(void* user_data, uint32_t address, uint8_t
 // Try to load a GBA rom, return false on invalid rom
 bool gba_load_rom(sb_emu_state_t*emu,gba_t* gba, gba_scratch_t *scratch);
  
+static void gba_rebuild_page_table(gba_t* gba, gba_page_table_t* table){
+  memset(table->pages,0,sizeof(table->pages));
+  table->gba = gba;
+  table->cart_rom = gba->mem.cart_rom;
+  table->rom_size = gba->cart.rom_size;
+  for(uint32_t p=0;p<GBA_NUM_PAGES;++p){
+    uint32_t addr = p<<GBA_PAGE_SHIFT;
+    uint8_t* page = NULL; 
+    switch(addr>>24){
+      case 0x2: page = gba->mem.wram0+(addr&0x3ffff); break;
+      case 0x3: page = gba->mem.wram1+(addr&0x7fff); break;
+      case 0x6:
+        // The upper 32KB mirror blocks writes in bitmap modes so it stays on the slow path
+        if((addr&0x18000)!=0x18000)page = gba->mem.vram+(addr&0x1ffff); 
+        break;
+      case 0x8: case 0x9: case 0xA: case 0xB: case 0xC: case 0xD:{
+        uint32_t maddr = addr&0x1ffffff;
+        if(gba->mem.cart_rom&&maddr+GBA_PAGE_SIZE<=gba->cart.rom_size){
+          page = (uint8_t*)((uintptr_t)(gba->mem.cart_rom+maddr)|GBA_PAGE_ROM);
+        }
+      }break;
+    }
+    table->pages[p]=page;
+  }
+}
 static FORCE_INLINE uint32_t * gba_dword_lookup(gba_t* gba,unsigned addr, int req_type){
   uint32_t *ret = &gba->mem.openbus_word;
+  if(SB_LIKELY(addr<0x10000000&&gba->mem.page_table)){
+    uintptr_t page = (uintptr_t)gba->mem.page_table->pages[addr>>GBA_PAGE_SHIFT];
+    if(SB_LIKELY(page)){
+      uint32_t* data = (uint32_t*)((page&~(uintptr_t)GBA_PAGE_ROM)+(addr&(GBA_PAGE_SIZE-4)));
+      if(!(page&GBA_PAGE_ROM)){
+        gba->mem.openbus_word=*data;
+        return data;
+      }
+      if(req_type&GBA_REQ_READ){
+        gba->mem.openbus_word = *data;
+        if(req_type&0x3){
+          uint16_t res16 = gba->mem.openbus_word >> (addr&2)*8;
+          gba->mem.openbus_word = res16*0x10001u;
+        }
+        return ret;
+      }
+    }
+  }
   switch(addr>>24){
     case 0x0: if(addr<0x4000){
       if(gba->cpu.registers[15]<0x4000)gba->mem.bios_word = *(uint32_t*)(gba->mem.bios+(addr&~3));
@@ -1490,7 +1664,7 @@ static FORCE_INLINE uint32_t * gba_dword_lookup(gba_t* gba,unsigned addr, int re
         if(SB_UNLIKELY(maddr>=gba->cart.rom_size)){
           gba->mem.openbus_word = ((maddr/2)&0xffff)|(((maddr/2+1)&0xffff)<<16);
           // Return ready when done writting EEPROM (required by Minish Cap)
-          if(gba->cart.backup_type==GBA_BACKUP_EEPROM) gba->mem.openbus_word = 1; 
+          if(gba->cart.backup_type==GBA_BACKUP_EEPROM) gba->mem.openbus_word = gba->rtc.total_clocks_ticked>=gba->mem.eeprom_ready_clock; 
         }else{
           gba->mem.openbus_word = *(uint32_t*)(gba->mem.cart_rom+maddr);
           if(req_type&0x3){
@@ -1525,6 +1699,29 @@ static FORCE_INLINE uint32_t * gba_dword_lookup(gba_t* gba,unsigned addr, int re
   return ret;
 }
 
+// Records the new FIFO head after a pop
+static FORCE_INLINE void gba_audio_log_fifo_pop(gba_t* gba, int fifo){
+  gba_audio_t* audio = &gba->audio;
+  int w = audio->fifo_log[fifo].write_ptr;
+  int next = (w+1)&(GBA_AUDIO_FIFO_LOG_SIZE-1);
+  if(next==audio->fifo_log[fifo].read_ptr){
+    // Full, the oldest pop loses its timing
+    audio->fifo_output[fifo] = audio->fifo_log[fifo].value[next];
+    audio->fifo_log[fifo].read_ptr = (next+1)&(GBA_AUDIO_FIFO_LOG_SIZE-1);
+  }
+  audio->fifo_log[fifo].clock[w] = audio->audio_clock+audio->pending_ticks;
+  audio->fifo_log[fifo].value[w] = audio->fifo[fifo].data[audio->fifo[fifo].read_ptr&0x1f];
+  audio->fifo_log[fifo].write_ptr = next;
+}
+// Applies the logged pops stamped at or before clock_offset cycles relative to the audio clock
+static FORCE_INLINE void gba_audio_apply_fifo_log(gba_audio_t* audio, int fifo, double clock_offset){
+  while(audio->fifo_log[fifo].read_ptr!=audio->fifo_log[fifo].write_ptr){
+    int r = audio->fifo_log[fifo].read_ptr;
+    if((int32_t)(audio->fifo_log[fifo].clock[r]-audio->audio_clock)>clock_offset)break;
+    audio->fifo_output[fifo] = audio->fifo_log[fifo].value[r];
+    audio->fifo_log[fifo].read_ptr = (r+1)&(GBA_AUDIO_FIFO_LOG_SIZE-1);
+  }
+}
 static FORCE_INLINE void gba_audio_fifo_push(gba_t*gba, int fifo, int8_t data){
   int size = (gba->audio.fifo[fifo].write_ptr-gba->audio.fifo[fifo].read_ptr)&0x1f; 
   if(size<28){
@@ -1565,14 +1762,163 @@ static void gba_recompute_mmio_mask_table(gba_t* gba){
             (dword_address==0x400100C))valid = false;
     gba->mem.mmio_data_mask_lookup[io_reg]=data_mask;
     gba->mem.mmio_reg_valid_lookup[io_reg]=valid;
+
+    gba_mmio_write_handler_t handler = GBA_MMIO_WRITE_PLAIN;
+    if(dword_address==GBA_IE)handler = GBA_MMIO_WRITE_IE;
+    else if(dword_address==GBA_SOUNDCNT_L)handler = GBA_MMIO_WRITE_SOUNDCNT;
+    else if(dword_address>=GBA_TM0CNT_L&&dword_address<=GBA_TM3CNT_L)handler = GBA_MMIO_WRITE_TIMER;
+    else if(dword_address==GBA_POSTFLG)handler = GBA_MMIO_WRITE_POSTFLG;
+    else if(dword_address==GBA_BG2X||dword_address==GBA_BG3X||
+            dword_address==GBA_BG2Y||dword_address==GBA_BG3Y)handler = GBA_MMIO_WRITE_BG_AFFINE;
+    else if(dword_address==GBA_DMA0CNT_L||dword_address==GBA_DMA1CNT_L||
+            dword_address==GBA_DMA2CNT_L||dword_address==GBA_DMA3CNT_L)handler = GBA_MMIO_WRITE_DMA;
+    else if(dword_address==GBA_WAITCNT)handler = GBA_MMIO_WRITE_WAITCNT;
+    else if(dword_address==GBA_KEYINPUT)handler = GBA_MMIO_WRITE_KEYINPUT;
+    else if(dword_address>=GBA_SOUND1CNT_L&&dword_address<GBA_WAVE_RAM)handler = GBA_MMIO_WRITE_SOUND;
+    else if(dword_address>=GBA_WAVE_RAM&&dword_address<GBA_FIFO_A)handler = GBA_MMIO_WRITE_WAVE_RAM;
+    /*
+    FIFO writes are ignored for now since they cause audio pops in Metroid Zero
+    See: https://github.com/mgba-emu/mgba/issues/1847
+    for(int i=0;i<4;++i){
+      if(word_mask&(0xff<<(8*i)))gba_audio_fifo_push(gba,fifo,SB_BFE(word_data,8*i,8));
+      else gba_audio_fifo_push(gba,fifo,gba->audio.fifo[fifo].data[(gba->audio.fifo[fifo].write_ptr)&0x1f]);
+    }
+    */
+    gba->mem.mmio_write_handler_lookup[io_reg]=handler;
   }
 }
 
 static FORCE_INLINE void gba_process_mmio_read(gba_t *gba, uint32_t address){
+  SB_PERF_COUNT(&gba->perf,SB_COUNTER_MMIO,1);
   // Force recomputing timers on timer read
-  if(address>= GBA_TM0CNT_L&&address<=GBA_TM3CNT_H)gba_compute_timers(gba);
+  if(address>= GBA_TM0CNT_L&&address<=GBA_TM3CNT_H){
+    gba_compute_timers(gba);
+    gba->mem.idle_loop_side_effects++;
+  }else if(address>=GBA_SOUND1CNT_L&&address<GBA_FIFO_A){
+    // The mixer updates the channel status bits
+    gba_flush_audio(gba);
+  }else if((address&~3)==GBA_KEYINPUT&&gba->mem.late_input){
+    uint32_t buttons = sb_atomic_load_acquire_u32(&gba->mem.late_input->buttons);
+    gba_io_store16(gba,GBA_KEYINPUT,sb_keyinput_from_buttons(buttons));
+  }
+}
+// Handlers get the write merged into the containing word (word_data is already masked by word_mask)
+// and return true if they consumed the write, false to let it be stored to the register as is.
+static bool gba_mmio_write_ie(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  uint16_t IE = gba_io_read16(gba,GBA_IE);
+  uint16_t IF = gba_io_read16(gba,GBA_IF);
+
+  IE = ((IE&~word_mask)|(word_data&word_mask))>>0;
+  IF &= ~((word_data)>>16);
+  gba_io_store16(gba,GBA_IE,IE);
+  gba_io_store16(gba,GBA_IF,IF);
+  return true;
 }
+static bool gba_mmio_write_soundcnt(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  gba_flush_audio(gba);
+  uint16_t soundcnt_h = SB_BFE(data,16,16);
+  // Channel volume for each FIFO
+  for(int i=0;i<2;++i){
+    bool reset = SB_BFE(soundcnt_h,11+i*4,1);
+    if(reset){
+      gba->audio.fifo[i].read_ptr=0;
+      gba->audio.fifo[i].write_ptr=0;
+      for(int d=0;d<32;++d)gba->audio.fifo[i].data[d]=0;
+      gba->audio.fifo_output[i]=0;
+    }
+  }
+  return false;
+}
+static bool gba_mmio_write_timer(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  gba_compute_timers(gba);
+  int timer_off = (address_u32-GBA_TM0CNT_L)/4;
+  if(word_mask&0xffff){
+    gba->timers[timer_off+0].pending_reload_value = word_data&(word_mask&0xffff);
+  }
+  if(word_mask&0xffff0000){
+    gba_store16(gba,address_u32+2,(word_data>>16)&0xffff);
+    gba->timers[timer_off+0].reload_value =gba->timers[timer_off+0].pending_reload_value;
+  }
+  gba->timer_ticks_before_event=0;
+  return true;
+}
+static bool gba_mmio_write_postflg(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  //Only BIOS can update Post Flag and haltcnt
+  if(gba->cpu.registers[15]<0x4000){
+    //Writes to haltcnt halt the CPU
+    if(word_mask&0xff00){
+      if(word_data&0x8000){
+        gba->stop_mode = true;
+        gba->frame_in_progress=false;
+      }
+      gba->cpu.wait_for_interrupt = true;
+    }
+    uint32_t data = gba_io_read32(gba,address_u32);
+    //POST can only be initialized once, then other writes are dropped.
+    if((word_mask&0xff)&&(data&0xff))word_mask&=~0xff;
+    data&=~word_mask;
+    data|=word_data&word_mask;
+    gba_io_store32(gba,address_u32,data);
+  }
+  return true;
+}
+static bool gba_mmio_write_bg_affine(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  int aff_bg = (address_u32-GBA_BG2X)/0x10;
+  if(((address_u32-GBA_BG2X)&0xf)==0)gba->ppu.aff[aff_bg].wrote_bgx= true;
+  else gba->ppu.aff[aff_bg].wrote_bgy = true;
+  return false;
+}
+static bool gba_mmio_write_dma(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  gba->activate_dmas=true;
+  return false;
+}
+static bool gba_mmio_write_waitcnt(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  uint16_t waitcnt = gba_io_read16(gba,GBA_WAITCNT);
+  waitcnt = ((waitcnt&~word_mask)|(word_data&word_mask));
+  gba_recompute_waitstate_table(gba,waitcnt);
+  return false;
+}
+static bool gba_mmio_write_keyinput(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  if(word_mask&0xffff0000){
+    gba_store16(gba,GBA_KEYINPUT,(word_data>>16)&0xffff);
+  }
+  gba_tick_keypad(NULL,gba);
+  return false;
+}
+static bool gba_mmio_write_sound(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  gba_flush_audio(gba);
+  for(int i=0;i<4;++i){
+    if(word_mask&(0xff<<(i*8))){
+      uint8_t data =gba_audio_process_byte_write(gba,address_u32+i,SB_BFE(word_data,(i*8),8));
+      gba_io_store8(gba,address_u32+i,data);
+    }
+  }
+  gba_process_audio_writes(gba);
+  return true;
+}
+static bool gba_mmio_write_wave_ram(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data){
+  gba_flush_audio(gba);
+  return false;
+}
+typedef bool (*gba_mmio_write_fn_t)(gba_t *gba, uint32_t address_u32, uint32_t word_data, uint32_t word_mask, uint32_t data);
+static const gba_mmio_write_fn_t gba_mmio_write_handlers[GBA_MMIO_WRITE_NUM_HANDLERS]={
+  NULL,
+  gba_mmio_write_ie,
+  gba_mmio_write_soundcnt,
+  gba_mmio_write_timer,
+  gba_mmio_write_postflg,
+  gba_mmio_write_bg_affine,
+  gba_mmio_write_dma,
+  gba_mmio_write_waitcnt,
+  gba_mmio_write_keyinput,
+  gba_mmio_write_sound,
+  gba_mmio_write_wave_ram,
+};
 static bool gba_process_mmio_write(gba_t *gba, uint32_t address, uint32_t data, int req_size_bytes){
+  SB_PERF_COUNT(&gba->perf,SB_COUNTER_MMIO,1);
+  gba_ppu_catch_up(gba);
+  int handler = gba->mem.mmio_write_handler_lookup[SB_BFE(address,2,8)];
+  if(SB_LIKELY(handler==GBA_MMIO_WRITE_PLAIN))return false;
   uint32_t address_u32 = address&~3; 
   uint32_t word_mask = 0xffffffff;
   uint32_t word_data = data; 
@@ -1584,103 +1930,7 @@ static bool gba_process_mmio_write(gba_t *gba, uint32_t address, uint32_t data,
     word_mask =0x000000ffu<< ((address&3)*8u);
   }
   word_data&=word_mask;
-
-  if(address_u32== GBA_IE){
-    uint16_t IE = gba_io_read16(gba,GBA_IE);
-    uint16_t IF = gba_io_read16(gba,GBA_IF);
-  
-    IE = ((IE&~word_mask)|(word_data&word_mask))>>0;
-    IF &= ~((word_data)>>16);
-    gba_io_store16(gba,GBA_IE,IE);
-    gba_io_store16(gba,GBA_IF,IF);
-
-    return true; 
-  }else if(address_u32==GBA_SOUNDCNT_L){
-    uint16_t soundcnt_h = SB_BFE(data,16,16);
-    // Channel volume for each FIFO
-    for(int i=0;i<2;++i){
-      int timer = SB_BFE(soundcnt_h,10+i*4,1);
-      bool reset = SB_BFE(soundcnt_h,11+i*4,1);
-      if(reset){
-        gba->audio.fifo[i].read_ptr=0;
-        gba->audio.fifo[i].write_ptr=0;  
-        for(int d=0;d<32;++d)gba->audio.fifo[i].data[d]=0;
-      }
-    }
-  }else if(address_u32 == GBA_TM0CNT_L||address_u32==GBA_TM1CNT_L||address_u32==GBA_TM2CNT_L||address_u32==GBA_TM3CNT_L){
-    gba_compute_timers(gba);
-    int timer_off = (address_u32-GBA_TM0CNT_L)/4;
-    if(word_mask&0xffff){
-      gba->timers[timer_off+0].pending_reload_value = word_data&(word_mask&0xffff);
-    }
-    if(word_mask&0xffff0000){
-      gba_store16(gba,address_u32+2,(word_data>>16)&0xffff);
-      gba->timers[timer_off+0].reload_value =gba->timers[timer_off+0].pending_reload_value;
-    }
-    gba->timer_ticks_before_event=0;
-    return true;
-  }else if(address_u32==GBA_POSTFLG){
-    //Only BIOS can update Post Flag and haltcnt
-    if(gba->cpu.registers[15]<0x4000){
-      //Writes to haltcnt halt the CPU
-      if(word_mask&0xff00){
-        if(word_data&0x8000){
-          gba->stop_mode = true;
-          gba->frame_in_progress=false;
-        }
-        gba->cpu.wait_for_interrupt = true;
-      }
-      uint32_t data = gba_io_read32(gba,address_u32);
-      //POST can only be initialized once, then other writes are dropped. 
-      if((word_mask&0xff)&&(data&0xff))word_mask&=~0xff;
-      data&=~word_mask;
-      data|=word_data&word_mask;
-      gba_io_store32(gba,address_u32,data);
-    }
-    return true; 
-  /*
-  Ignore these for now since it is causing audio pops in Metroid Zero
-  }else if(address_u32==GBA_FIFO_A){
-    // See: https://github.com/mgba-emu/mgba/issues/1847
-    for(int i=0;i<4;++i){
-      if(word_mask&(0xff<<(8*i)))gba_audio_fifo_push(gba,0,SB_BFE(word_data,8*i,8));
-      else gba_audio_fifo_push(gba,0,gba->audio.fifo[0].data[(gba->audio.fifo[0].write_ptr)&0x1f]);
-    }
-  }else if(address_u32==GBA_FIFO_B){
-    for(int i=0;i<4;++i){
-      if(word_mask&(0xff<<(8*i)))gba_audio_fifo_push(gba,1,SB_BFE(word_data,8*i,8));
-      else gba_audio_fifo_push(gba,1,gba->audio.fifo[1].data[(gba->audio.fifo[1].write_ptr)&0x1f]);
-    }
-  */
-  }else if(address_u32==GBA_BG2X||address_u32==GBA_BG3X){
-    int aff_bg = (address_u32-GBA_BG2X)/0x10;
-    gba->ppu.aff[aff_bg].wrote_bgx= true;
-  }else if(address_u32==GBA_BG2Y||address_u32==GBA_BG3Y){
-    int aff_bg = (address_u32-GBA_BG2Y)/0x10;
-    gba->ppu.aff[aff_bg].wrote_bgy = true;
-  }else if(address_u32==GBA_DMA0CNT_L||address_u32==GBA_DMA1CNT_L||
-           address_u32==GBA_DMA2CNT_L||address_u32==GBA_DMA3CNT_L){
-    gba->activate_dmas=true;
-  }else if (address_u32==GBA_WAITCNT){
-     uint16_t waitcnt = gba_io_read16(gba,GBA_WAITCNT);
-     waitcnt = ((waitcnt&~word_mask)|(word_data&word_mask));
-     gba_recompute_waitstate_table(gba,waitcnt);
-  }else if(address_u32==GBA_KEYINPUT){
-    if(word_mask&0xffff0000){
-      gba_store16(gba,GBA_KEYINPUT,(word_data>>16)&0xffff);
-    }
-    gba_tick_keypad(NULL,gba);
-  }else if(address_u32>=GBA_SOUND1CNT_L&&address_u32<GBA_WAVE_RAM){
-    for(int i=0;i<4;++i){
-      if(word_mask&(0xff<<(i*8))){
-        uint8_t data =gba_audio_process_byte_write(gba,address_u32+i,SB_BFE(word_data,(i*8),8));
-        gba_io_store8(gba,address_u32+i,data);
-      }
-    }
-    gba_process_audio_writes(gba);
-    return true;
-  }
-  return false;
+  return gba_mmio_write_handlers[handler](gba,address_u32,word_data,word_mask,data);
 }
 int gba_search_rom_for_backup_string(gba_t* gba){
   int btype = GBA_BACKUP_NONE; 
@@ -1723,7 +1973,7 @@ bool gba_load_rom(sb_emu_state_t*emu,gba_t* gba, gba_scratch_t *scratch){
   }  
 
   gba->mem.bios=scratch->bios;
-  bool loaded_bios= se_load_bios_file("GBA BIOS", emu->save_file_path, "gba_bios.bin", scratch->bios,16*1024);
+  bool loaded_bios= sb_load_bios_file(emu,"GBA BIOS", emu->save_file_path, "gba_bios.bin", scratch->bios,16*1024);
   if(!loaded_bios){
     memcpy(scratch->bios,gba_bios_bin,sizeof(gba_bios_bin));
     scratch->skip_bios_intro=true;
@@ -1734,14 +1984,14 @@ bool gba_load_rom(sb_emu_state_t*emu,gba_t* gba, gba_scratch_t *scratch){
   gba->cart.backup_type = gba_search_rom_for_backup_string(gba);
 
   size_t bytes=0;
-  uint8_t*data = sb_load_file_data(emu->save_file_path,&bytes);
+  uint8_t*data = emu->save_file_path[0]? sb_load_file_data(emu->save_file_path,&bytes): NULL;
   if(data){
     printf("Loaded save file: %s, bytes: %zu\n",emu->save_file_path,bytes);
     if(bytes>=128*1024)bytes=128*1024;
     memcpy(gba->mem.cart_backup, data, bytes);
     sb_free_file_data(data);
   }else{
-    printf("Could not find save file: %s\n",emu->save_file_path);
+    if(emu->save_file_path[0])printf("Could not find save file: %s\n",emu->save_file_path);
     for(int i=0;i<sizeof(gba->mem.cart_backup);++i) gba->mem.cart_backup[i]=0xff;
   }
 
@@ -1777,7 +2027,7 @@ bool gba_load_rom(sb_emu_state_t*emu,gba_t* gba, gba_scratch_t *scratch){
       0x3007fa0,0x0,0x3007fe0,0x0,0x0,0x0,0x0,0x0,
       0x0,0x0,0x0,0x0,0x0,
     };
-    for(int i=0;i<37;++i)gba->cpu.registers[i]=initial_regs[i];
+    arm7_set_registers(&gba->cpu,initial_regs);
     const uint32_t initial_mmio_writes[]={
       0x4000000,0x80,
       0x4000004,0x7e0000,
@@ -1802,7 +2052,7 @@ bool gba_load_rom(sb_emu_state_t*emu,gba_t* gba, gba_scratch_t *scratch){
     gba_store16(gba,GBA_DISPCNT,0x9140);
   }else{
     gba->cpu.registers[PC]  = 0x0000000; 
-    gba->cpu.registers[CPSR]= 0x000000d3; 
+    arm7_set_cpsr(&gba->cpu,0x000000d3);
   }
   if(gba->cpu.log_cmp_file){fclose(gba->cpu.log_cmp_file);gba->cpu.log_cmp_file=NULL;};
   gba->cpu.log_cmp_file =se_load_log_file(scratch->save_file_path, "log.bin");
@@ -1822,11 +2072,335 @@ static FORCE_INLINE int gba_ppu_compute_max_fast_forward(gba_t* gba, bool render
   int scanline_clock = (gba->ppu.scan_clock)%1232;
   //If inside hblank, can fastforward to outside of hblank
   if(scanline_clock>=GBA_LCD_HBLANK_START*4&&scanline_clock<=GBA_LCD_HBLANK_END*4) return GBA_LCD_HBLANK_END*4-scanline_clock-1;
-  //If inside hrender, can fastforward to hblank if not the first pixel and not visible
-  bool not_visible = !render||gba->ppu.scan_clock>GBA_LCD_VBLANK_START; 
-  if(not_visible&& (scanline_clock>=1 && scanline_clock<=GBA_LCD_HBLANK_START*4))return GBA_LCD_HBLANK_START*4-scanline_clock-1; 
+  //If inside hrender, can fastforward to hblank if not the first pixel. Visible pixels are drawn by gba_ppu_catch_up
+  if(scanline_clock>=1 && scanline_clock<=GBA_LCD_HBLANK_START*4)return GBA_LCD_HBLANK_START*4-scanline_clock-1; 
   return 3-((gba->ppu.scan_clock)%4);
 }
+#define GBA_AFFINE_CHUNK 16
+// Marks the opaque texels of an affine line, so the transparent ones can be 0
+#define GBA_AFFINE_OPAQUE (1u<<31)
+// Renders the texels of the rotation/scaling or bitmap BG over pixels [x_start,x_end) of the line 
+// into out, 0 where transparent. Each chunk of pixels first gets its texel coordinates and VRAM 
+// addresses in branch free loops the compiler vectorizes, then the tiles and colors are gathered.
+static void gba_ppu_affine_line(gba_t* gba, int bg, int bg_mode, int x_start, int x_end, uint32_t* out){
+  uint16_t bgcnt = gba_io_read16(gba,GBA_BG0CNT+bg*2);
+  int character_base_addr = SB_BFE(bgcnt,2,2)*16*1024;
+  bool mosaic = SB_BFE(bgcnt,6,1);
+  int screen_base_addr = SB_BFE(bgcnt,8,5)*2048;
+  bool display_overflow = SB_BFE(bgcnt,13,1);
+  int screen_size = SB_BFE(bgcnt,14,2);
+  bool bitmap = bg_mode>=3;
+  int32_t size_x = (16*8)<<screen_size, size_y = size_x;
+  if(bg_mode==3||bg_mode==4){size_x=240;size_y=160;}
+  else if(bg_mode==5){size_x=160;size_y=128;}
+  uint32_t frame_base = bg_mode>=4? SB_BFE(gba_io_read16(gba,GBA_DISPCNT),4,1)*0xA000: 0;
+
+  int32_t bgx = gba->ppu.aff[bg-2].render_bgx;
+  int32_t bgy = gba->ppu.aff[bg-2].render_bgy;
+  int32_t a = (int16_t)gba_io_read16(gba,GBA_BG2PA+(bg-2)*0x10);
+  int32_t c = (int16_t)gba_io_read16(gba,GBA_BG2PC+(bg-2)*0x10);
+  int32_t mos_x = mosaic? SB_BFE(gba_io_read16(gba,GBA_MOSAIC),0,4)+1: 1;
+  const uint8_t* vram = gba->mem.vram;
+  const uint16_t* palette = (const uint16_t*)(gba->mem.palette+GBA_BG_PALETTE);
+
+  for(int x0=x_start;x0<x_end;x0+=GBA_AFFINE_CHUNK){
+    int32_t tx[GBA_AFFINE_CHUNK], ty[GBA_AFFINE_CHUNK];
+    uint32_t addr[GBA_AFFINE_CHUNK];
+    uint8_t inside[GBA_AFFINE_CHUNK];
+    for(int i=0;i<GBA_AFFINE_CHUNK;++i){
+      int32_t x = ((x0+i)/mos_x)*mos_x;
+      tx[i] = (a*x+bgx)>>8;
+      ty[i] = (c*x+bgy)>>8;
+    }
+    if(display_overflow&&!bitmap){
+      for(int i=0;i<GBA_AFFINE_CHUNK;++i){tx[i]&=size_x-1;ty[i]&=size_y-1;}
+    }else if(display_overflow){
+      for(int i=0;i<GBA_AFFINE_CHUNK;++i){
+        tx[i]%=size_x; tx[i]+= tx[i]<0? size_x: 0;
+        ty[i]%=size_y; ty[i]+= ty[i]<0? size_y: 0;
+      }
+    }
+    for(int i=0;i<GBA_AFFINE_CHUNK;++i){
+      inside[i] = (uint32_t)tx[i]<(uint32_t)size_x&&(uint32_t)ty[i]<(uint32_t)size_y;
+      int32_t x = inside[i]? tx[i]: 0, y = inside[i]? ty[i]: 0;
+      // Bitmaps address the pixel, tile maps the map entry
+      addr[i] = bitmap? (x+y*size_x)*(bg_mode==4? 1: 2)+frame_base: screen_base_addr+(y/8)*(size_x/8)+x/8;
+    }
+    int n = x_end-x0<GBA_AFFINE_CHUNK? x_end-x0: GBA_AFFINE_CHUNK;
+    for(int i=0;i<n;++i){
+      uint32_t col = 0;
+      if(!inside[i]){
+      }else if(bg_mode==3||bg_mode==5){
+        col = (*(uint16_t*)(vram+addr[i])&0x7fff)|GBA_AFFINE_OPAQUE;
+      }else{
+        uint32_t texel = character_base_addr+vram[addr[i]]*8*8+(tx[i]&7)+(ty[i]&7)*8;
+        //There is an undocumented GBA quirk where tiles over 64KB are not loaded
+        //https://github.com/skylersaleh/SkyEmu/issues/292
+        uint8_t palette_id = bg_mode==4? vram[addr[i]]: SB_LIKELY(texel<0x10000)? vram[texel]: 0;
+        if(palette_id)col = palette[palette_id]|GBA_AFFINE_OPAQUE;
+      }
+      out[x0+i] = col;
+    }
+  }
+}
+// Color effect gba_ppu_output_span applies to a pixel
+enum{GBA_EFFECT_NONE,GBA_EFFECT_ALPHA,GBA_EFFECT_LIGHTEN,GBA_EFFECT_DARKEN};
+// Sorts the BG pixels into the target buffers and returns the GBA_EFFECT_* of the pixel
+static FORCE_INLINE int gba_ppu_render_pixel(gba_t* gba, int lcd_x, int lcd_y, const uint32_t affine[2][GBA_LCD_W]){
+  uint16_t dispcnt = gba_io_read16(gba,GBA_DISPCNT);
+  int bg_mode = SB_BFE(dispcnt,0,3);
+  uint8_t window_control =gba->window[lcd_x];
+  if(bg_mode==6 ||bg_mode==7){
+    //Palette 0 is taken as the background
+  }else if (bg_mode<=5){     
+    for(int bg = 3; bg>=0;--bg){
+      uint32_t col =0;         
+      if((bg<2&&bg_mode==2)||(bg==3&&bg_mode==1)||(bg!=2&&bg_mode>=3))continue;
+      bool bg_en = SB_BFE(dispcnt,8+bg,1)&&SB_BFE(gba->ppu.dispcnt_pipeline[0],8+bg,1);
+      if(!bg_en || SB_BFE(window_control,bg,1)==0)continue;
+
+      bool rot_scale = bg_mode>=1&&bg>=2;
+      uint16_t bgcnt = gba_io_read16(gba, GBA_BG0CNT+bg*2);
+      int priority = SB_BFE(bgcnt,0,2);
+      int character_base = SB_BFE(bgcnt,2,2);
+      bool mosaic = SB_BFE(bgcnt,6,1);
+      bool colors = SB_BFE(bgcnt,7,1);
+      int screen_base = SB_BFE(bgcnt,8,5);
+      int screen_size = SB_BFE(bgcnt,14,2);
+
+      int screen_size_x = (screen_size&1)?512:256;
+      int screen_size_y = (screen_size>=2)?512:256;
+      
+      if(rot_scale){
+        col = affine[bg-2][lcd_x];
+        if(!col)continue;
+        col&=~GBA_AFFINE_OPAQUE;
+      }else{
+        int16_t hoff = gba_io_read16(gba,GBA_BG0HOFS+bg*4);
+        int16_t voff = gba_io_read16(gba,GBA_BG0VOFS+bg*4);
+        hoff=(hoff<<7)>>7;
+        voff=(voff<<7)>>7;
+        int bg_x = (hoff+lcd_x);
+        int bg_y = (voff+lcd_y);
+        if(mosaic){
+          uint16_t mos_reg = gba_io_read16(gba,GBA_MOSAIC);
+          int mos_x = SB_BFE(mos_reg,0,4)+1;
+          int mos_y = SB_BFE(mos_reg,4,4)+1;
+          bg_x = hoff+(lcd_x/mos_x)*mos_x;
+          bg_y = voff+(lcd_y/mos_y)*mos_y;
+        }
+        bg_x = bg_x&(screen_size_x-1);
+        bg_y = bg_y&(screen_size_y-1);
+        int bg_tile_x = bg_x/8;
+        int bg_tile_y = bg_y/8;
+
+        int screen_base_addr =    screen_base*2048;
+        int character_base_addr = character_base*16*1024;
+
+        int px = bg_x%8;
+        int py = bg_y%8;
+
+        int tile_off = (bg_tile_y%32)*32+(bg_tile_x%32);
+        if(bg_tile_x>=32)tile_off+=32*32;
+        if(bg_tile_y>=32)tile_off+=32*32*(screen_size==3?2:1);
+        uint16_t tile_data=*(uint16_t*)(gba->mem.vram+screen_base_addr+tile_off*2);
+
+        int h_flip = SB_BFE(tile_data,10,1);
+        int v_flip = SB_BFE(tile_data,11,1);
+        if(h_flip)px=7-px;
+        if(v_flip)py=7-py;
+        int tile_id = SB_BFE(tile_data,0,10);
+        int palette = SB_BFE(tile_data,12,4);
+
+        uint8_t tile_d=tile_id;
+        if(colors==false){
+          int addr = character_base_addr+tile_id*8*4+px/2+py*4;
+          tile_d=gba->mem.vram[addr];
+          tile_d= (tile_d>>((px&1)*4))&0xf;
+          //There is an undocumented GBA quirk where tiles over 64KB are not loaded
+          //https://github.com/skylersaleh/SkyEmu/issues/292
+          if(tile_d==0||SB_UNLIKELY(addr>=0x10000))continue;
+          tile_d+=palette*16;
+        }else{
+          //There is an undocumented GBA quirk where tiles over 64KB are not loaded
+          //https://github.com/skylersaleh/SkyEmu/issues/292
+          int addr=character_base_addr+tile_id*8*8+px+py*8;
+          tile_d=gba->mem.vram[addr];
+          if(tile_d==0||SB_UNLIKELY(addr>=0x10000))continue;
+        }
+        uint8_t pallete_id = tile_d;
+        col = *(uint16_t*)(gba->mem.palette+GBA_BG_PALETTE+pallete_id*2);
+      }
+      col |= (bg<<17) | ((5-priority)<<28)|((4-bg)<<25);
+      if(col>gba->first_target_buffer[lcd_x]){
+        uint32_t t = gba->first_target_buffer[lcd_x];
+        gba->first_target_buffer[lcd_x]=col;
+        col = t;
+      }
+      if(col>gba->second_target_buffer[lcd_x])gba->second_target_buffer[lcd_x]=col;          
+    }
+  }
+  uint32_t col = gba->first_target_buffer[lcd_x];
+  uint32_t type = SB_BFE(col,17,3);
+  bool effect_enable = SB_BFE(window_control,5,1);
+  uint16_t bldcnt = gba_io_read16(gba,GBA_BLDCNT);
+  int mode = SB_BFE(bldcnt,6,2);
+  uint32_t type2 = SB_BFE(gba->second_target_buffer[lcd_x],17,3);
+  bool blend = SB_BFE(bldcnt,8+type2,1);
+  //Semitransparent objects are always selected for blending
+  if(SB_BFE(col,16,1)&&blend){mode=1;effect_enable=true;}
+  else effect_enable &= SB_BFE(bldcnt,type,1);
+  if(!effect_enable||(mode==1&&!blend))mode = GBA_EFFECT_NONE;
+  return mode;
+}
+// Applies the color effects gba_ppu_render_pixel picked to a span of the line, writes it to the 
+// framebuffer and resets the target buffers to the backdrop. Stores that change the registers 
+// split the spans, so only the effect varies per pixel. Every effect is computed for every pixel 
+// and the picked one is selected without branches, which the compiler vectorizes.
+static void gba_ppu_output_span(gba_t* gba, int x_start, int x_end, const uint8_t* effect){
+  uint16_t dispcnt = gba_io_read16(gba,GBA_DISPCNT);
+  uint16_t bldalpha = gba_io_read16(gba,GBA_BLDALPHA);
+  uint32_t eva = SB_BFE(bldalpha,0,5), evb = SB_BFE(bldalpha,8,5), evy = SB_BFE(gba_io_read16(gba,GBA_BLDY),0,5);
+  if(eva>16)eva=16;
+  if(evb>16)evb=16;
+  if(evy>16)evy=16;
+  uint32_t* fb = (uint32_t*)(gba->framebuffer+gba->ppu.line_render_y*GBA_LCD_W*4);
+  uint32_t* first = gba->first_target_buffer;
+  uint32_t* second = gba->second_target_buffer;
+  // Green swap puts the green of each pixel into the other pixel of its pair, an odd first pixel
+  // already got its green from the previous span
+  bool green_swap = gba_io_read16(gba,GBA_GREENSWP)&1;
+  uint8_t* fb8 = (uint8_t*)fb;
+  uint8_t swapped_green = fb8[x_start*4+1];
+  if(SB_BFE(dispcnt,7,1)){
+    // Forced blank, 255*8 wraps to 248 in the 8 bit channels
+    uint32_t c = gba->stop_mode? 0: 0xf8f8f8;
+    for(int x=x_start;x<x_end;++x)fb[x]=(fb[x]&0xff000000)|c;
+  }else{
+    int x = x_start;
+#ifdef SB_SIMD_WASM
+    v128_t c31 = wasm_i32x4_splat(31), c15 = wasm_i32x4_splat(15), c0x1f = wasm_i32x4_splat(0x1f);
+    v128_t v_eva = wasm_i32x4_splat(eva), v_evb = wasm_i32x4_splat(evb), v_evy = wasm_i32x4_splat(evy);
+    for(;x+4<=x_end;x+=4){
+      v128_t e = wasm_u32x4_make(effect[x],effect[x+1],effect[x+2],effect[x+3]);
+      v128_t c1 = wasm_v128_load(first+x), c2 = wasm_v128_load(second+x);
+      v128_t out = wasm_v128_and(wasm_v128_load(fb+x),wasm_i32x4_splat(0xff000000));
+      for(int ch=0;ch<3;++ch){
+        v128_t v1 = wasm_v128_and(wasm_u32x4_shr(c1,ch*5),c0x1f), v2 = wasm_v128_and(wasm_u32x4_shr(c2,ch*5),c0x1f);
+        v128_t alpha = wasm_i32x4_min(wasm_u32x4_shr(wasm_i32x4_add(wasm_i32x4_mul(v1,v_eva),wasm_i32x4_mul(v2,v_evb)),4),c31);
+        v128_t lighten = wasm_i32x4_add(v1,wasm_u32x4_shr(wasm_i32x4_mul(wasm_i32x4_sub(c31,v1),v_evy),4));
+        v128_t darken = wasm_i32x4_sub(v1,wasm_u32x4_shr(wasm_i32x4_add(wasm_i32x4_mul(v1,v_evy),c15),4));
+        v128_t v = wasm_v128_bitselect(alpha,v1,wasm_i32x4_eq(e,wasm_i32x4_splat(GBA_EFFECT_ALPHA)));
+        v = wasm_v128_bitselect(lighten,v,wasm_i32x4_eq(e,wasm_i32x4_splat(GBA_EFFECT_LIGHTEN)));
+        v = wasm_v128_bitselect(darken,v,wasm_i32x4_eq(e,wasm_i32x4_splat(GBA_EFFECT_DARKEN)));
+        out = wasm_v128_or(out,wasm_i32x4_shl(v,ch*8+3));
+      }
+      wasm_v128_store(fb+x,out);
+    }
+#endif
+    for(;x<x_end;++x){
+      uint32_t c1 = first[x], c2 = second[x], e = effect[x];
+      uint32_t out = fb[x]&0xff000000;
+      for(int ch=0;ch<3;++ch){
+        uint32_t v1 = SB_BFE(c1,ch*5,5), v2 = SB_BFE(c2,ch*5,5);
+        uint32_t alpha = (v1*eva+v2*evb)>>4;
+        alpha = alpha>31? 31: alpha;
+        uint32_t lighten = v1+(((31-v1)*evy)>>4);
+        uint32_t darken = v1-((v1*evy+15)>>4);
+        uint32_t v = e==GBA_EFFECT_ALPHA? alpha: e==GBA_EFFECT_LIGHTEN? lighten: e==GBA_EFFECT_DARKEN? darken: v1;
+        out|= v<<(ch*8+3);
+      }
+      fb[x] = out;
+    }
+  }
+  if(SB_UNLIKELY(green_swap)){
+    uint8_t green[GBA_LCD_W];
+    for(int x=x_start;x<x_end;++x)green[x]=fb8[x*4+1];
+    if(x_start&1)fb8[x_start*4+1] = swapped_green;
+    for(int x=x_start;x<x_end;++x)fb8[(x^1)*4+1]=green[x];
+  }
+  uint32_t backdrop_col = (*(uint16_t*)(gba->mem.palette + GBA_BG_PALETTE))|(5<<17);
+  for(int x=x_start;x<x_end;++x)first[x]=second[x]=backdrop_col;
+}
+// Bitmap mode spans where BG2 is the only layer, unscaled and without windows, effects, mosaic, 
+// wraparound or green swap are a straight conversion of a VRAM row, so they skip the compositing.
+// Returns false if the span needs the general path.
+static bool gba_ppu_render_bitmap_span(gba_t* gba, int x_start, int x_end){
+  uint16_t dispcnt = gba_io_read16(gba,GBA_DISPCNT);
+  int bg_mode = SB_BFE(dispcnt,0,3);
+  if(bg_mode<3||bg_mode>5)return false;
+  // Forced blank, BG/OBJ enables and windows
+  if((dispcnt&0xff80)!=(1<<10)||!SB_BFE(gba->ppu.dispcnt_pipeline[0],10,1))return false;
+  if(SB_BFE(gba_io_read16(gba,GBA_BG2CNT),6,1)||SB_BFE(gba_io_read16(gba,GBA_BG2CNT),13,1))return false;
+  uint16_t bldcnt = gba_io_read16(gba,GBA_BLDCNT);
+  // Effects that BG2 or the backdrop are the first target of
+  if(SB_BFE(bldcnt,6,2)&&(bldcnt&((1<<2)|(1<<5))))return false;
+  if(gba_io_read16(gba,GBA_GREENSWP)&1)return false;
+  if(gba_io_read16(gba,GBA_BG2PA)!=0x100||gba_io_read16(gba,GBA_BG2PC)!=0)return false;
+
+  int size_x = bg_mode==5? 160: 240, size_y = bg_mode==5? 128: 160;
+  uint32_t frame_base = bg_mode>=4? SB_BFE(dispcnt,4,1)*0xA000: 0;
+  int32_t x_off = gba->ppu.aff[0].render_bgx>>8, row = gba->ppu.aff[0].render_bgy>>8;
+  const uint16_t* palette = (const uint16_t*)(gba->mem.palette+GBA_BG_PALETTE);
+  uint16_t backdrop = palette[0];
+  // Pixels [x_in,x_out) of the span are on the bitmap, the rest show the backdrop
+  int x_in = x_start, x_out = x_end;
+  if((uint32_t)row>=(uint32_t)size_y)x_out = x_in;
+  if(x_in<-x_off)x_in = -x_off;
+  if(x_out>size_x-x_off)x_out = size_x-x_off;
+  if(x_out<x_in)x_out = x_in;
+
+  uint16_t line[GBA_LCD_W];
+  for(int x=x_start;x<x_end;++x)line[x]=backdrop;
+  if(bg_mode==4){
+    const uint8_t* src = gba->mem.vram+frame_base+row*size_x+x_off;
+    for(int x=x_in;x<x_out;++x)line[x]= src[x]? palette[src[x]]: backdrop;
+  }else{
+    const uint16_t* src = (const uint16_t*)(gba->mem.vram+frame_base)+row*size_x+x_off;
+    for(int x=x_in;x<x_out;++x)line[x]=src[x];
+  }
+  // Branch free so the compiler can vectorize it
+  uint8_t* fb = gba->framebuffer+gba->ppu.line_render_y*GBA_LCD_W*4;
+  for(int x=x_start;x<x_end;++x){
+    uint16_t c = line[x];
+    fb[x*4+0] = SB_BFE(c,0,5)*8;
+    fb[x*4+1] = SB_BFE(c,5,5)*8;
+    fb[x*4+2] = SB_BFE(c,10,5)*8;
+  }
+  int backdrop_type = 5;
+  uint32_t backdrop_col = backdrop|(backdrop_type<<17);
+  for(int x=x_start;x<x_end;++x)gba->first_target_buffer[x]=gba->second_target_buffer[x]=backdrop_col;
+  return true;
+}
+// Composites the pending pixels of the current line up to (but not including) x_end
+static void gba_ppu_render_pixels(gba_t* gba, int x_end){
+  if(x_end>GBA_LCD_W)x_end=GBA_LCD_W;
+  int x_start = gba->ppu.line_render_x;
+  if(x_end<=x_start)return;
+  gba->ppu.line_render_x=x_end;
+  if(gba_ppu_render_bitmap_span(gba,x_start,x_end))return;
+  uint32_t affine[2][GBA_LCD_W];
+  uint16_t dispcnt = gba_io_read16(gba,GBA_DISPCNT);
+  int bg_mode = SB_BFE(dispcnt,0,3);
+  for(int bg=2;bg<4;++bg){
+    // Same BGs gba_ppu_render_pixel draws with rotation/scaling
+    bool rot_scale = bg_mode>=1&&bg_mode<=5&&!(bg==3&&bg_mode!=2);
+    bool bg_en = SB_BFE(dispcnt,8+bg,1)&&SB_BFE(gba->ppu.dispcnt_pipeline[0],8+bg,1);
+    // Skip BGs the windows hide over the whole line
+    bg_en&= SB_BFE(gba->window_spans.line_any,bg,1);
+    if(rot_scale&&bg_en)gba_ppu_affine_line(gba,bg,bg_mode,x_start,x_end,affine[bg-2]);
+  }
+  uint8_t effect[GBA_LCD_W];
+  for(int x=x_start;x<x_end;++x)effect[x]=gba_ppu_render_pixel(gba,x,gba->ppu.line_render_y,affine);
+  gba_ppu_output_span(gba,x_start,x_end,effect);
+}
+// Must be called before any store that can change the output of pixels that haven't been drawn yet
+static FORCE_INLINE void gba_ppu_catch_up(gba_t* gba){
+  if(SB_LIKELY(!gba->ppu.line_render_pending))return;
+  // The pixel at x is drawn on the cycle the scan clock reaches x*4
+  int scanline_clock = (gba->ppu.scan_clock-gba->ppu.fast_forward_ticks)%1232;
+  gba_ppu_render_pixels(gba,(scanline_clock+3)/4);
+}
 static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
   if(SB_LIKELY(gba->ppu.fast_forward_ticks>0)){
     gba->ppu.fast_forward_ticks--;
@@ -1834,6 +2408,11 @@ static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
   }
 
   if(gba->ppu.scan_clock>=280896)gba->ppu.scan_clock-=280896;
+  // The fast forward always stops on both of these clocks
+  if(SB_UNLIKELY(gba->mem.video_capture)){
+    int scanline_clock = gba->ppu.scan_clock%1232;
+    if(scanline_clock==0||scanline_clock==GBA_LCD_HBLANK_START*4)gba->mem.video_capture->sync(gba->mem.video_capture->user_data,gba->ppu.scan_clock);
+  }
   int lcd_y = (gba->ppu.scan_clock)/1232;
   int lcd_x = ((gba->ppu.scan_clock)%1232)/4;
   gba->ppu.scan_clock++;
@@ -1880,7 +2459,11 @@ static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
   }
 
   if(!render)return; 
-  
+  // Finish the line before the HBlank updates to the affine and sprite state
+  if(lcd_x==GBA_LCD_HBLANK_START&&gba->ppu.line_render_pending){
+    gba_ppu_render_pixels(gba,GBA_LCD_W);
+    gba->ppu.line_render_pending = false;
+  }
   if(lcd_x==GBA_LCD_HBLANK_START){
     uint16_t dispcnt = gba->ppu.dispcnt_pipeline[0];
     int bg_mode = SB_BFE(dispcnt,0,3);
@@ -1929,7 +2512,6 @@ static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
   uint16_t dispcnt = gba_io_read16(gba,GBA_DISPCNT);
   int bg_mode = SB_BFE(dispcnt,0,3);
   int obj_vram_map_2d = !SB_BFE(dispcnt,6,1);
-  int forced_blank = SB_BFE(dispcnt,7,1);
   bool visible = lcd_x<240 && lcd_y<160;
   //Render sprites over scanline when it completes
   if((lcd_y<159 || lcd_y ==227) && lcd_x == GBA_LCD_HBLANK_START){
@@ -1944,15 +2526,46 @@ static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
     uint8_t default_window_control =0x3f;//bitfield [0-3:bg0-bg3 enable 4:obj enable, 5: special effect enable]
     bool winout_enable = SB_BFE(dispcnt,13,3)!=0;
     uint16_t WINOUT = gba_io_read16(gba, GBA_WINOUT);
-    if(winout_enable)default_window_control = SB_BFE(WINOUT,0,8);
-  
-    for(int x=0;x<240;++x){gba->window[x] = default_window_control;}
+    if(winout_enable)default_window_control = SB_BFE(WINOUT,0,6);
+    int enabled_windows = SB_BFE(dispcnt,13,3); // [0: win0, 1:win1, 2: objwin]
+    uint8_t win_value[2]={0,0};
+    int win_xmin[2]={0,0}, win_xmax[2]={0,0};
+    int active_windows = 0;
+    for(int win=0;win<2;++win){
+      if(!SB_BFE(enabled_windows,win,1))continue;
+      uint16_t WINH = gba_io_read16(gba, GBA_WIN0H+2*win);
+      uint16_t WINV = gba_io_read16(gba, GBA_WIN0V+2*win);
+      win_xmin[win] = SB_BFE(WINH,8,8);
+      win_xmax[win] = SB_BFE(WINH,0,8);
+      int win_ymin = SB_BFE(WINV,8,8);
+      int win_ymax = SB_BFE(WINV,0,8);
+      // Garbage values of X2>240 or X1>X2 are interpreted as X2=240.
+      // Garbage values of Y2>160 or Y1>Y2 are interpreted as Y2=160. 
+      if(win_xmin[win]>win_xmax[win])win_xmax[win]=240;
+      if(win_ymin>win_ymax)win_ymax=161;
+      if(win_xmax[win]>240)win_xmax[win]=240;
+      if(sprite_lcd_y<win_ymin||sprite_lcd_y>=win_ymax)continue;
+      win_value[win] = SB_BFE(gba_io_read16(gba,GBA_WININ),win*8,6);
+      active_windows|=1<<win;
+    }
+    sb_window_spans_t* spans = &gba->window_spans;
+    sb_update_window_spans(spans,gba->window,GBA_LCD_W,default_window_control,win_value,win_xmin,win_xmax,active_windows);
     uint8_t obj_window_control = default_window_control;
     bool obj_window_enable = SB_BFE(dispcnt,15,1);
     if(obj_window_enable)obj_window_control = SB_BFE(WINOUT,8,6);
     bool display_obj = SB_BFE(dispcnt,12,1);
     if(display_obj){
-      for(int o=0;o<128;++o){
+      // Only walk the objects binned to this line when bins are available
+      int obj_count = 128;
+      const uint8_t* obj_list = NULL;
+      if(gba->mem.sprite_bins){
+        sb_sprite_bins_t* bins = gba->mem.sprite_bins;
+        sb_update_sprite_bins(bins,gba->mem.oam);
+        obj_count = bins->count[sprite_lcd_y&0xff];
+        obj_list = bins->objs[sprite_lcd_y&0xff];
+      }
+      for(int obj_index=0;obj_index<obj_count;++obj_index){
+        int o = obj_list? obj_list[obj_index]: obj_index;
         uint16_t attr0 = *(uint16_t*)(gba->mem.oam+o*8+0);
         //Attr0
         uint8_t y_coord = SB_BFE(attr0,0,8);
@@ -2069,7 +2682,7 @@ static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
 
             uint32_t col = *(uint16_t*)(gba->mem.palette+GBA_OBJ_PALETTE+palette_id*2);
             //Handle window objects(not displayed but control the windowing of other things)
-            if(obj_mode==2&&!transparent){gba->window[x]=obj_window_control; 
+            if(obj_mode==2&&!transparent){if(gba->window[x]&SB_WINDOW_OUTSIDE)gba->window[x]=obj_window_control; 
             }else if(obj_mode!=3){
               int type =4;
               col=col|(type<<17)|((5-priority)<<28)|((0x7)<<25);
@@ -2086,27 +2699,12 @@ static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
         }
       }
     }
-    int enabled_windows = SB_BFE(dispcnt,13,3); // [0: win0, 1:win1, 2: objwin]
-    if(enabled_windows){
-      for(int win=1;win>=0;--win){
-        bool win_enable = SB_BFE(dispcnt,13+win,1);
-        if(!win_enable)continue;
-        uint16_t WINH = gba_io_read16(gba, GBA_WIN0H+2*win);
-        uint16_t WINV = gba_io_read16(gba, GBA_WIN0V+2*win);
-        int win_xmin = SB_BFE(WINH,8,8);
-        int win_xmax = SB_BFE(WINH,0,8);
-        int win_ymin = SB_BFE(WINV,8,8);
-        int win_ymax = SB_BFE(WINV,0,8);
-        // Garbage values of X2>240 or X1>X2 are interpreted as X2=240.
-        // Garbage values of Y2>160 or Y1>Y2 are interpreted as Y2=160. 
-        if(win_xmin>win_xmax)win_xmax=240;
-        if(win_ymin>win_ymax)win_ymax=161;
-        if(win_xmax>240)win_xmax=240;
-        if(sprite_lcd_y<win_ymin||sprite_lcd_y>=win_ymax)continue;
-        uint16_t winin = gba_io_read16(gba,GBA_WININ);
-        uint8_t win_value = SB_BFE(winin,win*8,6);
-        for(int x=win_xmin;x<win_xmax;++x)gba->window[x] = win_value;
-      }
+    // The OBJ window can only change pixels outside of WIN0/WIN1
+    if(display_obj&&(spans->line_any&SB_WINDOW_OUTSIDE)){
+      spans->line_any|=obj_window_control;
+      spans->line_all&=obj_window_control;
+    }
+    if(enabled_windows&&!SB_BFE(spans->line_all,4,1)){
       int backdrop_type = 5;
       uint32_t backdrop_col = (*(uint16_t*)(gba->mem.palette + GBA_BG_PALETTE+0*2))|(backdrop_type<<17);
       for(int x=0;x<240;++x){
@@ -2117,238 +2715,11 @@ static FORCE_INLINE void gba_tick_ppu(gba_t* gba, bool render){
   }
 
   if(visible){
-    uint8_t window_control =gba->window[lcd_x];
-    if(bg_mode==6 ||bg_mode==7){
-      //Palette 0 is taken as the background
-    }else if (bg_mode<=5){     
-      for(int bg = 3; bg>=0;--bg){
-        uint32_t col =0;         
-        if((bg<2&&bg_mode==2)||(bg==3&&bg_mode==1)||(bg!=2&&bg_mode>=3))continue;
-        bool bg_en = SB_BFE(dispcnt,8+bg,1)&&SB_BFE(gba->ppu.dispcnt_pipeline[0],8+bg,1);
-        if(!bg_en || SB_BFE(window_control,bg,1)==0)continue;
-
-        bool rot_scale = bg_mode>=1&&bg>=2;
-        uint16_t bgcnt = gba_io_read16(gba, GBA_BG0CNT+bg*2);
-        int priority = SB_BFE(bgcnt,0,2);
-        int character_base = SB_BFE(bgcnt,2,2);
-        bool mosaic = SB_BFE(bgcnt,6,1);
-        bool colors = SB_BFE(bgcnt,7,1);
-        int screen_base = SB_BFE(bgcnt,8,5);
-        bool display_overflow =SB_BFE(bgcnt,13,1);
-        int screen_size = SB_BFE(bgcnt,14,2);
-
-        int screen_size_x = (screen_size&1)?512:256;
-        int screen_size_y = (screen_size>=2)?512:256;
-        
-        int bg_x = 0;
-        int bg_y = 0;
-        
-        if(rot_scale){
-          screen_size_x = screen_size_y = (16*8)<<screen_size;
-          if(bg_mode==3||bg_mode==4){
-            screen_size_x=240;
-            screen_size_y=160;
-          }else if(bg_mode==5){
-            screen_size_x=160;
-            screen_size_y=128;
-          }
-          colors = true;
-
-          int32_t bgx = gba->ppu.aff[bg-2].render_bgx;
-          int32_t bgy = gba->ppu.aff[bg-2].render_bgy;
-
-          int32_t a = (int16_t)gba_io_read16(gba,GBA_BG2PA+(bg-2)*0x10);
-          int32_t c = (int16_t)gba_io_read16(gba,GBA_BG2PC+(bg-2)*0x10);
-
-          // Shift lcd_coords into fixed point
-          int64_t x2 = a*lcd_x + (((int64_t)bgx));
-          int64_t y2 = c*lcd_x + (((int64_t)bgy));
-          if(mosaic){
-            int16_t mos_reg = gba_io_read16(gba,GBA_MOSAIC);
-            int mos_x = SB_BFE(mos_reg,0,4)+1;
-            x2 = a*((lcd_x/mos_x)*mos_x) + (((int64_t)bgx));
-            y2 = c*((lcd_x/mos_x)*mos_x) + (((int64_t)bgy));
-          }
-
-
-          bg_x = (x2>>8);
-          bg_y = (y2>>8);
-
-          if(display_overflow==0){
-            if(bg_x<0||bg_x>=screen_size_x||bg_y<0||bg_y>=screen_size_y)continue; 
-          }else{
-            bg_x%=screen_size_x;
-            bg_y%=screen_size_y;
-          }
-                              
-        }else{
-          int16_t hoff = gba_io_read16(gba,GBA_BG0HOFS+bg*4);
-          int16_t voff = gba_io_read16(gba,GBA_BG0VOFS+bg*4);
-          hoff=(hoff<<7)>>7;
-          voff=(voff<<7)>>7;
-          bg_x = (hoff+lcd_x);
-          bg_y = (voff+lcd_y);
-          if(mosaic){
-            uint16_t mos_reg = gba_io_read16(gba,GBA_MOSAIC);
-            int mos_x = SB_BFE(mos_reg,0,4)+1;
-            int mos_y = SB_BFE(mos_reg,4,4)+1;
-            bg_x = hoff+(lcd_x/mos_x)*mos_x;
-            bg_y = voff+(lcd_y/mos_y)*mos_y;
-          }
-        }
-        if(bg_mode==3){
-          int p = bg_x+bg_y*240;
-          int addr = p*2; 
-          col  = *(uint16_t*)(gba->mem.vram+addr);
-        }else if(bg_mode==4){
-          int p = bg_x+bg_y*240;
-          int frame_sel = SB_BFE(dispcnt,4,1);
-          int addr = p*1+0xA000*frame_sel; 
-          uint8_t pallete_id = gba->mem.vram[addr];
-          if(pallete_id==0)continue;
-          col = *(uint16_t*)(gba->mem.palette+GBA_BG_PALETTE+pallete_id*2);
-        }else if(bg_mode==5){
-          int p = bg_x+bg_y*160;
-          int frame_sel = SB_BFE(dispcnt,4,1);
-          int addr = p*2+0xA000*frame_sel; 
-          col  = *(uint16_t*)(gba->mem.vram+addr);
-        }else{
-          bg_x = bg_x&(screen_size_x-1);
-          bg_y = bg_y&(screen_size_y-1);
-          int bg_tile_x = bg_x/8;
-          int bg_tile_y = bg_y/8;
-
-          int tile_off = bg_tile_y*(screen_size_x/8)+bg_tile_x;
-
-          int screen_base_addr =    screen_base*2048;
-          int character_base_addr = character_base*16*1024;
-
-          uint16_t tile_data =0;
-
-          int px = bg_x%8;
-          int py = bg_y%8;
-
-          if(rot_scale)tile_data=gba->mem.vram[screen_base_addr+tile_off];
-          else{
-            int tile_off = (bg_tile_y%32)*32+(bg_tile_x%32);
-            if(bg_tile_x>=32)tile_off+=32*32;
-            if(bg_tile_y>=32)tile_off+=32*32*(screen_size==3?2:1);
-            tile_data=*(uint16_t*)(gba->mem.vram+screen_base_addr+tile_off*2);
-
-            int h_flip = SB_BFE(tile_data,10,1);
-            int v_flip = SB_BFE(tile_data,11,1);
-            if(h_flip)px=7-px;
-            if(v_flip)py=7-py;
-          }
-          int tile_id = SB_BFE(tile_data,0,10);
-          int palette = SB_BFE(tile_data,12,4);
-
-          uint8_t tile_d=tile_id;
-          if(colors==false){
-            int addr = character_base_addr+tile_id*8*4+px/2+py*4;
-            tile_d=gba->mem.vram[addr];
-            tile_d= (tile_d>>((px&1)*4))&0xf;
-            //There is an undocumented GBA quirk where tiles over 64KB are not loaded
-            //https://github.com/skylersaleh/SkyEmu/issues/292
-            if(tile_d==0||SB_UNLIKELY(addr>=0x10000))continue;
-            tile_d+=palette*16;
-          }else{
-            //There is an undocumented GBA quirk where tiles over 64KB are not loaded
-            //https://github.com/skylersaleh/SkyEmu/issues/292
-            int addr=character_base_addr+tile_id*8*8+px+py*8;
-            tile_d=gba->mem.vram[addr];
-            if(tile_d==0||SB_UNLIKELY(addr>=0x10000))continue;
-          }
-          uint8_t pallete_id = tile_d;
-          col = *(uint16_t*)(gba->mem.palette+GBA_BG_PALETTE+pallete_id*2);
-        }
-        col |= (bg<<17) | ((5-priority)<<28)|((4-bg)<<25);
-        if(col>gba->first_target_buffer[lcd_x]){
-          uint32_t t = gba->first_target_buffer[lcd_x];
-          gba->first_target_buffer[lcd_x]=col;
-          col = t;
-        }
-        if(col>gba->second_target_buffer[lcd_x])gba->second_target_buffer[lcd_x]=col;          
-      }
-    }
-    uint32_t col = gba->first_target_buffer[lcd_x];
-    int r = SB_BFE(col,0,5);
-    int g = SB_BFE(col,5,5);
-    int b = SB_BFE(col,10,5);
-    uint32_t type = SB_BFE(col,17,3);
-
-    bool effect_enable = SB_BFE(window_control,5,1);
-    uint16_t bldcnt = gba_io_read16(gba,GBA_BLDCNT);
-    int mode = SB_BFE(bldcnt,6,2);
-
-    //Semitransparent objects are always selected for blending
-    if(SB_BFE(col,16,1)){
-      uint32_t col2 = gba->second_target_buffer[lcd_x];
-      uint32_t type2 = SB_BFE(col2,17,3);
-      bool blend = SB_BFE(bldcnt,8+type2,1);
-      if(blend){mode=1;effect_enable=true;}
-      else effect_enable &= SB_BFE(bldcnt,type,1);
-    }else effect_enable &= SB_BFE(bldcnt,type,1);
-    if(effect_enable){
-      uint16_t bldy = gba_io_read16(gba,GBA_BLDY);
-      float evy = SB_BFE(bldy,0,5)/16.;
-      if(evy>1.0)evy=1;
-      switch(mode){
-        case 0: break; //None
-        case 1: {
-          uint32_t col2 = gba->second_target_buffer[lcd_x];
-          uint32_t type2 = SB_BFE(col2,17,3);
-          bool blend = SB_BFE(bldcnt,8+type2,1);
-          if(blend){
-            uint16_t bldalpha= gba_io_read16(gba,GBA_BLDALPHA);
-            int r2 = SB_BFE(col2,0,5);
-            int g2 = SB_BFE(col2,5,5);
-            int b2 = SB_BFE(col2,10,5);
-            int eva = SB_BFE(bldalpha,0,5);
-            int evb = SB_BFE(bldalpha,8,5);
-            if(eva>16)eva=16;
-            if(evb>16)evb=16;
-            r = (r*eva+r2*evb)/16;
-            g = (g*eva+g2*evb)/16;
-            b = (b*eva+b2*evb)/16;
-            if(r>31)r = 31;
-            if(g>31)g = 31;
-            if(b>31)b = 31;
-          }
-        }break; //Alpha Blend
-        case 2: //Lighten
-          r = r+(31-r)*evy;
-          g = g+(31-g)*evy;
-          b = b+(31-b)*evy;  
-          break; 
-        case 3: //Darken
-          r = r-(r)*evy;
-          g = g-(g)*evy;
-          b = b-(b)*evy;         
-          break; 
-      }
-    }
-    if(forced_blank){
-      r=g=b=255;
-      if(gba->stop_mode)r=g=b=0;
-    }
-
-    int backdrop_type = 5;
-    uint32_t backdrop_col = (*(uint16_t*)(gba->mem.palette + GBA_BG_PALETTE+0*2))|(backdrop_type<<17);
-    gba->first_target_buffer[lcd_x] = backdrop_col;
-    gba->second_target_buffer[lcd_x] = backdrop_col;
-
-    int p = (lcd_x+lcd_y*240)*4;
-    float screen_blend_factor = 0.3*gba->ppu.ghosting_strength;
-    uint16_t green_swap = gba_io_read16(gba,GBA_GREENSWP);
-    gba->framebuffer[p+0] = r*8*(1.0-screen_blend_factor)+gba->framebuffer[p+0]*screen_blend_factor;
-    gba->framebuffer[p+2] = b*8*(1.0-screen_blend_factor)+gba->framebuffer[p+2]*screen_blend_factor;  
-
-    if(green_swap&1){
-      if(p&4) gba->framebuffer[p+1-4] = g*8*(1.0-screen_blend_factor)+gba->framebuffer[p+1-4]*screen_blend_factor;
-      else gba->framebuffer[p+1+4] = g*8*(1.0-screen_blend_factor)+gba->framebuffer[p+1+4]*screen_blend_factor;
-    }else{
-      gba->framebuffer[p+1] = g*8*(1.0-screen_blend_factor)+gba->framebuffer[p+1]*screen_blend_factor;
+    // Pixels are drawn by the catch up renderer, this just opens the line
+    if(lcd_x==0){
+      gba->ppu.line_render_pending = true;
+      gba->ppu.line_render_x = 0;
+      gba->ppu.line_render_y = lcd_y;
     }
   }
 }
@@ -2390,18 +2761,90 @@ static void gba_tick_keypad(sb_joy_t*joy, gba_t* gba){
   }
 
 }
+// Time the EEPROM stays busy after a block write (~6.5ms)
+#define GBA_EEPROM_WRITE_CYCLES 108368
+// Host pointer to element offset of a DMA bitstream when all size elements sit in one work RAM page, else NULL
+static FORCE_INLINE uint8_t* gba_eeprom_bitstream_ptr(gba_t *gba, uint32_t address, int offset, int size, int elem_size, int dir){
+  uint32_t first = address+offset*elem_size*dir;
+  uint32_t last = address+(offset+size-1)*elem_size*dir;
+  if(!gba->mem.page_table||(first>>GBA_PAGE_SHIFT)!=(last>>GBA_PAGE_SHIFT))return NULL;
+  if((first>>24)!=0x2&&(first>>24)!=0x3)return NULL;
+  uint8_t* page = gba->mem.page_table->pages[first>>GBA_PAGE_SHIFT];
+  return page? page+(first&(GBA_PAGE_SIZE-2)): NULL;
+}
 uint64_t gba_read_eeprom_bitstream(gba_t *gba, uint32_t source_address, int offset, int size, int elem_size, int dir){
   uint64_t data = 0; 
+  uint8_t* p = gba_eeprom_bitstream_ptr(gba,source_address,offset,size,elem_size,dir);
+  if(p){
+    for(int i=0;i<size;++i)data = (data<<1)|(*(uint16_t*)(p+i*elem_size*dir)&1);
+    return data;
+  }
   for(int i=0;i<size;++i){
     data|= ((uint64_t)(gba_read16(gba,source_address+(i+offset)*elem_size*dir)&1))<<(size-i-1);
   }
   return data; 
 }
 void gba_store_eeprom_bitstream(gba_t *gba, uint32_t source_address, int offset, int size, int elem_size, int dir,uint64_t data){
+  uint8_t* p = gba_eeprom_bitstream_ptr(gba,source_address,offset,size,elem_size,dir);
+  if(p){
+    for(int i=0;i<size;++i)*(uint16_t*)(p+i*elem_size*dir)=data>>(size-i-1)&1;
+    gba->mem.idle_loop_side_effects++;
+    return;
+  }
   for(int i=0;i<size;++i){
     gba_store16(gba,source_address+(i+offset)*elem_size*dir,data>>(size-i-1)&1);
   }
 }
+static FORCE_INLINE int gba_scheduler_cycles_to_next_event(gba_t* gba);
+// Runs the remaining transfers of DMA channel i that fit before the next scheduled event and stay
+// within one host page, so no IRQ, timer, PPU or other DMA could observe the intermediate state.
+// Returns the cycles charged, 0 when the channel has to step one transfer at a time.
+static FORCE_INLINE int gba_dma_burst(gba_t* gba, int i, uint32_t src, uint32_t dst, int src_dir, int dst_dir, bool type, uint32_t cnt, int ticks){
+  uint32_t x = gba->dma[i].current_transaction;
+  // activate_dmas is set here when a higher priority channel is still in its startup delay
+  if(x+1>=cnt||dst_dir!=1||src_dir<0||gba->activate_dmas||!gba->mem.page_table)return 0;
+  int transfer_bytes = type? 4:2;
+  uint32_t src_addr = src+x*transfer_bytes*src_dir;
+  uint32_t dst_addr = dst+x*transfer_bytes;
+  if(src_addr<0x02000000||src_addr>=0x10000000||dst_addr>=0x10000000)return 0;
+  // VRAM writes are only invisible when the PPU isn't drawing the line
+  if((dst_addr>>24)==0x6&&gba->ppu.line_render_pending)return 0;
+  uintptr_t src_page = (uintptr_t)gba->mem.page_table->pages[src_addr>>GBA_PAGE_SHIFT];
+  uintptr_t dst_page = (uintptr_t)gba->mem.page_table->pages[dst_addr>>GBA_PAGE_SHIFT];
+  if(!src_page||!dst_page||(dst_page&GBA_PAGE_ROM))return 0;
+
+  // All transfers after the first are sequential
+  int cost = gba_compute_access_cycles_dma(gba,src_addr,type?2:0)+gba_compute_access_cycles_dma(gba,dst_addr,type?2:0);
+  int budget = gba_scheduler_cycles_to_next_event(gba)-1-ticks;
+  uint32_t n = cnt-x;
+  if(budget<cost*2)return 0;
+  if(n>budget/cost)n=budget/cost;
+  uint32_t dst_left = (GBA_PAGE_SIZE-(dst_addr&(GBA_PAGE_SIZE-1)))/transfer_bytes;
+  uint32_t src_left = (GBA_PAGE_SIZE-(src_addr&(GBA_PAGE_SIZE-1)))/transfer_bytes;
+  if(n>dst_left)n=dst_left;
+  if(src_dir&&n>src_left)n=src_left;
+  if(n<2)return 0;
+
+  uint8_t* s = (uint8_t*)(src_page&~(uintptr_t)GBA_PAGE_ROM)+(src_addr&(GBA_PAGE_SIZE-1));
+  uint8_t* d = (uint8_t*)dst_page+(dst_addr&(GBA_PAGE_SIZE-1));
+  // Element wise so overlapping ranges behave like the hardware
+  if(type)for(uint32_t e=0;e<n-1;++e)((uint32_t*)d)[e]=((uint32_t*)s)[e*src_dir];
+  else    for(uint32_t e=0;e<n-1;++e)((uint16_t*)d)[e]=((uint16_t*)s)[e*src_dir];
+  // The last transfer takes the regular path so the latch and open bus end up the same
+  uint32_t last_src = src_addr+(n-1)*transfer_bytes*src_dir;
+  uint32_t last_dst = dst_addr+(n-1)*transfer_bytes;
+  if(type){
+    gba->dma[i].latched_transfer = gba_read32(gba,last_src);
+    gba_dma_write32(gba,last_dst,gba->dma[i].latched_transfer);
+  }else{
+    gba->dma[i].latched_transfer = gba_read16(gba,last_src)&0xffff;
+    gba->dma[i].latched_transfer |= gba->dma[i].latched_transfer<<16;
+    gba_dma_write16(gba,last_dst,gba->dma[i].latched_transfer&0xffff);
+  }
+  gba->dma[i].current_transaction+=n;
+  SB_PERF_COUNT(&gba->perf,SB_COUNTER_DMA_BYTES,n*transfer_bytes);
+  return cost*n;
+}
 static FORCE_INLINE int gba_tick_dma(gba_t*gba, int last_tick){
   int ticks =0;
   gba->activate_dmas=false;
@@ -2535,12 +2978,14 @@ static FORCE_INLINE int gba_tick_dma(gba_t*gba, int last_tick){
             uint64_t data = gba_read_eeprom_bitstream(gba, src, 2+6, 64, type?4:2, src_dir); 
             ((uint64_t*)gba->mem.cart_backup)[addr]=data;
             gba->cart.backup_is_dirty=true;
+            gba->mem.eeprom_ready_clock = gba->rtc.total_clocks_ticked+GBA_EEPROM_WRITE_CYCLES;
           }else if(cnt==81){
             // Write data 14 bit address
             uint32_t addr = gba_read_eeprom_bitstream(gba, src, 2, 14, type?4:2, src_dir)&0x3ff;
             uint64_t data = gba_read_eeprom_bitstream(gba, src, 2+14, 64, type?4:2, src_dir); 
             ((uint64_t*)gba->mem.cart_backup)[addr]=data;
             gba->cart.backup_is_dirty=true;
+            gba->mem.eeprom_ready_clock = gba->rtc.total_clocks_ticked+GBA_EEPROM_WRITE_CYCLES;
           }else if(cnt==9){
             // 2 bits "11" (Read Request)
             // 6 bits eeprom address (MSB first)
@@ -2567,6 +3012,13 @@ static FORCE_INLINE int gba_tick_dma(gba_t*gba, int last_tick){
           }
           gba->dma[i].current_transaction=cnt;
         }
+        if(skip_dma){
+          // The whole command is retired at once, charge the bus time of every transfer
+          int size = type? 2:0;
+          ticks+=gba_compute_access_cycles_dma(gba,src,size+1)+gba_compute_access_cycles_dma(gba,dst,size+1);
+          ticks+=(cnt-1)*(gba_compute_access_cycles_dma(gba,src,size)+gba_compute_access_cycles_dma(gba,dst,size));
+          SB_PERF_COUNT(&gba->perf,SB_COUNTER_DMA_BYTES,cnt*transfer_bytes);
+        }
       }
       bool audio_dma = (mode==3) && (i==1||i==2);
       if(audio_dma){
@@ -2586,6 +3038,7 @@ static FORCE_INLINE int gba_tick_dma(gba_t*gba, int last_tick){
         dst_addr_ctl= 2; 
         transfer_bytes=4;
         cnt=4;
+        SB_PERF_COUNT(&gba->perf,SB_COUNTER_DMA_BYTES,16);
         skip_dma=true;
         gba->dma[i].current_transaction=cnt;
       }else if(!skip_dma){
@@ -2596,6 +3049,7 @@ static FORCE_INLINE int gba_tick_dma(gba_t*gba, int last_tick){
         // and Tomb Raider
         if(gba->dma[i].current_transaction<cnt){
           int x = gba->dma[i].current_transaction++;
+          SB_PERF_COUNT(&gba->perf,SB_COUNTER_DMA_BYTES,transfer_bytes);
           int dst_addr = dst+x*transfer_bytes*dst_dir;
           int src_addr = src+x*transfer_bytes*src_dir;
           if(type){
@@ -2615,6 +3069,7 @@ static FORCE_INLINE int gba_tick_dma(gba_t*gba, int last_tick){
             gba_dma_write16(gba,dst_addr,v&0xffff);
             ticks+=gba_compute_access_cycles_dma(gba, dst_addr, x!=0||force_first_write_sequential? 0:1);
           }
+          ticks+=gba_dma_burst(gba,i,src,dst,src_dir,dst_dir,type,cnt,ticks);
         }
       }
       
@@ -2654,9 +3109,67 @@ static FORCE_INLINE int gba_tick_dma(gba_t*gba, int last_tick){
 
   return ticks; 
 }                                              
-static FORCE_INLINE void gba_tick_sio(gba_t* gba){
-  //Just a stub for now;
+static void gba_finish_sio_transfer(gba_t* gba, uint16_t siocnt){
+  if(SB_BFE(siocnt,14,1))gba_send_interrupt(gba,4,1<<GBA_INT_SERIAL);
+  gba_io_store16(gba,GBA_SIOCNT,siocnt&~(1<<7));
+  gba->sio.last_active=false;
+}
+// Normal (8 and 32 bit) and multiplayer transfers over the link cable. UART and JOY Bus modes
+// aren't connected.
+static void gba_tick_sio_link(sb_emu_state_t* emu, gba_t* gba, uint16_t siocnt){
+  sb_link_port_t* port = emu->link->port+emu->link_port;
+  bool active = SB_BFE(siocnt,7,1);
+  int mode = SB_BFE(gba_io_read16(gba,GBA_RCNT),15,1)? 3: SB_BFE(siocnt,12,2);
+  if(mode==2){
+    // SI is low for the parent, SD is high since every console is ready and the ID is the port
+    uint16_t status = ((emu->link_port!=0)<<2)|(1<<3)|((emu->link_port&3)<<4);
+    if((siocnt&0x3c)!=status){
+      siocnt = (siocnt&~0x3c)|status;
+      gba_io_store16(gba,GBA_SIOCNT,siocnt);
+    }
+    port->send = gba_io_read16(gba,GBA_SIOMLT_SEND);
+    if(emu->link_port==0&&active&&!port->done){
+      if(sb_link_try_transfer(emu->link,0,SB_LINK_MULTIPLAYER))emu->link_yield = true;
+    }
+    if(port->done){
+      port->done = false;
+      for(int p=0;p<4;++p)gba_io_store16(gba,GBA_SIOMULTI0+p*2,emu->link->multi[p]);
+      gba_finish_sio_transfer(gba,siocnt);
+    }
+    return;
+  }
+  if(mode==3||!active){
+    port->ready = false;
+    return;
+  }
+  bool bits32 = mode==1;
+  port->send = bits32? gba_io_read32(gba,GBA_SIODATA32): gba_io_read8(gba,GBA_SIODATA8);
+  if(!SB_BFE(siocnt,0,1))port->ready = true;
+  else{
+    if(gba->sio.last_active==false){
+      gba->sio.last_active =true;
+      gba->sio.ticks_till_transfer_done=8*8;
+    }
+    gba->sio.ticks_till_transfer_done--;
+    if(gba->sio.ticks_till_transfer_done<=0&&!port->done){
+      bool first_try = !port->ready;
+      port->ready = true;
+      if(sb_link_try_transfer(emu->link,emu->link_port,SB_LINK_NORMAL)||first_try)emu->link_yield = true;
+    }
+  }
+  if(port->done){
+    port->done = false;
+    if(bits32)gba_io_store32(gba,GBA_SIODATA32,port->recv);
+    else gba_io_store8(gba,GBA_SIODATA8,port->recv);
+    gba_finish_sio_transfer(gba,siocnt);
+  }
+}
+static FORCE_INLINE void gba_tick_sio(sb_emu_state_t* emu, gba_t* gba){
   uint16_t siocnt = gba_io_read16(gba,GBA_SIOCNT);
+  if(SB_UNLIKELY(emu->link)){
+    gba_tick_sio_link(emu,gba,siocnt);
+    return;
+  }
   bool active = SB_BFE(siocnt,7,1);
   bool irq_enabled = SB_BFE(siocnt,14,1);
   if(active){
@@ -2752,6 +3265,7 @@ static void gba_compute_timers(gba_t* gba){
             int size = (gba->audio.fifo[i].write_ptr-gba->audio.fifo[i].read_ptr)&0x1f;
             while(samples_to_pop--&& size){
               gba->audio.fifo[i].read_ptr=(gba->audio.fifo[i].read_ptr+1)&0x1f;
+              gba_audio_log_fifo_pop(gba,i);
               --size;
             }
             if(size<GBA_AUDIO_DMA_ACTIVATE_THRESHOLD)gba->dma[i+1].activate_audio_dma=gba->activate_dmas=true;
@@ -2816,6 +3330,20 @@ static FORCE_INLINE void gba_tick_interrupts(gba_t*gba){
     gba->active_if_pipe_stages>>=1;
   }
 }
+// Ticks before the next pending IF stage is delivered, INT32_MAX when the pipeline is empty
+static FORCE_INLINE int gba_if_pipe_ticks_to_delivery(gba_t*gba){
+  int stages = gba->active_if_pipe_stages;
+  if(!stages)return INT32_MAX;
+  int t = 0;
+  while(!(stages&1)){stages>>=1;++t;}
+  return t;
+}
+// Moves the pipeline ticks cycles ahead, none of them may deliver a stage
+static FORCE_INLINE void gba_skip_interrupts(gba_t*gba, int ticks){
+  if(!gba->active_if_pipe_stages||ticks<=0)return;
+  for(int i=0;i<5;++i)gba->pipelined_if[i]= i+ticks<5? gba->pipelined_if[i+ticks]: 0;
+  gba->active_if_pipe_stages>>=ticks;
+}
 
 // Thanks fleroviux!
 uint64_t gba_decrypt_arv3(uint64_t code){
@@ -2837,6 +3365,39 @@ uint64_t gba_decrypt_arv3(uint64_t code){
 
   return ((uint64_t)l << 32) | r;
 }
+// Inverse of gba_decrypt_arv3, for codes generated by the emulator
+uint64_t gba_encrypt_arv3(uint64_t code){
+  const uint32_t S0 = 0x7AA9648F;
+  const uint32_t S1 = 0x7FAE6994;
+  const uint32_t S2 = 0xC0EFAAD5;
+  const uint32_t S3 = 0x42712C57;
+
+  uint32_t l = code >> 32;
+  uint32_t r = code & 0xFFFFFFFF;
+
+  uint32_t tmp = 0x9E3779B9;
+
+  for (int i = 0; i < 32; i++) {
+    l += ((r << 4) + S0) ^ (r + tmp) ^ ((r >> 5) + S1);
+    r += ((l << 4) + S2) ^ (l + tmp) ^ ((l >> 5) + S3);
+    tmp += 0x9E3779B9;
+  }
+
+  return ((uint64_t)l << 32) | r;
+}
+// Decrypts every code pair once so gba_run_ar_cheat doesn't have to each frame
+static bool gba_compile_ar_cheat(const uint32_t* buffer, uint32_t size, uint32_t* compiled){
+  if(size%2!=0){
+    printf("Invalid Action Replay cheat size:%d\n",size);
+    return false;
+  }
+  for(int i=0;i<size;i+=2){
+    uint64_t code=gba_decrypt_arv3(buffer[i+1] | ((uint64_t)buffer[i] << 32));
+    compiled[i]=code>>32;
+    compiled[i+1]=code&0xFFFFFFFF;
+  }
+  return true;
+}
 bool gba_handle_ar_if_instruction(gba_t* gba, uint32_t left, uint32_t right){
   uint32_t address = ((left<<4)&0x0F000000) | (left&0x000FFFFF);
   uint8_t current_code = (left>>24)&0xFF;
@@ -2904,6 +3465,7 @@ bool gba_handle_ar_if_instruction(gba_t* gba, uint32_t left, uint32_t right){
 
   return false;
 }
+// Runs codes already decrypted by gba_compile_ar_cheat
 bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size){
   if(size%2!=0){
     printf("Invalid Action Replay cheat size:%d\n",size);
@@ -2919,9 +3481,8 @@ bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size){
   bool ar_button_pressed = true;
 
   for(int i=0;i<size;i+=2){
-    uint64_t code=gba_decrypt_arv3(buffer[i+1] | ((uint64_t)buffer[i] << 32));
-    uint32_t left=code>>32;
-    uint32_t right=code&0xFFFFFFFF;
+    uint32_t left=buffer[i];
+    uint32_t right=buffer[i+1];
 
     if (!if_stack[if_stack_index])
       continue;
@@ -3082,7 +3643,7 @@ bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size){
         case 0x1E:{
           if(i+3>=size)return false;
           uint32_t address=0x8000000|((right&0xFFFFFF)<<1);
-          uint64_t decrypted=gba_decrypt_arv3(buffer[i+3] | ((uint64_t)buffer[i+2] << 32));
+          uint64_t decrypted=buffer[i+3] | ((uint64_t)buffer[i+2] << 32);
           uint16_t data=decrypted>>32;
           gba->mem.cart_rom[address&0x1FFFFFF]=data;
           gba->mem.cart_rom[(address+1)&0x1FFFFFF]=data>>8;
@@ -3093,7 +3654,7 @@ bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size){
           // IF AR_BUTTON THEN [a0aaaaa]=zz
           if(i+3>=size)return false;
           if (ar_button_pressed) {
-            uint64_t decrypted=gba_decrypt_arv3(buffer[i+3] | ((uint64_t)buffer[i+2] << 32));
+            uint64_t decrypted=buffer[i+3] | ((uint64_t)buffer[i+2] << 32);
             uint32_t address=((right<<4)&0x0F000000) | (right&0x000FFFFF);
             uint8_t data = decrypted>>32;
             gba_store8(gba,address,data);
@@ -3105,7 +3666,7 @@ bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size){
           // IF AR_BUTTON THEN [a0aaaaa]=zzzz
           if(i+3>=size)return false;
           if (ar_button_pressed) {
-            uint64_t decrypted=gba_decrypt_arv3(buffer[i+3] | ((uint64_t)buffer[i+2] << 32));
+            uint64_t decrypted=buffer[i+3] | ((uint64_t)buffer[i+2] << 32);
             uint32_t address=((right<<4)&0x0F000000) | (right&0x000FFFFF);
             uint16_t data = decrypted>>32;
             gba_store16(gba,address,data);
@@ -3117,7 +3678,7 @@ bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size){
           // IF AR_BUTTON THEN [a0aaaaa]=zzzzzzzz
           if(i+3>=size)return false;
           if (ar_button_pressed) {
-            uint64_t decrypted=gba_decrypt_arv3(buffer[i+3] | ((uint64_t)buffer[i+2] << 32));
+            uint64_t decrypted=buffer[i+3] | ((uint64_t)buffer[i+2] << 32);
             uint32_t address=((right<<4)&0x0F000000) | (right&0x000FFFFF);
             uint32_t data = decrypted>>32;
             gba_store32(gba,address,data);
@@ -3131,7 +3692,7 @@ bool gba_run_ar_cheat(gba_t* gba, const uint32_t* buffer, uint32_t size){
           // 00000000 8naaaaaa 000000yy ssccssss  repeat cc times [a0aaaaa]=yy
           // (with yy=yy+ss, a0aaaaa=a0aaaaa+ssss after each step)
           if(i+3>=size)return false;
-          uint64_t decrypted=gba_decrypt_arv3(buffer[i+3] | ((uint64_t)buffer[i+2] << 32));
+          uint64_t decrypted=buffer[i+3] | ((uint64_t)buffer[i+2] << 32);
           uint32_t address=((right<<4)&0x0F000000) | (right&0x000FFFFF);
           uint8_t repeat=(decrypted>>16)&0xFF;
           uint8_t data_increment=(decrypted>>24)&0xFF;
@@ -3527,7 +4088,15 @@ static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, doubl
 
   bool master_enable = SB_BFE(nrf_52,7,1);
   if(!master_enable)return;
-  float sample_delta_t = 1.0/SE_AUDIO_SAMPLE_RATE;
+  float sample_delta_t = 1.0/GBA_AUDIO_SAMPLE_RATE;
+  if(emu->audio_disabled){
+    // The sequencer, wave channel and FIFOs above stay exact, only the samples are skipped
+    #ifdef GBA_AUDIO
+      gba_io_store16(gb,GBA_SOUNDCNT_H,gba_io_read16(gb,GBA_SOUNDCNT_H)&~((1<<11)|(1<<15)));
+    #endif
+    audio->current_sample_generated_time+=ceil((audio->current_sim_time-audio->current_sample_generated_time)/sample_delta_t)*sample_delta_t;
+    return;
+  }
 
   const static float duty_lookup[]={0.125,0.25,0.5,0.75};
   uint8_t length_duty1 = sb_read8_io(gb, SB_IO_AUD1_LENGTH_DUTY);
@@ -3602,6 +4171,12 @@ static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, doubl
   freq_hz[2]= (65536.)/(2048-seq->frequency[2]);
   freq_hz[3] = 524288.0/r4/pow(2.0,s4+1);
   while(audio->current_sample_generated_time < audio->current_sim_time){
+    #ifdef GBA_AUDIO
+      // The sample hears the pops from before the slice it would have been generated in when
+      // mixing every tick, i.e. the ones stamped no later than its start
+      double sample_clock = (audio->current_sample_generated_time-audio->current_sim_time)*(16*1024*1024);
+      for(int i=0;i<2;++i)gba_audio_apply_fifo_log(audio,i,sample_clock);
+    #endif
 
     audio->current_sample_generated_time+=sample_delta_t;
     
@@ -3638,7 +4213,7 @@ static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, doubl
     channels[3] = ((seq->lfsr4 & 1) * 2.-1.)*v[3];
 
     #ifdef GBA_AUDIO
-      for(int i=0;i<2;++i)channels[4+i] = audio->fifo[i].data[audio->fifo[i].read_ptr&0x1f]/128.;
+      for(int i=0;i<2;++i)channels[4+i] = audio->fifo_output[i]/128.;
     #else
       for(int i=0;i<2;++i)channels[4+i] =0;
     #endif 
@@ -3677,12 +4252,7 @@ static FORCE_INLINE void sb_process_audio(sb_gb_t *gb, sb_emu_state_t*emu, doubl
     float out_r = sample_volume_r-audio->capacitor_r;
     audio->capacitor_l = (sample_volume_l-out_l)*0.996;
     audio->capacitor_r = (sample_volume_r-out_r)*0.996;
-    // Quantization
-    unsigned write_entry0 = (emu->audio_ring_buff.write_ptr++)%SB_AUDIO_RING_BUFFER_SIZE;
-    unsigned write_entry1 = (emu->audio_ring_buff.write_ptr++)%SB_AUDIO_RING_BUFFER_SIZE;
-
-    emu->audio_ring_buff.data[write_entry0] = out_l*32760;
-    emu->audio_ring_buff.data[write_entry1] = out_r*32760;
+    sb_resampler_push(&audio->resampler,&emu->audio_ring_buff,out_l,out_r,GBA_AUDIO_SAMPLE_RATE/(double)SE_AUDIO_SAMPLE_RATE,emu->audio_low_quality);
   }
 }
 
@@ -3735,6 +4305,216 @@ void gba_cpu_trigger_breakpoint(void* data){
   gba->pause_after_frame=true;
 }
 
+// Sets up the BIOS affine matrix for a rotation of angle (only the upper 8 bits are used), shared by 
+// BgAffineSet and ObjAffineSet. Results are in 8.8 fixed point like the BIOS output
+static void gba_hle_affine_matrix(double sx, double sy, uint16_t angle, double* pa, double* pb, double* pc, double* pd){
+  double theta = (angle>>8)/128.0*3.14159265358979323846;
+  *pa = cos(theta)*sx;
+  *pb = -sin(theta)*sx;
+  *pc = sin(theta)*sy;
+  *pd = cos(theta)*sy;
+}
+// High level emulation of the BIOS math, copy, affine and decompression SWIs. Memory goes through the
+// CPU callbacks so wait states are charged as usual, i_cycles adds a rough estimate of the BIOS code
+// around it. Everything else (and invalid arguments) still runs the BIOS handler.
+static bool gba_hle_swi(void* user_data, uint32_t swi_number){
+  gba_t* gba = (gba_t*)user_data;
+  arm7_t* cpu = &gba->cpu;
+  int func = arm7_get_thumb_bit(cpu)? SB_BFE(swi_number,0,8): SB_BFE(swi_number,16,8);
+  uint32_t* r = cpu->registers;
+  void* u = cpu->user_data;
+  switch(func){
+    case 0x06:   //Div
+    case 0x07:{  //DivArm
+      int32_t numer = func==0x06? r[0]: r[1];
+      int32_t denom = func==0x06? r[1]: r[0];
+      if(denom==0||(numer==INT32_MIN&&denom==-1))return false;
+      int32_t quot = numer/denom;
+      r[0]=quot;
+      r[1]=numer%denom;
+      r[3]=quot<0? -quot: quot;
+      cpu->i_cycles+=60;
+      return true;
+    }
+    case 0x08:{ //Sqrt
+      uint32_t v = r[0];
+      uint32_t res = sqrt((double)v);
+      while(res*res>v)res--;
+      while((res+1)*(res+1)<=v&&res<0xffff)res++;
+      r[0]=res;
+      cpu->i_cycles+=40;
+      return true;
+    }
+    case 0x0B:{ //CpuSet
+      uint32_t src = r[0], dst = r[1], cnt = r[2];
+      uint32_t count = SB_BFE(cnt,0,21);
+      bool fixed = SB_BFE(cnt,24,1);
+      if(SB_BFE(cnt,26,1)){
+        src&=~3; dst&=~3;
+        uint32_t v = cpu->read32(u,src);
+        for(uint32_t i=0;i<count;++i){
+          if(!fixed)v = cpu->read32(u,src+i*4);
+          cpu->write32(u,dst+i*4,v);
+        }
+      }else{
+        src&=~1; dst&=~1;
+        uint16_t v = cpu->read16(u,src);
+        for(uint32_t i=0;i<count;++i){
+          if(!fixed)v = cpu->read16(u,src+i*2);
+          cpu->write16(u,dst+i*2,v);
+        }
+      }
+      cpu->i_cycles+=20+count*2;
+      return true;
+    }
+    case 0x0C:{ //CpuFastSet
+      uint32_t src = r[0]&~3, dst = r[1]&~3, cnt = r[2];
+      uint32_t count = (SB_BFE(cnt,0,21)+7)&~7;
+      bool fixed = SB_BFE(cnt,24,1);
+      uint32_t v = cpu->read32(u,src);
+      for(uint32_t i=0;i<count;++i){
+        if(!fixed)v = cpu->read32(u,src+i*4);
+        cpu->write32(u,dst+i*4,v);
+      }
+      cpu->i_cycles+=20+count/4;
+      return true;
+    }
+    case 0x0E:{ //BgAffineSet
+      uint32_t src = r[0], dst = r[1], count = r[2];
+      for(uint32_t i=0;i<count;++i){
+        double ox = (int32_t)cpu->read32(u,src+0)/256.0;
+        double oy = (int32_t)cpu->read32(u,src+4)/256.0;
+        double cx = (int16_t)cpu->read16(u,src+8);
+        double cy = (int16_t)cpu->read16(u,src+10);
+        double sx = (int16_t)cpu->read16(u,src+12)/256.0;
+        double sy = (int16_t)cpu->read16(u,src+14)/256.0;
+        double pa,pb,pc,pd;
+        gba_hle_affine_matrix(sx,sy,cpu->read16(u,src+16),&pa,&pb,&pc,&pd);
+        double rx = ox-(pa*cx+pb*cy);
+        double ry = oy-(pc*cx+pd*cy);
+        cpu->write16(u,dst+0,(int16_t)(pa*256));
+        cpu->write16(u,dst+2,(int16_t)(pb*256));
+        cpu->write16(u,dst+4,(int16_t)(pc*256));
+        cpu->write16(u,dst+6,(int16_t)(pd*256));
+        cpu->write32(u,dst+8,(int32_t)(rx*256));
+        cpu->write32(u,dst+12,(int32_t)(ry*256));
+        src+=20; dst+=16;
+      }
+      cpu->i_cycles+=20+count*60;
+      return true;
+    }
+    case 0x0F:{ //ObjAffineSet
+      uint32_t src = r[0], dst = r[1], count = r[2], stride = r[3];
+      for(uint32_t i=0;i<count;++i){
+        double sx = (int16_t)cpu->read16(u,src+0)/256.0;
+        double sy = (int16_t)cpu->read16(u,src+2)/256.0;
+        double pa,pb,pc,pd;
+        gba_hle_affine_matrix(sx,sy,cpu->read16(u,src+4),&pa,&pb,&pc,&pd);
+        cpu->write16(u,dst+stride*0,(int16_t)(pa*256));
+        cpu->write16(u,dst+stride*1,(int16_t)(pb*256));
+        cpu->write16(u,dst+stride*2,(int16_t)(pc*256));
+        cpu->write16(u,dst+stride*3,(int16_t)(pd*256));
+        src+=8; dst+=stride*4;
+      }
+      cpu->i_cycles+=20+count*40;
+      return true;
+    }
+    case 0x11:   //LZ77UnCompWram
+    case 0x12:{  //LZ77UnCompVram
+      uint32_t src = r[0], dst = r[1];
+      uint32_t header = cpu->read32(u,src&~3); src+=4;
+      if(SB_BFE(header,4,4)!=1)return false;
+      uint32_t size = SB_BFE(header,8,24);
+      bool vram = func==0x12;
+      // The VRAM version can only write halfwords so the even byte waits for the odd one
+      uint16_t half = 0;
+      uint32_t written = 0;
+      while(written<size){
+        uint8_t flags = cpu->read8(u,src++);
+        for(int b=7;b>=0&&written<size;--b){
+          int len = 1;
+          uint32_t from = src;
+          if(SB_BFE(flags,b,1)){
+            uint8_t b0 = cpu->read8(u,src++);
+            uint8_t b1 = cpu->read8(u,src++);
+            from = dst+written-(((b0&0xf)<<8|b1)+1);
+            len = (b0>>4)+3;
+          }else src++;
+          for(int i=0;i<len&&written<size;++i,++written){
+            uint8_t v = cpu->read8(u,from+i);
+            if(!vram)cpu->write8(u,dst+written,v);
+            else if(written&1)cpu->write16(u,dst+written-1,half|(v<<8));
+            else half = v;
+          }
+        }
+      }
+      cpu->i_cycles+=20+size*2;
+      return true;
+    }
+    case 0x13:{ //HuffUnComp
+      uint32_t src = r[0]&~3, dst = r[1];
+      uint32_t header = cpu->read32(u,src);
+      int bits = SB_BFE(header,0,4);
+      if(SB_BFE(header,4,4)!=2||(bits!=4&&bits!=8))return false;
+      int32_t remaining = SB_BFE(header,8,24);
+      uint32_t tree = src+5;
+      uint32_t stream = src+4+(cpu->read8(u,src+4)+1)*2;
+      uint32_t node_addr = tree;
+      uint8_t node = cpu->read8(u,node_addr);
+      uint32_t block = 0;
+      int block_bits = 0;
+      while(remaining>0){
+        uint32_t word = cpu->read32(u,stream); stream+=4;
+        for(int b=31;b>=0&&remaining>0;--b){
+          bool right = SB_BFE(word,b,1);
+          uint32_t child = (node_addr&~1)+SB_BFE(node,0,6)*2+2+right;
+          // Bit 7 marks node 0 as data, bit 6 node 1
+          if(!SB_BFE(node,right?6:7,1)){
+            node_addr = child;
+            node = cpu->read8(u,node_addr);
+            continue;
+          }
+          block |= (cpu->read8(u,child)&((1<<bits)-1))<<block_bits;
+          block_bits+=bits;
+          node_addr = tree;
+          node = cpu->read8(u,node_addr);
+          if(block_bits==32){
+            cpu->write32(u,dst,block);
+            dst+=4; remaining-=4;
+            block = 0; block_bits = 0;
+          }
+        }
+      }
+      cpu->i_cycles+=20+SB_BFE(header,8,24)*4;
+      return true;
+    }
+    case 0x14:   //RLUnCompWram
+    case 0x15:{  //RLUnCompVram
+      uint32_t src = r[0], dst = r[1];
+      uint32_t header = cpu->read32(u,src&~3); src+=4;
+      if(SB_BFE(header,4,4)!=3)return false;
+      uint32_t size = SB_BFE(header,8,24);
+      bool vram = func==0x15;
+      uint16_t half = 0;
+      uint32_t written = 0;
+      while(written<size){
+        uint8_t flag = cpu->read8(u,src++);
+        bool run = SB_BFE(flag,7,1);
+        int len = (flag&0x7f)+(run?3:1);
+        uint8_t v = run? cpu->read8(u,src++): 0;
+        for(int i=0;i<len&&written<size;++i,++written){
+          if(!run)v = cpu->read8(u,src++);
+          if(!vram)cpu->write8(u,dst+written,v);
+          else if(written&1)cpu->write16(u,dst+written-1,half|(v<<8));
+          else half = v;
+        }
+      }
+      cpu->i_cycles+=20+size*2;
+      return true;
+    }
+  }
+  return false;
+}
 void gba_ptrs_init(gba_t* gba,gba_scratch_t *scratch, uint8_t* rom_data) {
 
   gba->framebuffer = scratch->framebuffer;
@@ -3749,17 +4529,150 @@ void gba_ptrs_init(gba_t* gba,gba_scratch_t *scratch, uint8_t* rom_data) {
   gba->cpu.write8 = arm7_write8;
   gba->cpu.write16 = arm7_write16;
   gba->cpu.write32 = arm7_write32;
+  gba->cpu.block_ptr = arm7_block_ptr;
   gba->cpu.user_data=gba;  
+  gba_page_table_t* table = &scratch->page_table;
+  if(table->gba!=gba||table->cart_rom!=rom_data||table->rom_size!=gba->cart.rom_size)gba_rebuild_page_table(gba,table);
+  gba->mem.page_table = table;
+  // OAM may have been replaced by a save state load or reset without going through the write hooks
+  gba->mem.sprite_bins = &scratch->sprite_bins;
+  sb_validate_sprite_bins(&scratch->sprite_bins,gba->mem.oam);
 }
 
+// Busy wait loops are only skipped when nothing but a PPU or timer event can wake them
+static FORCE_INLINE bool gba_idle_loop_can_skip(gba_t* gba){
+  if(gba->activate_dmas||gba->residual_dma_ticks)return false;
+  if(SB_BFE(gba_io_read16(gba,GBA_SIOCNT),7,1))return false;
+  uint16_t int_if = gba_io_read16(gba,GBA_IF)&gba_io_read16(gba,GBA_IE);
+  return !(int_if&&SB_BFE(gba_io_read32(gba,GBA_IME),0,1));
+}
+// The hardware is advanced between CPU steps by an event scheduler. Each event source reports 
+// how many cycles remain until it needs servicing, the clock is advanced in bulk up to the 
+// earliest one and only that cycle runs through the component tick functions. With three 
+// sources a linear min beats a heap. DMA and SIO are serviced at CPU step boundaries by gba_tick 
+// instead: DMAs have no due time of their own, they are started by the events above or by 
+// register writes and then run in place of CPU steps. SIO counts its transfer time in CPU steps 
+// and link cable transfers wait on the other consoles, which is only polled between steps. 
+typedef enum{
+  GBA_EVENT_IF_PIPELINE, // Delivery of the next pending IF stage
+  GBA_EVENT_TIMERS,      // Timer overflow
+  GBA_EVENT_PPU,         // Scanline/HBlank boundaries
+  GBA_NUM_EVENTS
+}gba_event_t;
+// Returns the number of cycles until the event is due, the due cycle included
+static FORCE_INLINE int gba_scheduler_cycles_to_event(gba_t* gba, gba_event_t event){
+  switch(event){
+    case GBA_EVENT_IF_PIPELINE:{
+      int ticks = gba_if_pipe_ticks_to_delivery(gba);
+      return ticks==INT32_MAX? ticks: ticks+1;
+    }
+    case GBA_EVENT_TIMERS:{
+      int ticks = gba->timer_ticks_before_event-gba->deferred_timer_ticks;
+      return ticks<1? 1: ticks;
+    }
+    case GBA_EVENT_PPU: return gba->ppu.fast_forward_ticks+1;
+    default: return INT32_MAX;
+  }
+}
+static FORCE_INLINE int gba_scheduler_cycles_to_next_event(gba_t* gba){
+  int next = INT32_MAX;
+  for(int e=0;e<GBA_NUM_EVENTS;++e){
+    int ticks = gba_scheduler_cycles_to_event(gba,(gba_event_t)e);
+    if(ticks<next)next=ticks;
+  }
+  return next;
+}
+static FORCE_INLINE void gba_scheduler_advance(gba_t* gba, int ticks, bool render){
+  bool last_activate_dmas =gba->activate_dmas;
+  int dma_activation_tick = -1;
+  int t = 0;
+  while(t<ticks){
+    int skip = gba_scheduler_cycles_to_next_event(gba)-1;
+    if(skip>ticks-t)skip=ticks-t;
+    // No event is due in the skipped cycles so only the counters move
+    gba->deferred_timer_ticks+=skip;
+    gba->ppu.fast_forward_ticks-=skip;
+    gba_skip_interrupts(gba,skip);
+    t+=skip;
+    if(t==ticks)break;
+    gba_tick_interrupts(gba);
+    gba_tick_timers(gba);
+    gba_tick_ppu(gba,render);
+    if(dma_activation_tick<0&&gba->activate_dmas&&!last_activate_dmas)dma_activation_tick=t;
+    ++t;
+  }
+  // A DMA triggered inside the step starts once the whole step has been retired
+  if(dma_activation_tick>=0&&dma_activation_tick<ticks-1){gba->residual_dma_ticks=0;gba->last_cpu_tick=ticks;}
+}
+#define GBA_MAX_BATCHED_INSTRUCTIONS 64
+// Runs instructions back to back while the cycles they consume can't reach a PPU, timer, DMA,
+// SIO or interrupt event, so the per instruction bookkeeping in gba_tick can be skipped. 
+// ticks is the cost of the instruction that was just executed, the cost of the last 
+// instruction run is returned and must be retired by the caller. The batch also ends when
+// idle_loop (optional) detects a busy wait loop.
+static FORCE_INLINE int gba_exec_cpu_batch(gba_t* gba, int ticks, int *batched_ticks, arm7_idle_loop_t* idle_loop){
+  *batched_ticks=0;
+  for(int i=0;i<GBA_MAX_BATCHED_INSTRUCTIONS;++i){
+    int ppu_fast_forward = gba->ppu.fast_forward_ticks;
+    int timer_fast_forward = gba->timer_ticks_before_event-gba->deferred_timer_ticks;
+    int horizon = ppu_fast_forward<timer_fast_forward?ppu_fast_forward:timer_fast_forward; 
+    int if_fast_forward = gba_if_pipe_ticks_to_delivery(gba);
+    if(if_fast_forward<horizon)horizon=if_fast_forward;
+    if(ticks>=horizon)break;
+    if(gba->activate_dmas||gba->cpu.wait_for_interrupt||!gba->frame_in_progress)break;
+    if(SB_BFE(gba_io_read16(gba,GBA_SIOCNT),7,1))break;
+    uint16_t int_if = gba_io_read16(gba,GBA_IF);
+    if(int_if&&(int_if&gba_io_read16(gba,GBA_IE))&&SB_BFE(gba_io_read32(gba,GBA_IME),0,1))break;
+    gba->rtc.total_clocks_ticked+=ticks;
+    gba->deferred_timer_ticks+=ticks;
+    gba->ppu.fast_forward_ticks-=ticks;
+    gba_skip_interrupts(gba,ticks);
+    *batched_ticks+=ticks;
+    gba->cpu.i_cycles=0;
+    gba->mem.requests=0;
+    uint32_t pc_before = gba->cpu.registers[PC];
+    arm7_exec_instruction(&gba->cpu);
+    ticks = gba->mem.requests+gba->cpu.i_cycles; 
+    if(idle_loop&&arm7_idle_loop_update(idle_loop,&gba->cpu,pc_before,gba->mem.idle_loop_side_effects))break;
+  }
+  return ticks;
+}
+// Mixes the pending cycles, the mixer only runs once a sample is due instead of every tick
+static void gba_flush_audio(gba_t* gba){
+  gba_audio_t* audio = &gba->audio;
+  if(audio->pending_ticks&&audio->emu){
+    int ticks = audio->pending_ticks;
+    audio->pending_ticks = 0;
+    gba_tick_audio(gba,audio->emu,((double)ticks)/(16*1024*1024),ticks);
+  }
+  // Pops stamped at the end of the slice are heard from the next sample on
+  for(int i=0;i<2;++i)gba_audio_apply_fifo_log(audio,i,0);
+  double wait = (audio->current_sample_generated_time-audio->current_sim_time)*(16*1024*1024);
+  audio->ticks_to_next_sample = wait<1? 1: wait>GBA_AUDIO_MAX_PENDING_TICKS? GBA_AUDIO_MAX_PENDING_TICKS: (uint32_t)wait;
+  // No samples are due and register accesses flush on their own, so only the pending tick limit applies
+  if(audio->emu&&audio->emu->audio_disabled)audio->ticks_to_next_sample = GBA_AUDIO_MAX_PENDING_TICKS;
+}
 void gba_tick(sb_emu_state_t* emu, gba_t* gba,gba_scratch_t *scratch){
   gba_ptrs_init(gba, scratch, emu->rom_data);
   gba->cpu.user_data=gba;
   gba->cpu.trigger_breakpoint=gba_cpu_trigger_breakpoint;
-
-  uint64_t* d = (uint64_t*)gba->mem.mmio_debug_access_buffer;
-  for(int i=0;i<sizeof(gba->mem.mmio_debug_access_buffer)/8;++i){
-    d[i]&=0x9191919191919191ULL;
+  gba->cpu.watch = sb_watch_active(emu->watch[0]);
+  gba->cpu.pc_profile = emu->pc_profile[0];
+  gba->cpu.exec_trace = emu->exec_trace[0];
+  gba->cpu.software_interrupt = emu->gba_hle_bios? gba_hle_swi: NULL;
+  gba->mem.late_input = emu->late_input;
+  gba->mem.video_capture = emu->video_capture;
+  gba->audio.emu = emu;
+  if(gba->cpu.watch)sb_watch_resume(gba->cpu.watch);
+  arm7_idle_loop_t* idle_loop = emu->cpu_idle_loop_skip? &scratch->idle_loop: NULL;
+  scratch->idle_loop.hint_pc = emu->idle_loop_hint_pc[0];
+
+  // The per tick access flags are only shown by the debugger
+  if(emu->watch[0]){
+    uint64_t* d = (uint64_t*)gba->mem.mmio_debug_access_buffer;
+    for(int i=0;i<sizeof(gba->mem.mmio_debug_access_buffer)/8;++i){
+      d[i]&=0x9191919191919191ULL;
+    }
   }
 
   gba_tick_keypad(&emu->joy,gba);
@@ -3768,9 +4681,15 @@ void gba_tick(sb_emu_state_t* emu, gba_t* gba,gba_scratch_t *scratch){
   if(!(solar_value <1.00))solar_value=1.00;
   if(!(solar_value >0.00))solar_value=0.00;
   gba->solar_sensor.value = 0xE7-solar_value*(0xE7-0x32);
-  gba->ppu.ghosting_strength = emu->screen_ghosting_strength;
+  uint64_t start_instructions = gba->cpu.executed_instructions;
   while(gba->frame_in_progress){
-    int ticks = gba->activate_dmas? gba_tick_dma(gba,gba->last_cpu_tick) :0;
+    int batched_ticks = 0;
+    int ticks = 0;
+    if(gba->activate_dmas){
+      SB_PROFILE_BEGIN(emu,SB_PROFILE_DMA,0);
+      ticks = gba_tick_dma(gba,gba->last_cpu_tick);
+      SB_PROFILE_END(emu,SB_PROFILE_DMA,0);
+    }
     if(!ticks&&gba->residual_dma_ticks){ticks=gba->residual_dma_ticks;gba->residual_dma_ticks=0;}
     if(!ticks){
       gba->cpu.i_cycles=0;
@@ -3784,35 +4703,35 @@ void gba_tick(sb_emu_state_t* emu, gba_t* gba,gba_scratch_t *scratch){
           if(int_if)arm7_process_interrupts(&gba->cpu);
         }
       }
+      uint32_t pc_before = gba->cpu.registers[PC];
       arm7_exec_instruction(&gba->cpu);
       gba->last_cpu_tick=ticks = gba->mem.requests+gba->cpu.i_cycles; 
+      bool idle = idle_loop&&arm7_idle_loop_update(idle_loop,&gba->cpu,pc_before,gba->mem.idle_loop_side_effects);
+      if(emu->cpu_batch_exec&&!idle){
+        gba->last_cpu_tick=ticks=gba_exec_cpu_batch(gba,ticks,&batched_ticks,idle_loop);
+      }
     }
-    gba_tick_sio(gba);
-    int ppu_fast_forward = gba->ppu.fast_forward_ticks;
-    int timer_fast_forward = gba->timer_ticks_before_event-gba->deferred_timer_ticks;
-    int fast_forward_ticks=ppu_fast_forward<timer_fast_forward?ppu_fast_forward:timer_fast_forward; 
-    if(fast_forward_ticks>ticks){
-      if(gba->cpu.wait_for_interrupt)ticks=fast_forward_ticks;
-      else fast_forward_ticks=ticks;
-    }
-    if(SB_UNLIKELY(gba->active_if_pipe_stages)){
-      for(int i=0;i<fast_forward_ticks;++i)gba_tick_interrupts(gba);
-    }
-    gba->rtc.total_clocks_ticked+=fast_forward_ticks;
-    gba->deferred_timer_ticks+=fast_forward_ticks;
-    gba->ppu.fast_forward_ticks-=fast_forward_ticks;
-    ticks -=fast_forward_ticks>ticks?ticks:fast_forward_ticks;
-    double delta_t = ((double)ticks+fast_forward_ticks)/(16*1024*1024);
-    gba_tick_audio(gba, emu,delta_t,ticks+fast_forward_ticks);
-  
-    bool last_activate_dmas =gba->activate_dmas;
-    gba->rtc.total_clocks_ticked+=ticks;
-    for(int t = 0;t<ticks;++t){
-      if(gba->activate_dmas&&!last_activate_dmas){gba->residual_dma_ticks=ticks-t-1;gba->last_cpu_tick=t+1;}
-      gba_tick_interrupts(gba);
-      gba_tick_timers(gba);
-      gba_tick_ppu(gba,emu->render_frame);
+    gba_tick_sio(emu,gba);
+    bool idle_loop_skip = idle_loop&&idle_loop->idle&&gba_idle_loop_can_skip(gba);
+    if(gba->cpu.wait_for_interrupt||idle_loop_skip){
+      // A halted CPU sleeps until the next event
+      int next_event = gba_scheduler_cycles_to_next_event(gba)-1;
+      if(next_event>ticks)ticks=next_event;
     }
+    // The loop has to run another iteration after an event before it can be skipped again
+    if(idle_loop)idle_loop->idle=false;
+    gba->audio.pending_ticks+=ticks+batched_ticks;
+    if(gba->audio.pending_ticks>=gba->audio.ticks_to_next_sample){
+      SB_PROFILE_BEGIN(emu,SB_PROFILE_AUDIO,4);
+      gba_flush_audio(gba);
+      SB_PROFILE_END(emu,SB_PROFILE_AUDIO,4);
+    }
+    gba->rtc.total_clocks_ticked+=ticks;
+    // Timers and interrupts are also retired here but the PPU dominates
+    SB_PROFILE_BEGIN(emu,SB_PROFILE_PPU,4);
+    gba_scheduler_advance(gba,ticks,emu->render_frame);
+    SB_PROFILE_END(emu,SB_PROFILE_PPU,4);
+    if(SB_UNLIKELY(emu->link_yield))break;
   } 
   emu->joy.rumble = SB_BFE(gba->cart.gpio_data,3,1); 
   //LCD turns off in stop mode
@@ -3821,6 +4740,13 @@ void gba_tick(sb_emu_state_t* emu, gba_t* gba,gba_scratch_t *scratch){
     emu->run_mode=SB_MODE_PAUSE;
     gba->pause_after_frame=false;
   }       
+  gba_flush_audio(gba);
+  gba->audio.emu = NULL;
+  // The snapshot is only valid while the frame runs, debugger reads outside of it use the register
+  gba->mem.late_input = NULL;
+  gba->mem.video_capture = NULL;
+  SB_PERF_COUNT(&gba->perf,SB_COUNTER_INSTRUCTIONS,gba->cpu.executed_instructions-start_instructions);
+  sb_profile_collect(&emu->profile,&gba->perf);
 }
 
 #endif
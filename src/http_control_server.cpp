@@ -2,19 +2,204 @@ extern "C"{
     #include "http_control_server.h"
 };
 #include "httplib.h"
+#include "json.hpp"
+#include "miniz.h"
+#include <atomic>
 #include <thread>
+#include <condition_variable>
+#include <memory>
 #include <iostream>
 #include <sstream>
 #include <vector>
+#define HCS_STREAM_BOUNDARY "skyemu-frame"
+static std::atomic<hcs_callback> hcs_unlocked_callback{nullptr};
+static std::string hcs_base64_encode(const uint8_t* data, uint64_t size){
+    static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((size+2)/3*4);
+    for(uint64_t i=0;i<size;i+=3){
+        uint32_t v = data[i]<<16;
+        if(i+1<size)v|=data[i+1]<<8;
+        if(i+2<size)v|=data[i+2];
+        out+=table[(v>>18)&63];
+        out+=table[(v>>12)&63];
+        out+=i+1<size? table[(v>>6)&63]: '=';
+        out+=i+2<size? table[v&63]: '=';
+    }
+    return out;
+}
+// Large text and raw responses are gzip'd for clients that accept it, httplib is built without zlib
+// so miniz does the deflate. PNG and JPG are already compressed.
+#define HCS_GZIP_MIN_SIZE 1024
+static bool hcs_accepts_gzip(const httplib::Request& req, const std::string& mime){
+    if(mime.compare(0,6,"image/")==0&&mime!="image/bmp")return false;
+    const std::string& accept = req.get_header_value("Accept-Encoding");
+    return accept.find("gzip")!=std::string::npos;
+}
+static void hcs_set_content(const httplib::Request& req, httplib::Response& res, const char* data, size_t size, const std::string& mime){
+    if(size>=HCS_GZIP_MIN_SIZE&&hcs_accepts_gzip(req,mime)){
+        size_t deflate_size = 0;
+        int flags = tdefl_create_comp_flags_from_zip_params(MZ_BEST_SPEED,-MZ_DEFAULT_WINDOW_BITS,MZ_DEFAULT_STRATEGY);
+        void* deflated = tdefl_compress_mem_to_heap(data,size,&deflate_size,flags);
+        if(deflated&&deflate_size+18<size){
+            static const uint8_t header[10]={0x1f,0x8b,8,0,0,0,0,0,0,0xff};
+            uint32_t crc = (uint32_t)mz_crc32(MZ_CRC32_INIT,(const uint8_t*)data,size);
+            uint32_t isize = (uint32_t)size;
+            std::string body((const char*)header,sizeof(header));
+            body.append((const char*)deflated,deflate_size);
+            for(int i=0;i<4;++i)body+=(char)(crc>>(i*8));
+            for(int i=0;i<4;++i)body+=(char)(isize>>(i*8));
+            mz_free(deflated);
+            res.set_header("Content-Encoding","gzip");
+            res.set_header("Vary","Accept-Encoding");
+            res.set_content(body,mime);
+            return;
+        }
+        mz_free(deflated);
+    }
+    res.set_content(data,size,mime);
+}
 struct HCSServer{
     hcs_callback callback; 
+    hcs_finish_callback finish;
     httplib::Server svr;
     std::recursive_mutex mutex;
     std::thread thread;
     int64_t port; 
+    // Count of rendered frames, /stream connections wait on frame_cv for it to advance
+    std::mutex frame_mutex;
+    std::condition_variable frame_cv;
+    uint64_t frame = 0;
+    bool stopping = false;
+    // Runs callback with the lock held (unless the caller already holds it) and finishes deferred results after releasing it
+    uint8_t* run_command(const char* cmd, const char** params, uint64_t* result_size, const char** mime_type, bool lock){
+        hcs_callback unlocked = hcs_unlocked_callback;
+        if(unlocked){
+            uint8_t* result = unlocked(cmd,params,result_size,mime_type);
+            if(result)return result;
+        }
+        if(lock)mutex.lock();
+        uint8_t* result = callback(cmd,params,result_size,mime_type);
+        if(lock)mutex.unlock();
+        if(result&&strcmp(*mime_type,HCS_DEFERRED_MIME)==0){
+            *mime_type = "";
+            *result_size = 0;
+            if(!finish)return NULL;
+            result = finish(result,result_size,mime_type);
+        }
+        return result;
+    }
+    // Serves /stream as a multipart/x-mixed-replace response that pushes the /screen output of
+    // every Nth rendered frame (every=N). The other parameters are forwarded to /screen, so
+    // format=jpg plays in a browser like MJPEG and format=raw avoids encoding entirely.
+    static void start_stream(HCSServer* server, const httplib::Request& req, httplib::Response& res){
+        uint64_t every = 1;
+        auto params = std::make_shared<std::vector<std::string>>();
+        for(auto &v :req.params){
+            if(v.first=="every"){
+                int n = atoi(v.second.c_str());
+                every = n>1? n: 1;
+            }else{
+                params->push_back(v.first);
+                params->push_back(v.second);
+            }
+        }
+        uint64_t start_frame = 0;
+        {
+            std::lock_guard<std::mutex> lock(server->frame_mutex);
+            start_frame = server->frame;
+        }
+        auto next_frame = std::make_shared<uint64_t>(start_frame+1);
+        res.set_chunked_content_provider("multipart/x-mixed-replace; boundary=" HCS_STREAM_BOUNDARY,
+            [server,params,every,next_frame](size_t offset, httplib::DataSink& sink){
+                {
+                    std::unique_lock<std::mutex> lock(server->frame_mutex);
+                    server->frame_cv.wait(lock,[&]{return server->stopping||server->frame>=*next_frame;});
+                    if(server->stopping)return false;
+                    *next_frame = server->frame+every;
+                }
+                std::vector<const char*> screen_params;
+                for(auto &p: *params)screen_params.push_back(p.c_str());
+                screen_params.push_back(NULL);
+                screen_params.push_back(NULL);
+                uint64_t result_size = 0;
+                const char *mime_type = "";
+                uint8_t * result = server->run_command("/screen",&screen_params[0],&result_size, &mime_type,true);
+                if(!result)return false;
+                std::string header = "--" HCS_STREAM_BOUNDARY "\r\nContent-Type: "+std::string(mime_type)+
+                                     "\r\nContent-Length: "+std::to_string(result_size)+"\r\n\r\n";
+                bool ok = sink.write(header.data(),header.size())&&
+                          sink.write((const char*)result,result_size)&&
+                          sink.write("\r\n",2);
+                free(result);
+                return ok;
+            });
+    }
+    // Runs a JSON list of commands like [{"cmd":"/input","params":{"A":1}},{"cmd":"/step"}] back to
+    // back without letting the emulator run in between. params can also be a list of [name,value]
+    // pairs for commands that repeat a parameter. Returns a JSON list with the result of each
+    // command: text results as "result" and binary ones (ie. /screen) base64 encoded as "base64".
+    static std::string run_batch(HCSServer* server, const std::string& body, bool* ok){
+        nlohmann::json commands = nlohmann::json::parse(body,nullptr,false);
+        nlohmann::json results = nlohmann::json::array();
+        *ok = commands.is_array();
+        if(!*ok)return "Failed (expected a JSON list of commands)";
+        std::lock_guard<std::recursive_mutex> lock(server->mutex);
+        for(auto& command: commands){
+            nlohmann::json entry;
+            std::string cmd = command.is_object()&&command.value("cmd",nlohmann::json()).is_string()? command["cmd"].get<std::string>(): "";
+            if(cmd.size()&&cmd[0]!='/')cmd = "/"+cmd;
+            entry["cmd"]=cmd;
+            std::vector<std::string> param_strings;
+            auto add_param = [&](const std::string& name, const nlohmann::json& value){
+                param_strings.push_back(name);
+                param_strings.push_back(value.is_string()? value.get<std::string>(): value.dump());
+            };
+            if(command.is_object()&&command.contains("params")){
+                const nlohmann::json& params = command["params"];
+                if(params.is_object())for(auto& p: params.items())add_param(p.key(),p.value());
+                else if(params.is_array()){
+                    for(auto& p: params)if(p.is_array()&&p.size()==2&&p[0].is_string())add_param(p[0].get<std::string>(),p[1]);
+                }
+            }
+            std::vector<const char*> params;
+            for(auto& p: param_strings)params.push_back(p.c_str());
+            params.push_back(NULL);
+            params.push_back(NULL);
+            uint64_t result_size = 0;
+            const char *mime_type = "";
+            uint8_t * result = cmd.size()&&cmd!="/batch"&&cmd!="/stream"?
+                               server->run_command(cmd.c_str(),&params[0],&result_size,&mime_type,false): NULL;
+            if(!result){
+                entry["error"]="Unhandled command";
+            }else{
+                std::string mime = mime_type;
+                entry["mime"]=mime.size()? mime: "text/plain";
+                if(mime.empty()||mime.compare(0,5,"text/")==0){
+                    entry["result"]=std::string((const char*)result,strnlen((const char*)result,result_size));
+                }else entry["base64"]=hcs_base64_encode(result,result_size);
+                free(result);
+            }
+            results.push_back(entry);
+        }
+        return results.dump(2);
+    }
     static void server_thread(HCSServer* server){
         server->svr.set_tcp_nodelay(true);
+        auto batch_handler = [server](const httplib::Request& req, httplib::Response& res){
+            bool ok = false;
+            std::string body = req.body.size()? req.body: req.get_param_value("commands");
+            std::string result = run_batch(server,body,&ok);
+            res.status = ok? 200: 400;
+            hcs_set_content(req,res,result.data(),result.size(),ok? "application/json": "text/plain");
+        };
+        server->svr.Post("/batch",batch_handler);
+        server->svr.Get("/batch",batch_handler);
         server->svr.set_pre_routing_handler([server](const httplib::Request& req, httplib::Response& res) {
+            if(req.path=="/stream"&&server->callback){
+                start_stream(server,req,res);
+                return httplib::Server::HandlerResponse::Handled;
+            }
             std::vector<const char*> params;
             for(auto &v :req.params){
                 params.push_back(v.first.c_str());
@@ -23,14 +208,13 @@ struct HCSServer{
             params.push_back(NULL);
             params.push_back(NULL);
             bool handled = false; 
+            if(req.path=="/batch")return httplib::Server::HandlerResponse::Unhandled;
             if(server->callback){
                 uint64_t result_size = 0; 
                 const char *mime_type = "";
-                server->mutex.lock();
-                uint8_t * result = server->callback(req.path.c_str(),&params[0],&result_size, &mime_type);
-                server->mutex.unlock();
+                uint8_t * result = server->run_command(req.path.c_str(),&params[0],&result_size, &mime_type,true);
                 if(result&&result_size){
-                    res.set_content((const char*)result,result_size,mime_type);
+                    hcs_set_content(req,res,(const char*)result,result_size,mime_type);
                     free(result);
                     return httplib::Server::HandlerResponse::Handled;
                 }
@@ -41,19 +225,28 @@ struct HCSServer{
         server->svr.listen("0.0.0.0",server->port);
         std::cout<<"Terminating HCS: http://localhost:"<<server->port<<std::endl;
     }
-    HCSServer(int64_t port, hcs_callback call){
+    HCSServer(int64_t port, hcs_callback call, hcs_finish_callback finish_call){
         callback = call; 
+        finish = finish_call;
         this->port = port; 
         thread = std::thread(server_thread,this);
     }
     ~HCSServer(){
+       {
+           std::lock_guard<std::mutex> lock(frame_mutex);
+           stopping = true;
+       }
+       frame_cv.notify_all();
        svr.stop();
        thread.join();
     }
 };
 HCSServer * server = NULL;
 extern "C"{
-    void hcs_update(bool enable, int64_t port, hcs_callback callback){
+    void hcs_set_unlocked_callback(hcs_callback callback){
+        hcs_unlocked_callback = callback;
+    }
+    void hcs_update(bool enable, int64_t port, hcs_callback callback, hcs_finish_callback finish){
         if(server)server->mutex.lock();
         if(server&&(!enable||port!=server->port)){
             server->mutex.unlock();
@@ -61,7 +254,7 @@ extern "C"{
             server = NULL;
         }
         if(!server&&enable){
-            server = new HCSServer(port, callback);
+            server = new HCSServer(port, callback, finish);
             server->mutex.lock();
         }
         if(server)server->mutex.unlock();
@@ -76,4 +269,12 @@ extern "C"{
     void hcs_join_server_thread(){
         if(server)server->thread.join();
     }
+    void hcs_notify_frame(){
+        if(!server)return;
+        {
+            std::lock_guard<std::mutex> lock(server->frame_mutex);
+            server->frame++;
+        }
+        server->frame_cv.notify_all();
+    }
 }
\ No newline at end of file
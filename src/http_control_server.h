@@ -9,8 +9,17 @@
 // the call back will set mime_type to the desired mime type for the return; 
 //Returns malloc'd data for a handled response or NULL for a non-handled response. 
 typedef uint8_t* (*hcs_callback)(const char* cmd, const char** params, uint64_t* result_size, const char** mime_type);
+//A callback can set mime_type to HCS_DEFERRED_MIME to finish slow work (ie. image encoding) later.
+//The returned pointer is then passed to the finish callback, which runs without the callback lock
+//and returns the final malloc'd response the same way.
+#define HCS_DEFERRED_MIME "application/x-hcs-deferred"
+typedef uint8_t* (*hcs_finish_callback)(uint8_t* deferred, uint64_t* result_size, const char** mime_type);
+//Optional callback tried before the callback for every command, without taking the callback lock.
+//It must only read state that is safe to access while the emulator runs, and return NULL for
+//commands it doesn't handle.
+void hcs_set_unlocked_callback(hcs_callback callback);
 //Update the HCS, and start/kill the server if needed
-void hcs_update(bool enable, int64_t port, hcs_callback callback);
+void hcs_update(bool enable, int64_t port, hcs_callback callback, hcs_finish_callback finish);
 
 //Suspend and resume callbacks from multiple threads
 void hcs_suspend_callbacks();
@@ -19,4 +28,7 @@ void hcs_resume_callbacks();
 //Join this thread to the server thread
 void hcs_join_server_thread();
 
+//Called after each rendered frame so /stream clients can push it
+void hcs_notify_frame();
+
 #endif
\ No newline at end of file
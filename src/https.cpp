@@ -1,4 +1,5 @@
 #include "https.hpp"
+#include <atomic>
 #include <mutex>
 #include <string.h>
 #include <unordered_map>
@@ -6,7 +7,6 @@
 #include <string>
 
 #ifndef EMSCRIPTEN
-#include <atomic>
 #include <curl/curl.h>
 #include <condition_variable>
 #include <openssl/err.h>
@@ -33,6 +33,7 @@ extern "C" {
 
 extern "C" {
 const char* se_get_pref_path();
+#include "trace.h"
 }
 
 std::mutex cache_mutex;
@@ -40,6 +41,28 @@ std::atomic_bool cache_enabled;
 std::atomic_uint64_t cache_size;
 std::unordered_map<std::string, std::vector<uint8_t>> download_cache;
 FILE* cache_file = nullptr;
+// curl_global_init brings up OpenSSL and the download cache can be large, so https_initialize
+// leaves both to https_load instead of delaying the first frame
+std::once_flag load_once;
+std::atomic_bool loaded;
+std::string cache_path;
+static void https_load();
+static void https_wait_loaded()
+{
+    std::call_once(load_once, https_load);
+}
+static bool https_cache_lookup(http_request_e type, const std::string& url, bool do_cache,
+                               const std::function<void(const std::vector<uint8_t>&)>& callback)
+{
+    if (type != http_request_e::GET || !do_cache || !cache_enabled.load(std::memory_order_relaxed))
+        return false;
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    auto it = download_cache.find(url);
+    if (it == download_cache.end())
+        return false;
+    callback(it->second);
+    return true;
+}
 
 #ifndef EMSCRIPTEN
 struct job {
@@ -51,6 +74,35 @@ struct job {
     bool do_cache;
 };
 
+// Connections, TLS sessions and DNS lookups are shared by every worker so requests to the same
+// host reuse a kept-alive connection instead of doing a new TLS handshake
+struct https_share {
+    https_share() {
+        share = curl_share_init();
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+
+    ~https_share() {
+        curl_share_cleanup(share);
+    }
+
+    static void lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        ((https_share*)userptr)->mutexes[data].lock();
+    }
+
+    static void unlock(CURL*, curl_lock_data data, void* userptr) {
+        ((https_share*)userptr)->mutexes[data].unlock();
+    }
+
+    CURLSH* share;
+    std::mutex mutexes[CURL_LOCK_DATA_LAST];
+};
+
 struct thread_pool {
     thread_pool(uint8_t n) {
         for (uint8_t i = 0; i < n; i++) {
@@ -76,16 +128,19 @@ struct thread_pool {
 
 private:
     void main_loop() {
+        trace_set_thread_name("HTTPS Worker");
+        https_wait_loaded();
         CURL* curl = curl_easy_init();
         curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L); 
         curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L); 
+        curl_easy_setopt(curl, CURLOPT_SHARE, share.share);
         while (!terminate_all) {
             job j;
             {
                 std::unique_lock<std::mutex> lock(jobs_mutex);
                 jobs_cv.wait(lock, [this] { return !jobs.empty() || terminate_all; });
                 if (terminate_all) {
-                    return;
+                    break;
                 }
                 j = jobs.front();
                 jobs.pop();
@@ -99,12 +154,48 @@ private:
 
     std::atomic_bool terminate_all = { false };
 
+    // Declared before the threads so it outlives the workers using it
+    https_share share;
+
     std::vector<std::thread> threads;
     std::mutex jobs_mutex;
     std::condition_variable jobs_cv;
     std::queue<job> jobs;
 };
 
+// Bounds how many requests are in flight at once, the rest wait in the queue for a free connection
+static thread_pool& https_pool()
+{
+    static thread_pool pool(8);
+    return pool;
+}
+// Requests made before the loader thread handed them over to the workers
+std::mutex pending_mutex;
+std::vector<job> pending_jobs;
+bool pending_flushed = false;
+std::thread load_thread;
+// Called with pending_mutex held. Started by https_initialize, or by the first request of the
+// frontends that never call it.
+static void https_start_loader()
+{
+    if (load_thread.joinable())
+        return;
+    cache_path = std::string(se_get_pref_path()) + "/download_cache.bin";
+    load_thread = std::thread([] {
+        trace_set_thread_name("HTTPS Loader");
+        https_wait_loaded();
+        std::vector<job> jobs;
+        {
+            std::unique_lock<std::mutex> lock(pending_mutex);
+            pending_flushed = true;
+            jobs.swap(pending_jobs);
+        }
+        for (job& j : jobs) {
+            if (!https_cache_lookup(j.type, j.url, j.do_cache, j.callback))
+                https_pool().push_job(j);
+        }
+    });
+}
 size_t curl_write_data(void* buffer, size_t size, size_t nmemb, void* d)
 {
     std::vector<uint8_t>* data = (std::vector<uint8_t>*)d;
@@ -189,31 +280,41 @@ extern "C" void em_https_request_callback_wrapper(void* callback, void* data, in
 
 #ifndef EMSCRIPTEN
 // See cacertinmem.c example from libcurl
+// The embedded CA bundle is parsed on the first request and reused for every later SSL context
+static STACK_OF(X509_INFO)* https_get_ca_bundle()
+{
+    static STACK_OF(X509_INFO)* inf = []() -> STACK_OF(X509_INFO)* {
+        uint64_t cacert_pem_len;
+        const uint8_t* cacert_pem = se_get_resource(SE_CACERT_PEM, &cacert_pem_len);
+        BIO *cbio = BIO_new_mem_buf(cacert_pem, cacert_pem_len);
+        if(!cbio) return NULL;
+        STACK_OF(X509_INFO)* parsed = PEM_X509_INFO_read_bio(cbio, NULL, NULL, NULL);
+        BIO_free(cbio);
+        return parsed;
+    }();
+    return inf;
+}
+
 CURLcode sslctx_function(CURL *curl, void *sslctx, void *parm)
 {
     CURLcode rv = CURLE_ABORTED_BY_CALLBACK;
     
-    uint64_t cacert_pem_len;
-    const uint8_t* cacert_pem = se_get_resource(SE_CACERT_PEM, &cacert_pem_len);
-
-    BIO *cbio = BIO_new_mem_buf(cacert_pem, cacert_pem_len);
     X509_STORE  *cts = SSL_CTX_get_cert_store((SSL_CTX *)sslctx);
     int i;
-    STACK_OF(X509_INFO) *inf;
     (void)curl;
     (void)parm;
 
-    if(!cts || !cbio) {
+    if(!cts) {
         return rv;
     }
 
-    inf = PEM_X509_INFO_read_bio(cbio, NULL, NULL, NULL);
+    STACK_OF(X509_INFO) *inf = https_get_ca_bundle();
 
     if(!inf) {
-        BIO_free(cbio);
         return rv;
     }
 
+    // X509_STORE_add_* take their own reference so the cached bundle stays valid
     for(i = 0; i < sk_X509_INFO_num(inf); i++) {
         X509_INFO *itmp = sk_X509_INFO_value(inf, i);
         if(itmp->x509) {
@@ -224,9 +325,6 @@ CURLcode sslctx_function(CURL *curl, void *sslctx, void *parm)
         }
     }
 
-    sk_X509_INFO_pop_free(inf, X509_INFO_free);
-    BIO_free(cbio);
-
     rv = CURLE_OK;
     return rv;
 }
@@ -289,7 +387,9 @@ void thread_pool::handle_job(job& j, CURL * curl)
     }
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
 
+    trace_begin("HTTPS Transfer");
     res = curl_easy_perform(curl);
+    trace_end();
 
     if (res != CURLE_OK)
     {
@@ -327,19 +427,37 @@ void https_request(http_request_e type, const std::string& url, const std::strin
                    const std::vector<std::pair<std::string, std::string>>& headers,
                    std::function<void(const std::vector<uint8_t>&)> callback, bool do_cache)
 {
-    if (type == http_request_e::GET && do_cache && cache_enabled.load(std::memory_order_relaxed)) {
-        std::unique_lock<std::mutex> lock(cache_mutex);
-        auto it = download_cache.find(url);
-        if (it != download_cache.end()) {
-            callback(it->second);
+    if (trace_active()) {
+        // The span covers the time in the queue and on the network until the callback returns
+        static std::atomic<uint64_t> next_id;
+        uint64_t id = ++next_id;
+        trace_async_begin("HTTPS Request", id);
+        callback = [id, callback](const std::vector<uint8_t>& result) {
+            trace_begin("HTTPS Callback");
+            callback(result);
+            trace_end();
+            trace_async_end("HTTPS Request", id);
+        };
+    }
+#ifndef EMSCRIPTEN
+    {
+        // Queued until the cache is loaded, which also keeps the caller from waiting on it
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        if (!pending_flushed) {
+            https_start_loader();
+            pending_jobs.push_back({type, url, body, headers, callback, do_cache});
             return;
         }
     }
-
-#ifndef EMSCRIPTEN
-    static thread_pool pool(32);
-    pool.push_job({type, url, body, headers, callback, do_cache});
+    if (https_cache_lookup(type, url, do_cache, callback))
+        return;
+    https_pool().push_job({type, url, body, headers, callback, do_cache});
 #else
+    // Without threads the cache is loaded by the first request
+    https_wait_loaded();
+    if (https_cache_lookup(type, url, do_cache, callback))
+        return;
+
     std::string method;
     switch (type)
     {
@@ -376,10 +494,21 @@ void https_request(http_request_e type, const std::string& url, const std::strin
 
 extern "C" void https_initialize()
 {
+#ifndef EMSCRIPTEN
+    std::unique_lock<std::mutex> lock(pending_mutex);
+    https_start_loader();
+#else
+    cache_path = std::string(se_get_pref_path()) + "/download_cache.bin";
+#endif
+}
+
+static void https_load()
+{
+    trace_begin("HTTPS Load");
 #ifndef EMSCRIPTEN
     curl_global_init(CURL_GLOBAL_ALL);
 #endif
-    std::string path = std::string(se_get_pref_path()) + "/download_cache.bin";
+    const std::string& path = cache_path;
     cache_file = fopen(path.c_str(), "rb+");
     if (!cache_file) {
         cache_file = fopen(path.c_str(), "wb+");
@@ -438,7 +567,7 @@ extern "C" void https_initialize()
                 break;
             }
 
-            // Don't need to lock here since this is very early initialization code
+            // Nothing else touches the cache before https_wait_loaded returns
             download_cache[url] = data;
         }
 
@@ -449,10 +578,22 @@ extern "C" void https_initialize()
             fwrite("SKYEMUCACHE", 1, 12, cache_file);
         }
     }
+    loaded.store(true);
+    trace_end();
 }
 
 extern "C" void https_shutdown()
 {
+#ifndef EMSCRIPTEN
+    {
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        if (!load_thread.joinable())
+            return;
+    }
+    load_thread.join();
+#endif
+    if (!loaded.load())
+        return;
 #ifndef EMSCRIPTEN
     curl_global_cleanup();
 #endif
@@ -467,6 +608,7 @@ extern "C" uint64_t https_cache_size()
 
 extern "C" void https_clear_cache()
 {
+    https_wait_loaded();
     std::unique_lock<std::mutex> lock(cache_mutex);
     download_cache.clear();
     cache_size.store(0, std::memory_order_relaxed);
@@ -483,6 +625,11 @@ extern "C" void https_set_cache_enabled(bool enabled)
     cache_enabled.store(enabled, std::memory_order_relaxed);
 }
 
+extern "C" bool https_cache_enabled()
+{
+    return cache_enabled.load(std::memory_order_relaxed);
+}
+
 extern "C" void https_open_url(const char* url)
 {
     std::string request = url;
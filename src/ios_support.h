@@ -1,9 +1,13 @@
 #ifndef IOS_SUPPORT_H
 #define IOS_SUPPORT_H 1
+#include <stdbool.h>
 
 void se_ios_open_file_picker( int num_extensions, const char ** extensions);
 void se_ios_get_safe_ui_padding(float *top, float* bottom,float* left, float *right);
 void se_ios_set_documents_working_directory();
 void se_ios_open_modal(const char* url);
 void se_ios_close_modal();
+// 0: nominal, 1: fair, 2: serious, 3: critical
+int se_ios_get_thermal_state();
+bool se_ios_low_power_mode();
 #endif
@@ -144,3 +144,10 @@ void se_ios_close_modal(){
     [webViewController dismissViewControllerAnimated:YES completion:nil];
   }];
 }
+int se_ios_get_thermal_state(){
+  // NSProcessInfoThermalState runs from Nominal (0) to Critical (3)
+  return (int)[[NSProcessInfo processInfo] thermalState];
+}
+bool se_ios_low_power_mode(){
+  return [[NSProcessInfo processInfo] isLowPowerModeEnabled];
+}
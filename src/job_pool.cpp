@@ -0,0 +1,176 @@
+extern "C" {
+#include "job_pool.h"
+#include "trace.h"
+}
+#include <atomic>
+
+static std::atomic<const char*> async_names[JOB_POOL_NUM_ASYNC_QUEUES];
+void job_pool_set_async_name(int queue, const char* name) { async_names[queue] = name; }
+// Web builds only get threads when built with pthreads (SE_WEB_THREADS)
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+struct job_pool_t {
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::vector<std::thread> workers;
+    job_pool_fn_t job = nullptr;
+    void* user_data = nullptr;
+    int num_jobs = 0;
+    std::atomic<int> next_job{0};
+    int busy_workers = 0;
+    unsigned generation = 0;
+    bool shutdown = false;
+
+    job_pool_t() {
+        unsigned threads = std::thread::hardware_concurrency();
+        // The calling thread also runs jobs
+        int num_workers = threads > 1 ? threads - 1 : 0;
+        if (num_workers > 7) num_workers = 7;
+        for (int i = 0; i < num_workers; ++i) workers.emplace_back([this] { worker_loop(); });
+    }
+    ~job_pool_t() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        work_cv.notify_all();
+        for (std::thread& t : workers) t.join();
+    }
+    void run_jobs() {
+        int i;
+        while ((i = next_job.fetch_add(1)) < num_jobs) job(user_data, i);
+    }
+    void worker_loop() {
+        trace_set_thread_name("Job Worker");
+        unsigned seen_generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [&] { return shutdown || generation != seen_generation; });
+                if (shutdown) return;
+                seen_generation = generation;
+            }
+            run_jobs();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busy_workers == 0) done_cv.notify_one();
+            }
+        }
+    }
+};
+}
+
+void job_pool_run(job_pool_fn_t job, void* user_data, int num_jobs) {
+    static job_pool_t pool;
+    if (pool.workers.empty() || num_jobs <= 1) {
+        for (int i = 0; i < num_jobs; ++i) job(user_data, i);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.job = job;
+        pool.user_data = user_data;
+        pool.num_jobs = num_jobs;
+        pool.next_job = 0;
+        pool.busy_workers = (int)pool.workers.size();
+        pool.generation++;
+    }
+    pool.work_cv.notify_all();
+    pool.run_jobs();
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done_cv.wait(lock, [] { return pool.busy_workers == 0; });
+}
+
+namespace {
+struct async_worker_t {
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::thread thread;
+    job_pool_fn_t job = nullptr;
+    void* user_data = nullptr;
+    std::atomic<bool> busy{false};
+    bool shutdown = false;
+
+    int queue;
+
+    async_worker_t(int queue) : queue(queue) { thread = std::thread([this] { worker_loop(); }); }
+    ~async_worker_t() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        work_cv.notify_all();
+        thread.join();
+    }
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_cv.wait(lock, [&] { return shutdown || job != nullptr; });
+            if (shutdown) return;
+            job_pool_fn_t curr_job = job;
+            lock.unlock();
+            const char* name = async_names[queue];
+            trace_set_thread_name(name);
+            trace_begin(name ? name : "Async Job");
+            curr_job(user_data, 0);
+            trace_end();
+            lock.lock();
+            job = nullptr;
+            busy = false;
+            done_cv.notify_all();
+        }
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&] { return job == nullptr; });
+    }
+};
+// Workers are started on first use so unused queues don't cost a thread
+async_worker_t& async_worker(int queue) {
+    static std::mutex mutex;
+    static std::unique_ptr<async_worker_t> workers[JOB_POOL_NUM_ASYNC_QUEUES];
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!workers[queue]) workers[queue].reset(new async_worker_t(queue));
+    return *workers[queue];
+}
+}
+
+void job_pool_run_async(int queue, job_pool_fn_t job, void* user_data) {
+    async_worker_t& worker = async_worker(queue);
+    worker.wait();
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.job = job;
+        worker.user_data = user_data;
+        worker.busy = true;
+    }
+    worker.work_cv.notify_one();
+}
+int job_pool_async_busy(int queue) { return async_worker(queue).busy; }
+void job_pool_wait_async(int queue) { async_worker(queue).wait(); }
+void job_pool_sleep_ms(int milliseconds) { std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds)); }
+#else
+// No threads on the single threaded web build
+void job_pool_run(job_pool_fn_t job, void* user_data, int num_jobs) {
+    for (int i = 0; i < num_jobs; ++i) job(user_data, i);
+}
+void job_pool_run_async(int queue, job_pool_fn_t job, void* user_data) {
+    const char* name = async_names[queue];
+    trace_begin(name ? name : "Async Job");
+    job(user_data, 0);
+    trace_end();
+}
+int job_pool_async_busy(int queue) { return 0; }
+void job_pool_wait_async(int queue) {}
+// The browser paces the main loop
+void job_pool_sleep_ms(int milliseconds) {}
+#endif
@@ -0,0 +1,21 @@
+#ifndef JOB_POOL_H
+#define JOB_POOL_H 1
+
+typedef void (*job_pool_fn_t)(void* user_data, int job_index);
+// Runs job(user_data,i) for every i in [0,num_jobs) across the worker threads and the calling
+// thread. Returns once all jobs completed.
+void job_pool_run(job_pool_fn_t job, void* user_data, int num_jobs);
+#define JOB_POOL_NUM_ASYNC_QUEUES 14
+// Runs job(user_data,0) on the background thread of queue and returns immediately. Each queue has
+// at most one job in flight, so this first waits for the previous job of the same queue.
+void job_pool_run_async(int queue, job_pool_fn_t job, void* user_data);
+// Names the queue's thread and jobs in traces (see trace.h), name must be a literal
+void job_pool_set_async_name(int queue, const char* name);
+// Returns non zero while the background job of queue is still running
+int job_pool_async_busy(int queue);
+// Blocks until the background job of queue (if any) completed
+void job_pool_wait_async(int queue);
+// Suspends the calling thread for at least milliseconds
+void job_pool_sleep_ms(int milliseconds);
+
+#endif
@@ -1,6 +1,7 @@
 #include "libretro.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 #include <string.h>
 #include <math.h>
@@ -11,6 +12,8 @@
 #include "gba.h"
 #include "nds.h"
 #include "localization.h"
+#define XXH_INLINE_ALL
+#include "xxhash.h"
 
 static retro_video_refresh_t video_refresh_cb = NULL;
 static retro_input_poll_t input_poll_cb = NULL;
@@ -40,8 +43,14 @@ enum opts_core_override {
   OPTS_CORE_OVERRIDE_NDS, 
 };
 
+enum opts_pixel_format {
+  OPTS_PIXEL_FORMAT_XRGB8888,
+  OPTS_PIXEL_FORMAT_RGB565,
+};
+
 struct {
   enum opts_core_override core_override;
+  enum opts_pixel_format pixel_format;
   bool gb_use_bios;
   bool gba_use_bios;
   bool nds_use_bios; 
@@ -60,9 +69,14 @@ struct {
 #define OPTS_KEY_SYSTEM_GBA_ENABLE_BIOS "system_gba_bios_enable"
 #define OPTS_KEY_SYSTEM_NDS_ENABLE_BIOS "system_nds_bios_enable"
 
+#define OPTS_KEY_VIDEO_PIXEL_FORMAT "video_pixel_format"
+#define OPTS_VAL_VIDEO_PIXEL_FORMAT_XRGB8888 "XRGB8888"
+#define OPTS_VAL_VIDEO_PIXEL_FORMAT_RGB565 "RGB565"
+
 void opts_initialize() {
   static struct retro_core_option_v2_category categories_default[] = {
     { .key = "system", .desc = "System Settings", .info = NULL },
+    { .key = "video", .desc = "Video Settings", .info = NULL },
     {0}
   };
 
@@ -83,6 +97,20 @@ void opts_initialize() {
       },
       OPTS_VAL_SYSTEM_CORE_OVERRIDE_AUTOMATIC,
     },
+    {
+      OPTS_KEY_VIDEO_PIXEL_FORMAT,
+      "Pixel Format",
+      NULL,
+      "Format of the frames sent to the frontend, RGB565 halves the bandwidth (Restart)",
+      NULL,
+      "video",
+      {
+        { OPTS_VAL_VIDEO_PIXEL_FORMAT_XRGB8888, NULL },
+        { OPTS_VAL_VIDEO_PIXEL_FORMAT_RGB565, NULL },
+        {0}
+      },
+      OPTS_VAL_VIDEO_PIXEL_FORMAT_XRGB8888,
+    },
     {
       OPTS_KEY_SYSTEM_GB_ENABLE_BIOS,
       "Game Boy Firmware",
@@ -205,6 +233,12 @@ void opts_reload_all() {
   else
     gopts.core_override = OPTS_CORE_OVERRIDE_AUTOMATIC;
 
+  var.key = OPTS_KEY_VIDEO_PIXEL_FORMAT;
+  if (env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, OPTS_VAL_VIDEO_PIXEL_FORMAT_RGB565) == 0)
+    gopts.pixel_format = OPTS_PIXEL_FORMAT_RGB565;
+  else
+    gopts.pixel_format = OPTS_PIXEL_FORMAT_XRGB8888;
+
   var.key = OPTS_KEY_SYSTEM_GB_ENABLE_BIOS;
   env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var);
   gopts.gb_use_bios = strcmp(var.value, OPTS_VAL_ON) == 0;
@@ -262,6 +296,163 @@ bool se_load_bios_file(const char* name, const char* base_path, const char* file
   return did_read;
 }
 
+/* ---------------- RETROARCH VIDEO ---------------- */
+
+static enum retro_pixel_format video_pixel_format = RETRO_PIXEL_FORMAT_XRGB8888;
+static bool video_can_dupe = false;
+static uint64_t video_last_frame_hash = 0;
+static bool video_last_frame_valid = false;
+
+void retro_set_pixel_format() {
+  enum retro_pixel_format fmt = gopts.pixel_format == OPTS_PIXEL_FORMAT_RGB565 ? RETRO_PIXEL_FORMAT_RGB565 : RETRO_PIXEL_FORMAT_XRGB8888;
+  if (!env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt) && fmt != RETRO_PIXEL_FORMAT_XRGB8888) {
+    log_cb(RETRO_LOG_WARN, "frontend rejected RGB565, falling back to XRGB8888\n");
+    fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+    env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt);
+  }
+  video_pixel_format = fmt;
+  video_last_frame_valid = false;
+}
+
+// Converts the RGBA8 framebuffer of a core straight into the frontend's buffer when it offers one
+static void retro_present_frame(const uint8_t* rgba, uint32_t width, uint32_t height, bool video_enabled) {
+  if (video_can_dupe) {
+    if (!video_enabled) {
+      video_refresh_cb(NULL, width, height, 0);
+      return;
+    }
+    uint64_t hash = XXH3_64bits_withSeed(rgba, width * height * 4, ((uint64_t)width << 32) | height);
+    if (video_last_frame_valid && hash == video_last_frame_hash) {
+      video_refresh_cb(NULL, width, height, 0);
+      return;
+    }
+    video_last_frame_hash = hash;
+    video_last_frame_valid = true;
+  }
+  static uint32_t fallback_frame[NDS_LCD_W * NDS_LCD_H * 2];
+  int bytes_per_pixel = video_pixel_format == RETRO_PIXEL_FORMAT_RGB565 ? 2 : 4;
+  uint8_t* dst = (uint8_t*)fallback_frame;
+  size_t pitch = width * bytes_per_pixel;
+  struct retro_framebuffer fb = {0};
+  fb.width = width;
+  fb.height = height;
+  fb.access_flags = RETRO_MEMORY_ACCESS_WRITE;
+  if (env_cb(RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER, &fb) && fb.data && fb.format == video_pixel_format &&
+      fb.pitch >= pitch) {
+    dst = (uint8_t*)fb.data;
+    pitch = fb.pitch;
+  }
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t* src = rgba + y * width * 4;
+    if (bytes_per_pixel == 2) {
+      uint16_t* line = (uint16_t*)(dst + y * pitch);
+      for (uint32_t x = 0; x < width; ++x, src += 4)
+        line[x] = ((src[0] >> 3) << 11) | ((src[1] >> 2) << 5) | (src[2] >> 3);
+    } else {
+      uint32_t* line = (uint32_t*)(dst + y * pitch);
+      for (uint32_t x = 0; x < width; ++x, src += 4)
+        line[x] = ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | src[2];
+    }
+  }
+  video_refresh_cb(dst, width, height, pitch);
+}
+
+// Sends everything the core produced this frame as one contiguous block
+static void retro_present_audio(bool audio_enabled) {
+  sb_ring_buffer_t* ring = &emu_state.audio_ring_buff;
+  uint32_t frames = sb_ring_buffer_size(ring) >> 1;
+  if (audio_enabled && frames) {
+    static int16_t block[SB_AUDIO_RING_BUFFER_SIZE];
+    uint32_t beg_ptr = ring->read_ptr % SB_AUDIO_RING_BUFFER_SIZE;
+    const int16_t* samples = &ring->data[beg_ptr];
+    if (beg_ptr + (frames << 1) > SB_AUDIO_RING_BUFFER_SIZE) {
+      uint32_t first = SB_AUDIO_RING_BUFFER_SIZE - beg_ptr;
+      memcpy(block, &ring->data[beg_ptr], first * sizeof(int16_t));
+      memcpy(block + first, ring->data, ((frames << 1) - first) * sizeof(int16_t));
+      samples = block;
+    }
+    size_t sent = 0;
+    while (sent < frames) {
+      size_t accepted = audio_sample_batch_cb(samples + sent * 2, frames - sent);
+      if (!accepted) break;
+      sent += accepted;
+    }
+  }
+  sb_ring_buffer_consume(ring, frames << 1);
+}
+
+/* ------------ RETROARCH SERIALIZATION ------------ */
+
+// States are the active core struct minus debug only and derived regions, which keep their
+// current values on unserialize. The layout is fixed once a game is loaded so the size never changes
+#define RETRO_STATE_MAGIC 0x534b5953u /* "SKYS" */
+#define RETRO_STATE_MAX_SEGMENTS 16
+
+typedef struct {
+  size_t offset;
+  size_t size;
+} retro_state_range_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t system;
+  uint64_t size;
+} retro_state_header_t;
+
+static retro_state_range_t retro_state_segments[RETRO_STATE_MAX_SEGMENTS];
+static int retro_state_num_segments = 0;
+static size_t retro_state_size = 0;
+
+static void retro_build_state_segments(size_t core_size, retro_state_range_t* skip, int num_skip) {
+  for (int i = 1; i < num_skip; ++i) {
+    for (int j = i; j > 0 && skip[j].offset < skip[j - 1].offset; --j) {
+      retro_state_range_t t = skip[j]; skip[j] = skip[j - 1]; skip[j - 1] = t;
+    }
+  }
+  retro_state_num_segments = 0;
+  retro_state_size = sizeof(retro_state_header_t);
+  size_t pos = 0;
+  for (int i = 0; i <= num_skip; ++i) {
+    size_t end = i < num_skip ? skip[i].offset : core_size;
+    if (end > pos && retro_state_num_segments < RETRO_STATE_MAX_SEGMENTS) {
+      retro_state_segments[retro_state_num_segments++] = (retro_state_range_t){ pos, end - pos };
+      retro_state_size += end - pos;
+    }
+    if (i < num_skip && skip[i].offset + skip[i].size > pos) pos = skip[i].offset + skip[i].size;
+  }
+}
+
+static bool retro_write_state(void* data, size_t size) {
+  if (size < retro_state_size || !retro_state_num_segments) return false;
+  retro_state_header_t header = { RETRO_STATE_MAGIC, emu_state.system, retro_state_size };
+  uint8_t* out = (uint8_t*)data;
+  memcpy(out, &header, sizeof header);
+  out += sizeof header;
+  const uint8_t* core = (const uint8_t*)&cores;
+  for (int i = 0; i < retro_state_num_segments; ++i) {
+    memcpy(out, core + retro_state_segments[i].offset, retro_state_segments[i].size);
+    out += retro_state_segments[i].size;
+  }
+  return true;
+}
+
+static bool retro_read_state(const void* data, size_t size) {
+  if (size < retro_state_size || !retro_state_num_segments) return false;
+  retro_state_header_t header;
+  memcpy(&header, data, sizeof header);
+  if (header.magic != RETRO_STATE_MAGIC || header.system != emu_state.system || header.size != retro_state_size) {
+    log_cb(RETRO_LOG_WARN, "rejecting save state with a different layout\n");
+    return false;
+  }
+  const uint8_t* in = (const uint8_t*)data + sizeof header;
+  uint8_t* core = (uint8_t*)&cores;
+  for (int i = 0; i < retro_state_num_segments; ++i) {
+    memcpy(core + retro_state_segments[i].offset, in, retro_state_segments[i].size);
+    in += retro_state_segments[i].size;
+  }
+  return true;
+}
+
 /* ------------------ RETROARCH GB ----------------- */
 
 void retro_gb_init(){
@@ -326,8 +517,7 @@ void retro_gb_init(){
   mmap.num_descriptors = sizeof mdesc / sizeof *mdesc;
   env_cb(RETRO_ENVIRONMENT_SET_MEMORY_MAPS, &mmap);
 
-  int pixel_fmt = RETRO_PIXEL_FORMAT_XRGB8888;
-  env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixel_fmt);
+  retro_set_pixel_format();
 
   sb_ptrs_init(&cores.gb, &scratch.gb, emu_state.rom_data);
 }
@@ -350,39 +540,31 @@ void retro_gb_reset() {
     sb_load_rom(&emu_state, &cores.gb, &scratch.gb);
 }
 
-void* retro_gb_step_frame(uint32_t* width, uint32_t* height) {
+const uint8_t* retro_gb_step_frame(uint32_t* width, uint32_t* height) {
   // must be done before each tick.
   uint8_t palette[12] = { 0xff,0xff,0xff,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x00,0x00,0x00 };
   for(int i = 0; i < 12; ++i) cores.gb.dmg_palette[i] = palette[i];
 
   sb_tick(&emu_state, &cores.gb, &scratch.gb);
 
-  static uint8_t flipped_frame[sizeof scratch.gb.framebuffer];
   *width = SB_LCD_W;
-  *height = SB_LCD_H;  
-  for (int i = 0; i < sizeof(flipped_frame); i += 4) {
-    // NOTE: assume little endian
-    flipped_frame[i + 0] = scratch.gb.framebuffer[i + 2]; // blue
-    flipped_frame[i + 1] = scratch.gb.framebuffer[i + 1]; // green
-    flipped_frame[i + 2] = scratch.gb.framebuffer[i + 0]; // red
-    flipped_frame[i + 3] = 0; // ignored
-  }
-  return flipped_frame;
-}
-
-size_t retro_gb_serialize_size() {
-  return sizeof cores.gb;
+  *height = SB_LCD_H;
+  return scratch.gb.framebuffer;
 }
 
-bool retro_gb_serialize(void* data, size_t size) {
-  if (size < sizeof cores.gb) return false;
-  memcpy(data, &cores.gb, sizeof cores.gb);
-  return true;
+void retro_gb_init_state_segments() {
+  // Only the part of the cartridge RAM the game actually has is live
+  size_t ram_size = cores.gb.cart.ram_size > 0 ? cores.gb.cart.ram_size : 0;
+  if (ram_size > sizeof cores.gb.cart.ram_data) ram_size = sizeof cores.gb.cart.ram_data;
+  retro_state_range_t skip[] = {
+    { offsetof(sb_gb_t, cart.ram_data) + ram_size, sizeof cores.gb.cart.ram_data - ram_size },
+    { offsetof(sb_gb_t, perf), sizeof cores.gb.perf },
+  };
+  retro_build_state_segments(sizeof cores.gb, skip, sizeof skip / sizeof *skip);
 }
 
 bool retro_gb_unserialize(const void* data, size_t size) {
-  if (size < sizeof cores.gb) return false;
-  memcpy(&cores.gb, data, sizeof cores.gb);
+  if (!retro_read_state(data, size)) return false;
   sb_ptrs_init(&cores.gb, &scratch.gb, emu_state.rom_data);
   return true;
 }
@@ -481,8 +663,7 @@ void retro_gba_init() {
   mmap.num_descriptors = sizeof mdesc / sizeof *mdesc;
   env_cb(RETRO_ENVIRONMENT_SET_MEMORY_MAPS, &mmap);
 
-  int pixel_fmt = RETRO_PIXEL_FORMAT_XRGB8888;
-  env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixel_fmt);
+  retro_set_pixel_format();
 
   gba_ptrs_init(&cores.gba, &scratch.gba, emu_state.rom_data);
 }
@@ -505,35 +686,24 @@ void retro_gba_reset() {
   gba_load_rom(&emu_state, &cores.gba, &scratch.gba);
 }
 
-void* retro_gba_step_frame(uint32_t* width, uint32_t* height) {
+const uint8_t* retro_gba_step_frame(uint32_t* width, uint32_t* height) {
   gba_tick(&emu_state, &cores.gba, &scratch.gba);
 
-  static uint8_t flipped_frame[sizeof scratch.gba.framebuffer];
   *width = GBA_LCD_W;
   *height = GBA_LCD_H;
-  for (int i = 0; i < sizeof(flipped_frame); i += 4) {
-    // NOTE: assume little endian
-    flipped_frame[i + 0] = scratch.gba.framebuffer[i + 2]; // blue
-    flipped_frame[i + 1] = scratch.gba.framebuffer[i + 1]; // green
-    flipped_frame[i + 2] = scratch.gba.framebuffer[i + 0]; // red
-    flipped_frame[i + 3] = 0; // ignored
-  }
-  return flipped_frame;
-}
-
-size_t retro_gba_serialize_size() {
-  return sizeof cores.gba;
+  return scratch.gba.framebuffer;
 }
 
-bool retro_gba_serialize(void* data, size_t size) {
-  if (size < sizeof cores.gba) return false;
-  memcpy(data, &cores.gba, sizeof cores.gba);
-  return true;
+void retro_gba_init_state_segments() {
+  retro_state_range_t skip[] = {
+    { offsetof(gba_t, mem.mmio_debug_access_buffer), sizeof cores.gba.mem.mmio_debug_access_buffer },
+    { offsetof(gba_t, perf), sizeof cores.gba.perf },
+  };
+  retro_build_state_segments(sizeof cores.gba, skip, sizeof skip / sizeof *skip);
 }
 
 bool retro_gba_unserialize(const void* data, size_t size) {
-  if (size < sizeof cores.gba) return false;
-  memcpy(&cores.gba, data, sizeof cores.gba);
+  if (!retro_read_state(data, size)) return false;
   gba_ptrs_init(&cores.gba, &scratch.gba, emu_state.rom_data);
   return true;
 }
@@ -717,8 +887,7 @@ void retro_nds_init() {
   mmap.num_descriptors = sizeof mdesc / sizeof *mdesc;
   env_cb(RETRO_ENVIRONMENT_SET_MEMORY_MAPS, &mmap);
 
-  int pixel_fmt = RETRO_PIXEL_FORMAT_XRGB8888;
-  env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixel_fmt);
+  retro_set_pixel_format();
 
   nds_ptrs_init(&cores.nds, &scratch.nds, emu_state.rom_data, emu_state.rom_size);
 }
@@ -741,36 +910,30 @@ void retro_nds_reset() {
   nds_load_rom(&emu_state, &cores.nds, &scratch.nds);
 }
 
-void* retro_nds_step_frame(uint32_t* width, uint32_t* height) {
+const uint8_t* retro_nds_step_frame(uint32_t* width, uint32_t* height) {
   nds_tick(&emu_state, &cores.nds, &scratch.nds);
 
-  static uint8_t flipped_frame[sizeof scratch.nds.framebuffer_full];
   *width = NDS_LCD_W;
   *height = NDS_LCD_H * 2; // we have two screens (bottom and top)
-  for (int i = 0; i < sizeof(flipped_frame); i += 4) {
-    // NOTE: assume little endian
-    flipped_frame[i + 0] = scratch.nds.framebuffer_full[i + 2]; // blue
-    flipped_frame[i + 1] = scratch.nds.framebuffer_full[i + 1]; // green
-    flipped_frame[i + 2] = scratch.nds.framebuffer_full[i + 0]; // red
-    flipped_frame[i + 3] = 0; // ignored
-  }
-  return flipped_frame;
-}
-
-size_t retro_nds_serialize_size() {
-  return sizeof cores.nds;
+  return scratch.nds.framebuffer_full;
 }
 
-bool retro_nds_serialize(void* data, size_t size) {
-  if (size < sizeof cores.nds) return false;
-  memcpy(data, &cores.nds, sizeof cores.nds);
-  return true;
+void retro_nds_init_state_segments() {
+  retro_state_range_t skip[] = {
+    { offsetof(nds_t, mem.mmio_debug_access_buffer), sizeof cores.nds.mem.mmio_debug_access_buffer },
+    // Rebuilt from VRAMCNT after the state is loaded
+    { offsetof(nds_t, mem.vram_bank_map), sizeof cores.nds.mem.vram_bank_map },
+    // The save path and log files only belong to the running session
+    { offsetof(nds_t, host), sizeof cores.nds.host },
+    { offsetof(nds_t, perf), sizeof cores.nds.perf },
+  };
+  retro_build_state_segments(sizeof cores.nds, skip, sizeof skip / sizeof *skip);
 }
 
 bool retro_nds_unserialize(const void* data, size_t size) {
-  if (size < sizeof cores.nds) return false;
-  memcpy(&cores.nds, data, sizeof cores.nds);
+  if (!retro_read_state(data, size)) return false;
   nds_ptrs_init(&cores.nds, &scratch.nds, emu_state.rom_data, emu_state.rom_size);
+  nds_update_vram_mapping(&cores.nds);
   return true;
 }
 
@@ -798,8 +961,16 @@ bool retro_nds_run_cheat(const uint32_t* buffer, uint32_t size) {
 
 /* ----------------- RETROARCH IMP ----------------- */
 
+static bool retro_set_serialization_quirks() {
+  // States are raw core structs, so they depend on the struct layout of the build that made them
+  uint64_t quirks = RETRO_SERIALIZATION_QUIRK_ENDIAN_DEPENDENT | RETRO_SERIALIZATION_QUIRK_PLATFORM_DEPENDENT;
+  env_cb(RETRO_ENVIRONMENT_SET_SERIALIZATION_QUIRKS, &quirks);
+  return true;
+}
+
 static bool load_rom(const struct retro_game_info* game) {
   opts_reload_all();
+  if (!env_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &video_can_dupe)) video_can_dupe = false;
 
   if (emu_state.rom_loaded) {
     free(emu_state.rom_data);
@@ -821,15 +992,21 @@ static bool load_rom(const struct retro_game_info* game) {
     ) {
       emu_state.system = SYSTEM_GB;
       retro_gb_init();
-      return retro_gb_load_rom();
+      if (!retro_gb_load_rom()) return false;
+      retro_gb_init_state_segments();
+      return retro_set_serialization_quirks();
     } else if ((!strcmp(".gba", extension) && gopts.core_override == OPTS_CORE_OVERRIDE_AUTOMATIC) || gopts.core_override == OPTS_CORE_OVERRIDE_GBA) {
       emu_state.system = SYSTEM_GBA;
       retro_gba_init();
-      return retro_gba_load_rom();
+      if (!retro_gba_load_rom()) return false;
+      retro_gba_init_state_segments();
+      return retro_set_serialization_quirks();
     } else if ((!strcmp(".nds", extension) && gopts.core_override == OPTS_CORE_OVERRIDE_AUTOMATIC) || gopts.core_override == OPTS_CORE_OVERRIDE_NDS) {
       emu_state.system = SYSTEM_NDS;
       retro_nds_init();
-      return retro_nds_load_rom();
+      if (!retro_nds_load_rom()) return false;
+      retro_nds_init_state_segments();
+      return retro_set_serialization_quirks();
     } 
   }  
 
@@ -953,69 +1130,49 @@ void retro_run(void) {
   emu_state.joy.touch_pos[1] = (float)mouse_pos[1] / SHRT_MAX;
   emu_state.joy.inputs[SE_KEY_PEN_DOWN] = input_state_cb(0, RETRO_DEVICE_POINTER, 0, RETRO_DEVICE_ID_POINTER_PRESSED) && emu_state.joy.touch_pos[1] > 0.0;
 
-  int video_audio_enabled;
-  env_cb(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &video_audio_enabled);
+  // Frontends without the call want both
+  int video_audio_enabled = 3;
+  if (!env_cb(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &video_audio_enabled)) video_audio_enabled = 3;
   int video_enabled = video_audio_enabled & 1;
   int audio_enabled = video_audio_enabled & 2;
 
   emu_state.render_frame = video_enabled;
+  // Sound registers keep working without the samples nobody hears
+  emu_state.audio_disabled = !audio_enabled;
+  // Frontends drawing only the last of several frames (ie. for run-ahead) can't tell us in advance
+  emu_state.render_next_frame = true;
 
   uint32_t width = 0, height = 0;
-  void* data = NULL;
+  const uint8_t* data = NULL;
   switch (emu_state.system) {
     case SYSTEM_GB: { 
       data = retro_gb_step_frame(&width, &height); 
-      se_run_all_ar_cheats(retro_gb_run_cheat);
+      se_run_all_ar_cheats(retro_gb_run_cheat,NULL);
     } break;
     case SYSTEM_GBA: { 
       data = retro_gba_step_frame(&width, &height);
-      se_run_all_ar_cheats(retro_gba_run_cheat);
+      se_run_all_ar_cheats(retro_gba_run_cheat,gba_compile_ar_cheat);
     } break;
     case SYSTEM_NDS: {
       data = retro_nds_step_frame(&width, &height);  
-      se_run_all_ar_cheats(retro_nds_run_cheat);
+      se_run_all_ar_cheats(retro_nds_run_cheat,NULL);
     } break;
     default:;
   }
-  int pitch = width * 4;
-  video_refresh_cb(data, width, height, pitch);
-
-  uint32_t samples = sb_ring_buffer_size(&emu_state.audio_ring_buff);
-  uint32_t frames = samples >> 1;
-  uint32_t beg_ptr = emu_state.audio_ring_buff.read_ptr;
-  uint32_t end_ptr = (emu_state.audio_ring_buff.read_ptr + (frames << 1)) % SB_AUDIO_RING_BUFFER_SIZE;
-  if (audio_enabled) {
-    if (end_ptr < beg_ptr) {
-      int remaining = (SB_AUDIO_RING_BUFFER_SIZE - beg_ptr) >> 1;
-      audio_sample_batch_cb(&emu_state.audio_ring_buff.data[beg_ptr], remaining);
-      audio_sample_batch_cb(&emu_state.audio_ring_buff.data[0], frames - remaining);
-    } else {
-      audio_sample_batch_cb(&emu_state.audio_ring_buff.data[beg_ptr], frames);
-    }
-  }
-  emu_state.audio_ring_buff.read_ptr = end_ptr;
+  if (data) retro_present_frame(data, width, height, video_enabled);
+  retro_present_audio(audio_enabled);
 }
 
 size_t retro_serialize_size(void) {
   // NOTE: savestate buffer size can never be allowed
-  // to increase from the initial call. But, since
-  // only ever one core can be loaded, that actual
-  // size will never change.
-  switch (emu_state.system) {
-    case SYSTEM_GB: return retro_gb_serialize_size();
-    case SYSTEM_GBA: return retro_gba_serialize_size();
-    case SYSTEM_NDS: return retro_nds_serialize_size(); 
-    default: return 0;
-  }
+  // to increase from the initial call. The segments
+  // are only built when a game is loaded, so the
+  // size stays fixed for the whole session.
+  return retro_state_num_segments ? retro_state_size : 0;
 }
 
 bool retro_serialize(void* data, size_t size) {
-  switch (emu_state.system) {
-    case SYSTEM_GB: return retro_gb_serialize(data, size);
-    case SYSTEM_GBA: return retro_gba_serialize(data, size);
-    case SYSTEM_NDS: return retro_nds_serialize(data, size);
-    default: return false;
-  }
+  return retro_write_state(data, size);
 }
 
 bool retro_unserialize(const void* data, size_t size) {
@@ -1059,6 +1216,7 @@ void retro_unload_game(void) {
   if (emu_state.rom_loaded) {
     free(emu_state.rom_data);
   }
+  retro_state_num_segments = 0;
   emu_state.rom_loaded = false;
   emu_state.rom_path[0] = 0;
 }
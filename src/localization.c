@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <locale.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #if defined(SE_PLATFORM_IOS) || defined(SE_PLATFORM_MACOS)
 #include <CoreFoundation/CoreFoundation.h>
@@ -2127,6 +2128,17 @@ char ** localization_map=NULL;
 size_t localization_size=0;
 int se_get_default_language();
 
+// se_localize_cached() results keyed on the string pointer. The hash of the contents is checked
+// too since some labels are built in reused buffers. Cleared when the language changes.
+#define SE_LOCALIZE_CACHE_SIZE 4096
+#define SE_LOCALIZE_CACHE_PROBES 8
+typedef struct{
+    const char* key;
+    const char* value;
+    uint64_t hash;
+}se_localize_cache_entry_t;
+static se_localize_cache_entry_t se_localize_cache[SE_LOCALIZE_CACHE_SIZE];
+
 int se_localize_cmp(const void *a, const void*b){return strcmp(((const char**)a)[0],((const char**)b)[0]);}
 void se_set_language(int language_enum){
     char ** new_map = NULL;
@@ -2144,6 +2156,7 @@ void se_set_language(int language_enum){
     if(new_map!=localization_map){
         localization_map=new_map;
         localization_size=0;
+        memset(se_localize_cache,0,sizeof(se_localize_cache));
         if(localization_map){
             while(localization_map[localization_size*2])++localization_size;
             qsort(localization_map,localization_size,sizeof(const char*)*2,se_localize_cmp);
@@ -2285,3 +2298,24 @@ const char* se_localize(const char* string){
     if(!result)return string;
     else return result[1];
 }
+const char* se_localize_cached(const char* string, bool* new_entry){
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(const char* c=string;*c;++c)hash=(hash^(uint8_t)*c)*0x100000001b3ull;
+    uint32_t slot = (uint32_t)((hash^(uintptr_t)string)*0x9E3779B97F4A7C15ull>>40);
+    se_localize_cache_entry_t* free_entry = NULL;
+    for(int p=0;p<SE_LOCALIZE_CACHE_PROBES;++p){
+        se_localize_cache_entry_t* entry = se_localize_cache+((slot+p)&(SE_LOCALIZE_CACHE_SIZE-1));
+        if(entry->key==string&&entry->hash==hash){
+            if(new_entry)*new_entry=false;
+            return entry->value;
+        }
+        if(!entry->key&&!free_entry)free_entry=entry;
+    }
+    // Strings from buffers that keep changing can fill the probe window, its first slot is reused then
+    if(!free_entry)free_entry = se_localize_cache+(slot&(SE_LOCALIZE_CACHE_SIZE-1));
+    free_entry->key = string;
+    free_entry->hash = hash;
+    free_entry->value = se_localize(string);
+    if(new_entry)*new_entry=true;
+    return free_entry->value;
+}
@@ -1,6 +1,8 @@
 #ifndef LOCALIZATION_H
 #define LOCALIZATION_H
 
+#include <stdbool.h>
+
 #define SE_LANG_DEFAULT 0
 #define SE_LANG_ENGLISH 5
 #define SE_LANG_ARABIC  10
@@ -26,6 +28,9 @@
 void se_set_language(int language_enum);//i.e. SE_LANG_ENGLISH
 const char* se_language_string(int language_enum);//returns "" if language is not supported
 const char* se_localize(const char* string);
+// Same as se_localize() but cached per string, new_entry (optional) is set on the first lookup of
+// the string in the current language
+const char* se_localize_cached(const char* string, bool* new_entry);
 int se_convert_locale_to_enum(const char* clocale);
 
 #endif
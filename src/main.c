@@ -8,12 +8,14 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "shared.h"
 #define SE_REBIND_TIMER_LENGTH 5.0
 
 #ifdef ENABLE_HTTP_CONTROL_SERVER
 #include "http_control_server.h"
+#include "shm_control.h"
 #endif 
 
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
@@ -22,6 +24,12 @@
 #include "retro_achievements.h"
 #endif
 
+#ifdef ENABLE_LUA_SCRIPTING
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#endif
+
 #include "gba.h"
 #include "nds.h"
 #include "gb.h"
@@ -32,10 +40,19 @@
 
 #if defined(EMSCRIPTEN)
 #include <emscripten.h>
+#if defined(__EMSCRIPTEN_PTHREADS__)
+#include <emscripten/threading.h>
+#endif
 #endif
 
 #include "cloud.h"
 #include "mutex.h"
+#include "job_pool.h"
+#include "trace.h"
+#include "xxhash.h"
+#include "frame_dump.h"
+#include "mem_search.h"
+#include "netplay.h"
 #include "res.h"
 #include "sokol_app.h"
 #include "sokol_audio.h"
@@ -59,6 +76,7 @@
 
 #ifdef SE_PLATFORM_ANDROID
   #include <android/log.h>
+  #include <dlfcn.h>
 #endif
 #ifdef SE_PLATFORM_IOS
 #include "ios_support.h"
@@ -169,6 +187,8 @@ typedef struct{
 typedef struct{
   char path[SB_FILE_PATH_SIZE];
 }se_game_info_t;
+// persistent_settings_t.nds_cpu_slice value that lets the performance governor pick the slice
+#define SE_NDS_CPU_SLICE_AUTO 4
 typedef struct{
   // This structure is directly saved out for the user settings. 
   // Be very careful to keep alignment and ordering the same otherwise you will break the settings. 
@@ -204,10 +224,46 @@ typedef struct{
   float gui_scale_factor;
   uint32_t only_one_notification;
   uint32_t enable_download_cache;
-  uint32_t padding[221];
+  uint32_t cpu_batch_exec;
+  uint32_t cpu_idle_loop_skip;
+  uint32_t nds_cpu_slice; // Index of Lockstep/16/64/256 cycles, SE_NDS_CPU_SLICE_AUTO
+  uint32_t nds_threaded_ppu;
+  uint32_t nds_hle_bios;
+  uint32_t nds_instant_card;
+  uint32_t rewind_memory;
+  uint32_t rewind_length;
+  uint32_t run_ahead_frames;
+  uint32_t run_ahead_second_instance;
+  uint32_t threaded_emulation;
+  uint32_t frame_pacing; // SE_PACING_WALL_CLOCK, SE_PACING_DISPLAY or SE_PACING_AUDIO
+  uint32_t late_input_polling;
+  uint32_t gba_hle_bios;
+  uint32_t perf_governor;
+  uint32_t shader_chain; // Index into se_shader_chains, 0: no upscaling passes
+  uint32_t nds_threaded_arm7;
+  uint32_t nds_3d_scale; // NDS 3D resolution multiplier minus one, 0: rendered by the core, see se_nds_3d_t
+  uint32_t padding[203];
 }persistent_settings_t; 
 _Static_assert(sizeof(persistent_settings_t)==1024, "persistent_settings_t must be exactly 1024 bytes");
 #define SE_STATS_GRAPH_DATA 256
+// Measurements of the last SE_FRAME_STATS_SIZE UI frames. Every measure also keeps a histogram of
+// the samples in the ring, updated as they enter and leave it, so percentiles need no sort.
+#define SE_FRAME_STATS_SIZE 1024
+#define SE_FRAME_STATS_BINS 2048
+#define SE_FRAME_STATS_BIN_MS 0.05 // The last bin also holds everything slower
+#define SE_FRAME_STAT_EMULATION 0
+#define SE_FRAME_STAT_RENDER 1
+#define SE_FRAME_STAT_UPLOAD 2
+#define SE_FRAME_STAT_PRESENT 3
+#define SE_FRAME_STAT_COUNT 4
+typedef struct{
+  float ms[SE_FRAME_STATS_SIZE][SE_FRAME_STAT_COUNT];
+  uint16_t bins[SE_FRAME_STAT_COUNT][SE_FRAME_STATS_BINS];
+  uint64_t frames; // Samples pushed so far
+}se_frame_stats_t;
+typedef struct{
+  float p50, p95, p99, max;
+}se_frame_percentiles_t;
 typedef struct{
   double last_render_time;
   double last_emu_time;
@@ -217,22 +273,132 @@ typedef struct{
   float waveform_r[SE_STATS_GRAPH_DATA];
   float waveform_fps_emulation[SE_STATS_GRAPH_DATA];
   float waveform_fps_render[SE_STATS_GRAPH_DATA];
+  float waveform_pacing_error[SE_STATS_GRAPH_DATA];
+  se_frame_stats_t frames;
+  // Accumulated over the current UI frame, emulation_ms is written by the emulation thread
+  double emulation_ms;
+  uint64_t upload_ticks;
+  uint64_t frame_start_tick;
+  float last_render_ms, last_upload_ms;
 }se_emulator_stats_t;
+// Frames can be scheduled against the wall clock, or once per display refresh with the rate
+// locked to the display or nudged by the audio ring fill so audio never has to be resampled
+#define SE_PACING_WALL_CLOCK 0
+#define SE_PACING_DISPLAY 1
+#define SE_PACING_AUDIO 2
+// Ratios of emulated frames per refresh this close to n or 1/n are snapped to it
+#define SE_PACING_SNAP_TOLERANCE 0.01
+#define SE_PACING_AUDIO_GAIN 0.005
+// Fill level of the audio ring the output resampler steers towards
+#define SE_AUDIO_TARGET_FILL 4096
+// Largest resampling ratio change the dynamic rate control applies (0.5% is below audible pitch shift)
+#define SE_AUDIO_MAX_RATE_DELTA 0.005
+typedef struct{
+  double display_period; // Measured refresh interval, 0 until known
+  double debt; // Fractional frames owed to the emulator
+  double last_tick_time;
+  double ratio; // Emulated frames per refresh used for the last tick
+  float error_ms; // Emulated minus elapsed time of the last tick
+  float error_avg_ms;
+}se_frame_pacer_t;
+// The performance governor trades output quality for speed while the emulator can't keep up or
+// the device is throttling, and gives it back once there is headroom again. Each level adds on
+// to the savings of the one below it. It never overrides a choice of the user, the NDS CPU slice is
+// only raised with that setting on Auto, and the 3D resolution is left alone.
+#define SE_GOVERNOR_LEVELS 5
+// Emulation time per frame over the frame period that counts as out of headroom, or as plenty
+#define SE_GOVERNOR_HIGH_LOAD 0.9
+#define SE_GOVERNOR_LOW_LOAD 0.6
+typedef struct{
+  int level;
+  int thermal; // 0: nominal, 1: fair, 2: serious, 3: critical
+  bool low_power;
+  float load; // Smoothed emulation load, 1.0 is just keeping full speed
+  double high_load_time, low_load_time; // Seconds the load has stayed past the thresholds
+  double hold_time; // Seconds of low load needed to step down, doubled when stepping down didn't stick
+  double last_change_time, last_update_time, last_poll_time;
+  const char* reason;
+  uint32_t frame_counter; // Emulated frames, phases the frame skip
+  // Applied to the emulator by se_update_frame and the emulation loop
+  int frame_skip;
+  int rewind_interval;
+  bool low_quality_audio;
+  int min_nds_cpu_slice_cycles; // Only applied with the NDS CPU slice setting on Auto
+}se_perf_governor_t;
+// Per game tuning applied when a ROM is loaded, from the bundled profiles and then game_profiles.txt
+// in the preferences folder so users can add and override entries. Fields left at -1 (0 for the
+// numbers) keep the user's settings.
+typedef struct{
+  char key[17]; // GBA/NDS game code or the game_checksum of any ROM as 16 hex digits, empty if none matched
+  int8_t idle_loop_skip;
+  int8_t instant_card; // Only where the game doesn't time its gamecard transfers
+  int8_t threaded_ppu;
+  int cpu_slice_cycles; // Preferred NDS CPU slice, also kept when the governor would raise it
+  int rewind_interval; // Frames between rewind captures at governor level 0
+  uint32_t idle_loop_pc[2]; // See sb_emu_state_t.idle_loop_hint_pc
+}se_game_profile_t;
+// Counters served by the /metrics HCS command. Every field has a single writer and the server thread
+// reads them without a lock, so a scrape can see a histogram a few observations off its count.
+#define SE_METRICS_BUCKETS 10
+static const double se_metrics_frame_buckets[SE_METRICS_BUCKETS]={0.001,0.002,0.004,0.008,0.0125,0.0167,0.025,0.0333,0.05,0.1};
+static const double se_metrics_save_buckets[SE_METRICS_BUCKETS]={0.001,0.0025,0.005,0.01,0.025,0.05,0.1,0.25,0.5,1.0};
+typedef struct{
+  volatile uint64_t buckets[SE_METRICS_BUCKETS+1]; // Per bucket counts, the last one is +Inf
+  volatile uint64_t count;
+  volatile uint64_t sum_ns;
+}se_metrics_histogram_t;
+typedef struct{
+  volatile uint64_t emulated_frames;
+  volatile uint64_t emulation_fps_milli;
+  volatile uint64_t rom_loaded;
+  se_metrics_histogram_t emulated_frame_time;
+  se_metrics_histogram_t display_frame_time;
+  volatile uint64_t audio_underruns;
+  volatile uint64_t audio_watchdog_resets;
+  volatile uint64_t rewind_bytes_used, rewind_bytes_budget, rewind_entries;
+  se_metrics_histogram_t save_write_time;
+  volatile uint64_t save_write_failures;
+  volatile uint64_t core_ns;
+  volatile uint64_t subsystem_ns[SB_PROFILE_COUNT];
+}se_metrics_t;
+static se_metrics_t se_metrics;
+// Only called by the field's writer, so reading the old value needs no atomic
+static void se_metrics_add(volatile uint64_t* v, uint64_t n){sb_atomic_store_relaxed_u64(v,*v+n);}
+static void se_metrics_observe(se_metrics_histogram_t* h, const double* bounds, double seconds){
+  if(seconds<0)seconds=0;
+  int b = 0;
+  while(b<SE_METRICS_BUCKETS&&seconds>bounds[b])++b;
+  se_metrics_add(&h->buckets[b],1);
+  se_metrics_add(&h->sum_ns,seconds*1e9);
+  se_metrics_add(&h->count,1);
+}
+static bool se_pacer_locked();
 #define SE_FILE_BROWSER_CLOSED 0
 #define SE_FILE_BROWSER_OPEN 1
 #define SE_FILE_BROWSER_SELECTED 2
 
+typedef struct{
+  char* path; // malloc'd
+  const char* name; // Points into path
+  bool is_dir;
+  bool is_link;
+}se_file_browser_entry_t;
+typedef struct{
+  se_file_browser_entry_t* entries;
+  size_t size;
+  size_t capacity;
+}se_file_browser_list_t;
 typedef struct{
   char current_path[SB_FILE_PATH_SIZE];
   char file_path[SB_FILE_PATH_SIZE];
   int state; // 0 = Closed no file selected,  1= Open,  2 = closed file selected
-  tinydir_file* cached_files;
+  se_file_browser_list_t cached_files; // Sorted, what is shown
+  se_file_browser_list_t refreshed_files; // Collected by a refresh of cached_path, swapped in once complete
   char cached_path[SB_FILE_PATH_SIZE];
   char cached_ext_filter[SB_FILE_PATH_SIZE];
-  size_t num_cached_files;
   double cached_time; 
-  tinydir_dir cached_dir; 
   bool has_cache;
+  bool listing_refresh;
   bool allow_directory;
   unsigned num_file_types;
   const char** file_types; 
@@ -252,7 +418,8 @@ typedef struct{
   char cheat_codes[SB_FILE_PATH_SIZE];
   char theme[SB_FILE_PATH_SIZE];
   char custom_font[SB_FILE_PATH_SIZE];
-  char padding[3][SB_FILE_PATH_SIZE];
+  char rom_library[SB_FILE_PATH_SIZE]; // Indexed for the load game screen, empty when unset
+  char padding[2][SB_FILE_PATH_SIZE];
 }se_search_paths_t;
 
 _Static_assert(sizeof(se_search_paths_t)==SB_FILE_PATH_SIZE*8, "se_search_paths_t must contain 8 paths");
@@ -373,14 +540,154 @@ typedef struct{
   uint8_t palettes[5*4];
   se_theme_region_t regions[SE_TOTAL_REGIONS];
 }se_custom_theme_t;
+// Memory range registered with the HCS /watch command, its value is returned after every /step
+#define SE_HCS_MAX_WATCHES 64
+#define SE_HCS_MAX_RANGE_SIZE (16*1024*1024)
+typedef struct{
+  uint64_t addr;
+  uint32_t size;
+  int map;
+}se_hcs_watch_t;
 typedef struct se_deferred_image_free_t{
   sg_image image; 
   struct se_deferred_image_free_t * next; 
 }se_deferred_image_free_t;
+// Images that are redrawn every frame are taken from a pool in draw order and updated in place.
+// Each slot rotates through several textures so an upload never waits on a frame still in flight.
+#define SE_STREAM_IMAGE_SLOTS 32
+#define SE_STREAM_IMAGE_BUFFERS 3
+typedef struct{
+  sg_image image[SE_STREAM_IMAGE_BUFFERS];
+  int width, height;
+  int next;
+  bool uploaded; // The current texture holds the pixels of hash
+  uint64_t hash; // Of the pixels in the current texture
+}se_stream_image_t;
+// Upscaling filters run on the emulated frame in offscreen passes before the LCD shader. Each pass
+// renders into a target that is an integer multiple of its input, so the cost follows the
+// emulated resolution rather than the window's.
+#define SE_MAX_SHADER_PASSES 2
+#define SE_SHADER_PASS_XBRZ 0
+#define SE_SHADER_PASS_SCALE2X 1
+typedef struct{
+  int num_passes;
+  uint8_t filter[SE_MAX_SHADER_PASSES];
+  uint8_t scale[SE_MAX_SHADER_PASSES];
+}se_shader_chain_t;
+// In the order of the "Upscaling Filter" setting
+static const se_shader_chain_t se_shader_chains[]={
+  {0}, // None
+  {1,{SE_SHADER_PASS_XBRZ},{2}},
+  {1,{SE_SHADER_PASS_XBRZ},{4}},
+  {1,{SE_SHADER_PASS_SCALE2X},{2}},
+  {2,{SE_SHADER_PASS_SCALE2X,SE_SHADER_PASS_SCALE2X},{2,2}},
+};
+#define SE_NUM_SHADER_CHAINS (sizeof(se_shader_chains)/sizeof(se_shader_chains[0]))
+// Chain outputs of the stream image slot with the same index, rendered again only when its input
+// changes
+typedef struct{
+  sg_image target[SE_MAX_SHADER_PASSES];
+  sg_pass pass[SE_MAX_SHADER_PASSES];
+  int chain;
+  int width, height;
+  bool valid; // The targets hold the output for image_id and hash
+  uint32_t image_id;
+  uint64_t hash;
+}se_shader_chain_slot_t;
+// Screen ghosting history of the stream image slot with the same index. Every emulated frame is
+// mixed in as history = frame*(1-coef)+history*coef, the decay the cores used to apply to their
+// framebuffers, so the LCD shows the history and it is only rendered while it still moves.
+typedef struct{
+  sg_image target[2];
+  sg_pass pass[2];
+  int width, height;
+  int current; // Target holding the history
+  bool valid;
+  uint64_t frame; // gui_state.emulated_frames at the last update
+  uint64_t hash;  // Stream image hash at the last update
+  float residual; // Weight the history still gives to frames before the current one
+}se_ghost_slot_t;
+// Renders the NDS 3D engine on the GPU at a multiple of its resolution from the polygons of
+// nds_gpu_hires_t in place of the rasterizer of the core, and blends the render into the pixels
+// of the frame the 2D engines marked as showing it. The color, polygon attributes and depth are
+// drawn in separate passes over the same geometry, since sokol_gfx can't blend them differently
+// in one pass on GL or sample a depth image, the post passes of the core then read them.
+#define SE_NDS_3D_TEXTURES 1024
+#define SE_NDS_3D_VERTEX_FLOATS 22
+typedef struct{
+  const uint32_t* texels; // Decoded texture in the texture cache of the core, NULL if free
+  uint32_t size_bits;     // Size bits of TEXIMAGE_PARAM
+  sg_image image;
+}se_nds_3d_texture_t;
+typedef struct{
+  int scale;
+  sg_image color, attrs, depths, depth, output;
+  sg_pass pass[3], output_pass; // Color, attributes and depths, all on depth
+  uint32_t frame;      // nds_gpu_hires_t.frame of the render
+  bool rendered;       // color, attrs and depths hold the render of frame or an earlier one
+  bool output_valid;
+  uint32_t output_image_id;
+  uint64_t output_hash;
+  uint16_t output_master_bright;
+  uint64_t tex_cache_flushes; // nds_tex_cache_t.flushes the textures belong to
+  se_nds_3d_texture_t textures[SE_NDS_3D_TEXTURES];
+  uint32_t num_textures;
+  sg_image toon, table, white;
+  sg_buffer vb;
+  float* verts;
+  sg_shader prog, output_prog;
+  // [output][opaque, translucent, translucent without depth writes][equal depth test]
+  sg_pipeline pipeline[3][3][2];
+  sg_pipeline output_pipeline;
+}se_nds_3d_t;
+// With nothing changing on screen and the emulator paused the UI drops to this rate
+#define SE_IDLE_FRAME_MS 50
+#define SE_IDLE_DELAY 1.0
+// Deflated varint encoding of one sb_exec_trace_chunk_t
+typedef struct{
+  uint64_t first_instruction;
+  uint32_t num_instructions;
+  uint32_t num_writes;
+  uint32_t raw_size;
+  uint32_t size;
+  uint8_t* data;
+}se_trace_block_t;
+typedef struct{
+  uint64_t instruction;
+  uint8_t* core;
+}se_trace_keyframe_t;
+#define SE_TIME_TRAVEL_MAX_KEYFRAMES 16
+typedef struct{
+  bool recording;
+  int cpu;
+  sb_exec_trace_t trace;
+  sb_exec_trace_chunk_t* chunks[2];
+  sb_exec_trace_chunk_t* compressing; // Owned by SE_ASYNC_EXEC_TRACE while it runs
+  uint8_t* encode_buffer;
+  se_trace_block_t* blocks; // Also owned by SE_ASYNC_EXEC_TRACE while it runs
+  int num_blocks;
+  int block_capacity;
+  uint64_t compressed_bytes;
+  se_trace_keyframe_t keyframes[SE_TIME_TRAVEL_MAX_KEYFRAMES];
+  int num_keyframes;
+  // Registers of the traced CPU after the last frame, anything else changing them ends the history
+  uint32_t last_registers[37];
+  bool replaying;
+  uint64_t replay_target;
+}se_time_travel_t;
 typedef struct {
     uint64_t laptime;
     sg_pass_action pass_action;
     se_deferred_image_free_t * image_free_list;
+    se_stream_image_t stream_images[SE_STREAM_IMAGE_SLOTS];
+    se_shader_chain_slot_t shader_chain_slots[SE_STREAM_IMAGE_SLOTS];
+    se_ghost_slot_t ghost_slots[SE_STREAM_IMAGE_SLOTS];
+    se_nds_3d_t nds_3d;
+    int stream_images_used; // Reset every frame
+    uint64_t emulated_frames; // Counted when an update ends, drives the screen ghosting decay
+    int stream_images_uploaded; // Reset every frame
+    double last_activity_time;
+    float idle_joy_inputs[SE_NUM_KEYBINDS];
     int screen_width;
     int screen_height;
     float dpi_override;
@@ -398,6 +705,9 @@ typedef struct {
     bool ra_encore_mode;
     bool ra_logged_in;
     bool ra_needs_reload;
+    // rcheevos hash of the loaded ROM, written by SE_ASYNC_RA_HASH. Empty if hashing failed.
+    char ra_hash[33];
+    bool ra_hash_started;
     se_keybind_state_t key;
     se_controller_state_t controller;
     se_game_info_t recently_loaded_games[SE_NUM_RECENT_PATHS];
@@ -408,19 +718,55 @@ typedef struct {
     persistent_settings_t last_saved_settings;
     bool overlay_open;
     se_emulator_stats_t emu_stats; 
+    se_frame_pacer_t pacer;
+    se_perf_governor_t governor;
+    se_game_profile_t game_profile; // Of the loaded ROM
+    // Where the last timeline recording was saved
+    char trace_path[SB_FILE_PATH_SIZE];
+    // Core event log (see sb_event_log_t), drained to event_log_file on SE_ASYNC_EVENT_LOG
+    sb_event_log_t* event_log;
+    FILE* event_log_file;
+    volatile uint64_t event_log_records;
+    bool event_log_failed;
+    bool event_log_types[SB_EVENT_COUNT];
+    char event_log_path[SB_FILE_PATH_SIZE];
+    // Used to render only the last frame of each tick while fast forwarding
+    double emulated_frame_cost;
+    int ticks_without_render;
+    // Profile of the last SE_PROFILE_WINDOW_FRAMES emulated frames, shown in the stats panel and /status
+    sb_profile_t last_profile;
     // Utilize a watchdog channel to detect if the audio context has encountered an error
     // and restart it if a problem occurred. 
     int audio_watchdog_timer; 
     int audio_watchdog_triggered; 
     bool block_touchscreen;
     bool test_runner_mode;
+    // Set when the emulation frames of this UI frame are handed to the emulation thread
+    bool emulation_dispatch_pending;
+    bool emulation_running_async;
+    // Keyboard presses arriving while the emulation thread runs are published here for the cores
+    sb_late_input_t late_input;
+    uint32_t late_input_other_buttons; // Pressed by sources other than the keyboard
+    bool late_input_keyboard;
     sg_shader lcd_prog;
     sg_buffer quad_vb;
     sg_pipeline lcd_pipeline;
+    sg_shader nds_prog;
+    sg_pipeline nds_pipeline; // Both NDS screens in one draw, see se_draw_nds_lcd
+    sg_shader ghost_prog;
+    sg_pipeline ghost_pipeline; // Screen ghosting history updates, see se_ghost_slot_t
+    sg_shader scale_prog;
+    sg_pipeline scale_pipeline; // Upscaling passes of se_shader_chains
     se_file_browser_state_t file_browser; 
     float mouse_pos[2];
     bool mouse_button[3];
     float menubar_hide_timer;
+    bool menubar_hidden; // Slid fully off screen in the last UI frame
+    // LCD only frames, see se_can_skip_ui_frame
+    bool ui_dirty;
+    bool ui_lcd_only;
+    double last_ui_frame_time;
+    uint32_t ui_ra_overlay_events;
     se_touch_controls_t touch_controls; 
     se_search_paths_t paths;
     se_search_paths_t last_saved_paths;
@@ -429,6 +775,35 @@ typedef struct {
     uint8_t font_cache_page_valid[(SE_MAX_UNICODE_CODE_POINT+1)/SE_FONT_CACHE_PAGE_SIZE];
     bool update_font_atlas;
     sb_joy_t hcs_joypad; 
+    se_hcs_watch_t hcs_watches[SE_HCS_MAX_WATCHES];
+    int num_hcs_watches;
+    // Debugger breakpoints of each CPU, indexed like sb_emu_state_t.watch
+    sb_watch_table_t cpu_watch[2];
+    int new_watch_start, new_watch_end;
+    sb_mem_search_t mem_search;
+    const uint8_t* mem_search_source; // Region data the search was started on
+    uint32_t mem_search_address;
+    int mem_search_region;
+    int mem_search_width;
+    int mem_search_op;
+    int mem_search_use_value;
+    int mem_search_value;
+    double mem_search_ms;
+    char frame_stats_path[SB_FILE_PATH_SIZE]; // Last CSV saved from the stats panel
+    bool new_watch_type[3];
+    sb_pc_profile_t pc_profile[2];
+    bool pc_profile_enabled[2];
+    se_time_travel_t time_travel;
+    // Loaded from a .elf, .sym or .map file next to the ROM
+    se_symbol_table_t symbols;
+#ifdef ENABLE_LUA_SCRIPTING
+    lua_State* lua; // NULL when no script is loaded
+    int lua_frame_callback; // Registry references, LUA_NOREF when unset
+    int lua_breakpoint_callback;
+    bool lua_in_callback;
+    uint64_t lua_frames; // Frames emulated since the script was loaded
+    sb_joy_t lua_joypad;
+#endif
     int editing_cheat_index; //-1 when not editing a cheat
     char cheat_path[SB_FILE_PATH_SIZE];
     ImFont* mono_font; 
@@ -444,12 +819,49 @@ typedef struct {
     char search_buffer[32];
 } gui_state_t;
 
-#define SE_REWIND_BUFFER_SIZE (1024*1024)
+// Default diff granularity, the cores pick their own for parts of their state (see sb_rewind_region_t)
 #define SE_REWIND_SEGMENT_SIZE 64
-#define SE_LAST_DELTA_IN_TX (1u<<31)
+#define SE_REWIND_BLOCK_SIZE 4096
+#define SE_REWIND_MAX_RANGES 32
+// Every Nth rewind push also stores a compressed copy of the whole state so seeks only
+// have to walk back at most N transactions
+#define SE_REWIND_KEYFRAME_INTERVAL 128
 
 #define SE_NUM_SAVE_STATES 4
 #define SE_MAX_SCREENSHOT_SIZE (NDS_LCD_H*NDS_LCD_W*2*4)
+// Queues of the async job pool
+#define SE_ASYNC_REWIND 0
+#define SE_ASYNC_SAVE_STATE 1
+#define SE_ASYNC_EMULATION 2
+#define SE_ASYNC_ROM_LOAD 3
+#define SE_ASYNC_SAVE_FILE 4
+#define SE_ASYNC_VIDEO 5
+#define SE_ASYNC_LIBRARY 6
+#define SE_ASYNC_FILE_BROWSER 7
+#define SE_ASYNC_EVENT_LOG 8
+#define SE_ASYNC_EXEC_TRACE 9
+#define SE_ASYNC_ROM_STREAM 10
+#define SE_ASYNC_NDS_ARM7 11
+#define SE_ASYNC_RA_HASH 12
+#define SE_ASYNC_SPECTATE 13
+#define SE_FRAMES_PER_REWIND_STATE 8
+// Rewind pushes between RetroAchievements progress captures when no rcheevos event happened
+#define SE_REWIND_RC_CAPTURE_PUSHES 8
+// Save states written with this extension use the compressed binary format instead of a PNG
+#define SE_BINARY_STATE_EXTENSION ".sestate"
+#define SE_BINARY_STATE_MAGIC "SKYSTATE"
+#define SE_BINARY_STATE_VERSION 2
+// Binary states only store the pages of the state data that aren't entirely zero
+#define SE_SPARSE_STATE_PAGE_SIZE 4096
+#define SE_MOVIE_MAGIC "SKYMOVIE"
+#define SE_MOVIE_VERSION 1
+// Frames between the hashes used to detect a movie desyncing
+#define SE_MOVIE_CHECKPOINT_FRAMES 60
+#define SE_MOVIE_OFF 0
+#define SE_MOVIE_RECORD 1
+#define SE_MOVIE_PLAY 2
+#define SE_MOVIE_STATE_HASH 0x1
+#define SE_MOVIE_FRAME_HASH 0x2
 
 #define SE_THEME_DARK 0
 #define SE_THEME_LIGHT 1
@@ -461,9 +873,8 @@ typedef struct {
 #define SE_TOGGLE_WIDTH 35
 #define SE_VOLUME_SLIDER_WIDTH 100
 
-//TODO: Clean this up to use unions...
-sb_emu_state_t emu_state = { .joy.solar_sensor=0.5};
 #define SE_MAX_CONST(A,B) ((A)>(B)? (A) : (B) )
+#define SE_MIN_CONST(A,B) ((A)<(B)? (A) : (B) )
 typedef union{
   // Do not reorder items in this struct otherwise you may break save states.
   // Append new data to the end of this structure. 
@@ -486,24 +897,120 @@ typedef union{
   nds_scratch_t nds;
 }se_core_scratch_t;
 
+// Header of one rewind delta, followed by size bytes of the state at offset
 typedef struct{
-  uint32_t offset; 
-  uint64_t data[SE_REWIND_SEGMENT_SIZE/8];
+  uint32_t offset;
+  uint32_t size;
 }se_core_delta_t;
+// Diff granularity of a part of se_core_state_t, parts with a segment_size of 0 aren't diffed
+typedef struct{
+  uint32_t start;
+  uint32_t end;
+  uint32_t segment_size;
+}se_rewind_range_t;
+// The deltas of one rewind push, compressed with miniz
 typedef struct{
-  se_core_delta_t deltas[SE_REWIND_BUFFER_SIZE];
+  uint8_t* data;
+  uint32_t compressed_size;
+  // Uncompressed size of the deltas
+  uint32_t delta_size;
+  // Frame the state was captured at, the deltas restore the state of the previous transaction
+  uint64_t frame;
+  // Compressed copy of the state captured at frame, NULL if this isn't a keyframe
+  uint8_t* keyframe;
+  uint32_t keyframe_size;
+}se_rewind_tx_t;
+typedef struct{
+  // Ring of transactions allocated on demand, the oldest are dropped once either limit is hit
+  se_rewind_tx_t* txs;
+  uint32_t capacity;
+  uint32_t first;
   uint32_t size;
-  uint32_t index; 
-  bool first_push; 
-  se_core_state_t last_core; 
+  uint64_t bytes_used;
+  uint64_t budget_bytes;
+  uint32_t max_txs;
+  uint32_t txs_since_keyframe;
+  // Frame of the state the oldest transaction restores
+  uint64_t base_frame;
+  // Count of emulated frames, only touched by the main thread
+  uint64_t curr_frame;
+  uint64_t capture_frame;
+  // Limits requested by the frontend, picked up when the next capture is dispatched
+  uint64_t requested_budget_bytes;
+  uint32_t requested_max_txs;
+  // Copy of the core taken at capture time, diffed and compressed on the background worker
+  se_core_state_t* capture;
+  // Uncompressed deltas of the transaction being pushed or popped
+  uint8_t* staging;
+  size_t staging_capacity;
+  // Built from the regions of the system on the first push
+  se_rewind_range_t ranges[SE_REWIND_MAX_RANGES];
+  uint32_t num_ranges;
+  uint8_t* compress_buffer;
+  size_t compress_buffer_size;
+  bool first_push;
+  // Pushes since the RetroAchievements progress in the core was last serialized
+  uint32_t pushes_since_rc_capture;
+  se_core_state_t last_core;
 }se_core_rewind_buffer_t;
+// Save files are written from SE_ASYNC_SAVE_FILE. After the first full write only the pages that
+// changed since the last write are rewritten in place.
+#define SE_SAVE_PAGE_SIZE 4096
+typedef struct{
+  char path[SB_FILE_PATH_SIZE];
+  // Save data as it is on disk once the pending write finished
+  uint8_t* shadow;
+  size_t size;
+  uint32_t* dirty_pages;
+  uint32_t num_dirty_pages;
+  // The whole file is written to a temporary file and renamed over the save
+  bool rewrite;
+  // Set by the writer when a write failed, the next write is a full rewrite
+  volatile bool failed;
+}se_save_writer_t;
+// Everything one emulated system needs, so any number of them can run in the same process. The
+// frontend drives gui_instance, headless users (test runners, servers) create their own with
+// se_instance_create() and tick each one from a single thread at a time.
+typedef struct{
+  sb_emu_state_t emu_state;
+  se_core_state_t core;
+  se_core_scratch_t scratch;
+  se_core_rewind_buffer_t rewind_buffer;
+  // Lets the NDS GPU and PPU split their work across the job pool, which only serves one caller
+  // at a time. NULL runs everything on the ticking thread.
+  sb_job_dispatch_t job_dispatch;
+  // Starts the thread of the threaded NDS ARM7, NULL where threads are unavailable
+  sb_job_start_t job_start;
+  // DMG palette as RGB8, the frontend copies it in from the settings
+  uint8_t dmg_palette[4*3];
+  uint8_t* run_ahead_core;
+  sb_emu_state_t run_ahead_emu;
+  // File mapping holding rom_data (a ROM file or a zip with a stored ROM entry), NULL when rom_data is a copy
+  uint8_t* rom_map;
+  size_t rom_map_size;
+  // Holds rom_data when it is loaded or decompressed into memory, kept for the whole session
+  sb_arena_t rom_arena;
+  // Streamed NDS ROM file backing emu_state.rom_read when the ROM couldn't be mapped
+  FILE* rom_file;
+  // Seekable compressed NDS ROM backing emu_state.rom_read, see se_ndsz_reader_t
+  struct se_ndsz_reader_t* rom_ndsz;
+  se_save_writer_t save_writer;
+  double simulation_time;
+  unsigned frames_since_last_save;
+}se_instance_t;
+se_instance_t gui_instance;
 typedef struct{
   uint8_t screenshot[SE_MAX_SCREENSHOT_SIZE];
   int32_t screenshot_width; 
   int32_t screenshot_height; 
   int32_t system;
   int32_t valid; //0: invalid, 1: Valid (Perfect Save State) 2: Valid (BESS restore)
-  se_core_state_t state;
+  // Copy of the active core, only as large as the system it was captured from (se_get_core_size).
+  // The slots grow on demand so a GB session doesn't carry NDS sized states. Read it through
+  // se_save_state_core() since only the active member of the union is backed.
+  uint8_t* core;
+  size_t core_capacity;
+  uint8_t rc_buffer[SE_RC_BUFFER_SIZE];
 }se_save_state_t; 
 typedef struct{
   char name[39]; //Emulator Name
@@ -514,20 +1021,139 @@ typedef struct{
   uint32_t rcheevos_buffer_size;   // Size of rc_buffer
   uint8_t padding[12];//Zero padding
 }se_emu_id;
+// Header of the binary save state format. It is followed by a miniz compressed payload holding the
+// RGBA screenshot and the sparse encoded data (the se_emu_id, active core and rc_buffer laid out the
+// same way as the data embedded in save state PNGs)
+typedef struct{
+  char magic[8]; //SE_BINARY_STATE_MAGIC
+  uint32_t version;
+  uint32_t system;
+  uint64_t data_size; // Size of the data once the sparse encoding is expanded
+  uint64_t payload_size;
+  uint64_t compressed_size;
+  int32_t screenshot_width;
+  int32_t screenshot_height;
+}se_binary_state_header_t;
+// Header of an input movie. It is followed by the binary save state the movie starts from and one
+// se_movie_frame_t per emulated frame
+typedef struct{
+  char magic[8]; //SE_MOVIE_MAGIC
+  uint32_t version;
+  uint32_t system;
+  uint64_t game_checksum;
+  uint64_t state_size;
+  uint64_t num_frames;
+  uint32_t frame_size; // sizeof(se_movie_frame_t)
+  uint32_t checkpoint_frames;
+}se_movie_header_t;
+typedef struct{
+  sb_joy_t joy;
+  uint32_t flags; // SE_MOVIE_STATE_HASH/SE_MOVIE_FRAME_HASH on checkpoint frames
+  uint64_t state_hash;
+  uint64_t frame_hash;
+}se_movie_frame_t;
+typedef struct{
+  int mode; // SE_MOVIE_OFF, SE_MOVIE_RECORD or SE_MOVIE_PLAY
+  char path[SB_FILE_PATH_SIZE];
+  se_movie_frame_t* frames;
+  uint64_t num_frames;
+  uint64_t capacity;
+  uint64_t frame; // Next frame to play back
+  sb_joy_t frame_joy; // Input of the frame being recorded
+  uint8_t* start_state; // Encoded binary save state
+  size_t start_state_size;
+  uint64_t checkpoints_passed;
+  int64_t first_desync; // -1 while every checkpoint matched
+  uint8_t* screenshot;
+}se_movie_t;
+typedef struct{
+  se_save_state_t save_state;
+  se_emu_id emu_id;
+  size_t core_size;
+  char path[SB_FILE_PATH_SIZE];
+}se_save_state_write_job_t;
+// Cloud save states are split in content addressed chunks of the raw state (se_emu_id, core and
+// rc_buffer) so a capture only uploads the chunks that changed. A per game index lists the chunk
+// hashes and screenshot of every slot, so syncing is a single download when the chunks are cached
+#define SE_CLOUD_CHUNK_SIZE (512*1024)
+#define SE_CLOUD_CHUNK_EXTENSION ".sechunk"
+#define SE_CLOUD_INDEX_EXTENSION ".states.index"
+#define SE_CLOUD_INDEX_MAGIC "SKYSIDX1"
+#define SE_CLOUD_CACHE_MAGIC "SKYSCCH1"
+#define SE_CLOUD_INDEX_VERSION 1
+typedef struct{
+  char magic[8]; //SE_CLOUD_INDEX_MAGIC
+  uint32_t version;
+  uint32_t num_slots;
+  uint64_t body_size;
+  uint64_t compressed_size;
+}se_cloud_index_header_t;
+// Followed in the index body by the chunk hashes and the RGBA screenshot of valid slots
+typedef struct{
+  int32_t valid;
+  int32_t system;
+  int32_t screenshot_width;
+  int32_t screenshot_height;
+  uint64_t state_hash; // Hash of the chunk hashes
+  uint64_t data_size;  // Size of the raw state
+}se_cloud_slot_header_t;
+typedef struct{
+  se_cloud_slot_header_t header;
+  uint64_t* chunk_hashes; // 0 for chunks that are all zero, which are never uploaded
+  uint8_t* screenshot;
+}se_cloud_slot_t;
+// Local copy of the last synced raw state of a slot, used as the base the changed chunks are applied on
+typedef struct{
+  char magic[8]; //SE_CLOUD_CACHE_MAGIC
+  uint64_t game_checksum;
+  uint64_t state_hash;
+  uint64_t data_size;
+  uint64_t compressed_size;
+}se_cloud_cache_header_t;
+typedef struct se_cloud_slot_download_t se_cloud_slot_download_t;
+typedef struct{
+  se_cloud_slot_download_t* download;
+  uint32_t chunk;
+}se_cloud_chunk_request_t;
+struct se_cloud_slot_download_t{
+  size_t slot;
+  uint32_t generation;
+  uint8_t* data;
+  se_cloud_slot_t entry;
+  se_cloud_chunk_request_t* requests;
+  int pending;
+  bool failed;
+};
 typedef struct{
   cloud_drive_t* drive;
   se_save_state_t save_states[SE_NUM_SAVE_STATES];
   mutex_t save_states_mutex;
   bool save_states_busy[SE_NUM_SAVE_STATES];
   cloud_user_info_t user_info;
+  // Protected by save_states_mutex
+  se_cloud_slot_t slots[SE_NUM_SAVE_STATES];
+  int pending_uploads[SE_NUM_SAVE_STATES];
+  bool index_uploading;
+  bool index_dirty;
+  // Bumped on every sync so downloads started for a previous game are dropped
+  uint32_t generation;
 } se_cloud_state_t;
 typedef struct{
   uint8_t* data; 
   size_t size; 
+  size_t capacity;
 }se_png_write_context_t;
 void se_png_write_mem(void *context, void *data, int size){
   se_png_write_context_t * cont =(se_png_write_context_t*)context;
-  cont->data = realloc(cont->data,size+cont->size);
+  if(cont->size+size>cont->capacity){
+    // Grown geometrically since the encoders write many small chunks
+    size_t capacity = cont->capacity? cont->capacity*2: 64*1024;
+    while(capacity<cont->size+size)capacity*=2;
+    uint8_t* data = (uint8_t*)realloc(cont->data,capacity);
+    if(!data)return;
+    cont->data = data;
+    cont->capacity = capacity;
+  }
   memcpy(cont->data+cont->size,data,size);
   cont->size+=size; 
 }
@@ -535,17 +1161,57 @@ static void se_sync_cloud_save_states();
 gui_state_t gui_state={ .update_font_atlas=true }; 
 
 void se_draw_image(uint8_t *data, int im_width, int im_height,int x, int y, int render_width, int render_height, bool has_alpha);
-void se_draw_lcd(uint8_t *data, int im_width, int im_height,int x, int y, int render_width, int render_height, float rotation,bool is_touch);
+void se_draw_lcd(sg_image image, int im_width, int im_height, int lcd_width, int lcd_height, int x, int y, int render_width, int render_height, float rotation);
+static sg_image se_run_shader_chain(int stream_slot, sg_image image, int* width, int* height);
+static sg_image se_run_ghosting(int stream_slot, sg_image image, int width, int height);
+static int se_nds_3d_scale();
+static bool se_run_nds_3d(int stream_slot, sg_image* image, int* width, int* height);
+static void se_lcd_touch_input(int x, int y, int render_width, int render_height, float rotation);
+void se_load_rom(const char *filename);
 void se_load_rom_overlay(bool visible);
 void sb_draw_onscreen_controller(sb_emu_state_t*state, int controller_h, int controller_y_pad,bool preview);
 void se_reset_save_states();
 void se_set_new_controller(se_controller_state_t* cont, int index);
 bool se_run_ar_cheat(const uint32_t* buffer, uint32_t size);
-void se_emscripten_flush_fs();
+se_cheat_compile_fn se_ar_cheat_compiler();
+void se_emscripten_flush_fs(const char* path);
 static uint32_t se_save_best_effort_state(se_core_state_t* state);
 static bool se_load_best_effort_state(se_core_state_t* state,uint8_t *save_state_data, uint32_t size, uint32_t bess_offset);
 static size_t se_get_core_size();
 uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_size, const char** mime_type);
+static uint8_t* se_hcs_finish(uint8_t* deferred, uint64_t* result_size, const char** mime_type);
+static void se_shm_process_cmds();
+static void se_shm_publish_frame();
+static void se_hcs_publish_snapshot(bool force);
+#ifdef ENABLE_LUA_SCRIPTING
+static bool se_lua_load_script(const char* path);
+static void se_lua_after_frame(int prev_run_mode);
+static void se_lua_unload_script();
+#endif
+static void se_movie_begin_frame();
+static void se_movie_end_frame();
+static void se_movie_stop();
+static bool se_movie_record(const char* path);
+static bool se_movie_play(const char* path);
+static bool se_movie_active();
+static void se_video_capture_frame(uint32_t audio_start);
+static bool se_video_record(const char* path);
+static void se_video_stop();
+static bool se_audio_output_unused();
+static double se_audio_output_latency_ms();
+static bool se_link_tick();
+static void se_join_emulation_thread();
+static void se_draw_background_rom_load_progress(const char* rom_path, float progress);
+static bool se_link_connect(const char* rom_path);
+static void se_link_disconnect();
+static bool se_netplay_start(int local_port, const char* remote_host, int remote_port, int delay);
+static bool se_netplay_active();
+static bool se_spectate_tick();
+static bool se_spectate_active();
+static bool se_spectate_watching();
+static void se_spectate_stop();
+static void se_spectate_discontinuity();
+static void se_spectate_update();
 void se_open_file_browser(bool clicked, float x, float y, float w, float h, void (*file_open_fn)(const char* dir), const char ** file_types,char * output_path);
 void se_file_browser_accept(const char * path);
 static void se_reset_core();
@@ -586,6 +1252,152 @@ static float se_dpi_scale(){
   return dpi_scale*gui_state.settings.gui_scale_factor;
 }
 
+// The built UI font atlas is cached in the pref path so startup and new glyph pages don't have to
+// rasterize the embedded TTFs again. The cache keeps the union of every glyph page the UI has used,
+// which is preloaded into font_cache_page_valid, so it only grows when a new page shows up.
+#define SE_FONT_ATLAS_CACHE_MAGIC 0x534b464eu // "SKFN"
+#define SE_FONT_ATLAS_CACHE_VERSION 1
+#define SE_FONT_ATLAS_CACHE_MAX_FONTS 16
+typedef struct{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key; // Build, DPI and font scale the atlas was baked for
+  uint8_t page_valid[(SE_MAX_UNICODE_CODE_POINT+1)/SE_FONT_CACHE_PAGE_SIZE];
+  int32_t tex_width, tex_height;
+  ImVec2 tex_uv_white_pixel;
+  ImVec4 tex_uv_lines[64]; // ImFontAtlas::TexUvLines
+  int32_t num_fonts;
+  int32_t default_font, mono_font;
+  struct{
+    float font_size, ascent, descent;
+    uint32_t fallback_char, ellipsis_char;
+    uint32_t num_glyphs;
+  }fonts[SE_FONT_ATLAS_CACHE_MAX_FONTS];
+  // Followed by the glyphs of each font and the alpha of the texture
+}se_font_atlas_cache_header_t;
+_Static_assert(sizeof(((se_font_atlas_cache_header_t*)0)->tex_uv_lines)==sizeof(((ImFontAtlas*)0)->TexUvLines), "TexUvLines size changed");
+static void se_font_atlas_cache_path(char* path){
+  const char* pref = se_get_pref_path();
+  size_t len = strlen(pref);
+  bool slash = len&&pref[len-1]!='/'&&pref[len-1]!='\\';
+  snprintf(path,SB_FILE_PATH_SIZE,"%s%sfont_atlas_cache.bin",pref,slash?"/":"");
+}
+static uint64_t se_font_atlas_cache_key(float font_scale){
+  float key_data[2]={se_dpi_scale(),font_scale};
+  return XXH3_64bits_withSeed(key_data,sizeof(key_data),XXH3_64bits(GIT_COMMIT_HASH,strlen(GIT_COMMIT_HASH)));
+}
+static int se_font_index(ImFontAtlas* atlas, ImFont* font){
+  for(int i=0;i<atlas->Fonts.Size;++i)if(atlas->Fonts.Data[i]==font)return i;
+  return 0;
+}
+static void se_save_font_atlas_cache(ImFontAtlas* atlas, float font_scale){
+  if(!atlas->TexPixelsAlpha8||atlas->Fonts.Size>SE_FONT_ATLAS_CACHE_MAX_FONTS)return;
+  se_font_atlas_cache_header_t* header = (se_font_atlas_cache_header_t*)calloc(1,sizeof(se_font_atlas_cache_header_t));
+  if(!header)return;
+  header->magic = SE_FONT_ATLAS_CACHE_MAGIC;
+  header->version = SE_FONT_ATLAS_CACHE_VERSION;
+  header->key = se_font_atlas_cache_key(font_scale);
+  memcpy(header->page_valid,gui_state.font_cache_page_valid,sizeof(header->page_valid));
+  header->tex_width = atlas->TexWidth;
+  header->tex_height = atlas->TexHeight;
+  header->tex_uv_white_pixel = atlas->TexUvWhitePixel;
+  memcpy(header->tex_uv_lines,atlas->TexUvLines,sizeof(header->tex_uv_lines));
+  header->num_fonts = atlas->Fonts.Size;
+  header->default_font = se_font_index(atlas,igGetIO()->FontDefault);
+  header->mono_font = se_font_index(atlas,gui_state.mono_font);
+  char path[SB_FILE_PATH_SIZE];
+  se_font_atlas_cache_path(path);
+  FILE* f = fopen(path,"wb");
+  if(!f){free(header);return;}
+  for(int i=0;i<atlas->Fonts.Size;++i){
+    ImFont* font = atlas->Fonts.Data[i];
+    header->fonts[i].font_size = font->FontSize;
+    header->fonts[i].ascent = font->Ascent;
+    header->fonts[i].descent = font->Descent;
+    header->fonts[i].fallback_char = font->FallbackChar;
+    header->fonts[i].ellipsis_char = font->EllipsisChar;
+    header->fonts[i].num_glyphs = font->Glyphs.Size;
+  }
+  bool success = fwrite(header,sizeof(*header),1,f)==1;
+  for(int i=0;i<atlas->Fonts.Size;++i){
+    ImFont* font = atlas->Fonts.Data[i];
+    success&= fwrite(font->Glyphs.Data,sizeof(ImFontGlyph),font->Glyphs.Size,f)==(size_t)font->Glyphs.Size;
+  }
+  size_t tex_size = (size_t)atlas->TexWidth*atlas->TexHeight;
+  success&= fwrite(atlas->TexPixelsAlpha8,1,tex_size,f)==tex_size;
+  fclose(f);
+  free(header);
+  if(!success)remove(path);
+}
+// Replaces the fonts of the atlas with the cached ones. Returns an RGBA copy of the texture (which
+// the caller frees) or NULL if the cache is missing, stale or doesn't cover every used glyph page.
+static uint8_t* se_load_font_atlas_cache(ImFontAtlas* atlas, float font_scale){
+  char path[SB_FILE_PATH_SIZE];
+  se_font_atlas_cache_path(path);
+  size_t size = 0;
+  bool mapped = true;
+  uint8_t* data = se_map_file_data(path,&size);
+  if(!data){
+    mapped = false;
+    data = sb_load_file_data(path,&size);
+  }
+  if(!data)return NULL;
+  uint8_t* rgba = NULL;
+  const se_font_atlas_cache_header_t* header = (const se_font_atlas_cache_header_t*)data;
+  bool valid = size>=sizeof(*header)&&header->magic==SE_FONT_ATLAS_CACHE_MAGIC&&header->version==SE_FONT_ATLAS_CACHE_VERSION&&
+               header->key==se_font_atlas_cache_key(font_scale)&&header->num_fonts>0&&header->num_fonts<=SE_FONT_ATLAS_CACHE_MAX_FONTS&&
+               header->tex_width>0&&header->tex_height>0;
+  size_t expected = valid? sizeof(*header)+(size_t)header->tex_width*header->tex_height: 0;
+  for(int i=0;valid&&i<header->num_fonts;++i)expected+=header->fonts[i].num_glyphs*sizeof(ImFontGlyph);
+  valid&= size==expected;
+  if(valid){
+    bool covered = true;
+    for(int i=0;i<sizeof(header->page_valid);++i){
+      // Pages the cache has are used from now on, which keeps the later rebuilds cumulative
+      if(gui_state.font_cache_page_valid[i]&&!header->page_valid[i])covered = false;
+      if(header->page_valid[i])gui_state.font_cache_page_valid[i]=0x1;
+    }
+    size_t tex_size = (size_t)header->tex_width*header->tex_height;
+    if(covered)rgba = (uint8_t*)malloc(tex_size*4);
+    if(rgba){
+      ImFontAtlas_Clear(atlas);
+      atlas->TexWidth = header->tex_width;
+      atlas->TexHeight = header->tex_height;
+      atlas->TexUvScale = (ImVec2){1.0f/header->tex_width,1.0f/header->tex_height};
+      atlas->TexUvWhitePixel = header->tex_uv_white_pixel;
+      memcpy(atlas->TexUvLines,header->tex_uv_lines,sizeof(atlas->TexUvLines));
+      atlas->Fonts.Data = (ImFont**)igMemAlloc(sizeof(ImFont*)*header->num_fonts);
+      atlas->Fonts.Size = atlas->Fonts.Capacity = header->num_fonts;
+      const ImFontGlyph* glyphs = (const ImFontGlyph*)(data+sizeof(*header));
+      for(int i=0;i<header->num_fonts;++i){
+        ImFont* font = ImFont_ImFont();
+        font->ContainerAtlas = atlas;
+        font->FontSize = header->fonts[i].font_size;
+        font->Ascent = header->fonts[i].ascent;
+        font->Descent = header->fonts[i].descent;
+        font->FallbackChar = header->fonts[i].fallback_char;
+        font->EllipsisChar = header->fonts[i].ellipsis_char;
+        for(uint32_t g=0;g<header->fonts[i].num_glyphs;++g,++glyphs){
+          ImFont_AddGlyph(font,NULL,glyphs->Codepoint,glyphs->X0,glyphs->Y0,glyphs->X1,glyphs->Y1,
+                          glyphs->U0,glyphs->V0,glyphs->U1,glyphs->V1,glyphs->AdvanceX);
+          font->Glyphs.Data[font->Glyphs.Size-1].Visible = glyphs->Visible;
+        }
+        ImFont_BuildLookupTable(font);
+        atlas->Fonts.Data[i] = font;
+      }
+      const uint8_t* alpha = (const uint8_t*)glyphs;
+      for(size_t p=0;p<tex_size;++p){
+        rgba[p*4+0]=rgba[p*4+1]=rgba[p*4+2]=0xff;
+        rgba[p*4+3]=alpha[p];
+      }
+      igGetIO()->FontDefault = atlas->Fonts.Data[SB_BFE(header->default_font,0,31)%header->num_fonts];
+      gui_state.mono_font = atlas->Fonts.Data[SB_BFE(header->mono_font,0,31)%header->num_fonts];
+    }
+  }
+  if(mapped)se_unmap_file_data(data,size);
+  else free(data);
+  return rgba;
+}
 static void se_cache_glyphs(const char* input_string){
   #ifdef UNICODE_GUI
   utf8proc_int32_t codepoint_ref=0;
@@ -616,8 +1428,10 @@ char* se_replace_fake_path(char * new_path){
   return new_path;
 }
 const char* se_localize_and_cache(const char* input_str){
-  const char * localized_string = se_localize(input_str);
-  se_cache_glyphs(localized_string);
+  bool new_entry = false;
+  const char * localized_string = se_localize_cached(input_str,&new_entry);
+  // Font cache pages are never dropped, so each string only needs its glyphs cached once
+  if(new_entry)se_cache_glyphs(localized_string);
   return localized_string;
 }
 bool se_checkbox(const char* label, bool * v){
@@ -638,12 +1452,14 @@ static void se_text_disabled(const char* label,...){
   va_end(args);
 }
 static bool se_combo_str(const char* label,int* current_item,const char* items_separated_by_zeros,int popup_max_height_in_items){
-  const char* localize_string= items_separated_by_zeros;
-  while(localize_string[0]){
+  bool new_entry = false;
+  const char* items = se_localize_cached(items_separated_by_zeros,&new_entry);
+  const char* localize_string= items;
+  while(new_entry&&localize_string[0]){
     se_cache_glyphs(localize_string);
     localize_string+=strlen(localize_string)+1;
   }
-  return igComboStr(se_localize_and_cache(label),current_item,se_localize_and_cache(items_separated_by_zeros),popup_max_height_in_items);
+  return igComboStr(se_localize_and_cache(label),current_item,items,popup_max_height_in_items);
 }
 static int se_slider_float(const char* label,float* v,float v_min,float v_max,const char* format){
   return igSliderFloat(se_localize_and_cache(label),v,v_min,v_max,se_localize_and_cache(format),ImGuiSliderFlags_AlwaysClamp);
@@ -966,7 +1782,7 @@ void se_bios_file_open_fn(const char* dir){
     if(sb_file_exists(se_bios_file_open_tmp_path)||strncmp(dir,"",SB_FILE_PATH_SIZE)==0)remove(se_bios_file_open_tmp_path);
     if(strncmp(dir,"",SB_FILE_PATH_SIZE)!=0)se_copy_file(dir,se_bios_file_open_tmp_path);
   }
-  emu_state.run_mode=SB_MODE_RESET;
+  gui_instance.emu_state.run_mode=SB_MODE_RESET;
 }
 
 const char* se_keycode_to_string(int keycode){
@@ -1096,80 +1912,279 @@ const char* se_keycode_to_string(int keycode){
 }
 
 
-se_core_state_t core;
-se_core_scratch_t scratch;
-se_core_rewind_buffer_t rewind_buffer;
 se_save_state_t save_states[SE_NUM_SAVE_STATES];
 se_cloud_state_t cloud_state;
 
-bool se_more_rewind_deltas(se_core_rewind_buffer_t* rewind, uint32_t index){
-  return (rewind->deltas[index%SE_REWIND_BUFFER_SIZE].offset&SE_LAST_DELTA_IN_TX)==0;
+void se_reset_rewind_buffer(se_core_rewind_buffer_t* rewind);
+static uint8_t* se_rewind_staging(se_core_rewind_buffer_t* rewind, size_t size){
+  if(size>rewind->staging_capacity){
+    size_t capacity = SE_MAX_CONST(size,rewind->staging_capacity*2);
+    uint8_t* staging = (uint8_t*)realloc(rewind->staging,capacity);
+    if(!staging)return NULL;
+    rewind->staging = staging;
+    rewind->staging_capacity = capacity;
+  }
+  return rewind->staging;
+}
+static se_rewind_tx_t* se_get_rewind_tx(se_core_rewind_buffer_t* rewind, uint32_t index){
+  return rewind->txs+(rewind->first+index)%rewind->capacity;
+}
+static uint64_t se_rewind_state_frame(se_core_rewind_buffer_t* rewind, int index){
+  return index<0? rewind->base_frame: se_get_rewind_tx(rewind,index)->frame;
+}
+static void se_free_rewind_tx(se_core_rewind_buffer_t* rewind, se_rewind_tx_t* tx){
+  rewind->bytes_used-=tx->compressed_size+tx->keyframe_size;
+  free(tx->data);
+  free(tx->keyframe);
+  tx->data=tx->keyframe=NULL;
+  tx->keyframe_size=0;
+}
+static void se_drop_oldest_rewind_tx(se_core_rewind_buffer_t* rewind){
+  se_rewind_tx_t* tx = rewind->txs+rewind->first;
+  rewind->base_frame = tx->frame;
+  se_free_rewind_tx(rewind,tx);
+  rewind->first=(rewind->first+1)%rewind->capacity;
+  rewind->size--;
+}
+// Returns a malloc'd copy of data compressed with miniz or NULL on failure
+static uint8_t* se_compress_rewind_data(se_core_rewind_buffer_t* rewind, const void* data, size_t size, uint32_t* compressed_size){
+  mz_ulong comp_size = mz_compressBound(size);
+  if(comp_size>rewind->compress_buffer_size){
+    uint8_t* buffer = (uint8_t*)realloc(rewind->compress_buffer,comp_size);
+    if(!buffer)return NULL;
+    rewind->compress_buffer = buffer;
+    rewind->compress_buffer_size = comp_size;
+  }
+  if(mz_compress2(rewind->compress_buffer,&comp_size,(const uint8_t*)data,size,MZ_BEST_SPEED)!=MZ_OK)return NULL;
+  uint8_t* out = (uint8_t*)malloc(comp_size);
+  if(!out)return NULL;
+  memcpy(out,rewind->compress_buffer,comp_size);
+  *compressed_size = comp_size;
+  return out;
+}
+static bool se_append_rewind_tx(se_core_rewind_buffer_t* rewind, uint32_t delta_size, uint64_t frame){
+  uint32_t comp_size = 0;
+  uint8_t* data = se_compress_rewind_data(rewind,rewind->staging,delta_size,&comp_size);
+  if(!data)return false;
+  if(rewind->size==rewind->capacity){
+    uint32_t capacity = rewind->capacity? rewind->capacity*2: 256;
+    se_rewind_tx_t* txs = (se_rewind_tx_t*)malloc(capacity*sizeof(se_rewind_tx_t));
+    if(!txs){free(data);return false;}
+    for(uint32_t i=0;i<rewind->size;++i)txs[i]=rewind->txs[(rewind->first+i)%rewind->capacity];
+    free(rewind->txs);
+    rewind->txs = txs;
+    rewind->capacity = capacity;
+    rewind->first = 0;
+  }
+  se_rewind_tx_t* tx = se_get_rewind_tx(rewind,rewind->size);
+  tx->data = data;
+  tx->compressed_size = comp_size;
+  tx->delta_size = delta_size;
+  tx->frame = frame;
+  tx->keyframe = NULL;
+  tx->keyframe_size = 0;
+  // A failed keyframe only makes seeks slower
+  if(++rewind->txs_since_keyframe>=SE_REWIND_KEYFRAME_INTERVAL){
+    tx->keyframe = se_compress_rewind_data(rewind,&rewind->last_core,sizeof(se_core_state_t),&tx->keyframe_size);
+    if(tx->keyframe)rewind->txs_since_keyframe=0;
+  }
+  rewind->size++;
+  rewind->bytes_used+=comp_size+tx->keyframe_size;
+  while(rewind->size>1&&(rewind->bytes_used>rewind->budget_bytes||rewind->size>rewind->max_txs))se_drop_oldest_rewind_tx(rewind);
+  return true;
+}
+static void se_clear_rewind_history(se_core_rewind_buffer_t* rewind){
+  while(rewind->size)se_drop_oldest_rewind_tx(rewind);
+  rewind->first = 0;
+  rewind->bytes_used = 0;
+  rewind->txs_since_keyframe = 0;
+  rewind->first_push = false;
+}
+static bool se_rewind_block_equal(const void* a, const void* b, size_t size){
+#ifdef SB_SIMD_WASM
+  // Emscripten's memcmp is a byte loop
+  const uint8_t* pa = (const uint8_t*)a;
+  const uint8_t* pb = (const uint8_t*)b;
+  size_t i = 0;
+  for(;i+64<=size;i+=64){
+    v128_t d = wasm_v128_xor(wasm_v128_load(pa+i),wasm_v128_load(pb+i));
+    d = wasm_v128_or(d,wasm_v128_xor(wasm_v128_load(pa+i+16),wasm_v128_load(pb+i+16)));
+    d = wasm_v128_or(d,wasm_v128_xor(wasm_v128_load(pa+i+32),wasm_v128_load(pb+i+32)));
+    d = wasm_v128_or(d,wasm_v128_xor(wasm_v128_load(pa+i+48),wasm_v128_load(pb+i+48)));
+    if(wasm_i64x2_extract_lane(d,0)|wasm_i64x2_extract_lane(d,1))return false;
+  }
+  return memcmp(pa+i,pb+i,size-i)==0;
+#else
+  return memcmp(a,b,size)==0;
+#endif
+}
+static void se_add_rewind_range(se_core_rewind_buffer_t* rewind, uint32_t start, uint32_t end, uint32_t segment_size){
+  if(start>=end||rewind->num_ranges>=SE_REWIND_MAX_RANGES)return;
+  se_rewind_range_t* range = rewind->ranges+rewind->num_ranges++;
+  range->start = start;
+  range->end = end;
+  range->segment_size = segment_size;
+}
+// Splits the state into the regions of the system, the gaps between them use SE_REWIND_SEGMENT_SIZE
+static void se_build_rewind_ranges(se_core_rewind_buffer_t* rewind, int system){
+  int num_regions = 0;
+  const sb_rewind_region_t* regions = NULL;
+  if(system==SYSTEM_NDS)regions = nds_rewind_regions(&num_regions);
+  else if(system==SYSTEM_GBA)regions = gba_rewind_regions(&num_regions);
+  else if(system==SYSTEM_GB)regions = sb_rewind_regions(&num_regions);
+  rewind->num_ranges = 0;
+  uint32_t pos = 0;
+  for(int i=0;i<=num_regions;++i){
+    // Regions are rounded out to whole words since the diff compares 8 bytes at a time
+    uint32_t start = i<num_regions? regions[i].offset&~7u: sizeof(se_core_state_t);
+    uint32_t end = i<num_regions? (regions[i].offset+regions[i].size+7)&~7u: sizeof(se_core_state_t);
+    start = SE_MAX_CONST(start,pos);
+    se_add_rewind_range(rewind,pos,start,SE_REWIND_SEGMENT_SIZE);
+    if(i<num_regions)se_add_rewind_range(rewind,start,end,regions[i].segment_size);
+    pos = SE_MAX_CONST(pos,end);
+  }
+}
+static void se_diff_rewind_state(se_core_state_t* core, se_core_rewind_buffer_t* rewind, uint64_t frame){
+  uint8_t * new_data = (uint8_t*)core;
+  uint8_t * old_data = (uint8_t*)&rewind->last_core;
+  size_t delta_size = 0;
+  for(uint32_t r=0;r<rewind->num_ranges;++r){
+    const se_rewind_range_t* range = rewind->ranges+r;
+    if(!range->segment_size)continue;
+    for(uint32_t block=range->start;block<range->end;block+=SE_REWIND_BLOCK_SIZE){
+      uint32_t block_end = SE_MIN_CONST(block+SE_REWIND_BLOCK_SIZE,range->end);
+      // Skip whole unchanged blocks with a vectorized compare, so the cost of a push follows how
+      // much of the state changed.
+      if(se_rewind_block_equal(new_data+block,old_data+block,block_end-block))continue;
+      for(uint32_t s=block;s<block_end;s+=range->segment_size){
+        uint32_t size = SE_MIN_CONST(range->segment_size,block_end-s);
+        const uint64_t* new_words = (const uint64_t*)(new_data+s);
+        uint64_t* old_words = (uint64_t*)(old_data+s);
+        uint64_t diff = 0;
+        // Branch free so the compiler can compare the segment with vector instructions
+        for(uint32_t w=0;w<size/8;++w)diff|=new_words[w]^old_words[w];
+        if(!diff)continue;
+        uint8_t* deltas = se_rewind_staging(rewind,delta_size+sizeof(se_core_delta_t)+size);
+        if(!deltas){
+          printf("Out of memory for rewind, clearing rewind history\n");
+          se_clear_rewind_history(rewind);
+          return;
+        }
+        se_core_delta_t header = {s,size};
+        memcpy(deltas+delta_size,&header,sizeof(header));
+        memcpy(deltas+delta_size+sizeof(header),old_words,size);
+        memcpy(old_words,new_words,size);
+        delta_size+=sizeof(header)+size;
+      }
+    }
+  }
+  if(delta_size==0)return;
+  if(!se_append_rewind_tx(rewind,delta_size,frame)){
+    // last_core already holds the new state so older history can't be rewound to anymore
+    printf("Failed to store rewind state, clearing rewind history\n");
+    se_clear_rewind_history(rewind);
+  }
+}
+static void se_rewind_capture_job(void* user_data, int job_index){
+  se_core_rewind_buffer_t* rewind = (se_core_rewind_buffer_t*)user_data;
+  se_diff_rewind_state(rewind->capture,rewind,rewind->capture_frame);
 }
-void se_push_rewind_state(se_core_state_t* core, se_core_rewind_buffer_t* rewind){
+void se_push_rewind_state(se_core_state_t* core, se_core_rewind_buffer_t* rewind, int system){
+  // The worker owns the history while a capture is in flight. Skipping a capture is harmless
+  // since the next one diffs against last_core and covers both intervals.
+  if(job_pool_async_busy(SE_ASYNC_REWIND))return;
   #ifdef ENABLE_RETRO_ACHIEVEMENTS
-    retro_achievements_capture_state(core->rc_buffer);
+    // Hit counts and delta values move every frame, but only events change anything the player
+    // sees, so between them the progress is refreshed every SE_REWIND_RC_CAPTURE_PUSHES pushes.
+    // Pushes in between keep the previous capture in rc_buffer, which rewinding restores.
+    if(retro_achievements_has_game_loaded()&&
+       (retro_achievements_progress_changed()||!rewind->first_push||++rewind->pushes_since_rc_capture>=SE_REWIND_RC_CAPTURE_PUSHES)){
+      retro_achievements_capture_state(core->rc_buffer);
+      rewind->pushes_since_rc_capture = 0;
+    }
   #endif
+  rewind->budget_bytes = rewind->requested_budget_bytes;
+  rewind->max_txs = rewind->requested_max_txs;
   if(!rewind->first_push){
     rewind->first_push=true;
+    se_build_rewind_ranges(rewind,system);
     rewind->last_core= *core;
-    return; 
+    rewind->base_frame = rewind->curr_frame;
+    return;
   }
-  int total_segments = sizeof(se_core_state_t)/SE_REWIND_SEGMENT_SIZE;
-  uint64_t * new_data = (uint64_t*)core;
-  uint64_t * old_data = (uint64_t*)&rewind->last_core;
-  int total_deltas =0; 
-  for(int s=0; s<total_segments;++s){
-    bool delta = false; 
-    int base_off = s*SE_REWIND_SEGMENT_SIZE/8;
-    for(int s_off = 0; s_off< SE_REWIND_SEGMENT_SIZE/8;++s_off){
-      if(new_data[base_off+s_off]!=old_data[base_off+s_off]){delta = true;break;}
-    }
-    if(delta){
-      int rewind_index = rewind->index%SE_REWIND_BUFFER_SIZE;
-      int offset = s; 
-      if(total_deltas==0)offset|= SE_LAST_DELTA_IN_TX;
-      for(int s_off = 0; s_off< SE_REWIND_SEGMENT_SIZE/8;++s_off){
-        rewind->deltas[rewind_index].data[s_off] =old_data[base_off+s_off];
-        old_data[base_off+s_off]= new_data[base_off+s_off]; 
-      } 
-      rewind->deltas[rewind_index].offset = offset;
-      rewind->index++;
-      rewind->size++;
-      ++total_deltas;
-    }
+  if(!rewind->capture)rewind->capture = (se_core_state_t*)se_alloc_huge(sizeof(se_core_state_t));
+  if(!rewind->capture){
+    se_diff_rewind_state(core,rewind,rewind->curr_frame);
+    return;
+  }
+  memcpy(rewind->capture,core,sizeof(se_core_state_t));
+  rewind->capture_frame = rewind->curr_frame;
+  job_pool_run_async(SE_ASYNC_REWIND,se_rewind_capture_job,rewind);
+}
+// Removes the newest transaction, applying its deltas to last_core if apply is set
+static void se_pop_rewind_tx(se_core_rewind_buffer_t* rewind, bool apply){
+  se_rewind_tx_t* tx = se_get_rewind_tx(rewind,rewind->size-1);
+  if(apply){
+    uint8_t * old_data = (uint8_t*)&rewind->last_core;
+    uint8_t* deltas = se_rewind_staging(rewind,tx->delta_size);
+    mz_ulong size = tx->delta_size;
+    if(deltas&&mz_uncompress(deltas,&size,tx->data,tx->compressed_size)==MZ_OK){
+      size_t off = 0;
+      while(off+sizeof(se_core_delta_t)<=size){
+        se_core_delta_t header;
+        memcpy(&header,deltas+off,sizeof(header));
+        off+=sizeof(header);
+        if(header.size>size-off||header.offset+(uint64_t)header.size>sizeof(se_core_state_t))break;
+        memcpy(old_data+header.offset,deltas+off,header.size);
+        off+=header.size;
+      }
+    }else printf("Failed to decompress rewind state\n");
   }
-  if(rewind->size>=SE_REWIND_BUFFER_SIZE)rewind->size=SE_REWIND_BUFFER_SIZE-1; 
-  rewind->index= rewind->index%SE_REWIND_BUFFER_SIZE;
-  //Discard partial transactions remaing
-  while(rewind->size>0 && se_more_rewind_deltas(rewind,rewind->index-rewind->size))rewind->size--;
+  se_free_rewind_tx(rewind,tx);
+  rewind->size--;
 }
 void se_rewind_state_single_tick(se_core_state_t* core, se_core_rewind_buffer_t* rewind){
-  uint64_t * old_data = (uint64_t*)&rewind->last_core;
-  int rewound_deltas=0; 
-  bool more_transactions = true;
-  while(rewind->size&&more_transactions){
-    ++rewound_deltas;
-    --rewind->size;
-    uint32_t rewind_index = (--rewind->index)%SE_REWIND_BUFFER_SIZE;
-    int s = rewind->deltas[rewind_index].offset; 
-    if(s&SE_LAST_DELTA_IN_TX){
-      more_transactions=false;
-      s&=~SE_LAST_DELTA_IN_TX;
-    }
-    int base_off = s*SE_REWIND_SEGMENT_SIZE/8;
-    for(int s_off = 0; s_off< SE_REWIND_SEGMENT_SIZE/8;++s_off){
-      old_data[base_off+s_off]=rewind->deltas[rewind_index].data[s_off];
-    }
-  }
-  rewind->index= rewind->index%SE_REWIND_BUFFER_SIZE;
+  job_pool_wait_async(SE_ASYNC_REWIND);
+  if(rewind->size){
+    se_pop_rewind_tx(rewind,true);
+    rewind->curr_frame = se_rewind_state_frame(rewind,(int)rewind->size-1);
+  }
+  *core = rewind->last_core;
+  #ifdef ENABLE_RETRO_ACHIEVEMENTS
+    retro_achievements_restore_state(core->rc_buffer);
+  #endif
+}
+// Restores the newest captured state at or before frame and discards the history after it.
+// Starts from the closest keyframe so at most SE_REWIND_KEYFRAME_INTERVAL transactions are replayed.
+bool se_seek_rewind_state(se_core_state_t* core, se_core_rewind_buffer_t* rewind, uint64_t frame){
+  job_pool_wait_async(SE_ASYNC_REWIND);
+  if(!rewind->first_push||frame<rewind->base_frame)return false;
+  int target = (int)rewind->size-1;
+  while(target>=0&&se_rewind_state_frame(rewind,target)>frame)--target;
+  int start = target<0? 0: target;
+  while(start<(int)rewind->size-1&&!se_get_rewind_tx(rewind,start)->keyframe)++start;
+  if(start<(int)rewind->size-1){
+    if(!rewind->capture)rewind->capture = (se_core_state_t*)se_alloc_huge(sizeof(se_core_state_t));
+    se_rewind_tx_t* tx = se_get_rewind_tx(rewind,start);
+    mz_ulong size = sizeof(se_core_state_t);
+    if(rewind->capture&&mz_uncompress((uint8_t*)rewind->capture,&size,tx->keyframe,tx->keyframe_size)==MZ_OK){
+      memcpy(&rewind->last_core,rewind->capture,sizeof(se_core_state_t));
+      while((int)rewind->size-1>start)se_pop_rewind_tx(rewind,false);
+    }
+  }
+  while((int)rewind->size-1>target)se_pop_rewind_tx(rewind,true);
+  rewind->txs_since_keyframe = 0;
+  rewind->curr_frame = se_rewind_state_frame(rewind,target);
   *core = rewind->last_core;
   #ifdef ENABLE_RETRO_ACHIEVEMENTS
     retro_achievements_restore_state(core->rc_buffer);
   #endif
+  return true;
 }
 void se_reset_rewind_buffer(se_core_rewind_buffer_t* rewind){
-  rewind->index = rewind->size = 0; 
-  rewind->first_push = false;
+  job_pool_wait_async(SE_ASYNC_REWIND);
+  se_clear_rewind_history(rewind);
+  rewind->curr_frame = 0;
 }
 // Detection based on code by Freak, modified by Sky to add WebAsm, and RISC-V
 const char *se_get_host_arch() { 
@@ -1239,6 +2254,25 @@ const char *se_get_host_platform() {
   return "Unknown Platform";
 }
 
+static bool se_reserve_save_state(se_save_state_t* save_state, size_t core_size){
+  if(core_size<=save_state->core_capacity)return true;
+  uint8_t* core = (uint8_t*)realloc(save_state->core,core_size);
+  if(!core){
+    printf("Failed to allocate %zu bytes for a save state\n",core_size);
+    return false;
+  }
+  save_state->core = core;
+  save_state->core_capacity = core_size;
+  return true;
+}
+static se_core_state_t* se_save_state_core(se_save_state_t* save_state){return (se_core_state_t*)save_state->core;}
+static void se_free_save_state(se_save_state_t* save_state){
+  if(!save_state)return;
+  free(save_state->core);
+  save_state->core = NULL;
+  save_state->core_capacity = 0;
+  save_state->valid = false;
+}
 se_emu_id se_get_emu_id(){
   se_emu_id emu_id={0};
   snprintf(emu_id.name,sizeof(emu_id.name),"SkyEmu (%s,%s)",se_get_host_platform(),se_get_host_arch());
@@ -1248,12 +2282,15 @@ se_emu_id se_get_emu_id(){
   emu_id.rcheevos_buffer_size = SE_RC_BUFFER_SIZE;
   return emu_id;
 }
-uint8_t* se_save_state_to_image(se_save_state_t * save_state, uint32_t *width, uint32_t *height){
+// Fills in the BESS block of the state, needs to run on the emulation thread since it depends on the loaded system
+static se_emu_id se_prepare_save_state(se_save_state_t * save_state){
   se_emu_id emu_id=se_get_emu_id();
-  emu_id.bess_offset = se_save_best_effort_state(&save_state->state);
+  emu_id.bess_offset = se_save_best_effort_state(se_save_state_core(save_state));
   emu_id.system = save_state->system;
   printf("Bess offset: %d\n",emu_id.bess_offset);
-  size_t save_state_size = se_get_core_size();
+  return emu_id;
+}
+static uint8_t* se_encode_save_state_image(se_save_state_t * save_state, se_emu_id emu_id, size_t save_state_size, uint32_t *width, uint32_t *height){
   size_t net_save_state_size = sizeof(emu_id)+save_state_size+SE_RC_BUFFER_SIZE;
   int screenshot_size = save_state->screenshot_width*save_state->screenshot_height;
 
@@ -1262,7 +2299,7 @@ uint8_t* se_save_state_to_image(se_save_state_t * save_state, uint32_t *width, u
 
   uint8_t *imdata = malloc(scale*scale*screenshot_size*4);
   uint8_t *emu_id_dat = (uint8_t*)&emu_id;
-  uint8_t *save_state_dat = (uint8_t*)&(save_state->state);
+  uint8_t *save_state_dat = save_state->core;
   for(int y=0;y<save_state->screenshot_height*scale;++y){
     for(int x=0;x<save_state->screenshot_width*scale;++x){
       int px = x/scale;
@@ -1276,7 +2313,7 @@ uint8_t* se_save_state_to_image(se_save_state_t * save_state, uint32_t *width, u
       uint8_t data =0; 
       if(p_out<sizeof(emu_id))data = emu_id_dat[p_out];
       else if(p_out-sizeof(emu_id)<save_state_size) data = save_state_dat[p_out-sizeof(emu_id)];
-      else if(p_out-sizeof(emu_id)-save_state_size<SE_RC_BUFFER_SIZE) data = save_state->state.rc_buffer[p_out-sizeof(emu_id)-save_state_size];
+      else if(p_out-sizeof(emu_id)-save_state_size<SE_RC_BUFFER_SIZE) data = save_state->rc_buffer[p_out-sizeof(emu_id)-save_state_size];
 
       r&=0xfC;
       g&=0xfC;
@@ -1297,22 +2334,225 @@ uint8_t* se_save_state_to_image(se_save_state_t * save_state, uint32_t *width, u
   *height = save_state->screenshot_height*scale;
   return imdata;
 }
-bool se_save_state_to_disk(se_save_state_t* save_state, const char* filename){
-  if(emu_state.rom_loaded==false)return false;
+uint8_t* se_save_state_to_image(se_save_state_t * save_state, uint32_t *width, uint32_t *height){
+  se_emu_id emu_id = se_prepare_save_state(save_state);
+  return se_encode_save_state_image(save_state,emu_id,se_get_core_size(),width,height);
+}
+static bool se_is_binary_state_path(const char* filename){
+  size_t len = strlen(filename), ext_len = strlen(SE_BINARY_STATE_EXTENSION);
+  return len>=ext_len&&strcmp(filename+len-ext_len,SE_BINARY_STATE_EXTENSION)==0;
+}
+// Packs data as a bitmap of the pages that contain non zero bytes followed by those pages.
+// Returns the number of bytes written to out, which must hold at least size+size/SE_SPARSE_STATE_PAGE_SIZE/8+1 bytes
+static size_t se_sparse_encode(const uint8_t* data, size_t size, uint8_t* out){
+  size_t num_pages = (size+SE_SPARSE_STATE_PAGE_SIZE-1)/SE_SPARSE_STATE_PAGE_SIZE;
+  uint8_t* bitmap = out;
+  size_t out_size = (num_pages+7)/8;
+  memset(bitmap,0,out_size);
+  for(size_t p=0;p<num_pages;++p){
+    size_t off = p*SE_SPARSE_STATE_PAGE_SIZE;
+    size_t page_size = SE_MIN_CONST(SE_SPARSE_STATE_PAGE_SIZE,size-off);
+    uint8_t used = 0;
+    for(size_t i=0;i<page_size;++i)used|=data[off+i];
+    if(!used)continue;
+    bitmap[p/8]|=1<<(p%8);
+    memcpy(out+out_size,data+off,page_size);
+    out_size+=page_size;
+  }
+  return out_size;
+}
+static bool se_sparse_decode(const uint8_t* sparse, size_t sparse_size, uint8_t* data, size_t size){
+  size_t num_pages = (size+SE_SPARSE_STATE_PAGE_SIZE-1)/SE_SPARSE_STATE_PAGE_SIZE;
+  size_t in_off = (num_pages+7)/8;
+  if(in_off>sparse_size)return false;
+  for(size_t p=0;p<num_pages;++p){
+    size_t off = p*SE_SPARSE_STATE_PAGE_SIZE;
+    size_t page_size = SE_MIN_CONST(SE_SPARSE_STATE_PAGE_SIZE,size-off);
+    if(!SB_BFE(sparse[p/8],p%8,1)){
+      memset(data+off,0,page_size);
+      continue;
+    }
+    if(in_off+page_size>sparse_size)return false;
+    memcpy(data+off,sparse+in_off,page_size);
+    in_off+=page_size;
+  }
+  return true;
+}
+// Returns a malloc'd binary save state or NULL on failure
+static uint8_t* se_encode_binary_state(se_save_state_t* save_state, se_emu_id emu_id, size_t core_size, size_t* size){
+  size_t data_size = sizeof(emu_id)+core_size+SE_RC_BUFFER_SIZE;
+  size_t screenshot_size = save_state->screenshot_width*save_state->screenshot_height*4;
+  uint8_t* data = (uint8_t*)malloc(data_size);
+  uint8_t* payload = (uint8_t*)malloc(screenshot_size+data_size+data_size/SE_SPARSE_STATE_PAGE_SIZE/8+1);
+  mz_ulong compressed_size = mz_compressBound(screenshot_size+data_size+data_size/SE_SPARSE_STATE_PAGE_SIZE/8+1);
+  uint8_t* file_data = (uint8_t*)malloc(sizeof(se_binary_state_header_t)+compressed_size);
+  bool success = false;
+  if(data&&payload&&file_data){
+    memcpy(data,&emu_id,sizeof(emu_id));
+    memcpy(data+sizeof(emu_id),save_state->core,core_size);
+    memcpy(data+sizeof(emu_id)+core_size,save_state->rc_buffer,SE_RC_BUFFER_SIZE);
+    memcpy(payload,save_state->screenshot,screenshot_size);
+    size_t payload_size = screenshot_size+se_sparse_encode(data,data_size,payload+screenshot_size);
+    if(mz_compress(file_data+sizeof(se_binary_state_header_t),&compressed_size,payload,payload_size)==MZ_OK){
+      se_binary_state_header_t header={0};
+      memcpy(header.magic,SE_BINARY_STATE_MAGIC,sizeof(header.magic));
+      header.version = SE_BINARY_STATE_VERSION;
+      header.system = save_state->system;
+      header.data_size = data_size;
+      header.payload_size = payload_size;
+      header.compressed_size = compressed_size;
+      header.screenshot_width = save_state->screenshot_width;
+      header.screenshot_height = save_state->screenshot_height;
+      memcpy(file_data,&header,sizeof(header));
+      *size = sizeof(header)+compressed_size;
+      success = true;
+    }
+  }
+  free(data);
+  free(payload);
+  if(!success){
+    free(file_data);
+    return NULL;
+  }
+  return file_data;
+}
+static bool se_write_binary_state(se_save_state_t* save_state, se_emu_id emu_id, size_t core_size, const char* filename){
+  size_t size = 0;
+  uint8_t* file_data = se_encode_binary_state(save_state,emu_id,core_size,&size);
+  bool success = file_data&&sb_save_file_data(filename,file_data,size);
+  free(file_data);
+  return success;
+}
+// PNG save states also carry the binary state in a private ancillary chunk so loading them doesn't
+// need to decode the image. Older builds and other PNG readers skip the chunk and use the pixels.
+#define SE_PNG_STATE_CHUNK "skYs"
+static void se_png_add_state_chunk(se_png_write_context_t* png, se_save_state_t* save_state, se_emu_id emu_id, size_t core_size){
+  // stb_image_write always ends the file with the 12 byte IEND chunk
+  if(!png->data||png->size<8+12||memcmp(png->data+png->size-8,"IEND",4))return;
+  size_t size = 0;
+  uint8_t* state = se_encode_binary_state(save_state,emu_id,core_size,&size);
+  if(!state)return;
+  uint8_t iend[12];
+  memcpy(iend,png->data+png->size-12,sizeof(iend));
+  png->size-=sizeof(iend);
+  uint8_t header[8]={size>>24,size>>16,size>>8,size};
+  memcpy(header+4,SE_PNG_STATE_CHUNK,4);
+  uint32_t crc = mz_crc32(mz_crc32(MZ_CRC32_INIT,header+4,4),state,size);
+  uint8_t footer[4]={crc>>24,crc>>16,crc>>8,crc};
+  se_png_write_mem(png,header,sizeof(header));
+  se_png_write_mem(png,state,size);
+  se_png_write_mem(png,footer,sizeof(footer));
+  se_png_write_mem(png,iend,sizeof(iend));
+  free(state);
+}
+// Returns the binary state of a PNG written with se_png_add_state_chunk, NULL if data has none
+static const uint8_t* se_png_find_state_chunk(const uint8_t* data, size_t size, size_t* chunk_size){
+  static const uint8_t png_signature[8]={0x89,'P','N','G','\r','\n',0x1a,'\n'};
+  if(size<sizeof(png_signature)||memcmp(data,png_signature,sizeof(png_signature)))return NULL;
+  size_t offset = sizeof(png_signature);
+  while(offset+12<=size){
+    const uint8_t* chunk = data+offset;
+    uint32_t length = ((uint32_t)chunk[0]<<24)|(chunk[1]<<16)|(chunk[2]<<8)|chunk[3];
+    if(length>size-offset-12||memcmp(chunk+4,"IEND",4)==0)break;
+    if(memcmp(chunk+4,SE_PNG_STATE_CHUNK,4)==0){
+      *chunk_size = length;
+      return chunk+8;
+    }
+    offset+=12+length;
+  }
+  return NULL;
+}
+// Returns a PNG with the state embedded in both the pixels and the state chunk, data is NULL on failure
+static se_png_write_context_t se_encode_save_state_png(se_save_state_t* save_state, se_emu_id emu_id, size_t core_size){
+  se_png_write_context_t png = {0};
   uint32_t width=0, height=0;
-  uint8_t* imdata = se_save_state_to_image(save_state, &width,&height);
-  bool success= stbi_write_png(filename, width,height, 4, imdata, 0);
+  uint8_t* imdata = se_encode_save_state_image(save_state,emu_id,core_size,&width,&height);
+  if(imdata&&!stbi_write_png_to_func(se_png_write_mem,&png,width,height,4,imdata,0)){
+    free(png.data);
+    png.data = NULL;
+  }
   free(imdata);
-  se_emscripten_flush_fs();
+  se_png_add_state_chunk(&png,save_state,emu_id,core_size);
+  return png;
+}
+static bool se_write_save_state(se_save_state_t* save_state, se_emu_id emu_id, size_t core_size, const char* filename){
+  bool success = false;
+  if(se_is_binary_state_path(filename))success = se_write_binary_state(save_state,emu_id,core_size,filename);
+  else{
+    se_png_write_context_t png = se_encode_save_state_png(save_state,emu_id,core_size);
+    success = png.data&&sb_save_file_data(filename,png.data,png.size);
+    free(png.data);
+  }
+  se_emscripten_flush_fs(filename);
+  if(!success)printf("Failed to write save state: %s\n",filename);
   return success;
 }
+bool se_save_state_to_disk(se_save_state_t* save_state, const char* filename){
+  if(gui_instance.emu_state.rom_loaded==false)return false;
+  se_emu_id emu_id = se_prepare_save_state(save_state);
+  return se_write_save_state(save_state,emu_id,se_get_core_size(),filename);
+}
+static void se_save_state_write_job(void* user_data, int job_index){
+  se_save_state_write_job_t* job = (se_save_state_write_job_t*)user_data;
+  se_write_save_state(&job->save_state,job->emu_id,job->core_size,job->path);
+}
+// Quick save slots are captured in memory and persisted by the save state worker, which writes the
+// latest capture of each slot. Captures aren't modified once taken, so the worker reads the core of
+// the slot in place and a new capture of that slot goes to a spare buffer meanwhile.
+typedef struct{
+  uint8_t* spare_core;
+  size_t spare_capacity;
+  const uint8_t* writing_core; // Core buffer the worker reads, NULL while it doesn't write this slot
+  bool pending; // Captured since its last write was started
+  se_emu_id emu_id;
+  size_t core_size;
+  char path[SB_FILE_PATH_SIZE];
+}se_state_slot_writer_t;
+static se_state_slot_writer_t se_state_slot_writers[SE_NUM_SAVE_STATES];
+static se_save_state_write_job_t se_state_slot_write_job;
+// Starts the write of the next pending slot once the worker is idle, called every frame
+static void se_update_state_slot_writes(){
+  bool active = false;
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i)active|=se_state_slot_writers[i].pending||se_state_slot_writers[i].writing_core;
+  if(!active||job_pool_async_busy(SE_ASYNC_SAVE_STATE))return;
+  job_pool_wait_async(SE_ASYNC_SAVE_STATE);
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i)se_state_slot_writers[i].writing_core = NULL;
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i){
+    se_state_slot_writer_t* w = se_state_slot_writers+i;
+    if(!w->pending)continue;
+    w->pending = false;
+    if(!save_states[i].valid)continue;
+    se_save_state_write_job_t* job = &se_state_slot_write_job;
+    // Shares the core of the slot, the worker only reads it
+    job->save_state = save_states[i];
+    job->emu_id = w->emu_id;
+    job->core_size = w->core_size;
+    memcpy(job->path,w->path,sizeof(job->path));
+    w->writing_core = save_states[i].core;
+    job_pool_run_async(SE_ASYNC_SAVE_STATE,se_save_state_write_job,job);
+    return;
+  }
+}
+// Writes every pending slot, before the slots are reloaded or the app exits
+static void se_flush_state_slot_writes(){
+  bool pending = true;
+  while(pending){
+    job_pool_wait_async(SE_ASYNC_SAVE_STATE);
+    se_update_state_slot_writes();
+    pending = false;
+    for(int i=0;i<SE_NUM_SAVE_STATES;++i)pending|=se_state_slot_writers[i].pending;
+  }
+  job_pool_wait_async(SE_ASYNC_SAVE_STATE);
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i)se_state_slot_writers[i].writing_core = NULL;
+}
 bool se_bess_state_restore(uint8_t*state_data, size_t data_size, const se_emu_id emu_id, se_save_state_t* state){
-  state->state = core;
+  if(!se_reserve_save_state(state,se_get_core_size()))return false;
+  memcpy(state->core,&gui_instance.core,se_get_core_size());
   printf("Attempting BESS Restore\n");
   if(sizeof(emu_id)>data_size)return false; 
   size_t save_state_size = data_size-sizeof(emu_id);
   uint8_t *data = state_data +sizeof(emu_id);
-  bool valid = se_load_best_effort_state(&(state->state),data, save_state_size, emu_id.bess_offset);
+  bool valid = se_load_best_effort_state(se_save_state_core(state),data, save_state_size, emu_id.bess_offset);
   printf("Valid:%d\n",valid);
   if(!valid){
     state->screenshot_width=1;
@@ -1324,6 +2564,7 @@ bool se_bess_state_restore(uint8_t*state_data, size_t data_size, const se_emu_id
   }
   return valid; 
 }
+bool se_load_state_data(se_save_state_t* save_state, const char* filename, uint8_t* data, size_t data_size);
 bool se_load_state_common(se_save_state_t* save_state, const char* filename, uint8_t* imdata, int im_w, int im_h){
   uint8_t *data = malloc(im_w*im_h);
   size_t data_size = im_w*im_h;
@@ -1349,9 +2590,11 @@ bool se_load_state_common(se_save_state_t* save_state, const char* filename, uin
   }
   
   stbi_image_free(imdata);
-
-  bool valid = data_size<sizeof(se_emu_id);
-
+  se_load_state_data(save_state,filename,data,data_size);
+  free(data);
+  return save_state->valid;
+}
+bool se_load_state_data(se_save_state_t* save_state, const char* filename, uint8_t* data, size_t data_size){
   if(sizeof(se_emu_id)<data_size){
 
     se_emu_id emu_id=se_get_emu_id();
@@ -1366,8 +2609,8 @@ bool se_load_state_common(se_save_state_t* save_state, const char* filename, uin
       bess=true; 
     }
     save_state->system = comp_id.system;
-    if(!bess&&se_get_core_size()+sizeof(se_emu_id)<=data_size){
-      memcpy(&(save_state->state), data+sizeof(se_emu_id), se_get_core_size());
+    if(!bess&&se_get_core_size()+sizeof(se_emu_id)<=data_size&&se_reserve_save_state(save_state,se_get_core_size())){
+      memcpy(save_state->core, data+sizeof(se_emu_id), se_get_core_size());
       save_state->valid = 1; 
     }else{
       // SkyEmu versions after the RetroAchievements merge move the location of the core structure
@@ -1406,27 +2649,59 @@ bool se_load_state_common(se_save_state_t* save_state, const char* filename, uin
     if(rc_buffer_bytes>comp_id.rcheevos_buffer_size)rc_buffer_bytes=comp_id.rcheevos_buffer_size;
     if(comp_id.rcheevos_buffer_offset+comp_id.rcheevos_buffer_size+sizeof(se_emu_id)<=data_size){
       printf("Restoring RC Buffer %d bytes\n", rc_buffer_bytes);
-      memcpy(save_state->state.rc_buffer,data+sizeof(se_emu_id)+comp_id.rcheevos_buffer_offset,rc_buffer_bytes);
+      memcpy(save_state->rc_buffer,data+sizeof(se_emu_id)+comp_id.rcheevos_buffer_offset,rc_buffer_bytes);
     }
   }
+  return save_state->valid;
+}
+static bool se_load_binary_state(se_save_state_t* save_state, const char* filename, uint8_t* file_data, size_t file_size){
+  se_binary_state_header_t header;
+  memcpy(&header,file_data,sizeof(header));
+  size_t screenshot_size = (size_t)header.screenshot_width*header.screenshot_height*4;
+  if(header.version!=SE_BINARY_STATE_VERSION||header.compressed_size>file_size-sizeof(header)||
+     header.screenshot_width<0||header.screenshot_height<0||screenshot_size>SE_MAX_SCREENSHOT_SIZE||screenshot_size>header.payload_size){
+    printf("ERROR: Save state:%s has an unsupported binary format\n",filename?filename:"");
+    return false;
+  }
+  mz_ulong payload_size = header.payload_size;
+  uint8_t* payload = (uint8_t*)malloc(payload_size);
+  uint8_t* data = (uint8_t*)malloc(header.data_size);
+  if(payload&&data&&mz_uncompress(payload,&payload_size,file_data+sizeof(header),header.compressed_size)==MZ_OK&&
+     payload_size==header.payload_size&&se_sparse_decode(payload+screenshot_size,payload_size-screenshot_size,data,header.data_size)){
+    save_state->screenshot_width=header.screenshot_width;
+    save_state->screenshot_height=header.screenshot_height;
+    memcpy(save_state->screenshot,payload,screenshot_size);
+    se_load_state_data(save_state,filename,data,header.data_size);
+  }
+  free(payload);
   free(data);
   return save_state->valid;
 }
-bool se_load_state_from_mem(se_save_state_t* save_state, void* data, size_t data_size){
+static bool se_is_binary_state(const uint8_t* data, size_t size){
+  return size>=sizeof(se_binary_state_header_t)&&memcmp(data,SE_BINARY_STATE_MAGIC,8)==0;
+}
+static bool se_load_state_from_file_data(se_save_state_t* save_state, const char* filename, uint8_t* data, size_t data_size){
   save_state->valid = false;
+  if(se_is_binary_state(data,data_size))return se_load_binary_state(save_state,filename,data,data_size);
+  size_t chunk_size = 0;
+  uint8_t* chunk = (uint8_t*)se_png_find_state_chunk(data,data_size,&chunk_size);
+  if(chunk&&se_is_binary_state(chunk,chunk_size)&&se_load_binary_state(save_state,filename,chunk,chunk_size))return true;
+  // States from builds without the state chunk only have it in the pixels
   int im_w, im_h, im_c;
   uint8_t *imdata = stbi_load_from_memory(data, data_size, &im_w, &im_h, &im_c, 4);
   if(!imdata)return false;
-
-  return se_load_state_common(save_state, NULL, imdata, im_w, im_h);
+  return se_load_state_common(save_state, filename, imdata, im_w, im_h);
+}
+bool se_load_state_from_mem(se_save_state_t* save_state, void* data, size_t data_size){
+  return se_load_state_from_file_data(save_state,NULL,(uint8_t*)data,data_size);
 }
 bool se_load_state_from_disk(se_save_state_t* save_state, const char* filename){
   save_state->valid = false;
-  int im_w, im_h, im_c; 
-  uint8_t *imdata = stbi_load(filename, &im_w, &im_h, &im_c, 4);
-  if(!imdata)return false; 
-
-  bool ret = se_load_state_common(save_state, filename, imdata, im_w, im_h);
+  size_t file_size = 0;
+  uint8_t* file_data = sb_load_file_data(filename,&file_size);
+  if(!file_data)return false;
+  bool ret = se_load_state_from_file_data(save_state,filename,file_data,file_size);
+  sb_free_file_data(file_data);
   if(save_state->valid)printf("Loaded save state:%s\n",filename);
   else printf("Failed to load state from file:%s\n",filename);
   return ret;
@@ -1460,9 +2735,91 @@ double se_fps_counter(int tick){
   return 1.0/fps; 
 }
 
-void se_emscripten_flush_fs(){
 #if defined(EMSCRIPTEN)
-    EM_ASM( FS.syncfs(function (err) {}););
+// Writes to IndexedDB are debounced so a game saving every few frames costs one transaction,
+// and only the files reported dirty are stored instead of diffing the whole tree with FS.syncfs.
+// A full sync still runs when the page is hidden, to catch files written without a report.
+#define SE_FS_FLUSH_DEBOUNCE_MS 1000
+#define SE_FS_FLUSH_MAX_DELAY_MS 5000
+EM_JS(void, se_emscripten_queue_flush, (const char* path, int debounce_ms, int max_delay_ms), {
+  var fs = Module._se_fs_flush;
+  if(!fs){
+    fs = Module._se_fs_flush = {dirty: new Set(), full: false, timer: null, first: 0, busy: false, again: false};
+    var done = function(err){
+      if(err)console.log('Failed to flush files to IndexedDB', err);
+      fs.busy = false;
+      if(fs.again){ fs.again = false; fs.run(); }
+    };
+    fs.run = function(){
+      if(fs.timer){ clearTimeout(fs.timer); fs.timer = null; }
+      if(fs.busy){ fs.again = true; return; }
+      var full = fs.full, paths = Array.from(fs.dirty);
+      fs.full = false;
+      fs.dirty.clear();
+      if(full){ fs.busy = true; FS.syncfs(false, done); return; }
+      if(!paths.length)return;
+      var mount = FS.lookupPath('/offline').node.mount;
+      fs.busy = true;
+      IDBFS.getDB(mount.mountpoint, function(err, db){
+        if(err)return done(err);
+        var tx = db.transaction([IDBFS.DB_STORE_NAME], 'readwrite');
+        var store = tx.objectStore(IDBFS.DB_STORE_NAME);
+        tx.oncomplete = function(){ done(null); };
+        tx.onerror = function(e){ done(tx.error); e.preventDefault(); };
+        var stored = new Set();
+        var store_path = function(p){
+          if(stored.has(p))return;
+          stored.add(p);
+          if(!FS.analyzePath(p).exists){ IDBFS.removeRemoteEntry(store, p, function(){}); return; }
+          IDBFS.loadLocalEntry(p, function(err, entry){
+            if(!err)IDBFS.storeRemoteEntry(store, p, entry, function(){});
+          });
+        };
+        paths.forEach(function(p){
+          // Parent directories have to exist in the store for the file to be restored
+          var parts = p.split('/');
+          for(var i=3;i<parts.length;++i)store_path(parts.slice(0,i).join('/'));
+          store_path(p);
+        });
+      });
+    };
+    document.addEventListener('visibilitychange', function(){
+      if(document.visibilityState !== 'hidden')return;
+      fs.full = true;
+      fs.run();
+    });
+  }
+  if(path){
+    var p = UTF8ToString(path);
+    while(p.indexOf('//') >= 0)p = p.replace('//', '/');
+    // Only files under the IDBFS mount are persisted
+    if(p.indexOf('/offline/') !== 0)return;
+    fs.dirty.add(p);
+  }else fs.full = true;
+  var now = Date.now();
+  if(fs.timer){
+    // Let a steady stream of writes through every max_delay_ms instead of waiting for a pause
+    if(now-fs.first >= max_delay_ms)return;
+    clearTimeout(fs.timer);
+  }else fs.first = now;
+  fs.timer = setTimeout(fs.run, debounce_ms);
+});
+static void se_emscripten_queue_flush_main_thread(char* path){
+  se_emscripten_queue_flush(path,SE_FS_FLUSH_DEBOUNCE_MS,SE_FS_FLUSH_MAX_DELAY_MS);
+  free(path);
+}
+#endif
+// Schedules the file at path to be persisted, NULL persists everything. Safe to call from jobs.
+void se_emscripten_flush_fs(const char* path){
+#if defined(EMSCRIPTEN)
+  char* copy = path? strdup(path): NULL;
+  if(path&&!copy)return;
+#if defined(__EMSCRIPTEN_PTHREADS__)
+  // IDBFS only exists on the main thread, save jobs run on workers in SE_WEB_THREADS builds
+  emscripten_async_run_in_main_runtime_thread(EM_FUNC_SIG_VI,(void*)se_emscripten_queue_flush_main_thread,copy);
+#else
+  se_emscripten_queue_flush_main_thread(copy);
+#endif
 #endif
 }
 void se_load_search_paths(){
@@ -1491,7 +2848,7 @@ void se_save_search_paths(){
   char settings_path[SB_FILE_PATH_SIZE];
   snprintf(settings_path,SB_FILE_PATH_SIZE,"%ssearch_paths.bin",se_get_pref_path());
   sb_save_file_data(settings_path,(uint8_t*)&gui_state.paths,sizeof(gui_state.paths));
-  se_emscripten_flush_fs();
+  se_emscripten_flush_fs(settings_path);
 }
 void se_reset_bios_info(){
   memset(&gui_state.bios_info,0,sizeof(se_bios_info_t));
@@ -1500,8 +2857,8 @@ bool se_load_bios_file(const char* name, const char* base_path, const char* file
   bool loaded_bios=false;
   const char* base, *file, *ext; 
   sb_breakup_path(base_path, &base,&file, &ext);
-  static char bios_path[SB_FILE_PATH_SIZE];
-  static char bios_create_path[SB_FILE_PATH_SIZE];
+  char bios_path[SB_FILE_PATH_SIZE];
+  char bios_create_path[SB_FILE_PATH_SIZE];
   se_join_path(bios_path,SB_FILE_PATH_SIZE,base,file_name,NULL);
   size_t bios_bytes=0;
   strncpy(bios_create_path,bios_path,SB_FILE_PATH_SIZE);
@@ -1586,7 +2943,7 @@ static void se_save_recent_games_list(){
     fprintf(f,"%s\n",gui->recently_loaded_games[i].path);
   }
   fclose(f);
-  se_emscripten_flush_fs();
+  se_emscripten_flush_fs(pref_path);
   se_sort_recent_games_list();
 }
 static void se_load_recent_games_list(){
@@ -1629,7 +2986,7 @@ bool se_key_is_pressed(int keycode){
   // Don't let keyboard input reach emulator when ImGUI is capturing it. 
   // Allow inputs if the touch screen is being pressed as the screen is an ImGUI object that 
   // registers drag events. 
-  if(igGetIO()->WantCaptureKeyboard && ! emu_state.joy.inputs[SE_KEY_PEN_DOWN] )return false; 
+  if(igGetIO()->WantCaptureKeyboard && ! gui_instance.emu_state.joy.inputs[SE_KEY_PEN_DOWN] )return false; 
   return gui_state.button_state[keycode];
 }
 static sg_image* se_get_image(){
@@ -1651,6 +3008,100 @@ static void se_free_all_images(){
     gui_state.image_free_list=tmp->next;
     free(tmp);
   }
+  gui_state.stream_images_used = 0;
+  gui_state.stream_images_uploaded = 0;
+}
+static void se_free_render_targets(sg_image* target, sg_pass* pass, int count, bool deferred){
+  for(int i=0;i<count;++i){
+    if(pass[i].id!=SG_INVALID_ID)sg_destroy_pass(pass[i]);
+    if(target[i].id!=SG_INVALID_ID){
+      if(deferred)se_free_image_deferred(target[i]);
+      else sg_destroy_image(target[i]);
+    }
+    pass[i].id = target[i].id = SG_INVALID_ID;
+  }
+}
+static void se_free_shader_chain_slot(se_shader_chain_slot_t* slot, bool deferred){
+  se_free_render_targets(slot->target,slot->pass,SE_MAX_SHADER_PASSES,deferred);
+  slot->chain = 0;
+  slot->valid = false;
+}
+static void se_free_ghost_slot(se_ghost_slot_t* slot, bool deferred){
+  se_free_render_targets(slot->target,slot->pass,2,deferred);
+  slot->width = slot->height = 0;
+  slot->valid = false;
+}
+static void se_free_stream_images(){
+  for(int s=0;s<SE_STREAM_IMAGE_SLOTS;++s){
+    se_stream_image_t* slot = gui_state.stream_images+s;
+    for(int b=0;b<SE_STREAM_IMAGE_BUFFERS;++b){
+      if(slot->image[b].id!=SG_INVALID_ID)sg_destroy_image(slot->image[b]);
+      slot->image[b].id = SG_INVALID_ID;
+    }
+    slot->width = slot->height = 0;
+    se_free_shader_chain_slot(gui_state.shader_chain_slots+s,false);
+    se_free_ghost_slot(gui_state.ghost_slots+s,false);
+  }
+}
+static sg_image_desc se_rgba8_image_desc(int width, int height, sg_usage usage){
+  sg_image_desc desc={
+    .type=              SG_IMAGETYPE_2D,
+    .render_target=     false,
+    .width=             width,
+    .height=            height,
+    .num_slices=        1,
+    .num_mipmaps=       1,
+    .usage=             usage,
+    .pixel_format=      SG_PIXELFORMAT_RGBA8,
+    .sample_count=      1,
+    .min_filter=        SG_FILTER_NEAREST,
+    .mag_filter=        SG_FILTER_NEAREST,
+    .wrap_u=            SG_WRAP_CLAMP_TO_EDGE,
+    .wrap_v=            SG_WRAP_CLAMP_TO_EDGE,
+    .wrap_w=            SG_WRAP_CLAMP_TO_EDGE,
+    .border_color=      SG_BORDERCOLOR_OPAQUE_BLACK,
+    .max_anisotropy=    1,
+    .min_lod=           0.0f,
+    .max_lod=           1e9f,
+  };
+  return desc;
+}
+// Uploads RGBA8 pixels to the next pooled streaming texture. Falls back to a temporary image
+// once the pool is exhausted. Unchanged pixels are detected by hash and not uploaded again.
+static sg_image se_stream_image(const uint8_t* rgba8_data, int width, int height){
+  sg_image_data im_data={0};
+  im_data.subimage[0][0].ptr = rgba8_data;
+  im_data.subimage[0][0].size = width*height*4;
+  if(gui_state.stream_images_used>=SE_STREAM_IMAGE_SLOTS){
+    uint64_t start = stm_now();
+    sg_image *image = se_get_image();
+    sg_image_desc desc = se_rgba8_image_desc(width,height,SG_USAGE_IMMUTABLE);
+    desc.data = im_data;
+    *image = sg_make_image(&desc);
+    gui_state.stream_images_uploaded++;
+    gui_state.emu_stats.upload_ticks+=stm_since(start);
+    return *image;
+  }
+  se_stream_image_t* slot = gui_state.stream_images+gui_state.stream_images_used++;
+  uint64_t hash = XXH3_64bits(rgba8_data,im_data.subimage[0][0].size);
+  if(slot->uploaded&&slot->width==width&&slot->height==height&&slot->hash==hash)return slot->image[slot->next];
+  if(slot->width!=width||slot->height!=height){
+    sg_image_desc desc = se_rgba8_image_desc(width,height,SG_USAGE_STREAM);
+    for(int b=0;b<SE_STREAM_IMAGE_BUFFERS;++b){
+      if(slot->image[b].id!=SG_INVALID_ID)se_free_image_deferred(slot->image[b]);
+      slot->image[b] = sg_make_image(&desc);
+    }
+    slot->width = width;
+    slot->height = height;
+  }
+  slot->next = (slot->next+1)%SE_STREAM_IMAGE_BUFFERS;
+  uint64_t start = stm_now();
+  sg_update_image(slot->image[slot->next],&im_data);
+  gui_state.emu_stats.upload_ticks+=stm_since(start);
+  slot->uploaded = true;
+  slot->hash = hash;
+  gui_state.stream_images_uploaded++;
+  return slot->image[slot->next];
 }
 typedef uint8_t (*emu_byte_read_t)(uint64_t address);
 typedef void (*emu_byte_write_t)(uint64_t address,uint8_t data);
@@ -1696,37 +3147,289 @@ void se_record_emulation_frame_stats(se_emulator_stats_t *stats, int frames_emul
   for(int i=0;i<abs_frames;++i)
     stats->waveform_fps_emulation[SE_STATS_GRAPH_DATA-abs_frames+i]= fps;
 }
-void se_draw_emu_stats(){
-  se_emulator_stats_t *stats = &gui_state.emu_stats;
-  double curr_time = se_time();
-  double fps_render = 1.0/(curr_time-stats->last_render_time);
-  stats->last_render_time=curr_time;
-  float render_min=1e9, render_max=0, render_avg=0; 
-  float emulate_min=1e9, emulate_max=0, emulate_avg=0; 
-  int render_data_points = 0; 
-  int emulate_data_points =0;
-
-  se_record_emulation_frame_stats(&gui_state.emu_stats,emu_state.frame);
-
-  for(int i=0;i<SE_STATS_GRAPH_DATA-1;++i){
-    stats->waveform_fps_render[i]=stats->waveform_fps_render[i+1];
-    if(stats->waveform_fps_render[i]>render_max)render_max=stats->waveform_fps_render[i];
-    if(stats->waveform_fps_render[i]<render_min)render_min=stats->waveform_fps_render[i];
-    if(fabs(stats->waveform_fps_render[i])>1.0){
-      render_avg+=1.0/stats->waveform_fps_render[i];
-      render_data_points++;
-    }
-    
-
-    if(stats->waveform_fps_emulation[i]>emulate_max)emulate_max=stats->waveform_fps_emulation[i];
-    if(stats->waveform_fps_emulation[i]<emulate_min)emulate_min=stats->waveform_fps_emulation[i];
-    if(fabs(stats->waveform_fps_emulation[i])>1.0){
-      emulate_avg+=1.0/fabs(stats->waveform_fps_emulation[i]);
-      ++emulate_data_points;
+#define SE_PROFILE_WINDOW_FRAMES 30
+static const char* se_profile_names[SB_PROFILE_COUNT]={"ppu","audio","dma","gx"};
+static const char* se_counter_names[SB_COUNTER_COUNT]={"instructions","mmio","dma_bytes","gx_commands","triangles","pixels"};
+// Time spent in the core outside of the profiled subsystems, per frame
+static double se_profile_cpu_ns_per_frame(const sb_profile_t* p){
+  if(!p->frames)return 0;
+  double cpu_ns = p->core_ns;
+  for(int i=0;i<SB_PROFILE_COUNT;++i)cpu_ns-=p->ns[i];
+  return cpu_ns>0? cpu_ns/p->frames: 0;
+}
+static const char* se_frame_stat_names[SE_FRAME_STAT_COUNT]={"emulation","render","upload","present"};
+static int se_frame_stats_bin(float ms){
+  int bin = ms/SE_FRAME_STATS_BIN_MS;
+  if(bin<0)bin = 0;
+  return bin<SE_FRAME_STATS_BINS? bin: SE_FRAME_STATS_BINS-1;
+}
+static void se_frame_stats_push(se_frame_stats_t* s, const float* ms){
+  float* sample = s->ms[s->frames%SE_FRAME_STATS_SIZE];
+  for(int m=0;m<SE_FRAME_STAT_COUNT;++m){
+    if(s->frames>=SE_FRAME_STATS_SIZE)s->bins[m][se_frame_stats_bin(sample[m])]--;
+    sample[m] = ms[m];
+    s->bins[m][se_frame_stats_bin(ms[m])]++;
+  }
+  s->frames++;
+}
+static int se_frame_stats_count(const se_frame_stats_t* s){
+  return s->frames<SE_FRAME_STATS_SIZE? s->frames: SE_FRAME_STATS_SIZE;
+}
+// Percentiles are the middle of their histogram bin (the max past the last bin), the max is exact
+static se_frame_percentiles_t se_frame_stats_percentiles(const se_frame_stats_t* s, int measure){
+  se_frame_percentiles_t p = {0};
+  int n = se_frame_stats_count(s);
+  if(!n)return p;
+  for(int i=0;i<n;++i)if(s->ms[i][measure]>p.max)p.max = s->ms[i][measure];
+  const double fractions[3]={0.5,0.95,0.99};
+  float* out[3]={&p.p50,&p.p95,&p.p99};
+  int count = 0, f = 0;
+  for(int b=0;b<SE_FRAME_STATS_BINS&&f<3;++b){
+    count+=s->bins[measure][b];
+    while(f<3&&count>=ceil(fractions[f]*n)){
+      float v = (b+0.5)*SE_FRAME_STATS_BIN_MS;
+      *out[f++] = v<p.max&&b+1<SE_FRAME_STATS_BINS? v: p.max;
     }
   }
-  if(render_data_points<1)render_data_points=1;
-  if(emulate_data_points<1)emulate_data_points=1;
+  return p;
+}
+// Called at the start of every UI frame after the emulation thread is joined, the sample is the
+// previous frame: emulation, UI and draw submission, texture uploads and the time between frames
+static void se_frame_stats_begin_frame(uint64_t present_ticks){
+  se_emulator_stats_t* stats = &gui_state.emu_stats;
+  uint64_t now = stm_now();
+  if(stats->frame_start_tick){
+    float ms[SE_FRAME_STAT_COUNT];
+    ms[SE_FRAME_STAT_EMULATION] = stats->emulation_ms;
+    ms[SE_FRAME_STAT_RENDER] = stats->last_render_ms;
+    ms[SE_FRAME_STAT_UPLOAD] = stats->last_upload_ms;
+    ms[SE_FRAME_STAT_PRESENT] = stm_ms(present_ticks);
+    se_frame_stats_push(&stats->frames,ms);
+  }
+  stats->emulation_ms = 0;
+  stats->upload_ticks = 0;
+  stats->frame_start_tick = now;
+}
+static void se_frame_stats_end_frame(){
+  se_emulator_stats_t* stats = &gui_state.emu_stats;
+  stats->last_render_ms = stm_ms(stm_since(stats->frame_start_tick));
+  stats->last_upload_ms = stm_ms(stats->upload_ticks);
+}
+// Oldest frame first, returns a malloc'd null terminated string
+static char* se_frame_stats_csv(size_t* size){
+  const se_frame_stats_t* s = &gui_state.emu_stats.frames;
+  int n = se_frame_stats_count(s);
+  size_t capacity = 64+(size_t)n*80;
+  char* csv = (char*)malloc(capacity);
+  if(!csv)return NULL;
+  size_t off = snprintf(csv,capacity,"frame,emulation_ms,render_ms,upload_ms,present_ms\n");
+  for(int i=0;i<n;++i){
+    uint64_t frame = s->frames-n+i;
+    const float* ms = s->ms[frame%SE_FRAME_STATS_SIZE];
+    off+=snprintf(csv+off,capacity-off,"%llu,%.3f,%.3f,%.3f,%.3f\n",(unsigned long long)frame,ms[0],ms[1],ms[2],ms[3]);
+  }
+  if(size)*size = off;
+  return csv;
+}
+static bool se_save_frame_stats_csv(const char* path){
+  size_t size = 0;
+  char* csv = se_frame_stats_csv(&size);
+  bool okay = csv&&sb_save_file_data(path,(const uint8_t*)csv,size);
+  free(csv);
+  if(okay){
+    printf("Saved frame stats to %s\n",path);
+    se_emscripten_flush_fs(path);
+  }else printf("Failed to save frame stats to %s\n",path);
+  return okay;
+}
+static void se_draw_frame_stats(){
+  static const char* labels[SE_FRAME_STAT_COUNT]={"Emulation","Render","Upload","Present Interval"};
+  const se_frame_stats_t* s = &gui_state.emu_stats.frames;
+  se_text("Last %d frames (ms)",se_frame_stats_count(s));
+  float w = igGetWindowContentRegionWidth();
+  se_text("");
+  const char* columns[4]={"p50","p95","p99","max"};
+  for(int c=0;c<4;++c){
+    igSameLine(w*(0.4+c*0.15),0);
+    se_text("%s",columns[c]);
+  }
+  for(int m=0;m<SE_FRAME_STAT_COUNT;++m){
+    se_frame_percentiles_t p = se_frame_stats_percentiles(s,m);
+    float v[4]={p.p50,p.p95,p.p99,p.max};
+    se_text("%s",se_localize_and_cache(labels[m]));
+    for(int c=0;c<4;++c){
+      igSameLine(w*(0.4+c*0.15),0);
+      se_text("%.2f",v[c]);
+    }
+  }
+  if(se_button(ICON_FK_FLOPPY_O " Save CSV",(ImVec2){0,0})){
+    char name[64];
+    time_t now = time(NULL);
+    strftime(name,sizeof(name),"frame-stats-%Y%m%d-%H%M%S.csv",localtime(&now));
+    snprintf(gui_state.frame_stats_path,sizeof(gui_state.frame_stats_path),"%s%s",se_get_pref_path(),name);
+    if(!se_save_frame_stats_csv(gui_state.frame_stats_path))gui_state.frame_stats_path[0]='\0';
+  }
+  if(gui_state.frame_stats_path[0])se_text("Saved: %s",gui_state.frame_stats_path);
+}
+// Timeline recordings (see trace.h) are toggled with Ctrl+Shift+T, the stats panel or /trace
+static bool se_save_trace(){
+  char name[64];
+  time_t now = time(NULL);
+  strftime(name,sizeof(name),"trace-%Y%m%d-%H%M%S.json",localtime(&now));
+  snprintf(gui_state.trace_path,sizeof(gui_state.trace_path),"%s%s",se_get_pref_path(),name);
+  if(!trace_save_json(gui_state.trace_path))return false;
+  printf("Saved trace to %s\n",gui_state.trace_path);
+  se_emscripten_flush_fs(gui_state.trace_path);
+  return true;
+}
+static void se_toggle_trace(){
+  if(!trace_active()){
+    trace_start();
+    return;
+  }
+  trace_stop();
+  se_save_trace();
+}
+// Event logs record the core events selected in the stats panel into a binary file that
+// skyemu_event_log_decode turns back into text. The ring is emptied on SE_ASYNC_EVENT_LOG once
+// per UI frame, so only bursts longer than SB_EVENT_LOG_SIZE records get dropped.
+static const char* se_event_type_names[SB_EVENT_COUNT]={"IO7","IO9","GX Commands","GX Vertices","Gamecard Commands","Gamecard Reads","Gamecard Data","DMA"};
+static void se_event_log_writer_job(void* user_data, int job_index){
+  sb_event_log_t* log = gui_state.event_log;
+  uint32_t read_ptr = log->read_ptr;
+  uint32_t write_ptr = sb_atomic_load_acquire_u32(&log->write_ptr);
+  while(read_ptr!=write_ptr){
+    uint32_t start = read_ptr%SB_EVENT_LOG_SIZE;
+    uint32_t records = write_ptr-read_ptr;
+    if(start+records>SB_EVENT_LOG_SIZE)records = SB_EVENT_LOG_SIZE-start;
+    if(fwrite(log->records+start,sizeof(sb_event_record_t),records,gui_state.event_log_file)!=records)gui_state.event_log_failed=true;
+    sb_atomic_store_relaxed_u64(&gui_state.event_log_records,gui_state.event_log_records+records);
+    read_ptr+=records;
+    sb_atomic_store_release_u32(&log->read_ptr,read_ptr);
+  }
+}
+static bool se_write_event_log_header(){
+  sb_event_log_file_header_t header={0};
+  memcpy(header.magic,SB_EVENT_LOG_MAGIC,sizeof(header.magic));
+  header.version = SB_EVENT_LOG_VERSION;
+  header.system = gui_instance.emu_state.system;
+  header.record_size = sizeof(sb_event_record_t);
+  header.num_records = gui_state.event_log_records;
+  header.dropped = gui_state.event_log? gui_state.event_log->dropped: 0;
+  return fseek(gui_state.event_log_file,0,SEEK_SET)==0&&fwrite(&header,sizeof(header),1,gui_state.event_log_file)==1;
+}
+static bool se_start_event_log(){
+  char name[64];
+  time_t now = time(NULL);
+  strftime(name,sizeof(name),"events-%Y%m%d-%H%M%S.seev",localtime(&now));
+  snprintf(gui_state.event_log_path,sizeof(gui_state.event_log_path),"%s%s",se_get_pref_path(),name);
+  gui_state.event_log_file = fopen(gui_state.event_log_path,"wb");
+  if(!gui_state.event_log_file){
+    printf("Failed to open %s\n",gui_state.event_log_path);
+    return false;
+  }
+  gui_state.event_log_records = 0;
+  gui_state.event_log_failed = !se_write_event_log_header();
+  se_join_emulation_thread();
+  gui_state.event_log = (sb_event_log_t*)calloc(1,sizeof(sb_event_log_t));
+  if(!gui_state.event_log){
+    fclose(gui_state.event_log_file);
+    gui_state.event_log_file = NULL;
+    return false;
+  }
+  for(int i=0;i<SB_EVENT_COUNT;++i)if(gui_state.event_log_types[i])gui_state.event_log->enabled|=1u<<i;
+  // Nothing selected records everything
+  if(!gui_state.event_log->enabled)gui_state.event_log->enabled = (1u<<SB_EVENT_COUNT)-1;
+  gui_instance.emu_state.event_log = gui_state.event_log;
+  return true;
+}
+static void se_stop_event_log(){
+  if(!gui_state.event_log)return;
+  se_join_emulation_thread();
+  gui_instance.emu_state.event_log = NULL;
+  job_pool_wait_async(SE_ASYNC_EVENT_LOG);
+  se_event_log_writer_job(NULL,0);
+  if(!se_write_event_log_header())gui_state.event_log_failed=true;
+  fclose(gui_state.event_log_file);
+  if(gui_state.event_log_failed)printf("Failed to write the event log %s\n",gui_state.event_log_path);
+  else printf("Saved %llu events (%llu dropped) to %s\n",(unsigned long long)gui_state.event_log_records,
+              (unsigned long long)gui_state.event_log->dropped,gui_state.event_log_path);
+  se_emscripten_flush_fs(gui_state.event_log_path);
+  free(gui_state.event_log);
+  gui_state.event_log = NULL;
+  gui_state.event_log_file = NULL;
+}
+static void se_poll_event_log(){
+  if(!gui_state.event_log||job_pool_async_busy(SE_ASYNC_EVENT_LOG))return;
+  if(gui_state.event_log->read_ptr==sb_atomic_load_acquire_u32(&gui_state.event_log->write_ptr))return;
+  job_pool_run_async(SE_ASYNC_EVENT_LOG,se_event_log_writer_job,NULL);
+}
+static void se_draw_event_log_controls(){
+  bool recording = gui_state.event_log!=NULL;
+  if(recording)se_push_disabled();
+  for(int i=0;i<SB_EVENT_COUNT;++i)se_checkbox(se_event_type_names[i],&gui_state.event_log_types[i]);
+  if(recording)se_pop_disabled();
+  if(se_button(recording?ICON_FK_STOP " Stop Event Log":ICON_FK_CIRCLE " Record Event Log",(ImVec2){0,0})){
+    if(recording)se_stop_event_log();
+    else se_start_event_log();
+  }
+  if(gui_state.event_log){
+    se_text("Recorded %llu events, %llu dropped",(unsigned long long)sb_atomic_load_relaxed_u64(&gui_state.event_log_records),
+            (unsigned long long)sb_atomic_load_relaxed_u64(&gui_state.event_log->dropped));
+  }else if(gui_state.event_log_path[0])se_text("Saved: %s",gui_state.event_log_path);
+  if(gui_instance.emu_state.system!=SYSTEM_NDS)se_text("Only the NDS core records events");
+}
+static void se_poll_trace_hotkey(){
+  static bool last_pressed = false;
+  const int* keys = gui_state.button_state;
+  bool ctrl = keys[SAPP_KEYCODE_LEFT_CONTROL]||keys[SAPP_KEYCODE_RIGHT_CONTROL];
+  bool shift = keys[SAPP_KEYCODE_LEFT_SHIFT]||keys[SAPP_KEYCODE_RIGHT_SHIFT];
+  bool pressed = ctrl&&shift&&keys[SAPP_KEYCODE_T];
+  if(pressed&&!last_pressed)se_toggle_trace();
+  last_pressed = pressed;
+}
+static void se_draw_profile(const sb_profile_t* p){
+  double per_frame = p->frames? 1.0/p->frames: 0;
+  se_text("Core: %.3f ms/frame",p->core_ns*per_frame*1e-6);
+#ifdef SE_ENABLE_PROFILER
+  se_text("CPU: %.3f ms/frame",se_profile_cpu_ns_per_frame(p)*1e-6);
+  for(int i=0;i<SB_PROFILE_COUNT;++i)se_text("%s: %.3f ms/frame",se_profile_names[i],p->ns[i]*per_frame*1e-6);
+  for(int i=0;i<SB_COUNTER_COUNT;++i)se_text("%s: %.0f/frame",se_counter_names[i],p->counters[i]*per_frame);
+#else
+  se_text("Build with ENABLE_PROFILER for a per subsystem breakdown");
+#endif
+}
+void se_draw_emu_stats(){
+  se_emulator_stats_t *stats = &gui_state.emu_stats;
+  double curr_time = se_time();
+  double fps_render = 1.0/(curr_time-stats->last_render_time);
+  stats->last_render_time=curr_time;
+  float render_min=1e9, render_max=0, render_avg=0; 
+  float emulate_min=1e9, emulate_max=0, emulate_avg=0; 
+  int render_data_points = 0; 
+  int emulate_data_points =0;
+
+  se_record_emulation_frame_stats(&gui_state.emu_stats,gui_instance.emu_state.frame);
+
+  for(int i=0;i<SE_STATS_GRAPH_DATA-1;++i){
+    stats->waveform_fps_render[i]=stats->waveform_fps_render[i+1];
+    if(stats->waveform_fps_render[i]>render_max)render_max=stats->waveform_fps_render[i];
+    if(stats->waveform_fps_render[i]<render_min)render_min=stats->waveform_fps_render[i];
+    if(fabs(stats->waveform_fps_render[i])>1.0){
+      render_avg+=1.0/stats->waveform_fps_render[i];
+      render_data_points++;
+    }
+    
+
+    if(stats->waveform_fps_emulation[i]>emulate_max)emulate_max=stats->waveform_fps_emulation[i];
+    if(stats->waveform_fps_emulation[i]<emulate_min)emulate_min=stats->waveform_fps_emulation[i];
+    if(fabs(stats->waveform_fps_emulation[i])>1.0){
+      emulate_avg+=1.0/fabs(stats->waveform_fps_emulation[i]);
+      ++emulate_data_points;
+    }
+  }
+  if(render_data_points<1)render_data_points=1;
+  if(emulate_data_points<1)emulate_data_points=1;
   render_avg/=render_data_points;
   render_avg=1.0/render_avg;
   emulate_avg/=emulate_data_points;
@@ -1734,10 +3437,17 @@ void se_draw_emu_stats(){
   if(stats->waveform_fps_emulation[SE_STATS_GRAPH_DATA-1]<0)emulate_avg*=-1;
 
   stats->waveform_fps_render[SE_STATS_GRAPH_DATA-1] = fps_render;
+  float pacing_min=0, pacing_max=0;
+  for(int i=0;i<SE_STATS_GRAPH_DATA-1;++i){
+    stats->waveform_pacing_error[i]=stats->waveform_pacing_error[i+1];
+    if(stats->waveform_pacing_error[i]<pacing_min)pacing_min=stats->waveform_pacing_error[i];
+    if(stats->waveform_pacing_error[i]>pacing_max)pacing_max=stats->waveform_pacing_error[i];
+  }
+  stats->waveform_pacing_error[SE_STATS_GRAPH_DATA-1] = gui_state.pacer.error_ms;
 
   for(int i=0;i<SE_STATS_GRAPH_DATA;++i){
-    float l = emu_state.audio_ring_buff.data[(emu_state.audio_ring_buff.write_ptr-i*2-2)%SB_AUDIO_RING_BUFFER_SIZE]/32768.;
-    float r = emu_state.audio_ring_buff.data[(emu_state.audio_ring_buff.write_ptr-i*2-1)%SB_AUDIO_RING_BUFFER_SIZE]/32768.;
+    float l = gui_instance.emu_state.audio_ring_buff.data[(gui_instance.emu_state.audio_ring_buff.write_ptr-i*2-2)%SB_AUDIO_RING_BUFFER_SIZE]/32768.;
+    float r = gui_instance.emu_state.audio_ring_buff.data[(gui_instance.emu_state.audio_ring_buff.write_ptr-i*2-1)%SB_AUDIO_RING_BUFFER_SIZE]/32768.;
     stats->waveform_l[i]=l;
     stats->waveform_r[i]=r;
   }
@@ -1750,6 +3460,27 @@ void se_draw_emu_stats(){
 
   snprintf(label_tmp,128,se_localize_and_cache("Emulation FPS: %2.1f\n"),emulate_avg);
   igPlotLinesFloatPtr("",stats->waveform_fps_emulation,SE_STATS_GRAPH_DATA,0,label_tmp,emulate_min,emulate_max*1.3,(ImVec2){content_width,80},4);
+
+  snprintf(label_tmp,128,se_localize_and_cache("Pacing Error: %2.2f ms\n"),gui_state.pacer.error_avg_ms);
+  igPlotLinesFloatPtr("",stats->waveform_pacing_error,SE_STATS_GRAPH_DATA,0,label_tmp,pacing_min*1.3-1,pacing_max*1.3+1,(ImVec2){content_width,80},4);
+  if(gui_state.pacer.display_period>0)se_text("Display Refresh: %2.2f Hz",1.0/gui_state.pacer.display_period);
+  if(se_pacer_locked())se_text("Frames per Refresh: %2.4f",gui_state.pacer.ratio);
+
+  se_section(ICON_FK_HOURGLASS_HALF " Frame Times");
+  se_draw_frame_stats();
+
+  if(gui_state.settings.perf_governor){
+    se_perf_governor_t* g = &gui_state.governor;
+    static const char* thermal_names[4]={"Nominal","Fair","Serious","Critical"};
+    se_section(ICON_FK_THERMOMETER_HALF " Performance Governor");
+    se_text("Level: %d/%d%s%s",g->level,SE_GOVERNOR_LEVELS-1,g->reason?" - ":"",g->reason?se_localize_and_cache(g->reason):"");
+    se_text("Emulation Load: %.0f%%",g->load*100);
+    se_text("Thermal State: %s%s",se_localize_and_cache(thermal_names[g->thermal&3]),g->low_power?se_localize_and_cache(" (Low Power Mode)"):"");
+    if(g->frame_skip)se_text("Frame Skip: %d",g->frame_skip);
+    se_text("Rewind Capture: every %d frames",g->rewind_interval);
+    se_text("Audio Resampler: %s",se_localize_and_cache(g->low_quality_audio?"Linear":"Windowed Sinc"));
+    if(g->min_nds_cpu_slice_cycles&&gui_state.settings.nds_cpu_slice==SE_NDS_CPU_SLICE_AUTO)se_text("NDS CPU Slice: at least %d cycles",g->min_nds_cpu_slice_cycles);
+  }
   
   se_section(ICON_FK_VOLUME_UP " Audio");
   igPlotLinesFloatPtr("",stats->waveform_l,SE_STATS_GRAPH_DATA,0,se_localize_and_cache("Left Audio Channel"),-1,1,(ImVec2){content_width,80},4);
@@ -1757,13 +3488,13 @@ void se_draw_emu_stats(){
   
   const char* null_names[] = {NULL};
   const char ** channel_names = null_names; 
-  if(emu_state.system == SYSTEM_GB){
+  if(gui_instance.emu_state.system == SYSTEM_GB){
     static const char* names[] ={"Channel 1 (Square)","Channel 2 (Square)","Channel 3 (Wave)","Channel 4 (Noise)",NULL};
     channel_names= names;
-  }else if(emu_state.system == SYSTEM_GBA){
+  }else if(gui_instance.emu_state.system == SYSTEM_GBA){
     static const char* names[] ={"Channel 1 (Square)","Channel 2 (Square)","Channel 3 (Wave)","Channel 4 (Noise)", "Channel A (FIFO)", "Channel B (FIFO)",NULL};
     channel_names= names;
-  }else if(emu_state.system == SYSTEM_NDS){
+  }else if(gui_instance.emu_state.system == SYSTEM_NDS){
     static const char* names[] ={
       "Channel 0","Channel 1","Channel 2","Channel 3",
       "Channel 4","Channel 5","Channel 6","Channel 7",
@@ -1776,14 +3507,26 @@ void se_draw_emu_stats(){
     if(!channel_names[i])break;
     se_text(channel_names[i]);
     igSameLine(content_width*0.42,0);
-    igProgressBar(emu_state.audio_channel_output[i],(ImVec2){content_width*0.6,0},"");
+    igProgressBar(gui_instance.emu_state.audio_channel_output[i],(ImVec2){content_width*0.6,0},"");
   }
-  float audio_buff_size = sb_ring_buffer_size(&emu_state.audio_ring_buff)/(float)SB_AUDIO_RING_BUFFER_SIZE;
-  snprintf(label_tmp,128,se_localize_and_cache("Audio Ring (Samples Available: %d)"),sb_ring_buffer_size(&emu_state.audio_ring_buff));
+  float audio_buff_size = sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff)/(float)SB_AUDIO_RING_BUFFER_SIZE;
+  snprintf(label_tmp,128,se_localize_and_cache("Audio Ring (Samples Available: %d)"),sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff));
   se_text(label_tmp);
   igProgressBar(audio_buff_size,(ImVec2){content_width,0},"");
   snprintf(label_tmp,128,se_localize_and_cache("Audio Watchdog Triggered %d Times"),gui_state.audio_watchdog_triggered);
   se_text(label_tmp);
+  double output_latency = se_audio_output_latency_ms();
+  if(output_latency>=0){
+    snprintf(label_tmp,128,se_localize_and_cache("Audio Output Latency: %.1f ms"),output_latency);
+    se_text(label_tmp);
+  }
+
+  se_section(ICON_FK_TACHOMETER " Profiler");
+  se_draw_profile(&gui_state.last_profile);
+  if(se_button(trace_active()?ICON_FK_STOP " Stop and Save Trace":ICON_FK_CIRCLE " Record Trace",(ImVec2){0,0}))se_toggle_trace();
+  if(trace_active())se_text("Recording... (Ctrl+Shift+T to stop)");
+  else if(gui_state.trace_path[0])se_text("Saved: %s",gui_state.trace_path);
+  se_draw_event_log_controls();
 
   se_section(ICON_FK_INFO_CIRCLE " Build Info");
   se_text("%s (%s)", se_get_host_platform(),se_get_host_arch());
@@ -1795,67 +3538,112 @@ void se_draw_emu_stats(){
 
 }
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
-uint32_t retro_achievements_read_memory_callback(uint32_t address, uint8_t* buffer, uint32_t num_bytes, rc_client_t* client){
-  if(emu_state.system==SYSTEM_GB){
-    if (address >= 0x00D000U && address <= 0x00DFFFU) {
-      // this region is always mapped to WRAM bank 1 (unlike during normal gbc operation)
-      uint8_t* wram = &core.gb.mem.wram[(SB_WRAM_BANK_SIZE * 1) + address - 0x00D000U];
-      for(int j=0;j<num_bytes;j++){
-        buffer[j]=wram[j];
-      }
-      return num_bytes;
-    } else if (address < 0x010000U) {
-      // these follow the normal gb memory map
-      for(int j=0;j<num_bytes;j++){
-        buffer[j]=sb_read8(&core.gb,address+j);
-      }
-      return num_bytes;
-    } else if (address <= 0x015FFFU) {
-      // 0x10000 - 0x15FFF is WRAM banks 2-7
-      uint8_t* wram = &core.gb.mem.wram[(SB_WRAM_BANK_SIZE * 2) + address - 0x010000U];
-      for(int j=0;j<num_bytes;j++){
-        buffer[j]=wram[j];
-      }
-      return num_bytes;
-    }
-    printf("GB address %08x not found\n",address);
-  }else if(emu_state.system==SYSTEM_GBA){
+// rcheevos address range, served straight from host memory when it isn't banked
+typedef struct{
+  uint32_t start;
+  uint32_t end; // Inclusive
+  uint8_t* host;
+  uint32_t bus_address; // Used through the core's read function when host is NULL
+}se_ra_memory_region_t;
+#define SE_RA_MAX_MEMORY_REGIONS 8
+static struct{
+  se_ra_memory_region_t region[SE_RA_MAX_MEMORY_REGIONS];
+  int num_regions;
+  int system;
+  int last_region;
+}se_ra_memory_map={.system=SYSTEM_UNKNOWN};
+static void se_ra_add_memory_region(uint32_t start, uint32_t end, uint8_t* host, uint32_t bus_address){
+  if(se_ra_memory_map.num_regions>=SE_RA_MAX_MEMORY_REGIONS)return;
+  se_ra_memory_map.region[se_ra_memory_map.num_regions++]=(se_ra_memory_region_t){start,end,host,bus_address};
+}
+static void se_ra_build_memory_map(){
+  se_ra_memory_map.num_regions=0;
+  se_ra_memory_map.last_region=0;
+  se_ra_memory_map.system=gui_instance.emu_state.system;
+  if(gui_instance.emu_state.system==SYSTEM_GB){
+    sb_gb_t* gb = &gui_instance.core.gb;
+    // ROM, VRAM and cart RAM are banked so they follow the normal memory map
+    se_ra_add_memory_region(0x000000U,0x00BFFFU,NULL,0x0000);
+    se_ra_add_memory_region(0x00C000U,0x00CFFFU,gb->mem.data+0xC000,0);
+    // this region is always mapped to WRAM bank 1 (unlike during normal gbc operation)
+    se_ra_add_memory_region(0x00D000U,0x00DFFFU,gb->mem.wram+SB_WRAM_BANK_SIZE*1,0);
+    se_ra_add_memory_region(0x00E000U,0x00FFFFU,NULL,0xE000);
+    // 0x10000 - 0x15FFF is WRAM banks 2-7
+    se_ra_add_memory_region(0x010000U,0x015FFFU,gb->mem.wram+SB_WRAM_BANK_SIZE*2,0);
+  }else if(gui_instance.emu_state.system==SYSTEM_GBA){
+    gba_t* gba = &gui_instance.core.gba;
     const rc_memory_regions_t* regions = rc_console_memory_regions(RC_CONSOLE_GAMEBOY_ADVANCE);
-    for (int i=0;i<regions->num_regions;i++) {
+    for(int i=0;i<regions->num_regions;i++){
       const rc_memory_region_t* region = &regions->region[i];
-      if (address >= 0x048000U && address <= 0x057FFFU) { // handle eeprom region specially
-        for (int j=0;j<num_bytes;j++){
-          buffer[j]=core.gba.mem.cart_backup[address-0x048000U+j];
-        }
-        return num_bytes;
-      } else if (address >= region->start_address && address <= region->end_address) {
-        for(int j=0;j<num_bytes;j++){
-          buffer[j]=gba_read8(&core.gba,region->real_address+(address-region->start_address)+j);
-        }
-        return num_bytes;
-      }
+      uint32_t size = region->end_address-region->start_address+1;
+      uint8_t* host = NULL;
+      if(region->real_address==0x02000000U&&size<=sizeof(gba->mem.wram0))host=gba->mem.wram0;
+      else if(region->real_address==0x03000000U&&size<=sizeof(gba->mem.wram1))host=gba->mem.wram1;
+      // Save RAM is read from the backup buffer since EEPROM isn't on the bus
+      else if(region->type==RC_MEMORY_TYPE_SAVE_RAM&&size<=sizeof(gba->mem.cart_backup))host=gba->mem.cart_backup;
+      se_ra_add_memory_region(region->start_address,region->end_address,host,region->real_address);
     }
-    printf("GBA address %08x not found\n",address);
-  }else if(emu_state.system==SYSTEM_NDS){
+  }else if(gui_instance.emu_state.system==SYSTEM_NDS){
+    nds_t* nds = &gui_instance.core.nds;
     const rc_memory_regions_t* regions = rc_console_memory_regions(RC_CONSOLE_NINTENDO_DS);
-    for (int i=0;i<regions->num_regions;i++) {
+    for(int i=0;i<regions->num_regions;i++){
       const rc_memory_region_t* region = &regions->region[i];
-      if (address >= region->start_address && address <= region->end_address) {
-        for(int j=0;j<num_bytes;j++){
-          buffer[j]=nds9_read8(&core.nds,region->real_address+(address-region->start_address)+j);
-        }
-        return num_bytes;
-      }
+      uint32_t size = region->end_address-region->start_address+1;
+      uint8_t* host = NULL;
+      if(region->real_address==0x02000000U&&size<=sizeof(nds->mem.ram))host=nds->mem.ram;
+      se_ra_add_memory_region(region->start_address,region->end_address,host,region->real_address);
     }
-    printf("NDS address %08x not found\n",address);
+  }
+}
+static uint8_t se_ra_bus_read8(uint32_t address){
+  switch(gui_instance.emu_state.system){
+    case SYSTEM_GB: return sb_read8(&gui_instance.core.gb,address);
+    case SYSTEM_GBA: return gba_read8(&gui_instance.core.gba,address);
+    case SYSTEM_NDS: return nds9_read8(&gui_instance.core.nds,address);
   }
   return 0;
 }
+uint32_t retro_achievements_read_memory_callback(uint32_t address, uint8_t* buffer, uint32_t num_bytes, rc_client_t* client){
+  if(se_ra_memory_map.system!=gui_instance.emu_state.system)se_ra_build_memory_map();
+  uint32_t read = 0;
+  while(read<num_bytes){
+    uint32_t addr = address+read;
+    // Conditions tend to hit the same region over and over
+    const se_ra_memory_region_t* region = se_ra_memory_map.region+se_ra_memory_map.last_region;
+    if(se_ra_memory_map.last_region>=se_ra_memory_map.num_regions||addr<region->start||addr>region->end){
+      region = NULL;
+      for(int i=0;i<se_ra_memory_map.num_regions;++i){
+        const se_ra_memory_region_t* r = se_ra_memory_map.region+i;
+        if(addr>=r->start&&addr<=r->end){region=r;se_ra_memory_map.last_region=i;break;}
+      }
+      if(!region){
+        if(read==0)printf("RetroAchievements address %08x not found\n",addr);
+        return read;
+      }
+    }
+    uint32_t chunk = SE_MIN_CONST(num_bytes-read,region->end-addr+1);
+    if(region->host)memcpy(buffer+read,region->host+(addr-region->start),chunk);
+    else for(uint32_t j=0;j<chunk;j++)buffer[read+j]=se_ra_bus_read8(region->bus_address+(addr-region->start)+j);
+    read+=chunk;
+  }
+  return read;
+}
+// Hashing reads the whole ROM, so it runs on SE_ASYNC_RA_HASH while the game already plays.
+// The ROM is only unloaded after job_pool_wait_async(SE_ASYNC_RA_HASH).
+static void se_ra_hash_job(void* user_data, int job_index){
+  if(!retro_achievements_hash_rom(gui_state.ra_hash))gui_state.ra_hash[0]='\0';
+}
+static void se_ra_start_hash(){
+  job_pool_wait_async(SE_ASYNC_RA_HASH);
+  gui_state.ra_hash[0]='\0';
+  gui_state.ra_hash_started = true;
+  if(gui_instance.emu_state.rom_loaded)job_pool_run_async(SE_ASYNC_RA_HASH,se_ra_hash_job,NULL);
+}
 #endif
 void se_psg_debugger(){
 
   // NOTE: GB and GBA framesequencer should each contain the same struct data
-  sb_frame_sequencer_t* seq = emu_state.system == SYSTEM_GB ? &core.gb.audio.sequencer : (sb_frame_sequencer_t*)&core.gba.audio.sequencer;
+  sb_frame_sequencer_t* seq = gui_instance.emu_state.system == SYSTEM_GB ? &gui_instance.core.gb.audio.sequencer : (sb_frame_sequencer_t*)&gui_instance.core.gba.audio.sequencer;
 
   for(int i=0;i<4;++i){
     se_section("Channel %d",i+1);
@@ -1884,16 +3672,473 @@ void se_psg_debugger(){
     }
   }
 }
-void se_draw_arm_state(const char* label, arm7_t *arm, emu_byte_read_t read){
+static void se_draw_watch_table(sb_watch_table_t* watch){
+  se_section(ICON_FK_BUG " Breakpoints");
+  const char* type_names[]={"Read","Write","Exec"};
+  if(watch->hit){
+    const char* type = watch->hit_type==SB_WATCH_EXEC? "Exec": watch->hit_type==SB_WATCH_WRITE? "Write": "Read";
+    se_text("Last hit: %s 0x%08x",type,watch->hit_address);
+  }
+  int remove = -1;
+  for(int i=0;i<watch->num_points;++i){
+    sb_watchpoint_t* p = watch->points+i;
+    igPushIDInt(i);
+    se_text("0x%08x-0x%08x %c%c%c",p->start,p->end,
+      (p->type&SB_WATCH_READ)?'R':'-',(p->type&SB_WATCH_WRITE)?'W':'-',(p->type&SB_WATCH_EXEC)?'X':'-');
+    igSameLine(igGetWindowWidth()-40,0);
+    if(se_button(ICON_FK_TRASH,(ImVec2){0,0}))remove=i;
+    igPopID();
+  }
+  sb_watch_remove(watch,remove);
+  int w = igGetWindowWidth();
+  igSetNextItemWidth((w-100)*0.5);
+  se_input_int("Start",&gui_state.new_watch_start,0,0,ImGuiInputTextFlags_CharsHexadecimal);
+  igSameLine(w*0.5,0);
+  igSetNextItemWidth(-50);
+  se_input_int("End",&gui_state.new_watch_end,0,0,ImGuiInputTextFlags_CharsHexadecimal);
+  for(int t=0;t<3;++t){
+    if(t)igSameLine(0,4);
+    se_checkbox(type_names[t],&gui_state.new_watch_type[t]);
+  }
+  igSameLine(0,4);
+  if(se_button(ICON_FK_PLUS " Add",(ImVec2){0,0})){
+    int type = 0;
+    for(int t=0;t<3;++t)if(gui_state.new_watch_type[t])type|=1<<t;
+    uint32_t start = gui_state.new_watch_start;
+    uint32_t end = gui_state.new_watch_end;
+    if(end<start)end=start;
+    if(!sb_watch_add(watch,start,end,type))printf("Failed to add breakpoint\n");
+  }
+}
+// Decoded instructions of the ARM debugger views. An entry is keyed by the address, mode and the
+// bytes it was decoded from, so code rewritten in memory misses like an invalidated entry.
+#define SE_DISASM_CACHE_SIZE 1024
+typedef struct{
+  uint32_t address;
+  uint32_t opcode;
+  uint8_t size; // 0 when empty
+  bool thumb;
+  char mnemonic[32];
+  char op_str[160];
+}se_disasm_entry_t;
+static const se_disasm_entry_t* se_disasm_arm(const uint8_t* data, size_t size, uint32_t address, bool thumb){
+  static se_disasm_entry_t cache[SE_DISASM_CACHE_SIZE];
+  static csh handles[2];
+  static cs_insn* insns[2];
+  uint32_t opcode = 0;
+  for(int i=0;i<4&&i<size;++i)opcode|=data[i]<<(i*8);
+  se_disasm_entry_t* e = cache+((address>>1)*2654435761u>>22)%SE_DISASM_CACHE_SIZE;
+  if(e->size&&e->address==address&&e->opcode==opcode&&e->thumb==thumb)return e;
+  e->address = address;
+  e->opcode = opcode;
+  e->thumb = thumb;
+  e->size = thumb? 2: 4;
+  snprintf(e->mnemonic,sizeof(e->mnemonic),"???");
+  e->op_str[0]='\0';
+  if(!insns[thumb]){
+    if(cs_open(CS_ARCH_ARM, thumb? CS_MODE_THUMB: CS_MODE_ARM, &handles[thumb]) != CS_ERR_OK)return e;
+    cs_option(handles[thumb], CS_OPT_SKIPDATA, CS_OPT_ON);
+    insns[thumb] = cs_malloc(handles[thumb]);
+    if(!insns[thumb])return e;
+  }
+  const uint8_t* code = data;
+  uint64_t addr = address;
+  if(cs_disasm_iter(handles[thumb],&code,&size,&addr,insns[thumb])){
+    cs_insn* insn = insns[thumb];
+    e->size = insn->size;
+    snprintf(e->mnemonic,sizeof(e->mnemonic),"%s",insn->mnemonic);
+    snprintf(e->op_str,sizeof(e->op_str),"%s",insn->op_str);
+  }
+  return e;
+}
+typedef struct{
+  uint32_t address; // Start of the symbol, or of the bucket without one
+  uint32_t count;
+  const se_symbol_t* symbol;
+}se_profile_entry_t;
+static int se_compare_profile_address(const void* a, const void* b){
+  uint32_t aa = ((const se_profile_entry_t*)a)->address, bb = ((const se_profile_entry_t*)b)->address;
+  return aa<bb? -1: aa>bb;
+}
+static int se_compare_profile_count(const void* a, const void* b){
+  uint32_t aa = ((const se_profile_entry_t*)a)->count, bb = ((const se_profile_entry_t*)b)->count;
+  return aa>bb? -1: aa<bb;
+}
+// Groups the buckets of a profile by function, hottest first. Returns the number of entries
+static int se_profile_functions(const sb_pc_profile_t* prof, se_profile_entry_t* entries){
+  int n = 0;
+  for(int i=0;i<SB_PC_PROFILE_SIZE;++i){
+    if(!prof->key[i])continue;
+    uint32_t addr = (prof->key[i]-1)<<SB_PC_PROFILE_BUCKET_SHIFT;
+    const se_symbol_t* sym = se_find_symbol(&gui_state.symbols,addr);
+    entries[n++]=(se_profile_entry_t){sym? sym->address: addr,prof->count[i],sym};
+  }
+  qsort(entries,n,sizeof(se_profile_entry_t),se_compare_profile_address);
+  int merged = 0;
+  for(int i=0;i<n;++i){
+    if(merged&&entries[merged-1].symbol&&entries[merged-1].symbol==entries[i].symbol)entries[merged-1].count+=entries[i].count;
+    else entries[merged++]=entries[i];
+  }
+  qsort(entries,merged,sizeof(se_profile_entry_t),se_compare_profile_count);
+  return merged;
+}
+static void se_profile_entry_name(const se_profile_entry_t* e, char* name, size_t size){
+  if(e->symbol)snprintf(name,size,"%s",e->symbol->name);
+  else snprintf(name,size,"0x%08x",e->address);
+}
+// Writes the folded stack format read by flamegraph.pl and speedscope. Samples only hold
+// the PC, so each stack is the CPU and the function it was in.
+static void se_export_pc_profile(const char* label, const sb_pc_profile_t* prof){
+  static se_profile_entry_t entries[SB_PC_PROFILE_SIZE];
+  char path[SB_FILE_PATH_SIZE];
+  snprintf(path,sizeof(path),"%s-%s.folded",gui_instance.emu_state.save_data_base_path,label);
+  FILE* f = fopen(path,"wb");
+  if(!f){
+    printf("Failed to write profile to %s\n",path);
+    return;
+  }
+  int n = se_profile_functions(prof,entries);
+  for(int i=0;i<n;++i){
+    char name[128];
+    se_profile_entry_name(entries+i,name,sizeof(name));
+    // Semicolons separate stack frames
+    for(char* c=name;*c;++c)if(*c==';'||*c==' ')*c='_';
+    fprintf(f,"%s;%s %u\n",label,name,entries[i].count);
+  }
+  fclose(f);
+  printf("Wrote profile to %s\n",path);
+}
+// Time travel debugging: while recording, the traced CPU logs the PC of every instruction and its
+// writes (see sb_exec_trace_t). Full chunks are varint delta encoded and deflated on
+// SE_ASYNC_EXEC_TRACE and the core is copied into a keyframe between frames every
+// SE_TIME_TRAVEL_KEYFRAME_INSTRUCTIONS. Going back restores the closest keyframe and steps the CPU
+// to the target instruction. Reverse continue finds its target by searching the trace, so it also
+// only needs that one replay. Only the history after the oldest keyframe is kept.
+#define SE_TIME_TRAVEL_KEYFRAME_INSTRUCTIONS (2*1024*1024)
+#define SE_TIME_TRAVEL_KEYFRAME_BUDGET (128*1024*1024)
+#define SE_TRACE_MAX_ENCODED_SIZE ((size_t)SB_EXEC_TRACE_CHUNK_INSTRUCTIONS*5+(size_t)SB_EXEC_TRACE_CHUNK_WRITES*(10+5+5+5))
+static uint8_t* se_put_varint(uint8_t* p, uint64_t v){
+  while(v>=0x80){*p++=(uint8_t)(v|0x80);v>>=7;}
+  *p++=(uint8_t)v;
+  return p;
+}
+static const uint8_t* se_get_varint(const uint8_t* p, const uint8_t* end, uint64_t* v){
+  uint64_t r = 0;
+  for(int shift=0;p<end&&shift<64;shift+=7){
+    uint8_t b = *p++;
+    r|=(uint64_t)(b&0x7f)<<shift;
+    if(!(b&0x80)){*v=r;return p;}
+  }
+  return NULL;
+}
+static uint32_t se_zigzag32(uint32_t delta){return (delta<<1)^(uint32_t)((int32_t)delta>>31);}
+static uint32_t se_unzigzag32(uint32_t v){return (v>>1)^(0u-(v&1));}
+static arm7_t* se_time_travel_arm(int cpu){
+  if(gui_instance.emu_state.system==SYSTEM_GBA)return cpu==0? &gui_instance.core.gba.cpu: NULL;
+  if(gui_instance.emu_state.system==SYSTEM_NDS)return cpu==NDS_ARM9? &gui_instance.core.nds.arm9: &gui_instance.core.nds.arm7;
+  return NULL;
+}
+static void se_time_travel_compress_job(void* user_data, int job_index){
+  se_time_travel_t* tt = (se_time_travel_t*)user_data;
+  sb_exec_trace_chunk_t* c = tt->compressing;
+  if(!c->num_instructions&&!c->num_writes)return;
+  uint8_t* p = tt->encode_buffer;
+  uint32_t prev = 0;
+  for(uint32_t i=0;i<c->num_instructions;++i){
+    p = se_put_varint(p,se_zigzag32(c->pc[i]-prev));
+    prev = c->pc[i];
+  }
+  uint64_t prev_instruction = c->first_instruction-1;
+  uint32_t prev_addr = 0;
+  for(uint32_t i=0;i<c->num_writes;++i){
+    sb_exec_trace_write_t* w = c->writes+i;
+    p = se_put_varint(p,w->instruction-prev_instruction);
+    p = se_put_varint(p,se_zigzag32(w->addr-prev_addr));
+    *p++ = (uint8_t)w->size;
+    p = se_put_varint(p,w->value);
+    prev_instruction = w->instruction;
+    prev_addr = w->addr;
+  }
+  mz_ulong raw_size = p-tt->encode_buffer;
+  mz_ulong size = mz_compressBound(raw_size);
+  se_trace_block_t block = {c->first_instruction,c->num_instructions,c->num_writes,(uint32_t)raw_size};
+  block.data = (uint8_t*)malloc(size);
+  if(tt->num_blocks==tt->block_capacity){
+    int capacity = tt->block_capacity? tt->block_capacity*2: 64;
+    se_trace_block_t* blocks = (se_trace_block_t*)realloc(tt->blocks,capacity*sizeof(se_trace_block_t));
+    if(blocks){
+      tt->blocks = blocks;
+      tt->block_capacity = capacity;
+    }
+  }
+  if(!block.data||tt->num_blocks==tt->block_capacity||
+     mz_compress2(block.data,&size,tt->encode_buffer,raw_size,MZ_BEST_SPEED)!=MZ_OK){
+    // The history can't be replayed past a hole, keep what is older than it
+    printf("Failed to compress the execution trace\n");
+    free(block.data);
+    return;
+  }
+  block.size = size;
+  tt->blocks[tt->num_blocks++] = block;
+  tt->compressed_bytes+=size;
+}
+static bool se_time_travel_decode_block(const se_trace_block_t* block, sb_exec_trace_chunk_t* c, uint8_t* buffer){
+  mz_ulong raw_size = block->raw_size;
+  if(mz_uncompress(buffer,&raw_size,block->data,block->size)!=MZ_OK||raw_size!=block->raw_size)return false;
+  const uint8_t* p = buffer;
+  const uint8_t* end = buffer+raw_size;
+  uint32_t prev = 0;
+  uint64_t v = 0;
+  c->first_instruction = block->first_instruction;
+  c->num_instructions = block->num_instructions;
+  c->num_writes = block->num_writes;
+  for(uint32_t i=0;i<c->num_instructions;++i){
+    if(!(p = se_get_varint(p,end,&v)))return false;
+    c->pc[i] = prev = prev+se_unzigzag32((uint32_t)v);
+  }
+  uint64_t prev_instruction = c->first_instruction-1;
+  uint32_t prev_addr = 0;
+  for(uint32_t i=0;i<c->num_writes;++i){
+    sb_exec_trace_write_t* w = c->writes+i;
+    if(!(p = se_get_varint(p,end,&v)))return false;
+    w->instruction = prev_instruction = prev_instruction+v;
+    if(!(p = se_get_varint(p,end,&v)))return false;
+    w->addr = prev_addr = prev_addr+se_unzigzag32((uint32_t)v);
+    if(p>=end)return false;
+    w->size = *p++;
+    if(!(p = se_get_varint(p,end,&v)))return false;
+    w->value = (uint32_t)v;
+  }
+  return true;
+}
+// Called by the core when the chunk being recorded is full
+static void se_time_travel_flush(sb_exec_trace_t* trace){
+  se_time_travel_t* tt = (se_time_travel_t*)trace->user_data;
+  job_pool_wait_async(SE_ASYNC_EXEC_TRACE);
+  tt->compressing = trace->chunk;
+  trace->chunk = tt->chunks[tt->chunks[0]==trace->chunk];
+  trace->chunk->first_instruction = trace->instructions;
+  trace->chunk->num_instructions = trace->chunk->num_writes = 0;
+  job_pool_run_async(SE_ASYNC_EXEC_TRACE,se_time_travel_compress_job,tt);
+}
+static void se_time_travel_drop_blocks_from(se_time_travel_t* tt, uint64_t instruction){
+  while(tt->num_blocks&&tt->blocks[tt->num_blocks-1].first_instruction>=instruction){
+    se_trace_block_t* b = tt->blocks+--tt->num_blocks;
+    tt->compressed_bytes-=b->size;
+    free(b->data);
+  }
+}
+static void se_time_travel_drop_oldest_keyframe(se_time_travel_t* tt){
+  free(tt->keyframes[0].core);
+  memmove(tt->keyframes,tt->keyframes+1,(tt->num_keyframes-1)*sizeof(se_trace_keyframe_t));
+  tt->num_keyframes--;
+  uint64_t start = tt->num_keyframes? tt->keyframes[0].instruction: tt->trace.instructions;
+  int drop = 0;
+  while(drop<tt->num_blocks&&tt->blocks[drop].first_instruction<start){
+    tt->compressed_bytes-=tt->blocks[drop].size;
+    free(tt->blocks[drop++].data);
+  }
+  memmove(tt->blocks,tt->blocks+drop,(tt->num_blocks-drop)*sizeof(se_trace_block_t));
+  tt->num_blocks-=drop;
+}
+static void se_time_travel_stop(){
+  se_time_travel_t* tt = &gui_state.time_travel;
+  job_pool_wait_async(SE_ASYNC_EXEC_TRACE);
+  while(tt->num_keyframes)se_time_travel_drop_oldest_keyframe(tt);
+  se_time_travel_drop_blocks_from(tt,0);
+  free(tt->blocks);
+  free(tt->chunks[0]);
+  free(tt->chunks[1]);
+  free(tt->encode_buffer);
+  memset(tt,0,sizeof(*tt));
+}
+static void se_time_travel_save_registers(se_time_travel_t* tt){
+  arm7_t* arm = se_time_travel_arm(tt->cpu);
+  if(arm)memcpy(tt->last_registers,arm->registers,sizeof(tt->last_registers));
+}
+// Flushes the partial chunk so the trace blocks start at keyframes
+static void se_time_travel_push_keyframe(se_time_travel_t* tt){
+  size_t core_size = se_get_core_size();
+  int max_keyframes = SE_TIME_TRAVEL_KEYFRAME_BUDGET/core_size;
+  if(max_keyframes>SE_TIME_TRAVEL_MAX_KEYFRAMES)max_keyframes = SE_TIME_TRAVEL_MAX_KEYFRAMES;
+  if(max_keyframes<2)max_keyframes = 2;
+  if(tt->trace.chunk->num_instructions)se_time_travel_flush(&tt->trace);
+  job_pool_wait_async(SE_ASYNC_EXEC_TRACE);
+  while(tt->num_keyframes>=max_keyframes)se_time_travel_drop_oldest_keyframe(tt);
+  uint8_t* core = (uint8_t*)malloc(core_size);
+  if(!core)return;
+  memcpy(core,&gui_instance.core,core_size);
+  tt->keyframes[tt->num_keyframes++]=(se_trace_keyframe_t){tt->trace.instructions,core};
+}
+static bool se_time_travel_start(int cpu){
+  se_time_travel_stop();
+  se_time_travel_t* tt = &gui_state.time_travel;
+  if(!se_time_travel_arm(cpu))return false;
+  tt->chunks[0] = (sb_exec_trace_chunk_t*)calloc(1,sizeof(sb_exec_trace_chunk_t));
+  tt->chunks[1] = (sb_exec_trace_chunk_t*)calloc(1,sizeof(sb_exec_trace_chunk_t));
+  tt->encode_buffer = (uint8_t*)malloc(SE_TRACE_MAX_ENCODED_SIZE);
+  if(!tt->chunks[0]||!tt->chunks[1]||!tt->encode_buffer){
+    se_time_travel_stop();
+    return false;
+  }
+  tt->recording = true;
+  tt->cpu = cpu;
+  tt->trace.chunk = tt->chunks[0];
+  tt->trace.flush = se_time_travel_flush;
+  tt->trace.user_data = tt;
+  se_time_travel_push_keyframe(tt);
+  se_time_travel_save_registers(tt);
+  return tt->num_keyframes>0;
+}
+static void se_time_travel_begin_frame(){
+  se_time_travel_t* tt = &gui_state.time_travel;
+  gui_instance.emu_state.exec_trace[0] = gui_instance.emu_state.exec_trace[1] = NULL;
+  if(!tt->recording)return;
+  arm7_t* arm = se_time_travel_arm(tt->cpu);
+  // Loading a state, rewinding, resets and register edits all break the recorded history
+  if(!arm||memcmp(tt->last_registers,arm->registers,sizeof(tt->last_registers))){
+    int cpu = tt->cpu;
+    if(!se_time_travel_start(cpu))return;
+  }
+  gui_instance.emu_state.exec_trace[tt->cpu] = &tt->trace;
+}
+static void se_time_travel_end_frame(){
+  se_time_travel_t* tt = &gui_state.time_travel;
+  gui_instance.emu_state.exec_trace[0] = gui_instance.emu_state.exec_trace[1] = NULL;
+  if(!tt->recording)return;
+  if(tt->replaying&&gui_instance.emu_state.run_mode==SB_MODE_PAUSE){
+    tt->replaying = false;
+    if(tt->trace.instructions!=tt->replay_target){
+      printf("Time travel stopped at instruction %llu instead of %llu\n",(unsigned long long)tt->trace.instructions,(unsigned long long)tt->replay_target);
+    }
+  }
+  uint64_t last = tt->num_keyframes? tt->keyframes[tt->num_keyframes-1].instruction: 0;
+  if(!tt->num_keyframes||tt->trace.instructions-last>=SE_TIME_TRAVEL_KEYFRAME_INSTRUCTIONS)se_time_travel_push_keyframe(tt);
+  se_time_travel_save_registers(tt);
+}
+static uint64_t se_time_travel_oldest(se_time_travel_t* tt){
+  return tt->num_keyframes? tt->keyframes[0].instruction: tt->trace.instructions;
+}
+// Restores the closest keyframe and lets the traced CPU run up to target instructions
+static bool se_time_travel_seek(uint64_t target){
+  se_time_travel_t* tt = &gui_state.time_travel;
+  se_join_emulation_thread();
+  job_pool_wait_async(SE_ASYNC_EXEC_TRACE);
+  int k = tt->num_keyframes-1;
+  while(k>=0&&tt->keyframes[k].instruction>target)--k;
+  if(k<0)return false;
+  se_trace_keyframe_t* kf = tt->keyframes+k;
+  memcpy(&gui_instance.core,kf->core,se_get_core_size());
+  // The replay records the same history again
+  while(tt->num_keyframes>k+1)free(tt->keyframes[--tt->num_keyframes].core);
+  se_time_travel_drop_blocks_from(tt,kf->instruction);
+  tt->trace.instructions = kf->instruction;
+  tt->trace.chunk->first_instruction = kf->instruction;
+  tt->trace.chunk->num_instructions = tt->trace.chunk->num_writes = 0;
+  arm7_t* arm = se_time_travel_arm(tt->cpu);
+  se_time_travel_save_registers(tt);
+  se_movie_stop();
+  se_spectate_discontinuity();
+  gui_instance.emu_state.run_mode = SB_MODE_PAUSE;
+  if(target>kf->instruction){
+    arm->step_instructions = target-kf->instruction;
+    tt->replaying = true;
+    tt->replay_target = target;
+    gui_instance.emu_state.run_mode = SB_MODE_RUN;
+  }
+  return true;
+}
+// Returns the latest position before now where the CPU stops on a breakpoint (before executing it)
+// or on a write watchpoint (after the write), or the start of the history
+static uint64_t se_time_travel_find_reverse_stop(se_time_travel_t* tt, sb_watch_table_t* watch){
+  uint64_t now = tt->trace.instructions;
+  uint64_t oldest = se_time_travel_oldest(tt);
+  if(!watch->num_points)return oldest;
+  // The chunk that isn't being recorded is free once the compression job is done
+  sb_exec_trace_chunk_t* decoded = tt->chunks[tt->chunks[0]==tt->trace.chunk];
+  sb_exec_trace_chunk_t* c = NULL;
+  uint8_t* buffer = tt->encode_buffer;
+  for(int b=tt->num_blocks;b>=0;--b){
+    if(b==tt->num_blocks)c = tt->trace.chunk;
+    else{
+      c = decoded;
+      if(!se_time_travel_decode_block(tt->blocks+b,c,buffer)){
+        printf("Failed to decode the execution trace\n");
+        return oldest;
+      }
+    }
+    int w = (int)c->num_writes-1;
+    for(int64_t i=(int64_t)c->num_instructions-1;i>=-1;--i){
+      uint64_t instruction = c->first_instruction+i;
+      for(;w>=0&&c->writes[w].instruction>=instruction;--w){
+        sb_exec_trace_write_t* wr = c->writes+w;
+        if(wr->instruction+1<now&&wr->instruction>=oldest&&sb_watch_find(watch,wr->addr,wr->size,SB_WATCH_WRITE)>=0)return wr->instruction+1;
+      }
+      if(i>=0&&instruction<now&&instruction>=oldest&&sb_watch_find(watch,c->pc[i],1,SB_WATCH_EXEC)>=0)return instruction;
+    }
+  }
+  return oldest;
+}
+static void se_time_travel_reverse_continue(){
+  se_time_travel_t* tt = &gui_state.time_travel;
+  se_join_emulation_thread();
+  job_pool_wait_async(SE_ASYNC_EXEC_TRACE);
+  se_time_travel_seek(se_time_travel_find_reverse_stop(tt,gui_state.cpu_watch+tt->cpu));
+}
+static void se_draw_time_travel(int cpu){
+  se_time_travel_t* tt = &gui_state.time_travel;
+  se_section(ICON_FK_HISTORY " Time Travel");
+  bool recording = tt->recording&&tt->cpu==cpu;
+  if(se_checkbox("Record Execution",&recording)){
+    se_join_emulation_thread();
+    if(recording)se_time_travel_start(cpu);
+    else se_time_travel_stop();
+  }
+  if(!tt->recording||tt->cpu!=cpu)return;
+  uint64_t oldest = se_time_travel_oldest(tt);
+  bool paused = gui_instance.emu_state.run_mode==SB_MODE_PAUSE;
+  if(!paused||tt->trace.instructions<=oldest)se_push_disabled();
+  if(se_button(ICON_FK_STEP_BACKWARD " Step Back",(ImVec2){0,0})&&paused&&tt->trace.instructions>oldest)se_time_travel_seek(tt->trace.instructions-1);
+  igSameLine(0,4);
+  if(se_button(ICON_FK_BACKWARD " Reverse Continue",(ImVec2){0,0})&&paused&&tt->trace.instructions>oldest)se_time_travel_reverse_continue();
+  if(!paused||tt->trace.instructions<=oldest)se_pop_disabled();
+  se_text("History: %llu instructions, %d keyframes, %.1f MB trace",(unsigned long long)(tt->trace.instructions-oldest),
+          tt->num_keyframes,tt->compressed_bytes/(1024.0*1024.0));
+  if(tt->replaying)se_text("Replaying to instruction %llu",(unsigned long long)tt->replay_target);
+}
+static void se_draw_pc_profile(const char* label, int cpu){
+  static se_profile_entry_t entries[SB_PC_PROFILE_SIZE];
+  sb_pc_profile_t* prof = gui_state.pc_profile+cpu;
+  se_section(ICON_FK_AREA_CHART " Profiler");
+  se_checkbox("Sample PC",&gui_state.pc_profile_enabled[cpu]);
+  igSameLine(0,4);
+  if(se_button("Reset",(ImVec2){0,0}))memset(prof,0,sizeof(*prof));
+  igSameLine(0,4);
+  if(se_button("Export",(ImVec2){0,0}))se_export_pc_profile(label,prof);
+  se_text("Samples: %llu Symbols: %d",(unsigned long long)prof->samples,gui_state.symbols.num_symbols);
+  if(prof->dropped)se_text("Dropped: %llu",(unsigned long long)prof->dropped);
+  if(!prof->samples)return;
+  int n = se_profile_functions(prof,entries);
+  igBeginChildStr(("##Profile"),(ImVec2){0,200},true,ImGuiWindowFlags_None);
+  for(int i=0;i<n&&i<64;++i){
+    char name[128];
+    se_profile_entry_name(entries+i,name,sizeof(name));
+    se_text("%5.1f%%",entries[i].count*100.0/prof->samples);
+    igSameLine(60,0);
+    se_text("%s",name);
+  }
+  igEndChild();
+}
+void se_draw_arm_state(const char* label, arm7_t *arm, emu_byte_read_t read, int cpu){
   const char* reg_names[]={"R0","R1","R2","R3","R4","R5","R6","R7","R8","R9 (SB)","R10 (SL)","R11 (FP)","R12 (IP)","R13 (SP)","R14 (LR)","R15 (" ICON_FK_BUG ")","CPSR","SPSR",NULL}; // NOLINT
   if(se_button("Step Instruction",(ImVec2){0,0})){
     arm->step_instructions=1;
-    emu_state.run_mode= SB_MODE_RUN;
+    gui_instance.emu_state.run_mode= SB_MODE_RUN;
   }
   igSameLine(0,4);
   if(se_button("Step Frame",(ImVec2){0,0})){
-    emu_state.step_frames=1;
-    emu_state.run_mode=SB_MODE_STEP;
+    gui_instance.emu_state.step_frames=1;
+    gui_instance.emu_state.run_mode=SB_MODE_STEP;
   }
   if(arm->log_cmp_file){
     igSameLine(0,0);
@@ -1946,40 +4191,38 @@ void se_draw_arm_state(const char* label, arm7_t *arm, emu_byte_read_t read){
   if(pc<off)off=pc;
   for(int i=0;i<buffer_size;++i)buffer[i]=read(pc-off+i);
   se_section(ICON_FK_LIST_OL " Disassembly");
-  csh handle;
-  if (cs_open(CS_ARCH_ARM, thumb? CS_MODE_THUMB: CS_MODE_ARM, &handle) == CS_ERR_OK){
-    cs_option(handle, CS_OPT_SKIPDATA, CS_OPT_ON);
-    cs_insn *insn;
-    int count = cs_disasm(handle, buffer, buffer_size, pc-off, 0, &insn);
-    size_t j;
-    for (j = 0; j < count; j++) {      
-      if(insn[j].address==pc){
-        igPushStyleColorVec4(ImGuiCol_Text, (ImVec4){1.f, 0.f, 0.f, 1.f});
-        se_text("PC" ICON_FK_ARROW_RIGHT);
-      }else se_text("");
-      ImVec4 text_color = *igGetStyleColorVec4(ImGuiCol_Text);
-      text_color.w*=0.5;
-      igPushStyleColorVec4(ImGuiCol_Text, text_color);
-      igSameLine(32,0);
-      se_text("0x%08x:", (int)insn[j].address);
-      igPopStyleColor(1);
-      igSameLine(102,0);
-      se_text(insn[j].mnemonic);
-      igSameLine(150,0);
-      text_color = *igGetStyleColorVec4(ImGuiCol_Text);
-      float ratio = 0.3; 
-      text_color.x*=1.0-ratio;
-      text_color.y*=1.0-ratio;
-      text_color.z*=1.0-ratio;
-      text_color.z+=ratio;
-      if(text_color.z<ratio*2)text_color.z+=ratio;
-      igPushStyleColorVec4(ImGuiCol_Text, text_color);
-      se_text(insn[j].op_str);
-      igPopStyleColor(1);
-      if(insn[j].address==pc)igPopStyleColor(1);
-    }  
+  for(int i=0;i<buffer_size;){
+    const se_disasm_entry_t* insn = se_disasm_arm(buffer+i,buffer_size-i,pc-off+i,thumb);
+    i+=insn->size;
+    if(insn->address==pc){
+      igPushStyleColorVec4(ImGuiCol_Text, (ImVec4){1.f, 0.f, 0.f, 1.f});
+      se_text("PC" ICON_FK_ARROW_RIGHT);
+    }else se_text("");
+    ImVec4 text_color = *igGetStyleColorVec4(ImGuiCol_Text);
+    text_color.w*=0.5;
+    igPushStyleColorVec4(ImGuiCol_Text, text_color);
+    igSameLine(32,0);
+    se_text("0x%08x:", (int)insn->address);
+    igPopStyleColor(1);
+    igSameLine(102,0);
+    se_text("%s",insn->mnemonic);
+    igSameLine(150,0);
+    text_color = *igGetStyleColorVec4(ImGuiCol_Text);
+    float ratio = 0.3; 
+    text_color.x*=1.0-ratio;
+    text_color.y*=1.0-ratio;
+    text_color.z*=1.0-ratio;
+    text_color.z+=ratio;
+    if(text_color.z<ratio*2)text_color.z+=ratio;
+    igPushStyleColorVec4(ImGuiCol_Text, text_color);
+    se_text("%s",insn->op_str);
+    igPopStyleColor(1);
+    if(insn->address==pc)igPopStyleColor(1);
   }
-  bool clear_step_data = emu_state.run_mode!=SB_MODE_PAUSE;
+  se_draw_watch_table(gui_state.cpu_watch+cpu);
+  se_draw_time_travel(cpu);
+  se_draw_pc_profile(label,cpu);
+  bool clear_step_data = gui_instance.emu_state.run_mode!=SB_MODE_PAUSE;
   se_section(ICON_FK_RANDOM " Last Branch Locations");
   igBeginChildStr(("##BranchLoc"),(ImVec2){0,150},true,ImGuiWindowFlags_None);
   for(int i=0;i<ARM_DEBUG_BRANCH_RING_SIZE&&i<arm->debug_branch_ring_offset;++i){
@@ -2007,16 +4250,16 @@ void se_draw_arm_state(const char* label, arm7_t *arm, emu_byte_read_t read){
 }
 
 void gb_cpu_debugger(){
-  sb_gb_t* gb = &core.gb;
+  sb_gb_t* gb = &gui_instance.core.gb;
   sb_gb_cpu_t *cpu_state = &gb->cpu;
   if(se_button("Step Instruction",(ImVec2){0,0})){
-    emu_state.step_instructions=1;
-    emu_state.run_mode= SB_MODE_STEP;
+    gui_instance.emu_state.step_instructions=1;
+    gui_instance.emu_state.run_mode= SB_MODE_STEP;
   }
   igSameLine(0,4);
   if(se_button("Step Frame",(ImVec2){0,0})){
-    emu_state.step_frames=1;
-    emu_state.run_mode=SB_MODE_STEP;
+    gui_instance.emu_state.step_frames=1;
+    gui_instance.emu_state.run_mode=SB_MODE_STEP;
   }
   
 
@@ -2135,7 +4378,7 @@ void se_draw_mem_debug_state(const char* label, gui_state_t* gui, emu_byte_read_
     uint8_t *data = (uint8_t*)malloc(gui->mem_dump_size);
     for(int i=0;i<gui->mem_dump_size;++i)data[i]=(*read)(gui->mem_dump_start_address+i);
     const char *base, *file_name,*ext;
-    sb_breakup_path(emu_state.save_file_path,&base,&file_name,&ext);
+    sb_breakup_path(gui_instance.emu_state.save_file_path,&base,&file_name,&ext);
     char new_path[SB_FILE_PATH_SIZE];
     snprintf(new_path,SB_FILE_PATH_SIZE,"%s/%s-memdump.bin",base,file_name);
     sb_save_file_data(new_path,data,gui->mem_dump_size);
@@ -2143,22 +4386,83 @@ void se_draw_mem_debug_state(const char* label, gui_state_t* gui, emu_byte_read_
   }
 
 }
+// The GB tile viewers keep their images between frames. A tile is decoded again only when its
+// bytes in VRAM change and a map cell is redrawn only when its entry, its tile or the palettes
+// change, so an idle viewer costs a comparison of VRAM against the last copy and no upload.
+#define SE_GB_TILES_PER_BANK 384
+#define SE_GB_TILE_MAP_IMAGE_SIZE (32*(8+2))
+#define SE_GB_TILE_DATA_IMAGE_W (16*(8+2))
+#define SE_GB_TILE_DATA_IMAGE_H (SE_GB_TILES_PER_BANK/16*(8+2))
+typedef struct{
+  uint8_t vram[SB_VRAM_NUM_BANKS*SB_VRAM_BANK_SIZE]; // Copy of the tile data the rows were decoded from
+  uint64_t rows[SB_VRAM_NUM_BANKS][SE_GB_TILES_PER_BANK][8]; // Color ids, see sb_decode_tile_row
+  uint32_t versions[SB_VRAM_NUM_BANKS][SE_GB_TILES_PER_BANK]; // Bumped when a tile is decoded, 0 until then
+  uint8_t rgb[64][3];
+  uint32_t palette_version;
+  // Entry, tile version and palette version each image part was drawn with
+  uint32_t map_keys[2][32*32];
+  uint32_t map_versions[2][32*32];
+  uint32_t map_palette_version[2];
+  uint32_t data_versions[SB_VRAM_NUM_BANKS][SE_GB_TILES_PER_BANK];
+  uint8_t map_image[2][SE_GB_TILE_MAP_IMAGE_SIZE*SE_GB_TILE_MAP_IMAGE_SIZE*4];
+  uint8_t data_image[SB_VRAM_NUM_BANKS][SE_GB_TILE_DATA_IMAGE_W*SE_GB_TILE_DATA_IMAGE_H*4];
+  bool images_cleared;
+}se_gb_tile_cache_t;
+static se_gb_tile_cache_t se_gb_tile_cache;
+static void se_gb_update_tile_cache(sb_gb_t* gb){
+  se_gb_tile_cache_t* c = &se_gb_tile_cache;
+  if(!c->images_cleared){
+    // Opaque black between the tiles
+    memset(c->map_image,0,sizeof(c->map_image));
+    memset(c->data_image,0,sizeof(c->data_image));
+    for(size_t i=3;i<sizeof(c->map_image);i+=4)((uint8_t*)c->map_image)[i]=0xff;
+    for(size_t i=3;i<sizeof(c->data_image);i+=4)((uint8_t*)c->data_image)[i]=0xff;
+    c->images_cleared = true;
+  }
+  for(int bank=0;bank<SB_VRAM_NUM_BANKS;++bank){
+    for(int t=0;t<SE_GB_TILES_PER_BANK;++t){
+      const uint8_t* data = gb->lcd.vram+bank*SB_VRAM_BANK_SIZE+t*16;
+      uint8_t* copy = c->vram+bank*SB_VRAM_BANK_SIZE+t*16;
+      if(c->versions[bank][t]&&memcmp(copy,data,16)==0)continue;
+      memcpy(copy,data,16);
+      for(int py=0;py<8;++py)c->rows[bank][t][py]=sb_decode_tile_row(data[py*2],data[py*2+1],false);
+      if(!++c->versions[bank][t])c->versions[bank][t]=1;
+    }
+  }
+  uint8_t rgb[64][3];
+  for(int i=0;i<64;++i){
+    int r=0,g=0,b=0;
+    sb_lookup_palette_color(gb,i,&r,&g,&b);
+    rgb[i][0]=r; rgb[i][1]=g; rgb[i][2]=b;
+  }
+  if(!c->palette_version||memcmp(rgb,c->rgb,sizeof(rgb))){
+    memcpy(c->rgb,rgb,sizeof(rgb));
+    if(!++c->palette_version)c->palette_version=1;
+  }
+}
+// Position of a tile map pixel in the tile map image, works for pixels wrapped to -256
+static int se_gb_tile_map_image_pos(int v){
+  v+=256;
+  return (v/8)*10+v%8+1-320;
+}
 void gb_tile_map_debugger(){
-  sb_gb_t *gb = &core.gb;
-  static uint8_t tmp_image[512*512*3];
+  sb_gb_t *gb = &gui_instance.core.gb;
+  se_gb_tile_cache_t* c = &se_gb_tile_cache;
+  se_gb_update_tile_cache(gb);
 
   uint8_t ctrl = sb_read8_direct(gb, SB_IO_LCD_CTRL);
   int bg_tile_map_base      = SB_BFE(ctrl,3,1)==1 ? 0x9c00 : 0x9800;
   int bg_win_tile_data_mode = SB_BFE(ctrl,4,1)==1;
   int win_tile_map_base      = SB_BFE(ctrl,6,1)==1 ? 0x9c00 : 0x9800;
+  bool gbc = sb_gbc_enable(gb);
 
   ImVec2 win;
   igGetWindowPos(&win);
 
   // Draw Tilemaps
   for(int tile_map = 0;tile_map<2;++tile_map){
-    int image_height = 32*(8+2);
-    int image_width =  32*(8+2);
+    int image_height = SE_GB_TILE_MAP_IMAGE_SIZE;
+    int image_width =  SE_GB_TILE_MAP_IMAGE_SIZE;
     float scale = igGetWindowContentRegionWidth()/image_width; 
 
     int wx = sb_read8_direct(gb, SB_IO_LCD_WX)-7;
@@ -2177,32 +4481,55 @@ void gb_tile_map_debugger(){
     int w = image_width*scale;
     int h = image_height*scale;
     int scanline = tile_map==0 ? gb->lcd.curr_scanline +sy : gb->lcd.curr_window_scanline;
-    for(int yt = 0; yt<32;++yt)
-      for(int xt = 0; xt<32;++xt)
-        for(int py = 0;py<8;++py)
-          for(int px = 0;px<8;++px){
-            int x = xt*8+px;
-            int y = yt*8+py;
-            int color_id = sb_lookup_tile(gb,x,y,tile_map_base,bg_win_tile_data_mode);
-            int p = (xt*10+(px)+1)+(yt*10+py+1)*image_width;
-            int r=0,g=0,b=0;
-            sb_lookup_palette_color(gb,color_id,&r,&g,&b);
-            if(((x==(box_x1%256)||x==(box_x2%256)) && (((y-box_y1)&0xff)>=0 && ((box_y2-y)&0xff) <=box_y2-box_y1))||
-               ((y==(box_y1%256)||y==(box_y2%256)) && (((x-box_x1)&0xff)>=0 && ((box_x2-x)&0xff) <=box_x2-box_x1))){
-               r=255; g=b=0;
-            }
-            if(y == (scanline&0xff) &&(((x-box_x1)&0xff)>=0 && (((x-box_x1)&0xff)>=0 && ((box_x2-x)&0xff) <=box_x2-box_x1))){
-              b = 255;  r=g=0;
-            }
-            tmp_image[p*3+0]=r;
-            tmp_image[p*3+1]=g;
-            tmp_image[p*3+2]=b;
-          }
+    uint8_t* image = c->map_image[tile_map];
+    bool palette_changed = c->map_palette_version[tile_map]!=c->palette_version;
+    c->map_palette_version[tile_map] = c->palette_version;
+    for(int cell=0;cell<32*32;++cell){
+      int map_off = tile_map_base-0x8000+cell;
+      int tile_id = gb->lcd.vram[map_off];
+      int attr = gbc? gb->lcd.vram[SB_VRAM_BANK_SIZE+map_off]: 0;
+      int bank = SB_BFE(attr,3,1);
+      int tile = bg_win_tile_data_mode? tile_id: 256+(int8_t)tile_id;
+      uint32_t key = tile_id|attr<<8|bg_win_tile_data_mode<<16|gbc<<17;
+      uint32_t version = c->versions[bank][tile];
+      if(!palette_changed&&c->map_keys[tile_map][cell]==key&&c->map_versions[tile_map][cell]==version)continue;
+      c->map_keys[tile_map][cell] = key;
+      c->map_versions[tile_map][cell] = version;
+      bool v_flip = SB_BFE(attr,6,1);
+      bool h_flip = SB_BFE(attr,5,1);
+      int palette = gbc? SB_BFE(attr,0,3): SB_BACKG_PALETTE;
+      int xt = cell%32, yt = cell/32;
+      for(int py = 0;py<8;++py){
+        uint64_t row = c->rows[bank][tile][v_flip? 7-py: py];
+        uint8_t* p = image+((xt*10+1)+(yt*10+py+1)*image_width)*4;
+        for(int px = 0;px<8;++px,p+=4){
+          int color_id = ((row>>((h_flip? 7-px: px)*8))&0x3)|palette<<2;
+          p[0]=c->rgb[color_id][0];
+          p[1]=c->rgb[color_id][1];
+          p[2]=c->rgb[color_id][2];
+        }
+      }
+    }
 
-    se_draw_image(tmp_image,image_width,image_height, x*se_dpi_scale(), y*se_dpi_scale(), w*se_dpi_scale(),h*se_dpi_scale(), false);
+    se_draw_image(image,image_width,image_height, x*se_dpi_scale(), y*se_dpi_scale(), w*se_dpi_scale(),h*se_dpi_scale(), true);
+    // The viewport and scanline are drawn on top so the image only changes with VRAM. Both wrap
+    // around the map, drawing them again 256 pixels up and left covers the wrapped parts.
+    ImDrawList* dl = igGetWindowDrawList();
+    ImDrawList_PushClipRect(dl,(ImVec2){x,y},(ImVec2){x+w,y+h},true);
+    for(int oy=0;oy>=-256;oy-=256)
+      for(int ox=0;ox>=-256;ox-=256){
+        float x1 = x+se_gb_tile_map_image_pos((box_x1&0xff)+ox)*scale;
+        float x2 = x+(se_gb_tile_map_image_pos((box_x1&0xff)+(box_x2-box_x1)+ox)+1)*scale;
+        float y1 = y+se_gb_tile_map_image_pos((box_y1&0xff)+oy)*scale;
+        float y2 = y+(se_gb_tile_map_image_pos((box_y1&0xff)+(box_y2-box_y1)+oy)+1)*scale;
+        ImDrawList_AddRect(dl,(ImVec2){x1,y1},(ImVec2){x2,y2},0xff0000ff,0,ImDrawCornerFlags_None,scale);
+        if(oy)continue;
+        float sl = y+se_gb_tile_map_image_pos(scanline&0xff)*scale;
+        ImDrawList_AddRectFilled(dl,(ImVec2){x1,sl},(ImVec2){x2,sl+scale},0xffff0000,0,ImDrawCornerFlags_None);
+      }
+    ImDrawList_PopClipRect(dl);
     igDummy((ImVec2){w,h});
     
-    const char * name = tile_map == 0  ? "Background" : "Window";
     ImVec2 mouse_pos = {gui_state.mouse_pos[0]/se_dpi_scale(),gui_state.mouse_pos[1]/se_dpi_scale()};
     mouse_pos.x-=x;
     mouse_pos.y-=y;
@@ -2218,22 +4545,18 @@ void gb_tile_map_debugger(){
   }
 }
 void gb_tile_data_debugger(){
-  sb_gb_t *gb= &core.gb;
-  static uint8_t tmp_image[512*512*3];
+  sb_gb_t *gb= &gui_instance.core.gb;
+  se_gb_tile_cache_t* c = &se_gb_tile_cache;
+  se_gb_update_tile_cache(gb);
   ImVec2 win;
   igGetWindowPos(&win);
 
-  uint8_t ctrl = sb_read8_direct(gb, SB_IO_LCD_CTRL);
-  int bg_tile_map_base      = SB_BFE(ctrl,3,1)==1 ? 0x9c00 : 0x9800;
-  int bg_win_tile_data_mode = SB_BFE(ctrl,4,1)==1;
-  int win_tile_map_base      = SB_BFE(ctrl,6,1)==1 ? 0x9c00 : 0x9800;
-
   // Draw tile data arrays
   for(int tile_data_bank = 0;tile_data_bank<SB_VRAM_NUM_BANKS;++tile_data_bank){
     se_section("Tile Data Bank %d\n",tile_data_bank);
     int tiles_per_row = 16;
-    int image_height = 384/tiles_per_row*(8+2);
-    int image_width =  tiles_per_row*(8+2);
+    int image_height = SE_GB_TILE_DATA_IMAGE_H;
+    int image_width =  SE_GB_TILE_DATA_IMAGE_W;
     float scale = igGetWindowContentRegionWidth()/image_width; 
     int x = igGetCursorPosX()+win.x-igGetScrollX();
     int y = igGetCursorPosY()+win.y-igGetScrollY();
@@ -2245,24 +4568,23 @@ void gb_tile_data_debugger(){
     mouse_pos.y-=y;
 
     int tile_data_base = 0x8000;
-    for(int t=0;t<384;++t){
+    uint8_t* image = c->data_image[tile_data_bank];
+    for(int t=0;t<SE_GB_TILES_PER_BANK;++t){
+      uint32_t version = c->versions[tile_data_bank][t];
+      if(c->data_versions[tile_data_bank][t]==version)continue;
+      c->data_versions[tile_data_bank][t] = version;
       int xt = (t%tiles_per_row)*10;
       int yt = (t/tiles_per_row)*10;
-
-      for(int py = 0;py<8;++py)
-        for(int px = 0;px<8;++px){
-          int d = tile_data_base+py*2+ t*16;
-          uint8_t data1 = sb_read_vram(gb,d,tile_data_bank);
-          uint8_t data2 = sb_read_vram(gb,d+1,tile_data_bank);
-          uint8_t value = SB_BFE(data1,px,1)+SB_BFE(data2,px,1)*2;
-          uint8_t color = value*80;
-          int p = (xt+(7-px)+1)+(yt+py+1)*image_width;
-          tmp_image[p*3+0]=color;
-          tmp_image[p*3+1]=color;
-          tmp_image[p*3+2]=color;
+      for(int py = 0;py<8;++py){
+        uint64_t row = c->rows[tile_data_bank][t][py];
+        uint8_t* p = image+((xt+1)+(yt+py+1)*image_width)*4;
+        for(int px = 0;px<8;++px,p+=4){
+          uint8_t color = ((row>>(px*8))&0x3)*80;
+          p[0]=p[1]=p[2]=color;
         }
+      }
     }
-    se_draw_image(tmp_image,image_width,image_height, x*se_dpi_scale(), y*se_dpi_scale(), w*se_dpi_scale(),h*se_dpi_scale(), false);
+    se_draw_image(image,image_width,image_height, x*se_dpi_scale(), y*se_dpi_scale(), w*se_dpi_scale(),h*se_dpi_scale(), true);
     igDummy((ImVec2){w,h});
 
     if(mouse_pos.x<w && mouse_pos.y <h &&
@@ -2356,90 +4678,1020 @@ void se_draw_io_state(const char * label, mmio_reg_t* mmios, int mmios_size, emu
 /////////////////////////////////
 
 // Used for file loading dialogs
-static const char* valid_rom_file_types[] = { "*.gb", "*.gba","*.gbc" ,"*.nds","*.zip",NULL};
-void se_load_rom_from_emu_state(sb_emu_state_t*emu){
-  if(!emu->rom_data)return;
-  printf("Loading: %s\n",emu_state.rom_path);
-  emu_state.rom_loaded = false; 
-  if(gba_load_rom(emu, &core.gba, &scratch.gba)){
-    emu->system = SYSTEM_GBA;
-    emu->rom_loaded = true;
-  }else if(sb_load_rom(emu,&core.gb,&scratch.gb)){
-    emu->system = SYSTEM_GB;
-    emu->rom_loaded = true; 
-  }else if(nds_load_rom(emu,&core.nds,&scratch.nds)){
-    emu->system = SYSTEM_NDS;
-    emu->rom_loaded = true; 
+static const char* valid_rom_file_types[] = { "*.gb", "*.gba","*.gbc" ,"*.nds","*.ndsz","*.zip",NULL};
+static bool se_read_rom_file(void* user_data, uint64_t offset, void* dst, size_t size){
+  FILE* f = (FILE*)user_data;
+  if(fseek(f,(long)offset,SEEK_SET))return false;
+  return fread(dst,1,size,f)==size;
+}
+// Streams NDS ROMs through the gamecard block cache instead of holding all of it in memory
+static bool se_instance_open_rom_stream(se_instance_t* inst){
+  sb_emu_state_t* emu = &inst->emu_state;
+  if(!sb_path_has_file_ext(emu->rom_path,".nds"))return false;
+  FILE* f = fopen(emu->rom_path,"rb");
+  if(!f)return false;
+  fseek(f,0,SEEK_END);
+  long size = ftell(f);
+  if(size<=0){
+    fclose(f);
+    return false;
   }
+  inst->rom_file = f;
+  emu->rom_size = size;
+  emu->rom_read = se_read_rom_file;
+  emu->rom_read_user_data = f;
+  printf("Streaming file %s file_size %zu\n",emu->rom_path,emu->rom_size);
+  return true;
 }
-void se_load_rom(const char *filename){
-  se_reset_rewind_buffer(&rewind_buffer);
-  se_reset_save_states();
-  se_reset_cheats();
-  gui_state.editing_cheat_index = -1;
-  se_reset_bios_info();
-  emu_state.force_dmg_mode=gui_state.settings.force_dmg_mode;
-  //Compute Save File Path
-  {
-    char *save_file=emu_state.save_file_path; 
-    save_file[0] = '\0';
-    const char* base, *c, *ext; 
-    sb_breakup_path(filename,&base, &c, &ext);
-  #if defined(EMSCRIPTEN)
-      if(sb_path_has_file_ext(filename,".sav")||sb_path_has_file_ext(filename,".code")){
-        if(strncmp(filename,gui_state.recently_loaded_games[0].path,SB_FILE_PATH_SIZE)!=0){
-          return se_load_rom(gui_state.recently_loaded_games[0].path);
-        }
-        return;
-      }
-      snprintf(emu_state.save_data_base_path, SB_FILE_PATH_SIZE,"/offline/%s", c);
-  #else
-      se_join_path(emu_state.save_data_base_path, SB_FILE_PATH_SIZE, base, c, NULL);
-  #endif
-    snprintf(save_file, SB_FILE_PATH_SIZE, "%s.sav",emu_state.save_data_base_path);
-    if(!sb_file_exists(save_file)){
-      const char* base, *c, *ext; 
-      sb_breakup_path(filename,&base, &c, &ext);
-      char tmp_path[SB_FILE_PATH_SIZE];
-      se_join_path(tmp_path,SB_FILE_PATH_SIZE,gui_state.paths.save,c,".sav");
-
-      if(sb_file_exists(tmp_path)||gui_state.settings.save_to_path){
-        se_join_path(emu_state.save_data_base_path,SB_FILE_PATH_SIZE,gui_state.paths.save,c,NULL);
-        strncpy(save_file,tmp_path,SB_FILE_PATH_SIZE);
-      }
+// Seekable compressed NDS ROMs (.ndsz). The ROM is split into blocks that are deflated independently
+// so any part can be read without decompressing what comes before it. Layout, little endian:
+// se_ndsz_header_t, uint64_t offsets[num_blocks+1] (file offset of every block and the end of the
+// last one), block data. Blocks that don't shrink are stored uncompressed.
+// Create them with: SkyEmu compress_rom <rom.nds> <rom.ndsz>
+#define SE_NDSZ_MAGIC "SKYNDSZ"
+#define SE_NDSZ_BLOCK_SIZE (64*1024)
+typedef struct{
+  char magic[8];
+  uint64_t rom_size;
+  uint32_t block_size;
+  uint32_t num_blocks;
+}se_ndsz_header_t;
+typedef struct se_ndsz_reader_t{
+  FILE* file;
+  se_ndsz_header_t header;
+  uint64_t* offsets;
+  uint8_t* compressed;
+  size_t compressed_size;
+  // Block held in data, and the following block which SE_ASYNC_ROM_STREAM decompresses into
+  // next_data while the game consumes the current one. The job owns file, compressed and
+  // next_* until job_pool_wait_async(SE_ASYNC_ROM_STREAM) returns.
+  int64_t block, next_block;
+  uint8_t* data, *next_data;
+  bool next_valid;
+}se_ndsz_reader_t;
+static bool se_ndsz_read_block(se_ndsz_reader_t* r, uint32_t block, uint8_t* dst){
+  uint64_t start = (uint64_t)block*r->header.block_size;
+  size_t size = SE_MIN_CONST(r->header.block_size,r->header.rom_size-start);
+  size_t comp_size = r->offsets[block+1]-r->offsets[block];
+  if(fseek(r->file,(long)r->offsets[block],SEEK_SET))return false;
+  if(comp_size==size)return fread(dst,1,size,r->file)==size;
+  if(fread(r->compressed,1,comp_size,r->file)!=comp_size)return false;
+  mz_ulong dst_size = size;
+  return mz_uncompress(dst,&dst_size,r->compressed,comp_size)==MZ_OK&&dst_size==size;
+}
+static void se_ndsz_prefetch_job(void* user_data, int job_index){
+  se_ndsz_reader_t* r = (se_ndsz_reader_t*)user_data;
+  r->next_valid = se_ndsz_read_block(r,r->next_block,r->next_data);
+}
+static const uint8_t* se_ndsz_get_block(se_ndsz_reader_t* r, uint32_t block){
+  if(r->block==block)return r->data;
+  job_pool_wait_async(SE_ASYNC_ROM_STREAM);
+  if(r->next_valid&&r->next_block==block){
+    uint8_t* data = r->data;
+    r->data = r->next_data;
+    r->next_data = data;
+  }else if(!se_ndsz_read_block(r,block,r->data)){
+    r->block = -1;
+    return NULL;
+  }
+  r->block = block;
+  // Card reads are mostly sequential so the next block is likely to be needed soon
+  r->next_valid = false;
+  r->next_block = block+1;
+  if(block+1<r->header.num_blocks)job_pool_run_async(SE_ASYNC_ROM_STREAM,se_ndsz_prefetch_job,r);
+  return r->data;
+}
+static bool se_read_ndsz(void* user_data, uint64_t offset, void* dst, size_t size){
+  se_ndsz_reader_t* r = (se_ndsz_reader_t*)user_data;
+  if(offset+size>r->header.rom_size)return false;
+  uint8_t* out = (uint8_t*)dst;
+  while(size){
+    uint64_t block_offset = offset%r->header.block_size;
+    const uint8_t* data = se_ndsz_get_block(r,offset/r->header.block_size);
+    if(!data)return false;
+    size_t chunk = SE_MIN_CONST(size,r->header.block_size-block_offset);
+    memcpy(out,data+block_offset,chunk);
+    out+=chunk;
+    offset+=chunk;
+    size-=chunk;
+  }
+  return true;
+}
+static void se_ndsz_close(se_ndsz_reader_t* r){
+  if(!r)return;
+  job_pool_wait_async(SE_ASYNC_ROM_STREAM);
+  if(r->file)fclose(r->file);
+  free(r->offsets);
+  free(r->compressed);
+  free(r->data);
+  free(r->next_data);
+  free(r);
+}
+static se_ndsz_reader_t* se_ndsz_open(const char* path){
+  se_ndsz_reader_t* r = (se_ndsz_reader_t*)calloc(1,sizeof(se_ndsz_reader_t));
+  if(!r)return NULL;
+  r->block = r->next_block = -1;
+  r->file = fopen(path,"rb");
+  se_ndsz_header_t* h = &r->header;
+  bool valid = r->file&&fread(h,1,sizeof(*h),r->file)==sizeof(*h)&&memcmp(h->magic,SE_NDSZ_MAGIC,sizeof(h->magic))==0&&
+               h->block_size&&h->block_size<=16*1024*1024&&h->rom_size&&
+               h->num_blocks==(h->rom_size+h->block_size-1)/h->block_size;
+  if(valid){
+    r->offsets = (uint64_t*)malloc(sizeof(uint64_t)*(h->num_blocks+1ull));
+    valid = r->offsets&&fread(r->offsets,sizeof(uint64_t),h->num_blocks+1ull,r->file)==h->num_blocks+1ull;
+  }
+  if(valid){
+    fseek(r->file,0,SEEK_END);
+    long file_size = ftell(r->file);
+    r->compressed_size = mz_compressBound(h->block_size);
+    for(uint32_t i=0;valid&&i<h->num_blocks;++i){
+      valid = r->offsets[i]<=r->offsets[i+1]&&r->offsets[i+1]-r->offsets[i]<=r->compressed_size;
     }
+    valid &= file_size>0&&r->offsets[h->num_blocks]<=(uint64_t)file_size;
   }
-  //Compute Cheat Code File Path
-  {
-    char *cheat_path=gui_state.cheat_path; 
-    cheat_path[0] = '\0';
-    const char* base, *c, *ext; 
-    sb_breakup_path(filename,&base, &c, &ext);
-    snprintf(cheat_path, SB_FILE_PATH_SIZE, "%s.code",emu_state.save_data_base_path);
-    if(!sb_file_exists(cheat_path)){
-      const char* base, *c, *ext; 
-      sb_breakup_path(filename,&base, &c, &ext);
-      char tmp_path[SB_FILE_PATH_SIZE];
-      se_join_path(tmp_path,SB_FILE_PATH_SIZE,gui_state.paths.cheat_codes,c,".code");
-      if(sb_file_exists(tmp_path)||gui_state.settings.save_to_path){
-        strncpy(cheat_path,tmp_path,SB_FILE_PATH_SIZE);
-      }
+  if(valid){
+    r->compressed = (uint8_t*)malloc(r->compressed_size);
+    r->data = (uint8_t*)malloc(h->block_size);
+    r->next_data = (uint8_t*)malloc(h->block_size);
+    valid = r->compressed&&r->data&&r->next_data;
+  }
+  if(!valid){
+    printf("Failed to open compressed ROM %s\n",path);
+    se_ndsz_close(r);
+    return NULL;
+  }
+  return r;
+}
+// Writes rom_path as a .ndsz to out_path. Returns non zero on failure.
+// Usage: SkyEmu compress_rom <rom.nds> <rom.ndsz>
+static int se_ndsz_compress_mode(const char* rom_path, const char* out_path){
+  FILE* in = fopen(rom_path,"rb");
+  FILE* out = fopen(out_path,"wb");
+  se_ndsz_header_t h = {0};
+  memcpy(h.magic,SE_NDSZ_MAGIC,sizeof(h.magic));
+  h.block_size = SE_NDSZ_BLOCK_SIZE;
+  long rom_size = 0;
+  if(in){
+    fseek(in,0,SEEK_END);
+    rom_size = ftell(in);
+    fseek(in,0,SEEK_SET);
+  }
+  h.rom_size = rom_size>0? rom_size: 0;
+  h.num_blocks = (h.rom_size+h.block_size-1)/h.block_size;
+  uint64_t* offsets = (uint64_t*)calloc(h.num_blocks+1ull,sizeof(uint64_t));
+  mz_ulong bound = mz_compressBound(h.block_size);
+  uint8_t* block = (uint8_t*)malloc(h.block_size);
+  uint8_t* compressed = (uint8_t*)malloc(bound);
+  bool ok = in&&out&&h.rom_size&&offsets&&block&&compressed&&
+            fwrite(&h,1,sizeof(h),out)==sizeof(h)&&fwrite(offsets,sizeof(uint64_t),h.num_blocks+1ull,out)==h.num_blocks+1ull;
+  uint64_t offset = sizeof(h)+sizeof(uint64_t)*(h.num_blocks+1ull);
+  for(uint32_t i=0;ok&&i<h.num_blocks;++i){
+    size_t size = SE_MIN_CONST(h.block_size,h.rom_size-(uint64_t)i*h.block_size);
+    ok = fread(block,1,size,in)==size;
+    mz_ulong comp_size = bound;
+    const uint8_t* data = compressed;
+    if(!ok||mz_compress2(compressed,&comp_size,block,size,MZ_BEST_COMPRESSION)!=MZ_OK||comp_size>=size){
+      data = block;
+      comp_size = size;
     }
-    se_load_cheats(cheat_path);
+    ok = ok&&fwrite(data,1,comp_size,out)==comp_size;
+    offsets[i] = offset;
+    offset+=comp_size;
+  }
+  if(ok){
+    offsets[h.num_blocks] = offset;
+    ok = !fseek(out,sizeof(h),SEEK_SET)&&fwrite(offsets,sizeof(uint64_t),h.num_blocks+1ull,out)==h.num_blocks+1ull;
+  }
+  if(in)fclose(in);
+  if(out&&fclose(out))ok = false;
+  free(offsets);
+  free(block);
+  free(compressed);
+  if(!ok){
+    printf("Failed to compress %s to %s\n",rom_path,out_path);
+    return 1;
+  }
+  printf("Compressed %s (%llu bytes) to %s (%llu bytes)\n",rom_path,(unsigned long long)h.rom_size,out_path,(unsigned long long)offset);
+  return 0;
+}
+static bool se_instance_open_rom_ndsz(se_instance_t* inst){
+  sb_emu_state_t* emu = &inst->emu_state;
+  se_ndsz_reader_t* r = se_ndsz_open(emu->rom_path);
+  if(!r)return false;
+  inst->rom_ndsz = r;
+  emu->rom_size = r->header.rom_size;
+  emu->rom_read = se_read_ndsz;
+  emu->rom_read_user_data = r;
+  printf("Streaming compressed file %s rom_size %zu\n",emu->rom_path,emu->rom_size);
+  return true;
+}
+// Same as cloud_drive_hash() over the whole ROM, streamed ROMs are hashed in chunks
+static uint64_t se_instance_rom_checksum(se_instance_t* inst){
+  sb_emu_state_t* emu = &inst->emu_state;
+  if(emu->rom_data)return cloud_drive_hash((const char*)emu->rom_data,emu->rom_size);
+  XXH64_state_t* state = XXH64_createState();
+  if(!state)return 0;
+  XXH64_reset(state,0);
+  uint8_t buffer[64*1024];
+  for(size_t offset=0;emu->rom_read&&offset<emu->rom_size;offset+=sizeof(buffer)){
+    size_t size = SE_MIN_CONST(sizeof(buffer),emu->rom_size-offset);
+    if(!emu->rom_read(emu->rom_read_user_data,offset,buffer,size))break;
+    XXH64_update(state,buffer,size);
+  }
+  uint64_t hash = XXH64_digest(state);
+  XXH64_freeState(state);
+  return hash;
+}
+// Picks the first entry with a ROM extension so nothing else gets decompressed. Returns -1 if there is none
+static int se_find_zip_rom_entry(mz_zip_archive* zip, mz_zip_archive_file_stat* stat){
+  static const char* rom_exts[]={".gb",".gbc",".gba",".nds"};
+  size_t total_files = mz_zip_reader_get_num_files(zip);
+  for(size_t i=0;i<total_files;++i){
+    if(!mz_zip_reader_file_stat(zip,i,stat)||stat->m_is_directory||!stat->m_is_supported)continue;
+    for(int e=0;e<sizeof(rom_exts)/sizeof(rom_exts[0]);++e){
+      if(sb_path_has_file_ext(stat->m_filename,rom_exts[e]))return i;
+    }
+  }
+  return -1;
+}
+// Offset of the data of an uncompressed entry within the archive, which can then be used in place
+static bool se_zip_stored_data_offset(mz_zip_archive* zip, const mz_zip_archive_file_stat* stat, uint64_t* offset){
+  if(stat->m_method!=0||stat->m_is_encrypted||stat->m_comp_size!=stat->m_uncomp_size)return false;
+  uint8_t header[30];
+  if(!zip->m_pRead)return false;
+  if(zip->m_pRead(zip->m_pIO_opaque,stat->m_local_header_ofs,header,sizeof(header))!=sizeof(header))return false;
+  uint32_t sig = header[0]|(header[1]<<8)|(header[2]<<16)|((uint32_t)header[3]<<24);
+  if(sig!=0x04034b50)return false;
+  uint32_t name_len = header[26]|(header[27]<<8);
+  uint32_t extra_len = header[28]|(header[29]<<8);
+  *offset = stat->m_local_header_ofs+sizeof(header)+name_len+extra_len;
+  return true;
+}
+// Deflated NDS ROMs this big are decompressed on SE_ASYNC_ROM_LOAD so the UI keeps running
+#define SE_ZIP_BACKGROUND_THRESHOLD (32*1024*1024)
+typedef struct{
+  char path[SB_FILE_PATH_SIZE]; // The zip
+  char rom_path[SB_FILE_PATH_SIZE]; // <zip>/<entry>, like emu_state.rom_path
+  int entry;
+  uint8_t* data; // Owned until se_instance_load_rom takes it
+  size_t size;
+  volatile size_t bytes_done;
+  volatile bool success;
+  bool active;
+}se_zip_extract_t;
+se_zip_extract_t se_zip_extract = {0};
+static void se_zip_extract_job(void* user_data, int job_index){
+  se_zip_extract_t* extract = (se_zip_extract_t*)user_data;
+  mz_zip_archive zip;
+  mz_zip_zero_struct(&zip);
+  if(!mz_zip_reader_init_file(&zip,extract->path,0))return;
+  mz_zip_reader_extract_iter_state* iter = mz_zip_reader_extract_iter_new(&zip,extract->entry,0);
+  if(iter){
+    while(extract->bytes_done<extract->size){
+      size_t chunk = SE_MIN_CONST(extract->size-extract->bytes_done,1024*1024);
+      size_t read = mz_zip_reader_extract_iter_read(iter,extract->data+extract->bytes_done,chunk);
+      if(read==0)break;
+      extract->bytes_done+=read;
+    }
+    extract->success = mz_zip_reader_extract_iter_free(iter)&&extract->bytes_done==extract->size;
+  }
+  mz_zip_reader_end(&zip);
+}
+// Loads a ROM from the UI. Big deflated NDS ROMs in zips are decompressed in the background first
+// and se_poll_background_rom_load() finishes loading them.
+static void se_load_rom_in_background(const char* filename){
+  se_zip_extract_t* extract = &se_zip_extract;
+  if(extract->active)return;
+  mz_zip_archive zip;
+  mz_zip_zero_struct(&zip);
+  bool background = false;
+  if(sb_path_has_file_ext(filename,".zip")&&mz_zip_reader_init_file(&zip,filename,0)){
+    mz_zip_archive_file_stat stat={0};
+    uint64_t data_offset = 0;
+    int entry = se_find_zip_rom_entry(&zip,&stat);
+    background = entry>=0&&sb_path_has_file_ext(stat.m_filename,".nds")&&stat.m_uncomp_size>=SE_ZIP_BACKGROUND_THRESHOLD&&
+                 !se_zip_stored_data_offset(&zip,&stat,&data_offset);
+    if(background){
+      free(extract->data);
+      extract->data = (uint8_t*)malloc(stat.m_uncomp_size);
+      background = extract->data!=NULL;
+    }
+    if(background){
+      strncpy(extract->path,filename,SB_FILE_PATH_SIZE-1);
+      extract->path[SB_FILE_PATH_SIZE-1]='\0';
+      snprintf(extract->rom_path,SB_FILE_PATH_SIZE,"%s/%s",filename,stat.m_filename);
+      extract->entry = entry;
+      extract->size = stat.m_uncomp_size;
+      extract->bytes_done = 0;
+      extract->success = false;
+      extract->active = true;
+    }
+    mz_zip_reader_end(&zip);
+  }
+  if(!background){
+    se_load_rom(filename);
+    return;
   }
-  strncpy(emu_state.rom_path, filename, sizeof(emu_state.rom_path));
+  printf("Decompressing %s in the background\n",extract->rom_path);
+  job_pool_run_async(SE_ASYNC_ROM_LOAD,se_zip_extract_job,extract);
+}
+static void se_poll_background_rom_load(){
+  se_zip_extract_t* extract = &se_zip_extract;
+  if(!extract->active)return;
+  if(job_pool_async_busy(SE_ASYNC_ROM_LOAD)){
+    se_draw_background_rom_load_progress(extract->rom_path,extract->size?(float)extract->bytes_done/extract->size:0);
+    return;
+  }
+  extract->active = false;
+  if(extract->success){
+    se_join_emulation_thread();
+    se_load_rom(extract->path);
+  }else printf("Failed to decompress %s\n",extract->rom_path);
+  // Not taken if loading failed before reaching the zip
+  free(extract->data);
+  extract->data = NULL;
+}
+// ROM library: SE_ASYNC_LIBRARY walks gui_state.paths.rom_library, parses the ROM headers and hashes
+// the files. Results are kept in <pref>/rom_library.bin and reused while a file's size and mtime
+// are unchanged, so only new or modified ROMs are read again.
+#define SE_LIBRARY_MAGIC "SKYLIB01"
+#define SE_LIBRARY_MAX_ENTRIES 16384
+#define SE_LIBRARY_MAX_DEPTH 8
+// Icon textures created per UI frame, keeps scrolling through a new library smooth
+#define SE_LIBRARY_ICON_UPLOADS_PER_FRAME 8
+typedef struct{
+  char path[SB_FILE_PATH_SIZE];
+  char title[32];
+  char game_code[8];
+  uint64_t mtime;
+  uint64_t size;
+  uint64_t hash; // XXH3 of the file
+  uint32_t system;
+  uint32_t has_icon;
+  uint8_t icon[512]; // NDS banner icon, 4x4 tiles of 8x8 4bpp pixels
+  uint16_t icon_palette[16];
+}se_library_entry_t;
+typedef struct{
+  char magic[8]; //SE_LIBRARY_MAGIC
+  uint32_t num_entries;
+  uint32_t entry_size;
+}se_library_header_t;
+typedef struct{
+  // Owned by the UI thread
+  se_library_entry_t* entries; // Sorted by title
+  sg_image* icons;
+  uint32_t num_entries;
+  bool loaded;
+  char scanned_path[SB_FILE_PATH_SIZE];
+  // Shared with the job while job_pool_async_busy(SE_ASYNC_LIBRARY)
+  char root[SB_FILE_PATH_SIZE];
+  char index_path[SB_FILE_PATH_SIZE];
+  se_library_entry_t* scan_entries;
+  uint32_t scan_capacity;
+  volatile uint32_t num_scan_entries;
+  // The index from the last run, handed to the UI before the scan itself starts
+  se_library_entry_t* index_entries;
+  uint32_t num_index_entries;
+  volatile bool index_ready;
+  volatile uint32_t files_visited;
+  volatile bool cancel;
+  bool active;
+}se_library_t;
+se_library_t se_library = {0};
 
-  if(emu_state.rom_loaded){
-    if(emu_state.system==SYSTEM_NDS)nds_unload(&core.nds, &scratch.nds);
-    else if(emu_state.system==SYSTEM_GBA)gba_unload(&core.gba,&scratch.gba);
+static int se_library_path_cmp(const void* a, const void* b){
+  return strcmp(((const se_library_entry_t*)a)->path,((const se_library_entry_t*)b)->path);
+}
+static int se_library_title_cmp(const void* a, const void* b){
+  const se_library_entry_t* ea = (const se_library_entry_t*)a;
+  const se_library_entry_t* eb = (const se_library_entry_t*)b;
+  for(int i=0;i<sizeof(ea->title);++i){
+    int ca = tolower((unsigned char)ea->title[i]), cb = tolower((unsigned char)eb->title[i]);
+    if(ca!=cb)return ca-cb;
+    if(ca==0)break;
+  }
+  return strcmp(ea->path,eb->path);
+}
+// Copies a fixed size header string, stopping at the first unprintable character
+static void se_library_copy_header_string(char* dst, size_t dst_size, const uint8_t* src, size_t src_size){
+  size_t len = 0;
+  while(len<src_size&&len<dst_size-1&&src[len]>=0x20&&src[len]<0x7f){dst[len]=src[len];++len;}
+  while(len&&dst[len-1]==' ')--len;
+  dst[len]='\0';
+}
+static uint32_t se_library_system_from_name(const char* name){
+  if(sb_path_has_file_ext(name,".gb")||sb_path_has_file_ext(name,".gbc"))return SYSTEM_GB;
+  if(sb_path_has_file_ext(name,".gba"))return SYSTEM_GBA;
+  if(sb_path_has_file_ext(name,".nds")||sb_path_has_file_ext(name,".ndsz"))return SYSTEM_NDS;
+  return SYSTEM_UNKNOWN;
+}
+// Fills in the title, game code and icon from the start of the ROM. data_size is what was read.
+// banner_data is the NDS banner if the caller could read it, otherwise NULL.
+static void se_library_parse_header(se_library_entry_t* entry, const uint8_t* data, size_t data_size, const uint8_t* banner_data){
+  entry->title[0]=entry->game_code[0]='\0';
+  entry->has_icon = false;
+  if(entry->system==SYSTEM_GB&&data_size>=0x150){
+    bool cgb = data[0x143]&0x80;
+    se_library_copy_header_string(entry->title,sizeof(entry->title),data+0x134,cgb?15:16);
+    if(cgb&&data[0x13f]>='A'&&data[0x13f]<='Z'){
+      se_library_copy_header_string(entry->game_code,sizeof(entry->game_code),data+0x13f,4);
+      if(strlen(entry->game_code)==4)entry->title[11]='\0';
+      else entry->game_code[0]='\0';
+    }
+  }else if(entry->system==SYSTEM_GBA&&data_size>=0xC0){
+    se_library_copy_header_string(entry->title,sizeof(entry->title),data+0xA0,12);
+    se_library_copy_header_string(entry->game_code,sizeof(entry->game_code),data+0xAC,4);
+  }else if(entry->system==SYSTEM_NDS&&data_size>=0x200){
+    se_library_copy_header_string(entry->title,sizeof(entry->title),data,12);
+    se_library_copy_header_string(entry->game_code,sizeof(entry->game_code),data+0xC,4);
+    if(banner_data){
+      memcpy(entry->icon,banner_data+0x20,sizeof(entry->icon));
+      for(int i=0;i<16;++i)entry->icon_palette[i]=banner_data[0x220+i*2]|(banner_data[0x221+i*2]<<8);
+      entry->has_icon = true;
+    }
+  }
+}
+#define SE_LIBRARY_BANNER_SIZE 0x240
+static bool se_library_read_zip(se_library_entry_t* entry){
+  mz_zip_archive zip;
+  mz_zip_zero_struct(&zip);
+  if(!mz_zip_reader_init_file(&zip,entry->path,0))return false;
+  mz_zip_archive_file_stat stat={0};
+  int index = se_find_zip_rom_entry(&zip,&stat);
+  bool found = false;
+  if(index>=0){
+    entry->system = se_library_system_from_name(stat.m_filename);
+    // Only the start of the entry is decompressed, NDS banners further into the ROM are skipped
+    uint8_t data[0x8000];
+    size_t size = 0;
+    mz_zip_reader_extract_iter_state* iter = mz_zip_reader_extract_iter_new(&zip,index,0);
+    if(iter){
+      size = mz_zip_reader_extract_iter_read(iter,data,sizeof(data));
+      mz_zip_reader_extract_iter_free(iter);
+    }
+    const uint8_t* banner = NULL;
+    if(entry->system==SYSTEM_NDS&&size>=0x200){
+      uint32_t banner_offset = data[0x68]|(data[0x69]<<8)|(data[0x6a]<<16)|((uint32_t)data[0x6b]<<24);
+      if(banner_offset&&banner_offset+SE_LIBRARY_BANNER_SIZE<=size)banner = data+banner_offset;
+    }
+    se_library_parse_header(entry,data,size,banner);
+    found = true;
+  }
+  mz_zip_reader_end(&zip);
+  return found;
+}
+// Only the blocks holding the header and the banner are decompressed
+static bool se_library_read_ndsz(se_library_entry_t* entry){
+  se_ndsz_reader_t* r = se_ndsz_open(entry->path);
+  if(!r)return false;
+  entry->system = SYSTEM_NDS;
+  size_t size = SE_MIN_CONST(r->header.block_size,r->header.rom_size);
+  bool found = se_ndsz_read_block(r,0,r->data);
+  const uint8_t* banner = NULL;
+  if(found&&size>=0x200){
+    const uint8_t* data = r->data;
+    uint64_t banner_offset = data[0x68]|(data[0x69]<<8)|(data[0x6a]<<16)|((uint32_t)data[0x6b]<<24);
+    uint64_t block = banner_offset/r->header.block_size, block_offset = banner_offset%r->header.block_size;
+    // Banners that straddle two blocks are skipped
+    if(banner_offset&&banner_offset+SE_LIBRARY_BANNER_SIZE<=r->header.rom_size&&block_offset+SE_LIBRARY_BANNER_SIZE<=r->header.block_size){
+      if(block==0)banner = data+block_offset;
+      else if(se_ndsz_read_block(r,block,r->next_data))banner = r->next_data+block_offset;
+    }
+  }
+  if(found)se_library_parse_header(entry,r->data,size,banner);
+  se_ndsz_close(r);
+  return found;
+}
+// Reads the header and banner of a ROM and hashes the whole file
+static bool se_library_read_rom(se_library_entry_t* entry){
+  if(sb_path_has_file_ext(entry->path,".zip")){
+    if(!se_library_read_zip(entry))return false;
+  }else if(sb_path_has_file_ext(entry->path,".ndsz")){
+    if(!se_library_read_ndsz(entry))return false;
+  }else{
+    entry->system = se_library_system_from_name(entry->path);
+    FILE* f = fopen(entry->path,"rb");
+    if(!f)return false;
+    uint8_t data[0x200]={0};
+    uint8_t banner[SE_LIBRARY_BANNER_SIZE];
+    size_t size = fread(data,1,sizeof(data),f);
+    bool has_banner = false;
+    if(entry->system==SYSTEM_NDS&&size==sizeof(data)){
+      uint32_t banner_offset = data[0x68]|(data[0x69]<<8)|(data[0x6a]<<16)|((uint32_t)data[0x6b]<<24);
+      has_banner = banner_offset&&!fseek(f,(long)banner_offset,SEEK_SET)&&fread(banner,1,sizeof(banner),f)==sizeof(banner);
+    }
+    fclose(f);
+    se_library_parse_header(entry,data,size,has_banner?banner:NULL);
+  }
+  if(entry->title[0]=='\0'){
+    // sb_breakup_path() isn't usable off the UI thread, it returns a static buffer
+    const char* file = entry->path;
+    for(const char* c=entry->path;*c;++c)if(*c=='/'||*c=='\\')file = c+1;
+    strncpy(entry->title,file,sizeof(entry->title)-1);
+    char* ext = strrchr(entry->title,'.');
+    if(ext&&ext!=entry->title)*ext='\0';
+  }
+  entry->hash = 0;
+  FILE* f = fopen(entry->path,"rb");
+  XXH3_state_t* state = XXH3_createState();
+  if(f&&state){
+    XXH3_64bits_reset(state);
+    static uint8_t buffer[256*1024];
+    size_t read = 0;
+    while(!se_library.cancel&&(read=fread(buffer,1,sizeof(buffer),f))>0)XXH3_64bits_update(state,buffer,read);
+    entry->hash = XXH3_64bits_digest(state);
+  }
+  if(state)XXH3_freeState(state);
+  if(f)fclose(f);
+  return !se_library.cancel;
+}
+static se_library_entry_t* se_library_load_index(const char* path, uint32_t* num_entries){
+  *num_entries = 0;
+  size_t file_size = 0;
+  uint8_t* data = sb_load_file_data(path,&file_size);
+  if(!data)return NULL;
+  se_library_header_t header;
+  se_library_entry_t* entries = NULL;
+  if(file_size>=sizeof(header)){
+    memcpy(&header,data,sizeof(header));
+    if(memcmp(header.magic,SE_LIBRARY_MAGIC,sizeof(header.magic))==0&&header.entry_size==sizeof(se_library_entry_t)&&
+       header.num_entries<=SE_LIBRARY_MAX_ENTRIES&&header.num_entries*sizeof(se_library_entry_t)<=file_size-sizeof(header)){
+      entries = (se_library_entry_t*)malloc(sizeof(se_library_entry_t)*SE_MAX_CONST(header.num_entries,1));
+      if(entries){
+        memcpy(entries,data+sizeof(header),header.num_entries*sizeof(se_library_entry_t));
+        for(uint32_t i=0;i<header.num_entries;++i){
+          entries[i].path[SB_FILE_PATH_SIZE-1]=entries[i].title[sizeof(entries[i].title)-1]='\0';
+          entries[i].game_code[sizeof(entries[i].game_code)-1]='\0';
+        }
+        *num_entries = header.num_entries;
+      }
+    }
+  }
+  free(data);
+  return entries;
+}
+static void se_library_save_index(const char* path, const se_library_entry_t* entries, uint32_t num_entries){
+  FILE* f = se_fopen_mkdir(path,"wb");
+  if(!f){
+    printf("Failed to write the ROM library index %s\n",path);
+    return;
+  }
+  se_library_header_t header={0};
+  memcpy(header.magic,SE_LIBRARY_MAGIC,sizeof(header.magic));
+  header.num_entries = num_entries;
+  header.entry_size = sizeof(se_library_entry_t);
+  fwrite(&header,1,sizeof(header),f);
+  fwrite(entries,sizeof(se_library_entry_t),num_entries,f);
+  fclose(f);
+}
+static void se_library_scan_dir(const char* path, int depth, const se_library_entry_t* cached, uint32_t num_cached){
+  se_library_t* lib = &se_library;
+  tinydir_dir dir;
+  if(tinydir_open(&dir,path)==-1)return;
+  for(;dir.has_next&&!lib->cancel;tinydir_next(&dir)){
+    tinydir_file file;
+    if(tinydir_readfile(&dir,&file)==-1)continue;
+    if(file.name[0]=='.')continue;
+    lib->files_visited++;
+    if(file.is_dir){
+      if(depth<SE_LIBRARY_MAX_DEPTH)se_library_scan_dir(file.path,depth+1,cached,num_cached);
+      continue;
+    }
+    bool rom = false;
+    for(int i=0;valid_rom_file_types[i];++i)rom|=sb_path_has_file_ext(file.name,valid_rom_file_types[i]);
+    if(!rom)continue;
+    if(lib->num_scan_entries==lib->scan_capacity){
+      if(lib->scan_capacity>=SE_LIBRARY_MAX_ENTRIES)break;
+      uint32_t capacity = lib->scan_capacity?lib->scan_capacity*2:256;
+      se_library_entry_t* entries = (se_library_entry_t*)realloc(lib->scan_entries,sizeof(se_library_entry_t)*capacity);
+      if(!entries)break;
+      lib->scan_entries = entries;
+      lib->scan_capacity = capacity;
+    }
+    se_library_entry_t* entry = lib->scan_entries+lib->num_scan_entries;
+    memset(entry,0,sizeof(*entry));
+    strncpy(entry->path,file.path,SB_FILE_PATH_SIZE-1);
+    entry->mtime = file._s.st_mtime;
+    entry->size = file._s.st_size;
+    const se_library_entry_t* old = num_cached?
+      (const se_library_entry_t*)bsearch(entry,cached,num_cached,sizeof(se_library_entry_t),se_library_path_cmp):NULL;
+    if(old&&old->mtime==entry->mtime&&old->size==entry->size)*entry = *old;
+    else if(!se_library_read_rom(entry))continue;
+    lib->num_scan_entries++;
+  }
+  tinydir_close(&dir);
+}
+static void se_library_scan_job(void* user_data, int job_index){
+  se_library_t* lib = (se_library_t*)user_data;
+  uint32_t num_cached = 0;
+  se_library_entry_t* cached = se_library_load_index(lib->index_path,&num_cached);
+  if(cached){
+    lib->index_entries = (se_library_entry_t*)malloc(sizeof(se_library_entry_t)*num_cached);
+    if(lib->index_entries)memcpy(lib->index_entries,cached,sizeof(se_library_entry_t)*num_cached);
+    lib->num_index_entries = lib->index_entries?num_cached:0;
+  }
+  lib->index_ready = true;
+  if(cached)qsort(cached,num_cached,sizeof(se_library_entry_t),se_library_path_cmp);
+  se_library_scan_dir(lib->root,0,cached,num_cached);
+  free(cached);
+  if(lib->cancel)return;
+  qsort(lib->scan_entries,lib->num_scan_entries,sizeof(se_library_entry_t),se_library_title_cmp);
+  se_library_save_index(lib->index_path,lib->scan_entries,lib->num_scan_entries);
+}
+static void se_library_free_icons(){
+  se_library_t* lib = &se_library;
+  if(lib->icons){
+    for(uint32_t i=0;i<lib->num_entries;++i)if(lib->icons[i].id!=SG_INVALID_ID)se_free_image_deferred(lib->icons[i]);
+  }
+  free(lib->icons);
+  lib->icons = NULL;
+}
+static void se_library_start_scan(){
+  se_library_t* lib = &se_library;
+  if(lib->active||gui_state.paths.rom_library[0]=='\0')return;
+  strncpy(lib->root,gui_state.paths.rom_library,SB_FILE_PATH_SIZE);
+  strncpy(lib->scanned_path,gui_state.paths.rom_library,SB_FILE_PATH_SIZE);
+  snprintf(lib->index_path,SB_FILE_PATH_SIZE,"%srom_library.bin",se_get_pref_path());
+  lib->num_scan_entries = 0;
+  lib->files_visited = 0;
+  lib->index_entries = NULL;
+  lib->num_index_entries = 0;
+  lib->index_ready = false;
+  lib->cancel = false;
+  lib->active = true;
+  job_pool_run_async(SE_ASYNC_LIBRARY,se_library_scan_job,lib);
+}
+// Shows the cached index right away and swaps in the results of a finished scan
+static void se_library_set_entries(se_library_entry_t* entries, uint32_t num_entries){
+  se_library_t* lib = &se_library;
+  se_library_free_icons();
+  free(lib->entries);
+  lib->entries = entries;
+  lib->num_entries = entries?num_entries:0;
+  lib->icons = (sg_image*)calloc(SE_MAX_CONST(lib->num_entries,1),sizeof(sg_image));
+}
+// Shows the index of the last run as soon as the job read it and swaps in the results of a finished scan
+static void se_library_poll(){
+  se_library_t* lib = &se_library;
+  if(lib->active&&lib->index_ready&&!lib->loaded){
+    se_library_set_entries(lib->index_entries,lib->num_index_entries);
+    lib->index_entries = NULL;
+    lib->loaded = true;
+  }
+  if(lib->active){
+    if(job_pool_async_busy(SE_ASYNC_LIBRARY))return;
+    lib->active = false;
+    free(lib->index_entries);
+    lib->index_entries = NULL;
+    if(!lib->cancel){
+      // The scan buffer becomes the list shown, the next scan starts with a new one
+      se_library_set_entries(lib->scan_entries,lib->num_scan_entries);
+      lib->loaded = true;
+    }else free(lib->scan_entries);
+    lib->scan_entries = NULL;
+    lib->scan_capacity = 0;
+  }
+  if(strncmp(lib->scanned_path,gui_state.paths.rom_library,SB_FILE_PATH_SIZE))se_library_start_scan();
+}
+static void se_library_shutdown(){
+  se_library_t* lib = &se_library;
+  lib->cancel = true;
+  job_pool_wait_async(SE_ASYNC_LIBRARY);
+  lib->active = false;
+  se_library_free_icons();
+  free(lib->entries);
+  free(lib->scan_entries);
+  free(lib->index_entries);
+  lib->entries = lib->scan_entries = lib->index_entries = NULL;
+  lib->num_entries = lib->scan_capacity = 0;
+}
+static sg_image se_library_icon(uint32_t index, int* uploads){
+  se_library_t* lib = &se_library;
+  se_library_entry_t* entry = lib->entries+index;
+  sg_image* image = lib->icons+index;
+  if(image->id!=SG_INVALID_ID||!entry->has_icon||*uploads>=SE_LIBRARY_ICON_UPLOADS_PER_FRAME)return *image;
+  uint8_t rgba[32*32*4];
+  for(int y=0;y<32;++y)for(int x=0;x<32;++x){
+    int tile = (y/8)*4+x/8;
+    int p = tile*64+(y%8)*8+(x%8);
+    int color_index = SB_BFE(entry->icon[p/2],(p&1)*4,4);
+    uint16_t color = entry->icon_palette[color_index];
+    uint8_t* out = rgba+(y*32+x)*4;
+    out[0] = SB_BFE(color,0,5)*255/31;
+    out[1] = SB_BFE(color,5,5)*255/31;
+    out[2] = SB_BFE(color,10,5)*255/31;
+    out[3] = color_index?255:0;
+  }
+  sg_image_desc desc = se_rgba8_image_desc(32,32,SG_USAGE_IMMUTABLE);
+  desc.data.subimage[0][0].ptr = rgba;
+  desc.data.subimage[0][0].size = sizeof(rgba);
+  *image = sg_make_image(&desc);
+  (*uploads)++;
+  return *image;
+}
+static void se_instance_load_rom_data(se_instance_t* inst){
+  sb_emu_state_t* emu = &inst->emu_state;
+  if(!emu->rom_data&&!emu->rom_read)return;
+  printf("Loading: %s\n",emu->rom_path);
+  emu->rom_loaded = false; 
+  if(gba_load_rom(emu, &inst->core.gba, &inst->scratch.gba)){
+    emu->system = SYSTEM_GBA;
+    emu->rom_loaded = true;
+  }else if(sb_load_rom(emu,&inst->core.gb,&inst->scratch.gb)){
+    emu->system = SYSTEM_GB;
+    emu->rom_loaded = true; 
+  }else if(nds_load_rom(emu,&inst->core.nds,&inst->scratch.nds)){
+    emu->system = SYSTEM_NDS;
+    emu->rom_loaded = true; 
+  }
+}
+static void se_instance_unload_rom(se_instance_t* inst){
+  sb_emu_state_t* emu = &inst->emu_state;
+  // The RetroAchievements hash may still be reading the ROM
+  if(inst==&gui_instance)job_pool_wait_async(SE_ASYNC_RA_HASH);
+  if(emu->rom_loaded){
+    if(emu->system==SYSTEM_NDS)nds_unload(&inst->core.nds, &inst->scratch.nds);
+    else if(emu->system==SYSTEM_GBA)gba_unload(&inst->core.gba,&inst->scratch.gba);
   }
-  if(emu_state.rom_data){
-    free(emu_state.rom_data);
-    emu_state.rom_data = NULL;
-    emu_state.rom_size = 0; 
-    emu_state.rom_loaded=false;
+  if(emu->rom_data){
+    if(inst->rom_map)se_unmap_file_data(inst->rom_map,inst->rom_map_size);
+    else if(!sb_arena_owns(&inst->rom_arena,emu->rom_data))free(emu->rom_data);
+    sb_arena_reset(&inst->rom_arena);
+    inst->rom_map = NULL;
+    emu->rom_data = NULL;
+    emu->rom_size = 0; 
+    emu->rom_loaded=false;
   }
-  memset(&core,0,sizeof(core));
+  if(inst->rom_file||inst->rom_ndsz){
+    if(inst->rom_file)fclose(inst->rom_file);
+    se_ndsz_close(inst->rom_ndsz);
+    inst->rom_file = NULL;
+    inst->rom_ndsz = NULL;
+    emu->rom_read = NULL;
+    emu->rom_read_user_data = NULL;
+    emu->rom_size = 0;
+    emu->rom_loaded=false;
+  }
+}
+// Reserves the largest cartridge of the system so switching between its ROMs reuses the arena.
+// NDS ROMs are normally mapped or streamed, so for them the arena only grows to the ROM itself.
+static uint8_t* se_instance_alloc_rom_data(se_instance_t* inst, const char* rom_path, size_t rom_size){
+  size_t capacity = 0;
+  if(sb_path_has_file_ext(rom_path,".gba"))capacity = 32*1024*1024;
+  else if(sb_path_has_file_ext(rom_path,".gb")||sb_path_has_file_ext(rom_path,".gbc"))capacity = 8*1024*1024;
+  sb_arena_reset(&inst->rom_arena);
+  if(!sb_arena_reserve(&inst->rom_arena,SE_MAX_CONST(capacity,rom_size)))return NULL;
+  return (uint8_t*)sb_arena_alloc(&inst->rom_arena,rom_size);
+}
+static uint8_t* se_instance_load_rom_file(se_instance_t* inst, const char* path, size_t* file_size){
+  *file_size = 0;
+  FILE* f = fopen(path,"rb");
+  if(!f){
+    printf("Failed to open file %s\n",path);
+    return NULL;
+  }
+  fseek(f,0,SEEK_END);
+  long size = ftell(f);
+  fseek(f,0,SEEK_SET);
+  uint8_t* data = size>0? se_instance_alloc_rom_data(inst,path,size): NULL;
+  if(data&&fread(data,1,size,f)==(size_t)size){
+    *file_size = size;
+    printf("Loaded file %s file_size %zu\n",path,*file_size);
+  }else{
+    printf("Failed to load file %s\n",path);
+    data = NULL;
+    sb_arena_reset(&inst->rom_arena);
+  }
+  fclose(f);
+  return data;
+}
+// Soft patching: a game.ips, game.bps or game.ups next to game.nds (or game.zip) is applied at
+// load time. Mapped ROMs are private copy on write mappings, so patching them in place only
+// allocates the pages the patch touches. The original contents of those pages are kept aside
+// while patching since BPS copies from anywhere in the source. ROMs that grow get a new buffer.
+#define SE_ROM_PATCH_PAGE_SIZE 4096
+typedef struct{
+  const uint8_t* patch;
+  size_t patch_size, patch_offset;
+  const uint8_t* source;
+  size_t source_size;
+  uint8_t* target;
+  size_t target_size;
+  uint8_t** saved_pages; // Original source pages written over, only when target==source
+  bool error;
+}se_rom_patch_t;
+static uint8_t se_rom_patch_read8(se_rom_patch_t* p){
+  if(p->patch_offset>=p->patch_size){p->error=true;return 0;}
+  return p->patch[p->patch_offset++];
+}
+static uint64_t se_rom_patch_read_varint(se_rom_patch_t* p){
+  uint64_t data = 0, shift = 1;
+  while(!p->error){
+    uint8_t x = se_rom_patch_read8(p);
+    data+= (x&0x7f)*shift;
+    if(x&0x80)break;
+    shift<<=7;
+    data+= shift;
+    if(shift>(1ull<<56))p->error = true;
+  }
+  return data;
+}
+static uint8_t se_rom_patch_source(se_rom_patch_t* p, uint64_t offset){
+  if(offset>=p->source_size)return 0;
+  uint8_t* saved = p->saved_pages? p->saved_pages[offset/SE_ROM_PATCH_PAGE_SIZE]: NULL;
+  return saved? saved[offset%SE_ROM_PATCH_PAGE_SIZE]: p->source[offset];
+}
+static void se_rom_patch_write(se_rom_patch_t* p, uint64_t offset, uint8_t value){
+  if(offset>=p->target_size){p->error=true;return;}
+  if(p->target[offset]==value)return;
+  if(p->saved_pages&&offset<p->source_size){
+    size_t page = offset/SE_ROM_PATCH_PAGE_SIZE;
+    if(!p->saved_pages[page]){
+      size_t page_start = page*SE_ROM_PATCH_PAGE_SIZE;
+      p->saved_pages[page] = (uint8_t*)malloc(SE_ROM_PATCH_PAGE_SIZE);
+      if(!p->saved_pages[page]){p->error=true;return;}
+      memcpy(p->saved_pages[page],p->source+page_start,SE_MIN_CONST(SE_ROM_PATCH_PAGE_SIZE,p->source_size-page_start));
+    }
+  }
+  p->target[offset] = value;
+}
+static bool se_rom_patch_check_crc(const uint8_t* patch, size_t patch_size){
+  uint32_t crc = patch[patch_size-4]|(patch[patch_size-3]<<8)|(patch[patch_size-2]<<16)|((uint32_t)patch[patch_size-1]<<24);
+  return mz_crc32(MZ_CRC32_INIT,patch,patch_size-4)==crc;
+}
+// Returns the size of the patched ROM, 0 if the patch is malformed or for a different ROM
+static size_t se_rom_patch_target_size(int format, const uint8_t* patch, size_t patch_size, size_t rom_size){
+  se_rom_patch_t p = {.patch=patch,.patch_size=patch_size};
+  if(format=='i'){
+    if(patch_size<8||memcmp(patch,"PATCH",5)!=0)return 0;
+    size_t size = rom_size;
+    p.patch_offset = 5;
+    while(p.patch_offset+3<=patch_size){
+      uint32_t offset = (patch[p.patch_offset]<<16)|(patch[p.patch_offset+1]<<8)|patch[p.patch_offset+2];
+      p.patch_offset+=3;
+      if(offset==0x454f46){
+        // Optional truncation
+        if(p.patch_offset+3<=patch_size)size = (patch[p.patch_offset]<<16)|(patch[p.patch_offset+1]<<8)|patch[p.patch_offset+2];
+        return size;
+      }
+      uint32_t len = se_rom_patch_read8(&p)<<8;
+      len|= se_rom_patch_read8(&p);
+      if(len==0){
+        len = se_rom_patch_read8(&p)<<8;
+        len|= se_rom_patch_read8(&p);
+        p.patch_offset++;
+      }else p.patch_offset+=len;
+      if(p.error||p.patch_offset>patch_size)return 0;
+      size = SE_MAX_CONST(size,offset+len);
+    }
+    return 0;
+  }
+  if(patch_size<16||memcmp(patch,format=='b'?"BPS1":"UPS1",4)!=0||!se_rom_patch_check_crc(patch,patch_size))return 0;
+  p.patch_offset = 4;
+  uint64_t source_size = se_rom_patch_read_varint(&p);
+  uint64_t target_size = se_rom_patch_read_varint(&p);
+  if(p.error||source_size!=rom_size||target_size>SIZE_MAX)return 0;
+  return target_size;
+}
+static bool se_rom_patch_apply(int format, se_rom_patch_t* p){
+  size_t end = p->patch_size-12;
+  if(format=='i'){
+    p->patch_offset = 5;
+    while(!p->error&&p->patch_offset+3<=p->patch_size){
+      const uint8_t* d = p->patch+p->patch_offset;
+      uint32_t offset = (d[0]<<16)|(d[1]<<8)|d[2];
+      p->patch_offset+=3;
+      if(offset==0x454f46)break;
+      uint32_t len = se_rom_patch_read8(p)<<8;
+      len|= se_rom_patch_read8(p);
+      if(len==0){
+        len = se_rom_patch_read8(p)<<8;
+        len|= se_rom_patch_read8(p);
+        uint8_t value = se_rom_patch_read8(p);
+        for(uint32_t i=0;i<len&&!p->error;++i)se_rom_patch_write(p,offset+i,value);
+      }else for(uint32_t i=0;i<len&&!p->error;++i)se_rom_patch_write(p,offset+i,se_rom_patch_read8(p));
+    }
+  }else if(format=='b'){
+    p->patch_offset = 4;
+    se_rom_patch_read_varint(p);
+    se_rom_patch_read_varint(p);
+    p->patch_offset+= se_rom_patch_read_varint(p); // Metadata
+    uint64_t output = 0, source_rel = 0, target_rel = 0;
+    while(!p->error&&p->patch_offset<end){
+      uint64_t data = se_rom_patch_read_varint(p);
+      uint64_t len = (data>>2)+1;
+      if(output+len>p->target_size){p->error=true;break;}
+      switch(data&3){
+        case 0: //SourceRead
+          for(uint64_t i=0;i<len;++i,++output)se_rom_patch_write(p,output,se_rom_patch_source(p,output));
+          break;
+        case 1: //TargetRead
+          for(uint64_t i=0;i<len&&!p->error;++i)se_rom_patch_write(p,output++,se_rom_patch_read8(p));
+          break;
+        case 2:{ //SourceCopy
+          uint64_t d = se_rom_patch_read_varint(p);
+          source_rel+= (d&1)? -(d>>1): (d>>1);
+          for(uint64_t i=0;i<len;++i)se_rom_patch_write(p,output++,se_rom_patch_source(p,source_rel++));
+          break;
+        }
+        case 3:{ //TargetCopy, may overlap the bytes it produces
+          uint64_t d = se_rom_patch_read_varint(p);
+          target_rel+= (d&1)? -(d>>1): (d>>1);
+          for(uint64_t i=0;i<len;++i){
+            if(target_rel>=output){p->error=true;break;}
+            se_rom_patch_write(p,output++,p->target[target_rel++]);
+          }
+          break;
+        }
+      }
+    }
+  }else{
+    p->patch_offset = 4;
+    se_rom_patch_read_varint(p);
+    se_rom_patch_read_varint(p);
+    uint64_t output = 0;
+    while(!p->error&&p->patch_offset<end){
+      output+= se_rom_patch_read_varint(p);
+      while(!p->error){
+        uint8_t x = se_rom_patch_read8(p);
+        if(output<p->target_size)se_rom_patch_write(p,output,se_rom_patch_source(p,output)^x);
+        ++output;
+        if(!x)break;
+      }
+    }
+  }
+  return !p->error;
+}
+// Returns the format of the patch next to rom_file ('i', 'b' or 'u') and its path, 0 if there is none
+static int se_find_rom_patch(const char* rom_file, char* patch_path){
+  static const char* patch_exts[]={"ips","bps","ups"};
+  const char* base, *file, *ext;
+  sb_breakup_path(rom_file,&base,&file,&ext);
+  for(int i=0;i<sizeof(patch_exts)/sizeof(patch_exts[0]);++i){
+    se_join_path(patch_path,SB_FILE_PATH_SIZE,base,file,patch_exts[i]);
+    if(sb_file_exists(patch_path))return patch_exts[i][0];
+  }
+  return 0;
+}
+// Applies the patch next to rom_file to the loaded ROM data. Streamed ROMs are left unpatched.
+static void se_instance_apply_rom_patch(se_instance_t* inst, const char* rom_file){
+  sb_emu_state_t* emu = &inst->emu_state;
+  char patch_path[SB_FILE_PATH_SIZE];
+  int format = se_find_rom_patch(rom_file,patch_path);
+  if(!format)return;
+  if(!emu->rom_data){
+    printf("Can't apply %s to a streamed ROM\n",patch_path);
+    return;
+  }
+  size_t patch_size = 0;
+  uint8_t* patch = sb_load_file_data(patch_path,&patch_size);
+  size_t target_size = patch? se_rom_patch_target_size(format,patch,patch_size,emu->rom_size): 0;
+  if(!target_size){
+    printf("Failed to apply patch %s: invalid or made for a different ROM\n",patch_path);
+    free(patch);
+    return;
+  }
+  se_rom_patch_t p = {.patch=patch,.patch_size=patch_size,.source=emu->rom_data,.source_size=emu->rom_size,
+                      .target=emu->rom_data,.target_size=target_size};
+  if(target_size>emu->rom_size){
+    p.target = (uint8_t*)calloc(target_size,1);
+    if(p.target)memcpy(p.target,emu->rom_data,emu->rom_size);
+  }else p.saved_pages = (uint8_t**)calloc((emu->rom_size+SE_ROM_PATCH_PAGE_SIZE-1)/SE_ROM_PATCH_PAGE_SIZE,sizeof(uint8_t*));
+  bool success = (p.target!=emu->rom_data||p.saved_pages)&&se_rom_patch_apply(format,&p);
+  size_t modified_pages = 0;
+  if(p.saved_pages){
+    for(size_t i=0;i<(emu->rom_size+SE_ROM_PATCH_PAGE_SIZE-1)/SE_ROM_PATCH_PAGE_SIZE;++i){
+      if(!p.saved_pages[i])continue;
+      // A failed in place patch is rolled back to the original ROM
+      if(!success)memcpy(emu->rom_data+i*SE_ROM_PATCH_PAGE_SIZE,p.saved_pages[i],SE_MIN_CONST(SE_ROM_PATCH_PAGE_SIZE,emu->rom_size-i*SE_ROM_PATCH_PAGE_SIZE));
+      free(p.saved_pages[i]);
+      ++modified_pages;
+    }
+    free(p.saved_pages);
+  }
+  free(patch);
+  if(!success){
+    if(p.target!=emu->rom_data)free(p.target);
+    printf("Failed to apply patch %s\n",patch_path);
+    return;
+  }
+  if(p.target!=emu->rom_data){
+    // The grown ROM replaces the original, which se_instance_unload_rom would otherwise release
+    if(inst->rom_map)se_unmap_file_data(inst->rom_map,inst->rom_map_size);
+    else if(!sb_arena_owns(&inst->rom_arena,emu->rom_data))free(emu->rom_data);
+    inst->rom_map = NULL;
+    emu->rom_data = p.target;
+  }
+  emu->rom_size = target_size;
+  printf("Applied patch %s (%zu pages modified in place)\n",patch_path,modified_pages);
+}
+// Loads a ROM (or the first loadable ROM of a zip) into the instance, replacing the current one.
+// Save file paths and the emu_state options are left to the caller.
+static bool se_instance_load_rom(se_instance_t* inst, const char* filename){
+  sb_emu_state_t* emu = &inst->emu_state;
+  strncpy(emu->rom_path, filename, sizeof(emu->rom_path));
+  se_instance_unload_rom(inst);
+  memset(&inst->core,0,sizeof(inst->core));
   printf("Loading ROM: %s\n", filename); 
 
   if(sb_path_has_file_ext(filename,".zip")){
@@ -2447,45 +5699,214 @@ void se_load_rom(const char *filename){
     mz_zip_archive zip = {0};
     mz_zip_zero_struct(&zip);
     if(mz_zip_reader_init_file(&zip, filename, 0)){
-      size_t total_files = mz_zip_reader_get_num_files(&zip);
-      for(size_t i=0;i<total_files;++i){
-        char file_name_buff[SB_FILE_PATH_SIZE];
-        uint8_t *file_data = NULL;
-        bool success= true;
-        mz_zip_reader_get_filename(&zip, i, file_name_buff, SB_FILE_PATH_SIZE);
-        file_name_buff[SB_FILE_PATH_SIZE-1]=0;
-        mz_zip_archive_file_stat stat={0};
-        success&= mz_zip_reader_file_stat(&zip,i, &stat);
-        success&= !stat.m_is_directory;
-        snprintf(emu_state.rom_path,sizeof(emu_state.rom_path),"%s/%s",filename,file_name_buff);
-        if(success){
-          file_data = (uint8_t *)malloc(stat.m_uncomp_size);
-          success&= mz_zip_reader_extract_to_mem(&zip,i,file_data, stat.m_uncomp_size,0);
-          if(!success){
-              if(zip.m_last_error==MZ_ZIP_UNSUPPORTED_METHOD)
-                  printf("Unsupported compression method, supported: deflate\n");
-              free(file_data);
+      mz_zip_archive_file_stat stat={0};
+      int entry = se_find_zip_rom_entry(&zip,&stat);
+      if(entry<0)printf("No ROM found in zip\n");
+      else{
+        snprintf(emu->rom_path,sizeof(emu->rom_path),"%s/%s",filename,stat.m_filename);
+        se_zip_extract_t* extract = &se_zip_extract;
+        uint64_t data_offset = 0;
+        if(extract->data&&strncmp(extract->rom_path,emu->rom_path,SB_FILE_PATH_SIZE)==0){
+          // Already decompressed in the background
+          emu->rom_data = extract->data;
+          emu->rom_size = extract->size;
+          extract->data = NULL;
+        }else if(se_zip_stored_data_offset(&zip,&stat,&data_offset)&&
+                 (inst->rom_map = se_map_file_data(filename,&inst->rom_map_size))){
+          if(data_offset+stat.m_uncomp_size<=inst->rom_map_size){
+            printf("Mapping stored zip entry %s\n",stat.m_filename);
+            emu->rom_data = inst->rom_map+data_offset;
+            emu->rom_size = stat.m_uncomp_size;
           }else{
-              emu_state.rom_size = stat.m_uncomp_size;
-              emu_state.rom_data = file_data;
+            se_unmap_file_data(inst->rom_map,inst->rom_map_size);
+            inst->rom_map = NULL;
           }
         }
-        if(success)se_load_rom_from_emu_state(&emu_state);
-        if(emu_state.rom_loaded)break;
+        if(!emu->rom_data){
+          uint8_t* file_data = se_instance_alloc_rom_data(inst,stat.m_filename,stat.m_uncomp_size);
+          if(file_data&&mz_zip_reader_extract_to_mem(&zip,entry,file_data, stat.m_uncomp_size,0)){
+            emu->rom_size = stat.m_uncomp_size;
+            emu->rom_data = file_data;
+          }else{
+            if(zip.m_last_error==MZ_ZIP_UNSUPPORTED_METHOD)
+                printf("Unsupported compression method, supported: deflate\n");
+            sb_arena_reset(&inst->rom_arena);
+          }
+        }
+        se_instance_apply_rom_patch(inst,filename);
+        se_instance_load_rom_data(inst);
       }
       mz_zip_reader_end(&zip);
     }else printf("Failed to read zip\n");
 
+  }else if(sb_path_has_file_ext(filename,".ndsz")){
+    if(se_instance_open_rom_ndsz(inst))se_instance_load_rom_data(inst);
   }else{
-    emu_state.rom_data = sb_load_file_data(emu_state.rom_path, &emu_state.rom_size);
-    se_load_rom_from_emu_state(&emu_state);
+    // Large NDS ROMs are paged in as the game reads them instead of being copied up front
+    emu->rom_data = se_map_file_data(emu->rom_path, &emu->rom_size);
+    if(emu->rom_data){
+      inst->rom_map = emu->rom_data;
+      inst->rom_map_size = emu->rom_size;
+    }
+    // Patched ROMs have to be in memory
+    char patch_path[SB_FILE_PATH_SIZE];
+    bool patched = se_find_rom_patch(filename,patch_path)!=0;
+    if(!emu->rom_data&&(patched||!se_instance_open_rom_stream(inst)))emu->rom_data = se_instance_load_rom_file(inst,emu->rom_path, &emu->rom_size);
+    se_instance_apply_rom_patch(inst,filename);
+    se_instance_load_rom_data(inst);
+  }
+  return emu->rom_loaded;
+}
+// One profile per line: the key and then name=value pairs, unknown names are ignored so older
+// builds can read newer files. Lines starting with # are comments. For example:
+//   ABCE instant_card=0 cpu_slice=64 arm9_idle_loop=0x02001234
+//   0123456789abcdef idle_loop_skip=1 threaded_ppu=1 rewind_interval=16
+// Entries are only added once a game was verified with them.
+static const char* se_bundled_game_profiles =
+  "# key idle_loop_skip instant_card threaded_ppu cpu_slice rewind_interval arm9_idle_loop arm7_idle_loop\n";
+// Applies the lines of text whose key is key, later lines override earlier ones
+static void se_parse_game_profiles(const char* text, const char* key, se_game_profile_t* profile){
+  size_t key_len = strlen(key);
+  while(key_len&&text&&*text){
+    const char* end = strchr(text,'\n');
+    size_t len = end? end-text: strlen(text);
+    const char* line = text;
+    text = end? end+1: NULL;
+    if(len<=key_len||strncmp(line,key,key_len)!=0||!isspace((unsigned char)line[key_len]))continue;
+    snprintf(profile->key,sizeof(profile->key),"%s",key);
+    for(size_t i=key_len;i<len;){
+      while(i<len&&isspace((unsigned char)line[i]))++i;
+      char pair[64];
+      size_t n = 0;
+      while(i<len&&!isspace((unsigned char)line[i])){
+        if(n+1<sizeof(pair))pair[n++] = line[i];
+        ++i;
+      }
+      pair[n] = '\0';
+      char* value = strchr(pair,'=');
+      if(!value)continue;
+      *value++ = '\0';
+      long v = strtol(value,NULL,0);
+      if(strcmp(pair,"idle_loop_skip")==0)profile->idle_loop_skip = v!=0;
+      else if(strcmp(pair,"instant_card")==0)profile->instant_card = v!=0;
+      else if(strcmp(pair,"threaded_ppu")==0)profile->threaded_ppu = v!=0;
+      else if(strcmp(pair,"cpu_slice")==0)profile->cpu_slice_cycles = v>0? v: 0;
+      else if(strcmp(pair,"rewind_interval")==0)profile->rewind_interval = v>0? v: 0;
+      else if(strcmp(pair,"arm9_idle_loop")==0)profile->idle_loop_pc[0] = strtoul(value,NULL,0);
+      else if(strcmp(pair,"arm7_idle_loop")==0)profile->idle_loop_pc[1] = strtoul(value,NULL,0);
+    }
+  }
+}
+// Looks the loaded ROM up by its game code and checksum, the checksum wins when both match
+static void se_load_game_profile(){
+  se_game_profile_t* profile = &gui_state.game_profile;
+  *profile = (se_game_profile_t){.idle_loop_skip=-1,.instant_card=-1,.threaded_ppu=-1};
+  sb_emu_state_t* emu = &gui_instance.emu_state;
+  char game_code[5]={0}, checksum[17];
+  snprintf(checksum,sizeof(checksum),"%016llx",(unsigned long long)emu->game_checksum);
+  uint64_t code_offset = emu->system==SYSTEM_NDS? 0x0c: emu->system==SYSTEM_GBA? 0xac: 0;
+  if(code_offset&&emu->rom_size>=code_offset+4){
+    if(emu->rom_data)memcpy(game_code,emu->rom_data+code_offset,4);
+    else if(emu->rom_read&&!emu->rom_read(emu->rom_read_user_data,code_offset,game_code,4))game_code[0]='\0';
+    for(int i=0;i<4;++i)if(!isalnum((unsigned char)game_code[i]))game_code[0]='\0';
+  }
+  char path[SB_FILE_PATH_SIZE];
+  snprintf(path,SB_FILE_PATH_SIZE,"%sgame_profiles.txt",se_get_pref_path());
+  size_t size = 0;
+  uint8_t* data = sb_load_file_data(path,&size);
+  char* user = data? (char*)realloc(data,size+1): NULL;
+  if(user)user[size] = '\0';
+  else sb_free_file_data(data);
+  const char* keys[2]={game_code,checksum};
+  for(int k=0;k<2;++k){
+    se_parse_game_profiles(se_bundled_game_profiles,keys[k],profile);
+    se_parse_game_profiles(user,keys[k],profile);
   }
-  if(emu_state.rom_loaded==false){
+  free(user);
+  if(profile->key[0])printf("Applied game profile %s\n",profile->key);
+  memcpy(emu->idle_loop_hint_pc,profile->idle_loop_pc,sizeof(emu->idle_loop_hint_pc));
+}
+void se_load_rom(const char *filename){
+  se_link_disconnect();
+  se_spectate_stop();
+  se_video_stop();
+  se_reset_rewind_buffer(&gui_instance.rewind_buffer);
+  se_reset_save_states();
+  se_reset_cheats();
+  gui_state.editing_cheat_index = -1;
+  memset(gui_state.cpu_watch,0,sizeof(gui_state.cpu_watch));
+  se_reset_bios_info();
+  // The screens recorded for LCD only frames belong to the previous system
+  gui_state.ui_dirty = true;
+  gui_instance.emu_state.force_dmg_mode=gui_state.settings.force_dmg_mode;
+  //Compute Save File Path
+  {
+    char *save_file=gui_instance.emu_state.save_file_path; 
+    save_file[0] = '\0';
+    const char* base, *c, *ext; 
+    sb_breakup_path(filename,&base, &c, &ext);
+  #if defined(EMSCRIPTEN)
+      if(sb_path_has_file_ext(filename,".sav")||sb_path_has_file_ext(filename,".code")){
+        if(strncmp(filename,gui_state.recently_loaded_games[0].path,SB_FILE_PATH_SIZE)!=0){
+          return se_load_rom(gui_state.recently_loaded_games[0].path);
+        }
+        return;
+      }
+      snprintf(gui_instance.emu_state.save_data_base_path, SB_FILE_PATH_SIZE,"/offline/%s", c);
+  #else
+      se_join_path(gui_instance.emu_state.save_data_base_path, SB_FILE_PATH_SIZE, base, c, NULL);
+  #endif
+    snprintf(save_file, SB_FILE_PATH_SIZE, "%s.sav",gui_instance.emu_state.save_data_base_path);
+    if(!sb_file_exists(save_file)){
+      const char* base, *c, *ext; 
+      sb_breakup_path(filename,&base, &c, &ext);
+      char tmp_path[SB_FILE_PATH_SIZE];
+      se_join_path(tmp_path,SB_FILE_PATH_SIZE,gui_state.paths.save,c,".sav");
+
+      if(sb_file_exists(tmp_path)||gui_state.settings.save_to_path){
+        se_join_path(gui_instance.emu_state.save_data_base_path,SB_FILE_PATH_SIZE,gui_state.paths.save,c,NULL);
+        strncpy(save_file,tmp_path,SB_FILE_PATH_SIZE);
+      }
+    }
+  }
+  //Compute Cheat Code File Path
+  {
+    char *cheat_path=gui_state.cheat_path; 
+    cheat_path[0] = '\0';
+    const char* base, *c, *ext; 
+    sb_breakup_path(filename,&base, &c, &ext);
+    snprintf(cheat_path, SB_FILE_PATH_SIZE, "%s.code",gui_instance.emu_state.save_data_base_path);
+    if(!sb_file_exists(cheat_path)){
+      const char* base, *c, *ext; 
+      sb_breakup_path(filename,&base, &c, &ext);
+      char tmp_path[SB_FILE_PATH_SIZE];
+      se_join_path(tmp_path,SB_FILE_PATH_SIZE,gui_state.paths.cheat_codes,c,".code");
+      if(sb_file_exists(tmp_path)||gui_state.settings.save_to_path){
+        strncpy(cheat_path,tmp_path,SB_FILE_PATH_SIZE);
+      }
+    }
+    se_load_cheats(cheat_path);
+  }
+  //Load debug symbols if the ROM was built with any
+  {
+    memset(gui_state.pc_profile,0,sizeof(gui_state.pc_profile));
+    se_free_symbols(&gui_state.symbols);
+    const char* base, *c, *ext; 
+    sb_breakup_path(filename,&base, &c, &ext);
+    const char* sym_exts[]={".elf",".sym",".map"};
+    for(int i=0;i<sizeof(sym_exts)/sizeof(sym_exts[0]);++i){
+      char tmp_path[SB_FILE_PATH_SIZE];
+      se_join_path(tmp_path,SB_FILE_PATH_SIZE,base,c,sym_exts[i]);
+      if(sb_file_exists(tmp_path)&&se_load_symbols(&gui_state.symbols,tmp_path))break;
+    }
+  }
+  se_instance_load_rom(&gui_instance,filename);
+  if(gui_instance.emu_state.rom_loaded==false){
     printf("ERROR: failed to load ROM: %s\n", filename);
-    emu_state.run_mode= SB_MODE_PAUSE;
+    gui_instance.emu_state.run_mode= SB_MODE_PAUSE;
   }else{
-    emu_state.run_mode= SB_MODE_RUN;
-    emu_state.step_frames = 1; 
+    gui_instance.emu_state.run_mode= SB_MODE_RUN;
+    gui_instance.emu_state.step_frames = 1; 
     se_game_info_t * recent_games=gui_state.recently_loaded_games;
     //Create a copy in case file name comes from one of these slots that will be modified. 
     char temp_filename[SB_FILE_PATH_SIZE];
@@ -2502,94 +5923,175 @@ void se_load_rom(const char *filename){
     }
     se_save_recent_games_list();
   }
+  // Slot writes of the previous game may still be pending
+  se_flush_state_slot_writes();
   for(int i=0;i<SE_NUM_SAVE_STATES;++i){
     save_states[i].valid=false;
     char save_state_path[SB_FILE_PATH_SIZE];
-    snprintf(save_state_path,SB_FILE_PATH_SIZE,"%s.slot%d.state.png",emu_state.save_data_base_path,i);
+    snprintf(save_state_path,SB_FILE_PATH_SIZE,"%s.slot%d.state.png",gui_instance.emu_state.save_data_base_path,i);
     se_load_state_from_disk(save_states+i,save_state_path);
     if(!save_states[i].valid){
       const char* base, *file,*ext;
-      sb_breakup_path(emu_state.save_data_base_path,&base,&file,&ext);
+      sb_breakup_path(gui_instance.emu_state.save_data_base_path,&base,&file,&ext);
       snprintf(save_state_path,SB_FILE_PATH_SIZE,"%s%s.slot%d.state.png",gui_state.paths.save,file,i);
       se_load_state_from_disk(save_states+i,save_state_path);
     }
   }
-  emu_state.game_checksum = cloud_drive_hash((const char*)emu_state.rom_data,emu_state.rom_size);
+  gui_instance.emu_state.game_checksum = se_instance_rom_checksum(&gui_instance);
+  se_load_game_profile();
   se_sync_cloud_save_states();
   #ifdef ENABLE_RETRO_ACHIEVEMENTS
   gui_state.ra_needs_reload=true;
+  gui_state.ra_hash_started=false;
+  // Identification starts with the game instead of blocking its first frame
+  if(rc_client_get_user_info(retro_achievements_get_client()))se_ra_start_hash();
   #endif
 }
 static void se_reset_core(){
-  if(emu_state.rom_loaded==false)return; 
+  if(gui_instance.emu_state.rom_loaded==false)return; 
   se_load_rom(gui_state.recently_loaded_games[0].path);
 }
-static bool se_write_save_to_disk(const char* path){
-  bool saved = false;
-  if(emu_state.system== SYSTEM_GB){
-    if(core.gb.cart.ram_is_dirty){
-      saved=true;
-      if(sb_save_file_data(path,core.gb.cart.ram_data,core.gb.cart.ram_size)){
-      }else printf("Failed to write out save file: %s\n",path);
-      core.gb.cart.ram_is_dirty=false;
-    }
-  }else if(emu_state.system ==SYSTEM_GBA){
-    if(core.gba.cart.backup_is_dirty){
-      int size = 0; 
-      switch(core.gba.cart.backup_type){
-        case GBA_BACKUP_NONE       : size = 0;       break;
-        case GBA_BACKUP_EEPROM     : size = 8*1024;  break;
-        case GBA_BACKUP_EEPROM_512B: size = 512;     break;
-        case GBA_BACKUP_EEPROM_8KB : size = 8*1024;  break;
-        case GBA_BACKUP_SRAM       : size = 32*1024; break;
-        case GBA_BACKUP_FLASH_64K  : size = 64*1024; break;
-        case GBA_BACKUP_FLASH_128K : size = 128*1024;break;
-      }
-      if(size){
-        saved =true;
-        if(sb_save_file_data(path,core.gba.mem.cart_backup,size)){
-        }else printf("Failed to write out save file: %s\n",path);
-      }
-      core.gba.cart.backup_is_dirty=false;
-    }
-  }else if(emu_state.system ==SYSTEM_NDS){
-    if(core.nds.backup.is_dirty){
-      int size = nds_get_save_size(&core.nds);
-      if(size){
-        saved =true;
-        if(sb_save_file_data(path,core.nds.mem.save_data,size)){
-        }else printf("Failed to write out save file: %s\n",path);
-      }
-      core.nds.backup.is_dirty=false;
-    }
-  }
-  return saved;
-}
-static bool se_sync_save_to_disk(){return se_write_save_to_disk(emu_state.save_file_path);}
+// Returns the battery backed memory of the instance and the flag the core sets when it changes
+static uint8_t* se_instance_save_data(se_instance_t* inst, size_t* size, bool** dirty){
+  *size = 0;
+  *dirty = NULL;
+  if(inst->emu_state.system== SYSTEM_GB){
+    *dirty = &inst->core.gb.cart.ram_is_dirty;
+    *size = inst->core.gb.cart.ram_size;
+    return inst->core.gb.cart.ram_data;
+  }else if(inst->emu_state.system ==SYSTEM_GBA){
+    *dirty = &inst->core.gba.cart.backup_is_dirty;
+    switch(inst->core.gba.cart.backup_type){
+      case GBA_BACKUP_NONE       : *size = 0;       break;
+      case GBA_BACKUP_EEPROM     : *size = 8*1024;  break;
+      case GBA_BACKUP_EEPROM_512B: *size = 512;     break;
+      case GBA_BACKUP_EEPROM_8KB : *size = 8*1024;  break;
+      case GBA_BACKUP_SRAM       : *size = 32*1024; break;
+      case GBA_BACKUP_FLASH_64K  : *size = 64*1024; break;
+      case GBA_BACKUP_FLASH_128K : *size = 128*1024;break;
+    }
+    return inst->core.gba.mem.cart_backup;
+  }else if(inst->emu_state.system ==SYSTEM_NDS){
+    *dirty = &inst->core.nds.backup.is_dirty;
+    *size = nds_get_save_size(&inst->core.nds);
+    return inst->core.nds.mem.save_data;
+  }
+  return NULL;
+}
+static void se_save_writer_job(void* user_data, int job_index){
+  se_save_writer_t* w = (se_save_writer_t*)user_data;
+  uint64_t start_tick = stm_now();
+  bool success = false;
+  if(w->rewrite){
+    // Written next to the save and renamed over it so a crash never leaves a torn save
+    char tmp_path[SB_FILE_PATH_SIZE+8];
+    snprintf(tmp_path,sizeof(tmp_path),"%s.tmp",w->path);
+    if(sb_save_file_data(tmp_path,w->shadow,w->size)){
+#ifdef _WIN32
+      remove(w->path);
+#endif
+      success = rename(tmp_path,w->path)==0;
+      if(!success)printf("Failed to replace save file: %s\n",w->path);
+    }
+  }else{
+    FILE* f = fopen(w->path,"r+b");
+    if(f){
+      success = true;
+      for(uint32_t i=0;i<w->num_dirty_pages;++i){
+        size_t offset = (size_t)w->dirty_pages[i]*SE_SAVE_PAGE_SIZE;
+        size_t size = SE_MIN_CONST(w->size-offset,SE_SAVE_PAGE_SIZE);
+        success&= fseek(f,offset,SEEK_SET)==0&&fwrite(w->shadow+offset,1,size,f)==size;
+      }
+      success&= fflush(f)==0;
+      fclose(f);
+    }
+    if(success)printf("Saved: %s (%u changed pages)\n",w->path,w->num_dirty_pages);
+  }
+  if(!success)printf("Failed to write out save file: %s\n",w->path);
+  else se_emscripten_flush_fs(w->path);
+  w->failed = !success;
+  se_metrics_observe(&se_metrics.save_write_time,se_metrics_save_buckets,stm_sec(stm_since(start_tick)));
+  if(!success)se_metrics_add(&se_metrics.save_write_failures,1);
+}
+// Queues a write of the changed parts of the save on SE_ASYNC_SAVE_FILE. Returns false if nothing
+// was queued; a dirty save is kept dirty while the previous write is still running.
+static bool se_instance_write_save(se_instance_t* inst, const char* path){
+  size_t size = 0;
+  bool* dirty = NULL;
+  uint8_t* data = se_instance_save_data(inst,&size,&dirty);
+  se_save_writer_t* w = &inst->save_writer;
+  if(!dirty||!(*dirty||w->failed)||job_pool_async_busy(SE_ASYNC_SAVE_FILE))return false;
+  *dirty = false;
+  // Only the range the NDS backup chip wrote to needs to be compared against the shadow
+  size_t scan_start = 0, scan_end = size;
+  if(inst->emu_state.system==SYSTEM_NDS){
+    nds_card_backup_t* back = &inst->core.nds.backup;
+    if(back->dirty_start<back->dirty_end){
+      scan_start = back->dirty_start/SE_SAVE_PAGE_SIZE*SE_SAVE_PAGE_SIZE;
+      scan_end = SE_MIN_CONST(back->dirty_end,size);
+    }
+    back->dirty_start = back->dirty_end = 0;
+  }
+  if(!size||!data)return false;
+  if(strncmp(w->path,path,SB_FILE_PATH_SIZE)!=0||w->size!=size||!w->shadow){
+    size_t pages = (size+SE_SAVE_PAGE_SIZE-1)/SE_SAVE_PAGE_SIZE;
+    uint8_t* shadow = (uint8_t*)realloc(w->shadow,size);
+    uint32_t* dirty_pages = (uint32_t*)realloc(w->dirty_pages,pages*sizeof(uint32_t));
+    if(shadow)w->shadow = shadow;
+    if(dirty_pages)w->dirty_pages = dirty_pages;
+    if(!shadow||!dirty_pages){
+      printf("Out of memory for the save file writer\n");
+      *dirty = true;
+      return false;
+    }
+    strncpy(w->path,path,SB_FILE_PATH_SIZE-1);
+    w->path[SB_FILE_PATH_SIZE-1]='\0';
+    w->size = size;
+    w->rewrite = true;
+  }
+  if(w->failed||!sb_file_exists(path))w->rewrite = true;
+  w->failed = false;
+  w->num_dirty_pages = 0;
+  if(w->rewrite)memcpy(w->shadow,data,size);
+  else{
+    for(size_t offset=scan_start;offset<scan_end;offset+=SE_SAVE_PAGE_SIZE){
+      size_t page_size = SE_MIN_CONST(size-offset,SE_SAVE_PAGE_SIZE);
+      if(memcmp(w->shadow+offset,data+offset,page_size)==0)continue;
+      memcpy(w->shadow+offset,data+offset,page_size);
+      w->dirty_pages[w->num_dirty_pages++] = offset/SE_SAVE_PAGE_SIZE;
+    }
+    if(w->num_dirty_pages==0)return false;
+  }
+  job_pool_run_async(SE_ASYNC_SAVE_FILE,se_save_writer_job,w);
+  w->rewrite = false;
+  return true;
+}
+static bool se_write_save_to_disk(const char* path){return se_instance_write_save(&gui_instance,path);}
+static bool se_sync_save_to_disk(){return se_write_save_to_disk(gui_instance.emu_state.save_file_path);}
 //Returns offset into savestate where bess info can be found
 static uint32_t se_save_best_effort_state(se_core_state_t* state){
-  if(emu_state.system==SYSTEM_GB)return sb_save_best_effort_state(&state->gb);
-  if(emu_state.system==SYSTEM_GBA)return gba_save_best_effort_state(&state->gba);
-  if(emu_state.system==SYSTEM_NDS)return nds_save_best_effort_state(&state->nds);
+  if(gui_instance.emu_state.system==SYSTEM_GB)return sb_save_best_effort_state(&state->gb);
+  if(gui_instance.emu_state.system==SYSTEM_GBA)return gba_save_best_effort_state(&state->gba);
+  if(gui_instance.emu_state.system==SYSTEM_NDS)return nds_save_best_effort_state(&state->nds);
   return -1; 
 }
 static bool se_load_best_effort_state(se_core_state_t* state,uint8_t *save_state_data, uint32_t size, uint32_t bess_offset){
-  if(emu_state.system==SYSTEM_GB)return sb_load_best_effort_state(&state->gb,save_state_data,size,bess_offset);
-  if(emu_state.system==SYSTEM_GBA)return gba_load_best_effort_state(&state->gba,save_state_data,size,bess_offset);
-  if(emu_state.system==SYSTEM_NDS)return nds_load_best_effort_state(&state->nds,save_state_data,size,bess_offset);
+  if(gui_instance.emu_state.system==SYSTEM_GB)return sb_load_best_effort_state(&state->gb,save_state_data,size,bess_offset);
+  if(gui_instance.emu_state.system==SYSTEM_GBA)return gba_load_best_effort_state(&state->gba,save_state_data,size,bess_offset);
+  if(gui_instance.emu_state.system==SYSTEM_NDS)return nds_load_best_effort_state(&state->nds,save_state_data,size,bess_offset);
   return false;
 }
 static double se_get_sim_fps(){
   double sim_fps=1.0;
-  if(emu_state.system==SYSTEM_GB)sim_fps = 59.727;
-  else if(emu_state.system == SYSTEM_GBA) sim_fps = 59.727;
-  else if(emu_state.system == SYSTEM_NDS) sim_fps = 59.8261;
+  if(gui_instance.emu_state.system==SYSTEM_GB)sim_fps = 59.727;
+  else if(gui_instance.emu_state.system == SYSTEM_GBA) sim_fps = 59.727;
+  else if(gui_instance.emu_state.system == SYSTEM_NDS) sim_fps = 59.8261;
   return sim_fps;
 }
 static size_t se_get_core_size(){
-  if(emu_state.system==SYSTEM_GB)return sizeof(core.gb);
-  else if(emu_state.system == SYSTEM_GBA) return sizeof(core.gba);
-  else if(emu_state.system == SYSTEM_NDS) return sizeof(core.nds);
+  if(gui_instance.emu_state.system==SYSTEM_GB)return sizeof(gui_instance.core.gb);
+  else if(gui_instance.emu_state.system == SYSTEM_GBA) return sizeof(gui_instance.core.gba);
+  else if(gui_instance.emu_state.system == SYSTEM_NDS) return sizeof(gui_instance.core.nds);
   return 0; 
 }
 typedef struct{
@@ -2600,8 +6102,8 @@ typedef struct{
   bool is_grayscale;
 }se_lcd_info_t;
 se_lcd_info_t se_get_lcd_info(){
-  if(emu_state.system==SYSTEM_GB){
-    if(core.gb.model==SB_GBC){
+  if(gui_instance.emu_state.system==SYSTEM_GB){
+    if(gui_instance.core.gb.model==SB_GBC){
       return (se_lcd_info_t){
         .red_color  ={26./32,0./32.,6./32.},
         .green_color={4./32,24/32.,4./32.},
@@ -2617,7 +6119,7 @@ se_lcd_info_t se_get_lcd_info(){
         .is_grayscale = true
       };
     }
-  }else if(emu_state.system == SYSTEM_GBA){
+  }else if(gui_instance.emu_state.system == SYSTEM_GBA){
     if(gui_state.settings.gba_color_correction_mode==GBA_HIGAN_CORRECTION){
       return (se_lcd_info_t){
         .red_color  ={1,0.039,0.196},
@@ -2640,87 +6142,1118 @@ se_lcd_info_t se_get_lcd_info(){
     .gamma = 2.2
   };
 }
-static void se_emulate_single_frame(){
-  if(emu_state.system == SYSTEM_GB){
-    if(gui_state.test_runner_mode){
-      uint8_t palette[4*3] = { 0xff,0xff,0xff,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x00,0x00,0x00 };
-      for(int i=0;i<12;++i)core.gb.dmg_palette[i]=palette[i];
+// Emits the per subsystem core time of the last tick as trace counters
+static void se_trace_core_profile(const sb_profile_t* p){
+#ifdef SE_ENABLE_PROFILER
+  static const char* names[SB_PROFILE_COUNT]={"Core PPU ns","Core Audio ns","Core DMA ns","Core GX ns"};
+  static sb_profile_t last;
+  // The profile restarts every SE_PROFILE_WINDOW_FRAMES
+  if(p->frames<last.frames)memset(&last,0,sizeof(last));
+  for(int i=0;i<SB_PROFILE_COUNT;++i)trace_counter(names[i],p->ns[i]-last.ns[i]);
+  trace_counter("Core Instructions",p->counters[SB_COUNTER_INSTRUCTIONS]-last.counters[SB_COUNTER_INSTRUCTIONS]);
+  last=*p;
+#endif
+}
+// Emulates one frame of the instance
+static void se_instance_tick(se_instance_t* inst){
+  sb_emu_state_t* emu = &inst->emu_state;
+  trace_begin("Core Tick");
+  uint64_t start_tick = stm_now();
+  if(emu->system == SYSTEM_GB){
+    memcpy(inst->core.gb.dmg_palette,inst->dmg_palette,sizeof(inst->dmg_palette));
+    sb_tick(emu,&inst->core.gb, &inst->scratch.gb);
+  }
+  else if(emu->system == SYSTEM_GBA)gba_tick(emu, &inst->core.gba, &inst->scratch.gba);
+  else if(emu->system == SYSTEM_NDS){
+    inst->scratch.nds.job_dispatch = inst->job_dispatch;
+    inst->scratch.nds.job_start = inst->job_start;
+    inst->scratch.nds.hires.enabled = inst==&gui_instance&&se_nds_3d_scale()>1;
+    nds_tick(emu, &inst->core.nds, &inst->scratch.nds);
+  }
+  emu->profile.core_ns+=stm_ns(stm_since(start_tick));
+  emu->profile.frames++;
+  trace_end();
+  if(inst==&gui_instance&&trace_active())se_trace_core_profile(&emu->profile);
+}
+// Thread pool dispatch for the cores that names their jobs in traces
+typedef struct{
+  sb_job_fn_t job;
+  void* user_data;
+  const char* name;
+}se_traced_job_t;
+static void se_run_traced_job(void* user_data, int job_index){
+  se_traced_job_t* j = (se_traced_job_t*)user_data;
+  trace_begin(j->name);
+  j->job(j->user_data,job_index);
+  trace_end();
+}
+static void se_job_dispatch(sb_job_fn_t job, void* user_data, int num_jobs){
+  if(!trace_active()){
+    job_pool_run(job,user_data,num_jobs);
+    return;
+  }
+  se_traced_job_t j = {job,user_data,"Core Job"};
+  if(job==nds_gpu_render_band)j.name="NDS 3D Raster Band";
+  else if(job==nds_ppu_render_job)j.name="NDS PPU Scanline";
+  job_pool_run(se_run_traced_job,&j,num_jobs);
+}
+static void se_job_start(sb_job_fn_t job, void* user_data){
+  job_pool_run_async(SE_ASYNC_NDS_ARM7,job,user_data);
+}
+static void se_tick_core(){
+  if(!gui_state.test_runner_mode){
+    for(int i=0;i<4;++i){
+      uint32_t v = gui_state.settings.gb_palette[i];
+      gui_instance.dmg_palette[i*3+0]=SB_BFE(v,0,8);
+      gui_instance.dmg_palette[i*3+1]=SB_BFE(v,8,8);
+      gui_instance.dmg_palette[i*3+2]=SB_BFE(v,16,8);
+    }
+  }
+  if(se_spectate_tick())return;
+  if(!se_link_tick())se_instance_tick(&gui_instance);
+}
+static void se_instance_init(se_instance_t* inst){
+  static const uint8_t palette[4*3] = { 0xff,0xff,0xff,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x00,0x00,0x00 };
+  memcpy(inst->dmg_palette,palette,sizeof(palette));
+  inst->emu_state.joy.solar_sensor=0.5;
+  // Build the tables the cores share up front so instances ticked on other threads only read them
+  arm7_init_lookup_tables();
+  nds_init_rom_database_index();
+  if(!sb_resampler_filter_ready)sb_resampler_init_filter();
+}
+// Headless instances emulate every frame as fast as they are ticked and don't touch the frontend
+// state, saves, cheats or rewind.
+se_instance_t* se_instance_create(){
+  se_instance_t* inst = (se_instance_t*)se_alloc_huge(sizeof(se_instance_t));
+  if(!inst){
+    printf("Failed to allocate emulator instance\n");
+    return NULL;
+  }
+  se_instance_init(inst);
+  return inst;
+}
+void se_instance_destroy(se_instance_t* inst){
+  if(!inst)return;
+  se_instance_unload_rom(inst);
+  // The writer may still be using the shadow copy
+  job_pool_wait_async(SE_ASYNC_SAVE_FILE);
+  free(inst->save_writer.shadow);
+  free(inst->save_writer.dirty_pages);
+  se_core_rewind_buffer_t* rewind = &inst->rewind_buffer;
+  se_reset_rewind_buffer(rewind);
+  free(rewind->txs);
+  se_free_huge(rewind->capture,sizeof(se_core_state_t));
+  free(rewind->staging);
+  free(rewind->compress_buffer);
+  free(inst->run_ahead_core);
+  sb_arena_free(&inst->rom_arena);
+  se_free_huge(inst,sizeof(se_instance_t));
+}
+// Emulates one frame with the given inputs and renders it into the instance framebuffer
+void se_instance_run_frame(se_instance_t* inst, const sb_joy_t* joy){
+  sb_emu_state_t* emu = &inst->emu_state;
+  if(!emu->rom_loaded)return;
+  if(joy)emu->joy = *joy;
+  emu->render_frame = true;
+  se_instance_tick(inst);
+  emu->prev_frame_joy = emu->joy;
+}
+// Link cable and netplay sessions of gui_instance. The second console runs in a headless instance
+// and both are ticked in lockstep, taking turns whenever a core yields at a transfer boundary.
+// Netplay runs both consoles on both machines and only exchanges their input: the local console
+// gets the local input after the input delay, the remote one the latest input received from the
+// peer, and frames emulated with a wrong prediction are rolled back once the real input arrives.
+#define SE_LINK_MAX_SLICES 65536 // Turns per frame before giving up on linked cores that keep yielding
+#define SE_NETPLAY_MAGIC 0x504e4b53u // "SKNP"
+#define SE_NETPLAY_WINDOW 16 // Frames that can be rolled back
+#define SE_NETPLAY_INPUT_RING 64
+#define SE_NETPLAY_PACKET_INPUTS 32
+#define SE_NETPLAY_MAX_DELAY 8
+typedef struct{
+  uint32_t magic;
+  int32_t ack; // Last frame of the receiver's input the sender has, -1 for none
+  int32_t first_frame;
+  uint32_t num_inputs;
+  uint32_t inputs[SE_NETPLAY_PACKET_INPUTS];
+}se_netplay_packet_t;
+typedef struct{
+  netplay_socket_t socket; // NULL when netplay isn't running
+  int delay;
+  int64_t frame; // Next frame to emulate
+  int64_t remote_frame; // Every remote input up to this frame was received
+  int64_t remote_ack; // Every local input up to this frame reached the peer
+  int64_t rollback_frame; // First frame emulated with a wrong prediction, -1 for none
+  uint32_t local_inputs[SE_NETPLAY_INPUT_RING];
+  uint32_t remote_inputs[SE_NETPLAY_INPUT_RING];
+  uint32_t used_remote_inputs[SE_NETPLAY_INPUT_RING]; // Remote input each frame was emulated with
+  uint8_t* states[SE_NETPLAY_WINDOW][2]; // Start of the frame for each link port
+  uint64_t rollbacks;
+  uint64_t stalls;
+}se_netplay_t;
+typedef struct{
+  sb_link_t cable;
+  se_instance_t* peer; // NULL while the cable is unplugged
+  char peer_rom_path[SB_FILE_PATH_SIZE];
+  se_netplay_t netplay;
+}se_link_session_t;
+se_link_session_t se_link = {0};
+
+// Ticks each instance until it finished its frame
+static void se_link_run_frame(se_instance_t** insts, int count){
+  bool done[SB_LINK_MAX_PORTS]={0};
+  int remaining = count;
+  for(int slice=0;remaining&&slice<SE_LINK_MAX_SLICES;++slice){
+    for(int i=0;i<count;++i){
+      if(done[i])continue;
+      insts[i]->emu_state.link_yield = false;
+      se_instance_tick(insts[i]);
+      if(!insts[i]->emu_state.link_yield){done[i]=true;--remaining;}
+    }
+  }
+  for(int i=0;i<count;++i)insts[i]->emu_state.link_yield = false;
+}
+// Both instances in port order, so every machine of a netplay session ticks them the same way
+static void se_link_instances(se_instance_t* insts[2]){
+  bool gui_first = gui_instance.emu_state.link_port==0;
+  insts[0] = gui_first? &gui_instance: se_link.peer;
+  insts[1] = gui_first? se_link.peer: &gui_instance;
+}
+static void se_link_peer_frame_done(){
+  sb_emu_state_t* emu = &se_link.peer->emu_state;
+  // Nothing plays the second console's audio
+  sb_ring_buffer_consume(&emu->audio_ring_buff,sb_ring_buffer_size(&emu->audio_ring_buff));
+  emu->prev_frame_joy = emu->joy;
+}
+static void se_link_disconnect(){
+  se_netplay_t* np = &se_link.netplay;
+  if(np->socket){
+    netplay_close(np->socket);
+    np->socket = NULL;
+    for(int i=0;i<SE_NETPLAY_WINDOW;++i)for(int p=0;p<2;++p){free(np->states[i][p]);np->states[i][p]=NULL;}
+    printf("Netplay stopped after %lld frames, %llu rollbacks\n",(long long)np->frame,(unsigned long long)np->rollbacks);
+  }
+  if(se_link.peer){
+    job_pool_wait_async(SE_ASYNC_SAVE_FILE);
+    se_instance_write_save(se_link.peer,se_link.peer->emu_state.save_file_path);
+    se_instance_destroy(se_link.peer);
+    se_link.peer = NULL;
+    printf("Link cable unplugged\n");
+  }
+  gui_instance.emu_state.link = NULL;
+  gui_instance.emu_state.link_port = 0;
+}
+// Plugs a second console running rom_path into gui_instance. The second console loads the save
+// file next to its ROM and writes it back when the cable is unplugged.
+static bool se_link_connect(const char* rom_path){
+  se_link_disconnect();
+  // Spectators only receive the input of gui_instance
+  se_spectate_stop();
+  int system = gui_instance.emu_state.system;
+  if(!gui_instance.emu_state.rom_loaded||(system!=SYSTEM_GB&&system!=SYSTEM_GBA)){
+    printf("The link cable needs a GB or GBA game to be running\n");
+    return false;
+  }
+  se_instance_t* peer = se_instance_create();
+  if(!peer)return false;
+  const char* base, *file, *ext;
+  sb_breakup_path(rom_path,&base,&file,&ext);
+  se_join_path(peer->emu_state.save_file_path,SB_FILE_PATH_SIZE,base,file,".sav");
+  peer->emu_state.force_dmg_mode = gui_instance.emu_state.force_dmg_mode;
+  peer->emu_state.audio_disabled = true;
+  if(!se_instance_load_rom(peer,rom_path)||peer->emu_state.system!=system){
+    printf("Failed to load a %s game for the linked console: %s\n",system==SYSTEM_GB?"GB":"GBA",rom_path);
+    se_instance_destroy(peer);
+    return false;
+  }
+  strncpy(se_link.peer_rom_path,rom_path,SB_FILE_PATH_SIZE-1);
+  se_link.peer_rom_path[SB_FILE_PATH_SIZE-1]='\0';
+  memset(&se_link.cable,0,sizeof(se_link.cable));
+  se_link.cable.port[0].connected = se_link.cable.port[1].connected = true;
+  se_link.peer = peer;
+  gui_instance.emu_state.link = peer->emu_state.link = &se_link.cable;
+  gui_instance.emu_state.link_port = 0;
+  peer->emu_state.link_port = 1;
+  printf("Linked with a second console running %s\n",rom_path);
+  return true;
+}
+static bool se_netplay_active(){return se_link.netplay.socket!=NULL;}
+// Packs the buttons (bits 0-13) and the solar sensor (bits 16-23)
+static uint32_t se_netplay_pack_input(const sb_joy_t* joy){
+  uint32_t input = 0;
+  for(int i=0;i<=SE_KEY_PEN_DOWN;++i)input|=(joy->inputs[i]>0.5)<<i;
+  float solar = joy->solar_sensor;
+  if(!(solar>0))solar = 0;
+  if(solar>1)solar = 1;
+  return input|((uint32_t)(solar*255+0.5)<<16);
+}
+static void se_netplay_unpack_input(uint32_t input, sb_joy_t* joy){
+  memset(joy,0,sizeof(*joy));
+  for(int i=0;i<=SE_KEY_PEN_DOWN;++i)joy->inputs[i]=SB_BFE(input,i,1);
+  joy->solar_sensor = SB_BFE(input,16,8)/255.f;
+}
+static void se_netplay_send(){
+  se_netplay_t* np = &se_link.netplay;
+  se_netplay_packet_t packet = {SE_NETPLAY_MAGIC};
+  int64_t last = np->frame+np->delay;
+  int64_t first = SE_MAX_CONST(np->remote_ack+1,last-SE_NETPLAY_PACKET_INPUTS+1);
+  if(first<0)first = 0;
+  packet.ack = np->remote_frame;
+  packet.first_frame = first;
+  for(int64_t f=first;f<=last;++f)packet.inputs[packet.num_inputs++]=np->local_inputs[f%SE_NETPLAY_INPUT_RING];
+  netplay_send(np->socket,&packet,sizeof(packet));
+}
+static void se_netplay_receive(){
+  se_netplay_t* np = &se_link.netplay;
+  se_netplay_packet_t packet;
+  while(netplay_recv(np->socket,&packet,sizeof(packet))==sizeof(packet)){
+    if(packet.magic!=SE_NETPLAY_MAGIC||packet.num_inputs>SE_NETPLAY_PACKET_INPUTS)continue;
+    if(packet.ack>np->remote_ack)np->remote_ack = packet.ack;
+    for(uint32_t i=0;i<packet.num_inputs;++i){
+      int64_t f = packet.first_frame+(int64_t)i;
+      // Inputs are only accepted in order so remote_frame never skips a frame
+      if(f!=np->remote_frame+1)continue;
+      uint32_t input = packet.inputs[i];
+      np->remote_inputs[f%SE_NETPLAY_INPUT_RING] = input;
+      np->remote_frame = f;
+      bool mispredicted = f<np->frame&&np->used_remote_inputs[f%SE_NETPLAY_INPUT_RING]!=input;
+      if(mispredicted&&(np->rollback_frame<0||f<np->rollback_frame))np->rollback_frame = f;
+    }
+  }
+}
+static void se_netplay_run_frame(int64_t frame, bool render){
+  se_netplay_t* np = &se_link.netplay;
+  se_instance_t* insts[2];
+  se_link_instances(insts);
+  size_t core_size = se_get_core_size();
+  for(int p=0;p<2;++p)memcpy(np->states[frame%SE_NETPLAY_WINDOW][p],&insts[p]->core,core_size);
+  uint32_t remote = 0;
+  if(frame<=np->remote_frame)remote = np->remote_inputs[frame%SE_NETPLAY_INPUT_RING];
+  else if(np->remote_frame>=0)remote = np->remote_inputs[np->remote_frame%SE_NETPLAY_INPUT_RING];
+  np->used_remote_inputs[frame%SE_NETPLAY_INPUT_RING] = remote;
+  se_netplay_unpack_input(np->local_inputs[frame%SE_NETPLAY_INPUT_RING],&gui_instance.emu_state.joy);
+  se_netplay_unpack_input(remote,&se_link.peer->emu_state.joy);
+  gui_instance.emu_state.render_frame = render;
+  se_link.peer->emu_state.render_frame = false;
+  se_link_run_frame(insts,2);
+  se_link_peer_frame_done();
+}
+static void se_netplay_tick(){
+  se_netplay_t* np = &se_link.netplay;
+  se_netplay_receive();
+  sb_joy_t live_joy = gui_instance.emu_state.joy;
+  bool render = gui_instance.emu_state.render_frame;
+  if(np->rollback_frame>=0){
+    se_instance_t* insts[2];
+    se_link_instances(insts);
+    size_t core_size = se_get_core_size();
+    for(int p=0;p<2;++p)memcpy(&insts[p]->core,np->states[np->rollback_frame%SE_NETPLAY_WINDOW][p],core_size);
+    // The audio of those frames was already queued
+    uint32_t audio_write_ptr = gui_instance.emu_state.audio_ring_buff.write_ptr;
+    for(int64_t f=np->rollback_frame;f<np->frame;++f)se_netplay_run_frame(f,false);
+    gui_instance.emu_state.audio_ring_buff.write_ptr = audio_write_ptr;
+    np->rollback_frame = -1;
+    np->rollbacks++;
+  }
+  // Too far ahead of the peer to roll back, wait for its input
+  if(np->frame-np->remote_frame>=SE_NETPLAY_WINDOW){
+    np->stalls++;
+    se_netplay_send();
+    return;
+  }
+  np->local_inputs[(np->frame+np->delay)%SE_NETPLAY_INPUT_RING] = se_netplay_pack_input(&live_joy);
+  se_netplay_send();
+  se_netplay_run_frame(np->frame,render);
+  np->frame++;
+  gui_instance.emu_state.joy = live_joy;
+  gui_instance.emu_state.render_frame = render;
+}
+// Both consoles restart from power on so both machines begin from the same state. The host is
+// player one and plays the console on link port 0.
+static bool se_netplay_start(int local_port, const char* remote_host, int remote_port, int delay){
+  if(!se_link.peer){
+    printf("Netplay needs a linked console, see --link\n");
+    return false;
+  }
+  se_netplay_t* np = &se_link.netplay;
+  if(np->socket){
+    netplay_close(np->socket);
+    np->socket = NULL;
+  }
+  size_t core_size = se_get_core_size();
+  for(int i=0;i<SE_NETPLAY_WINDOW;++i)for(int p=0;p<2;++p){
+    if(!np->states[i][p])np->states[i][p] = (uint8_t*)malloc(core_size);
+    if(!np->states[i][p]){
+      printf("Out of memory for the netplay rollback states\n");
+      return false;
+    }
+  }
+  netplay_socket_t socket = netplay_open(local_port,remote_host,remote_port);
+  if(!socket)return false;
+  if(!se_instance_load_rom(&gui_instance,gui_state.recently_loaded_games[0].path)||
+     !se_instance_load_rom(se_link.peer,se_link.peer_rom_path)){
+    netplay_close(socket);
+    se_link_disconnect();
+    return false;
+  }
+  bool host = remote_host==NULL;
+  gui_instance.emu_state.link_port = host? 0: 1;
+  se_link.peer->emu_state.link_port = host? 1: 0;
+  memset(&se_link.cable.port,0,sizeof(se_link.cable.port));
+  se_link.cable.port[0].connected = se_link.cable.port[1].connected = true;
+  np->socket = socket;
+  np->delay = delay<0? 0: delay>SE_NETPLAY_MAX_DELAY? SE_NETPLAY_MAX_DELAY: delay;
+  np->frame = 0;
+  np->remote_frame = np->remote_ack = np->rollback_frame = -1;
+  np->rollbacks = np->stalls = 0;
+  memset(np->local_inputs,0,sizeof(np->local_inputs));
+  memset(np->remote_inputs,0,sizeof(np->remote_inputs));
+  printf("Netplay %s on port %d with %d frames of input delay\n",host?"hosting":"joining",host?local_port:remote_port,np->delay);
+  return true;
+}
+// Splits an address given as "host:port"
+static bool se_split_address(const char* address, char* host, size_t host_size, int* port){
+  const char* colon = strrchr(address,':');
+  if(!colon||colon==address||colon-address>=(ptrdiff_t)host_size){
+    printf("Address must be host:port: %s\n",address);
+    return false;
+  }
+  memcpy(host,address,colon-address);
+  host[colon-address]='\0';
+  *port = atoi(colon+1);
+  return true;
+}
+static bool se_netplay_join(const char* address, int delay){
+  char host[256];
+  int port = 0;
+  if(!se_split_address(address,host,sizeof(host),&port))return false;
+  return se_netplay_start(0,host,port,delay);
+}
+// Returns false when gui_instance isn't linked and should be ticked on its own
+static bool se_link_tick(){
+  if(!se_link.peer)return false;
+  if(se_netplay_active()){
+    se_netplay_tick();
+    return true;
+  }
+  se_instance_t* insts[2];
+  se_link_instances(insts);
+  se_link.peer->emu_state.render_frame = false;
+  se_link_run_frame(insts,2);
+  se_link_peer_frame_done();
+  return true;
+}
+// Spectating: a broadcaster serves the input of every frame of gui_instance to any number of
+// spectators, which emulate the game themselves instead of receiving video. Keyframes of the core
+// are captured every SE_SPECTATE_KEYFRAME_FRAMES frames and after discontinuities like loading a
+// state; spectators join from the full compressed keyframe and afterwards only fetch the compressed
+// block diff against the previous one, which puts them back in sync if they diverged. Spectators
+// pull everything over UDP, so the broadcaster keeps no per spectator state and lost packets are
+// simply requested again.
+#define SE_SPECTATE_MAGIC 0x50534b53u // "SKSP"
+#define SE_SPECTATE_KEYFRAME_FRAMES 600
+#define SE_SPECTATE_INPUT_RING 4096
+#define SE_SPECTATE_PACKET_RUNS 64
+#define SE_SPECTATE_CHUNK_SIZE 1024
+#define SE_SPECTATE_CHUNK_WINDOW 32 // Chunks requested per UI frame while downloading a keyframe
+#define SE_SPECTATE_POLL_FRAMES 4 // UI frames between input requests
+#define SE_SPECTATE_CATCH_UP_FRAMES 30 // Received frames at which the spectator emulates faster
+#define SE_SPECTATE_CATCH_UP_SPEED 4
+#define SE_SPECTATE_HELLO 1
+#define SE_SPECTATE_INPUTS 2
+#define SE_SPECTATE_CHUNK 3
+#define SE_SPECTATE_FULL 0
+#define SE_SPECTATE_DELTA 1
+typedef struct{
+  uint32_t buttons; // See se_netplay_pack_input
+  float touch_pos[2];
+}se_spectate_input_t;
+typedef struct{
+  se_spectate_input_t input;
+  uint32_t count; // Consecutive frames with this input
+}se_spectate_run_t;
+typedef struct{
+  uint32_t id; // Counts up from 1 with every keyframe
+  uint32_t full_size; // Compressed sizes, there is no delta for the first keyframe
+  uint32_t delta_size;
+  uint32_t padding;
+  int64_t frame; // The state is the start of this frame
+}se_spectate_keyframe_info_t;
+typedef struct{
+  se_spectate_keyframe_info_t info;
+  uint8_t* full;
+  uint8_t* delta; // se_core_delta_t headers each followed by the new data, from keyframe id-1
+}se_spectate_keyframe_t;
+typedef struct{
+  uint32_t magic;
+  uint32_t type;
+  int64_t frame; // SE_SPECTATE_INPUTS: first frame wanted
+  uint32_t keyframe; // SE_SPECTATE_CHUNK: id, kind and byte offset of the chunk
+  uint32_t kind;
+  uint32_t offset;
+  uint32_t padding;
+}se_spectate_request_t;
+typedef struct{
+  uint32_t magic;
+  uint32_t type;
+  se_spectate_keyframe_info_t keyframe; // Latest published keyframe
+  union{
+    struct{
+      uint64_t game_checksum;
+      uint32_t system;
+      uint32_t core_size;
+      char build[41];
+    }hello;
+    struct{
+      int64_t first_frame;
+      uint32_t num_runs;
+      uint32_t padding;
+      se_spectate_run_t runs[SE_SPECTATE_PACKET_RUNS];
+    }inputs;
+    struct{
+      uint32_t id;
+      uint32_t kind;
+      uint32_t offset;
+      uint32_t size;
+      uint8_t data[SE_SPECTATE_CHUNK_SIZE];
+    }chunk;
+  };
+}se_spectate_reply_t;
+typedef struct{
+  netplay_socket_t socket; // NULL when spectating isn't running
+  bool host;
+  size_t core_size;
+  int64_t frame; // Next frame to emulate
+  se_spectate_input_t inputs[SE_SPECTATE_INPUT_RING];
+  // Broadcaster: capture is the core at the start of the pending keyframe, base the previous keyframe
+  uint8_t* capture;
+  uint8_t* base;
+  bool has_base;
+  bool force_keyframe; // Set by discontinuities
+  int64_t next_keyframe_frame;
+  uint32_t next_keyframe_id;
+  se_spectate_keyframe_t keyframe; // Latest published keyframe
+  se_spectate_keyframe_t pending; // Compressed on SE_ASYNC_SPECTATE, published once done
+  // Spectator: base is the latest applied keyframe
+  bool greeted; // The broadcaster runs the same build and game
+  bool joined;
+  bool keyframe_due; // The applied keyframe replaces the core when frame reaches applied_frame
+  int64_t received_frame; // Inputs up to this frame were received
+  se_spectate_keyframe_info_t remote_keyframe; // Latest keyframe announced by the broadcaster
+  uint32_t applied_keyframe;
+  int64_t applied_frame;
+  uint8_t* download;
+  uint8_t* chunk_received;
+  uint32_t download_id, download_kind, download_size, chunks_missing, chunk_cursor;
+  int64_t download_frame;
+  int poll_timer;
+  uint64_t resyncs; // Keyframes that found the spectator's core had diverged
+  uint64_t stalls;
+}se_spectate_t;
+se_spectate_t se_spectate = {0};
+
+static bool se_spectate_active(){return se_spectate.socket!=NULL;}
+static bool se_spectate_watching(){return se_spectate.socket&&!se_spectate.host;}
+static void se_spectate_free_keyframe(se_spectate_keyframe_t* kf){
+  free(kf->full);
+  free(kf->delta);
+  memset(kf,0,sizeof(*kf));
+}
+static void se_spectate_free_download(){
+  se_spectate_t* sp = &se_spectate;
+  free(sp->download);
+  free(sp->chunk_received);
+  sp->download = sp->chunk_received = NULL;
+  sp->download_id = sp->chunks_missing = 0;
+}
+static void se_spectate_stop(){
+  se_spectate_t* sp = &se_spectate;
+  if(!sp->socket)return;
+  job_pool_wait_async(SE_ASYNC_SPECTATE);
+  netplay_close(sp->socket);
+  if(sp->host)printf("Stopped broadcasting to spectators after %lld frames\n",(long long)sp->frame);
+  else printf("Stopped spectating after %lld frames, %llu resyncs\n",(long long)sp->frame,(unsigned long long)sp->resyncs);
+  se_spectate_free_keyframe(&sp->keyframe);
+  se_spectate_free_keyframe(&sp->pending);
+  se_spectate_free_download();
+  free(sp->capture);
+  free(sp->base);
+  memset(sp,0,sizeof(*sp));
+}
+// Loading a state, rewinding or seeking the execution trace, the broadcaster sends a new keyframe
+static void se_spectate_discontinuity(){
+  if(se_spectate.socket&&se_spectate.host)se_spectate.force_keyframe = true;
+}
+// Returns a malloc'd copy of data compressed with miniz or NULL on failure
+static uint8_t* se_spectate_compress(const void* data, size_t size, uint32_t* compressed_size){
+  mz_ulong comp_size = mz_compressBound(size);
+  uint8_t* out = (uint8_t*)malloc(comp_size);
+  if(!out)return NULL;
+  if(mz_compress2(out,&comp_size,(const uint8_t*)data,size,MZ_BEST_SPEED)!=MZ_OK){
+    free(out);
+    return NULL;
+  }
+  *compressed_size = comp_size;
+  return out;
+}
+static void se_spectate_keyframe_job(void* user_data, int job_index){
+  se_spectate_t* sp = (se_spectate_t*)user_data;
+  se_spectate_keyframe_t* kf = &sp->pending;
+  kf->full = se_spectate_compress(sp->capture,sp->core_size,&kf->info.full_size);
+  if(sp->has_base){
+    // Same diff as rewind pushes, whole unchanged blocks are skipped before comparing segments
+    uint8_t* deltas = NULL;
+    size_t delta_size = 0, capacity = 0;
+    bool failed = false;
+    for(size_t block=0;block<sp->core_size&&!failed;block+=SE_REWIND_BLOCK_SIZE){
+      size_t block_end = SE_MIN_CONST(block+SE_REWIND_BLOCK_SIZE,sp->core_size);
+      if(se_rewind_block_equal(sp->capture+block,sp->base+block,block_end-block))continue;
+      for(size_t s=block;s<block_end;s+=SE_REWIND_SEGMENT_SIZE){
+        uint32_t size = SE_MIN_CONST(SE_REWIND_SEGMENT_SIZE,block_end-s);
+        if(memcmp(sp->capture+s,sp->base+s,size)==0)continue;
+        if(delta_size+sizeof(se_core_delta_t)+size>capacity){
+          capacity = SE_MAX_CONST(capacity*2,64*1024);
+          uint8_t* grown = (uint8_t*)realloc(deltas,capacity);
+          if(!grown){failed = true;break;}
+          deltas = grown;
+        }
+        se_core_delta_t header = {(uint32_t)s,size};
+        memcpy(deltas+delta_size,&header,sizeof(header));
+        memcpy(deltas+delta_size+sizeof(header),sp->capture+s,size);
+        delta_size+=sizeof(header)+size;
+      }
+    }
+    // Without a delta spectators fall back to the full keyframe
+    if(!failed&&delta_size)kf->delta = se_spectate_compress(deltas,delta_size,&kf->info.delta_size);
+    free(deltas);
+  }
+  memcpy(sp->base,sp->capture,sp->core_size);
+  sp->has_base = true;
+}
+static void se_spectate_capture_keyframe(){
+  se_spectate_t* sp = &se_spectate;
+  job_pool_wait_async(SE_ASYNC_SPECTATE);
+  // A keyframe that wasn't published yet is replaced, its id is skipped so spectators take the full state
+  se_spectate_free_keyframe(&sp->pending);
+  memcpy(sp->capture,&gui_instance.core,sp->core_size);
+  sp->pending.info.id = ++sp->next_keyframe_id;
+  sp->pending.info.frame = sp->frame;
+  sp->force_keyframe = false;
+  sp->next_keyframe_frame = sp->frame+SE_SPECTATE_KEYFRAME_FRAMES;
+  job_pool_run_async(SE_ASYNC_SPECTATE,se_spectate_keyframe_job,sp);
+}
+static void se_spectate_pack_input(const sb_joy_t* joy, se_spectate_input_t* input){
+  input->buttons = se_netplay_pack_input(joy);
+  input->touch_pos[0] = joy->touch_pos[0];
+  input->touch_pos[1] = joy->touch_pos[1];
+}
+static void se_spectate_unpack_input(const se_spectate_input_t* input, sb_joy_t* joy){
+  se_netplay_unpack_input(input->buttons,joy);
+  joy->touch_pos[0] = input->touch_pos[0];
+  joy->touch_pos[1] = input->touch_pos[1];
+}
+// The core of the spectator is replaced by the applied keyframe, inputs after it are replayed
+static void se_spectate_restore_keyframe(){
+  se_spectate_t* sp = &se_spectate;
+  memcpy(&gui_instance.core,sp->base,sp->core_size);
+  sp->frame = sp->applied_frame;
+  if(!sp->joined||sp->received_frame-sp->frame>=SE_SPECTATE_INPUT_RING)sp->received_frame = sp->frame-1;
+  sp->keyframe_due = false;
+  if(!sp->joined)printf("Spectating from frame %lld\n",(long long)sp->frame);
+  sp->joined = true;
+}
+static bool se_spectate_frame_ready(){
+  se_spectate_t* sp = &se_spectate;
+  if(!sp->joined||sp->frame>sp->received_frame)return false;
+  // A keyframe at or before this frame has to be applied first
+  return sp->remote_keyframe.id==sp->applied_keyframe||sp->remote_keyframe.frame>sp->frame;
+}
+// Records the input of the broadcaster or emulates the spectator. Returns true when the frame was
+// handled, spectators never emulate frames they have no input for.
+static bool se_spectate_tick(){
+  se_spectate_t* sp = &se_spectate;
+  if(!sp->socket)return false;
+  if(sp->host){
+    if(sp->force_keyframe||sp->frame>=sp->next_keyframe_frame)se_spectate_capture_keyframe();
+    se_spectate_pack_input(&gui_instance.emu_state.joy,sp->inputs+sp->frame%SE_SPECTATE_INPUT_RING);
+    sp->frame++;
+    return false;
+  }
+  sb_joy_t live_joy = gui_instance.emu_state.joy;
+  bool render = gui_instance.emu_state.render_frame;
+  int frames = sp->received_frame-sp->frame>SE_SPECTATE_CATCH_UP_FRAMES? SE_SPECTATE_CATCH_UP_SPEED: 1;
+  for(int i=0;i<frames;++i){
+    if(!se_spectate_frame_ready()){
+      sp->stalls++;
+      break;
+    }
+    if(sp->keyframe_due&&sp->frame==sp->applied_frame){
+      if(memcmp(&gui_instance.core,sp->base,sp->core_size)){
+        memcpy(&gui_instance.core,sp->base,sp->core_size);
+        sp->resyncs++;
+      }
+      sp->keyframe_due = false;
+    }
+    se_spectate_unpack_input(sp->inputs+sp->frame%SE_SPECTATE_INPUT_RING,&gui_instance.emu_state.joy);
+    gui_instance.emu_state.render_frame = render&&i==frames-1;
+    se_instance_tick(&gui_instance);
+    sp->frame++;
+  }
+  gui_instance.emu_state.joy = live_joy;
+  gui_instance.emu_state.render_frame = render;
+  return true;
+}
+static void se_spectate_serve(){
+  se_spectate_t* sp = &se_spectate;
+  if(sp->pending.info.id&&!job_pool_async_busy(SE_ASYNC_SPECTATE)){
+    if(sp->pending.full){
+      se_spectate_free_keyframe(&sp->keyframe);
+      sp->keyframe = sp->pending;
+      memset(&sp->pending,0,sizeof(sp->pending));
     }else{
-      for(int i=0;i<4;++i){
-        uint32_t v = gui_state.settings.gb_palette[i];
-        core.gb.dmg_palette[i*3+0]=SB_BFE(v,0,8);
-        core.gb.dmg_palette[i*3+1]=SB_BFE(v,8,8);
-        core.gb.dmg_palette[i*3+2]=SB_BFE(v,16,8);
+      printf("Failed to compress the spectator keyframe\n");
+      se_spectate_free_keyframe(&sp->pending);
+    }
+  }
+  // Inputs from the pending keyframe on would run ahead of the state spectators can get
+  int64_t last_frame = (sp->pending.info.id? sp->pending.info.frame: sp->frame)-1;
+  se_spectate_request_t req;
+  se_spectate_reply_t reply;
+  while(netplay_recv(sp->socket,&req,sizeof(req))==sizeof(req)){
+    if(req.magic!=SE_SPECTATE_MAGIC)continue;
+    reply.magic = SE_SPECTATE_MAGIC;
+    reply.type = req.type;
+    reply.keyframe = sp->keyframe.info;
+    size_t size = offsetof(se_spectate_reply_t,hello);
+    if(req.type==SE_SPECTATE_HELLO){
+      memset(&reply.hello,0,sizeof(reply.hello));
+      reply.hello.game_checksum = gui_instance.emu_state.game_checksum;
+      reply.hello.system = gui_instance.emu_state.system;
+      reply.hello.core_size = sp->core_size;
+      se_emu_id emu_id = se_get_emu_id();
+      memcpy(reply.hello.build,emu_id.build,sizeof(reply.hello.build));
+      size+=sizeof(reply.hello);
+    }else if(req.type==SE_SPECTATE_INPUTS){
+      int64_t first = SE_MAX_CONST(req.frame,sp->frame-SE_SPECTATE_INPUT_RING);
+      if(first<0)first = 0;
+      uint32_t n = 0;
+      for(int64_t f=first;f<=last_frame;++f){
+        const se_spectate_input_t* input = sp->inputs+f%SE_SPECTATE_INPUT_RING;
+        if(n&&memcmp(&reply.inputs.runs[n-1].input,input,sizeof(*input))==0){reply.inputs.runs[n-1].count++;continue;}
+        if(n==SE_SPECTATE_PACKET_RUNS)break;
+        reply.inputs.runs[n].input = *input;
+        reply.inputs.runs[n++].count = 1;
       }
+      reply.inputs.first_frame = first;
+      reply.inputs.num_runs = n;
+      reply.inputs.padding = 0;
+      size = offsetof(se_spectate_reply_t,inputs.runs)+n*sizeof(se_spectate_run_t);
+    }else if(req.type==SE_SPECTATE_CHUNK){
+      // Requests for an older keyframe get an empty chunk, the header tells about the new one
+      const se_spectate_keyframe_t* kf = &sp->keyframe;
+      const uint8_t* data = req.kind==SE_SPECTATE_DELTA? kf->delta: kf->full;
+      uint32_t data_size = req.kind==SE_SPECTATE_DELTA? kf->info.delta_size: kf->info.full_size;
+      reply.chunk.id = kf->info.id;
+      reply.chunk.kind = req.kind;
+      reply.chunk.offset = req.offset;
+      reply.chunk.size = 0;
+      if(req.keyframe==kf->info.id&&data&&req.offset<data_size){
+        reply.chunk.size = SE_MIN_CONST(SE_SPECTATE_CHUNK_SIZE,data_size-req.offset);
+        memcpy(reply.chunk.data,data+req.offset,reply.chunk.size);
+      }
+      size = offsetof(se_spectate_reply_t,chunk.data)+reply.chunk.size;
+    }else continue;
+    // The socket replies to the sender of the last packet
+    netplay_send(sp->socket,&reply,size);
+  }
+}
+static void se_spectate_send(uint32_t type, int64_t frame, uint32_t keyframe, uint32_t kind, uint32_t offset){
+  se_spectate_request_t req = {SE_SPECTATE_MAGIC,type,frame,keyframe,kind,offset,0};
+  netplay_send(se_spectate.socket,&req,sizeof(req));
+}
+// Returns false if the keyframe could not be decompressed into base
+static bool se_spectate_apply_download(){
+  se_spectate_t* sp = &se_spectate;
+  if(sp->download_kind==SE_SPECTATE_FULL){
+    mz_ulong size = sp->core_size;
+    return mz_uncompress(sp->base,&size,sp->download,sp->download_size)==MZ_OK&&size==sp->core_size;
+  }
+  // The delta is at most the size of the core plus a header per segment
+  mz_ulong size = sp->core_size+sp->core_size/SE_REWIND_SEGMENT_SIZE*sizeof(se_core_delta_t)+sizeof(se_core_delta_t);
+  uint8_t* deltas = (uint8_t*)malloc(size);
+  bool ok = deltas&&mz_uncompress(deltas,&size,sp->download,sp->download_size)==MZ_OK;
+  for(size_t off=0;ok&&off<size;){
+    se_core_delta_t header;
+    if(size-off<sizeof(header)){ok = false;break;}
+    memcpy(&header,deltas+off,sizeof(header));
+    off+=sizeof(header);
+    if(header.size>size-off||header.offset+(uint64_t)header.size>sp->core_size){ok = false;break;}
+    memcpy(sp->base+header.offset,deltas+off,header.size);
+    off+=header.size;
+  }
+  free(deltas);
+  return ok;
+}
+static void se_spectate_receive_chunk(const se_spectate_reply_t* reply, size_t size){
+  se_spectate_t* sp = &se_spectate;
+  const uint32_t chunk = reply->chunk.offset/SE_SPECTATE_CHUNK_SIZE;
+  if(!sp->chunks_missing||reply->chunk.id!=sp->download_id||reply->chunk.kind!=sp->download_kind)return;
+  if(reply->chunk.offset%SE_SPECTATE_CHUNK_SIZE||reply->chunk.offset>=sp->download_size||sp->chunk_received[chunk])return;
+  uint32_t expected = SE_MIN_CONST(SE_SPECTATE_CHUNK_SIZE,sp->download_size-reply->chunk.offset);
+  if(reply->chunk.size!=expected||size<expected)return;
+  memcpy(sp->download+reply->chunk.offset,reply->chunk.data,expected);
+  sp->chunk_received[chunk] = true;
+  sp->chunks_missing--;
+}
+// Picks the delta when the spectator holds the keyframe before the announced one, otherwise the full state
+static void se_spectate_update_download(){
+  se_spectate_t* sp = &se_spectate;
+  const se_spectate_keyframe_info_t* kf = &sp->remote_keyframe;
+  if(!kf->id||kf->id==sp->applied_keyframe)return;
+  uint32_t kind = sp->joined&&kf->id==sp->applied_keyframe+1&&kf->delta_size? SE_SPECTATE_DELTA: SE_SPECTATE_FULL;
+  if(sp->download_id!=kf->id||sp->download_kind!=kind){
+    se_spectate_free_download();
+    uint32_t size = kind==SE_SPECTATE_DELTA? kf->delta_size: kf->full_size;
+    uint32_t chunks = (size+SE_SPECTATE_CHUNK_SIZE-1)/SE_SPECTATE_CHUNK_SIZE;
+    sp->download = (uint8_t*)malloc(size);
+    sp->chunk_received = (uint8_t*)calloc(chunks,1);
+    if(!size||!sp->download||!sp->chunk_received){
+      se_spectate_free_download();
+      return;
     }
-    sb_tick(&emu_state,&core.gb, &scratch.gb);
+    sp->download_id = kf->id;
+    sp->download_kind = kind;
+    sp->download_size = size;
+    sp->download_frame = kf->frame;
+    sp->chunks_missing = chunks;
+    sp->chunk_cursor = 0;
   }
-  else if(emu_state.system == SYSTEM_GBA)gba_tick(&emu_state, &core.gba, &scratch.gba);
-  else if(emu_state.system == SYSTEM_NDS)nds_tick(&emu_state, &core.nds, &scratch.nds);
+  if(sp->chunks_missing){
+    uint32_t chunks = (sp->download_size+SE_SPECTATE_CHUNK_SIZE-1)/SE_SPECTATE_CHUNK_SIZE;
+    // Lost chunks are requested again once the cursor comes around
+    for(uint32_t sent=0,i=0;sent<SE_SPECTATE_CHUNK_WINDOW&&i<chunks;++i){
+      uint32_t c = (sp->chunk_cursor+i)%chunks;
+      if(sp->chunk_received[c])continue;
+      se_spectate_send(SE_SPECTATE_CHUNK,0,sp->download_id,sp->download_kind,c*SE_SPECTATE_CHUNK_SIZE);
+      sp->chunk_cursor = c+1;
+      sent++;
+    }
+    return;
+  }
+  if(!se_spectate_apply_download()){
+    printf("Failed to decompress the spectator keyframe, downloading the full state\n");
+    sp->joined = false;
+    sp->applied_keyframe = 0;
+    se_spectate_free_download();
+    return;
+  }
+  sp->applied_keyframe = sp->download_id;
+  sp->applied_frame = sp->download_frame;
+  se_spectate_free_download();
+  sp->keyframe_due = true;
+  if(!sp->joined||sp->frame>sp->applied_frame)se_spectate_restore_keyframe();
+}
+static void se_spectate_watch(){
+  se_spectate_t* sp = &se_spectate;
+  se_spectate_reply_t reply;
+  size_t size;
+  while((size=netplay_recv(sp->socket,&reply,sizeof(reply)))>=offsetof(se_spectate_reply_t,hello)){
+    if(reply.magic!=SE_SPECTATE_MAGIC)continue;
+    if(reply.keyframe.id>sp->remote_keyframe.id)sp->remote_keyframe = reply.keyframe;
+    if(reply.type==SE_SPECTATE_HELLO&&size>=offsetof(se_spectate_reply_t,hello)+sizeof(reply.hello)&&!sp->greeted){
+      const char* error = NULL;
+      se_emu_id emu_id = se_get_emu_id();
+      reply.hello.build[sizeof(reply.hello.build)-1]='\0';
+      if(strcmp(reply.hello.build,emu_id.build))error = "runs a different SkyEmu build";
+      else if((int)reply.hello.system!=gui_instance.emu_state.system||reply.hello.game_checksum!=gui_instance.emu_state.game_checksum)error = "runs a different game";
+      else if(reply.hello.core_size!=sp->core_size)error = "has a different core size";
+      if(error){
+        printf("Can't spectate, the broadcaster %s\n",error);
+        se_spectate_stop();
+        return;
+      }
+      sp->greeted = true;
+    }else if(reply.type==SE_SPECTATE_INPUTS&&size>=offsetof(se_spectate_reply_t,inputs.runs)&&sp->joined){
+      uint32_t n = SE_MIN_CONST(reply.inputs.num_runs,(size-offsetof(se_spectate_reply_t,inputs.runs))/sizeof(se_spectate_run_t));
+      int64_t f = reply.inputs.first_frame;
+      // The broadcaster no longer has the inputs after the spectator's keyframe
+      if(f>sp->received_frame+1){
+        printf("Spectator fell behind, rejoining\n");
+        sp->joined = false;
+        sp->applied_keyframe = 0;
+        continue;
+      }
+      for(uint32_t r=0;r<n;++r)for(uint32_t c=0;c<reply.inputs.runs[r].count;++c,++f){
+        // Inputs are only accepted in order and while the ring has room for them
+        if(f!=sp->received_frame+1||f-sp->frame>=SE_SPECTATE_INPUT_RING)continue;
+        sp->inputs[f%SE_SPECTATE_INPUT_RING] = reply.inputs.runs[r].input;
+        sp->received_frame = f;
+      }
+    }else if(reply.type==SE_SPECTATE_CHUNK&&size>=offsetof(se_spectate_reply_t,chunk.data)){
+      se_spectate_receive_chunk(&reply,size-offsetof(se_spectate_reply_t,chunk.data));
+    }
+  }
+  if(!sp->socket)return;
+  if(sp->greeted)se_spectate_update_download();
+  if(--sp->poll_timer>0)return;
+  sp->poll_timer = SE_SPECTATE_POLL_FRAMES;
+  if(sp->greeted&&sp->joined)se_spectate_send(SE_SPECTATE_INPUTS,sp->received_frame+1,0,0,0);
+  else se_spectate_send(SE_SPECTATE_HELLO,0,0,0,0);
+}
+// Called once per UI frame while the emulation thread is idle
+static void se_spectate_update(){
+  if(!se_spectate.socket)return;
+  if(se_spectate.host)se_spectate_serve();
+  else se_spectate_watch();
+}
+static bool se_spectate_start(int local_port, const char* remote_host, int remote_port){
+  se_spectate_stop();
+  if(!gui_instance.emu_state.rom_loaded){
+    printf("Spectating needs a game to be running\n");
+    return false;
+  }
+  if(se_link.peer){
+    printf("Spectating doesn't support linked consoles\n");
+    return false;
+  }
+  se_spectate_t* sp = &se_spectate;
+  sp->core_size = se_get_core_size();
+  sp->base = (uint8_t*)malloc(sp->core_size);
+  if(!remote_host)sp->capture = (uint8_t*)malloc(sp->core_size);
+  sp->socket = sp->base&&(remote_host||sp->capture)? netplay_open(local_port,remote_host,remote_port): NULL;
+  if(!sp->socket){
+    free(sp->base);
+    free(sp->capture);
+    memset(sp,0,sizeof(*sp));
+    return false;
+  }
+  sp->host = remote_host==NULL;
+  sp->force_keyframe = true;
+  sp->received_frame = -1;
+  if(sp->host)printf("Broadcasting to spectators on port %d\n",local_port);
+  else printf("Joining the broadcast at %s:%d\n",remote_host,remote_port);
+  return true;
+}
+// Spectates a broadcaster given as "host:port", which has to run the same build and game
+static bool se_spectate_join(const char* address){
+  char host[256];
+  int port = 0;
+  if(!se_split_address(address,host,sizeof(host),&port))return false;
+  return se_spectate_start(0,host,port);
+}
+static void se_emulate_single_frame(){
+#ifdef ENABLE_RETRO_ACHIEVEMENTS
+  // Hardcore sessions have to start from power on with achievements active, so the core waits for
+  // the game to be identified. Softcore plays right away and activates the achievements later.
+  if(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in&&gui_state.ra_needs_reload&&
+     job_pool_async_busy(SE_ASYNC_RA_HASH))return;
+#endif
+#ifdef ENABLE_LUA_SCRIPTING
+  int prev_run_mode = gui_instance.emu_state.run_mode;
+#endif
+  bool debugger_open = gui_state.settings.draw_debug_menu&&!(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in);
+  for(int i=0;i<2;++i){
+    // Replays stop at the target instruction, not at the breakpoints on the way
+    gui_instance.emu_state.watch[i] = debugger_open&&!gui_state.time_travel.replaying? gui_state.cpu_watch+i: NULL;
+    gui_instance.emu_state.pc_profile[i] = debugger_open&&gui_state.pc_profile_enabled[i]? gui_state.pc_profile+i: NULL;
+  }
+  if(!debugger_open&&gui_state.time_travel.recording)se_time_travel_stop();
+  se_time_travel_begin_frame();
+  se_movie_begin_frame();
+  se_tick_core();
+  se_time_travel_end_frame();
 
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
   if (rc_client_get_user_info(retro_achievements_get_client())){
     if (gui_state.ra_needs_reload) {
-      rc_client_set_encore_mode_enabled(retro_achievements_get_client(), gui_state.ra_encore_mode);
-      rc_client_set_hardcore_enabled(retro_achievements_get_client(), gui_state.settings.hardcore_mode);
-      if (retro_achievements_load_game()) {
-        gui_state.ra_needs_reload = false;
+      if (!gui_state.ra_hash_started) se_ra_start_hash();
+      if (!job_pool_async_busy(SE_ASYNC_RA_HASH)) {
+        se_ra_build_memory_map();
+        rc_client_set_encore_mode_enabled(retro_achievements_get_client(), gui_state.ra_encore_mode);
+        rc_client_set_hardcore_enabled(retro_achievements_get_client(), gui_state.settings.hardcore_mode);
+        if (retro_achievements_load_game(gui_state.ra_hash)) {
+          gui_state.ra_needs_reload = false;
+        }
       }
     } else {
+      trace_begin("RetroAchievements Frame");
       retro_achievements_frame();
+      trace_end();
     }
   }
 #endif
-  se_run_all_ar_cheats(se_run_ar_cheat);
+  se_run_all_ar_cheats(se_run_ar_cheat,se_ar_cheat_compiler());
+  se_movie_end_frame();
+#ifdef ENABLE_LUA_SCRIPTING
+  se_lua_after_frame(prev_run_mode);
+#endif
+#ifdef ENABLE_HTTP_CONTROL_SERVER
+  if(gui_instance.emu_state.render_frame)hcs_notify_frame();
+  se_shm_publish_frame();
+#endif
 }
-static void se_screenshot(uint8_t * output_buffer, int * out_width, int * out_height){
+// Run-ahead hides the input lag of games that poll input late: the real frame is emulated without
+// being shown, then the following frames are emulated speculatively and only the last one is shown.
+// The single instance mode rolls the core back afterwards and drops the speculative audio, the
+// second instance mode runs the speculative frames on a copy of the core and leaves it untouched.
+// The speculative frames skip RetroAchievements processing.
+static void se_emulate_frame_with_run_ahead(int frames, bool second_instance){
+  se_instance_t* inst = &gui_instance;
+  // The speculative frames would advance the linked console and the spectator stream
+  bool supported = (inst->emu_state.system==SYSTEM_GB||inst->emu_state.system==SYSTEM_GBA)&&!se_link.peer&&!se_spectate_active();
+  // Rolling the core back would leave speculative instructions in the execution trace
+  if(gui_state.time_travel.recording)supported = false;
+  if(supported&&frames>0&&!inst->run_ahead_core)inst->run_ahead_core = (uint8_t*)malloc(SE_MAX_CONST(sizeof(sb_gb_t),sizeof(gba_t)));
+  if(!supported||frames<=0||!inst->run_ahead_core){
+    se_emulate_single_frame();
+    return;
+  }
+  bool render = inst->emu_state.render_frame;
+  inst->emu_state.render_frame = false;
+  se_emulate_single_frame();
+  size_t core_size = se_get_core_size();
+  memcpy(inst->run_ahead_core,&inst->core,core_size);
+  if(second_instance){
+    inst->run_ahead_emu = inst->emu_state;
+    inst->run_ahead_emu.audio_disabled = true;
+    // Speculative frames must not stop on breakpoints
+    inst->run_ahead_emu.watch[0] = inst->run_ahead_emu.watch[1] = NULL;
+    inst->run_ahead_emu.pc_profile[0] = inst->run_ahead_emu.pc_profile[1] = NULL;
+    inst->run_ahead_emu.exec_trace[0] = inst->run_ahead_emu.exec_trace[1] = NULL;
+    for(int i=0;i<frames;++i){
+      inst->run_ahead_emu.render_frame = render&&i==frames-1;
+      if(inst->emu_state.system==SYSTEM_GB)sb_tick(&inst->run_ahead_emu,(sb_gb_t*)inst->run_ahead_core,&inst->scratch.gb);
+      else gba_tick(&inst->run_ahead_emu,(gba_t*)inst->run_ahead_core,&inst->scratch.gba);
+    }
+  }else{
+    uint32_t audio_write_ptr = inst->emu_state.audio_ring_buff.write_ptr;
+    bool audio_disabled = inst->emu_state.audio_disabled;
+    inst->emu_state.audio_disabled = true;
+    for(int i=0;i<frames;++i){
+      inst->emu_state.render_frame = render&&i==frames-1;
+      se_tick_core();
+      se_run_all_ar_cheats(se_run_ar_cheat,se_ar_cheat_compiler());
+    }
+    memcpy(&inst->core,inst->run_ahead_core,core_size);
+    inst->emu_state.audio_ring_buff.write_ptr = audio_write_ptr;
+    inst->emu_state.audio_disabled = audio_disabled;
+  }
+  inst->emu_state.render_frame = render;
+}
+static void se_instance_screenshot(se_instance_t* inst, uint8_t * output_buffer, int * out_width, int * out_height){
   *out_height=*out_width=0;
   // output_bufer is always SE_MAX_SCREENSHOT_SIZE bytes. RGB8
-  if(emu_state.system==SYSTEM_GBA){
+  if(inst->emu_state.system==SYSTEM_GBA){
     *out_width = GBA_LCD_W;
     *out_height = GBA_LCD_H;
-    memcpy(output_buffer,scratch.gba.framebuffer,GBA_LCD_W*GBA_LCD_H*4);
-  }else if (emu_state.system==SYSTEM_NDS){
+    memcpy(output_buffer,inst->scratch.gba.framebuffer,GBA_LCD_W*GBA_LCD_H*4);
+  }else if (inst->emu_state.system==SYSTEM_NDS){
     *out_width = NDS_LCD_W;
     *out_height = NDS_LCD_H*2;
-    memcpy(output_buffer,scratch.nds.framebuffer_top,NDS_LCD_W*NDS_LCD_H*4);
-    memcpy(output_buffer+NDS_LCD_W*NDS_LCD_H*4,scratch.nds.framebuffer_bottom,NDS_LCD_W*NDS_LCD_H*4);
-  }else if (emu_state.system==SYSTEM_GB){
+    memcpy(output_buffer,inst->scratch.nds.framebuffer_top,NDS_LCD_W*NDS_LCD_H*4);
+    memcpy(output_buffer+NDS_LCD_W*NDS_LCD_H*4,inst->scratch.nds.framebuffer_bottom,NDS_LCD_W*NDS_LCD_H*4);
+  }else if (inst->emu_state.system==SYSTEM_GB){
     *out_width = SB_LCD_W;
     *out_height = SB_LCD_H;
-    memcpy(output_buffer,scratch.gb.framebuffer,SB_LCD_W*SB_LCD_H*4);
+    memcpy(output_buffer,inst->scratch.gb.framebuffer,SB_LCD_W*SB_LCD_H*4);
   }
   for(int i=3;i<SE_MAX_SCREENSHOT_SIZE;i+=4)output_buffer[i]=0xff;
 }
 typedef struct{
-  uint8_t *data;
+  uint8_t* data;
+  sg_image image;
   int im_width; 
   int im_height;
+  int lcd_width, lcd_height;
   int x;
   int y;
   int render_width;
   int render_height;
   float rotation;
   bool is_touch;
+  // Area of the touch screen, which is only part of the image when both NDS screens are drawn at once
+  int touch_x, touch_y;
+  int touch_width, touch_height;
+  // NDS layouts drawn by se_draw_nds_lcd, num_rects is 0 for a single screen
+  int num_rects;
+  float rects[3][4];
+  float rect_screen[3];
 }se_draw_lcd_callback_t;
+// Screens drawn by the last UI frame, replayed by LCD only frames
+#define SE_MAX_LCD_REPLAYS 4
+static se_draw_lcd_callback_t se_lcd_replays[SE_MAX_LCD_REPLAYS];
+static int se_num_lcd_replays = 0;
+static void se_draw_nds_lcd(sg_image image, int im_width, int im_height, int x, int y, int render_width, int render_height, float rotation, const float rects[3][4], const float rect_screen[3]);
+static void se_draw_lcd_call(const se_draw_lcd_callback_t* call){
+  if(call->num_rects)se_draw_nds_lcd(call->image,call->im_width,call->im_height,call->x,call->y,call->render_width,call->render_height,call->rotation,call->rects,call->rect_screen);
+  else se_draw_lcd(call->image,call->im_width,call->im_height,call->lcd_width,call->lcd_height,call->x,call->y,call->render_width,call->render_height,call->rotation);
+  if(call->is_touch)se_lcd_touch_input(call->touch_x,call->touch_y,call->touch_width,call->touch_height,call->rotation);
+}
 void se_draw_lcd_callback(const ImDrawList* parent_list, const ImDrawCmd* cmd){
   if(cmd->UserCallbackData==NULL)return;
   se_draw_lcd_callback_t *call = (se_draw_lcd_callback_t*)cmd->UserCallbackData;
-  se_draw_lcd(call->data,call->im_width,call->im_height,call->x,call->y,call->render_width,call->render_height,call->rotation,call->is_touch);
+  se_draw_lcd_call(call);
+  if(se_num_lcd_replays<SE_MAX_LCD_REPLAYS)se_lcd_replays[se_num_lcd_replays]=*call;
+  se_num_lcd_replays++;
   free(call);
 }
-void se_draw_lcd_defer(uint8_t *data, int im_width, int im_height,int x, int y, int render_width, int render_height, float rotation,bool is_touch){
+// Uploaded, ghosted and upscaled before the render pass the call is drawn in. Only images of the
+// pool get the GPU passes, their outputs are cached along their slot.
+static void se_upload_lcd(se_draw_lcd_callback_t* call){
+  int stream_slot = gui_state.stream_images_used;
+  call->image = se_stream_image(call->data,call->lcd_width<=0?1:call->lcd_width,call->lcd_height<=0?1:call->lcd_height);
+  call->im_width=call->lcd_width;
+  call->im_height=call->lcd_height;
+  if(stream_slot<SE_STREAM_IMAGE_SLOTS){
+    // The NDS 3D render replaces the upscaling passes
+    bool nds_3d = call->data==gui_instance.scratch.nds.framebuffer_full&&se_run_nds_3d(stream_slot,&call->image,&call->im_width,&call->im_height);
+    call->image = se_run_ghosting(stream_slot,call->image,call->im_width,call->im_height);
+    if(!nds_3d)call->image = se_run_shader_chain(stream_slot,call->image,&call->im_width,&call->im_height);
+  }
+}
+se_draw_lcd_callback_t* se_draw_lcd_defer(uint8_t *data, int im_width, int im_height,int x, int y, int render_width, int render_height, float rotation,bool is_touch){
+  if(!data)return NULL;
   se_draw_lcd_callback_t *call = (se_draw_lcd_callback_t*)malloc(sizeof(se_draw_lcd_callback_t));
   call->data = data;
-  call->im_width=im_width;
-  call->im_height=im_height;
+  call->lcd_width = im_width;
+  call->lcd_height = im_height;
+  se_upload_lcd(call);
   call->x = x;
   call->y = y;
   call->render_width=render_width;
   call->render_height=render_height;
   call->rotation=rotation;
   call->is_touch=is_touch;
+  call->touch_x = x;
+  call->touch_y = y;
+  call->touch_width = render_width;
+  call->touch_height = render_height;
+  call->num_rects = 0;
   ImDrawList_AddCallback(igGetWindowDrawList(),se_draw_lcd_callback,call);
+  return call;
+}
+// Both screens share one upload and one draw: the top and bottom framebuffers are contiguous in
+// the NDS scratch, so they are a single 256x384 image that the NDS compositor lays out in the
+// render box. The stacked layout shows the screens one above the other, the hybrid one adds a
+// large top screen on the left of a stacked column a third of the box wide.
+static void se_draw_nds_screens_defer(int x, int y, int render_width, int render_height, float rotation, bool is_touch, bool hybrid){
+  se_draw_lcd_callback_t* call = se_draw_lcd_defer(gui_instance.scratch.nds.framebuffer_full,NDS_LCD_W,NDS_LCD_H*2,x,y,render_width,render_height,rotation,is_touch);
+  if(!call)return;
+  // x, y, width, height in the box and the screen shown
+  static const float stacked[3][5]={{0,0,1,0.5,0},{0,0.5,1,0.5,1}};
+  static const float hybrid_rects[3][5]={{0,0,2./3.,1,0},{2./3.,0,1./3.,0.5,0},{2./3.,0.5,1./3.,0.5,1}};
+  const float (*layout)[5] = hybrid? hybrid_rects: stacked;
+  call->num_rects = hybrid? 3: 2;
+  for(int i=0;i<3;++i){
+    for(int c=0;c<4;++c)call->rects[i][c] = layout[i][c];
+    call->rect_screen[i] = layout[i][4];
+  }
+  // The bottom screen is the last rect, touch maps onto it rotated around the box center
+  const float* b = layout[call->num_rects-1];
+  float dx = (b[0]+b[2]*0.5-0.5)*render_width, dy = (b[1]+b[3]*0.5-0.5)*render_height;
+  call->touch_x = x+round(dx*cos(-rotation)+dy*sin(-rotation));
+  call->touch_y = y+round(-dx*sin(-rotation)+dy*cos(-rotation));
+  call->touch_width = b[2]*render_width;
+  call->touch_height = b[3]*render_height;
 }
 static void se_draw_emulated_system_screen(bool preview){
   int lcd_render_x = 0, lcd_render_y = 0; 
@@ -2739,8 +7272,8 @@ static void se_draw_emulated_system_screen(bool preview){
   bool hybrid_nds=false; 
   float lcd_aspect = SB_LCD_H/(float)SB_LCD_W;
   bool touch_controller_active = gui_state.last_touch_time>=0||gui_state.settings.auto_hide_touch_controls==false;
-  if(emu_state.system==SYSTEM_GBA){native_w = GBA_LCD_W; native_h = GBA_LCD_H;}
-  else if(emu_state.system==SYSTEM_NDS){
+  if(gui_instance.emu_state.system==SYSTEM_GBA){native_w = GBA_LCD_W; native_h = GBA_LCD_H;}
+  else if(gui_instance.emu_state.system==SYSTEM_NDS){
     native_w = NDS_LCD_W; native_h = NDS_LCD_H*2;
     if(scr_w/scr_h>1&&!touch_controller_active){
       native_w = NDS_LCD_W+NDS_LCD_W*0.5;
@@ -2786,7 +7319,7 @@ static void se_draw_emulated_system_screen(bool preview){
   int controller_h = fmin(scr_h,scr_w*0.8); 
   int controller_y_pad = 0; 
   if(touch_controller_active){
-    if(emu_state.system==SYSTEM_NDS && (gui_state.settings.screen_rotation==0)){
+    if(gui_instance.emu_state.system==SYSTEM_NDS && (gui_state.settings.screen_rotation==0)){
       if(render_h/height<0.7){
         controller_h = height-render_h;
         lcd_render_y = -(height-render_h)*0.5;
@@ -2841,69 +7374,162 @@ static void se_draw_emulated_system_screen(bool preview){
     igGetWindowPos(&v);
     lcd_render_x+=v.x*dpi_scale+scr_w*0.5;
     lcd_render_y+=v.y*dpi_scale+scr_h*0.5;
-    if(preview&&emu_state.rom_loaded==false){
+    if(preview&&gui_instance.emu_state.rom_loaded==false){
       ImVec2 min = {(lcd_render_x-lcd_render_w*0.5)/se_dpi_scale(),(lcd_render_y-lcd_render_h*0.5)/se_dpi_scale()};
       ImVec2 max = {(lcd_render_x+lcd_render_w*0.5)/se_dpi_scale(),(lcd_render_y+lcd_render_h*0.5)/se_dpi_scale()};
       
       ImU32 col = 0xffC08000;
       igRenderFrame(min,max,col,true,0);
     }else{
-      if(emu_state.system==SYSTEM_GBA){
-        se_draw_lcd_defer(core.gba.framebuffer,GBA_LCD_W,GBA_LCD_H,lcd_render_x,lcd_render_y, lcd_render_w, lcd_render_h,rotation,false);
-      }else if (emu_state.system==SYSTEM_NDS){
+      if(gui_instance.emu_state.system==SYSTEM_GBA){
+        se_draw_lcd_defer(gui_instance.core.gba.framebuffer,GBA_LCD_W,GBA_LCD_H,lcd_render_x,lcd_render_y, lcd_render_w, lcd_render_h,rotation,false);
+      }else if (gui_instance.emu_state.system==SYSTEM_NDS){
         bool masked_touchscreen = !gui_state.block_touchscreen&&!preview;
-        if(hybrid_nds){
-          float p[6]={
-            0.3333*lcd_render_w,-lcd_render_h*0.25,
-            0.3333*lcd_render_w,lcd_render_h*0.25,
-            -0.1666*lcd_render_w,0,
-
-          };
-          for(int i=0;i<3;++i){
-            float x = p[i*2+0];
-            float y = p[i*2+1];
-            p[i*2+0] = x*cos(-rotation)+y*sin(-rotation);
-            p[i*2+1] = x*-sin(-rotation)+y*cos(-rotation);
-          }
-          se_draw_lcd_defer(core.nds.framebuffer_top,NDS_LCD_W,NDS_LCD_H,lcd_render_x+p[0],lcd_render_y+p[1], lcd_render_w/3, lcd_render_h*0.5,rotation,false);
-          se_draw_lcd_defer(core.nds.framebuffer_bottom,NDS_LCD_W,NDS_LCD_H,lcd_render_x+p[2],lcd_render_y+p[3], lcd_render_w/3, lcd_render_h*0.5,rotation,masked_touchscreen);
-          se_draw_lcd_defer(core.nds.framebuffer_top,NDS_LCD_W,NDS_LCD_H,lcd_render_x+p[4],lcd_render_y+p[5], lcd_render_w*2/3, lcd_render_h,rotation,false);
-        }else{
-          float p[4]={
-            0,-lcd_render_h*0.25,
-            0,lcd_render_h*0.25
-          };
-          for(int i=0;i<2;++i){
-            float x = p[i*2+0];
-            float y = p[i*2+1];
-            p[i*2+0] = x*cos(-rotation)+y*sin(-rotation);
-            p[i*2+1] = x*-sin(-rotation)+y*cos(-rotation);
-          }
-          se_draw_lcd_defer(core.nds.framebuffer_top,NDS_LCD_W,NDS_LCD_H,lcd_render_x+p[0],lcd_render_y+p[1], lcd_render_w, lcd_render_h*0.5,rotation,false);
-          se_draw_lcd_defer(core.nds.framebuffer_bottom,NDS_LCD_W,NDS_LCD_H,lcd_render_x+p[2],lcd_render_y+p[3], lcd_render_w, lcd_render_h*0.5,rotation,masked_touchscreen);
-        }
-      }else if (emu_state.system==SYSTEM_GB){
-        se_draw_lcd_defer(core.gb.lcd.framebuffer,SB_LCD_W,SB_LCD_H,lcd_render_x,lcd_render_y, lcd_render_w, lcd_render_h,rotation,false);
+        se_draw_nds_screens_defer(lcd_render_x,lcd_render_y,lcd_render_w,lcd_render_h,rotation,masked_touchscreen,hybrid_nds);
+      }else if (gui_instance.emu_state.system==SYSTEM_GB){
+        se_draw_lcd_defer(gui_instance.core.gb.lcd.framebuffer,SB_LCD_W,SB_LCD_H,lcd_render_x,lcd_render_y, lcd_render_w, lcd_render_h,rotation,false);
       }
     }
   }
-  if(!gui_state.block_touchscreen||preview)sb_draw_onscreen_controller(&emu_state, controller_h, controller_y_pad,preview);
+  if(!gui_state.block_touchscreen||preview)sb_draw_onscreen_controller(&gui_instance.emu_state, controller_h, controller_y_pad,preview);
 }
-static uint8_t gba_byte_read(uint64_t address){return gba_read8_debug(&core.gba,address);}
-static void gba_byte_write(uint64_t address, uint8_t data){gba_store8_debug(&core.gba,address,data);}
+static uint8_t gba_byte_read(uint64_t address){return gba_read8_debug(&gui_instance.core.gba,address);}
+static void gba_byte_write(uint64_t address, uint8_t data){gba_store8_debug(&gui_instance.core.gba,address,data);}
 
-static uint8_t gb_byte_read(uint64_t address){return sb_read8(&core.gb,address);}
-static void gb_byte_write(uint64_t address, uint8_t data){sb_store8(&core.gb,address,data);}
+static uint8_t gb_byte_read(uint64_t address){return sb_read8(&gui_instance.core.gb,address);}
+static void gb_byte_write(uint64_t address, uint8_t data){sb_store8(&gui_instance.core.gb,address,data);}
 
-static uint8_t nds9_byte_read(uint64_t address){return nds9_debug_read8(&core.nds,address);}
-static void nds9_byte_write(uint64_t address, uint8_t data){nds9_debug_write8(&core.nds,address,data);}
-static uint8_t nds7_byte_read(uint64_t address){return nds7_debug_read8(&core.nds,address);}
-static void nds7_byte_write(uint64_t address, uint8_t data){nds7_debug_write8(&core.nds,address,data);}
+static uint8_t nds9_byte_read(uint64_t address){return nds9_debug_read8(&gui_instance.core.nds,address);}
+static void nds9_byte_write(uint64_t address, uint8_t data){nds9_debug_write8(&gui_instance.core.nds,address,data);}
+static uint8_t nds7_byte_read(uint64_t address){return nds7_debug_read8(&gui_instance.core.nds,address);}
+static void nds7_byte_write(uint64_t address, uint8_t data){nds7_debug_write8(&gui_instance.core.nds,address,data);}
 
 static void null_byte_write(uint64_t address, uint8_t data){}
 static uint8_t null_byte_read(uint64_t address){return 0;}
 
 
+typedef struct{
+  uint32_t address;
+  uint8_t* data;
+  uint32_t size;
+}se_mem_search_region_t;
+// Regions that can be searched, in the order of the names returned in items
+static int se_mem_search_regions(se_mem_search_region_t* regions, const char** items){
+  switch(gui_instance.emu_state.system){
+    case SYSTEM_GB:
+      // Banks 0 and 1 as mapped at C000-DFFF, the other CGB banks aren't searched
+      *items = "WRAM\0";
+      regions[0]=(se_mem_search_region_t){0xC000,gui_instance.core.gb.mem.wram,2*SB_WRAM_BANK_SIZE};
+      return 1;
+    case SYSTEM_GBA:
+      *items = "EWRAM\0IWRAM\0";
+      regions[0]=(se_mem_search_region_t){0x02000000,gui_instance.core.gba.mem.wram0,sizeof(gui_instance.core.gba.mem.wram0)};
+      regions[1]=(se_mem_search_region_t){0x03000000,gui_instance.core.gba.mem.wram1,sizeof(gui_instance.core.gba.mem.wram1)};
+      return 2;
+    case SYSTEM_NDS:
+      *items = "Main RAM\0ARM7 WRAM\0";
+      regions[0]=(se_mem_search_region_t){0x02000000,gui_instance.core.nds.mem.ram,sizeof(gui_instance.core.nds.mem.ram)};
+      regions[1]=(se_mem_search_region_t){0x03800000,gui_instance.core.nds.mem.wram+32*1024,64*1024};
+      return 2;
+  }
+  *items = "\0";
+  return 0;
+}
+// Action Replay code that keeps the element at address at value, returns its size in words
+static int se_mem_search_cheat_code(uint32_t address, uint32_t width, uint32_t value, uint32_t* code){
+  if(width<4)value&=(1u<<(width*8))-1;
+  switch(gui_instance.emu_state.system){
+    case SYSTEM_GB:
+      // GameShark 01VVAAAA with the address byte swapped, one code per byte
+      for(uint32_t i=0;i<width;++i){
+        uint16_t addr = address+i;
+        code[i]=0x01000000|((value>>(i*8))&0xff)<<16|(addr&0xff)<<8|addr>>8;
+      }
+      return width;
+    case SYSTEM_GBA:{
+      uint32_t left = (width==4? 0x04: width==2? 0x02: 0x00)<<24|(address&0x0F000000)>>4|(address&0x000FFFFF);
+      uint64_t encrypted = gba_encrypt_arv3((uint64_t)left<<32|value);
+      code[0]=encrypted>>32;
+      code[1]=encrypted&0xFFFFFFFF;
+      return 2;
+    }
+    case SYSTEM_NDS:
+      code[0]=(width==4? 0x00000000: width==2? 0x10000000: 0x20000000)|(address&0x0fffffff);
+      code[1]=value;
+      return 2;
+  }
+  return 0;
+}
+static void se_mem_search_add_cheat(uint32_t address, uint32_t width, uint32_t value){
+  for(int i=0;i<SE_NUM_CHEATS;++i){
+    se_cheat_t* cheat = cheats+i;
+    if(cheat->state!=-1)continue;
+    memset(cheat->buffer,0,sizeof(cheat->buffer));
+    cheat->size = se_mem_search_cheat_code(address,width,value,cheat->buffer);
+    snprintf(cheat->name,SE_MAX_CHEAT_NAME_SIZE,"0x%08x = %u",address,value);
+    cheat->compiled_by = NULL;
+    cheat->state = 1;
+    se_save_cheats(gui_state.cheat_path);
+    return;
+  }
+  printf("No free cheat slots for 0x%08x\n",address);
+}
+#define SE_MEM_SEARCH_MAX_RESULTS 100
+static void se_draw_mem_search(){
+  se_mem_search_region_t regions[2];
+  const char* items = NULL;
+  int num_regions = se_mem_search_regions(regions,&items);
+  if(!num_regions)return;
+  if(gui_state.mem_search_region>=num_regions)gui_state.mem_search_region = 0;
+  se_mem_search_region_t* region = regions+gui_state.mem_search_region;
+  sb_mem_search_t* s = &gui_state.mem_search;
+  if(s->snapshot&&(gui_state.mem_search_source!=region->data||s->size!=region->size))sb_mem_search_free(s);
+
+  se_section(ICON_FK_SEARCH " Cheat Search");
+  se_combo_str("Region",&gui_state.mem_search_region,items,num_regions);
+  se_combo_str("Width",&gui_state.mem_search_width,"8 bit\0""16 bit\0""32 bit\0",3);
+  if(se_button(ICON_FK_REFRESH " New Search",(ImVec2){0,0})){
+    se_join_emulation_thread();
+    if(sb_mem_search_start(s,region->data,region->size,1u<<gui_state.mem_search_width)){
+      gui_state.mem_search_source = region->data;
+      gui_state.mem_search_address = region->address;
+    }else printf("Failed to allocate the memory search\n");
+  }
+  if(!s->snapshot)return;
+  se_combo_str("Compare",&gui_state.mem_search_op,"Equal to\0Not equal to\0Greater than\0Less than\0",4);
+  se_combo_str("With",&gui_state.mem_search_use_value,"Previous search\0Value\0",2);
+  if(gui_state.mem_search_use_value)se_input_int("Value",&gui_state.mem_search_value,1,100,ImGuiInputTextFlags_None);
+  if(se_button(ICON_FK_FILTER " Filter",(ImVec2){0,0})){
+    se_join_emulation_thread();
+    uint64_t start = stm_now();
+    sb_mem_search_filter(s,region->data,gui_state.mem_search_op,gui_state.mem_search_use_value,gui_state.mem_search_value);
+    gui_state.mem_search_ms = stm_ms(stm_diff(stm_now(),start));
+  }
+  se_text("%u candidates",s->num_candidates);
+  if(gui_state.mem_search_ms>0){
+    igSameLine(0,4);
+    se_text("(%.2f ms)",gui_state.mem_search_ms);
+  }
+  se_section(ICON_FK_LIST " Results");
+  int64_t offset = sb_mem_search_next(s,0);
+  float w = igGetWindowWidth();
+  igPushFont(gui_state.mono_font);
+  for(int i=0;i<SE_MEM_SEARCH_MAX_RESULTS&&offset>=0;++i){
+    uint32_t value = 0;
+    memcpy(&value,region->data+offset,s->width);
+    uint32_t address = gui_state.mem_search_address+offset;
+    igPushIDInt(i);
+    se_text("0x%08x %10u %10u",address,sb_mem_search_value(s,offset),value);
+    igSameLine(w-40,0);
+    if(se_button(ICON_FK_PLUS,(ImVec2){0,0}))se_mem_search_add_cheat(address,s->width,value);
+    se_tooltip("Add a cheat that keeps the current value");
+    igPopID();
+    offset = sb_mem_search_next(s,offset+1);
+  }
+  igPopFont();
+  if(offset>=0)se_text("Only the first %d candidates are listed",SE_MEM_SEARCH_MAX_RESULTS);
+}
+
 typedef struct{
   const char* short_label;
   const char* label;
@@ -2912,24 +7538,24 @@ typedef struct{
   bool allow_hardcore;
 }se_debug_tool_desc_t; 
 
-sb_debug_mmio_access_t gba_mmio_access_type(uint64_t address,int trigger_breakpoint){return gba_debug_mmio_access(&core.gba,address,trigger_breakpoint);}
+sb_debug_mmio_access_t gba_mmio_access_type(uint64_t address,int trigger_breakpoint){return gba_debug_mmio_access(&gui_instance.core.gba,address,trigger_breakpoint);}
 void gba_memory_debugger(){se_draw_mem_debug_state("GBA MEM", &gui_state, &gba_byte_read, &gba_byte_write); }
-void gba_cpu_debugger(){se_draw_arm_state("CPU",&core.gba.cpu,&gba_byte_read);}
+void gba_cpu_debugger(){se_draw_arm_state("CPU",&gui_instance.core.gba.cpu,&gba_byte_read,0);}
 void gba_mmio_debugger(){se_draw_io_state("GBA MMIO", gba_io_reg_desc,sizeof(gba_io_reg_desc)/sizeof(mmio_reg_t), &gba_byte_read, &gba_byte_write,&gba_mmio_access_type);}
 
 void gb_mmio_debugger(){se_draw_io_state("GB MMIO", gb_io_reg_desc,sizeof(gb_io_reg_desc)/sizeof(mmio_reg_t), &gb_byte_read, &gb_byte_write,NULL);}
 void gb_memory_debugger(){se_draw_mem_debug_state("GB MEM", &gui_state, &gb_byte_read, &gb_byte_write);}
 
-sb_debug_mmio_access_t nds7_mmio_access_type(uint64_t address,int trigger_breakpoint){return nds_debug_mmio_access(&core.nds,NDS_ARM7,address,trigger_breakpoint);}
-sb_debug_mmio_access_t nds9_mmio_access_type(uint64_t address,int trigger_breakpoint){return nds_debug_mmio_access(&core.nds,NDS_ARM9,address,trigger_breakpoint);}
+sb_debug_mmio_access_t nds7_mmio_access_type(uint64_t address,int trigger_breakpoint){return nds_debug_mmio_access(&gui_instance.core.nds,NDS_ARM7,address,trigger_breakpoint);}
+sb_debug_mmio_access_t nds9_mmio_access_type(uint64_t address,int trigger_breakpoint){return nds_debug_mmio_access(&gui_instance.core.nds,NDS_ARM9,address,trigger_breakpoint);}
 void nds7_mmio_debugger(){se_draw_io_state("NDS7 MMIO", nds7_io_reg_desc,sizeof(nds7_io_reg_desc)/sizeof(mmio_reg_t), &nds7_byte_read, &nds7_byte_write,&nds7_mmio_access_type); }
 void nds9_mmio_debugger(){se_draw_io_state("NDS9 MMIO", nds9_io_reg_desc,sizeof(nds9_io_reg_desc)/sizeof(mmio_reg_t), &nds9_byte_read, &nds9_byte_write,&nds9_mmio_access_type); }
 void nds7_mem_debugger(){se_draw_mem_debug_state("NDS9 MEM",&gui_state, &nds9_byte_read, &nds9_byte_write); }
 void nds9_mem_debugger(){se_draw_mem_debug_state("NDS7_MEM",&gui_state, &nds7_byte_read, &nds7_byte_write);}
-void nds7_cpu_debugger(){se_draw_arm_state("ARM7",&core.nds.arm7,&nds7_byte_read); }
-void nds9_cpu_debugger(){se_draw_arm_state("ARM9",&core.nds.arm9,&nds9_byte_read);}
+void nds7_cpu_debugger(){se_draw_arm_state("ARM7",&gui_instance.core.nds.arm7,&nds7_byte_read,NDS_ARM7); }
+void nds9_cpu_debugger(){se_draw_arm_state("ARM9",&gui_instance.core.nds.arm9,&nds9_byte_read,NDS_ARM9);}
 void nds_io_debugger(){
-  nds_t * nds = &core.nds;
+  nds_t * nds = &gui_instance.core.nds;
   for(int cpu=0;cpu<2;++cpu){
     se_section(cpu? ICON_FK_EXCHANGE " ARM9 IPC FIFO":ICON_FK_EXCHANGE " ARM7 IPC FIFO");
     se_text("Write Pointer: %d\n", nds->ipc[cpu].write_ptr);
@@ -2940,10 +7566,96 @@ void nds_io_debugger(){
   }
 }
 
+// VRAM bank viewer. Only the blocks of the bank that changed since the last frame are converted
+// (a tile, or 32 pixels of a bitmap), everything is redrawn when the view or the palette changes.
+#define SE_NDS_VRAM_VIEW_MAX_H 1024
+typedef struct{
+  int bank, format, palette_source, palette_row;
+  int drawn_key; // Options the image was drawn with, -1 to redraw
+  uint8_t vram[128*1024];
+  uint16_t palette[256];
+  uint8_t image[256*SE_NDS_VRAM_VIEW_MAX_H*4];
+}se_nds_vram_view_t;
+static se_nds_vram_view_t se_nds_vram_view = {.drawn_key=-1};
+static FORCE_INLINE void se_bgr555_to_rgba(uint16_t c, uint8_t* p){
+  p[0]=SB_BFE(c,0,5)<<3|SB_BFE(c,2,3);
+  p[1]=SB_BFE(c,5,5)<<3|SB_BFE(c,7,3);
+  p[2]=SB_BFE(c,10,5)<<3|SB_BFE(c,12,3);
+  p[3]=0xff;
+}
+void nds_vram_debugger(){
+  nds_t * nds = &gui_instance.core.nds;
+  se_nds_vram_view_t* v = &se_nds_vram_view;
+  se_combo_str("Bank",&v->bank,"A\0B\0C\0D\0E\0F\0G\0H\0I\0",9);
+  se_combo_str("Format",&v->format,"Direct Color\0""256 Color Tiles\0""16 Color Tiles\0",3);
+  if(v->format){
+    se_combo_str("Palette",&v->palette_source,"Engine A BG\0Engine A OBJ\0Engine B BG\0Engine B OBJ\0",4);
+    if(v->format==2){
+      se_input_int("Palette Row",&v->palette_row,1,4,ImGuiInputTextFlags_None);
+      v->palette_row&=0xf;
+    }
+  }
+  int vram_offset = 0;
+  for(int b=0;b<v->bank;++b)vram_offset+=nds_vram_bank_size[b];
+  int size = nds_vram_bank_size[v->bank];
+  uint8_t vramcnt = nds9_io_read8(nds,nds_vram_cnt_array[v->bank]);
+  se_text("VRAMCNT: 0x%02x (MST %d OFS %d%s)",vramcnt,(int)SB_BFE(vramcnt,0,3),(int)SB_BFE(vramcnt,3,2),SB_BFE(vramcnt,7,1)?"":", disabled");
+
+  const uint8_t* vram = nds->mem.vram+vram_offset;
+  // Direct color is 2 bytes per pixel, the tiles are 8x8 at 1 or 1/2 byte per pixel, 32 per row
+  int block = v->format==2? 32: 64;
+  int image_h = v->format==0? size/512: v->format==1? size/256: size/128;
+  uint16_t palette[256];
+  memcpy(palette,nds->mem.palette+v->palette_source*512,sizeof(palette));
+  int key = v->bank|v->format<<4|v->palette_source<<8|v->palette_row<<12;
+  bool redraw = v->drawn_key!=key||(v->format&&memcmp(palette,v->palette,sizeof(palette)));
+  v->drawn_key = key;
+  memcpy(v->palette,palette,sizeof(palette));
+  for(int off=0;off<size;off+=block){
+    if(!redraw&&memcmp(v->vram+off,vram+off,block)==0)continue;
+    memcpy(v->vram+off,vram+off,block);
+    const uint8_t* d = vram+off;
+    if(v->format==0){
+      uint8_t* p = v->image+off*2;
+      for(int i=0;i<block/2;++i)se_bgr555_to_rgba(d[i*2]|d[i*2+1]<<8,p+i*4);
+      continue;
+    }
+    int t = off/block;
+    int tx = (t%32)*8, ty = (t/32)*8;
+    for(int py=0;py<8;++py)
+      for(int px=0;px<8;++px){
+        int index = v->format==1? d[py*8+px]: SB_BFE(d[py*4+px/2],(px&1)*4,4)|v->palette_row<<4;
+        se_bgr555_to_rgba(palette[index],v->image+((tx+px)+(ty+py)*256)*4);
+      }
+  }
+
+  ImVec2 win;
+  igGetWindowPos(&win);
+  float scale = igGetWindowContentRegionWidth()/256;
+  int x = igGetCursorPosX()+win.x-igGetScrollX();
+  int y = igGetCursorPosY()+win.y-igGetScrollY();
+  int w = 256*scale;
+  int h = image_h*scale;
+  se_draw_image(v->image,256,image_h,x*se_dpi_scale(),y*se_dpi_scale(),w*se_dpi_scale(),h*se_dpi_scale(),true);
+  igDummy((ImVec2){w,h});
+  ImVec2 mouse_pos = {gui_state.mouse_pos[0]/se_dpi_scale()-x,gui_state.mouse_pos[1]/se_dpi_scale()-y};
+  if(mouse_pos.x>=0&&mouse_pos.y>=0&&mouse_pos.x<w&&mouse_pos.y<h){
+    int px = mouse_pos.x/scale, py = mouse_pos.y/scale;
+    if(v->format==0){
+      int off = (px+py*256)*2;
+      se_text("Offset 0x%05x Color 0x%04x",off,vram[off]|vram[off+1]<<8);
+    }else{
+      int t = px/8+py/8*32;
+      se_text("Tile %d Offset 0x%05x",t,t*block);
+    }
+  }else se_text("No pixel hovered");
+}
+
 se_debug_tool_desc_t gba_debug_tools[]={
   {ICON_FK_TELEVISION, ICON_FK_TELEVISION " CPU", gba_cpu_debugger},
   {ICON_FK_SITEMAP, ICON_FK_SITEMAP " MMIO", gba_mmio_debugger},
   {ICON_FK_PENCIL_SQUARE_O, ICON_FK_PENCIL_SQUARE_O " Memory",gba_memory_debugger},
+  {ICON_FK_SEARCH, ICON_FK_SEARCH " Cheat Search",se_draw_mem_search},
   {ICON_FK_VOLUME_UP, ICON_FK_VOLUME_UP " PSG",se_psg_debugger},
   {ICON_FK_AREA_CHART, ICON_FK_AREA_CHART " Emulator Stats",se_draw_emu_stats, .allow_hardcore=true},
   {NULL,NULL,NULL}
@@ -2952,6 +7664,7 @@ se_debug_tool_desc_t gb_debug_tools[]={
   {ICON_FK_TELEVISION, ICON_FK_TELEVISION " CPU", gb_cpu_debugger},
   {ICON_FK_SITEMAP, ICON_FK_SITEMAP " MMIO", gb_mmio_debugger},
   {ICON_FK_PENCIL_SQUARE_O, ICON_FK_PENCIL_SQUARE_O " Memory",gb_memory_debugger},
+  {ICON_FK_SEARCH, ICON_FK_SEARCH " Cheat Search",se_draw_mem_search},
   {ICON_FK_VOLUME_UP, ICON_FK_VOLUME_UP " PSG",se_psg_debugger},
   {ICON_FK_DELICIOUS, ICON_FK_DELICIOUS " Tile Map",gb_tile_map_debugger},
   {ICON_FK_TH, ICON_FK_TH " Tile Data",gb_tile_data_debugger},
@@ -2965,28 +7678,30 @@ se_debug_tool_desc_t nds_debug_tools[]={
   {ICON_FK_SITEMAP " 9", ICON_FK_SITEMAP " ARM9 MMIO", nds9_mmio_debugger},
   {ICON_FK_PENCIL_SQUARE_O " 7", ICON_FK_PENCIL_SQUARE_O " ARM7 Memory",nds7_mem_debugger},
   {ICON_FK_PENCIL_SQUARE_O " 9", ICON_FK_PENCIL_SQUARE_O " ARM9 Memory",nds9_mem_debugger},
+  {ICON_FK_SEARCH, ICON_FK_SEARCH " Cheat Search",se_draw_mem_search},
   {ICON_FK_INFO_CIRCLE, ICON_FK_INFO_CIRCLE " NDS IO",nds_io_debugger},
+  {ICON_FK_PICTURE_O, ICON_FK_PICTURE_O " VRAM",nds_vram_debugger},
 
   {ICON_FK_AREA_CHART, ICON_FK_AREA_CHART " Emulator Stats",se_draw_emu_stats, .allow_hardcore=true},
   {NULL,NULL,NULL}
 };
 static se_debug_tool_desc_t* se_get_debug_description(){
   se_debug_tool_desc_t *desc = NULL;
-  if(emu_state.system ==SYSTEM_GBA)desc = gba_debug_tools;
-  if(emu_state.system ==SYSTEM_GB)desc = gb_debug_tools;
-  if(emu_state.system ==SYSTEM_NDS)desc = nds_debug_tools;
+  if(gui_instance.emu_state.system ==SYSTEM_GBA)desc = gba_debug_tools;
+  if(gui_instance.emu_state.system ==SYSTEM_GB)desc = gb_debug_tools;
+  if(gui_instance.emu_state.system ==SYSTEM_NDS)desc = nds_debug_tools;
   return desc; 
 }
 emu_byte_read_t se_read_byte_func(int addr_map){
-  if(emu_state.system ==SYSTEM_GBA)return gba_byte_read;
-  if(emu_state.system ==SYSTEM_GB)return gb_byte_read;
-  if(emu_state.system ==SYSTEM_NDS)return addr_map==7? nds7_byte_read:nds9_byte_read;
+  if(gui_instance.emu_state.system ==SYSTEM_GBA)return gba_byte_read;
+  if(gui_instance.emu_state.system ==SYSTEM_GB)return gb_byte_read;
+  if(gui_instance.emu_state.system ==SYSTEM_NDS)return addr_map==7? nds7_byte_read:nds9_byte_read;
   return null_byte_read;
 }
 emu_byte_write_t se_write_byte_func(int addr_map){
-  if(emu_state.system ==SYSTEM_GBA)return gba_byte_write;
-  if(emu_state.system ==SYSTEM_GB)return gb_byte_write;
-  if(emu_state.system ==SYSTEM_NDS)return addr_map==7? nds7_byte_write:nds9_byte_write;
+  if(gui_instance.emu_state.system ==SYSTEM_GBA)return gba_byte_write;
+  if(gui_instance.emu_state.system ==SYSTEM_GB)return gb_byte_write;
+  if(gui_instance.emu_state.system ==SYSTEM_NDS)return addr_map==7? nds7_byte_write:nds9_byte_write;
   return null_byte_write;
 }
 ///////////////////////////////
@@ -2994,73 +7709,305 @@ emu_byte_write_t se_write_byte_func(int addr_map){
 ///////////////////////////////
 
 void se_capture_state(se_core_state_t* core, se_save_state_t * save_state){
+  size_t core_size = se_get_core_size();
+  if(!se_reserve_save_state(save_state,core_size)){
+    save_state->valid = false;
+    return;
+  }
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
-  retro_achievements_capture_state(save_state->state.rc_buffer);
+  retro_achievements_capture_state(save_state->rc_buffer);
 #endif
-  save_state->state = *core; 
+  memcpy(save_state->core,core,core_size);
   save_state->valid = true;
-  save_state->system = emu_state.system;
-  se_screenshot(save_state->screenshot, &save_state->screenshot_width, &save_state->screenshot_height);
+  save_state->system = gui_instance.emu_state.system;
+  se_instance_screenshot(&gui_instance,save_state->screenshot, &save_state->screenshot_width, &save_state->screenshot_height);
 }
 void se_restore_state(se_core_state_t* core, se_save_state_t * save_state){
-  if(!save_state->valid || save_state->system != emu_state.system||(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in))return; 
-  *core=save_state->state;
+  if(!save_state->valid || save_state->system != gui_instance.emu_state.system||(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in))return; 
+  // Would desync the consoles of the peer, spectators follow the broadcaster
+  if(se_netplay_active()||se_spectate_watching())return;
+  // The movie input no longer matches the state
+  se_movie_stop();
+  se_spectate_discontinuity();
+  memcpy(core,save_state->core,se_get_core_size());
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
-  retro_achievements_restore_state(save_state->state.rc_buffer);
+  retro_achievements_restore_state(save_state->rc_buffer);
 #endif
-  emu_state.render_frame = true;
+  gui_instance.emu_state.render_frame = true;
   se_emulate_single_frame();
 }
-void se_state_download_callback(void* userdata, void* data, size_t size){
-  size_t slot = (size_t)userdata;
-  se_save_state_t* save_state = cloud_state.save_states+slot;
-  if (data == NULL) {
-    printf("Failed to download save state\n");
-    cloud_state.save_states_busy[slot] = false;
+// Set in the download userdata when fetching the PNG states uploaded by older versions
+#define SE_CLOUD_LEGACY_STATE 0x100
+void se_state_download_callback(void* userdata, void* data, size_t size){
+  size_t slot = (size_t)userdata&~SE_CLOUD_LEGACY_STATE;
+  se_save_state_t* save_state = cloud_state.save_states+slot;
+  if (data == NULL&&!((size_t)userdata&SE_CLOUD_LEGACY_STATE)) {
+    char file[SB_FILE_PATH_SIZE];
+    snprintf(file,SB_FILE_PATH_SIZE,"%016llx.slot%zu.state.png",gui_instance.emu_state.game_checksum,slot);
+    cloud_drive_download(cloud_state.drive, file, se_state_download_callback, (void*)(slot|SE_CLOUD_LEGACY_STATE));
+    return;
+  }
+  if (data == NULL) {
+    printf("Failed to download save state\n");
+    cloud_state.save_states_busy[slot] = false;
+    return;
+  }
+
+  mutex_lock(cloud_state.save_states_mutex);
+  se_load_state_from_mem(save_state, data, size);
+  cloud_state.save_states_busy[slot] = false;
+  mutex_unlock(cloud_state.save_states_mutex);
+}
+static uint64_t se_cloud_chunk_hash(const uint8_t* data, size_t size){
+  uint64_t used = 0;
+  for(size_t i=0;i<size;++i)used|=data[i];
+  if(!used)return 0;
+  uint64_t hash = XXH3_64bits(data,size);
+  return hash? hash: 1;
+}
+static uint32_t se_cloud_num_chunks(uint64_t data_size){
+  return (data_size+SE_CLOUD_CHUNK_SIZE-1)/SE_CLOUD_CHUNK_SIZE;
+}
+static size_t se_cloud_chunk_size(uint64_t data_size, uint32_t chunk){
+  return SE_MIN_CONST(SE_CLOUD_CHUNK_SIZE,data_size-(uint64_t)chunk*SE_CLOUD_CHUNK_SIZE);
+}
+// Fills in the chunk hashes and returns the hash of the whole state
+static uint64_t se_cloud_hash_chunks(const uint8_t* data, uint64_t data_size, uint64_t* hashes){
+  uint32_t num_chunks = se_cloud_num_chunks(data_size);
+  for(uint32_t c=0;c<num_chunks;++c)hashes[c]=se_cloud_chunk_hash(data+(uint64_t)c*SE_CLOUD_CHUNK_SIZE,se_cloud_chunk_size(data_size,c));
+  return XXH3_64bits_withSeed(hashes,num_chunks*sizeof(uint64_t),data_size);
+}
+static void se_cloud_chunk_name(char* name, uint64_t hash){
+  snprintf(name,SB_FILE_PATH_SIZE,"%016llx"SE_CLOUD_CHUNK_EXTENSION,(unsigned long long)hash);
+}
+static void se_cloud_index_name(char* name){
+  snprintf(name,SB_FILE_PATH_SIZE,"%016llx"SE_CLOUD_INDEX_EXTENSION,gui_instance.emu_state.game_checksum);
+}
+static void se_cloud_cache_path(char* path, uint64_t game_checksum, size_t slot){
+  snprintf(path,SB_FILE_PATH_SIZE,"%scloud_cache/%016llx.slot%zu.cache",se_get_pref_path(),(unsigned long long)game_checksum,slot);
+}
+static void se_cloud_free_slot(se_cloud_slot_t* slot){
+  free(slot->chunk_hashes);
+  free(slot->screenshot);
+  memset(slot,0,sizeof(*slot));
+}
+static void se_cloud_write_cache(size_t slot, uint64_t game_checksum, uint64_t state_hash, const uint8_t* data, uint64_t data_size){
+  mz_ulong compressed_size = mz_compressBound(data_size);
+  uint8_t* compressed = (uint8_t*)malloc(compressed_size);
+  if(compressed&&mz_compress2(compressed,&compressed_size,data,data_size,MZ_BEST_SPEED)==MZ_OK){
+    char path[SB_FILE_PATH_SIZE];
+    se_cloud_cache_path(path,game_checksum,slot);
+    FILE* f = se_fopen_mkdir(path,"wb");
+    if(f){
+      se_cloud_cache_header_t header={0};
+      memcpy(header.magic,SE_CLOUD_CACHE_MAGIC,sizeof(header.magic));
+      header.game_checksum = game_checksum;
+      header.state_hash = state_hash;
+      header.data_size = data_size;
+      header.compressed_size = compressed_size;
+      fwrite(&header,1,sizeof(header),f);
+      fwrite(compressed,1,compressed_size,f);
+      fclose(f);
+    }
+  }
+  free(compressed);
+}
+// Returns the malloc'd raw state cached for the slot if it belongs to the game and has the expected size
+static uint8_t* se_cloud_read_cache(size_t slot, uint64_t game_checksum, uint64_t data_size, uint64_t* state_hash){
+  char path[SB_FILE_PATH_SIZE];
+  se_cloud_cache_path(path,game_checksum,slot);
+  size_t file_size = 0;
+  uint8_t* file_data = sb_load_file_data(path,&file_size);
+  if(!file_data)return NULL;
+  uint8_t* data = NULL;
+  se_cloud_cache_header_t header;
+  if(file_size>=sizeof(header)){
+    memcpy(&header,file_data,sizeof(header));
+    if(memcmp(header.magic,SE_CLOUD_CACHE_MAGIC,sizeof(header.magic))==0&&header.game_checksum==game_checksum&&
+       header.data_size==data_size&&header.compressed_size<=file_size-sizeof(header)){
+      data = (uint8_t*)malloc(data_size);
+      mz_ulong size = data_size;
+      if(data&&(mz_uncompress(data,&size,file_data+sizeof(header),header.compressed_size)!=MZ_OK||size!=data_size)){
+        free(data);
+        data = NULL;
+      }
+      *state_hash = header.state_hash;
+    }
+  }
+  sb_free_file_data(file_data);
+  return data;
+}
+static void se_cloud_upload_index();
+static void se_cloud_index_uploaded_callback(void* userdata, void* data){
+  free(data);
+  mutex_lock(cloud_state.save_states_mutex);
+  cloud_state.index_uploading = false;
+  bool dirty = cloud_state.index_dirty;
+  mutex_unlock(cloud_state.save_states_mutex);
+  if(dirty)se_cloud_upload_index();
+}
+// Only one index upload is in flight at a time so the first upload can't create the file twice
+static void se_cloud_upload_index(){
+  if(!cloud_state.drive)return;
+  mutex_lock(cloud_state.save_states_mutex);
+  if(cloud_state.index_uploading){
+    cloud_state.index_dirty = true;
+    mutex_unlock(cloud_state.save_states_mutex);
     return;
   }
-
-  mutex_lock(cloud_state.save_states_mutex);
-  se_load_state_from_mem(save_state, data, size);
-  cloud_state.save_states_busy[slot] = false;
+  cloud_state.index_uploading = true;
+  cloud_state.index_dirty = false;
+  size_t body_size = 0;
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i){
+    se_cloud_slot_t* slot = cloud_state.slots+i;
+    body_size+=sizeof(se_cloud_slot_header_t);
+    if(!slot->header.valid)continue;
+    body_size+=se_cloud_num_chunks(slot->header.data_size)*sizeof(uint64_t);
+    body_size+=(size_t)slot->header.screenshot_width*slot->header.screenshot_height*4;
+  }
+  uint8_t* body = (uint8_t*)malloc(body_size);
+  mz_ulong compressed_size = mz_compressBound(body_size);
+  uint8_t* file_data = (uint8_t*)malloc(sizeof(se_cloud_index_header_t)+compressed_size);
+  bool success = false;
+  if(body&&file_data){
+    uint8_t* out = body;
+    for(int i=0;i<SE_NUM_SAVE_STATES;++i){
+      se_cloud_slot_t* slot = cloud_state.slots+i;
+      memcpy(out,&slot->header,sizeof(slot->header));
+      out+=sizeof(slot->header);
+      if(!slot->header.valid)continue;
+      size_t hashes_size = se_cloud_num_chunks(slot->header.data_size)*sizeof(uint64_t);
+      memcpy(out,slot->chunk_hashes,hashes_size);
+      out+=hashes_size;
+      size_t screenshot_size = (size_t)slot->header.screenshot_width*slot->header.screenshot_height*4;
+      memcpy(out,slot->screenshot,screenshot_size);
+      out+=screenshot_size;
+    }
+    if(mz_compress(file_data+sizeof(se_cloud_index_header_t),&compressed_size,body,body_size)==MZ_OK){
+      se_cloud_index_header_t header={0};
+      memcpy(header.magic,SE_CLOUD_INDEX_MAGIC,sizeof(header.magic));
+      header.version = SE_CLOUD_INDEX_VERSION;
+      header.num_slots = SE_NUM_SAVE_STATES;
+      header.body_size = body_size;
+      header.compressed_size = compressed_size;
+      memcpy(file_data,&header,sizeof(header));
+      success = true;
+    }
+  }
+  if(!success)cloud_state.index_uploading = false;
   mutex_unlock(cloud_state.save_states_mutex);
+  free(body);
+  if(!success){
+    printf("Failed to encode the cloud save state index\n");
+    free(file_data);
+    return;
+  }
+  char file[SB_FILE_PATH_SIZE];
+  se_cloud_index_name(file);
+  cloud_drive_upload(cloud_state.drive, file, "save_states", "application/octet-stream", file_data,
+                     sizeof(se_cloud_index_header_t)+compressed_size, se_cloud_index_uploaded_callback, NULL);
 }
-void se_capture_cloud_callback(void* userdata, void* data){
+// Called once per uploaded chunk plus once by the capture itself, the index goes up after the last one
+static void se_cloud_chunk_uploaded_callback(void* userdata, void* data){
   free(data);
   size_t slot = (size_t)userdata;
   mutex_lock(cloud_state.save_states_mutex);
-  cloud_state.save_states[slot].valid = true;
-  cloud_state.save_states_busy[slot] = false;
+  bool done = --cloud_state.pending_uploads[slot]==0;
+  if(done){
+    cloud_state.save_states[slot].valid = true;
+    cloud_state.save_states_busy[slot] = false;
+  }
   mutex_unlock(cloud_state.save_states_mutex);
+  if(done)se_cloud_upload_index();
 }
 void se_logged_out_cloud_callback(){
   cloud_state.drive = NULL;
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i)se_free_save_state(cloud_state.save_states+i);
   memset(cloud_state.save_states, 0, sizeof(cloud_state.save_states));
   memset(cloud_state.save_states_busy, 0, sizeof(cloud_state.save_states_busy));
-}
-void se_write_png_cloud(void* context, void* data, int size){
-  char file[SB_FILE_PATH_SIZE];
-  size_t slot = (size_t)context;
-  snprintf(file,SB_FILE_PATH_SIZE,"%016llx.slot%zu.state.png",emu_state.game_checksum,slot);
-  // data is freed after this function returns, so we need to copy it
-  void* data_copy = malloc(size);
-  memcpy(data_copy,data,size);
-  cloud_drive_upload(cloud_state.drive, file, "save_states", "image/png", data_copy, (size_t)size, se_capture_cloud_callback, (void*)slot);
+  mutex_lock(cloud_state.save_states_mutex);
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i)se_cloud_free_slot(cloud_state.slots+i);
+  cloud_state.generation++;
+  mutex_unlock(cloud_state.save_states_mutex);
 }
 void se_capture_state_slot_cloud(size_t slot){
-  if(emu_state.rom_loaded==false)return;
+  if(gui_instance.emu_state.rom_loaded==false)return;
   se_save_state_t* save_state = cloud_state.save_states+slot;
-  se_capture_state(&core, save_state);
+  se_capture_state(&gui_instance.core, save_state);
   save_state->valid = false;
   cloud_state.save_states_busy[slot] = true;
-  uint32_t width=0, height=0;
-  uint8_t* imdata = se_save_state_to_image(save_state, &width,&height);
-  int len;
-  stbi_write_png_to_func(se_write_png_cloud, (void*)slot, width, height, 4, imdata, 0);
-  free(imdata);
+  se_emu_id emu_id = se_prepare_save_state(save_state);
+  size_t core_size = se_get_core_size();
+  uint64_t data_size = sizeof(emu_id)+core_size+SE_RC_BUFFER_SIZE;
+  uint32_t num_chunks = se_cloud_num_chunks(data_size);
+  size_t screenshot_size = (size_t)save_state->screenshot_width*save_state->screenshot_height*4;
+  uint8_t* data = (uint8_t*)malloc(data_size);
+  uint64_t* hashes = (uint64_t*)malloc(num_chunks*sizeof(uint64_t));
+  uint8_t* screenshot = (uint8_t*)malloc(screenshot_size);
+  if(!data||!hashes||!screenshot){
+    free(data);free(hashes);free(screenshot);
+    cloud_state.save_states_busy[slot] = false;
+    return;
+  }
+  memcpy(data,&emu_id,sizeof(emu_id));
+  memcpy(data+sizeof(emu_id),save_state->core,core_size);
+  memcpy(data+sizeof(emu_id)+core_size,save_state->rc_buffer,SE_RC_BUFFER_SIZE);
+  memcpy(screenshot,save_state->screenshot,screenshot_size);
+  uint64_t state_hash = se_cloud_hash_chunks(data,data_size,hashes);
+
+  mutex_lock(cloud_state.save_states_mutex);
+  se_cloud_slot_t* entry = cloud_state.slots+slot;
+  if(entry->header.valid&&entry->header.state_hash==state_hash){
+    // Nothing changed since the last upload
+    save_state->valid = true;
+    cloud_state.save_states_busy[slot] = false;
+    mutex_unlock(cloud_state.save_states_mutex);
+    free(data);free(hashes);free(screenshot);
+    return;
+  }
+  se_cloud_free_slot(entry);
+  entry->header.valid = 1;
+  entry->header.system = save_state->system;
+  entry->header.screenshot_width = save_state->screenshot_width;
+  entry->header.screenshot_height = save_state->screenshot_height;
+  entry->header.state_hash = state_hash;
+  entry->header.data_size = data_size;
+  entry->chunk_hashes = (uint64_t*)malloc(num_chunks*sizeof(uint64_t));
+  if(entry->chunk_hashes)memcpy(entry->chunk_hashes,hashes,num_chunks*sizeof(uint64_t));
+  else entry->header.valid = 0;
+  entry->screenshot = screenshot;
+  cloud_state.pending_uploads[slot] = 1;
+  mutex_unlock(cloud_state.save_states_mutex);
+
+  int uploaded = 0;
+  for(uint32_t c=0;c<num_chunks;++c){
+    if(hashes[c]==0)continue;
+    char file[SB_FILE_PATH_SIZE];
+    se_cloud_chunk_name(file,hashes[c]);
+    bool duplicate = false;
+    for(uint32_t p=0;p<c&&!duplicate;++p)duplicate = hashes[p]==hashes[c];
+    if(duplicate||cloud_drive_file_exists(cloud_state.drive,file))continue;
+    size_t chunk_size = se_cloud_chunk_size(data_size,c);
+    mz_ulong compressed_size = mz_compressBound(chunk_size);
+    uint8_t* compressed = (uint8_t*)malloc(compressed_size);
+    if(!compressed||mz_compress(compressed,&compressed_size,data+(uint64_t)c*SE_CLOUD_CHUNK_SIZE,chunk_size)!=MZ_OK){
+      free(compressed);
+      continue;
+    }
+    mutex_lock(cloud_state.save_states_mutex);
+    cloud_state.pending_uploads[slot]++;
+    mutex_unlock(cloud_state.save_states_mutex);
+    cloud_drive_upload(cloud_state.drive, file, "save_states", "application/octet-stream", compressed, compressed_size, se_cloud_chunk_uploaded_callback, (void*)slot);
+    uploaded++;
+  }
+  printf("Uploading %d of %u cloud save state chunks\n",uploaded,num_chunks);
+  se_cloud_write_cache(slot,gui_instance.emu_state.game_checksum,state_hash,data,data_size);
+  free(data);
+  free(hashes);
+  se_cloud_chunk_uploaded_callback((void*)slot,NULL);
 }
 void se_restore_state_slot_cloud(size_t slot){
-  se_restore_state(&core, cloud_state.save_states+slot);
+  se_restore_state(&gui_instance.core, cloud_state.save_states+slot);
 }
 static void se_drive_ready_callback(cloud_drive_t* drive){
   cloud_state.drive = drive;
@@ -3068,7 +8015,7 @@ static void se_drive_ready_callback(cloud_drive_t* drive){
     cloud_state.user_info = cloud_drive_get_user_info(drive);
 
     // If there's a game, check if there's any save states to download
-    if(emu_state.rom_loaded){
+    if(gui_instance.emu_state.rom_loaded){
       se_sync_cloud_save_states();
     }
   }else{
@@ -3081,20 +8028,192 @@ ImFont* se_get_mono_font(){
 void se_login_cloud(){
   cloud_drive_create(se_drive_ready_callback);
 }
-static void se_sync_cloud_save_states_callback(){
+static void se_cloud_finish_slot_download(se_cloud_slot_download_t* download){
+  size_t slot = download->slot;
+  uint64_t data_size = download->entry.header.data_size;
+  uint64_t state_hash = download->entry.header.state_hash;
+  bool applied = false;
+  mutex_lock(cloud_state.save_states_mutex);
+  if(download->generation==cloud_state.generation){
+    if(!download->failed){
+      se_save_state_t* save_state = cloud_state.save_states+slot;
+      save_state->screenshot_width = download->entry.header.screenshot_width;
+      save_state->screenshot_height = download->entry.header.screenshot_height;
+      memcpy(save_state->screenshot,download->entry.screenshot,(size_t)save_state->screenshot_width*save_state->screenshot_height*4);
+      se_load_state_data(save_state,NULL,download->data,data_size);
+      se_cloud_free_slot(cloud_state.slots+slot);
+      cloud_state.slots[slot] = download->entry;
+      memset(&download->entry,0,sizeof(download->entry));
+      applied = true;
+    }else printf("Failed to download cloud save state %zu\n",slot);
+    cloud_state.save_states_busy[slot] = false;
+  }
+  mutex_unlock(cloud_state.save_states_mutex);
+  if(applied)se_cloud_write_cache(slot,gui_instance.emu_state.game_checksum,state_hash,download->data,data_size);
+  se_cloud_free_slot(&download->entry);
+  free(download->requests);
+  free(download->data);
+  free(download);
+}
+static void se_cloud_release_slot_download(se_cloud_slot_download_t* download){
+  mutex_lock(cloud_state.save_states_mutex);
+  bool done = --download->pending==0;
+  mutex_unlock(cloud_state.save_states_mutex);
+  if(done)se_cloud_finish_slot_download(download);
+}
+static void se_cloud_chunk_download_callback(void* userdata, void* data, size_t size){
+  se_cloud_chunk_request_t* request = (se_cloud_chunk_request_t*)userdata;
+  se_cloud_slot_download_t* download = request->download;
+  uint64_t data_size = download->entry.header.data_size;
+  size_t chunk_size = se_cloud_chunk_size(data_size,request->chunk);
+  uint8_t* chunk = download->data+(uint64_t)request->chunk*SE_CLOUD_CHUNK_SIZE;
+  mz_ulong out_size = chunk_size;
+  // Chunks are written to disjoint ranges so they can be decompressed without holding the lock
+  if(!data||mz_uncompress(chunk,&out_size,(const uint8_t*)data,size)!=MZ_OK||out_size!=chunk_size||
+     se_cloud_chunk_hash(chunk,chunk_size)!=download->entry.chunk_hashes[request->chunk]){
+    download->failed = true;
+  }
+  se_cloud_release_slot_download(download);
+}
+// Starts from the locally cached state of the slot and only downloads the chunks that differ
+static void se_cloud_download_slot(se_cloud_slot_download_t* download){
+  se_cloud_slot_t* entry = &download->entry;
+  uint64_t data_size = entry->header.data_size;
+  uint32_t num_chunks = se_cloud_num_chunks(data_size);
+  uint64_t cached_hash = 0;
+  download->data = se_cloud_read_cache(download->slot,gui_instance.emu_state.game_checksum,data_size,&cached_hash);
+  if(!download->data)download->data = (uint8_t*)calloc(1,data_size);
+  download->requests = (se_cloud_chunk_request_t*)calloc(num_chunks,sizeof(se_cloud_chunk_request_t));
+  download->pending = 1;
+  if(!download->data||!download->requests){
+    download->failed = true;
+    se_cloud_release_slot_download(download);
+    return;
+  }
+  int downloads = 0;
+  if(cached_hash!=entry->header.state_hash){
+    for(uint32_t c=0;c<num_chunks;++c){
+      uint8_t* chunk = download->data+(uint64_t)c*SE_CLOUD_CHUNK_SIZE;
+      size_t chunk_size = se_cloud_chunk_size(data_size,c);
+      if(se_cloud_chunk_hash(chunk,chunk_size)==entry->chunk_hashes[c])continue;
+      if(entry->chunk_hashes[c]==0){
+        memset(chunk,0,chunk_size);
+        continue;
+      }
+      char file[SB_FILE_PATH_SIZE];
+      se_cloud_chunk_name(file,entry->chunk_hashes[c]);
+      download->requests[c].download = download;
+      download->requests[c].chunk = c;
+      mutex_lock(cloud_state.save_states_mutex);
+      download->pending++;
+      mutex_unlock(cloud_state.save_states_mutex);
+      cloud_drive_download(cloud_state.drive, file, se_cloud_chunk_download_callback, download->requests+c);
+      downloads++;
+    }
+  }
+  printf("Downloading %d of %u chunks for cloud save state %zu\n",downloads,num_chunks,download->slot);
+  se_cloud_release_slot_download(download);
+}
+static void se_cloud_download_legacy_states(bool only_existing){
   for(size_t i=0;i<SE_NUM_SAVE_STATES;++i){
     char file[SB_FILE_PATH_SIZE];
-    snprintf(file,SB_FILE_PATH_SIZE,"%016llx.slot%d.state.png",emu_state.game_checksum,(int)i);
+    snprintf(file,SB_FILE_PATH_SIZE,"%016llx.slot%d"SE_BINARY_STATE_EXTENSION,gui_instance.emu_state.game_checksum,(int)i);
+    char png_file[SB_FILE_PATH_SIZE];
+    snprintf(png_file,SB_FILE_PATH_SIZE,"%016llx.slot%zu.state.png",gui_instance.emu_state.game_checksum,i);
+    if(only_existing&&!cloud_drive_file_exists(cloud_state.drive,file)&&!cloud_drive_file_exists(cloud_state.drive,png_file)){
+      cloud_state.save_states_busy[i] = false;
+      continue;
+    }
     cloud_drive_download(cloud_state.drive, file, se_state_download_callback, (void*)i);
   }
 }
+static bool se_cloud_parse_index(const uint8_t* data, size_t size, se_cloud_slot_t* slots){
+  se_cloud_index_header_t header;
+  if(size<sizeof(header))return false;
+  memcpy(&header,data,sizeof(header));
+  if(memcmp(header.magic,SE_CLOUD_INDEX_MAGIC,sizeof(header.magic))||header.version!=SE_CLOUD_INDEX_VERSION||
+     header.num_slots!=SE_NUM_SAVE_STATES||header.compressed_size>size-sizeof(header))return false;
+  mz_ulong body_size = header.body_size;
+  uint8_t* body = (uint8_t*)malloc(body_size);
+  bool valid = body&&mz_uncompress(body,&body_size,data+sizeof(header),header.compressed_size)==MZ_OK&&body_size==header.body_size;
+  size_t off = 0;
+  for(int i=0;i<SE_NUM_SAVE_STATES&&valid;++i){
+    se_cloud_slot_t* slot = slots+i;
+    if(off+sizeof(slot->header)>body_size){valid=false;break;}
+    memcpy(&slot->header,body+off,sizeof(slot->header));
+    off+=sizeof(slot->header);
+    if(!slot->header.valid)continue;
+    size_t screenshot_size = (size_t)slot->header.screenshot_width*slot->header.screenshot_height*4;
+    size_t hashes_size = se_cloud_num_chunks(slot->header.data_size)*sizeof(uint64_t);
+    if(slot->header.screenshot_width<0||slot->header.screenshot_height<0||screenshot_size>SE_MAX_SCREENSHOT_SIZE||
+       off+hashes_size+screenshot_size>body_size){valid=false;break;}
+    if(slot->header.data_size!=sizeof(se_emu_id)+se_get_core_size()+SE_RC_BUFFER_SIZE){
+      // Captured by a build with a different core layout
+      off+=hashes_size+screenshot_size;
+      memset(&slot->header,0,sizeof(slot->header));
+      continue;
+    }
+    slot->chunk_hashes = (uint64_t*)malloc(hashes_size);
+    slot->screenshot = (uint8_t*)malloc(screenshot_size+1);
+    if(!slot->chunk_hashes||!slot->screenshot){valid=false;break;}
+    memcpy(slot->chunk_hashes,body+off,hashes_size);
+    memcpy(slot->screenshot,body+off+hashes_size,screenshot_size);
+    off+=hashes_size+screenshot_size;
+  }
+  free(body);
+  if(!valid)for(int i=0;i<SE_NUM_SAVE_STATES;++i)se_cloud_free_slot(slots+i);
+  return valid;
+}
+static void se_cloud_index_download_callback(void* userdata, void* data, size_t size){
+  uint32_t generation = (uint32_t)(size_t)userdata;
+  if(generation!=cloud_state.generation)return;
+  se_cloud_slot_t slots[SE_NUM_SAVE_STATES];
+  memset(slots,0,sizeof(slots));
+  if(!data||!se_cloud_parse_index((const uint8_t*)data,size,slots)){
+    printf("Failed to load the cloud save state index\n");
+    se_cloud_download_legacy_states(false);
+    return;
+  }
+  for(size_t i=0;i<SE_NUM_SAVE_STATES;++i){
+    if(!slots[i].header.valid){
+      // Slots captured by older versions before the index existed
+      char file[SB_FILE_PATH_SIZE];
+      snprintf(file,SB_FILE_PATH_SIZE,"%016llx.slot%d"SE_BINARY_STATE_EXTENSION,gui_instance.emu_state.game_checksum,(int)i);
+      if(cloud_drive_file_exists(cloud_state.drive,file))cloud_drive_download(cloud_state.drive, file, se_state_download_callback, (void*)i);
+      else cloud_state.save_states_busy[i] = false;
+      continue;
+    }
+    se_cloud_slot_download_t* download = (se_cloud_slot_download_t*)calloc(1,sizeof(se_cloud_slot_download_t));
+    if(!download){
+      se_cloud_free_slot(slots+i);
+      cloud_state.save_states_busy[i] = false;
+      continue;
+    }
+    download->slot = i;
+    download->generation = generation;
+    download->entry = slots[i];
+    se_cloud_download_slot(download);
+  }
+}
+static void se_sync_cloud_save_states_callback(){
+  char file[SB_FILE_PATH_SIZE];
+  se_cloud_index_name(file);
+  if(cloud_drive_file_exists(cloud_state.drive,file)){
+    cloud_drive_download(cloud_state.drive, file, se_cloud_index_download_callback, (void*)(size_t)cloud_state.generation);
+  }else se_cloud_download_legacy_states(true);
+}
 static void se_sync_cloud_save_states(){
   if(cloud_state.drive == NULL) return;
   printf("Syncing cloud saves...\n");
+  mutex_lock(cloud_state.save_states_mutex);
+  cloud_state.generation++;
   for(size_t i=0;i<SE_NUM_SAVE_STATES;++i){
+    se_free_save_state(&cloud_state.save_states[i]);
     memset(&cloud_state.save_states[i], 0, sizeof(cloud_state.save_states[i]));
     cloud_state.save_states_busy[i] = true;
+    se_cloud_free_slot(cloud_state.slots+i);
   }
+  mutex_unlock(cloud_state.save_states_mutex);
   cloud_drive_sync(cloud_state.drive, se_sync_cloud_save_states_callback);
 }
 void se_drive_login(bool clicked, int x, int y, int w, int h){
@@ -3182,7 +8301,8 @@ void se_ra_register(bool clicked, int x, int y, int w, int h){
 #endif
 }
 void se_reset_save_states(){
-  for(int i=0;i<SE_NUM_SAVE_STATES;++i)save_states[i].valid = false;
+  // Released so the slots are sized for the next system
+  for(int i=0;i<SE_NUM_SAVE_STATES;++i)se_free_save_state(save_states+i);
 }
 
 static void se_draw_debug_menu(){
@@ -3297,11 +8417,9 @@ void se_reset_joy(sb_joy_t*joy){
 }
 
 void se_draw_image_opacity(uint8_t *data, int im_width, int im_height,int x, int y, int render_width, int render_height, bool has_alpha,float opacity){
-  sg_image *image = se_get_image();
-  if(!image||!data){return; }
+  if(!data){return; }
   if(im_width<=0)im_width=1;
   if(im_height<=0)im_height=1;
-  sg_image_data im_data={0};
   uint8_t * rgba8_data = data;
   if(has_alpha==false){
     rgba8_data= malloc(im_width*im_height*4);
@@ -3312,94 +8430,590 @@ void se_draw_image_opacity(uint8_t *data, int im_width, int im_height,int x, int
       rgba8_data[i*4+3]= 255; 
     }
   }
-  im_data.subimage[0][0].ptr = rgba8_data;
-  im_data.subimage[0][0].size = im_width*im_height*4; 
-  sg_image_desc desc={
-    .type=              SG_IMAGETYPE_2D,
-    .render_target=     false,
-    .width=             im_width,
-    .height=            im_height,
-    .num_slices=        1,
-    .num_mipmaps=       1,
-    .usage=             SG_USAGE_IMMUTABLE,
-    .pixel_format=      SG_PIXELFORMAT_RGBA8,
-    .sample_count=      1,
-    .min_filter=        SG_FILTER_NEAREST,
-    .mag_filter=        SG_FILTER_NEAREST,
-    .wrap_u=            SG_WRAP_CLAMP_TO_EDGE,
-    .wrap_v=            SG_WRAP_CLAMP_TO_EDGE,
-    .wrap_w=            SG_WRAP_CLAMP_TO_EDGE,
-    .border_color=      SG_BORDERCOLOR_OPAQUE_BLACK,
-    .max_anisotropy=    1,
-    .min_lod=           0.0f,
-    .max_lod=           1e9f,
-    .data=              im_data,
-  };
-
-  *image =  sg_make_image(&desc);
+  sg_image image = se_stream_image(rgba8_data,im_width,im_height);
   float dpi_scale = se_dpi_scale();
   unsigned tint = opacity*0xff;
   tint*=0x010101;
   tint|=0xff000000;
   ImDrawList_AddImage(igGetWindowDrawList(),
-    (ImTextureID)(uintptr_t)image->id,
+    (ImTextureID)(uintptr_t)image.id,
     (ImVec2){x/dpi_scale,y/dpi_scale},
     (ImVec2){(x+render_width)/dpi_scale,(y+render_height)/dpi_scale},
     (ImVec2){0,0},(ImVec2){1,1},
     tint);
   if(has_alpha==false)free(rgba8_data);
 }
+// Compiled the first time a screen is drawn so startup doesn't wait on the shader compiler
+static void se_init_lcd_pipeline(){
+  if(gui_state.lcd_pipeline.id!=SG_INVALID_ID)return;
+  sg_push_debug_group("LCD Shader Init");
 
-void se_draw_lcd(uint8_t *data, int im_width, int im_height,int x, int y, int render_width, int render_height, float rotation,bool is_touch){
-  sg_image *image = se_get_image();
-  if(!image||!data){return; }
-  if(im_width<=0)im_width=1;
-  if(im_height<=0)im_height=1;
-  sg_image_data im_data={0};
-  uint8_t * rgba8_data = data;
-  /*
-  Delta compression codec
-  static uint8_t last_value[1024*1024];
-  int packet_count=0;
-  uint32_t last_color =-1;
-  for(int i=0;i<im_width*im_height;++i){
-
-    uint16_t color = SB_BFE(rgba8_data[i*4+0]-last_value[i*4+0],3,5)|(SB_BFE(rgba8_data[i*4+1]-last_value[i*4+1],2,6)<<5)|(SB_BFE(rgba8_data[i*4+2]-last_value[i*4+2],3,5)<<11);
-    last_value[i*4+0]=rgba8_data[i*4+0];
-    last_value[i*4+1]=rgba8_data[i*4+1];
-    last_value[i*4+2]=rgba8_data[i*4+2];
-    if(color!=last_color){
-      packet_count++;
-      last_color=color;
-    }
-  }
-  printf("Compressed Size:%d\n",packet_count*2);
-  */
-  im_data.subimage[0][0].ptr = rgba8_data;
-  im_data.subimage[0][0].size = im_width*im_height*4; 
-  sg_image_desc desc={
-    .type=              SG_IMAGETYPE_2D,
-    .render_target=     false,
-    .width=             im_width,
-    .height=            im_height,
-    .num_slices=        1,
-    .num_mipmaps=       1,
-    .usage=             SG_USAGE_IMMUTABLE,
-    .pixel_format=      SG_PIXELFORMAT_RGBA8,
-    .sample_count=      1,
-    .min_filter=        SG_FILTER_NEAREST,
-    .mag_filter=        SG_FILTER_NEAREST,
-    .wrap_u=            SG_WRAP_CLAMP_TO_EDGE,
-    .wrap_v=            SG_WRAP_CLAMP_TO_EDGE,
-    .wrap_w=            SG_WRAP_CLAMP_TO_EDGE,
-    .border_color=      SG_BORDERCOLOR_OPAQUE_BLACK,
-    .max_anisotropy=    1,
-    .min_lod=           0.0f,
-    .max_lod=           1e9f,
-    .data=              im_data,
+  gui_state.lcd_prog = sg_make_shader(lcdprog_shader_desc(sg_query_backend()));
+  /* pipeline object for imgui rendering */
+  sg_pipeline_desc pip_desc={0};
+  pip_desc.layout.buffers[0].stride = 16;
+  {
+      sg_vertex_attr_desc* attr = &pip_desc.layout.attrs[0];
+      attr->offset =0;
+      attr->format = SG_VERTEXFORMAT_FLOAT2;
+  }
+  {
+      sg_vertex_attr_desc* attr = &pip_desc.layout.attrs[1];
+      attr->offset = 8;
+      attr->format = SG_VERTEXFORMAT_FLOAT2;
+  }
+  pip_desc.shader = gui_state.lcd_prog;
+  pip_desc.index_type = SG_INDEXTYPE_NONE;
+  pip_desc.colors[0].blend.enabled = false;
+  pip_desc.colors[0].blend.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA;
+  pip_desc.colors[0].blend.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA;
+  pip_desc.label = "lcd-pipeline";
+  gui_state.lcd_pipeline = sg_make_pipeline(&pip_desc);
+  printf("Built pipeline: %d\n",gui_state.lcd_pipeline.id);
+  gui_state.nds_prog = sg_make_shader(ndsprog_shader_desc(sg_query_backend()));
+  pip_desc.shader = gui_state.nds_prog;
+  pip_desc.label = "nds-lcd-pipeline";
+  gui_state.nds_pipeline = sg_make_pipeline(&pip_desc);
+  static float quad_verts[6*4]={
+    0,0, 0,0,
+    1,0, 1,0,
+    1,1, 1,1,
+
+    1,1, 1,1,
+    0,1, 0,1,
+    0,0, 0,0,
+  };
+
+  sg_buffer_desc vb_desc={
+    .usage     = SG_USAGE_IMMUTABLE,
+    .data.size =sizeof(quad_verts),
+    .data.ptr  = quad_verts
+  };
+  gui_state.quad_vb = sg_make_buffer(&vb_desc);
+  sg_pop_debug_group();
+}
+
+// Weight of the previous frames when emulating the slow response of the original LCDs
+static float se_screen_ghosting_coef(){
+  float strength = fminf(fmaxf(0.0f,gui_instance.emu_state.screen_ghosting_strength),1.0f);
+  if(gui_state.test_runner_mode)return 0;
+  switch(gui_instance.emu_state.system){
+    case SYSTEM_GB: return strength*(gui_instance.core.gb.model!=SB_GB? 0.2f: 0.5f);
+    case SYSTEM_GBA:
+    case SYSTEM_NDS: return strength*0.3f;
+  }
+  return 0;
+}
+static void se_init_ghost_pipeline(){
+  if(gui_state.ghost_pipeline.id!=SG_INVALID_ID)return;
+  gui_state.ghost_prog = sg_make_shader(ghostprog_shader_desc(sg_query_backend()));
+  sg_pipeline_desc pip_desc={0};
+  pip_desc.layout.buffers[0].stride = 16;
+  pip_desc.layout.attrs[0] = (sg_vertex_attr_desc){.offset=0,.format=SG_VERTEXFORMAT_FLOAT2};
+  pip_desc.layout.attrs[1] = (sg_vertex_attr_desc){.offset=8,.format=SG_VERTEXFORMAT_FLOAT2};
+  pip_desc.shader = gui_state.ghost_prog;
+  pip_desc.index_type = SG_INDEXTYPE_NONE;
+  pip_desc.colors[0].pixel_format = SG_PIXELFORMAT_RGBA8;
+  pip_desc.depth.pixel_format = SG_PIXELFORMAT_NONE;
+  pip_desc.sample_count = 1;
+  pip_desc.label = "ghost-pipeline";
+  gui_state.ghost_pipeline = sg_make_pipeline(&pip_desc);
+}
+// Mixes the frames emulated since the last call into the ghosting history of stream_slot and
+// returns the history, or returns image when ghosting is off. Decays by frames emulated rather
+// than frames drawn, so the result doesn't depend on the UI frame rate, and renders nothing once
+// the screen is still and the old frames have faded out. Must be called outside of a render pass.
+static sg_image se_run_ghosting(int stream_slot, sg_image image, int width, int height){
+  se_ghost_slot_t* slot = gui_state.ghost_slots+stream_slot;
+  se_stream_image_t* stream = gui_state.stream_images+stream_slot;
+  float coef = se_screen_ghosting_coef();
+  if(coef<1.0f/128.0f||width<=0||height<=0){
+    slot->valid = false;
+    return image;
+  }
+  if(slot->width!=width||slot->height!=height){
+    se_free_ghost_slot(slot,true);
+    sg_image_desc desc = se_rgba8_image_desc(width,height,SG_USAGE_IMMUTABLE);
+    desc.render_target = true;
+    for(int t=0;t<2;++t){
+      slot->target[t] = sg_make_image(&desc);
+      slot->pass[t] = sg_make_pass(&(sg_pass_desc){.color_attachments[0].image=slot->target[t]});
+    }
+    slot->width = width;
+    slot->height = height;
+  }
+  bool changed = !slot->valid||slot->hash!=stream->hash;
+  uint64_t emulated_frames = gui_state.emulated_frames;
+  uint64_t frames = emulated_frames-slot->frame;
+  // A new picture always counts as at least one frame, e.g. when a paused game is redrawn
+  if(changed&&frames==0)frames=1;
+  if(frames>64)frames=64;
+  float weight = slot->valid? powf(coef,frames): 0;
+  if(frames&&(changed||slot->residual>=1.0f/512.0f)){
+    sg_push_debug_group("Screen Ghosting");
+    se_init_lcd_pipeline();
+    se_init_ghost_pipeline();
+    // The same frame mixed in n times is frame*(1-coef^n)+history*coef^n
+    ghost_params_t params={.history_weight = weight};
+    sg_pass_action action={.colors[0].action=SG_ACTION_DONTCARE};
+    sg_begin_pass(slot->pass[!slot->current],&action);
+    sg_apply_pipeline(gui_state.ghost_pipeline);
+    sg_bindings bind={
+      .vertex_buffers[0] = gui_state.quad_vb,
+      .fs_images[SLOT_tex] = image,
+      .fs_images[SLOT_history] = slot->valid? slot->target[slot->current]: image,
+    };
+    sg_apply_bindings(&bind);
+    sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_ghost_params, SG_RANGE_REF(params));
+    sg_draw(0, 6, 1);
+    sg_end_pass();
+    sg_pop_debug_group();
+    slot->current = !slot->current;
+    slot->residual = changed? weight: slot->residual*weight;
+  }
+  slot->frame = emulated_frames;
+  slot->hash = stream->hash;
+  slot->valid = true;
+  return slot->target[slot->current];
+}
+static void se_init_scale_pipeline(){
+  if(gui_state.scale_pipeline.id!=SG_INVALID_ID)return;
+  gui_state.scale_prog = sg_make_shader(scaleprog_shader_desc(sg_query_backend()));
+  sg_pipeline_desc pip_desc={0};
+  pip_desc.layout.buffers[0].stride = 16;
+  pip_desc.layout.attrs[0] = (sg_vertex_attr_desc){.offset=0,.format=SG_VERTEXFORMAT_FLOAT2};
+  pip_desc.layout.attrs[1] = (sg_vertex_attr_desc){.offset=8,.format=SG_VERTEXFORMAT_FLOAT2};
+  pip_desc.shader = gui_state.scale_prog;
+  pip_desc.index_type = SG_INDEXTYPE_NONE;
+  // Offscreen targets have no depth buffer or MSAA, unlike the swapchain
+  pip_desc.colors[0].pixel_format = SG_PIXELFORMAT_RGBA8;
+  pip_desc.depth.pixel_format = SG_PIXELFORMAT_NONE;
+  pip_desc.sample_count = 1;
+  pip_desc.label = "scale-pipeline";
+  gui_state.scale_pipeline = sg_make_pipeline(&pip_desc);
+}
+// Runs the upscaling passes of the selected chain on the image uploaded to stream_slot. Returns
+// the output and updates width and height to its size, or returns image when no chain is selected.
+// Must be called outside of a render pass.
+static sg_image se_run_shader_chain(int stream_slot, sg_image image, int* width, int* height){
+  int chain = gui_state.test_runner_mode? 0: gui_state.settings.shader_chain;
+  if(chain<=0||chain>=SE_NUM_SHADER_CHAINS||*width<=0||*height<=0)return image;
+  const se_shader_chain_t* c = se_shader_chains+chain;
+  se_shader_chain_slot_t* slot = gui_state.shader_chain_slots+stream_slot;
+  se_stream_image_t* stream = gui_state.stream_images+stream_slot;
+  if(slot->chain!=chain||slot->width!=*width||slot->height!=*height){
+    se_free_shader_chain_slot(slot,true);
+    int w = *width, h = *height;
+    for(int p=0;p<c->num_passes;++p){
+      w*=c->scale[p];
+      h*=c->scale[p];
+      sg_image_desc desc = se_rgba8_image_desc(w,h,SG_USAGE_IMMUTABLE);
+      desc.render_target = true;
+      slot->target[p] = sg_make_image(&desc);
+      slot->pass[p] = sg_make_pass(&(sg_pass_desc){.color_attachments[0].image=slot->target[p]});
+    }
+    slot->chain = chain;
+    slot->width = *width;
+    slot->height = *height;
+  }
+  if(!slot->valid||slot->image_id!=image.id||slot->hash!=stream->hash){
+    sg_push_debug_group("Shader Chain");
+    se_init_lcd_pipeline();
+    se_init_scale_pipeline();
+    sg_pass_action action={.colors[0].action=SG_ACTION_DONTCARE};
+    sg_image input = image;
+    int w = *width, h = *height;
+    for(int p=0;p<c->num_passes;++p){
+      scale_params_t params={
+        .source_size = {w,h},
+        .output_size = {w*c->scale[p],h*c->scale[p]},
+        .filter_type = c->filter[p],
+      };
+      sg_begin_pass(slot->pass[p],&action);
+      sg_apply_pipeline(gui_state.scale_pipeline);
+      sg_bindings bind={
+        .vertex_buffers[0] = gui_state.quad_vb,
+        .fs_images[0] = input
+      };
+      sg_apply_bindings(&bind);
+      sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_scale_params, SG_RANGE_REF(params));
+      sg_draw(0, 6, 1);
+      sg_end_pass();
+      input = slot->target[p];
+      w*=c->scale[p];
+      h*=c->scale[p];
+    }
+    sg_pop_debug_group();
+    slot->valid = true;
+    slot->image_id = image.id;
+    slot->hash = stream->hash;
+  }
+  for(int p=0;p<c->num_passes;++p){
+    *width*=c->scale[p];
+    *height*=c->scale[p];
+  }
+  return slot->target[c->num_passes-1];
+}
+static int se_nds_3d_scale(){
+  // GLSL ES 1.0 can't write the depth of a pixel
+  if(gui_state.test_runner_mode||sg_query_backend()==SG_BACKEND_GLES2)return 1;
+  int scale = gui_state.settings.nds_3d_scale+1;
+  return scale<1? 1: scale>8? 8: scale;
+}
+static void se_init_nds_3d_pipelines(){
+  se_nds_3d_t* gpu = &gui_state.nds_3d;
+  if(gpu->output_pipeline.id!=SG_INVALID_ID)return;
+  gpu->prog = sg_make_shader(nds3dprog_shader_desc(sg_query_backend()));
+  sg_pipeline_desc pip_desc={0};
+  pip_desc.layout.buffers[0].stride = SE_NDS_3D_VERTEX_FLOATS*4;
+  pip_desc.layout.attrs[ATTR_nds3dvs_position] = (sg_vertex_attr_desc){.offset=0,.format=SG_VERTEXFORMAT_FLOAT4};
+  pip_desc.layout.attrs[ATTR_nds3dvs_color0] = (sg_vertex_attr_desc){.offset=16,.format=SG_VERTEXFORMAT_FLOAT4};
+  pip_desc.layout.attrs[ATTR_nds3dvs_texcoord0] = (sg_vertex_attr_desc){.offset=32,.format=SG_VERTEXFORMAT_FLOAT2};
+  pip_desc.layout.attrs[ATTR_nds3dvs_poly0] = (sg_vertex_attr_desc){.offset=40,.format=SG_VERTEXFORMAT_FLOAT4};
+  pip_desc.layout.attrs[ATTR_nds3dvs_wrap0] = (sg_vertex_attr_desc){.offset=56,.format=SG_VERTEXFORMAT_FLOAT4};
+  pip_desc.layout.attrs[ATTR_nds3dvs_flags0] = (sg_vertex_attr_desc){.offset=72,.format=SG_VERTEXFORMAT_FLOAT4};
+  pip_desc.shader = gpu->prog;
+  pip_desc.index_type = SG_INDEXTYPE_NONE;
+  pip_desc.colors[0].pixel_format = SG_PIXELFORMAT_RGBA8;
+  pip_desc.depth.pixel_format = SG_PIXELFORMAT_DEPTH;
+  pip_desc.sample_count = 1;
+  pip_desc.label = "nds-3d-pipeline";
+  for(int o=0;o<3;++o)for(int k=0;k<3;++k)for(int e=0;e<2;++e){
+    sg_blend_state blend = {0};
+    if(o==0){
+      // Opaque polygons output an alpha of 1. The alpha of the core is the max of both, not a blend.
+      blend = (sg_blend_state){.enabled=true,
+        .src_factor_rgb=SG_BLENDFACTOR_SRC_ALPHA,.dst_factor_rgb=SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+        .src_factor_alpha=SG_BLENDFACTOR_ONE,.dst_factor_alpha=SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA};
+    }else if(o==1&&k){
+      // Translucent pixels only keep the fog flag if it's set for both polygons
+      blend = (sg_blend_state){.enabled=true,
+        .src_factor_rgb=SG_BLENDFACTOR_ONE,.dst_factor_rgb=SG_BLENDFACTOR_ZERO,
+        .src_factor_alpha=SG_BLENDFACTOR_ZERO,.dst_factor_alpha=SG_BLENDFACTOR_SRC_ALPHA};
+    }
+    pip_desc.colors[0].blend = blend;
+    pip_desc.depth.write_enabled = k!=2;
+    // The margin of the equal depth test isn't emulated
+    pip_desc.depth.compare = e? SG_COMPAREFUNC_LESS_EQUAL: SG_COMPAREFUNC_LESS;
+    gpu->pipeline[o][k][e] = sg_make_pipeline(&pip_desc);
+  }
+  gpu->output_prog = sg_make_shader(nds3dcompprog_shader_desc(sg_query_backend()));
+  pip_desc = (sg_pipeline_desc){0};
+  pip_desc.layout.buffers[0].stride = 16;
+  pip_desc.layout.attrs[0] = (sg_vertex_attr_desc){.offset=0,.format=SG_VERTEXFORMAT_FLOAT2};
+  pip_desc.layout.attrs[1] = (sg_vertex_attr_desc){.offset=8,.format=SG_VERTEXFORMAT_FLOAT2};
+  pip_desc.shader = gpu->output_prog;
+  pip_desc.index_type = SG_INDEXTYPE_NONE;
+  pip_desc.colors[0].pixel_format = SG_PIXELFORMAT_RGBA8;
+  pip_desc.depth.pixel_format = SG_PIXELFORMAT_NONE;
+  pip_desc.sample_count = 1;
+  pip_desc.label = "nds-3d-output-pipeline";
+  gpu->output_pipeline = sg_make_pipeline(&pip_desc);
+
+  sg_image_desc desc = se_rgba8_image_desc(32,1,SG_USAGE_DYNAMIC);
+  gpu->toon = sg_make_image(&desc);
+  desc = se_rgba8_image_desc(64,1,SG_USAGE_DYNAMIC);
+  gpu->table = sg_make_image(&desc);
+  static const uint32_t white = 0xffffffff;
+  desc = se_rgba8_image_desc(1,1,SG_USAGE_IMMUTABLE);
+  desc.data.subimage[0][0] = (sg_range){&white,4};
+  gpu->white = sg_make_image(&desc);
+  size_t vb_size = NDS_GPU_MAX_TRIS*3*SE_NDS_3D_VERTEX_FLOATS*sizeof(float);
+  gpu->vb = sg_make_buffer(&(sg_buffer_desc){.size=vb_size,.usage=SG_USAGE_STREAM,.label="nds-3d-vertices"});
+  gpu->verts = (float*)malloc(vb_size);
+}
+static void se_free_nds_3d_textures(){
+  se_nds_3d_t* gpu = &gui_state.nds_3d;
+  for(int i=0;i<SE_NDS_3D_TEXTURES;++i){
+    if(gpu->textures[i].texels)se_free_image_deferred(gpu->textures[i].image);
+    gpu->textures[i].texels = NULL;
+  }
+  gpu->num_textures = 0;
+}
+// Returns the GPU copy of a decoded texture of the core, uploading it on the first use
+static sg_image se_nds_3d_texture(const uint32_t* texels, uint32_t tex_param){
+  se_nds_3d_t* gpu = &gui_state.nds_3d;
+  uint32_t size_bits = SB_BFE(tex_param,20,6);
+  if(gpu->num_textures>=SE_NDS_3D_TEXTURES/2)se_free_nds_3d_textures();
+  uint32_t hash = (((uintptr_t)texels^size_bits)*0x9E3779B97F4A7C15ull)>>40;
+  for(int probe=0;probe<SE_NDS_3D_TEXTURES;++probe){
+    se_nds_3d_texture_t* t = gpu->textures+((hash+probe)%SE_NDS_3D_TEXTURES);
+    if(t->texels==texels&&t->size_bits==size_bits)return t->image;
+    if(t->texels)continue;
+    int w = 8<<SB_BFE(tex_param,20,3), h = 8<<SB_BFE(tex_param,23,3);
+    sg_image_desc desc = se_rgba8_image_desc(w,h,SG_USAGE_IMMUTABLE);
+    desc.data.subimage[0][0] = (sg_range){texels,w*h*4};
+    t->image = sg_make_image(&desc);
+    t->texels = texels;
+    t->size_bits = size_bits;
+    gpu->num_textures++;
+    return t->image;
+  }
+  return gpu->white;
+}
+// Draws the triangles of the frame into the current pass of output (0: color, 1: attributes,
+// 2: depths). Opaque pixels come first in each batch, then the translucent ones, the way the
+// hardware sorts them.
+static void se_draw_nds_3d_tris(const nds_gpu_hires_t* hires, int output){
+  se_nds_3d_t* gpu = &gui_state.nds_3d;
+  const nds_gpu_poly_ram_t* poly_ram = &hires->queue.poly_ram;
+  uint32_t num_tris = poly_ram->num_tris;
+  nds3d_params_t params={
+    .alpha_test_ref = hires->alpha_test_ref/31.f,
+    .w_buffer = poly_ram->w_buffer,
+    .output_mode = output,
+  };
+  // Consecutive triangles with the same texture and state are drawn together
+  sg_image batch_image = gpu->white;
+  uint32_t batch_state = 0, start = 0;
+  for(uint32_t t=0;t<=num_tris;++t){
+    sg_image image = gpu->white;
+    uint32_t state = 0;
+    if(t<num_tris){
+      int poly = poly_ram->tri_poly[t];
+      uint32_t disp3dcnt = poly_ram->disp3dcnt[poly];
+      uint32_t poly_attr = poly_ram->poly_attr[poly];
+      if(SB_BFE(disp3dcnt,0,1)&&poly_ram->texels[poly])image = se_nds_3d_texture(poly_ram->texels[poly],poly_ram->tex_image_param[poly]);
+      // Equal depth test, alpha blending, depth writes of translucent pixels
+      state = SB_BFE(poly_attr,14,1)|SB_BFE(disp3dcnt,3,1)<<1|SB_BFE(poly_attr,11,1)<<2;
+      if(t>0&&image.id==batch_image.id&&state==batch_state)continue;
+    }
+    if(t>start){
+      sg_bindings bind={
+        .vertex_buffers[0] = gpu->vb,
+        .fs_images[SLOT_tex] = batch_image,
+        .fs_images[SLOT_toon] = gpu->toon,
+      };
+      int equal = SB_BFE(batch_state,0,1);
+      for(int translucent=0;translucent<=SB_BFE(batch_state,1,1);++translucent){
+        int kind = !translucent? 0: SB_BFE(batch_state,2,1)? 1: 2;
+        // Translucent pixels that don't write depth leave the depths as they are
+        if(output==2&&kind==2)continue;
+        params.translucent = translucent;
+        sg_apply_pipeline(gpu->pipeline[output][kind][equal]);
+        sg_apply_bindings(&bind);
+        sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_nds3d_params, SG_RANGE_REF(params));
+        sg_draw(start*3,(t-start)*3,1);
+      }
+    }
+    start = t;
+    batch_image = image;
+    batch_state = state;
+  }
+}
+// Draws the last 3D frame of the core into the color, attribute and depth images of
+// gui_state.nds_3d. Returns false if the textures of the frame have already been dropped by the
+// core, the images are left as they are then.
+static bool se_render_nds_3d(const nds_gpu_hires_t* hires){
+  se_nds_3d_t* gpu = &gui_state.nds_3d;
+  const nds_tex_cache_t* tex_cache = &gui_instance.scratch.nds.tex_cache;
+  const nds_gpu_poly_ram_t* poly_ram = &hires->queue.poly_ram;
+  const nds_gpu_vertex_ram_t* vert_ram = &hires->queue.vert_ram;
+  if(tex_cache->flushes!=hires->tex_cache_flushes)return false;
+  if(gpu->tex_cache_flushes!=hires->tex_cache_flushes){
+    se_free_nds_3d_textures();
+    gpu->tex_cache_flushes = hires->tex_cache_flushes;
+  }
+  uint32_t toon[32];
+  for(int i=0;i<32;++i){
+    uint16_t c = hires->toon_table[i];
+    toon[i] = 0xff000000;
+    SE_RPT3 toon[i]|= (SB_BFE(c,5*r,5)*255/31)<<(8*r);
+  }
+  sg_update_image(gpu->toon,&(sg_image_data){.subimage[0][0]={toon,sizeof(toon)}});
+  // Edge colors and the fog densities of nds_gpu_post_setup
+  uint32_t table[64]={0};
+  for(int i=0;i<8;++i)SE_RPT3 table[i]|= (SB_BFE(hires->edge_color[i],5*r,5)*8)<<(8*r);
+  for(int i=0;i<34;++i){
+    int d = hires->fog_table[i<32? i: 31];
+    table[8+i] = d==127? 128: d;
+  }
+  sg_update_image(gpu->table,&(sg_image_data){.subimage[0][0]={table,sizeof(table)}});
+
+  uint32_t num_tris = poly_ram->num_tris;
+  float* v = gpu->verts;
+  for(uint32_t t=0;t<num_tris;++t){
+    int poly = poly_ram->tri_poly[t];
+    uint32_t disp3dcnt = poly_ram->disp3dcnt[poly];
+    uint32_t poly_attr = poly_ram->poly_attr[poly];
+    uint32_t tex_param = poly_ram->tex_image_param[poly];
+    bool textured = SB_BFE(disp3dcnt,0,1)&&SB_BFE(tex_param,26,3);
+    for(int i=0;i<3;++i){
+      int vi = poly_ram->tri_verts[i][t];
+      SE_RPT4 *v++ = vert_ram->pos[r][vi];
+      SE_RPT3 *v++ = vert_ram->color[r][vi]/255.f;
+      *v++ = SB_BFE(poly_attr,16,5)/31.f;
+      SE_RPT2 *v++ = vert_ram->tex[r][vi];
+      *v++ = SB_BFE(poly_attr,4,2);
+      *v++ = textured;
+      *v++ = 8<<SB_BFE(tex_param,20,3);
+      *v++ = 8<<SB_BFE(tex_param,23,3);
+      *v++ = SB_BFE(tex_param,16,1);
+      *v++ = SB_BFE(tex_param,17,1);
+      *v++ = SB_BFE(tex_param,18,1);
+      *v++ = SB_BFE(tex_param,19,1);
+      *v++ = SB_BFE(disp3dcnt,1,1);
+      *v++ = SB_BFE(disp3dcnt,2,1);
+      *v++ = SB_BFE(disp3dcnt,3,1);
+      *v++ = SB_BFE(poly_attr,24,6)+64*SB_BFE(poly_attr,15,1);
+    }
+  }
+  if(num_tris)sg_update_buffer(gpu->vb,&(sg_range){gpu->verts,num_tris*3*SE_NDS_3D_VERTEX_FLOATS*sizeof(float)});
+
+  uint32_t clear = hires->clear_color, clear_depth = hires->clear_depth;
+  // All passes start from the clear plane and test against the depths they write themselves
+  sg_color clear_values[3]={
+    {SB_BFE(clear,0,5)*8/255.f,SB_BFE(clear,5,5)*8/255.f,SB_BFE(clear,10,5)*8/255.f,SB_BFE(clear,16,5)/31.f},
+    {SB_BFE(clear,24,6)/63.f,0,0,SB_BFE(clear,15,1)},
+    {SB_BFE(clear_depth,16,8)/255.f,SB_BFE(clear_depth,8,8)/255.f,SB_BFE(clear_depth,0,8)/255.f,1},
   };
+  for(int o=0;o<3;++o){
+    sg_pass_action action={
+      .colors[0]={.action=SG_ACTION_CLEAR,.value=clear_values[o]},
+      .depth={.action=SG_ACTION_CLEAR,.value=clear_depth/(float)NDS_GPU_DEPTH_MASK},
+    };
+    sg_begin_pass(gpu->pass[o],&action);
+    se_draw_nds_3d_tris(hires,o);
+    sg_end_pass();
+  }
+  return true;
+}
+// Replaces image, the uploaded NDS frame, with the frame at the resolution of the GPU 3D render
+// and updates width and height to its size. Returns false when the frame is left as it is, which
+// is the case for the frames the core rasterized itself.
+// Must be called outside of a render pass.
+static bool se_run_nds_3d(int stream_slot, sg_image* image, int* width, int* height){
+  se_nds_3d_t* gpu = &gui_state.nds_3d;
+  const nds_gpu_hires_t* hires = &gui_instance.scratch.nds.hires;
+  int scale = se_nds_3d_scale();
+  if(scale<=1||!hires->enabled||!hires->on_gpu||*width!=NDS_LCD_W||*height!=NDS_LCD_H*2)return false;
+  if(gpu->scale!=scale){
+    sg_pass no_pass = {SG_INVALID_ID};
+    se_free_render_targets(&gpu->color,&gpu->pass[0],1,true);
+    se_free_render_targets(&gpu->attrs,&gpu->pass[1],1,true);
+    se_free_render_targets(&gpu->depths,&gpu->pass[2],1,true);
+    se_free_render_targets(&gpu->depth,&no_pass,1,true);
+    se_free_render_targets(&gpu->output,&gpu->output_pass,1,true);
+    sg_image_desc desc = se_rgba8_image_desc(NDS_LCD_W*scale,NDS_LCD_H*scale,SG_USAGE_IMMUTABLE);
+    desc.render_target = true;
+    gpu->color = sg_make_image(&desc);
+    gpu->attrs = sg_make_image(&desc);
+    gpu->depths = sg_make_image(&desc);
+    desc.pixel_format = SG_PIXELFORMAT_DEPTH;
+    gpu->depth = sg_make_image(&desc);
+    sg_image targets[3] = {gpu->color,gpu->attrs,gpu->depths};
+    for(int o=0;o<3;++o)gpu->pass[o] = sg_make_pass(&(sg_pass_desc){.color_attachments[0].image=targets[o],.depth_stencil_attachment.image=gpu->depth});
+    desc = se_rgba8_image_desc(NDS_LCD_W*scale,NDS_LCD_H*2*scale,SG_USAGE_IMMUTABLE);
+    desc.render_target = true;
+    gpu->output = sg_make_image(&desc);
+    gpu->output_pass = sg_make_pass(&(sg_pass_desc){.color_attachments[0].image=gpu->output});
+    gpu->scale = scale;
+    gpu->rendered = gpu->output_valid = false;
+  }
+  se_stream_image_t* stream = gui_state.stream_images+stream_slot;
+  if(!gpu->rendered||gpu->frame!=hires->frame){
+    sg_push_debug_group("NDS 3D");
+    se_init_lcd_pipeline();
+    se_init_nds_3d_pipelines();
+    // The core didn't rasterize the frame, so a frame that can't be drawn keeps the last render
+    if(se_render_nds_3d(hires))gpu->rendered = true;
+    gpu->frame = hires->frame;
+    gpu->output_valid = false;
+    sg_pop_debug_group();
+  }
+  if(!gpu->rendered)return false;
+  uint16_t master_bright = nds9_io_read16(&gui_instance.core.nds,NDS_A_MASTER_BRIGHT);
+  if(!gpu->output_valid||gpu->output_image_id!=image->id||gpu->output_hash!=stream->hash||gpu->output_master_bright!=master_bright){
+    uint32_t disp3dcnt = hires->disp3dcnt;
+    int step_shift = SB_BFE(disp3dcnt,8,4);
+    uint32_t fog_color = hires->fog_color;
+    uint32_t clear = hires->clear_color;
+    int factor = SB_BFE(master_bright,0,5);
+    nds3dcomp_params_t params={
+      .fog_color = {SB_BFE(fog_color,0,5)*8,SB_BFE(fog_color,5,5)*8,SB_BFE(fog_color,10,5)*8,SB_BFE(fog_color,16,5)*8},
+      .fog = {hires->fog_offset,step_shift>10? 0: 10-step_shift,SB_BFE(disp3dcnt,7,1),SB_BFE(disp3dcnt,6,1)},
+      .post = {SB_BFE(disp3dcnt,5,1),SB_BFE(disp3dcnt,4,1),1.f/(NDS_LCD_W*scale),1.f/(NDS_LCD_H*scale)},
+      .clear = {SB_BFE(clear,24,6),hires->clear_depth,SB_BFE(master_bright,14,2),factor>16? 16: factor},
+    };
+    sg_pass_action action={.colors[0].action=SG_ACTION_DONTCARE};
+    sg_begin_pass(gpu->output_pass,&action);
+    sg_apply_pipeline(gpu->output_pipeline);
+    sg_bindings bind={
+      .vertex_buffers[0] = gui_state.quad_vb,
+      .fs_images[SLOT_frame] = *image,
+      .fs_images[SLOT_render] = gpu->color,
+      .fs_images[SLOT_attrs] = gpu->attrs,
+      .fs_images[SLOT_depths] = gpu->depths,
+      .fs_images[SLOT_table] = gpu->table,
+    };
+    sg_apply_bindings(&bind);
+    sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_nds3dcomp_params, SG_RANGE_REF(params));
+    sg_draw(0, 6, 1);
+    sg_end_pass();
+    gpu->output_valid = true;
+    gpu->output_image_id = image->id;
+    gpu->output_hash = stream->hash;
+    gpu->output_master_bright = master_bright;
+  }
+  *image = gpu->output;
+  *width = NDS_LCD_W*scale;
+  *height = NDS_LCD_H*2*scale;
+  return true;
+}
+// Maps the mouse and touch points inside the rotated render box to the emulated touch screen
+static void se_lcd_touch_input(int x, int y, int render_width, int render_height, float rotation){
+  float tx = gui_state.mouse_pos[0];
+  float ty = gui_state.mouse_pos[1];
+  tx-=x;
+  ty-=y;
+
+  float rx=cos(-rotation)*tx-sin(-rotation)*ty;
+  float ry=sin(-rotation)*tx+cos(-rotation)*ty;
+
+  rx/=render_width;
+  ry/=render_height;
+  rx+=0.5;
+  ry+=0.5;
+
+  gui_instance.emu_state.joy.touch_pos[0]=rx;
+  gui_instance.emu_state.joy.touch_pos[1]=ry;
+  if(gui_state.mouse_button[0]&&rx>=0&&rx<=1.0&&ry>=0.&&ry<=1.0)gui_instance.emu_state.joy.inputs[SE_KEY_PEN_DOWN]=true;
+
+  for(int i=0;i<SAPP_MAX_TOUCHPOINTS;++i){
+    if(gui_state.touch_points[i].active==false)continue;
+
+    float tx = gui_state.touch_points[i].pos[0];
+    float ty = gui_state.touch_points[i].pos[1];
+    tx-=x;
+    ty-=y;
+
+    float rx=cos(-rotation)*tx-sin(-rotation)*ty;
+    float ry=sin(-rotation)*tx+cos(-rotation)*ty;
+
+    rx/=render_width;
+    ry/=render_height;
+    rx+=0.5;
+    ry+=0.5;
 
-  *image =  sg_make_image(&desc);
+    if(rx>=0&&rx<=1.0&&ry>=0.&&ry<=1.0){
+      gui_instance.emu_state.joy.touch_pos[0]=rx;
+      gui_instance.emu_state.joy.touch_pos[1]=ry;
+      gui_instance.emu_state.joy.inputs[SE_KEY_PEN_DOWN]=true;
+      break;
+    }
+  }
+}
+// lcd_width and lcd_height are the emulated resolution, smaller than the image after upscaling passes
+static lcd_params_t se_lcd_params(int im_width, int im_height, int lcd_width, int lcd_height, int x, int y, int render_width, int render_height, float rotation){
+  if(im_width<=0)im_width=1;
+  if(im_height<=0)im_height=1;
+  if(lcd_width<=0)lcd_width=1;
+  if(lcd_height<=0)lcd_height=1;
+  bool upscaled = im_width!=lcd_width||im_height!=lcd_height;
+  int display_mode = gui_state.test_runner_mode?0:gui_state.settings.screen_shader;
+  // The single pass xBRZ has nothing left to do, and integer scaling of the native resolution
+  // isn't one of the upscaled image
+  if(upscaled&&display_mode==4)display_mode = 0;
   float dpi_scale = se_dpi_scale();
 
   ImGuiIO* io = igGetIO();
@@ -3407,7 +9021,6 @@ void se_draw_lcd(uint8_t *data, int im_width, int im_height,int x, int y, int re
   const int fb_width = (int) (io->DisplaySize.x * dpi_scale);
   const int fb_height = (int) (io->DisplaySize.y * dpi_scale);
 
-  sg_apply_pipeline(gui_state.lcd_pipeline);
   se_lcd_info_t lcd_info=se_get_lcd_info();
   lcd_params_t lcd_params={
     .display_size[0] = fb_width,
@@ -3418,67 +9031,31 @@ void se_draw_lcd(uint8_t *data, int im_width, int im_height,int x, int y, int re
     .render_size[1]= render_height,
     .emu_lcd_size[0]= im_width,
     .emu_lcd_size[1]= im_height,
-    .display_mode = gui_state.test_runner_mode?0:gui_state.settings.screen_shader,
+    .lcd_grid_size[0]= lcd_width,
+    .lcd_grid_size[1]= lcd_height,
+    .display_mode = display_mode,
     .render_scale_x[0] = cos(rotation),
     .render_scale_x[1] = sin(rotation),
     .render_scale_y[0] = -sin(rotation),
     .render_scale_y[1] = cos(rotation),
     .lcd_is_grayscale = lcd_info.is_grayscale,
-    .integer_scaling = gui_state.settings.integer_scaling,
+    .integer_scaling = gui_state.settings.integer_scaling&&!upscaled,
     .input_gamma = lcd_info.gamma,
     .red_color = {lcd_info.red_color[0],lcd_info.red_color[1],lcd_info.red_color[2]},
     .green_color = {lcd_info.green_color[0],lcd_info.green_color[1],lcd_info.green_color[2]},
     .blue_color = {lcd_info.blue_color[0],lcd_info.blue_color[1],lcd_info.blue_color[2]},
     .color_correction_strength=gui_state.test_runner_mode?0:gui_state.settings.color_correction
   };
-
-  if(is_touch){
-    float tx = gui_state.mouse_pos[0];
-    float ty = gui_state.mouse_pos[1];
-    tx-=x;
-    ty-=y;
-
-    float rx=cos(-rotation)*tx-sin(-rotation)*ty;
-    float ry=sin(-rotation)*tx+cos(-rotation)*ty;
-
-    rx/=render_width;
-    ry/=render_height;
-    rx+=0.5;
-    ry+=0.5;
-
-    emu_state.joy.touch_pos[0]=rx;
-    emu_state.joy.touch_pos[1]=ry;
-    if(gui_state.mouse_button[0]&&rx>=0&&rx<=1.0&&ry>=0.&&ry<=1.0)emu_state.joy.inputs[SE_KEY_PEN_DOWN]=true;
-
-    for(int i=0;i<SAPP_MAX_TOUCHPOINTS;++i){
-      if(gui_state.touch_points[i].active==false)continue;
-
-      float tx = gui_state.touch_points[i].pos[0];
-      float ty = gui_state.touch_points[i].pos[1];
-      tx-=x;
-      ty-=y;
-
-      float rx=cos(-rotation)*tx-sin(-rotation)*ty;
-      float ry=sin(-rotation)*tx+cos(-rotation)*ty;
-
-      rx/=render_width;
-      ry/=render_height;
-      rx+=0.5;
-      ry+=0.5;
-
-      if(rx>=0&&rx<=1.0&&ry>=0.&&ry<=1.0){
-        emu_state.joy.touch_pos[0]=rx;
-        emu_state.joy.touch_pos[1]=ry;
-        emu_state.joy.inputs[SE_KEY_PEN_DOWN]=true;
-        break;
-      }
-    }
-
-  }
-
+  return lcd_params;
+}
+void se_draw_lcd(sg_image image, int im_width, int im_height, int lcd_width, int lcd_height, int x, int y, int render_width, int render_height, float rotation){
+  if(image.id==SG_INVALID_ID){return; }
+  lcd_params_t lcd_params = se_lcd_params(im_width,im_height,lcd_width,lcd_height,x,y,render_width,render_height,rotation);
+  se_init_lcd_pipeline();
+  sg_apply_pipeline(gui_state.lcd_pipeline);
   sg_bindings bind={
     .vertex_buffers[0] = gui_state.quad_vb,
-    .fs_images[0] = *image
+    .fs_images[0] = image
   };
   sg_apply_bindings(&bind);
   sg_apply_uniforms(SG_SHADERSTAGE_VS, 0, SG_RANGE_REF(lcd_params));
@@ -3486,6 +9063,44 @@ void se_draw_lcd(uint8_t *data, int im_width, int im_height,int x, int y, int re
   int verts = 6;
   sg_draw(0, verts, 1);
 }
+// Draws an NDS layout in one pass. The image holds the top screen over the bottom one, rects
+// are the parts of the render box showing each of them, see se_draw_nds_screens_defer.
+static void se_draw_nds_lcd(sg_image image, int im_width, int im_height, int x, int y, int render_width, int render_height, float rotation, const float rects[3][4], const float rect_screen[3]){
+  if(image.id==SG_INVALID_ID){return; }
+  lcd_params_t lcd = se_lcd_params(im_width,im_height/2,NDS_LCD_W,NDS_LCD_H,x,y,render_width,render_height,rotation);
+  nds_vs_params_t vs_params={
+    .display_size = {lcd.display_size[0],lcd.display_size[1]},
+    .render_off = {lcd.render_off[0],lcd.render_off[1]},
+    .render_size = {lcd.render_size[0],lcd.render_size[1]},
+    .render_scale_x = {lcd.render_scale_x[0],lcd.render_scale_x[1]},
+    .render_scale_y = {lcd.render_scale_y[0],lcd.render_scale_y[1]},
+  };
+  nds_params_t params={
+    .rect_screen = {rect_screen[0],rect_screen[1],rect_screen[2]},
+    .box_size = {lcd.render_size[0],lcd.render_size[1]},
+    .screen_size = {lcd.emu_lcd_size[0],lcd.emu_lcd_size[1]},
+    .grid_size = {lcd.lcd_grid_size[0],lcd.lcd_grid_size[1]},
+    .display_mode = lcd.display_mode,
+    .lcd_is_grayscale = lcd.lcd_is_grayscale,
+    .integer_scaling = lcd.integer_scaling,
+    .color_correction_strength = lcd.color_correction_strength,
+    .input_gamma = lcd.input_gamma,
+  };
+  memcpy(params.rects,rects,sizeof(params.rects));
+  memcpy(params.red_color,lcd.red_color,sizeof(params.red_color));
+  memcpy(params.green_color,lcd.green_color,sizeof(params.green_color));
+  memcpy(params.blue_color,lcd.blue_color,sizeof(params.blue_color));
+  se_init_lcd_pipeline();
+  sg_apply_pipeline(gui_state.nds_pipeline);
+  sg_bindings bind={
+    .vertex_buffers[0] = gui_state.quad_vb,
+    .fs_images[0] = image
+  };
+  sg_apply_bindings(&bind);
+  sg_apply_uniforms(SG_SHADERSTAGE_VS, SLOT_nds_vs_params, SG_RANGE_REF(vs_params));
+  sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_nds_params, SG_RANGE_REF(params));
+  sg_draw(0, 6, 1);
+}
 
 void se_draw_image(uint8_t *data, int im_width, int im_height,int x, int y, int render_width, int render_height, bool has_alpha){
   se_draw_image_opacity(data,im_width,im_height,x,y,render_width,render_height,has_alpha,1.0);
@@ -3917,6 +9532,97 @@ bool se_handle_keybind_settings(int keybind_type, se_keybind_state_t * state){
   igPopID();
   return settings_changed;
 }
+// Replays the geometry recorded for the same key instead of building it again. Used for parts of the
+// UI that are costly to tessellate but rarely change, like the circles of the touch controller.
+#define SE_DRAW_CACHE_MAX_KEY 512
+#define SE_DRAW_CACHE_MAX_CMDS 32
+typedef struct{
+  ImTextureID texture;
+  int idx_start;
+  int idx_count;
+}se_draw_cache_cmd_t;
+typedef struct{
+  uint8_t key[SE_DRAW_CACHE_MAX_KEY];
+  size_t key_size;
+  bool valid;
+  ImDrawVert* vtx;
+  ImDrawIdx* idx; // Relative to the first vertex
+  int vtx_capacity, idx_capacity;
+  int vtx_count, idx_count;
+  se_draw_cache_cmd_t cmds[SE_DRAW_CACHE_MAX_CMDS];
+  int num_cmds;
+  // Draw list state when recording started
+  int rec_cmd, rec_idx, rec_vtx;
+  unsigned rec_vtx_current, rec_vtx_offset;
+  uint32_t rec_lcd_draws;
+}se_draw_cache_t;
+static se_draw_cache_t se_touch_controller_draw_cache;
+// Theme regions with a screen queue a deferred LCD draw, which a replay would miss
+static uint32_t se_lcd_in_rect_draws = 0;
+
+static bool se_draw_cache_replay(se_draw_cache_t* cache, ImDrawList* dl, const void* key, size_t key_size){
+  if(!cache->valid||cache->key_size!=key_size||memcmp(cache->key,key,key_size))return false;
+  if(!cache->vtx_count)return true;
+  ImDrawList_PrimReserve(dl,0,cache->vtx_count);
+  unsigned base = dl->_VtxCurrentIdx;
+  memcpy(dl->_VtxWritePtr,cache->vtx,cache->vtx_count*sizeof(ImDrawVert));
+  dl->_VtxWritePtr+=cache->vtx_count;
+  dl->_VtxCurrentIdx+=cache->vtx_count;
+  for(int c=0;c<cache->num_cmds;++c){
+    se_draw_cache_cmd_t* cmd = cache->cmds+c;
+    ImDrawList_PushTextureID(dl,cmd->texture);
+    ImDrawList_PrimReserve(dl,cmd->idx_count,0);
+    const ImDrawIdx* src = cache->idx+cmd->idx_start;
+    for(int i=0;i<cmd->idx_count;++i)dl->_IdxWritePtr[i]=(ImDrawIdx)(src[i]+base);
+    dl->_IdxWritePtr+=cmd->idx_count;
+    ImDrawList_PopTextureID(dl);
+  }
+  return true;
+}
+static void se_draw_cache_begin(se_draw_cache_t* cache, ImDrawList* dl){
+  cache->valid = false;
+  cache->rec_cmd = dl->CmdBuffer.Size-1;
+  cache->rec_idx = dl->IdxBuffer.Size;
+  cache->rec_vtx = dl->VtxBuffer.Size;
+  cache->rec_vtx_current = dl->_VtxCurrentIdx;
+  cache->rec_vtx_offset = dl->_CmdHeader.VtxOffset;
+  cache->rec_lcd_draws = se_lcd_in_rect_draws;
+}
+static void se_draw_cache_end(se_draw_cache_t* cache, ImDrawList* dl, const void* key, size_t key_size){
+  if(key_size>sizeof(cache->key)||cache->rec_lcd_draws!=se_lcd_in_rect_draws)return;
+  int num_cmds = 0;
+  for(int c=cache->rec_cmd;c<dl->CmdBuffer.Size;++c){
+    ImDrawCmd* cmd = dl->CmdBuffer.Data+c;
+    int start = SE_MAX_CONST((int)cmd->IdxOffset,cache->rec_idx);
+    int end = cmd->IdxOffset+cmd->ElemCount;
+    if(end<=start)continue;
+    // Callbacks and geometry that spilled into a new 64k vertex block aren't replayed
+    if(cmd->UserCallback||cmd->VtxOffset!=cache->rec_vtx_offset||num_cmds==SE_DRAW_CACHE_MAX_CMDS)return;
+    cache->cmds[num_cmds++] = (se_draw_cache_cmd_t){cmd->TextureId,start-cache->rec_idx,end-start};
+  }
+  int vtx_count = dl->VtxBuffer.Size-cache->rec_vtx;
+  int idx_count = dl->IdxBuffer.Size-cache->rec_idx;
+  if(vtx_count>cache->vtx_capacity){
+    ImDrawVert* vtx = (ImDrawVert*)realloc(cache->vtx,vtx_count*sizeof(ImDrawVert));
+    if(!vtx)return;
+    cache->vtx = vtx;
+    cache->vtx_capacity = vtx_count;
+  }
+  if(idx_count>cache->idx_capacity){
+    ImDrawIdx* idx = (ImDrawIdx*)realloc(cache->idx,idx_count*sizeof(ImDrawIdx));
+    if(!idx)return;
+    cache->idx = idx;
+    cache->idx_capacity = idx_count;
+  }
+  memcpy(cache->vtx,dl->VtxBuffer.Data+cache->rec_vtx,vtx_count*sizeof(ImDrawVert));
+  for(int i=0;i<idx_count;++i)cache->idx[i]=dl->IdxBuffer.Data[cache->rec_idx+i]-cache->rec_vtx_current;
+  cache->vtx_count = vtx_count;
+  cache->idx_count = idx_count;
+  cache->num_cmds = num_cmds;
+  memcpy(cache->key,key,key_size);
+  cache->key_size = key_size;
+  cache->valid = true;
+}
 void sb_draw_onscreen_controller(sb_emu_state_t*state, int controller_h, int controller_y_pad,bool preview){
   if(state->run_mode!=SB_MODE_RUN&&preview==false)return;
   controller_h*=gui_state.settings.touch_controls_scale;
@@ -3988,7 +9694,7 @@ void sb_draw_onscreen_controller(sb_emu_state_t*state, int controller_h, int con
   float x_pos[2] = {10e9,10e9};
   float y_pos[2] = {10e9,10e9};
   float dpad_pos[2] = {dpad_sz1+button_padding*2,face_button_h*0.5+face_button_y};
-  if(emu_state.system==SYSTEM_GB){
+  if(gui_instance.emu_state.system==SYSTEM_GB){
     dpad_pos[1]*=0.8;
     a_pos[1]*=0.8;
     b_pos[1]*=0.8;
@@ -4013,7 +9719,7 @@ void sb_draw_onscreen_controller(sb_emu_state_t*state, int controller_h, int con
   };
 
 
-  bool abxy= emu_state.system==SYSTEM_NDS;
+  bool abxy= gui_instance.emu_state.system==SYSTEM_NDS;
 
   if(abxy){
     float fx = win_w-button_r*2.65;
@@ -4102,92 +9808,12 @@ void sb_draw_onscreen_controller(sb_emu_state_t*state, int controller_h, int con
     y_pos
   };
 
-  ImDrawList*dl= igGetWindowDrawList();
-  for(int i=0;i<4;++i){
-    ImU32 col = SB_BFE(gui_state.touch_controls.hold_toggle,i,1)?hold_color: SB_BFE(gui_state.touch_controls.turbo_toggle,i,1)? turbo_color: line_color;
-    bool pressed = SB_BFE(button_press|prev_pressed,i,1);
-    float * pos = key_pos[i];
-
-    if(se_draw_theme_region_tint(SE_REGION_KEY_A+i*2+(pressed?1:0),
-                             pos[0]-button_r*themed_scale,
-                             pos[1]-button_r*themed_scale,
-                             button_r*2*themed_scale,
-                             button_r*2*themed_scale,
-                             col));
-    else if(se_draw_theme_region_tint(SE_REGION_KEY_A+i*2,
-                             pos[0]-button_r*themed_scale,
-                             pos[1]-button_r*themed_scale,
-                             button_r*2*themed_scale,
-                             button_r*2*themed_scale,
-                             col)){
-      if(pressed)  ImDrawList_AddCircleFilled(dl,(ImVec2){pos[0],pos[1]},button_r,sel_color,128);
-
-    }else if(se_draw_theme_region_tint(SE_REGION_KEY_BLANK+(pressed?1:0),
-                             pos[0]-button_r*themed_scale,
-                             pos[1]-button_r*themed_scale,
-                             button_r*2*themed_scale,
-                             button_r*2*themed_scale,
-                             col));
-    else if(se_draw_theme_region_tint(SE_REGION_KEY_BLANK,
-                             pos[0]-button_r*themed_scale,
-                             pos[1]-button_r*themed_scale,
-                             button_r*2*themed_scale,
-                             button_r*2*themed_scale,
-                             col)){
-      if(pressed)  ImDrawList_AddCircleFilled(dl,(ImVec2){pos[0],pos[1]},button_r,sel_color,128);
-    }else{
-      if(pressed)  ImDrawList_AddCircleFilled(dl,(ImVec2){pos[0],pos[1]},button_r,sel_color,128);
-      ImDrawList_AddCircle(dl,(ImVec2){pos[0],pos[1]},button_r,line_color2,128,line_w1);
-      ImDrawList_AddCircle(dl,(ImVec2){pos[0],pos[1]},button_r,col,128,line_w0);
-    }
-  }
-
   int dpad_code = up ? 0: down? 6: 3; 
   dpad_code += left? 0: right? 2: 1; 
   if(dpad_code==4){
     dpad_code = state->prev_frame_joy.inputs[SE_KEY_UP]>0.2 ? 0: state->prev_frame_joy.inputs[SE_KEY_DOWN]>0.2? 6: 3; 
     dpad_code += state->prev_frame_joy.inputs[SE_KEY_LEFT]>0.2? 0: state->prev_frame_joy.inputs[SE_KEY_RIGHT]>0.2? 2: 1; 
   }
-  bool draw_dpad = !se_draw_theme_region_tint(SE_REGION_DPAD_UL+dpad_code,dpad_pos[0]-dpad_sz1*themed_scale,
-                                              dpad_pos[1]-dpad_sz1*themed_scale,
-                                              dpad_sz1*2*themed_scale,
-                                              dpad_sz1*2*themed_scale,
-                                              line_color);
-  if(draw_dpad){
-    if(!se_draw_theme_region_tint(SE_REGION_DPAD_UL+4,dpad_pos[0]-dpad_sz1*themed_scale,
-                                              dpad_pos[1]-dpad_sz1*themed_scale,
-                                              dpad_sz1*2*themed_scale,
-                                              dpad_sz1*2*themed_scale,
-                                              line_color)){
-      ImVec2 dpad_points[12]={
-        //Up
-        {dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz0},
-        {dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz1}, 
-        {dpad_pos[0]+dpad_sz0,dpad_pos[1]+dpad_sz1}, 
-        //right
-        {dpad_pos[0]+dpad_sz0,dpad_pos[1]+dpad_sz0}, 
-        {dpad_pos[0]+dpad_sz1,dpad_pos[1]+dpad_sz0}, 
-        {dpad_pos[0]+dpad_sz1,dpad_pos[1]-dpad_sz0}, 
-        //Down
-        {dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz0},
-        {dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz1}, 
-        {dpad_pos[0]-dpad_sz0,dpad_pos[1]-dpad_sz1}, 
-        //left
-        {dpad_pos[0]-dpad_sz0,dpad_pos[1]-dpad_sz0}, 
-        {dpad_pos[0]-dpad_sz1,dpad_pos[1]-dpad_sz0}, 
-        {dpad_pos[0]-dpad_sz1,dpad_pos[1]+dpad_sz0}, 
-      };
-      ImDrawList_AddPolyline(dl,dpad_points,12,line_color2,true,line_w1);
-      ImDrawList_AddPolyline(dl,dpad_points,12,line_color,true,line_w0);
-    }
-
-    
-    if(dpad_code>=6) ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz0},(ImVec2){dpad_pos[0]+dpad_sz0,dpad_pos[1]+dpad_sz1},sel_color,0,ImDrawCornerFlags_None);
-    if(dpad_code<3)   ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]-dpad_sz0,dpad_pos[1]-dpad_sz1},(ImVec2){dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz0},sel_color,0,ImDrawCornerFlags_None);
-
-    if((dpad_code%3)==0) ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]-dpad_sz1,dpad_pos[1]-dpad_sz0},(ImVec2){dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz0},sel_color,0,ImDrawCornerFlags_None);
-    if((dpad_code%3)==2)ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz0},(ImVec2){dpad_pos[0]+dpad_sz1,dpad_pos[1]+dpad_sz0},sel_color,0,ImDrawCornerFlags_None);
-  }
   
   int hold_button =1;
   int turbo_button =2; 
@@ -4201,69 +9827,178 @@ void sb_draw_onscreen_controller(sb_emu_state_t*state, int controller_h, int con
     gui_state.touch_controls.last_hold_toggle_presses= gui_state.touch_controls.last_turbo_toggle_presses=0;
   }
 
-  for(int b=0;b<sizeof(bottom_row)/sizeof(bottom_row[0]);++b){                                           
-    int state = 0;   
-    int x_min = bottom_row[b].x;
-    int x_max = bottom_row[b].x+bottom_row[b].width;
-    if(bottom_row[b].width==0)continue;
-    int region = bottom_row[b].theme_region;
-    bool pressed = SB_BFE(prev_pressed,6+b,1);
+  // Everything that changes the look is worked out before drawing so the geometry can be cached.
+  // Rows 0-3 are the bottom row (Select, Hold, Turbo, Start), 4-5 the top row (L, R) and each uses
+  // the bit of its index+6 or index in button_press.
+  typedef struct{int x_min; int x_max; int y; int region; ImU32 col; uint32_t pressed; uint32_t visible;}row_button_t;
+  row_button_t row_buttons[6];
+  memset(row_buttons,0,sizeof(row_buttons));
+  for(int b=0;b<6;++b){
+    bool top = b>=4;
+    button_row_t* row = top? top_row+b-4: bottom_row+b;
+    int bit = top? b: b+6;
+    row_button_t* rb = row_buttons+b;
+    if(row->width==0||(top&&gui_instance.emu_state.system==SYSTEM_GB))continue;
+    rb->visible = true;
+    rb->x_min = row->x;
+    rb->x_max = row->x+row->width;
+    rb->y = top? win_y+button_padding: button_y;
+    rb->region = row->theme_region;
+    bool pressed = SB_BFE(prev_pressed,bit,1);
     for(int i = 0;i<p;++i){
-      int dx = points[i][0]-x_min;
-      int dy = points[i][1]-button_y;
-      if(dx>=-(x_max-x_min)*0.05 && dx<=(x_max-x_min)*1.05 && dy>=0 && dy<=button_h ){
-        button_press|=1<<(b+6); 
+      int dx = points[i][0]-rb->x_min;
+      int dy = points[i][1]-rb->y;
+      if(dx>=-(rb->x_max-rb->x_min)*0.05 && dx<=(rb->x_max-rb->x_min)*1.05 && dy>=0 && dy<=button_h ){
+        button_press|=1<<bit; 
         pressed=true;
-        region+=1;
+        rb->region+=1;
       }
     }
     ImU32 col = line_color;
-    if(b==turbo_button&&(pressed || gui_state.touch_controls.turbo_toggle))col=turbo_color;
-    if(b==hold_button&&(pressed || gui_state.touch_controls.hold_toggle))col=hold_color;
-    if(SB_BFE(gui_state.touch_controls.hold_toggle,b+6,1))col = hold_color;
-    if(SB_BFE(gui_state.touch_controls.turbo_toggle,b+6,1))col = turbo_color;
-    if(!se_draw_theme_region_tint(region+pressed,x_min,button_y,x_max-x_min,button_h,col)){
-      if(!se_draw_theme_region_tint(region,x_min,button_y,x_max-x_min,button_h,col)){
-        ImDrawList_AddRect(dl,(ImVec2){x_min,button_y},(ImVec2){x_max,button_y+button_h},line_color2,0,ImDrawCornerFlags_None,line_w1);  
-        ImDrawList_AddRect(dl,(ImVec2){x_min,button_y},(ImVec2){x_max,button_y+button_h},col,0,ImDrawCornerFlags_None,line_w0);  
-      }
-      if(pressed){
-        ImDrawList_AddRectFilled(dl,(ImVec2){x_min,button_y},(ImVec2){x_max,button_y+button_h},sel_color,0,ImDrawCornerFlags_None);  
-      }
-    }
-  }
-  button_y=win_y+button_padding;
-  if(emu_state.system!=SYSTEM_GB){
-    for(int b=0;b<sizeof(top_row)/sizeof(top_row[0]);++b){                                           
-      int state = 0;   
-      int x_min = top_row[b].x;; 
-      int x_max = top_row[b].x+top_row[b].width;
-      bool pressed = SB_BFE(prev_pressed,4+b,1);
-      int region = top_row[b].theme_region;
-      for(int i = 0;i<p;++i){
-        int dx = points[i][0]-x_min;
-        int dy = points[i][1]-button_y;
-        if(dx>=-(x_max-x_min)*0.05 && dx<=(x_max-x_min)*1.05 && dy>=0 && dy<=button_h ){
-          button_press|=1<<(b+4); 
-          pressed=true;
-          region++;
-        }
+    if(!top&&b==turbo_button&&(pressed || gui_state.touch_controls.turbo_toggle))col=turbo_color;
+    if(!top&&b==hold_button&&(pressed || gui_state.touch_controls.hold_toggle))col=hold_color;
+    if(SB_BFE(gui_state.touch_controls.hold_toggle,bit,1))col = hold_color;
+    if(SB_BFE(gui_state.touch_controls.turbo_toggle,bit,1))col = turbo_color;
+    rb->col = col;
+    rb->pressed = pressed;
+  }
+
+  struct{
+    float face_pos[4][2];
+    float dpad_pos[2];
+    float button_r, dpad_sz0, dpad_sz1;
+    ImU32 face_col[4];
+    uint32_t face_pressed;
+    int dpad_code;
+    row_button_t rows[6];
+    int button_h;
+    ImU32 line_color, line_color2, sel_color;
+    uint32_t theme, theme_image;
+    ImVec4 clip_rect;
+  }draw_key;
+  memset(&draw_key,0,sizeof(draw_key));
+  for(int i=0;i<4;++i){
+    draw_key.face_pos[i][0] = key_pos[i][0];
+    draw_key.face_pos[i][1] = key_pos[i][1];
+    draw_key.face_col[i] = SB_BFE(gui_state.touch_controls.hold_toggle,i,1)?hold_color: SB_BFE(gui_state.touch_controls.turbo_toggle,i,1)? turbo_color: line_color;
+  }
+  draw_key.face_pressed = (button_press|prev_pressed)&0xf;
+  draw_key.dpad_pos[0] = dpad_pos[0];
+  draw_key.dpad_pos[1] = dpad_pos[1];
+  draw_key.button_r = button_r;
+  draw_key.dpad_sz0 = dpad_sz0;
+  draw_key.dpad_sz1 = dpad_sz1;
+  draw_key.dpad_code = dpad_code;
+  memcpy(draw_key.rows,row_buttons,sizeof(row_buttons));
+  draw_key.button_h = button_h;
+  draw_key.line_color = line_color;
+  draw_key.line_color2 = line_color2;
+  draw_key.sel_color = sel_color;
+  draw_key.theme = gui_state.settings.theme;
+  draw_key.theme_image = gui_state.theme.image.id;
+
+  ImDrawList*dl= igGetWindowDrawList();
+  draw_key.clip_rect = dl->_CmdHeader.ClipRect;
+  se_draw_cache_t* draw_cache = &se_touch_controller_draw_cache;
+  if(!se_draw_cache_replay(draw_cache,dl,&draw_key,sizeof(draw_key))){
+    se_draw_cache_begin(draw_cache,dl);
+    for(int i=0;i<4;++i){
+      ImU32 col = draw_key.face_col[i];
+      bool pressed = SB_BFE(draw_key.face_pressed,i,1);
+      float * pos = key_pos[i];
+
+      if(se_draw_theme_region_tint(SE_REGION_KEY_A+i*2+(pressed?1:0),
+                               pos[0]-button_r*themed_scale,
+                               pos[1]-button_r*themed_scale,
+                               button_r*2*themed_scale,
+                               button_r*2*themed_scale,
+                               col));
+      else if(se_draw_theme_region_tint(SE_REGION_KEY_A+i*2,
+                               pos[0]-button_r*themed_scale,
+                               pos[1]-button_r*themed_scale,
+                               button_r*2*themed_scale,
+                               button_r*2*themed_scale,
+                               col)){
+        if(pressed)  ImDrawList_AddCircleFilled(dl,(ImVec2){pos[0],pos[1]},button_r,sel_color,128);
+
+      }else if(se_draw_theme_region_tint(SE_REGION_KEY_BLANK+(pressed?1:0),
+                               pos[0]-button_r*themed_scale,
+                               pos[1]-button_r*themed_scale,
+                               button_r*2*themed_scale,
+                               button_r*2*themed_scale,
+                               col));
+      else if(se_draw_theme_region_tint(SE_REGION_KEY_BLANK,
+                               pos[0]-button_r*themed_scale,
+                               pos[1]-button_r*themed_scale,
+                               button_r*2*themed_scale,
+                               button_r*2*themed_scale,
+                               col)){
+        if(pressed)  ImDrawList_AddCircleFilled(dl,(ImVec2){pos[0],pos[1]},button_r,sel_color,128);
+      }else{
+        if(pressed)  ImDrawList_AddCircleFilled(dl,(ImVec2){pos[0],pos[1]},button_r,sel_color,128);
+        ImDrawList_AddCircle(dl,(ImVec2){pos[0],pos[1]},button_r,line_color2,128,line_w1);
+        ImDrawList_AddCircle(dl,(ImVec2){pos[0],pos[1]},button_r,col,128,line_w0);
       }
-      ImU32 col = line_color;
+    }
+
+    bool draw_dpad = !se_draw_theme_region_tint(SE_REGION_DPAD_UL+dpad_code,dpad_pos[0]-dpad_sz1*themed_scale,
+                                                dpad_pos[1]-dpad_sz1*themed_scale,
+                                                dpad_sz1*2*themed_scale,
+                                                dpad_sz1*2*themed_scale,
+                                                line_color);
+    if(draw_dpad){
+      if(!se_draw_theme_region_tint(SE_REGION_DPAD_UL+4,dpad_pos[0]-dpad_sz1*themed_scale,
+                                                dpad_pos[1]-dpad_sz1*themed_scale,
+                                                dpad_sz1*2*themed_scale,
+                                                dpad_sz1*2*themed_scale,
+                                                line_color)){
+        ImVec2 dpad_points[12]={
+          //Up
+          {dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz0},
+          {dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz1}, 
+          {dpad_pos[0]+dpad_sz0,dpad_pos[1]+dpad_sz1}, 
+          //right
+          {dpad_pos[0]+dpad_sz0,dpad_pos[1]+dpad_sz0}, 
+          {dpad_pos[0]+dpad_sz1,dpad_pos[1]+dpad_sz0}, 
+          {dpad_pos[0]+dpad_sz1,dpad_pos[1]-dpad_sz0}, 
+          //Down
+          {dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz0},
+          {dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz1}, 
+          {dpad_pos[0]-dpad_sz0,dpad_pos[1]-dpad_sz1}, 
+          //left
+          {dpad_pos[0]-dpad_sz0,dpad_pos[1]-dpad_sz0}, 
+          {dpad_pos[0]-dpad_sz1,dpad_pos[1]-dpad_sz0}, 
+          {dpad_pos[0]-dpad_sz1,dpad_pos[1]+dpad_sz0}, 
+        };
+        ImDrawList_AddPolyline(dl,dpad_points,12,line_color2,true,line_w1);
+        ImDrawList_AddPolyline(dl,dpad_points,12,line_color,true,line_w0);
+      }
+
+      
+      if(dpad_code>=6) ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz0},(ImVec2){dpad_pos[0]+dpad_sz0,dpad_pos[1]+dpad_sz1},sel_color,0,ImDrawCornerFlags_None);
+      if(dpad_code<3)   ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]-dpad_sz0,dpad_pos[1]-dpad_sz1},(ImVec2){dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz0},sel_color,0,ImDrawCornerFlags_None);
+
+      if((dpad_code%3)==0) ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]-dpad_sz1,dpad_pos[1]-dpad_sz0},(ImVec2){dpad_pos[0]-dpad_sz0,dpad_pos[1]+dpad_sz0},sel_color,0,ImDrawCornerFlags_None);
+      if((dpad_code%3)==2)ImDrawList_AddRectFilled(dl,(ImVec2){dpad_pos[0]+dpad_sz0,dpad_pos[1]-dpad_sz0},(ImVec2){dpad_pos[0]+dpad_sz1,dpad_pos[1]+dpad_sz0},sel_color,0,ImDrawCornerFlags_None);
+    }
 
-      if(SB_BFE(gui_state.touch_controls.hold_toggle,b+4,1))col = hold_color;
-      if(SB_BFE(gui_state.touch_controls.turbo_toggle,b+4,1))col = turbo_color;
-      if(!se_draw_theme_region_tint(region+pressed,x_min,button_y,x_max-x_min,button_h,col)){
-        if(!se_draw_theme_region_tint(region,x_min,button_y,x_max-x_min,button_h,col)){
-          ImDrawList_AddRect(dl,(ImVec2){x_min,button_y},(ImVec2){x_max,button_y+button_h},line_color2,0,ImDrawCornerFlags_None,line_w1);  
-          ImDrawList_AddRect(dl,(ImVec2){x_min,button_y},(ImVec2){x_max,button_y+button_h},col,0,ImDrawCornerFlags_None,line_w0);  
+    for(int b=0;b<6;++b){
+      row_button_t* rb = row_buttons+b;
+      if(!rb->visible)continue;
+      int x_min = rb->x_min, x_max = rb->x_max, y = rb->y;
+      bool pressed = rb->pressed;
+      ImU32 col = rb->col;
+      if(!se_draw_theme_region_tint(rb->region+pressed,x_min,y,x_max-x_min,button_h,col)){
+        if(!se_draw_theme_region_tint(rb->region,x_min,y,x_max-x_min,button_h,col)){
+          ImDrawList_AddRect(dl,(ImVec2){x_min,y},(ImVec2){x_max,y+button_h},line_color2,0,ImDrawCornerFlags_None,line_w1);  
+          ImDrawList_AddRect(dl,(ImVec2){x_min,y},(ImVec2){x_max,y+button_h},col,0,ImDrawCornerFlags_None,line_w0);  
         }
-        if(pressed)ImDrawList_AddRectFilled(dl,(ImVec2){x_min,button_y},(ImVec2){x_max,button_y+button_h},sel_color,0,ImDrawCornerFlags_None);  
+        if(pressed)ImDrawList_AddRectFilled(dl,(ImVec2){x_min,y},(ImVec2){x_max,y+button_h},sel_color,0,ImDrawCornerFlags_None);  
       }
     }
+    se_draw_cache_end(draw_cache,dl,&draw_key,sizeof(draw_key));
   }
 
-
   bool hold = SB_BFE(button_press,7,1);
   bool turbo = SB_BFE(button_press,8,1);
   state->joy.inputs[SE_KEY_START] += SB_BFE(button_press,9,1);
@@ -4739,15 +10474,15 @@ void se_android_poll_events(bool visible){
     (*pJavaVM)->DetachCurrentThread(pJavaVM);
   }
 
-  for(int i=0;i<SE_NUM_KEYBINDS;++i)emu_state.joy.inputs[i]  += cont->key.value[i]>0.5;
+  for(int i=0;i<SE_NUM_KEYBINDS;++i)gui_instance.emu_state.joy.inputs[i]  += cont->key.value[i]>0.5;
 
-  emu_state.joy.inputs[SE_KEY_LEFT]  += cont->analog.value[SE_ANALOG_LEFT_RIGHT]<-0.3;
-  emu_state.joy.inputs[SE_KEY_RIGHT] += cont->analog.value[SE_ANALOG_LEFT_RIGHT]> 0.3;
-  emu_state.joy.inputs[SE_KEY_UP]   += cont->analog.value[SE_ANALOG_UP_DOWN]<-0.3;
-  emu_state.joy.inputs[SE_KEY_DOWN] += cont->analog.value[SE_ANALOG_UP_DOWN]>0.3;
+  gui_instance.emu_state.joy.inputs[SE_KEY_LEFT]  += cont->analog.value[SE_ANALOG_LEFT_RIGHT]<-0.3;
+  gui_instance.emu_state.joy.inputs[SE_KEY_RIGHT] += cont->analog.value[SE_ANALOG_LEFT_RIGHT]> 0.3;
+  gui_instance.emu_state.joy.inputs[SE_KEY_UP]   += cont->analog.value[SE_ANALOG_UP_DOWN]<-0.3;
+  gui_instance.emu_state.joy.inputs[SE_KEY_DOWN] += cont->analog.value[SE_ANALOG_UP_DOWN]>0.3;
 
-  emu_state.joy.inputs[SE_KEY_L]  += cont->analog.value[SE_ANALOG_L]>0.1;
-  emu_state.joy.inputs[SE_KEY_R]  += cont->analog.value[SE_ANALOG_R]>0.1;
+  gui_instance.emu_state.joy.inputs[SE_KEY_L]  += cont->analog.value[SE_ANALOG_L]>0.1;
+  gui_instance.emu_state.joy.inputs[SE_KEY_R]  += cont->analog.value[SE_ANALOG_R]>0.1;
 }
 
 void se_android_request_permissions(){
@@ -4806,13 +10541,13 @@ void se_download_emscripten_save_states()
   mz_zip_error zip_error;
   char archive_filename[SB_FILE_PATH_SIZE];
   const char* base, *file_name, *ext;
-  sb_breakup_path(emu_state.rom_path,&base,&file_name,&ext);
+  sb_breakup_path(gui_instance.emu_state.rom_path,&base,&file_name,&ext);
   snprintf(archive_filename,SB_FILE_PATH_SIZE,"%s.save_states.zip",file_name);
   for(int i=0;i<SE_NUM_SAVE_STATES;++i)
   {
     char save_state_path[SB_FILE_PATH_SIZE];
     char save_state_name[SB_FILE_PATH_SIZE];
-    snprintf(save_state_path,SB_FILE_PATH_SIZE,"%s.slot%d.state.png",emu_state.save_data_base_path,i);
+    snprintf(save_state_path,SB_FILE_PATH_SIZE,"%s.slot%d.state.png",gui_instance.emu_state.save_data_base_path,i);
     snprintf(save_state_name,SB_FILE_PATH_SIZE,"slot%d.state.png",i);
     if(!sb_file_exists(save_state_path))continue;
     size_t data_size;
@@ -4830,11 +10565,8 @@ void se_download_emscripten_save_states()
     if(cloud_state.save_states_busy[i]||cloud_state.save_states[i].valid==false)continue;
     char save_state_name[SB_FILE_PATH_SIZE];
     snprintf(save_state_name,SB_FILE_PATH_SIZE,"cloud.slot%d.state.png",i);
-    uint32_t width=0, height=0;
-    uint8_t* imdata = se_save_state_to_image(&cloud_state.save_states[i], &width,&height);
-    se_png_write_context_t cont ={0};
-    stbi_write_png_to_func(se_png_write_mem, &cont,width,height,4, imdata, 0);
-    free(imdata);
+    se_save_state_t* save_state = &cloud_state.save_states[i];
+    se_png_write_context_t cont = se_encode_save_state_png(save_state,se_prepare_save_state(save_state),se_get_core_size());
     if(cont.data){
       mz_bool status = mz_zip_add_mem_to_archive_file_in_place_v2(archive_filename,save_state_name,cont.data,cont.size,NULL,0,MZ_BEST_COMPRESSION,&zip_error);
       free(cont.data);
@@ -4867,8 +10599,8 @@ void se_bring_text_field_into_view(){
 }
 
 int file_sorter (const void * a, const void * b) {
-  tinydir_file*af = (tinydir_file*)a;
-  tinydir_file*bf = (tinydir_file*)b;
+  const se_file_browser_entry_t*af = (const se_file_browser_entry_t*)a;
+  const se_file_browser_entry_t*bf = (const se_file_browser_entry_t*)b;
   if(af->is_dir!=bf->is_dir)return af->is_dir?-1:1;
   int i=0;
   for(i = 0; af->path[i];++i){
@@ -4882,6 +10614,123 @@ int file_sorter (const void * a, const void * b) {
   }
   return bf->path[i]=='\0'?0:-1;
 }
+static bool se_file_browser_list_push(se_file_browser_list_t* list, const se_file_browser_entry_t* entries, size_t count){
+  if(list->size+count>list->capacity){
+    size_t capacity = SE_MAX_CONST(list->capacity*2,list->size+count);
+    capacity = SE_MAX_CONST(capacity,64);
+    se_file_browser_entry_t* new_entries = (se_file_browser_entry_t*)realloc(list->entries,capacity*sizeof(se_file_browser_entry_t));
+    if(!new_entries)return false;
+    list->entries = new_entries;
+    list->capacity = capacity;
+  }
+  memcpy(list->entries+list->size,entries,count*sizeof(se_file_browser_entry_t));
+  list->size+=count;
+  return true;
+}
+static void se_file_browser_list_free(se_file_browser_list_t* list){
+  for(size_t i=0;i<list->size;++i)free(list->entries[i].path);
+  free(list->entries);
+  memset(list,0,sizeof(*list));
+}
+// Directories are read on SE_ASYNC_FILE_BROWSER since SAF storage and network shares can take
+// seconds to list. Entries are handed to the UI in batches through pending.
+#define SE_FILE_LISTING_BATCH 128
+typedef struct{
+  char path[SB_FILE_PATH_SIZE];
+  const char** file_types;
+  unsigned num_file_types;
+  mutex_t mutex;
+  se_file_browser_list_t pending; // Guarded by mutex
+  volatile bool cancel;
+  volatile bool failed;
+  bool active;
+}se_file_listing_t;
+se_file_listing_t se_file_listing = {0};
+static void se_file_listing_flush(se_file_listing_t* listing, se_file_browser_list_t* batch){
+  mutex_lock(listing->mutex);
+  bool pushed = se_file_browser_list_push(&listing->pending,batch->entries,batch->size);
+  mutex_unlock(listing->mutex);
+  if(!pushed)for(size_t i=0;i<batch->size;++i)free(batch->entries[i].path);
+  batch->size = 0;
+}
+static void se_file_listing_job(void* user_data, int job_index){
+  se_file_listing_t* listing = (se_file_listing_t*)user_data;
+  tinydir_dir dir;
+  if(tinydir_open(&dir,listing->path)==-1){
+    printf("Error opening %s\n",listing->path);
+    listing->failed = true;
+    return;
+  }
+  se_file_browser_list_t batch={0};
+  for(;dir.has_next&&!listing->cancel;tinydir_next(&dir)){
+    tinydir_file file;
+    if(tinydir_readfile(&dir,&file)==-1)continue;
+    bool show_item = true; 
+    if(!file.is_dir){
+      show_item=false;
+      for(int i=0;i<listing->num_file_types;++i){
+        if(sb_path_has_file_ext(file.path,listing->file_types[i])){show_item=true;break;}
+      }
+      if(listing->num_file_types==0)show_item=true;
+    }else if(strcmp(file.name,".")==0||strcmp(file.name,"..")==0)show_item=false;
+    if(!show_item)continue;
+    size_t path_len = strlen(file.path);
+    se_file_browser_entry_t entry={0};
+    entry.path = (char*)malloc(path_len+1);
+    if(!entry.path)continue;
+    memcpy(entry.path,file.path,path_len+1);
+    size_t name_len = strlen(file.name);
+    entry.name = entry.path+(name_len<=path_len?path_len-name_len:0);
+    entry.is_dir = file.is_dir;
+    entry.is_link = file.is_link;
+    if(!se_file_browser_list_push(&batch,&entry,1)){
+      free(entry.path);
+      continue;
+    }
+    if(batch.size>=SE_FILE_LISTING_BATCH)se_file_listing_flush(listing,&batch);
+  }
+  if(batch.size)se_file_listing_flush(listing,&batch);
+  free(batch.entries);
+  tinydir_close(&dir);
+}
+// Starts listing path unless a (possibly cancelled) listing is still running
+static bool se_file_listing_start(const char* path, const char** file_types, unsigned num_file_types){
+  se_file_listing_t* listing = &se_file_listing;
+  if(listing->active)return false;
+  if(!listing->mutex)listing->mutex = mutex_create();
+  strncpy(listing->path,path,SB_FILE_PATH_SIZE-1);
+  listing->path[SB_FILE_PATH_SIZE-1]='\0';
+  listing->file_types = file_types;
+  listing->num_file_types = num_file_types;
+  listing->cancel = false;
+  listing->failed = false;
+  listing->active = true;
+  job_pool_run_async(SE_ASYNC_FILE_BROWSER,se_file_listing_job,listing);
+  return true;
+}
+// Moves the entries listed so far into list. Returns true once the listing finished (or was cancelled)
+static bool se_file_listing_poll(se_file_browser_list_t* list){
+  se_file_listing_t* listing = &se_file_listing;
+  if(!listing->active)return true;
+  bool done = !job_pool_async_busy(SE_ASYNC_FILE_BROWSER);
+  mutex_lock(listing->mutex);
+  se_file_browser_list_t pending = listing->pending;
+  memset(&listing->pending,0,sizeof(listing->pending));
+  mutex_unlock(listing->mutex);
+  if(listing->cancel||!list||!se_file_browser_list_push(list,pending.entries,pending.size)){
+    for(size_t i=0;i<pending.size;++i)free(pending.entries[i].path);
+  }
+  free(pending.entries);
+  if(done)listing->active = false;
+  return done;
+}
+static void se_file_listing_shutdown(){
+  se_file_listing.cancel = true;
+  job_pool_wait_async(SE_ASYNC_FILE_BROWSER);
+  se_file_listing_poll(NULL);
+  se_file_browser_list_free(&gui_state.file_browser.cached_files);
+  se_file_browser_list_free(&gui_state.file_browser.refreshed_files);
+}
 void se_file_browser_accept(const char * path){
   se_file_browser_state_t* file_browse = &gui_state.file_browser;
   if(file_browse->file_open_fn){
@@ -5090,67 +10939,72 @@ bool se_process_file_browser(){
   igSetNextWindowSize((ImVec2){w_size.x,w_size.y-list_y_off}, ImGuiCond_Always);
 
   igBegin(se_localize_and_cache(ICON_FK_FOLDER_OPEN " Open File From Disk"),NULL,ImGuiWindowFlags_NoCollapse|ImGuiWindowFlags_NoResize);
-  bool update_cache = file_browse->has_cache==false||file_browse->cached_time+5.<se_time()||strncmp(file_browse->cached_path,file_browse->current_path,SB_FILE_PATH_SIZE)!=0;
-  if(update_cache){
+  se_file_listing_t* listing = &se_file_listing;
+  if(strncmp(file_browse->cached_path,file_browse->current_path,SB_FILE_PATH_SIZE)!=0){
+    // Entries of the old directory still being listed are dropped
+    if(listing->active)listing->cancel = true;
+    se_file_browser_list_free(&file_browse->cached_files);
+    se_file_browser_list_free(&file_browse->refreshed_files);
     strncpy(file_browse->cached_path,file_browse->current_path,SB_FILE_PATH_SIZE);
-    file_browse->cached_time=se_time();
-    if(file_browse->has_cache){
-      if(file_browse->cached_files){
-        free(file_browse->cached_files);
-        file_browse->cached_files = NULL;
-        file_browse->num_cached_files=0;
-      }
-      tinydir_close(&file_browse->cached_dir);
-      file_browse->has_cache=false;
-    }
-    if(tinydir_open(&file_browse->cached_dir, gui_state.file_browser.current_path)==-1){
-      printf("Error opening %s\n",gui_state.file_browser.current_path);
-    }else{
-      int max_files = 4096;
-      file_browse->cached_files= (tinydir_file*)malloc(sizeof(tinydir_file)*max_files);
-      int f = 0; 
-      while(file_browse->cached_dir.has_next&&f<max_files){
-        tinydir_readfile(&file_browse->cached_dir, &file_browse->cached_files[f]);
-        char *ext = file_browse->cached_files[f].extension;
-        bool show_item = true; 
-        if(!file_browse->cached_files[f].is_dir){
-          show_item=false;
-          for(int i=0;i<file_browse->num_file_types;++i){
-            if(sb_path_has_file_ext(file_browse->cached_files[f].path,file_browse->file_types[i])){show_item=true;break;}
-          }
-          if(file_browse->num_file_types==0)show_item=true;
-        }else{
-          const char* name = file_browse->cached_files[f].name;
-          if(strcmp(name,".")==0||strcmp(name,"..")==0)show_item=false;
-        }
-        if(show_item)++f;
-        tinydir_next(&file_browse->cached_dir);
-      }
-      file_browse->num_cached_files = f;
-      qsort(file_browse->cached_files,f,sizeof(tinydir_file),file_sorter);
+    file_browse->has_cache=false;
+  }
+  bool update_cache = file_browse->has_cache==false||file_browse->cached_time+5.<se_time();
+  if(update_cache&&!listing->active){
+    file_browse->listing_refresh = file_browse->has_cache;
+    if(se_file_listing_start(file_browse->cached_path,file_browse->file_types,file_browse->num_file_types)){
+      file_browse->has_cache = true;
+      file_browse->cached_time = se_time();
     }
-    file_browse->has_cache=true;
   }
-  for(int f = 0;f<file_browse->num_cached_files;++f) {
-    const char *ext = file_browse->cached_files[f].is_link ? ICON_FK_FOLDER_OPEN_O:ICON_FK_FOLDER_OPEN;
-    if (!file_browse->cached_files[f].is_dir) {
-      const char* base, *file;
-      sb_breakup_path(file_browse->cached_files[f].path, &base, &file, &ext);
+  if(listing->active){
+    // A refresh of the shown directory is swapped in once complete, a new directory fills in as it is read
+    se_file_browser_list_t* list = file_browse->listing_refresh?&file_browse->refreshed_files:&file_browse->cached_files;
+    size_t old_size = list->size;
+    bool cancelled = listing->cancel;
+    bool done = se_file_listing_poll(list);
+    if(list==&file_browse->cached_files&&list->size!=old_size){
+      qsort(list->entries,list->size,sizeof(se_file_browser_entry_t),file_sorter);
+    }
+    if(done&&file_browse->listing_refresh&&!cancelled){
+      se_file_browser_list_free(&file_browse->cached_files);
+      file_browse->cached_files = file_browse->refreshed_files;
+      memset(&file_browse->refreshed_files,0,sizeof(file_browse->refreshed_files));
+      qsort(file_browse->cached_files.entries,file_browse->cached_files.size,sizeof(se_file_browser_entry_t),file_sorter);
     }
-    if (se_selectable_with_box(file_browse->cached_files[f].name, file_browse->cached_files[f].path, ext, false, 0)) {
-      if (file_browse->cached_files[f].is_dir)
-        strncpy(gui_state.file_browser.current_path, file_browse->cached_files[f].path, SB_FILE_PATH_SIZE);
-      else {
-        se_file_browser_accept(file_browse->cached_files[f].path);
+    if(done)file_browse->cached_time = se_time();
+  }
+  bool listing_this_path = listing->active&&!listing->cancel&&!file_browse->listing_refresh;
+  if(listing_this_path)se_text_disabled("Reading directory... %zu entries",file_browse->cached_files.size);
+  else if(listing->failed&&file_browse->cached_files.size==0)se_text_disabled("Error opening %s",file_browse->cached_path);
+  // Only the visible rows are submitted, directories can have many thousands of entries
+  ImGuiListClipper* clipper = ImGuiListClipper_ImGuiListClipper();
+  ImGuiListClipper_Begin(clipper,file_browse->cached_files.size,-1.0f);
+  while(ImGuiListClipper_Step(clipper)){
+    for(int f = clipper->DisplayStart;f<clipper->DisplayEnd;++f) {
+      se_file_browser_entry_t* entry = file_browse->cached_files.entries+f;
+      const char *ext = entry->is_link ? ICON_FK_FOLDER_OPEN_O:ICON_FK_FOLDER_OPEN;
+      if (!entry->is_dir) {
+        const char* base, *file;
+        sb_breakup_path(entry->path, &base, &file, &ext);
+      }
+      if (se_selectable_with_box(entry->name, entry->path, ext, false, 0)) {
+        // The list is only replaced next frame once the current path changed
+        if (entry->is_dir)
+          strncpy(gui_state.file_browser.current_path, entry->path, SB_FILE_PATH_SIZE);
+        else {
+          se_file_browser_accept(entry->path);
+        }
       }
     }
   }
+  ImGuiListClipper_End(clipper);
+  ImGuiListClipper_destroy(clipper);
   igEnd();
   return true;
 }
 bool se_load_rom_file_browser_callback(const char* path){
-  se_load_rom(path);
-  return emu_state.rom_loaded;
+  se_load_rom_in_background(path);
+  return gui_instance.emu_state.rom_loaded||se_zip_extract.active;
 }
 bool se_string_contains_string_case_insensitive(char *canidate, char *search) {
   int len1 = strlen(canidate);
@@ -5165,6 +11019,17 @@ bool se_string_contains_string_case_insensitive(char *canidate, char *search) {
   }
   return false;
 }
+static void se_draw_background_rom_load_progress(const char* rom_path, float progress){
+  const char* base, *file, *ext;
+  sb_breakup_path(rom_path,&base,&file,&ext);
+  ImGuiIO* io = igGetIO();
+  igSetNextWindowPos((ImVec2){io->DisplaySize.x*0.5f,io->DisplaySize.y*0.5f},ImGuiCond_Always,(ImVec2){0.5f,0.5f});
+  igSetNextWindowSize((ImVec2){320,0},ImGuiCond_Always);
+  igBegin("##BackgroundRomLoad",NULL,ImGuiWindowFlags_NoDecoration|ImGuiWindowFlags_NoMove|ImGuiWindowFlags_NoSavedSettings);
+  igText(se_localize_and_cache("Decompressing %s"),file);
+  igProgressBar(progress,(ImVec2){-1,0},NULL);
+  igEnd();
+}
 void se_load_rom_overlay(bool visible){
   if(visible==false)return;
   ImVec2 w_pos, w_size;
@@ -5267,7 +11132,7 @@ void se_load_rom_overlay(bool visible){
       continue;
     }
     if(se_selectable_with_box(file_name,se_replace_fake_path(info->path),ext_upper,false,reduce_width+cross_width)){
-      se_load_rom(info->path);
+      se_load_rom_in_background(info->path);
     }
     #ifdef EMSCRIPTEN
     if(save_exists){
@@ -5287,6 +11152,46 @@ void se_load_rom_overlay(bool visible){
     igPopID();
   }
   if(num_entries==0)se_text("No recently played games");
+  se_library_poll();
+  if(gui_state.paths.rom_library[0]){
+    se_library_t* lib = &se_library;
+    se_section(ICON_FK_BOOK " ROM Library");
+    if(lib->active)se_text_disabled("Indexing... %u ROMs found in %u files",lib->num_scan_entries,lib->files_visited);
+    else if(se_button(ICON_FK_REFRESH " Rescan ROM Library",(ImVec2){0,0}))se_library_start_scan();
+    igSeparator();
+    int icon_uploads = 0;
+    int library_entries = 0;
+    for(uint32_t i=0;i<lib->num_entries;++i){
+      se_library_entry_t* entry = lib->entries+i;
+      if(!se_string_contains_string_case_insensitive(entry->title,gui_state.search_buffer)&&
+         !se_string_contains_string_case_insensitive(entry->game_code,gui_state.search_buffer)&&
+         !se_string_contains_string_case_insensitive(entry->path,gui_state.search_buffer))continue;
+      igPushIDInt(i);
+      const char* base, *file_name, *ext;
+      sb_breakup_path(entry->path,&base,&file_name,&ext);
+      char ext_upper[8]={0};
+      for(int e=0;e<7&&ext[e];++e)ext_upper[e]=toupper(ext[e]);
+      ImVec2 item_pos;
+      igGetCursorScreenPos(&item_pos);
+      sg_image icon = {SG_INVALID_ID};
+      if(entry->has_icon&&igIsRectVisibleNil((ImVec2){1,40}))icon = se_library_icon(i,&icon_uploads);
+      char subtitle[SB_FILE_PATH_SIZE+16];
+      if(entry->game_code[0])snprintf(subtitle,sizeof(subtitle),"[%s] %s",entry->game_code,se_replace_fake_path(entry->path));
+      else snprintf(subtitle,sizeof(subtitle),"%s",se_replace_fake_path(entry->path));
+      if(se_selectable_with_box(entry->title,subtitle,icon.id!=SG_INVALID_ID?"":ext_upper,false,0)){
+        se_load_rom_in_background(entry->path);
+      }
+      if(icon.id!=SG_INVALID_ID){
+        ImVec2 p0 = {item_pos.x+4,item_pos.y+4};
+        ImVec2 p1 = {p0.x+32,p0.y+32};
+        ImDrawList_AddImage(igGetWindowDrawList(),(ImTextureID)(uintptr_t)icon.id,p0,p1,(ImVec2){0,0},(ImVec2){1,1},0xffffffff);
+      }
+      igSeparator();
+      library_entries++;
+      igPopID();
+    }
+    if(library_entries==0&&!lib->active)se_text("No ROMs found in %s",se_replace_fake_path(gui_state.paths.rom_library));
+  }
   igEnd();
   return;
 }
@@ -5389,121 +11294,444 @@ static void se_poll_sdl(){
       }
       cont->analog.value[a]= val;
     }
-    float intensity= emu_state.joy.rumble*65000;
+    float intensity= gui_instance.emu_state.joy.rumble*65000;
     SDL_JoystickRumble(cont->sdl_joystick, intensity, intensity, 100);
 
-    for(int i=0;i<SE_NUM_KEYBINDS;++i)emu_state.joy.inputs[i]  += cont->key.value[i]>0.5;
+    for(int i=0;i<SE_NUM_KEYBINDS;++i)gui_instance.emu_state.joy.inputs[i]  += cont->key.value[i]>0.5;
 
-    emu_state.joy.inputs[SE_KEY_LEFT]  += cont->analog.value[SE_ANALOG_LEFT_RIGHT]<-0.3;
-    emu_state.joy.inputs[SE_KEY_RIGHT] += cont->analog.value[SE_ANALOG_LEFT_RIGHT]> 0.3;
-    emu_state.joy.inputs[SE_KEY_UP]   += cont->analog.value[SE_ANALOG_UP_DOWN]<-0.3;
-    emu_state.joy.inputs[SE_KEY_DOWN] += cont->analog.value[SE_ANALOG_UP_DOWN]>0.3;
+    gui_instance.emu_state.joy.inputs[SE_KEY_LEFT]  += cont->analog.value[SE_ANALOG_LEFT_RIGHT]<-0.3;
+    gui_instance.emu_state.joy.inputs[SE_KEY_RIGHT] += cont->analog.value[SE_ANALOG_LEFT_RIGHT]> 0.3;
+    gui_instance.emu_state.joy.inputs[SE_KEY_UP]   += cont->analog.value[SE_ANALOG_UP_DOWN]<-0.3;
+    gui_instance.emu_state.joy.inputs[SE_KEY_DOWN] += cont->analog.value[SE_ANALOG_UP_DOWN]>0.3;
 
-    emu_state.joy.inputs[SE_KEY_L]  += cont->analog.value[SE_ANALOG_L]>0.1;
-    emu_state.joy.inputs[SE_KEY_R]  += cont->analog.value[SE_ANALOG_R]>0.1;
+    gui_instance.emu_state.joy.inputs[SE_KEY_L]  += cont->analog.value[SE_ANALOG_L]>0.1;
+    gui_instance.emu_state.joy.inputs[SE_KEY_R]  += cont->analog.value[SE_ANALOG_R]>0.1;
   }
 }
 #endif
 
-void se_update_frame() {
+// Returns the platform thermal state, 0 (nominal) to 3 (critical), and if power saving is on
+static int se_get_thermal_state(bool* low_power){
+  *low_power = false;
+#if defined(SE_PLATFORM_ANDROID)
+  // AThermal is API level 30, looked up at runtime so older devices still load
+  static void* (*acquire_manager)(void) = NULL;
+  static int (*get_status)(void*) = NULL;
+  static void* manager = NULL;
+  static bool loaded = false;
+  if(!loaded){
+    loaded = true;
+    void* lib = dlopen("libandroid.so",RTLD_NOW);
+    if(lib){
+      acquire_manager = (void*(*)(void))dlsym(lib,"AThermal_acquireManager");
+      get_status = (int(*)(void*))dlsym(lib,"AThermal_getCurrentThermalStatus");
+    }
+    if(acquire_manager&&get_status)manager = acquire_manager();
+  }
+  if(!manager)return 0;
+  // ATHERMAL_STATUS_NONE..SHUTDOWN, LIGHT/MODERATE/SEVERE and up map onto fair/serious/critical
+  int status = get_status(manager);
+  return status<0? 0: status>3? 3: status;
+#elif defined(SE_PLATFORM_IOS)
+  *low_power = se_ios_low_power_mode();
+  int state = se_ios_get_thermal_state();
+  return state<0? 0: state>3? 3: state;
+#else
+  return 0;
+#endif
+}
+static void se_update_perf_governor(){
+  static const struct{int frame_skip; int rewind_interval; bool low_quality_audio; int min_nds_cpu_slice_cycles;} levels[SE_GOVERNOR_LEVELS]={
+    {0, SE_FRAMES_PER_REWIND_STATE,   false,   0},
+    {0, SE_FRAMES_PER_REWIND_STATE*2, false,   0},
+    {0, SE_FRAMES_PER_REWIND_STATE*4, true,   64},
+    {1, SE_FRAMES_PER_REWIND_STATE*4, true,   64},
+    {2, SE_FRAMES_PER_REWIND_STATE*8, true,  256},
+  };
+  se_perf_governor_t* g = &gui_state.governor;
+  double now = se_time();
+  double dt = now-g->last_update_time;
+  g->last_update_time = now;
+  if(dt<0||dt>0.25)dt = 0.25;
+  if(g->hold_time<5.0)g->hold_time = 5.0;
+  // Peers, movies and spectators replay the emulation exactly, so nothing may change with host load
+  bool deterministic_session = se_netplay_active()||se_movie_active()||se_spectate_active();
+  if(!gui_state.settings.perf_governor||gui_state.test_runner_mode||deterministic_session){
+    g->level = 0;
+    g->reason = deterministic_session? "Off during netplay, movies and spectating": NULL;
+    g->high_load_time = g->low_load_time = 0;
+  }else{
+    if(now-g->last_poll_time>2.0){
+      g->thermal = se_get_thermal_state(&g->low_power);
+      g->last_poll_time = now;
+    }
+    // Only full speed play says anything about headroom
+    sb_emu_state_t* emu = &gui_instance.emu_state;
+    if(emu->rom_loaded&&emu->run_mode==SB_MODE_RUN&&emu->step_frames==1){
+      float load = gui_state.emulated_frame_cost*se_get_sim_fps();
+      g->load += (load-g->load)*SE_MIN_CONST(1.0,dt*2.0);
+      g->high_load_time = g->load>SE_GOVERNOR_HIGH_LOAD? g->high_load_time+dt: 0;
+      g->low_load_time = g->load<SE_GOVERNOR_LOW_LOAD? g->low_load_time+dt: 0;
+    }else g->high_load_time = g->low_load_time = 0;
+    int min_level = g->thermal;
+    if(g->low_power&&min_level<1)min_level = 1;
+    int level = g->level;
+    const char* reason = g->reason;
+    double since_change = now-g->last_change_time;
+    if(level<min_level){
+      level = min_level;
+      reason = g->thermal? "Thermal throttling": "Low power mode";
+    }else if(g->high_load_time>1.0&&level<SE_GOVERNOR_LEVELS-1&&since_change>2.0){
+      // Stepping down didn't stick, wait longer before trying again
+      if(since_change<10.0&&g->reason&&strcmp(g->reason,"Headroom")==0)g->hold_time = SE_MIN_CONST(g->hold_time*2,60.0);
+      level++;
+      reason = "Low headroom";
+    }else if(g->low_load_time>g->hold_time&&level>min_level&&since_change>g->hold_time){
+      level--;
+      reason = "Headroom";
+    }
+    if(level!=g->level){
+      printf("Performance governor: level %d (%s, load %.0f%%, thermal %d)\n",level,reason,g->load*100,g->thermal);
+      g->level = level;
+      g->last_change_time = now;
+      g->high_load_time = g->low_load_time = 0;
+    }
+    g->reason = reason;
+  }
+  g->frame_skip = levels[g->level].frame_skip;
+  g->rewind_interval = levels[g->level].rewind_interval;
+  int profile_interval = gui_state.game_profile.rewind_interval;
+  if(profile_interval)g->rewind_interval = g->rewind_interval/SE_FRAMES_PER_REWIND_STATE*profile_interval;
+  g->low_quality_audio = levels[g->level].low_quality_audio;
+  g->min_nds_cpu_slice_cycles = levels[g->level].min_nds_cpu_slice_cycles;
+}
+static void se_begin_update_frame(){
+  se_spectate_update();
   #ifdef ENABLE_HTTP_CONTROL_SERVER
-  hcs_update(gui_state.settings.http_control_server_enable,gui_state.settings.http_control_server_port,se_hcs_callback);
+  hcs_update(gui_state.settings.http_control_server_enable,gui_state.settings.http_control_server_port,se_hcs_callback,se_hcs_finish);
   if(gui_state.settings.http_control_server_enable){
-    for(int i=0;i<SE_NUM_KEYBINDS;++i)emu_state.joy.inputs[i]+=gui_state.hcs_joypad.inputs[i];
+    for(int i=0;i<SE_NUM_KEYBINDS;++i)gui_instance.emu_state.joy.inputs[i]+=gui_state.hcs_joypad.inputs[i];
   }
   hcs_suspend_callbacks();
+  se_shm_process_cmds();
+  #endif
+  #ifdef ENABLE_LUA_SCRIPTING
+  if(gui_state.lua){
+    for(int i=0;i<SE_NUM_KEYBINDS;++i)gui_instance.emu_state.joy.inputs[i]+=gui_state.lua_joypad.inputs[i];
+  }
   #endif
-  se_update_key_turbo(&emu_state);
-  se_update_solar_sensor(&emu_state);
+  se_update_key_turbo(&gui_instance.emu_state);
+  se_update_solar_sensor(&gui_instance.emu_state);
 
-  if(emu_state.run_mode == SB_MODE_RESET){
+  if(gui_instance.emu_state.run_mode == SB_MODE_RESET){
     se_reset_core();
-    emu_state.run_mode = SB_MODE_RUN;
+    gui_instance.emu_state.run_mode = SB_MODE_RUN;
   }
-  static unsigned frames_since_last_save = 0; 
-  frames_since_last_save++;
-  if(frames_since_last_save>10){
+  gui_instance.frames_since_last_save++;
+  if(gui_instance.frames_since_last_save>10){
+    // The writer job queues the IndexedDB flush once the file is on disk
     bool saved = se_sync_save_to_disk();
-    if(saved){
-      frames_since_last_save=0;
-      se_emscripten_flush_fs();
-    }
+    if(saved)gui_instance.frames_since_last_save=0;
   }
-
-  emu_state.screen_ghosting_strength = gui_state.settings.ghosting;
-  const int frames_per_rewind_state = 8; 
-  static double simulation_time = -1;
+  se_update_state_slot_writes();
+
+  gui_instance.emu_state.screen_ghosting_strength = gui_state.settings.ghosting;
+  // Accuracy tests always run the plain interpreter
+  gui_instance.emu_state.cpu_batch_exec = gui_state.settings.cpu_batch_exec&&!gui_state.test_runner_mode;
+  // Game profiles override the speed settings, test runs stay on the accurate paths
+  const se_game_profile_t* profile = &gui_state.game_profile;
+#define SE_PROFILE_OR(field,setting) (profile->field>=0? profile->field: (setting))
+  gui_instance.emu_state.cpu_idle_loop_skip = SE_PROFILE_OR(idle_loop_skip,gui_state.settings.cpu_idle_loop_skip)&&!gui_state.test_runner_mode;
+  se_update_perf_governor();
+  // Auto starts in lockstep, the governor only raises the slice when the user left it to it
+  const int nds_cpu_slice_cycles[]={1,16,64,256,1};
+  gui_instance.emu_state.nds_cpu_slice_cycles = gui_state.test_runner_mode? 1:
+                                                profile->cpu_slice_cycles? profile->cpu_slice_cycles: nds_cpu_slice_cycles[gui_state.settings.nds_cpu_slice%5];
+  bool auto_cpu_slice = gui_state.settings.nds_cpu_slice==SE_NDS_CPU_SLICE_AUTO&&!profile->cpu_slice_cycles&&!gui_state.test_runner_mode;
+  if(auto_cpu_slice&&gui_instance.emu_state.nds_cpu_slice_cycles<gui_state.governor.min_nds_cpu_slice_cycles)gui_instance.emu_state.nds_cpu_slice_cycles = gui_state.governor.min_nds_cpu_slice_cycles;
+  gui_instance.emu_state.audio_low_quality = gui_state.governor.low_quality_audio;
+  gui_instance.emu_state.audio_disabled = se_audio_output_unused();
+  gui_instance.emu_state.nds_threaded_ppu = SE_PROFILE_OR(threaded_ppu,gui_state.settings.nds_threaded_ppu)&&!gui_state.test_runner_mode;
+  gui_instance.emu_state.nds_threaded_arm7 = gui_state.settings.nds_threaded_arm7&&!gui_state.test_runner_mode;
+  gui_instance.emu_state.nds_hle_bios = gui_state.settings.nds_hle_bios&&!gui_state.test_runner_mode;
+  gui_instance.emu_state.gba_hle_bios = gui_state.settings.gba_hle_bios&&!gui_state.test_runner_mode;
+  gui_instance.emu_state.nds_instant_card = SE_PROFILE_OR(instant_card,gui_state.settings.nds_instant_card)&&!gui_state.test_runner_mode;
+#undef SE_PROFILE_OR
+  const static int rewind_memory_mb[5]={16,32,64,128,256};
+  const static int rewind_length_seconds[5]={15,30,60,120,300};
+  gui_instance.rewind_buffer.requested_budget_bytes = (uint64_t)rewind_memory_mb[gui_state.settings.rewind_memory%5]*1024*1024;
+  gui_instance.rewind_buffer.requested_max_txs = rewind_length_seconds[gui_state.settings.rewind_length%5]*60/gui_state.governor.rewind_interval;
+}
+// Runs the emulated frames that are due. Only touches the core, emu_state and the audio ring
+// which the UI leaves alone while this is running on the emulation thread
+// Fed the interval between UI frames, which sokol has already snapped to a common refresh rate
+static void se_pacer_measure_display(double delta_time){
+  se_frame_pacer_t* p = &gui_state.pacer;
+  // Hitches and the idle rate say nothing about the display
+  if(delta_time<1.0/500.||delta_time>1.0/20.)return;
+  if(p->display_period==0||fabs(delta_time-p->display_period)>p->display_period*0.25)p->display_period=delta_time;
+  else p->display_period+= (delta_time-p->display_period)*0.05;
+}
+static double se_pacer_audio_fill_error(){
+  if(gui_instance.emu_state.audio_disabled)return 0;
+  double fill_error = ((double)sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff)-SE_AUDIO_TARGET_FILL)/SE_AUDIO_TARGET_FILL;
+  if(fill_error>1.0)fill_error=1.0;
+  if(fill_error<-1.0)fill_error=-1.0;
+  return fill_error;
+}
+static bool se_pacer_locked(){
+  return gui_state.settings.frame_pacing!=SE_PACING_WALL_CLOCK&&gui_state.pacer.display_period>0&&!gui_state.test_runner_mode;
+}
+// Returns how many frames to emulate this refresh when pacing to the display or audio clock
+static int se_pacer_frames(double curr_time, double frames_per_second, int max_frames){
+  se_frame_pacer_t* p = &gui_state.pacer;
+  double elapsed = curr_time-p->last_tick_time;
+  p->last_tick_time = curr_time;
+  double ratio = frames_per_second*p->display_period;
+  double inv = ratio>0? 1.0/ratio: 0;
+  // ie. 59.73Hz content on a 60Hz display runs one frame per refresh and lets the audio rate control
+  // absorb the 0.45% difference, on 120Hz it runs a frame every other refresh
+  if(ratio>=1&&fabs(ratio-round(ratio))<ratio*SE_PACING_SNAP_TOLERANCE)ratio = round(ratio);
+  else if(ratio>0&&ratio<1&&fabs(inv-round(inv))<inv*SE_PACING_SNAP_TOLERANCE)ratio = 1.0/round(inv);
+  if(gui_state.settings.frame_pacing==SE_PACING_AUDIO)ratio*=1.0-SE_PACING_AUDIO_GAIN*se_pacer_audio_fill_error();
+  p->ratio = ratio;
+  // Refreshes missed while the UI stalled are made up, but never more than a few frames
+  double missed = p->display_period>0? elapsed/p->display_period-1.0: 0;
+  if(missed>0.5)p->debt+=fmin(missed,4.0)*ratio;
+  p->debt+=ratio;
+  int frames = (int)p->debt;
+  if(frames>max_frames)frames=max_frames;
+  p->debt-=frames;
+  if(p->debt>max_frames)p->debt=0;
+  return frames;
+}
+static void se_pacer_record(double elapsed, int frames, double frames_per_second){
+  se_frame_pacer_t* p = &gui_state.pacer;
+  if(elapsed>1.0/20.||frames_per_second<=0)return;
+  p->error_ms = (frames/frames_per_second-elapsed)*1000.0;
+  p->error_avg_ms+= (fabs(p->error_ms)-p->error_avg_ms)*0.05;
+}
+// Predicts how many more frames the current tick will emulate, including the next one.
+// Mirrors the break conditions of se_run_emulation_frames
+static int se_frames_left_in_tick(double curr_time, double sim_time_increment, bool unlocked_mode, int paced_frames, int frames_emulated, int max_frames_left){
+  double frames = 1;
+  if(paced_frames>=0)frames = paced_frames-frames_emulated;
+  else if(unlocked_mode){
+    double cost = gui_state.emulated_frame_cost;
+    frames = cost>0? 1+floor((gui_instance.simulation_time-curr_time)/cost): max_frames_left;
+  }else if(sim_time_increment>0)frames = 1+floor((curr_time-gui_instance.simulation_time)/sim_time_increment-0.8);
+  if(frames>max_frames_left)frames = max_frames_left;
+  return frames<1? 1: frames;
+}
+static void se_run_emulation_frames(void* user_data, int job_index){
+  trace_begin("Emulate Frames");
   double curr_time = se_time();
 
-  if(fabs(curr_time-simulation_time)>1.0/60.*10||emu_state.run_mode==SB_MODE_PAUSE)simulation_time = curr_time;
-  if(emu_state.run_mode==SB_MODE_RUN||emu_state.run_mode==SB_MODE_STEP||emu_state.run_mode==SB_MODE_REWIND){
-    emu_state.frame=0;
-    int max_frames_per_tick =1+ emu_state.step_frames;
-    if(emu_state.run_mode==SB_MODE_STEP)max_frames_per_tick= emu_state.step_frames;
+  if(fabs(curr_time-gui_instance.simulation_time)>1.0/60.*10||gui_instance.emu_state.run_mode==SB_MODE_PAUSE)gui_instance.simulation_time = curr_time;
+  if(gui_instance.emu_state.run_mode==SB_MODE_RUN||gui_instance.emu_state.run_mode==SB_MODE_STEP||gui_instance.emu_state.run_mode==SB_MODE_REWIND){
+    gui_instance.emu_state.frame=0;
+    int max_frames_per_tick =1+ gui_instance.emu_state.step_frames;
+    if(gui_instance.emu_state.run_mode==SB_MODE_STEP)max_frames_per_tick= gui_instance.emu_state.step_frames;
 
-    emu_state.render_frame = true;
+    gui_instance.emu_state.render_frame = true;
 
     double sim_fps= se_get_sim_fps();
-    double sim_time_increment = 1./sim_fps/emu_state.step_frames;
-    if(emu_state.run_mode==SB_MODE_REWIND)sim_time_increment*=frames_per_rewind_state/2;
-    if(emu_state.step_frames<0){
+    double sim_time_increment = 1./sim_fps/gui_instance.emu_state.step_frames;
+    if(gui_instance.emu_state.run_mode==SB_MODE_REWIND)sim_time_increment*=SE_FRAMES_PER_REWIND_STATE/2;
+    if(gui_instance.emu_state.step_frames<0){
       max_frames_per_tick =1;
-      sim_time_increment = 1./sim_fps*-emu_state.step_frames;
+      sim_time_increment = 1./sim_fps*-gui_instance.emu_state.step_frames;
     }
-    bool unlocked_mode = emu_state.step_frames==0;
+    bool unlocked_mode = gui_instance.emu_state.step_frames==0;
     if(gui_state.test_runner_mode)unlocked_mode=true;
-    if(unlocked_mode&&emu_state.run_mode!=SB_MODE_STEP){
+    if(unlocked_mode&&gui_instance.emu_state.run_mode!=SB_MODE_STEP){
       sim_time_increment=0;
       max_frames_per_tick=1000;
-      simulation_time=curr_time+1./30.;
+      gui_instance.simulation_time=curr_time+1./30.;
     }
+    double frames_per_second = sim_time_increment>0? 1.0/sim_time_increment: 0;
+    double tick_elapsed = curr_time-gui_state.pacer.last_tick_time;
+    int paced_frames = -1;
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN&&!unlocked_mode&&se_pacer_locked()){
+      paced_frames = se_pacer_frames(curr_time,frames_per_second,max_frames_per_tick);
+      // Keeps the wall clock schedule in step for when pacing switches back to it
+      gui_instance.simulation_time = curr_time;
+    }else gui_state.pacer.last_tick_time = curr_time;
+    int frames_emulated = 0;
+    bool rendered = false;
     while(max_frames_per_tick--){
       // On steps emulate all frames, but only render the last frame of the step
       // and don't allow screen ghosting
-      if(emu_state.run_mode==SB_MODE_STEP){
-        emu_state.render_frame = max_frames_per_tick==0;
-        emu_state.screen_ghosting_strength=0; 
+      if(gui_instance.emu_state.run_mode==SB_MODE_STEP){
+        gui_instance.emu_state.render_frame = max_frames_per_tick==0;
+        gui_instance.emu_state.render_next_frame = max_frames_per_tick<=1;
+        gui_instance.emu_state.screen_ghosting_strength=0; 
       }else{
-        if(unlocked_mode){
-          if(simulation_time<curr_time&&emu_state.frame){break;}
+        if(paced_frames>=0){
+          if(frames_emulated>=paced_frames)break;
+        }else if(unlocked_mode){
+          if(gui_instance.simulation_time<curr_time&&gui_instance.emu_state.frame){break;}
         }else{
-          if(emu_state.frame==0&&simulation_time>curr_time)break;
-          if(emu_state.frame&&curr_time-simulation_time<sim_time_increment*0.8){break;}
+          if(gui_instance.emu_state.frame==0&&gui_instance.simulation_time>curr_time)break;
+          if(gui_instance.emu_state.frame&&curr_time-gui_instance.simulation_time<sim_time_increment*0.8){break;}
         }
       }
-      if(emu_state.run_mode==SB_MODE_REWIND){
-        se_rewind_state_single_tick(&core, &rewind_buffer);
-        emu_state.render_frame = true;
+      if(gui_instance.emu_state.run_mode==SB_MODE_REWIND&&(se_netplay_active()||se_spectate_watching()))gui_instance.emu_state.run_mode=SB_MODE_RUN;
+      if(gui_instance.emu_state.run_mode==SB_MODE_RUN){
+        // Frames that are overwritten before the UI presents skip all pixel work
+        int frames_left = se_frames_left_in_tick(curr_time,sim_time_increment,unlocked_mode,paced_frames,frames_emulated,max_frames_per_tick+1);
+        gui_instance.emu_state.render_frame = frames_left<=1||(frames_emulated==0&&gui_state.ticks_without_render>1);
+        gui_instance.emu_state.render_next_frame = frames_left<=2;
+        int skip = gui_state.governor.frame_skip;
+        if(skip){
+          uint32_t f = gui_state.governor.frame_counter++;
+          gui_instance.emu_state.render_frame&= f%(skip+1)==0;
+          gui_instance.emu_state.render_next_frame&= (f+1)%(skip+1)==0;
+        }
+      }
+      rendered|=gui_instance.emu_state.render_frame;
+      double frame_start = curr_time;
+      if(gui_instance.emu_state.run_mode==SB_MODE_REWIND){
+        se_movie_stop();
+        se_spectate_discontinuity();
+        se_rewind_state_single_tick(&gui_instance.core, &gui_instance.rewind_buffer);
+        gui_instance.emu_state.render_frame = false;
+        gui_instance.emu_state.render_next_frame = true;
         se_emulate_single_frame();
+        gui_instance.emu_state.render_frame = true;
         se_emulate_single_frame();
-        simulation_time+=sim_time_increment*2;
+        gui_instance.rewind_buffer.curr_frame+=2;
+        gui_instance.simulation_time+=sim_time_increment*2;
       }else{
-        se_emulate_single_frame();
-        ++emu_state.frames_since_rewind_push;
-        if(emu_state.frames_since_rewind_push>frames_per_rewind_state-1 ){
-          se_push_rewind_state(&core,&rewind_buffer);
-          emu_state.frames_since_rewind_push=0;
+        // Run-ahead is only used at normal and slow motion speed
+        bool run_ahead = gui_instance.emu_state.run_mode==SB_MODE_RUN&&gui_instance.emu_state.step_frames<=1&&gui_instance.emu_state.step_frames!=0&&!gui_state.test_runner_mode;
+        uint32_t audio_start = gui_instance.emu_state.audio_ring_buff.write_ptr;
+        trace_begin("Emulate Frame");
+        se_emulate_frame_with_run_ahead(run_ahead? gui_state.settings.run_ahead_frames%5: 0,gui_state.settings.run_ahead_second_instance);
+        trace_end();
+        se_video_capture_frame(audio_start);
+        ++gui_instance.rewind_buffer.curr_frame;
+        ++gui_instance.emu_state.frames_since_rewind_push;
+        if(gui_instance.emu_state.frames_since_rewind_push>gui_state.governor.rewind_interval-1 ){
+          trace_begin("Rewind Push");
+          se_push_rewind_state(&gui_instance.core,&gui_instance.rewind_buffer,gui_instance.emu_state.system);
+          trace_end();
+          gui_instance.emu_state.frames_since_rewind_push=0;
         }
-        simulation_time+=sim_time_increment;
+        gui_instance.simulation_time+=sim_time_increment;
       }
-      emu_state.frame++;
-      emu_state.render_frame = false;
+      frames_emulated++;
+      gui_instance.emu_state.frame++;
+      gui_instance.emu_state.render_frame = false;
       curr_time = se_time();
-      if(emu_state.run_mode==SB_MODE_PAUSE)break;
+      gui_state.emulated_frame_cost+= (curr_time-frame_start-gui_state.emulated_frame_cost)*0.1;
+      gui_state.emu_stats.emulation_ms+=(curr_time-frame_start)*1000.;
+      se_metrics_observe(&se_metrics.emulated_frame_time,se_metrics_frame_buckets,curr_time-frame_start);
+      se_metrics_add(&se_metrics.emulated_frames,1);
+      if(gui_instance.emu_state.run_mode==SB_MODE_PAUSE)break;
     }
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN&&!unlocked_mode)se_pacer_record(tick_elapsed,frames_emulated,frames_per_second);
+    gui_state.ticks_without_render = rendered||!frames_emulated? 0: gui_state.ticks_without_render+1;
   }
-  if(emu_state.run_mode==SB_MODE_STEP)printf("Emulated %d frames\n",emu_state.frame);
-  if(emu_state.run_mode==SB_MODE_STEP)emu_state.run_mode = SB_MODE_PAUSE; 
-  if(emu_state.run_mode==SB_MODE_PAUSE)emu_state.frame = 0; 
-  if(emu_state.run_mode==SB_MODE_REWIND)emu_state.frame = - emu_state.frame*frames_per_rewind_state;
-
-  emu_state.prev_frame_joy = emu_state.joy; 
-  se_reset_joy(&emu_state.joy);
+  if(gui_instance.emu_state.run_mode==SB_MODE_STEP)printf("Emulated %d frames\n",gui_instance.emu_state.frame);
+  if(gui_instance.emu_state.run_mode==SB_MODE_STEP)gui_instance.emu_state.run_mode = SB_MODE_PAUSE; 
+  if(gui_instance.emu_state.run_mode==SB_MODE_PAUSE)gui_instance.emu_state.frame = 0; 
+  if(gui_instance.emu_state.run_mode==SB_MODE_REWIND)gui_instance.emu_state.frame = - gui_instance.emu_state.frame*SE_FRAMES_PER_REWIND_STATE;
+  trace_end();
+}
+// Publishes the gauges of the emulator state for /metrics
+static void se_update_metrics(){
+  static double last_time = 0;
+  static uint64_t last_frames = 0;
+  double now = se_time();
+  uint64_t frames = se_metrics.emulated_frames;
+  if(now-last_time>=1.0){
+    if(last_time>0)sb_atomic_store_relaxed_u64(&se_metrics.emulation_fps_milli,(frames-last_frames)*1000/(now-last_time));
+    last_time = now;
+    last_frames = frames;
+  }
+  se_core_rewind_buffer_t* rewind = &gui_instance.rewind_buffer;
+  sb_atomic_store_relaxed_u64(&se_metrics.rewind_bytes_used,rewind->bytes_used);
+  sb_atomic_store_relaxed_u64(&se_metrics.rewind_bytes_budget,rewind->budget_bytes);
+  sb_atomic_store_relaxed_u64(&se_metrics.rewind_entries,rewind->size);
+  sb_atomic_store_relaxed_u64(&se_metrics.rom_loaded,gui_instance.emu_state.rom_loaded);
+}
+static void se_end_update_frame(){
+  // Negative while rewinding
+  gui_state.emulated_frames+=abs(gui_instance.emu_state.frame);
+  if(gui_instance.emu_state.profile.frames>=SE_PROFILE_WINDOW_FRAMES){
+    gui_state.last_profile = gui_instance.emu_state.profile;
+    const sb_profile_t* p = &gui_state.last_profile;
+    se_metrics_add(&se_metrics.core_ns,p->core_ns);
+    for(int i=0;i<SB_PROFILE_COUNT;++i)se_metrics_add(&se_metrics.subsystem_ns[i],p->ns[i]);
+    memset(&gui_instance.emu_state.profile,0,sizeof(gui_instance.emu_state.profile));
+  }
+  se_update_metrics();
+  gui_instance.emu_state.prev_frame_joy = gui_instance.emu_state.joy; 
+  se_reset_joy(&gui_instance.emu_state.joy);
 
   #ifdef ENABLE_HTTP_CONTROL_SERVER
+    se_hcs_publish_snapshot(gui_instance.emu_state.run_mode!=SB_MODE_PAUSE);
     hcs_resume_callbacks();
   #endif
 }
+void se_update_frame() {
+  trace_begin("Update Frame");
+  gui_instance.emu_state.late_input = NULL;
+  se_begin_update_frame();
+  se_run_emulation_frames(NULL,0);
+  se_end_update_frame();
+  trace_end();
+}
+// Waits for the frames handed to the emulation thread so the UI can use the core again
+static void se_join_emulation_thread(){
+  if(!gui_state.emulation_running_async)return;
+  trace_begin("Wait For Emulation");
+  job_pool_wait_async(SE_ASYNC_EMULATION);
+  trace_end();
+  gui_state.emulation_running_async=false;
+  se_end_update_frame();
+}
+// Movies, netplay, spectating and run-ahead replay the input of a frame so it can't change while it runs
+static bool se_late_input_allowed(){
+  return gui_state.settings.late_input_polling&&gui_instance.emu_state.run_mode==SB_MODE_RUN&&
+         !se_movie_active()&&!se_netplay_active()&&!se_spectate_active()&&gui_state.settings.run_ahead_frames%5==0;
+}
+static void se_publish_late_input(){
+  uint32_t buttons = gui_state.late_input_other_buttons;
+  if(gui_state.late_input_keyboard){
+    for(int i=0;i<=SE_KEY_SELECT;++i){
+      int keycode = gui_state.key.bound_id[i];
+      if(keycode>=0&&keycode<SAPP_MAX_KEYCODES&&gui_state.button_state[keycode])buttons|=1u<<i;
+    }
+  }
+  sb_atomic_store_release_u32(&gui_state.late_input.buttons,buttons);
+}
+static void se_dispatch_emulation_thread(){
+  if(!gui_state.emulation_dispatch_pending)return;
+  gui_state.emulation_dispatch_pending=false;
+  gui_instance.emu_state.late_input = NULL;
+  if(se_late_input_allowed()){
+    sb_joy_t* joy = &gui_instance.emu_state.joy;
+    gui_state.late_input_other_buttons = 0;
+    for(int i=0;i<=SE_KEY_SELECT;++i){
+      if(joy->inputs[i]-(gui_state.key.value[i]>0.5)>0.3)gui_state.late_input_other_buttons|=1u<<i;
+    }
+    gui_state.late_input_keyboard = !igGetIO()->WantCaptureKeyboard;
+    se_publish_late_input();
+    gui_instance.emu_state.late_input = &gui_state.late_input;
+  }
+  gui_state.emulation_running_async=true;
+  job_pool_run_async(SE_ASYNC_EMULATION,se_run_emulation_frames,NULL);
+}
+static bool se_use_emulation_thread(){
+  if(!gui_state.settings.threaded_emulation||gui_state.test_runner_mode)return false;
+  #ifdef ENABLE_RETRO_ACHIEVEMENTS
+  // rcheevos callbacks talk to the UI so they stay on the main thread
+  if(retro_achievements_has_game_loaded())return false;
+  #endif
+  return true;
+}
 void se_imgui_theme()
 {
   ImVec4* colors = igGetStyle()->Colors;
@@ -5939,31 +12167,646 @@ void se_draw_controller_config(gui_state_t* gui){
       bind_map[i]= cont->key.bound_id[i];
       bind_map[i+SE_NUM_BINDS_ALLOC]= cont->analog.bound_id[i];
     }
-    char settings_path[SB_FILE_PATH_SIZE];
-    snprintf(settings_path,SB_FILE_PATH_SIZE,"%s%s-bindings.bin",se_get_pref_path(),cont_name);
-    sb_save_file_data(settings_path,(uint8_t*)bind_map,sizeof(bind_map));
-    se_emscripten_flush_fs();
+    char settings_path[SB_FILE_PATH_SIZE];
+    snprintf(settings_path,SB_FILE_PATH_SIZE,"%s%s-bindings.bin",se_get_pref_path(),cont_name);
+    sb_save_file_data(settings_path,(uint8_t*)bind_map,sizeof(bind_map));
+    se_emscripten_flush_fs(settings_path);
+  }
+#ifdef USE_SDL
+  if(SDL_JoystickHasRumble(cont->sdl_joystick)){se_text("Rumble Supported");
+  }else se_text("Rumble Not Supported");
+#endif
+}
+
+void se_reset_default_gb_palette(){
+  uint8_t palette[4*3] = { 0x81,0x8F,0x38,0x64,0x7D,0x43,0x56,0x6D,0x3F,0x31,0x4A,0x2D };
+  for(int i=0;i<4;++i){
+    gui_state.settings.gb_palette[i]=palette[i*3]|(palette[i*3+1]<<8)|(palette[i*3+2]<<16);
+  }
+}
+void se_capture_state_slot(int slot){
+  se_save_state_t* save_state = save_states+slot;
+  se_state_slot_writer_t* w = se_state_slot_writers+slot;
+  if(w->writing_core&&w->writing_core==save_state->core){
+    uint8_t* core = save_state->core;
+    size_t capacity = save_state->core_capacity;
+    save_state->core = w->spare_core;
+    save_state->core_capacity = w->spare_capacity;
+    w->spare_core = core;
+    w->spare_capacity = capacity;
+  }
+  se_capture_state(&gui_instance.core, save_state);
+  if(!save_state->valid||!gui_instance.emu_state.rom_loaded)return;
+  w->emu_id = se_prepare_save_state(save_state);
+  w->core_size = se_get_core_size();
+  snprintf(w->path,SB_FILE_PATH_SIZE,"%s.slot%d.state.png",gui_instance.emu_state.save_data_base_path,slot);
+  w->pending = true;
+  se_update_state_slot_writes();
+}
+void se_restore_state_slot(int slot){
+  if(save_states[slot].valid)se_restore_state(&gui_instance.core, save_states+slot);
+}
+#ifdef ENABLE_LUA_SCRIPTING
+// Scripts run on the emulation thread between frames through the global "emu" table. Addresses
+// use the same maps as the HTTP control server (7 selects the ARM7 bus on the NDS).
+static int se_lua_keybind(lua_State* L, int arg){
+  const char* name = luaL_checkstring(L,arg);
+  for(int i=0;i<SE_NUM_KEYBINDS;++i)if(strcmp(name,se_keybind_names[i])==0)return i;
+  return luaL_error(L,"Unknown input: %s",name);
+}
+static int se_lua_read(lua_State* L, int bytes){
+  uint64_t addr = luaL_checkinteger(L,1);
+  emu_byte_read_t read = se_read_byte_func(luaL_optinteger(L,2,0));
+  uint32_t value = 0;
+  for(int i=0;i<bytes;++i)value|=((uint32_t)read(addr+i))<<(i*8);
+  lua_pushinteger(L,value);
+  return 1;
+}
+static int se_lua_write(lua_State* L, int bytes){
+  uint64_t addr = luaL_checkinteger(L,1);
+  uint32_t value = luaL_checkinteger(L,2);
+  emu_byte_write_t write = se_write_byte_func(luaL_optinteger(L,3,0));
+  for(int i=0;i<bytes;++i)write(addr+i,SB_BFE(value,i*8,8));
+  return 0;
+}
+static int se_lua_read8(lua_State* L){return se_lua_read(L,1);}
+static int se_lua_read16(lua_State* L){return se_lua_read(L,2);}
+static int se_lua_read32(lua_State* L){return se_lua_read(L,4);}
+static int se_lua_write8(lua_State* L){return se_lua_write(L,1);}
+static int se_lua_write16(lua_State* L){return se_lua_write(L,2);}
+static int se_lua_write32(lua_State* L){return se_lua_write(L,4);}
+static int se_lua_read_range(lua_State* L){
+  uint64_t addr = luaL_checkinteger(L,1);
+  lua_Integer size = luaL_checkinteger(L,2);
+  luaL_argcheck(L,size>=0&&size<=SE_HCS_MAX_RANGE_SIZE,2,"invalid size");
+  emu_byte_read_t read = se_read_byte_func(luaL_optinteger(L,3,0));
+  luaL_Buffer buffer;
+  char* data = luaL_buffinitsize(L,&buffer,size);
+  for(lua_Integer i=0;i<size;++i)data[i]=read(addr+i);
+  luaL_pushresultsize(&buffer,size);
+  return 1;
+}
+static int se_lua_set_input(lua_State* L){
+  int key = se_lua_keybind(L,1);
+  gui_state.lua_joypad.inputs[key] = lua_isboolean(L,2)? lua_toboolean(L,2): luaL_checknumber(L,2);
+  return 0;
+}
+static int se_lua_get_input(lua_State* L){
+  lua_pushnumber(L,gui_instance.emu_state.joy.inputs[se_lua_keybind(L,1)]);
+  return 1;
+}
+static int se_lua_save_slot(lua_State* L){
+  lua_Integer slot = luaL_checkinteger(L,1);
+  luaL_argcheck(L,slot>=0&&slot<SE_NUM_SAVE_STATES,1,"invalid slot");
+  return slot;
+}
+static int se_lua_save_state(lua_State* L){
+  se_capture_state(&gui_instance.core, save_states+se_lua_save_slot(L));
+  return 0;
+}
+static int se_lua_load_state(lua_State* L){
+  int slot = se_lua_save_slot(L);
+  lua_pushboolean(L,save_states[slot].valid&&save_states[slot].system==gui_instance.emu_state.system);
+  se_restore_state_slot(slot);
+  return 1;
+}
+static int se_lua_frame(lua_State* L){
+  lua_pushinteger(L,gui_state.lua_frames);
+  return 1;
+}
+static int se_lua_system(lua_State* L){
+  const char* names[]={"none","GB","GBA","NDS"};
+  int system = gui_instance.emu_state.system;
+  lua_pushstring(L,system>=0&&system<4? names[system]: "none");
+  return 1;
+}
+static int se_lua_set_callback(lua_State* L, int* ref){
+  if(!lua_isnoneornil(L,1))luaL_checktype(L,1,LUA_TFUNCTION);
+  luaL_unref(L,LUA_REGISTRYINDEX,*ref);
+  lua_settop(L,1);
+  *ref = lua_isnil(L,1)? LUA_NOREF: luaL_ref(L,LUA_REGISTRYINDEX);
+  return 0;
+}
+static int se_lua_on_frame(lua_State* L){return se_lua_set_callback(L,&gui_state.lua_frame_callback);}
+static int se_lua_on_breakpoint(lua_State* L){return se_lua_set_callback(L,&gui_state.lua_breakpoint_callback);}
+static int se_lua_pause(lua_State* L){
+  gui_instance.emu_state.run_mode = SB_MODE_PAUSE;
+  return 0;
+}
+static int se_lua_resume(lua_State* L){
+  gui_instance.emu_state.run_mode = SB_MODE_RUN;
+  return 0;
+}
+static void se_lua_unload_script(){
+  if(!gui_state.lua)return;
+  lua_close(gui_state.lua);
+  gui_state.lua = NULL;
+  memset(&gui_state.lua_joypad,0,sizeof(gui_state.lua_joypad));
+}
+static bool se_lua_load_script(const char* path){
+  se_lua_unload_script();
+  static const luaL_Reg emu_funcs[]={
+    {"read8",se_lua_read8},
+    {"read16",se_lua_read16},
+    {"read32",se_lua_read32},
+    {"write8",se_lua_write8},
+    {"write16",se_lua_write16},
+    {"write32",se_lua_write32},
+    {"read_range",se_lua_read_range},
+    {"set_input",se_lua_set_input},
+    {"get_input",se_lua_get_input},
+    {"save_state",se_lua_save_state},
+    {"load_state",se_lua_load_state},
+    {"frame",se_lua_frame},
+    {"system",se_lua_system},
+    {"on_frame",se_lua_on_frame},
+    {"on_breakpoint",se_lua_on_breakpoint},
+    {"pause",se_lua_pause},
+    {"resume",se_lua_resume},
+    {NULL,NULL}
+  };
+  lua_State* L = luaL_newstate();
+  if(!L)return false;
+  luaL_openlibs(L);
+  luaL_newlib(L,emu_funcs);
+  lua_setglobal(L,"emu");
+  gui_state.lua = L;
+  gui_state.lua_frame_callback = LUA_NOREF;
+  gui_state.lua_breakpoint_callback = LUA_NOREF;
+  gui_state.lua_frames = 0;
+  gui_state.lua_in_callback = true;
+  bool loaded = luaL_dofile(L,path)==LUA_OK;
+  gui_state.lua_in_callback = false;
+  if(!loaded){
+    printf("Failed to load Lua script %s: %s\n",path,lua_tostring(L,-1));
+    se_lua_unload_script();
+    return false;
+  }
+  printf("Loaded Lua script %s\n",path);
+  return true;
+}
+static void se_lua_run_callback(int ref){
+  lua_State* L = gui_state.lua;
+  if(ref==LUA_NOREF)return;
+  lua_rawgeti(L,LUA_REGISTRYINDEX,ref);
+  gui_state.lua_in_callback = true;
+  bool ok = lua_pcall(L,0,0,0)==LUA_OK;
+  gui_state.lua_in_callback = false;
+  if(!ok){
+    printf("Lua script error, unloading script: %s\n",lua_tostring(L,-1));
+    se_lua_unload_script();
+  }
+}
+// Called after every emulated frame. Frames emulated by a script (e.g. through load_state) don't
+// invoke the callbacks again.
+static void se_lua_after_frame(int prev_run_mode){
+  if(!gui_state.lua||gui_state.lua_in_callback)return;
+  gui_state.lua_frames++;
+  bool hit_breakpoint = prev_run_mode!=SB_MODE_PAUSE&&gui_instance.emu_state.run_mode==SB_MODE_PAUSE;
+  if(hit_breakpoint)se_lua_run_callback(gui_state.lua_breakpoint_callback);
+  if(gui_state.lua)se_lua_run_callback(gui_state.lua_frame_callback);
+}
+#endif
+
+// Movies replay the input of every frame from a save state. The emulated memory and framebuffer
+// are hashed every SE_MOVIE_CHECKPOINT_FRAMES frames so playback reports the first frame that
+// diverged from the recording. Loading a state or rewinding ends the movie.
+se_movie_t se_movie = {.first_desync=-1};
+static uint64_t se_movie_state_hash(){
+  se_core_state_t* core = &gui_instance.core;
+  uint64_t hash = 0;
+  if(gui_instance.emu_state.system==SYSTEM_GB){
+    hash = XXH3_64bits_withSeed(core->gb.mem.data,sizeof(core->gb.mem.data),hash);
+    hash = XXH3_64bits_withSeed(core->gb.mem.wram,sizeof(core->gb.mem.wram),hash);
+    uint16_t regs[6]={core->gb.cpu.af,core->gb.cpu.bc,core->gb.cpu.de,core->gb.cpu.hl,core->gb.cpu.sp,core->gb.cpu.pc};
+    hash = XXH3_64bits_withSeed(regs,sizeof(regs),hash);
+  }else if(gui_instance.emu_state.system==SYSTEM_GBA){
+    hash = XXH3_64bits_withSeed(core->gba.mem.wram0,sizeof(core->gba.mem.wram0),hash);
+    hash = XXH3_64bits_withSeed(core->gba.mem.wram1,sizeof(core->gba.mem.wram1),hash);
+    hash = XXH3_64bits_withSeed(core->gba.cpu.registers,sizeof(core->gba.cpu.registers),hash);
+  }else if(gui_instance.emu_state.system==SYSTEM_NDS){
+    hash = XXH3_64bits_withSeed(core->nds.mem.ram,sizeof(core->nds.mem.ram),hash);
+    hash = XXH3_64bits_withSeed(core->nds.mem.wram,sizeof(core->nds.mem.wram),hash);
+    hash = XXH3_64bits_withSeed(core->nds.arm7.registers,sizeof(core->nds.arm7.registers),hash);
+    hash = XXH3_64bits_withSeed(core->nds.arm9.registers,sizeof(core->nds.arm9.registers),hash);
+  }
+  return hash;
+}
+static uint64_t se_movie_frame_hash(){
+  if(!se_movie.screenshot)se_movie.screenshot = (uint8_t*)malloc(SE_MAX_SCREENSHOT_SIZE);
+  if(!se_movie.screenshot)return 0;
+  int w=0, h=0;
+  se_instance_screenshot(&gui_instance,se_movie.screenshot,&w,&h);
+  return XXH3_64bits(se_movie.screenshot,w*h*4);
+}
+static void se_movie_free(){
+  free(se_movie.frames);
+  free(se_movie.start_state);
+  se_movie.frames = NULL;
+  se_movie.start_state = NULL;
+  se_movie.num_frames = se_movie.capacity = 0;
+  se_movie.mode = SE_MOVIE_OFF;
+}
+static bool se_movie_active(){return se_movie.mode!=SE_MOVIE_OFF;}
+static bool se_movie_write(){
+  se_movie_header_t header={0};
+  memcpy(header.magic,SE_MOVIE_MAGIC,sizeof(header.magic));
+  header.version = SE_MOVIE_VERSION;
+  header.system = gui_instance.emu_state.system;
+  header.game_checksum = gui_instance.emu_state.game_checksum;
+  header.state_size = se_movie.start_state_size;
+  header.num_frames = se_movie.num_frames;
+  header.frame_size = sizeof(se_movie_frame_t);
+  header.checkpoint_frames = SE_MOVIE_CHECKPOINT_FRAMES;
+  size_t frames_size = se_movie.num_frames*sizeof(se_movie_frame_t);
+  size_t size = sizeof(header)+se_movie.start_state_size+frames_size;
+  uint8_t* data = (uint8_t*)malloc(size);
+  bool success = false;
+  if(data){
+    memcpy(data,&header,sizeof(header));
+    memcpy(data+sizeof(header),se_movie.start_state,se_movie.start_state_size);
+    if(frames_size)memcpy(data+sizeof(header)+se_movie.start_state_size,se_movie.frames,frames_size);
+    success = sb_save_file_data(se_movie.path,data,size);
+    free(data);
+  }
+  se_emscripten_flush_fs(se_movie.path);
+  if(success)printf("Recorded %llu frame movie: %s\n",(unsigned long long)se_movie.num_frames,se_movie.path);
+  else printf("Failed to write movie: %s\n",se_movie.path);
+  return success;
+}
+static void se_movie_stop(){
+  if(se_movie.mode==SE_MOVIE_RECORD)se_movie_write();
+  else if(se_movie.mode==SE_MOVIE_PLAY){
+    printf("Movie playback stopped after %llu/%llu frames, %llu checkpoints matched",
+      (unsigned long long)se_movie.frame,(unsigned long long)se_movie.num_frames,(unsigned long long)se_movie.checkpoints_passed);
+    if(se_movie.first_desync>=0)printf(", first desync at frame %lld",(long long)se_movie.first_desync);
+    printf("\n");
+  }
+  se_movie_free();
+}
+static bool se_movie_record(const char* path){
+  se_movie_stop();
+  if(!gui_instance.emu_state.rom_loaded)return false;
+  se_save_state_t* state = (se_save_state_t*)calloc(1,sizeof(se_save_state_t));
+  if(!state)return false;
+  se_capture_state(&gui_instance.core,state);
+  se_emu_id emu_id = se_prepare_save_state(state);
+  se_movie.start_state = state->valid? se_encode_binary_state(state,emu_id,se_get_core_size(),&se_movie.start_state_size): NULL;
+  se_free_save_state(state);
+  free(state);
+  if(!se_movie.start_state){
+    printf("Failed to capture the start state of movie: %s\n",path);
+    return false;
+  }
+  strncpy(se_movie.path,path,SB_FILE_PATH_SIZE-1);
+  se_movie.path[SB_FILE_PATH_SIZE-1]='\0';
+  se_movie.mode = SE_MOVIE_RECORD;
+  printf("Recording movie: %s\n",path);
+  return true;
+}
+static bool se_movie_play(const char* path){
+  se_movie_stop();
+  if(!gui_instance.emu_state.rom_loaded)return false;
+  size_t size = 0;
+  uint8_t* data = sb_load_file_data(path,&size);
+  if(!data){
+    printf("Failed to open movie: %s\n",path);
+    return false;
+  }
+  se_movie_header_t header;
+  bool valid = size>=sizeof(header);
+  if(valid){
+    memcpy(&header,data,sizeof(header));
+    valid = memcmp(header.magic,SE_MOVIE_MAGIC,sizeof(header.magic))==0&&header.version==SE_MOVIE_VERSION&&
+            header.frame_size==sizeof(se_movie_frame_t)&&header.state_size<=size-sizeof(header)&&
+            header.num_frames<=(size-sizeof(header)-header.state_size)/sizeof(se_movie_frame_t);
+  }
+  if(!valid)printf("ERROR: Movie:%s has an unsupported format\n",path);
+  else if(header.system!=gui_instance.emu_state.system){
+    printf("ERROR: Movie:%s was recorded on a different system\n",path);
+    valid = false;
+  }else if(header.game_checksum!=gui_instance.emu_state.game_checksum)printf("WARNING: Movie:%s was recorded with a different ROM\n",path);
+  se_save_state_t* state = valid? (se_save_state_t*)calloc(1,sizeof(se_save_state_t)): NULL;
+  se_movie.frames = valid? (se_movie_frame_t*)malloc(header.num_frames*sizeof(se_movie_frame_t)+1): NULL;
+  valid = state&&se_movie.frames&&se_load_state_from_mem(state,data+sizeof(header),header.state_size)&&state->system==gui_instance.emu_state.system;
+  if(valid){
+    // Restored without emulating a frame so the first recorded input lands on the first frame
+    memcpy(&gui_instance.core,state->core,se_get_core_size());
+#ifdef ENABLE_RETRO_ACHIEVEMENTS
+    retro_achievements_restore_state(state->rc_buffer);
+#endif
+    memcpy(se_movie.frames,data+sizeof(header)+header.state_size,header.num_frames*sizeof(se_movie_frame_t));
+    se_movie.num_frames = se_movie.capacity = header.num_frames;
+    se_movie.frame = 0;
+    se_movie.checkpoints_passed = 0;
+    se_movie.first_desync = -1;
+    strncpy(se_movie.path,path,SB_FILE_PATH_SIZE-1);
+    se_movie.path[SB_FILE_PATH_SIZE-1]='\0';
+    se_movie.mode = SE_MOVIE_PLAY;
+    printf("Playing %llu frame movie: %s\n",(unsigned long long)header.num_frames,path);
+  }else se_movie_free();
+  se_free_save_state(state);
+  free(state);
+  sb_free_file_data(data);
+  return valid;
+}
+static void se_movie_begin_frame(){
+  if(se_movie.mode==SE_MOVIE_RECORD)se_movie.frame_joy = gui_instance.emu_state.joy;
+  else if(se_movie.mode==SE_MOVIE_PLAY){
+    if(se_movie.frame>=se_movie.num_frames)se_movie_stop();
+    else gui_instance.emu_state.joy = se_movie.frames[se_movie.frame].joy;
+  }
+}
+static void se_movie_end_frame(){
+  if(se_movie.mode==SE_MOVIE_OFF)return;
+  uint64_t frame = se_movie.mode==SE_MOVIE_RECORD? se_movie.num_frames: se_movie.frame;
+  se_movie_frame_t f = {.joy=se_movie.frame_joy};
+  if(frame%SE_MOVIE_CHECKPOINT_FRAMES==SE_MOVIE_CHECKPOINT_FRAMES-1){
+    f.flags|=SE_MOVIE_STATE_HASH;
+    f.state_hash = se_movie_state_hash();
+    // Skipped frames leave the framebuffer stale
+    if(gui_instance.emu_state.render_frame){
+      f.flags|=SE_MOVIE_FRAME_HASH;
+      f.frame_hash = se_movie_frame_hash();
+    }
+  }
+  if(se_movie.mode==SE_MOVIE_RECORD){
+    if(se_movie.num_frames==se_movie.capacity){
+      uint64_t capacity = se_movie.capacity? se_movie.capacity*2: 4096;
+      se_movie_frame_t* frames = (se_movie_frame_t*)realloc(se_movie.frames,capacity*sizeof(se_movie_frame_t));
+      if(!frames){
+        printf("Out of memory for movie, stopping the recording\n");
+        se_movie_stop();
+        return;
+      }
+      se_movie.frames = frames;
+      se_movie.capacity = capacity;
+    }
+    se_movie.frames[se_movie.num_frames++] = f;
+    return;
+  }
+  se_movie_frame_t* rec = se_movie.frames+frame;
+  uint32_t checked = rec->flags&f.flags;
+  bool match = true;
+  if(checked&SE_MOVIE_STATE_HASH)match&=rec->state_hash==f.state_hash;
+  if(checked&SE_MOVIE_FRAME_HASH)match&=rec->frame_hash==f.frame_hash;
+  if(checked&&match)se_movie.checkpoints_passed++;
+  if(!match&&se_movie.first_desync<0){
+    se_movie.first_desync = frame;
+    printf("Movie desync detected at frame %llu\n",(unsigned long long)frame);
+  }
+  if(++se_movie.frame==se_movie.num_frames)se_movie_stop();
+}
+// Video recording: emulated frames and their audio are copied into a ring that SE_ASYNC_VIDEO
+// drains, encoding each frame as JPEG into a Motion JPEG AVI with 16 bit PCM audio. The emulator
+// never waits on the encoder, frames are dropped if the ring is full.
+#define SE_VIDEO_RING_FRAMES 8
+#define SE_VIDEO_MAX_AUDIO_SAMPLES 8192
+#define SE_VIDEO_JPEG_QUALITY 90
+// Old AVI readers use signed 32 bit offsets
+#define SE_VIDEO_MAX_FILE_SIZE (2000u*1024*1024)
+typedef struct{
+  uint8_t pixels[SE_MAX_SCREENSHOT_SIZE];
+  int16_t audio[SE_VIDEO_MAX_AUDIO_SAMPLES];
+  uint32_t audio_samples;
+}se_video_frame_t;
+typedef struct{
+  uint32_t id, flags, offset, size;
+}se_avi_index_entry_t;
+typedef struct{
+  FILE* file;
+  char path[SB_FILE_PATH_SIZE];
+  int width, height;
+  double fps;
+  se_video_frame_t* frames; // SE_VIDEO_RING_FRAMES
+  volatile uint32_t write_index;
+  volatile uint32_t read_index;
+  uint32_t dropped_frames;
+  // Only touched by the encoder
+  se_png_write_context_t jpeg;
+  se_avi_index_entry_t* index;
+  uint32_t index_size, index_capacity;
+  uint32_t video_frames;
+  uint32_t audio_frames;
+  uint32_t max_chunk_size;
+  uint32_t file_size;
+  bool failed;
+}se_video_recorder_t;
+se_video_recorder_t se_video;
+
+static void se_avi_u16(uint8_t** p, uint16_t v){(*p)[0]=v;(*p)[1]=v>>8;*p+=2;}
+static void se_avi_u32(uint8_t** p, uint32_t v){for(int i=0;i<4;++i)(*p)[i]=v>>(i*8);*p+=4;}
+static void se_avi_fourcc(uint8_t** p, const char* id){memcpy(*p,id,4);*p+=4;}
+static uint32_t se_avi_id(const char* id){return id[0]|(id[1]<<8)|(id[2]<<16)|((uint32_t)id[3]<<24);}
+#define SE_AVI_HEADER_SIZE 324
+// Written once at the start with zero counts and again with the final ones when the recording stops
+static void se_video_write_avi_header(se_video_recorder_t* v, uint32_t index_bytes){
+  uint8_t header[SE_AVI_HEADER_SIZE];
+  uint8_t* p = header;
+  uint32_t fps_scale = 1000;
+  uint32_t fps_rate = v->fps*fps_scale+0.5;
+  uint32_t movi_size = v->file_size-SE_AVI_HEADER_SIZE+4;
+  se_avi_fourcc(&p,"RIFF");
+  se_avi_u32(&p,v->file_size+index_bytes-8);
+  se_avi_fourcc(&p,"AVI ");
+  se_avi_fourcc(&p,"LIST");
+  se_avi_u32(&p,SE_AVI_HEADER_SIZE-12-8-12);
+  se_avi_fourcc(&p,"hdrl");
+  se_avi_fourcc(&p,"avih");
+  se_avi_u32(&p,56);
+  se_avi_u32(&p,1e6/v->fps);
+  se_avi_u32(&p,(uint32_t)(v->max_chunk_size*v->fps)+SE_AUDIO_SAMPLE_RATE*4);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,0x10); // AVIF_HASINDEX
+  se_avi_u32(&p,v->video_frames);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,2);
+  se_avi_u32(&p,v->max_chunk_size);
+  se_avi_u32(&p,v->width);
+  se_avi_u32(&p,v->height);
+  for(int i=0;i<4;++i)se_avi_u32(&p,0);
+  // Video stream
+  se_avi_fourcc(&p,"LIST");
+  se_avi_u32(&p,4+8+56+8+40);
+  se_avi_fourcc(&p,"strl");
+  se_avi_fourcc(&p,"strh");
+  se_avi_u32(&p,56);
+  se_avi_fourcc(&p,"vids");
+  se_avi_fourcc(&p,"MJPG");
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,fps_scale);
+  se_avi_u32(&p,fps_rate);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,v->video_frames);
+  se_avi_u32(&p,v->max_chunk_size);
+  se_avi_u32(&p,0xffffffff);
+  se_avi_u32(&p,0);
+  se_avi_u16(&p,0);se_avi_u16(&p,0);se_avi_u16(&p,v->width);se_avi_u16(&p,v->height);
+  se_avi_fourcc(&p,"strf");
+  se_avi_u32(&p,40);
+  se_avi_u32(&p,40);
+  se_avi_u32(&p,v->width);
+  se_avi_u32(&p,v->height);
+  se_avi_u16(&p,1);
+  se_avi_u16(&p,24);
+  se_avi_fourcc(&p,"MJPG");
+  se_avi_u32(&p,v->width*v->height*3);
+  for(int i=0;i<4;++i)se_avi_u32(&p,0);
+  // Audio stream
+  se_avi_fourcc(&p,"LIST");
+  se_avi_u32(&p,4+8+56+8+16);
+  se_avi_fourcc(&p,"strl");
+  se_avi_fourcc(&p,"strh");
+  se_avi_u32(&p,56);
+  se_avi_fourcc(&p,"auds");
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,1);
+  se_avi_u32(&p,SE_AUDIO_SAMPLE_RATE);
+  se_avi_u32(&p,0);
+  se_avi_u32(&p,v->audio_frames);
+  se_avi_u32(&p,SE_VIDEO_MAX_AUDIO_SAMPLES*2);
+  se_avi_u32(&p,0xffffffff);
+  se_avi_u32(&p,4);
+  for(int i=0;i<4;++i)se_avi_u16(&p,0);
+  se_avi_fourcc(&p,"strf");
+  se_avi_u32(&p,16);
+  se_avi_u16(&p,1); // PCM
+  se_avi_u16(&p,2);
+  se_avi_u32(&p,SE_AUDIO_SAMPLE_RATE);
+  se_avi_u32(&p,SE_AUDIO_SAMPLE_RATE*4);
+  se_avi_u16(&p,4);
+  se_avi_u16(&p,16);
+  se_avi_fourcc(&p,"LIST");
+  se_avi_u32(&p,movi_size);
+  se_avi_fourcc(&p,"movi");
+  fseek(v->file,0,SEEK_SET);
+  if(fwrite(header,1,sizeof(header),v->file)!=sizeof(header))v->failed=true;
+}
+static void se_video_write_chunk(se_video_recorder_t* v, const char* id, const void* data, uint32_t size, uint32_t flags){
+  if(v->failed)return;
+  if(v->index_size==v->index_capacity){
+    uint32_t capacity = v->index_capacity? v->index_capacity*2: 4096;
+    se_avi_index_entry_t* index = (se_avi_index_entry_t*)realloc(v->index,capacity*sizeof(se_avi_index_entry_t));
+    if(!index){v->failed=true;return;}
+    v->index = index;
+    v->index_capacity = capacity;
+  }
+  uint32_t padded = (size+1)&~1;
+  if((uint64_t)v->file_size+8+padded+(v->index_size+1)*sizeof(se_avi_index_entry_t)>SE_VIDEO_MAX_FILE_SIZE){
+    printf("Video recording reached the AVI size limit: %s\n",v->path);
+    v->failed=true;
+    return;
+  }
+  // idx1 offsets are relative to the "movi" fourcc
+  v->index[v->index_size++]=(se_avi_index_entry_t){se_avi_id(id),flags,v->file_size-(SE_AVI_HEADER_SIZE-4),size};
+  uint8_t chunk_header[8];
+  uint8_t* p = chunk_header;
+  se_avi_fourcc(&p,id);
+  se_avi_u32(&p,size);
+  uint8_t pad = 0;
+  bool ok = fwrite(chunk_header,1,8,v->file)==8&&fwrite(data,1,size,v->file)==size&&(padded==size||fwrite(&pad,1,1,v->file)==1);
+  if(!ok){
+    printf("Failed to write video: %s\n",v->path);
+    v->failed=true;
+  }
+  v->file_size+=8+padded;
+  if(size>v->max_chunk_size)v->max_chunk_size=size;
+}
+static void se_video_encode_frames(void* user_data, int job_index){
+  se_video_recorder_t* v = (se_video_recorder_t*)user_data;
+  while(v->read_index!=sb_atomic_load_acquire_u32(&v->write_index)){
+    se_video_frame_t* f = v->frames+v->read_index%SE_VIDEO_RING_FRAMES;
+    v->jpeg.size = 0;
+    stbi_write_jpg_to_func(se_png_write_mem,&v->jpeg,v->width,v->height,4,f->pixels,SE_VIDEO_JPEG_QUALITY);
+    se_video_write_chunk(v,"00dc",v->jpeg.data,v->jpeg.size,0x10);
+    v->video_frames++;
+    if(f->audio_samples){
+      se_video_write_chunk(v,"01wb",f->audio,f->audio_samples*2,0x10);
+      v->audio_frames+=f->audio_samples/2;
+    }
+    sb_atomic_store_release_u32(&v->read_index,v->read_index+1);
   }
-#ifdef USE_SDL
-  if(SDL_JoystickHasRumble(cont->sdl_joystick)){se_text("Rumble Supported");
-  }else se_text("Rumble Not Supported");
-#endif
 }
-
-void se_reset_default_gb_palette(){
-  uint8_t palette[4*3] = { 0x81,0x8F,0x38,0x64,0x7D,0x43,0x56,0x6D,0x3F,0x31,0x4A,0x2D };
-  for(int i=0;i<4;++i){
-    gui_state.settings.gb_palette[i]=palette[i*3]|(palette[i*3+1]<<8)|(palette[i*3+2]<<16);
+static void se_video_stop(){
+  se_video_recorder_t* v = &se_video;
+  if(!v->file)return;
+  job_pool_wait_async(SE_ASYNC_VIDEO);
+  se_video_encode_frames(v,0);
+  if(!v->failed){
+    fseek(v->file,v->file_size,SEEK_SET);
+    uint8_t header[8];
+    uint8_t* p = header;
+    se_avi_fourcc(&p,"idx1");
+    se_avi_u32(&p,v->index_size*sizeof(se_avi_index_entry_t));
+    fwrite(header,1,8,v->file);
+    for(uint32_t i=0;i<v->index_size;++i){
+      uint8_t entry[16];
+      p = entry;
+      se_avi_u32(&p,v->index[i].id);
+      se_avi_u32(&p,v->index[i].flags);
+      se_avi_u32(&p,v->index[i].offset);
+      se_avi_u32(&p,v->index[i].size);
+      fwrite(entry,1,16,v->file);
+    }
+    se_video_write_avi_header(v,8+v->index_size*sizeof(se_avi_index_entry_t));
   }
+  fclose(v->file);
+  printf("Recorded %u frame video (%u dropped): %s\n",v->video_frames,v->dropped_frames,v->path);
+  free(v->frames);
+  free(v->index);
+  free(v->jpeg.data);
+  memset(v,0,sizeof(*v));
 }
-void se_capture_state_slot(int slot){
-  se_capture_state(&core, save_states+slot);
-  char save_state_path[SB_FILE_PATH_SIZE];
-  snprintf(save_state_path,SB_FILE_PATH_SIZE,"%s.slot%d.state.png",emu_state.save_data_base_path,slot);
-  se_save_state_to_disk(save_states+slot,save_state_path);
+static bool se_video_record(const char* path){
+  se_video_stop();
+  if(!gui_instance.emu_state.rom_loaded)return false;
+  se_video_recorder_t* v = &se_video;
+  v->frames = (se_video_frame_t*)malloc(sizeof(se_video_frame_t)*SE_VIDEO_RING_FRAMES);
+  v->file = v->frames? fopen(path,"wb"): NULL;
+  if(!v->file){
+    printf("Failed to open video for writing: %s\n",path);
+    free(v->frames);
+    memset(v,0,sizeof(*v));
+    return false;
+  }
+  strncpy(v->path,path,SB_FILE_PATH_SIZE-1);
+  int w=0,h=0;
+  se_instance_screenshot(&gui_instance,v->frames[0].pixels,&w,&h);
+  v->width = w;
+  v->height = h;
+  v->fps = se_get_sim_fps();
+  v->file_size = SE_AVI_HEADER_SIZE;
+  se_video_write_avi_header(v,0);
+  printf("Recording video: %s\n",path);
+  return true;
 }
-void se_restore_state_slot(int slot){
-  if(save_states[slot].valid)se_restore_state(&core, save_states+slot);
+// Called after every emulated frame. audio_start is the audio ring write pointer before the frame
+static void se_video_capture_frame(uint32_t audio_start){
+  se_video_recorder_t* v = &se_video;
+  if(!v->file||v->failed)return;
+  if(v->write_index-sb_atomic_load_acquire_u32(&v->read_index)>=SE_VIDEO_RING_FRAMES){
+    v->dropped_frames++;
+    return;
+  }
+  se_video_frame_t* f = v->frames+v->write_index%SE_VIDEO_RING_FRAMES;
+  int w=0,h=0;
+  se_instance_screenshot(&gui_instance,f->pixels,&w,&h);
+  if(w!=v->width||h!=v->height){
+    v->dropped_frames++;
+    return;
+  }
+  sb_ring_buffer_t* ring = &gui_instance.emu_state.audio_ring_buff;
+  uint32_t samples = ring->write_ptr-audio_start;
+  if(samples>SE_VIDEO_MAX_AUDIO_SAMPLES)samples=SE_VIDEO_MAX_AUDIO_SAMPLES;
+  for(uint32_t i=0;i<samples;++i)f->audio[i]=ring->data[(audio_start+i)%SB_AUDIO_RING_BUFFER_SIZE];
+  f->audio_samples = samples&~1;
+  sb_atomic_store_release_u32(&v->write_index,v->write_index+1);
+  if(!job_pool_async_busy(SE_ASYNC_VIDEO))job_pool_run_async(SE_ASYNC_VIDEO,se_video_encode_frames,v);
 }
 void se_push_disabled(){
   ImGuiStyle *style = igGetStyle();
@@ -6017,7 +12860,7 @@ void se_draw_save_states(bool cloud){
   float win_w = igGetWindowContentRegionWidth();
   ImDrawList*dl= igGetWindowDrawList();
   bool has_save_states=false;
-  if(!emu_state.rom_loaded)se_push_disabled();
+  if(!gui_instance.emu_state.rom_loaded)se_push_disabled();
 
   for(size_t i=0;i<SE_NUM_SAVE_STATES;++i){
     mutex_lock(cloud_state.save_states_mutex);
@@ -6102,7 +12945,7 @@ void se_draw_save_states(bool cloud){
   if(se_button(ICON_FK_DOWNLOAD " Export Save States",(ImVec2){win_w,0})) { se_download_emscripten_save_states(); }
   if(!has_save_states)se_pop_disabled();
   #endif 
-  if(!emu_state.rom_loaded)se_pop_disabled();
+  if(!gui_instance.emu_state.rom_loaded)se_pop_disabled();
 }
 void se_draw_menu_panel(){
   ImGuiStyle *style = igGetStyle();
@@ -6126,6 +12969,24 @@ void se_draw_menu_panel(){
       se_draw_save_states(false);
     }
   }
+  se_section(ICON_FK_HISTORY " Rewind History");
+  if(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in)se_text("Disabled in Hardcore Mode");
+  else if(!gui_instance.emu_state.rom_loaded||!gui_instance.rewind_buffer.first_push)se_text("No rewind history");
+  else{
+    // The range is only refreshed while the rewind worker is idle so drawing never waits on it
+    static int first_frame = 0, last_frame = 0;
+    if(!job_pool_async_busy(SE_ASYNC_REWIND)){
+      first_frame = gui_instance.rewind_buffer.base_frame;
+      last_frame = se_rewind_state_frame(&gui_instance.rewind_buffer,(int)gui_instance.rewind_buffer.size-1);
+    }
+    static int scrub_frame = -1;
+    if(!igIsAnyItemActive()||scrub_frame<first_frame||scrub_frame>last_frame)scrub_frame = last_frame;
+    igPushItemWidth(-1);
+    igSliderInt("##Rewind History",&scrub_frame,first_frame,last_frame,se_localize_and_cache("Frame %d"),ImGuiSliderFlags_AlwaysClamp);
+    igPopItemWidth();
+    // Seeking discards the newer history, so only do it once the slider is released
+    if(igIsItemDeactivatedAfterEdit())se_seek_rewind_state(&gui_instance.core,&gui_instance.rewind_buffer,scrub_frame);
+  }
   se_section(ICON_FK_CLOUD " Google Drive");
   if (!cloud_state.drive){
     bool pending_login = cloud_drive_pending_login();
@@ -6174,7 +13035,7 @@ void se_draw_menu_panel(){
     igEndGroup();
   }
 
-  if(emu_state.system==SYSTEM_NDS || emu_state.system == SYSTEM_GBA || emu_state.system == SYSTEM_GB){
+  if(gui_instance.emu_state.system==SYSTEM_NDS || gui_instance.emu_state.system == SYSTEM_GBA || gui_instance.emu_state.system == SYSTEM_GB){
     se_section(ICON_FK_KEY " Action Replay Codes");
     if(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in) se_text("Disabled in Hardcore Mode");
     else{
@@ -6234,6 +13095,7 @@ void se_draw_menu_panel(){
           cheat->state = 0; 
           strcpy(cheat->name,"Untitled Code");
           memset(cheat->buffer,0,sizeof(cheat->buffer));
+          cheat->compiled_by = NULL;
         }
       }
     }
@@ -6385,10 +13247,10 @@ void se_draw_menu_panel(){
   #endif
   {
     se_bios_info_t * info = &gui_state.bios_info;
-    if(emu_state.rom_loaded){
+    if(gui_instance.emu_state.rom_loaded){
       se_section(ICON_FK_CROSSHAIRS " Located Files");
       static const char* wildcard_types[]={NULL};
-      if(sb_file_exists(emu_state.save_file_path)){
+      if(sb_file_exists(gui_instance.emu_state.save_file_path)){
         igPushStyleColorU32(ImGuiCol_Text,0xff00ff00);
         se_text(ICON_FK_CHECK);
       }else{
@@ -6398,7 +13260,7 @@ void se_draw_menu_panel(){
       igPopStyleColor(1);
       igSameLine(0,2);
       igSetNextItemWidth(win_w-55);
-      se_input_file_callback("Save File",emu_state.save_file_path,wildcard_types,se_bios_file_open_fn,ImGuiInputTextFlags_None);
+      se_input_file_callback("Save File",gui_instance.emu_state.save_file_path,wildcard_types,se_bios_file_open_fn,ImGuiInputTextFlags_None);
 
       bool missing_bios = false;
       for(int i=0;i<sizeof(info->name)/sizeof(info->name[0]);++i){
@@ -6431,6 +13293,14 @@ void se_draw_menu_panel(){
   se_text("Screen Shader");igSameLine(SE_FIELD_INDENT,0);
   se_combo_str("##Screen Shader",&v,"Pixelate\0Bilinear\0LCD\0LCD & Subpixels\0Smooth Upscale (xBRZ)\0",0);
   gui_state.settings.screen_shader=v;
+  v = gui_state.settings.shader_chain;
+  se_text("Upscaling Filter");igSameLine(SE_FIELD_INDENT,0);
+  se_combo_str("##Upscaling Filter",&v,"None\0xBRZ 2x\0xBRZ 4x\0Scale2x\0Scale4x\0",0);
+  gui_state.settings.shader_chain=v;
+  v = gui_state.settings.nds_3d_scale;
+  se_text("NDS 3D Resolution");igSameLine(SE_FIELD_INDENT,0);
+  se_combo_str("##NDS 3D Resolution",&v,"Native\0GPU 2x\0GPU 3x\0GPU 4x\0GPU 5x\0GPU 6x\0GPU 7x\0GPU 8x\0",0);
+  gui_state.settings.nds_3d_scale=v;
   v = gui_state.settings.screen_rotation;
   se_text("Screen Rotation");igSameLine(SE_FIELD_INDENT,0);
   se_combo_str("##Screen Rotation",&v,"0 degrees\00090 degrees\000180 degrees\000270 degrees\0",0);
@@ -6497,7 +13367,7 @@ void se_draw_menu_panel(){
       char settings_path[SB_FILE_PATH_SIZE];
       snprintf(settings_path,SB_FILE_PATH_SIZE,"%skeyboard-bindings.bin",se_get_pref_path());
       sb_save_file_data(settings_path,(uint8_t*)gui_state.key.bound_id,sizeof(gui_state.key.bound_id));
-      se_emscripten_flush_fs();
+      se_emscripten_flush_fs(settings_path);
     }
   }
   #if defined( USE_SDL) ||defined(SE_PLATFORM_ANDROID)
@@ -6610,6 +13480,7 @@ void se_draw_menu_panel(){
     se_input_path("Save File/State Path", gui_state.paths.save,ImGuiInputTextFlags_None);
     se_input_path("BIOS/Firmware Path", gui_state.paths.bios,ImGuiInputTextFlags_None);
     se_input_path("Cheat Code Path", gui_state.paths.cheat_codes,ImGuiInputTextFlags_None);
+    se_input_path("ROM Library Path", gui_state.paths.rom_library,ImGuiInputTextFlags_None);
     bool save_to_path=gui_state.settings.save_to_path;
     se_checkbox("Create new files in paths",&save_to_path);
     gui_state.settings.save_to_path=save_to_path;
@@ -6621,13 +13492,77 @@ void se_draw_menu_panel(){
   se_section(ICON_FK_WRENCH " Advanced");
   se_text("Solar Sensor");igSameLine(SE_FIELD_INDENT,0);
   igPushItemWidth(-1);
-  se_slider_float("##Solar Sensor",&emu_state.joy.solar_sensor,0.,1.,"Brightness: %.2f");
+  se_slider_float("##Solar Sensor",&gui_instance.emu_state.joy.solar_sensor,0.,1.,"Brightness: %.2f");
   bool force_dmg_mode = gui_state.settings.force_dmg_mode;
   se_checkbox("Force GB games to run in DMG mode",&force_dmg_mode);
   gui_state.settings.force_dmg_mode=force_dmg_mode;
   bool draw_debug_menu = gui_state.settings.draw_debug_menu;
   se_checkbox("Show Debug Tools",&draw_debug_menu);
   gui_state.settings.draw_debug_menu = draw_debug_menu;
+  bool cpu_batch_exec = gui_state.settings.cpu_batch_exec;
+  se_checkbox("Batch CPU Execution Between Events",&cpu_batch_exec);
+  gui_state.settings.cpu_batch_exec = cpu_batch_exec;
+  bool cpu_idle_loop_skip = gui_state.settings.cpu_idle_loop_skip;
+  se_checkbox("Skip Idle Loops",&cpu_idle_loop_skip);
+  gui_state.settings.cpu_idle_loop_skip = cpu_idle_loop_skip;
+  int nds_cpu_slice = gui_state.settings.nds_cpu_slice;
+  se_text("NDS CPU Slice");igSameLine(SE_FIELD_INDENT,0);
+  igPushItemWidth(-1);
+  se_combo_str("##NDS CPU Slice",&nds_cpu_slice,"Lockstep\00016 Cycles\00064 Cycles\000256 Cycles\0Auto (Performance Governor)\0",0);
+  igPopItemWidth();
+  gui_state.settings.nds_cpu_slice = nds_cpu_slice;
+  bool nds_threaded_ppu = gui_state.settings.nds_threaded_ppu;
+  se_checkbox("Render NDS 2D Engines in Parallel",&nds_threaded_ppu);
+  gui_state.settings.nds_threaded_ppu = nds_threaded_ppu;
+  bool nds_threaded_arm7 = gui_state.settings.nds_threaded_arm7;
+  se_checkbox("Run NDS ARM7 on its Own Thread",&nds_threaded_arm7);
+  gui_state.settings.nds_threaded_arm7 = nds_threaded_arm7;
+  bool gba_hle_bios = gui_state.settings.gba_hle_bios;
+  se_checkbox("High Level GBA BIOS Functions",&gba_hle_bios);
+  gui_state.settings.gba_hle_bios = gba_hle_bios;
+  bool nds_hle_bios = gui_state.settings.nds_hle_bios;
+  se_checkbox("High Level NDS BIOS Functions",&nds_hle_bios);
+  gui_state.settings.nds_hle_bios = nds_hle_bios;
+  bool nds_instant_card = gui_state.settings.nds_instant_card;
+  se_checkbox("Instant NDS Gamecard Loads",&nds_instant_card);
+  gui_state.settings.nds_instant_card = nds_instant_card;
+  if(gui_state.game_profile.key[0])se_text("Game profile %s overrides some of these settings",gui_state.game_profile.key);
+  int rewind_memory = gui_state.settings.rewind_memory;
+  se_text("Rewind Memory");igSameLine(SE_FIELD_INDENT,0);
+  igPushItemWidth(-1);
+  se_combo_str("##Rewind Memory",&rewind_memory,"16 MB\00032 MB\00064 MB\000128 MB\000256 MB\0",0);
+  igPopItemWidth();
+  gui_state.settings.rewind_memory = rewind_memory;
+  int rewind_length = gui_state.settings.rewind_length;
+  se_text("Rewind Length");igSameLine(SE_FIELD_INDENT,0);
+  igPushItemWidth(-1);
+  se_combo_str("##Rewind Length",&rewind_length,"15 Seconds\00030 Seconds\00060 Seconds\0002 Minutes\0005 Minutes\0",0);
+  igPopItemWidth();
+  gui_state.settings.rewind_length = rewind_length;
+  int run_ahead_frames = gui_state.settings.run_ahead_frames;
+  se_text("Run Ahead (GB/GBA)");igSameLine(SE_FIELD_INDENT,0);
+  igPushItemWidth(-1);
+  se_combo_str("##Run Ahead",&run_ahead_frames,"Off\0001 Frame\0002 Frames\0003 Frames\0004 Frames\0",0);
+  igPopItemWidth();
+  gui_state.settings.run_ahead_frames = run_ahead_frames;
+  bool run_ahead_second_instance = gui_state.settings.run_ahead_second_instance;
+  se_checkbox("Run Ahead in a Second Instance",&run_ahead_second_instance);
+  gui_state.settings.run_ahead_second_instance = run_ahead_second_instance;
+  bool threaded_emulation = gui_state.settings.threaded_emulation;
+  se_checkbox("Run Emulation on a Separate Thread",&threaded_emulation);
+  gui_state.settings.threaded_emulation = threaded_emulation;
+  int frame_pacing = gui_state.settings.frame_pacing;
+  se_text("Frame Pacing");igSameLine(SE_FIELD_INDENT,0);
+  igPushItemWidth(-1);
+  se_combo_str("##Frame Pacing",&frame_pacing,"Wall Clock\0Display Refresh\0Audio Clock\0",0);
+  igPopItemWidth();
+  gui_state.settings.frame_pacing = frame_pacing;
+  bool late_input_polling = gui_state.settings.late_input_polling;
+  se_checkbox("Poll Input at Keypad Reads",&late_input_polling);
+  gui_state.settings.late_input_polling = late_input_polling;
+  bool perf_governor = gui_state.settings.perf_governor;
+  se_checkbox("Adaptive Performance Governor",&perf_governor);
+  gui_state.settings.perf_governor = perf_governor;
 
 #ifdef ENABLE_HTTP_CONTROL_SERVER
   bool enable_hcs = gui_state.settings.http_control_server_enable;
@@ -6644,7 +13579,7 @@ void se_draw_menu_panel(){
 #endif 
 
   char byte_str[32];
-  uint64_t cache_size = https_cache_size();
+  uint64_t cache_size = https_cache_size()+atlas_disk_cache_size();
   if(cache_size>1024*1024*1024){
     cache_size/=1024*1024*1024;
     snprintf(byte_str,32,"%d GiB",(int)cache_size);
@@ -6667,6 +13602,7 @@ void se_draw_menu_panel(){
   se_text("Download Cache Size: %s",byte_str);
   if (se_button("Clear Download Cache", (ImVec2){0,0})){
     https_clear_cache();
+    atlas_clear_disk_cache();
   }
   if (!enable_download_cache)se_pop_disabled();
 
@@ -6676,13 +13612,221 @@ void se_draw_menu_panel(){
   #endif
   igDummy((ImVec2){0,bottom_padding});
 }
+// Fractional position of the output resampler past the ring read pointer, in stereo frames
+static double se_audio_read_frac = 0;
 static void se_reset_audio_ring(){
-  //Reset the audio ring to 50% full with empty samples to avoid crackles while the buffer fills back up. 
-  emu_state.audio_ring_buff.read_ptr = 0;
-  emu_state.audio_ring_buff.write_ptr=4096;
-  for(int i=0;i<SB_AUDIO_RING_BUFFER_SIZE;++i)emu_state.audio_ring_buff.data[i]=0; 
+  //Reset the audio ring to the target fill with empty samples to avoid crackles while the buffer fills back up. 
+  gui_instance.emu_state.audio_ring_buff.read_ptr = 0;
+  gui_instance.emu_state.audio_ring_buff.write_ptr=SE_AUDIO_TARGET_FILL;
+  se_audio_read_frac = 0;
+  for(int i=0;i<SB_AUDIO_RING_BUFFER_SIZE;++i)gui_instance.emu_state.audio_ring_buff.data[i]=0; 
+}
+#if defined(EMSCRIPTEN) && defined(__EMSCRIPTEN_PTHREADS__)
+// Threaded web builds play audio from an AudioWorklet that reads this ring straight out of the
+// shared wasm memory, so playback doesn't depend on the main thread running in time like the
+// ScriptProcessorNode of sokol_audio does. Written by the UI thread, read by the audio thread.
+#define SE_WEB_AUDIO_WORKLET 1
+#define SE_AUDIO_THREAD_RING 1
+#define SE_AUDIO_THREAD_RING_FRAMES 8192
+// Frames kept queued, enough to ride out a few dropped main thread frames
+#define SE_AUDIO_THREAD_TARGET_FRAMES 4096
+#elif defined(SE_PLATFORM_ANDROID)
+// Android plays audio from the data callback of a low latency AAudio stream which pulls from this
+// ring, so sound isn't delayed by the conservative buffering of the OpenSLES backend of sokol_audio.
+// libaaudio is loaded at runtime and devices without it (before Android 8) keep using sokol_audio.
+#define SE_ANDROID_AAUDIO 1
+#define SE_AUDIO_THREAD_RING 1
+#define SE_AUDIO_THREAD_RING_FRAMES 4096
+// About two emulated frames, the callback runs far more often than the UI thread
+#define SE_AUDIO_THREAD_TARGET_FRAMES 1536
+#endif
+#ifdef SE_AUDIO_THREAD_RING
+typedef struct{
+  volatile uint32_t read; // In frames, wrapping
+  volatile uint32_t write;
+  float data[SE_AUDIO_THREAD_RING_FRAMES*2];
+}se_audio_thread_ring_t;
+static se_audio_thread_ring_t se_audio_thread_ring;
+#endif
+#ifdef SE_WEB_AUDIO_WORKLET
+EM_JS(void, se_web_audio_js_init, (int ring_ptr, int ring_frames, int sample_rate), {
+  if(typeof AudioContext==='undefined'||typeof AudioWorkletNode==='undefined'){
+    console.log('No AudioWorklet support');
+    return;
+  }
+  var processor = `
+    class SkyEmuAudio extends AudioWorkletProcessor{
+      constructor(options){
+        super();
+        var o = options.processorOptions;
+        this.frames = o.frames;
+        this.index = new Uint32Array(o.memory.buffer,o.ptr,2);
+        this.data = new Float32Array(o.memory.buffer,o.ptr+8,o.frames*2);
+      }
+      process(inputs, outputs){
+        var l = outputs[0][0], r = outputs[0][1]||outputs[0][0];
+        var read = Atomics.load(this.index,0), write = Atomics.load(this.index,1);
+        for(var i=0;i<l.length;++i){
+          if(read!==write){
+            var s = (read%this.frames)*2;
+            l[i] = this.data[s];
+            r[i] = this.data[s+1];
+            read = (read+1)>>>0;
+          }else l[i] = r[i] = 0;
+        }
+        Atomics.store(this.index,0,read);
+        return true;
+      }
+    }
+    registerProcessor('skyemu-audio',SkyEmuAudio);`;
+  var context = new AudioContext({sampleRate: sample_rate, latencyHint: 'interactive'});
+  var url = URL.createObjectURL(new Blob([processor],{type:'application/javascript'}));
+  context.audioWorklet.addModule(url).then(function(){
+    var node = new AudioWorkletNode(context,'skyemu-audio',{
+      numberOfInputs: 0,
+      outputChannelCount: [2],
+      processorOptions: {memory: wasmMemory, ptr: ring_ptr, frames: ring_frames}
+    });
+    node.connect(context.destination);
+  });
+  var resume = function(){ if(context.state==='suspended')context.resume(); };
+  document.addEventListener('click', resume, {once:true});
+  document.addEventListener('touchstart', resume, {once:true});
+  document.addEventListener('keydown', resume, {once:true});
+  Module._se_audio_context = context;
+});
+EM_JS(void, se_web_audio_js_shutdown, (void), {
+  if(Module._se_audio_context)Module._se_audio_context.close();
+  Module._se_audio_context = null;
+});
+#endif
+#ifdef SE_ANDROID_AAUDIO
+// Subset of the AAudio API (Android 8+), resolved from libaaudio.so by se_aaudio_load
+typedef struct AAudioStreamStruct se_aaudio_stream_t;
+typedef struct AAudioStreamBuilderStruct se_aaudio_builder_t;
+typedef int32_t (*se_aaudio_data_callback_t)(se_aaudio_stream_t* stream, void* user_data, void* audio_data, int32_t num_frames);
+typedef void (*se_aaudio_error_callback_t)(se_aaudio_stream_t* stream, void* user_data, int32_t error);
+#define SE_AAUDIO_OK 0
+#define SE_AAUDIO_FORMAT_PCM_FLOAT 2
+#define SE_AAUDIO_SHARING_MODE_EXCLUSIVE 0
+#define SE_AAUDIO_PERFORMANCE_MODE_LOW_LATENCY 12
+#define SE_AAUDIO_CALLBACK_RESULT_CONTINUE 0
+typedef struct{
+  void* library;
+  int32_t (*createStreamBuilder)(se_aaudio_builder_t** builder);
+  void (*setSampleRate)(se_aaudio_builder_t* builder, int32_t sample_rate);
+  void (*setChannelCount)(se_aaudio_builder_t* builder, int32_t channel_count);
+  void (*setFormat)(se_aaudio_builder_t* builder, int32_t format);
+  void (*setSharingMode)(se_aaudio_builder_t* builder, int32_t sharing_mode);
+  void (*setPerformanceMode)(se_aaudio_builder_t* builder, int32_t mode);
+  void (*setDataCallback)(se_aaudio_builder_t* builder, se_aaudio_data_callback_t callback, void* user_data);
+  void (*setErrorCallback)(se_aaudio_builder_t* builder, se_aaudio_error_callback_t callback, void* user_data);
+  int32_t (*openStream)(se_aaudio_builder_t* builder, se_aaudio_stream_t** stream);
+  int32_t (*deleteBuilder)(se_aaudio_builder_t* builder);
+  int32_t (*requestStart)(se_aaudio_stream_t* stream);
+  int32_t (*close)(se_aaudio_stream_t* stream);
+  int32_t (*getFramesPerBurst)(se_aaudio_stream_t* stream);
+  int32_t (*setBufferSizeInFrames)(se_aaudio_stream_t* stream, int32_t num_frames);
+  int32_t (*getSampleRate)(se_aaudio_stream_t* stream);
+  int64_t (*getFramesWritten)(se_aaudio_stream_t* stream);
+  int32_t (*getTimestamp)(se_aaudio_stream_t* stream, clockid_t clock, int64_t* frame_position, int64_t* time_ns);
+  se_aaudio_stream_t* stream;
+  // Set from the error callback when the device goes away (e.g. headphones unplugged)
+  volatile bool disconnected;
+}se_aaudio_t;
+static se_aaudio_t se_aaudio;
+static bool se_aaudio_load(){
+  if(se_aaudio.library)return true;
+  void* lib = dlopen("libaaudio.so",RTLD_NOW);
+  if(!lib)return false;
+  se_aaudio_t* a = &se_aaudio;
+  #define SE_AAUDIO_SYM(FIELD,NAME) if(!(*(void**)&a->FIELD = dlsym(lib,NAME))){dlclose(lib);return false;}
+  SE_AAUDIO_SYM(createStreamBuilder,"AAudio_createStreamBuilder");
+  SE_AAUDIO_SYM(setSampleRate,"AAudioStreamBuilder_setSampleRate");
+  SE_AAUDIO_SYM(setChannelCount,"AAudioStreamBuilder_setChannelCount");
+  SE_AAUDIO_SYM(setFormat,"AAudioStreamBuilder_setFormat");
+  SE_AAUDIO_SYM(setSharingMode,"AAudioStreamBuilder_setSharingMode");
+  SE_AAUDIO_SYM(setPerformanceMode,"AAudioStreamBuilder_setPerformanceMode");
+  SE_AAUDIO_SYM(setDataCallback,"AAudioStreamBuilder_setDataCallback");
+  SE_AAUDIO_SYM(setErrorCallback,"AAudioStreamBuilder_setErrorCallback");
+  SE_AAUDIO_SYM(openStream,"AAudioStreamBuilder_openStream");
+  SE_AAUDIO_SYM(deleteBuilder,"AAudioStreamBuilder_delete");
+  SE_AAUDIO_SYM(requestStart,"AAudioStream_requestStart");
+  SE_AAUDIO_SYM(close,"AAudioStream_close");
+  SE_AAUDIO_SYM(getFramesPerBurst,"AAudioStream_getFramesPerBurst");
+  SE_AAUDIO_SYM(setBufferSizeInFrames,"AAudioStream_setBufferSizeInFrames");
+  SE_AAUDIO_SYM(getSampleRate,"AAudioStream_getSampleRate");
+  SE_AAUDIO_SYM(getFramesWritten,"AAudioStream_getFramesWritten");
+  SE_AAUDIO_SYM(getTimestamp,"AAudioStream_getTimestamp");
+  #undef SE_AAUDIO_SYM
+  a->library = lib;
+  return true;
+}
+// Runs on the AAudio thread
+static int32_t se_aaudio_data_callback(se_aaudio_stream_t* stream, void* user_data, void* audio_data, int32_t num_frames){
+  se_audio_thread_ring_t* ring = &se_audio_thread_ring;
+  float* out = (float*)audio_data;
+  uint32_t read = ring->read;
+  uint32_t write = sb_atomic_load_acquire_u32(&ring->write);
+  for(int32_t i=0;i<num_frames;++i){
+    if(read!=write){
+      uint32_t s = (read%SE_AUDIO_THREAD_RING_FRAMES)*2;
+      out[i*2] = ring->data[s];
+      out[i*2+1] = ring->data[s+1];
+      ++read;
+    }else out[i*2] = out[i*2+1] = 0;
+  }
+  sb_atomic_store_release_u32(&ring->read,read);
+  return SE_AAUDIO_CALLBACK_RESULT_CONTINUE;
+}
+static void se_aaudio_error_callback(se_aaudio_stream_t* stream, void* user_data, int32_t error){
+  se_aaudio.disconnected = true;
+}
+static bool se_aaudio_open(){
+  se_aaudio_t* a = &se_aaudio;
+  if(!se_aaudio_load())return false;
+  se_aaudio_builder_t* builder = NULL;
+  if(a->createStreamBuilder(&builder)!=SE_AAUDIO_OK)return false;
+  a->setSampleRate(builder,SE_AUDIO_SAMPLE_RATE);
+  a->setChannelCount(builder,2);
+  a->setFormat(builder,SE_AAUDIO_FORMAT_PCM_FLOAT);
+  // Exclusive mode is a request, AAudio falls back to a shared stream when the device is in use
+  a->setSharingMode(builder,SE_AAUDIO_SHARING_MODE_EXCLUSIVE);
+  a->setPerformanceMode(builder,SE_AAUDIO_PERFORMANCE_MODE_LOW_LATENCY);
+  a->setDataCallback(builder,se_aaudio_data_callback,NULL);
+  a->setErrorCallback(builder,se_aaudio_error_callback,NULL);
+  a->disconnected = false;
+  int32_t result = a->openStream(builder,&a->stream);
+  a->deleteBuilder(builder);
+  if(result!=SE_AAUDIO_OK){
+    a->stream = NULL;
+    return false;
+  }
+  // Double buffering of the hardware burst is the lowest latency that doesn't glitch
+  int32_t burst = a->getFramesPerBurst(a->stream);
+  if(burst>0)a->setBufferSizeInFrames(a->stream,burst*2);
+  if(a->requestStart(a->stream)!=SE_AAUDIO_OK){
+    a->close(a->stream);
+    a->stream = NULL;
+    return false;
+  }
+  return true;
+}
+static void se_aaudio_close(){
+  if(se_aaudio.stream)se_aaudio.close(se_aaudio.stream);
+  se_aaudio.stream = NULL;
 }
+#endif
 static void se_init_audio(){
+#ifdef SE_AUDIO_THREAD_RING
+ se_audio_thread_ring.read = se_audio_thread_ring.write = 0;
+#endif
+#ifdef SE_WEB_AUDIO_WORKLET
+ se_web_audio_js_init((int)(uintptr_t)&se_audio_thread_ring,SE_AUDIO_THREAD_RING_FRAMES,SE_AUDIO_SAMPLE_RATE);
+#else
+ #ifdef SE_ANDROID_AAUDIO
+ if(!se_aaudio_open())
+ #endif
  saudio_setup(&(saudio_desc){
     .sample_rate=SE_AUDIO_SAMPLE_RATE,
     .num_channels=2,
@@ -6690,8 +13834,94 @@ static void se_init_audio(){
     .buffer_frames=1024*2,
     .packet_frames=1024
   });
+#endif
  se_reset_audio_ring();
 }
+static void se_shutdown_audio(){
+#ifdef SE_WEB_AUDIO_WORKLET
+  se_web_audio_js_shutdown();
+#else
+  #ifdef SE_ANDROID_AAUDIO
+  if(se_aaudio.stream){
+    se_aaudio_close();
+    return;
+  }
+  #endif
+  saudio_shutdown();
+#endif
+}
+// True when audio plays from se_audio_thread_ring instead of sokol_audio
+static bool se_audio_uses_thread_ring(){
+#if defined(SE_WEB_AUDIO_WORKLET)
+  return true;
+#elif defined(SE_ANDROID_AAUDIO)
+  return se_aaudio.stream!=NULL;
+#else
+  return false;
+#endif
+}
+// Number of frames the audio backend wants pushed
+static int se_audio_expect(){
+#ifdef SE_ANDROID_AAUDIO
+  if(se_aaudio.stream&&se_aaudio.disconnected){
+    // The stream can't be closed from its own error callback, so it is reopened here
+    se_shutdown_audio();
+    se_init_audio();
+  }
+#endif
+#ifdef SE_AUDIO_THREAD_RING
+  if(se_audio_uses_thread_ring()){
+    uint32_t queued = se_audio_thread_ring.write-sb_atomic_load_acquire_u32(&se_audio_thread_ring.read);
+    return queued<SE_AUDIO_THREAD_TARGET_FRAMES? SE_AUDIO_THREAD_TARGET_FRAMES-queued: 0;
+  }
+#endif
+#ifndef SE_WEB_AUDIO_WORKLET
+  return saudio_expect();
+#endif
+}
+static void se_audio_push(const float* frames, int num_frames){
+#ifdef SE_AUDIO_THREAD_RING
+  if(se_audio_uses_thread_ring()){
+    uint32_t write = se_audio_thread_ring.write;
+    for(int i=0;i<num_frames;++i){
+      if(write-sb_atomic_load_acquire_u32(&se_audio_thread_ring.read)>=SE_AUDIO_THREAD_RING_FRAMES)break;
+      uint32_t s = (write%SE_AUDIO_THREAD_RING_FRAMES)*2;
+      se_audio_thread_ring.data[s] = frames[i*2];
+      se_audio_thread_ring.data[s+1] = frames[i*2+1];
+      ++write;
+    }
+    sb_atomic_store_release_u32(&se_audio_thread_ring.write,write);
+    return;
+  }
+#endif
+#ifndef SE_WEB_AUDIO_WORKLET
+  saudio_push(frames,num_frames);
+#endif
+}
+// Milliseconds between pushing a frame and hearing it, queued frames included. Negative when the
+// backend can't tell.
+static double se_audio_output_latency_ms(){
+  double latency = -1;
+#ifdef SE_AUDIO_THREAD_RING
+  if(!se_audio_uses_thread_ring())return latency;
+  uint32_t queued = se_audio_thread_ring.write-sb_atomic_load_acquire_u32(&se_audio_thread_ring.read);
+  latency = queued*1000.0/SE_AUDIO_SAMPLE_RATE;
+#endif
+#ifdef SE_ANDROID_AAUDIO
+  // Time until the last frame handed to the device is presented, from its latest timestamp
+  int64_t frame_position = 0, time_ns = 0;
+  if(se_aaudio.getTimestamp(se_aaudio.stream,CLOCK_MONOTONIC,&frame_position,&time_ns)==SE_AAUDIO_OK){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    int64_t now_ns = (int64_t)now.tv_sec*1000000000ll+now.tv_nsec;
+    int32_t sample_rate = se_aaudio.getSampleRate(se_aaudio.stream);
+    int64_t frames_queued = se_aaudio.getFramesWritten(se_aaudio.stream)-frame_position;
+    int64_t presentation_ns = time_ns+frames_queued*1000000000ll/(sample_rate>0?sample_rate:SE_AUDIO_SAMPLE_RATE);
+    if(presentation_ns>now_ns)latency+=(presentation_ns-now_ns)/1e6;
+  }
+#endif
+  return latency;
+}
 
 // For the main menu bar, which cannot be moved, we honor g.Style.DisplaySafeAreaPadding to ensure text can be visible on a TV set.
 bool se_begin_menu_bar(){
@@ -6703,6 +13933,7 @@ bool se_begin_menu_bar(){
   if(gui_state.settings.always_show_menubar)y_off=0;
   y_off = y_off*menu_bar_size.y+style->DisplaySafeAreaPadding.y;
   if(y_off<-menu_bar_size.y)y_off=-menu_bar_size.y;
+  gui_state.menubar_hidden = y_off<=-menu_bar_size.y;
   float y_pos = g->Style.DisplaySafeAreaPadding.y - g->Style.FramePadding.y;
   if(y_pos<0)y_pos=0;
   g->NextWindowData.MenuBarOffsetMinVal = (ImVec2){g->Style.DisplaySafeAreaPadding.x, y_pos};
@@ -6747,21 +13978,663 @@ void se_append_char_to_string(char** str, uint64_t* size, char c){
   (*str)[*size]='\0';
   *size+=1;
 }
-uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_size, const char** mime_type){
+// Returns the watched ranges as one "map:addr:hex bytes" line per range, prefixed by prefix
+static char* se_hcs_watch_values(const char* prefix, uint64_t* result_size){
+  uint64_t size = strlen(prefix)+1;
+  for(int w=0;w<gui_state.num_hcs_watches;++w)size+=32+gui_state.hcs_watches[w].size*2;
+  char* result = (char*)malloc(size);
+  uint64_t off = snprintf(result,size,"%s",prefix);
+  const char *hex="0123456789abcdef";
+  for(int w=0;w<gui_state.num_hcs_watches;++w){
+    se_hcs_watch_t* watch = gui_state.hcs_watches+w;
+    emu_byte_read_t read = se_read_byte_func(watch->map);
+    off+=snprintf(result+off,size-off,"\n%d:%08llx:",watch->map,(unsigned long long)watch->addr);
+    for(uint32_t i=0;i<watch->size;++i){
+      uint8_t byte = read(watch->addr+i);
+      result[off++]=hex[SB_BFE(byte,4,4)];
+      result[off++]=hex[SB_BFE(byte,0,4)];
+    }
+    result[off]='\0';
+  }
+  *result_size = off+1;
+  return result;
+}
+// Shared memory control channel (shm_control.h), opened with --shm <name>. Commands are applied at
+// the start of every update and frames are published from the emulation thread as they finish.
+typedef struct{
+  shm_control_t* shm;
+  char name[256];
+  uint64_t buttons;
+  bool pen_down;
+  float touch_pos[2];
+  shm_control_ram_window_t windows[SHM_CONTROL_MAX_RAM_WINDOWS];
+  uint32_t num_windows, ram_bytes;
+  uint32_t audio_read_ptr; // Audio ring write pointer already copied to the channel
+  uint64_t frames;
+  bool restore_step_frames;
+  int step_frames;
+}se_shm_t;
+static se_shm_t se_shm;
+#endif
+// Muted, unlocked fast forward and test runs have no listener, the cores then skip the samples and
+// only keep the audio state the games can observe. Video recordings and the shm channel need them.
+static bool se_audio_output_unused(){
+  if(se_video.file)return false;
+#ifdef ENABLE_HTTP_CONTROL_SERVER
+  if(se_shm.shm)return false;
+#endif
+  if(gui_state.test_runner_mode||gui_state.settings.volume<=0)return true;
+  return gui_instance.emu_state.run_mode==SB_MODE_RUN&&gui_instance.emu_state.step_frames==0;
+}
+#ifdef ENABLE_HTTP_CONTROL_SERVER
+static bool se_shm_open(const char* name){
+  shm_control_t* shm = shm_control_open(name,true);
+  if(!shm){
+    printf("Failed to create the shared memory control channel %s\n",name);
+    return false;
+  }
+  memset(&se_shm,0,sizeof(se_shm));
+  strncpy(se_shm.name,name,sizeof(se_shm.name)-1);
+  shm->sample_rate = SE_AUDIO_SAMPLE_RATE;
+  se_shm.audio_read_ptr = gui_instance.emu_state.audio_ring_buff.write_ptr;
+  se_shm.shm = shm;
+  printf("Shared memory control channel open at %s\n",name);
+  return true;
+}
+static void se_shm_close(){
+  shm_control_close(se_shm.shm,se_shm.name,true);
+  se_shm.shm = NULL;
+}
+static void se_shm_process_cmds(){
+  shm_control_t* shm = se_shm.shm;
+  if(!shm)return;
+  sb_emu_state_t* emu = &gui_instance.emu_state;
+  // A step ran in the previous update
+  if(se_shm.restore_step_frames&&emu->run_mode!=SB_MODE_STEP){
+    emu->step_frames = se_shm.step_frames;
+    se_shm.restore_step_frames = false;
+  }
+  uint32_t write = shm_control_load_acquire(&shm->cmd_write);
+  uint32_t read = shm->cmd_read;
+  while(read!=write&&!se_shm.restore_step_frames){
+    shm_control_cmd_t cmd = shm->cmds[read%SHM_CONTROL_CMD_QUEUE_SIZE];
+    ++read;
+    switch(cmd.type){
+      case SHM_CONTROL_CMD_INPUT: se_shm.buttons = cmd.value; break;
+      case SHM_CONTROL_CMD_TOUCH:{
+        uint32_t x = cmd.value, y = cmd.value>>32;
+        memcpy(se_shm.touch_pos,&x,sizeof(float));
+        memcpy(se_shm.touch_pos+1,&y,sizeof(float));
+        se_shm.pen_down = cmd.address!=0;
+      }break;
+      case SHM_CONTROL_CMD_RUN:
+        emu->step_frames = 1;
+        emu->run_mode = SB_MODE_RUN;
+        break;
+      case SHM_CONTROL_CMD_PAUSE: emu->run_mode = SB_MODE_PAUSE; break;
+      case SHM_CONTROL_CMD_STEP:
+        // Later commands wait for the step so a client can interleave inputs and steps
+        se_shm.step_frames = emu->step_frames;
+        se_shm.restore_step_frames = true;
+        emu->step_frames = cmd.value? cmd.value: 1;
+        emu->run_mode = SB_MODE_STEP;
+        break;
+      case SHM_CONTROL_CMD_WRITE_BYTE: se_write_byte_func(cmd.map)(cmd.address,cmd.value); break;
+      case SHM_CONTROL_CMD_ADD_RAM_WINDOW:
+        if(se_shm.num_windows<SHM_CONTROL_MAX_RAM_WINDOWS&&cmd.value&&cmd.value<=SHM_CONTROL_MAX_RAM_BYTES-se_shm.ram_bytes){
+          shm_control_ram_window_t* w = se_shm.windows+se_shm.num_windows++;
+          *w = (shm_control_ram_window_t){.map=cmd.map,.size=cmd.value,.address=cmd.address,.offset=se_shm.ram_bytes};
+          se_shm.ram_bytes+=cmd.value;
+        }
+        break;
+      case SHM_CONTROL_CMD_CLEAR_RAM_WINDOWS: se_shm.num_windows = se_shm.ram_bytes = 0; break;
+      case SHM_CONTROL_CMD_CAPTURE_SLOT: se_capture_state_slot(cmd.value); break;
+      case SHM_CONTROL_CMD_LOAD_SLOT: se_restore_state_slot(cmd.value); break;
+    }
+  }
+  shm_control_store_release(&shm->cmd_read,read);
+  for(int i=0;i<SE_NUM_KEYBINDS&&i<64;++i)emu->joy.inputs[i]+=SB_BFE(se_shm.buttons,i,1);
+  if(se_shm.pen_down){
+    emu->joy.inputs[SE_KEY_PEN_DOWN]=true;
+    emu->joy.touch_pos[0]=se_shm.touch_pos[0];
+    emu->joy.touch_pos[1]=se_shm.touch_pos[1];
+  }
+}
+static void se_shm_publish_frame(){
+  shm_control_t* shm = se_shm.shm;
+  if(!shm)return;
+  uint32_t seq = shm->seq+1;
+  shm->writing = seq;
+  shm_control_fence();
+  shm_control_slot_t* slot = shm->slots+(seq&1);
+  int w, h;
+  se_instance_screenshot(&gui_instance,slot->pixels,&w,&h);
+  slot->frame = ++se_shm.frames;
+  slot->width = w;
+  slot->height = h;
+  slot->ram_bytes = se_shm.ram_bytes;
+  slot->num_ram_windows = se_shm.num_windows;
+  for(uint32_t i=0;i<se_shm.num_windows;++i){
+    shm_control_ram_window_t* win = se_shm.windows+i;
+    slot->ram_windows[i] = *win;
+    emu_byte_read_t read = se_read_byte_func(win->map);
+    for(uint32_t b=0;b<win->size;++b)slot->ram[win->offset+b]=read(win->address+b);
+  }
+  shm_control_store_release(&shm->seq,seq);
+
+  // The audio ring is consumed by the audio device, the channel gets its own copy of every sample
+  sb_ring_buffer_t* ring = &gui_instance.emu_state.audio_ring_buff;
+  uint32_t write_ptr = sb_atomic_load_acquire_u32(&ring->write_ptr);
+  uint32_t samples = write_ptr-se_shm.audio_read_ptr;
+  uint32_t lost = samples>SB_AUDIO_RING_BUFFER_SIZE? samples-SB_AUDIO_RING_BUFFER_SIZE: 0;
+  uint32_t audio_write = shm->audio_write+lost/2;
+  for(uint32_t i=lost;i+1<samples;i+=2){
+    uint32_t dst = (audio_write%SHM_CONTROL_AUDIO_FRAMES)*2;
+    shm->audio[dst] = ring->data[(se_shm.audio_read_ptr+i)%SB_AUDIO_RING_BUFFER_SIZE];
+    shm->audio[dst+1] = ring->data[(se_shm.audio_read_ptr+i+1)%SB_AUDIO_RING_BUFFER_SIZE];
+    ++audio_write;
+  }
+  se_shm.audio_read_ptr = write_ptr;
+  shm_control_store_release(&shm->audio_write,audio_write);
+}
+// /screen captures the pixels while the callback lock is held and encodes them in se_hcs_finish
+// on the HTTP thread. Pixel buffers come from a small pool, and the last encoding is reused while
+// the screen doesn't change.
+#define SE_SCREEN_JOB_POOL_SIZE 4
+typedef struct{
+  uint8_t* pixels;
+  uint32_t width, height;
+  int format; // 0: PNG, 1: BMP, 2: JPG, 3: RAW
+  int compression_level;
+  int pool_index; // -1 if pixels are owned by the job
+}se_screen_job_t;
+typedef struct{
+  mutex_t mutex;
+  se_screen_job_t jobs[SE_SCREEN_JOB_POOL_SIZE];
+  uint8_t* buffers[SE_SCREEN_JOB_POOL_SIZE];
+  bool busy[SE_SCREEN_JOB_POOL_SIZE];
+  // Last encoded response
+  uint8_t* cache;
+  uint64_t cache_size;
+  uint64_t cache_key;
+  const char* cache_mime;
+}se_screen_service_t;
+se_screen_service_t se_screen_service;
+// The mutex is created by the locked callback or se_hcs_publish_snapshot before any other thread gets here
+static se_screen_job_t* se_screen_job_begin(int format){
+  se_screen_service_t* service = &se_screen_service;
+  if(!service->mutex)service->mutex = mutex_create();
+  se_screen_job_t* job = NULL;
+  mutex_lock(service->mutex);
+  for(int i=0;i<SE_SCREEN_JOB_POOL_SIZE;++i){
+    if(service->busy[i])continue;
+    if(!service->buffers[i])service->buffers[i] = (uint8_t*)malloc(SE_MAX_SCREENSHOT_SIZE);
+    if(!service->buffers[i])break;
+    service->busy[i] = true;
+    job = service->jobs+i;
+    job->pixels = service->buffers[i];
+    job->pool_index = i;
+    break;
+  }
+  mutex_unlock(service->mutex);
+  if(!job){
+    job = (se_screen_job_t*)malloc(sizeof(se_screen_job_t));
+    if(!job)return NULL;
+    job->pixels = (uint8_t*)malloc(SE_MAX_SCREENSHOT_SIZE);
+    job->pool_index = -1;
+    if(!job->pixels){
+      free(job);
+      return NULL;
+    }
+  }
+  job->format = format;
+  job->compression_level = MZ_BEST_SPEED;
+  job->width = job->height = 0;
+  return job;
+}
+static void se_screen_job_end(se_screen_job_t* job){
+  se_screen_service_t* service = &se_screen_service;
+  if(job->pool_index<0){
+    free(job->pixels);
+    free(job);
+    return;
+  }
+  // Embedded save state images are allocated separately
+  if(job->pixels!=service->buffers[job->pool_index])free(job->pixels);
+  mutex_lock(service->mutex);
+  service->busy[job->pool_index] = false;
+  mutex_unlock(service->mutex);
+}
+static uint8_t* se_screen_job_encode(se_screen_job_t* job, uint64_t* result_size, const char** mime_type){
+  uint32_t width = job->width, height = job->height;
+  uint8_t* data = NULL;
+  size_t size = 0;
+  if(job->format==0){
+    // miniz writes unfiltered rows, which is much faster than stb and a close size for screens
+    data = (uint8_t*)tdefl_write_image_to_png_file_in_memory_ex(job->pixels,width,height,4,&size,job->compression_level,MZ_FALSE);
+    *mime_type="image/png";
+  }else if(job->format==1){
+    se_png_write_context_t cont ={0};
+    stbi_write_bmp_to_func(se_png_write_mem, &cont,width,height,4, job->pixels);
+    data = cont.data;
+    size = cont.size;
+    *mime_type="image/bmp";
+  }else if(job->format==2){
+    se_png_write_context_t cont ={0};
+    stbi_write_jpg_to_func(se_png_write_mem, &cont,width,height,4, job->pixels,95);
+    data = cont.data;
+    size = cont.size;
+    *mime_type="image/jpg";
+  }else if(job->format==3){
+    // Unencoded RGBA8 pixels after the width and height as little endian uint32s
+    size = 8+(uint64_t)width*height*4;
+    data = (uint8_t*)malloc(size);
+    if(data){
+      for(int i=0;i<4;++i){
+        data[i]=SB_BFE(width,i*8,8);
+        data[4+i]=SB_BFE(height,i*8,8);
+      }
+      memcpy(data+8,job->pixels,size-8);
+    }
+    *mime_type="application/octet-stream";
+  }
+  *result_size = size;
+  return data;
+}
+// Finishes a response deferred by se_hcs_callback. Runs on HTTP threads, possibly several at once
+static uint8_t* se_hcs_finish(uint8_t* deferred, uint64_t* result_size, const char** mime_type){
+  se_screen_service_t* service = &se_screen_service;
+  se_screen_job_t* job = (se_screen_job_t*)deferred;
+  uint8_t* data = NULL;
+  *result_size = 0;
+  if(!job->pixels||!job->width||!job->height){
+    se_screen_job_end(job);
+    return NULL;
+  }
+  // Streams and pollers often ask for the same screen many times, so the encoding is reused
+  uint64_t key = XXH3_64bits_withSeed(job->pixels,(uint64_t)job->width*job->height*4,((uint64_t)job->width<<32)^((uint64_t)job->height<<8)^job->format);
+  mutex_lock(service->mutex);
+  if(service->cache&&service->cache_key==key){
+    data = (uint8_t*)malloc(service->cache_size);
+    if(data){
+      memcpy(data,service->cache,service->cache_size);
+      *result_size = service->cache_size;
+      *mime_type = service->cache_mime;
+    }
+  }
+  mutex_unlock(service->mutex);
+  if(!data){
+    data = se_screen_job_encode(job,result_size,mime_type);
+    mutex_lock(service->mutex);
+    uint8_t* cache = data? (uint8_t*)realloc(service->cache,*result_size): NULL;
+    if(cache){
+      memcpy(cache,data,*result_size);
+      service->cache = cache;
+      service->cache_size = *result_size;
+      service->cache_key = key;
+      service->cache_mime = *mime_type;
+    }
+    mutex_unlock(service->mutex);
+  }
+  se_screen_job_end(job);
+  return data;
+}
+static int se_metrics_write_counter(char* buffer, size_t size, const char* name, const char* type, const char* help, double value){
+  return snprintf(buffer,size,"# HELP %s %s\n# TYPE %s %s\n%s %.17g\n",name,help,name,type,name,value);
+}
+static int se_metrics_write_histogram(char* buffer, size_t size, const char* name, const char* help, se_metrics_histogram_t* h, const double* bounds){
+  int off = snprintf(buffer,size,"# HELP %s %s\n# TYPE %s histogram\n",name,help,name);
+  uint64_t count = 0;
+  for(int i=0;i<=SE_METRICS_BUCKETS;++i){
+    count+=sb_atomic_load_relaxed_u64(&h->buckets[i]);
+    if(i<SE_METRICS_BUCKETS)off+=snprintf(buffer+off,size-off,"%s_bucket{le=\"%g\"} %llu\n",name,bounds[i],(unsigned long long)count);
+    else off+=snprintf(buffer+off,size-off,"%s_bucket{le=\"+Inf\"} %llu\n",name,(unsigned long long)count);
+  }
+  off+=snprintf(buffer+off,size-off,"%s_sum %.9f\n",name,sb_atomic_load_relaxed_u64(&h->sum_ns)*1e-9);
+  // The count has to match the +Inf bucket
+  off+=snprintf(buffer+off,size-off,"%s_count %llu\n",name,(unsigned long long)count);
+  return off;
+}
+// JSON served by /status, the buffer is malloc'd
+static char* se_hcs_status_json(uint64_t* result_size){
+  char buffer[4096]={0};
+  int off = 0;
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"{\n");
+
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"emulator\": \"SkyEmu (%s)\",\n",GIT_COMMIT_HASH);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"run-mode\": ");
+  switch(gui_instance.emu_state.run_mode){
+    case SB_MODE_PAUSE: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"PAUSE\",\n");break;
+    case SB_MODE_RUN: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"RUN\",\n");break;
+    case SB_MODE_STEP: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"STEP\",\n");break;
+    case SB_MODE_RESET: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"RESET\",\n");break;
+    case SB_MODE_REWIND: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"REWIND\",\n");break;
+  }
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"rom-loaded\" : %s,\n",gui_instance.emu_state.rom_loaded?"true":"false");
+  if(gui_instance.emu_state.rom_loaded){
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"rom-path\": \"%s\",\n",gui_instance.emu_state.rom_path);
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"save-path\": \"%s\",\n",gui_instance.emu_state.save_file_path);
+  }
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"rewind-info\" : {\n");
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"entries-used\" : %d,\n",gui_instance.rewind_buffer.size);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"capacity\" : %d,\n",gui_instance.rewind_buffer.max_txs);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"current-frame\" : %llu,\n",(unsigned long long)gui_instance.rewind_buffer.curr_frame);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"first-frame\" : %llu,\n",(unsigned long long)gui_instance.rewind_buffer.base_frame);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"bytes-used\" : %llu,\n",(unsigned long long)gui_instance.rewind_buffer.bytes_used);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"bytes-budget\" : %llu,\n",(unsigned long long)gui_instance.rewind_buffer.budget_bytes);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"percent_full\" : %0.1f\n",gui_instance.rewind_buffer.max_txs?(float)(gui_instance.rewind_buffer.size)/gui_instance.rewind_buffer.max_txs*100.:0.);
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"  },\n");
+  {
+    const sb_profile_t* p = &gui_state.last_profile;
+    double per_frame = p->frames? 1.0/p->frames: 0;
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"profile\" : {\n");
+#ifdef SE_ENABLE_PROFILER
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"enabled\" : true,\n");
+#else
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"enabled\" : false,\n");
+#endif
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"core_ns_per_frame\" : %.0f,\n",p->core_ns*per_frame);
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"cpu_ns_per_frame\" : %.0f,\n",se_profile_cpu_ns_per_frame(p));
+    for(int i=0;i<SB_PROFILE_COUNT;++i)off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"%s_ns_per_frame\" : %.0f,\n",se_profile_names[i],p->ns[i]*per_frame);
+    for(int i=0;i<SB_COUNTER_COUNT;++i){
+      off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"%s_per_frame\" : %.0f%s\n",se_counter_names[i],p->counters[i]*per_frame,i+1==SB_COUNTER_COUNT?"":",");
+    }
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"  },\n");
+  }
+
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"inputs\": {\n");
+  for(int i=0; i<SE_NUM_KEYBINDS;++i){
+    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"%s\": %f",se_keybind_names[i],gui_state.hcs_joypad.inputs[i]);
+    if(i+1==SE_NUM_KEYBINDS)off+=snprintf(buffer+off,sizeof(buffer)-off,"\n");
+    else off+=snprintf(buffer+off,sizeof(buffer)-off,",\n");
+  }
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"  }\n");
+
+  off+=snprintf(buffer+off,sizeof(buffer)-off,"}");
+
+  char* result = strdup(buffer);
+  *result_size = strlen(result);
+  return result;
+}
+// Read only commands (/status, /screen, /read_byte and /read_range of watched ranges) are served
+// from a snapshot published while the callback lock is held: at the end of every update and after
+// every locked command. They then run on the HTTP threads without waiting for the emulator.
+#define SE_HCS_SNAPSHOT_MAX_RANGE_BYTES (1024*1024)
+typedef struct{
+  int refs; // Guarded by se_hcs_snapshots.mutex, the current snapshot holds one
+  char* status;
+  uint64_t status_size;
+  uint8_t* pixels; // NULL without a ROM
+  uint32_t width, height;
+  se_hcs_watch_t ranges[SE_HCS_MAX_WATCHES];
+  uint8_t* range_data[SE_HCS_MAX_WATCHES];
+  int num_ranges;
+}se_hcs_snapshot_t;
+typedef struct{
+  mutex_t mutex;
+  se_hcs_snapshot_t* current;
+  double publish_time;
+}se_hcs_snapshots_t;
+se_hcs_snapshots_t se_hcs_snapshots;
+static void se_hcs_release_snapshot(se_hcs_snapshot_t* snap){
+  if(!snap)return;
+  mutex_lock(se_hcs_snapshots.mutex);
+  bool last = --snap->refs==0;
+  mutex_unlock(se_hcs_snapshots.mutex);
+  if(!last)return;
+  free(snap->status);
+  free(snap->pixels);
+  for(int i=0;i<snap->num_ranges;++i)free(snap->range_data[i]);
+  free(snap);
+}
+static se_hcs_snapshot_t* se_hcs_acquire_snapshot(){
+  if(!se_hcs_snapshots.mutex)return NULL;
+  mutex_lock(se_hcs_snapshots.mutex);
+  se_hcs_snapshot_t* snap = se_hcs_snapshots.current;
+  if(snap)snap->refs++;
+  mutex_unlock(se_hcs_snapshots.mutex);
+  return snap;
+}
+// Must hold the callback lock. Updates that may not have changed anything (ie. while paused) only
+// publish every SE_HCS_SNAPSHOT_INTERVAL seconds.
+#define SE_HCS_SNAPSHOT_INTERVAL (1./60.)
+static void se_hcs_publish_snapshot(bool force){
+  if(!gui_state.settings.http_control_server_enable)return;
+  double now = se_time();
+  if(!force&&now-se_hcs_snapshots.publish_time<SE_HCS_SNAPSHOT_INTERVAL)return;
+  se_hcs_snapshots.publish_time = now;
+  if(!se_hcs_snapshots.mutex){
+    se_hcs_snapshots.mutex = mutex_create();
+    se_screen_service.mutex = mutex_create();
+  }
+  se_hcs_snapshot_t* snap = (se_hcs_snapshot_t*)calloc(1,sizeof(se_hcs_snapshot_t));
+  if(!snap)return;
+  snap->refs = 1;
+  snap->status = se_hcs_status_json(&snap->status_size);
+  if(gui_instance.emu_state.rom_loaded){
+    snap->pixels = (uint8_t*)malloc(SE_MAX_SCREENSHOT_SIZE);
+    int w=0, h=0;
+    if(snap->pixels)se_instance_screenshot(&gui_instance,snap->pixels,&w,&h);
+    snap->width = w;
+    snap->height = h;
+    uint64_t range_bytes = 0;
+    for(int i=0;i<gui_state.num_hcs_watches;++i){
+      se_hcs_watch_t* watch = gui_state.hcs_watches+i;
+      if(range_bytes+watch->size>SE_HCS_SNAPSHOT_MAX_RANGE_BYTES)continue;
+      uint8_t* data = (uint8_t*)malloc(watch->size);
+      if(!data)continue;
+      emu_byte_read_t read = se_read_byte_func(watch->map);
+      for(uint32_t b=0;b<watch->size;++b)data[b]=read(watch->addr+b);
+      snap->ranges[snap->num_ranges] = *watch;
+      snap->range_data[snap->num_ranges++] = data;
+      range_bytes+=watch->size;
+    }
+  }
+  mutex_lock(se_hcs_snapshots.mutex);
+  se_hcs_snapshot_t* old = se_hcs_snapshots.current;
+  se_hcs_snapshots.current = snap;
+  mutex_unlock(se_hcs_snapshots.mutex);
+  se_hcs_release_snapshot(old);
+}
+// Returns the snapshotted bytes [addr,addr+len) of map or NULL if no watched range covers them
+static const uint8_t* se_hcs_snapshot_bytes(se_hcs_snapshot_t* snap, int map, uint64_t addr, uint64_t len){
+  for(int i=0;i<snap->num_ranges;++i){
+    se_hcs_watch_t* r = snap->ranges+i;
+    if(r->map==map&&addr>=r->addr&&addr-r->addr+len<=r->size)return snap->range_data[i]+(addr-r->addr);
+  }
+  return NULL;
+}
+// Returns NULL to leave the command to the locked callback
+static uint8_t* se_hcs_snapshot_callback(se_hcs_snapshot_t* snap, const char* cmd, const char** params, uint64_t* result_size, const char** mime_type){
+  if(strcmp(cmd,"/status")==0){
+    char* result = snap->status? strdup(snap->status): NULL;
+    *result_size = result? snap->status_size: 0;
+    *mime_type = "application/json";
+    return (uint8_t*)result;
+  }else if(strcmp(cmd,"/screen")==0){
+    if(!snap->pixels||!snap->width)return NULL;
+    int format = 0;
+    for(const char** p=params;*p;p+=2){
+      if(strcmp(p[0],"embed_state")==0&&atoi(p[1])!=0)return NULL;
+      if(strcmp(p[0],"format")==0){
+        if(strcmp(p[1],"BMP")==0||strcmp(p[1],"bmp")==0)format = 1;
+        if(strcmp(p[1],"JPG")==0||strcmp(p[1],"jpg")==0)format = 2;
+        if(strcmp(p[1],"RAW")==0||strcmp(p[1],"raw")==0)format = 3;
+      }
+    }
+    se_screen_job_t* job = se_screen_job_begin(format);
+    if(!job)return NULL;
+    memcpy(job->pixels,snap->pixels,(size_t)snap->width*snap->height*4);
+    job->width = snap->width;
+    job->height = snap->height;
+    return se_hcs_finish((uint8_t*)job,result_size,mime_type);
+  }else if(strcmp(cmd,"/read_byte")==0||strcmp(cmd,"/read_range")==0){
+    bool hex = cmd[6]=='b';
+    uint64_t size = 0, addr = 0;
+    int map = 0;
+    for(const char** p=params;*p;p+=2){
+      if(strcmp(p[0],"addr")==0){
+        addr = se_hex_string_to_int(p[1]);
+        if(hex)size+=2;
+      }else if(!hex&&strcmp(p[0],"len")==0)size+=strtoull(p[1],NULL,0);
+    }
+    if(!size||size>SE_HCS_SNAPSHOT_MAX_RANGE_BYTES*2)return NULL;
+    uint8_t* result = (uint8_t*)malloc(size+1);
+    if(!result)return NULL;
+    uint64_t off = 0;
+    for(const char** p=params;*p;p+=2){
+      const uint8_t* data = NULL;
+      if(strcmp(p[0],"map")==0)map = atoi(p[1]);
+      else if(strcmp(p[0],"addr")==0){
+        addr = se_hex_string_to_int(p[1]);
+        if(!hex)continue;
+        if(!(data = se_hcs_snapshot_bytes(snap,map,addr,1)))break;
+        const char *digits="0123456789abcdef";
+        result[off++]=digits[SB_BFE(*data,4,4)];
+        result[off++]=digits[SB_BFE(*data,0,4)];
+      }else if(!hex&&strcmp(p[0],"len")==0){
+        uint64_t len = strtoull(p[1],NULL,0);
+        if(!(data = se_hcs_snapshot_bytes(snap,map,addr,len)))break;
+        memcpy(result+off,data,len);
+        off+=len;
+        addr+=len;
+      }
+    }
+    if(off!=size){
+      free(result);
+      return NULL;
+    }
+    // /read_byte counts the terminator like the locked version
+    result[off] = '\0';
+    *result_size = hex? size+1: size;
+    *mime_type = hex? "text/html": "application/octet-stream";
+    return result;
+  }
+  return NULL;
+}
+// Serves /metrics in the Prometheus text format straight from se_metrics and the read only
+// commands from the latest snapshot, so they don't wait for the emulator to release the HCS callback lock
+static uint8_t* se_hcs_unlocked_callback(const char* cmd, const char** params, uint64_t* result_size, const char** mime_type){
+  if(strcmp(cmd,"/metrics")!=0){
+    se_hcs_snapshot_t* snap = se_hcs_acquire_snapshot();
+    uint8_t* result = snap? se_hcs_snapshot_callback(snap,cmd,params,result_size,mime_type): NULL;
+    se_hcs_release_snapshot(snap);
+    return result;
+  }
+  size_t size = 16*1024;
+  char* buffer = (char*)malloc(size);
+  if(!buffer)return NULL;
+  se_metrics_t* m = &se_metrics;
+  int off = 0;
+#define SE_METRIC(name,type,help,value) off+=se_metrics_write_counter(buffer+off,size-off,name,type,help,value)
+  SE_METRIC("skyemu_rom_loaded","gauge","Whether a ROM is loaded",sb_atomic_load_relaxed_u64(&m->rom_loaded));
+  SE_METRIC("skyemu_emulated_frames_total","counter","Frames emulated",sb_atomic_load_relaxed_u64(&m->emulated_frames));
+  SE_METRIC("skyemu_emulation_fps","gauge","Frames emulated per second over the last second",sb_atomic_load_relaxed_u64(&m->emulation_fps_milli)*1e-3);
+  off+=se_metrics_write_histogram(buffer+off,size-off,"skyemu_emulated_frame_seconds","Time spent emulating each frame",&m->emulated_frame_time,se_metrics_frame_buckets);
+  off+=se_metrics_write_histogram(buffer+off,size-off,"skyemu_display_frame_seconds","Time between presented UI frames",&m->display_frame_time,se_metrics_frame_buckets);
+  SE_METRIC("skyemu_audio_underruns_total","counter","Times the audio ring ran dry",sb_atomic_load_relaxed_u64(&m->audio_underruns));
+  SE_METRIC("skyemu_audio_watchdog_resets_total","counter","Times the audio device was restarted",sb_atomic_load_relaxed_u64(&m->audio_watchdog_resets));
+  SE_METRIC("skyemu_rewind_bytes_used","gauge","Bytes used by the rewind buffer",sb_atomic_load_relaxed_u64(&m->rewind_bytes_used));
+  SE_METRIC("skyemu_rewind_bytes_budget","gauge","Byte budget of the rewind buffer",sb_atomic_load_relaxed_u64(&m->rewind_bytes_budget));
+  SE_METRIC("skyemu_rewind_entries","gauge","Rewind states in the buffer",sb_atomic_load_relaxed_u64(&m->rewind_entries));
+  off+=se_metrics_write_histogram(buffer+off,size-off,"skyemu_save_write_seconds","Latency of writing out save files",&m->save_write_time,se_metrics_save_buckets);
+  SE_METRIC("skyemu_save_write_failures_total","counter","Save file writes that failed",sb_atomic_load_relaxed_u64(&m->save_write_failures));
+  SE_METRIC("skyemu_core_seconds_total","counter","Time spent in the emulator core",sb_atomic_load_relaxed_u64(&m->core_ns)*1e-9);
+#undef SE_METRIC
+#ifdef SE_ENABLE_PROFILER
+  off+=snprintf(buffer+off,size-off,"# HELP skyemu_subsystem_seconds_total Time spent in each core subsystem\n# TYPE skyemu_subsystem_seconds_total counter\n");
+  for(int i=0;i<SB_PROFILE_COUNT;++i){
+    off+=snprintf(buffer+off,size-off,"skyemu_subsystem_seconds_total{subsystem=\"%s\"} %.9f\n",se_profile_names[i],sb_atomic_load_relaxed_u64(&m->subsystem_ns[i])*1e-9);
+  }
+#endif
+  *result_size = off;
+  *mime_type = "text/plain; version=0.0.4";
+  return (uint8_t*)buffer;
+}
+static uint8_t* se_hcs_handle_cmd(const char* cmd, const char** params, uint64_t* result_size, const char** mime_type){
   *result_size = 0;
   *mime_type = "text/html";
   printf("Got HCS Cmd: %s\n",cmd);
   const char* str_result = NULL;
   if(strcmp(cmd,"/ping")==0)str_result="pong";
+  else if(strcmp(cmd,"/trace")==0){
+    // Without start or path the events recorded so far are returned as Chrome trace JSON
+    bool okay = true, export_json = true;
+    while(*params){
+      if(strcmp(params[0],"start")==0&&atoi(params[1])){trace_start();export_json=false;}
+      else if(strcmp(params[0],"stop")==0&&atoi(params[1]))trace_stop();
+      else if(strcmp(params[0],"path")==0){okay&=trace_save_json(params[1]);export_json=false;}
+      params+=2;
+    }
+    if(export_json){
+      size_t size = 0;
+      char* json = trace_export_json(&size);
+      if(json){
+        *result_size = size;
+        *mime_type = "application/json";
+        return (uint8_t*)json;
+      }
+      okay = false;
+    }
+    str_result=okay?"ok":"failed";
+  }
   else if(strcmp(cmd,"/load_rom")==0){
     while(*params){
       if(strcmp(params[0],"path")==0)se_load_rom(params[1]);
       if(strcmp(params[0],"pause")==0){
-        if(atoi(params[1]))emu_state.run_mode=SB_MODE_PAUSE;
+        if(atoi(params[1]))gui_instance.emu_state.run_mode=SB_MODE_PAUSE;
       };
       params+=2;
     }
-    str_result=emu_state.rom_loaded?"ok":"Failed to load ROM";
+    str_result=gui_instance.emu_state.rom_loaded?"ok":"Failed to load ROM";
+  }else if(strcmp(cmd,"/movie")==0){
+    bool okay = true;
+    while(*params){
+      if(strcmp(params[0],"record")==0)okay&=se_movie_record(params[1]);
+      else if(strcmp(params[0],"play")==0)okay&=se_movie_play(params[1]);
+      else if(strcmp(params[0],"stop")==0&&atoi(params[1]))se_movie_stop();
+      params+=2;
+    }
+    str_result=okay?"ok":"failed";
+  }else if(strcmp(cmd,"/record_video")==0){
+    bool okay = true;
+    while(*params){
+      if(strcmp(params[0],"path")==0)okay&=se_video_record(params[1]);
+      else if(strcmp(params[0],"stop")==0&&atoi(params[1]))se_video_stop();
+      params+=2;
+    }
+    str_result=okay?"ok":"failed";
+  }else if(strcmp(cmd,"/link")==0){
+    bool okay = true;
+    int delay = 1;
+    while(*params){
+      if(strcmp(params[0],"path")==0)okay&=se_link_connect(params[1]);
+      else if(strcmp(params[0],"disconnect")==0&&atoi(params[1]))se_link_disconnect();
+      else if(strcmp(params[0],"delay")==0)delay=atoi(params[1]);
+      else if(strcmp(params[0],"host")==0)okay&=se_netplay_start(atoi(params[1]),NULL,0,delay);
+      else if(strcmp(params[0],"join")==0)okay&=se_netplay_join(params[1],delay);
+      params+=2;
+    }
+    str_result=okay?"ok":"failed";
+  }else if(strcmp(cmd,"/spectate")==0){
+    bool okay = true;
+    while(*params){
+      if(strcmp(params[0],"host")==0)okay&=se_spectate_start(atoi(params[1]),NULL,0);
+      else if(strcmp(params[0],"join")==0)okay&=se_spectate_join(params[1]);
+      else if(strcmp(params[0],"stop")==0&&atoi(params[1]))se_spectate_stop();
+      params+=2;
+    }
+    str_result=okay?"ok":"failed";
+#ifdef ENABLE_LUA_SCRIPTING
+  }else if(strcmp(cmd,"/lua")==0){
+    bool okay = true;
+    while(*params){
+      if(strcmp(params[0],"path")==0)okay&=se_lua_load_script(params[1]);
+      else if(strcmp(params[0],"stop")==0&&atoi(params[1]))se_lua_unload_script();
+      params+=2;
+    }
+    str_result=okay?"ok":"Failed to load script";
+#endif
   }else if(strcmp(cmd,"/setting")==0){
     while(*params){
       if(strcmp(params[0],"ui_type")==0){
@@ -6774,6 +14647,7 @@ uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_
       else if(strcmp(params[0],"touch_controls_scale")==0)gui_state.settings.touch_controls_scale=atof(params[1]);
       else if(strcmp(params[0],"language")==0)gui_state.settings.language=se_convert_locale_to_enum(params[1]);
       else if(strcmp(params[0],"shader")==0)gui_state.settings.screen_shader=atof(params[1]);
+      else if(strcmp(params[0],"shader_chain")==0)gui_state.settings.shader_chain=atoi(params[1]);
       else if(strcmp(params[0],"load_slot")==0)se_restore_state_slot(atoi(params[1]));
       else if(strcmp(params[0],"capture_slot")==0)se_capture_state_slot(atoi(params[1]));
       else if(strcmp(params[0],"edit_cheat_index")==0)gui_state.editing_cheat_index = atoi(params[1]);
@@ -6790,25 +14664,33 @@ uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_
       }
       params+=2;
     }
-    str_result=emu_state.rom_loaded?"ok":"Failed to load ROM";
+    str_result=gui_instance.emu_state.rom_loaded?"ok":"Failed to load ROM";
   }else if(strcmp(cmd,"/step")==0){
     int step_frames = 1; 
-    int old_step = emu_state.step_frames;
+    int old_step = gui_instance.emu_state.step_frames;
     while(*params){
       if(strcmp(params[0],"frames")==0)step_frames=atoi(params[1]);
       params+=2;
     }
-    emu_state.step_frames=step_frames;
-    emu_state.run_mode = SB_MODE_STEP;
+    gui_instance.emu_state.step_frames=step_frames;
+    gui_instance.emu_state.run_mode = SB_MODE_STEP;
     se_update_frame(); 
-    emu_state.step_frames=old_step;
+    gui_instance.emu_state.step_frames=old_step;
+    if(gui_state.num_hcs_watches)return (uint8_t*)se_hcs_watch_values("ok",result_size);
     str_result="ok";
+  }else if(strcmp(cmd,"/rewind")==0){
+    bool okay=false;
+    while(*params){
+      if(strcmp(params[0],"frame")==0)okay=se_seek_rewind_state(&gui_instance.core,&gui_instance.rewind_buffer,strtoull(params[1],NULL,10));
+      params+=2;
+    }
+    str_result=okay? "ok":"failed";
   }else if(strcmp(cmd,"/run")==0){
-    emu_state.step_frames=1;
-    emu_state.run_mode = SB_MODE_RUN;
+    gui_instance.emu_state.step_frames=1;
+    gui_instance.emu_state.run_mode = SB_MODE_RUN;
     str_result="ok";
   }else if(strcmp(cmd,"/screen")==0){
-    if(emu_state.rom_loaded){
+    if(gui_instance.emu_state.rom_loaded){
       bool embed_state = false;
       int format = 0; 
       while(*params){
@@ -6816,45 +14698,32 @@ uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_
         if(strcmp(params[0],"format")==0){
           if(strcmp(params[1],"BMP")==0||strcmp(params[1],"bmp")==0)format = 1; 
           if(strcmp(params[1],"JPG")==0||strcmp(params[1],"jpg")==0)format = 2; 
+          if(strcmp(params[1],"RAW")==0||strcmp(params[1],"raw")==0)format = 3; 
         }
         params+=2;
       }
-      uint8_t* imdata = NULL;
-      uint32_t width=0, height=0; 
+      se_screen_job_t* job = se_screen_job_begin(format);
+      if(!job)return NULL;
       if(embed_state){
-        se_save_state_t* save_state = (se_save_state_t*)malloc(sizeof(se_save_state_t));
-        se_capture_state(&core,save_state);
-        imdata = se_save_state_to_image(save_state, &width,&height);
+        se_save_state_t* save_state = (se_save_state_t*)calloc(1,sizeof(se_save_state_t));
+        uint8_t* image = NULL;
+        if(save_state)se_capture_state(&gui_instance.core,save_state);
+        if(save_state&&save_state->valid)image = se_save_state_to_image(save_state, &job->width,&job->height);
+        se_free_save_state(save_state);
         free(save_state);
+        if(job->pool_index<0)free(job->pixels);
+        job->pixels = image;
+        job->compression_level = MZ_DEFAULT_LEVEL;
       }else{
-        imdata = (uint8_t*)malloc(SE_MAX_SCREENSHOT_SIZE);
         int out_width=0, out_height=0;
-        se_screenshot(imdata, &out_width, &out_height);
-        width = out_width;
-        height = out_height;
-      }
-      if(format==0){
-        se_png_write_context_t cont ={0};
-        stbi_write_png_to_func(se_png_write_mem, &cont,width,height,4, imdata, 0);
-        free(imdata);
-        *result_size = cont.size;
-        *mime_type="image/png";
-        return cont.data;
-      }else if(format==1){
-        se_png_write_context_t cont ={0};
-        stbi_write_bmp_to_func(se_png_write_mem, &cont,width,height,4, imdata);
-        free(imdata);
-        *result_size = cont.size;
-        *mime_type="image/bmp";
-        return cont.data;
-      }else if(format==2){
-        se_png_write_context_t cont ={0};
-        stbi_write_jpg_to_func(se_png_write_mem, &cont,width,height,4, imdata,95);
-        free(imdata);
-        *result_size = cont.size;
-        *mime_type="image/jpg";
-        return cont.data;
+        se_instance_screenshot(&gui_instance,job->pixels, &out_width, &out_height);
+        job->width = out_width;
+        job->height = out_height;
       }
+      // Encoded by se_hcs_finish without holding up the emulator
+      *result_size = sizeof(*job);
+      *mime_type = HCS_DEFERRED_MIME;
+      return (uint8_t*)job;
     }else str_result = "Failed (no ROM loaded)";
   }else if(strcmp(cmd,"/read_byte")==0){
     uint64_t response_size = 0; 
@@ -6875,6 +14744,70 @@ uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_
       *result_size = response_size;
       return (uint8_t*)response;
     }   
+  }else if(strcmp(cmd,"/read_range")==0){
+    // Each len reads that many bytes from the last addr, the ranges are returned back to back
+    uint8_t* response = NULL;
+    uint64_t response_size = 0;
+    uint64_t addr = 0;
+    int address_map=0; 
+    bool okay = true;
+    while(*params){
+      if(strcmp(params[0],"map")==0) address_map = atoi(params[1]);
+      else if(strcmp(params[0],"addr")==0) addr = se_hex_string_to_int(params[1]);
+      else if(strcmp(params[0],"len")==0){
+        uint64_t len = strtoull(params[1],NULL,0);
+        if(response_size+len>SE_HCS_MAX_RANGE_SIZE){okay=false;break;}
+        response = (uint8_t*)realloc(response,response_size+len+1);
+        emu_byte_read_t read = se_read_byte_func(address_map);
+        for(uint64_t i=0;i<len;++i)response[response_size+i]=read(addr+i);
+        response_size+=len;
+        addr+=len;
+      }
+      params+=2;
+    }
+    if(okay&&response_size){
+      *result_size = response_size;
+      *mime_type = "application/octet-stream";
+      return response;
+    }
+    free(response);
+    str_result = okay? "Failed (no ranges requested)": "Failed (ranges too large)";
+  }else if(strcmp(cmd,"/write_range")==0){
+    uint64_t addr = 0;
+    int address_map=0; 
+    while(*params){
+      if(strcmp(params[0],"map")==0) address_map = atoi(params[1]);
+      else if(strcmp(params[0],"addr")==0) addr = se_hex_string_to_int(params[1]);
+      else if(strcmp(params[0],"data")==0){
+        emu_byte_write_t write = se_write_byte_func(address_map);
+        const char* data = params[1];
+        char byte_str[3]={0};
+        for(size_t i=0;data[i]&&data[i+1];i+=2){
+          byte_str[0]=data[i];
+          byte_str[1]=data[i+1];
+          write(addr++,se_hex_string_to_int(byte_str));
+        }
+      }
+      params+=2;
+    }
+    str_result="ok";
+  }else if(strcmp(cmd,"/watch")==0){
+    uint64_t addr = 0;
+    int address_map=0; 
+    bool okay = true;
+    while(*params){
+      if(strcmp(params[0],"map")==0) address_map = atoi(params[1]);
+      else if(strcmp(params[0],"addr")==0) addr = se_hex_string_to_int(params[1]);
+      else if(strcmp(params[0],"clear")==0) gui_state.num_hcs_watches=0;
+      else if(strcmp(params[0],"len")==0){
+        uint64_t len = strtoull(params[1],NULL,0);
+        if(gui_state.num_hcs_watches==SE_HCS_MAX_WATCHES||len==0||len>SE_HCS_MAX_RANGE_SIZE/SE_HCS_MAX_WATCHES)okay=false;
+        else gui_state.hcs_watches[gui_state.num_hcs_watches++]=(se_hcs_watch_t){addr,(uint32_t)len,address_map};
+      }
+      params+=2;
+    }
+    if(!okay)str_result="failed";
+    else return (uint8_t*)se_hcs_watch_values("ok",result_size);
   }else if(strcmp(cmd,"/write_byte")==0){
     uint64_t response_size = 0; 
     char *response = NULL;
@@ -6902,51 +14835,47 @@ uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_
     str_result = "ok";
   }else if(strcmp(cmd,"/status")==0){
     *mime_type = "application/json";
-    char buffer[4096]={0};
-    int off = 0;
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"{\n");
-
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"emulator\": \"SkyEmu (%s)\",\n",GIT_COMMIT_HASH);
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"run-mode\": ");
-    switch(emu_state.run_mode){
-      case SB_MODE_PAUSE: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"PAUSE\",\n");break;
-      case SB_MODE_RUN: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"RUN\",\n");break;
-      case SB_MODE_STEP: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"STEP\",\n");break;
-      case SB_MODE_RESET: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"RESET\",\n");break;
-      case SB_MODE_REWIND: off+=snprintf(buffer+off,sizeof(buffer)-off,"\"REWIND\",\n");break;
-    }
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"rom-loaded\" : %s,\n",emu_state.rom_loaded?"true":"false");
-    if(emu_state.rom_loaded){
-      off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"rom-path\": \"%s\",\n",emu_state.rom_path);
-      off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"save-path\": \"%s\",\n",emu_state.save_file_path);
-    }
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"rewind-info\" : {\n");
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"entries-used\" : %d,\n",rewind_buffer.size);
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"capacity\" : %d,\n",SE_REWIND_BUFFER_SIZE);
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"percent_full\" : %0.1f\n",(float)(rewind_buffer.size)/SE_REWIND_BUFFER_SIZE*100.);
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"  },\n");
-
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"inputs\": {\n");
-    for(int i=0; i<SE_NUM_KEYBINDS;++i){
-      off+=snprintf(buffer+off,sizeof(buffer)-off,"    \"%s\": %f",se_keybind_names[i],gui_state.hcs_joypad.inputs[i]);
-      if(i+1==SE_NUM_KEYBINDS)off+=snprintf(buffer+off,sizeof(buffer)-off,"\n");
-      else off+=snprintf(buffer+off,sizeof(buffer)-off,",\n");
+    return (uint8_t*)se_hcs_status_json(result_size);
+  }else if(strcmp(cmd,"/frame_stats")==0){
+    bool csv = false, okay = true, saved = false;
+    while(*params){
+      if(strcmp(params[0],"format")==0)csv = strcmp(params[1],"csv")==0;
+      else if(strcmp(params[0],"path")==0){okay&=se_save_frame_stats_csv(params[1]);saved=true;}
+      params+=2;
+    }
+    if(saved)str_result = okay?"ok":"failed";
+    else if(csv){
+      size_t size = 0;
+      char* result = se_frame_stats_csv(&size);
+      if(!result)return NULL;
+      *mime_type = "text/csv";
+      *result_size = size;
+      return (uint8_t*)result;
+    }else{
+      *mime_type = "application/json";
+      const se_frame_stats_t* s = &gui_state.emu_stats.frames;
+      char buffer[1024]={0};
+      int off = 0;
+      off+=snprintf(buffer+off,sizeof(buffer)-off,"{\n");
+      off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"frames\" : %d,\n",se_frame_stats_count(s));
+      for(int m=0;m<SE_FRAME_STAT_COUNT;++m){
+        se_frame_percentiles_t p = se_frame_stats_percentiles(s,m);
+        off+=snprintf(buffer+off,sizeof(buffer)-off,"  \"%s_ms\" : { \"p50\" : %.3f, \"p95\" : %.3f, \"p99\" : %.3f, \"max\" : %.3f }%s\n",
+                      se_frame_stat_names[m],p.p50,p.p95,p.p99,p.max,m+1==SE_FRAME_STAT_COUNT?"":",");
+      }
+      off+=snprintf(buffer+off,sizeof(buffer)-off,"}");
+      const char* result=strdup(buffer);
+      *result_size=strlen(result);
+      return (uint8_t*)result;
     }
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"  }\n");
-
-    off+=snprintf(buffer+off,sizeof(buffer)-off,"}");
-
-    str_result = buffer;
-    const char* result=strdup(str_result);
-    *result_size=strlen(result);
-    return (uint8_t*)result;
   }else if(strcmp(cmd,"/save")==0){
     bool okay=false;; 
     while(*params){
       if(strcmp(params[0],"path")==0){
-        se_save_state_t* save_state = (se_save_state_t*)malloc(sizeof(se_save_state_t));
-        se_capture_state(&core,save_state);
-        okay|=se_save_state_to_disk(save_state,params[1]);
+        se_save_state_t* save_state = (se_save_state_t*)calloc(1,sizeof(se_save_state_t));
+        if(save_state)se_capture_state(&gui_instance.core,save_state);
+        if(save_state&&save_state->valid)okay|=se_save_state_to_disk(save_state,params[1]);
+        se_free_save_state(save_state);
         free(save_state);
       }
       params+=2;
@@ -6956,11 +14885,12 @@ uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_
     bool okay=false;; 
     while(*params){
       if(strcmp(params[0],"path")==0){
-        se_save_state_t* save_state = (se_save_state_t*)malloc(sizeof(se_save_state_t));
-        if(se_load_state_from_disk(save_state,params[1])){
+        se_save_state_t* save_state = (se_save_state_t*)calloc(1,sizeof(se_save_state_t));
+        if(save_state&&se_load_state_from_disk(save_state,params[1])){
           okay=true;
-          se_restore_state(&core,save_state);
+          se_restore_state(&gui_instance.core,save_state);
         }
+        se_free_save_state(save_state);
         free(save_state);
       }
       params+=2;
@@ -7091,47 +15021,99 @@ uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_
   }
   return NULL;
 }
+uint8_t* se_hcs_callback(const char* cmd, const char** params, uint64_t* result_size, const char** mime_type){
+  trace_begin("HCS Callback");
+  uint8_t* result = se_hcs_handle_cmd(cmd,params,result_size,mime_type);
+  se_hcs_publish_snapshot(true);
+  trace_end();
+  return result;
+}
 
 #endif 
 
-static void frame(void) {
-  se_reset_html_click_regions();
-#ifdef USE_SDL
-  se_poll_sdl();
-#endif
-  se_set_language(gui_state.settings.language);
-#if !defined(EMSCRIPTEN) && !defined(SE_PLATFORM_ANDROID) &&!defined(SE_PLATFORM_IOS)
-  static bool last_toggle_fullscreen=false;
-  if(emu_state.joy.inputs[SE_KEY_TOGGLE_FULLSCREEN]&&last_toggle_fullscreen==false)sapp_toggle_fullscreen();
-  last_toggle_fullscreen = emu_state.joy.inputs[SE_KEY_TOGGLE_FULLSCREEN];
+// True when the last frame could be presented at a lower rate without anyone noticing: the
+// emulator isn't producing frames, no screen image changed and there was no recent input.
+// The web and iOS builds are paced by the browser and the OS.
+static bool se_ui_is_idle(){
+#if defined(EMSCRIPTEN) || defined(SE_PLATFORM_IOS)
+  return false;
+#else
+  double now = se_time();
+  if(memcmp(gui_state.idle_joy_inputs,gui_instance.emu_state.joy.inputs,sizeof(gui_state.idle_joy_inputs))){
+    memcpy(gui_state.idle_joy_inputs,gui_instance.emu_state.joy.inputs,sizeof(gui_state.idle_joy_inputs));
+    gui_state.last_activity_time = now;
+  }
+  if(gui_state.test_runner_mode)return false;
+  if(gui_instance.emu_state.rom_loaded&&gui_instance.emu_state.run_mode!=SB_MODE_PAUSE)return false;
+  if(gui_state.stream_images_uploaded)gui_state.last_activity_time = now;
+  return now-gui_state.last_activity_time>SE_IDLE_DELAY;
 #endif
+}
+// Services the first frame doesn't need, started once it has been presented. Requests made
+// earlier, like the RetroAchievements token login, wait in https.cpp for its deferred setup.
+static void se_start_deferred_services(){
+  char refresh_token_path[SB_FILE_PATH_SIZE];
+  snprintf(refresh_token_path,SB_FILE_PATH_SIZE,"%srefresh_token.txt",se_get_pref_path());
+  if(sb_file_exists(refresh_token_path))cloud_drive_create(se_drive_ready_callback);
+}
+// True if the screens were all the last ImGui frame drew: the other draw lists are empty, apart
+// from the menu bar while it is slid off screen.
+static bool se_ui_drew_only_lcd(){
+  if(se_num_lcd_replays==0||se_num_lcd_replays>SE_MAX_LCD_REPLAYS)return false;
+  ImDrawData* draw_data = igGetDrawData();
+  if(!draw_data)return false;
+  for(int i=0;i<draw_data->CmdListsCount;++i){
+    const ImDrawList* list = draw_data->CmdLists[i];
+    if(list->VtxBuffer.Size==0)continue;
+    if(gui_state.menubar_hidden&&list->_OwnerName&&strcmp(list->_OwnerName,"##MainMenuBar")==0)continue;
+    return false;
+  }
+  return true;
+}
+// Gameplay with nothing but the screens visible doesn't need ImGui, until an event, a hotkey or a
+// RetroAchievements overlay can change what is shown. UI state that changes without events, like
+// settings edited by the HTTP control server, is caught up by a full frame every second.
+static bool se_can_skip_ui_frame(){
+  if(!gui_state.ui_lcd_only||gui_state.ui_dirty||gui_state.test_runner_mode)return false;
+  if(!gui_instance.emu_state.rom_loaded||gui_instance.emu_state.run_mode!=SB_MODE_RUN)return false;
+  if(gui_state.sidebar_open||gui_state.ra_sidebar_open)return false;
+  if(se_time()-gui_state.last_ui_frame_time>1.0)return false;
+  // The menu bar handles the emulator hotkeys, the touch controls apply their held buttons
+  const sb_joy_t* curr = &gui_instance.emu_state.joy;
+  const sb_joy_t* prev = &gui_instance.emu_state.prev_frame_joy;
+  for(int i=SE_KEY_EMU_PAUSE;i<=SE_KEY_RESET_GAME;++i)if(curr->inputs[i]||prev->inputs[i])return false;
+  if(curr->inputs[SE_KEY_TOGGLE_FULLSCREEN]||prev->inputs[SE_KEY_TOGGLE_FULLSCREEN])return false;
+  for(int i=0;i<SAPP_MAX_TOUCHPOINTS;++i)if(gui_state.touch_points[i].active)return false;
+  if(gui_state.touch_controls.hold_toggle||gui_state.touch_controls.turbo_toggle)return false;
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
-  retro_achievements_keep_alive();
-  gui_state.ra_logged_in = rc_client_get_user_info(retro_achievements_get_client()) != NULL;
+  if(retro_achievements_overlay_events()!=gui_state.ui_ra_overlay_events)return false;
 #endif
-#ifdef SE_PLATFORM_ANDROID
-  //Handle Android Back Button Navigation
-  static bool last_back_press = false;
-  if(!last_back_press&&gui_state.button_state[SAPP_KEYCODE_BACK]){
-      if(gui_state.ra_sidebar_open)gui_state.ra_sidebar_open = false;
-      else if(gui_state.sidebar_open)gui_state.sidebar_open = false;
-      else if(emu_state.run_mode!=SB_MODE_PAUSE)emu_state.run_mode = SB_MODE_PAUSE;
-      else if(emu_state.rom_loaded &&!gui_state.ran_from_launcher)emu_state.run_mode = SB_MODE_RUN;
-      else sapp_quit();
+  return true;
+}
+// Runs the emulation and redraws the screens of the last UI frame with their current images,
+// without building or rendering an ImGui frame
+static void se_draw_lcd_only_frame(int width, int height){
+  trace_begin("LCD Only Frame");
+  if(se_use_emulation_thread()){
+    se_begin_update_frame();
+    gui_state.emulation_dispatch_pending=true;
+  }else se_update_frame();
+  se_draw_lcd_callback_t calls[SE_MAX_LCD_REPLAYS];
+  for(int i=0;i<se_num_lcd_replays;++i){
+    calls[i] = se_lcd_replays[i];
+    se_upload_lcd(calls+i);
   }
-  last_back_press= gui_state.button_state[SAPP_KEYCODE_BACK];
-#endif
-
-  int width = sapp_width();
-  int height = sapp_height();
-  const double delta_time = stm_sec(stm_round_to_common_refresh_rate(stm_laptime(&gui_state.laptime)));
-  gui_state.screen_width=width;
-  gui_state.screen_height=height;
   sg_begin_default_pass(&gui_state.pass_action, width, height);
+  for(int i=0;i<se_num_lcd_replays;++i)se_draw_lcd_call(calls+i);
+  sg_end_pass();
+  trace_end();
+}
+static void se_draw_ui_frame(int width, int height, double delta_time){
   simgui_new_frame(width, height, delta_time);
   float menu_height = 0; 
   se_imgui_theme();
   /*=== UI CODE STARTS HERE ===*/
+  trace_begin("UI");
   igPushStyleVarVec2(ImGuiStyleVar_FramePadding,(ImVec2){5,5});
   igPushStyleVarVec2(ImGuiStyleVar_WindowPadding,(ImVec2){0,5});
   ImGuiStyle* style = igGetStyle();
@@ -7144,17 +15126,12 @@ static void frame(void) {
   style->DisplaySafeAreaPadding.y = top_padding;
 #endif
 
-#ifdef SE_PLATFORM_ANDROID
-  se_android_poll_events(igGetIO()->WantTextInput);
-#endif
-  sb_poll_controller_input(&emu_state.joy);
-  
 
   if(gui_state.ui_type==SE_UI_ANDROID || gui_state.ui_type == SE_UI_IOS){
       style->ScrollbarSize=4;
   }
 #if !defined(EMSCRIPTEN) && !defined(SE_PLATFORM_ANDROID) &&!defined(SE_PLATFORM_IOS)
-  if(!emu_state.joy.inputs[SE_KEY_TOGGLE_FULLSCREEN]&&emu_state.prev_frame_joy.inputs[SE_KEY_TOGGLE_FULLSCREEN])sapp_toggle_fullscreen();
+  if(!gui_instance.emu_state.joy.inputs[SE_KEY_TOGGLE_FULLSCREEN]&&gui_instance.emu_state.prev_frame_joy.inputs[SE_KEY_TOGGLE_FULLSCREEN])sapp_toggle_fullscreen();
 #endif
   se_bring_text_field_into_view();
 
@@ -7207,11 +15184,11 @@ static void frame(void) {
     igSameLine(toggle_x,0);
     igPushItemWidth(sel_width);
 
-    sb_joy_t *curr = &emu_state.joy;
-    sb_joy_t *prev = &emu_state.prev_frame_joy;
+    sb_joy_t *curr = &gui_instance.emu_state.joy;
+    sb_joy_t *prev = &gui_instance.emu_state.prev_frame_joy;
 
     if(curr->inputs[SE_KEY_RESET_GAME]){
-      emu_state.run_mode=SB_MODE_RESET;
+      gui_instance.emu_state.run_mode=SB_MODE_RESET;
     }
 
     for(int i=0;i<SE_NUM_SAVE_STATES;++i){
@@ -7219,39 +15196,39 @@ static void frame(void) {
       if(curr->inputs[SE_KEY_RESTORE_STATE(i)])se_restore_state_slot(i);
     }
 
-    if(!emu_state.rom_loaded) emu_state.run_mode = SB_MODE_PAUSE;
+    if(!gui_instance.emu_state.rom_loaded) gui_instance.emu_state.run_mode = SB_MODE_PAUSE;
 
     int curr_toggle = 3;
-    if(emu_state.run_mode==SB_MODE_REWIND)curr_toggle=0;
-    if(emu_state.run_mode==SB_MODE_RUN && (emu_state.step_frames<0))curr_toggle=1;
-    if(emu_state.run_mode==SB_MODE_PAUSE)curr_toggle=2;
-    if(emu_state.run_mode==SB_MODE_RUN && emu_state.step_frames==1)curr_toggle=2;
-    if(emu_state.run_mode==SB_MODE_RUN && (emu_state.step_frames>1 || emu_state.step_frames==0))curr_toggle=3;
+    if(gui_instance.emu_state.run_mode==SB_MODE_REWIND)curr_toggle=0;
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN && (gui_instance.emu_state.step_frames<0))curr_toggle=1;
+    if(gui_instance.emu_state.run_mode==SB_MODE_PAUSE)curr_toggle=2;
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN && gui_instance.emu_state.step_frames==1)curr_toggle=2;
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN && (gui_instance.emu_state.step_frames>1 || gui_instance.emu_state.step_frames==0))curr_toggle=3;
 
-    if(emu_state.run_mode==SB_MODE_PAUSE)gui_state.menubar_hide_timer=se_time();
+    if(gui_instance.emu_state.run_mode==SB_MODE_PAUSE)gui_state.menubar_hide_timer=se_time();
 
     const char* fast_forward_label = ICON_FK_FORWARD;
-    if(emu_state.run_mode==SB_MODE_RUN){
-      if(emu_state.step_frames==0)fast_forward_label=ICON_FK_UNLOCK;
-      if(emu_state.step_frames>1){
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN){
+      if(gui_instance.emu_state.step_frames==0)fast_forward_label=ICON_FK_UNLOCK;
+      if(gui_instance.emu_state.step_frames>1){
         static char buffer[3]="2X";
-        buffer[0]='0'+emu_state.step_frames;
+        buffer[0]='0'+gui_instance.emu_state.step_frames;
         fast_forward_label=buffer;
       }
     }
     const char* rewind_label = ICON_FK_BACKWARD;
-    if(emu_state.run_mode==SB_MODE_REWIND){
-      if(emu_state.step_frames<0)rewind_label=ICON_FK_UNLOCK;
-      else if(emu_state.step_frames>=1){
+    if(gui_instance.emu_state.run_mode==SB_MODE_REWIND){
+      if(gui_instance.emu_state.step_frames<0)rewind_label=ICON_FK_UNLOCK;
+      else if(gui_instance.emu_state.step_frames>=1){
         static char buffer[3]="2X";
-        buffer[0]='0'+emu_state.step_frames;
+        buffer[0]='0'+gui_instance.emu_state.step_frames;
         rewind_label=buffer;
       }
     }
     const char* slow_label = ICON_FK_HOURGLASS;
-    if(emu_state.run_mode==SB_MODE_RUN && emu_state.step_frames<0){
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN && gui_instance.emu_state.step_frames<0){
       static char buffer[4]="1/X";
-      buffer[2]='0'-emu_state.step_frames;
+      buffer[2]='0'-gui_instance.emu_state.step_frames;
       slow_label=buffer;
     }
     const char* toggle_labels[]={
@@ -7267,37 +15244,37 @@ static void frame(void) {
       "Toggle pause/play.\n When paused, the rom selection screen will be shown.",
       "Fast Forward",
     };
-    if(emu_state.run_mode==SB_MODE_RUN && emu_state.step_frames==1){
+    if(gui_instance.emu_state.run_mode==SB_MODE_RUN && gui_instance.emu_state.step_frames==1){
       toggle_labels[2]=ICON_FK_PAUSE;
     }
     int next_toggle_id = -1; 
 
     int first_hardcore_toggle = 2;
 
-    if(emu_state.run_mode!=SB_MODE_PAUSE){
+    if(gui_instance.emu_state.run_mode!=SB_MODE_PAUSE){
       if(curr->inputs[SE_KEY_EMU_REWIND] && !prev->inputs[SE_KEY_EMU_REWIND]){
-        emu_state.run_mode=SB_MODE_REWIND;
-        emu_state.step_frames=2;
+        gui_instance.emu_state.run_mode=SB_MODE_REWIND;
+        gui_instance.emu_state.step_frames=2;
       }
       if(
           (!curr->inputs[SE_KEY_EMU_REWIND] && prev->inputs[SE_KEY_EMU_REWIND]) ||
           (!curr->inputs[SE_KEY_EMU_FF_2X] && prev->inputs[SE_KEY_EMU_FF_2X]) ||
           (!curr->inputs[SE_KEY_EMU_FF_MAX] && prev->inputs[SE_KEY_EMU_FF_MAX])
         ){
-        emu_state.run_mode=SB_MODE_RUN;
-        emu_state.step_frames=1;
+        gui_instance.emu_state.run_mode=SB_MODE_RUN;
+        gui_instance.emu_state.step_frames=1;
       }
       if(curr->inputs[SE_KEY_EMU_FF_2X] && !prev->inputs[SE_KEY_EMU_FF_2X]){
-        emu_state.run_mode=SB_MODE_RUN;
-        emu_state.step_frames=2;
+        gui_instance.emu_state.run_mode=SB_MODE_RUN;
+        gui_instance.emu_state.step_frames=2;
       }
       if(curr->inputs[SE_KEY_EMU_FF_MAX] && !prev->inputs[SE_KEY_EMU_FF_MAX]){
-        emu_state.run_mode=SB_MODE_RUN;
-        emu_state.step_frames=-1;
+        gui_instance.emu_state.run_mode=SB_MODE_RUN;
+        gui_instance.emu_state.step_frames=-1;
       }
     }
 
-    if(!emu_state.rom_loaded)se_push_disabled();
+    if(!gui_instance.emu_state.rom_loaded)se_push_disabled();
     for(int i=0;i<num_toggles;++i){
       bool hardcore_disabled = gui_state.settings.hardcore_mode&&gui_state.ra_logged_in&& i<first_hardcore_toggle;
       if(hardcore_disabled)se_push_disabled();
@@ -7313,48 +15290,48 @@ static void frame(void) {
       if(i==num_toggles-1)igPopStyleVar(1);
       if(hardcore_disabled)se_pop_disabled();
     }
-    if(!emu_state.rom_loaded)se_pop_disabled();
+    if(!gui_instance.emu_state.rom_loaded)se_pop_disabled();
     
     switch(next_toggle_id){
       case 0: {
-        emu_state.run_mode=SB_MODE_REWIND;
-        if(emu_state.step_frames==2 && curr_toggle == next_toggle_id)emu_state.step_frames=4;
-        else if(emu_state.step_frames==4 && curr_toggle == next_toggle_id)emu_state.step_frames=8;
-        else emu_state.step_frames=2;
+        gui_instance.emu_state.run_mode=SB_MODE_REWIND;
+        if(gui_instance.emu_state.step_frames==2 && curr_toggle == next_toggle_id)gui_instance.emu_state.step_frames=4;
+        else if(gui_instance.emu_state.step_frames==4 && curr_toggle == next_toggle_id)gui_instance.emu_state.step_frames=8;
+        else gui_instance.emu_state.step_frames=2;
       } ;break;
       case 1: {
-        emu_state.run_mode=SB_MODE_RUN;
-        if(emu_state.step_frames==-2&& curr_toggle == next_toggle_id)emu_state.step_frames=-4;
-        else if(emu_state.step_frames==-4&& curr_toggle == next_toggle_id)emu_state.step_frames=-8;
-        else emu_state.step_frames=-2;
+        gui_instance.emu_state.run_mode=SB_MODE_RUN;
+        if(gui_instance.emu_state.step_frames==-2&& curr_toggle == next_toggle_id)gui_instance.emu_state.step_frames=-4;
+        else if(gui_instance.emu_state.step_frames==-4&& curr_toggle == next_toggle_id)gui_instance.emu_state.step_frames=-8;
+        else gui_instance.emu_state.step_frames=-2;
       } ;break;
-      case 2: {emu_state.run_mode=emu_state.run_mode==SB_MODE_RUN&&emu_state.step_frames==1?SB_MODE_PAUSE: SB_MODE_RUN;emu_state.step_frames=1;} ;break;
+      case 2: {gui_instance.emu_state.run_mode=gui_instance.emu_state.run_mode==SB_MODE_RUN&&gui_instance.emu_state.step_frames==1?SB_MODE_PAUSE: SB_MODE_RUN;gui_instance.emu_state.step_frames=1;} ;break;
       case 3: {
-        emu_state.run_mode=SB_MODE_RUN;
-        if(emu_state.step_frames==2     && curr_toggle == next_toggle_id)emu_state.step_frames=4;
-        else if(emu_state.step_frames==4&& curr_toggle == next_toggle_id)emu_state.step_frames=8;
-        else if(emu_state.step_frames==8&& curr_toggle == next_toggle_id)emu_state.step_frames=0;
-        else emu_state.step_frames=2;
+        gui_instance.emu_state.run_mode=SB_MODE_RUN;
+        if(gui_instance.emu_state.step_frames==2     && curr_toggle == next_toggle_id)gui_instance.emu_state.step_frames=4;
+        else if(gui_instance.emu_state.step_frames==4&& curr_toggle == next_toggle_id)gui_instance.emu_state.step_frames=8;
+        else if(gui_instance.emu_state.step_frames==8&& curr_toggle == next_toggle_id)gui_instance.emu_state.step_frames=0;
+        else gui_instance.emu_state.step_frames=2;
         break;
       } 
     }
 
     if(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in){
-      if(emu_state.run_mode==SB_MODE_REWIND||emu_state.run_mode==SB_MODE_STEP){
-        emu_state.run_mode= SB_MODE_RUN;
-        emu_state.step_frames=1;
+      if(gui_instance.emu_state.run_mode==SB_MODE_REWIND||gui_instance.emu_state.run_mode==SB_MODE_STEP){
+        gui_instance.emu_state.run_mode= SB_MODE_RUN;
+        gui_instance.emu_state.step_frames=1;
       }
-      if(emu_state.step_frames<1&&emu_state.step_frames!=-1)emu_state.step_frames=1; 
+      if(gui_instance.emu_state.step_frames<1&&gui_instance.emu_state.step_frames!=-1)gui_instance.emu_state.step_frames=1; 
     }
 
     if(gui_state.settings.hardcore_mode&&gui_state.ra_logged_in){
-      if(emu_state.run_mode==SB_MODE_REWIND||emu_state.run_mode==SB_MODE_STEP)emu_state.run_mode= SB_MODE_RUN;
-      if(emu_state.step_frames<1&&emu_state.step_frames!=-1)emu_state.step_frames=1; 
+      if(gui_instance.emu_state.run_mode==SB_MODE_REWIND||gui_instance.emu_state.run_mode==SB_MODE_STEP)gui_instance.emu_state.run_mode= SB_MODE_RUN;
+      if(gui_instance.emu_state.step_frames<1&&gui_instance.emu_state.step_frames!=-1)gui_instance.emu_state.step_frames=1; 
     }
 
     if(curr->inputs[SE_KEY_EMU_PAUSE] && !prev->inputs[SE_KEY_EMU_PAUSE]){
-      if(emu_state.run_mode!=SB_MODE_RUN){emu_state.run_mode=SB_MODE_RUN;emu_state.step_frames=1;}
-      else emu_state.run_mode = SB_MODE_PAUSE;
+      if(gui_instance.emu_state.run_mode!=SB_MODE_RUN){gui_instance.emu_state.run_mode=SB_MODE_RUN;gui_instance.emu_state.step_frames=1;}
+      else gui_instance.emu_state.run_mode = SB_MODE_PAUSE;
     }
 
     igPopItemWidth();
@@ -7392,7 +15369,9 @@ static void frame(void) {
       igSetNextWindowPos((ImVec2){screen_x,menu_height}, ImGuiCond_Always, (ImVec2){0,0});
       igSetNextWindowSize((ImVec2){sidebar_w, (gui_state.screen_height-menu_height*se_dpi_scale())/se_dpi_scale()}, ImGuiCond_Always);
       igBegin(se_localize_and_cache("Menu"),&gui_state.sidebar_open, ImGuiWindowFlags_NoCollapse|ImGuiWindowFlags_NoResize);
+      trace_begin("Menu Panel");
       se_draw_menu_panel();
+      trace_end();
       igEnd();
       screen_x += sidebar_w;
       screen_width -=sidebar_w*se_dpi_scale();
@@ -7433,9 +15412,15 @@ static void frame(void) {
     igBegin("Screen", 0,ImGuiWindowFlags_NoDecoration
       |ImGuiWindowFlags_NoBringToFrontOnFocus);
   
-    se_update_frame();
+    if(se_use_emulation_thread()){
+      // The frames run while the UI presents, so the screen shows the previous frames' output
+      se_begin_update_frame();
+      gui_state.emulation_dispatch_pending=true;
+    }else se_update_frame();
 
+    trace_begin("Draw Screen");
     se_draw_emulated_system_screen(false);
+    trace_end();
 
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
     float left = screen_x;
@@ -7464,7 +15449,7 @@ static void frame(void) {
     igPopStyleVar(2);
     igPopStyleColor(1);
     igEnd();
-    bool draw_click_region = emu_state.run_mode!=SB_MODE_RUN&&emu_state.run_mode!=SB_MODE_REWIND && !draw_sidebars_over_screen&& (gui_state.overlay_open||!emu_state.rom_loaded);
+    bool draw_click_region = gui_instance.emu_state.run_mode!=SB_MODE_RUN&&gui_instance.emu_state.run_mode!=SB_MODE_REWIND && !draw_sidebars_over_screen&& (gui_state.overlay_open||!gui_instance.emu_state.rom_loaded);
     if(draw_click_region){
       igSetNextWindowPos((ImVec2){screen_x,menu_height}, ImGuiCond_Always, (ImVec2){0,0});
       igSetNextWindowSize((ImVec2){screen_width, height-menu_height*se_dpi_scale()}, ImGuiCond_Always);
@@ -7472,12 +15457,25 @@ static void frame(void) {
     }
     se_load_rom_overlay(draw_click_region);
     if(draw_click_region)igEnd();
+    se_poll_background_rom_load();
   }
-  if(emu_state.run_mode==SB_MODE_RUN||emu_state.run_mode==SB_MODE_REWIND)gui_state.overlay_open= true; 
+  if(gui_instance.emu_state.run_mode==SB_MODE_RUN||gui_instance.emu_state.run_mode==SB_MODE_REWIND)gui_state.overlay_open= true; 
+  trace_end();
   /*=== UI CODE ENDS HERE ===*/
 
+  trace_begin("ImGui Render");
+  // Begun after the UI code so the ghosting and upscaling passes of se_draw_lcd_defer can run in between
+  sg_begin_default_pass(&gui_state.pass_action, width, height);
+  se_num_lcd_replays = 0;
   simgui_render();
   sg_end_pass();
+  trace_end();
+  gui_state.ui_lcd_only = se_ui_drew_only_lcd();
+  gui_state.ui_dirty = false;
+  gui_state.last_ui_frame_time = se_time();
+#ifdef ENABLE_RETRO_ACHIEVEMENTS
+  gui_state.ui_ra_overlay_events = retro_achievements_overlay_events();
+#endif
   static float old_dpi= 0;
   if(old_dpi!=se_dpi_scale()){
     simgui_shutdown();
@@ -7487,10 +15485,18 @@ static void frame(void) {
   }
   if(gui_state.update_font_atlas){
     gui_state.update_font_atlas=false;
+    trace_begin("Font Atlas Rebuild");
     ImFontAtlas* atlas = igGetIO()->Fonts;    
 
     ImFont *font = NULL;
     float font_scale=1.0;
+    // Custom fonts are loaded from a user file that can change between runs
+    bool use_cache = gui_state.settings.theme!=SE_THEME_CUSTOM;
+    uint8_t* cached_pixels = use_cache? se_load_font_atlas_cache(atlas,font_scale): NULL;
+    unsigned char* font_pixels = cached_pixels;
+    int font_width = atlas->TexWidth, font_height = atlas->TexHeight;
+    if(!cached_pixels){
+    ImFontAtlas_Clear(atlas);
    
     if(gui_state.settings.theme==SE_THEME_CUSTOM){
       size_t size =0; 
@@ -7502,30 +15508,35 @@ static void frame(void) {
       }
     }
     
+    // The embedded fonts are decompressed once and shared by every rebuild, so the atlas must not free them
+    ImFontConfig* resident_config=ImFontConfig_ImFontConfig();
+    resident_config->FontDataOwnedByAtlas = false;
     if(!font){
-      uint64_t karla_compressed_size; 
-      const uint8_t* karla_compressed_data = se_get_resource(SE_KARLA,&karla_compressed_size);
-      font =ImFontAtlas_AddFontFromMemoryCompressedTTF(
-        atlas,karla_compressed_data,karla_compressed_size,13*se_dpi_scale()*font_scale,NULL,NULL);
+      uint64_t karla_size; 
+      const uint8_t* karla_data = se_get_resource_decompressed(SE_KARLA,&karla_size);
+      font =ImFontAtlas_AddFontFromMemoryTTF(
+        atlas,(void*)karla_data,karla_size,13*se_dpi_scale()*font_scale,resident_config,NULL);
     }
     
-    uint64_t forkawesome_compressed_size; 
-    const uint8_t* forkawesome_compressed_data = se_get_resource(SE_FORKAWESOME,&forkawesome_compressed_size);
+    uint64_t forkawesome_size; 
+    const uint8_t* forkawesome_data = se_get_resource_decompressed(SE_FORKAWESOME,&forkawesome_size);
 
     static const ImWchar icons_ranges[] = { ICON_MIN_FK, ICON_MAX_FK, 0 }; // Will not be copied by AddFont* so keep in scope.
     ImFontConfig* config=ImFontConfig_ImFontConfig();
     config->MergeMode = true;
     config->GlyphMinAdvanceX = 13.0f;
-    ImFont* font2 =ImFontAtlas_AddFontFromMemoryCompressedTTF(atlas,
-      forkawesome_compressed_data,forkawesome_compressed_size,13*se_dpi_scale()*font_scale,config,icons_ranges);
+    config->FontDataOwnedByAtlas = false;
+    ImFont* font2 =ImFontAtlas_AddFontFromMemoryTTF(atlas,
+      (void*)forkawesome_data,forkawesome_size,13*se_dpi_scale()*font_scale,config,icons_ranges);
     ImFontConfig_destroy(config);
     igGetIO()->FontDefault=font2;
   
     #ifdef UNICODE_GUI
-      uint64_t notosans_cjksc_compressed_size; 
-      const uint8_t* notosans_cjksc_compressed_data = se_get_resource(SE_NOTO,&notosans_cjksc_compressed_size);
+      uint64_t notosans_cjksc_size; 
+      const uint8_t* notosans_cjksc_data = se_get_resource_decompressed(SE_NOTO,&notosans_cjksc_size);
       ImFontConfig* config3=ImFontConfig_ImFontConfig();
       config3->MergeMode = true;
+      config3->FontDataOwnedByAtlas = false;
       config3->OversampleH=1;
       config3->PixelSnapH = true;
 
@@ -7539,29 +15550,30 @@ static void frame(void) {
           index++;
         }
       }
-      ImFont* font3 =ImFontAtlas_AddFontFromMemoryCompressedTTF(atlas,notosans_cjksc_compressed_data,notosans_cjksc_compressed_size,14*se_dpi_scale()*font_scale,config3,ranges);
+      ImFont* font3 =ImFontAtlas_AddFontFromMemoryTTF(atlas,(void*)notosans_cjksc_data,notosans_cjksc_size,14*se_dpi_scale()*font_scale,config3,ranges);
       uint64_t noto_armenian_size;
-      const uint8_t *noto_armenian = se_get_resource(SE_NOTO_ARMENIAN,&noto_armenian_size);
-      ImFont* font4 =ImFontAtlas_AddFontFromMemoryCompressedTTF(atlas,noto_armenian,noto_armenian_size,14*se_dpi_scale()*font_scale,config3,ranges);
+      const uint8_t *noto_armenian = se_get_resource_decompressed(SE_NOTO_ARMENIAN,&noto_armenian_size);
+      ImFont* font4 =ImFontAtlas_AddFontFromMemoryTTF(atlas,(void*)noto_armenian,noto_armenian_size,14*se_dpi_scale()*font_scale,config3,ranges);
       uint64_t noto_sans_size=0;
-      const uint8_t *noto_sans = se_get_resource(SE_NOTO_SANS,&noto_sans_size);
-      ImFont* font5 =ImFontAtlas_AddFontFromMemoryCompressedTTF(atlas,noto_sans,noto_sans_size,14*se_dpi_scale()*font_scale,config3,ranges);
+      const uint8_t *noto_sans = se_get_resource_decompressed(SE_NOTO_SANS,&noto_sans_size);
+      ImFont* font5 =ImFontAtlas_AddFontFromMemoryTTF(atlas,(void*)noto_sans,noto_sans_size,14*se_dpi_scale()*font_scale,config3,ranges);
       ImFontConfig_destroy(config3);
       igGetIO()->FontDefault=font3;
     #endif
 
     {
-      uint64_t karla_compressed_size; 
-      const uint8_t* karla_compressed_data = se_get_resource(SE_SV_BASIC_MANUAL,&karla_compressed_size);
-      gui_state.mono_font =ImFontAtlas_AddFontFromMemoryCompressedTTF(
-        atlas,karla_compressed_data,karla_compressed_size,13*se_dpi_scale()*font_scale,NULL,NULL);
+      uint64_t mono_size; 
+      const uint8_t* mono_data = se_get_resource_decompressed(SE_SV_BASIC_MANUAL,&mono_size);
+      gui_state.mono_font =ImFontAtlas_AddFontFromMemoryTTF(
+        atlas,(void*)mono_data,mono_size,13*se_dpi_scale()*font_scale,resident_config,NULL);
     }
+    ImFontConfig_destroy(resident_config);
     
 
-    unsigned char* font_pixels;
-    int font_width, font_height;
     int bytes_per_pixel;
     ImFontAtlas_GetTexDataAsRGBA32(atlas, &font_pixels, &font_width, &font_height, &bytes_per_pixel);
+    if(use_cache)se_save_font_atlas_cache(atlas,font_scale);
+    }
     sg_image_desc img_desc;
     memset(&img_desc, 0, sizeof(img_desc));
     img_desc.width = font_width;
@@ -7579,55 +15591,145 @@ static void frame(void) {
     has_atlas_image = true;
     gui_state.font_atlas_image = sg_make_image(&img_desc);
     atlas->TexID = (ImTextureID)(uintptr_t)gui_state.font_atlas_image.id;
+    free(cached_pixels);
     ImFontAtlas_ClearTexData(atlas);
     ImFontAtlas_ClearInputData(atlas);
     
     igGetIO()->Fonts=atlas;
     igGetIO()->FontGlobalScale=1./se_dpi_scale();
+    trace_end();
+  }
+}
+static void frame(void) {
+  trace_begin("Frame");
+  se_join_emulation_thread();
+  se_reset_html_click_regions();
+#ifdef USE_SDL
+  se_poll_sdl();
+#endif
+  se_set_language(gui_state.settings.language);
+#if !defined(EMSCRIPTEN) && !defined(SE_PLATFORM_ANDROID) &&!defined(SE_PLATFORM_IOS)
+  static bool last_toggle_fullscreen=false;
+  if(gui_instance.emu_state.joy.inputs[SE_KEY_TOGGLE_FULLSCREEN]&&last_toggle_fullscreen==false)sapp_toggle_fullscreen();
+  last_toggle_fullscreen = gui_instance.emu_state.joy.inputs[SE_KEY_TOGGLE_FULLSCREEN];
+#endif
+#ifdef ENABLE_RETRO_ACHIEVEMENTS
+  retro_achievements_keep_alive();
+  gui_state.ra_logged_in = rc_client_get_user_info(retro_achievements_get_client()) != NULL;
+#endif
+#ifdef SE_PLATFORM_ANDROID
+  //Handle Android Back Button Navigation
+  static bool last_back_press = false;
+  if(!last_back_press&&gui_state.button_state[SAPP_KEYCODE_BACK]){
+      if(gui_state.ra_sidebar_open)gui_state.ra_sidebar_open = false;
+      else if(gui_state.sidebar_open)gui_state.sidebar_open = false;
+      else if(gui_instance.emu_state.run_mode!=SB_MODE_PAUSE)gui_instance.emu_state.run_mode = SB_MODE_PAUSE;
+      else if(gui_instance.emu_state.rom_loaded &&!gui_state.ran_from_launcher)gui_instance.emu_state.run_mode = SB_MODE_RUN;
+      else sapp_quit();
   }
+  last_back_press= gui_state.button_state[SAPP_KEYCODE_BACK];
+#endif
+
+  int width = sapp_width();
+  int height = sapp_height();
+  uint64_t frame_ticks = stm_laptime(&gui_state.laptime);
+  se_metrics_observe(&se_metrics.display_frame_time,se_metrics_frame_buckets,stm_sec(frame_ticks));
+  se_frame_stats_begin_frame(frame_ticks);
+  const double delta_time = stm_sec(stm_round_to_common_refresh_rate(frame_ticks));
+  se_pacer_measure_display(delta_time);
+  gui_state.screen_width=width;
+  gui_state.screen_height=height;
+#ifdef SE_PLATFORM_ANDROID
+  se_android_poll_events(igGetIO()->WantTextInput);
+#endif
+  sb_poll_controller_input(&gui_instance.emu_state.joy);
+  se_poll_trace_hotkey();
+  se_poll_event_log();
+  if(se_can_skip_ui_frame())se_draw_lcd_only_frame(width,height);
+  else se_draw_ui_frame(width,height,delta_time);
+  trace_begin("GPU Commit");
   sg_commit();
-  int num_samples_to_push = saudio_expect()*2;
+  trace_end();
+  static bool deferred_services_started = false;
+  if(!deferred_services_started){
+    deferred_services_started = true;
+    se_start_deferred_services();
+  }
+  se_frame_stats_end_frame();
+  trace_begin("Audio Push");
+  int num_samples_to_push = se_audio_expect()*2;
   enum{samples_to_push=128};
   float volume_sq = gui_state.settings.volume*gui_state.settings.volume/32768.;
   int sample_copies = 1;
-  if(emu_state.step_frames<0)sample_copies = -emu_state.step_frames;
-  int sample_copy_index = sample_copies; 
+  if(gui_instance.emu_state.step_frames<0)sample_copies = -gui_instance.emu_state.step_frames;
+  sb_ring_buffer_t* ring = &gui_instance.emu_state.audio_ring_buff;
   for(int s = 0; s<num_samples_to_push;s+=samples_to_push){
     float audio_buff[samples_to_push];
-    if(sb_ring_buffer_size(&emu_state.audio_ring_buff)<=samples_to_push){
+    if(gui_instance.emu_state.audio_disabled){
+      // The cores leave the ring empty, silence keeps the device running for when audio comes back
+      memset(audio_buff,0,sizeof(audio_buff));
+      se_audio_push(audio_buff, samples_to_push/2);
+      gui_state.audio_watchdog_timer = 0;
+      continue;
+    }
+    uint32_t available = sb_ring_buffer_size(ring);
+    // Needs a block at the fastest rate plus the interpolation tap
+    if(available<samples_to_push+8){
       se_reset_audio_ring();
+      se_metrics_add(&se_metrics.audio_underruns,1);
       break;
     }
+    // Dynamic rate control: read slightly faster when the ring is above the target fill and slower
+    // when below, so drift between the emulated and host clocks never under or overruns it
+    double fill_error = ((double)available-SE_AUDIO_TARGET_FILL)/SE_AUDIO_TARGET_FILL;
+    if(fill_error>1.0)fill_error=1.0;
+    if(fill_error<-1.0)fill_error=-1.0;
+    // When the emulator is paced by the audio ring it does the correcting
+    if(se_pacer_locked()&&gui_state.settings.frame_pacing==SE_PACING_AUDIO)fill_error=0;
+    double step = (1.0+SE_AUDIO_MAX_RATE_DELTA*fill_error)/sample_copies;
+    double pos = se_audio_read_frac;
     for(int i=0;i<samples_to_push/2;++i){
-      int16_t data0 = emu_state.audio_ring_buff.data[(emu_state.audio_ring_buff.read_ptr)%SB_AUDIO_RING_BUFFER_SIZE];
-      int16_t data1 = emu_state.audio_ring_buff.data[(emu_state.audio_ring_buff.read_ptr+1)%SB_AUDIO_RING_BUFFER_SIZE];
-      if(--sample_copy_index == 0){
-        sample_copy_index = sample_copies;
-        emu_state.audio_ring_buff.read_ptr+=2;
+      uint32_t frame = (uint32_t)pos;
+      float t = pos-frame;
+      for(int c=0;c<2;++c){
+        float a = sb_ring_buffer_peek(ring,frame*2+c);
+        float b = sb_ring_buffer_peek(ring,frame*2+2+c);
+        audio_buff[i*2+c]=(a+(b-a)*t)*volume_sq;
       }
-      audio_buff[i*2]=data0*volume_sq;
-      audio_buff[i*2+1]=data1*volume_sq;
+      pos+=step;
     }
-    saudio_push(audio_buff, samples_to_push/2);
+    uint32_t consumed = (uint32_t)pos;
+    sb_ring_buffer_consume(ring,consumed*2);
+    se_audio_read_frac = pos-consumed;
+    se_audio_push(audio_buff, samples_to_push/2);
     gui_state.audio_watchdog_timer = 0;
   }
   //This watchdog timer was inserted since 
   gui_state.audio_watchdog_timer++;
   if(gui_state.audio_watchdog_timer>100){
     gui_state.audio_watchdog_timer=0;
-    saudio_shutdown();
+    se_shutdown_audio();
     se_init_audio();
     gui_state.audio_watchdog_triggered++;
+    se_metrics_add(&se_metrics.audio_watchdog_resets,1);
   }
+  trace_counter("Audio Ring Samples",sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff));
+  trace_end();
+  bool idle = se_ui_is_idle();
   se_free_all_images();
   if(memcmp(&gui_state.last_saved_settings, &gui_state.settings,sizeof(gui_state.settings))){
     char settings_path[SB_FILE_PATH_SIZE];
     snprintf(settings_path,SB_FILE_PATH_SIZE,"%suser_settings.bin",se_get_pref_path());
     sb_save_file_data(settings_path,(uint8_t*)&gui_state.settings,sizeof(gui_state.settings));
-    se_emscripten_flush_fs();
+    se_emscripten_flush_fs(settings_path);
     gui_state.last_saved_settings=gui_state.settings;
   }
+  trace_begin("Atlas Upload");
   atlas_upload_all();
+  trace_end();
+  se_dispatch_emulation_thread();
+  trace_end();
+  if(idle)job_pool_sleep_ms(SE_IDLE_FRAME_MS);
 }
 void se_load_settings(){
   se_load_recent_games_list();
@@ -7649,7 +15751,7 @@ void se_load_settings(){
     char settings_path[SB_FILE_PATH_SIZE];
     snprintf(settings_path,SB_FILE_PATH_SIZE,"%suser_settings.bin",se_get_pref_path());
     if(!sb_load_file_data_into_buffer(settings_path,(void*)&gui_state.settings,sizeof(gui_state.settings))){gui_state.settings.settings_file_version=-1;}
-    int max_settings_version_supported =3;
+    int max_settings_version_supported =5;
     if(gui_state.settings.settings_file_version>max_settings_version_supported){
       gui_state.settings.volume=0.8;
       gui_state.settings.draw_debug_menu = false; 
@@ -7666,6 +15768,7 @@ void se_load_settings(){
       gui_state.settings.stretch_to_fit = 0; 
     }
     if(gui_state.settings.screen_shader>4)gui_state.settings.screen_shader=4;
+    if(gui_state.settings.shader_chain>=SE_NUM_SHADER_CHAINS)gui_state.settings.shader_chain=0;
     if(gui_state.settings.settings_file_version<2){
       gui_state.settings.settings_file_version = 2; 
       gui_state.settings.auto_hide_touch_controls=true;
@@ -7694,6 +15797,15 @@ void se_load_settings(){
       gui_state.settings.enable_download_cache=1;
       https_set_cache_enabled(gui_state.settings.enable_download_cache);
     }
+    if(gui_state.settings.settings_file_version<4){
+      gui_state.settings.settings_file_version = 4;
+      gui_state.settings.rewind_memory = 2;
+      gui_state.settings.rewind_length = 2;
+    }
+    if(gui_state.settings.settings_file_version<5){
+      gui_state.settings.settings_file_version = 5;
+      gui_state.settings.perf_governor = gui_state.ui_type == SE_UI_ANDROID || gui_state.ui_type == SE_UI_IOS;
+    }
     if(gui_state.settings.gui_scale_factor<0.5)gui_state.settings.gui_scale_factor=1.0;
     if(gui_state.settings.gui_scale_factor>4.0)gui_state.settings.gui_scale_factor=1.0;
     if(gui_state.settings.custom_font_scale<0.5)gui_state.settings.custom_font_scale=1.0;
@@ -7707,15 +15819,10 @@ void se_load_settings(){
   {
     memset(&cloud_state,0,sizeof(se_cloud_state_t));
     cloud_state.save_states_mutex = mutex_create();
-    char refresh_token_path[SB_FILE_PATH_SIZE];
-    snprintf(refresh_token_path,SB_FILE_PATH_SIZE,"%srefresh_token.txt",se_get_pref_path());
-    if(sb_file_exists(refresh_token_path)){
-      cloud_drive_create(se_drive_ready_callback);
-    }
   }
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
   bool is_mobile = gui_state.ui_type == SE_UI_ANDROID || gui_state.ui_type == SE_UI_IOS;
-  retro_achievements_initialize(&emu_state,gui_state.settings.hardcore_mode);
+  retro_achievements_initialize(&gui_instance.emu_state,gui_state.settings.hardcore_mode);
 #endif
 }
 static void se_compute_draw_lcd_rect(float *lcd_render_w, float *lcd_render_h, bool *hybrid_nds){
@@ -7727,8 +15834,8 @@ static void se_compute_draw_lcd_rect(float *lcd_render_w, float *lcd_render_h, b
     float native_w = SB_LCD_W;
     float native_h = SB_LCD_H;
     bool touch_controller_active = gui_state.last_touch_time>=0||gui_state.settings.auto_hide_touch_controls==false;
-    if(emu_state.system==SYSTEM_GBA){native_w = GBA_LCD_W; native_h = GBA_LCD_H;}
-    else if(emu_state.system==SYSTEM_NDS){
+    if(gui_instance.emu_state.system==SYSTEM_GBA){native_w = GBA_LCD_W; native_h = GBA_LCD_H;}
+    else if(gui_instance.emu_state.system==SYSTEM_NDS){
       native_w = NDS_LCD_W; native_h = NDS_LCD_H*2;
       if(scr_w/scr_h>1&&!touch_controller_active){
         native_w = NDS_LCD_W+NDS_LCD_W*0.5;
@@ -7774,6 +15881,7 @@ static void se_compute_draw_lcd_rect(float *lcd_render_w, float *lcd_render_h, b
   }
 }
 static void se_draw_lcd_in_rect(float lcd_render_x, float lcd_render_y, float lcd_render_w, float lcd_render_h, bool hybrid_nds){
+  se_lcd_in_rect_draws++;
   float dpi_scale = se_dpi_scale();
   float lx = lcd_render_x*dpi_scale;
   float ly = lcd_render_y*dpi_scale;
@@ -7781,40 +15889,12 @@ static void se_draw_lcd_in_rect(float lcd_render_x, float lcd_render_y, float lc
   float lh = lcd_render_h*dpi_scale;
   float rotation = gui_state.settings.screen_rotation*0.5*3.14159;
 
-  if(emu_state.system==SYSTEM_GBA){
-    se_draw_lcd_defer(core.gba.framebuffer,GBA_LCD_W,GBA_LCD_H,lx,ly, lw, lh,rotation,false);
-  }else if (emu_state.system==SYSTEM_NDS){
-    if(hybrid_nds){
-      float p[6]={
-        0.3333* lw,- lh*0.25,
-        0.3333* lw, lh*0.25,
-        -0.1666* lw,0,
-      };
-      for(int i=0;i<3;++i){
-        float x = p[i*2+0];
-        float y = p[i*2+1];
-        p[i*2+0] = x*cos(-rotation)+y*sin(-rotation);
-        p[i*2+1] = x*-sin(-rotation)+y*cos(-rotation);
-      }
-      se_draw_lcd_defer(core.nds.framebuffer_top,NDS_LCD_W,NDS_LCD_H,lx+p[0],ly+p[1], lw/3, lh*0.5,rotation,false);
-      se_draw_lcd_defer(core.nds.framebuffer_bottom,NDS_LCD_W,NDS_LCD_H,lx+p[2],ly+p[3], lw/3, lh*0.5,rotation,true);
-      se_draw_lcd_defer(core.nds.framebuffer_top,NDS_LCD_W,NDS_LCD_H,lx+p[4],ly+p[5], lw*2/3, lh,rotation,false);
-    }else{
-      float p[4]={
-        0,- lh*0.25,
-        0,lh*0.25
-      };
-      for(int i=0;i<2;++i){
-        float x = p[i*2+0];
-        float y = p[i*2+1];
-        p[i*2+0] = x*cos(-rotation)+y*sin(-rotation);
-        p[i*2+1] = x*-sin(-rotation)+y*cos(-rotation);
-      }
-      se_draw_lcd_defer(core.nds.framebuffer_top,NDS_LCD_W,NDS_LCD_H,lx+p[0],ly+p[1], lw, lh*0.5,rotation,false);
-      se_draw_lcd_defer(core.nds.framebuffer_bottom,NDS_LCD_W,NDS_LCD_H,lx+p[2],ly+p[3], lw, lh*0.5,rotation,true);
-    }
-  }else if (emu_state.system==SYSTEM_GB){
-    se_draw_lcd_defer(core.gb.lcd.framebuffer,SB_LCD_W,SB_LCD_H,lx,ly, lw, lh,rotation,false);
+  if(gui_instance.emu_state.system==SYSTEM_GBA){
+    se_draw_lcd_defer(gui_instance.core.gba.framebuffer,GBA_LCD_W,GBA_LCD_H,lx,ly, lw, lh,rotation,false);
+  }else if (gui_instance.emu_state.system==SYSTEM_NDS){
+    se_draw_nds_screens_defer(lx,ly,lw,lh,rotation,true,hybrid_nds);
+  }else if (gui_instance.emu_state.system==SYSTEM_GB){
+    se_draw_lcd_defer(gui_instance.core.gb.lcd.framebuffer,SB_LCD_W,SB_LCD_H,lx,ly, lw, lh,rotation,false);
   }
 }
 static bool se_draw_theme_region_tint_partial(int region, float x, float y, float w, float h, float w_ratio, float h_ratio, uint32_t tint){
@@ -8125,6 +16205,9 @@ static bool se_load_theme_from_image(uint8_t* im, uint32_t im_w, uint32_t im_h){
       }
     }
   }
+  return true;
+}
+static void se_upload_theme_image(uint8_t* im, uint32_t im_w, uint32_t im_h){
   sg_image_data im_data={0};
  
   im_data.subimage[0][0].ptr = im;
@@ -8151,17 +16234,150 @@ static bool se_load_theme_from_image(uint8_t* im, uint32_t im_w, uint32_t im_h){
     .data=              im_data,
   };
   gui_state.theme.image=  sg_make_image(&desc);
-  return true;
+}
+// Decoding and slicing a theme PNG takes hundreds of milliseconds, so the result is cached in the
+// pref path keyed by the hash of the file: the sliced regions followed by the GPU ready RGBA8
+// pixels of the non transparent tiles, which most of a theme sheet isn't.
+#define SE_THEME_CACHE_MAGIC 0x534b5448u // "SKTH"
+#define SE_THEME_CACHE_VERSION 1
+#define SE_THEME_CACHE_TILE 64
+typedef struct{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key; // Build and theme file
+  uint32_t im_w, im_h;
+  uint32_t version_code;
+  uint8_t palettes[5*4];
+  se_theme_region_t regions[SE_TOTAL_REGIONS];
+  uint32_t num_tiles; // Set entries of the tile mask that follows, then their pixels in order
+}se_theme_cache_header_t;
+static void se_theme_cache_path(char* path, uint64_t key){
+  const char* pref = se_get_pref_path();
+  size_t len = strlen(pref);
+  bool slash = len&&pref[len-1]!='/'&&pref[len-1]!='\\';
+  snprintf(path,SB_FILE_PATH_SIZE,"%s%stheme_cache_%016llx.bin",pref,slash?"/":"",(unsigned long long)key);
+}
+static uint64_t se_theme_cache_key(const uint8_t* file_data, size_t file_size){
+  return XXH3_64bits_withSeed(file_data,file_size,XXH3_64bits(GIT_COMMIT_HASH,strlen(GIT_COMMIT_HASH)));
+}
+static void se_save_theme_cache(uint64_t key, const uint8_t* im){
+  se_custom_theme_t* theme = &gui_state.theme;
+  uint32_t tiles_x = (theme->im_w+SE_THEME_CACHE_TILE-1)/SE_THEME_CACHE_TILE;
+  uint32_t tiles_y = (theme->im_h+SE_THEME_CACHE_TILE-1)/SE_THEME_CACHE_TILE;
+  se_theme_cache_header_t* header = (se_theme_cache_header_t*)calloc(1,sizeof(se_theme_cache_header_t));
+  uint8_t* mask = (uint8_t*)calloc(tiles_x*tiles_y,1);
+  if(!header||!mask){free(header);free(mask);return;}
+  header->magic = SE_THEME_CACHE_MAGIC;
+  header->version = SE_THEME_CACHE_VERSION;
+  header->key = key;
+  header->im_w = theme->im_w;
+  header->im_h = theme->im_h;
+  header->version_code = theme->version_code;
+  memcpy(header->palettes,theme->palettes,sizeof(header->palettes));
+  memcpy(header->regions,theme->regions,sizeof(header->regions));
+  for(uint32_t ty=0;ty<tiles_y;++ty)for(uint32_t tx=0;tx<tiles_x;++tx){
+    uint32_t x0 = tx*SE_THEME_CACHE_TILE, y0 = ty*SE_THEME_CACHE_TILE;
+    uint32_t w = SE_MIN_CONST(SE_THEME_CACHE_TILE,theme->im_w-x0), h = SE_MIN_CONST(SE_THEME_CACHE_TILE,theme->im_h-y0);
+    bool empty = true;
+    for(uint32_t y=0;y<h&&empty;++y){
+      const uint8_t* row = im+((size_t)(y0+y)*theme->im_w+x0)*4;
+      for(uint32_t x=0;x<w*4;++x)if(row[x]){empty=false;break;}
+    }
+    if(!empty){mask[tx+ty*tiles_x]=1;header->num_tiles++;}
+  }
+  char path[SB_FILE_PATH_SIZE];
+  se_theme_cache_path(path,key);
+  FILE* f = fopen(path,"wb");
+  if(!f){free(header);free(mask);return;}
+  bool success = fwrite(header,sizeof(*header),1,f)==1;
+  success&= fwrite(mask,1,tiles_x*tiles_y,f)==tiles_x*tiles_y;
+  for(uint32_t ty=0;ty<tiles_y;++ty)for(uint32_t tx=0;tx<tiles_x;++tx){
+    if(!mask[tx+ty*tiles_x])continue;
+    uint32_t x0 = tx*SE_THEME_CACHE_TILE, y0 = ty*SE_THEME_CACHE_TILE;
+    uint32_t w = SE_MIN_CONST(SE_THEME_CACHE_TILE,theme->im_w-x0), h = SE_MIN_CONST(SE_THEME_CACHE_TILE,theme->im_h-y0);
+    for(uint32_t y=0;y<h&&success;++y)success&= fwrite(im+((size_t)(y0+y)*theme->im_w+x0)*4,4,w,f)==w;
+  }
+  fclose(f);
+  free(header);
+  free(mask);
+  if(!success)remove(path);
+  se_emscripten_flush_fs(path);
+}
+// Restores the theme and returns its pixels (which the caller frees), NULL if there is no valid cache
+static uint8_t* se_load_theme_cache(uint64_t key){
+  char path[SB_FILE_PATH_SIZE];
+  se_theme_cache_path(path,key);
+  size_t size = 0;
+  bool mapped = true;
+  uint8_t* data = se_map_file_data(path,&size);
+  if(!data){
+    mapped = false;
+    data = sb_load_file_data(path,&size);
+  }
+  if(!data)return NULL;
+  uint8_t* im = NULL;
+  const se_theme_cache_header_t* header = (const se_theme_cache_header_t*)data;
+  bool valid = size>=sizeof(*header)&&header->magic==SE_THEME_CACHE_MAGIC&&header->version==SE_THEME_CACHE_VERSION&&
+               header->key==key&&header->im_w>0&&header->im_h>0&&header->im_w<=16384&&header->im_h<=16384;
+  uint32_t tiles_x = valid? (header->im_w+SE_THEME_CACHE_TILE-1)/SE_THEME_CACHE_TILE: 0;
+  uint32_t tiles_y = valid? (header->im_h+SE_THEME_CACHE_TILE-1)/SE_THEME_CACHE_TILE: 0;
+  valid&= size>=sizeof(*header)+tiles_x*tiles_y;
+  // Calloc keeps the skipped transparent tiles zero without touching them
+  if(valid)im = (uint8_t*)calloc((size_t)header->im_w*header->im_h,4);
+  if(im){
+    const uint8_t* mask = data+sizeof(*header);
+    const uint8_t* pixels = mask+tiles_x*tiles_y;
+    const uint8_t* end = data+size;
+    for(uint32_t ty=0;ty<tiles_y&&im;++ty)for(uint32_t tx=0;tx<tiles_x&&im;++tx){
+      if(!mask[tx+ty*tiles_x])continue;
+      uint32_t x0 = tx*SE_THEME_CACHE_TILE, y0 = ty*SE_THEME_CACHE_TILE;
+      uint32_t w = SE_MIN_CONST(SE_THEME_CACHE_TILE,header->im_w-x0), h = SE_MIN_CONST(SE_THEME_CACHE_TILE,header->im_h-y0);
+      if(end-pixels<(ptrdiff_t)w*h*4){free(im);im=NULL;break;}
+      for(uint32_t y=0;y<h;++y,pixels+=w*4)memcpy(im+((size_t)(y0+y)*header->im_w+x0)*4,pixels,w*4);
+    }
+    if(im&&pixels!=end){free(im);im=NULL;}
+  }
+  if(im){
+    se_custom_theme_t* theme = &gui_state.theme;
+    theme->im_w = header->im_w;
+    theme->im_h = header->im_h;
+    theme->version_code = header->version_code;
+    memcpy(theme->palettes,header->palettes,sizeof(theme->palettes));
+    memcpy(theme->regions,header->regions,sizeof(theme->regions));
+  }
+  if(mapped)se_unmap_file_data(data,size);
+  else free(data);
+  return im;
 }
 static bool se_load_theme_from_file(const char * filename){
   int im_w, im_h, im_c; 
   strncpy(gui_state.loaded_theme_path,filename,SB_FILE_PATH_SIZE);
-  uint8_t *imdata = stbi_load(filename, &im_w, &im_h, &im_c, 4);
+  size_t file_size = 0;
+  uint8_t* file_data = sb_load_file_data(filename,&file_size);
+  if(!file_data){
+    printf("Failed to open theme image %s\n",filename);
+    return false;
+  }
+  uint64_t key = se_theme_cache_key(file_data,file_size);
+  uint8_t* cached = se_load_theme_cache(key);
+  if(cached){
+    free(file_data);
+    se_upload_theme_image(cached,gui_state.theme.im_w,gui_state.theme.im_h);
+    free(cached);
+    printf("Successfully loaded theme: %s (cached)\n",filename);
+    return true;
+  }
+  uint8_t *imdata = stbi_load_from_memory(file_data, file_size, &im_w, &im_h, &im_c, 4);
+  free(file_data);
   if(!imdata){
     printf("Failed to open theme image %s\n",filename);
     return false;
   }
   bool ret = se_load_theme_from_image(imdata, im_w, im_h);
+  if(ret){
+    se_upload_theme_image(imdata, im_w, im_h);
+    se_save_theme_cache(key, imdata);
+  }
   stbi_image_free(imdata);
   if(ret){
     printf("Successfully loaded theme: %s\n",filename);
@@ -8170,30 +16386,60 @@ static bool se_load_theme_from_file(const char * filename){
 }
 static void se_init(){
   printf("SkyEmu %s\n",GIT_COMMIT_HASH);
+  se_advise_huge(&gui_instance,sizeof(gui_instance));
   stm_setup();
   se_load_settings();
   se_reset_cheats();
   gui_state.editing_cheat_index = -1;
   bool http_server_mode = false;
-  if(emu_state.cmd_line_arg_count >3&&strcmp("http_server",emu_state.cmd_line_args[1])==0){
+  if(gui_instance.emu_state.cmd_line_arg_count >3&&strcmp("http_server",gui_instance.emu_state.cmd_line_args[1])==0){
     gui_state.test_runner_mode=true;
-    gui_state.settings.http_control_server_port = atoi(emu_state.cmd_line_args[2]);
-    emu_state.cmd_line_arg_count =emu_state.cmd_line_arg_count-2;
-    emu_state.cmd_line_args =emu_state.cmd_line_args+2;
+    gui_state.settings.http_control_server_port = atoi(gui_instance.emu_state.cmd_line_args[2]);
+    gui_instance.emu_state.cmd_line_arg_count =gui_instance.emu_state.cmd_line_arg_count-2;
+    gui_instance.emu_state.cmd_line_args =gui_instance.emu_state.cmd_line_args+2;
     gui_state.settings.http_control_server_enable=true;
     http_server_mode=true;
     // HTTP Server mode only has frame stepping which is not allowed in hardcore mode.
     gui_state.settings.hardcore_mode = false; // TODO: this doesn't do much as it can be re-enabled
   } 
-  if(emu_state.cmd_line_arg_count>=2){
-    se_load_rom(emu_state.cmd_line_args[1]);
-    if(http_server_mode)emu_state.run_mode=SB_MODE_PAUSE;
+  if(gui_instance.emu_state.cmd_line_arg_count>=2){
+    se_load_rom(gui_instance.emu_state.cmd_line_args[1]);
+    if(http_server_mode)gui_instance.emu_state.run_mode=SB_MODE_PAUSE;
+  }
+  int netplay_delay = 1;
+  for(int i=2;i+1<gui_instance.emu_state.cmd_line_arg_count;++i){
+    const char* arg = gui_instance.emu_state.cmd_line_args[i];
+    const char* value = gui_instance.emu_state.cmd_line_args[i+1];
+    if(strcmp("--link",arg)==0)se_link_connect(value);
+    if(strcmp("--netplay-delay",arg)==0)netplay_delay=atoi(value);
+    if(strcmp("--netplay-host",arg)==0)se_netplay_start(atoi(value),NULL,0,netplay_delay);
+    if(strcmp("--netplay-join",arg)==0)se_netplay_join(value,netplay_delay);
+    if(strcmp("--spectate-host",arg)==0)se_spectate_start(atoi(value),NULL,0);
+    if(strcmp("--spectate",arg)==0)se_spectate_join(value);
+    if(strcmp("--record-movie",arg)==0)se_movie_record(value);
+    if(strcmp("--play-movie",arg)==0)se_movie_play(value);
+    if(strcmp("--record-video",arg)==0)se_video_record(value);
+#ifdef ENABLE_LUA_SCRIPTING
+    if(strcmp("--lua",arg)==0)se_lua_load_script(value);
+#endif
+#ifdef ENABLE_HTTP_CONTROL_SERVER
+    if(strcmp("--shm",arg)==0)se_shm_open(value);
+#endif
   }
 }
 static void init(void) {
   #if defined(EMSCRIPTEN)
   em_init_fs();
   #endif
+  trace_set_thread_name("Main");
+#ifdef ENABLE_HTTP_CONTROL_SERVER
+  hcs_set_unlocked_callback(se_hcs_unlocked_callback);
+#endif
+  static const char* async_names[JOB_POOL_NUM_ASYNC_QUEUES]={
+    "Rewind","Save State","Emulation","ROM Load","Save File","Video","Library","File Browser","Event Log","Execution Trace",
+    "ROM Stream","NDS ARM7","RA Hash","Spectate"
+  };
+  for(int i=0;i<JOB_POOL_NUM_ASYNC_QUEUES;++i)job_pool_set_async_name(i,async_names[i]);
   https_initialize();
   gui_state.overlay_open= true;
 #ifdef USE_SDL
@@ -8213,7 +16459,10 @@ static void init(void) {
 
   se_initialize_keybind(&gui_state.key);
   sg_setup(&(sg_desc){
-      .context = sapp_sgcontext()
+      .context = sapp_sgcontext(),
+      // Room for the stream images and the targets of their ghosting and upscaling passes
+      .image_pool_size = SE_STREAM_IMAGE_SLOTS*(SE_STREAM_IMAGE_BUFFERS+SE_MAX_SHADER_PASSES+2)+128,
+      .pass_pool_size = SE_STREAM_IMAGE_SLOTS*(SE_MAX_SHADER_PASSES+2)+16,
   });
   simgui_setup(&(simgui_desc_t){ .dpi_scale= se_dpi_scale()});
   se_init();
@@ -8224,59 +16473,41 @@ static void init(void) {
   };
   gui_state.last_touch_time=-10000;
   se_init_audio();
-  sg_push_debug_group("LCD Shader Init");
-
-  gui_state.lcd_prog = sg_make_shader(lcdprog_shader_desc(sg_query_backend()));
-  /* pipeline object for imgui rendering */
-  sg_pipeline_desc pip_desc={0};
-  pip_desc.layout.buffers[0].stride = 16;
-  {
-      sg_vertex_attr_desc* attr = &pip_desc.layout.attrs[0];
-      attr->offset =0;
-      attr->format = SG_VERTEXFORMAT_FLOAT2;
-  }
-  {
-      sg_vertex_attr_desc* attr = &pip_desc.layout.attrs[1];
-      attr->offset = 8;
-      attr->format = SG_VERTEXFORMAT_FLOAT2;
-  }
-  pip_desc.shader = gui_state.lcd_prog;
-  pip_desc.index_type = SG_INDEXTYPE_NONE;
-  pip_desc.colors[0].blend.enabled = false;
-  pip_desc.colors[0].blend.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA;
-  pip_desc.colors[0].blend.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA;
-  pip_desc.label = "lcd-pipeline";
-  gui_state.lcd_pipeline = sg_make_pipeline(&pip_desc);
-  printf("Built pipeline: %d\n",gui_state.lcd_pipeline.id);
-  static float quad_verts[6*4]={
-    0,0, 0,0,
-    1,0, 1,0,
-    1,1, 1,1,
-
-    1,1, 1,1,
-    0,1, 0,1,
-    0,0, 0,0,
-  };
-
-  sg_buffer_desc vb_desc={
-    .usage     = SG_USAGE_IMMUTABLE,
-    .data.size =sizeof(quad_verts),
-    .data.ptr  = quad_verts
-  };
-  gui_state.quad_vb = sg_make_buffer(&vb_desc);
-  sg_pop_debug_group();
 #ifdef SE_PLATFORM_ANDROID
   se_android_request_permissions();
   #endif
 }
 static void cleanup(void) {
+  se_join_emulation_thread();
+  // Writes out a movie that is still being recorded
+  se_movie_stop();
+  se_spectate_stop();
+  se_video_stop();
+  se_stop_event_log();
+  se_time_travel_stop();
+  sb_mem_search_free(&gui_state.mem_search);
+  // Writes the save of the linked console
+  se_link_disconnect();
+#ifdef ENABLE_HTTP_CONTROL_SERVER
+  se_shm_close();
+#endif
+  // Don't lose a save state that is still being written
+  se_flush_state_slot_writes();
+  job_pool_wait_async(SE_ASYNC_ROM_LOAD);
+  se_library_shutdown();
+  se_file_listing_shutdown();
+  // Write out the latest save changes
+  job_pool_wait_async(SE_ASYNC_SAVE_FILE);
+  se_sync_save_to_disk();
+  job_pool_wait_async(SE_ASYNC_SAVE_FILE);
   simgui_shutdown();
   se_free_all_images();
+  se_free_stream_images();
 #ifdef ENABLE_RETRO_ACHIEVEMENTS
   retro_achievements_shutdown();
 #endif
   sg_shutdown();
-  saudio_shutdown();
+  se_shutdown_audio();
 #ifdef USE_SDL
   SDL_Quit();
 #endif
@@ -8296,6 +16527,11 @@ static void emsc_load_callback(const sapp_html5_fetch_response* response) {
 #endif 
 static void event(const sapp_event* ev) {
   simgui_handle_event(ev);
+  gui_state.last_activity_time = se_time();
+  // Keys reach the UI through the hotkeys of the joypad, mouse moves only matter over the menu bar
+  bool lcd_only_event = ev->type==SAPP_EVENTTYPE_KEY_DOWN||ev->type==SAPP_EVENTTYPE_KEY_UP||
+    (ev->type==SAPP_EVENTTYPE_MOUSE_MOVE&&ev->mouse_y>=gui_state.screen_height*0.1);
+  if(!lcd_only_event)gui_state.ui_dirty = true;
   if (ev->type == SAPP_EVENTTYPE_FILES_DROPPED) {
     // get the number of files and their paths like this:
     const int num_dropped_files = sapp_get_num_dropped_files();
@@ -8315,15 +16551,18 @@ static void event(const sapp_event* ev) {
                   .user_data=rom_file});
     }
 #else
-        se_load_rom(sapp_get_dropped_file_path(0));
+        se_join_emulation_thread();
+        se_load_rom_in_background(sapp_get_dropped_file_path(0));
 #endif
     }
   }else if (ev->type == SAPP_EVENTTYPE_KEY_DOWN) {
     gui_state.button_state[ev->key_code] = true;
     gui_state.key.last_bind_activitiy = ev->key_code; 
+    if(gui_instance.emu_state.late_input)se_publish_late_input();
   }
   else if (ev->type == SAPP_EVENTTYPE_KEY_UP) {
     gui_state.button_state[ev->key_code] = false;
+    if(gui_instance.emu_state.late_input)se_publish_late_input();
   }else if(ev->type==SAPP_EVENTTYPE_TOUCHES_BEGAN||
     ev->type==SAPP_EVENTTYPE_TOUCHES_MOVED||
     ev->type==SAPP_EVENTTYPE_TOUCHES_ENDED||
@@ -8347,22 +16586,515 @@ static void event(const sapp_event* ev) {
   }
 }
 bool se_run_ar_cheat(const uint32_t* buffer, uint32_t size){
-  if(emu_state.system ==SYSTEM_GBA)return gba_run_ar_cheat(&core.gba, buffer, size);
-  if(emu_state.system ==SYSTEM_GB)return sb_run_ar_cheat(&core.gb, buffer, size);
-  if(emu_state.system ==SYSTEM_NDS)return nds_run_ar_cheat(&core.nds, buffer, size);
+  if(gui_instance.emu_state.system ==SYSTEM_GBA)return gba_run_ar_cheat(&gui_instance.core.gba, buffer, size);
+  if(gui_instance.emu_state.system ==SYSTEM_GB)return sb_run_ar_cheat(&gui_instance.core.gb, buffer, size);
+  if(gui_instance.emu_state.system ==SYSTEM_NDS)return nds_run_ar_cheat(&gui_instance.core.nds, buffer, size);
 
   return false;
 }
+se_cheat_compile_fn se_ar_cheat_compiler(){
+  // GB and NDS codes are stored unencrypted and run as entered
+  if(gui_instance.emu_state.system ==SYSTEM_GBA)return gba_compile_ar_cheat;
+  return NULL;
+}
 
 static void headless_mode(){
   //Leave here so the entry point still exists
 #ifdef ENABLE_HTTP_CONTROL_SERVER
   se_init();
   se_update_frame();
+  // Without a window the shared memory channel needs its own update loop, the HTTP commands
+  // interleave with it through the callback lock
+  while(se_shm.shm){
+    se_update_frame();
+    if(gui_instance.emu_state.run_mode!=SB_MODE_RUN)job_pool_sleep_ms(1);
+  }
   hcs_join_server_thread();
 #endif 
 }
 
+// Runs a ROM for a fixed number of frames as fast as possible without a window or audio device
+// and prints a JSON timing report. Usage: SkyEmu benchmark <rom> [--frames N] [--output report.json] [--movie input.semovie] [--audio 0]
+// --audio 0 measures the cores with sample synthesis skipped, as when nothing hears the output.
+// A movie supplies the input, and the length of the run unless --frames is given.
+static int se_benchmark_mode(const char* rom_path, int frames, const char* output_path, const char* movie_path, bool audio){
+  se_advise_huge(&gui_instance,sizeof(gui_instance));
+  stm_setup();
+  se_load_settings();
+  gui_state.settings.http_control_server_enable=false;
+  se_load_rom(rom_path);
+  if(!gui_instance.emu_state.rom_loaded){
+    printf("{\"error\":\"Failed to load ROM\"}\n");
+    return 1;
+  }
+  if(movie_path){
+    if(!se_movie_play(movie_path)){
+      printf("{\"error\":\"Failed to load movie\"}\n");
+      return 1;
+    }
+    if(frames<1)frames = se_movie.num_frames;
+  }
+  if(frames<1)frames = 3600;
+  se_begin_update_frame();
+  gui_instance.emu_state.render_frame = true;
+  gui_instance.emu_state.audio_disabled = !audio;
+  memset(&gui_instance.emu_state.profile,0,sizeof(gui_instance.emu_state.profile));
+  uint64_t core_ticks = 0, rewind_ticks = 0;
+  uint64_t start = stm_now();
+  for(int f=0;f<frames;++f){
+    uint64_t t = stm_now();
+    se_emulate_single_frame();
+    core_ticks+=stm_since(t);
+    // Nothing plays the audio so drain the ring to keep the cores synthesizing every sample
+    sb_ring_buffer_consume(&gui_instance.emu_state.audio_ring_buff,sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff));
+    if(f%SE_FRAMES_PER_REWIND_STATE==SE_FRAMES_PER_REWIND_STATE-1){
+      t = stm_now();
+      se_push_rewind_state(&gui_instance.core,&gui_instance.rewind_buffer,gui_instance.emu_state.system);
+      // Count the compression done on the rewind thread as well
+      job_pool_wait_async(SE_ASYNC_REWIND);
+      rewind_ticks+=stm_since(t);
+    }
+  }
+  double total_ns = stm_ns(stm_since(start));
+  int64_t desync_frame = se_movie.first_desync;
+  se_movie_stop();
+  // se_end_update_frame() starts a new profile window
+  sb_profile_t profile = gui_instance.emu_state.profile;
+  se_end_update_frame();
+
+  double per_frame = frames? 1.0/frames: 0;
+  double subsystem_ns[SB_PROFILE_COUNT];
+  double cpu_ns = stm_ns(core_ticks);
+  for(int i=0;i<SB_PROFILE_COUNT;++i){
+    subsystem_ns[i]=profile.ns[i];
+    cpu_ns-=subsystem_ns[i];
+  }
+  if(cpu_ns<0)cpu_ns=0;
+  // The emulator logs to stdout so the report can be sent to a file instead
+  FILE* out = output_path? fopen(output_path,"wb"): stdout;
+  if(!out){
+    printf("Failed to open %s\n",output_path);
+    return 1;
+  }
+  const char* system_names[]={"None","GB","GBA","NDS"};
+  fprintf(out,"{\n  \"rom\": \"");
+  for(const char*c=rom_path;*c;++c){
+    if(*c=='"'||*c=='\\')fputc('\\',out);
+    fputc(*c,out);
+  }
+  fprintf(out,"\",\n");
+  fprintf(out,"  \"system\": \"%s\",\n",gui_instance.emu_state.system<4?system_names[gui_instance.emu_state.system]:"Unknown");
+  fprintf(out,"  \"commit\": \"%s\",\n",GIT_COMMIT_HASH);
+  fprintf(out,"  \"frames\": %d,\n",frames);
+  fprintf(out,"  \"audio\": %s,\n",audio?"true":"false");
+  if(movie_path)fprintf(out,"  \"movie_desync_frame\": %lld,\n",(long long)desync_frame);
+  fprintf(out,"  \"host_seconds\": %f,\n",total_ns*1e-9);
+  fprintf(out,"  \"emulated_fps\": %f,\n",total_ns>0? frames/(total_ns*1e-9): 0.);
+  fprintf(out,"  \"ns_per_frame\": %.0f,\n",total_ns*per_frame);
+#ifdef SE_ENABLE_PROFILER
+  fprintf(out,"  \"profiler\": true,\n");
+#else
+  // Without the profiler everything in the core tick is reported as CPU time
+  fprintf(out,"  \"profiler\": false,\n");
+#endif
+  fprintf(out,"  \"subsystem_ns_per_frame\": {\n");
+  fprintf(out,"    \"cpu\": %.0f,\n",cpu_ns*per_frame);
+  fprintf(out,"    \"ppu\": %.0f,\n",subsystem_ns[SB_PROFILE_PPU]*per_frame);
+  fprintf(out,"    \"audio\": %.0f,\n",subsystem_ns[SB_PROFILE_AUDIO]*per_frame);
+  fprintf(out,"    \"dma\": %.0f,\n",subsystem_ns[SB_PROFILE_DMA]*per_frame);
+  fprintf(out,"    \"gx\": %.0f,\n",subsystem_ns[SB_PROFILE_GX]*per_frame);
+  fprintf(out,"    \"rewind\": %.0f\n",stm_ns(rewind_ticks)*per_frame);
+  fprintf(out,"  },\n");
+  fprintf(out,"  \"counters_per_frame\": {\n");
+  for(int i=0;i<SB_COUNTER_COUNT;++i){
+    fprintf(out,"    \"%s\": %.0f%s\n",se_counter_names[i],profile.counters[i]*per_frame,i+1==SB_COUNTER_COUNT?"":",");
+  }
+  fprintf(out,"  }\n}\n");
+  if(out!=stdout)fclose(out);
+  return 0;
+}
+// Plays a movie back without a window as fast as possible. Returns non zero if it desynced.
+// Usage: SkyEmu replay_movie <rom> <movie>
+static int se_replay_movie_mode(const char* rom_path, const char* movie_path){
+  stm_setup();
+  se_load_settings();
+  gui_state.settings.http_control_server_enable=false;
+  se_load_rom(rom_path);
+  if(!gui_instance.emu_state.rom_loaded)return 1;
+  se_begin_update_frame();
+  // The movie hashes don't cover the audio state
+  gui_instance.emu_state.audio_disabled = true;
+  if(!se_movie_play(movie_path))return 1;
+  uint64_t frames = se_movie.num_frames;
+  uint64_t start = stm_now();
+  while(se_movie.mode==SE_MOVIE_PLAY){
+    gui_instance.emu_state.render_frame = true;
+    se_emulate_single_frame();
+    sb_ring_buffer_consume(&gui_instance.emu_state.audio_ring_buff,sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff));
+  }
+  double seconds = stm_sec(stm_since(start));
+  printf("Replayed %llu frames in %f seconds (%f fps)\n",(unsigned long long)frames,seconds,seconds>0? frames/seconds: 0.);
+  return se_movie.first_desync>=0? 2: 0;
+}
+// Captures the video state of frames into a dump that skyemu_ppu_bench renders without the CPUs.
+// GBA dumps hold whole frames, NDS dumps the rasterized 3D buffer swaps.
+// Usage: SkyEmu frame_dump <rom> <output.sefd> [--skip N] [--frames N] [--movie input.semovie]
+// skip frames are emulated first, a movie supplies the input to reach the part of the game to capture.
+static int se_frame_dump_mode(const char* rom_path, const char* output_path, int skip, int frames, const char* movie_path){
+  stm_setup();
+  se_load_settings();
+  gui_state.settings.http_control_server_enable=false;
+  se_load_rom(rom_path);
+  if(!gui_instance.emu_state.rom_loaded){
+    printf("Failed to load ROM %s\n",rom_path);
+    return 1;
+  }
+  if(movie_path&&!se_movie_play(movie_path)){
+    printf("Failed to load movie %s\n",movie_path);
+    return 1;
+  }
+  if(frames<1)frames = 60;
+  se_begin_update_frame();
+  gui_instance.emu_state.render_frame = true;
+  for(int f=0;f<skip;++f){
+    se_emulate_single_frame();
+    sb_ring_buffer_consume(&gui_instance.emu_state.audio_ring_buff,sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff));
+  }
+  int system = gui_instance.emu_state.system;
+  void* core = system==SYSTEM_GBA? (void*)&gui_instance.core.gba: (void*)&gui_instance.core.nds;
+  sb_frame_dump_t dump;
+  if(!sb_frame_dump_init(&dump,system,core,frames)){
+    sb_frame_dump_free(&dump);
+    return 1;
+  }
+  sb_video_capture_t capture = {sb_frame_dump_sync,&dump};
+  gui_instance.emu_state.video_capture = &capture;
+  // Games that don't use the 3D engine never swap, give up after a while
+  int max_emulated = frames*8+2;
+  for(int f=0;f<max_emulated&&dump.header.num_frames<(uint32_t)frames&&!dump.failed;++f){
+    se_emulate_single_frame();
+    sb_ring_buffer_consume(&gui_instance.emu_state.audio_ring_buff,sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff));
+  }
+  gui_instance.emu_state.video_capture = NULL;
+  se_movie_stop();
+  se_end_update_frame();
+  bool ok = sb_frame_dump_finish(&dump);
+  if(ok){
+    FILE* f = fopen(output_path,"wb");
+    ok = f&&fwrite(dump.data,1,dump.size,f)==dump.size;
+    if(f)fclose(f);
+    if(!ok)printf("Failed to write %s\n",output_path);
+  }
+  uint32_t captured = dump.header.num_frames;
+  if(ok)printf("Captured %u frames (%zu bytes) to %s\n",captured,dump.size,output_path);
+  if(ok&&!captured)printf("No frames were rendered while capturing\n");
+  sb_frame_dump_free(&dump);
+  return ok&&captured? 0: 1;
+}
+
+// Hash logs store a hash of every region of the emulated state after each frame so two builds
+// can be checked for identical behavior over a run. Only guest visible state is hashed: the CPUs
+// through their canonical registers (lazy flags applied), the memories and the output
+// framebuffers, never host pointers, caches, perf counters or debug buffers.
+// Usage: SkyEmu hash_log <rom> <output.sehl> [--frames N] [--movie input.semovie]
+//        SkyEmu compare_hash_logs <a.sehl> <b.sehl>
+#define SE_HASH_LOG_MAGIC "SEHL"
+#define SE_HASH_LOG_VERSION 1
+#define SE_HASH_LOG_MAX_REGIONS 16
+typedef struct{
+  char magic[4];
+  uint32_t version;
+  uint32_t system;
+  uint32_t num_regions;
+  char region_names[SE_HASH_LOG_MAX_REGIONS][16];
+  uint64_t num_frames;
+}se_hash_log_header_t;
+typedef struct{
+  const char* name;
+  const void* data;
+  size_t size;
+}se_hash_region_t;
+typedef struct{
+  uint32_t arm9[37];
+  uint32_t arm7[37];
+  uint16_t gb[10];
+}se_hash_log_scratch_t;
+static int se_hash_log_regions(se_core_state_t* core, int system, se_hash_region_t* r, se_hash_log_scratch_t* scratch){
+  int n = 0;
+  #define SE_HASH_REGION(NAME,DATA,SIZE) r[n++]=(se_hash_region_t){NAME,DATA,SIZE}
+  if(system==SYSTEM_GB){
+    sb_gb_t* gb = &core->gb;
+    uint16_t regs[10]={gb->cpu.af,gb->cpu.bc,gb->cpu.de,gb->cpu.hl,gb->cpu.sp,gb->cpu.pc,
+                       gb->cpu.interrupt_enable,gb->cpu.deferred_interrupt_enable,gb->cpu.wait_for_interrupt,gb->cpu.halt_bug};
+    memcpy(scratch->gb,regs,sizeof(regs));
+    SE_HASH_REGION("cpu",scratch->gb,sizeof(scratch->gb));
+    SE_HASH_REGION("mem",gb->mem.data,sizeof(gb->mem.data));
+    SE_HASH_REGION("wram",gb->mem.wram,sizeof(gb->mem.wram));
+    SE_HASH_REGION("vram",gb->lcd.vram,sizeof(gb->lcd.vram));
+    SE_HASH_REGION("palette",gb->lcd.color_palettes,sizeof(gb->lcd.color_palettes));
+    SE_HASH_REGION("cart_ram",gb->cart.ram_data,sizeof(gb->cart.ram_data));
+    SE_HASH_REGION("framebuffer",gb->lcd.framebuffer,SB_LCD_W*SB_LCD_H*4);
+  }else if(system==SYSTEM_GBA){
+    gba_t* gba = &core->gba;
+    arm7_get_registers(&gba->cpu,scratch->arm7);
+    SE_HASH_REGION("cpu",scratch->arm7,sizeof(scratch->arm7));
+    SE_HASH_REGION("wram0",gba->mem.wram0,sizeof(gba->mem.wram0));
+    SE_HASH_REGION("wram1",gba->mem.wram1,sizeof(gba->mem.wram1));
+    SE_HASH_REGION("io",gba->mem.io,sizeof(gba->mem.io));
+    SE_HASH_REGION("palette",gba->mem.palette,sizeof(gba->mem.palette));
+    SE_HASH_REGION("vram",gba->mem.vram,sizeof(gba->mem.vram));
+    SE_HASH_REGION("oam",gba->mem.oam,sizeof(gba->mem.oam));
+    SE_HASH_REGION("cart_backup",gba->mem.cart_backup,sizeof(gba->mem.cart_backup));
+    SE_HASH_REGION("framebuffer",gba->framebuffer,GBA_LCD_W*GBA_LCD_H*4);
+  }else if(system==SYSTEM_NDS){
+    nds_t* nds = &core->nds;
+    arm7_get_registers(&nds->arm9,scratch->arm9);
+    arm7_get_registers(&nds->arm7,scratch->arm7);
+    SE_HASH_REGION("arm9",scratch->arm9,sizeof(scratch->arm9));
+    SE_HASH_REGION("arm7",scratch->arm7,sizeof(scratch->arm7));
+    SE_HASH_REGION("ram",nds->mem.ram,sizeof(nds->mem.ram));
+    SE_HASH_REGION("wram",nds->mem.wram,sizeof(nds->mem.wram));
+    SE_HASH_REGION("code_tcm",nds->mem.code_tcm,sizeof(nds->mem.code_tcm));
+    SE_HASH_REGION("data_tcm",nds->mem.data_tcm,sizeof(nds->mem.data_tcm));
+    SE_HASH_REGION("io",nds->mem.io,sizeof(nds->mem.io));
+    SE_HASH_REGION("palette",nds->mem.palette,sizeof(nds->mem.palette));
+    SE_HASH_REGION("vram",nds->mem.vram,sizeof(nds->mem.vram));
+    SE_HASH_REGION("oam",nds->mem.oam,sizeof(nds->mem.oam));
+    SE_HASH_REGION("framebuffer_top",nds->framebuffer_top,NDS_LCD_W*NDS_LCD_H*4);
+    SE_HASH_REGION("framebuffer_bottom",nds->framebuffer_bottom,NDS_LCD_W*NDS_LCD_H*4);
+  }
+  #undef SE_HASH_REGION
+  return n;
+}
+static int se_hash_log_mode(const char* rom_path, const char* output_path, int frames, const char* movie_path){
+  stm_setup();
+  se_load_settings();
+  gui_state.settings.http_control_server_enable=false;
+  se_load_rom(rom_path);
+  if(!gui_instance.emu_state.rom_loaded){
+    printf("Failed to load ROM %s\n",rom_path);
+    return 1;
+  }
+  if(movie_path){
+    if(!se_movie_play(movie_path)){
+      printf("Failed to load movie %s\n",movie_path);
+      return 1;
+    }
+    if(frames<1)frames = se_movie.num_frames;
+  }
+  if(frames<1)frames = 3600;
+  FILE* f = fopen(output_path,"wb");
+  if(!f){
+    printf("Failed to open %s\n",output_path);
+    return 1;
+  }
+  se_hash_log_scratch_t scratch;
+  se_hash_region_t regions[SE_HASH_LOG_MAX_REGIONS];
+  se_hash_log_header_t header={0};
+  memcpy(header.magic,SE_HASH_LOG_MAGIC,sizeof(header.magic));
+  header.version = SE_HASH_LOG_VERSION;
+  header.system = gui_instance.emu_state.system;
+  header.num_regions = se_hash_log_regions(&gui_instance.core,header.system,regions,&scratch);
+  for(uint32_t i=0;i<header.num_regions;++i)strncpy(header.region_names[i],regions[i].name,sizeof(header.region_names[i])-1);
+  bool ok = fwrite(&header,sizeof(header),1,f)==1;
+  se_begin_update_frame();
+  uint64_t hashes[SE_HASH_LOG_MAX_REGIONS];
+  for(int frame=0;frame<frames&&ok;++frame){
+    gui_instance.emu_state.render_frame = true;
+    se_emulate_single_frame();
+    sb_ring_buffer_consume(&gui_instance.emu_state.audio_ring_buff,sb_ring_buffer_size(&gui_instance.emu_state.audio_ring_buff));
+    se_hash_log_regions(&gui_instance.core,header.system,regions,&scratch);
+    for(uint32_t i=0;i<header.num_regions;++i)hashes[i]=XXH3_64bits(regions[i].data,regions[i].size);
+    ok = fwrite(hashes,sizeof(uint64_t),header.num_regions,f)==header.num_regions;
+    header.num_frames++;
+  }
+  se_movie_stop();
+  se_end_update_frame();
+  // The frame count goes in last so an interrupted run still describes the frames it wrote
+  ok = ok&&fseek(f,0,SEEK_SET)==0&&fwrite(&header,sizeof(header),1,f)==1;
+  fclose(f);
+  if(!ok){
+    printf("Failed to write %s\n",output_path);
+    return 1;
+  }
+  printf("Hashed %llu frames to %s\n",(unsigned long long)header.num_frames,output_path);
+  return 0;
+}
+static FILE* se_open_hash_log(const char* path, se_hash_log_header_t* header){
+  FILE* f = fopen(path,"rb");
+  bool ok = f&&fread(header,sizeof(*header),1,f)==1;
+  ok = ok&&memcmp(header->magic,SE_HASH_LOG_MAGIC,sizeof(header->magic))==0;
+  ok = ok&&header->version==SE_HASH_LOG_VERSION&&header->num_regions<=SE_HASH_LOG_MAX_REGIONS;
+  if(!ok){
+    printf("%s is not a hash log\n",path);
+    if(f)fclose(f);
+    return NULL;
+  }
+  for(uint32_t i=0;i<header->num_regions;++i)header->region_names[i][sizeof(header->region_names[i])-1]='\0';
+  return f;
+}
+// Every frame is logged so a linear scan finds the exact first frame that diverged.
+// Returns 0 if the logs match, 2 if they diverge and 1 if they couldn't be compared.
+static int se_compare_hash_logs_mode(const char* path_a, const char* path_b){
+  se_hash_log_header_t a, b;
+  FILE* fa = se_open_hash_log(path_a,&a);
+  FILE* fb = fa? se_open_hash_log(path_b,&b): NULL;
+  if(!fb){
+    if(fa)fclose(fa);
+    return 1;
+  }
+  int ret = 0;
+  bool same_layout = a.system==b.system&&a.num_regions==b.num_regions;
+  for(uint32_t i=0;same_layout&&i<a.num_regions;++i)same_layout = strcmp(a.region_names[i],b.region_names[i])==0;
+  if(!same_layout){
+    printf("The logs were recorded with different systems or regions\n");
+    ret = 1;
+  }
+  uint64_t frames = a.num_frames<b.num_frames? a.num_frames: b.num_frames;
+  uint64_t hash_a[SE_HASH_LOG_MAX_REGIONS], hash_b[SE_HASH_LOG_MAX_REGIONS];
+  for(uint64_t frame=0;frame<frames&&!ret;++frame){
+    if(fread(hash_a,sizeof(uint64_t),a.num_regions,fa)!=a.num_regions||
+       fread(hash_b,sizeof(uint64_t),b.num_regions,fb)!=b.num_regions){
+      printf("The logs end before frame %llu\n",(unsigned long long)frame);
+      ret = 1;
+      break;
+    }
+    if(memcmp(hash_a,hash_b,sizeof(uint64_t)*a.num_regions)==0)continue;
+    printf("First divergence at frame %llu in:",(unsigned long long)frame);
+    for(uint32_t i=0;i<a.num_regions;++i)if(hash_a[i]!=hash_b[i])printf(" %s",a.region_names[i]);
+    printf("\n");
+    ret = 2;
+  }
+  if(!ret){
+    printf("The logs match for %llu frames\n",(unsigned long long)frames);
+    if(a.num_frames!=b.num_frames)printf("%s has %llu frames and %s has %llu\n",path_a,(unsigned long long)a.num_frames,path_b,(unsigned long long)b.num_frames);
+  }
+  fclose(fa);
+  fclose(fb);
+  return ret;
+}
+
+typedef struct{
+  char rom_path[SB_FILE_PATH_SIZE];
+  char expected_path[SB_FILE_PATH_SIZE];
+  char actual_path[SB_FILE_PATH_SIZE];
+  uint64_t expected_hash;
+  uint64_t actual_hash;
+  bool loaded;
+  bool has_expected;
+  bool passed;
+}se_test_case_t;
+typedef struct{
+  se_test_case_t* cases;
+  int frames;
+  bool update;
+  // The BIOS and log helpers used while loading a ROM write to shared buffers
+  mutex_t load_mutex;
+}se_test_suite_t;
+static uint64_t se_hash_framebuffer(const uint8_t* data, int width, int height){
+  return XXH3_64bits(data,(size_t)width*height*4);
+}
+static void se_run_test_case(void* user_data, int job_index){
+  se_test_suite_t* suite = (se_test_suite_t*)user_data;
+  se_test_case_t* test = suite->cases+job_index;
+  se_instance_t* inst = se_instance_create();
+  uint8_t* screenshot = (uint8_t*)malloc(SE_MAX_SCREENSHOT_SIZE);
+  if(!inst||!screenshot){
+    free(screenshot);
+    se_instance_destroy(inst);
+    return;
+  }
+  // Same settings as the single ROM test runner
+  inst->emu_state.nds_cpu_slice_cycles = 1;
+  inst->emu_state.audio_disabled = true;
+  mutex_lock(suite->load_mutex);
+  test->loaded = se_instance_load_rom(inst,test->rom_path);
+  mutex_unlock(suite->load_mutex);
+  if(test->loaded){
+    for(int f=0;f<suite->frames;++f){
+      se_instance_run_frame(inst,NULL);
+      sb_ring_buffer_consume(&inst->emu_state.audio_ring_buff,sb_ring_buffer_size(&inst->emu_state.audio_ring_buff));
+    }
+    int width=0, height=0;
+    se_instance_screenshot(inst,screenshot,&width,&height);
+    test->actual_hash = se_hash_framebuffer(screenshot,width,height);
+    int im_w=0, im_h=0, im_c=0;
+    uint8_t* expected = suite->update? NULL: stbi_load(test->expected_path,&im_w,&im_h,&im_c,4);
+    if(expected){
+      test->has_expected = true;
+      test->expected_hash = se_hash_framebuffer(expected,im_w,im_h);
+      test->passed = im_w==width&&im_h==height&&test->expected_hash==test->actual_hash;
+      stbi_image_free(expected);
+    }
+    const char* write_path = suite->update? test->expected_path: test->passed? NULL: test->actual_path;
+    if(write_path&&!stbi_write_png(write_path,width,height,4,screenshot,width*4))printf("Failed to write %s\n",write_path);
+  }
+  free(screenshot);
+  se_instance_destroy(inst);
+}
+static int se_compare_test_cases(const void* a, const void* b){
+  return strcmp(((const se_test_case_t*)a)->rom_path,((const se_test_case_t*)b)->rom_path);
+}
+// Runs every ROM in rom_dir for the given number of frames on the job pool and compares the last
+// frame against <screenshot_dir>/<rom name>.png. Failing frames are written next to the expected
+// ones as <rom name>.actual.png, update rewrites the expected screenshots instead.
+static int se_test_suite_mode(const char* rom_dir, const char* screenshot_dir, int frames, bool update){
+  stm_setup();
+  se_load_settings();
+  tinydir_dir dir;
+  if(tinydir_open(&dir,rom_dir)==-1){
+    printf("Failed to open ROM directory %s\n",rom_dir);
+    return 1;
+  }
+  const char* rom_exts[]={".gb",".gbc",".gba",".nds",".ndsz",".zip"};
+  int num_cases = 0, capacity = 0;
+  se_test_case_t* cases = NULL;
+  while(dir.has_next){
+    tinydir_file file;
+    tinydir_readfile(&dir,&file);
+    tinydir_next(&dir);
+    if(file.is_dir)continue;
+    bool is_rom = false;
+    for(int i=0;i<sizeof(rom_exts)/sizeof(rom_exts[0]);++i)is_rom|=sb_path_has_file_ext(file.name,rom_exts[i]);
+    if(!is_rom)continue;
+    if(num_cases==capacity){
+      capacity = capacity? capacity*2: 64;
+      cases = (se_test_case_t*)realloc(cases,capacity*sizeof(se_test_case_t));
+    }
+    se_test_case_t* test = cases+num_cases++;
+    memset(test,0,sizeof(se_test_case_t));
+    strncpy(test->rom_path,file.path,SB_FILE_PATH_SIZE-1);
+    const char* base, *name, *ext;
+    sb_breakup_path(file.path,&base,&name,&ext);
+    se_join_path(test->expected_path,SB_FILE_PATH_SIZE,screenshot_dir,name,".png");
+    se_join_path(test->actual_path,SB_FILE_PATH_SIZE,screenshot_dir,name,".actual.png");
+  }
+  tinydir_close(&dir);
+  if(num_cases)qsort(cases,num_cases,sizeof(se_test_case_t),se_compare_test_cases);
+
+  se_test_suite_t suite = {.cases = cases, .frames = frames, .update = update, .load_mutex = mutex_create()};
+  uint64_t start = stm_now();
+  job_pool_run(se_run_test_case,&suite,num_cases);
+  double seconds = stm_sec(stm_since(start));
+  mutex_destroy(suite.load_mutex);
+
+  int passed = 0, failed = 0;
+  for(int i=0;i<num_cases;++i){
+    se_test_case_t* test = cases+i;
+    const char* result = "PASS";
+    if(!test->loaded)result = "LOAD FAILED";
+    else if(update)result = "UPDATED";
+    else if(!test->has_expected)result = "NO SCREENSHOT";
+    else if(!test->passed)result = "FAIL";
+    if(test->passed||(update&&test->loaded))++passed;
+    else ++failed;
+    printf("%-13s %016llx %s\n",result,(unsigned long long)test->actual_hash,test->rom_path);
+  }
+  printf("%d/%d passed in %.2f seconds\n",passed,num_cases,seconds);
+  free(cases);
+  return failed? 1: 0;
+}
+
 #ifdef SE_PLATFORM_ANDROID
 void Java_com_sky_SkyEmu_EnhancedNativeActivity_se_1android_1load_1rom(JNIEnv *env, jobject thiz, jstring filePath) {
     const char *nativeFilePath = (*env)->GetStringUTFChars(env, filePath, 0);
@@ -8378,25 +17110,75 @@ void Java_com_sky_SkyEmu_EnhancedNativeActivity_se_1android_1load_1file(JNIEnv *
 #endif
 
 sapp_desc sokol_main(int argc, char* argv[]) {
-  emu_state.cmd_line_arg_count =argc;
-  emu_state.cmd_line_args =argv;
+  se_instance_init(&gui_instance);
+  gui_instance.job_dispatch = se_job_dispatch;
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+  gui_instance.job_start = se_job_start;
+#endif
+  gui_instance.emu_state.cmd_line_arg_count =argc;
+  gui_instance.emu_state.cmd_line_args =argv;
   int width = 1280;
   int height = 800;
   if(argc>2&&strcmp("run_gb_test",argv[1])==0){
     gui_state.test_runner_mode=true;
-    emu_state.cmd_line_arg_count =argc-1;
-    emu_state.cmd_line_args =argv+1;
+    gui_instance.emu_state.cmd_line_arg_count =argc-1;
+    gui_instance.emu_state.cmd_line_args =argv+1;
     width = SB_LCD_W;
     height= SB_LCD_H;
   }
   if(argc>2&&strcmp("run_gba_test",argv[1])==0){
     gui_state.test_runner_mode=true;
-    emu_state.cmd_line_arg_count =argc-1;
-    emu_state.cmd_line_args =argv+1;
+    gui_instance.emu_state.cmd_line_arg_count =argc-1;
+    gui_instance.emu_state.cmd_line_args =argv+1;
     width = GBA_LCD_W;
     height= GBA_LCD_H;
   } 
-  if(emu_state.cmd_line_arg_count >3&&strcmp("http_server",emu_state.cmd_line_args[1])==0)headless_mode();
+  if(gui_instance.emu_state.cmd_line_arg_count >3&&strcmp("http_server",gui_instance.emu_state.cmd_line_args[1])==0)headless_mode();
+  if(argc>2&&strcmp("benchmark",argv[1])==0){
+    int frames = 0;
+    const char* output_path = NULL;
+    const char* movie_path = NULL;
+    bool audio = true;
+    for(int i=3;i+1<argc;++i){
+      if(strcmp("--frames",argv[i])==0)frames=atoi(argv[i+1]);
+      if(strcmp("--output",argv[i])==0)output_path=argv[i+1];
+      if(strcmp("--movie",argv[i])==0)movie_path=argv[i+1];
+      if(strcmp("--audio",argv[i])==0)audio=atoi(argv[i+1])!=0;
+    }
+    exit(se_benchmark_mode(argv[2],frames,output_path,movie_path,audio));
+  }
+  if(argc>3&&strcmp("compress_rom",argv[1])==0)exit(se_ndsz_compress_mode(argv[2],argv[3]));
+  if(argc>3&&strcmp("replay_movie",argv[1])==0)exit(se_replay_movie_mode(argv[2],argv[3]));
+  if(argc>3&&strcmp("frame_dump",argv[1])==0){
+    int skip = 0, frames = 60;
+    const char* movie_path = NULL;
+    for(int i=4;i+1<argc;++i){
+      if(strcmp("--skip",argv[i])==0)skip=atoi(argv[++i]);
+      else if(strcmp("--frames",argv[i])==0)frames=atoi(argv[++i]);
+      else if(strcmp("--movie",argv[i])==0)movie_path=argv[++i];
+    }
+    exit(se_frame_dump_mode(argv[2],argv[3],skip,frames,movie_path));
+  }
+  if(argc>3&&strcmp("hash_log",argv[1])==0){
+    int frames = 0;
+    const char* movie_path = NULL;
+    for(int i=4;i+1<argc;++i){
+      if(strcmp("--frames",argv[i])==0)frames=atoi(argv[++i]);
+      else if(strcmp("--movie",argv[i])==0)movie_path=argv[++i];
+    }
+    exit(se_hash_log_mode(argv[2],argv[3],frames,movie_path));
+  }
+  if(argc>3&&strcmp("compare_hash_logs",argv[1])==0)exit(se_compare_hash_logs_mode(argv[2],argv[3]));
+  if(argc>3&&strcmp("run_test_suite",argv[1])==0){
+    int frames = 600;
+    bool update = false;
+    for(int i=4;i<argc;++i){
+      if(strcmp("--frames",argv[i])==0&&i+1<argc)frames=atoi(argv[++i]);
+      else if(strcmp("--update",argv[i])==0)update=true;
+    }
+    if(frames<1)frames=1;
+    exit(se_test_suite_mode(argv[2],argv[3],frames,update));
+  }
 
   #ifdef SE_PLATFORM_IOS
   se_ios_set_documents_working_directory();
@@ -0,0 +1,172 @@
+#ifndef MEM_SEARCH_H
+#define MEM_SEARCH_H 1
+
+#include "sb_types.h"
+
+// RAM search for finding cheat addresses. A search keeps a snapshot of a memory region and a bitset
+// of the offsets that are still candidates. Every filter compares the memory against the snapshot
+// (or a value) 16 bytes at a time and clears the candidates that don't match, then takes the new
+// snapshot. The bitset has one bit per byte so a vector compare mask applies to it directly, only
+// the bit of the first byte of each element of the search width is ever set.
+#if defined(SB_SIMD_WASM)
+#elif defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&_M_IX86_FP>=2)
+#include <emmintrin.h>
+#define SB_MEM_SEARCH_SSE2 1
+#elif defined(__aarch64__)||defined(_M_ARM64)
+#include <arm_neon.h>
+#define SB_MEM_SEARCH_NEON 1
+#endif
+
+// Comparisons are unsigned, current value on the left
+#define SB_MEM_SEARCH_EQUAL 0
+#define SB_MEM_SEARCH_NOT_EQUAL 1
+#define SB_MEM_SEARCH_GREATER 2
+#define SB_MEM_SEARCH_LESS 3
+
+typedef struct{
+  uint8_t* snapshot;    // Padded with zeros to a multiple of 16 bytes
+  uint16_t* candidates; // Bit n of word b is set while offset b*16+n is a candidate
+  uint32_t size;
+  uint32_t blocks;
+  uint32_t width;       // 1, 2 or 4 bytes, elements are aligned to it
+  uint32_t num_candidates;
+}sb_mem_search_t;
+
+static FORCE_INLINE uint32_t sb_mem_search_popcount16(uint32_t v){
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcount(v);
+#else
+  v = v-((v>>1)&0x5555);
+  v = (v&0x3333)+((v>>2)&0x3333);
+  v = (v+(v>>4))&0x0f0f;
+  return (v+(v>>8))&0x1f;
+#endif
+}
+// Bits of the first byte of each element in a 16 byte block
+static FORCE_INLINE uint32_t sb_mem_search_lane_mask(uint32_t width){
+  return width==4? 0x1111: width==2? 0x5555: 0xffff;
+}
+// Byte mask of the elements of cur that compare true against ref
+static FORCE_INLINE uint32_t sb_mem_search_compare(const uint8_t* cur, const uint8_t* ref, uint32_t width, int op){
+#if defined(SB_MEM_SEARCH_SSE2)
+  __m128i a = _mm_loadu_si128((const __m128i*)cur);
+  __m128i b = _mm_loadu_si128((const __m128i*)ref);
+  __m128i m;
+  if(op==SB_MEM_SEARCH_EQUAL||op==SB_MEM_SEARCH_NOT_EQUAL){
+    m = width==1? _mm_cmpeq_epi8(a,b): width==2? _mm_cmpeq_epi16(a,b): _mm_cmpeq_epi32(a,b);
+  }else{
+    // SSE2 only has signed compares, flipping the sign bits makes them unsigned
+    __m128i bias = width==1? _mm_set1_epi8((char)0x80): width==2? _mm_set1_epi16((short)0x8000): _mm_set1_epi32((int)0x80000000);
+    a = _mm_xor_si128(a,bias);
+    b = _mm_xor_si128(b,bias);
+    if(op==SB_MEM_SEARCH_LESS){__m128i t = a; a = b; b = t;}
+    m = width==1? _mm_cmpgt_epi8(a,b): width==2? _mm_cmpgt_epi16(a,b): _mm_cmpgt_epi32(a,b);
+  }
+  uint32_t mask = _mm_movemask_epi8(m);
+#elif defined(SB_MEM_SEARCH_NEON)
+  uint8x16_t a = vld1q_u8(cur), b = vld1q_u8(ref), m;
+  if(op==SB_MEM_SEARCH_LESS){uint8x16_t t = a; a = b; b = t;}
+  bool eq = op==SB_MEM_SEARCH_EQUAL||op==SB_MEM_SEARCH_NOT_EQUAL;
+  if(width==1)m = eq? vceqq_u8(a,b): vcgtq_u8(a,b);
+  else if(width==2){
+    uint16x8_t a16 = vreinterpretq_u16_u8(a), b16 = vreinterpretq_u16_u8(b);
+    m = vreinterpretq_u8_u16(eq? vceqq_u16(a16,b16): vcgtq_u16(a16,b16));
+  }else{
+    uint32x4_t a32 = vreinterpretq_u32_u8(a), b32 = vreinterpretq_u32_u8(b);
+    m = vreinterpretq_u8_u32(eq? vceqq_u32(a32,b32): vcgtq_u32(a32,b32));
+  }
+  static const uint8_t bits[16]={1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+  m = vandq_u8(m,vld1q_u8(bits));
+  uint32_t mask = vaddv_u8(vget_low_u8(m))|(vaddv_u8(vget_high_u8(m))<<8);
+#elif defined(SB_SIMD_WASM)
+  v128_t a = wasm_v128_load(cur), b = wasm_v128_load(ref), m;
+  if(op==SB_MEM_SEARCH_LESS){v128_t t = a; a = b; b = t;}
+  bool eq = op==SB_MEM_SEARCH_EQUAL||op==SB_MEM_SEARCH_NOT_EQUAL;
+  if(width==1)m = eq? wasm_i8x16_eq(a,b): wasm_u8x16_gt(a,b);
+  else if(width==2)m = eq? wasm_i16x8_eq(a,b): wasm_u16x8_gt(a,b);
+  else m = eq? wasm_i32x4_eq(a,b): wasm_u32x4_gt(a,b);
+  uint32_t mask = wasm_i8x16_bitmask(m);
+#else
+  uint32_t mask = 0;
+  for(uint32_t i=0;i<16;i+=width){
+    uint32_t x = 0, y = 0;
+    memcpy(&x,cur+i,width);
+    memcpy(&y,ref+i,width);
+    bool hit = op==SB_MEM_SEARCH_GREATER? x>y: op==SB_MEM_SEARCH_LESS? x<y: x==y;
+    if(hit)mask|=((1u<<width)-1)<<i;
+  }
+#endif
+  return op==SB_MEM_SEARCH_NOT_EQUAL? mask^0xffff: mask;
+}
+static void sb_mem_search_free(sb_mem_search_t* s){
+  free(s->snapshot);
+  free(s->candidates);
+  memset(s,0,sizeof(*s));
+}
+// Every aligned element of the region becomes a candidate
+static bool sb_mem_search_start(sb_mem_search_t* s, const uint8_t* data, uint32_t size, uint32_t width){
+  sb_mem_search_free(s);
+  if(width!=1&&width!=2&&width!=4)return false;
+  uint32_t blocks = (size+15)/16;
+  s->snapshot = (uint8_t*)calloc(blocks,16);
+  s->candidates = (uint16_t*)malloc(blocks*sizeof(uint16_t));
+  if(!s->snapshot||!s->candidates){
+    sb_mem_search_free(s);
+    return false;
+  }
+  memcpy(s->snapshot,data,size);
+  s->size = size;
+  s->blocks = blocks;
+  s->width = width;
+  uint32_t lanes = sb_mem_search_lane_mask(width);
+  for(uint32_t b=0;b<blocks;++b)s->candidates[b]=lanes;
+  // Drop the elements that would extend past the end of the region
+  for(uint32_t off=size&~(width-1);off<blocks*16;off+=width)s->candidates[off/16]&=~(1u<<(off%16));
+  s->num_candidates = size/width;
+  return true;
+}
+// Keeps the candidates whose current value compares true with op against the snapshot, or against
+// value if use_value is set. data must hold the same region the search was started on.
+static void sb_mem_search_filter(sb_mem_search_t* s, const uint8_t* data, int op, bool use_value, uint32_t value){
+  uint8_t ref[16];
+  for(uint32_t i=0;i<16;i+=s->width)memcpy(ref+i,&value,s->width);
+  uint32_t count = 0;
+  uint32_t full_blocks = s->size/16;
+  for(uint32_t b=0;b<s->blocks;++b){
+    uint8_t* snapshot = s->snapshot+b*16;
+    const uint8_t* cur = data+b*16;
+    uint8_t tail[16];
+    if(SB_UNLIKELY(b>=full_blocks)){
+      memset(tail,0,sizeof(tail));
+      memcpy(tail,cur,s->size-b*16);
+      cur = tail;
+    }
+    uint32_t candidates = s->candidates[b];
+    if(candidates){
+      candidates&=sb_mem_search_compare(cur,use_value? ref: snapshot,s->width,op);
+      s->candidates[b] = candidates;
+      count+=sb_mem_search_popcount16(candidates);
+    }
+    memcpy(snapshot,cur,16);
+  }
+  s->num_candidates = count;
+}
+// Offset of the first candidate at or after offset, -1 when there are no more
+static int64_t sb_mem_search_next(const sb_mem_search_t* s, uint32_t offset){
+  for(uint32_t b=offset/16;b<s->blocks;++b){
+    uint32_t candidates = s->candidates[b];
+    if(b==offset/16)candidates&=0xffffu<<(offset%16);
+    if(!candidates)continue;
+    uint32_t bit = 0;
+    while(!(candidates&(1u<<bit)))++bit;
+    return b*16+bit;
+  }
+  return -1;
+}
+// Value of the element at offset when the snapshot was taken
+static uint32_t sb_mem_search_value(const sb_mem_search_t* s, uint32_t offset){
+  uint32_t v = 0;
+  memcpy(&v,s->snapshot+offset,s->width);
+  return v;
+}
+#endif
@@ -7,6 +7,11 @@
 #include "freebios/drastic_bios_arm9.h"
 
 #define NDS_SCANLINE_PPU 1
+// The ARM7 mixer outputs a sample every 1024 bus cycles (~32.7kHz), resampled to SE_AUDIO_SAMPLE_RATE on output
+#define NDS_AUDIO_SAMPLE_CYCLES 1024
+// Samples the mixer produces per channel pass
+#define NDS_AUDIO_BLOCK_SAMPLES 32
+#define NDS_AUDIO_DISABLED_BLOCK_SAMPLES 1024 // Without output only SOUNDxCNT reads need the channels up to date
 
 typedef enum{
   kARM7,
@@ -1866,6 +1871,9 @@ mmio_reg_t nds7_io_reg_desc[]={
 #define NDS_VRAM_SLOT_OFF    0x20000
 #define NDS_ARM9 1
 #define NDS_ARM7 0
+// Main RAM is tracked in 4KB pages to find memory both CPUs communicate through
+#define NDS_SHARED_RAM_PAGE_SHIFT 12
+#define NDS_SHARED_RAM_PAGES (4*1024*1024>>NDS_SHARED_RAM_PAGE_SHIFT)
 
 #define NDS_GXFIFO_SIZE 256
 #define NDS_GXFIFO_STORAGE 512
@@ -1873,7 +1881,92 @@ mmio_reg_t nds7_io_reg_desc[]={
 #define NDS_GPU_MAX_PARAM 64
 #define NDS_GX_DMA_THRESHOLD 128
 
+// Software TLB mapping 16KB pages of 0x00000000-0x07FFFFFF straight to host memory for each CPU. 
+// Only main RAM, shared/ARM7 WRAM, VRAM pages backed by a single bank and (for the ARM9) page 
+// aligned TCM are mapped, everything else has a NULL entry and goes through the general 
+// transaction functions. 
+#define NDS_TLB_PAGE_SHIFT 14
+#define NDS_TLB_PAGE_SIZE (1<<NDS_TLB_PAGE_SHIFT)
+#define NDS_TLB_NUM_PAGES (0x08000000>>NDS_TLB_PAGE_SHIFT)
+#define NDS_TLB_VRAM_FIRST_PAGE (0x06000000>>NDS_TLB_PAGE_SHIFT)
+#define NDS_TLB_VRAM_LAST_PAGE  (0x07000000>>NDS_TLB_PAGE_SHIFT)
+#define NDS_TLB_BUS 1     // Charged to the shared bus
+#define NDS_TLB_BUS_VRAM 2 // Charged to the shared bus and 8 bit writes are dropped (ARM9 VRAM)
+#define NDS_TLB_SLOW 0xff // Left to the general transaction functions
+typedef struct{
+  uint8_t* read[NDS_TLB_NUM_PAGES];
+  uint8_t* write[NDS_TLB_NUM_PAGES];
+  uint8_t bus_cycles[NDS_TLB_NUM_PAGES]; // 0 or one of NDS_TLB_BUS/NDS_TLB_BUS_VRAM/NDS_TLB_SLOW
+}nds_tlb_map_t;
+typedef struct{
+  nds_tlb_map_t arm7;
+  nds_tlb_map_t arm9;
+  // State the maps were generated from, they are rebuilt when any of it changes
+  void* nds;
+  uint32_t wramcnt;
+  uint32_t dtcm_start_address;
+  uint32_t dtcm_end_address;
+  uint32_t itcm_start_address;
+  uint32_t itcm_end_address;
+  uint32_t tcm_flags;
+  uint8_t vramcnt[9]; // Only the VRAM pages are rebuilt when just these change
+}nds_tlb_t;
+
+// LRU cache of 4KB gamecard blocks, used when the ROM is streamed instead of resident
+#define NDS_CARD_BLOCK_SHIFT 12
+#define NDS_CARD_BLOCK_SIZE (1<<NDS_CARD_BLOCK_SHIFT)
+#define NDS_CARD_CACHE_BLOCKS 64
+typedef struct{
+  uint32_t tag[NDS_CARD_CACHE_BLOCKS]; // Block index+1, 0 when empty
+  uint64_t last_use[NDS_CARD_CACHE_BLOCKS];
+  uint64_t use_counter;
+  uint64_t misses;
+  uint8_t data[NDS_CARD_CACHE_BLOCKS][NDS_CARD_BLOCK_SIZE];
+}nds_card_cache_t;
+// Host image behind the DLDI driver patched into homebrew (see nds_dldi_patch), lives in the scratch memory
+#define NDS_DLDI_SECTOR_SIZE 512
+typedef struct{
+  FILE* image;
+  uint32_t sectors;
+}nds_dldi_t;
 typedef struct {     
+  // Small state used by every access comes before the memory arrays
+  nds_tlb_t *tlb;
+  uint32_t slow_bus_cycles; 
+  uint32_t requests;
+  uint32_t openbus_word;
+  uint32_t arm7_bios_word;
+  uint32_t dtcm_start_address;
+  uint32_t dtcm_end_address;
+  uint32_t itcm_start_address;
+  uint32_t itcm_end_address;
+  bool dtcm_load_mode;
+  bool itcm_load_mode;
+  bool dtcm_enable;
+  bool itcm_enable;
+  // Bumped by writes and timer reads so the idle loop detector can tell if a loop has side effects
+  uint32_t idle_loop_side_effects;
+  sb_late_input_t* late_input;
+  sb_sprite_bins_t *sprite_bins; /* One per 2D engine */
+  uint8_t *save_data;
+  /* BIOS ROM (4K NDS9, 16K NDS7, 16K GBA) */
+  uint8_t *nds7_bios;
+  uint8_t *nds9_bios;
+  /* Firmware FLASH (512KB in iQue variant, with chinese charset) */
+  uint8_t *firmware;
+  uint8_t *card_data;
+  size_t card_size;
+  // Backs card reads when card_data is NULL
+  sb_rom_read_fn card_read;
+  void* card_read_user_data;
+  nds_card_cache_t* card_cache;
+  nds_dldi_t* dldi;
+  // Sector, sector count, buffer and command/result of the patched DLDI driver
+  uint32_t dldi_port[4];
+  uint32_t card_chip_id;
+  int card_read_offset;
+  int card_transfer_bytes;
+
   uint8_t ram[4*1024*1024]; /*4096KB Main RAM (8192KB in debug version)*/
   uint8_t wram[96*1024];    /*96KB   WRAM (64K mapped to NDS7, plus 32K mappable to NDS7 or NDS9)*/
   /* TCM/Cache (TCM: 16K Data, 32K Code) (Cache: 4K Data, 8K Code) */
@@ -1882,41 +1975,18 @@ typedef struct {
   uint8_t code_cache[8*1024];
   uint8_t data_cache[4*1024];
   uint8_t vram[1024*1024];    /* VRAM (allocateable as BG/OBJ/2D/3D/Palette/Texture/WRAM memory) */
-  uint64_t vram_translation_cache[1024*16];
+  // VRAM 16KB page for each (transaction type&0xf, address bits 14-23) pair. Rebuilt by nds_update_vram_mapping
+  int16_t vram_bank_map[16][1024];
   uint8_t palette[2*1024];   
-  uint8_t *save_data;
-
   uint8_t oam[4*1024];       /* OAM/PAL (2K OBJ Attribute Memory, 2K Standard Palette RAM) */
-  /* BIOS ROM (4K NDS9, 16K NDS7, 16K GBA) */
-  uint8_t *nds7_bios;
-  uint8_t *nds9_bios;
-  /* Firmware FLASH (512KB in iQue variant, with chinese charset) */
-  uint8_t *firmware;
   uint8_t io[64*1024];
+  // NDS_MMIO_PREPROCESS/POSTPROCESS for each word of the IO map, registers without them skip the handlers
+  uint8_t mmio_handler_flags[16*1024];
   uint8_t wifi_io[64*1024];
   uint8_t baseband_io[0x70];
   uint8_t rf_io[0x10];
-  uint8_t mmio_debug_access_buffer[16*1024];
-
-  uint8_t *card_data;
-  size_t card_size;
   uint8_t card_transfer_data[0x1000];
-  uint32_t card_chip_id;
-  int card_read_offset;
-  int card_transfer_bytes;
-  uint64_t curr_vram_translation_key; 
-  uint32_t requests;
-  uint32_t openbus_word;
-  uint32_t arm7_bios_word;
-  uint32_t dtcm_start_address;
-  uint32_t dtcm_end_address;
-  uint32_t itcm_start_address;
-  uint32_t itcm_end_address;
-  bool dtcm_load_mode;
-  bool itcm_load_mode;
-  bool dtcm_enable;
-  bool itcm_enable;
-  uint32_t slow_bus_cycles; 
+  uint8_t mmio_debug_access_buffer[16*1024];
 } nds_mem_t;
 
 typedef struct {
@@ -2000,6 +2070,7 @@ typedef struct{
   uint32_t first_target_buffer[NDS_LCD_W];
   uint32_t second_target_buffer[NDS_LCD_W];
   uint8_t window[NDS_LCD_W];
+  sb_window_spans_t window_spans;
   uint32_t bg_vram_base;
   uint32_t obj_vram_base; 
 }nds_ppu_t;
@@ -2032,13 +2103,43 @@ typedef struct{
   uint32_t sync_data;
   bool error; 
 }nds_ipc_t;
+// ARM946E-S caches: 4 way set associative with 32 byte lines (8KB instruction, 4KB data)
+#define NDS_ARM9_CACHE_WAYS 4
+#define NDS_ARM9_CACHE_LINE_SHIFT 5
+#define NDS_ARM9_ICACHE_SETS (8*1024/32/NDS_ARM9_CACHE_WAYS)
+#define NDS_ARM9_DCACHE_SETS (4*1024/32/NDS_ARM9_CACHE_WAYS)
+#define NDS_ARM9_CACHE_VALID 0x80000000u
+// Bus cycles charged for a line fill
+#define NDS_ARM9_CACHE_MISS_CYCLES 4
+// Cacheability is tracked per 4KB page for main RAM (0x02000000-0x02FFFFFF) and the BIOS (0xFFFF0000-0xFFFFFFFF)
+#define NDS_ARM9_CACHE_PAGE_SHIFT 12
+#define NDS_ARM9_CACHE_BIOS_PAGE 4096
+#define NDS_ARM9_CACHE_PAGES (4096+16)
+#define NDS_ARM9_CACHE_DATA 0x1
+#define NDS_ARM9_CACHE_CODE 0x2
+typedef struct{
+  // Only the tags are modeled since memory is always accessed directly, tags are (addr>>5)|NDS_ARM9_CACHE_VALID
+  uint32_t icache[NDS_ARM9_ICACHE_SETS][NDS_ARM9_CACHE_WAYS];
+  uint32_t dcache[NDS_ARM9_DCACHE_SETS][NDS_ARM9_CACHE_WAYS];
+  uint32_t icache_victim;
+  uint32_t dcache_victim;
+  uint16_t lfsr;
+  bool round_robin;
+  // NDS_ARM9_CACHE_DATA/CODE if the page is cacheable, enabled and not covered by a TCM. Rebuilt on CP15 writes
+  uint8_t page_flags[NDS_ARM9_CACHE_PAGES];
+  uint8_t enable_mask;
+}nds_arm9_cache_t;
 typedef struct{
   //[Cn][Cm][Cp]
-  uint32_t reg[16*16*8]; 
+  uint32_t reg[16*16*8];
+  nds_arm9_cache_t cache;
 }nds_system_control_processor;
 typedef struct{
   uint64_t div_last_update_clock;
   uint64_t sqrt_last_update_clock;
+  // Results are computed on the first read after the unit finished and cleared by parameter writes
+  bool div_result_valid;
+  bool sqrt_result_valid;
 }nds_math_t;
 typedef struct{
   uint8_t last_device;
@@ -2057,11 +2158,43 @@ typedef struct{
   bool write_enable;
   uint8_t status_reg;
   bool is_dirty;
+  // Set once a read or write has served its first data byte, the following bytes of the transfer
+  // skip the command decode. stream_wrap holds the address bits that advance (page or whole chip).
+  uint8_t stream_mode;
+  uint32_t stream_addr;
+  uint32_t stream_wrap;
+  // Bytes of save_data changed since the save writer last looked, empty while start>=end
+  uint32_t dirty_start, dirty_end;
 }nds_card_backup_t;
 typedef struct{
   uint16_t x_reg, y_reg; 
   uint16_t tx_reg; 
 }nds_touch_t; 
+// Decoded IMA-ADPCM samples in main RAM, keyed by source address, length and loop start. Each 
+// sample stores the decoder state after its nibble (PCM16 in the low half, table index above) 
+// and is filled in as channels play from the start. Writes to a page with cached samples drop
+// the entries overlapping it, save states and rewinds flush everything through the generation.
+#define NDS_ADPCM_CACHE_ENTRIES 256
+#define NDS_ADPCM_CACHE_SAMPLES (1024*1024)
+#define NDS_ADPCM_CACHE_PAGE_SHIFT 12
+#define NDS_ADPCM_CACHE_PAGES (4*1024*1024>>NDS_ADPCM_CACHE_PAGE_SHIFT)
+typedef struct{
+  uint32_t sad;   // Offset into main RAM
+  uint32_t tot_samps;
+  uint32_t pnt;
+  uint32_t offset;
+  uint32_t decoded;
+  bool used;
+  bool dropped;   // Kept so the probe chains stay intact
+}nds_adpcm_cache_entry_t;
+typedef struct{
+  nds_adpcm_cache_entry_t entries[NDS_ADPCM_CACHE_ENTRIES];
+  uint32_t states[NDS_ADPCM_CACHE_SAMPLES];
+  uint32_t states_used;
+  uint32_t num_entries;
+  uint32_t source_pages[NDS_ADPCM_CACHE_PAGES/32];
+  uint64_t generation;
+}nds_adpcm_cache_t;
 typedef struct{
   uint64_t current_sample_generated_time;
   struct{
@@ -2073,7 +2206,11 @@ typedef struct{
     int32_t adpcm_index_latch;
     uint32_t lfsr;
   }channel[16];
-
+  sb_resampler_t resampler;
+  // Only set while nds_tick runs so sound register accesses can flush the pending samples
+  sb_emu_state_t* emu;
+  nds_adpcm_cache_t* adpcm_cache;
+  uint64_t adpcm_cache_generation;
 }nds_audio_t; 
 
 #define NDS_MATRIX_PROJ 0
@@ -2082,13 +2219,173 @@ typedef struct{
 #define NDS_MATRIX_TEX 3
 
 #define NDS_MAX_VERTS 8192
+// Slots at the end of vert_buffer that hold the vertices created by clipping, a triangle clipped
+// by all six planes has up to 9
+#define NDS_GPU_CLIP_VERTS 9
+// Outcode bits of a vertex, one per view volume plane it's outside of.
+#define NDS_GPU_CLIP_X_NEG (1<<0)
+#define NDS_GPU_CLIP_X_POS (1<<1)
+#define NDS_GPU_CLIP_Y_NEG (1<<2)
+#define NDS_GPU_CLIP_Y_POS (1<<3)
+#define NDS_GPU_CLIP_Z_NEG (1<<4) // Near plane
+#define NDS_GPU_CLIP_Z_POS (1<<5) // Far plane
+#define NDS_GPU_CLIP_PLANES 0x3f
+// Set when x or y is outside the guard band the rasterizer can take without clipping
+#define NDS_GPU_CLIP_GUARD_BAND (1<<6)
+#define NDS_GPU_GUARD_BAND 8.0f
 
 typedef struct{
   float pos[4];
   float clip_pos[3];
   uint8_t color[3];
+  uint8_t clip_code; // NDS_GPU_CLIP_* bits
   float tex[2];
 }nds_vert_t;
+// Hardware limits of the polygon list and vertex RAM
+#define NDS_GPU_POLY_RAM_SIZE 2048
+#define NDS_GPU_VERTEX_RAM_SIZE 6144
+// Quads and clipped polygons can emit up to 4 triangles per polygon RAM entry
+#define NDS_GPU_MAX_TRIS (NDS_GPU_POLY_RAM_SIZE*4)
+#define NDS_GPU_RENDER_BANDS 8
+// Vertex RAM: the transformed vertices referenced by polygon RAM
+typedef struct{
+  float pos[4][NDS_GPU_VERTEX_RAM_SIZE];
+  float tex[2][NDS_GPU_VERTEX_RAM_SIZE];
+  uint8_t color[3][NDS_GPU_VERTEX_RAM_SIZE];
+  uint32_t size;
+}nds_gpu_vertex_ram_t;
+// Polygon RAM: per polygon render state plus the triangles each polygon was split into
+typedef struct{
+  uint32_t poly_attr[NDS_GPU_POLY_RAM_SIZE];
+  uint32_t disp3dcnt[NDS_GPU_POLY_RAM_SIZE];
+  uint32_t tex_image_param[NDS_GPU_POLY_RAM_SIZE];
+  uint32_t tex_plt_base[NDS_GPU_POLY_RAM_SIZE];
+  const uint32_t *texels[NDS_GPU_POLY_RAM_SIZE]; // Decoded texture from the texture cache, NULL to sample VRAM directly
+  uint32_t size;
+  uint16_t tri_verts[3][NDS_GPU_MAX_TRIS];
+  uint16_t tri_poly[NDS_GPU_MAX_TRIS];
+  uint32_t num_tris;
+  bool w_buffer; // SWAP_BUFFERS depth mode of the frame (0=Z, 1=W)
+}nds_gpu_poly_ram_t;
+// 3D depth buffer pixels: 24 bit depth with the attributes of the polygon that wrote it
+#define NDS_GPU_DEPTH_MASK 0xffffff
+#define NDS_GPU_DEPTH_POLY_ID_SHIFT 24 // 6 bit polygon ID
+#define NDS_GPU_DEPTH_POLY_ID_MASK (0x3fu<<NDS_GPU_DEPTH_POLY_ID_SHIFT)
+#define NDS_GPU_DEPTH_TRANSLUCENT (1u<<30)
+#define NDS_GPU_DEPTH_FOG (1u<<31)
+// Polygons are stored as they are submitted and rasterized when the buffers are swapped
+typedef struct{
+  nds_gpu_vertex_ram_t vert_ram;
+  nds_gpu_poly_ram_t poly_ram;
+  // vert_buffer slot -> vertex RAM index+1 so strips share their vertices, 0 if not stored yet
+  uint16_t vert_ram_index[NDS_MAX_VERTS];
+}nds_gpu_render_queue_t;
+// A swap on a frame that isn't shown keeps a copy of its polygons and of the 3D registers the
+// game may rewrite meanwhile instead of rasterizing it. Display capture and VRAMCNT writes 
+// rasterize it before they read or remap its inputs, so emulated memory doesn't depend on 
+// which frames the frontend renders.
+#define NDS_GPU_RASTER_REGS_SIZE (NDS9_TOON_TABLE+64-NDS9_EDGE_COLOR)
+typedef struct{
+  bool pending;
+  uint32_t swap_count; // nds_gpu_t::swap_count after the deferred swap
+  uint32_t disp3dcnt;
+  uint8_t regs[NDS_GPU_RASTER_REGS_SIZE]; // EDGE_COLOR up to the end of TOON_TABLE
+  nds_gpu_render_queue_t queue; // Only the used part of the RAMs is copied
+}nds_gpu_deferred_raster_t;
+
+// Decoded textures in RGBA8888, keyed by TEXIMAGE_PARAM (without the wrap modes) and PLTT_BASE. 
+// Texture and texture palette slots are not CPU writable so their contents can only change when 
+// VRAMCNT is written, which bumps nds_gpu_t.tex_cache_generation and flushes the whole cache.
+#define NDS_TEX_CACHE_ENTRIES 512
+#define NDS_TEX_CACHE_TEXELS (1024*1024)
+typedef struct{
+  uint64_t key;
+  uint32_t offset;
+}nds_tex_cache_entry_t;
+typedef struct{
+  nds_tex_cache_entry_t entries[NDS_TEX_CACHE_ENTRIES];
+  uint32_t texels[NDS_TEX_CACHE_TEXELS];
+  uint32_t texels_used;
+  uint32_t num_entries;
+  uint64_t generation;
+  uint64_t flushes; // Bumped whenever the entries are dropped, older texel pointers are stale then
+  bool full;
+}nds_tex_cache_t;
+// Snapshot of the last displayed 3D frame for a host GPU renderer that draws it at a higher
+// resolution, taken at the buffer swap while enabled is set by the frontend. Frames it can draw
+// (on_gpu) replace the rasterization of the core, which is deferred like the one of a frame that
+// isn't shown. The 2D engines then treat the 3D layer as opaque, and output the color below it
+// with NDS_HIRES_* in the alpha where it is the top layer, for the frontend to finish the blend.
+#define NDS_HIRES_3D_TOP 0x80   // The 3D layer is on top, the color is the one of the layer below
+#define NDS_HIRES_3D_BLEND 0x40 // The 3D pixel is alpha blended with the layer below by its alpha
+#define NDS_HIRES_DARKEN 0x20   // The brightness effect darkens instead of brightening
+#define NDS_HIRES_EVY_MASK 0x1f // Factor of the brightness effect (0..16)
+typedef struct{
+  bool enabled;
+  bool on_gpu; // False for frames with a rear-plane bitmap or textures the cache couldn't hold
+  uint32_t frame; // Bumped with every snapshot
+  nds_gpu_render_queue_t queue; // Only the used part of the RAMs is copied
+  uint32_t disp3dcnt;
+  uint32_t clear_color;
+  uint32_t clear_depth; // 24 bit
+  uint8_t alpha_test_ref;
+  uint16_t toon_table[32];
+  uint16_t edge_color[8];
+  uint32_t fog_color;
+  uint16_t fog_offset;
+  uint8_t fog_table[32];
+  uint64_t tex_cache_flushes; // nds_tex_cache_t.flushes the texel pointers of the queue belong to
+}nds_gpu_hires_t;
+// Transformed vertices and lit colors of the geometry engine, so geometry that is submitted again
+// with the same matrices and lights (static level geometry, UI quads, usually every frame) skips
+// the math. The matrix and light state are interned by content into slots that get a new serial 
+// whenever their contents change, entries only hit with the serial of the current state. A state
+// is only interned once it was used NDS_GEOMETRY_CACHE_MIN_USES times, so matrices that change
+// every few vertices (skinned models) don't pay for the hashing.
+#define NDS_GEOMETRY_CACHE_STATES 1024
+#define NDS_GEOMETRY_CACHE_VERTS 16384
+#define NDS_GEOMETRY_CACHE_NORMALS 8192
+#define NDS_GEOMETRY_CACHE_MIN_USES 4
+typedef struct{
+  int32_t matrices[3][16]; // Position, projection and texture matrix
+}nds_geometry_xform_key_t;
+typedef struct{
+  int32_t direction_matrix[16];
+  float light_vector[4*4];
+  uint8_t light_color[4*3];
+  uint8_t ambient[3], diffuse[3], specular[3], emission[3];
+  uint8_t shininess_table[128];
+  uint8_t use_shininess_table;
+  uint8_t enabled_lights; // POLYGON_ATTR bits 0-3
+  uint8_t padding[6];
+}nds_geometry_light_key_t;
+typedef struct{
+  uint32_t state; // Serial of the transform state, 0 if unused
+  int16_t pos[3];
+  int16_t tex_coord[2];
+  uint8_t xform_mode; // TEXIMAGE_PARAM bits 30-31
+  float clip_pos[4];
+  float uv[2];
+}nds_geometry_vert_t;
+typedef struct{
+  uint32_t state; // Serial of the light state, 0 if unused
+  int16_t normal[3];
+  float transformed_normal[4];
+  uint8_t color[3];
+}nds_geometry_normal_t;
+typedef struct{
+  nds_geometry_xform_key_t xform_keys[NDS_GEOMETRY_CACHE_STATES];
+  nds_geometry_light_key_t light_keys[NDS_GEOMETRY_CACHE_STATES];
+  uint32_t xform_serials[NDS_GEOMETRY_CACHE_STATES];
+  uint32_t light_serials[NDS_GEOMETRY_CACHE_STATES];
+  uint32_t next_serial;
+  // Serials of the current GX state, 0 when it changed since it was last interned
+  uint32_t xform_state, light_state;
+  // Vertices and normals since the state changed
+  uint32_t xform_uses, light_uses;
+  nds_geometry_vert_t verts[NDS_GEOMETRY_CACHE_VERTS];
+  nds_geometry_normal_t normals[NDS_GEOMETRY_CACHE_NORMALS];
+}nds_geometry_cache_t;
 typedef struct{
   uint32_t fifo_data[NDS_GXFIFO_STORAGE];
   uint8_t fifo_cmd[NDS_GXFIFO_STORAGE];
@@ -2136,9 +2433,23 @@ typedef struct{
   uint32_t pending_poly_attr;
   uint32_t poly_ram_offset;
   bool pending_swap;
+  // Cleared on frames whose 3D output can't be seen, swaps then defer the rasterization
+  bool raster_on_swap;
+  uint32_t swap_count; // Tells a deferred rasterization apart from one of another save state timeline
+  bool framebuffer_3d_front; // Scratch framebuffer_3d being displayed
   bool box_test_result;
   int test_busy;
   uint32_t rendered_primitive_tracker; 
+  nds_gpu_render_queue_t *render_queue;
+  uint32_t band_pixels[NDS_GPU_RENDER_BANDS];
+  sb_job_dispatch_t job_dispatch;
+  // Only set while nds_tick runs and a frame dump is captured
+  sb_video_capture_t* video_capture;
+  nds_tex_cache_t *tex_cache;
+  uint64_t tex_cache_generation;
+  nds_geometry_cache_t *geometry_cache;
+  nds_gpu_hires_t *hires;
+  nds_gpu_deferred_raster_t *deferred_raster;
 }nds_gpu_t; 
 
 typedef struct{
@@ -2194,65 +2505,126 @@ typedef struct{
   uint32_t card_transfer_bytes;
 
   uint32_t padding[39];
+  // Canonical copies of the CPU registers, cpu*_reg_seg point here (see arm7_get_registers)
+  uint32_t cpu9_registers[37];
+  uint32_t cpu7_registers[37];
 }nds_bess_info_t;
 
+// Host side state that is not part of the emulated machine
 typedef struct{
-  nds_mem_t mem;
+  char save_file_path[SB_FILE_PATH_SIZE];
+  // Only set while nds_tick runs and the frontend records an event log
+  sb_event_log_t* event_log;
+  // Threaded ARM7 (see nds_exec_cpu_slice_threaded). Slices are numbered per frame, the main thread
+  // publishes arm7_start and arm9_done, the ARM7 thread arm7_done once its part of the slice ran
+  volatile uint32_t arm7_start;
+  volatile uint32_t arm9_done;
+  volatile uint32_t arm7_done;
+  volatile uint32_t arm7_stop;
+  volatile uint32_t arm7_thread_running;
+  uint32_t arm7_slice;
+  // Inputs of the current slice, snapshots of shared state taken before the ARM9 starts
+  int arm7_budget;
+  bool arm7_irq_line;
+  uint32_t arm7_side_effects;
+  arm7_idle_loop_t* arm7_idle_loop;
+  // Steps the ARM7 took in the last slice
+  int arm7_steps;
+  // Cleared while the ARM7 may only touch its private memory, set once the ARM9 finished the slice
+  bool arm7_joined;
+}nds_host_t;
+typedef struct{
+  // Scheduling state touched on every tick, padded out to whole cache lines so it is followed
+  // by the CPUs and the large memories only start after the per instruction working set
+  union{
+    struct{
+      uint64_t current_clock;
+      uint64_t last_timer_clock;
+      uint32_t next_timer_clock;
+      int ppu_fast_forward_ticks;
+      int active_if_pipe_stages; 
+      // Some HW has up to a 4 cycle delay before its IF propagates. 
+      // This array acts as a FIFO to keep track of that. 
+      uint32_t nds9_pipelined_if[5];
+      uint32_t nds7_pipelined_if[5];
+      bool nds7_interrupt_line;
+      bool nds9_interrupt_line;
+      //There is a 2 cycle penalty when the CPU takes over from the DMA
+      bool last_transaction_dma; 
+      bool activate_dmas; 
+      bool dma_wait_gx;
+      bool dma_wait_ppu;
+      bool dma_processed[2];
+      // Set on IPC register accesses, WRAMCNT writes and writes to shared main RAM pages so batched 
+      // CPU slices hand over to the other CPU
+      bool cpu_sync_point;
+      bool sleep_mode;
+      bool prev_key_interrupt;
+      bool display_flip;
+      bool frame_in_progress;
+      bool pause_after_frame; 
+      // Set every tick from the frontend option, gamecard DMAs move the whole block at once
+      bool instant_card;
+    };
+    uint8_t hot_padding[SB_CACHE_LINE_SIZE*2];
+  };
   arm7_t arm7;
   arm7_t arm9;
-  nds_card_t card;
-  nds_input_t joy;       
-  nds_ppu_t ppu[2];
-  nds_gpu_t gpu;
-  nds_rtc_t rtc;
+  nds_timer_t timers[2][4];
   nds_dma_t dma[2][4]; 
   nds_ipc_t ipc[2];
-  nds_system_control_processor cp15;
   nds_math_t math; 
+  // Set every tick when the 2D engines may render a line concurrently, NULL otherwise
+  sb_job_dispatch_t ppu_job_dispatch;
+  uint8_t *framebuffer_top;
+  uint8_t *framebuffer_bottom;
+  uint32_t *framebuffer_3d_depth; // NDS_GPU_DEPTH_* pixels
+  uint8_t *framebuffer_3d;
+  uint8_t *framebuffer_3d_disp;
+  // First and last row of every band between the post passes, anti-aliasing is skipped when NULL
+  uint8_t *framebuffer_3d_halo;
+  nds_system_control_processor cp15;
+  nds_card_t card;
+  nds_input_t joy;       
+  nds_rtc_t rtc;
   nds_spi_t spi; 
   nds_flash_t firmware;
   nds_touch_t touch;
-  nds_audio_t audio;
   nds_card_backup_t backup;
+  nds_audio_t audio;
+  // Bus cycles the ARM7 ran ahead of the ARM9 in a slice, taken off the budget of the next one
+  int arm7_ahead_ticks;
+  // Which CPUs (1<<NDS_ARM7, 1<<NDS_ARM9) wrote each main RAM page. Pages both have written
+  // are treated as shared and every further write to them ends the slice.
+  uint8_t shared_ram_writers[NDS_SHARED_RAM_PAGES];
+  // Large memories and the video state
+  nds_mem_t mem;
+  nds_ppu_t ppu[2];
+  nds_gpu_t gpu;
   nds_bess_info_t bess;
-  //There is a 2 cycle penalty when the CPU takes over from the DMA
-  bool last_transaction_dma; 
-  bool activate_dmas; 
-  bool dma_wait_gx;
-  bool dma_wait_ppu;
-  bool dma_processed[2];
-  bool display_flip;
-  bool frame_in_progress;
-  bool pause_after_frame; 
-  nds_timer_t timers[2][4];
-  uint32_t next_timer_clock;
-  uint64_t last_timer_clock;
-  bool prev_key_interrupt;
-  // Some HW has up to a 4 cycle delay before its IF propagates. 
-  // This array acts as a FIFO to keep track of that. 
-  uint32_t nds9_pipelined_if[5];
-  uint32_t nds7_pipelined_if[5];
-  bool nds7_interrupt_line;
-  bool nds9_interrupt_line;
-  int active_if_pipe_stages; 
-  char save_file_path[SB_FILE_PATH_SIZE];
-
-  uint8_t *framebuffer_top;
-  uint8_t *framebuffer_bottom;
-  float *framebuffer_3d_depth;
-  uint8_t *framebuffer_3d;
-  uint8_t *framebuffer_3d_disp;
-  uint64_t current_clock;
-  float ghosting_strength;
-  int ppu_fast_forward_ticks;
-  bool sleep_mode;
-  FILE * gx_log;
-  FILE * io9_log;
-  FILE * io7_log;
-  FILE * gc_log;
-  FILE * dma_log;
-  FILE * vert_log;
+  // Cold state, left at the end so it stays out of the way of the rest
+  nds_host_t host;
+  sb_perf_counters_t perf;
 } nds_t; 
+_Static_assert(sizeof(((nds_t*)0)->hot_padding)>=offsetof(nds_t,instant_card)+sizeof(bool), "nds_t scheduling state outgrew its cache lines");
+// Rewind granularity of nds_t, sorted by offset. Texture and BG uploads touch VRAM in long runs while
+// the CPU and IO state changes a few words at a time.
+static inline const sb_rewind_region_t* nds_rewind_regions(int* num_regions){
+  static const sb_rewind_region_t regions[]={
+    {0,offsetof(nds_t,mem.ram),32},
+    SB_REWIND_REGION(nds_t,mem.vram,256),
+    SB_REWIND_REGION(nds_t,mem.vram_bank_map,256),
+    SB_REWIND_REGION(nds_t,mem.io,32),
+    SB_REWIND_REGION(nds_t,mem.mmio_handler_flags,256),
+    SB_REWIND_REGION(nds_t,mem.wifi_io,256),
+    SB_REWIND_REGION(nds_t,mem.card_transfer_data,256),
+    SB_REWIND_REGION(nds_t,mem.mmio_debug_access_buffer,SB_REWIND_SKIP),
+    SB_REWIND_REGION(nds_t,host,SB_REWIND_SKIP),
+    SB_REWIND_REGION(nds_t,perf,SB_REWIND_SKIP),
+  };
+  *num_regions = sizeof(regions)/sizeof(regions[0]);
+  return regions;
+}
 typedef struct{
   uint8_t nds7_bios[16*1024];
   uint8_t nds9_bios[4*1024];
@@ -2266,12 +2638,32 @@ typedef struct{
     };
     uint8_t framebuffer_full[NDS_LCD_W*NDS_LCD_H*8];
   };
-  float framebuffer_3d_depth[NDS_LCD_W*NDS_LCD_H];
-  uint8_t framebuffer_3d[NDS_LCD_W*NDS_LCD_H*4];
-  uint8_t framebuffer_3d_disp[NDS_LCD_W*NDS_LCD_H*4];
+  uint32_t framebuffer_3d_depth[NDS_LCD_W*NDS_LCD_H];
+  // Render and display buffers of the 3D engine, nds_gpu_swap_buffers exchanges them
+  uint8_t framebuffer_3d[2][NDS_LCD_W*NDS_LCD_H*4];
+  uint8_t framebuffer_3d_halo[NDS_GPU_RENDER_BANDS*2*NDS_LCD_W*4];
   nds_vert_t vert_buffer[NDS_MAX_VERTS];
+  nds_gpu_render_queue_t render_queue;
+  nds_gpu_deferred_raster_t deferred_raster;
+  nds_tex_cache_t tex_cache;
+  nds_geometry_cache_t geometry_cache;
+  nds_gpu_hires_t hires;
+  // Optional, lets the frontend spread 3D rendering over a thread pool. Bands render serially when NULL.
+  sb_job_dispatch_t job_dispatch;
+  // Optional, starts the thread of the threaded ARM7 (sb_emu_state_t::nds_threaded_arm7)
+  sb_job_start_t job_start;
+  nds_tlb_t tlb;
+  sb_sprite_bins_t sprite_bins[2];
+  arm7_idle_loop_t arm7_idle_loop;
+  arm7_idle_loop_t arm9_idle_loop;
+  nds_card_cache_t card_cache;
+  nds_adpcm_cache_t adpcm_cache;
+  nds_dldi_t dldi;
 }nds_scratch_t; 
 static void nds_tick_keypad(sb_emu_state_t*emu, nds_t* nds); 
+static FORCE_INLINE void nds_log_event(nds_t* nds, int type, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3){
+  if(SB_UNLIKELY(sb_event_log_enabled(nds->host.event_log,type)))sb_event_log_push(nds->host.event_log,type,nds->current_clock,d0,d1,d2,d3);
+}
 static void nds_tick_touch(sb_joy_t*joy, nds_t* nds); 
 static FORCE_INLINE void nds_tick_timers(nds_t* nds);
 static FORCE_INLINE int nds_cycles_till_vblank(nds_t*nds);
@@ -2279,6 +2671,9 @@ static void nds_compute_timers(nds_t* nds);
 static uint32_t nds_get_save_size(nds_t*nds);
 static uint8_t nds_process_flash_write(nds_t *nds, uint8_t write_data, nds_flash_t* flash, uint8_t *flash_data, uint32_t flash_size);
 static bool nds_run_ar_cheat(nds_t* nds, const uint32_t* buffer, uint32_t size);
+static void nds_update_vram_mapping(nds_t*nds);
+static void nds_update_arm9_cache_config(nds_t* nds);
+static void nds_invalidate_adpcm_cache(nds_t* nds);
 static FORCE_INLINE void nds_update_gx_irq(nds_t* nds);
 static FORCE_INLINE void nds_update_interrupt_lines(nds_t* nds);
 
@@ -2286,8 +2681,10 @@ static FORCE_INLINE void nds_update_interrupt_lines(nds_t* nds);
 static uint32_t nds_save_best_effort_state(nds_t* nds){
   nds->bess.bess_version = 1;   
 
-  nds->bess.cpu9_reg_seg= (uint8_t*)nds->arm9.registers-(uint8_t*)nds;
-  nds->bess.cpu7_reg_seg= (uint8_t*)nds->arm7.registers-(uint8_t*)nds;
+  arm7_get_registers(&nds->arm9,nds->bess.cpu9_registers);
+  arm7_get_registers(&nds->arm7,nds->bess.cpu7_registers);
+  nds->bess.cpu9_reg_seg= (uint8_t*)nds->bess.cpu9_registers-(uint8_t*)nds;
+  nds->bess.cpu7_reg_seg= (uint8_t*)nds->bess.cpu7_registers-(uint8_t*)nds;
   nds->bess.ram_seg= (uint8_t*)nds->mem.ram-(uint8_t*)nds;
   nds->bess.wram_seg= (uint8_t*)nds->mem.wram-(uint8_t*)nds; 
   nds->bess.code_tcm_seg= (uint8_t*)nds->mem.code_tcm-(uint8_t*)nds;
@@ -2335,9 +2732,13 @@ static bool nds_load_best_effort_state(nds_t* nds,uint8_t *save_state_data, uint
   if(bess->card_transfer_data_seg + sizeof(nds->mem.card_transfer_data)>size)return false;
   if(bess->coproc_reg_seg + sizeof(nds->cp15.reg)>size)return false;
 
-  memcpy((uint8_t*)nds->arm9.registers, save_state_data+bess->cpu9_reg_seg, sizeof(nds->arm9.registers));
-  memcpy((uint8_t*)nds->arm7.registers, save_state_data+bess->cpu7_reg_seg, sizeof(nds->arm7.registers));
+  uint32_t registers[37];
+  memcpy(registers, save_state_data+bess->cpu9_reg_seg, sizeof(registers));
+  arm7_set_registers(&nds->arm9,registers);
+  memcpy(registers, save_state_data+bess->cpu7_reg_seg, sizeof(registers));
+  arm7_set_registers(&nds->arm7,registers);
   memcpy((uint8_t*)nds->mem.ram,        save_state_data+bess->ram_seg, sizeof(nds->mem.ram));
+  nds_invalidate_adpcm_cache(nds);
   memcpy((uint8_t*)nds->mem.wram,       save_state_data+bess->wram_seg, sizeof(nds->mem.wram));
   memcpy((uint8_t*)nds->mem.code_tcm,   save_state_data+bess->code_tcm_seg, sizeof(nds->mem.code_tcm));
   memcpy((uint8_t*)nds->mem.data_tcm,   save_state_data+bess->data_tcm_seg, sizeof(nds->mem.data_tcm));
@@ -2365,6 +2766,9 @@ static bool nds_load_best_effort_state(nds_t* nds,uint8_t *save_state_data, uint
   nds->mem.card_transfer_bytes=bess->card_transfer_bytes;
   for(int cpu=0;cpu<2;++cpu)
     for(int i=0;i<4;++i)nds->timers[cpu][i].reload_value=nds->bess.timer_reload_values[cpu][i];
+  nds_update_vram_mapping(nds);
+  memset(&nds->cp15.cache,0,sizeof(nds->cp15.cache));
+  nds_update_arm9_cache_config(nds);
   printf("Bess restore successful\n");
   return true; 
 }
@@ -2376,6 +2780,14 @@ static void FORCE_INLINE nds7_send_interrupt(nds_t*nds,int delay,int if_bit){
   nds->active_if_pipe_stages|=1<<delay;
   nds->nds7_pipelined_if[delay]|= if_bit;
 }      
+// Ticks before the next pending IF stage is delivered, INT32_MAX when the pipeline is empty
+static FORCE_INLINE int nds_if_pipe_ticks_to_delivery(nds_t*nds){
+  int stages = nds->active_if_pipe_stages;
+  if(!stages)return INT32_MAX;
+  int t = 0;
+  while(!(stages&1)){stages>>=1;++t;}
+  return t;
+}
 static uint64_t nds_rev_bits(uint64_t data, int bits){
   uint64_t out = 0;
   for(int i=0;i<bits;++i){
@@ -2495,181 +2907,321 @@ static FORCE_INLINE uint32_t nds_apply_mem_op(uint8_t * memory,uint32_t address,
   }
   return data; 
 }
-static FORCE_INLINE uint32_t nds_apply_vram_mem_op(nds_t *nds,uint32_t address, uint32_t data, int transaction_type){
-
-  int lookup_addr = SB_BFE(address,14,10)*16+(transaction_type&0xf);
-  uint64_t key = nds->mem.vram_translation_cache[lookup_addr];
-  if((key&~(1023))==nds->mem.curr_vram_translation_key){
-    int vram_addr = ((key&1023)*16*1024)+SB_BFE(address,0,14);
-    return nds_apply_mem_op(nds->mem.vram,vram_addr,data,transaction_type);
-  }
-
-  const static int bank_size[9]={
-    128*1024, //A
-    128*1024, //B
-    128*1024, //C
-    128*1024, //D
-    64*1024,  //E
-    16*1024,  //F
-    16*1024,  //G
-    32*1024,  //H
-    16*1024,  //I
-  };
-  const uint32_t offset_table[10][5]={
-    {0,0,0,0}, //Offset ignored
-    {0x20000*0, 0x20000*1, 0x20000*2,0x20000*3}, //(0x20000*OFS)
-    {0x0, 0x4000, 0x10000,0x14000}, //(4000h*OFS.0)+(10000h*OFS.1)
-    {NDS_VRAM_SLOT_OFF*0, NDS_VRAM_SLOT_OFF*1, NDS_VRAM_SLOT_OFF*2,NDS_VRAM_SLOT_OFF*3}, // Slot 0-3 (mirrored)
-    {NDS_VRAM_SLOT_OFF*0, NDS_VRAM_SLOT_OFF*2, NDS_VRAM_SLOT_OFF*0,NDS_VRAM_SLOT_OFF*2}, // Slot 0-1 (OFS=0), Slot 2-3 (OFS=1)
-    {NDS_VRAM_SLOT_OFF*0, NDS_VRAM_SLOT_OFF*1, NDS_VRAM_SLOT_OFF*4,NDS_VRAM_SLOT_OFF*5}, // Slot (OFS.0*1)+(OFS.1*4)
-    {0x20000*0, 0x20000*1, 0x20000*2,0x20000*3}, //(0x20000*OFS)
-    {0x10000*0, 0x10000*1, 0x10000*2,0x10000*3}, //   E       64K   4    -     Slot 0-3  ;only lower 32K used 
-    {0x4000*0, 0x4000*1, 0x4000*0,0x4000*1}, // 16KB slot
-    {16*1024*0, 16*1024*1, 16*1024*4,16*1024*5}, // Slot (OFS.0*1)+(OFS.1*4)
-  };
-  typedef struct vram_bank_info_t{
-    int transaction_mask; // Block transactions of these types
-    int offset_table;
-    uint32_t mem_address_start;
-    uint32_t mirror;
-  }vram_bank_info_t;
-
-  const static vram_bank_info_t bank_info[9][8]={
-    { //Bank A 
-      {NDS_MEM_ARM7, 0, 0x06800000,0x100000-1}, //MST 0 6800000h-681FFFFh
-      {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
-      {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 2 6400000h+(20000h*OFS.0)  ;OFS.1 must be zero
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
-      {NDS_MEM_ARM7, 0, 0x06800000,0x100000-1}, //MST 4
-      {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 5 
-      {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 6 
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 7
-    },{ //Bank B
-      {NDS_MEM_ARM7, 0, 0x06820000,0x100000-1}, //MST 0 6820000h-683FFFFh
-      {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
-      {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 2 6400000h+(20000h*OFS.0)  ;OFS.1 must be zero
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
-      {NDS_MEM_ARM7, 0, 0x06820000,0x100000-1}, //MST 4
-      {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 5 
-      {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 6 
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 7
-    },{ //Bank C
-      {NDS_MEM_ARM7, 0, 0x06840000,0x100000-1}, //MST 0 6840000h-685FFFFh
-      {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
-      {NDS_MEM_ARM9|NDS_MEM_PPU, 6, 0x06000000,0x80000-1}, //MST 2 6000000h+(20000h*OFS.0)  ;OFS.1 must be zero
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
-      {NDS_MEM_ARM7, 0, 0x06200000,0x20000-1}, //MST 4 6200000h
-      {0xffffffff, 0, 0x0}, // MST 5 INVALID
-      {0xffffffff, 0, 0x0}, // MST 6 INVALID
-      {0xffffffff, 0, 0x0}, // MST 7 INVALID
-    },{ //Bank D
-      {NDS_MEM_ARM7, 0, 0x06860000,0x100000-1}, //MST 0 6860000h-687FFFFh
-      {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
-      {NDS_MEM_ARM9|NDS_MEM_PPU, 6, 0x06000000,0x80000-1}, //MST 2 6000000h+(20000h*OFS.0)  ;OFS.1 must be zero
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
-      {NDS_MEM_ARM7, 0, 0x06600000,0x20000-1}, //MST 4 6600000h
-      {0xffffffff, 0, 0x0}, // MST 5 INVALID
-      {0xffffffff, 0, 0x0}, // MST 6 INVALID
-      {0xffffffff, 0, 0x0}, // MST 7 INVALID
-    },{ //Bank E
-      {NDS_MEM_ARM7, 0, 0x06880000,0x100000-1}, //MST 0 6880000h-688FFFFh
-      {NDS_MEM_ARM7, 0, 0x06000000,0x80000-1}, //MST 1 6000000h
-      {NDS_MEM_ARM7, 0, 0x06400000,0x40000-1}, //MST 2 6400000h
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_TEX_PAL_SLOT0}, //MST 3 Slots 0-3;OFS=don't care
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_BGA_SLOT0}, //MST 4 (64K Slot 0-3  ;only lower 32K used)
-      {0xffffffff, 0, 0x0}, // MST 5 INVALID
-      {0xffffffff, 0, 0x0}, // MST 6 INVALID
-      {0xffffffff, 0, 0x0}, // MST 7 INVALID
-    },{ //Bank F
-      {NDS_MEM_ARM7, 0, 0x06890000,0x100000-1}, //MST 0 6890000h-6893FFFh
-      {NDS_MEM_ARM7, 2, 0x06000000,0x80000-1}, //MST 1 6000000h+(4000h*OFS.0)+(10000h*OFS.1)
-      {NDS_MEM_ARM7, 2, 0x06400000,0x40000-1}, //MST 2 6400000h+(4000h*OFS.0)+(10000h*OFS.1)
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 9, NDS_VRAM_TEX_PAL_SLOT0}, //MST 3 Slot (OFS.0*1)+(OFS.1*4)  ;ie. Slot 0, 1, 4, or 5
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 8, NDS_VRAM_BGA_SLOT0}, //MST 4 0..1  Slot 0-1 (OFS=0), Slot 2-3 (OFS=1)
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJA_SLOT0}, //MST 5 Slot 0  ;16K each (only lower 8K used)
-      {0xffffffff, 0, 0x0}, // MST 6 INVALID
-      {0xffffffff, 0, 0x0}, // MST 7 INVALID
-    },{ //Bank G
-      {NDS_MEM_ARM7, 0, 0x06894000,0x100000-1}, //MST 0 6894000h-6897FFFh
-      {NDS_MEM_ARM7, 2, 0x06000000,0x80000-1}, //MST 1 6000000h+(4000h*OFS.0)+(10000h*OFS.1)
-      {NDS_MEM_ARM7, 2, 0x06400000,0x40000-1}, //MST 2 6400000h+(4000h*OFS.0)+(10000h*OFS.1)
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 9, NDS_VRAM_TEX_PAL_SLOT0}, //MST3 Slot (OFS.0*1)+(OFS.1*4)  ;ie. Slot 0, 1, 4, or 5
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 8, NDS_VRAM_BGA_SLOT0}, //MST 4 0..1  Slot 0-1 (OFS=0), Slot 2-3 (OFS=1)
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJA_SLOT0}, //MST 5 Slot 0  ;16K each (only lower 8K used)
-      {0xffffffff, 0, 0x0}, // MST 6 INVALID
-      {0xffffffff, 0, 0x0}, // MST 7 INVALID
-    },{ //Bank H
-      {NDS_MEM_ARM7, 0, 0x06898000,0x100000-1}, //MST 0 6898000h-689FFFFh
-      {NDS_MEM_ARM7, 0, 0x06200000,0x10000-1}, //MST 1 6200000h
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_BGB_SLOT0}, //MST 2 Slot 0-3
-      {0xffffffff, 0, 0x0}, // MST 3 INVALID
-      {NDS_MEM_ARM7, 0, 0x06898000,0x100000-1}, //MST 4 6898000h-689FFFFh
-      {NDS_MEM_ARM7, 0, 0x06200000,0x10000-1}, //MST 5 6200000h
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_BGB_SLOT0}, //MST 6 Slot 0-3
-      {0xffffffff, 0, 0x0}, // MST 7 INVALID
-    },{ //Bank I
-      {NDS_MEM_ARM7, 0, 0x068A0000,0x100000-1}, //MST 0 68A0000h-68A3FFFh
-      {NDS_MEM_ARM7, 0, 0x06208000,0x10000-1}, //MST 1 6208000h
-      {NDS_MEM_ARM7, 0, 0x06600000,0x4000-1}, //MST 2 6600000h
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJB_SLOT0}, //MST 3 Slot 0  ;16K each (only lower 8K used)
-      {NDS_MEM_ARM7, 0, 0x068A0000,0x100000-1}, //MST 4 68A0000h-68A3FFFh
-      {NDS_MEM_ARM7, 0, 0x06208000,0x10000-1}, //MST 5 6208000h
-      {NDS_MEM_ARM7, 0, 0x06600000,0x4000-1}, //MST 6 6600000h
-      {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJB_SLOT0}, //MST 7 Slot 0  ;16K each (only lower 8K used)
-    }
-  };
-  int total_banks = 9;
-  int vram_offset = 0; 
-
-  bool special_case_multiple_found = false;
+static const int nds_vram_bank_size[9]={
+  128*1024, //A
+  128*1024, //B
+  128*1024, //C
+  128*1024, //D
+  64*1024,  //E
+  16*1024,  //F
+  16*1024,  //G
+  32*1024,  //H
+  16*1024,  //I
+};
+static const uint32_t nds_vram_offset_table[10][5]={
+  {0,0,0,0}, //Offset ignored
+  {0x20000*0, 0x20000*1, 0x20000*2,0x20000*3}, //(0x20000*OFS)
+  {0x0, 0x4000, 0x10000,0x14000}, //(4000h*OFS.0)+(10000h*OFS.1)
+  {NDS_VRAM_SLOT_OFF*0, NDS_VRAM_SLOT_OFF*1, NDS_VRAM_SLOT_OFF*2,NDS_VRAM_SLOT_OFF*3}, // Slot 0-3 (mirrored)
+  {NDS_VRAM_SLOT_OFF*0, NDS_VRAM_SLOT_OFF*2, NDS_VRAM_SLOT_OFF*0,NDS_VRAM_SLOT_OFF*2}, // Slot 0-1 (OFS=0), Slot 2-3 (OFS=1)
+  {NDS_VRAM_SLOT_OFF*0, NDS_VRAM_SLOT_OFF*1, NDS_VRAM_SLOT_OFF*4,NDS_VRAM_SLOT_OFF*5}, // Slot (OFS.0*1)+(OFS.1*4)
+  {0x20000*0, 0x20000*1, 0x20000*2,0x20000*3}, //(0x20000*OFS)
+  {0x10000*0, 0x10000*1, 0x10000*2,0x10000*3}, //   E       64K   4    -     Slot 0-3  ;only lower 32K used 
+  {0x4000*0, 0x4000*1, 0x4000*0,0x4000*1}, // 16KB slot
+  {16*1024*0, 16*1024*1, 16*1024*4,16*1024*5}, // Slot (OFS.0*1)+(OFS.1*4)
+};
+typedef struct nds_vram_bank_info_t{
+  int transaction_mask; // Block transactions of these types
+  int offset_table;
+  uint32_t mem_address_start;
+  uint32_t mirror;
+}nds_vram_bank_info_t;
+
+static const nds_vram_bank_info_t nds_vram_bank_info[9][8]={
+  { //Bank A 
+    {NDS_MEM_ARM7, 0, 0x06800000,0x100000-1}, //MST 0 6800000h-681FFFFh
+    {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
+    {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 2 6400000h+(20000h*OFS.0)  ;OFS.1 must be zero
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
+    {NDS_MEM_ARM7, 0, 0x06800000,0x100000-1}, //MST 4
+    {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 5 
+    {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 6 
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 7
+  },{ //Bank B
+    {NDS_MEM_ARM7, 0, 0x06820000,0x100000-1}, //MST 0 6820000h-683FFFFh
+    {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
+    {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 2 6400000h+(20000h*OFS.0)  ;OFS.1 must be zero
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
+    {NDS_MEM_ARM7, 0, 0x06820000,0x100000-1}, //MST 4
+    {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 5 
+    {NDS_MEM_ARM7, 6, 0x06400000,0x40000-1}, //MST 6 
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 7
+  },{ //Bank C
+    {NDS_MEM_ARM7, 0, 0x06840000,0x100000-1}, //MST 0 6840000h-685FFFFh
+    {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
+    {NDS_MEM_ARM9|NDS_MEM_PPU, 6, 0x06000000,0x80000-1}, //MST 2 6000000h+(20000h*OFS.0)  ;OFS.1 must be zero
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
+    {NDS_MEM_ARM7, 0, 0x06200000,0x20000-1}, //MST 4 6200000h
+    {0xffffffff, 0, 0x0}, // MST 5 INVALID
+    {0xffffffff, 0, 0x0}, // MST 6 INVALID
+    {0xffffffff, 0, 0x0}, // MST 7 INVALID
+  },{ //Bank D
+    {NDS_MEM_ARM7, 0, 0x06860000,0x100000-1}, //MST 0 6860000h-687FFFFh
+    {NDS_MEM_ARM7, 1, 0x06000000,0x80000-1}, //MST 1 6000000h+(20000h*OFS)
+    {NDS_MEM_ARM9|NDS_MEM_PPU, 6, 0x06000000,0x80000-1}, //MST 2 6000000h+(20000h*OFS.0)  ;OFS.1 must be zero
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 6, NDS_VRAM_TEX_SLOT0}, //MST 3 Slot OFS(0-3)   ;(Slot2-3: Texture, or Rear-plane)
+    {NDS_MEM_ARM7, 0, 0x06600000,0x20000-1}, //MST 4 6600000h
+    {0xffffffff, 0, 0x0}, // MST 5 INVALID
+    {0xffffffff, 0, 0x0}, // MST 6 INVALID
+    {0xffffffff, 0, 0x0}, // MST 7 INVALID
+  },{ //Bank E
+    {NDS_MEM_ARM7, 0, 0x06880000,0x100000-1}, //MST 0 6880000h-688FFFFh
+    {NDS_MEM_ARM7, 0, 0x06000000,0x80000-1}, //MST 1 6000000h
+    {NDS_MEM_ARM7, 0, 0x06400000,0x40000-1}, //MST 2 6400000h
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_TEX_PAL_SLOT0}, //MST 3 Slots 0-3;OFS=don't care
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_BGA_SLOT0}, //MST 4 (64K Slot 0-3  ;only lower 32K used)
+    {0xffffffff, 0, 0x0}, // MST 5 INVALID
+    {0xffffffff, 0, 0x0}, // MST 6 INVALID
+    {0xffffffff, 0, 0x0}, // MST 7 INVALID
+  },{ //Bank F
+    {NDS_MEM_ARM7, 0, 0x06890000,0x100000-1}, //MST 0 6890000h-6893FFFh
+    {NDS_MEM_ARM7, 2, 0x06000000,0x80000-1}, //MST 1 6000000h+(4000h*OFS.0)+(10000h*OFS.1)
+    {NDS_MEM_ARM7, 2, 0x06400000,0x40000-1}, //MST 2 6400000h+(4000h*OFS.0)+(10000h*OFS.1)
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 9, NDS_VRAM_TEX_PAL_SLOT0}, //MST 3 Slot (OFS.0*1)+(OFS.1*4)  ;ie. Slot 0, 1, 4, or 5
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 8, NDS_VRAM_BGA_SLOT0}, //MST 4 0..1  Slot 0-1 (OFS=0), Slot 2-3 (OFS=1)
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJA_SLOT0}, //MST 5 Slot 0  ;16K each (only lower 8K used)
+    {0xffffffff, 0, 0x0}, // MST 6 INVALID
+    {0xffffffff, 0, 0x0}, // MST 7 INVALID
+  },{ //Bank G
+    {NDS_MEM_ARM7, 0, 0x06894000,0x100000-1}, //MST 0 6894000h-6897FFFh
+    {NDS_MEM_ARM7, 2, 0x06000000,0x80000-1}, //MST 1 6000000h+(4000h*OFS.0)+(10000h*OFS.1)
+    {NDS_MEM_ARM7, 2, 0x06400000,0x40000-1}, //MST 2 6400000h+(4000h*OFS.0)+(10000h*OFS.1)
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 9, NDS_VRAM_TEX_PAL_SLOT0}, //MST3 Slot (OFS.0*1)+(OFS.1*4)  ;ie. Slot 0, 1, 4, or 5
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 8, NDS_VRAM_BGA_SLOT0}, //MST 4 0..1  Slot 0-1 (OFS=0), Slot 2-3 (OFS=1)
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJA_SLOT0}, //MST 5 Slot 0  ;16K each (only lower 8K used)
+    {0xffffffff, 0, 0x0}, // MST 6 INVALID
+    {0xffffffff, 0, 0x0}, // MST 7 INVALID
+  },{ //Bank H
+    {NDS_MEM_ARM7, 0, 0x06898000,0x100000-1}, //MST 0 6898000h-689FFFFh
+    {NDS_MEM_ARM7, 0, 0x06200000,0x10000-1}, //MST 1 6200000h
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_BGB_SLOT0}, //MST 2 Slot 0-3
+    {0xffffffff, 0, 0x0}, // MST 3 INVALID
+    {NDS_MEM_ARM7, 0, 0x06898000,0x100000-1}, //MST 4 6898000h-689FFFFh
+    {NDS_MEM_ARM7, 0, 0x06200000,0x10000-1}, //MST 5 6200000h
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_BGB_SLOT0}, //MST 6 Slot 0-3
+    {0xffffffff, 0, 0x0}, // MST 7 INVALID
+  },{ //Bank I
+    {NDS_MEM_ARM7, 0, 0x068A0000,0x100000-1}, //MST 0 68A0000h-68A3FFFh
+    {NDS_MEM_ARM7, 0, 0x06208000,0x10000-1}, //MST 1 6208000h
+    {NDS_MEM_ARM7, 0, 0x06600000,0x4000-1}, //MST 2 6600000h
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJB_SLOT0}, //MST 3 Slot 0  ;16K each (only lower 8K used)
+    {NDS_MEM_ARM7, 0, 0x068A0000,0x100000-1}, //MST 4 68A0000h-68A3FFFh
+    {NDS_MEM_ARM7, 0, 0x06208000,0x10000-1}, //MST 5 6208000h
+    {NDS_MEM_ARM7, 0, 0x06600000,0x4000-1}, //MST 6 6600000h
+    {NDS_MEM_ARM7|NDS_MEM_ARM9, 0, NDS_VRAM_OBJB_SLOT0}, //MST 7 Slot 0  ;16K each (only lower 8K used)
+  }
+};
+static const int nds_vram_cnt_array[9]={
+  NDS9_VRAMCNT_A,
+  NDS9_VRAMCNT_B,
+  NDS9_VRAMCNT_C,
+  NDS9_VRAMCNT_D,
+  NDS9_VRAMCNT_E,
+  NDS9_VRAMCNT_F,
+  NDS9_VRAMCNT_G,
+  NDS9_VRAMCNT_H, //These are not contiguous
+  NDS9_VRAMCNT_I, //These are not contiguous
+};
+#define NDS_VRAM_UNMAPPED -1
+#define NDS_VRAM_MULTI_MAPPED -2
+// Slow path for pages where several banks overlap: reads OR the banks together, writes go to all of them
+static uint32_t nds_apply_vram_mem_op_overlapped(nds_t *nds,uint32_t address, uint32_t data, int transaction_type){
+  int vram_offset = 0;
   uint32_t ret_data=0;
-
-  for(int b = 0; b<total_banks;++b){
+  for(int b = 0; b<9;++b){
     int vram_off = vram_offset;
-    vram_offset +=bank_size[b];
-    const static int vram_cnt_array[]={
-      NDS9_VRAMCNT_A,
-      NDS9_VRAMCNT_B,
-      NDS9_VRAMCNT_C,
-      NDS9_VRAMCNT_D,
-      NDS9_VRAMCNT_E,
-      NDS9_VRAMCNT_F,
-      NDS9_VRAMCNT_G,
-      NDS9_VRAMCNT_H, //These are not contiguous
-      NDS9_VRAMCNT_I, //These are not contiguous
-    };
-    uint8_t vramcnt = nds9_io_read8(nds,vram_cnt_array[b]);
+    vram_offset +=nds_vram_bank_size[b];
+    uint8_t vramcnt = nds9_io_read8(nds,nds_vram_cnt_array[b]);
     bool enable = SB_BFE(vramcnt,7,1);
     int mst = SB_BFE(vramcnt,0,3);
     int off = SB_BFE(vramcnt,3,2);
     if(!enable)continue;
 
-    const vram_bank_info_t bank = bank_info[b][mst];
+    const nds_vram_bank_info_t bank = nds_vram_bank_info[b][mst];
     if(transaction_type& bank.transaction_mask)continue;
 
     int base = bank.mem_address_start;
-    base += offset_table[bank.offset_table][off];
+    base += nds_vram_offset_table[bank.offset_table][off];
     if((address&0x0ffe0000)!=(base&0x0ffe0000))continue;
 
-    int bank_offset = address-base; 
+    int bank_offset = address-base;
     bank_offset&=bank.mirror? bank.mirror : -1;
-    if(bank_offset>=bank_size[b])continue;
-    int vram_addr = bank_offset+vram_off;
-
-    if(special_case_multiple_found)nds->mem.vram_translation_cache[lookup_addr]=0;
-    else nds->mem.vram_translation_cache[lookup_addr] = nds->mem.curr_vram_translation_key | SB_BFE(vram_addr,14,10);
-  
-    special_case_multiple_found = true;
-    
-    ret_data|= nds_apply_mem_op(nds->mem.vram,vram_addr,data,transaction_type);
+    if(bank_offset<0||bank_offset>=nds_vram_bank_size[b])continue;
+    ret_data|= nds_apply_mem_op(nds->mem.vram,bank_offset+vram_off,data,transaction_type);
   }
-  return ret_data; 
+  return ret_data;
+}
+static FORCE_INLINE uint32_t nds_apply_vram_mem_op(nds_t *nds,uint32_t address, uint32_t data, int transaction_type){
+  int page = nds->mem.vram_bank_map[transaction_type&0xf][SB_BFE(address,14,10)];
+  if(SB_LIKELY(page>=0))return nds_apply_mem_op(nds->mem.vram,page*16*1024+SB_BFE(address,0,14),data,transaction_type);
+  if(page==NDS_VRAM_UNMAPPED)return 0;
+  return nds_apply_vram_mem_op_overlapped(nds,address,data,transaction_type);
 }
 
 static bool nds_preprocess_mmio(nds_t * nds, uint32_t addr, uint32_t data, int transaction_type);
 static void nds_postprocess_mmio_write(nds_t * nds, uint32_t addr, uint32_t data, int transaction_type);
+// Unused ARM9 IO address the patched DLDI driver talks to
+#define NDS_DLDI_PORT 0x04FFD000
+static uint32_t nds_dldi_port_access(nds_t* nds, uint32_t addr, uint32_t data, int transaction_type);
+#define NDS_MMIO_PREPROCESS  0x1
+#define NDS_MMIO_POSTPROCESS 0x2
+static void nds_recompute_mmio_handler_table(nds_t* nds);
+static void nds_flush_audio(nds_t* nds);
+// Mixed with the clock so diverging save state timelines don't reuse a generation
+static void nds_invalidate_adpcm_cache(nds_t* nds){
+  nds->audio.adpcm_cache_generation = nds->audio.adpcm_cache_generation*6364136223846793005ull+nds->current_clock+1;
+}
+static void nds_adpcm_cache_drop_page(nds_adpcm_cache_t* cache, uint32_t page){
+  cache->source_pages[page/32]&=~(1u<<(page&31));
+  for(int i=0;i<NDS_ADPCM_CACHE_ENTRIES;++i){
+    nds_adpcm_cache_entry_t* entry = cache->entries+i;
+    if(!entry->used||entry->dropped)continue;
+    uint32_t first = entry->sad>>NDS_ADPCM_CACHE_PAGE_SHIFT;
+    uint32_t last = (entry->sad+4+entry->tot_samps/2)>>NDS_ADPCM_CACHE_PAGE_SHIFT;
+    if(page>=first&&page<=last)entry->dropped = true;
+  }
+}
+// Write side effects shared by every path: idle loop tracking, the ADPCM cache and shared RAM sync points
+static FORCE_INLINE void nds_note_memory_write(nds_t* nds, uint32_t addr, int transaction_type){
+  if(SB_LIKELY(!(transaction_type&NDS_MEM_WRITE)))return;
+  nds->mem.idle_loop_side_effects++;
+  if((addr>>24)!=0x2)return;
+  nds_adpcm_cache_t* adpcm_cache = nds->audio.adpcm_cache;
+  if(adpcm_cache){
+    uint32_t page = SB_BFE(addr,NDS_ADPCM_CACHE_PAGE_SHIFT,22-NDS_ADPCM_CACHE_PAGE_SHIFT);
+    if(SB_UNLIKELY(adpcm_cache->source_pages[page/32]&(1u<<(page&31))))nds_adpcm_cache_drop_page(adpcm_cache,page);
+  }
+  if(transaction_type&NDS_MEM_DEBUG)return;
+  uint8_t* writers = nds->shared_ram_writers+SB_BFE(addr,NDS_SHARED_RAM_PAGE_SHIFT,22-NDS_SHARED_RAM_PAGE_SHIFT);
+  *writers|= 1<<((transaction_type&NDS_MEM_ARM9)? NDS_ARM9: NDS_ARM7);
+  if(*writers==((1<<NDS_ARM7)|(1<<NDS_ARM9)))nds->cpu_sync_point = true;
+}
+static uint8_t* nds_tlb_tcm_page(uint8_t* tcm, uint32_t tcm_size, uint32_t start, uint32_t end, uint32_t addr){
+  if(addr<start||addr+NDS_TLB_PAGE_SIZE>end||((addr-start)&(NDS_TLB_PAGE_SIZE-1)))return NULL;
+  return tcm+((addr-start)&(tcm_size-1));
+}
+static bool nds_tlb_tcm_overlaps(uint32_t start, uint32_t end, uint32_t addr){
+  return addr<end&&addr+NDS_TLB_PAGE_SIZE>start;
+}
+static void nds_rebuild_tlb_page(nds_t* nds, nds_tlb_t* tlb, uint32_t p){
+  uint8_t cnt = tlb->wramcnt;
+  uint32_t addr = p<<NDS_TLB_PAGE_SHIFT;
+  uint8_t* arm7_page = NULL;
+  uint8_t* arm9_bus_page = NULL;
+  uint8_t arm9_bus_cycles = 0;
+  switch(addr>>24){
+    case 0x2: 
+      arm7_page = arm9_bus_page = nds->mem.ram+(addr&(4*1024*1024-1));
+      break;
+    case 0x3:{
+      const int offset9[4]={0,16*1024,0,0};
+      const int mask9[4]={32*1024-1,16*1024-1,16*1024-1,0};
+      if(cnt!=3)arm9_bus_page = nds->mem.wram+(addr&mask9[cnt])+offset9[cnt];
+      arm9_bus_cycles = NDS_TLB_BUS;
+      if(addr<=0x037FFFFF){
+        const int offset7[4]={0,0,16*1024,0};
+        const int mask7[4]={0,16*1024-1,16*1024-1,32*1024-1};
+        if(mask7[cnt]==0)arm7_page = nds->mem.wram+32*1024+(addr&(64*1024-1));
+        else             arm7_page = nds->mem.wram+(addr&mask7[cnt])+offset7[cnt];
+      }else arm7_page = nds->mem.wram+32*1024+((addr-0x03800000)&(64*1024-1));
+    }break;
+    case 0x6:{
+      // The bank map pages match the TLB pages, unmapped and overlapped pages stay on the slow path
+      int page9 = nds->mem.vram_bank_map[NDS_MEM_ARM9][SB_BFE(addr,14,10)];
+      int page7 = nds->mem.vram_bank_map[NDS_MEM_ARM7][SB_BFE(addr,14,10)];
+      if(page9>=0)arm9_bus_page = nds->mem.vram+page9*16*1024;
+      if(page7>=0)arm7_page = nds->mem.vram+page7*16*1024;
+      arm9_bus_cycles = NDS_TLB_BUS_VRAM;
+    }break;
+  }
+  tlb->arm7.read[p] = tlb->arm7.write[p] = arm7_page;
+  tlb->arm7.bus_cycles[p] = 0;
+
+  // TCMs have priority over the bus and are only mapped if they cover the whole page
+  uint8_t* read9 = arm9_bus_page;
+  uint8_t* write9 = arm9_bus_page;
+  uint8_t cycles9 = arm9_bus_cycles;
+  bool tcm_read_hit = false, tcm_write_hit = false;
+  if(nds->mem.dtcm_enable&&nds_tlb_tcm_overlaps(nds->mem.dtcm_start_address,nds->mem.dtcm_end_address,addr)){
+    uint8_t* tcm = nds_tlb_tcm_page(nds->mem.data_tcm,16*1024,nds->mem.dtcm_start_address,nds->mem.dtcm_end_address,addr);
+    write9 = tcm; tcm_write_hit = true;
+    if(!nds->mem.dtcm_load_mode){read9 = tcm; tcm_read_hit = true;}
+  }
+  if(nds->mem.itcm_enable&&nds_tlb_tcm_overlaps(nds->mem.itcm_start_address,nds->mem.itcm_end_address,addr)){
+    uint8_t* tcm = nds_tlb_tcm_page(nds->mem.code_tcm,32*1024,nds->mem.itcm_start_address,nds->mem.itcm_end_address,addr);
+    if(!tcm_write_hit){write9 = tcm; tcm_write_hit= true;}
+    if(!tcm_read_hit){
+      if(!nds->mem.itcm_load_mode){read9 = tcm; tcm_read_hit = true;}
+    }
+  }
+  // Bus timed pages that also hit a TCM are left to the slow path
+  tlb->arm9.read[p] = read9;
+  tlb->arm9.write[p] = write9;
+  tlb->arm9.bus_cycles[p] = (tcm_read_hit||tcm_write_hit)&&cycles9? NDS_TLB_SLOW: cycles9;
+}
+static void nds_rebuild_tlb(nds_t* nds, nds_tlb_t* tlb){
+  tlb->nds = nds;
+  tlb->wramcnt = nds9_io_read8(nds,NDS9_WRAMCNT)&0x3;
+  tlb->dtcm_start_address = nds->mem.dtcm_start_address;
+  tlb->dtcm_end_address = nds->mem.dtcm_end_address;
+  tlb->itcm_start_address = nds->mem.itcm_start_address;
+  tlb->itcm_end_address = nds->mem.itcm_end_address;
+  tlb->tcm_flags = nds->mem.dtcm_enable|(nds->mem.dtcm_load_mode<<1)|(nds->mem.itcm_enable<<2)|(nds->mem.itcm_load_mode<<3);
+  for(int b=0;b<9;++b)tlb->vramcnt[b] = nds9_io_read8(nds,nds_vram_cnt_array[b]);
+  for(uint32_t p=0;p<NDS_TLB_NUM_PAGES;++p)nds_rebuild_tlb_page(nds,tlb,p);
+}
+// Rebuilds the TLB if the memory map it was generated from changed, a VRAMCNT write only 
+// regenerates the VRAM pages from the bank map nds_update_vram_mapping built
+static void nds_update_tlb(nds_t* nds){
+  nds_tlb_t* tlb = nds->mem.tlb;
+  if(!tlb)return;
+  uint32_t tcm_flags = nds->mem.dtcm_enable|(nds->mem.dtcm_load_mode<<1)|(nds->mem.itcm_enable<<2)|(nds->mem.itcm_load_mode<<3);
+  if(tlb->nds!=nds||tlb->wramcnt!=(nds9_io_read8(nds,NDS9_WRAMCNT)&0x3)||
+     tlb->dtcm_start_address!=nds->mem.dtcm_start_address||tlb->dtcm_end_address!=nds->mem.dtcm_end_address||
+     tlb->itcm_start_address!=nds->mem.itcm_start_address||tlb->itcm_end_address!=nds->mem.itcm_end_address||
+     tlb->tcm_flags!=tcm_flags){
+    nds_rebuild_tlb(nds,tlb);
+    return;
+  }
+  bool vram_changed = false;
+  for(int b=0;b<9;++b){
+    uint8_t vramcnt = nds9_io_read8(nds,nds_vram_cnt_array[b]);
+    vram_changed |= tlb->vramcnt[b]!=vramcnt;
+    tlb->vramcnt[b] = vramcnt;
+  }
+  if(!vram_changed)return;
+  for(uint32_t p=NDS_TLB_VRAM_FIRST_PAGE;p<NDS_TLB_VRAM_LAST_PAGE;++p)nds_rebuild_tlb_page(nds,tlb,p);
+}
+static FORCE_INLINE bool nds_tlb_transaction(nds_t* nds, nds_tlb_map_t* map, uint32_t addr, uint32_t data, int transaction_type){
+  if(SB_UNLIKELY(addr>=0x08000000))return false;
+  uint32_t page = addr>>NDS_TLB_PAGE_SHIFT;
+  bool write = transaction_type&NDS_MEM_WRITE;
+  uint8_t* host = write? map->write[page]: map->read[page];
+  if(SB_UNLIKELY(!host))return false;
+  uint8_t bus_cycles = map->bus_cycles[page];
+  if(bus_cycles){
+    if(bus_cycles==NDS_TLB_SLOW)return false;
+    nds->mem.slow_bus_cycles+=(transaction_type&NDS_MEM_SEQ)?1:4;
+    const int ignore_write_mask = (NDS_MEM_WRITE|NDS_MEM_1B);
+    if(bus_cycles==NDS_TLB_BUS_VRAM&&(transaction_type&ignore_write_mask)==ignore_write_mask)return true;
+  }
+  nds_note_memory_write(nds,addr,transaction_type);
+  nds->mem.openbus_word = nds_apply_mem_op(host,addr&(NDS_TLB_PAGE_SIZE-1),data,transaction_type);
+  return true;
+}
 static FORCE_INLINE uint32_t nds9_process_memory_transaction(nds_t * nds, uint32_t addr, uint32_t data, int transaction_type){
   uint32_t *ret = &nds->mem.openbus_word;
+  nds_note_memory_write(nds,addr,transaction_type);
   switch(addr>>24){
     case 0x2: //Main RAM
       if(!(transaction_type&(NDS_MEM_ARM9)))nds->mem.slow_bus_cycles+=(transaction_type&NDS_MEM_SEQ)?1:9;
@@ -2690,16 +3242,21 @@ static FORCE_INLINE uint32_t nds9_process_memory_transaction(nds_t * nds, uint32
       break;
     case 0x4: 
         nds->mem.slow_bus_cycles+=(transaction_type&NDS_MEM_SEQ)?1:4;
+        if(SB_UNLIKELY((addr&~0xf)==NDS_DLDI_PORT)){*ret = nds_dldi_port_access(nds,addr,data,transaction_type); return *ret;}
         if((addr&0xffff)>=0x2000||addr>=0x04200000){*ret = 0; return *ret;}
         if(addr >=0x04100000&&addr <0x04200000){addr|=NDS_IO_MAP_041_OFFSET;}
-        bool process_write = nds_preprocess_mmio(nds,addr,data,transaction_type);
+        uint8_t handler_flags = nds->mem.mmio_handler_flags[(addr&0xffff)/4];
+        bool process_write = !(handler_flags&NDS_MMIO_PREPROCESS)||nds_preprocess_mmio(nds,addr,data,transaction_type);
         int baddr =addr&0xffff;
         if(process_write)*ret = nds_apply_mem_op(nds->mem.io, baddr, data, transaction_type); 
         if(!(transaction_type&NDS_MEM_DEBUG)){
+          SB_PERF_COUNT(&nds->perf,SB_COUNTER_MMIO,1);
           nds->mem.mmio_debug_access_buffer[baddr/4]|=(transaction_type&NDS_MEM_WRITE)?0x70:0xf;
           if(nds->mem.mmio_debug_access_buffer[baddr/4]&0x80)nds->arm9.trigger_breakpoint(nds);
+          bool write = transaction_type&NDS_MEM_WRITE;
+          nds_log_event(nds,SB_EVENT_IO9,addr,write?data:*ret,write,0);
         }
-        if((transaction_type&NDS_MEM_WRITE)){
+        if((transaction_type&NDS_MEM_WRITE)&&(handler_flags&NDS_MMIO_POSTPROCESS)){
           nds_postprocess_mmio_write(nds,addr,data,transaction_type);
         }
       break;
@@ -2720,6 +3277,7 @@ static FORCE_INLINE uint32_t nds9_process_memory_transaction(nds_t * nds, uint32
       nds->mem.slow_bus_cycles+=(transaction_type&NDS_MEM_SEQ)?1:4;
       addr&=2*1024-1;
       *ret = nds_apply_mem_op(nds->mem.oam, addr, data, transaction_type); 
+      if((transaction_type&NDS_MEM_WRITE)&&nds->mem.sprite_bins)nds->mem.sprite_bins[addr>>10].dirty=true;
       break;
     case 0xFF: 
       if(addr>=0xFFFF0000){
@@ -2730,59 +3288,72 @@ static FORCE_INLINE uint32_t nds9_process_memory_transaction(nds_t * nds, uint32
   }
   return *ret; 
 }
-static FORCE_INLINE uint32_t nds9_process_memory_transaction_cpu(nds_t * nds, uint32_t addr, uint32_t data, int transaction_type){
+static FORCE_INLINE uint32_t nds9_process_memory_transaction_uncached(nds_t * nds, uint32_t addr, uint32_t data, int transaction_type){
   uint32_t *ret = &nds->mem.openbus_word;
+  if(SB_LIKELY(nds->mem.tlb)&&nds_tlb_transaction(nds,&nds->mem.tlb->arm9,addr,data,transaction_type))return *ret;
   if(addr>=nds->mem.dtcm_start_address&&addr<nds->mem.dtcm_end_address){
     if(SB_LIKELY(nds->mem.dtcm_enable&&(!nds->mem.dtcm_load_mode||(transaction_type&NDS_MEM_WRITE)))){
+      nds_note_memory_write(nds,addr,transaction_type);
       nds->mem.openbus_word = nds_apply_mem_op(nds->mem.data_tcm,(addr-nds->mem.dtcm_start_address)&(16*1024-1),data,transaction_type);
       return *ret; 
     }
   }
   if(addr>=nds->mem.itcm_start_address&&addr<nds->mem.itcm_end_address){
     if(SB_LIKELY(nds->mem.itcm_enable&&(!nds->mem.itcm_load_mode||(transaction_type&NDS_MEM_WRITE)))){
+      nds_note_memory_write(nds,addr,transaction_type);
       nds->mem.openbus_word = nds_apply_mem_op(nds->mem.code_tcm,(addr-nds->mem.itcm_start_address)&(32*1024-1),data,transaction_type);
       return *ret; 
     }
   }
-  //int old_slow_bus_cycles = nds->mem.slow_bus_cycles;
-  uint32_t ret_data = nds9_process_memory_transaction(nds,addr,data,transaction_type);
-  /*int bus = addr>>24;
-  if((bus==0x02&& SB_BFE(addr,0,24)<0x00800000)||(bus==0xff&& SB_BFE(addr,0,24)<0x00008000)){
-    if(!(transaction_type&NDS_MEM_WRITE)){
-      bool found = false; 
-      bool code = (transaction_type&NDS_MEM_CODE);
-      static uint32_t dcache[4*1024/32];
-      static uint32_t icache[8*1024/32];
-      uint32_t * cache = code?icache:dcache;
-      uint32_t hash =    code? (8*1024)/128- 1: (4*1024)/128-1;
-      uint32_t key = addr/32;
-      uint32_t cache_addr = (key&hash)*4;
-      uint32_t shift_val = key; 
-      for(int i=0;i<4;++i){
-        uint32_t t = cache[cache_addr+i];
-        cache[cache_addr+i] = shift_val;
-        shift_val = t; 
-        if(key==shift_val){
-          found=true;
-          break;
-        }
-      }
-      if(!found){
-        int seq_words = 4; 
-        if(code)nds->mem.slow_bus_cycles=old_slow_bus_cycles+seq_words;
-        else nds->mem.slow_bus_cycles=old_slow_bus_cycles+seq_words;
-      }else{
-        nds->mem.slow_bus_cycles= old_slow_bus_cycles;
-      }
-    }else{
-      nds->mem.slow_bus_cycles= old_slow_bus_cycles;
-    }
-  }*/
-  return ret_data; 
+  return nds9_process_memory_transaction(nds,addr,data,transaction_type);
+}
+static FORCE_INLINE bool nds_arm9_cache_find(const uint32_t* ways, uint32_t tag){
+  // Branch free so the four tag compares can be done as one vector compare
+  return (ways[0]==tag)|(ways[1]==tag)|(ways[2]==tag)|(ways[3]==tag);
+}
+// Returns 1 on a hit, 0 on a miss (which allocates the line) and -1 if the address is not cached.
+// Only reads are looked up since the ARM946E-S doesn't allocate on writes
+static int nds_arm9_cache_access(nds_arm9_cache_t* cache, uint32_t addr, bool code){
+  int page = -1;
+  if((addr>>24)==0x02)page = SB_BFE(addr,NDS_ARM9_CACHE_PAGE_SHIFT,12);
+  else if(addr>=0xFFFF0000)page = NDS_ARM9_CACHE_BIOS_PAGE+SB_BFE(addr,NDS_ARM9_CACHE_PAGE_SHIFT,4);
+  if(page<0||!(cache->page_flags[page]&(code?NDS_ARM9_CACHE_CODE:NDS_ARM9_CACHE_DATA)))return -1;
+  uint32_t tag = (addr>>NDS_ARM9_CACHE_LINE_SHIFT)|NDS_ARM9_CACHE_VALID;
+  uint32_t* ways = code? cache->icache[tag&(NDS_ARM9_ICACHE_SETS-1)]: cache->dcache[tag&(NDS_ARM9_DCACHE_SETS-1)];
+  if(nds_arm9_cache_find(ways,tag))return 1;
+  int victim = 0;
+  if(cache->round_robin){
+    uint32_t* counter = code? &cache->icache_victim: &cache->dcache_victim;
+    victim = (*counter)++;
+  }else{
+    if(cache->lfsr==0)cache->lfsr=1;
+    cache->lfsr = (cache->lfsr>>1)^(-(cache->lfsr&1)&0xB400u);
+    victim = cache->lfsr;
+  }
+  ways[victim&(NDS_ARM9_CACHE_WAYS-1)] = tag;
+  return 0;
+}
+static void nds_arm9_cache_invalidate_line(uint32_t (*sets)[NDS_ARM9_CACHE_WAYS], int num_sets, uint32_t addr){
+  uint32_t tag = (addr>>NDS_ARM9_CACHE_LINE_SHIFT)|NDS_ARM9_CACHE_VALID;
+  uint32_t* ways = sets[tag&(num_sets-1)];
+  for(int w=0;w<NDS_ARM9_CACHE_WAYS;++w)if(ways[w]==tag)ways[w]=0;
+}
+static FORCE_INLINE uint32_t nds9_process_memory_transaction_cpu(nds_t * nds, uint32_t addr, uint32_t data, int transaction_type){
+  nds_arm9_cache_t* cache = &nds->cp15.cache;
+  if(SB_LIKELY(!cache->enable_mask||(transaction_type&(NDS_MEM_WRITE|NDS_MEM_DEBUG))))
+    return nds9_process_memory_transaction_uncached(nds,addr,data,transaction_type);
+  int old_slow_bus_cycles = nds->mem.slow_bus_cycles;
+  uint32_t ret_data = nds9_process_memory_transaction_uncached(nds,addr,data,transaction_type);
+  // Cached accesses don't touch the bus unless the line has to be filled
+  int hit = nds_arm9_cache_access(cache,addr,transaction_type&NDS_MEM_CODE);
+  if(hit>=0)nds->mem.slow_bus_cycles = old_slow_bus_cycles+(hit?0:NDS_ARM9_CACHE_MISS_CYCLES);
+  return ret_data;
 }
 
 static FORCE_INLINE uint32_t nds7_process_memory_transaction(nds_t * nds, uint32_t addr, uint32_t data, int transaction_type){
   uint32_t *ret = &nds->mem.openbus_word;
+  nds_note_memory_write(nds,addr,transaction_type);
+  if(SB_LIKELY(nds->mem.tlb)&&nds_tlb_transaction(nds,&nds->mem.tlb->arm7,addr,data,transaction_type))return *ret;
   switch(addr>>24){
       case 0x0: //BIOS(NDS7), TCM(NDS9)
       if(addr<0x4000){
@@ -2832,24 +3403,21 @@ static FORCE_INLINE uint32_t nds7_process_memory_transaction(nds_t * nds, uint32
         if((addr&0xffff)>=0x2000){*ret = 0; return *ret;}
         if(addr >=0x04100000&&addr <0x04200000){addr|=NDS_IO_MAP_041_OFFSET;}
         
-        bool process_write = nds_preprocess_mmio(nds,addr,data,transaction_type);
+        uint8_t handler_flags = nds->mem.mmio_handler_flags[(addr&0xffff)/4];
+        bool process_write = !(handler_flags&NDS_MMIO_PREPROCESS)||nds_preprocess_mmio(nds,addr,data,transaction_type);
         int baddr =addr|NDS_IO_MAP_SPLIT_OFFSET;
         baddr&=0xffff;
         if(process_write)*ret = nds_apply_mem_op(nds->mem.io, baddr, data, transaction_type); 
         if(!(transaction_type&NDS_MEM_DEBUG)){
+          SB_PERF_COUNT(&nds->perf,SB_COUNTER_MMIO,1);
           nds->mem.mmio_debug_access_buffer[baddr/4]|=(transaction_type&NDS_MEM_WRITE)?0x70:0xf;
           if(nds->mem.mmio_debug_access_buffer[baddr/4]&0x80)nds->arm7.trigger_breakpoint(nds);
+          bool write = transaction_type&NDS_MEM_WRITE;
+          nds_log_event(nds,SB_EVENT_IO7,addr,write?data:*ret,write,0);
         }
-        if((transaction_type&NDS_MEM_WRITE)){
+        if((transaction_type&NDS_MEM_WRITE)&&(handler_flags&NDS_MMIO_POSTPROCESS)){
           nds_postprocess_mmio_write(nds,addr,data,transaction_type);
         }
-        if(SB_UNLIKELY(nds->io7_log)){
-          if(addr!=0x04000180){
-            const char* dir = (transaction_type&NDS_MEM_WRITE)? "W":"R";
-            uint32_t io_data = (transaction_type&NDS_MEM_WRITE)?data:*ret;
-            fprintf(nds->io7_log,"%s %08x %08x\n",dir,addr,io_data);
-          }
-        }
       break;
     case 0x6: //VRAM(NDS9) WRAM(NDS7)
       *ret = nds_apply_vram_mem_op(nds, addr, data, transaction_type); 
@@ -2963,23 +3531,75 @@ static FORCE_INLINE uint16_t nds_ppu_read16(nds_t*nds, unsigned baddr){
 static FORCE_INLINE uint32_t nds_ppu_read32(nds_t*nds, unsigned baddr){
   return nds_apply_vram_mem_op(nds,baddr,0,NDS_MEM_4B|NDS_MEM_PPU);
 }
-uint32_t nds9_arm_read32(void* user_data, uint32_t address){return nds9_cpu_read32((nds_t*)user_data,address);}
-uint32_t nds9_arm_read16(void* user_data, uint32_t address){return nds9_cpu_read16((nds_t*)user_data,address);}
+// LDM/STM fast path for the ARM9 DTCM (usually where the stack lives), which has no bus cycles
+static uint32_t* nds9_arm_block_ptr(void* user_data, uint32_t address, uint32_t words, bool write){
+  nds_t* nds = (nds_t*)user_data;
+  if(!nds->mem.dtcm_enable||(nds->mem.dtcm_load_mode&&!write))return NULL;
+  if(address<nds->mem.dtcm_start_address||address+words*4>nds->mem.dtcm_end_address)return NULL;
+  uint32_t offset = (address-nds->mem.dtcm_start_address)&(16*1024-1);
+  if(offset+words*4>16*1024)return NULL;
+  if(write)for(uint32_t i=0;i<words;++i)nds_note_memory_write(nds,address+i*4,NDS_MEM_WRITE|NDS_MEM_4B|NDS_MEM_ARM9);
+  return (uint32_t*)(nds->mem.data_tcm+offset);
+}
+uint32_t nds9_arm_read32(void* user_data, uint32_t address){
+  arm7_watch_access(&((nds_t*)user_data)->arm9,address,4,SB_WATCH_READ);
+  return nds9_cpu_read32((nds_t*)user_data,address);
+}
+uint32_t nds9_arm_read16(void* user_data, uint32_t address){
+  arm7_watch_access(&((nds_t*)user_data)->arm9,address,2,SB_WATCH_READ);
+  return nds9_cpu_read16((nds_t*)user_data,address);
+}
 uint32_t nds9_arm_read32_seq(void* user_data, uint32_t address,bool is_sequential){return nds9_cpu_read32_seq((nds_t*)user_data,address,is_sequential);}
 uint32_t nds9_arm_read16_seq(void* user_data, uint32_t address,bool is_sequential){return nds9_cpu_read16_seq((nds_t*)user_data,address,is_sequential);}
-uint8_t nds9_arm_read8(void* user_data, uint32_t address){return nds9_cpu_read8((nds_t*)user_data,address);}
-void nds9_arm_write32(void* user_data, uint32_t address, uint32_t data){nds9_cpu_write32((nds_t*)user_data,address,data);}
-void nds9_arm_write16(void* user_data, uint32_t address, uint16_t data){nds9_cpu_write16((nds_t*)user_data,address,data);}
-void nds9_arm_write8(void* user_data, uint32_t address, uint8_t data){nds9_cpu_write8((nds_t*)user_data,address,data);}
+uint8_t nds9_arm_read8(void* user_data, uint32_t address){
+  arm7_watch_access(&((nds_t*)user_data)->arm9,address,1,SB_WATCH_READ);
+  return nds9_cpu_read8((nds_t*)user_data,address);
+}
+void nds9_arm_write32(void* user_data, uint32_t address, uint32_t data){
+  arm7_watch_access(&((nds_t*)user_data)->arm9,address,4,SB_WATCH_WRITE);
+  arm7_trace_write(&((nds_t*)user_data)->arm9,address,4,data);
+  nds9_cpu_write32((nds_t*)user_data,address,data);
+}
+void nds9_arm_write16(void* user_data, uint32_t address, uint16_t data){
+  arm7_watch_access(&((nds_t*)user_data)->arm9,address,2,SB_WATCH_WRITE);
+  arm7_trace_write(&((nds_t*)user_data)->arm9,address,2,data);
+  nds9_cpu_write16((nds_t*)user_data,address,data);
+}
+void nds9_arm_write8(void* user_data, uint32_t address, uint8_t data){
+  arm7_watch_access(&((nds_t*)user_data)->arm9,address,1,SB_WATCH_WRITE);
+  arm7_trace_write(&((nds_t*)user_data)->arm9,address,1,data);
+  nds9_cpu_write8((nds_t*)user_data,address,data);
+}
 
-uint32_t nds7_arm_read32(void* user_data, uint32_t address){return nds7_read32((nds_t*)user_data,address);}
-uint32_t nds7_arm_read16(void* user_data, uint32_t address){return nds7_read16((nds_t*)user_data,address);}
+uint32_t nds7_arm_read32(void* user_data, uint32_t address){
+  arm7_watch_access(&((nds_t*)user_data)->arm7,address,4,SB_WATCH_READ);
+  return nds7_read32((nds_t*)user_data,address);
+}
+uint32_t nds7_arm_read16(void* user_data, uint32_t address){
+  arm7_watch_access(&((nds_t*)user_data)->arm7,address,2,SB_WATCH_READ);
+  return nds7_read16((nds_t*)user_data,address);
+}
 uint32_t nds7_arm_read32_seq(void* user_data, uint32_t address,bool is_sequential){return nds7_read32_seq((nds_t*)user_data,address,is_sequential);}
 uint32_t nds7_arm_read16_seq(void* user_data, uint32_t address,bool is_sequential){return nds7_read16_seq((nds_t*)user_data,address,is_sequential);}
-uint8_t nds7_arm_read8(void* user_data, uint32_t address){return nds7_read8((nds_t*)user_data,address);}
-void nds7_arm_write32(void* user_data, uint32_t address, uint32_t data){nds7_write32((nds_t*)user_data,address,data);}
-void nds7_arm_write16(void* user_data, uint32_t address, uint16_t data){nds7_write16((nds_t*)user_data,address,data);}
-void nds7_arm_write8(void* user_data, uint32_t address, uint8_t data){nds7_write8((nds_t*)user_data,address,data);}
+uint8_t nds7_arm_read8(void* user_data, uint32_t address){
+  arm7_watch_access(&((nds_t*)user_data)->arm7,address,1,SB_WATCH_READ);
+  return nds7_read8((nds_t*)user_data,address);
+}
+void nds7_arm_write32(void* user_data, uint32_t address, uint32_t data){
+  arm7_watch_access(&((nds_t*)user_data)->arm7,address,4,SB_WATCH_WRITE);
+  arm7_trace_write(&((nds_t*)user_data)->arm7,address,4,data);
+  nds7_write32((nds_t*)user_data,address,data);
+}
+void nds7_arm_write16(void* user_data, uint32_t address, uint16_t data){
+  arm7_watch_access(&((nds_t*)user_data)->arm7,address,2,SB_WATCH_WRITE);
+  arm7_trace_write(&((nds_t*)user_data)->arm7,address,2,data);
+  nds7_write16((nds_t*)user_data,address,data);
+}
+void nds7_arm_write8(void* user_data, uint32_t address, uint8_t data){
+  arm7_watch_access(&((nds_t*)user_data)->arm7,address,1,SB_WATCH_WRITE);
+  arm7_trace_write(&((nds_t*)user_data)->arm7,address,1,data);
+  nds7_write8((nds_t*)user_data,address,data);
+}
 
 uint32_t nds_coprocessor_read(void* user_data, int coproc,int opcode,int Cn, int Cm,int Cp);
 void nds_coprocessor_write(void* user_data, int coproc,int opcode,int Cn, int Cm,int Cp,uint32_t data);
@@ -3006,45 +3626,286 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds, nds_scratch_t* scratch);
 static void nds_reset_gpu(nds_t*nds);
 void nds_reset(nds_t*nds);
  
+// Returns the 4KB block holding card offset block<<NDS_CARD_BLOCK_SHIFT, bytes past the end of the card read as 0xff
+static const uint8_t* nds_card_block(nds_t* nds, uint32_t block){
+  nds_card_cache_t* cache = nds->mem.card_cache;
+  int victim = 0;
+  for(int i=0;i<NDS_CARD_CACHE_BLOCKS;++i){
+    if(cache->tag[i]==block+1){
+      cache->last_use[i]=++cache->use_counter;
+      return cache->data[i];
+    }
+    if(cache->last_use[i]<cache->last_use[victim])victim=i;
+  }
+  uint8_t* data = cache->data[victim];
+  uint64_t offset = (uint64_t)block<<NDS_CARD_BLOCK_SHIFT;
+  size_t size = NDS_CARD_BLOCK_SIZE;
+  if(offset+size>nds->mem.card_size)size = offset<nds->mem.card_size? nds->mem.card_size-offset: 0;
+  memset(data+size,0xff,NDS_CARD_BLOCK_SIZE-size);
+  if(size&&!nds->mem.card_read(nds->mem.card_read_user_data,offset,data,size)){
+    printf("Failed to read gamecard block at 0x%08llx\n",(unsigned long long)offset);
+    memset(data,0xff,size);
+  }
+  cache->tag[victim]=block+1;
+  cache->last_use[victim]=++cache->use_counter;
+  cache->misses++;
+  return data;
+}
+// Copies size bytes of the card from offset, wrapping around at the end of the card
+static void nds_card_read(nds_t* nds, uint32_t offset, uint8_t* dst, uint32_t size){
+  size_t card_size = nds->mem.card_size;
+  if(!card_size||(!nds->mem.card_data&&!nds->mem.card_read)){
+    memset(dst,0xff,size);
+    return;
+  }
+  while(size){
+    offset%=card_size;
+    uint32_t chunk = size;
+    if(nds->mem.card_data){
+      if(offset+chunk>card_size)chunk = card_size-offset;
+      memcpy(dst,nds->mem.card_data+offset,chunk);
+    }else{
+      uint32_t block_off = offset&(NDS_CARD_BLOCK_SIZE-1);
+      chunk = NDS_MIN(chunk,NDS_CARD_BLOCK_SIZE-block_off);
+      if(offset+chunk>card_size)chunk = card_size-offset;
+      memcpy(dst,nds_card_block(nds,offset>>NDS_CARD_BLOCK_SHIFT)+block_off,chunk);
+    }
+    dst+=chunk;
+    offset+=chunk;
+    size-=chunk;
+  }
+}
 void nds9_copy_card_region_to_ram(nds_t* nds, const char* region_name, uint32_t rom_offset, uint32_t ram_offset, uint32_t size){
   printf("Copy %s: Card[0x%x]-> RAM[0x%x] Size: %d Card Size:%zu\n",region_name,rom_offset,ram_offset,size,nds->mem.card_size);
-  for(int i=0;i<size;++i){
-    if(rom_offset+i<nds->mem.card_size) nds9_write8(nds,ram_offset+i,nds->mem.card_data[rom_offset+i]);
+  uint8_t buffer[NDS_CARD_BLOCK_SIZE];
+  for(uint32_t i=0;i<size&&rom_offset+i<nds->mem.card_size;i+=NDS_CARD_BLOCK_SIZE){
+    uint32_t chunk = NDS_MIN(size-i,NDS_CARD_BLOCK_SIZE);
+    if(rom_offset+i+chunk>nds->mem.card_size)chunk = nds->mem.card_size-rom_offset-i;
+    nds_card_read(nds,rom_offset+i,buffer,chunk);
+    for(uint32_t j=0;j<chunk;++j)nds9_write8(nds,ram_offset+i+j,buffer[j]);
   }
 }
 void nds7_copy_card_region_to_ram(nds_t* nds, const char* region_name, uint32_t rom_offset, uint32_t ram_offset, uint32_t size){
   printf("Copy %s: Card[0x%x]-> RAM[0x%x] Size: %d Card Size:%zu\n",region_name,rom_offset,ram_offset,size,nds->mem.card_size);
-  for(int i=0;i<size;++i){
-    if(rom_offset+i<nds->mem.card_size) nds7_write8(nds,ram_offset+i,nds->mem.card_data[rom_offset+i]);
+  uint8_t buffer[NDS_CARD_BLOCK_SIZE];
+  for(uint32_t i=0;i<size&&rom_offset+i<nds->mem.card_size;i+=NDS_CARD_BLOCK_SIZE){
+    uint32_t chunk = NDS_MIN(size-i,NDS_CARD_BLOCK_SIZE);
+    if(rom_offset+i+chunk>nds->mem.card_size)chunk = nds->mem.card_size-rom_offset-i;
+    nds_card_read(nds,rom_offset+i,buffer,chunk);
+    for(uint32_t j=0;j<chunk;++j)nds7_write8(nds,ram_offset+i+j,buffer[j]);
+  }
+}
+// Open addressed index of nds_rom_database by game code, at most half full so lookups take about one probe.
+// Like the ARM lookup tables it is shared by every core and only built once.
+#define NDS_ROM_DB_INDEX_SIZE 16384
+#define NDS_ROM_DB_COUNT (sizeof(nds_rom_database)/sizeof(nds_rom_database[0]))
+static uint16_t nds_rom_db_index[NDS_ROM_DB_INDEX_SIZE]; // Entry index+1, 0 when empty
+static bool nds_rom_db_index_ready = false;
+static FORCE_INLINE uint32_t nds_rom_db_hash(uint32_t game_code){
+  return (game_code*0x9E3779B1u)>>(32-14);
+}
+static void nds_init_rom_database_index(){
+  if(nds_rom_db_index_ready)return;
+  _Static_assert(NDS_ROM_DB_COUNT*2<=NDS_ROM_DB_INDEX_SIZE&&NDS_ROM_DB_INDEX_SIZE==(1<<14), "nds_rom_db_index is too small");
+  for(uint32_t i=0;i<NDS_ROM_DB_COUNT;++i){
+    uint32_t slot = nds_rom_db_hash(nds_rom_database[i].GameCode);
+    while(nds_rom_db_index[slot])slot=(slot+1)&(NDS_ROM_DB_INDEX_SIZE-1);
+    nds_rom_db_index[slot]=i+1;
   }
+  nds_rom_db_index_ready = true;
 }
-int nds_rom_db_compare_func(const void* a, const void *b){
-  return ((nds_rom_entry_t*)a)->GameCode-*(uint32_t*)b;
+// Returns the database entry of a game code, NULL if it isn't known
+static const nds_rom_entry_t* nds_lookup_rom_database(uint32_t game_code){
+  nds_init_rom_database_index();
+  uint32_t slot = nds_rom_db_hash(game_code);
+  while(nds_rom_db_index[slot]){
+    const nds_rom_entry_t* entry = nds_rom_database+nds_rom_db_index[slot]-1;
+    if(entry->GameCode==game_code)return entry;
+    slot=(slot+1)&(NDS_ROM_DB_INDEX_SIZE-1);
+  }
+  return NULL;
 }
 static void nds_update_vram_mapping(nds_t*nds){
-  const static int vram_cnt_array[]={
-    NDS9_VRAMCNT_A,
-    NDS9_VRAMCNT_B,
-    NDS9_VRAMCNT_C,
-    NDS9_VRAMCNT_D,
-    NDS9_VRAMCNT_E,
-    NDS9_VRAMCNT_F,
-    NDS9_VRAMCNT_G,
-    NDS9_VRAMCNT_H, //These are not contiguous
-    NDS9_VRAMCNT_I, //These are not contiguous
-  };
-  //Recompute VRAM translation key
-  nds->mem.curr_vram_translation_key=0; 
-  for(int b =0;b<sizeof(vram_cnt_array)/sizeof(vram_cnt_array[0]);++b){
-    uint8_t bank_settings = nds9_io_read8(nds,vram_cnt_array[b]);
-    uint64_t bank_key = SB_BFE(bank_settings,0,5);
-    bank_key|= SB_BFE(bank_settings,7,1)<<5;
-    nds->mem.curr_vram_translation_key|= bank_key<<(b*6+10);
+  //Rebuild the flat bank map
+  memset(nds->mem.vram_bank_map,0xff,sizeof(nds->mem.vram_bank_map));
+  int vram_offset = 0;
+  for(int b = 0; b<9;++b){
+    int vram_off = vram_offset;
+    vram_offset +=nds_vram_bank_size[b];
+    uint8_t vramcnt = nds9_io_read8(nds,nds_vram_cnt_array[b]);
+    bool enable = SB_BFE(vramcnt,7,1);
+    int mst = SB_BFE(vramcnt,0,3);
+    int off = SB_BFE(vramcnt,3,2);
+    if(!enable)continue;
+
+    const nds_vram_bank_info_t bank = nds_vram_bank_info[b][mst];
+    // Invalid MST values block every transaction type
+    if(bank.transaction_mask&~0xf)continue;
+    int base = bank.mem_address_start;
+    base += nds_vram_offset_table[bank.offset_table][off];
+    // A bank only decodes within the 128KB window holding its base
+    for(int p=0;p<8;++p){
+      int page_addr = (base&0x0ffe0000)+p*16*1024;
+      int bank_offset = page_addr-base;
+      bank_offset&=bank.mirror? bank.mirror : -1;
+      if(bank_offset<0||bank_offset>=nds_vram_bank_size[b])continue;
+      int vram_page = (bank_offset+vram_off)/(16*1024);
+      for(int t=0;t<16;++t){
+        if(t& bank.transaction_mask)continue;
+        int16_t* entry = &nds->mem.vram_bank_map[t][SB_BFE(page_addr,14,10)];
+        *entry = *entry==NDS_VRAM_UNMAPPED? vram_page: NDS_VRAM_MULTI_MAPPED;
+      }
+    }
+  }
+  // Mixed with the clock so diverging save state timelines don't reuse a generation
+  nds->gpu.tex_cache_generation = nds->gpu.tex_cache_generation*6364136223846793005ull+nds->current_clock+1;
+}
+// DLDI lets homebrew built with libfat use whatever storage the flashcart provides by patching a
+// driver over a stub in the binary. A driver that forwards each call to NDS_DLDI_PORT is patched in
+// when a host image is available, the sectors are then copied from/to the image directly instead
+// of emulating a storage device and its bus.
+#define NDS_DLDI_MAGIC 0xBF8DA5ED
+#define NDS_DLDI_HEADER_SIZE 0x80
+#define NDS_DLDI_DRIVER_SIZE 0xC4
+#define NDS_DLDI_SIZE_LOG2 8
+enum{
+  NDS_DLDI_STARTUP=1,
+  NDS_DLDI_IS_INSERTED,
+  NDS_DLDI_READ_SECTORS,
+  NDS_DLDI_WRITE_SECTORS,
+  NDS_DLDI_CLEAR_STATUS,
+  NDS_DLDI_SHUTDOWN,
+};
+static void nds_dldi_build_driver(uint8_t* driver){
+  memset(driver,0,NDS_DLDI_DRIVER_SIZE);
+  uint32_t* w = (uint32_t*)driver;
+  w[0x00/4] = NDS_DLDI_MAGIC;
+  memcpy(driver+0x04," Chishm",8);
+  driver[0x0C] = 1; // Version
+  driver[0x0D] = NDS_DLDI_SIZE_LOG2;
+  driver[0x0E] = 0; // Position independent, nothing to fix up
+  strncpy((char*)driver+0x10,"SkyEmu host storage",48);
+  // Data, glue, GOT and BSS ranges, relative to the address the driver is linked at (0)
+  w[0x40/4] = 0;
+  for(int i=0x44;i<0x60;i+=4)w[i/4] = NDS_DLDI_DRIVER_SIZE;
+  memcpy(driver+0x60,"SKYE",4);
+  w[0x64/4] = 0x23; // Can read, can write, slot-1
+  // startup, isInserted, readSectors, writeSectors, clearStatus, shutdown
+  for(int f=0;f<6;++f){
+    w[0x68/4+f] = NDS_DLDI_HEADER_SIZE+f*8;
+    w[(NDS_DLDI_HEADER_SIZE+f*8)/4] = 0xE3A0C000|(NDS_DLDI_STARTUP+f); // mov r12,#command
+    w[(NDS_DLDI_HEADER_SIZE+f*8)/4+1] = 0xEA000000|((9-f*2)&0xffffff);  // b common
+  }
+  w[0xB0/4] = 0xE59F3008; // common: ldr r3,=NDS_DLDI_PORT
+  w[0xB4/4] = 0xE8831007; // stmia r3,{r0,r1,r2,r12}
+  w[0xB8/4] = 0xE593000C; // ldr r0,[r3,#12]
+  w[0xBC/4] = 0xE12FFF1E; // bx lr
+  w[0xC0/4] = NDS_DLDI_PORT;
+}
+// Patches the driver over the DLDI stub of the binary loaded at [address,address+size)
+static bool nds_dldi_patch(nds_t* nds, uint32_t address, uint32_t size){
+  if((address>>24)!=0x02)return false;
+  uint32_t offset = address&(4*1024*1024-1);
+  if(size>sizeof(nds->mem.ram)-offset)size = sizeof(nds->mem.ram)-offset;
+  uint8_t* bin = nds->mem.ram+offset;
+  for(uint32_t off=0;off+NDS_DLDI_HEADER_SIZE<=size;off+=4){
+    uint8_t* stub = bin+off;
+    if(*(uint32_t*)stub!=NDS_DLDI_MAGIC||memcmp(stub+4," Chishm",8))continue;
+    uint8_t allocated = stub[0x0F];
+    if(allocated<NDS_DLDI_SIZE_LOG2||off+(1u<<NDS_DLDI_SIZE_LOG2)>size){
+      printf("DLDI stub at 0x%08x is too small for the driver\n",address+off);
+      return false;
+    }
+    // The stub can be relocated, pointers are rebased to the address it was linked at
+    uint32_t link_address = *(uint32_t*)(stub+0x40);
+    if(!link_address)link_address = *(uint32_t*)(stub+0x68)-NDS_DLDI_HEADER_SIZE;
+    nds_dldi_build_driver(stub);
+    stub[0x0F] = allocated;
+    for(int i=0x40;i<0x60;i+=4)*(uint32_t*)(stub+i)+=link_address;
+    for(int i=0x68;i<0x80;i+=4)*(uint32_t*)(stub+i)+=link_address;
+    printf("Patched DLDI stub at 0x%08x\n",address+off);
+    return true;
+  }
+  return false;
+}
+// Opens the host image that backs the DLDI driver, <rom>.fat.img next to the save file
+static void nds_dldi_open(nds_dldi_t* dldi, const char* save_file_path){
+  if(dldi->image)fclose(dldi->image);
+  memset(dldi,0,sizeof(*dldi));
+  const char* base, *file, *ext;
+  sb_breakup_path(save_file_path,&base,&file,&ext);
+  char path[SB_FILE_PATH_SIZE];
+  se_join_path(path,SB_FILE_PATH_SIZE,base,file,"fat.img");
+  FILE* f = fopen(path,"r+b");
+  if(!f)return;
+  fseek(f,0,SEEK_END);
+  long size = ftell(f);
+  if(size<NDS_DLDI_SECTOR_SIZE){fclose(f);return;}
+  dldi->image = f;
+  dldi->sectors = size/NDS_DLDI_SECTOR_SIZE;
+  printf("Loaded DLDI image:%s (%u sectors)\n",path,dldi->sectors);
+}
+// Copies between host memory and the ARM9 address space, main RAM is accessed directly
+static void nds_dldi_copy(nds_t* nds, uint32_t addr, uint8_t* data, uint32_t size, bool write){
+  uint32_t slow_bus_cycles = nds->mem.slow_bus_cycles;
+  for(uint32_t i=0;i<size;){
+    uint32_t a = addr+i;
+    if((a>>24)==0x02){
+      uint32_t offset = a&(4*1024*1024-1);
+      // Chunks stay in one 4KB page so a single note invalidates everything derived from it
+      uint32_t chunk = 4096-(offset&4095);
+      if(chunk>size-i)chunk = size-i;
+      if(write){
+        memcpy(nds->mem.ram+offset,data+i,chunk);
+        nds_note_memory_write(nds,a,NDS_MEM_WRITE|NDS_MEM_ARM9);
+      }else memcpy(data+i,nds->mem.ram+offset,chunk);
+      i+=chunk;
+    }else{
+      if(write)nds9_process_memory_transaction_uncached(nds,a,data[i],NDS_MEM_WRITE|NDS_MEM_1B|NDS_MEM_ARM9);
+      else data[i] = nds9_process_memory_transaction_uncached(nds,a,0,NDS_MEM_1B|NDS_MEM_ARM9);
+      ++i;
+    }
+  }
+  nds->mem.slow_bus_cycles = slow_bus_cycles;
+}
+static bool nds_dldi_command(nds_t* nds, uint32_t command, uint32_t sector, uint32_t count, uint32_t buffer){
+  nds_dldi_t* dldi = nds->mem.dldi;
+  if(!dldi||!dldi->image)return false;
+  switch(command){
+    case NDS_DLDI_STARTUP: case NDS_DLDI_IS_INSERTED: case NDS_DLDI_CLEAR_STATUS: return true;
+    case NDS_DLDI_SHUTDOWN: fflush(dldi->image); return true;
+    case NDS_DLDI_READ_SECTORS: case NDS_DLDI_WRITE_SECTORS:{
+      bool write = command==NDS_DLDI_WRITE_SECTORS;
+      if(sector>=dldi->sectors||count>dldi->sectors-sector)return false;
+      if(fseek(dldi->image,(long)sector*NDS_DLDI_SECTOR_SIZE,SEEK_SET))return false;
+      uint8_t data[NDS_DLDI_SECTOR_SIZE];
+      for(uint32_t i=0;i<count;++i){
+        uint32_t addr = buffer+i*NDS_DLDI_SECTOR_SIZE;
+        if(write){
+          nds_dldi_copy(nds,addr,data,NDS_DLDI_SECTOR_SIZE,false);
+          if(fwrite(data,1,NDS_DLDI_SECTOR_SIZE,dldi->image)!=NDS_DLDI_SECTOR_SIZE)return false;
+        }else{
+          if(fread(data,1,NDS_DLDI_SECTOR_SIZE,dldi->image)!=NDS_DLDI_SECTOR_SIZE)return false;
+          nds_dldi_copy(nds,addr,data,NDS_DLDI_SECTOR_SIZE,true);
+        }
+      }
+      if(write)fflush(dldi->image);
+      return true;
+    }
   }
-  nds->mem.curr_vram_translation_key|=(1ull)<<63;
+  return false;
+}
+// The driver stores sector, count, buffer and then the command with one STM and reads back the result
+static uint32_t nds_dldi_port_access(nds_t* nds, uint32_t addr, uint32_t data, int transaction_type){
+  uint32_t* port = nds->mem.dldi_port;
+  int reg = SB_BFE(addr,2,2);
+  if(!(transaction_type&NDS_MEM_WRITE))return port[reg];
+  if(reg==3&&!(transaction_type&NDS_MEM_DEBUG))port[3] = nds_dldi_command(nds,data,port[0],port[1],port[2]);
+  else port[reg] = data;
+  return data;
 }
 bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
-  if(!sb_path_has_file_ext(emu->rom_path, ".nds"))return false; 
+  if(!sb_path_has_file_ext(emu->rom_path, ".nds")&&!sb_path_has_file_ext(emu->rom_path, ".ndsz"))return false; 
 
   if(emu->rom_size>512*1024*1024){
     printf("ROMs with sizes >512MB (%zu bytes) are too big for the NDS\n",emu->rom_size); 
@@ -3056,19 +3917,30 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
   }
   memset(nds,0,sizeof(nds_t));
 
-  strncpy(nds->save_file_path,emu->save_file_path,SB_FILE_PATH_SIZE);
-  nds->save_file_path[SB_FILE_PATH_SIZE-1]=0;
+  strncpy(nds->host.save_file_path,emu->save_file_path,SB_FILE_PATH_SIZE);
+  nds->host.save_file_path[SB_FILE_PATH_SIZE-1]=0;
   memset(&nds->mem,0,sizeof(nds->mem));
 
   nds->mem.card_data=emu->rom_data;
   nds->mem.card_size=emu->rom_size;
+  nds->mem.card_read=emu->rom_read;
+  nds->mem.card_read_user_data=emu->rom_read_user_data;
+  memset(&scratch->card_cache,0,sizeof(scratch->card_cache));
+  nds->mem.card_cache=&scratch->card_cache;
+  memset(&scratch->adpcm_cache,0,sizeof(scratch->adpcm_cache));
+  nds->audio.adpcm_cache=&scratch->adpcm_cache;
+  nds_dldi_open(&scratch->dldi,nds->host.save_file_path);
+  nds->mem.dldi=&scratch->dldi;
   nds->mem.save_data = scratch->save_data;
+  nds_recompute_mmio_handler_table(nds);
 
-  memcpy(&nds->card,emu->rom_data,sizeof(nds_card_t));
+  nds_card_read(nds,0,(uint8_t*)&nds->card,sizeof(nds_card_t));
   nds->card.title[11]=0;
 
   nds->arm7 = arm7_init(nds);
   nds->arm9 = arm7_init(nds);
+  scratch->tex_cache.full = true;
+  memset(&scratch->geometry_cache,0,sizeof(scratch->geometry_cache));
   
   for(int bg = 2;bg<4;++bg){
     nds9_io_store16(nds,GBA_BG2PA+(bg-2)*0x10,1<<8);
@@ -3080,14 +3952,14 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
   nds9_write16(nds,0x04000088,512);
   nds->activate_dmas=false;
   nds->last_timer_clock= 0; 
-  if(nds->mem.card_data)memcpy(&nds->card,nds->mem.card_data,sizeof(nds->card));
-  bool load_nds7= se_load_bios_file("NDS7 BIOS", nds->save_file_path, "nds7.bin", scratch->nds7_bios,sizeof(scratch->nds7_bios));
+  nds_card_read(nds,0,(uint8_t*)&nds->card,sizeof(nds->card));
+  bool load_nds7= sb_load_bios_file(emu,"NDS7 BIOS", nds->host.save_file_path, "nds7.bin", scratch->nds7_bios,sizeof(scratch->nds7_bios));
   if(!load_nds7)memcpy(scratch->nds7_bios,drastic_bios_arm7_bin,sizeof(drastic_bios_arm7_bin));
 
-  bool load_nds9= se_load_bios_file("NDS9 BIOS", nds->save_file_path, "nds9.bin", scratch->nds9_bios,sizeof(scratch->nds9_bios));
+  bool load_nds9= sb_load_bios_file(emu,"NDS9 BIOS", nds->host.save_file_path, "nds9.bin", scratch->nds9_bios,sizeof(scratch->nds9_bios));
   if(!load_nds9)memcpy(scratch->nds9_bios,drastic_bios_arm9_bin,sizeof(drastic_bios_arm9_bin));
 
-  bool loaded_firmware = se_load_bios_file("NDS Firmware", nds->save_file_path, "firmware.bin", scratch->firmware,sizeof(scratch->firmware));
+  bool loaded_firmware = sb_load_bios_file(emu,"NDS Firmware", nds->host.save_file_path, "firmware.bin", scratch->firmware,sizeof(scratch->firmware));
 
   bool fast_boot =true;
   if(fast_boot){
@@ -3106,8 +3978,8 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
       0x03003f80,0x0,0x03003fc0,0x0,0x0,0x0,0x0,0x0,
       0x0,0x0,0x0,0x0,0x0,
     };
-    for(int i=0;i<37;++i)nds->arm7.registers[i]=initial_regs[i];
-    for(int i=0;i<37;++i)nds->arm9.registers[i]=initial_regs_arm9[i];
+    arm7_set_registers(&nds->arm7,initial_regs);
+    arm7_set_registers(&nds->arm9,initial_regs_arm9);
     const uint32_t initial_mmio_writes[]={
       0x4000000,0x80,
       0x4000004,0x7e0000,
@@ -3146,6 +4018,7 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
     printf("Game Name: %s\n",nds->card.title);
     nds9_copy_card_region_to_ram(nds,"ARM9 Executable",nds->card.arm9_rom_offset,nds->card.arm9_ram_address,nds->card.arm9_size);
     nds7_copy_card_region_to_ram(nds,"ARM7 Executable",nds->card.arm7_rom_offset,nds->card.arm7_ram_address,nds->card.arm7_size);
+    if(scratch->dldi.image)nds_dldi_patch(nds,nds->card.arm9_ram_address,nds->card.arm9_size);
     nds->arm9.registers[PC] = nds->card.arm9_entrypoint;
     nds->arm7.registers[PC] = nds->card.arm7_entrypoint;
     
@@ -3185,8 +4058,8 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
 
   if(nds->arm7.log_cmp_file){fclose(nds->arm7.log_cmp_file);nds->arm7.log_cmp_file=NULL;};
   if(nds->arm9.log_cmp_file){fclose(nds->arm9.log_cmp_file);nds->arm9.log_cmp_file=NULL;};
-  nds->arm7.log_cmp_file =se_load_log_file(nds->save_file_path, "log7.bin");
-  nds->arm9.log_cmp_file =se_load_log_file(nds->save_file_path, "log9.bin");
+  nds->arm7.log_cmp_file =se_load_log_file(nds->host.save_file_path, "log7.bin");
+  nds->arm9.log_cmp_file =se_load_log_file(nds->host.save_file_path, "log9.bin");
 
 
   //Preload user settings
@@ -3346,10 +4219,8 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
   nds_reset_gpu(nds);
 
   uint32_t game_code = (nds->card.gamecode[0]<<0)|(nds->card.gamecode[1]<<8)|(nds->card.gamecode[2]<<16)|(nds->card.gamecode[3]<<24);
-  nds_rom_entry_t* rom_entry = (nds_rom_entry_t*)bsearch(&game_code, nds_rom_database,
-                                sizeof(nds_rom_database)/sizeof(nds_rom_database[0]),sizeof(nds_rom_database[0]),
-                                nds_rom_db_compare_func);
-  if(rom_entry&&rom_entry->GameCode==game_code){
+  const nds_rom_entry_t* rom_entry = nds_lookup_rom_database(game_code);
+  if(rom_entry){
     nds->backup.backup_type = rom_entry->SaveMemType;
   }else{
     printf("Save type for %08x could not be looked up in the database. A default will be assumed\n",game_code);
@@ -3358,25 +4229,18 @@ bool nds_load_rom(sb_emu_state_t*emu,nds_t* nds,nds_scratch_t*scratch){
   printf("NDS Save Type: %d\n",nds->backup.backup_type);
 
   size_t bytes=0;
-  uint8_t*data = sb_load_file_data(emu->save_file_path,&bytes);
+  uint8_t*data = emu->save_file_path[0]? sb_load_file_data(emu->save_file_path,&bytes): NULL;
   if(data){
     printf("Loaded save file: %s, bytes: %zu\n",emu->save_file_path,bytes);
     if(bytes>=nds_get_save_size(nds))bytes=nds_get_save_size(nds);
     memcpy(nds->mem.save_data, data, bytes);
     sb_free_file_data(data);
   }else{
-    printf("Could not find save file: %s\n",emu->save_file_path);
+    if(emu->save_file_path[0])printf("Could not find save file: %s\n",emu->save_file_path);
     for(int i=0;i<sizeof(nds->mem.save_data);++i) nds->mem.save_data[i]=0;
   }
   nds_update_vram_mapping(nds);
 
-  //nds->gx_log = fopen("gxlog.txt","wb");
-  //nds->io7_log = fopen("io7log.txt","wb");
-  //nds->io9_log = fopen("io9log.txt","wb");
-  //nds->vert_log = fopen("vertlog.txt","wb");
-  //nds->gc_log = fopen("gclog.txt","wb");
-  //nds->dma_log = fopen("dmalog.txt","wb");
-
   return true; 
 }  
 static void nds_unload(nds_t* nds, nds_scratch_t* scratch){
@@ -3385,33 +4249,138 @@ static void nds_unload(nds_t* nds, nds_scratch_t* scratch){
   printf("Unloading DS data\n");
 }
 uint32_t nds_sqrt_u64(uint64_t value){
-  uint32_t res = 0;
-  for(uint64_t b=0;b<32;++b){
-    uint64_t test = res | (1ull<<(31-b));
-    if(test*test<=value)res = test;
-  }
+  // The double estimate is within one of the floor of the root, so only fix up the rounding
+  uint64_t res = sqrt((double)value);
+  if(res>0xffffffffull)res = 0xffffffffull;
+  while(res*res>value)res--;
+  while(res<0xffffffffull&&(res+1)*(res+1)<=value)res++;
   return res; 
 }
-#define NDS_CARD_MAIN_DATA_READ 0xB7
-#define NDS_CARD_CHIP_ID_READ 0xB8
-static void nds_process_gc_bus_read(nds_t*nds, int cpu_id){
-  if(nds->mem.card_transfer_bytes<=0)return;
-  nds->activate_dmas=true;
-  uint16_t exmemcnt = nds9_io_read16(nds,NDS9_EXMEMCNT);
-  bool arm7_has_slot = SB_BFE(exmemcnt,11,1);
-  if(cpu_id==arm7_has_slot)return;
-  
-  uint8_t data[4]; 
-  int bank = nds->mem.card_read_offset&~0xfff;
-  int bank_off = nds->mem.card_read_offset&0xfff;
-  data[0]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
-  data[1]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
-  data[2]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
-  data[3]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
-  uint32_t data_out = *(uint32_t*)(data);
-  if(nds->gc_log)fprintf(nds->gc_log,"Data: %08x\n",data_out);
-  //printf("data[%08x]: %08x\n",nds->mem.card_read_offset,data_out);
-  nds_io_store32(nds,cpu_id,NDS_GC_BUS,data_out);
+// High level emulation of the BIOS SWIs that don't call back into game code. Both CPUs share
+// the numbering for these, everything else (and divide by zero) still runs the BIOS handler.
+static bool nds_hle_swi(arm7_t* cpu, uint32_t swi_number){
+  int func = arm7_get_thumb_bit(cpu)? SB_BFE(swi_number,0,8): SB_BFE(swi_number,16,8);
+  uint32_t* r = cpu->registers;
+  void* u = cpu->user_data;
+  switch(func){
+    case 0x09:{ //Div
+      int32_t numer = r[0], denom = r[1];
+      if(denom==0||(numer==INT32_MIN&&denom==-1))return false;
+      int32_t quot = numer/denom;
+      r[0]=quot;
+      r[1]=numer%denom;
+      r[3]=quot<0? -quot: quot;
+      return true;
+    }
+    case 0x0B:{ //CpuSet
+      uint32_t src = r[0], dst = r[1], cnt = r[2];
+      uint32_t count = SB_BFE(cnt,0,21);
+      bool fixed = SB_BFE(cnt,24,1);
+      if(SB_BFE(cnt,26,1)){
+        src&=~3; dst&=~3;
+        uint32_t v = cpu->read32(u,src);
+        for(uint32_t i=0;i<count;++i){
+          if(!fixed)v = cpu->read32(u,src+i*4);
+          cpu->write32(u,dst+i*4,v);
+        }
+      }else{
+        src&=~1; dst&=~1;
+        uint16_t v = cpu->read16(u,src);
+        for(uint32_t i=0;i<count;++i){
+          if(!fixed)v = cpu->read16(u,src+i*2);
+          cpu->write16(u,dst+i*2,v);
+        }
+      }
+      return true;
+    }
+    case 0x0C:{ //CpuFastSet
+      uint32_t src = r[0]&~3, dst = r[1]&~3, cnt = r[2];
+      uint32_t count = (SB_BFE(cnt,0,21)+7)&~7;
+      bool fixed = SB_BFE(cnt,24,1);
+      uint32_t v = cpu->read32(u,src);
+      for(uint32_t i=0;i<count;++i){
+        if(!fixed)v = cpu->read32(u,src+i*4);
+        cpu->write32(u,dst+i*4,v);
+      }
+      return true;
+    }
+    case 0x0D: //Sqrt
+      r[0]=nds_sqrt_u64(r[0]);
+      return true;
+    case 0x0E:{ //GetCRC16
+      uint32_t crc = r[0]&0xffff, addr = r[1]&~1, len = r[2]&~1;
+      for(uint32_t i=0;i<len;i+=2){
+        uint16_t half = cpu->read16(u,addr+i);
+        for(int b=0;b<2;++b){
+          crc^= SB_BFE(half,b*8,8);
+          for(int j=0;j<8;++j)crc = (crc>>1)^((crc&1)?0xA001:0);
+        }
+      }
+      r[0]=crc;
+      return true;
+    }
+    case 0x11:{ //LZ77UnCompReadNormalWrite8bit
+      uint32_t src = r[0], dst = r[1];
+      uint32_t header = cpu->read32(u,src&~3); src+=4;
+      if(SB_BFE(header,4,4)!=1)return false;
+      uint32_t size = SB_BFE(header,8,24);
+      uint32_t written = 0;
+      while(written<size){
+        uint8_t flags = cpu->read8(u,src++);
+        for(int b=7;b>=0&&written<size;--b){
+          if(SB_BFE(flags,b,1)){
+            uint8_t b0 = cpu->read8(u,src++);
+            uint8_t b1 = cpu->read8(u,src++);
+            uint32_t disp = ((b0&0xf)<<8|b1)+1;
+            int len = (b0>>4)+3;
+            for(int i=0;i<len&&written<size;++i,++written)cpu->write8(u,dst+written,cpu->read8(u,dst+written-disp));
+          }else cpu->write8(u,dst+written++,cpu->read8(u,src++));
+        }
+      }
+      return true;
+    }
+    case 0x14:{ //RLUnCompReadNormalWrite8bit
+      uint32_t src = r[0], dst = r[1];
+      uint32_t header = cpu->read32(u,src&~3); src+=4;
+      if(SB_BFE(header,4,4)!=3)return false;
+      uint32_t size = SB_BFE(header,8,24);
+      uint32_t written = 0;
+      while(written<size){
+        uint8_t flag = cpu->read8(u,src++);
+        if(SB_BFE(flag,7,1)){
+          uint8_t v = cpu->read8(u,src++);
+          for(int i=0;i<(flag&0x7f)+3&&written<size;++i)cpu->write8(u,dst+written++,v);
+        }else{
+          for(int i=0;i<(flag&0x7f)+1&&written<size;++i)cpu->write8(u,dst+written++,cpu->read8(u,src++));
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
+static bool nds7_hle_swi(void* user_data, uint32_t swi_number){return nds_hle_swi(&((nds_t*)user_data)->arm7,swi_number);}
+static bool nds9_hle_swi(void* user_data, uint32_t swi_number){return nds_hle_swi(&((nds_t*)user_data)->arm9,swi_number);}
+#define NDS_CARD_MAIN_DATA_READ 0xB7
+#define NDS_CARD_CHIP_ID_READ 0xB8
+static void nds_process_gc_bus_read(nds_t*nds, int cpu_id){
+  if(nds->mem.card_transfer_bytes<=0)return;
+  nds->activate_dmas=true;
+  uint16_t exmemcnt = nds9_io_read16(nds,NDS9_EXMEMCNT);
+  bool arm7_has_slot = SB_BFE(exmemcnt,11,1);
+  if(cpu_id==arm7_has_slot)return;
+  
+  uint8_t data[4]; 
+  int bank = nds->mem.card_read_offset&~0xfff;
+  int bank_off = nds->mem.card_read_offset&0xfff;
+  data[0]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
+  data[1]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
+  data[2]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
+  data[3]= nds->mem.card_transfer_data[(bank_off++)&0xfff];
+  uint32_t data_out = *(uint32_t*)(data);
+  nds_log_event(nds,SB_EVENT_GC_DATA,data_out,0,0,0);
+  //printf("data[%08x]: %08x\n",nds->mem.card_read_offset,data_out);
+  nds_io_store32(nds,cpu_id,NDS_GC_BUS,data_out);
   nds->mem.card_read_offset = bank|(bank_off&0xfff);
     
   nds->mem.card_transfer_bytes-=4;
@@ -3442,10 +4411,10 @@ static void nds_process_gc_bus_ctl(nds_t*nds, int cpu_id){
   gcbus_ctl|=(1u<<23);
   if(start_transfer){
     //Mask out start bit;
-    uint8_t commands[8];
+    uint8_t commands[8]={0};
     for(int i=0;i<7;++i)commands[i]=nds9_io_read8(nds,NDS_GCBUS_CMD+i);
-    if(nds->gc_log)fprintf(nds->gc_log,"GCBUS CMD: %02x %02x %02x%02x %02x%02x %02x%02x\n",commands[0],commands[1],commands[2],commands[3]
-      ,commands[4],commands[5],commands[6],commands[7]);
+    nds_log_event(nds,SB_EVENT_GC_CMD,(commands[0]<<24)|(commands[1]<<16)|(commands[2]<<8)|commands[3],
+                  (commands[4]<<24)|(commands[5]<<16)|(commands[6]<<8)|commands[7],0,0);
     switch(commands[0]){
       case NDS_CARD_MAIN_DATA_READ:{
         //Encrypted data read;
@@ -3454,11 +4423,9 @@ static void nds_process_gc_bus_ctl(nds_t*nds, int cpu_id){
         nds->mem.card_read_offset=read_off;
         int data_block_size = SB_BFE(gcbus_ctl,24,3);
         const int transfer_size_map[8]={0, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000, 4};
-        for(int i=0;i<0x1000;++i){
-          nds->mem.card_transfer_data[i]=nds->mem.card_data[(i+(read_off&~0xfff))%nds->mem.card_size];
-        }
+        nds_card_read(nds,read_off&~0xfff,nds->mem.card_transfer_data,0x1000);
         nds->mem.card_transfer_bytes=transfer_size_map[data_block_size];
-        if(nds->gc_log)fprintf(nds->gc_log,"Encrypted Read: 0x%08x transfer_size: %08x\n",read_off,nds->mem.card_transfer_bytes);
+        nds_log_event(nds,SB_EVENT_GC_READ,read_off,nds->mem.card_transfer_bytes,0,0);
         gcbus_ctl|=(1<<23)|(1<<31);//Set data_ready bit and busy
       }break; 
       case NDS_CARD_CHIP_ID_READ:{
@@ -3469,7 +4436,6 @@ static void nds_process_gc_bus_ctl(nds_t*nds, int cpu_id){
         nds->mem.card_transfer_data[2]=SB_BFE(nds->mem.card_chip_id,16,8);
         nds->mem.card_transfer_data[3]=SB_BFE(nds->mem.card_chip_id,24,8);
         nds->mem.card_transfer_bytes=4;
-        if(nds->gc_log)fprintf(nds->gc_log,"CHIPID Read transfer:\n");
         gcbus_ctl|=(1<<23)|(1<<31);//Set data_ready bit and busy
       }break; 
       default: printf("Unknown cmd: %02x\n",commands[0]);break;
@@ -3630,6 +4596,30 @@ static uint32_t nds_get_curr_backup_address(nds_t*nds){
   printf("Unhandled backup_type: %d\n",bak->backup_type);
   return 0xffffffff;
 }
+#define NDS_FLASH_RECV_CMD  0 
+#define NDS_FLASH_RXTX      1 
+#define NDS_FLASH_SET_ADDR0 2
+#define NDS_FLASH_SET_ADDR1 3
+#define NDS_FLASH_SET_ADDR2 4
+#define NDS_FLASH_SET_ADDR3 5
+#define NDS_FLASH_DUMMY     6
+
+#define NDS_BACKUP_STREAM_NONE     0
+#define NDS_BACKUP_STREAM_READ     1
+#define NDS_BACKUP_STREAM_WRITE    2 // EEPROM/FRAM write, returns 0
+#define NDS_BACKUP_STREAM_PAGE_WRITE 3 // Flash PW, returns the written byte
+#define NDS_BACKUP_STREAM_PROGRAM  4 // Flash PP, clears bits
+
+static FORCE_INLINE void nds_mark_backup_dirty(nds_card_backup_t* back, uint32_t addr, uint32_t size){
+  back->is_dirty = true;
+  if(back->dirty_start>=back->dirty_end){
+    back->dirty_start = addr;
+    back->dirty_end = addr+size;
+  }else{
+    if(addr<back->dirty_start)back->dirty_start = addr;
+    if(addr+size>back->dirty_end)back->dirty_end = addr+size;
+  }
+}
 static void nds_process_gc_spi(nds_t* nds, int cpu_id){
   uint32_t aux_spi_cnt = nds_io_read32(nds,cpu_id,NDS9_AUXSPICNT);
   uint8_t spi_data = nds_io_read8(nds,cpu_id,NDS9_AUXSPIDATA);
@@ -3640,61 +4630,99 @@ static void nds_process_gc_spi(nds_t* nds, int cpu_id){
   nds_card_backup_t* back = &nds->backup;
   uint8_t ret_data = 0; 
 
-  if(back->command_offset<sizeof(back->command)){
-    back->command[back->command_offset]=spi_data;
-  }
-  back->command_offset++;
-  //IR Stub (needed due to Pokemon Black Anti-Piracy Check)
-  //Check for IR-ID command
-  if(back->command[0]==0x08){
-    printf("IR ID Read\n");
-    ret_data=back->command_offset>1?0xAA:0;
+  if(back->stream_mode){
+    uint32_t addr = back->stream_addr;
+    uint8_t* data = nds->mem.save_data+addr;
+    back->stream_addr = ((addr+1)&back->stream_wrap)|(addr&~back->stream_wrap);
+    back->command_offset++;
+    switch(back->stream_mode){
+      case NDS_BACKUP_STREAM_READ: ret_data = *data; break;
+      case NDS_BACKUP_STREAM_WRITE: *data = spi_data; nds_mark_backup_dirty(back,addr,1); break;
+      case NDS_BACKUP_STREAM_PAGE_WRITE: ret_data = *data = spi_data; nds_mark_backup_dirty(back,addr,1); break;
+      case NDS_BACKUP_STREAM_PROGRAM: ret_data = *data &= spi_data; nds_mark_backup_dirty(back,addr,1); break;
+    }
   }else{
-    if(nds->backup.backup_type>=NDS_BACKUP_FLASH_256KB&&nds->backup.backup_type<=NDS_BACKUP_FLASH_1MB){
-      ret_data = nds_process_flash_write(nds,spi_data,&nds->backup.flash,nds->mem.save_data, nds_get_save_size(nds));
-      nds->backup.is_dirty=true;
+    if(back->command_offset<sizeof(back->command)){
+      back->command[back->command_offset]=spi_data;
+    }
+    back->command_offset++;
+    //IR Stub (needed due to Pokemon Black Anti-Piracy Check)
+    //Check for IR-ID command
+    if(back->command[0]==0x08){
+      printf("IR ID Read\n");
+      ret_data=back->command_offset>1?0xAA:0;
     }else{
-      switch(back->command[0]){
-        case 0x00: /*NOP*/  break ;
-        case 0x06: /*WREN*/ back->write_enable=true;break;
-        case 0x04: /*WRDI*/ back->write_enable=false;break;
-        case 0x05: /*RDSR*/ 
-          /*
-            Status Register
-              0   WIP  Write in Progress (1=Busy) (Read only) (always 0 for FRAM chips)
-              1   WEL  Write Enable Latch (1=Enable) (Read only, except by WREN,WRDI)
-              2-3 WP   Write Protect (0=None, 1=Upper quarter, 2=Upper Half, 3=All memory)
-            For 0.5K EEPROM:
-              4-7 ONEs Not used (all four bits are always set to "1" each)
-            For 8K..64K EEPROM and for FRAM:
-              4-6 ZERO Not used (all three bits are always set to "0" each)
-              7   SRWD Status Register Write Disable (0=Normal, 1=Lock) (Only if /W=LOW)
-          */
-          back->status_reg&= (3<<2)|(1<<7);
-          if(back->write_enable)back->status_reg|=0x2;
-          if(back->backup_type==NDS_BACKUP_EEPROM_512B)back->status_reg|=0xf0;
-          ret_data = back->status_reg;
-          break;
-        case 0x01: /*WRSR*/ back->status_reg=spi_data;break;
-        case 0x9f: /*RDID*/ ret_data = 0xff; break;
-        case 0x03: /*RD/RDLO*/
-        case 0x0B: /*RDHI*/{
-          uint32_t addr = nds_get_curr_backup_address(nds);
-          if(addr!=0xffffffff)ret_data = nds->mem.save_data[addr];
-          break;
+      if(nds->backup.backup_type>=NDS_BACKUP_FLASH_256KB&&nds->backup.backup_type<=NDS_BACKUP_FLASH_1MB){
+        nds_flash_t* flash = &back->flash;
+        uint32_t save_size = nds_get_save_size(nds);
+        if(flash->state==NDS_FLASH_RXTX&&flash->write_enable){
+          switch(flash->cmd){
+            case 0x0A: case 0x02: nds_mark_backup_dirty(back,flash->addr&(save_size-1),1); break;
+            case 0xDB: nds_mark_backup_dirty(back,flash->addr&~0xff&(save_size-1),0x100); break;
+            case 0xD8: nds_mark_backup_dirty(back,flash->addr&~0xffff&(save_size-1),save_size<0x10000?save_size:0x10000); break;
+          }
         }
-        case 0x02: /*WR/WRLO*/
-        case 0x0A: /*WRHI*/{
-          uint32_t addr = nds_get_curr_backup_address(nds);
-          if(addr!=0xffffffff&&back->write_enable){
-            nds->mem.save_data[addr]=spi_data;
-            back->is_dirty = true;
+        ret_data = nds_process_flash_write(nds,spi_data,flash,nds->mem.save_data,save_size);
+        if(flash->state==NDS_FLASH_RXTX){
+          switch(flash->cmd){
+            case 0x03: case 0x0B: back->stream_mode = NDS_BACKUP_STREAM_READ; back->stream_wrap = save_size-1; break;
+            case 0x0A: back->stream_mode = NDS_BACKUP_STREAM_PAGE_WRITE; back->stream_wrap = 0xff; break;
+            case 0x02: back->stream_mode = NDS_BACKUP_STREAM_PROGRAM; back->stream_wrap = 0xff; break;
           }
-          break;
+          back->stream_addr = flash->addr&(save_size-1);
         }
-        default:
-          if(back->command_offset==1)printf("Unknown AUX SPI command:%02x\n",back->command[0]);
-          break;
+      }else{
+        switch(back->command[0]){
+          case 0x00: /*NOP*/  break ;
+          case 0x06: /*WREN*/ back->write_enable=true;break;
+          case 0x04: /*WRDI*/ back->write_enable=false;break;
+          case 0x05: /*RDSR*/ 
+            /*
+              Status Register
+                0   WIP  Write in Progress (1=Busy) (Read only) (always 0 for FRAM chips)
+                1   WEL  Write Enable Latch (1=Enable) (Read only, except by WREN,WRDI)
+                2-3 WP   Write Protect (0=None, 1=Upper quarter, 2=Upper Half, 3=All memory)
+              For 0.5K EEPROM:
+                4-7 ONEs Not used (all four bits are always set to "1" each)
+              For 8K..64K EEPROM and for FRAM:
+                4-6 ZERO Not used (all three bits are always set to "0" each)
+                7   SRWD Status Register Write Disable (0=Normal, 1=Lock) (Only if /W=LOW)
+            */
+            back->status_reg&= (3<<2)|(1<<7);
+            if(back->write_enable)back->status_reg|=0x2;
+            if(back->backup_type==NDS_BACKUP_EEPROM_512B)back->status_reg|=0xf0;
+            ret_data = back->status_reg;
+            break;
+          case 0x01: /*WRSR*/ back->status_reg=spi_data;break;
+          case 0x9f: /*RDID*/ ret_data = 0xff; break;
+          case 0x03: /*RD/RDLO*/
+          case 0x0B: /*RDHI*/{
+            uint32_t addr = nds_get_curr_backup_address(nds);
+            if(addr!=0xffffffff){
+              ret_data = nds->mem.save_data[addr];
+              back->stream_mode = NDS_BACKUP_STREAM_READ;
+            }
+            back->stream_addr = addr+1;
+            break;
+          }
+          case 0x02: /*WR/WRLO*/
+          case 0x0A: /*WRHI*/{
+            uint32_t addr = nds_get_curr_backup_address(nds);
+            if(addr!=0xffffffff&&back->write_enable){
+              nds->mem.save_data[addr]=spi_data;
+              nds_mark_backup_dirty(back,addr,1);
+              back->stream_mode = NDS_BACKUP_STREAM_WRITE;
+            }
+            back->stream_addr = addr+1;
+            break;
+          }
+          default:
+            if(back->command_offset==1)printf("Unknown AUX SPI command:%02x\n",back->command[0]);
+            break;
+        }
+        // EEPROM and FRAM addresses wrap around the whole chip
+        back->stream_wrap = nds_get_save_size(nds)-1;
+        back->stream_addr&= back->stream_wrap;
       }
     }
   }
@@ -3703,6 +4731,7 @@ static void nds_process_gc_spi(nds_t* nds, int cpu_id){
   if(!hold_chip_sel){
     nds->backup.command_offset=0;
     nds->backup.flash.state =0;
+    nds->backup.stream_mode = NDS_BACKUP_STREAM_NONE;
   }
 }
 static FORCE_INLINE uint32_t nds_align_data(uint32_t addr, uint32_t data, int transaction_type){
@@ -3716,14 +4745,6 @@ static FORCE_INLINE uint32_t nds_word_mask(uint32_t addr, int transaction_type){
   return 0xffffffff;
 }
 
-#define NDS_FLASH_RECV_CMD  0 
-#define NDS_FLASH_RXTX      1 
-#define NDS_FLASH_SET_ADDR0 2
-#define NDS_FLASH_SET_ADDR1 3
-#define NDS_FLASH_SET_ADDR2 4
-#define NDS_FLASH_SET_ADDR3 5
-#define NDS_FLASH_DUMMY     6
-
 static uint8_t nds_process_flash_write(nds_t *nds, uint8_t write_data, nds_flash_t* flash, uint8_t *flash_data, uint32_t flash_size){
   uint8_t return_data = 0xff;
   if(flash->state==NDS_FLASH_RECV_CMD){
@@ -3869,6 +4890,11 @@ static int32_t * nds_gpu_get_active_matrix(nds_t*nds){
 static void nds_identity_matrix(int32_t* m){
   for(int i=0;i<16;++i)m[i]=(i%5)==0?(1<<NDS_MATRIX_FRACTION_BITS):0;
 }
+static FORCE_INLINE void nds_geometry_cache_invalidate(nds_geometry_cache_t* cache, bool xform, bool light){
+  if(!cache)return;
+  if(xform)cache->xform_state = cache->xform_uses = 0;
+  if(light)cache->light_state = cache->light_uses = 0;
+}
 static void nds_reset_gpu(nds_t*nds){
   printf("Reset GPU\n");
   nds->gpu.mv_matrix_stack_ptr=0;
@@ -3887,25 +4913,92 @@ static void nds_reset_gpu(nds_t*nds){
   nds_identity_matrix(nds->gpu.proj_matrix_stack);
   nds_identity_matrix(nds->gpu.tex_matrix_stack);
   nds_identity_matrix(nds->gpu.mv_matrix_stack);
+  nds_geometry_cache_invalidate(nds->gpu.geometry_cache,true,true);
 }
-static void nds_gpu_swap_buffers(nds_t*nds){
-  uint32_t clear_color = nds9_io_read32(nds,NDS9_CLEAR_COLOR);
-  for(int i=0;i<NDS_LCD_W*NDS_LCD_H;++i){
-    nds->framebuffer_3d_disp[i*4+0]=nds->framebuffer_3d[i*4+0];
-    nds->framebuffer_3d_disp[i*4+1]=nds->framebuffer_3d[i*4+1];
-    nds->framebuffer_3d_disp[i*4+2]=nds->framebuffer_3d[i*4+2];
-    nds->framebuffer_3d_disp[i*4+3]=nds->framebuffer_3d[i*4+3];
-    nds->framebuffer_3d[i*4+0]=SB_BFE(clear_color,0,5)*8;
-    nds->framebuffer_3d[i*4+1]=SB_BFE(clear_color,5,5)*8;
-    nds->framebuffer_3d[i*4+2]=SB_BFE(clear_color,10,5)*8;
-    nds->framebuffer_3d[i*4+3]=SB_BFE(clear_color,16,5)*8;
-
-    nds->framebuffer_3d_depth[i]=10e24;
-  }
+static void nds_gpu_render_band(void* user_data, int band);
+static void nds_gpu_post_band(void* user_data, int band);
+static void nds_gpu_antialias_band(void* user_data, int band);
+static void nds_gpu_resolve_textures(nds_t* nds);
+static bool nds_gpu_snapshot_hires(nds_t* nds);
+static void nds_gpu_copy_render_queue(nds_gpu_render_queue_t* s, const nds_gpu_render_queue_t* q);
+static void nds_gpu_dispatch_bands(nds_t* nds, sb_job_fn_t job){
+  if(nds->gpu.job_dispatch)nds->gpu.job_dispatch(job,nds,NDS_GPU_RENDER_BANDS);
+  else for(int b=0;b<NDS_GPU_RENDER_BANDS;++b)job(nds,b);
+}
+// Renders the queued polygons into framebuffer_3d
+static void nds_gpu_rasterize(nds_t* nds){
+  nds_gpu_resolve_textures(nds);
+  nds_gpu_dispatch_bands(nds,nds_gpu_render_band);
+  for(int b=0;b<NDS_GPU_RENDER_BANDS;++b)SB_PERF_COUNT(&nds->perf,SB_COUNTER_PIXELS,nds->gpu.band_pixels[b]);
+  // The post passes need the finished buffers of the neighbouring bands so they run once all 
+  // bands are rasterized instead of inside the band jobs
+  uint32_t disp3dcnt = nds9_io_read32(nds,NDS_DISP3DCNT);
+  bool anti_alias = SB_BFE(disp3dcnt,4,1)&&nds->framebuffer_3d_halo;
+  if(SB_BFE(disp3dcnt,5,1)||SB_BFE(disp3dcnt,7,1)||anti_alias)nds_gpu_dispatch_bands(nds,nds_gpu_post_band);
+  if(anti_alias)nds_gpu_dispatch_bands(nds,nds_gpu_antialias_band);
+}
+// Rasterizes the queued polygons into the render buffer and displays it
+static void nds_gpu_present(nds_t*nds){
+  nds_gpu_rasterize(nds);
+  uint8_t* displayed = nds->framebuffer_3d;
+  nds->framebuffer_3d = nds->framebuffer_3d_disp;
+  nds->framebuffer_3d_disp = displayed;
+  nds->gpu.framebuffer_3d_front = !nds->gpu.framebuffer_3d_front;
+}
+// Presents the deferred swap with the registers it was made with. The frame is dropped if a
+// save state was loaded since, its polygons are from another timeline then.
+static void nds_gpu_flush_deferred_raster(nds_t*nds){
+  nds_gpu_deferred_raster_t* d = nds->gpu.deferred_raster;
+  if(!d||!d->pending)return;
+  d->pending = false;
+  if(d->swap_count!=nds->gpu.swap_count)return;
+  uint8_t* io_regs = nds->mem.io+(NDS9_EDGE_COLOR&0xffff);
+  uint8_t regs[NDS_GPU_RASTER_REGS_SIZE];
+  uint32_t disp3dcnt = nds9_io_read32(nds,NDS_DISP3DCNT);
+  memcpy(regs,io_regs,sizeof(regs));
+  memcpy(io_regs,d->regs,sizeof(regs));
+  nds9_io_store32(nds,NDS_DISP3DCNT,d->disp3dcnt);
+  nds_gpu_render_queue_t* queue = nds->gpu.render_queue;
+  nds->gpu.render_queue = &d->queue;
+  nds_gpu_present(nds);
+  nds->gpu.render_queue = queue;
+  memcpy(io_regs,regs,sizeof(regs));
+  nds9_io_store32(nds,NDS_DISP3DCNT,disp3dcnt);
+}
+static void nds_gpu_reset_queue(nds_t*nds){
   //printf("Rendered %d verts and %d polys\n",nds->gpu.curr_vert,nds->gpu.poly_ram_offset);
+  nds_gpu_render_queue_t* queue = nds->gpu.render_queue;
+  if(queue){
+    queue->poly_ram.num_tris = queue->poly_ram.size = queue->vert_ram.size = 0;
+    memset(queue->vert_ram_index,0,sizeof(queue->vert_ram_index));
+  }
   nds->gpu.curr_vert = 0; 
   nds->gpu.poly_ram_offset=0;
 }
+static void nds_gpu_swap_buffers(nds_t*nds){
+  nds_gpu_deferred_raster_t* deferred = nds->gpu.deferred_raster;
+  // A deferred frame nothing read is replaced by this one
+  if(deferred)deferred->pending = false;
+  nds->gpu.swap_count++;
+  bool on_gpu = false;
+  if(nds->gpu.raster_on_swap){
+    if(SB_UNLIKELY(nds->gpu.video_capture))nds->gpu.video_capture->sync(nds->gpu.video_capture->user_data,SB_VIDEO_SYNC_NDS_3D_SWAP);
+    nds_gpu_hires_t* hires = nds->gpu.hires;
+    if(hires)on_gpu = hires->on_gpu = hires->enabled&&nds_gpu_snapshot_hires(nds);
+    if(!on_gpu)nds_gpu_present(nds);
+  }
+  // Frames drawn by the frontend are deferred too, display capture still needs the core's
+  if((!nds->gpu.raster_on_swap||on_gpu)&&deferred&&nds->gpu.render_queue){
+    nds_gpu_copy_render_queue(&deferred->queue,nds->gpu.render_queue);
+    memcpy(deferred->regs,nds->mem.io+(NDS9_EDGE_COLOR&0xffff),sizeof(deferred->regs));
+    deferred->disp3dcnt = nds9_io_read32(nds,NDS_DISP3DCNT);
+    deferred->swap_count = nds->gpu.swap_count;
+    deferred->pending = true;
+  }
+  nds_gpu_reset_queue(nds);
+}
+// Products within +-2^29 can't saturate any of the nested NDS_MATRIX_ADDs of a 4 term dot product
+#define NDS_MATRIX_PRODUCT_SAFE(P) ((uint64_t)((P)+(1<<29))<(1ull<<30))
 //res=res*m2
 void nds_mult_matrix4(int32_t * res, int32_t *m2){
   //printf("Mult Matrix:\n");
@@ -3913,6 +5006,20 @@ void nds_mult_matrix4(int32_t * res, int32_t *m2){
   int32_t t[16];
   for(int i=0;i<16;++i)t[i]=res[i];
 
+  int64_t p[64];
+  bool safe = true;
+  for(int y=0;y<4;++y)
+    for(int i=0;i<4;++i)
+      for(int x=0;x<4;++x){
+        int64_t prod = NDS_MATRIX_MULTIPLY(m2[i+y*4],t[x+i*4]);
+        safe&= NDS_MATRIX_PRODUCT_SAFE(prod);
+        p[(y*4+x)*4+i]=prod;
+      }
+  if(SB_LIKELY(safe)){
+    for(int i=0;i<16;++i)res[i]=p[i*4+0]+p[i*4+1]+p[i*4+2]+p[i*4+3];
+    return;
+  }
+  // Reference path with saturation after every add
   for(int y=0;y<4;++y) 
     for(int x=0;x<4;++x){
       res[x+y*4] = NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m2[0+y*4],t[x+0*4]),
@@ -3922,10 +5029,15 @@ void nds_mult_matrix4(int32_t * res, int32_t *m2){
   }
 }
 void nds_translate_matrix(int32_t * m, int32_t x, int32_t y, int32_t z){
-  m[12]=NDS_MATRIX_ADD(m[12],NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[0],x),NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[4],y),NDS_MATRIX_MULTIPLY(m[8],z))));
-  m[13]=NDS_MATRIX_ADD(m[13],NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[1],x),NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[5],y),NDS_MATRIX_MULTIPLY(m[9],z))));
-  m[14]=NDS_MATRIX_ADD(m[14],NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[2],x),NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[6],y),NDS_MATRIX_MULTIPLY(m[10],z))));
-  m[15]=NDS_MATRIX_ADD(m[15],NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[3],x),NDS_MATRIX_ADD(NDS_MATRIX_MULTIPLY(m[7],y),NDS_MATRIX_MULTIPLY(m[11],z))));
+  for(int r=0;r<4;++r){
+    int64_t p0 = NDS_MATRIX_MULTIPLY(m[0+r],x);
+    int64_t p1 = NDS_MATRIX_MULTIPLY(m[4+r],y);
+    int64_t p2 = NDS_MATRIX_MULTIPLY(m[8+r],z);
+    if(SB_LIKELY(NDS_MATRIX_PRODUCT_SAFE(p0)&&NDS_MATRIX_PRODUCT_SAFE(p1)&&NDS_MATRIX_PRODUCT_SAFE(p2))){
+      // The partial sums fit in 32 bits so only the final add can saturate
+      m[12+r]=NDS_MATRIX_ADD(m[12+r],p0+p1+p2);
+    }else m[12+r]=NDS_MATRIX_ADD(m[12+r],NDS_MATRIX_ADD(p0,NDS_MATRIX_ADD(p1,p2)));
+  }
 }
 void nds_scale_matrix(int32_t * m, int32_t x, int32_t y, int32_t z){
   SE_RPT4 m[0*4+r] =NDS_MATRIX_MULTIPLY(m[0*4+r],x);
@@ -3933,12 +5045,48 @@ void nds_scale_matrix(int32_t * m, int32_t x, int32_t y, int32_t z){
   SE_RPT4 m[2*4+r] =NDS_MATRIX_MULTIPLY(m[2*4+r],z);
 }
 void nds_mult_matrix_vector(float * result, int32_t * m, float *v,int dims){
+  // Scaling by the power of two reciprocal is exact, so this matches dividing by 1<<NDS_MATRIX_FRACTION_BITS
+  const float scale = 1.0f/(float)(1<<NDS_MATRIX_FRACTION_BITS);
+  if(SB_LIKELY(dims==4)){
+    for(int x=0;x<4;++x){
+      float sum = 0;
+      sum+=m[x+0*4]*scale*v[0];
+      sum+=m[x+1*4]*scale*v[1];
+      sum+=m[x+2*4]*scale*v[2];
+      sum+=m[x+3*4]*scale*v[3];
+      result[x]=sum;
+    }
+    return;
+  }
   for(int x=0;x<dims;++x){
     result[x]=0;
-    for(int y = 0;y<dims;++y)result[x]+=m[x+y*dims]/(float)(1<<NDS_MATRIX_FRACTION_BITS)*v[y];
+    for(int y = 0;y<dims;++y)result[x]+=m[x+y*dims]*scale*v[y];
+  }
+}
+// Applies the clamp/repeat/flip modes of tex_param to uv and returns the texel coordinates
+static FORCE_INLINE void nds_wrap_texture_coords(uint32_t tex_param, const float* uv, int* x, int* y){
+  bool repeat[2]={SB_BFE(tex_param,16,1),SB_BFE(tex_param,17,1)};
+  bool flip[2]={SB_BFE(tex_param,18,1),SB_BFE(tex_param,19,1)};
+  int sz[2]={SB_BFE(tex_param,20,3),SB_BFE(tex_param,23,3)};
+  int coord[2];
+  for(int i=0;i<2;++i){
+    signed sz_lin = 8<<sz[i];
+    signed tex_coord = uv[i];
+    if(!repeat[i]){
+      if(tex_coord>=sz_lin)tex_coord=sz_lin-1;
+      if(tex_coord<0)tex_coord=0;
+    }else{
+      signed int_part = tex_coord>>(3+sz[i]);
+      tex_coord&=sz_lin-1;
+      if((int_part&1)&&(flip[i]))tex_coord=sz_lin-tex_coord-1;
+    }
+    coord[i]=tex_coord;
   }
+  *x = coord[0];
+  *y = coord[1];
 }
-static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
+// Decodes texel (x,y) of the texture described by tex_param. Returns true if it is transparent.
+static bool nds_decode_texel(nds_t* nds, uint32_t tex_param, uint32_t tex_plt_base, int x, int y, float* tex_color){
   /*
   0-15  Texture VRAM Offset div 8 (0..FFFFh -> 512K RAM in Slot 0,1,2,3)
         (VRAM must be allocated as Texture data, see Memory Control chapter)
@@ -3951,11 +5099,8 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
   26-28 Texture Format        (0..7, see below)
   29    Color 0 of 4/16/256-Color Palettes (0=Displayed, 1=Made Transparent)
   30-31 Texture Coordinates Transformation Mode (0..3, see below)*/
-  uint32_t tex_param = nds->gpu.tex_image_param;
   uint32_t vram_offset = SB_BFE(tex_param,0,16)*8;
-  bool repeat[2]={SB_BFE(tex_param,16,1),SB_BFE(tex_param,17,1)};
-  bool flip[2]={SB_BFE(tex_param,18,1),SB_BFE(tex_param,19,1)};
-  int sz[2]={SB_BFE(tex_param,20,3),SB_BFE(tex_param,23,3)};
+  int sz[2]={8<<SB_BFE(tex_param,20,3),8<<SB_BFE(tex_param,23,3)};
   int format = SB_BFE(tex_param,26,3);
   bool color0_transparent = SB_BFE(tex_param,29,1);
 
@@ -3964,25 +5109,10 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
   tex_color[2]=0;
   tex_color[3]=1;
   
-  for(int i=0;i<2;++i){
-    signed sz_lin = 8<<sz[i];
-    signed tex_coord = uv[i];
-    if(!repeat[i]){
-      if(tex_coord>=sz_lin)tex_coord=sz_lin-1;
-      if(tex_coord<0)tex_coord=0;
-    }else{
-      signed int_part = tex_coord>>(3+sz[i]);
-      tex_coord&=sz_lin-1;
-      if((int_part&1)&&(flip[i]))tex_coord=sz_lin-tex_coord-1;
-    }
-    uv[i]=tex_coord;
-    sz[i]=sz_lin;
-  }
-  int x = uv[0], y=uv[1];
   switch(format){
     case -1:
-      tex_color[0]=fabs(uv[0]/sz[0]);
-      tex_color[1]=fabs(uv[1]/sz[1]);
+      tex_color[0]=fabs((float)x/sz[0]);
+      tex_color[1]=fabs((float)y/sz[1]);
       tex_color[2]=0;
       tex_color[3]=1;
     break;
@@ -3994,7 +5124,7 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
       uint32_t palette = nds_ppu_read8(nds,NDS_VRAM_TEX_SLOT0+vram_offset+x+y*sz[0]);
       uint32_t alpha = SB_BFE(palette,5,3);
       palette = SB_BFE(palette,0,5);
-      uint32_t palette_base = SB_BFE(nds->gpu.tex_plt_base,0,13)*16;
+      uint32_t palette_base = SB_BFE(tex_plt_base,0,13)*16;
       uint16_t color= nds_ppu_read16(nds,NDS_VRAM_TEX_PAL_SLOT0+palette_base+palette*2);
       tex_color[0] = SB_BFE(color,0,5)/31.;
       tex_color[1] = SB_BFE(color,5,5)/31.;
@@ -4005,7 +5135,7 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
     {
       uint32_t palette = nds_ppu_read8(nds,NDS_VRAM_TEX_SLOT0+vram_offset+x/4+y*sz[0]/4);
       palette = SB_BFE(palette,2*(x&3),2);
-      uint32_t palette_base = SB_BFE(nds->gpu.tex_plt_base,0,13)*8;
+      uint32_t palette_base = SB_BFE(tex_plt_base,0,13)*8;
       uint16_t color= nds_ppu_read16(nds,NDS_VRAM_TEX_PAL_SLOT0+palette_base+palette*2);
       if(palette==0&&color0_transparent)tex_color[3]=0;
       tex_color[0] = SB_BFE(color,0,5)/31.;
@@ -4016,7 +5146,7 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
     {
       uint32_t palette = nds_ppu_read8(nds,NDS_VRAM_TEX_SLOT0+vram_offset+x/2+y*sz[0]/2);
       palette = SB_BFE(palette,(x&1)*4,4);
-      uint32_t palette_base = SB_BFE(nds->gpu.tex_plt_base,0,13)*16;
+      uint32_t palette_base = SB_BFE(tex_plt_base,0,13)*16;
       uint16_t color= nds_ppu_read16(nds,NDS_VRAM_TEX_PAL_SLOT0+palette_base+palette*2);
       if(palette==0&&color0_transparent)tex_color[3]=0;
       tex_color[0] = SB_BFE(color,0,5)/31.;
@@ -4026,7 +5156,7 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
     case 0x4: /*Format 4: 256-Color Palette Texture*/
     {
       uint32_t palette = nds_ppu_read8(nds,NDS_VRAM_TEX_SLOT0+vram_offset+x+y*sz[0]);
-      uint32_t palette_base = SB_BFE(nds->gpu.tex_plt_base,0,13)*16;
+      uint32_t palette_base = SB_BFE(tex_plt_base,0,13)*16;
       uint16_t color= nds_ppu_read16(nds,NDS_VRAM_TEX_PAL_SLOT0+palette_base+palette*2);
       if(palette==0&&color0_transparent)tex_color[3]=0;
       tex_color[0] = SB_BFE(color,0,5)/31.;
@@ -4047,7 +5177,7 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
       int palette_off = SB_BFE(pal_index_data,0,14);
       int mode = SB_BFE(pal_index_data,14,2);
       int slot = slot0_addr/(128*1024);
-      uint32_t palette_addr = palette_off*4+SB_BFE(nds->gpu.tex_plt_base,0,13)*16;
+      uint32_t palette_addr = palette_off*4+SB_BFE(tex_plt_base,0,13)*16;
 
       switch(texel){
         case 0:{
@@ -4112,7 +5242,7 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
       uint32_t palette = nds_ppu_read8(nds,NDS_VRAM_TEX_SLOT0+vram_offset+x+y*sz[0]);
       uint32_t alpha = SB_BFE(palette,3,5);
       palette = SB_BFE(palette,0,3);
-      uint32_t palette_base = SB_BFE(nds->gpu.tex_plt_base,0,13)*16;
+      uint32_t palette_base = SB_BFE(tex_plt_base,0,13)*16;
       uint16_t color= nds_ppu_read16(nds,NDS_VRAM_TEX_PAL_SLOT0+palette_base+palette*2);
       tex_color[0] = SB_BFE(color,0,5)/31.;
       tex_color[1] = SB_BFE(color,5,5)/31.;
@@ -4129,7 +5259,8 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
     }break;
     default:
       printf("Unknown texture format:%d\n",format);
-      for(int i=0;i<2;++i)tex_color[i]= uv[i]/((float)(sz[i]));
+      tex_color[0]= x/((float)(sz[0]));
+      tex_color[1]= y/((float)(sz[1]));
       break;
   }
   //tex_color[0]= (format&0x1)?0xff:0;
@@ -4137,150 +5268,265 @@ static bool nds_sample_texture(nds_t* nds, float* tex_color, float*uv){
   //tex_color[2]= (format&0x4)?0xff:0;
   return tex_color[3]==0;
 }
+// Texels are stored as RGBA8888 in the cache, the uncached path goes through the same rounding so 
+// both give identical colors
+static FORCE_INLINE uint32_t nds_pack_texel(const float* c){
+  uint32_t texel = 0;
+  SE_RPT4 texel|=((uint32_t)(fminf(fmaxf(c[r],0.f),1.f)*255.f+0.5f))<<(r*8);
+  return texel;
+}
+static FORCE_INLINE bool nds_unpack_texel(uint32_t texel, float* tex_color){
+  SE_RPT4 tex_color[r]=SB_BFE(texel,r*8,8)*(1.f/255.f);
+  return SB_BFE(texel,24,8)==0;
+}
+static bool nds_sample_texture(nds_t* nds, uint32_t tex_param, uint32_t tex_plt_base, float* tex_color, float*uv){
+  int x,y;
+  nds_wrap_texture_coords(tex_param,uv,&x,&y);
+  float c[4]={1,1,1,1};
+  nds_decode_texel(nds,tex_param,tex_plt_base,x,y,c);
+  return nds_unpack_texel(nds_pack_texel(c),tex_color);
+}
+static FORCE_INLINE bool nds_sample_cached_texture(const uint32_t* texels, uint32_t tex_param, float* tex_color, float*uv){
+  int x,y;
+  nds_wrap_texture_coords(tex_param,uv,&x,&y);
+  return nds_unpack_texel(texels[x+(y<<(SB_BFE(tex_param,20,3)+3))],tex_color);
+}
+// Returns the decoded texture, decoding it on a miss. NULL if it is untextured or doesn't fit.
+static const uint32_t* nds_lookup_texture(nds_t* nds, nds_tex_cache_t* cache, uint32_t tex_param, uint32_t tex_plt_base){
+  int format = SB_BFE(tex_param,26,3);
+  if(format==0)return NULL;
+  uint32_t palette_base = format==7? 0: SB_BFE(tex_plt_base,0,13);
+  uint64_t key = (tex_param&0x3FF0FFFF)|((uint64_t)palette_base<<32)|(1ull<<63);
+  uint32_t hash = (key*0x9E3779B97F4A7C15ull)>>40;
+  for(int probe=0;probe<NDS_TEX_CACHE_ENTRIES;++probe){
+    nds_tex_cache_entry_t* entry = cache->entries+((hash+probe)%NDS_TEX_CACHE_ENTRIES);
+    if(entry->key==key)return cache->texels+entry->offset;
+    if(entry->key)continue;
+    int w = 8<<SB_BFE(tex_param,20,3);
+    int h = 8<<SB_BFE(tex_param,23,3);
+    if(cache->texels_used+w*h>NDS_TEX_CACHE_TEXELS||cache->num_entries>=NDS_TEX_CACHE_ENTRIES*3/4){
+      cache->full = true;
+      return NULL;
+    }
+    uint32_t* texels = cache->texels+cache->texels_used;
+    for(int y=0;y<h;++y)
+      for(int x=0;x<w;++x){
+        float c[4]={1,1,1,1};
+        nds_decode_texel(nds,tex_param,tex_plt_base,x,y,c);
+        texels[x+y*w]=nds_pack_texel(c);
+      }
+    entry->key = key;
+    entry->offset = cache->texels_used;
+    cache->texels_used+=w*h;
+    cache->num_entries++;
+    return texels;
+  }
+  return NULL;
+}
+// Resolves the textures of all stored polygons before the bands render, since the cache isn't thread safe
+static void nds_gpu_resolve_textures(nds_t* nds){
+  nds_gpu_render_queue_t* queue = nds->gpu.render_queue;
+  nds_tex_cache_t* cache = nds->gpu.tex_cache;
+  if(!queue)return;
+  if(cache&&(cache->full||cache->generation!=nds->gpu.tex_cache_generation)){
+    memset(cache->entries,0,sizeof(cache->entries));
+    cache->texels_used = cache->num_entries = 0;
+    cache->generation = nds->gpu.tex_cache_generation;
+    cache->full = false;
+    cache->flushes++;
+  }
+  nds_gpu_poly_ram_t* poly_ram = &queue->poly_ram;
+  const uint32_t* last_texels = NULL;
+  uint32_t last_param = 0, last_plt_base = 0;
+  for(uint32_t p=0;p<poly_ram->size;++p){
+    poly_ram->texels[p] = NULL;
+    if(!cache||!SB_BFE(poly_ram->disp3dcnt[p],0,1))continue;
+    uint32_t tex_param = poly_ram->tex_image_param[p];
+    uint32_t tex_plt_base = poly_ram->tex_plt_base[p];
+    if(!last_texels||tex_param!=last_param||tex_plt_base!=last_plt_base){
+      last_texels = nds_lookup_texture(nds,cache,tex_param,tex_plt_base);
+      last_param = tex_param;
+      last_plt_base = tex_plt_base;
+    }
+    poly_ram->texels[p] = last_texels;
+  }
+}
 
-static bool nds_gpu_draw_tri(nds_t* nds, int vi0, int vi1, int vi2){
-  if(nds->gpu.poly_ram_offset>=2048)return true;// Ignore extra polygons for now
-  uint32_t disp3dcnt = nds9_io_read32(nds,NDS_DISP3DCNT);
+#define NDS_GPU_SUBPIXEL_BITS 4
+// Floor division for the span setup (C division truncates towards zero)
+static FORCE_INLINE int64_t nds_gpu_floor_div(int64_t a, int64_t b){
+  int64_t q = a/b;
+  if((a%b)!=0&&((a<0)!=(b<0)))--q;
+  return q;
+}
+// Z-buffering interpolates z/w linearly in screen space and maps [-1,1] to the 24 bit range
+static FORCE_INLINE uint32_t nds_gpu_z_depth(float z_over_w){
+  float depth = z_over_w*0x800000+0x7ffe00;
+  return depth<=0? 0: depth>=NDS_GPU_DEPTH_MASK? NDS_GPU_DEPTH_MASK: (uint32_t)depth;
+}
+// W-buffering stores the perspective correct w with 12 fractional bits
+static FORCE_INLINE uint32_t nds_gpu_w_depth(float w){
+  float depth = fabsf(w)*4096.f;
+  return depth>=NDS_GPU_DEPTH_MASK? NDS_GPU_DEPTH_MASK: (uint32_t)depth;
+}
+// Rasterizes the rows of a queued triangle that fall in [y_start,y_end). Vertices are snapped to a
+// 4 bit subpixel grid and coverage comes from integer edge functions, which give the exact span
+// of covered pixel centers for each row. The perspective correct attributes are interpolated as
+// attr/w planes that are stepped once per pixel, depth is z/w or w depending on the buffering mode.
+// Returns the number of pixels covered by the triangle within the band
+static uint32_t nds_gpu_raster_tri(nds_t* nds, const nds_gpu_render_queue_t* queue, uint32_t tri, int y_start, int y_end){
+  const nds_gpu_poly_ram_t* poly_ram = &queue->poly_ram;
+  const nds_gpu_vertex_ram_t* vert_ram = &queue->vert_ram;
+  int poly = poly_ram->tri_poly[tri];
+  uint32_t disp3dcnt = poly_ram->disp3dcnt[poly];
+  uint32_t tex_image_param = poly_ram->tex_image_param[poly];
+  uint32_t tex_plt_base = poly_ram->tex_plt_base[poly];
+  const uint32_t* texels = poly_ram->texels[poly];
 
   bool tex_map     = SB_BFE(disp3dcnt,0,1);/*Texture Mapping      (0=Disable, 1=Enable)*/
   bool shade_mode  = SB_BFE(disp3dcnt,1,1);/*PolygonAttr Shading  (0=Toon Shading, 1=Highlight Shading)*/
   bool alpha_test  = SB_BFE(disp3dcnt,2,1);/*Alpha-Test           (0=Disable, 1=Enable) (see ALPHA_TEST_REF)*/
   bool alpha_blend = SB_BFE(disp3dcnt,3,1);/*Alpha-Blending       (0=Disable, 1=Enable) (see various Alpha values)*/
-  bool anti_alias  = SB_BFE(disp3dcnt,4,1);/*Anti-Aliasing        (0=Disable, 1=Enable)*/
-  bool edge_mark   = SB_BFE(disp3dcnt,5,1);/*Edge-Marking         (0=Disable, 1=Enable) (see EDGE_COLOR)*/
-  bool fogalpha_mode = SB_BFE(disp3dcnt,6,1);/*Fog Color/Alpha Mode (0=Alpha and Color, 1=Only Alpha) (see FOG_COLOR)*/
-  bool fog_enable  = SB_BFE(disp3dcnt,7,1);/*Fog Master Enable    (0=Disable, 1=Enable)*/
-  int fog_depth_shift = SB_BFE(disp3dcnt,8,4); /*Fog Depth Shift      (FOG_STEP=400h shr FOG_SHIFT) (see FOG_OFFSET)*/
-  bool rear_plane_mode = SB_BFE(disp3dcnt,14,1);/*Rear-Plane Mode                (0=Blank, 1=Bitmap)*/
 
-  nds_vert_t *v[3] = {nds->gpu.vert_buffer+vi0,nds->gpu.vert_buffer+vi1,nds->gpu.vert_buffer+vi2};
+  uint32_t poly_attr = poly_ram->poly_attr[poly];
+  int alpha = SB_BFE(poly_attr,16,5);
+  int polygon_mode = SB_BFE(poly_attr,4,2);//(0=Modulation,1=Decal,2=Toon/Highlight Shading,3=Shadow)
+  bool translucent_has_depth = SB_BFE(poly_attr,11,1);
+  bool depth_equal = SB_BFE(poly_attr,14,1);
+  bool w_buffer = poly_ram->w_buffer;
+  // Equal depth tests pass within the margin of the hardware
+  uint32_t depth_margin = depth_equal? (w_buffer? 0xff: 0x200): 0;
+  uint32_t attributes = SB_BFE(poly_attr,24,6)<<NDS_GPU_DEPTH_POLY_ID_SHIFT;
+  if(SB_BFE(poly_attr,15,1))attributes|=NDS_GPU_DEPTH_FOG;
+
+  nds_vert_t verts[3];
   for(int i=0;i<3;++i){
-    SE_RPT3 v[i]->clip_pos[r]=v[i]->pos[r]/fabs(v[i]->pos[3]);
+    int vi = poly_ram->tri_verts[i][tri];
+    SE_RPT4 verts[i].pos[r] = vert_ram->pos[r][vi];
+    SE_RPT2 verts[i].tex[r] = vert_ram->tex[r][vi];
+    SE_RPT3 verts[i].color[r] = vert_ram->color[r][vi];
+    SE_RPT3 verts[i].clip_pos[r] = verts[i].pos[r]/fabs(verts[i].pos[3]);
   }
-
-  float min_p[3] = {1,1,1};
-  float max_p[3] = {-1,-1,-1};
-  
+  const nds_vert_t *v[3] = {verts+0,verts+1,verts+2};
+  const int subpixel = 1<<NDS_GPU_SUBPIXEL_BITS;
+  // Screen space vertex positions in subpixels
+  int64_t sx[3], sy[3];
   for(int i=0;i<3;++i){
-    SE_RPT3 min_p[r]=fminf(v[i]->clip_pos[r],min_p[r]);
-    SE_RPT3 max_p[r]=fmaxf(v[i]->clip_pos[r],max_p[r]);
+    float x = (v[i]->clip_pos[0]*0.5+0.5)*NDS_LCD_W;
+    float y = (v[i]->clip_pos[1]*0.5+0.5)*NDS_LCD_H;
+    x = fminf(fmaxf(x,-4096.f),4096.f);
+    y = fminf(fmaxf(y,-4096.f),4096.f);
+    sx[i] = (int64_t)floorf(x*subpixel+0.5f);
+    sy[i] = (int64_t)floorf(y*subpixel+0.5f);
   }
-
-  SE_RPT3 if(min_p[r]<-1)min_p[r]=-1;
-  SE_RPT3 if(max_p[r]>1)max_p[r]=1;
-
-  float x_inc = 2./NDS_LCD_W;
-  float y_inc = 2./NDS_LCD_H;
-
-  min_p[0] = (floor(min_p[0]*NDS_LCD_W/2)-0.5)/NDS_LCD_W*2;
-  min_p[1] = (floor(min_p[1]*NDS_LCD_H/2)-0.5)/NDS_LCD_H*2;
-
-  max_p[0] = (floor(max_p[0]*NDS_LCD_W/2+0.5)+0.5)/NDS_LCD_W*2;
-  max_p[1] = (floor(max_p[1]*NDS_LCD_H/2+0.5)+0.5)/NDS_LCD_H*2;
-
-  uint32_t poly_attr = nds->gpu.poly_attr;
-  int alpha = SB_BFE(poly_attr,16,5);
-  int polygon_mode = SB_BFE(poly_attr,4,2);//(0=Modulation,1=Decal,2=Toon/Highlight Shading,3=Shadow)
-  bool render_front =   SB_BFE(poly_attr,6,1);
-  bool render_back =  SB_BFE(poly_attr,7,1);
-  bool translucent_has_depth = SB_BFE(poly_attr,11,1);
-  
-  //Skip shadow triangles for now TODO: Fix this
-  if(polygon_mode==3)return true;
-  bool front_face=true;
-  {
-    float e0[2],e1[2];
-    SE_RPT2 e0[r]=v[1]->clip_pos[r]-v[0]->clip_pos[r];
-    SE_RPT2 e1[r]=v[2]->clip_pos[r]-v[0]->clip_pos[r];
-
-    front_face = (e0[1]*e1[0]-e0[0]*e1[1])<=0;
-    
-    if(!((front_face&&render_front)||(!front_face&&render_back)))return true; 
-
-    if(!front_face){
-      nds_vert_t*vt = v[2];
-      v[2]=v[1];
-      v[1]=vt;
-    }
+  // Edge i is opposite vertex i: e_i(x,y) = a_i*x + b_i*y + c_i
+  int64_t a[3], b[3], c[3];
+  for(int i=0;i<3;++i){
+    int i0 = (i+1)%3, i1 = (i+2)%3;
+    a[i] = sy[i0]-sy[i1];
+    b[i] = sx[i1]-sx[i0];
+    c[i] = sx[i0]*sy[i1]-sx[i1]*sy[i0];
+  }
+  int64_t area = a[0]*sx[0]+b[0]*sy[0]+c[0];
+  if(area==0)return 0;
+  // Orient the edges so the inside of the triangle is positive
+  if(area<0){
+    area = -area;
+    SE_RPT3 {a[r]=-a[r];b[r]=-b[r];c[r]=-c[r];}
   }
 
-  bool tri_not_rendered = true; 
-
-  float edge0[2],edge1[2],edge2[2];
-  SE_RPT2 edge0[r] = v[0]->clip_pos[r];
-  SE_RPT2 edge1[r] = v[1]->clip_pos[r];
-  SE_RPT2 edge2[r] = v[2]->clip_pos[r];
-  float sub_tri_area_ref[3];
-  sub_tri_area_ref[0]=edge0[1]*edge1[0]-edge0[0]*edge1[1];
-  sub_tri_area_ref[1]=edge1[1]*edge2[0]-edge1[0]*edge2[1];
-  sub_tri_area_ref[2]=edge2[1]*edge0[0]-edge2[0]*edge0[1];
-
-  float tri_area = sub_tri_area_ref[0]+sub_tri_area_ref[1]+sub_tri_area_ref[2];
-  float sub_tri_area_dx[3]={
-      (edge1[1]-edge0[1]),
-      (edge2[1]-edge1[1]),
-      (edge0[1]-edge2[1]),
-  };
-  float sub_tri_area_dy[3]={
-      (edge0[0]-edge1[0]),
-      (edge1[0]-edge2[0]),
-      (edge2[0]-edge0[0]),
-  };
-  SE_RPT3 sub_tri_area_ref[r]+=sub_tri_area_dx[r]*min_p[0];
-  SE_RPT3 sub_tri_area_dx[r]*=x_inc;
-
-  float tex_i[2], tex_j[2],color_i[3],color_j[3];
-  SE_RPT3 color_i[r]=v[1]->color[r]-v[0]->color[r];
-  SE_RPT3 color_j[r]=v[2]->color[r]-v[0]->color[r];
-  SE_RPT2 tex_i[r]=v[1]->tex[r]-v[0]->tex[r];
-  SE_RPT2 tex_j[r]=v[2]->tex[r]-v[0]->tex[r];
-
-  for(float y=min_p[1];y<max_p[1];y+=y_inc){
-    bool line_rendered =false; 
-    float sub_tri_area[3];
-    SE_RPT3 sub_tri_area[r]=sub_tri_area_dy[r]*y+sub_tri_area_ref[r];
-    for(float x=min_p[0];x<max_p[0];x+=x_inc){
-
-      if(sub_tri_area[0]>0||sub_tri_area[1]>0||sub_tri_area[2]>0){
-        if(line_rendered)break;
-        SE_RPT3 sub_tri_area[r]+=sub_tri_area_dx[r];
-        continue;
-      }
-
-      line_rendered=true;
-
-      float bary_nopersp[3];
-      float bary[3];
-
-      SE_RPT3 bary_nopersp[r] = sub_tri_area[(r+1)%3]/tri_area;
-      SE_RPT3 bary[r] = sub_tri_area[(r+1)%3]/v[r]->pos[3];
-
-      SE_RPT3 sub_tri_area[r]+=sub_tri_area_dx[r];
-
-      float bary_area = bary[0]+bary[1]+bary[2];
-      SE_RPT3 bary[r] /= bary_area;
+  int64_t min_x = sx[0], max_x = sx[0], min_y = sy[0], max_y = sy[0];
+  for(int i=1;i<3;++i){
+    if(sx[i]<min_x)min_x=sx[i];
+    if(sx[i]>max_x)max_x=sx[i];
+    if(sy[i]<min_y)min_y=sy[i];
+    if(sy[i]>max_y)max_y=sy[i];
+  }
+  // Pixel (x,y) is sampled at its center (x*16+8,y*16+8)
+  int x0 = nds_gpu_floor_div(min_x-subpixel/2+subpixel-1,subpixel);
+  int x1 = nds_gpu_floor_div(max_x-subpixel/2,subpixel);
+  int y0 = nds_gpu_floor_div(min_y-subpixel/2+subpixel-1,subpixel);
+  int y1 = nds_gpu_floor_div(max_y-subpixel/2,subpixel);
+  if(x0<0)x0=0;
+  if(x1>NDS_LCD_W-1)x1=NDS_LCD_W-1;
+  if(y0<y_start)y0=y_start;
+  if(y1>y_end-1)y1=y_end-1;
+  if(x0>x1||y0>y1)return 0;
+
+  // Attribute planes: q = sum(lambda_i*attr_i/w_i) where lambda_i = e_i/area
+  enum{NDS_ATTR_INV_W,NDS_ATTR_Z,NDS_ATTR_U,NDS_ATTR_V,NDS_ATTR_R,NDS_ATTR_G,NDS_ATTR_B,NDS_NUM_ATTRS};
+  float attr[3][NDS_NUM_ATTRS];
+  for(int i=0;i<3;++i){
+    float inv_w = 1.f/v[i]->pos[3];
+    attr[i][NDS_ATTR_INV_W] = inv_w;
+    attr[i][NDS_ATTR_Z] = v[i]->pos[2]*inv_w;
+    attr[i][NDS_ATTR_U] = v[i]->tex[0]*inv_w;
+    attr[i][NDS_ATTR_V] = v[i]->tex[1]*inv_w;
+    attr[i][NDS_ATTR_R] = v[i]->color[0]*inv_w;
+    attr[i][NDS_ATTR_G] = v[i]->color[1]*inv_w;
+    attr[i][NDS_ATTR_B] = v[i]->color[2]*inv_w;
+  }
+  float inv_area = 1.0f/(float)area;
+  float attr_dx[NDS_NUM_ATTRS];
+  for(int k=0;k<NDS_NUM_ATTRS;++k){
+    attr_dx[k]=0;
+    SE_RPT3 attr_dx[k]+=(float)(a[r]*subpixel)*inv_area*attr[r][k];
+  }
 
-      float z = v[0]->pos[2]+bary[1]*(v[1]->pos[2]-v[0]->pos[2])+bary[2]*(v[2]->pos[2]-v[0]->pos[2]);
-      float w = v[0]->pos[3]+bary[1]*(v[1]->pos[3]-v[0]->pos[3])+bary[2]*(v[2]->pos[3]-v[0]->pos[3]);
-      //if(z<=0)continue;
+  int alpha_test_ref = nds9_io_read8(nds,NDS9_ALPHA_TEST_REF)&0x1f;
+  uint32_t pixels = 0;
+
+  for(int iy=y0;iy<=y1;++iy){
+    int64_t py = iy*subpixel+subpixel/2;
+    int64_t px = x0*subpixel+subpixel/2;
+    // Find the covered span [span_start,span_end] of this row
+    int span_start = x0, span_end = x1;
+    int64_t e[3];
+    for(int i=0;i<3;++i){
+      e[i] = a[i]*px+b[i]*py+c[i];
+      int64_t step = a[i]*subpixel;
+      if(step>0){
+        if(e[i]<0){
+          int64_t k = nds_gpu_floor_div(-e[i]+step-1,step);
+          if(x0+k>span_start)span_start = x0+k>NDS_LCD_W? NDS_LCD_W: x0+k;
+        }
+      }else if(step<0){
+        if(e[i]<0){span_end=-1;break;}
+        int64_t k = nds_gpu_floor_div(e[i],-step);
+        if(x0+k<span_end)span_end = x0+k;
+      }else if(e[i]<0){span_end=-1;break;}
+    }
+    if(span_start>span_end)continue;
+    pixels+=span_end-span_start+1;
 
-      int ix = (x*0.5+0.5)*NDS_LCD_W;
-      int iy = (y*0.5+0.5)*NDS_LCD_H;
+    float q[NDS_NUM_ATTRS];
+    {
+      float lambda[3];
+      // Start one pixel left of the span since the planes are stepped at the top of the loop
+      SE_RPT3 lambda[r]=(float)(e[r]+a[r]*subpixel*(span_start-1-x0))*inv_area;
+      for(int k=0;k<NDS_NUM_ATTRS;++k)q[k]=lambda[0]*attr[0][k]+lambda[1]*attr[1][k]+lambda[2]*attr[2][k];
+    }
+    for(int ix=span_start;ix<=span_end;++ix){
+      for(int k=0;k<NDS_NUM_ATTRS;++k)q[k]+=attr_dx[k];
       int p = ix+iy*NDS_LCD_W;
-
-      if(nds->framebuffer_3d_depth[p]<z*0.999999)continue;
-      float uv[2];
-      SE_RPT2 uv[r]=v[0]->tex[r]+tex_i[r]*bary[1]+tex_j[r]*bary[2];
+      float w = 1.0f/q[NDS_ATTR_INV_W];
+      uint32_t depth = w_buffer? nds_gpu_w_depth(w): nds_gpu_z_depth(q[NDS_ATTR_Z]);
+      uint32_t old_depth = nds->framebuffer_3d_depth[p]&NDS_GPU_DEPTH_MASK;
+      if(depth_equal? depth+depth_margin<old_depth||depth>old_depth+depth_margin: depth>=old_depth)continue;
+      float uv[2] = {q[NDS_ATTR_U]*w,q[NDS_ATTR_V]*w};
 
       float tex_color[4]={1,1,1,1};
       if(tex_map){
-        bool discard=nds_sample_texture(nds, tex_color, uv);
+        bool discard=texels? nds_sample_cached_texture(texels, tex_image_param, tex_color, uv):
+                              nds_sample_texture(nds, tex_image_param, tex_plt_base, tex_color, uv);
         if(discard)continue;
       }
 
       float output_col[4];
       float col_v[4]; 
-      SE_RPT3 col_v[r]=(v[0]->color[r]+color_i[r]*bary[1]+color_j[r]*bary[2])/255.;
+      col_v[0]= q[NDS_ATTR_R]*w/255.;
+      col_v[1]= q[NDS_ATTR_G]*w/255.;
+      col_v[2]= q[NDS_ATTR_B]*w/255.;
       col_v[3]= alpha/31.;
 
       switch(polygon_mode){
@@ -4312,109 +5558,539 @@ static bool nds_gpu_draw_tri(nds_t* nds, int vi0, int vi1, int vi2){
       }
       SE_RPT4 output_col[r]=fminf(fmaxf(output_col[r],0.f),1.0f);
       if(alpha_test){
-        int alpha_test_ref = nds9_io_read8(nds,NDS9_ALPHA_TEST_REF)&0x1f;
         if(output_col[3]<=alpha_test_ref/31.)continue; 
       }
       if(alpha_blend){
         float alpha_blend_factor = output_col[3]; 
-        if(translucent_has_depth||alpha_blend_factor>0.95)nds->framebuffer_3d_depth[p]=z;
+        if(alpha_blend_factor>0.95)nds->framebuffer_3d_depth[p]=depth|attributes;
+        else{
+          // Translucent pixels keep the fog flag only if it's set for both polygons
+          uint32_t old = nds->framebuffer_3d_depth[p];
+          uint32_t merged = (attributes&~NDS_GPU_DEPTH_FOG)|(attributes&old&NDS_GPU_DEPTH_FOG)|NDS_GPU_DEPTH_TRANSLUCENT;
+          nds->framebuffer_3d_depth[p]=(translucent_has_depth? depth: old&NDS_GPU_DEPTH_MASK)|merged;
+        }
         for(int c=0;c<3;++c){
           nds->framebuffer_3d[p*4+c]=output_col[c]*255*alpha_blend_factor+(nds->framebuffer_3d[p*4+c])*(1.0-alpha_blend_factor);
         }
         if(nds->framebuffer_3d[p*4+3]<alpha_blend_factor*255)nds->framebuffer_3d[p*4+3]=alpha_blend_factor*255;
       }else{
         SE_RPT3 nds->framebuffer_3d[p*4+r]=output_col[r]*255;
-        nds->framebuffer_3d_depth[p]=z;
+        nds->framebuffer_3d_depth[p]=depth|attributes;
         nds->framebuffer_3d[p*4+3]=255;
       }
     }
-    tri_not_rendered&=!line_rendered;
   }
-  return tri_not_rendered;
+  return pixels;
 }
-static void nds_interp_wp_vert(nds_t*nds, int v_wp, int v_wn){
-  nds_vert_t* vb = nds->gpu.vert_buffer;
-  float wn = vb[v_wn].pos[3];
-  float wp = vb[v_wp].pos[3];
-  float alpha = (-wn)/(wp-wn)+0.000001;
-
-  SE_RPT4 vb[v_wn].pos[r] += (vb[v_wp].pos[r]-vb[v_wn].pos[r])*alpha;
-  SE_RPT3 vb[v_wn].color[r] += (vb[v_wp].color[r]-vb[v_wn].color[r])*alpha;
-  SE_RPT2 vb[v_wn].tex[r] += (vb[v_wp].tex[r]-vb[v_wn].tex[r])*alpha;
-
+// Clear depths are 15 bit, the farthest one is expanded to the maximum 24 bit depth
+static FORCE_INLINE uint32_t nds_gpu_clear_depth(uint32_t depth){
+  depth&=0x7fff;
+  return depth*0x200+((depth+1)/0x8000)*0x1ff;
 }
-static bool nds_gpu_clip_tri(nds_t* nds, int vi0, int vi1, int vi2){
-  //nds_gpu_draw_tri(nds,vi0,vi1,vi2);
-  //return;
-  int inds[3] = {vi0,vi1,vi2};
-  nds_vert_t* vb = nds->gpu.vert_buffer;
-  
-  if(vb[inds[0]].pos[3]>0.){
-    if(vb[inds[2]].pos[3]>0.){
-      if(vb[inds[1]].pos[3]>0.)return nds_gpu_draw_tri(nds,inds[0],inds[1],inds[2]);
-      int i = inds[0];
-      inds[0]=inds[2];
-      inds[2]=inds[1];
-      inds[1]=i;
+// Copies the used part of the RAMs of q, q may be NULL
+static void nds_gpu_copy_render_queue(nds_gpu_render_queue_t* s, const nds_gpu_render_queue_t* q){
+  uint32_t verts = q? q->vert_ram.size: 0, polys = q? q->poly_ram.size: 0, tris = q? q->poly_ram.num_tris: 0;
+  if(q){
+    SE_RPT4 memcpy(s->vert_ram.pos[r],q->vert_ram.pos[r],verts*sizeof(float));
+    SE_RPT2 memcpy(s->vert_ram.tex[r],q->vert_ram.tex[r],verts*sizeof(float));
+    SE_RPT3 memcpy(s->vert_ram.color[r],q->vert_ram.color[r],verts);
+    memcpy(s->poly_ram.poly_attr,q->poly_ram.poly_attr,polys*sizeof(uint32_t));
+    memcpy(s->poly_ram.disp3dcnt,q->poly_ram.disp3dcnt,polys*sizeof(uint32_t));
+    memcpy(s->poly_ram.tex_image_param,q->poly_ram.tex_image_param,polys*sizeof(uint32_t));
+    memcpy(s->poly_ram.tex_plt_base,q->poly_ram.tex_plt_base,polys*sizeof(uint32_t));
+    memcpy(s->poly_ram.texels,q->poly_ram.texels,polys*sizeof(q->poly_ram.texels[0]));
+    SE_RPT3 memcpy(s->poly_ram.tri_verts[r],q->poly_ram.tri_verts[r],tris*sizeof(uint16_t));
+    memcpy(s->poly_ram.tri_poly,q->poly_ram.tri_poly,tris*sizeof(uint16_t));
+    s->poly_ram.w_buffer = q->poly_ram.w_buffer;
+  }
+  s->vert_ram.size = verts;
+  s->poly_ram.size = polys;
+  s->poly_ram.num_tris = tris;
+}
+// Returns false if the frame needs the rasterizer of the core, for the rear-plane bitmap or 
+// textures that aren't in the texture cache
+static bool nds_gpu_snapshot_hires(nds_t* nds){
+  nds_gpu_hires_t* hires = nds->gpu.hires;
+  uint32_t disp3dcnt = nds9_io_read32(nds,NDS_DISP3DCNT);
+  if(SB_BFE(disp3dcnt,14,1)||!nds->gpu.tex_cache)return false;
+  nds_gpu_resolve_textures(nds);
+  const nds_gpu_poly_ram_t* poly_ram = nds->gpu.render_queue? &nds->gpu.render_queue->poly_ram: NULL;
+  for(uint32_t p=0;poly_ram&&p<poly_ram->size;++p){
+    bool textured = SB_BFE(poly_ram->disp3dcnt[p],0,1)&&SB_BFE(poly_ram->tex_image_param[p],26,3);
+    if(textured&&!poly_ram->texels[p])return false;
+  }
+  nds_gpu_copy_render_queue(&hires->queue,nds->gpu.render_queue);
+  hires->disp3dcnt = disp3dcnt;
+  hires->clear_color = nds9_io_read32(nds,NDS9_CLEAR_COLOR);
+  hires->clear_depth = nds_gpu_clear_depth(nds9_io_read16(nds,NDS9_CLEAR_DEPTH));
+  hires->alpha_test_ref = nds9_io_read8(nds,NDS9_ALPHA_TEST_REF)&0x1f;
+  for(int i=0;i<32;++i)hires->toon_table[i] = nds9_io_read16(nds,NDS9_TOON_TABLE+i*2);
+  for(int i=0;i<8;++i)hires->edge_color[i] = nds9_io_read16(nds,NDS9_EDGE_COLOR+i*2);
+  hires->fog_color = nds9_io_read32(nds,NDS9_FOG_COLOR);
+  hires->fog_offset = nds9_io_read16(nds,NDS9_FOG_OFFSET)&0x7fff;
+  for(int i=0;i<32;++i)hires->fog_table[i] = nds9_io_read8(nds,NDS9_FOG_TABLE+i)&0x7f;
+  hires->tex_cache_flushes = nds->gpu.tex_cache->flushes;
+  hires->frame++;
+  return true;
+}
+// Fills the first element_size bytes of data over all size bytes, doubling the filled part with
+// every memcpy so the copies run at full vector width
+static FORCE_INLINE void nds_gpu_fill(void* data, size_t element_size, size_t size){
+  uint8_t* d = (uint8_t*)data;
+  for(size_t filled = element_size; filled<size; filled*=2){
+    memcpy(d+filled,d,filled*2<=size? filled: size-filled);
+  }
+}
+static void nds_gpu_clear_band(nds_t* nds, int y_start, int y_end){
+  uint8_t* color = nds->framebuffer_3d+y_start*NDS_LCD_W*4;
+  uint32_t* depth = nds->framebuffer_3d_depth+y_start*NDS_LCD_W;
+  uint32_t clear_color = nds9_io_read32(nds,NDS9_CLEAR_COLOR);
+  uint32_t poly_id = SB_BFE(clear_color,24,6)<<NDS_GPU_DEPTH_POLY_ID_SHIFT;
+  int pixels = (y_end-y_start)*NDS_LCD_W;
+  if(SB_BFE(nds9_io_read32(nds,NDS_DISP3DCNT),14,1)){
+    // Rear-plane bitmap: 256x256 color image in texture slot 2 and depth image in slot 3, both
+    // wrapped around the scroll offset
+    uint32_t offset = nds9_io_read16(nds,NDS9_CLRIMAGE_OFFSET);
+    for(int y=y_start;y<y_end;++y){
+      uint32_t row = ((y+SB_BFE(offset,8,8))&0xff)*256;
+      for(int x=0;x<NDS_LCD_W;++x){
+        uint32_t addr = (row+((x+SB_BFE(offset,0,8))&0xff))*2;
+        uint16_t c = nds_ppu_read16(nds,NDS_VRAM_TEX_SLOT0+0x40000+addr);
+        uint16_t z = nds_ppu_read16(nds,NDS_VRAM_TEX_SLOT0+0x60000+addr);
+        uint8_t* p = color+((y-y_start)*NDS_LCD_W+x)*4;
+        p[0]=SB_BFE(c,0,5)*8;
+        p[1]=SB_BFE(c,5,5)*8;
+        p[2]=SB_BFE(c,10,5)*8;
+        p[3]=SB_BFE(c,15,1)? 31*8: 0;
+        depth[(y-y_start)*NDS_LCD_W+x]=nds_gpu_clear_depth(z)|poly_id|(SB_BFE(z,15,1)? NDS_GPU_DEPTH_FOG: 0);
+      }
     }
-  }else if(vb[inds[1]].pos[3]>0.){
-    int i = inds[0];
-    inds[0]=inds[1];
-    inds[1]=inds[2];
-    inds[2]=i;
-  }else if(vb[inds[2]].pos[3]>0.){
-    int i = inds[0];
-    inds[0]=inds[2];
-    inds[2]=inds[1];
-    inds[1]=i;
-  }else return true;
-  
-  if(vb[inds[1]].pos[3]<0.){
-    int extra_ind0 = NDS_MAX_VERTS-1;
-    int extra_ind1 = NDS_MAX_VERTS-2;
-    vb[extra_ind0]=vb[inds[1]];
-    vb[extra_ind1]=vb[inds[2]];
-    nds_interp_wp_vert(nds,inds[0],extra_ind0);
-    nds_interp_wp_vert(nds,inds[0],extra_ind1);
-    return nds_gpu_draw_tri(nds,inds[0],extra_ind0,extra_ind1);
-  }
-
-  int extra_ind0 = NDS_MAX_VERTS-1;
-  int extra_ind1 = NDS_MAX_VERTS-2;
-  vb[extra_ind0]=vb[inds[2]];
-  vb[extra_ind1]=vb[inds[2]];
-  nds_interp_wp_vert(nds,inds[0],extra_ind0);
-  nds_interp_wp_vert(nds,inds[1],extra_ind1);
-  bool culled = nds_gpu_draw_tri(nds,inds[0],inds[1],extra_ind1);
-  culled&=nds_gpu_draw_tri(nds,inds[0],extra_ind1,extra_ind0);
-  return culled;
+    return;
+  }
+  color[0]=SB_BFE(clear_color,0,5)*8;
+  color[1]=SB_BFE(clear_color,5,5)*8;
+  color[2]=SB_BFE(clear_color,10,5)*8;
+  color[3]=SB_BFE(clear_color,16,5)*8;
+  nds_gpu_fill(color,4,pixels*4);
+  depth[0]=nds_gpu_clear_depth(nds9_io_read16(nds,NDS9_CLEAR_DEPTH))|poly_id|(SB_BFE(clear_color,15,1)? NDS_GPU_DEPTH_FOG: 0);
+  nds_gpu_fill(depth,sizeof(uint32_t),pixels*sizeof(uint32_t));
 }
-static void nds_gpu_process_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz){
-  if(nds->gpu.curr_vert>=6144)return;
-  nds->gpu.last_vertex_pos[0]=vx;
-  nds->gpu.last_vertex_pos[1]=vy;
-  nds->gpu.last_vertex_pos[2]=vz;
-
-  if(SB_UNLIKELY(nds->vert_log))fprintf(nds->vert_log,"Vertex {%d %d %d}\n",vx,vy,vz);
-  
-  float v[4] = {vx/4096.0,vy/4096.0,vz/4096.0,1.0};
-  float res[4];
-  nds_mult_matrix_vector(res,nds->gpu.mv_matrix,v,4);
-  nds_mult_matrix_vector(v,nds->gpu.proj_matrix,res,4);
-  //printf("Vert <%f, %f, %f, %f> matrix_stack_ptr:%d\n",v[0],v[1],v[2],v[3],nds->gpu.mv_matrix_stack_ptr);
-  v[1]*=-1;
-  /*
-  float abs_w = v[3];
-  if(abs_w!=0){
-    res[0]=(v[0])/abs_w;
-    res[1]=(v[1])/abs_w;
-    res[2]=(v[2])/abs_w;
-    res[3]=v[3];
-  }else{
-    res[0]=v[0]<0.?-INFINITY:INFINITY;
-    res[1]=v[1]<0.?-INFINITY:INFINITY;
-    res[2]=v[2]<0.?-INFINITY:INFINITY;
-    res[3]=v[3];
+// Renders the queued triangles into one horizontal band of the 3D framebuffer
+static void nds_gpu_render_band(void* user_data, int band){
+  nds_t* nds = (nds_t*)user_data;
+  int y_start = band*NDS_LCD_H/NDS_GPU_RENDER_BANDS;
+  int y_end = (band+1)*NDS_LCD_H/NDS_GPU_RENDER_BANDS;
+  nds_gpu_clear_band(nds,y_start,y_end);
+  nds_gpu_render_queue_t* queue = nds->gpu.render_queue;
+  if(!queue)return;
+  uint32_t pixels = 0;
+  for(uint32_t t=0;t<queue->poly_ram.num_tris;++t)pixels+=nds_gpu_raster_tri(nds,queue,t,y_start,y_end);
+  // Bands may run on other threads so each one only writes its own slot
+  nds->gpu.band_pixels[band]=pixels;
+}
+// State of the post passes, read from the IO registers at the start of every band
+typedef struct{
+  bool edge_mark, fog_enable, fog_alpha_only, anti_alias;
+  uint32_t clear;           // Depth buffer value used for the neighbours outside the screen
+  uint8_t edge_color[8][3];
+  uint8_t fog_color[4];
+  uint8_t fog_channels[4];  // 0xff for the channels fog applies to
+  uint8_t fog_density[34];  // 0..128, the last entry is repeated so index 32 interpolates to it
+  int32_t fog_offset;
+  int fog_step_shift;       // log2 of FOG_STEP in 15 bit depth units
+}nds_gpu_post_t;
+static void nds_gpu_post_setup(nds_t* nds, nds_gpu_post_t* post){
+  uint32_t disp3dcnt = nds9_io_read32(nds,NDS_DISP3DCNT);
+  post->anti_alias = SB_BFE(disp3dcnt,4,1);
+  post->edge_mark = SB_BFE(disp3dcnt,5,1);
+  post->fog_alpha_only = SB_BFE(disp3dcnt,6,1);
+  post->fog_enable = SB_BFE(disp3dcnt,7,1);
+  uint32_t clear_color = nds9_io_read32(nds,NDS9_CLEAR_COLOR);
+  post->clear = nds_gpu_clear_depth(nds9_io_read16(nds,NDS9_CLEAR_DEPTH))|(SB_BFE(clear_color,24,6)<<NDS_GPU_DEPTH_POLY_ID_SHIFT);
+  for(int i=0;i<8;++i){
+    uint16_t c = nds9_io_read16(nds,NDS9_EDGE_COLOR+i*2);
+    SE_RPT3 post->edge_color[i][r]=SB_BFE(c,5*r,5)*8;
+  }
+  uint32_t fog_color = nds9_io_read32(nds,NDS9_FOG_COLOR);
+  SE_RPT3 post->fog_color[r]=SB_BFE(fog_color,5*r,5)*8;
+  post->fog_color[3]=SB_BFE(fog_color,16,5)*8;
+  SE_RPT3 post->fog_channels[r]=post->fog_alpha_only? 0: 0xff;
+  post->fog_channels[3]=0xff;
+  for(int i=0;i<34;++i){
+    int d = nds9_io_read8(nds,NDS9_FOG_TABLE+(i<32? i: 31))&0x7f;
+    post->fog_density[i]= d==127? 128: d;
+  }
+  post->fog_offset = nds9_io_read16(nds,NDS9_FOG_OFFSET)&0x7fff;
+  int shift = SB_BFE(disp3dcnt,8,4);
+  post->fog_step_shift = shift>10? 0: 10-shift;
+}
+// Bit i is set in edges[x] when neighbour i (left, right, up, down) of pixel x in row y was written
+// by a polygon with another ID and is farther away. Translucent pixels are never edges. Only reads
+// the depth buffer, which is final once all bands are rasterized.
+static void nds_gpu_find_edges(nds_t* nds, const nds_gpu_post_t* post, int y, uint8_t* edges){
+  uint32_t win[3][NDS_LCD_W+2];
+  for(int i=0;i<3;++i){
+    int row = y+i-1;
+    win[i][0] = win[i][NDS_LCD_W+1] = post->clear;
+    if(row<0||row>=NDS_LCD_H){
+      for(int x=1;x<=NDS_LCD_W;++x)win[i][x]=post->clear;
+    }else memcpy(win[i]+1,nds->framebuffer_3d_depth+row*NDS_LCD_W,NDS_LCD_W*sizeof(uint32_t));
+  }
+  // Branch free so the compiler can vectorize it
+  for(int x=0;x<NDS_LCD_W;++x){
+    uint32_t d = win[1][x+1];
+    uint32_t n[4] = {win[1][x],win[1][x+2],win[0][x+1],win[2][x+1]};
+    uint32_t e = 0;
+    SE_RPT4 e|= (((d^n[r])&NDS_GPU_DEPTH_POLY_ID_MASK)!=0&&(n[r]&NDS_GPU_DEPTH_MASK)>(d&NDS_GPU_DEPTH_MASK))<<r;
+    edges[x] = (d&NDS_GPU_DEPTH_TRANSLUCENT)? 0: e;
+  }
+}
+// Blends the fog color over the pixels of a row that have the fog flag, by the density the fog 
+// table gives for their depth
+static void nds_gpu_fog_row(const nds_gpu_post_t* post, const uint32_t* depth, uint8_t* color){
+  uint8_t density[NDS_LCD_W];
+  int shift = post->fog_step_shift;
+  for(int x=0;x<NDS_LCD_W;++x){
+    int32_t z = (int32_t)((depth[x]&NDS_GPU_DEPTH_MASK)>>9)-post->fog_offset;
+    z = z<0? 0: z;
+    int32_t i = z>>shift;
+    int32_t frac = ((z&((1<<shift)-1))<<7)>>shift;
+    if(i>32){i=32;frac=0;}
+    int32_t d0 = post->fog_density[i], d1 = post->fog_density[i+1];
+    int32_t d = d0+(((d1-d0)*frac)/128);
+    density[x] = (depth[x]&NDS_GPU_DEPTH_FOG)? d: 0;
+  }
+#ifdef SB_SIMD_WASM
+  v128_t channels = wasm_v128_load32_splat(post->fog_channels);
+  v128_t fog = wasm_v128_load32_splat(post->fog_color);
+  v128_t fog_lo = wasm_u16x8_extend_low_u8x16(fog);
+  v128_t fog_hi = wasm_u16x8_extend_high_u8x16(fog);
+  v128_t full = wasm_i16x8_splat(128);
+  for(int x=0;x<NDS_LCD_W;x+=4){
+    // Spread the density of 4 pixels over their channels
+    v128_t d = wasm_i8x16_swizzle(wasm_v128_load32_zero(density+x),wasm_i8x16_const(0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3));
+    d = wasm_v128_and(d,channels);
+    v128_t c = wasm_v128_load(color+x*4);
+    v128_t d_lo = wasm_u16x8_extend_low_u8x16(d), d_hi = wasm_u16x8_extend_high_u8x16(d);
+    v128_t lo = wasm_i16x8_add(wasm_i16x8_mul(fog_lo,d_lo),wasm_i16x8_mul(wasm_u16x8_extend_low_u8x16(c),wasm_i16x8_sub(full,d_lo)));
+    v128_t hi = wasm_i16x8_add(wasm_i16x8_mul(fog_hi,d_hi),wasm_i16x8_mul(wasm_u16x8_extend_high_u8x16(c),wasm_i16x8_sub(full,d_hi)));
+    wasm_v128_store(color+x*4,wasm_u8x16_narrow_i16x8(wasm_u16x8_shr(lo,7),wasm_u16x8_shr(hi,7)));
+  }
+#else
+  for(int i=0;i<NDS_LCD_W*4;++i){
+    uint32_t d = density[i/4]&post->fog_channels[i%4];
+    color[i] = (post->fog_color[i%4]*d+color[i]*(128-d))>>7;
+  }
+#endif
+}
+// Edge marking and fog of one band, in place. With anti-aliasing on the first and last row are 
+// also saved so the next pass can read the neighbouring bands without racing them.
+static void nds_gpu_post_band(void* user_data, int band){
+  nds_t* nds = (nds_t*)user_data;
+  int y_start = band*NDS_LCD_H/NDS_GPU_RENDER_BANDS;
+  int y_end = (band+1)*NDS_LCD_H/NDS_GPU_RENDER_BANDS;
+  nds_gpu_post_t post;
+  nds_gpu_post_setup(nds,&post);
+  uint8_t edges[NDS_LCD_W];
+  for(int y=y_start;y<y_end;++y){
+    uint8_t* color = nds->framebuffer_3d+y*NDS_LCD_W*4;
+    const uint32_t* depth = nds->framebuffer_3d_depth+y*NDS_LCD_W;
+    if(post.edge_mark){
+      nds_gpu_find_edges(nds,&post,y,edges);
+      for(int x=0;x<NDS_LCD_W;++x){
+        if(!edges[x])continue;
+        const uint8_t* edge_color = post.edge_color[SB_BFE(depth[x],NDS_GPU_DEPTH_POLY_ID_SHIFT+3,3)];
+        SE_RPT3 color[x*4+r]=edge_color[r];
+      }
+    }
+    if(post.fog_enable)nds_gpu_fog_row(&post,depth,color);
+  }
+  if(post.anti_alias&&nds->framebuffer_3d_halo){
+    uint8_t* halo = nds->framebuffer_3d_halo+band*2*NDS_LCD_W*4;
+    memcpy(halo,nds->framebuffer_3d+y_start*NDS_LCD_W*4,NDS_LCD_W*4);
+    memcpy(halo+NDS_LCD_W*4,nds->framebuffer_3d+(y_end-1)*NDS_LCD_W*4,NDS_LCD_W*4);
+  }
+}
+// Anti-aliasing of one band. Without the coverage of the edge pixels they're treated as half 
+// covered and blended 50/50 with the farthest neighbour behind the edge. Rows are read from 
+// copies taken before they were blended, the rows of other bands from the halo rows.
+static void nds_gpu_antialias_band(void* user_data, int band){
+  nds_t* nds = (nds_t*)user_data;
+  int y_start = band*NDS_LCD_H/NDS_GPU_RENDER_BANDS;
+  int y_end = (band+1)*NDS_LCD_H/NDS_GPU_RENDER_BANDS;
+  nds_gpu_post_t post;
+  nds_gpu_post_setup(nds,&post);
+  const uint8_t* halo = nds->framebuffer_3d_halo;
+  uint8_t rows[2][NDS_LCD_W*4];
+  uint8_t edges[NDS_LCD_W];
+  int prev = 0;
+  if(band>0)memcpy(rows[prev],halo+((band-1)*2+1)*NDS_LCD_W*4,NDS_LCD_W*4);
+  for(int y=y_start;y<y_end;++y){
+    uint8_t* color = nds->framebuffer_3d+y*NDS_LCD_W*4;
+    uint8_t* curr = rows[!prev];
+    memcpy(curr,color,NDS_LCD_W*4);
+    const uint8_t* up = y>0? rows[prev]: NULL;
+    const uint8_t* down = y+1<y_end? color+NDS_LCD_W*4: y+1<NDS_LCD_H? halo+(band+1)*2*NDS_LCD_W*4: NULL;
+    nds_gpu_find_edges(nds,&post,y,edges);
+    for(int x=0;x<NDS_LCD_W;++x){
+      if(!edges[x])continue;
+      const uint8_t* behind = NULL;
+      uint32_t farthest = 0;
+      for(int i=0;i<4;++i){
+        if(!SB_BFE(edges[x],i,1))continue;
+        int nx = x+(i==0? -1: i==1? 1: 0);
+        int ny = y+(i==2? -1: i==3? 1: 0);
+        // Neighbours outside the screen have no color to blend with
+        if(nx<0||nx>=NDS_LCD_W||ny<0||ny>=NDS_LCD_H)continue;
+        const uint8_t* n = i==2? up+x*4: i==3? down+x*4: curr+nx*4;
+        uint32_t nd = nds->framebuffer_3d_depth[ny*NDS_LCD_W+nx]&NDS_GPU_DEPTH_MASK;
+        if(!behind||nd>farthest){behind=n;farthest=nd;}
+      }
+      if(behind)SE_RPT3 color[x*4+r]=(curr[x*4+r]+behind[r]+1)/2;
+    }
+    prev = !prev;
+  }
+}
+static FORCE_INLINE void nds_gpu_set_ram_overflow(nds_t* nds){
+  nds9_io_store32(nds,NDS_DISP3DCNT,nds9_io_read32(nds,NDS_DISP3DCNT)|(1<<13));
+}
+// Sets up a triangle of the current polygon and stores it in polygon/vertex RAM for rendering at
+// the next buffer swap. Returns true if it was culled.
+static bool nds_gpu_draw_tri(nds_t* nds, int vi0, int vi1, int vi2){
+  nds_gpu_render_queue_t* queue = nds->gpu.render_queue;
+  if(!queue)return true;
+  if(nds->gpu.poly_ram_offset>=NDS_GPU_POLY_RAM_SIZE||queue->poly_ram.num_tris>=NDS_GPU_MAX_TRIS){
+    nds_gpu_set_ram_overflow(nds);
+    return true;
+  }
+
+  int vi[3] = {vi0,vi1,vi2};
+  nds_vert_t *v[3] = {nds->gpu.vert_buffer+vi0,nds->gpu.vert_buffer+vi1,nds->gpu.vert_buffer+vi2};
+  for(int i=0;i<3;++i){
+    SE_RPT3 v[i]->clip_pos[r]=v[i]->pos[r]/fabs(v[i]->pos[3]);
+  }
+
+  float min_p[2] = {1,1};
+  float max_p[2] = {-1,-1};
+  for(int i=0;i<3;++i){
+    SE_RPT2 min_p[r]=fminf(v[i]->clip_pos[r],min_p[r]);
+    SE_RPT2 max_p[r]=fmaxf(v[i]->clip_pos[r],max_p[r]);
+  }
+  // Entirely off screen
+  if(min_p[0]>1||min_p[1]>1||max_p[0]<-1||max_p[1]<-1)return true;
+
+  uint32_t poly_attr = nds->gpu.poly_attr;
+  int polygon_mode = SB_BFE(poly_attr,4,2);//(0=Modulation,1=Decal,2=Toon/Highlight Shading,3=Shadow)
+  bool render_front =   SB_BFE(poly_attr,6,1);
+  bool render_back =  SB_BFE(poly_attr,7,1);
+  
+  //Skip shadow triangles for now TODO: Fix this
+  if(polygon_mode==3)return true;
+  bool front_face=true;
+  {
+    float e0[2],e1[2];
+    SE_RPT2 e0[r]=v[1]->clip_pos[r]-v[0]->clip_pos[r];
+    SE_RPT2 e1[r]=v[2]->clip_pos[r]-v[0]->clip_pos[r];
+
+    front_face = (e0[1]*e1[0]-e0[0]*e1[1])<=0;
+    
+    if(!((front_face&&render_front)||(!front_face&&render_back)))return true; 
+
+    if(!front_face){
+      nds_vert_t*vt = v[2];
+      v[2]=v[1];
+      v[1]=vt;
+      int t = vi[2];
+      vi[2]=vi[1];
+      vi[1]=t;
+    }
+  }
+  // Vertices already stored by a previous triangle of a strip are shared. The clipping scratch 
+  // slots at the end of vert_buffer are always stored as new vertices.
+  nds_gpu_vertex_ram_t* vert_ram = &queue->vert_ram;
+  int new_verts = 0;
+  for(int i=0;i<3;++i){
+    bool shareable = vi[i]<NDS_MAX_VERTS-NDS_GPU_CLIP_VERTS;
+    if(!shareable||!queue->vert_ram_index[vi[i]])new_verts++;
+  }
+  if(vert_ram->size+new_verts>NDS_GPU_VERTEX_RAM_SIZE){
+    nds_gpu_set_ram_overflow(nds);
+    return true;
+  }
+  nds_gpu_poly_ram_t* poly_ram = &queue->poly_ram;
+  uint32_t tri = poly_ram->num_tris++;
+  for(int i=0;i<3;++i){
+    bool shareable = vi[i]<NDS_MAX_VERTS-NDS_GPU_CLIP_VERTS;
+    if(shareable&&queue->vert_ram_index[vi[i]]){
+      poly_ram->tri_verts[i][tri]=queue->vert_ram_index[vi[i]]-1;
+      continue;
+    }
+    uint32_t index = vert_ram->size++;
+    SE_RPT4 vert_ram->pos[r][index] = v[i]->pos[r];
+    SE_RPT2 vert_ram->tex[r][index] = v[i]->tex[r];
+    SE_RPT3 vert_ram->color[r][index] = v[i]->color[r];
+    if(shareable)queue->vert_ram_index[vi[i]]=index+1;
+    poly_ram->tri_verts[i][tri]=index;
+  }
+  uint32_t poly = nds->gpu.poly_ram_offset;
+  poly_ram->tri_poly[tri] = poly;
+  poly_ram->poly_attr[poly] = poly_attr;
+  poly_ram->disp3dcnt[poly] = nds9_io_read32(nds,NDS_DISP3DCNT);
+  poly_ram->tex_image_param[poly] = nds->gpu.tex_image_param;
+  poly_ram->tex_plt_base[poly] = nds->gpu.tex_plt_base;
+  if(poly>=poly_ram->size)poly_ram->size = poly+1;
+  SB_PERF_COUNT(&nds->perf,SB_COUNTER_TRIANGLES,1);
+  return false;
+}
+static FORCE_INLINE uint32_t nds_gpu_clip_code(const float* pos){
+  float w = pos[3], g = w*NDS_GPU_GUARD_BAND;
+  uint32_t code = 0;
+  if(pos[0]<-w)code|=NDS_GPU_CLIP_X_NEG;
+  if(pos[0]> w)code|=NDS_GPU_CLIP_X_POS;
+  if(pos[1]<-w)code|=NDS_GPU_CLIP_Y_NEG;
+  if(pos[1]> w)code|=NDS_GPU_CLIP_Y_POS;
+  if(pos[2]<-w)code|=NDS_GPU_CLIP_Z_NEG;
+  if(pos[2]> w)code|=NDS_GPU_CLIP_Z_POS;
+  if(pos[0]<-g||pos[0]>g||pos[1]<-g||pos[1]>g)code|=NDS_GPU_CLIP_GUARD_BAND;
+  return code;
+}
+// Signed distance to a view volume plane, positive inside
+static FORCE_INLINE float nds_gpu_clip_dist(const nds_vert_t* v, int plane){
+  float p = v->pos[plane/2];
+  return plane&1? v->pos[3]-p: v->pos[3]+p;
+}
+// Triangles inside all planes and the guard band are drawn as they are and triangles outside the
+// same plane are dropped. Only the rest are clipped, against just the planes their vertices cross,
+// and the clipped polygon is drawn as a fan. Returns true if nothing was drawn.
+static bool nds_gpu_clip_tri(nds_t* nds, int vi0, int vi1, int vi2){
+  nds_vert_t* vb = nds->gpu.vert_buffer;
+  uint32_t code_or = vb[vi0].clip_code|vb[vi1].clip_code|vb[vi2].clip_code;
+  uint32_t code_and = vb[vi0].clip_code&vb[vi1].clip_code&vb[vi2].clip_code;
+  if(SB_LIKELY(!(code_or&(NDS_GPU_CLIP_Z_NEG|NDS_GPU_CLIP_Z_POS|NDS_GPU_CLIP_GUARD_BAND))))return nds_gpu_draw_tri(nds,vi0,vi1,vi2);
+  if(code_and&NDS_GPU_CLIP_PLANES)return true;
+  // POLYGON_ATTR bit 12: polygons crossing the far plane are hidden unless it's set
+  if((code_or&NDS_GPU_CLIP_Z_POS)&&!SB_BFE(nds->gpu.poly_attr,12,1))return true;
+
+  // Sutherland-Hodgman, vertices that are never clipped keep their vert_buffer slot (-1 if new)
+  nds_vert_t poly[2][NDS_GPU_CLIP_VERTS];
+  int slot[2][NDS_GPU_CLIP_VERTS];
+  int n = 3, curr = 0;
+  int inds[3] = {vi0,vi1,vi2};
+  for(int i=0;i<3;++i){poly[0][i]=vb[inds[i]];slot[0][i]=inds[i];}
+  for(int plane=0;plane<6;++plane){
+    if(!(code_or&(1<<plane)))continue;
+    nds_vert_t* in = poly[curr];
+    nds_vert_t* out = poly[!curr];
+    int* in_slot = slot[curr];
+    int* out_slot = slot[!curr];
+    int out_n = 0;
+    for(int i=0;i<n;++i){
+      const nds_vert_t* a = in+(i+n-1)%n;
+      const nds_vert_t* b = in+i;
+      float da = nds_gpu_clip_dist(a,plane), db = nds_gpu_clip_dist(b,plane);
+      if((da>=0)!=(db>=0)&&out_n<NDS_GPU_CLIP_VERTS){
+        float t = da/(da-db);
+        nds_vert_t* v = out+out_n;
+        SE_RPT4 v->pos[r] = a->pos[r]+(b->pos[r]-a->pos[r])*t;
+        SE_RPT3 v->color[r] = a->color[r]+(b->color[r]-a->color[r])*t+0.5f;
+        SE_RPT2 v->tex[r] = a->tex[r]+(b->tex[r]-a->tex[r])*t;
+        out_slot[out_n++] = -1;
+      }
+      if(db>=0&&out_n<NDS_GPU_CLIP_VERTS){
+        out[out_n] = *b;
+        out_slot[out_n++] = in_slot[i];
+      }
+    }
+    n = out_n;
+    curr = !curr;
+    if(n<3)return true;
+  }
+  int scratch = NDS_MAX_VERTS-1;
+  for(int i=0;i<n;++i){
+    if(slot[curr][i]>=0)continue;
+    vb[scratch]=poly[curr][i];
+    slot[curr][i]=scratch--;
+  }
+  bool culled = true;
+  for(int i=1;i+1<n;++i)culled&=nds_gpu_draw_tri(nds,slot[curr][0],slot[curr][i],slot[curr][i+1]);
+  return culled;
+}
+// Moves a vert_buffer slot along with its vertex RAM entry
+static FORCE_INLINE void nds_gpu_move_vert(nds_t*nds, int from, int to){
+  nds->gpu.vert_buffer[to]=nds->gpu.vert_buffer[from];
+  if(nds->gpu.render_queue)nds->gpu.render_queue->vert_ram_index[to]=nds->gpu.render_queue->vert_ram_index[from];
+}
+// Keys are a multiple of 16 bytes, hashed in 4 independent lanes
+static uint32_t nds_geometry_hash(const void* data, size_t size){
+  const uint32_t* w = (const uint32_t*)data;
+  uint32_t h[4]={0,1,2,3};
+  for(size_t i=0;i<size/4;i+=4)SE_RPT4 h[r] = (h[r]^w[i+r])*0x9E3779B1u;
+  uint32_t hash = h[0]^(h[1]>>7)^(h[2]>>13)^(h[3]>>19)^(h[1]<<25)^(h[2]<<19)^(h[3]<<13);
+  return hash^(hash>>16);
+}
+static uint32_t nds_geometry_next_serial(nds_geometry_cache_t* cache){
+  if(SB_UNLIKELY(cache->next_serial==UINT32_MAX)){
+    // Serials wrapped, drop everything so no stale entry can match a reused one
+    memset(cache,0,sizeof(*cache));
+  }
+  return ++cache->next_serial;
+}
+// Serial of the slot holding key, a slot that held something else gets key and a new serial
+static uint32_t nds_geometry_intern(nds_geometry_cache_t* cache, void* keys, uint32_t* serials, const void* key, size_t key_size){
+  uint32_t slot = nds_geometry_hash(key,key_size)%NDS_GEOMETRY_CACHE_STATES;
+  uint8_t* stored = (uint8_t*)keys+slot*key_size;
+  if(!serials[slot]||memcmp(stored,key,key_size)!=0){
+    uint32_t serial = nds_geometry_next_serial(cache);
+    memcpy(stored,key,key_size);
+    serials[slot]=serial;
+  }
+  return serials[slot];
+}
+static FORCE_INLINE uint32_t nds_geometry_xform_state(nds_t* nds, nds_geometry_cache_t* cache){
+  if(SB_LIKELY(cache->xform_state))return cache->xform_state;
+  nds_geometry_xform_key_t key;
+  memcpy(key.matrices[0],nds->gpu.mv_matrix,sizeof(key.matrices[0]));
+  memcpy(key.matrices[1],nds->gpu.proj_matrix,sizeof(key.matrices[1]));
+  memcpy(key.matrices[2],nds->gpu.tex_matrix,sizeof(key.matrices[2]));
+  return cache->xform_state = nds_geometry_intern(cache,cache->xform_keys,cache->xform_serials,&key,sizeof(key));
+}
+static FORCE_INLINE uint32_t nds_geometry_light_state(nds_t* nds, nds_geometry_cache_t* cache){
+  if(SB_LIKELY(cache->light_state))return cache->light_state;
+  nds_gpu_t* gpu = &nds->gpu;
+  nds_geometry_light_key_t key;
+  memset(&key,0,sizeof(key));
+  memcpy(key.direction_matrix,gpu->direction_matrix,sizeof(key.direction_matrix));
+  memcpy(key.light_vector,gpu->light_vector,sizeof(key.light_vector));
+  memcpy(key.light_color,gpu->light_color,sizeof(key.light_color));
+  SE_RPT3 key.ambient[r]=gpu->curr_ambient_color[r];
+  SE_RPT3 key.diffuse[r]=gpu->curr_diffuse_color[r];
+  SE_RPT3 key.specular[r]=gpu->curr_specular_color[r];
+  SE_RPT3 key.emission[r]=gpu->curr_emission_color[r];
+  memcpy(key.shininess_table,gpu->shininess_table,sizeof(key.shininess_table));
+  key.use_shininess_table = gpu->use_shininess_table;
+  key.enabled_lights = SB_BFE(gpu->poly_attr,0,4);
+  return cache->light_state = nds_geometry_intern(cache,cache->light_keys,cache->light_serials,&key,sizeof(key));
+}
+// Clip space position and texture coordinates of a vertex with the current GX state
+static void nds_gpu_transform_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz, int coord_xform_mode, float* v, float* uv){
+  v[0]=vx/4096.0; v[1]=vy/4096.0; v[2]=vz/4096.0; v[3]=1.0;
+  float res[4];
+  nds_mult_matrix_vector(res,nds->gpu.mv_matrix,v,4);
+  nds_mult_matrix_vector(v,nds->gpu.proj_matrix,res,4);
+  //printf("Vert <%f, %f, %f, %f> matrix_stack_ptr:%d\n",v[0],v[1],v[2],v[3],nds->gpu.mv_matrix_stack_ptr);
+  v[1]*=-1;
+  /*
+  float abs_w = v[3];
+  if(abs_w!=0){
+    res[0]=(v[0])/abs_w;
+    res[1]=(v[1])/abs_w;
+    res[2]=(v[2])/abs_w;
+    res[3]=v[3];
+  }else{
+    res[0]=v[0]<0.?-INFINITY:INFINITY;
+    res[1]=v[1]<0.?-INFINITY:INFINITY;
+    res[2]=v[2]<0.?-INFINITY:INFINITY;
+    res[3]=v[3];
   }
   
   int x0 = (res[0]*0.5+0.5)*NDS_LCD_W;
@@ -4431,11 +6107,7 @@ static void nds_gpu_process_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz)
       if(res[3]<0)nds->framebuffer_3d[p*4+0]=0;
     }
   }*/
-  nds_vert_t*vert = nds->gpu.vert_buffer+nds->gpu.curr_vert++;
-  nds->gpu.curr_draw_vert++;
-  uint32_t tex_param = nds->gpu.tex_image_param;
-  int coord_xform_mode = SB_BFE(tex_param,30,2);
-  float uv[4] = {nds->gpu.curr_tex_coord[0]/16.,nds->gpu.curr_tex_coord[1]/16.,0,1};
+  uv[0]=nds->gpu.curr_tex_coord[0]/16.; uv[1]=nds->gpu.curr_tex_coord[1]/16.; uv[2]=0; uv[3]=1;
   switch(coord_xform_mode){
     case 0: break;
     case 1:{
@@ -4466,9 +6138,45 @@ static void nds_gpu_process_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz)
       //printf("Unknown Tex Coord XForm mode:%d\n",coord_xform_mode);
       break;
   }
+}
+static void nds_gpu_process_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz){
+  if(nds->gpu.curr_vert>=6144)return;
+  nds->gpu.last_vertex_pos[0]=vx;
+  nds->gpu.last_vertex_pos[1]=vy;
+  nds->gpu.last_vertex_pos[2]=vz;
+
+  nds_log_event(nds,SB_EVENT_GX_VERTEX,vx,vy,vz,0);
+  
+  if(nds->gpu.render_queue)nds->gpu.render_queue->vert_ram_index[nds->gpu.curr_vert]=0;
+  nds_vert_t*vert = nds->gpu.vert_buffer+nds->gpu.curr_vert++;
+  nds->gpu.curr_draw_vert++;
+  int coord_xform_mode = SB_BFE(nds->gpu.tex_image_param,30,2);
+  float v[4], uv[4];
+  nds_geometry_cache_t* cache = nds->gpu.geometry_cache;
+  // Normal based texture coordinates depend on the last NORMAL, those aren't cached
+  if(cache&&coord_xform_mode!=2&&++cache->xform_uses>NDS_GEOMETRY_CACHE_MIN_USES){
+    uint32_t state = nds_geometry_xform_state(nds,cache);
+    int16_t s = nds->gpu.curr_tex_coord[0], t = nds->gpu.curr_tex_coord[1];
+    uint32_t hash = (state*0x9E3779B1u)^((uint16_t)vx*0x85EBCA6Bu)^((uint16_t)vy*0xC2B2AE35u)^((uint16_t)vz*0x27D4EB2Fu)
+                   ^((uint16_t)s*0x165667B1u)^((uint16_t)t*0xD3A2646Cu)^coord_xform_mode;
+    nds_geometry_vert_t* e = cache->verts+((hash^(hash>>15))%NDS_GEOMETRY_CACHE_VERTS);
+    if(e->state==state&&e->pos[0]==vx&&e->pos[1]==vy&&e->pos[2]==vz&&e->tex_coord[0]==s&&e->tex_coord[1]==t&&e->xform_mode==coord_xform_mode){
+      SE_RPT4 v[r]=e->clip_pos[r];
+      SE_RPT2 uv[r]=e->uv[r];
+    }else{
+      nds_gpu_transform_vertex(nds,vx,vy,vz,coord_xform_mode,v,uv);
+      e->state = state;
+      e->pos[0]=vx; e->pos[1]=vy; e->pos[2]=vz;
+      e->tex_coord[0]=s; e->tex_coord[1]=t;
+      e->xform_mode = coord_xform_mode;
+      SE_RPT4 e->clip_pos[r]=v[r];
+      SE_RPT2 e->uv[r]=uv[r];
+    }
+  }else nds_gpu_transform_vertex(nds,vx,vy,vz,coord_xform_mode,v,uv);
   SE_RPT3 vert->color[r]=nds->gpu.curr_color[r];
   SE_RPT2 vert->tex[r]= uv[r];
   SE_RPT4 vert->pos[r] = v[r];
+  vert->clip_code = nds_gpu_clip_code(v);
 
   switch(nds->gpu.prim_type){
     /*Triangles */ case 0: 
@@ -4495,11 +6203,11 @@ static void nds_gpu_process_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz)
         if(culled){
           nds->gpu.rendered_primitive_tracker|=1;
           if((nds->gpu.rendered_primitive_tracker&0x7)==0x7){
-            nds->gpu.vert_buffer[nds->gpu.curr_vert-3]=nds->gpu.vert_buffer[nds->gpu.curr_vert-2];
-            nds->gpu.vert_buffer[nds->gpu.curr_vert-2]=nds->gpu.vert_buffer[nds->gpu.curr_vert-1];
+            nds_gpu_move_vert(nds,nds->gpu.curr_vert-2,nds->gpu.curr_vert-3);
+            nds_gpu_move_vert(nds,nds->gpu.curr_vert-1,nds->gpu.curr_vert-2);
             nds->gpu.curr_vert--;
-          }else nds->gpu.poly_ram_offset++;
-        }
+          }
+        }else nds->gpu.poly_ram_offset++;
       }
       break;
     /*Quadstrip */ case 3: 
@@ -4516,8 +6224,8 @@ static void nds_gpu_process_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz)
         if(culled){
           nds->gpu.rendered_primitive_tracker|=1;
           if((nds->gpu.rendered_primitive_tracker&0x3)==0x3){
-            nds->gpu.vert_buffer[nds->gpu.curr_vert-4]=nds->gpu.vert_buffer[nds->gpu.curr_vert-2];
-            nds->gpu.vert_buffer[nds->gpu.curr_vert-3]=nds->gpu.vert_buffer[nds->gpu.curr_vert-1];
+            nds_gpu_move_vert(nds,nds->gpu.curr_vert-2,nds->gpu.curr_vert-4);
+            nds_gpu_move_vert(nds,nds->gpu.curr_vert-1,nds->gpu.curr_vert-3);
             nds->gpu.curr_vert-=2;
           }
         }else nds->gpu.poly_ram_offset++;
@@ -4526,50 +6234,51 @@ static void nds_gpu_process_vertex(nds_t*nds, int16_t vx,int16_t vy, int16_t vz)
   }
   //printf("Vertex %f %f %f->%f %f %f\n",vx/65536.0,vy/65536.0,vz/65536.0,res[0],res[1],res[2]);
 }
-static int nds_gpu_cmd_params(int cmd){
-  switch(cmd){
-    case 0x10:return  1 ; /*MTX_MODE - Set Matrix Mode (W)*/
-    case 0x11:return  0 ; /*MTX_PUSH - Push Current Matrix on Stack (W)*/
-    case 0x12:return  1 ; /*MTX_POP - Pop Current Matrix from Stack (W)*/
-    case 0x13:return  1 ; /*MTX_STORE - Store Current Matrix on Stack (W)*/
-    case 0x14:return  1 ; /*MTX_RESTORE - Restore Current Matrix from Stack (W)*/
-    case 0x15:return  0 ; /*MTX_IDENTITY - Load Unit Matrix to Current Matrix (W)*/
-    case 0x16:return  16; /*MTX_LOAD_4x4 - Load 4x4 Matrix to Current Matrix (W)*/
-    case 0x17:return  12; /*MTX_LOAD_4x3 - Load 4x3 Matrix to Current Matrix (W)*/
-    case 0x18:return  16; /*MTX_MULT_4x4 - Multiply Current Matrix by 4x4 Matrix (W)*/
-    case 0x19:return  12; /*MTX_MULT_4x3 - Multiply Current Matrix by 4x3 Matrix (W)*/
-    case 0x1A:return  9 ; /*MTX_MULT_3x3 - Multiply Current Matrix by 3x3 Matrix (W)*/
-    case 0x1B:return  3 ; /*MTX_SCALE - Multiply Current Matrix by Scale Matrix (W)*/
-    case 0x1C:return  3 ; /*MTX_TRANS - Mult. Curr. Matrix by Translation Matrix (W)*/
-    case 0x20:return  1 ; /*COLOR - Directly Set Vertex Color (W)*/
-    case 0x21:return  1 ; /*NORMAL - Set Normal Vector (W)*/
-    case 0x22:return  1 ; /*TEXCOORD - Set Texture Coordinates (W)*/
-    case 0x23:return  2 ; /*VTX_16 - Set Vertex XYZ Coordinates (W)*/
-    case 0x24:return  1 ; /*VTX_10 - Set Vertex XYZ Coordinates (W)*/
-    case 0x25:return  1 ; /*VTX_XY - Set Vertex XY Coordinates (W)*/
-    case 0x26:return  1 ; /*VTX_XZ - Set Vertex XZ Coordinates (W)*/
-    case 0x27:return  1 ; /*VTX_YZ - Set Vertex YZ Coordinates (W)*/
-    case 0x28:return  1 ; /*VTX_DIFF - Set Relative Vertex Coordinates (W)*/
-    case 0x29:return  1 ; /*POLYGON_ATTR - Set Polygon Attributes (W)*/
-    case 0x2A:return  1 ; /*TEXIMAGE_PARAM - Set Texture Parameters (W)*/
-    case 0x2B:return  1 ; /*PLTT_BASE - Set Texture Palette Base Address (W)*/
-    case 0x30:return  1 ; /*DIF_AMB - MaterialColor0 - Diffuse/Ambient Reflect. (W)*/
-    case 0x31:return  1 ; /*SPE_EMI - MaterialColor1 - Specular Ref. & Emission (W)*/
-    case 0x32:return  1 ; /*LIGHT_VECTOR - Set Light's Directional Vector (W)*/
-    case 0x33:return  1 ; /*LIGHT_COLOR - Set Light Color (W)*/
-    case 0x34:return  32; /*SHININESS - Specular Reflection Shininess Table (W)*/
-    case 0x40:return  1 ; /*BEGIN_VTXS - Start of Vertex List (W)*/
-    case 0x41:return  0 ; /*END_VTXS - End of Vertex List (W)*/
-    case 0x50:return  1 ; /*SWAP_BUFFERS - Swap Rendering Engine Buffer (W)*/
-    case 0x60:return  1 ; /*VIEWPORT - Set Viewport (W)*/
-    case 0x70:return  3 ; /*BOX_TEST - Test if Cuboid Sits inside View Volume (W)*/
-    case 0x71:return  2 ; /*POS_TEST - Set Position Coordinates for Test (W)*/
-    case 0x72:return  1 ; /*VEC_TEST - Set Directional Vector for Test (W)*/
-  }
-  return 0; 
-}
-
-static int nds_gpu_cmd_cycles(int cmd){
+// Parameter words of each GX command, 0 for commands without parameters and unused ids
+static const uint8_t nds_gpu_cmd_param_table[256]={
+  [0x10]=1 , /*MTX_MODE - Set Matrix Mode (W)*/
+  [0x11]=0 , /*MTX_PUSH - Push Current Matrix on Stack (W)*/
+  [0x12]=1 , /*MTX_POP - Pop Current Matrix from Stack (W)*/
+  [0x13]=1 , /*MTX_STORE - Store Current Matrix on Stack (W)*/
+  [0x14]=1 , /*MTX_RESTORE - Restore Current Matrix from Stack (W)*/
+  [0x15]=0 , /*MTX_IDENTITY - Load Unit Matrix to Current Matrix (W)*/
+  [0x16]=16, /*MTX_LOAD_4x4 - Load 4x4 Matrix to Current Matrix (W)*/
+  [0x17]=12, /*MTX_LOAD_4x3 - Load 4x3 Matrix to Current Matrix (W)*/
+  [0x18]=16, /*MTX_MULT_4x4 - Multiply Current Matrix by 4x4 Matrix (W)*/
+  [0x19]=12, /*MTX_MULT_4x3 - Multiply Current Matrix by 4x3 Matrix (W)*/
+  [0x1A]=9 , /*MTX_MULT_3x3 - Multiply Current Matrix by 3x3 Matrix (W)*/
+  [0x1B]=3 , /*MTX_SCALE - Multiply Current Matrix by Scale Matrix (W)*/
+  [0x1C]=3 , /*MTX_TRANS - Mult. Curr. Matrix by Translation Matrix (W)*/
+  [0x20]=1 , /*COLOR - Directly Set Vertex Color (W)*/
+  [0x21]=1 , /*NORMAL - Set Normal Vector (W)*/
+  [0x22]=1 , /*TEXCOORD - Set Texture Coordinates (W)*/
+  [0x23]=2 , /*VTX_16 - Set Vertex XYZ Coordinates (W)*/
+  [0x24]=1 , /*VTX_10 - Set Vertex XYZ Coordinates (W)*/
+  [0x25]=1 , /*VTX_XY - Set Vertex XY Coordinates (W)*/
+  [0x26]=1 , /*VTX_XZ - Set Vertex XZ Coordinates (W)*/
+  [0x27]=1 , /*VTX_YZ - Set Vertex YZ Coordinates (W)*/
+  [0x28]=1 , /*VTX_DIFF - Set Relative Vertex Coordinates (W)*/
+  [0x29]=1 , /*POLYGON_ATTR - Set Polygon Attributes (W)*/
+  [0x2A]=1 , /*TEXIMAGE_PARAM - Set Texture Parameters (W)*/
+  [0x2B]=1 , /*PLTT_BASE - Set Texture Palette Base Address (W)*/
+  [0x30]=1 , /*DIF_AMB - MaterialColor0 - Diffuse/Ambient Reflect. (W)*/
+  [0x31]=1 , /*SPE_EMI - MaterialColor1 - Specular Ref. & Emission (W)*/
+  [0x32]=1 , /*LIGHT_VECTOR - Set Light's Directional Vector (W)*/
+  [0x33]=1 , /*LIGHT_COLOR - Set Light Color (W)*/
+  [0x34]=32, /*SHININESS - Specular Reflection Shininess Table (W)*/
+  [0x40]=1 , /*BEGIN_VTXS - Start of Vertex List (W)*/
+  [0x41]=0 , /*END_VTXS - End of Vertex List (W)*/
+  [0x50]=1 , /*SWAP_BUFFERS - Swap Rendering Engine Buffer (W)*/
+  [0x60]=1 , /*VIEWPORT - Set Viewport (W)*/
+  [0x70]=3 , /*BOX_TEST - Test if Cuboid Sits inside View Volume (W)*/
+  [0x71]=2 , /*POS_TEST - Set Position Coordinates for Test (W)*/
+  [0x72]=1 , /*VEC_TEST - Set Directional Vector for Test (W)*/
+};
+static FORCE_INLINE int nds_gpu_cmd_params(int cmd){
+  return nds_gpu_cmd_param_table[cmd&0xff];
+}
+
+static FORCE_INLINE int nds_gpu_cmd_cycles(int cmd){
   //https://melonds.kuribo64.net/board/thread.php?id=141
   int params = nds_gpu_cmd_params(cmd); 
   if(params==0)params=1;
@@ -4639,6 +6348,20 @@ static void nds_vertex_lighting(nds_t * nds, int16_t nxi, int16_t nyi, int16_t n
   gpu->normal[1]=nyi/32768.;
   gpu->normal[2]=nzi/32768.;
   gpu->normal[3]=0.;
+  nds_geometry_cache_t* cache = gpu->geometry_cache;
+  nds_geometry_normal_t* e = NULL;
+  if(cache&&++cache->light_uses>NDS_GEOMETRY_CACHE_MIN_USES){
+    uint32_t state = nds_geometry_light_state(nds,cache);
+    uint32_t hash = (state*0x9E3779B1u)^((uint16_t)nxi*0x85EBCA6Bu)^((uint16_t)nyi*0xC2B2AE35u)^((uint16_t)nzi*0x27D4EB2Fu);
+    e = cache->normals+((hash^(hash>>15))%NDS_GEOMETRY_CACHE_NORMALS);
+    if(e->state==state&&e->normal[0]==nxi&&e->normal[1]==nyi&&e->normal[2]==nzi){
+      SE_RPT4 gpu->transformed_normal[r]=e->transformed_normal[r];
+      SE_RPT3 gpu->curr_color[r]=e->color[r];
+      return;
+    }
+    e->state = state;
+    e->normal[0]=nxi; e->normal[1]=nyi; e->normal[2]=nzi;
+  }
   float* normal_object = gpu->normal;
   float *normal= gpu->transformed_normal;
   nds_mult_matrix_vector(normal,gpu->direction_matrix,normal_object,4);
@@ -4671,6 +6394,10 @@ static void nds_vertex_lighting(nds_t * nds, int16_t nxi, int16_t nyi, int16_t n
     SE_RPT3 color[r]+=(float)gpu->curr_ambient_color[r]*(float)gpu->light_color[i*3+r]/(255.*255.);
   }
   SE_RPT3 gpu->curr_color[r]= fmax(0.0,fmin(255.0,color[r]*255));
+  if(e){
+    SE_RPT4 e->transformed_normal[r]=normal[r];
+    SE_RPT3 e->color[r]=gpu->curr_color[r];
+  }
 }
 static FORCE_INLINE void nds_update_gx_irq(nds_t* nds){
   int sz = nds_gxfifo_size(nds);
@@ -4688,18 +6415,19 @@ static FORCE_INLINE void nds_update_gx_irq(nds_t* nds){
     nds_update_interrupt_lines(nds);
   }
 }
-static FORCE_INLINE void nds_tick_gx(nds_t* nds){
+// Executes the command at the head of the FIFO. Returns false if no complete command is queued
+static bool nds_gx_exec_cmd(nds_t* nds){
   nds_gpu_t* gpu = &nds->gpu;
-  if(gpu->cmd_busy_cycles>0){gpu->cmd_busy_cycles--;return;}
   if(gpu->pending_swap){nds_gpu_swap_buffers(nds);gpu->pending_swap=false;}
   int sz = nds_gxfifo_size(nds);
   if(sz<=NDS_GX_DMA_THRESHOLD){nds->activate_dmas|=nds->dma_wait_gx;}
-  if(SB_LIKELY(sz==0))return; 
+  if(SB_LIKELY(sz==0))return false; 
   uint8_t cmd = gpu->fifo_cmd[gpu->fifo_read_ptr%NDS_GXFIFO_STORAGE];
   uint32_t cmd_params = nds_gpu_cmd_params(cmd);
-  if(SB_LIKELY(sz<cmd_params))return; 
+  if(SB_LIKELY(sz<cmd_params))return false; 
   if(cmd_params<1)cmd_params=1;
   nds_update_gx_irq(nds);
+  SB_PERF_COUNT(&nds->perf,SB_COUNTER_GX_COMMANDS,1);
 
   int32_t p[NDS_GPU_MAX_PARAM];
   for(int i=0;i<cmd_params;++i)p[i]=gpu->fifo_data[(gpu->fifo_read_ptr++)%NDS_GXFIFO_STORAGE];
@@ -4711,17 +6439,10 @@ static FORCE_INLINE void nds_tick_gx(nds_t* nds){
   float fixed_to_float = 1.0/(1<<NDS_MATRIX_FRACTION_BITS);
   gpu->cmd_busy_cycles= nds_gpu_cmd_cycles(cmd);
 
-  if(SB_UNLIKELY(nds->gx_log)){
-    if(cmd){
-      fprintf(nds->gx_log,"GPU CMD: %02x\n",cmd);
-      fprintf(nds->gx_log,"mv_stack: %d proj_stack: %d\n",gpu->mv_matrix_stack_ptr, gpu->proj_matrix_stack_ptr);
-      fprintf(nds->gx_log,"proj: ");
-      for(int i=0;i<16;++i)fprintf(nds->gx_log,"%lld ",(long long)gpu->proj_matrix[i]);
-      fprintf(nds->gx_log,"\nmv: ");
-      for(int i=0;i<16;++i)fprintf(nds->gx_log,"%lld ",(long long)gpu->mv_matrix[i]);
-      fprintf(nds->gx_log,"\n");
-    }
-  }
+  if(cmd)nds_log_event(nds,SB_EVENT_GX_CMD,cmd,gpu->mv_matrix_stack_ptr,gpu->proj_matrix_stack_ptr,cmd_params?p[0]:0);
+  // Matrix, light and material changes need the state to be interned again
+  if(cmd>=0x11&&cmd<=0x1c)nds_geometry_cache_invalidate(gpu->geometry_cache,true,true);
+  else if(cmd>=0x30&&cmd<=0x34)nds_geometry_cache_invalidate(gpu->geometry_cache,false,true);
   
 
   switch(cmd){
@@ -4988,12 +6709,14 @@ static FORCE_INLINE void nds_tick_gx(nds_t* nds){
 
     case 0x40: /*BEGIN_VTXS*/ 
       nds->gpu.prim_type = SB_BFE(p[0],0,2);
+      if(SB_BFE(nds->gpu.poly_attr^nds->gpu.pending_poly_attr,0,4))nds_geometry_cache_invalidate(gpu->geometry_cache,false,true);
       nds->gpu.poly_attr=nds->gpu.pending_poly_attr;
       nds->gpu.curr_draw_vert =0; 
       break;
     case 0x41: /*END_VTXS  */  nds->gpu.curr_draw_vert =0; break;
     case 0x50: 
       gpu->pending_swap=true;
+      if(gpu->render_queue)gpu->render_queue->poly_ram.w_buffer = SB_BFE(p[0],1,1);
       nds->gpu.cmd_busy_cycles+=nds_cycles_till_vblank(nds);
       break; //Swap buffers
     case 0x60: /*SET_VIEWPORT*/
@@ -5052,6 +6775,33 @@ static FORCE_INLINE void nds_tick_gx(nds_t* nds){
       
       break;
   }
+  return true;
+}
+// Runs the geometry engine for up to ticks cycles, starting each queued command as soon as the 
+// previous one finished. The run stops early when a command requests a GX DMA, raises an ARM9 
+// interrupt, frees a slot in a full FIFO or swaps the buffers, so the scheduler can react at that
+// cycle. Returns the cycles used.
+static FORCE_INLINE int nds_tick_gx(nds_t* nds, int ticks){
+  nds_gpu_t* gpu = &nds->gpu;
+  int t = 0;
+  while(t<ticks){
+    if(gpu->cmd_busy_cycles>0){
+      uint32_t wait = ticks-t;
+      if(gpu->cmd_busy_cycles<wait)wait = gpu->cmd_busy_cycles;
+      gpu->cmd_busy_cycles-=wait;
+      t+=wait;
+      continue;
+    }
+    ++t;
+    bool dma_active = nds->activate_dmas;
+    bool irq_line = nds->nds9_interrupt_line;
+    bool fifo_full = nds_gxfifo_size(nds)>=NDS_GXFIFO_SIZE;
+    // Nothing can be queued while the engine runs, so it stays idle for the rest of the cycles
+    if(!nds_gx_exec_cmd(nds))return ticks;
+    if((nds->activate_dmas&&!dma_active)||(nds->nds9_interrupt_line&&!irq_line)||gpu->pending_swap)return t;
+    if(fifo_full&&nds_gxfifo_size(nds)<NDS_GXFIFO_SIZE)return t;
+  }
+  return t;
 }
 static void nds_gpu_write_packed_cmd(nds_t *nds, uint32_t data){
   nds_gpu_t* gpu = &nds->gpu;
@@ -5114,17 +6864,73 @@ static void nds_tick_ipc_fifo(nds_t* nds){
   }
 }
 
+// Flags the IO words nds_preprocess_mmio and nds_postprocess_mmio_write act on. Must be kept in
+// sync with the addresses they check.
+static void nds_recompute_mmio_handler_table(nds_t* nds){
+  for(int w=0;w<sizeof(nds->mem.mmio_handler_flags);++w){
+    uint32_t low = w*4;
+    uint32_t addr = low>=NDS_IO_MAP_041_OFFSET? 0x04100000|low: 0x04000000|low;
+    uint8_t flags = 0;
+    // Preprocess (reads and writes)
+    if((addr>=NDS_IPCSYNC&&addr<=NDS_IPCFIFOSEND)||addr==NDS_IPCFIFORECV)flags|=NDS_MMIO_PREPROCESS;
+    if(addr>=GBA_TM0CNT_L&&addr<=GBA_TM3CNT_H)flags|=NDS_MMIO_PREPROCESS;
+    if(addr==GBA_KEYINPUT||addr==(NDS7_EXTKEYIN&~3))flags|=NDS_MMIO_PREPROCESS;
+    if(addr>=NDS9_CLIPMTX_RESULT&&addr<=NDS9_CLIPMTX_RESULT+0x40)flags|=NDS_MMIO_PREPROCESS;
+    if(addr>=NDS7_SOUND0_CNT&&addr<=NDS7_SNDCAP1LEN)flags|=NDS_MMIO_PREPROCESS;
+    switch(addr){
+      case NDS9_IF: case NDS7_VRAMSTAT: case NDS_IPCFIFOCNT: case NDS9_RDLINES_COUNT:
+      case NDS9_GXSTAT: case NDS9_RAM_COUNT: case NDS9_POWCNT1: case NDS7_EXMEMSTAT: case NDS_GC_BUS:
+      case NDS9_DIVCNT: case NDS9_DIV_RESULT: case NDS9_DIVREM_RESULT: case NDS9_DIV_RESULT+4: case NDS9_DIVREM_RESULT+4:
+      case NDS9_SQRTCNT: case NDS9_SQRT_RESULT: case NDS9_SQRT_RESULT+4:
+        flags|=NDS_MMIO_PREPROCESS;
+        break;
+    }
+    // Postprocess (writes)
+    if(addr>=GBA_DMA0SAD&&addr<=GBA_DMA3CNT_H)flags|=NDS_MMIO_POSTPROCESS;
+    if(addr>=GBA_TM0CNT_L&&addr<=GBA_TM3CNT_H)flags|=NDS_MMIO_POSTPROCESS;
+    if(addr>=0x4000400&&addr<0x40005CC)flags|=NDS_MMIO_POSTPROCESS;
+    if(addr>=(NDS9_VRAMCNT_A&~3)&&addr<=NDS9_VRAMCNT_I)flags|=NDS_MMIO_POSTPROCESS;
+    switch(addr){
+      case NDS9_IF: case NDS9_IME: case NDS9_IE: case NDS7_HALTCNT&~3: case NDS_IPCSYNC:
+      case NDS7_SPI_BUS_CTL: case NDS7_RTC_BUS: case NDS_IPCFIFOSEND: case NDS_IPCFIFOCNT: case NDS9_VRAMCNT_E:
+      case NDS9_DIVCNT: case NDS9_DIV_DENOM: case NDS9_DIV_DENOM+4: case NDS9_DIV_NUMER: case NDS9_DIV_NUMER+4:
+      case NDS9_SQRTCNT: case NDS9_SQRT_PARAM: case NDS9_SQRT_PARAM+4:
+      case NDS9_AUXSPICNT: case NDS_GCBUS_CTL|NDS_IO_MAP_SPLIT_OFFSET: case NDS_GCBUS_CTL:
+      case NDS9_GXSTAT: case NDS_DISP3DCNT:
+        flags|=NDS_MMIO_POSTPROCESS;
+        break;
+    }
+    nds->mem.mmio_handler_flags[low/4]=flags;
+  }
+}
 static bool nds_preprocess_mmio(nds_t * nds, uint32_t addr,uint32_t data, int transaction_type){
   uint32_t word_mask = nds_word_mask(addr,transaction_type);
   uint32_t baddr =addr;
   addr&=~3;
   int cpu = (transaction_type&NDS_MEM_ARM9)? NDS_ARM9: NDS_ARM7;
+  if((addr>=NDS_IPCSYNC&&addr<=NDS_IPCFIFOSEND)||addr==NDS_IPCFIFORECV)nds->cpu_sync_point=true;
+  // The SPU state has to be current before the ARM7 observes or changes it
+  if(addr>=NDS7_SOUND0_CNT&&addr<=NDS7_SNDCAP1LEN&&cpu==NDS_ARM7)nds_flush_audio(nds);
   /*if(addr!=0x04000208&&addr!=0x04000301&&addr!=0x04000138
     &&addr!= 0x040001c0 && addr!=0x040001c2)printf("MMIO Read: %08x\n",addr);*/
 
   //if(addr>=0x4000620&&addr<0x04000800&&!(transaction_type&NDS_MEM_DEBUG))printf("MMIO Read: %08x\n",addr);
 
-  if(addr>= GBA_TM0CNT_L&&addr<=GBA_TM3CNT_H)nds_compute_timers(nds);
+  if(addr>= GBA_TM0CNT_L&&addr<=GBA_TM3CNT_H){
+    nds_compute_timers(nds);
+    nds->mem.idle_loop_side_effects++;
+  }
+  else if(addr==GBA_KEYINPUT&&nds->mem.late_input&&!(transaction_type&NDS_MEM_WRITE)){
+    uint32_t buttons = sb_atomic_load_acquire_u32(&nds->mem.late_input->buttons);
+    nds_io_store16(nds,cpu,GBA_KEYINPUT,sb_keyinput_from_buttons(buttons));
+  }
+  else if(addr==(NDS7_EXTKEYIN&~3)&&cpu==NDS_ARM7&&nds->mem.late_input&&!(transaction_type&NDS_MEM_WRITE)){
+    uint32_t buttons = sb_atomic_load_acquire_u32(&nds->mem.late_input->buttons);
+    uint16_t ext_key = nds7_io_read16(nds,NDS7_EXTKEYIN)&~3;
+    ext_key|= !((buttons>>SE_KEY_X)&1)<<0;
+    ext_key|= !((buttons>>SE_KEY_Y)&1)<<1;
+    nds7_io_store16(nds,NDS7_EXTKEYIN,ext_key);
+  }
   //Reading ClipMTX
   else if(addr>=NDS9_CLIPMTX_RESULT&&addr<=NDS9_CLIPMTX_RESULT+0x40&&cpu==NDS_ARM9){
     int32_t clipmtx[16];
@@ -5231,7 +7037,7 @@ static bool nds_preprocess_mmio(nds_t * nds, uint32_t addr,uint32_t data, int tr
     }break;
     case NDS9_RAM_COUNT:
       if(cpu!=NDS_ARM9||(transaction_type&NDS_MEM_DEBUG))return true;
-      nds9_io_store16(nds,NDS9_RAM_COUNT+2,nds->gpu.curr_vert);
+      nds9_io_store16(nds,NDS9_RAM_COUNT+2,nds->gpu.render_queue?nds->gpu.render_queue->vert_ram.size:nds->gpu.curr_vert);
       nds9_io_store16(nds,NDS9_RAM_COUNT,nds->gpu.poly_ram_offset);
       break;
     case NDS9_POWCNT1:
@@ -5278,32 +7084,34 @@ static bool nds_preprocess_mmio(nds_t * nds, uint32_t addr,uint32_t data, int tr
       if(cpu!=NDS_ARM9)return true; 
       uint32_t cnt = nds9_io_read32(nds,NDS9_DIVCNT);
       int mode = SB_BFE(cnt,0,2);
-      int64_t numer = nds9_io_read32(nds,NDS9_DIV_NUMER+4);
-      numer<<=32ll;
-      numer|= nds9_io_read32(nds,NDS9_DIV_NUMER);
-      bool busy= true; 
-
+      // The busy flag follows from the time since the last parameter write
+      bool busy = nds->current_clock-nds->math.div_last_update_clock <= (mode==0? 18: 34); 
       int64_t denom = nds9_io_read32(nds,NDS9_DIV_DENOM+4);
       denom<<=32ll;
       denom|= nds9_io_read32(nds,NDS9_DIV_DENOM);
       bool div_zero = denom==0; 
+      cnt&=3;
+      cnt|= (busy<<15)|(div_zero<<14);
+      nds9_io_store32(nds,NDS9_DIVCNT,cnt);
+      if(busy||nds->math.div_result_valid)break;
+      nds->math.div_result_valid = true;
+      int64_t numer = nds9_io_read32(nds,NDS9_DIV_NUMER+4);
+      numer<<=32ll;
+      numer|= nds9_io_read32(nds,NDS9_DIV_NUMER);
       int64_t result = 0; 
       int64_t mod_result = 0;
       switch(mode){
         case 0:{
-          busy = nds->current_clock-nds->math.div_last_update_clock <= 18; 
           numer = (int32_t)numer;
           denom = (int32_t)denom;
           break; 
         }
         case 1: case 3:{
-          busy = nds->current_clock-nds->math.div_last_update_clock <= 34; 
           numer = (int64_t)numer;
           denom = (int32_t)denom;
           break; 
         }
         case 2: {
-          busy = nds->current_clock-nds->math.div_last_update_clock <= 34; 
           numer = (int64_t)numer;
           denom = (int64_t)denom;
           break; 
@@ -5317,35 +7125,30 @@ static bool nds_preprocess_mmio(nds_t * nds, uint32_t addr,uint32_t data, int tr
         result = (numer)/(denom);
         mod_result = (numer)%(denom);
       }
-      cnt&=3;
-      cnt|= (busy<<15)|(div_zero<<14);
-      nds9_io_store32(nds,NDS9_DIVCNT,cnt);
-      if(!busy){
-        nds9_io_store32(nds,NDS9_DIV_RESULT,SB_BFE(result,0,32));
-        nds9_io_store32(nds,NDS9_DIV_RESULT+4,SB_BFE(result,32,32));
-        nds9_io_store32(nds,NDS9_DIVREM_RESULT,SB_BFE(mod_result,0,32));
-        nds9_io_store32(nds,NDS9_DIVREM_RESULT+4,SB_BFE(mod_result,32,32));
-      }
+      nds9_io_store32(nds,NDS9_DIV_RESULT,SB_BFE(result,0,32));
+      nds9_io_store32(nds,NDS9_DIV_RESULT+4,SB_BFE(result,32,32));
+      nds9_io_store32(nds,NDS9_DIVREM_RESULT,SB_BFE(mod_result,0,32));
+      nds9_io_store32(nds,NDS9_DIVREM_RESULT+4,SB_BFE(mod_result,32,32));
     }break;
     case NDS9_SQRTCNT:case NDS9_SQRT_RESULT:case NDS9_SQRT_RESULT+4:{
       if(cpu!=NDS_ARM9)return true; 
       uint32_t cnt = nds9_io_read32(nds,NDS9_SQRTCNT);
       int mode = SB_BFE(cnt,0,1);
+      bool busy= nds->current_clock-nds->math.sqrt_last_update_clock<=13; 
+      cnt&=1;
+      cnt|= (busy<<15);
+      nds9_io_store32(nds,NDS9_SQRTCNT,cnt);
+      if(busy||nds->math.sqrt_result_valid)break;
+      nds->math.sqrt_result_valid = true;
       int64_t numer = nds9_io_read32(nds,NDS9_SQRT_PARAM+4);
       numer<<=32ll;
       numer|= nds9_io_read32(nds,NDS9_SQRT_PARAM);
-      bool busy= nds->current_clock-nds->math.sqrt_last_update_clock<=13; 
       uint64_t result = 0; 
       switch(mode){
         case 0:result = nds_sqrt_u64((uint32_t)numer);break;
         case 1:result = nds_sqrt_u64(numer);break;
       }
-      cnt&=1;
-      cnt|= (busy<<15);
-      nds9_io_store32(nds,NDS9_SQRTCNT,cnt);
-      if(!busy){
-        nds9_io_store32(nds,NDS9_SQRT_RESULT,SB_BFE(result,0,32));
-      }
+      nds9_io_store32(nds,NDS9_SQRT_RESULT,SB_BFE(result,0,32));
     }break;
     break; 
   }
@@ -5363,7 +7166,15 @@ static void nds_postprocess_mmio_write(nds_t * nds, uint32_t baddr, uint32_t dat
     nds_gxfifo_push(nds, (addr-0x4000400)/4, nds_align_data(baddr,data,transaction_type));
   }else if(addr>=0x4000400&& addr<0x4000440 &&cpu==NDS_ARM9){
       nds_gpu_write_packed_cmd(nds,mmio);
-  }else if(addr>=NDS9_VRAMCNT_A&&addr<=NDS9_VRAMCNT_I)nds_update_vram_mapping(nds);
+  }else if(addr>=NDS9_VRAMCNT_A&&addr<=NDS9_VRAMCNT_I){
+    // A deferred swap still reads the textures through the old mapping
+    nds_gpu_flush_deferred_raster(nds);
+    nds_update_vram_mapping(nds);
+    //WRAMCNT shares the word with the VRAMCNT registers
+    nds_update_tlb(nds);
+    // Banks handed to the other CPU (shared WRAM, VRAM C/D as ARM7 WRAM) must be seen in order
+    nds->cpu_sync_point = true;
+  }
 
   switch(addr){
     case NDS9_IF:  //alias case NDS7_IF:
@@ -5491,11 +7302,13 @@ static void nds_postprocess_mmio_write(nds_t * nds, uint32_t baddr, uint32_t dat
     case NDS9_DIVCNT:case NDS9_DIV_DENOM:case NDS9_DIV_DENOM+4:case NDS9_DIV_NUMER:case NDS9_DIV_NUMER+4:
       if(cpu==NDS_ARM7)break;
       nds->math.div_last_update_clock= nds->current_clock;
+      nds->math.div_result_valid = false;
       break;
 
     case NDS9_SQRTCNT:case NDS9_SQRT_PARAM:case NDS9_SQRT_PARAM+4:
       if(cpu==NDS_ARM7)break;
       nds->math.sqrt_last_update_clock= nds->current_clock;
+      nds->math.sqrt_result_valid = false;
       break;
     case NDS9_AUXSPICNT: 
       if(nds_word_mask(baddr,transaction_type)&0xff0000)nds_process_gc_spi(nds,cpu); break; 
@@ -5556,6 +7369,747 @@ static FORCE_INLINE int nds_ppu_compute_max_fast_forward(nds_t *nds){
   if(not_visible&& (scanline_clock>=1 && scanline_clock<=NDS_LCD_W*NDS_CLOCKS_PER_DOT))return NDS_LCD_W*NDS_CLOCKS_PER_DOT-scanline_clock-1; 
   return (NDS_CLOCKS_PER_DOT-1)-((nds->ppu[0].scan_clock)%NDS_CLOCKS_PER_DOT);
 }
+// Pointer to the VRAM behind address through the flat bank map, NULL when no bank or several 
+// banks are mapped at its page. page is set to the 16KB VRAM page.
+static FORCE_INLINE uint8_t* nds_vram_page_ptr(nds_t* nds, uint32_t address, int transaction_type, int* page){
+  *page = nds->mem.vram_bank_map[transaction_type&0xf][SB_BFE(address,14,10)];
+  return *page>=0? nds->mem.vram+*page*16*1024+SB_BFE(address,0,14): NULL;
+}
+// Flushes the texture cache if a VRAM page written by the hardware is also seen through a texture 
+// or texture palette slot. Pages several banks overlap at always flush it.
+static void nds_gpu_invalidate_tex_page(nds_t* nds, int page){
+  const int16_t* map = nds->mem.vram_bank_map[NDS_MEM_PPU];
+  bool hit = page==NDS_VRAM_MULTI_MAPPED;
+  for(int i=0;i<32&&!hit;++i)hit = map[SB_BFE(NDS_VRAM_TEX_SLOT0,14,10)+i]==page;
+  for(int i=0;i<8&&!hit;++i)hit = map[SB_BFE(NDS_VRAM_TEX_PAL_SLOT0,14,10)+i]==page;
+  if(hit)nds->gpu.tex_cache_generation = nds->gpu.tex_cache_generation*6364136223846793005ull+nds->current_clock+1;
+}
+// Display capture of one line. Source A is the engine A output or the 3D layer, source B a VRAM 
+// bank (the one DISPCNT displays in VRAM mode) or the main memory display FIFO. The line is 
+// blended as a whole and written straight into the target bank through the flat bank map.
+static void nds_ppu_capture_line(nds_t* nds, int lcd_y, const uint16_t* graphics){
+  uint32_t dispcapcnt = nds9_io_read32(nds,NDS_DISPCAPCNT);
+  int size = SB_BFE(dispcapcnt,20,2);
+  int width = size? 256: 128;
+  int height = size? size*64: 128;
+  if(lcd_y>=height)return;
+  int capture_mode = SB_BFE(dispcapcnt,29,2);//(0=Source A, 1=Source B, 2/3=Sources A+B blended)
+  int eva = SB_BFE(dispcapcnt,0,5), evb = SB_BFE(dispcapcnt,8,5);
+  if(eva>16)eva=16;
+  if(evb>16)evb=16;
+  if(capture_mode==0){eva=16;evb=0;}
+  else if(capture_mode==1){eva=0;evb=16;}
+
+  uint16_t a[NDS_LCD_W], b[NDS_LCD_W];
+  if(!SB_BFE(dispcapcnt,24,1)){
+    for(int x=0;x<width;++x)a[x]=graphics[x]|0x8000;
+  }else{
+    const uint8_t* src = nds->framebuffer_3d_disp+lcd_y*NDS_LCD_W*4;
+    for(int x=0;x<width;++x){
+      a[x] = SB_BFE(src[x*4+0],3,5)|(SB_BFE(src[x*4+1],3,5)<<5)|(SB_BFE(src[x*4+2],3,5)<<10)|((src[x*4+3]!=0)<<15);
+    }
+  }
+  if(capture_mode==0||SB_BFE(dispcapcnt,25,1)){
+    //TODO: Main memory display FIFO
+    memset(b,0,sizeof(b));
+  }else{
+    uint32_t read_block = SB_BFE(nds9_io_read32(nds,GBA_DISPCNT),18,2);
+    uint32_t read_address = 0x06800000+read_block*0x20000+((SB_BFE(dispcapcnt,26,2)*0x8000+lcd_y*width*2)&0x1ffff);
+    int page;
+    const uint8_t* src = nds_vram_page_ptr(nds,read_address,NDS_MEM_PPU,&page);
+    if(src)memcpy(b,src,width*2);
+    else for(int x=0;x<width;++x)b[x]=nds_ppu_read16(nds,read_address+x*2);
+  }
+  // Branch free so the compiler can vectorize it, each channel sum is at most 62
+  uint16_t out[NDS_LCD_W];
+  for(int x=0;x<width;++x){
+    uint32_t ca = a[x], cb = b[x];
+    uint32_t c = 0;
+    for(int ch=0;ch<3;++ch){
+      uint32_t v = (SB_BFE(ca,ch*5,5)*eva+SB_BFE(cb,ch*5,5)*evb)>>4;
+      c|= (v>31? 31: v)<<(ch*5);
+    }
+    bool alpha = (SB_BFE(ca,15,1)&&eva)||(SB_BFE(cb,15,1)&&evb);
+    out[x] = c|(alpha<<15);
+  }
+  uint32_t write_address = 0x06800000+SB_BFE(dispcapcnt,16,2)*0x20000+((SB_BFE(dispcapcnt,18,2)*0x8000+lcd_y*width*2)&0x1ffff);
+  int page;
+  uint8_t* dst = nds_vram_page_ptr(nds,write_address,NDS_MEM_ARM9|NDS_MEM_WRITE,&page);
+  if(page==NDS_VRAM_UNMAPPED)return;
+  if(dst)memcpy(dst,out,width*2);
+  else for(int x=0;x<width;++x)nds9_write16(nds,write_address+x*2,out[x]);
+  nds_gpu_invalidate_tex_page(nds,page);
+}
+#define NDS_BG_TEXT 0
+#define NDS_BG_AFFINE 1
+#define NDS_BG_BITMAP 2
+#define NDS_BG_LARGE_BITMAP 3
+#define NDS_BG_INVALID 4
+
+static const int nds_bg_mode_table[8*4]={
+  /* mode 0: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,
+  /* mode 1: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_AFFINE,
+  /* mode 2: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_AFFINE,NDS_BG_AFFINE,
+  /* mode 3: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_BITMAP,
+  /* mode 4: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_AFFINE,NDS_BG_BITMAP,
+  /* mode 5: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_BITMAP,NDS_BG_BITMAP,
+  /* mode 6: */NDS_BG_TEXT,NDS_BG_INVALID,NDS_BG_LARGE_BITMAP,NDS_BG_INVALID,
+  /* mode 7: */NDS_BG_INVALID,NDS_BG_INVALID,NDS_BG_INVALID,NDS_BG_INVALID,
+};
+static const int nds_bg_size_table[4*4*2]={
+  /* TEXT: */        
+  256,256,
+  512,256,
+  256,512,
+  512,512,
+  /* AFFINE: */ 
+  128,128,
+  256,256,
+  512,512,
+  1024,1024,
+  /* BITMAP: */ 
+  128,128,
+  256,256,
+  512,256,
+  512,512,
+  /* LARGE BITMAP: */
+  512,1024,
+  1024,512,
+  0,0, //INVALID
+  0,0, //INVALID
+};
+#define NDS_AFFINE_CHUNK 16
+// Marks the opaque texels of an affine line, so the transparent ones can be 0
+#define NDS_AFFINE_OPAQUE (1u<<31)
+// Renders the texels of a rotation/scaling, extended (16 bit map) or bitmap BG over pixels 
+// [x_start,x_end) of the line into out, 0 where transparent. Each chunk of pixels first gets its 
+// texel coordinates and VRAM addresses in branch free loops the compiler vectorizes, then the 
+// map entries and colors are gathered.
+static void nds_ppu_affine_line(nds_t* nds, int ppu_id, int bg, int bg_type, int x_start, int x_end, uint32_t* out){
+  nds_ppu_t* ppu = nds->ppu+ppu_id;
+  int reg_offset = ppu_id==0? 0: 0x00001000;
+  uint32_t dispcnt = nds9_io_read32(nds,GBA_DISPCNT+reg_offset);
+  uint16_t bgcnt = nds9_io_read16(nds,GBA_BG0CNT+bg*2+reg_offset);
+  bool mosaic = SB_BFE(bgcnt,6,1);
+  int screen_base = SB_BFE(bgcnt,8,5);
+  bool display_overflow = SB_BFE(bgcnt,13,1);
+  int screen_size = SB_BFE(bgcnt,14,2);
+  bool large = bg_type==NDS_BG_BITMAP||bg_type==NDS_BG_LARGE_BITMAP;
+  bool bitmap_mode = SB_BFE(bgcnt,7,1)&&large;
+  bool extended_bgmap = !SB_BFE(bgcnt,7,1)&&large;
+  bool direct_color = bitmap_mode&&SB_BFE(bgcnt,2,1);
+  //NDS can have an affine "bitmap" that is really a large affine tile map
+  uint32_t bg_type_for_size = (bg_type==NDS_BG_BITMAP&&!bitmap_mode)? NDS_BG_AFFINE: bg_type;
+  int32_t size_x = nds_bg_size_table[(bg_type_for_size*4+screen_size)*2+0];
+  int32_t size_y = nds_bg_size_table[(bg_type_for_size*4+screen_size)*2+1];
+
+  uint32_t bg_base = ppu_id? 0x06200000:0x06000000;
+  uint32_t screen_base_addr = screen_base*2*1024;
+  uint32_t character_base_addr = SB_BFE(bgcnt,2,4)*16*1024;
+  if(bitmap_mode)screen_base_addr = screen_base*16*1024;
+  else if(ppu_id==0){
+    //engine A screen base: BGxCNT.bits*2K + DISPCNT.bits*64K
+    //engine A char base: BGxCNT.bits*16K + DISPCNT.bits*64K
+    character_base_addr+=SB_BFE(dispcnt,24,3)*64*1024;
+    screen_base_addr+=SB_BFE(dispcnt,27,3)*64*1024;
+  }
+  // Extended palettes only apply to the 16 bit maps
+  bool use_ext_palettes = SB_BFE(dispcnt,30,1)&&extended_bgmap;
+  uint32_t ext_palette_base = (ppu_id?NDS_VRAM_BGB_SLOT0:NDS_VRAM_BGA_SLOT0)+0x2000*bg;
+  const uint16_t* palette = (const uint16_t*)(nds->mem.palette+(ppu_id?0x400:0));
+
+  int32_t bgx = ppu->aff[bg-2].internal_bgx;
+  int32_t bgy = ppu->aff[bg-2].internal_bgy;
+  int32_t a = (int16_t)nds9_io_read16(nds,GBA_BG2PA+(bg-2)*0x10+reg_offset);
+  int32_t c = (int16_t)nds9_io_read16(nds,GBA_BG2PC+(bg-2)*0x10+reg_offset);
+  int32_t mos_x = mosaic? SB_BFE(nds9_io_read16(nds,GBA_MOSAIC+reg_offset),0,4)+1: 1;
+
+  for(int x0=x_start;x0<x_end;x0+=NDS_AFFINE_CHUNK){
+    int32_t tx[NDS_AFFINE_CHUNK], ty[NDS_AFFINE_CHUNK];
+    uint32_t addr[NDS_AFFINE_CHUNK];
+    uint8_t inside[NDS_AFFINE_CHUNK];
+    for(int i=0;i<NDS_AFFINE_CHUNK;++i){
+      int32_t x = ((x0+i)/mos_x)*mos_x;
+      tx[i] = (a*x+bgx)>>8;
+      ty[i] = (c*x+bgy)>>8;
+    }
+    // All the sizes are powers of two
+    if(display_overflow){
+      for(int i=0;i<NDS_AFFINE_CHUNK;++i){tx[i]&=size_x-1;ty[i]&=size_y-1;}
+    }
+    for(int i=0;i<NDS_AFFINE_CHUNK;++i){
+      inside[i] = (uint32_t)tx[i]<(uint32_t)size_x&&(uint32_t)ty[i]<(uint32_t)size_y;
+      uint32_t x = inside[i]? tx[i]: 0, y = inside[i]? ty[i]: 0;
+      // Bitmaps address the pixel, tile maps the map entry
+      uint32_t entry = bitmap_mode? x+y*size_x: (y/8)*(size_x/8)+x/8;
+      addr[i] = bg_base+screen_base_addr+entry*(direct_color||extended_bgmap? 2: 1);
+    }
+    int n = x_end-x0<NDS_AFFINE_CHUNK? x_end-x0: NDS_AFFINE_CHUNK;
+    for(int i=0;i<n;++i){
+      uint32_t col = 0;
+      if(!inside[i]){
+      }else if(direct_color){
+        col = nds_ppu_read16(nds,addr[i]);
+        col = SB_BFE(col,15,1)? col|NDS_AFFINE_OPAQUE: 0;
+      }else if(bitmap_mode){
+        uint8_t palette_id = nds_ppu_read8(nds,addr[i]);
+        if(palette_id)col = palette[palette_id]|NDS_AFFINE_OPAQUE;
+      }else{
+        int px = tx[i]&7, py = ty[i]&7;
+        uint16_t tile_data;
+        if(extended_bgmap){
+          tile_data = nds_ppu_read16(nds,addr[i]);
+          if(SB_BFE(tile_data,10,1))px=7-px;
+          if(SB_BFE(tile_data,11,1))py=7-py;
+        }else tile_data = nds_ppu_read8(nds,addr[i]);
+        uint8_t tile_d = nds_ppu_read8(nds,bg_base+character_base_addr+SB_BFE(tile_data,0,10)*8*8+px+py*8);
+        if(tile_d){
+          if(use_ext_palettes)col = nds_ppu_read16(nds,ext_palette_base+(SB_BFE(tile_data,12,4)*256+tile_d)*2);
+          else col = palette[tile_d];
+          col|=NDS_AFFINE_OPAQUE;
+        }
+      }
+      out[x0+i] = col;
+    }
+  }
+}
+// VRAM display mode shows a bank as it is, without any of the layers. Lines of it that aren't 
+// captured and have no master brightness are converted straight from VRAM.
+// Returns false if the line needs the general path.
+static bool nds_ppu_render_vram_line(nds_t* nds, int ppu_id, int lcd_y){
+  if(ppu_id!=0)return false;
+  uint32_t dispcnt = nds9_io_read32(nds,GBA_DISPCNT);
+  if(SB_BFE(dispcnt,16,2)!=2)return false;
+  if(SB_BFE(nds9_io_read16(nds,NDS_A_MASTER_BRIGHT),14,2))return false;
+  const uint16_t* src = (const uint16_t*)nds->mem.vram+lcd_y*NDS_LCD_W+SB_BFE(dispcnt,18,2)*64*1024;
+  uint8_t *framebuffer = (ppu_id==0)^nds->display_flip?nds->framebuffer_bottom: nds->framebuffer_top;
+  uint8_t* fb = framebuffer+lcd_y*NDS_LCD_W*4;
+  // Branch free so the compiler can vectorize it
+  for(int x=0;x<NDS_LCD_W;++x){
+    uint16_t c = src[x];
+    fb[x*4+0] = SB_BFE(c,0,5)*7;
+    fb[x*4+1] = SB_BFE(c,5,5)*7;
+    fb[x*4+2] = SB_BFE(c,10,5)*7;
+    fb[x*4+3] = 0;
+  }
+  nds_ppu_t* ppu = nds->ppu+ppu_id;
+  int backdrop_type = 5;
+  uint32_t backdrop_col = (*(uint16_t*)(nds->mem.palette + GBA_BG_PALETTE+0*2+ppu_id*1024))|(backdrop_type<<17);
+  for(int x=0;x<NDS_LCD_W;++x)ppu->first_target_buffer[x]=ppu->second_target_buffer[x]=backdrop_col;
+  return true;
+}
+static void nds_ppu_render(nds_t* nds, int ppu_id, int lcd_x, int lcd_y, bool render){
+  nds_ppu_t * ppu = nds->ppu+ppu_id;
+  uint32_t dispcapcnt = nds9_io_read32(nds,NDS_DISPCAPCNT);
+  int reg_offset = ppu_id==0? 0: 0x00001000;
+  uint32_t dispcnt = nds9_io_read32(nds, GBA_DISPCNT+reg_offset);
+  int display_mode = SB_BFE(dispcnt,16,2);
+  bool enable_capture = SB_BFE(dispcapcnt,31,1)&&ppu_id==0;
+  int forced_blank = SB_BFE(dispcnt,7,1);
+  render&= !forced_blank;
+  if(!render&&!enable_capture)return;
+  if(NDS_SCANLINE_PPU&&lcd_x==0&&lcd_y<NDS_LCD_H&&!enable_capture&&nds_ppu_render_vram_line(nds,ppu_id,lcd_y))return;
+  
+  bool enable_3d = ppu_id==0&&SB_BFE(dispcnt,3,1);
+  // The frontend draws the 3D layer of the frame, see nds_gpu_hires_t. Captures flush the 
+  // rasterization of the core and composite it as usual.
+  const nds_gpu_hires_t* hires = nds->gpu.hires;
+  bool gpu_3d = enable_3d&&display_mode==1&&!enable_capture&&hires&&hires->enabled&&hires->on_gpu;
+  int bg_mode = SB_BFE(dispcnt,0,3);
+  bool visible = lcd_x<NDS_LCD_W && lcd_y<NDS_LCD_H;
+  //Render sprites over scanline when it completes
+  if(lcd_y<NDS_LCD_H && lcd_x == 0){
+    int obj_vram_map_2d = !SB_BFE(dispcnt,6,1);
+    //Render sprites over scanline when it completes
+    uint8_t default_window_control =0x3f;//bitfield [0-3:bg0-bg3 enable 4:obj enable, 5: special effect enable]
+    bool winout_enable = SB_BFE(dispcnt,13,3)!=0;
+    uint16_t WINOUT = nds9_io_read16(nds, GBA_WINOUT+reg_offset);
+    if(winout_enable)default_window_control = SB_BFE(WINOUT,0,6);
+    int enabled_windows = SB_BFE(dispcnt,13,3); // [0: win0, 1:win1, 2: objwin]
+    uint8_t win_value[2]={0,0};
+    int win_xmin[2]={0,0}, win_xmax[2]={0,0};
+    int active_windows = 0;
+    for(int win=0;win<2;++win){
+      if(!SB_BFE(enabled_windows,win,1))continue;
+      uint16_t WINH = nds9_io_read16(nds, GBA_WIN0H+2*win+reg_offset);
+      uint16_t WINV = nds9_io_read16(nds, GBA_WIN0V+2*win+reg_offset);
+      win_xmin[win] = SB_BFE(WINH,8,8);
+      win_xmax[win] = SB_BFE(WINH,0,8);
+      int win_ymin = SB_BFE(WINV,8,8);
+      int win_ymax = SB_BFE(WINV,0,8);
+      // Garbage values of X2>240 or X1>X2 are interpreted as X2=240.
+      // Garbage values of Y2>160 or Y1>Y2 are interpreted as Y2=160. 
+      if(win_xmin[win]>win_xmax[win])win_xmax[win]=NDS_LCD_W;
+      if(win_ymin>win_ymax)win_ymax=NDS_LCD_H+1;
+      if(win_xmax[win]>NDS_LCD_W)win_xmax[win]=NDS_LCD_W;
+      if(lcd_y<win_ymin||lcd_y>=win_ymax)continue;
+      win_value[win] = SB_BFE(nds9_io_read16(nds,GBA_WININ+reg_offset),win*8,6);
+      active_windows|=1<<win;
+    }
+    sb_window_spans_t* spans = &ppu->window_spans;
+    sb_update_window_spans(spans,ppu->window,NDS_LCD_W,default_window_control,win_value,win_xmin,win_xmax,active_windows);
+
+    bool display_obj = SB_BFE(dispcnt,12,1);
+    uint8_t obj_window_control = default_window_control;
+    bool obj_window_enable = SB_BFE(dispcnt,15,1);
+    if(obj_window_enable)obj_window_control = SB_BFE(WINOUT,8,6);
+    if(display_obj){
+      int oam_offset = ppu_id*1024;
+      int obj_vram_base = ppu_id ==0? 0x06400000: 0x06600000;
+      // Only walk the objects binned to this line when bins are available
+      int obj_count = 128;
+      const uint8_t* obj_list = NULL;
+      if(nds->mem.sprite_bins){
+        sb_sprite_bins_t* bins = nds->mem.sprite_bins+ppu_id;
+        sb_update_sprite_bins(bins,nds->mem.oam+oam_offset);
+        obj_count = bins->count[lcd_y&0xff];
+        obj_list = bins->objs[lcd_y&0xff];
+      }
+      for(int obj_index=0;obj_index<obj_count;++obj_index){
+        int o = obj_list? obj_list[obj_index]: obj_index;
+        uint16_t attr0 = *(uint16_t*)(nds->mem.oam+o*8+0+oam_offset);
+        //Attr0
+        uint8_t y_coord = SB_BFE(attr0,0,8);
+        bool rot_scale =  SB_BFE(attr0,8,1);
+        bool double_size = SB_BFE(attr0,9,1)&&rot_scale;
+        bool obj_disable = SB_BFE(attr0,9,1)&&!rot_scale;
+        if(obj_disable) continue; 
+
+        int obj_mode = SB_BFE(attr0,10,2); //(0=Normal, 1=Semi-Transparent, 2=OBJ Window, 3=bitmap)
+        bool mosaic  = SB_BFE(attr0,12,1);
+        bool colors_or_palettes = SB_BFE(attr0,13,1);
+        int obj_shape = SB_BFE(attr0,14,2);//(0=Square,1=Horizontal,2=Vertical,3=Prohibited)
+        uint16_t attr1 = *(uint16_t*)(nds->mem.oam+o*8+2+oam_offset);
+
+        int rotscale_param = SB_BFE(attr1,9,5);
+        bool h_flip = SB_BFE(attr1,12,1)&&!rot_scale;
+        bool v_flip = SB_BFE(attr1,13,1)&&!rot_scale;
+        int obj_size = SB_BFE(attr1,14,2);
+        // Size  Square   Horizontal  Vertical
+        // 0     8x8      16x8        8x16
+        // 1     16x16    32x8        8x32
+        // 2     32x32    32x16       16x32
+        // 3     64x64    64x32       32x64
+        const int xsize_lookup[16]={
+          8,16,8,0,
+          16,32,8,0,
+          32,32,16,0,
+          64,64,32,0
+        };
+        const int ysize_lookup[16]={
+          8,8,16,0,
+          16,8,32,0,
+          32,16,32,0,
+          64,32,64,0
+        }; 
+
+        int y_size = ysize_lookup[obj_size*4+obj_shape];
+
+        if(((lcd_y-y_coord)&0xff) <y_size*(double_size?2:1)){
+
+          int16_t x_coord = SB_BFE(attr1,0,9);
+          if (SB_BFE(x_coord,8,1))x_coord|=0xfe00;
+
+          int x_size = xsize_lookup[obj_size*4+obj_shape];
+          int x_start = x_coord>=0?x_coord:0;
+          int x_end   = x_coord+x_size*(double_size?2:1);
+          if(x_end>=NDS_LCD_W)x_end=NDS_LCD_W;
+          //Attr2
+          //Skip objects disabled by window
+          uint16_t attr2 = *(uint16_t*)(nds->mem.oam+o*8+4 +oam_offset);
+          int tile_base = SB_BFE(attr2,0,10);
+          // Always place sprites as the highest priority
+          int priority = SB_BFE(attr2,10,2);
+          int palette = SB_BFE(attr2,12,4);
+          for(int x = x_start; x< x_end;++x){
+            int sx = (x-x_coord);
+            int sy = (lcd_y-y_coord)&0xff;
+            if(mosaic){
+              uint16_t mos_reg = nds9_io_read16(nds,GBA_MOSAIC+reg_offset);
+              int mos_x = SB_BFE(mos_reg,8,4)+1;
+              int mos_y = SB_BFE(mos_reg,12,4)+1;
+              sx = ((x/mos_x)*mos_x-x_coord);
+              sy = (((lcd_y/mos_y)*mos_y-y_coord)&0xff);
+            }
+            if(rot_scale){
+              uint32_t param_base = rotscale_param*0x20+oam_offset; 
+              int32_t a = *(int16_t*)(nds->mem.oam+param_base+0x6);
+              int32_t b = *(int16_t*)(nds->mem.oam+param_base+0xe);
+              int32_t c = *(int16_t*)(nds->mem.oam+param_base+0x16);
+              int32_t d = *(int16_t*)(nds->mem.oam+param_base+0x1e);
+
+              int64_t x1 = sx<<8;
+              int64_t y1 = sy<<8;
+              int64_t objref_x = (x_size<<(double_size?8:7));
+              int64_t objref_y = (y_size<<(double_size?8:7));
+            
+              int64_t x2 = a*(x1-objref_x) + b*(y1-objref_y)+(x_size<<15);
+              int64_t y2 = c*(x1-objref_x) + d*(y1-objref_y)+(y_size<<15);
+
+              sx = (x2>>16);
+              sy = (y2>>16);
+              if(sx>=x_size||sy>=y_size||sx<0||sy<0)continue;
+            }else{
+              if(h_flip)sx=x_size-sx-1;
+              if(v_flip)sy=y_size-sy-1;
+            }
+            uint32_t col =0;
+            if(obj_mode==3){
+
+              bool linear = SB_BFE(dispcnt,6,1);
+              //TODO: Bitmap sprites
+              if(linear){
+                int boundry = SB_BFE(dispcnt,22,1);
+                tile_base *= boundry? 256: 128;
+                int p = sx+sy*x_size;
+                col = nds_ppu_read16(nds,obj_vram_base+tile_base+p*2);
+              }else{
+                bool size = SB_BFE(dispcnt,5,1);
+                int p = 0;             
+                if(size){
+                  int tile_x=SB_BFE(tile_base,0,5);
+                  int tile_y=SB_BFE(tile_base,5,5);
+                  p = (tile_x*8+sx)+(tile_y*8+sy)*32*8;
+                }else{
+                  int tile_x=SB_BFE(tile_base,0,4);
+                  int tile_y=SB_BFE(tile_base,4,6);
+                  p = (tile_x*8+sx)+(tile_y*8+sy)*16*8;
+                }
+                col = nds_ppu_read16(nds,obj_vram_base+p*2);
+                if(!SB_BFE(col,15,1))continue;
+              }
+            }else{
+              int tx = sx%8;
+              int ty = sy%8;
+              bool tile_obj_mapping = SB_BFE(dispcnt,4,1);
+                      
+              int y_tile_stride = obj_vram_map_2d? 32 : x_size/8*(colors_or_palettes? 2:1);
+
+              int tile_boundry = 32;
+              if(tile_obj_mapping ==true){
+                int tile_obj_1d_boundry = SB_BFE(dispcnt,20,2);
+                tile_boundry = 32<<tile_obj_1d_boundry;
+                y_tile_stride=x_size/8*(colors_or_palettes? 2:1);
+              }
+              int tile = tile_base*tile_boundry/32 + (((sx/8))*(colors_or_palettes? 2:1)+(sy/8)*y_tile_stride);
+              //tile*=tile_boundry/32;
+              uint16_t palette_id;
+              bool use_obj_ext_palettes = SB_BFE(dispcnt,31,1);
+              if(colors_or_palettes==false){
+                palette_id= nds_ppu_read8(nds,obj_vram_base+tile*32+tx/2+ty*4);
+                palette_id= (palette_id>>((tx&1)*4))&0xf;
+                if(palette_id==0)continue;
+                palette_id+=palette*16;
+                use_obj_ext_palettes=false; //Not supported in 16 color mode
+              }else{
+                palette_id=nds_ppu_read8(nds,obj_vram_base+tile*32+tx+ty*8);
+                if(palette_id==0)continue;
+              }
+              if(use_obj_ext_palettes){
+                palette_id=(palette)*256+palette_id;
+                uint32_t read_addr = (ppu_id?NDS_VRAM_OBJB_SLOT0:NDS_VRAM_OBJA_SLOT0)+palette_id*2;
+                col = nds_ppu_read16(nds, read_addr);
+              }else{
+                uint32_t pallete_offset = ppu_id?0x600:0x200; 
+                col = *(uint16_t*)(nds->mem.palette+pallete_offset+palette_id*2);
+              }
+            }
+
+            //Handle window objects(not displayed but control the windowing of other things)
+            if(obj_mode==2){if(ppu->window[x]&SB_WINDOW_OUTSIDE)ppu->window[x]=obj_window_control; 
+            }else{
+              int type =4;
+              col=col|(type<<17)|((5-priority)<<28)|((0x7)<<25);
+              if(obj_mode==1)col|=1<<16;
+              if((col>>17)>(ppu->first_target_buffer[x]>>17))ppu->first_target_buffer[x]=col;
+            }  
+          }
+        }
+      }
+    }
+    // The OBJ window can only change pixels outside of WIN0/WIN1
+    if(display_obj&&(spans->line_any&SB_WINDOW_OUTSIDE)){
+      spans->line_any|=obj_window_control;
+      spans->line_all&=obj_window_control;
+    }
+    if(enabled_windows&&!SB_BFE(spans->line_all,4,1)){
+      int backdrop_type = 5;
+      uint32_t backdrop_col = (*(uint16_t*)(nds->mem.palette + GBA_BG_PALETTE+0*2+ppu_id*1024))|(backdrop_type<<17);
+      for(int x=0;x<NDS_LCD_W;++x){
+        uint8_t window_control = ppu->window[x];
+        if(SB_BFE(window_control,4,1)==0)ppu->first_target_buffer[x]=backdrop_col;  
+      }
+    }
+  }
+  uint16_t capture_line[NDS_LCD_W];
+  uint32_t affine_line[2][NDS_LCD_W];
+  if(visible){
+    for(int bg=2;bg<4;++bg){
+      int bg_type = nds_bg_mode_table[bg_mode*4+bg];
+      bool bg_en = SB_BFE(dispcnt,8+bg,1)&&SB_BFE(ppu->dispcnt_pipeline[0],8+bg,1);
+      // Skip BGs the windows hide over the whole line
+      bg_en&= SB_BFE(ppu->window_spans.line_any,bg,1);
+      if(bg_en&&bg_type!=NDS_BG_TEXT&&bg_type!=NDS_BG_INVALID){
+        nds_ppu_affine_line(nds,ppu_id,bg,bg_type,lcd_x,NDS_SCANLINE_PPU? NDS_LCD_W: lcd_x+1,affine_line[bg-2]);
+      }
+    }
+    #if NDS_SCANLINE_PPU == 1
+    if(lcd_x==0){while(lcd_x<NDS_LCD_W){
+    #endif
+    uint8_t window_control =ppu->window[lcd_x];
+    bool render_backgrounds = true; //TODO hook up power management
+    if(render_backgrounds){
+      for(int bg = 3; bg>=0;--bg){
+        int bg_type = nds_bg_mode_table[bg_mode*4+bg];
+        uint32_t col =0;         
+        bool bg_en = SB_BFE(dispcnt,8+bg,1)&&SB_BFE(ppu->dispcnt_pipeline[0],8+bg,1)&&bg_type!=NDS_BG_INVALID;
+        if(!bg_en || SB_BFE(window_control,bg,1)==0)continue;
+        uint16_t bgcnt = nds9_io_read16(nds, GBA_BG0CNT+bg*2+reg_offset);
+        int priority = SB_BFE(bgcnt,0,2);
+        if(SB_UNLIKELY(enable_3d&&bg==0)){
+          int p = lcd_x+lcd_y*NDS_LCD_W;
+          if(SB_BFE(nds->framebuffer_3d_disp[p*4+3],3,5)==0&&!gpu_3d)continue;
+          col  = SB_BFE(nds->framebuffer_3d_disp[p*4+0],3,5);
+          col |= SB_BFE(nds->framebuffer_3d_disp[p*4+1],3,5)<<5;
+          col |= SB_BFE(nds->framebuffer_3d_disp[p*4+2],3,5)<<10;
+          // Treat 3d as semitransparent (needed for Soul Silver particle effects)
+          col|=1<<16;
+        }else if(bg_type!=NDS_BG_TEXT){
+          col = affine_line[bg-2][lcd_x];
+          if(!col)continue;
+          col&=~NDS_AFFINE_OPAQUE;
+        }else{
+          int character_base = SB_BFE(bgcnt,2,4);
+          bool mosaic = SB_BFE(bgcnt,6,1);
+          bool colors = SB_BFE(bgcnt,7,1);
+          int screen_base = SB_BFE(bgcnt,8,5);
+          int screen_size = SB_BFE(bgcnt,14,2); 
+          int screen_size_x = nds_bg_size_table[screen_size*2+0];
+          int screen_size_y = nds_bg_size_table[screen_size*2+1];
+
+          uint32_t pallete_offset = ppu_id?0x400:0; 
+          bool use_ext_palettes = SB_BFE(dispcnt,30,1);
+          int16_t hoff = SB_BFE(nds9_io_read16(nds,GBA_BG0HOFS+bg*4+reg_offset),0,9);
+          int16_t voff = SB_BFE(nds9_io_read16(nds,GBA_BG0VOFS+bg*4+reg_offset),0,9);
+          hoff=(hoff<<7)>>7;
+          voff=(voff<<7)>>7;
+          int bg_x = (hoff+lcd_x);
+          int bg_y = (voff+lcd_y);
+          if(mosaic){
+            uint16_t mos_reg = nds9_io_read16(nds,GBA_MOSAIC+reg_offset);
+            int mos_x = SB_BFE(mos_reg,0,4)+1;
+            int mos_y = SB_BFE(mos_reg,4,4)+1;
+            bg_x = hoff+(lcd_x/mos_x)*mos_x;
+            bg_y = voff+(lcd_y/mos_y)*mos_y;
+          }
+          int screen_base_addr    = screen_base*2*1024;
+          int character_base_addr = character_base*16*1024;
+          int32_t bg_base = ppu_id? 0x06200000:0x06000000;
+          bg_x = bg_x&(screen_size_x-1);
+          bg_y = bg_y&(screen_size_y-1);
+          int bg_tile_x = bg_x/8;
+          int bg_tile_y = bg_y/8;
+
+          //engine A screen base: BGxCNT.bits*2K + DISPCNT.bits*64K
+          //engine A char base: BGxCNT.bits*16K + DISPCNT.bits*64K
+          if(ppu_id==0){
+            character_base_addr+=SB_BFE(dispcnt,24,3)*64*1024;
+            screen_base_addr+=SB_BFE(dispcnt,27,3)*64*1024;
+          }
+          int px = bg_x%8;
+          int py = bg_y%8;
+
+          int tile_off = (bg_tile_y%32)*32+(bg_tile_x%32);
+          if(bg_tile_x>=32)tile_off+=32*32;
+          if(bg_tile_y>=32)tile_off+=32*32*(screen_size==3?2:1);
+          uint16_t tile_data=nds_ppu_read16(nds,bg_base+screen_base_addr+tile_off*2);
+          int h_flip = SB_BFE(tile_data,10,1);
+          int v_flip = SB_BFE(tile_data,11,1);
+          if(h_flip)px=7-px;
+          if(v_flip)py=7-py;
+          int tile_id = SB_BFE(tile_data,0,10);
+          int palette = SB_BFE(tile_data,12,4);
+
+          uint8_t tile_d=tile_id;
+          if(colors==false){
+            tile_d=nds_ppu_read8(nds,bg_base+character_base_addr+tile_id*8*4+px/2+py*4);
+            tile_d= (tile_d>>((px&1)*4))&0xf;
+            if(tile_d==0)continue;
+            tile_d+=palette*16;
+            use_ext_palettes=false;
+          }else{
+            tile_d=nds_ppu_read8(nds,bg_base+character_base_addr+tile_id*8*8+px+py*8);
+            if(tile_d==0)continue;
+          }
+          uint32_t palette_id = tile_d;
+          if(use_ext_palettes){
+            palette_id=(palette)*256+tile_d;
+            int ext_palette_slot = bg;
+            if(bg<2)ext_palette_slot+=SB_BFE(bgcnt,13,1)*2;
+            uint32_t read_addr = (ppu_id?NDS_VRAM_BGB_SLOT0:NDS_VRAM_BGA_SLOT0)+palette_id*2+0x2000*(ext_palette_slot);
+            col = nds_ppu_read16(nds, read_addr);
+          }else col = *(uint16_t*)(nds->mem.palette+pallete_offset+palette_id*2);
+        }
+        col |= (bg<<17) | ((5-priority)<<28)|((4-bg)<<25);
+        if(col>ppu->first_target_buffer[lcd_x]){
+          uint32_t t = ppu->first_target_buffer[lcd_x];
+          ppu->first_target_buffer[lcd_x]=col;
+          col = t;
+        }
+        if(col>ppu->second_target_buffer[lcd_x])ppu->second_target_buffer[lcd_x]=col;          
+      }
+    }
+    uint32_t col = ppu->first_target_buffer[lcd_x];
+    int r = SB_BFE(col,0,5);
+    int g = SB_BFE(col,5,5);
+    int b = SB_BFE(col,10,5);
+    uint32_t type = SB_BFE(col,17,3);
+
+    bool effect_enable = SB_BFE(window_control,5,1);
+    uint16_t bldcnt = nds9_io_read16(nds,GBA_BLDCNT+reg_offset);
+    int mode = SB_BFE(bldcnt,6,2);
+
+    //Semitransparent objects are always selected for blending
+    if(SB_BFE(col,16,1)){
+      uint32_t col2 = ppu->second_target_buffer[lcd_x];
+      uint32_t type2 = SB_BFE(col2,17,3);
+      bool blend = SB_BFE(bldcnt,8+type2,1);
+      if(blend){mode=1;effect_enable=true;}
+      else effect_enable &= SB_BFE(bldcnt,type,1);
+    }else effect_enable &= SB_BFE(bldcnt,type,1);
+    // The frontend blends the 3D pixel over the layer below with the effect it is given
+    uint8_t hires_mark = 0;
+    if(SB_UNLIKELY(gpu_3d)&&type==0){
+      uint32_t col2 = ppu->second_target_buffer[lcd_x];
+      r = SB_BFE(col2,0,5);
+      g = SB_BFE(col2,5,5);
+      b = SB_BFE(col2,10,5);
+      hires_mark = NDS_HIRES_3D_TOP;
+      if(effect_enable&&mode==1&&SB_BFE(bldcnt,8+SB_BFE(col2,17,3),1))hires_mark|=NDS_HIRES_3D_BLEND;
+      else if(effect_enable&&mode>=2){
+        int evy = SB_BFE(nds9_io_read16(nds,GBA_BLDY+reg_offset),0,5);
+        hires_mark|=(evy>16? 16: evy)|(mode==3? NDS_HIRES_DARKEN: 0);
+      }
+      effect_enable = false;
+    }
+    if(effect_enable){
+      uint16_t bldy = nds9_io_read16(nds,GBA_BLDY+reg_offset);
+      float evy = SB_BFE(bldy,0,5)/16.;
+      if(evy>1.0)evy=1;
+      switch(mode){
+        case 0: break; //None
+        case 1: {
+          uint32_t col2 = ppu->second_target_buffer[lcd_x];
+          uint32_t type2 = SB_BFE(col2,17,3);
+          // The color of a GPU drawn 3D layer below isn't known, the layer on top stays unblended
+          bool blend = SB_BFE(bldcnt,8+type2,1)&&!(gpu_3d&&type2==0);
+          if(blend){
+            uint16_t bldalpha= nds9_io_read16(nds,GBA_BLDALPHA+reg_offset);
+            //3d engines alpha blend based on the 3d alpha
+            
+            int r2 = SB_BFE(col2,0,5);
+            int g2 = SB_BFE(col2,5,5);
+            int b2 = SB_BFE(col2,10,5);
+            int eva = SB_BFE(bldalpha,0,5);
+            int evb = SB_BFE(bldalpha,8,5);
+            if(enable_3d&&type==0){
+              eva = nds->framebuffer_3d_disp[(lcd_x+lcd_y*NDS_LCD_W)*4+3]/16;
+              if(eva==15)eva=16;
+              evb = 16-eva;
+            }
+            if(eva>16)eva=16;
+            if(evb>16)evb=16;
+            r = (r*eva+r2*evb)/16;
+            g = (g*eva+g2*evb)/16;
+            b = (b*eva+b2*evb)/16;
+            if(r>31)r = 31;
+            if(g>31)g = 31;
+            if(b>31)b = 31;
+          }
+        }break; //Alpha Blend
+        case 2: //Lighten
+          r = r+(31-r)*evy;
+          g = g+(31-g)*evy;
+          b = b+(31-b)*evy;  
+          break; 
+        case 3: //Darken
+          r = r-(r)*evy;
+          g = g-(g)*evy;
+          b = b-(b)*evy;         
+          break; 
+      }
+    }
+
+    // Source A of the capture is the engine output before the display mode picks what's shown
+    if(enable_capture)capture_line[lcd_x]=(r&0x1f)|((g&0x1f)<<5)|((b&0x1f)<<10);
+    if(display_mode==2&&ppu_id==0){
+      int vram_block = SB_BFE(dispcnt,18,2);
+      uint16_t value = ((uint16_t*)nds->mem.vram)[lcd_x+lcd_y*NDS_LCD_W+vram_block*64*1024];
+      r = SB_BFE(value,0,5);
+      g = SB_BFE(value,5,5);
+      b = SB_BFE(value,10,5);
+    }else if(display_mode==0){
+      r=31;
+      g=31;
+      b=31;
+    }
+
+    int disp_r = r; 
+    int disp_g = g; 
+    int disp_b = b; 
+    {
+      uint16_t master_brightness= nds9_io_read16(nds,reg_offset+NDS_A_MASTER_BRIGHT);
+      int mode = SB_BFE(master_brightness,14,2);
+      // The frontend applies it to the pixels it finishes
+      if(SB_UNLIKELY(mode)&&!hires_mark){
+        int factor = SB_BFE(master_brightness,0,5);
+        if(factor>16)factor=16;
+        if(mode==1){
+          disp_r += (63-disp_r)*factor/16;
+          disp_g += (63-disp_g)*factor/16;
+          disp_b += (63-disp_b)*factor/16;
+          if(disp_r>31)disp_r=31;
+          if(disp_g>31)disp_g=31;
+          if(disp_b>31)disp_b=31;
+        }else if(mode==2){
+          disp_r -= disp_r*factor/16;
+          disp_g -= disp_g*factor/16;
+          disp_b -= disp_b*factor/16;
+          if(disp_r<0)r=0;
+          if(disp_g<0)g=0;
+          if(disp_b<0)b=0;
+        }
+      }
+    }
+    int p = (lcd_x+lcd_y*NDS_LCD_W)*4;
+    uint8_t *framebuffer = (ppu_id==0)^nds->display_flip?nds->framebuffer_bottom: nds->framebuffer_top;
+    framebuffer[p+0] = disp_r*7;
+    framebuffer[p+1] = disp_g*7;
+    framebuffer[p+2] = disp_b*7;
+    framebuffer[p+3] = hires_mark;
+    int backdrop_type = 5;
+    uint32_t backdrop_col = (*(uint16_t*)(nds->mem.palette + GBA_BG_PALETTE+0*2+ppu_id*1024))|(backdrop_type<<17);
+    
+    ppu->first_target_buffer[lcd_x] = backdrop_col;
+    ppu->second_target_buffer[lcd_x] = backdrop_col;
+  #if NDS_SCANLINE_PPU == 1
+  lcd_x++;
+  }
+  if(enable_capture)nds_ppu_capture_line(nds,lcd_y,capture_line);
+  lcd_x = 0; 
+  }
+  #endif
+  }
+}
+typedef struct{
+  nds_t* nds;
+  int lcd_x, lcd_y;
+  bool render;
+}nds_ppu_render_job_t;
+static void nds_ppu_render_job(void* user_data, int ppu_id){
+  nds_ppu_render_job_t* job = (nds_ppu_render_job_t*)user_data;
+  nds_ppu_render(job->nds,ppu_id,job->lcd_x,job->lcd_y,job->render);
+}
 static FORCE_INLINE void nds_tick_ppu(nds_t* nds,bool render){
   if(SB_LIKELY(nds->ppu_fast_forward_ticks-->0))return;
   //if(SB_LIKELY(nds->ppu[0].scan_clock%NDS_CLOCKS_PER_DOT))return;
@@ -5566,6 +8120,12 @@ static FORCE_INLINE void nds_tick_ppu(nds_t* nds,bool render){
   int lcd_y = (nds->ppu[0].scan_clock)/clocks_per_line;
   int lcd_x = ((nds->ppu[0].scan_clock)%clocks_per_line)/NDS_CLOCKS_PER_DOT;
   nds->ppu[0].scan_clock+=nds->ppu_fast_forward_ticks+1;
+  bool capture = lcd_x==0&&lcd_y<NDS_LCD_H&&SB_BFE(nds9_io_read32(nds,NDS_DISPCAPCNT),31,1);
+  // The line may capture the 3D layer of a swap that wasn't rasterized yet
+  if(capture)nds_gpu_flush_deferred_raster(nds);
+  // Both engines only read shared state while rendering a line, so they can
+  // render it concurrently. Display capture writes VRAM and stays serial.
+  bool threaded = lcd_x==0&&lcd_y<NDS_LCD_H&&nds->ppu_job_dispatch&&!capture;
   for(int ppu_id=0;ppu_id<2;++ppu_id){
     nds_ppu_t * ppu = nds->ppu+ppu_id;
     uint32_t dispcapcnt = nds9_io_read32(nds,NDS_DISPCAPCNT);
@@ -5679,614 +8239,11 @@ static FORCE_INLINE void nds_tick_ppu(nds_t* nds,bool render){
         nds->activate_dmas|=nds->dma_wait_ppu;
       }
     }
-    uint32_t dispcnt = nds9_io_read32(nds, GBA_DISPCNT+reg_offset);
-    int display_mode = SB_BFE(dispcnt,16,2);
-    bool enable_capture = SB_BFE(dispcapcnt,31,1)&&ppu_id==0;
-    int forced_blank = SB_BFE(dispcnt,7,1);
-    render&= !forced_blank;
-    if(!render&&!enable_capture)continue;
-    
-    bool enable_3d = ppu_id==0&&SB_BFE(dispcnt,3,1);
-    int bg_mode = SB_BFE(dispcnt,0,3);
-    bool visible = lcd_x<NDS_LCD_W && lcd_y<NDS_LCD_H;
-    //Render sprites over scanline when it completes
-    if(lcd_y<NDS_LCD_H && lcd_x == 0){
-      int obj_vram_map_2d = !SB_BFE(dispcnt,6,1);
-      //Render sprites over scanline when it completes
-      uint8_t default_window_control =0x3f;//bitfield [0-3:bg0-bg3 enable 4:obj enable, 5: special effect enable]
-      bool winout_enable = SB_BFE(dispcnt,13,3)!=0;
-      uint16_t WINOUT = nds9_io_read16(nds, GBA_WINOUT+reg_offset);
-      if(winout_enable)default_window_control = SB_BFE(WINOUT,0,8);
-
-      memset(ppu->window,default_window_control,NDS_LCD_W);
-
-      bool display_obj = SB_BFE(dispcnt,12,1);
-      if(display_obj){
-        uint8_t obj_window_control = default_window_control;
-        bool obj_window_enable = SB_BFE(dispcnt,15,1);
-        if(obj_window_enable)obj_window_control = SB_BFE(WINOUT,8,6);
-        int oam_offset = ppu_id*1024;
-        int obj_vram_base = ppu_id ==0? 0x06400000: 0x06600000;
-        for(int o=0;o<128;++o){
-          uint16_t attr0 = *(uint16_t*)(nds->mem.oam+o*8+0+oam_offset);
-          //Attr0
-          uint8_t y_coord = SB_BFE(attr0,0,8);
-          bool rot_scale =  SB_BFE(attr0,8,1);
-          bool double_size = SB_BFE(attr0,9,1)&&rot_scale;
-          bool obj_disable = SB_BFE(attr0,9,1)&&!rot_scale;
-          if(obj_disable) continue; 
-
-          int obj_mode = SB_BFE(attr0,10,2); //(0=Normal, 1=Semi-Transparent, 2=OBJ Window, 3=bitmap)
-          bool mosaic  = SB_BFE(attr0,12,1);
-          bool colors_or_palettes = SB_BFE(attr0,13,1);
-          int obj_shape = SB_BFE(attr0,14,2);//(0=Square,1=Horizontal,2=Vertical,3=Prohibited)
-          uint16_t attr1 = *(uint16_t*)(nds->mem.oam+o*8+2+oam_offset);
-
-          int rotscale_param = SB_BFE(attr1,9,5);
-          bool h_flip = SB_BFE(attr1,12,1)&&!rot_scale;
-          bool v_flip = SB_BFE(attr1,13,1)&&!rot_scale;
-          int obj_size = SB_BFE(attr1,14,2);
-          // Size  Square   Horizontal  Vertical
-          // 0     8x8      16x8        8x16
-          // 1     16x16    32x8        8x32
-          // 2     32x32    32x16       16x32
-          // 3     64x64    64x32       32x64
-          const int xsize_lookup[16]={
-            8,16,8,0,
-            16,32,8,0,
-            32,32,16,0,
-            64,64,32,0
-          };
-          const int ysize_lookup[16]={
-            8,8,16,0,
-            16,8,32,0,
-            32,16,32,0,
-            64,32,64,0
-          }; 
-
-          int y_size = ysize_lookup[obj_size*4+obj_shape];
-
-          if(((lcd_y-y_coord)&0xff) <y_size*(double_size?2:1)){
-
-            int16_t x_coord = SB_BFE(attr1,0,9);
-            if (SB_BFE(x_coord,8,1))x_coord|=0xfe00;
-
-            int x_size = xsize_lookup[obj_size*4+obj_shape];
-            int x_start = x_coord>=0?x_coord:0;
-            int x_end   = x_coord+x_size*(double_size?2:1);
-            if(x_end>=NDS_LCD_W)x_end=NDS_LCD_W;
-            //Attr2
-            //Skip objects disabled by window
-            uint16_t attr2 = *(uint16_t*)(nds->mem.oam+o*8+4 +oam_offset);
-            int tile_base = SB_BFE(attr2,0,10);
-            // Always place sprites as the highest priority
-            int priority = SB_BFE(attr2,10,2);
-            int palette = SB_BFE(attr2,12,4);
-            for(int x = x_start; x< x_end;++x){
-              int sx = (x-x_coord);
-              int sy = (lcd_y-y_coord)&0xff;
-              if(mosaic){
-                uint16_t mos_reg = nds9_io_read16(nds,GBA_MOSAIC+reg_offset);
-                int mos_x = SB_BFE(mos_reg,8,4)+1;
-                int mos_y = SB_BFE(mos_reg,12,4)+1;
-                sx = ((x/mos_x)*mos_x-x_coord);
-                sy = (((lcd_y/mos_y)*mos_y-y_coord)&0xff);
-              }
-              if(rot_scale){
-                uint32_t param_base = rotscale_param*0x20+oam_offset; 
-                int32_t a = *(int16_t*)(nds->mem.oam+param_base+0x6);
-                int32_t b = *(int16_t*)(nds->mem.oam+param_base+0xe);
-                int32_t c = *(int16_t*)(nds->mem.oam+param_base+0x16);
-                int32_t d = *(int16_t*)(nds->mem.oam+param_base+0x1e);
-  
-                int64_t x1 = sx<<8;
-                int64_t y1 = sy<<8;
-                int64_t objref_x = (x_size<<(double_size?8:7));
-                int64_t objref_y = (y_size<<(double_size?8:7));
-              
-                int64_t x2 = a*(x1-objref_x) + b*(y1-objref_y)+(x_size<<15);
-                int64_t y2 = c*(x1-objref_x) + d*(y1-objref_y)+(y_size<<15);
-
-                sx = (x2>>16);
-                sy = (y2>>16);
-                if(sx>=x_size||sy>=y_size||sx<0||sy<0)continue;
-              }else{
-                if(h_flip)sx=x_size-sx-1;
-                if(v_flip)sy=y_size-sy-1;
-              }
-              uint32_t col =0;
-              if(obj_mode==3){
-
-                bool linear = SB_BFE(dispcnt,6,1);
-                //TODO: Bitmap sprites
-                if(linear){
-                  int boundry = SB_BFE(dispcnt,22,1);
-                  tile_base *= boundry? 256: 128;
-                  int p = sx+sy*x_size;
-                  col = nds_ppu_read16(nds,obj_vram_base+tile_base+p*2);
-                }else{
-                  bool size = SB_BFE(dispcnt,5,1);
-                  int p = 0;             
-                  if(size){
-                    int tile_x=SB_BFE(tile_base,0,5);
-                    int tile_y=SB_BFE(tile_base,5,5);
-                    p = (tile_x*8+sx)+(tile_y*8+sy)*32*8;
-                  }else{
-                    int tile_x=SB_BFE(tile_base,0,4);
-                    int tile_y=SB_BFE(tile_base,4,6);
-                    p = (tile_x*8+sx)+(tile_y*8+sy)*16*8;
-                  }
-                  col = nds_ppu_read16(nds,obj_vram_base+p*2);
-                  if(!SB_BFE(col,15,1))continue;
-                }
-              }else{
-                int tx = sx%8;
-                int ty = sy%8;
-                bool tile_obj_mapping = SB_BFE(dispcnt,4,1);
-                        
-                int y_tile_stride = obj_vram_map_2d? 32 : x_size/8*(colors_or_palettes? 2:1);
-
-                int tile_boundry = 32;
-                if(tile_obj_mapping ==true){
-                  int tile_obj_1d_boundry = SB_BFE(dispcnt,20,2);
-                  tile_boundry = 32<<tile_obj_1d_boundry;
-                  y_tile_stride=x_size/8*(colors_or_palettes? 2:1);
-                }
-                int tile = tile_base*tile_boundry/32 + (((sx/8))*(colors_or_palettes? 2:1)+(sy/8)*y_tile_stride);
-                //tile*=tile_boundry/32;
-                uint16_t palette_id;
-                bool use_obj_ext_palettes = SB_BFE(dispcnt,31,1);
-                if(colors_or_palettes==false){
-                  palette_id= nds_ppu_read8(nds,obj_vram_base+tile*32+tx/2+ty*4);
-                  palette_id= (palette_id>>((tx&1)*4))&0xf;
-                  if(palette_id==0)continue;
-                  palette_id+=palette*16;
-                  use_obj_ext_palettes=false; //Not supported in 16 color mode
-                }else{
-                  palette_id=nds_ppu_read8(nds,obj_vram_base+tile*32+tx+ty*8);
-                  if(palette_id==0)continue;
-                }
-                if(use_obj_ext_palettes){
-                  palette_id=(palette)*256+palette_id;
-                  uint32_t read_addr = (ppu_id?NDS_VRAM_OBJB_SLOT0:NDS_VRAM_OBJA_SLOT0)+palette_id*2;
-                  col = nds_ppu_read16(nds, read_addr);
-                }else{
-                  uint32_t pallete_offset = ppu_id?0x600:0x200; 
-                  col = *(uint16_t*)(nds->mem.palette+pallete_offset+palette_id*2);
-                }
-              }
-
-              //Handle window objects(not displayed but control the windowing of other things)
-              if(obj_mode==2){ppu->window[x]=obj_window_control; 
-              }else{
-                int type =4;
-                col=col|(type<<17)|((5-priority)<<28)|((0x7)<<25);
-                if(obj_mode==1)col|=1<<16;
-                if((col>>17)>(ppu->first_target_buffer[x]>>17))ppu->first_target_buffer[x]=col;
-              }  
-            }
-          }
-        }
-      }
-      int enabled_windows = SB_BFE(dispcnt,13,3); // [0: win0, 1:win1, 2: objwin]
-      if(enabled_windows){
-        for(int win=1;win>=0;--win){
-          bool win_enable = SB_BFE(dispcnt,13+win,1);
-          if(!win_enable)continue;
-          uint16_t WINH = nds9_io_read16(nds, GBA_WIN0H+2*win+reg_offset);
-          uint16_t WINV = nds9_io_read16(nds, GBA_WIN0V+2*win+reg_offset);
-          int win_xmin = SB_BFE(WINH,8,8);
-          int win_xmax = SB_BFE(WINH,0,8);
-          int win_ymin = SB_BFE(WINV,8,8);
-          int win_ymax = SB_BFE(WINV,0,8);
-          // Garbage values of X2>240 or X1>X2 are interpreted as X2=240.
-          // Garbage values of Y2>160 or Y1>Y2 are interpreted as Y2=160. 
-          if(win_xmin>win_xmax)win_xmax=NDS_LCD_W;
-          if(win_ymin>win_ymax)win_ymax=NDS_LCD_H+1;
-          if(win_xmax>NDS_LCD_W)win_xmax=NDS_LCD_W;
-          if(lcd_y<win_ymin||lcd_y>=win_ymax)continue;
-          uint16_t winin = nds9_io_read16(nds,GBA_WININ+reg_offset);
-          uint8_t win_value = SB_BFE(winin,win*8,6);
-          memset(ppu->window+win_xmin,win_value,win_xmax-win_xmin);
-        }
-        int backdrop_type = 5;
-        uint32_t backdrop_col = (*(uint16_t*)(nds->mem.palette + GBA_BG_PALETTE+0*2+ppu_id*1024))|(backdrop_type<<17);
-        for(int x=0;x<NDS_LCD_W;++x){
-          uint8_t window_control = ppu->window[x];
-          if(SB_BFE(window_control,4,1)==0)ppu->first_target_buffer[x]=backdrop_col;  
-        }
-      }
-    }
-    if(visible){
-      #if NDS_SCANLINE_PPU == 1
-      if(lcd_x==0){while(lcd_x<NDS_LCD_W){
-      #endif
-      uint8_t window_control =ppu->window[lcd_x];
-      bool render_backgrounds = true; //TODO hook up power management
-      if(render_backgrounds){
-        for(int bg = 3; bg>=0;--bg){
-          #define NDS_BG_TEXT 0
-          #define NDS_BG_AFFINE 1
-          #define NDS_BG_BITMAP 2
-          #define NDS_BG_LARGE_BITMAP 3
-          #define NDS_BG_INVALID 4
-
-          const int bg_mode_table[8*4]={
-            /* mode 0: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,
-            /* mode 1: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_AFFINE,
-            /* mode 2: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_AFFINE,NDS_BG_AFFINE,
-            /* mode 3: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_BITMAP,
-            /* mode 4: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_AFFINE,NDS_BG_BITMAP,
-            /* mode 5: */NDS_BG_TEXT,NDS_BG_TEXT,NDS_BG_BITMAP,NDS_BG_BITMAP,
-            /* mode 6: */NDS_BG_TEXT,NDS_BG_INVALID,NDS_BG_LARGE_BITMAP,NDS_BG_INVALID,
-            /* mode 7: */NDS_BG_INVALID,NDS_BG_INVALID,NDS_BG_INVALID,NDS_BG_INVALID,
-          };
-          const int bg_size_table[4*4*2]={
-            /* TEXT: */        
-            256,256,
-            512,256,
-            256,512,
-            512,512,
-            /* AFFINE: */ 
-            128,128,
-            256,256,
-            512,512,
-            1024,1024,
-            /* BITMAP: */ 
-            128,128,
-            256,256,
-            512,256,
-            512,512,
-            /* LARGE BITMAP: */
-            512,1024,
-            1024,512,
-            0,0, //INVALID
-            0,0, //INVALID
-          };
-          int bg_type = bg_mode_table[bg_mode*4+bg];
-          uint32_t col =0;         
-          bool bg_en = SB_BFE(dispcnt,8+bg,1)&&SB_BFE(ppu->dispcnt_pipeline[0],8+bg,1)&&bg_type!=NDS_BG_INVALID;
-          if(!bg_en || SB_BFE(window_control,bg,1)==0)continue;
-          uint16_t bgcnt = nds9_io_read16(nds, GBA_BG0CNT+bg*2+reg_offset);
-          int priority = SB_BFE(bgcnt,0,2);
-          if(SB_UNLIKELY(enable_3d&&bg==0)){
-            int p = lcd_x+lcd_y*NDS_LCD_W;
-            if(SB_BFE(nds->framebuffer_3d_disp[p*4+3],3,5)==0)continue;
-            col  = SB_BFE(nds->framebuffer_3d_disp[p*4+0],3,5);
-            col |= SB_BFE(nds->framebuffer_3d_disp[p*4+1],3,5)<<5;
-            col |= SB_BFE(nds->framebuffer_3d_disp[p*4+2],3,5)<<10;
-            // Treat 3d as semitransparent (needed for Soul Silver particle effects)
-            col|=1<<16;
-          }else{
-            bool rot_scale = bg_type!=NDS_BG_TEXT;
-            int character_base = SB_BFE(bgcnt,2,4);
-            bool mosaic = SB_BFE(bgcnt,6,1);
-            bool colors = SB_BFE(bgcnt,7,1);
-            int screen_base = SB_BFE(bgcnt,8,5);
-            bool display_overflow =SB_BFE(bgcnt,13,1);
-            int screen_size = SB_BFE(bgcnt,14,2); 
-
-            bool bitmap_mode = SB_BFE(bgcnt,7,1)&&(bg_type==NDS_BG_BITMAP||bg_type==NDS_BG_LARGE_BITMAP);
-            bool extended_bgmap=!SB_BFE(bgcnt,7,1)&&(bg_type==NDS_BG_BITMAP||bg_type==NDS_BG_LARGE_BITMAP);
-            //NDS can have an affine "bitmap" that is really a large affine tile map
-            uint32_t bg_type_for_size = (bg_type==2&&!bitmap_mode)? 1: bg_type; 
-            int screen_size_x = bg_size_table[(bg_type_for_size*4+screen_size)*2+0];
-            int screen_size_y = bg_size_table[(bg_type_for_size*4+screen_size)*2+1];
-          
-            int bg_x = 0;
-            int bg_y = 0;
-            uint32_t pallete_offset = ppu_id?0x400:0; 
-
-            bool use_ext_palettes = SB_BFE(dispcnt,30,1);
-
-            if(rot_scale){
-              colors = true;
-
-              int32_t bgx = ppu->aff[bg-2].internal_bgx;
-              int32_t bgy = ppu->aff[bg-2].internal_bgy;
-
-              int32_t a = (int16_t)nds9_io_read16(nds,GBA_BG2PA+(bg-2)*0x10+reg_offset);
-              int32_t c = (int16_t)nds9_io_read16(nds,GBA_BG2PC+(bg-2)*0x10+reg_offset);
-
-              // Shift lcd_coords into fixed point
-              int64_t x2 = a*lcd_x + (((int64_t)bgx));
-              int64_t y2 = c*lcd_x + (((int64_t)bgy));
-              if(mosaic){
-                int16_t mos_reg = nds9_io_read16(nds,GBA_MOSAIC+reg_offset);
-                int mos_x = SB_BFE(mos_reg,0,4)+1;
-                x2 = a*((lcd_x/mos_x)*mos_x) + (((int64_t)bgx));
-                y2 = c*((lcd_x/mos_x)*mos_x) + (((int64_t)bgy));
-              }
-              bg_x = (x2>>8);
-              bg_y = (y2>>8);
-
-              if(display_overflow==0){
-                if(bg_x<0||bg_x>=screen_size_x||bg_y<0||bg_y>=screen_size_y)continue; 
-              }else{
-                bg_x%=screen_size_x;
-                bg_y%=screen_size_y;
-              }
-            }else{
-              int16_t hoff = SB_BFE(nds9_io_read16(nds,GBA_BG0HOFS+bg*4+reg_offset),0,9);
-              int16_t voff = SB_BFE(nds9_io_read16(nds,GBA_BG0VOFS+bg*4+reg_offset),0,9);
-              hoff=(hoff<<7)>>7;
-              voff=(voff<<7)>>7;
-              bg_x = (hoff+lcd_x);
-              bg_y = (voff+lcd_y);
-              if(mosaic){
-                uint16_t mos_reg = nds9_io_read16(nds,GBA_MOSAIC+reg_offset);
-                int mos_x = SB_BFE(mos_reg,0,4)+1;
-                int mos_y = SB_BFE(mos_reg,4,4)+1;
-                bg_x = hoff+(lcd_x/mos_x)*mos_x;
-                bg_y = voff+(lcd_y/mos_y)*mos_y;
-              }
-            }
-            int screen_base_addr    = screen_base*2*1024;
-            int character_base_addr = character_base*16*1024;
-          
-            int32_t bg_base = ppu_id? 0x06200000:0x06000000;
-            if(bitmap_mode){
-              screen_base_addr=screen_base*16*1024;
-              int p = bg_x+(bg_y)*screen_size_x;
-              bool direct_color = SB_BFE(bgcnt,2,1);
-              if(direct_color){
-                col = nds_ppu_read16(nds,bg_base+screen_base_addr+p*2);
-                if(!SB_BFE(col,15,1))continue;
-              }else{
-                int pallete_id  = nds_ppu_read8(nds,bg_base+screen_base_addr+p);
-                if(pallete_id==0)continue;
-                col = *(uint16_t*)(nds->mem.palette+pallete_offset+pallete_id*2);
-              }
-            }else{
-              bg_x = bg_x&(screen_size_x-1);
-              bg_y = bg_y&(screen_size_y-1);
-              int bg_tile_x = bg_x/8;
-              int bg_tile_y = bg_y/8;
-
-              int tile_off = bg_tile_y*(screen_size_x/8)+bg_tile_x;
-
-              //engine A screen base: BGxCNT.bits*2K + DISPCNT.bits*64K
-              //engine A char base: BGxCNT.bits*16K + DISPCNT.bits*64K
-              if(ppu_id==0){
-                character_base_addr+=SB_BFE(dispcnt,24,3)*64*1024;
-                screen_base_addr+=SB_BFE(dispcnt,27,3)*64*1024;
-              }
-              uint16_t tile_data =0;
-
-              int px = bg_x%8;
-              int py = bg_y%8;
-
-              if(extended_bgmap){
-                tile_data=nds_ppu_read16(nds,bg_base+screen_base_addr+tile_off*2);
-                int h_flip = SB_BFE(tile_data,10,1);
-                int v_flip = SB_BFE(tile_data,11,1);
-                if(h_flip)px=7-px;
-                if(v_flip)py=7-py;
-              }else if(rot_scale){
-                tile_data=nds_ppu_read8(nds,bg_base+screen_base_addr+tile_off);
-                use_ext_palettes=false; //Not supported for 8bit bg map
-              }else{
-                int tile_off = (bg_tile_y%32)*32+(bg_tile_x%32);
-                if(bg_tile_x>=32)tile_off+=32*32;
-                if(bg_tile_y>=32)tile_off+=32*32*(screen_size==3?2:1);
-                tile_data=nds_ppu_read16(nds,bg_base+screen_base_addr+tile_off*2);
-                //printf("tx:%d ty:%d tile_off:%08x data:%08x\n",bg_tile_x,bg_tile_y,bg_base+screen_base_addr+tile_off,tile_data);
-                int h_flip = SB_BFE(tile_data,10,1);
-                int v_flip = SB_BFE(tile_data,11,1);
-                if(h_flip)px=7-px;
-                if(v_flip)py=7-py;
-              }
-              int tile_id = SB_BFE(tile_data,0,10);
-              int palette = SB_BFE(tile_data,12,4);
-
-              uint8_t tile_d=tile_id;
-              if(colors==false){
-                tile_d=nds_ppu_read8(nds,bg_base+character_base_addr+tile_id*8*4+px/2+py*4);
-                tile_d= (tile_d>>((px&1)*4))&0xf;
-                if(tile_d==0)continue;
-                tile_d+=palette*16;
-                use_ext_palettes=false;
-              }else{
-                tile_d=nds_ppu_read8(nds,bg_base+character_base_addr+tile_id*8*8+px+py*8);
-                if(tile_d==0)continue;
-              }
-              uint32_t palette_id = tile_d;
-              if(use_ext_palettes){
-                palette_id=(palette)*256+tile_d;
-                int ext_palette_slot = bg;
-                if(bg<2)ext_palette_slot+=SB_BFE(bgcnt,13,1)*2;
-                uint32_t read_addr = (ppu_id?NDS_VRAM_BGB_SLOT0:NDS_VRAM_BGA_SLOT0)+palette_id*2+0x2000*(ext_palette_slot);
-                col = nds_ppu_read16(nds, read_addr);
-              }else col = *(uint16_t*)(nds->mem.palette+pallete_offset+palette_id*2);
-            }
-          }
-          col |= (bg<<17) | ((5-priority)<<28)|((4-bg)<<25);
-          if(col>ppu->first_target_buffer[lcd_x]){
-            uint32_t t = ppu->first_target_buffer[lcd_x];
-            ppu->first_target_buffer[lcd_x]=col;
-            col = t;
-          }
-          if(col>ppu->second_target_buffer[lcd_x])ppu->second_target_buffer[lcd_x]=col;          
-        }
-      }
-      uint32_t col = ppu->first_target_buffer[lcd_x];
-      int r = SB_BFE(col,0,5);
-      int g = SB_BFE(col,5,5);
-      int b = SB_BFE(col,10,5);
-      uint32_t type = SB_BFE(col,17,3);
-
-      bool effect_enable = SB_BFE(window_control,5,1);
-      uint16_t bldcnt = nds9_io_read16(nds,GBA_BLDCNT+reg_offset);
-      int mode = SB_BFE(bldcnt,6,2);
-
-      //Semitransparent objects are always selected for blending
-      if(SB_BFE(col,16,1)){
-        uint32_t col2 = ppu->second_target_buffer[lcd_x];
-        uint32_t type2 = SB_BFE(col2,17,3);
-        bool blend = SB_BFE(bldcnt,8+type2,1);
-        if(blend){mode=1;effect_enable=true;}
-        else effect_enable &= SB_BFE(bldcnt,type,1);
-      }else effect_enable &= SB_BFE(bldcnt,type,1);
-      if(effect_enable){
-        uint16_t bldy = nds9_io_read16(nds,GBA_BLDY+reg_offset);
-        float evy = SB_BFE(bldy,0,5)/16.;
-        if(evy>1.0)evy=1;
-        switch(mode){
-          case 0: break; //None
-          case 1: {
-            uint32_t col2 = ppu->second_target_buffer[lcd_x];
-            uint32_t type2 = SB_BFE(col2,17,3);
-            bool blend = SB_BFE(bldcnt,8+type2,1);
-            if(blend){
-              uint16_t bldalpha= nds9_io_read16(nds,GBA_BLDALPHA+reg_offset);
-              //3d engines alpha blend based on the 3d alpha
-              
-              int r2 = SB_BFE(col2,0,5);
-              int g2 = SB_BFE(col2,5,5);
-              int b2 = SB_BFE(col2,10,5);
-              int eva = SB_BFE(bldalpha,0,5);
-              int evb = SB_BFE(bldalpha,8,5);
-              if(enable_3d&&type==0){
-                eva = nds->framebuffer_3d_disp[(lcd_x+lcd_y*NDS_LCD_W)*4+3]/16;
-                if(eva==15)eva=16;
-                evb = 16-eva;
-              }
-              if(eva>16)eva=16;
-              if(evb>16)evb=16;
-              r = (r*eva+r2*evb)/16;
-              g = (g*eva+g2*evb)/16;
-              b = (b*eva+b2*evb)/16;
-              if(r>31)r = 31;
-              if(g>31)g = 31;
-              if(b>31)b = 31;
-            }
-          }break; //Alpha Blend
-          case 2: //Lighten
-            r = r+(31-r)*evy;
-            g = g+(31-g)*evy;
-            b = b+(31-b)*evy;  
-            break; 
-          case 3: //Darken
-            r = r-(r)*evy;
-            g = g-(g)*evy;
-            b = b-(b)*evy;         
-            break; 
-        }
-      }
-
-      if(display_mode==2&&ppu_id==0){
-        int vram_block = SB_BFE(dispcnt,18,2);
-        uint16_t value = ((uint16_t*)nds->mem.vram)[lcd_x+lcd_y*NDS_LCD_W+vram_block*64*1024];
-        r = SB_BFE(value,0,5);
-        g = SB_BFE(value,5,5);
-        b = SB_BFE(value,10,5);
-      }else if(display_mode==0){
-        r=31;
-        g=31;
-        b=31;
-      }
-
-      if(enable_capture){
-        int size = SB_BFE(dispcapcnt, 20,2);
-        int szx = 128; int szy = 128;
-        if(size!=0){szx=256; szy= size*64;}
-        if(lcd_x<szx&&lcd_y<szy){
-          uint16_t color = (((uint16_t)r&0x1f))|(((uint16_t)g&0x1f)<<5)|(((uint16_t)b&0x1f)<<10);
-          //TODO: EVA/EVB, sources other than 0
-          int write_block = SB_BFE(dispcapcnt, 16,2);
-          int write_offset = SB_BFE(dispcapcnt, 18,2);
-          bool source_a = SB_BFE(dispcapcnt,24,1);
-          if(source_a){
-            int p = lcd_x+lcd_y*NDS_LCD_W;
-            color  = SB_BFE(nds->framebuffer_3d_disp[p*4+0],3,5);
-            color |= SB_BFE(nds->framebuffer_3d_disp[p*4+1],3,5)<<5;
-            color |= SB_BFE(nds->framebuffer_3d_disp[p*4+2],3,5)<<10;
-          }
-          int capture_mode = SB_BFE(dispcapcnt,29,2);
-          
-          if(capture_mode>=2){        
-            int r = SB_BFE(color,0,5);
-            int g = SB_BFE(color,5,5);
-            int b = SB_BFE(color,10,5);
-            int read_offset = SB_BFE(dispcapcnt, 26,2);
-            uint32_t read_address = 0x06800000;
-            read_address+=read_offset*0x08000;
-            read_address+=lcd_y*szx*2+lcd_x*2;
-            uint16_t color2=nds_ppu_read16(nds,read_address);
-            if(display_mode==2)color2=ppu->first_target_buffer[lcd_x];
-
-            int r2 = SB_BFE(color2,0,5);
-            int g2 = SB_BFE(color2,5,5);
-            int b2 = SB_BFE(color2,10,5);
-            int eva = SB_BFE(dispcapcnt,0,5);
-            int evb = SB_BFE(dispcapcnt,8,5);
-        
-            if(eva>16)eva=16;
-            if(evb>16)evb=16;
-            r = (r*eva+r2*evb)/16;
-            g = (g*eva+g2*evb)/16;
-            b = (b*eva+b2*evb)/16;
-            if(r>31)r = 31;
-            if(g>31)g = 31;
-            if(b>31)b = 31;
-            color  = SB_BFE(r,0,5);
-            color |= SB_BFE(g,0,5)<<5;
-            color |= SB_BFE(b,0,5)<<10;
-          }      
-          uint32_t write_address = 0x06800000;
-          write_address+=write_block*128*1024;
-          write_address+=write_offset*0x08000;
-          write_address+=lcd_y*szx*2+lcd_x*2;
-          color|=0x8000;//TODO: Confirm that captured alpha is always 1
-          nds9_write16(nds,write_address,color);
-        }
-      }
-
-      int disp_r = r; 
-      int disp_g = g; 
-      int disp_b = b; 
-      {
-        uint16_t master_brightness= nds9_io_read16(nds,reg_offset+NDS_A_MASTER_BRIGHT);
-        int mode = SB_BFE(master_brightness,14,2);
-        if(SB_UNLIKELY(mode)){
-          int factor = SB_BFE(master_brightness,0,5);
-          if(factor>16)factor=16;
-          if(mode==1){
-            disp_r += (63-disp_r)*factor/16;
-            disp_g += (63-disp_g)*factor/16;
-            disp_b += (63-disp_b)*factor/16;
-            if(disp_r>31)disp_r=31;
-            if(disp_g>31)disp_g=31;
-            if(disp_b>31)disp_b=31;
-          }else if(mode==2){
-            disp_r -= disp_r*factor/16;
-            disp_g -= disp_g*factor/16;
-            disp_b -= disp_b*factor/16;
-            if(disp_r<0)r=0;
-            if(disp_g<0)g=0;
-            if(disp_b<0)b=0;
-          }
-        }
-      }
-      int p = (lcd_x+lcd_y*NDS_LCD_W)*4;
-      float screen_blend_factor = nds->ghosting_strength;
-      
-      uint8_t *framebuffer = (ppu_id==0)^nds->display_flip?nds->framebuffer_bottom: nds->framebuffer_top;
-      framebuffer[p+0] = disp_r*7+(framebuffer[p+0]-disp_r*7)*screen_blend_factor;
-      framebuffer[p+1] = disp_g*7+(framebuffer[p+1]-disp_g*7)*screen_blend_factor;
-      framebuffer[p+2] = disp_b*7+(framebuffer[p+2]-disp_b*7)*screen_blend_factor; 
-      int backdrop_type = 5;
-      uint32_t backdrop_col = (*(uint16_t*)(nds->mem.palette + GBA_BG_PALETTE+0*2+ppu_id*1024))|(backdrop_type<<17);
-      
-      ppu->first_target_buffer[lcd_x] = backdrop_col;
-      ppu->second_target_buffer[lcd_x] = backdrop_col;
-    #if NDS_SCANLINE_PPU == 1
-    lcd_x++;
-    }
-    lcd_x = 0; 
-    }
-    #endif
-    }
+    if(!threaded)nds_ppu_render(nds,ppu_id,lcd_x,lcd_y,render);
+  }
+  if(threaded){
+    nds_ppu_render_job_t job = {nds,lcd_x,lcd_y,render};
+    nds->ppu_job_dispatch(nds_ppu_render_job,&job,2);
   }
 }
 static void nds_tick_keypad(sb_emu_state_t*emu, nds_t* nds){
@@ -6385,6 +8342,28 @@ static void nds_tick_touch(sb_joy_t*joy, nds_t* nds){
   }
   
 }
+// Cycles a DMA on cpu can keep transferring before an interrupt, timer, PPU or GX event could
+// see it. 0 unless the other CPU is halted with no DMA of its own, since it would otherwise run
+// between the transfers.
+static FORCE_INLINE int nds_dma_burst_budget(nds_t* nds, int cpu){
+  int other = cpu==NDS_ARM7? NDS_ARM9: NDS_ARM7;
+  if(!(other==NDS_ARM7? nds->arm7.wait_for_interrupt: nds->arm9.wait_for_interrupt))return 0;
+  for(int i=0;i<4;++i)if(SB_BFE(nds_io_read16(nds,other,GBA_DMA0CNT_H+12*i),15,1))return 0;
+  int budget = nds->next_timer_clock-nds->current_clock;
+  if(nds->ppu_fast_forward_ticks<budget)budget=nds->ppu_fast_forward_ticks;
+  if(nds->gpu.cmd_busy_cycles&&nds->gpu.cmd_busy_cycles<budget)budget=nds->gpu.cmd_busy_cycles;
+  int if_ticks = nds_if_pipe_ticks_to_delivery(nds);
+  if(if_ticks<budget)budget=if_ticks;
+  return budget;
+}
+// True when both sides of a transfer are plain memory mapped by the TLB, which has no side
+// effects beyond the write notification
+static FORCE_INLINE bool nds_dma_burst_mapped(nds_t* nds, int cpu, uint32_t src, uint32_t dst){
+  if(!nds->mem.tlb||src<0x02000000||src>=0x08000000||dst>=0x08000000)return false;
+  nds_tlb_map_t* map = cpu==NDS_ARM7? &nds->mem.tlb->arm7: &nds->mem.tlb->arm9;
+  uint32_t src_page = src>>NDS_TLB_PAGE_SHIFT, dst_page = dst>>NDS_TLB_PAGE_SHIFT;
+  return map->read[src_page]&&map->write[dst_page]&&map->bus_cycles[src_page]!=NDS_TLB_SLOW&&map->bus_cycles[dst_page]!=NDS_TLB_SLOW;
+}
 static FORCE_INLINE void nds_tick_dma(nds_t*nds, int last_tick){
   if(nds->activate_dmas==false)return;
   nds->activate_dmas=false;
@@ -6493,7 +8472,7 @@ static FORCE_INLINE void nds_tick_dma(nds_t*nds, int last_tick){
             if(cnt==0)cnt =0x200000;
           }
           nds_io_store16(nds,cpu,GBA_DMA0CNT_L+12*i,cnt);
-          if(nds->dma_log)fprintf(nds->dma_log,"DMA[%d][%d]: Src: 0x%08x DST: 0x%08x Cnt:%d mode: %d\n",cpu,i,nds->dma[cpu][i].source_addr,nds->dma[cpu][i].dest_addr,cnt,mode);
+          nds_log_event(nds,SB_EVENT_DMA,cpu|(i<<8)|(mode<<16),nds->dma[cpu][i].source_addr,nds->dma[cpu][i].dest_addr,cnt);
           //printf("DMA[%d][%d]: Src: 0x%08x DST: 0x%08x Cnt:%d mode: %d\n",cpu,i,nds->dma[cpu][i].source_addr,nds->dma[cpu][i].dest_addr,cnt,mode);
         }
         
@@ -6529,28 +8508,49 @@ static FORCE_INLINE void nds_tick_dma(nds_t*nds, int last_tick){
           // TODO: There in theory should be separate latches per DMA, but that breaks Hello Kitty
           // and Tomb Raider
           if(nds->dma[cpu][i].current_transaction<cnt){
+            // Consecutive transfers between TLB mapped memory run in one call as long as they
+            // finish before the next event, each charged the cycles it would take alone
+            bool higher_pending = nds->activate_dmas;
             nds->dma_processed[cpu]|=true;
             nds->activate_dmas|=true;
-            int x = nds->dma[cpu][i].current_transaction++;
-            int dst_addr = dst+x*transfer_bytes*dst_dir;
-            int src_addr = src+x*transfer_bytes*src_dir;
-            if(type){
-              if(src_addr>=0x02000000){
-                if(cpu==NDS_ARM7)nds->dma[cpu][i].latched_transfer = nds7_read32(nds,src_addr);
-                else nds->dma[cpu][i].latched_transfer = nds9_read32(nds,src_addr);
+            int burst_budget = higher_pending||mode==0x7? 0: -1;
+            int burst_start_cycles = nds->mem.slow_bus_cycles;
+            // Instant card loads drain the card block in one go with no bus time, like a memcpy
+            bool instant_card = nds->instant_card&&((mode==5&&cpu==NDS_ARM9)||(mode==2&&cpu==NDS_ARM7));
+            int burst_cycles = 0;
+            do{
+              int bus_cycles = nds->mem.slow_bus_cycles;
+              int x = nds->dma[cpu][i].current_transaction++;
+              SB_PERF_COUNT(&nds->perf,SB_COUNTER_DMA_BYTES,transfer_bytes);
+              int dst_addr = dst+x*transfer_bytes*dst_dir;
+              int src_addr = src+x*transfer_bytes*src_dir;
+              if(type){
+                if(src_addr>=0x02000000){
+                  if(cpu==NDS_ARM7)nds->dma[cpu][i].latched_transfer = nds7_read32(nds,src_addr);
+                  else nds->dma[cpu][i].latched_transfer = nds9_read32(nds,src_addr);
+                }
+                if(cpu==NDS_ARM7)nds7_write32(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
+                else nds9_write32(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
+              }else{
+                int v = 0;
+                if(src_addr>=0x02000000){
+                  if(cpu==NDS_ARM7)v=nds->dma[cpu][i].latched_transfer = nds7_read16(nds,src_addr)&0xffff;
+                  else v=nds->dma[cpu][i].latched_transfer = nds9_read16(nds,src_addr)&0xffff;
+                  nds->dma[cpu][i].latched_transfer |= nds->dma[cpu][i].latched_transfer<<16;
+                }else v = nds->dma[cpu][i].latched_transfer>>(((dst_addr)&0x3)*8);
+                if(cpu==NDS_ARM7)nds7_write16(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
+                else nds9_write16(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
               }
-              if(cpu==NDS_ARM7)nds7_write32(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
-              else nds9_write32(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
-            }else{
-              int v = 0;
-              if(src_addr>=0x02000000){
-                if(cpu==NDS_ARM7)v=nds->dma[cpu][i].latched_transfer = nds7_read16(nds,src_addr)&0xffff;
-                else v=nds->dma[cpu][i].latched_transfer = nds9_read16(nds,src_addr)&0xffff;
-                nds->dma[cpu][i].latched_transfer |= nds->dma[cpu][i].latched_transfer<<16;
-              }else v = nds->dma[cpu][i].latched_transfer>>(((dst_addr)&0x3)*8);
-              if(cpu==NDS_ARM7)nds7_write16(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
-              else nds9_write16(nds,dst_addr,nds->dma[cpu][i].latched_transfer);
-            }
+              bus_cycles = nds->mem.slow_bus_cycles-bus_cycles;
+              burst_cycles += bus_cycles? bus_cycles: 1;
+              if(burst_budget<0)burst_budget=nds_dma_burst_budget(nds,cpu);
+              // A transfer costs at most two 4 cycle accesses
+            }while(nds->dma[cpu][i].current_transaction<cnt&&(instant_card? nds->mem.card_transfer_bytes>0:
+                   burst_cycles+8<burst_budget&&
+                   nds_dma_burst_mapped(nds,cpu,src+nds->dma[cpu][i].current_transaction*transfer_bytes*src_dir,
+                                                dst+nds->dma[cpu][i].current_transaction*transfer_bytes*dst_dir)));
+            if(instant_card)nds->mem.slow_bus_cycles = burst_start_cycles;
+            else if(burst_cycles>1)nds->mem.slow_bus_cycles = burst_start_cycles+burst_cycles;
           }
         }
 
@@ -6743,6 +8743,15 @@ static FORCE_INLINE void nds_tick_interrupts(nds_t*nds){
     nds_update_interrupt_lines(nds);
   }
 }
+// Moves the pipeline ticks cycles ahead, none of them may deliver a stage
+static FORCE_INLINE void nds_skip_interrupts(nds_t*nds, int ticks){
+  if(!nds->active_if_pipe_stages||ticks<=0)return;
+  for(int i=0;i<5;++i){
+    nds->nds9_pipelined_if[i]= i+ticks<5? nds->nds9_pipelined_if[i+ticks]: 0;
+    nds->nds7_pipelined_if[i]= i+ticks<5? nds->nds7_pipelined_if[i+ticks]: 0;
+  }
+  nds->active_if_pipe_stages>>=ticks;
+}
 static uint8_t nds_bin_to_bcd(uint8_t bin){
   bin%=100;
   return (bin%10)|((bin/10)<<4);
@@ -6758,169 +8767,320 @@ void nds_tick_rtc(nds_t*nds){
   nds->rtc.year  = nds_bin_to_bcd(tm->tm_year%100);
   nds->rtc.day_of_week=nds_bin_to_bcd(tm->tm_wday);
 }
-static FORCE_INLINE void nds_tick_audio(nds_t*nds, sb_emu_state_t*emu){
-
+// Returns the cache entry for an ADPCM sample in main RAM, creating an empty one on a miss.
+// NULL if the sample can't be cached.
+static nds_adpcm_cache_entry_t* nds_adpcm_cache_lookup(nds_t* nds, uint32_t sad, uint32_t tot_samps, uint32_t pnt){
+  nds_adpcm_cache_t* cache = nds->audio.adpcm_cache;
+  if(!cache||(sad>>24)!=0x2||tot_samps==0||tot_samps>NDS_ADPCM_CACHE_SAMPLES/4)return NULL;
+  sad&=4*1024*1024-1;
+  if(sad+4+tot_samps/2>=4*1024*1024)return NULL;
+  if(cache->generation!=nds->audio.adpcm_cache_generation||cache->states_used+tot_samps>NDS_ADPCM_CACHE_SAMPLES||
+     cache->num_entries>=NDS_ADPCM_CACHE_ENTRIES*3/4){
+    memset(cache->entries,0,sizeof(cache->entries));
+    memset(cache->source_pages,0,sizeof(cache->source_pages));
+    cache->states_used = cache->num_entries = 0;
+    cache->generation = nds->audio.adpcm_cache_generation;
+  }
+  uint32_t hash = ((sad^(tot_samps<<8)^(pnt<<20))*0x9E3779B1u)>>24;
+  for(int probe=0;probe<NDS_ADPCM_CACHE_ENTRIES;++probe){
+    nds_adpcm_cache_entry_t* entry = cache->entries+((hash+probe)%NDS_ADPCM_CACHE_ENTRIES);
+    if(entry->used){
+      if(!entry->dropped&&entry->sad==sad&&entry->tot_samps==tot_samps&&entry->pnt==pnt)return entry;
+      continue;
+    }
+    entry->used = true;
+    entry->dropped = false;
+    entry->sad = sad;
+    entry->tot_samps = tot_samps;
+    entry->pnt = pnt;
+    entry->offset = cache->states_used;
+    entry->decoded = 0;
+    cache->states_used+=tot_samps;
+    cache->num_entries++;
+    for(uint32_t p=sad>>NDS_ADPCM_CACHE_PAGE_SHIFT;p<=(sad+4+tot_samps/2)>>NDS_ADPCM_CACHE_PAGE_SHIFT;++p)
+      cache->source_pages[p/32]|=1u<<(p&31);
+    // Entries added after a save state was made must not survive loading it
+    nds_invalidate_adpcm_cache(nds);
+    cache->generation = nds->audio.adpcm_cache_generation;
+    return entry;
+  }
+  return NULL;
+}
+// Advances channel c by n output samples and writes its volume scaled output to out.
+// Returns false if the channel was silent for the whole block.
+static const int16_t nds_adpcm_table[89] ={
+  0x0007, 0x0008, 0x0009, 0x000A, 0x000B, 0x000C, 0x000D, 0x000E, 
+  0x0010, 0x0011, 0x0013, 0x0015, 0x0017, 0x0019, 0x001C, 0x001F, 
+  0x0022, 0x0025, 0x0029, 0x002D, 0x0032, 0x0037, 0x003C, 0x0042,
+  0x0049, 0x0050, 0x0058, 0x0061, 0x006B, 0x0076, 0x0082, 0x008F, 
+  0x009D, 0x00AD, 0x00BE, 0x00D1, 0x00E6, 0x00FD, 0x0117, 0x0133,
+  0x0151, 0x0173, 0x0198, 0x01C1, 0x01EE, 0x0220, 0x0256, 0x0292,
+  0x02D4, 0x031C, 0x036C, 0x03C3, 0x0424, 0x048E, 0x0502, 0x0583,
+  0x0610, 0x06AB, 0x0756, 0x0812, 0x08E0, 0x09C3, 0x0ABD, 0x0BD0,
+  0x0CFF, 0x0E4C, 0x0FBA, 0x114C, 0x1307, 0x14EE, 0x1706, 0x1954,
+  0x1BDC, 0x1EA5, 0x21B6, 0x2515, 0x28CA, 0x2CDF, 0x315B, 0x364B,
+  0x3BB9, 0x41B2, 0x4844, 0x4F7E, 0x5771, 0x602F, 0x69CE, 0x7462,
+  0x7FFF
+};
+static const int nds_adpcm_indextable[8]={ -1, -1, -1, -1, 2, 4, 6, 8 };
+// With out NULL the channel is only advanced, keeping its position, ADPCM state and enable bit exact
+static bool nds_audio_decode_channel(nds_t*nds, sb_emu_state_t*emu, int c, float* out, int n){
   nds_audio_t* audio = &nds->audio;
-  uint64_t current_sim_time =nds->current_clock*64;
-
-  while(audio->current_sample_generated_time < current_sim_time){
-    uint64_t prev_cycles = audio->current_sample_generated_time;
-    audio->current_sample_generated_time+=33513982*64/SE_AUDIO_SAMPLE_RATE;
-    uint64_t cycles_since_tick=(audio->current_sample_generated_time-prev_cycles)/64; 
-
-    const float lowpass_coef = 0.999;
-
-    float l = 0, r = 0; 
-    for(int c = 0; c<16;++c){
-      uint32_t cnt = nds7_io_read32(nds,NDS7_SOUND0_CNT+c*16);
-      bool enable = SB_BFE(cnt,31,1);
-      uint32_t tmr = nds7_io_read16(nds,NDS7_SOUND0_TMR+c*16)*2;
-      int format =  SB_BFE(cnt,29,2);//(0=PCM8, 1=PCM16, 2=IMA-ADPCM, 3=PSG/Noise);
-      if(!enable){
-        audio->channel[c].sample=0;
-        audio->channel[c].lfsr = 0x7FFF;
-        audio->channel[c].timer = tmr;
-        emu->audio_channel_output[c] = emu->audio_channel_output[c]*lowpass_coef;
-        continue;
-      }
-      uint32_t sad = nds7_io_read32(nds,NDS7_SOUND0_SAD+c*16);
-      uint16_t pnt = nds7_io_read16(nds,NDS7_SOUND0_PNT+c*16);
-      uint16_t len = nds7_io_read32(nds,NDS7_SOUND0_LEN+c*16);
-      uint32_t tot_samps = len*4;
+  const float lowpass_coef = 0.999;
+  uint32_t cnt = nds7_io_read32(nds,NDS7_SOUND0_CNT+c*16);
+  uint32_t tmr = nds7_io_read16(nds,NDS7_SOUND0_TMR+c*16)*2;
+  if(!SB_BFE(cnt,31,1)){
+    // Register writes flush the mixer, so a disabled channel stays off for the whole block
+    audio->channel[c].sample=0;
+    audio->channel[c].lfsr = 0x7FFF;
+    audio->channel[c].timer = tmr;
+    if(out)for(int i=0;i<n;++i)emu->audio_channel_output[c] = emu->audio_channel_output[c]*lowpass_coef;
+    return false;
+  }
+  int format =  SB_BFE(cnt,29,2);//(0=PCM8, 1=PCM16, 2=IMA-ADPCM, 3=PSG/Noise);
+  uint32_t sad = nds7_io_read32(nds,NDS7_SOUND0_SAD+c*16);
+  uint16_t pnt = nds7_io_read16(nds,NDS7_SOUND0_PNT+c*16);
+  uint16_t len = nds7_io_read32(nds,NDS7_SOUND0_LEN+c*16);
+  uint32_t tot_samps = len*4;
+  switch(format){
+    case 0: tot_samps = (len+pnt)*4; pnt*=4;break;
+    case 1: tot_samps = (len+pnt)*2; pnt*=2;break;
+    case 2: tot_samps = 8*(len+pnt-1); pnt=(pnt-1)*8;break;
+    case 3: tot_samps = 8;  break;
+  }
+  uint32_t vol_mul = SB_BFE(cnt,0,7);
+  uint32_t vol_div = SB_BFE(cnt,8,2);
+  float div_table[4]={1.0,0.5,0.25,1.0/16.};
+  float vol = vol_mul*div_table[vol_div]/128.;
+  nds_adpcm_cache_entry_t* adpcm_entry = format==2? nds_adpcm_cache_lookup(nds,sad,tot_samps,pnt): NULL;
+  uint32_t* adpcm_states = adpcm_entry? nds->audio.adpcm_cache->states+adpcm_entry->offset: NULL;
+  for(int i=0;i<n;++i){
+    bool enable = SB_BFE(cnt,31,1);
+    if(!enable){
+      audio->channel[c].sample=0;
+      audio->channel[c].lfsr = 0x7FFF;
+      audio->channel[c].timer = tmr;
+      if(!out)break;
+      emu->audio_channel_output[c] = emu->audio_channel_output[c]*lowpass_coef;
+      out[i]=0;
+      continue;
+    }
+    if(out){
+      float v = 0; 
       switch(format){
-        case 0: tot_samps = (len+pnt)*4; pnt*=4;break;
-        case 1: tot_samps = (len+pnt)*2; pnt*=2;break;
-        case 2: tot_samps = 8*(len+pnt-1); pnt=(pnt-1)*8;break;
-        case 3: tot_samps = 8;  break;
+        case 0: v= ((int8_t)nds7_read8(nds,sad+audio->channel[c].sample))/128.;break;
+        case 1: v= ((int16_t)nds7_read16(nds,sad+audio->channel[c].sample*2))/32768.;break;
+        case 2: v= ((int16_t)audio->channel[c].adpcm_sample) / 32768.0;break;
+        case 3:
+        if(c>=8&&c<=13)v= (audio->channel[c].sample<SB_BFE(cnt,24,3))*2.-1.;//Todo: add antialiasing
+        else if(c==14||c==15){ //PSG Noise
+          if(audio->channel[c].lfsr&1){
+            v = -1.;
+            audio->channel[c].lfsr^=0x6000<<1;
+          }else v= 1;
+          audio->channel[c].lfsr>>=1;
+        }
+        break; 
       }
-      if(enable){
-        float v = 0; 
-        switch(format){
-          case 0: v= ((int8_t)nds7_read8(nds,sad+audio->channel[c].sample))/128.;break;
-          case 1: v= ((int16_t)nds7_read16(nds,sad+audio->channel[c].sample*2))/32768.;break;
-          case 2: v= ((int16_t)audio->channel[c].adpcm_sample) / 32768.0;break;
-          case 3:
-          if(c>=8&&c<=13)v= (audio->channel[c].sample<SB_BFE(cnt,24,3))*2.-1.;//Todo: add antialiasing
-          else if(c==14||c==15){ //PSG Noise
-            if(audio->channel[c].lfsr&1){
-              v = -1.;
-              audio->channel[c].lfsr^=0x6000<<1;
-            }else v= 1;
-            audio->channel[c].lfsr>>=1;
-          }
-          break; 
+      v*=vol;
+      out[i]=v;
+      emu->audio_channel_output[c] = emu->audio_channel_output[c]*lowpass_coef + fabs(v)*(1.0-lowpass_coef);
+    }
+    audio->channel[c].timer+=NDS_AUDIO_SAMPLE_CYCLES;
+    while(audio->channel[c].timer>0x1ffff){
+      audio->channel[c].timer-=0x20000;
+      audio->channel[c].timer+=tmr;
+      if(audio->channel[c].sample+1>=tot_samps){
+        int repeat_mode = SB_BFE(cnt,27,2);
+        switch(repeat_mode){
+          case 0: audio->channel[c].sample=0; enable=false;break; //Manual (TODO: Does this repeat?)
+          case 1: 
+            audio->channel[c].sample=pnt;
+            if(format==2){//ADPCM
+              audio->channel[c].adpcm_sample = audio->channel[c].adpcm_sample_latch;
+              audio->channel[c].adpcm_index = audio->channel[c].adpcm_index_latch;
+            }
+            break; //Infinite
+          case 2: audio->channel[c].sample=0;enable=false; break; //One Shot
+          case 3: audio->channel[c].sample=0;enable=false; break; //Reserved
+        }
+        if(format==3){enable=true;audio->channel[c].sample=0;}
+        if(!enable){
+          cnt&=~(1u<<31);
+          nds7_io_store32(nds,NDS7_SOUND0_CNT+c*16,cnt);
         }
-        uint32_t vol_mul = SB_BFE(cnt,0,7);
-        uint32_t vol_div = SB_BFE(cnt,8,2);
-        uint16_t pan = SB_BFE(cnt,16,7);
-        float div_table[4]={1.0,0.5,0.25,1.0/16.};
-        v*=vol_mul*div_table[vol_div]/128.;
-        emu->audio_channel_output[c] = emu->audio_channel_output[c]*lowpass_coef + fabs(v)*(1.0-lowpass_coef);
-        r+=v*pan/128.;
-        l+=v*(128-pan)/128.;
       }
-      audio->channel[c].timer+=cycles_since_tick;
-      while(audio->channel[c].timer>0x1ffff){
-        audio->channel[c].timer-=0x20000;
-        audio->channel[c].timer+=tmr;
-        if(audio->channel[c].sample+1>=tot_samps){
-          int repeat_mode = SB_BFE(cnt,27,2);
-          switch(repeat_mode){
-            case 0: audio->channel[c].sample=0; enable=false;break; //Manual (TODO: Does this repeat?)
-            case 1: 
-              audio->channel[c].sample=pnt;
-              if(format==2){//ADPCM
-                audio->channel[c].adpcm_sample = audio->channel[c].adpcm_sample_latch;
-                audio->channel[c].adpcm_index = audio->channel[c].adpcm_index_latch;
-              }
-              break; //Infinite
-            case 2: audio->channel[c].sample=0;enable=false; break; //One Shot
-            case 3: audio->channel[c].sample=0;enable=false; break; //Reserved
-          }
-          if(format==3){enable=true;audio->channel[c].sample=0;}
-          if(!enable){
-            cnt&=~(1u<<31);
-            nds7_io_store32(nds,NDS7_SOUND0_CNT+c*16,cnt);
-          }
+      if(format==2){
+        if(audio->channel[c].sample==pnt){
+          audio->channel[c].adpcm_index_latch=audio->channel[c].adpcm_index;
+          audio->channel[c].adpcm_sample_latch=audio->channel[c].adpcm_sample;
         }
-        if(format==2){
-            if(audio->channel[c].sample==pnt){
-              audio->channel[c].adpcm_index_latch=audio->channel[c].adpcm_index;
-              audio->channel[c].adpcm_sample_latch=audio->channel[c].adpcm_sample;
-            }
-            static const int16_t adpcm_table[89] ={
-              0x0007, 0x0008, 0x0009, 0x000A, 0x000B, 0x000C, 0x000D, 0x000E, 
-              0x0010, 0x0011, 0x0013, 0x0015, 0x0017, 0x0019, 0x001C, 0x001F, 
-              0x0022, 0x0025, 0x0029, 0x002D, 0x0032, 0x0037, 0x003C, 0x0042,
-              0x0049, 0x0050, 0x0058, 0x0061, 0x006B, 0x0076, 0x0082, 0x008F, 
-              0x009D, 0x00AD, 0x00BE, 0x00D1, 0x00E6, 0x00FD, 0x0117, 0x0133,
-              0x0151, 0x0173, 0x0198, 0x01C1, 0x01EE, 0x0220, 0x0256, 0x0292,
-              0x02D4, 0x031C, 0x036C, 0x03C3, 0x0424, 0x048E, 0x0502, 0x0583,
-              0x0610, 0x06AB, 0x0756, 0x0812, 0x08E0, 0x09C3, 0x0ABD, 0x0BD0,
-              0x0CFF, 0x0E4C, 0x0FBA, 0x114C, 0x1307, 0x14EE, 0x1706, 0x1954,
-              0x1BDC, 0x1EA5, 0x21B6, 0x2515, 0x28CA, 0x2CDF, 0x315B, 0x364B,
-              0x3BB9, 0x41B2, 0x4844, 0x4F7E, 0x5771, 0x602F, 0x69CE, 0x7462,
-              0x7FFF
-            };
-            static const int adpcm_indextable[8]={ -1, -1, -1, -1, 2, 4, 6, 8 };
-            if(audio->channel[c].sample==0){
-              uint32_t header = nds7_read32(nds,sad);
-              audio->channel[c].adpcm_sample = (int16_t)(header & 0xFFFF);
-              audio->channel[c].adpcm_index = (header >> 16) & 0x7F;
-              if(audio->channel[c].adpcm_index>88)audio->channel[c].adpcm_index=88;
-            }
-            uint8_t data = nds7_read8(nds,sad+audio->channel[c].sample/2+4);
-            data = (data>>((audio->channel[c].sample&1)*4))&0xf;
-
-            int16_t entry = adpcm_table[audio->channel[c].adpcm_index];
-            int16_t diff = entry >> 3;
-            if (data & 1) diff += entry >> 2;
-            if (data & 2) diff += entry >> 1;
-            if (data & 4) diff += entry;
-
-            if (data & 8) audio->channel[c].adpcm_sample = audio->channel[c].adpcm_sample - diff;
-            else audio->channel[c].adpcm_sample = audio->channel[c].adpcm_sample + diff;
-            if(audio->channel[c].adpcm_sample>+0x7FFF)audio->channel[c].adpcm_sample=0x7fff;
-            if(audio->channel[c].adpcm_sample<-0x7FFF)audio->channel[c].adpcm_sample=-0x7fff;
-            int new_index = audio->channel[c].adpcm_index + adpcm_indextable[data & 7];
-            if(new_index>88)new_index=88;
-            if(new_index<0)new_index=0;
-            audio->channel[c].adpcm_index =new_index;
+        uint32_t sample = audio->channel[c].sample;
+        if(adpcm_entry&&sample<adpcm_entry->decoded){
+          uint32_t state = adpcm_states[sample];
+          audio->channel[c].adpcm_sample = (int16_t)(state&0xffff);
+          audio->channel[c].adpcm_index = state>>16;
+          audio->channel[c].sample+=1;
+          continue;
+        }
+        uint32_t prev_state = (audio->channel[c].adpcm_sample&0xffff)|(audio->channel[c].adpcm_index<<16);
+        if(audio->channel[c].sample==0){
+          uint32_t header = nds7_read32(nds,sad);
+          audio->channel[c].adpcm_sample = (int16_t)(header & 0xFFFF);
+          audio->channel[c].adpcm_index = (header >> 16) & 0x7F;
+          if(audio->channel[c].adpcm_index>88)audio->channel[c].adpcm_index=88;
+        }
+        uint8_t data = nds7_read8(nds,sad+audio->channel[c].sample/2+4);
+        data = (data>>((audio->channel[c].sample&1)*4))&0xf;
+
+        int16_t entry = nds_adpcm_table[audio->channel[c].adpcm_index];
+        int16_t diff = entry >> 3;
+        if (data & 1) diff += entry >> 2;
+        if (data & 2) diff += entry >> 1;
+        if (data & 4) diff += entry;
+
+        if (data & 8) audio->channel[c].adpcm_sample = audio->channel[c].adpcm_sample - diff;
+        else audio->channel[c].adpcm_sample = audio->channel[c].adpcm_sample + diff;
+        if(audio->channel[c].adpcm_sample>+0x7FFF)audio->channel[c].adpcm_sample=0x7fff;
+        if(audio->channel[c].adpcm_sample<-0x7FFF)audio->channel[c].adpcm_sample=-0x7fff;
+        int new_index = audio->channel[c].adpcm_index + nds_adpcm_indextable[data & 7];
+        if(new_index>88)new_index=88;
+        if(new_index<0)new_index=0;
+        audio->channel[c].adpcm_index =new_index;
+        // Only extend the entry from a channel that followed it, others may have decoded stale data
+        if(adpcm_entry&&sample==adpcm_entry->decoded&&sample<adpcm_entry->tot_samps&&(sample==0||adpcm_states[sample-1]==prev_state)){
+          adpcm_states[sample] = (audio->channel[c].adpcm_sample&0xffff)|(audio->channel[c].adpcm_index<<16);
+          adpcm_entry->decoded++;
         }
-        audio->channel[c].sample+=1;
       }
+      audio->channel[c].sample+=1;
+    }
+  }
+  return true;
+}
+// Decodes each channel for the whole block before panning it into the mix, the mix loops
+// are kept branch free over contiguous floats so they compile to vector code
+static void nds_mix_audio_block(nds_t*nds, sb_emu_state_t*emu, int n){
+  nds_audio_t* audio = &nds->audio;
+  const float lowpass_coef = 0.999;
+  float l[NDS_AUDIO_BLOCK_SAMPLES]={0}, r[NDS_AUDIO_BLOCK_SAMPLES]={0};
+  float channel[NDS_AUDIO_BLOCK_SAMPLES];
+  if(emu->audio_disabled){
+    for(int c = 0; c<16;++c)nds_audio_decode_channel(nds,emu,c,NULL,n);
+    return;
+  }
+  for(int c = 0; c<16;++c){
+    uint16_t pan = SB_BFE(nds7_io_read32(nds,NDS7_SOUND0_CNT+c*16),16,7);
+    if(!nds_audio_decode_channel(nds,emu,c,channel,n))continue;
+    float pan_r = pan/128., pan_l = (128-pan)/128.;
+    for(int i=0;i<n;++i){
+      r[i]+=channel[i]*pan_r;
+      l[i]+=channel[i]*pan_l;
     }
+  }
+  for(int i=0;i<n;++i){
     if((sb_ring_buffer_size(&emu->audio_ring_buff)+3>SB_AUDIO_RING_BUFFER_SIZE)) continue;
-
     // Clipping
-    if(l>1.0)l=1;
-    if(r>1.0)r=1;
-    if(l<-1.0)l=-1;
-    if(r<-1.0)r=-1;
-    l*=0.5;
-    r*=0.5;
-
-    // Quantization
-    unsigned write_entry0 = (emu->audio_ring_buff.write_ptr++)%SB_AUDIO_RING_BUFFER_SIZE;
-    unsigned write_entry1 = (emu->audio_ring_buff.write_ptr++)%SB_AUDIO_RING_BUFFER_SIZE;
-
-    emu->mix_l_volume = emu->mix_l_volume*lowpass_coef + fabs(l)*(1.0-lowpass_coef);
-    emu->mix_r_volume = emu->mix_r_volume*lowpass_coef + fabs(r)*(1.0-lowpass_coef); 
+    float sl = l[i]>1.0?1.0: l[i]<-1.0? -1.0: l[i];
+    float sr = r[i]>1.0?1.0: r[i]<-1.0? -1.0: r[i];
+    sl*=0.5;
+    sr*=0.5;
+    emu->mix_l_volume = emu->mix_l_volume*lowpass_coef + fabs(sl)*(1.0-lowpass_coef);
+    emu->mix_r_volume = emu->mix_r_volume*lowpass_coef + fabs(sr)*(1.0-lowpass_coef); 
+    sb_resampler_push(&audio->resampler,&emu->audio_ring_buff,sl,sr,33513982./NDS_AUDIO_SAMPLE_CYCLES/SE_AUDIO_SAMPLE_RATE,emu->audio_low_quality);
+  }
+}
+// Produces every sample that is due by the current clock
+static void nds_flush_audio(nds_t* nds){
+  nds_audio_t* audio = &nds->audio;
+  if(!audio->emu)return;
+  const uint64_t sample_time = NDS_AUDIO_SAMPLE_CYCLES*64;
+  uint64_t current_sim_time =nds->current_clock*64;
+  while(audio->current_sample_generated_time < current_sim_time){
+    uint64_t pending = (current_sim_time-audio->current_sample_generated_time+sample_time-1)/sample_time;
+    int max_n = audio->emu->audio_disabled? NDS_AUDIO_DISABLED_BLOCK_SAMPLES: NDS_AUDIO_BLOCK_SAMPLES;
+    int n = pending>max_n? max_n: pending;
+    nds_mix_audio_block(nds,audio->emu,n);
+    audio->current_sample_generated_time+=n*sample_time;
+  }
+}
+static FORCE_INLINE void nds_tick_audio(nds_t*nds){
+  // Samples are batched until a block is due or the ARM7 touches the sound registers
+  uint64_t block_time = (NDS_AUDIO_BLOCK_SAMPLES-1)*NDS_AUDIO_SAMPLE_CYCLES*64;
+  if(nds->audio.emu&&nds->audio.emu->audio_disabled)block_time = (NDS_AUDIO_DISABLED_BLOCK_SAMPLES-1)*NDS_AUDIO_SAMPLE_CYCLES*64;
+  if(SB_UNLIKELY(nds->current_clock*64 > nds->audio.current_sample_generated_time+block_time))nds_flush_audio(nds);
+}
 
-    emu->audio_ring_buff.data[write_entry0] = l*32760;
-    emu->audio_ring_buff.data[write_entry1] = r*32760;
+// Threaded ARM7 bus. Until the ARM9 finished the slice the ARM7 may only touch ARM7 WRAM and its
+// BIOS, which nothing else maps. The first other access waits for the ARM9, from then on the ARM7
+// owns the whole machine until the slice ends. The join point only depends on the ARM7 instruction
+// stream, so the result doesn't depend on how the host schedules the threads.
+static void nds7_thread_join(nds_t* nds){
+  nds_host_t* h = &nds->host;
+  if(h->arm7_joined)return;
+  uint32_t spins = 0;
+  while(sb_atomic_load_acquire_u32(&h->arm9_done)!=h->arm7_slice)sb_spin_wait(&spins);
+  h->arm7_joined = true;
+}
+static FORCE_INLINE uint32_t nds7_threaded_transaction(nds_t* nds, uint32_t addr, uint32_t data, int transaction_type){
+  if(SB_UNLIKELY(!nds->host.arm7_joined)){
+    if(addr>=0x03800000&&addr<0x04000000){
+      if(transaction_type&NDS_MEM_WRITE)nds->host.arm7_side_effects++;
+      return nds_apply_mem_op(nds->mem.wram,32*1024+((addr-0x03800000)&(64*1024-1)),data,transaction_type);
+    }
+    if(addr<0x4000&&!(transaction_type&NDS_MEM_WRITE)){
+      if(nds->arm7.registers[PC]<0x4000)nds->mem.arm7_bios_word = nds_apply_mem_op(nds->mem.nds7_bios,addr,data,transaction_type);
+      return nds->mem.arm7_bios_word;
+    }
+    nds7_thread_join(nds);
   }
+  return nds7_process_memory_transaction(nds,addr,data,transaction_type);
+}
+uint32_t nds7_threaded_read32(void* user_data, uint32_t address){return nds7_threaded_transaction((nds_t*)user_data,address,0,NDS_MEM_4B|NDS_MEM_ARM7);}
+uint32_t nds7_threaded_read16(void* user_data, uint32_t address){return (uint16_t)nds7_threaded_transaction((nds_t*)user_data,address,0,NDS_MEM_2B|NDS_MEM_ARM7);}
+uint8_t nds7_threaded_read8(void* user_data, uint32_t address){return nds7_threaded_transaction((nds_t*)user_data,address,0,NDS_MEM_1B|NDS_MEM_ARM7);}
+uint32_t nds7_threaded_read32_seq(void* user_data, uint32_t address,bool is_sequential){
+  return nds7_threaded_transaction((nds_t*)user_data,address,0,NDS_MEM_4B|NDS_MEM_ARM7|NDS_MEM_CODE|(is_sequential?NDS_MEM_SEQ:0));
+}
+uint32_t nds7_threaded_read16_seq(void* user_data, uint32_t address,bool is_sequential){
+  return (uint16_t)nds7_threaded_transaction((nds_t*)user_data,address,0,NDS_MEM_2B|NDS_MEM_ARM7|NDS_MEM_CODE|(is_sequential?NDS_MEM_SEQ:0));
+}
+void nds7_threaded_write32(void* user_data, uint32_t address, uint32_t data){nds7_threaded_transaction((nds_t*)user_data,address,data,NDS_MEM_WRITE|NDS_MEM_4B|NDS_MEM_ARM7);}
+void nds7_threaded_write16(void* user_data, uint32_t address, uint16_t data){nds7_threaded_transaction((nds_t*)user_data,address,data,NDS_MEM_WRITE|NDS_MEM_2B|NDS_MEM_ARM7);}
+void nds7_threaded_write8(void* user_data, uint32_t address, uint8_t data){nds7_threaded_transaction((nds_t*)user_data,address,data,NDS_MEM_WRITE|NDS_MEM_1B|NDS_MEM_ARM7);}
+static bool nds7_threaded_hle_swi(void* user_data, uint32_t swi_number){
+  nds7_thread_join((nds_t*)user_data);
+  return nds7_hle_swi(user_data,swi_number);
+}
+uint32_t nds7_threaded_coprocessor_read(void* user_data, int coproc,int opcode,int Cn, int Cm,int Cp){
+  nds7_thread_join((nds_t*)user_data);
+  return nds_coprocessor_read(user_data,coproc,opcode,Cn,Cm,Cp);
+}
+void nds7_threaded_coprocessor_write(void* user_data, int coproc,int opcode,int Cn, int Cm,int Cp,uint32_t data){
+  nds7_thread_join((nds_t*)user_data);
+  nds_coprocessor_write(user_data,coproc,opcode,Cn,Cm,Cp,data);
+}
+void nds7_threaded_breakpoint(void* user_data){
+  nds7_thread_join((nds_t*)user_data);
+  nds7_cpu_breakpoint(user_data);
+}
+static void nds_set_arm7_bus(nds_t* nds, bool threaded){
+  nds->arm7.read8      = threaded? nds7_threaded_read8: nds7_arm_read8;
+  nds->arm7.read16     = threaded? nds7_threaded_read16: nds7_arm_read16;
+  nds->arm7.read32     = threaded? nds7_threaded_read32: nds7_arm_read32;
+  nds->arm7.read16_seq = threaded? nds7_threaded_read16_seq: nds7_arm_read16_seq;
+  nds->arm7.read32_seq = threaded? nds7_threaded_read32_seq: nds7_arm_read32_seq;
+  nds->arm7.write8     = threaded? nds7_threaded_write8: nds7_arm_write8;
+  nds->arm7.write16    = threaded? nds7_threaded_write16: nds7_arm_write16;
+  nds->arm7.write32    = threaded? nds7_threaded_write32: nds7_arm_write32;
+  nds->arm7.coprocessor_read  = threaded? nds7_threaded_coprocessor_read: nds_coprocessor_read;
+  nds->arm7.coprocessor_write = threaded? nds7_threaded_coprocessor_write: nds_coprocessor_write;
+  nds->arm7.trigger_breakpoint = threaded? nds7_threaded_breakpoint: nds7_cpu_breakpoint;
+  if(nds->arm7.software_interrupt)nds->arm7.software_interrupt = threaded? nds7_threaded_hle_swi: nds7_hle_swi;
 }
 
 void nds_ptrs_init(nds_t* nds, nds_scratch_t* scratch, uint8_t* rom_data, size_t rom_size) {
-  nds->arm7.read8      = nds7_arm_read8;
-  nds->arm7.read16     = nds7_arm_read16;
-  nds->arm7.read32     = nds7_arm_read32;
-  nds->arm7.read16_seq = nds7_arm_read16_seq;
-  nds->arm7.read32_seq = nds7_arm_read32_seq;
-  nds->arm7.write8     = nds7_arm_write8;
-  nds->arm7.write16    = nds7_arm_write16;
-  nds->arm7.write32    = nds7_arm_write32;
+  nds_set_arm7_bus(nds,false);
   nds->arm9.read8      = nds9_arm_read8;
   nds->arm9.read16     = nds9_arm_read16;
   nds->arm9.read32     = nds9_arm_read32;
@@ -6929,9 +9089,10 @@ void nds_ptrs_init(nds_t* nds, nds_scratch_t* scratch, uint8_t* rom_data, size_t
   nds->arm9.write8     = nds9_arm_write8;
   nds->arm9.write16    = nds9_arm_write16;
   nds->arm9.write32    = nds9_arm_write32;
-  nds->arm9.coprocessor_read =  nds->arm7.coprocessor_read =nds_coprocessor_read;
-  nds->arm9.coprocessor_write=  nds->arm7.coprocessor_write=nds_coprocessor_write;
-  nds->arm7.trigger_breakpoint = nds7_cpu_breakpoint;
+  nds->arm7.block_ptr  = NULL;
+  nds->arm9.block_ptr  = nds9_arm_block_ptr;
+  nds->arm9.coprocessor_read = nds_coprocessor_read;
+  nds->arm9.coprocessor_write= nds_coprocessor_write;
   nds->arm9.trigger_breakpoint = nds9_cpu_breakpoint;
 
   nds->arm7.user_data = (void*)nds;
@@ -6943,18 +9104,190 @@ void nds_ptrs_init(nds_t* nds, nds_scratch_t* scratch, uint8_t* rom_data, size_t
   nds->mem.save_data = scratch->save_data;
   nds->mem.card_data = rom_data;
   nds->mem.card_size = rom_size;
+  nds->mem.card_cache = &scratch->card_cache;
+  nds->mem.dldi = &scratch->dldi;
   nds->framebuffer_top=scratch->framebuffer_top;
   nds->framebuffer_bottom=scratch->framebuffer_bottom;
   nds->framebuffer_3d_depth=scratch->framebuffer_3d_depth;
-  nds->framebuffer_3d=scratch->framebuffer_3d;
-  nds->framebuffer_3d_disp=scratch->framebuffer_3d_disp;
+  nds->framebuffer_3d=scratch->framebuffer_3d[!nds->gpu.framebuffer_3d_front];
+  nds->framebuffer_3d_disp=scratch->framebuffer_3d[nds->gpu.framebuffer_3d_front];
+  nds->framebuffer_3d_halo=scratch->framebuffer_3d_halo;
   nds->gpu.vert_buffer=scratch->vert_buffer;
+  nds->gpu.render_queue=&scratch->render_queue;
+  nds->gpu.deferred_raster=&scratch->deferred_raster;
+  nds->gpu.job_dispatch=scratch->job_dispatch;
+  nds->gpu.tex_cache=&scratch->tex_cache;
+  nds->gpu.geometry_cache=&scratch->geometry_cache;
+  nds->gpu.hires=&scratch->hires;
+  // The GX state may have been replaced by a save state load
+  nds_geometry_cache_invalidate(&scratch->geometry_cache,true,true);
+  nds->audio.adpcm_cache=&scratch->adpcm_cache;
+  if(nds->mem.tlb!=&scratch->tlb){
+    nds->mem.tlb = &scratch->tlb;
+    // Force a rebuild since the core may have been restored from a save state
+    scratch->tlb.nds = NULL;
+  }
+  nds_update_tlb(nds);
+  // OAM may have been replaced by a save state load or reset without going through the write hooks
+  nds->mem.sprite_bins = scratch->sprite_bins;
+  for(int i=0;i<2;++i)sb_validate_sprite_bins(&scratch->sprite_bins[i],nds->mem.oam+i*1024);
 }
 
+// Runs the ARM9 for up to max_ticks bus cycles. Slices end early on DMA requests, a full GX FIFO,
+// IPC accesses, bank switches and writes to shared main RAM pages so the other CPU observes them
+// with little delay. Returns the bus cycles consumed, arm7_steps is set to the number of steps the
+// ARM7 would have taken in lockstep.
+static FORCE_INLINE int nds_exec_arm9_slice(nds_t* nds, int max_ticks, arm7_idle_loop_t* arm9_idle_loop, int* arm7_steps){
+  int ticks = 0;
+  int steps = 0;
+  nds->cpu_sync_point = false;
+  while(ticks<max_ticks){
+    if(SB_UNLIKELY(nds->nds9_interrupt_line))arm7_process_interrupts(&nds->arm9);
+    if(nds->arm9.wait_for_interrupt){
+      // A halted ARM9 doesn't stall the bus for the rest of the slice
+      steps+=max_ticks-ticks;
+      ticks=max_ticks;
+      break;
+    }
+    nds->arm9.i_cycles=0;
+    uint32_t pc_before = nds->arm9.registers[PC];
+    arm9_exec_instruction(&nds->arm9);
+    if(arm9_idle_loop)arm7_idle_loop_update(arm9_idle_loop,&nds->arm9,pc_before,nds->mem.idle_loop_side_effects);
+    if(!nds->arm9.i_cycles){
+      pc_before = nds->arm9.registers[PC];
+      arm9_exec_instruction(&nds->arm9);
+      if(arm9_idle_loop)arm7_idle_loop_update(arm9_idle_loop,&nds->arm9,pc_before,nds->mem.idle_loop_side_effects);
+    }
+    nds->mem.slow_bus_cycles+=nds->arm9.i_cycles/2;
+    if(nds->mem.slow_bus_cycles)ticks+=nds->mem.slow_bus_cycles;
+    else{ticks++;steps++;}
+    nds->mem.slow_bus_cycles=0;
+    if(nds->activate_dmas||nds->cpu_sync_point||nds_gxfifo_size(nds)>=NDS_GXFIFO_SIZE)break;
+  }
+  nds->cpu_sync_point = false;
+  *arm7_steps = steps;
+  return ticks;
+}
+// Runs the ARM9 slice and then lets the ARM7 catch up. The ARM7 gets the bus cycles it would have
+// run in lockstep (the ARM9 steps without wait states) and pays for its own wait states out of them
+// the same way the ARM9 does, what it overshoots is taken off the next slice. Remaining skew against
+// lockstep: ARM7 wait states no longer stall the ARM9, the ARM7 sees the interrupt lines as the ARM9
+// left them at the end of its slice (IPC and other ARM9 raised IRQs arrive up to a slice early), and
+// budget left when a DMA or sync point ends the catch up early is dropped. Returns the bus cycles consumed.
+static int nds_exec_cpu_slice(nds_t* nds, int max_ticks, arm7_idle_loop_t* arm7_idle_loop, arm7_idle_loop_t* arm9_idle_loop){
+  int arm7_steps = 0;
+  int ticks = nds_exec_arm9_slice(nds,max_ticks,arm9_idle_loop,&arm7_steps);
+  int budget = arm7_steps-nds->arm7_ahead_ticks;
+  int arm7_ticks = 0;
+  while(arm7_ticks<budget){
+    if(SB_UNLIKELY(nds->nds7_interrupt_line))arm7_process_interrupts(&nds->arm7);
+    if(nds->arm7.wait_for_interrupt)break;
+    uint32_t pc_before = nds->arm7.registers[PC];
+    arm7_exec_instruction(&nds->arm7);
+    if(arm7_idle_loop)arm7_idle_loop_update(arm7_idle_loop,&nds->arm7,pc_before,nds->mem.idle_loop_side_effects);
+    arm7_ticks+=nds->mem.slow_bus_cycles? nds->mem.slow_bus_cycles: 1;
+    nds->mem.slow_bus_cycles=0;
+    if(nds->activate_dmas||nds->cpu_sync_point)break;
+  }
+  int ahead = arm7_ticks-budget;
+  nds->arm7_ahead_ticks = ahead>0? ahead: 0;
+  return ticks;
+}
+// ARM7 part of a threaded slice. Up to the join it sees the interrupt line and side effect counter
+// as they were when the slice started.
+static void nds_exec_arm7_slice(nds_t* nds){
+  nds_host_t* h = &nds->host;
+  arm7_idle_loop_t* arm7_idle_loop = h->arm7_idle_loop;
+  int steps = 0;
+  h->arm7_joined = false;
+  while(steps<h->arm7_budget){
+    if(SB_UNLIKELY(h->arm7_joined? nds->nds7_interrupt_line: h->arm7_irq_line))arm7_process_interrupts(&nds->arm7);
+    if(nds->arm7.wait_for_interrupt)break;
+    uint32_t pc_before = nds->arm7.registers[PC];
+    arm7_exec_instruction(&nds->arm7);
+    ++steps;
+    if(arm7_idle_loop)arm7_idle_loop_update(arm7_idle_loop,&nds->arm7,pc_before,h->arm7_joined? nds->mem.idle_loop_side_effects: h->arm7_side_effects);
+    if(h->arm7_joined&&(nds->activate_dmas||nds->cpu_sync_point))break;
+  }
+  // The ARM9 may still be running, the rest of the slice runs on the main thread
+  h->arm7_joined = true;
+  h->arm7_steps = steps;
+}
+static void nds_arm7_thread(void* user_data, int job_index){
+  nds_t* nds = (nds_t*)user_data;
+  nds_host_t* h = &nds->host;
+  uint32_t done = 0, spins = 0;
+  while(!sb_atomic_load_acquire_u32(&h->arm7_stop)){
+    if(sb_atomic_load_acquire_u32(&h->arm7_start)==done){sb_spin_wait(&spins);continue;}
+    spins = 0;
+    nds_exec_arm7_slice(nds);
+    sb_atomic_store_release_u32(&h->arm7_done,++done);
+  }
+  sb_atomic_store_release_u32(&h->arm7_thread_running,0);
+}
+// Runs the ARM7 on its own thread while the ARM9 runs its slice. The ARM7 gets the slice length as
+// budget, minus what it ran ahead of the ARM9 in earlier slices, so both CPUs advance by the same
+// emulated time on average no matter how the threads are scheduled.
+static int nds_exec_cpu_slice_threaded(nds_t* nds, int max_ticks, arm7_idle_loop_t* arm9_idle_loop){
+  nds_host_t* h = &nds->host;
+  int budget = max_ticks-nds->arm7_ahead_ticks;
+  bool arm7_runs = budget>0&&(!nds->arm7.wait_for_interrupt||nds->nds7_interrupt_line);
+  if(arm7_runs){
+    h->arm7_budget = budget;
+    h->arm7_irq_line = nds->nds7_interrupt_line;
+    h->arm7_side_effects = nds->mem.idle_loop_side_effects;
+    sb_atomic_store_release_u32(&h->arm7_start,++h->arm7_slice);
+  }
+  int arm7_steps = 0;
+  int ticks = nds_exec_arm9_slice(nds,max_ticks,arm9_idle_loop,&arm7_steps);
+  arm7_steps = 0;
+  if(arm7_runs){
+    sb_atomic_store_release_u32(&h->arm9_done,h->arm7_slice);
+    uint32_t spins = 0;
+    while(sb_atomic_load_acquire_u32(&h->arm7_done)!=h->arm7_slice)sb_spin_wait(&spins);
+    arm7_steps = h->arm7_steps;
+  }
+  int ahead = nds->arm7_ahead_ticks+arm7_steps-ticks;
+  nds->arm7_ahead_ticks = ahead>0? ahead: 0;
+  nds->mem.slow_bus_cycles=0;
+  return ticks;
+}
+static void nds_start_arm7_thread(nds_t* nds, nds_scratch_t* scratch, arm7_idle_loop_t* arm7_idle_loop){
+  nds_host_t* h = &nds->host;
+  h->arm7_start = h->arm9_done = h->arm7_done = h->arm7_slice = h->arm7_stop = 0;
+  h->arm7_thread_running = 1;
+  h->arm7_joined = true;
+  h->arm7_idle_loop = arm7_idle_loop;
+  nds_set_arm7_bus(nds,true);
+  scratch->job_start(nds_arm7_thread,nds);
+}
+static void nds_stop_arm7_thread(nds_t* nds){
+  nds_host_t* h = &nds->host;
+  sb_atomic_store_release_u32(&h->arm7_stop,1);
+  uint32_t spins = 0;
+  while(sb_atomic_load_acquire_u32(&h->arm7_thread_running))sb_spin_wait(&spins);
+  h->arm7_idle_loop = NULL;
+  nds_set_arm7_bus(nds,false);
+}
 void nds_tick(sb_emu_state_t* emu, nds_t* nds, nds_scratch_t* scratch){
   //printf("#####New Frame#####\n");
-  nds->ghosting_strength = fminf(fmaxf(0.0f,emu->screen_ghosting_strength),1.0f)*0.3;
   nds_ptrs_init(nds, scratch, emu->rom_data, emu->rom_size);
+  nds->mem.card_read = emu->rom_read;
+  nds->mem.card_read_user_data = emu->rom_read_user_data;
+  arm7_idle_loop_t* arm7_idle_loop = emu->cpu_idle_loop_skip? &scratch->arm7_idle_loop: NULL;
+  arm7_idle_loop_t* arm9_idle_loop = emu->cpu_idle_loop_skip? &scratch->arm9_idle_loop: NULL;
+  scratch->arm9_idle_loop.hint_pc = emu->idle_loop_hint_pc[0];
+  scratch->arm7_idle_loop.hint_pc = emu->idle_loop_hint_pc[1];
+  nds->arm7.software_interrupt = emu->nds_hle_bios? nds7_hle_swi: NULL;
+  nds->arm9.software_interrupt = emu->nds_hle_bios? nds9_hle_swi: NULL;
+  nds->ppu_job_dispatch = emu->nds_threaded_ppu? scratch->job_dispatch: NULL;
+  nds->instant_card = emu->nds_instant_card;
+  nds->mem.late_input = emu->late_input;
+  nds->gpu.video_capture = emu->video_capture;
+  nds->host.event_log = emu->event_log;
+  nds->audio.emu = emu;
+  // A swap is shown on the following frame, captures rasterize deferred swaps themselves
+  nds->gpu.raster_on_swap = emu->render_frame||emu->render_next_frame;
 
   nds_tick_rtc(nds);
   nds_tick_keypad(emu,nds);
@@ -6962,11 +9295,27 @@ void nds_tick(sb_emu_state_t* emu, nds_t* nds, nds_scratch_t* scratch){
   
   bool prev_vblank=true;
 
-  uint64_t* d = (uint64_t*)nds->mem.mmio_debug_access_buffer;
-  for(int i=0;i<sizeof(nds->mem.mmio_debug_access_buffer)/8;++i){
-    d[i]&=0x9191919191919191ULL;
+  nds->arm7.watch = sb_watch_active(emu->watch[NDS_ARM7]);
+  nds->arm9.watch = sb_watch_active(emu->watch[NDS_ARM9]);
+  nds->arm7.pc_profile = emu->pc_profile[NDS_ARM7];
+  nds->arm9.pc_profile = emu->pc_profile[NDS_ARM9];
+  nds->arm7.exec_trace = emu->exec_trace[NDS_ARM7];
+  nds->arm9.exec_trace = emu->exec_trace[NDS_ARM9];
+  if(nds->arm7.watch)sb_watch_resume(nds->arm7.watch);
+  if(nds->arm9.watch)sb_watch_resume(nds->arm9.watch);
+  // The per tick access flags are only shown by the debugger
+  if(emu->watch[NDS_ARM7]||emu->watch[NDS_ARM9]){
+    uint64_t* d = (uint64_t*)nds->mem.mmio_debug_access_buffer;
+    for(int i=0;i<sizeof(nds->mem.mmio_debug_access_buffer)/8;++i){
+      d[i]&=0x9191919191919191ULL;
+    }
   }
   nds->frame_in_progress=true;
+  // The ARM7 gets its own thread unless something follows the CPUs instruction by instruction
+  bool threaded_arm7 = emu->nds_threaded_arm7&&scratch->job_start&&emu->nds_cpu_slice_cycles>1&&
+    !nds->arm7.watch&&!nds->arm9.watch&&!nds->arm7.exec_trace&&!nds->arm9.exec_trace&&!nds->arm7.pc_profile;
+  if(threaded_arm7)nds_start_arm7_thread(nds,scratch,arm7_idle_loop);
+  uint64_t start_instructions = nds->arm7.executed_instructions+nds->arm9.executed_instructions;
   if(nds->sleep_mode){
     nds->frame_in_progress=false;
     memset(scratch->framebuffer_top,0,sizeof(scratch->framebuffer_top));
@@ -6974,63 +9323,162 @@ void nds_tick(sb_emu_state_t* emu, nds_t* nds, nds_scratch_t* scratch){
   }
   while(nds->frame_in_progress){
     bool gx_fifo_full = nds_gxfifo_size(nds)>=NDS_GXFIFO_SIZE;
+    int slice_ticks = 0; 
     if(!gx_fifo_full){
+      SB_PROFILE_BEGIN(emu,SB_PROFILE_DMA,4);
       nds_tick_dma(nds,true);
-      if(SB_LIKELY(!nds->dma_processed[1])){
-        if(SB_UNLIKELY(nds->nds9_interrupt_line))arm7_process_interrupts(&nds->arm9);
-        if(SB_LIKELY(!nds->arm9.wait_for_interrupt)){
-          nds->arm9.i_cycles=0;
-          arm9_exec_instruction(&nds->arm9);
-          if(!nds->arm9.i_cycles)arm9_exec_instruction(&nds->arm9);
-          nds->mem.slow_bus_cycles+=nds->arm9.i_cycles/2;
+      SB_PROFILE_END(emu,SB_PROFILE_DMA,4);
+      if(emu->nds_cpu_slice_cycles>1&&!nds->dma_processed[0]&&!nds->dma_processed[1]&&!nds->mem.slow_bus_cycles){
+        // Slices stop at the next timer, PPU, GX or interrupt event
+        int max_ticks = emu->nds_cpu_slice_cycles;
+        int next_event = nds->next_timer_clock-nds->current_clock;
+        if(next_event<max_ticks)max_ticks=next_event;
+        int if_ticks = nds_if_pipe_ticks_to_delivery(nds);
+        if(if_ticks<max_ticks)max_ticks=if_ticks;
+        if(nds->ppu_fast_forward_ticks<max_ticks)max_ticks=nds->ppu_fast_forward_ticks;
+        if(nds->gpu.cmd_busy_cycles&&nds->gpu.cmd_busy_cycles<max_ticks)max_ticks=nds->gpu.cmd_busy_cycles;
+        if(max_ticks<1)max_ticks=1;
+        slice_ticks = threaded_arm7? nds_exec_cpu_slice_threaded(nds,max_ticks,arm9_idle_loop):
+                                     nds_exec_cpu_slice(nds,max_ticks,arm7_idle_loop,arm9_idle_loop);
+      }else{
+        if(SB_LIKELY(!nds->dma_processed[1])){
+          if(SB_UNLIKELY(nds->nds9_interrupt_line))arm7_process_interrupts(&nds->arm9);
+          if(SB_LIKELY(!nds->arm9.wait_for_interrupt)){
+            nds->arm9.i_cycles=0;
+            uint32_t pc_before = nds->arm9.registers[PC];
+            arm9_exec_instruction(&nds->arm9);
+            if(arm9_idle_loop)arm7_idle_loop_update(arm9_idle_loop,&nds->arm9,pc_before,nds->mem.idle_loop_side_effects);
+            if(!nds->arm9.i_cycles){
+              pc_before = nds->arm9.registers[PC];
+              arm9_exec_instruction(&nds->arm9);
+              if(arm9_idle_loop)arm7_idle_loop_update(arm9_idle_loop,&nds->arm9,pc_before,nds->mem.idle_loop_side_effects);
+            }
+            nds->mem.slow_bus_cycles+=nds->arm9.i_cycles/2;
+          }
+        }
+        if(SB_LIKELY(!nds->dma_processed[0] &&!nds->mem.slow_bus_cycles)){
+          if(SB_UNLIKELY(nds->nds7_interrupt_line))arm7_process_interrupts(&nds->arm7);
+          uint32_t pc_before = nds->arm7.registers[PC];
+          arm7_exec_instruction(&nds->arm7);
+          if(arm7_idle_loop)arm7_idle_loop_update(arm7_idle_loop,&nds->arm7,pc_before,nds->mem.idle_loop_side_effects);
         }
-      }
-      if(SB_LIKELY(!nds->dma_processed[0] &&!nds->mem.slow_bus_cycles)){
-        if(SB_UNLIKELY(nds->nds7_interrupt_line))arm7_process_interrupts(&nds->arm7);
-        arm7_exec_instruction(&nds->arm7);
       }
     }      
-    int ticks = (nds->mem.slow_bus_cycles==0)+nds->mem.slow_bus_cycles;
+    int ticks = slice_ticks? slice_ticks: (nds->mem.slow_bus_cycles==0)+nds->mem.slow_bus_cycles;
     nds->mem.slow_bus_cycles = 0; 
+    // Busy wait loops count as halted as long as no DMA or pending interrupt can wake them early
+    bool can_skip_idle_loops = !nds->activate_dmas;
+    bool arm9_idle = nds->arm9.wait_for_interrupt||
+      (can_skip_idle_loops&&arm9_idle_loop&&arm9_idle_loop->idle&&!nds->nds9_interrupt_line);
+    bool arm7_idle = nds->arm7.wait_for_interrupt||
+      (can_skip_idle_loops&&arm7_idle_loop&&arm7_idle_loop->idle&&!nds->nds7_interrupt_line);
     
     while(ticks){
       int fast_forward_ticks = nds->next_timer_clock-nds->current_clock;
       if(fast_forward_ticks>nds->ppu_fast_forward_ticks)fast_forward_ticks=nds->ppu_fast_forward_ticks;
-      if(nds->gpu.cmd_busy_cycles&&nds->gpu.cmd_busy_cycles<=fast_forward_ticks)fast_forward_ticks=nds->gpu.cmd_busy_cycles; 
+      // Pending IF stages are delivered by the single tick after the span
+      int if_ticks = nds_if_pipe_ticks_to_delivery(nds);
+      if(if_ticks<fast_forward_ticks)fast_forward_ticks=if_ticks;
       if(SB_LIKELY(fast_forward_ticks)){
-        if(SB_UNLIKELY(nds->active_if_pipe_stages)){
-          int i=0;
-          while(i<fast_forward_ticks&&nds->active_if_pipe_stages){
-            nds_tick_interrupts(nds);
-            ++i;
-          }
-          fast_forward_ticks =i;
-        }
-        if(!((nds->arm9.wait_for_interrupt&&nds->arm7.wait_for_interrupt)||gx_fifo_full)&&fast_forward_ticks>ticks)
+        if(!((arm9_idle&&arm7_idle)||gx_fifo_full)&&fast_forward_ticks>ticks)
           fast_forward_ticks=ticks;
-        nds->ppu_fast_forward_ticks-=fast_forward_ticks;
-        if(nds->gpu.cmd_busy_cycles){
-          nds->gpu.cmd_busy_cycles-=fast_forward_ticks-1;
+        else if(fast_forward_ticks>ticks){
+          // The loops have to run another iteration after an event before they can be skipped again
+          if(arm9_idle_loop)arm9_idle_loop->idle=false;
+          if(arm7_idle_loop)arm7_idle_loop->idle=false;
+          arm9_idle = nds->arm9.wait_for_interrupt;
+          arm7_idle = nds->arm7.wait_for_interrupt;
         }
-        nds_tick_gx(nds);
+        // The geometry engine runs its commands first and can end the span early
+        SB_PROFILE_BEGIN(emu,SB_PROFILE_GX,6);
+        fast_forward_ticks = nds_tick_gx(nds,fast_forward_ticks);
+        SB_PROFILE_END(emu,SB_PROFILE_GX,6);
+        nds->ppu_fast_forward_ticks-=fast_forward_ticks;
         nds->current_clock+=fast_forward_ticks;
+        nds_skip_interrupts(nds,fast_forward_ticks);
         ticks =ticks<=fast_forward_ticks?0:ticks-fast_forward_ticks;
       }      
       if(SB_UNLIKELY(ticks)){
         nds->current_clock++;
         nds_tick_interrupts(nds);
         nds_tick_timers(nds);
+        SB_PROFILE_BEGIN(emu,SB_PROFILE_PPU,6);
         nds_tick_ppu(nds,emu->render_frame);
-        nds_tick_audio(nds, emu);
-        nds_tick_gx(nds);
+        SB_PROFILE_END(emu,SB_PROFILE_PPU,6);
+        SB_PROFILE_BEGIN(emu,SB_PROFILE_AUDIO,6);
+        nds_tick_audio(nds);
+        SB_PROFILE_END(emu,SB_PROFILE_AUDIO,6);
+        SB_PROFILE_BEGIN(emu,SB_PROFILE_GX,6);
+        nds_tick_gx(nds,1);
+        SB_PROFILE_END(emu,SB_PROFILE_GX,6);
         ticks--;
       }
     }
   }
+  if(threaded_arm7)nds_stop_arm7_thread(nds);
   if(nds->pause_after_frame){
     emu->run_mode=SB_MODE_PAUSE;
     nds->pause_after_frame=false;
   }
+  // The snapshot is only valid while the frame runs, debugger reads outside of it use the register
+  nds->mem.late_input = NULL;
+  nds->gpu.video_capture = NULL;
+  nds->host.event_log = NULL;
+  nds_flush_audio(nds);
+  nds->audio.emu = NULL;
+  SB_PERF_COUNT(&nds->perf,SB_COUNTER_INSTRUCTIONS,nds->arm7.executed_instructions+nds->arm9.executed_instructions-start_instructions);
+  sb_profile_collect(&emu->profile,&nds->perf);
+}
+// Sets the flags of the pages of [area_start,area_end) (the first one being first_page) whose 
+// start address lies in [start,end)
+static void nds_arm9_cache_fill_pages(nds_arm9_cache_t* cache, uint64_t start, uint64_t end, uint64_t area_start, uint64_t area_end, int first_page, uint8_t flags){
+  const uint64_t page_size = 1<<NDS_ARM9_CACHE_PAGE_SHIFT;
+  if(start<area_start)start=area_start;
+  if(end>area_end)end=area_end;
+  if(start>=end)return;
+  int p0 = (start-area_start+page_size-1)>>NDS_ARM9_CACHE_PAGE_SHIFT;
+  int p1 = (end-area_start+page_size-1)>>NDS_ARM9_CACHE_PAGE_SHIFT;
+  if(p1>p0)memset(cache->page_flags+first_page+p0,flags,p1-p0);
+}
+// Recomputes which main RAM/BIOS pages the caches serve from the control register, the
+// cacheable bits (C2) and the protection regions (C6). TCM mapped pages bypass the caches.
+static void nds_update_arm9_cache_config(nds_t* nds){
+  nds_arm9_cache_t* cache = &nds->cp15.cache;
+  uint32_t control = nds->cp15.reg[(1*16+0)*8+0];
+  bool mpu_enable = SB_BFE(control,0,1);
+  cache->enable_mask = 0;
+  if(mpu_enable&&SB_BFE(control,2,1))cache->enable_mask|=NDS_ARM9_CACHE_DATA;
+  if(mpu_enable&&SB_BFE(control,12,1))cache->enable_mask|=NDS_ARM9_CACHE_CODE;
+  cache->round_robin = SB_BFE(control,14,1);
+  uint32_t data_cacheable = nds->cp15.reg[(2*16+0)*8+0];
+  uint32_t code_cacheable = nds->cp15.reg[(2*16+0)*8+1];
+  memset(cache->page_flags,0,sizeof(cache->page_flags));
+  if(!cache->enable_mask)return;
+  // Paint the regions from lowest to highest priority so each page ends up with the flags of the 
+  // highest numbered region covering it, instead of testing all 8 regions for every page
+  for(int r=0;r<8;++r){
+    uint32_t region = nds->cp15.reg[(6*16+r)*8+0];
+    if(!SB_BFE(region,0,1))continue;
+    uint64_t size = 2ull<<SB_BFE(region,1,5);
+    uint64_t base = (SB_BFE(region,12,20)<<12)&~(size-1);
+    uint8_t flags = 0;
+    if(SB_BFE(data_cacheable,r,1))flags|=NDS_ARM9_CACHE_DATA;
+    if(SB_BFE(code_cacheable,r,1))flags|=NDS_ARM9_CACHE_CODE;
+    flags&=cache->enable_mask;
+    nds_arm9_cache_fill_pages(cache,base,base+size,0x02000000,0x03000000,0,flags);
+    nds_arm9_cache_fill_pages(cache,base,base+size,0xFFFF0000,0x100000000ull,NDS_ARM9_CACHE_BIOS_PAGE,flags);
+  }
+  // TCM mapped pages bypass the caches
+  if(nds->mem.dtcm_enable&&!nds->mem.dtcm_load_mode){
+    uint32_t start = nds->mem.dtcm_start_address, end = nds->mem.dtcm_end_address;
+    nds_arm9_cache_fill_pages(cache,start,end,0x02000000,0x03000000,0,0);
+    nds_arm9_cache_fill_pages(cache,start,end,0xFFFF0000,0x100000000ull,NDS_ARM9_CACHE_BIOS_PAGE,0);
+  }
+  if(nds->mem.itcm_enable&&!nds->mem.itcm_load_mode){
+    uint32_t start = nds->mem.itcm_start_address, end = nds->mem.itcm_end_address;
+    nds_arm9_cache_fill_pages(cache,start,end,0x02000000,0x03000000,0,0);
+    nds_arm9_cache_fill_pages(cache,start,end,0xFFFF0000,0x100000000ull,NDS_ARM9_CACHE_BIOS_PAGE,0);
+  }
 }
 // See: http://merry.usamimi.org/archex/SysReg_v84A_xml-00bet7/enc_index.xml#mcr_mrc_32
 uint32_t nds_coprocessor_read(void* user_data, int coproc,int opcode,int Cn, int Cm,int Cp){
@@ -7110,9 +9558,17 @@ void nds_coprocessor_write(void* user_data, int coproc,int opcode,int Cn, int Cm
     if((Cm==0&&Cp==4)||(Cm==8&&Cp==2)){
       nds->arm9.wait_for_interrupt = true; 
     }
+    nds_arm9_cache_t* cache = &nds->cp15.cache;
+    if(Cm==5&&Cp==0)memset(cache->icache,0,sizeof(cache->icache));
+    else if(Cm==5&&Cp==1)nds_arm9_cache_invalidate_line(cache->icache,NDS_ARM9_ICACHE_SETS,data);
+    else if(Cm==6&&Cp==0)memset(cache->dcache,0,sizeof(cache->dcache));
+    else if((Cm==6||Cm==14)&&Cp==1)nds_arm9_cache_invalidate_line(cache->dcache,NDS_ARM9_DCACHE_SETS,data);
+    else if(Cm==14&&Cp==2)cache->dcache[SB_BFE(data,5,5)&(NDS_ARM9_DCACHE_SETS-1)][SB_BFE(data,30,2)]=0;
   }else{
     printf("Unhandled: Cn:%d Cm:%d Cp:%d\n",Cn,Cm,Cp);
   }
+  if(Cn==1||Cn==2||Cn==6||(Cn==9&&Cm==1))nds_update_arm9_cache_config(nds);
+  nds_update_tlb(nds);
 }
 static bool nds_run_ar_cheat(nds_t* nds, const uint32_t* buffer, uint32_t size){
   if(!buffer){
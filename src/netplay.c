@@ -0,0 +1,126 @@
+#include "netplay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(EMSCRIPTEN)
+// Browsers can't open UDP sockets
+netplay_socket_t netplay_open(int local_port, const char* remote_host, int remote_port){
+  printf("Netplay is not supported on this platform\n");
+  return NULL;
+}
+void netplay_close(netplay_socket_t socket){}
+bool netplay_send(netplay_socket_t socket, const void* data, size_t size){return false;}
+size_t netplay_recv(netplay_socket_t socket, void* data, size_t max_size){return 0;}
+#else
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+typedef SOCKET netplay_fd_t;
+#define NETPLAY_INVALID_FD INVALID_SOCKET
+#define netplay_close_fd closesocket
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+typedef int netplay_fd_t;
+#define NETPLAY_INVALID_FD -1
+#define netplay_close_fd close
+#endif
+
+typedef struct{
+  netplay_fd_t fd;
+  struct sockaddr_storage remote;
+  socklen_t remote_size;
+  bool fixed_remote; // The remote address was given instead of learned from the first packet
+}netplay_udp_t;
+
+netplay_socket_t netplay_open(int local_port, const char* remote_host, int remote_port){
+#if defined(_WIN32)
+  static bool wsa_started = false;
+  if(!wsa_started){
+    WSADATA wsa;
+    if(WSAStartup(MAKEWORD(2,2),&wsa)!=0){
+      printf("Failed to initialize Winsock\n");
+      return NULL;
+    }
+    wsa_started = true;
+  }
+#endif
+  netplay_udp_t* udp = (netplay_udp_t*)calloc(1,sizeof(netplay_udp_t));
+  if(!udp)return NULL;
+  udp->fd = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+  if(udp->fd==NETPLAY_INVALID_FD){
+    printf("Failed to create netplay socket\n");
+    free(udp);
+    return NULL;
+  }
+  struct sockaddr_in local;
+  memset(&local,0,sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(local_port);
+  if(bind(udp->fd,(struct sockaddr*)&local,sizeof(local))!=0){
+    printf("Failed to bind netplay socket to port %d\n",local_port);
+    netplay_close_fd(udp->fd);
+    free(udp);
+    return NULL;
+  }
+#if defined(_WIN32)
+  u_long non_blocking = 1;
+  ioctlsocket(udp->fd,FIONBIO,&non_blocking);
+#else
+  fcntl(udp->fd,F_SETFL,fcntl(udp->fd,F_GETFL,0)|O_NONBLOCK);
+#endif
+  if(remote_host){
+    struct addrinfo hints, *result = NULL;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    char port[16];
+    snprintf(port,sizeof(port),"%d",remote_port);
+    if(getaddrinfo(remote_host,port,&hints,&result)!=0||!result){
+      printf("Failed to resolve netplay host %s\n",remote_host);
+      netplay_close_fd(udp->fd);
+      free(udp);
+      return NULL;
+    }
+    memcpy(&udp->remote,result->ai_addr,result->ai_addrlen);
+    udp->remote_size = result->ai_addrlen;
+    udp->fixed_remote = true;
+    freeaddrinfo(result);
+  }
+  return udp;
+}
+void netplay_close(netplay_socket_t socket){
+  netplay_udp_t* udp = (netplay_udp_t*)socket;
+  if(!udp)return;
+  netplay_close_fd(udp->fd);
+  free(udp);
+}
+bool netplay_send(netplay_socket_t socket, const void* data, size_t size){
+  netplay_udp_t* udp = (netplay_udp_t*)socket;
+  if(!udp||!udp->remote_size)return false;
+  return sendto(udp->fd,(const char*)data,size,0,(struct sockaddr*)&udp->remote,udp->remote_size)==(int)size;
+}
+size_t netplay_recv(netplay_socket_t socket, void* data, size_t max_size){
+  netplay_udp_t* udp = (netplay_udp_t*)socket;
+  if(!udp)return 0;
+  struct sockaddr_storage from;
+  socklen_t from_size = sizeof(from);
+  int size = recvfrom(udp->fd,(char*)data,max_size,0,(struct sockaddr*)&from,&from_size);
+  if(size<=0)return 0;
+  if(!udp->fixed_remote){
+    memcpy(&udp->remote,&from,from_size);
+    udp->remote_size = from_size;
+  }
+  return size;
+}
+#endif
@@ -0,0 +1,18 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H 1
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Non blocking UDP socket used to exchange netplay packets with one peer
+typedef void* netplay_socket_t;
+// Binds local_port. With a remote_host packets go to remote_host:remote_port, otherwise the socket
+// answers whoever sent the last packet. Returns NULL on failure.
+netplay_socket_t netplay_open(int local_port, const char* remote_host, int remote_port);
+void netplay_close(netplay_socket_t socket);
+// Returns false if the packet couldn't be sent or the remote address isn't known yet
+bool netplay_send(netplay_socket_t socket, const void* data, size_t size);
+// Returns the size of the received packet or 0 when no packet is pending
+size_t netplay_recv(netplay_socket_t socket, void* data, size_t max_size);
+
+#endif
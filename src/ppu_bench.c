@@ -0,0 +1,127 @@
+/*****************************************************************************
+ *
+ *   SkyEmu renderer benchmarks
+ *
+ *   Replays frame dumps captured with "SkyEmu frame_dump" through the GBA PPU
+ *   and the NDS 3D rasterizer without the rest of the system, reporting the
+ *   host time per frame and checking the frames against the captured hashes.
+ *
+ *   Usage: skyemu_ppu_bench [--passes N] [--threads] dump.sefd...
+ *
+**/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared.h"
+#include "sb_types.h"
+#include "job_pool.h"
+#define XXH_INLINE_ALL
+#include "frame_dump.h"
+
+// Frontend hook of the cores, replays never boot a BIOS
+bool se_load_bios_file(const char* name, const char* base_path, const char* file_name, uint8_t* data, size_t data_size){
+  return false;
+}
+
+static uint64_t bench_now_ns(){
+  struct timespec ts;
+  timespec_get(&ts,TIME_UTC);
+  return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+static void bench_job_dispatch(sb_job_fn_t job, void* user_data, int num_jobs){
+  job_pool_run(job,user_data,num_jobs);
+}
+
+static uint8_t* bench_load_file(const char* path, size_t* size){
+  FILE* f = fopen(path,"rb");
+  if(!f)return NULL;
+  fseek(f,0,SEEK_END);
+  long file_size = ftell(f);
+  fseek(f,0,SEEK_SET);
+  uint8_t* data = file_size>0? (uint8_t*)malloc(file_size): NULL;
+  if(data&&fread(data,1,file_size,f)!=(size_t)file_size){
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *size = data? file_size: 0;
+  return data;
+}
+
+// Returns false if the dump couldn't be replayed or a frame didn't match its hash
+static bool bench_run_dump(const char* path, int passes, bool threads){
+  size_t size = 0;
+  uint8_t* dump = bench_load_file(path,&size);
+  if(!dump){
+    printf("%s: failed to read the frame dump\n",path);
+    return false;
+  }
+  sb_frame_dump_replay_t r;
+  if(!sb_frame_dump_replay_init(&r,dump,size,threads? bench_job_dispatch: NULL)){
+    printf("%s: failed to load the frame dump\n",path);
+    free(dump);
+    return false;
+  }
+  const char* system = r.header.system==SYSTEM_GBA? "gba_ppu": "nds_3d";
+  uint32_t frames = 0, mismatches = 0;
+  uint64_t best_ns = UINT64_MAX, total_ns = 0;
+  // The first pass also warms up the caches and the texture cache
+  for(int pass=0;pass<=passes;++pass){
+    sb_frame_dump_replay_rewind(&r);
+    uint32_t pass_frames = 0;
+    bool matches = true;
+    uint64_t start = bench_now_ns();
+    while(sb_frame_dump_replay_frame(&r,NULL,&matches,false)){
+      pass_frames++;
+      mismatches+=!matches&&pass==0;
+      if(!matches&&pass==0)printf("%s: frame %u doesn't match the captured hash\n",path,pass_frames-1);
+    }
+    uint64_t elapsed = bench_now_ns()-start;
+    frames = pass_frames;
+    if(frames!=r.header.num_frames)break;
+    if(pass==0)continue;
+    total_ns+=elapsed;
+    if(elapsed<best_ns)best_ns = elapsed;
+  }
+  if(frames!=r.header.num_frames){
+    printf("%s: replayed %u of %u frames\n",path,frames,r.header.num_frames);
+    mismatches++;
+  }
+  if(frames&&passes){
+    printf("%-40s %-8s %5u frames %10.0f ns/frame (best %.0f) %s\n",path,system,frames,
+           (double)total_ns/passes/frames,(double)best_ns/frames,mismatches? "MISMATCH": "OK");
+  }
+  sb_frame_dump_replay_free(&r);
+  free(dump);
+  return !mismatches;
+}
+
+int main(int argc, char** argv){
+  int passes = 10;
+  bool threads = false;
+  int num_dumps = 0;
+  for(int i=1;i<argc;++i){
+    if(strcmp(argv[i],"--passes")==0&&i+1<argc)passes = atoi(argv[++i]);
+    else if(strcmp(argv[i],"--threads")==0)threads = true;
+    else if(argv[i][0]=='-'){
+      num_dumps = 0;
+      break;
+    }else ++num_dumps;
+  }
+  if(!num_dumps){
+    printf("Usage: %s [--passes N] [--threads] dump.sefd...\n",argv[0]);
+    return 1;
+  }
+  if(passes<1)passes = 1;
+  bool ok = true;
+  for(int i=1;i<argc;++i){
+    if(strcmp(argv[i],"--passes")==0){++i;continue;}
+    if(argv[i][0]=='-')continue;
+    ok&=bench_run_dump(argv[i],passes,threads);
+  }
+  return ok? 0: 2;
+}
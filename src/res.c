@@ -11,6 +11,8 @@
 #include "sv_basic_manual.h"
 #include "karla.h"
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 const uint8_t* se_get_resource(int res_id, uint64_t* size){
   uint64_t sz_dummy = 0; 
   if(!size)size=&sz_dummy; 
@@ -30,3 +32,106 @@ const uint8_t* se_get_resource(int res_id, uint64_t* size){
   *size = 0; 
   return NULL;
 }
+
+// Decompressor for the stb_compress'd fonts, from stb.h (public domain) by Sean Barrett
+// https://github.com/nothings/stb/blob/master/stb.h
+typedef struct{
+  const uint8_t* in_b;
+  uint8_t* out_b;
+  uint8_t* out_e;
+  uint8_t* dout;
+}se_stb_decompress_t;
+
+static void se_stb_match(se_stb_decompress_t* d, const uint8_t* data, uint32_t length){
+  // INVERSE of memmove... write each byte before copying the next...
+  if(d->dout+length>d->out_e){d->dout+=length;return;}
+  if(data<d->out_b){d->dout=d->out_e+1;return;}
+  while(length--)*d->dout++ = *data++;
+}
+static void se_stb_lit(se_stb_decompress_t* d, const uint8_t* data, uint32_t length){
+  if(d->dout+length>d->out_e){d->dout+=length;return;}
+  if(data<d->in_b){d->dout=d->out_e+1;return;}
+  memcpy(d->dout,data,length);
+  d->dout+=length;
+}
+#define se_stb_in2(x) ((i[x]<<8)+i[(x)+1])
+#define se_stb_in3(x) ((i[x]<<16)+se_stb_in2((x)+1))
+#define se_stb_in4(x) ((uint32_t)(i[x]<<24)+se_stb_in3((x)+1))
+static const uint8_t* se_stb_decompress_token(se_stb_decompress_t* d, const uint8_t* i){
+  if(*i>=0x20){
+    if(*i>=0x80)     se_stb_match(d,d->dout-i[1]-1,i[0]-0x80+1), i+=2;
+    else if(*i>=0x40)se_stb_match(d,d->dout-(se_stb_in2(0)-0x4000+1),i[2]+1), i+=3;
+    else             se_stb_lit(d,i+1,i[0]-0x20+1), i+=1+(i[0]-0x20+1);
+  }else{
+    if(*i>=0x18)     se_stb_match(d,d->dout-(se_stb_in3(0)-0x180000+1),i[3]+1), i+=4;
+    else if(*i>=0x10)se_stb_match(d,d->dout-(se_stb_in3(0)-0x100000+1),se_stb_in2(3)+1), i+=5;
+    else if(*i>=0x08)se_stb_lit(d,i+2,se_stb_in2(0)-0x0800+1), i+=2+(se_stb_in2(0)-0x0800+1);
+    else if(*i==0x07)se_stb_lit(d,i+3,se_stb_in2(1)+1), i+=3+(se_stb_in2(1)+1);
+    else if(*i==0x06)se_stb_match(d,d->dout-(se_stb_in3(1)+1),i[4]+1), i+=5;
+    else if(*i==0x04)se_stb_match(d,d->dout-(se_stb_in3(1)+1),se_stb_in2(4)+1), i+=6;
+  }
+  return i;
+}
+static uint32_t se_stb_adler32(uint32_t adler32, const uint8_t* buffer, uint32_t buflen){
+  const uint32_t ADLER_MOD = 65521;
+  uint32_t s1 = adler32&0xffff, s2 = adler32>>16;
+  uint32_t blocklen = buflen%5552;
+  while(buflen){
+    for(uint32_t i=0;i<blocklen;++i)s1+=*buffer++, s2+=s1;
+    s1%=ADLER_MOD, s2%=ADLER_MOD;
+    buflen-=blocklen;
+    blocklen=5552;
+  }
+  return (s2<<16)+s1;
+}
+static uint8_t* se_stb_decompress(const uint8_t* i, uint64_t* size){
+  if(se_stb_in4(0)!=0x57bC0000||se_stb_in4(4)!=0)return NULL;
+  uint32_t olen = se_stb_in4(8);
+  uint8_t* output = (uint8_t*)malloc(olen);
+  if(!output)return NULL;
+  se_stb_decompress_t d = {i,output,output+olen,output};
+  i+=16;
+  for(;;){
+    const uint8_t* old_i = i;
+    i = se_stb_decompress_token(&d,i);
+    if(i==old_i){
+      if(*i==0x05&&i[1]==0xfa&&d.dout==output+olen&&se_stb_adler32(1,output,olen)==se_stb_in4(2)){
+        *size = olen;
+        return output;
+      }
+      break;
+    }
+    if(d.dout>output+olen)break;
+  }
+  free(output);
+  return NULL;
+}
+#undef se_stb_in2
+#undef se_stb_in3
+#undef se_stb_in4
+
+const uint8_t* se_get_resource_decompressed(int res_id, uint64_t* size){
+  static struct{const uint8_t* data; uint64_t size;} cache[SE_NUM_RESOURCES];
+  uint64_t sz_dummy = 0; 
+  if(!size)size=&sz_dummy; 
+  *size = 0;
+  if(res_id<0||res_id>=SE_NUM_RESOURCES)return NULL;
+  if(!cache[res_id].data){
+    uint64_t compressed_size = 0;
+    const uint8_t* data = se_get_resource(res_id,&compressed_size);
+    if(!data)return NULL;
+    // The CA bundle is stored as is
+    if(res_id==SE_CACERT_PEM){
+      cache[res_id].data = data;
+      cache[res_id].size = compressed_size;
+    }else{
+      cache[res_id].data = se_stb_decompress(data,&cache[res_id].size);
+      if(!cache[res_id].data){
+        printf("Failed to decompress resource %d\n",res_id);
+        return NULL;
+      }
+    }
+  }
+  *size = cache[res_id].size;
+  return cache[res_id].data;
+}
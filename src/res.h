@@ -10,8 +10,11 @@
 #define SE_NOTO_SANS 4
 #define SE_SV_BASIC_MANUAL 5
 #define SE_CACERT_PEM 6
+#define SE_NUM_RESOURCES 7
 
 const uint8_t* se_get_resource(int res_id, uint64_t* size);
+// Decompresses the resource on first use and keeps it for the lifetime of the process. Not thread safe
+const uint8_t* se_get_resource_decompressed(int res_id, uint64_t* size);
 
 
 #endif
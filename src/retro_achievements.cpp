@@ -16,7 +16,7 @@ bool se_checkbox(const char* label, bool* v);
 void se_section(const char* label,...);
 const char* se_localize_and_cache(const char* input_str);
 ImFont* se_get_mono_font();
-void se_emscripten_flush_fs();
+void se_emscripten_flush_fs(const char* path);
 double se_time();
 }
 
@@ -24,6 +24,7 @@ double se_time();
 #include "IconsForkAwesome.h"
 #include "rc_client.h"
 #include "rc_consoles.h"
+#include "rc_hash.h"
 #include "sb_types.h"
 #include "sokol_time.h"
 
@@ -152,6 +153,10 @@ struct ra_state_t
     atlas_tile_t* user_image = nullptr;
 
     std::atomic_bool pending_login = { false };
+    // Set by rcheevos events, cleared when the progress is captured
+    std::atomic_bool progress_changed = { true };
+    // Counts the events that can add or change an overlay (notifications, indicators, trackers)
+    std::atomic_uint32_t overlay_events = { 0 };
 
     // Game state is a shared_ptr. This is because there's a lot of asynchronous http requests
     // referring to it so every time we need to create such a request, we make a copy of the
@@ -198,6 +203,7 @@ namespace
         notification.tile = game_state->game_image;
 
         game_state->notifications.push_back(notification);
+        ra_state->overlay_events++;
     }
 
     ra_achievement_t* retro_achievements_move_bucket(ra_game_state_ptr game_state, uint32_t id,
@@ -402,7 +408,7 @@ namespace
             path += "ra_token.txt";
 
             sb_save_file_data(path.c_str(), (const uint8_t*)data.data(), data.size());
-            se_emscripten_flush_fs();
+            se_emscripten_flush_fs(path.c_str());
             ra_state->error_message.store(nullptr);
 
             std::string url;
@@ -421,6 +427,8 @@ namespace
 
     void retro_achievements_event_handler(const rc_client_event_t* event, rc_client_t* client)
     {
+        ra_state->progress_changed.store(true);
+        ra_state->overlay_events++;
         switch (event->type)
         {
             case RC_CLIENT_EVENT_ACHIEVEMENT_TRIGGERED:
@@ -893,7 +901,32 @@ void retro_achievements_shutdown()
     delete ra_state;
 }
 
-bool retro_achievements_load_game()
+static uint32_t retro_achievements_console_id()
+{
+    switch (ra_state->emu_state->system)
+    {
+        case SYSTEM_GB:
+            return RC_CONSOLE_GAMEBOY;
+        case SYSTEM_GBA:
+            return RC_CONSOLE_GAMEBOY_ADVANCE;
+        case SYSTEM_NDS:
+            return RC_CONSOLE_NINTENDO_DS;
+    }
+    return RC_CONSOLE_UNKNOWN;
+}
+
+bool retro_achievements_hash_rom(char hash[33])
+{
+    sb_emu_state_t* emu_state = ra_state->emu_state;
+    uint32_t console_id = retro_achievements_console_id();
+    // Streamed ROMs aren't resident, rcheevos reads those from the file
+    if (emu_state->rom_data)
+        return rc_hash_generate_from_buffer(hash, console_id, emu_state->rom_data,
+                                            emu_state->rom_size);
+    return rc_hash_generate_from_file(hash, console_id, emu_state->rom_path);
+}
+
+bool retro_achievements_load_game(const char* hash)
 {
     if (!ra_state->emu_state->rom_loaded)
         return true;
@@ -906,6 +939,12 @@ bool retro_achievements_load_game()
     if (loading_game)
         return false;
 
+    if (!hash || !hash[0])
+    {
+        printf("[rcheevos]: failed to hash the ROM\n");
+        return true;
+    }
+
     // the old one will be destroyed when the last reference is gone
     ra_state->game_state.reset(new ra_game_state_t());
 
@@ -913,27 +952,8 @@ bool retro_achievements_load_game()
     ra_game_state_ptr* game_state = new ra_game_state_ptr(ra_state->game_state);
 
     loading_game = true;
-
-    switch (ra_state->emu_state->system)
-    {
-        case SYSTEM_GB:
-            rc_client_begin_identify_and_load_game(
-                ra_state->rc_client, RC_CONSOLE_GAMEBOY, NULL, ra_state->emu_state->rom_data,
-                ra_state->emu_state->rom_size, retro_achievements_load_game_callback, game_state);
-            break;
-        case SYSTEM_GBA:
-            rc_client_begin_identify_and_load_game(
-                ra_state->rc_client, RC_CONSOLE_GAMEBOY_ADVANCE, NULL,
-                ra_state->emu_state->rom_data, ra_state->emu_state->rom_size,
-                retro_achievements_load_game_callback, game_state);
-            break;
-        case SYSTEM_NDS:
-            rc_client_begin_identify_and_load_game(
-                ra_state->rc_client, RC_CONSOLE_NINTENDO_DS, NULL, ra_state->emu_state->rom_data,
-                ra_state->emu_state->rom_size, retro_achievements_load_game_callback, game_state);
-            break;
-    }
-
+    rc_client_begin_load_game(ra_state->rc_client, hash, retro_achievements_load_game_callback,
+                              game_state);
     return true;
 }
 
@@ -1379,6 +1399,7 @@ void retro_achievements_capture_state(uint8_t *buffer)
         return;
     }
 
+    ra_state->progress_changed.store(false);
     if (rc_client_serialize_progress(ra_state->rc_client, buffer + 8) == RC_OK) {
         memcpy(buffer, "RCHV", 4);
         memcpy(buffer + 4, &buffer_size, 4);
@@ -1413,4 +1434,15 @@ void retro_achievements_restore_state(const uint8_t *buffer)
     if (rc_client_deserialize_progress(ra_state->rc_client, (const uint8_t*)(buffer + 8)) != RC_OK) {
         printf("Failed to deserialize RetroAchievements state\n");
     }
+    ra_state->progress_changed.store(true);
+}
+
+bool retro_achievements_progress_changed()
+{
+    return ra_state && ra_state->progress_changed.load();
+}
+
+uint32_t retro_achievements_overlay_events()
+{
+    return ra_state ? ra_state->overlay_events.load() : 0;
 }
\ No newline at end of file
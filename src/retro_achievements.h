@@ -19,7 +19,11 @@ void retro_achievements_initialize(void* emu_state, bool hardcore);
 
 void retro_achievements_shutdown();
 
-bool retro_achievements_load_game();
+// rcheevos hash of the loaded ROM, safe to call from another thread while the ROM stays loaded
+bool retro_achievements_hash_rom(char hash[33]);
+
+// Identifies the game by the hash from retro_achievements_hash_rom and loads its achievements
+bool retro_achievements_load_game(const char* hash);
 
 void retro_achievements_frame();
 
@@ -51,6 +55,12 @@ void retro_achievements_capture_state(uint8_t* buffer);
 
 void retro_achievements_restore_state(const uint8_t* buffer);
 
+// True after an rcheevos event (unlock, challenge, progress, leaderboard, ...) since the last capture
+bool retro_achievements_progress_changed();
+
+// Changes whenever an rcheevos event or a loaded game may have added or updated an overlay
+uint32_t retro_achievements_overlay_events();
+
 bool retro_achievements_has_game_loaded(); 
 
 #endif
@@ -10,11 +10,13 @@
 #define SB_TYPES_H 1
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <math.h>
 #if defined(__GNUC__) || defined(__clang__)
   #define FORCE_INLINE inline __attribute__((always_inline))
 #elif defined(_MSC_VER)
@@ -35,6 +37,12 @@
 #define SB_LIKELY(x) (x)
 #endif  // defined(COMPILER_GCC)
 
+// Explicit WebAssembly SIMD kernels, native builds rely on the compiler vectorizing the scalar code
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define SB_SIMD_WASM 1
+#endif
+
 #define SB_FILE_PATH_SIZE 1024
 #define MAX_CARTRIDGE_SIZE 8 * 1024 * 1024
 #define MAX_CARTRIDGE_RAM 128 * 1024
@@ -123,20 +131,520 @@ typedef struct{
   float solar_sensor; 
 } sb_joy_t;
   
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static FORCE_INLINE uint32_t sb_atomic_load_acquire_u32(volatile uint32_t* p){return (uint32_t)_InterlockedOr((volatile long*)p,0);}
+static FORCE_INLINE void sb_atomic_store_release_u32(volatile uint32_t* p, uint32_t v){_InterlockedExchange((volatile long*)p,(long)v);}
+static FORCE_INLINE uint64_t sb_atomic_load_relaxed_u64(volatile uint64_t* p){return (uint64_t)_InterlockedOr64((volatile __int64*)p,0);}
+static FORCE_INLINE void sb_atomic_store_relaxed_u64(volatile uint64_t* p, uint64_t v){_InterlockedExchange64((volatile __int64*)p,(__int64)v);}
+#if defined(_M_ARM)||defined(_M_ARM64)
+static FORCE_INLINE void sb_cpu_relax(){__yield();}
+#else
+static FORCE_INLINE void sb_cpu_relax(){_mm_pause();}
+#endif
+#else
+static FORCE_INLINE uint32_t sb_atomic_load_acquire_u32(volatile uint32_t* p){return __atomic_load_n(p,__ATOMIC_ACQUIRE);}
+static FORCE_INLINE void sb_atomic_store_release_u32(volatile uint32_t* p, uint32_t v){__atomic_store_n(p,v,__ATOMIC_RELEASE);}
+// Untorn 64 bit values for counters that another thread samples, also on 32 bit targets
+static FORCE_INLINE uint64_t sb_atomic_load_relaxed_u64(volatile uint64_t* p){return __atomic_load_n(p,__ATOMIC_RELAXED);}
+static FORCE_INLINE void sb_atomic_store_relaxed_u64(volatile uint64_t* p, uint64_t v){__atomic_store_n(p,v,__ATOMIC_RELAXED);}
+static FORCE_INLINE void sb_cpu_relax(){
+#if defined(__x86_64__)||defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)||(defined(__arm__)&&__ARM_ARCH>=7)
+  __asm__ __volatile__("yield");
+#endif
+}
+#endif
+#if defined(_WIN32)
+#ifdef __cplusplus
+extern "C"
+#endif
+__declspec(dllimport) int __stdcall SwitchToThread(void);
+static FORCE_INLINE void sb_thread_yield(){SwitchToThread();}
+#else
+#include <sched.h>
+static FORCE_INLINE void sb_thread_yield(){sched_yield();}
+#endif
+// One step of a loop polling another thread. Gives the core away after a few spins so the waits
+// don't starve the other thread on hosts with fewer cores than busy threads.
+#define SB_SPIN_WAIT_YIELD 256
+static FORCE_INLINE void sb_spin_wait(uint32_t* spins){
+  if(*spins<SB_SPIN_WAIT_YIELD){++*spins;sb_cpu_relax();}
+  else sb_thread_yield();
+}
+// Buttons the frontend keeps publishing while frames are emulated on their own thread (bit n is
+// SE_KEY n). When set the cores latch the keypad from it as the game reads the register
+typedef struct{
+  volatile uint32_t buttons;
+}sb_late_input_t;
+static FORCE_INLINE uint32_t sb_joy_buttons(const sb_joy_t* joy){
+  uint32_t buttons = 0;
+  for(int i=0;i<=SE_KEY_SELECT;++i)buttons|=(uint32_t)(joy->inputs[i]>0.3)<<i;
+  return buttons;
+}
+static FORCE_INLINE void sb_latch_late_input(sb_late_input_t* late, sb_joy_t* joy){
+  uint32_t buttons = sb_atomic_load_acquire_u32(&late->buttons);
+  for(int i=0;i<=SE_KEY_SELECT;++i)joy->inputs[i]=(buttons>>i)&1;
+}
+// GBA/NDS KEYINPUT value (0=pressed) for the pressed SE_KEY bits
+static FORCE_INLINE uint16_t sb_keyinput_from_buttons(uint32_t buttons){
+  uint16_t pressed = ((buttons>>SE_KEY_A)&1)<<0|((buttons>>SE_KEY_B)&1)<<1|
+                     ((buttons>>SE_KEY_SELECT)&1)<<2|((buttons>>SE_KEY_START)&1)<<3|
+                     ((buttons>>SE_KEY_RIGHT)&1)<<4|((buttons>>SE_KEY_LEFT)&1)<<5|
+                     ((buttons>>SE_KEY_UP)&1)<<6|((buttons>>SE_KEY_DOWN)&1)<<7|
+                     ((buttons>>SE_KEY_R)&1)<<8|((buttons>>SE_KEY_L)&1)<<9;
+  return pressed^0x3ff;
+}
+#define SB_CACHE_LINE_SIZE 64
+// Single producer (the core) single consumer (the audio output) ring of interleaved stereo samples.
+// The pointers count samples forever and wrap at 2^32, each one is only written by its own side
+// and they sit on separate cache lines so the two threads don't fight over them.
 typedef struct{
   int16_t data[SB_AUDIO_RING_BUFFER_SIZE];
-  uint32_t read_ptr;
-  uint32_t write_ptr;
+  volatile uint32_t read_ptr;
+  uint8_t read_padding[SB_CACHE_LINE_SIZE-sizeof(uint32_t)];
+  volatile uint32_t write_ptr;
+  uint8_t write_padding[SB_CACHE_LINE_SIZE-sizeof(uint32_t)];
 }sb_ring_buffer_t;
 static FORCE_INLINE uint32_t sb_ring_buffer_size(sb_ring_buffer_t* buff){
-  if(buff->read_ptr>SB_AUDIO_RING_BUFFER_SIZE){
-    buff->write_ptr-=SB_AUDIO_RING_BUFFER_SIZE;
-    buff->read_ptr-=SB_AUDIO_RING_BUFFER_SIZE;
+  return sb_atomic_load_acquire_u32(&buff->write_ptr)-sb_atomic_load_acquire_u32(&buff->read_ptr);
+}
+// Producer side: returns false and drops the sample pair when the consumer has fallen behind
+static FORCE_INLINE bool sb_ring_buffer_push_stereo(sb_ring_buffer_t* buff, int16_t l, int16_t r){
+  uint32_t write_ptr = buff->write_ptr;
+  if(write_ptr-sb_atomic_load_acquire_u32(&buff->read_ptr)+2>SB_AUDIO_RING_BUFFER_SIZE)return false;
+  buff->data[write_ptr%SB_AUDIO_RING_BUFFER_SIZE]=l;
+  buff->data[(write_ptr+1)%SB_AUDIO_RING_BUFFER_SIZE]=r;
+  sb_atomic_store_release_u32(&buff->write_ptr,write_ptr+2);
+  return true;
+}
+// Consumer side: sample at offset samples past the read pointer, which must be below sb_ring_buffer_size()
+static FORCE_INLINE int16_t sb_ring_buffer_peek(sb_ring_buffer_t* buff, uint32_t offset){
+  return buff->data[(buff->read_ptr+offset)%SB_AUDIO_RING_BUFFER_SIZE];
+}
+static FORCE_INLINE void sb_ring_buffer_consume(sb_ring_buffer_t* buff, uint32_t samples){
+  sb_atomic_store_release_u32(&buff->read_ptr,buff->read_ptr+samples);
+}
+// Polyphase windowed sinc resampler that converts a core's native mixing rate to the host rate
+#define SB_RESAMPLER_TAPS 16
+#define SB_RESAMPLER_PHASES 64
+#define SB_PI 3.14159265358979323846
+typedef struct{
+  // Each input frame is stored twice so the newest SB_RESAMPLER_TAPS frames are always contiguous
+  float history[2][SB_RESAMPLER_TAPS*2];
+  uint32_t history_pos;
+  // Position of the next output frame past the filter center, in input frames
+  double frac;
+}sb_resampler_t;
+// Shared by every instance, built on first use. Cutoff is 90% of the input Nyquist rate since
+// the cores only ever upsample
+static float sb_resampler_filter[SB_RESAMPLER_PHASES+1][SB_RESAMPLER_TAPS];
+static bool sb_resampler_filter_ready = false;
+static void sb_resampler_init_filter(){
+  const double cutoff = 0.9;
+  for(int p=0;p<=SB_RESAMPLER_PHASES;++p){
+    double sum = 0;
+    for(int k=0;k<SB_RESAMPLER_TAPS;++k){
+      double t = k-(SB_RESAMPLER_TAPS/2-1)-(double)p/SB_RESAMPLER_PHASES;
+      double x = SB_PI*cutoff*t;
+      double sinc = fabs(t)<1e-9? 1.0: sin(x)/x;
+      // Blackman window
+      double w = t/(SB_RESAMPLER_TAPS/2);
+      double window = fabs(w)>=1.0? 0.0: 0.42+0.5*cos(SB_PI*w)+0.08*cos(2*SB_PI*w);
+      sb_resampler_filter[p][k]=sinc*window;
+      sum+=sinc*window;
+    }
+    for(int k=0;k<SB_RESAMPLER_TAPS;++k)sb_resampler_filter[p][k]/=sum;
+  }
+  sb_resampler_filter_ready = true;
+}
+// Feeds one input frame and pushes the output frames it completes into the ring. step is the
+// input rate divided by the output rate. low_quality interpolates linearly between the two
+// frames around the filter center instead, with the same latency.
+static void sb_resampler_push(sb_resampler_t* rs, sb_ring_buffer_t* ring, float l, float r, double step, bool low_quality){
+  if(SB_UNLIKELY(!sb_resampler_filter_ready))sb_resampler_init_filter();
+  uint32_t pos = rs->history_pos = (rs->history_pos+1)%SB_RESAMPLER_TAPS;
+  rs->history[0][pos]=rs->history[0][pos+SB_RESAMPLER_TAPS]=l;
+  rs->history[1][pos]=rs->history[1][pos+SB_RESAMPLER_TAPS]=r;
+  const float* hl = rs->history[0]+pos+1;
+  const float* hr = rs->history[1]+pos+1;
+  if(!(rs->frac>=0&&rs->frac<2))rs->frac=0;
+  while(rs->frac<1.0){
+    float out_l = 0, out_r = 0;
+    if(low_quality){
+      const int c = SB_RESAMPLER_TAPS/2-1;
+      float t = rs->frac;
+      out_l = hl[c]+(hl[c+1]-hl[c])*t;
+      out_r = hr[c]+(hr[c+1]-hr[c])*t;
+    }else{
+      const float* h = sb_resampler_filter[(int)(rs->frac*SB_RESAMPLER_PHASES+0.5)];
+      // Plain multiply-add over contiguous arrays so the compiler can vectorize the taps
+      for(int k=0;k<SB_RESAMPLER_TAPS;++k){
+        out_l+=hl[k]*h[k];
+        out_r+=hr[k]*h[k];
+      }
+    }
+    if(out_l>1.0f)out_l=1.0f;
+    if(out_l<-1.0f)out_l=-1.0f;
+    if(out_r>1.0f)out_r=1.0f;
+    if(out_r<-1.0f)out_r=-1.0f;
+    sb_ring_buffer_push_stereo(ring,out_l*32760,out_r*32760);
+    rs->frac+=step;
   }
-  uint32_t v = (buff->write_ptr-buff->read_ptr);
-  v= v%SB_AUDIO_RING_BUFFER_SIZE;
-  return v;
+  rs->frac-=1.0;
+}
+// Time spent in each emulated subsystem, only collected in builds with SE_ENABLE_PROFILER.
+// CPU time is whatever part of a core tick isn't attributed to another subsystem.
+#define SB_PROFILE_PPU 0
+#define SB_PROFILE_AUDIO 1
+#define SB_PROFILE_DMA 2
+#define SB_PROFILE_GX 3
+#define SB_PROFILE_COUNT 4
+// Work done by the cores, counted in their own state so deep helpers don't need the emu state.
+// Only incremented in builds with SE_ENABLE_PROFILER, the fields are always present so the
+// state layout is the same in every build.
+#define SB_COUNTER_INSTRUCTIONS 0
+#define SB_COUNTER_MMIO 1
+#define SB_COUNTER_DMA_BYTES 2
+#define SB_COUNTER_GX_COMMANDS 3
+#define SB_COUNTER_TRIANGLES 4
+#define SB_COUNTER_PIXELS 5
+#define SB_COUNTER_COUNT 6
+typedef struct{
+  uint64_t value[SB_COUNTER_COUNT];
+}sb_perf_counters_t;
+typedef struct{
+  uint64_t ns[SB_PROFILE_COUNT];
+  uint32_t calls[SB_PROFILE_COUNT];
+  uint64_t counters[SB_COUNTER_COUNT];
+  // Filled in by the frontend around each core tick
+  uint64_t core_ns;
+  uint32_t frames;
+}sb_profile_t;
+// Moves the counters of a core into the profile, called at the end of each core tick
+static FORCE_INLINE void sb_profile_collect(sb_profile_t* p, sb_perf_counters_t* c){
+  for(int i=0;i<SB_COUNTER_COUNT;++i){
+    p->counters[i]+=c->value[i];
+    c->value[i]=0;
+  }
+}
+#ifdef SE_ENABLE_PROFILER
+#include <time.h>
+static FORCE_INLINE uint64_t sb_profile_now_ns(){
+  struct timespec ts;
+  timespec_get(&ts,TIME_UTC);
+  return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+// Call sites that run every cycle only time one in 2^sample_shift calls and scale the result
+static FORCE_INLINE uint64_t sb_profile_begin(sb_profile_t* p, int id, int sample_shift){
+  if((p->calls[id]++)&((1u<<sample_shift)-1))return 0;
+  return sb_profile_now_ns();
 }
+static FORCE_INLINE void sb_profile_end(sb_profile_t* p, int id, int sample_shift, uint64_t start){
+  if(start)p->ns[id]+=(sb_profile_now_ns()-start)<<sample_shift;
+}
+#define SB_PROFILE_BEGIN(emu,id,sample_shift) uint64_t sb_profile_start_##id = sb_profile_begin(&(emu)->profile,id,sample_shift)
+#define SB_PROFILE_END(emu,id,sample_shift) sb_profile_end(&(emu)->profile,id,sample_shift,sb_profile_start_##id)
+#define SB_PERF_COUNT(counters,id,n) ((counters)->value[id]+=(n))
+#else
+#define SB_PROFILE_BEGIN(emu,id,sample_shift) do{}while(0)
+#define SB_PROFILE_END(emu,id,sample_shift) do{}while(0)
+#define SB_PERF_COUNT(counters,id,n) ((void)sizeof(n))
+#endif
+// Link cable between the serial ports of up to SB_LINK_MAX_PORTS consoles. The cores only exchange
+// data at transfer boundaries: a transfer completes once every connected port armed it, and the core
+// that completes it hands each port the data of the others. A core that has to wait for the other
+// consoles, or that completed a transfer, sets link_yield so the frontend lets the others run.
+#define SB_LINK_MAX_PORTS 4
+#define SB_LINK_NORMAL 0      // GB serial and GBA normal mode, 8 or 32 bits swapped between two ports
+#define SB_LINK_MULTIPLAYER 1 // GBA multiplayer mode, 16 bits from each port broadcast to all of them
+typedef struct{
+  bool connected;
+  bool ready; // Armed a transfer, for the clock master once its bits were clocked out
+  bool done;  // The transfer completed and recv holds the data shifted in
+  uint32_t send;
+  uint32_t recv;
+}sb_link_port_t;
+typedef struct{
+  sb_link_port_t port[SB_LINK_MAX_PORTS];
+  uint16_t multi[SB_LINK_MAX_PORTS]; // Data of the last multiplayer transfer, 0xffff for unconnected ports
+  uint64_t transfers;
+}sb_link_t;
+// Completes a transfer started by the master port if the other ports are ready for it. Multiplayer
+// children are always ready since the parent drives their transfers.
+static bool sb_link_try_transfer(sb_link_t* link, int master, int mode){
+  for(int p=0;p<SB_LINK_MAX_PORTS;++p){
+    sb_link_port_t* port = link->port+p;
+    if(mode==SB_LINK_NORMAL&&p!=master&&port->connected&&!port->ready)return false;
+  }
+  for(int p=0;p<SB_LINK_MAX_PORTS;++p)link->multi[p]=link->port[p].connected? link->port[p].send&0xffff: 0xffff;
+  for(int p=0;p<SB_LINK_MAX_PORTS;++p){
+    sb_link_port_t* port = link->port+p;
+    if(!port->connected&&p!=master)continue;
+    port->recv = 0xffffffff;
+    for(int o=0;o<SB_LINK_MAX_PORTS;++o){
+      if(o!=p&&link->port[o].connected){port->recv = link->port[o].send;break;}
+    }
+    port->ready = false;
+    port->done = true;
+  }
+  link->transfers++;
+  return true;
+}
+// Address range breakpoints and watchpoints of one CPU. Ranges are kept sorted by start so a
+// lookup is a binary search, and a per-page summary keeps the lookup off unwatched pages.
+#define SB_MAX_WATCHPOINTS 64
+#define SB_WATCH_PAGE_SHIFT 12
+#define SB_WATCH_READ  0x1
+#define SB_WATCH_WRITE 0x2
+#define SB_WATCH_EXEC  0x4
+typedef struct{
+  uint32_t start;
+  uint32_t end; // Inclusive
+  uint32_t max_end; // Largest end of this and all earlier ranges, bounds the backwards scan
+  uint8_t type;
+}sb_watchpoint_t;
+typedef struct{
+  sb_watchpoint_t points[SB_MAX_WATCHPOINTS];
+  int num_points;
+  // OR of the types watched in each page, rebuilt by sb_watch_rebuild
+  uint8_t page_flags[1<<(32-SB_WATCH_PAGE_SHIFT)];
+  bool hit;
+  uint8_t hit_type;
+  uint32_t hit_address;
+  int hit_index;
+  // The CPU is held before an execute breakpoint until sb_watch_resume, then runs it once
+  bool halted;
+  bool resume_valid;
+  uint32_t resume_pc;
+}sb_watch_table_t;
+static inline void sb_watch_rebuild(sb_watch_table_t* watch){
+  memset(watch->page_flags,0,sizeof(watch->page_flags));
+  uint32_t max_end = 0;
+  for(int i=0;i<watch->num_points;++i){
+    sb_watchpoint_t* p = watch->points+i;
+    if(p->end>max_end)max_end=p->end;
+    p->max_end = max_end;
+    for(uint32_t page=p->start>>SB_WATCH_PAGE_SHIFT;page<=p->end>>SB_WATCH_PAGE_SHIFT;++page)watch->page_flags[page]|=p->type;
+  }
+}
+static inline bool sb_watch_add(sb_watch_table_t* watch, uint32_t start, uint32_t end, int type){
+  if(watch->num_points>=SB_MAX_WATCHPOINTS||end<start||!type)return false;
+  int i = watch->num_points++;
+  while(i>0&&watch->points[i-1].start>start){watch->points[i]=watch->points[i-1];--i;}
+  watch->points[i]=(sb_watchpoint_t){start,end,0,(uint8_t)type};
+  sb_watch_rebuild(watch);
+  return true;
+}
+static inline void sb_watch_remove(sb_watch_table_t* watch, int index){
+  if(index<0||index>=watch->num_points)return;
+  memmove(watch->points+index,watch->points+index+1,(watch->num_points-index-1)*sizeof(sb_watchpoint_t));
+  watch->num_points--;
+  watch->halted = false;
+  sb_watch_rebuild(watch);
+}
+// Returns the index of a range of the given type overlapping [addr, addr+size), or -1
+static inline int sb_watch_find(const sb_watch_table_t* watch, uint32_t addr, uint32_t size, int type){
+  uint32_t last = addr+size-1;
+  int lo = 0, hi = watch->num_points;
+  while(lo<hi){
+    int mid = (lo+hi)/2;
+    if(watch->points[mid].start<=last)lo=mid+1;
+    else hi=mid;
+  }
+  for(int i=lo-1;i>=0&&watch->points[i].max_end>=addr;--i){
+    if(watch->points[i].end>=addr&&(watch->points[i].type&type))return i;
+  }
+  return -1;
+}
+static inline void sb_watch_record_hit(sb_watch_table_t* watch, int index, uint32_t addr, int type){
+  watch->hit = true;
+  watch->hit_index = index;
+  watch->hit_address = addr;
+  watch->hit_type = type;
+}
+// Returns true if a CPU data access hits a watchpoint
+static FORCE_INLINE bool sb_watch_access(sb_watch_table_t* watch, uint32_t addr, uint32_t size, int type){
+  if(SB_LIKELY(!(watch->page_flags[addr>>SB_WATCH_PAGE_SHIFT]&type)))return false;
+  int index = sb_watch_find(watch,addr,size,type);
+  if(index<0)return false;
+  sb_watch_record_hit(watch,index,addr,type);
+  return true;
+}
+// Returns true if the instruction at pc must not run yet
+static FORCE_INLINE bool sb_watch_exec(sb_watch_table_t* watch, uint32_t pc){
+  if(SB_UNLIKELY(watch->halted))return pc==watch->hit_address;
+  if(SB_UNLIKELY(watch->resume_valid)){
+    watch->resume_valid = false;
+    if(pc==watch->resume_pc)return false;
+  }
+  if(SB_LIKELY(!(watch->page_flags[pc>>SB_WATCH_PAGE_SHIFT]&SB_WATCH_EXEC)))return false;
+  int index = sb_watch_find(watch,pc,1,SB_WATCH_EXEC);
+  if(index<0)return false;
+  sb_watch_record_hit(watch,index,pc,SB_WATCH_EXEC);
+  watch->halted = true;
+  return true;
+}
+// Called when emulation continues after a hit
+static inline void sb_watch_resume(sb_watch_table_t* watch){
+  if(watch->halted){
+    watch->halted = false;
+    watch->resume_valid = true;
+    watch->resume_pc = watch->hit_address;
+  }
+}
+// Watch tables are only handed to the CPUs while they hold ranges
+static FORCE_INLINE sb_watch_table_t* sb_watch_active(sb_watch_table_t* watch){
+  return watch&&watch->num_points? watch: NULL;
+}
+// Sampling PC profiler: every SB_PC_PROFILE_INTERVAL instructions the PC is counted in a hash
+// table of 16 byte buckets. The interval is prime so it doesn't alias with loop lengths.
+#define SB_PC_PROFILE_INTERVAL 97
+#define SB_PC_PROFILE_BUCKET_SHIFT 4
+#define SB_PC_PROFILE_SIZE (16*1024)
+typedef struct{
+  uint32_t key[SB_PC_PROFILE_SIZE]; // (pc>>SB_PC_PROFILE_BUCKET_SHIFT)+1, 0 when empty
+  uint32_t count[SB_PC_PROFILE_SIZE];
+  uint32_t used;
+  uint32_t countdown;
+  uint64_t samples;
+  uint64_t dropped; // Samples of new buckets that didn't fit
+}sb_pc_profile_t;
+static void sb_pc_profile_add(sb_pc_profile_t* prof, uint32_t pc){
+  prof->countdown = SB_PC_PROFILE_INTERVAL;
+  prof->samples++;
+  uint32_t key = (pc>>SB_PC_PROFILE_BUCKET_SHIFT)+1;
+  uint32_t slot = (key*2654435761u)&(SB_PC_PROFILE_SIZE-1);
+  // Linear probing, kept at most 3/4 full
+  while(prof->key[slot]&&prof->key[slot]!=key)slot=(slot+1)&(SB_PC_PROFILE_SIZE-1);
+  if(!prof->key[slot]){
+    if(prof->used>=SB_PC_PROFILE_SIZE*3/4){prof->dropped++;return;}
+    prof->key[slot]=key;
+    prof->used++;
+  }
+  prof->count[slot]++;
+}
+static FORCE_INLINE void sb_pc_profile_tick(sb_pc_profile_t* prof, uint32_t pc){
+  if(SB_UNLIKELY(prof->countdown<=1))sb_pc_profile_add(prof,pc);
+  else prof->countdown--;
+}
+// Execution trace of one CPU for the time travel debugger. The PC of every executed instruction and
+// the data writes of the CPU are appended to a raw chunk, which is handed back to the user through
+// flush once one of its arrays is full. instructions counts every instruction recorded so far.
+#define SB_EXEC_TRACE_CHUNK_INSTRUCTIONS (64*1024)
+#define SB_EXEC_TRACE_CHUNK_WRITES (16*1024)
+typedef struct{
+  uint64_t instruction; // Index of the writing instruction, may be the last one of the previous chunk
+  uint32_t addr;
+  uint32_t value;
+  uint32_t size;
+}sb_exec_trace_write_t;
+typedef struct{
+  uint64_t first_instruction;
+  uint32_t num_instructions;
+  uint32_t num_writes;
+  uint32_t pc[SB_EXEC_TRACE_CHUNK_INSTRUCTIONS];
+  sb_exec_trace_write_t writes[SB_EXEC_TRACE_CHUNK_WRITES];
+}sb_exec_trace_chunk_t;
+typedef struct sb_exec_trace_t{
+  sb_exec_trace_chunk_t* chunk;
+  uint64_t instructions;
+  // Has to replace chunk with an empty one that starts at instructions
+  void (*flush)(struct sb_exec_trace_t* trace);
+  void* user_data;
+}sb_exec_trace_t;
+// Called before an instruction executes
+static FORCE_INLINE void sb_exec_trace_pc(sb_exec_trace_t* trace, uint32_t pc){
+  if(SB_UNLIKELY(trace->chunk->num_instructions==SB_EXEC_TRACE_CHUNK_INSTRUCTIONS))trace->flush(trace);
+  sb_exec_trace_chunk_t* c = trace->chunk;
+  c->pc[c->num_instructions++]=pc;
+  trace->instructions++;
+}
+static FORCE_INLINE void sb_exec_trace_write(sb_exec_trace_t* trace, uint32_t addr, uint32_t size, uint32_t value){
+  if(SB_UNLIKELY(trace->chunk->num_writes==SB_EXEC_TRACE_CHUNK_WRITES))trace->flush(trace);
+  sb_exec_trace_chunk_t* c = trace->chunk;
+  c->writes[c->num_writes++]=(sb_exec_trace_write_t){trace->instructions-1,addr,value,size};
+}
+// Sync points where frame dumps (see frame_dump.h) snapshot the state the renderers read. The GBA
+// PPU passes the clock within the frame at the start of each line and of its HBlank, the NDS 3D
+// engine passes SB_VIDEO_SYNC_NDS_3D_SWAP right before it rasterizes a buffer swap.
+#define SB_VIDEO_SYNC_NDS_3D_SWAP (-1)
+typedef struct{
+  void (*sync)(void* user_data, int point);
+  void* user_data;
+}sb_video_capture_t;
+// Binary event log the cores append to from hot paths instead of formatting text. A single producer
+// ring of fixed size records drained to a file by a background thread of the frontend and decoded
+// offline by skyemu_event_log_decode. Records are dropped and counted while the ring is full.
+enum{
+  SB_EVENT_IO7,      // addr, value, write
+  SB_EVENT_IO9,      // addr, value, write
+  SB_EVENT_GX_CMD,   // cmd, modelview stack ptr, projection stack ptr, first parameter
+  SB_EVENT_GX_VERTEX,// x, y, z
+  SB_EVENT_GC_CMD,   // command bytes 0-3, command bytes 4-7
+  SB_EVENT_GC_READ,  // offset, transfer size
+  SB_EVENT_GC_DATA,  // data
+  SB_EVENT_DMA,      // cpu|channel<<8|mode<<16, source, dest, count
+  SB_EVENT_COUNT
+};
+typedef struct{
+  uint64_t clock;
+  uint32_t type;
+  uint32_t data[4];
+  uint32_t padding; // Keeps records at 32 bytes
+}sb_event_record_t;
+#define SB_EVENT_LOG_SIZE (1<<18)
+typedef struct{
+  sb_event_record_t records[SB_EVENT_LOG_SIZE];
+  uint32_t enabled; // Bit n records SB_EVENT n
+  volatile uint64_t dropped;
+  volatile uint32_t read_ptr;
+  uint8_t read_padding[SB_CACHE_LINE_SIZE-sizeof(uint32_t)];
+  volatile uint32_t write_ptr;
+  uint8_t write_padding[SB_CACHE_LINE_SIZE-sizeof(uint32_t)];
+}sb_event_log_t;
+// Event log files are this header followed by num_records raw records
+#define SB_EVENT_LOG_MAGIC "SEEV"
+#define SB_EVENT_LOG_VERSION 1
+typedef struct{
+  char magic[4];
+  uint32_t version;
+  uint32_t system;
+  uint32_t record_size;
+  uint64_t num_records;
+  uint64_t dropped;
+}sb_event_log_file_header_t;
+static FORCE_INLINE bool sb_event_log_enabled(sb_event_log_t* log, int type){return log&&((log->enabled>>type)&1);}
+static void sb_event_log_push(sb_event_log_t* log, int type, uint64_t clock, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3){
+  uint32_t write_ptr = log->write_ptr;
+  if(write_ptr-sb_atomic_load_acquire_u32(&log->read_ptr)>=SB_EVENT_LOG_SIZE){
+    sb_atomic_store_relaxed_u64(&log->dropped,log->dropped+1);
+    return;
+  }
+  sb_event_record_t* r = log->records+write_ptr%SB_EVENT_LOG_SIZE;
+  r->clock = clock;
+  r->type = type;
+  r->data[0]=d0;
+  r->data[1]=d1;
+  r->data[2]=d2;
+  r->data[3]=d3;
+  r->padding=0;
+  sb_atomic_store_release_u32(&log->write_ptr,write_ptr+1);
+}
+// Range of a core's state that rewind diffs in segment_size byte pieces instead of the default.
+// SB_REWIND_SKIP ranges hold host or debug data that doesn't need to be rewound and are never diffed.
+#define SB_REWIND_SKIP 0
+typedef struct{
+  uint32_t offset;
+  uint32_t size;
+  uint32_t segment_size; // Multiple of 8
+}sb_rewind_region_t;
+#define SB_REWIND_REGION(TYPE,MEMBER,SEGMENT_SIZE) {offsetof(TYPE,MEMBER),sizeof(((TYPE*)0)->MEMBER),SEGMENT_SIZE}
+// Reads size bytes at offset of a ROM that isn't resident in rom_data
+typedef bool (*sb_rom_read_fn)(void* user_data, uint64_t offset, void* dst, size_t size);
+// Copies the BIOS/firmware file_name into data, false when it isn't available
+typedef bool (*sb_bios_load_fn)(void* user_data, const char* name, const char* file_name, uint8_t* data, size_t data_size);
 typedef struct {
   int run_mode;          // [0: Reset, 1: Pause, 2: Run, 3: Step ]
   int step_instructions; // Number of instructions to advance while stepping
@@ -145,25 +653,56 @@ typedef struct {
   int system;            // Enum to emulated system Ex. SYSTEM_GB, SYSTEM_GBA
   sb_joy_t joy;
   sb_joy_t prev_frame_joy;  //Used for tracking button press changes in a frame 
+  sb_late_input_t* late_input; // Live buttons to latch at keypad reads, NULL to use joy for the whole frame
+  sb_video_capture_t* video_capture; // Receives the video sync points while a frame dump is captured
+  sb_event_log_t* event_log; // Event log the cores record into, NULL while not logging
   int frame;
   bool render_frame;
+  bool render_next_frame; // The next frame may be rendered, for output that is shown a frame late (NDS 3D)
   sb_ring_buffer_t audio_ring_buff;
   float audio_channel_output[16];
   float mix_l_volume, mix_r_volume;
   float master_volume;
+  bool audio_low_quality; // Resample the core audio with linear interpolation
+  bool audio_disabled; // Nothing hears the output: keep the register visible audio state, skip synthesis
   int cmd_line_arg_count;
   char** cmd_line_args;
   //Temporary storage for use by cores that persists across frames but not in save states
   //or rewind buffers
   uint32_t frames_since_rewind_push;
+  sb_profile_t profile;
   char save_data_base_path[SB_FILE_PATH_SIZE];
   char save_file_path[SB_FILE_PATH_SIZE]; 
   float screen_ghosting_strength;  //0 = off 1 = full strength
   size_t rom_size;
   uint8_t *rom_data;
+  // Used instead of rom_data when it is NULL. Only supported by the NDS core
+  sb_rom_read_fn rom_read;
+  void* rom_read_user_data;
+  // Used instead of se_load_bios_file when set, for hosts running several instances
+  sb_bios_load_fn bios_load;
+  void* bios_load_user_data;
   char rom_path[SB_FILE_PATH_SIZE]; 
   bool force_dmg_mode; 
   uint64_t game_checksum;
+  bool cpu_batch_exec;  // Run CPU instructions in batches between hardware events
+  bool cpu_idle_loop_skip; // Fast forward through busy wait loops as if the CPU was halted
+  uint32_t idle_loop_hint_pc[2]; // Per CPU (GBA uses the first) loop known to only wait for events, 0 for none
+  int nds_cpu_slice_cycles; // Bus cycles the NDS CPUs may run ahead of the hardware (<=1 runs them in lockstep)
+  bool nds_threaded_ppu; // Render the two NDS 2D engines on separate threads
+  bool nds_threaded_arm7; // Run the NDS ARM7 slices on their own thread next to the ARM9 (needs nds_cpu_slice_cycles>1)
+  bool nds_hle_bios; // Emulate the NDS BIOS math, copy and decompression SWIs natively
+  bool nds_instant_card; // Finish NDS gamecard DMA blocks immediately instead of word by word
+  bool gba_hle_bios; // Emulate the GBA BIOS math, copy, affine and decompression SWIs natively
+  sb_link_t* link; // Link cable the serial port is plugged into, NULL when unplugged
+  // Breakpoints of each CPU (GBA uses the first), both NULL while no debugger is open
+  sb_watch_table_t* watch[2];
+  // PC profiles of each CPU, NULL while not profiling
+  sb_pc_profile_t* pc_profile[2];
+  // Execution traces of each CPU, NULL while not recording
+  sb_exec_trace_t* exec_trace[2];
+  int link_port;
+  bool link_yield; // Set by the core when it stopped mid frame at a link transfer boundary
 } sb_emu_state_t;
 typedef struct{
   bool read_since_reset;
@@ -183,6 +722,123 @@ typedef struct{
   } bits[32]; 
 }mmio_reg_t; 
 
+// Runs job(user_data,i) for i in [0,num_jobs) and returns once all of them completed. Jobs may run
+// concurrently so they must only write disjoint data. 
+typedef void (*sb_job_fn_t)(void* user_data, int job_index);
+typedef void (*sb_job_dispatch_t)(sb_job_fn_t job, void* user_data, int num_jobs);
+// Starts job(user_data,0) on a dedicated thread and returns without waiting for it
+typedef void (*sb_job_start_t)(sb_job_fn_t job, void* user_data);
+
+// GBA/NDS 2D engines: per scanline lists of the OAM entries that overlap the line. Entries are 
+// kept in OAM order so sprite priority is unchanged. Users set dirty when OAM is written and call 
+// sb_update_sprite_bins before walking a line. OAM replaced behind the write hooks (save state 
+// loads, resets) is caught by sb_validate_sprite_bins.
+#define SB_SPRITE_BIN_LINES 256
+#define SB_SPRITE_BIN_OBJS 128
+typedef struct{
+  uint8_t count[SB_SPRITE_BIN_LINES];
+  uint8_t objs[SB_SPRITE_BIN_LINES][SB_SPRITE_BIN_OBJS];
+  uint8_t oam[SB_SPRITE_BIN_OBJS*8]; /* OAM the bins were built from */
+  bool dirty;
+  uint64_t rebuilds;
+}sb_sprite_bins_t;
+static void sb_rebuild_sprite_bins(sb_sprite_bins_t* bins, const uint8_t* oam){
+  // Height of each OBJ size (attr1 bits 14-15) and shape (attr0 bits 14-15)
+  const int ysize_lookup[16]={
+    8,8,16,0,
+    16,8,32,0,
+    32,16,32,0,
+    64,32,64,0
+  }; 
+  memset(bins->count,0,sizeof(bins->count));
+  memcpy(bins->oam,oam,sizeof(bins->oam));
+  for(int o=0;o<SB_SPRITE_BIN_OBJS;++o){
+    uint16_t attr0 = oam[o*8+0]|(oam[o*8+1]<<8);
+    uint16_t attr1 = oam[o*8+2]|(oam[o*8+3]<<8);
+    bool rot_scale = SB_BFE(attr0,8,1);
+    bool double_size = SB_BFE(attr0,9,1)&&rot_scale;
+    bool obj_disable = SB_BFE(attr0,9,1)&&!rot_scale;
+    if(obj_disable)continue;
+    int y_coord = SB_BFE(attr0,0,8);
+    int y_size = ysize_lookup[SB_BFE(attr1,14,2)*4+SB_BFE(attr0,14,2)]*(double_size?2:1);
+    for(int y=0;y<y_size;++y){
+      int line = (y_coord+y)&(SB_SPRITE_BIN_LINES-1);
+      bins->objs[line][bins->count[line]++]=o;
+    }
+  }
+  bins->dirty=false;
+  bins->rebuilds++;
+}
+static FORCE_INLINE void sb_update_sprite_bins(sb_sprite_bins_t* bins, const uint8_t* oam){
+  if(SB_UNLIKELY(bins->dirty))sb_rebuild_sprite_bins(bins,oam);
+}
+static inline void sb_validate_sprite_bins(sb_sprite_bins_t* bins, const uint8_t* oam){
+  if(!bins->dirty&&(!bins->rebuilds||memcmp(bins->oam,oam,sizeof(bins->oam))))bins->dirty=true;
+}
+// GBA/NDS 2D engines: the WIN0/WIN1/WINOUT layout of a line as runs of equal window control 
+// ([0-3:bg0-bg3 enable 4:obj enable, 5: special effect enable]). Pixels outside of WIN0/WIN1 also 
+// have SB_WINDOW_OUTSIDE set so the OBJ window can be applied over them. The runs are only rebuilt 
+// when the registers that shape them or the windows covering the line change.
+#define SB_WINDOW_MAX_RUNS 5
+#define SB_WINDOW_OUTSIDE (1<<7)
+typedef struct{
+  uint32_t key[3];
+  bool valid;
+  int num_runs;
+  uint16_t run_start[SB_WINDOW_MAX_RUNS+1];
+  uint8_t run_control[SB_WINDOW_MAX_RUNS];
+  // OR and AND of the control of every pixel of the line, so whole layers can be skipped 
+  uint8_t line_any;
+  uint8_t line_all;
+  uint64_t rebuilds;
+}sb_window_spans_t;
+static void sb_rebuild_window_spans(sb_window_spans_t* w, int width, uint8_t outside, const uint8_t win_control[2], const int win_min[2], const int win_max[2], int active){
+  int bounds[6]={0,width};
+  int num_bounds=2;
+  for(int win=0;win<2;++win){
+    if(!SB_BFE(active,win,1))continue;
+    bounds[num_bounds++]=win_min[win];
+    bounds[num_bounds++]=win_max[win];
+  }
+  for(int i=1;i<num_bounds;++i){
+    for(int j=i;j>0&&bounds[j-1]>bounds[j];--j){int t=bounds[j];bounds[j]=bounds[j-1];bounds[j-1]=t;}
+  }
+  w->num_runs=0;
+  for(int i=0;i+1<num_bounds;++i){
+    int x = bounds[i];
+    if(x>=bounds[i+1]||x>=width)continue;
+    // WIN0 has priority over WIN1
+    uint8_t control = outside|SB_WINDOW_OUTSIDE;
+    if(SB_BFE(active,1,1)&&x>=win_min[1]&&x<win_max[1])control=win_control[1];
+    if(SB_BFE(active,0,1)&&x>=win_min[0]&&x<win_max[0])control=win_control[0];
+    if(w->num_runs&&w->run_control[w->num_runs-1]==control)continue;
+    w->run_start[w->num_runs]=x;
+    w->run_control[w->num_runs++]=control;
+  }
+  w->run_start[w->num_runs]=width;
+  w->valid=true;
+  w->rebuilds++;
+}
+// Fills window with the layout of the line. active has bit 0/1 set when WIN0/WIN1 cover the line. 
+static FORCE_INLINE void sb_update_window_spans(sb_window_spans_t* w, uint8_t* window, int width, uint8_t outside, const uint8_t win_control[2], const int win_min[2], const int win_max[2], int active){
+  uint32_t key[3]={(uint32_t)(outside|(active<<8)),0,0};
+  for(int win=0;win<2;++win){
+    if(!SB_BFE(active,win,1))continue;
+    key[0]|=win_control[win]<<(10+win*8);
+    key[1+win]=win_min[win]|(win_max[win]<<16);
+  }
+  if(SB_UNLIKELY(!w->valid||memcmp(key,w->key,sizeof(key)))){
+    memcpy(w->key,key,sizeof(key));
+    sb_rebuild_window_spans(w,width,outside,win_control,win_min,win_max,active);
+  }
+  w->line_any=0;
+  w->line_all=0xff;
+  for(int r=0;r<w->num_runs;++r){
+    memset(window+w->run_start[r],w->run_control[r],w->run_start[r+1]-w->run_start[r]);
+    w->line_any|=w->run_control[r];
+    w->line_all&=w->run_control[r];
+  }
+}
 static inline float sb_random_float(float min, float max){
   float v = rand()/(float)RAND_MAX;
   return min + v*(max-min);
@@ -263,6 +919,39 @@ static bool sb_save_file_data(const char* path, const uint8_t* data, size_t file
 static void sb_free_file_data(uint8_t* data){
   if(data)free(data);
 }
+// Bump allocator for data that lives as long as a loaded ROM. The block is allocated once and only
+// replaced when a bigger one is needed, so the footprint stays fixed across ROM switches and
+// releasing everything is a reset.
+typedef struct{
+  uint8_t* base;
+  size_t capacity;
+  size_t used;
+}sb_arena_t;
+// Only grows an empty arena, returns false if the allocation fails
+static inline bool sb_arena_reserve(sb_arena_t* arena, size_t capacity){
+  if(capacity<=arena->capacity)return true;
+  if(arena->used)return false;
+  free(arena->base);
+  arena->base = (uint8_t*)malloc(capacity);
+  arena->capacity = arena->base? capacity: 0;
+  return arena->base!=NULL;
+}
+// Allocations are cache line aligned, returns NULL when the arena is full
+static inline void* sb_arena_alloc(sb_arena_t* arena, size_t size){
+  size_t offset = (arena->used+SB_CACHE_LINE_SIZE-1)&~(size_t)(SB_CACHE_LINE_SIZE-1);
+  if(!arena->base||offset>arena->capacity||size>arena->capacity-offset)return NULL;
+  arena->used = offset+size;
+  return arena->base+offset;
+}
+static inline bool sb_arena_owns(const sb_arena_t* arena, const void* ptr){
+  return arena->base&&(const uint8_t*)ptr>=arena->base&&(const uint8_t*)ptr<arena->base+arena->capacity;
+}
+static inline void sb_arena_reset(sb_arena_t* arena){arena->used = 0;}
+static inline void sb_arena_free(sb_arena_t* arena){
+  free(arena->base);
+  arena->base = NULL;
+  arena->capacity = arena->used = 0;
+}
 static const char* sb_parent_path(const char* path){
   static char tmp_path[SB_FILE_PATH_SIZE];
   snprintf(tmp_path, SB_FILE_PATH_SIZE, "%s", path);
@@ -334,6 +1023,10 @@ static void se_join_path(char * dest_path, int dest_size, const char * base_path
   dest_path[dest_size-1]=0;
 }
 bool se_load_bios_file(const char* name, const char* base_path, const char* file_name, uint8_t * data, size_t data_size);
+static inline bool sb_load_bios_file(sb_emu_state_t* emu, const char* name, const char* base_path, const char* file_name, uint8_t* data, size_t data_size){
+  if(emu->bios_load)return emu->bios_load(emu->bios_load_user_data,name,file_name,data,data_size);
+  return se_load_bios_file(name,base_path,file_name,data,data_size);
+}
 static FILE * se_load_log_file(const char* rom_path, const char* log_name){
   bool loaded_bios=false;
   const char* base, *file, *ext; 
@@ -3,14 +3,28 @@
 
 #include<stdio.h>
 #include<string.h>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif !defined(EMSCRIPTEN)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 se_cheat_t cheats[SE_NUM_CHEATS];
 
-void se_run_all_ar_cheats(se_cheat_fn fn) {
+void se_run_all_ar_cheats(se_cheat_fn fn, se_cheat_compile_fn compile) {
   for(int i=0;i< SE_NUM_CHEATS ;++i){
     se_cheat_t * cheat = cheats+i;
-    if(cheat->state!=1)continue;
-    bool success = fn(cheat->buffer,cheat->size);
+    if(cheat->state!=1){cheat->compiled_by=NULL;continue;}
+    if(compile&&cheat->compiled_by!=compile){
+      if(!compile(cheat->buffer,cheat->size,cheat->compiled)){cheat->state = 0;continue;}
+      cheat->compiled_by=compile;
+    }
+    bool success = fn(compile?cheat->compiled:cheat->buffer,cheat->size);
     if(!success) cheat->state = 0; 
   }
 }
@@ -90,6 +104,7 @@ void se_convert_cheat_code(const char * text_code, int cheat_index){
       char_count++;
     }
   }
+  cheat->compiled_by = NULL;
   cheat->size = char_count/8;
   if(cheat->size>=SE_MAX_CHEAT_CODE_SIZE)cheat->size=SE_MAX_CHEAT_CODE_SIZE;
   for(int i=0;i<cheat->size;++i)cheat->buffer[i]=0; 
@@ -105,6 +120,7 @@ void se_convert_cheat_code(const char * text_code, int cheat_index){
 void se_enable_cheat(int cheat_index) {
   if (cheat_index < SE_NUM_CHEATS) {
     cheats[cheat_index].state=1;
+    cheats[cheat_index].compiled_by=NULL;
   }
 }
 
@@ -118,3 +134,470 @@ void se_reset_cheats(void){
   memset(cheats,0,sizeof(cheats));
   for (int i=0;i<SE_NUM_CHEATS;++i){cheats[i].state=-1;}
 }
+
+uint8_t* se_map_file_data(const char* path, size_t* file_size){
+  if(file_size)*file_size = 0;
+  uint8_t* data = NULL;
+  size_t size = 0;
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(path,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+  if(file==INVALID_HANDLE_VALUE)return NULL;
+  LARGE_INTEGER file_bytes;
+  if(GetFileSizeEx(file,&file_bytes)&&file_bytes.QuadPart>0&&(uint64_t)file_bytes.QuadPart<=SIZE_MAX){
+    size = (size_t)file_bytes.QuadPart;
+    HANDLE mapping = CreateFileMappingA(file,NULL,PAGE_WRITECOPY,0,0,NULL);
+    if(mapping){
+      data = (uint8_t*)MapViewOfFile(mapping,FILE_MAP_COPY,0,0,0);
+      // The view keeps the mapping alive
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+#elif !defined(EMSCRIPTEN)
+  int fd = open(path,O_RDONLY);
+  if(fd<0)return NULL;
+  struct stat st;
+  if(fstat(fd,&st)==0&&S_ISREG(st.st_mode)&&st.st_size>0){
+    size = (size_t)st.st_size;
+    void* map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+    if(map!=MAP_FAILED)data = (uint8_t*)map;
+  }
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+#endif
+  if(!data)return NULL;
+  if(file_size)*file_size = size;
+  printf("Mapped file %s file_size %zu\n",path,size);
+  return data;
+}
+void se_unmap_file_data(uint8_t* data, size_t file_size){
+  if(!data)return;
+#if defined(_WIN32)
+  UnmapViewOfFile(data);
+#elif !defined(EMSCRIPTEN)
+  munmap(data,file_size);
+#endif
+}
+
+#define SE_HUGE_PAGE_SIZE (2*1024*1024)
+#define SE_HUGE_ROUND_UP(size) (((size)+SE_HUGE_PAGE_SIZE-1)&~(size_t)(SE_HUGE_PAGE_SIZE-1))
+void se_advise_huge(void* data, size_t size){
+#if defined(MADV_HUGEPAGE)
+  // Transparent huge pages, ignored where they are disabled
+  uintptr_t begin = SE_HUGE_ROUND_UP((uintptr_t)data);
+  uintptr_t end = ((uintptr_t)data+size)&~(uintptr_t)(SE_HUGE_PAGE_SIZE-1);
+  if(end>begin)madvise((void*)begin,end-begin,MADV_HUGEPAGE);
+#endif
+}
+void* se_alloc_huge(size_t size){
+  if(!size)return NULL;
+#if defined(_WIN32)
+  // Large pages need the "Lock pages in memory" privilege, without it regular pages are used
+  SIZE_T large_page = GetLargePageMinimum();
+  if(large_page){
+    void* data = VirtualAlloc(NULL,(size+large_page-1)/large_page*large_page,MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES,PAGE_READWRITE);
+    if(data)return data;
+  }
+  return VirtualAlloc(NULL,size,MEM_RESERVE|MEM_COMMIT,PAGE_READWRITE);
+#elif !defined(EMSCRIPTEN)
+  // Maps a huge page more than needed and unmaps the slack around the aligned block
+  size = SE_HUGE_ROUND_UP(size);
+  size_t mapped_size = size+SE_HUGE_PAGE_SIZE;
+  uint8_t* map = (uint8_t*)mmap(NULL,mapped_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if(map==MAP_FAILED)return NULL;
+  uint8_t* data = (uint8_t*)SE_HUGE_ROUND_UP((uintptr_t)map);
+  if(data>map)munmap(map,data-map);
+  if(map+mapped_size>data+size)munmap(data+size,map+mapped_size-(data+size));
+  se_advise_huge(data,size);
+  return data;
+#else
+  return calloc(1,size);
+#endif
+}
+void se_free_huge(void* data, size_t size){
+  if(!data)return;
+#if defined(_WIN32)
+  VirtualFree(data,0,MEM_RELEASE);
+#elif !defined(EMSCRIPTEN)
+  munmap(data,SE_HUGE_ROUND_UP(size));
+#else
+  free(data);
+#endif
+}
+#if defined(_WIN32)||(!defined(EMSCRIPTEN)&&!defined(__ANDROID__))
+#define SE_SHARED_IMAGES 1
+#endif
+struct se_shared_image_t{
+  size_t size;
+  int refs;
+  uint8_t* data; // View the object was filled through, new images are compared against it
+#if defined(_WIN32)
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+};
+#define SE_MAX_SHARED_IMAGES 64
+#if defined(SE_SHARED_IMAGES)
+static se_shared_image_t se_shared_images[SE_MAX_SHARED_IMAGES];
+// Held while the table is searched or changed, which only happens when ROMs are loaded or freed
+static volatile uint32_t se_shared_images_lock;
+static void se_lock_shared_images(){
+  uint32_t spins = 0;
+#if defined(_MSC_VER) && !defined(__clang__)
+  while(_InterlockedExchange((volatile long*)&se_shared_images_lock,1))sb_spin_wait(&spins);
+#else
+  while(__atomic_exchange_n(&se_shared_images_lock,1,__ATOMIC_ACQUIRE))sb_spin_wait(&spins);
+#endif
+}
+static void se_unlock_shared_images(){sb_atomic_store_release_u32(&se_shared_images_lock,0);}
+static bool se_shared_image_create(se_shared_image_t* img, const void* data, size_t size){
+  uint8_t* map = NULL;
+#if defined(_WIN32)
+  HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE,NULL,PAGE_READWRITE,(DWORD)((uint64_t)size>>32),(DWORD)size,NULL);
+  if(!mapping)return false;
+  map = (uint8_t*)MapViewOfFile(mapping,FILE_MAP_WRITE,0,0,size);
+  if(!map){CloseHandle(mapping);return false;}
+  img->mapping = mapping;
+#else
+  static uint32_t counter = 0;
+  char name[64];
+  snprintf(name,sizeof(name),"/skyemu-image-%d-%u",(int)getpid(),counter++);
+  int fd = shm_open(name,O_CREAT|O_EXCL|O_RDWR,0600);
+  if(fd<0)return false;
+  // The object lives on as long as it is open or mapped
+  shm_unlink(name);
+  if(ftruncate(fd,size)==0)map = (uint8_t*)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  if(!map||map==(uint8_t*)MAP_FAILED){close(fd);return false;}
+  img->fd = fd;
+#endif
+  memcpy(map,data,size);
+  img->data = map;
+  img->size = size;
+  img->refs = 0;
+  return true;
+}
+static void se_shared_image_destroy(se_shared_image_t* img){
+#if defined(_WIN32)
+  UnmapViewOfFile(img->data);
+  CloseHandle(img->mapping);
+#else
+  munmap(img->data,img->size);
+  close(img->fd);
+#endif
+  memset(img,0,sizeof(*img));
+}
+static uint8_t* se_shared_image_map(se_shared_image_t* img){
+#if defined(_WIN32)
+  return (uint8_t*)MapViewOfFile(img->mapping,FILE_MAP_COPY,0,0,img->size);
+#else
+  void* view = mmap(NULL,img->size,PROT_READ|PROT_WRITE,MAP_PRIVATE,img->fd,0);
+  return view==MAP_FAILED? NULL: (uint8_t*)view;
+#endif
+}
+#endif
+uint8_t* se_shared_image_acquire(const void* data, size_t size, se_shared_image_t** image){
+  *image = NULL;
+  if(!size)return NULL;
+#if defined(SE_SHARED_IMAGES)
+  se_lock_shared_images();
+  se_shared_image_t* img = NULL, *free_slot = NULL;
+  for(int i=0;i<SE_MAX_SHARED_IMAGES;++i){
+    se_shared_image_t* s = se_shared_images+i;
+    if(!s->data){
+      if(!free_slot)free_slot = s;
+    }else if(s->size==size&&(s->data==data||memcmp(s->data,data,size)==0)){
+      img = s;
+      break;
+    }
+  }
+  if(!img&&free_slot&&se_shared_image_create(free_slot,data,size))img = free_slot;
+  uint8_t* view = img? se_shared_image_map(img): NULL;
+  if(view){
+    img->refs++;
+    *image = img;
+  }else if(img&&!img->refs)se_shared_image_destroy(img);
+  se_unlock_shared_images();
+  if(view)return view;
+#endif
+  uint8_t* copy = (uint8_t*)malloc(size);
+  if(copy)memcpy(copy,data,size);
+  return copy;
+}
+void se_shared_image_release(se_shared_image_t* image, uint8_t* view){
+  if(!view)return;
+  if(!image){
+    free(view);
+    return;
+  }
+#if defined(SE_SHARED_IMAGES)
+#if defined(_WIN32)
+  UnmapViewOfFile(view);
+#else
+  munmap(view,image->size);
+#endif
+  se_lock_shared_images();
+  if(--image->refs==0)se_shared_image_destroy(image);
+  se_unlock_shared_images();
+#endif
+}
+#if defined(_WIN32)||!defined(EMSCRIPTEN)
+#define SE_WRITE_TRACKING 1
+#endif
+struct se_write_tracker_t{
+  uint8_t* data;
+  size_t size;
+  size_t page_size;
+  volatile uint8_t* dirty; // One byte per page so the fault handler needs no atomics
+};
+#if defined(SE_WRITE_TRACKING)
+#define SE_MAX_WRITE_TRACKERS 1024
+// Read lock free by the fault handler, entries are only published once fully set up
+static se_write_tracker_t* volatile se_write_trackers[SE_MAX_WRITE_TRACKERS];
+static volatile uint32_t se_write_trackers_lock;
+static size_t se_os_page_size(){
+#if defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+static bool se_protect_pages(void* data, size_t size, bool writable){
+#if defined(_WIN32)
+  DWORD old;
+  return VirtualProtect(data,size,writable? PAGE_READWRITE: PAGE_READONLY,&old)!=0;
+#else
+  return mprotect(data,size,writable? PROT_READ|PROT_WRITE: PROT_READ)==0;
+#endif
+}
+// Marks the page dirty and lets the write through, false if addr isn't tracked
+static bool se_write_tracker_fault(uintptr_t addr){
+  for(int i=0;i<SE_MAX_WRITE_TRACKERS;++i){
+    se_write_tracker_t* t = se_write_trackers[i];
+    if(!t||addr<(uintptr_t)t->data||addr>=(uintptr_t)t->data+t->size)continue;
+    size_t page = (addr-(uintptr_t)t->data)/t->page_size;
+    t->dirty[page] = 1;
+    se_protect_pages(t->data+page*t->page_size,t->page_size,true);
+    return true;
+  }
+  return false;
+}
+#if defined(_WIN32)
+static LONG CALLBACK se_write_tracker_handler(PEXCEPTION_POINTERS info){
+  PEXCEPTION_RECORD r = info->ExceptionRecord;
+  if(r->ExceptionCode==EXCEPTION_ACCESS_VIOLATION&&r->NumberParameters>=2&&r->ExceptionInformation[0]==1&&
+     se_write_tracker_fault((uintptr_t)r->ExceptionInformation[1]))return EXCEPTION_CONTINUE_EXECUTION;
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+#else
+static struct sigaction se_prev_segv_action;
+static void se_write_tracker_handler(int sig, siginfo_t* info, void* context){
+  if(se_write_tracker_fault((uintptr_t)info->si_addr))return;
+  // Not ours, hand it to whoever was installed before
+  if(se_prev_segv_action.sa_flags&SA_SIGINFO)se_prev_segv_action.sa_sigaction(sig,info,context);
+  else if(se_prev_segv_action.sa_handler!=SIG_IGN&&se_prev_segv_action.sa_handler!=SIG_DFL)se_prev_segv_action.sa_handler(sig);
+  else sigaction(sig,&se_prev_segv_action,NULL);
+}
+#endif
+static bool se_install_write_tracker_handler(){
+  static bool installed = false;
+  if(installed)return true;
+#if defined(_WIN32)
+  installed = AddVectoredExceptionHandler(1,se_write_tracker_handler)!=NULL;
+#else
+  struct sigaction action;
+  memset(&action,0,sizeof(action));
+  action.sa_sigaction = se_write_tracker_handler;
+  action.sa_flags = SA_SIGINFO|SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  installed = sigaction(SIGSEGV,&action,&se_prev_segv_action)==0;
+#endif
+  return installed;
+}
+#endif
+se_write_tracker_t* se_write_tracker_create(void* data, size_t size){
+#if defined(SE_WRITE_TRACKING)
+  size_t page_size = se_os_page_size();
+  if(!page_size||((uintptr_t)data%page_size))return NULL;
+  size = (size+page_size-1)/page_size*page_size;
+  se_write_tracker_t* t = (se_write_tracker_t*)calloc(1,sizeof(se_write_tracker_t));
+  if(!t)return NULL;
+  t->data = (uint8_t*)data;
+  t->size = size;
+  t->page_size = page_size;
+  t->dirty = (volatile uint8_t*)calloc(size/page_size,1);
+  uint32_t spins = 0;
+#if defined(_MSC_VER) && !defined(__clang__)
+  while(_InterlockedExchange((volatile long*)&se_write_trackers_lock,1))sb_spin_wait(&spins);
+#else
+  while(__atomic_exchange_n(&se_write_trackers_lock,1,__ATOMIC_ACQUIRE))sb_spin_wait(&spins);
+#endif
+  int slot = -1;
+  if(t->dirty&&se_install_write_tracker_handler()){
+    for(int i=0;i<SE_MAX_WRITE_TRACKERS&&slot<0;++i)if(!se_write_trackers[i])slot = i;
+  }
+  if(slot>=0)se_write_trackers[slot] = t;
+  sb_atomic_store_release_u32(&se_write_trackers_lock,0);
+  // Large pages (Windows) can't be protected
+  if(slot>=0&&se_protect_pages(t->data,t->size,false))return t;
+  if(slot>=0)se_write_trackers[slot] = NULL;
+  free((void*)t->dirty);
+  free(t);
+#endif
+  return NULL;
+}
+void se_write_tracker_destroy(se_write_tracker_t* tracker){
+#if defined(SE_WRITE_TRACKING)
+  if(!tracker)return;
+  se_protect_pages(tracker->data,tracker->size,true);
+  for(int i=0;i<SE_MAX_WRITE_TRACKERS;++i)if(se_write_trackers[i]==tracker)se_write_trackers[i] = NULL;
+  free((void*)tracker->dirty);
+  free(tracker);
+#endif
+}
+bool se_write_tracker_dirty(const se_write_tracker_t* tracker, size_t offset, size_t size){
+  if(!size)return false;
+  size_t last = (offset+size-1)/tracker->page_size;
+  for(size_t page = offset/tracker->page_size;page<=last;++page)if(tracker->dirty[page])return true;
+  return false;
+}
+void se_write_tracker_reset(se_write_tracker_t* tracker, size_t offset, size_t size){
+#if defined(SE_WRITE_TRACKING)
+  if(!size)return;
+  size_t last = (offset+size-1)/tracker->page_size;
+  for(size_t page = offset/tracker->page_size;page<=last;++page){
+    if(!tracker->dirty[page])continue;
+    tracker->dirty[page] = 0;
+    se_protect_pages(tracker->data+page*tracker->page_size,tracker->page_size,false);
+  }
+#endif
+}
+static bool se_push_symbol(se_symbol_table_t* table, int* capacity, uint32_t address, uint32_t size, const char* name, size_t name_len){
+  if(table->num_symbols==*capacity){
+    int new_capacity = *capacity? *capacity*2: 1024;
+    se_symbol_t* symbols = (se_symbol_t*)realloc(table->symbols,new_capacity*sizeof(se_symbol_t));
+    if(!symbols)return false;
+    table->symbols = symbols;
+    *capacity = new_capacity;
+  }
+  char* copy = (char*)malloc(name_len+1);
+  if(!copy)return false;
+  memcpy(copy,name,name_len);
+  copy[name_len]=0;
+  table->symbols[table->num_symbols++] = (se_symbol_t){address,size,copy};
+  return true;
+}
+static uint32_t se_elf_read32(const uint8_t* data){return data[0]|(data[1]<<8)|(data[2]<<16)|((uint32_t)data[3]<<24);}
+static uint16_t se_elf_read16(const uint8_t* data){return data[0]|(data[1]<<8);}
+// Only little endian ELF32, which is what GBA and NDS toolchains produce
+static bool se_load_elf_symbols(se_symbol_table_t* table, int* capacity, const uint8_t* data, size_t size){
+  if(size<52||data[4]!=1||data[5]!=1)return false;
+  uint32_t shoff = se_elf_read32(data+0x20);
+  uint32_t shentsize = se_elf_read16(data+0x2E);
+  uint32_t shnum = se_elf_read16(data+0x30);
+  if(shentsize<40||shoff>size||(uint64_t)shnum*shentsize>size-shoff)return false;
+  for(uint32_t s=0;s<shnum;++s){
+    const uint8_t* sh = data+shoff+s*shentsize;
+    // SHT_SYMTAB
+    if(se_elf_read32(sh+4)!=2)continue;
+    uint32_t sym_off = se_elf_read32(sh+16);
+    uint32_t sym_size = se_elf_read32(sh+20);
+    uint32_t link = se_elf_read32(sh+24);
+    if(link>=shnum||sym_off>size||sym_size>size-sym_off)continue;
+    const uint8_t* strtab_sh = data+shoff+link*shentsize;
+    uint32_t str_off = se_elf_read32(strtab_sh+16);
+    uint32_t str_size = se_elf_read32(strtab_sh+20);
+    if(str_off>size||str_size>size-str_off)continue;
+    for(uint32_t e=0;e+16<=sym_size;e+=16){
+      const uint8_t* sym = data+sym_off+e;
+      // STT_FUNC
+      if((sym[12]&0xf)!=2)continue;
+      uint32_t name = se_elf_read32(sym);
+      if(name>=str_size)continue;
+      const char* str = (const char*)data+str_off+name;
+      size_t len = strnlen(str,str_size-name);
+      // The low bit only marks Thumb code
+      if(len&&!se_push_symbol(table,capacity,se_elf_read32(sym+4)&~1u,se_elf_read32(sym+8),str,len))return false;
+    }
+  }
+  return true;
+}
+// Takes lines holding exactly an address and a name, which covers "02000000 name" (NO$GBA)
+// and "0x02000000 name" (ld map). Directives like .arm and section lines are skipped.
+static bool se_load_text_symbols(se_symbol_table_t* table, int* capacity, const char* data, size_t size){
+  size_t i = 0;
+  while(i<size){
+    size_t end = i;
+    while(end<size&&data[end]!='\n')++end;
+    const char* tok[3]; size_t tok_len[3]; int num_tok = 0;
+    for(size_t c=i;c<end&&num_tok<3;){
+      while(c<end&&isspace((unsigned char)data[c]))++c;
+      if(c>=end)break;
+      tok[num_tok]=data+c;
+      while(c<end&&!isspace((unsigned char)data[c]))++c;
+      tok_len[num_tok]=data+c-tok[num_tok];
+      num_tok++;
+    }
+    i = end+1;
+    if(num_tok!=2)continue;
+    const char* addr = tok[0];
+    size_t addr_len = tok_len[0];
+    if(addr_len>2&&addr[0]=='0'&&(addr[1]=='x'||addr[1]=='X')){addr+=2;addr_len-=2;}
+    if(addr_len<6||addr_len>16)continue;
+    bool hex = true;
+    uint64_t value = 0;
+    for(size_t c=0;c<addr_len&&hex;++c){
+      char ch = tolower((unsigned char)addr[c]);
+      if(ch>='0'&&ch<='9')value=value*16+ch-'0';
+      else if(ch>='a'&&ch<='f')value=value*16+ch-'a'+10;
+      else hex=false;
+    }
+    char first = tok[1][0];
+    if(!hex||!(isalpha((unsigned char)first)||first=='_'||first=='$'))continue;
+    if(!se_push_symbol(table,capacity,(uint32_t)value,0,tok[1],tok_len[1]))return false;
+  }
+  return true;
+}
+static int se_compare_symbols(const void* a, const void* b){
+  uint32_t aa = ((const se_symbol_t*)a)->address;
+  uint32_t bb = ((const se_symbol_t*)b)->address;
+  return aa<bb? -1: aa>bb;
+}
+bool se_load_symbols(se_symbol_table_t* table, const char* path){
+  se_free_symbols(table);
+  size_t size = 0;
+  uint8_t* data = sb_load_file_data(path,&size);
+  if(!data)return false;
+  int capacity = 0;
+  bool okay = size>=4&&memcmp(data,"\x7f" "ELF",4)==0? se_load_elf_symbols(table,&capacity,data,size)
+                                                       : se_load_text_symbols(table,&capacity,(const char*)data,size);
+  sb_free_file_data(data);
+  if(!okay||!table->num_symbols){
+    if(!okay)printf("Failed to load symbols from %s\n",path);
+    se_free_symbols(table);
+    return false;
+  }
+  qsort(table->symbols,table->num_symbols,sizeof(se_symbol_t),se_compare_symbols);
+  printf("Loaded %d symbols from %s\n",table->num_symbols,path);
+  return true;
+}
+void se_free_symbols(se_symbol_table_t* table){
+  for(int i=0;i<table->num_symbols;++i)free(table->symbols[i].name);
+  free(table->symbols);
+  table->symbols = NULL;
+  table->num_symbols = 0;
+}
+const se_symbol_t* se_find_symbol(const se_symbol_table_t* table, uint32_t address){
+  int lo = 0, hi = table->num_symbols;
+  while(lo<hi){
+    int mid = (lo+hi)/2;
+    if(table->symbols[mid].address<=address)lo=mid+1;
+    else hi=mid;
+  }
+  if(lo==0)return NULL;
+  const se_symbol_t* sym = table->symbols+lo-1;
+  if(sym->size&&address-sym->address>=sym->size)return NULL;
+  return sym;
+}
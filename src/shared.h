@@ -3,6 +3,7 @@
 
 #include<stdint.h>
 #include<stdbool.h>
+#include<stddef.h>
 
 #define SE_AUDIO_SAMPLE_RATE 48000
 #define SE_AUDIO_BUFF_CHANNELS 2
@@ -12,17 +13,24 @@
 #define SE_MAX_CHEAT_NAME_SIZE 32
 #define SE_MAX_CHEAT_CODE_SIZE 256
 
+typedef bool(*se_cheat_fn)(const uint32_t* buffer, uint32_t size);
+// Translates a code buffer into the form run every frame (e.g. decrypted), returns false if the code is invalid
+typedef bool(*se_cheat_compile_fn)(const uint32_t* buffer, uint32_t size, uint32_t* compiled);
+
 typedef struct{
   char name[SE_MAX_CHEAT_NAME_SIZE];
   uint32_t buffer[SE_MAX_CHEAT_CODE_SIZE];
   uint32_t size; //In 32bit words
   int32_t state; //-1: invalid, 0: inactive, 1: active
+  // Cached output of compiled_by, NULL when it has to be rebuilt
+  se_cheat_compile_fn compiled_by;
+  uint32_t compiled[SE_MAX_CHEAT_CODE_SIZE];
 }se_cheat_t;
 
 extern se_cheat_t cheats[SE_NUM_CHEATS];
-typedef bool(*se_cheat_fn)(const uint32_t* buffer, uint32_t size);
 
-void se_run_all_ar_cheats(se_cheat_fn fn);
+// compile may be NULL if the codes are run as entered
+void se_run_all_ar_cheats(se_cheat_fn fn, se_cheat_compile_fn compile);
 void se_load_cheats(const char * filename);
 void se_save_cheats(const char* filename);
 void se_convert_cheat_code(const char * text_code, int cheat_index);
@@ -30,4 +38,54 @@ void se_enable_cheat(int cheat_index);
 void se_disable_cheat(int cheat_index);
 void se_reset_cheats(void);
 
+typedef struct{
+  uint32_t address;
+  uint32_t size; // 0 if the symbol extends to the next one
+  char* name;
+}se_symbol_t;
+// Debug symbols of a ROM sorted by address
+typedef struct{
+  se_symbol_t* symbols;
+  int num_symbols;
+}se_symbol_table_t;
+
+// Loads the functions of an ELF symbol table, or address/name pairs of a NO$GBA .sym or a GNU ld .map file
+bool se_load_symbols(se_symbol_table_t* table, const char* path);
+void se_free_symbols(se_symbol_table_t* table);
+// Returns the symbol covering address, NULL if there is none
+const se_symbol_t* se_find_symbol(const se_symbol_table_t* table, uint32_t address);
+
+// Maps a file copy on write so its pages are only read in (and written back nowhere) when touched.
+// Returns NULL where mapping isn't supported or fails, callers fall back to sb_load_file_data.
+uint8_t* se_map_file_data(const char* path, size_t* file_size);
+void se_unmap_file_data(uint8_t* data, size_t file_size);
+
+// Zero filled memory for large, randomly accessed guest state (cores, rewind captures). It starts on
+// a 2MB boundary and is backed by huge pages where the OS allows it, cutting TLB misses.
+// Returns NULL on failure, free it with se_free_huge and the same size.
+void* se_alloc_huge(size_t size);
+void se_free_huge(void* data, size_t size);
+// Asks for huge pages on the 2MB pages inside an existing range (ie. a global), a hint only
+void se_advise_huge(void* data, size_t size);
+
+// Read only images (ROMs) shared by the instances that load identical bytes. Every user gets its own
+// copy on write view of one shared memory object, so only the pages a core writes to (GBA GPIO
+// registers, ROM patching cheats) are duplicated. Where shared memory isn't supported the view is a
+// private copy and image is set to NULL. Thread safe, returns NULL when out of memory.
+typedef struct se_shared_image_t se_shared_image_t;
+uint8_t* se_shared_image_acquire(const void* data, size_t size, se_shared_image_t** image);
+void se_shared_image_release(se_shared_image_t* image, uint8_t* view);
+
+// Records which pages of [data,data+size) get written by write protecting them and catching the
+// first write to each page. data must be page aligned. Returns NULL where pages can't be protected
+// (Emscripten, Windows large pages), callers then have to compare the contents instead. Writes by
+// the OS (read() into the range) fail instead of being recorded, only the CPU may write to it.
+typedef struct se_write_tracker_t se_write_tracker_t;
+se_write_tracker_t* se_write_tracker_create(void* data, size_t size);
+void se_write_tracker_destroy(se_write_tracker_t* tracker);
+// Whether a page overlapping [offset,offset+size) was written since it was last reset
+bool se_write_tracker_dirty(const se_write_tracker_t* tracker, size_t offset, size_t size);
+// Protects the written pages overlapping the range again and marks them clean
+void se_write_tracker_reset(se_write_tracker_t* tracker, size_t offset, size_t size);
+
 #endif
@@ -0,0 +1,180 @@
+#ifndef SHM_CONTROL_H
+#define SHM_CONTROL_H
+// Shared memory control channel for automation clients on the same host, an alternative to the
+// HTTP Control Server without sockets or encoding. The emulator creates a named mapping with the
+// layout of shm_control_t: the latest frame and RAM windows in two slots published through a
+// sequence counter, the audio output and a queue of commands from the client.
+//
+// This header is also the C client: it has no other dependencies, see tools/skyemu_shm.py for Python.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_CONTROL_MAGIC 0x4d48534bu /* "KSHM" */
+#define SHM_CONTROL_VERSION 1
+#define SHM_CONTROL_MAX_FRAME_BYTES (256*192*2*4) /* Both NDS screens */
+#define SHM_CONTROL_AUDIO_FRAMES 16384
+#define SHM_CONTROL_MAX_RAM_WINDOWS 16
+#define SHM_CONTROL_MAX_RAM_BYTES (1024*1024)
+#define SHM_CONTROL_CMD_QUEUE_SIZE 256 /* Power of 2 */
+
+// Commands, map is an address map of the HCS /read_byte command
+#define SHM_CONTROL_CMD_INPUT 1      // value: held buttons, bit n is the n'th HCS /input key
+#define SHM_CONTROL_CMD_TOUCH 2      // address: pen down, value: float x (low 32 bits) and y, 0-1 on the touch screen
+#define SHM_CONTROL_CMD_RUN 3
+#define SHM_CONTROL_CMD_PAUSE 4
+#define SHM_CONTROL_CMD_STEP 5       // value: frames to run before pausing
+#define SHM_CONTROL_CMD_WRITE_BYTE 6 // map, address, value: byte
+#define SHM_CONTROL_CMD_ADD_RAM_WINDOW 7 // map, address, value: size. Copied into every published slot
+#define SHM_CONTROL_CMD_CLEAR_RAM_WINDOWS 8
+#define SHM_CONTROL_CMD_CAPTURE_SLOT 9 // value: save state slot
+#define SHM_CONTROL_CMD_LOAD_SLOT 10   // value: save state slot
+
+typedef struct{
+  uint32_t type;
+  uint32_t map;
+  uint64_t address;
+  uint64_t value;
+}shm_control_cmd_t;
+
+typedef struct{
+  uint32_t map;
+  uint32_t size;
+  uint64_t address;
+  uint32_t offset; // Into the ram of a slot
+  uint32_t padding;
+}shm_control_ram_window_t;
+
+typedef struct{
+  uint64_t frame; // Frames published since the channel was opened
+  uint32_t width, height; // RGBA8, the alpha channel is undefined
+  uint32_t ram_bytes;
+  uint32_t num_ram_windows;
+  shm_control_ram_window_t ram_windows[SHM_CONTROL_MAX_RAM_WINDOWS];
+  uint8_t pixels[SHM_CONTROL_MAX_FRAME_BYTES];
+  uint8_t ram[SHM_CONTROL_MAX_RAM_BYTES];
+}shm_control_slot_t;
+
+// Every counter only ever grows and is written by one side, each sits on its own cache line
+typedef struct{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint32_t sample_rate;
+  uint8_t padding0[44];
+  // Slot seq&1 holds the latest published frame, 0 while nothing was published. The emulator sets
+  // writing to the next seq before it overwrites slot writing&1, so a copy of slot seq&1 is intact
+  // if writing is at most seq+1 after the copy.
+  volatile uint32_t seq;
+  volatile uint32_t writing;
+  uint8_t padding1[56];
+  // Interleaved stereo int16 frames written so far, the last SHM_CONTROL_AUDIO_FRAMES are in audio
+  volatile uint32_t audio_write;
+  uint8_t padding2[60];
+  // Command queue, written by the client and consumed by the emulator once per UI frame
+  volatile uint32_t cmd_write;
+  uint8_t padding3[60];
+  volatile uint32_t cmd_read;
+  uint8_t padding4[60];
+  shm_control_cmd_t cmds[SHM_CONTROL_CMD_QUEUE_SIZE];
+  int16_t audio[SHM_CONTROL_AUDIO_FRAMES*2];
+  shm_control_slot_t slots[2];
+}shm_control_t;
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static inline uint32_t shm_control_load_acquire(volatile uint32_t* p){return (uint32_t)_InterlockedOr((volatile long*)p,0);}
+static inline void shm_control_store_release(volatile uint32_t* p, uint32_t v){_InterlockedExchange((volatile long*)p,(long)v);}
+// Orders the stores and loads before it against the ones after it
+static inline void shm_control_fence(){_ReadWriteBarrier();MemoryBarrier();}
+#else
+static inline uint32_t shm_control_load_acquire(volatile uint32_t* p){return __atomic_load_n(p,__ATOMIC_ACQUIRE);}
+static inline void shm_control_store_release(volatile uint32_t* p, uint32_t v){__atomic_store_n(p,v,__ATOMIC_RELEASE);}
+static inline void shm_control_fence(){__atomic_thread_fence(__ATOMIC_SEQ_CST);}
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif !defined(__ANDROID__) && !defined(__EMSCRIPTEN__)
+#define SHM_CONTROL_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+// Creates (emulator) or opens (client) the mapping called name, a POSIX shared memory object name
+// like "/skyemu" or a Windows file mapping name. Returns NULL on failure or where unsupported.
+static inline shm_control_t* shm_control_open(const char* name, bool create){
+  shm_control_t* shm = NULL;
+  uint64_t size = sizeof(shm_control_t);
+#if defined(_WIN32)
+  HANDLE mapping = create? CreateFileMappingA(INVALID_HANDLE_VALUE,NULL,PAGE_READWRITE,(DWORD)(size>>32),(DWORD)size,name):
+                           OpenFileMappingA(FILE_MAP_ALL_ACCESS,FALSE,name);
+  if(!mapping)return NULL;
+  shm = (shm_control_t*)MapViewOfFile(mapping,FILE_MAP_ALL_ACCESS,0,0,size);
+  // The view keeps the mapping alive
+  CloseHandle(mapping);
+#elif defined(SHM_CONTROL_POSIX)
+  int fd = shm_open(name,create? O_CREAT|O_RDWR: O_RDWR,0600);
+  if(fd<0)return NULL;
+  struct stat st;
+  bool ok = create? ftruncate(fd,size)==0: fstat(fd,&st)==0&&(uint64_t)st.st_size>=size;
+  if(ok){
+    shm = (shm_control_t*)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if(shm==MAP_FAILED)shm = NULL;
+  }
+  close(fd);
+  if(!shm&&create)shm_unlink(name);
+#endif
+  if(!shm)return NULL;
+  if(create){
+    memset(shm,0,offsetof(shm_control_t,cmds));
+    shm->size = size;
+    shm->version = SHM_CONTROL_VERSION;
+    shm_control_store_release(&shm->magic,SHM_CONTROL_MAGIC);
+  }else if(shm_control_load_acquire(&shm->magic)!=SHM_CONTROL_MAGIC||shm->version!=SHM_CONTROL_VERSION||shm->size!=size){
+#if defined(_WIN32)
+    UnmapViewOfFile(shm);
+#elif defined(SHM_CONTROL_POSIX)
+    munmap(shm,size);
+#endif
+    return NULL;
+  }
+  return shm;
+}
+// The creator also removes the name, clients that still have it mapped keep their view
+static inline void shm_control_close(shm_control_t* shm, const char* name, bool created){
+  if(!shm)return;
+  if(created)shm_control_store_release(&shm->magic,0);
+#if defined(_WIN32)
+  UnmapViewOfFile(shm);
+#elif defined(SHM_CONTROL_POSIX)
+  munmap(shm,sizeof(shm_control_t));
+  if(created)shm_unlink(name);
+#endif
+}
+
+// Client: queues a command, returns false while the queue is full
+static inline bool shm_control_push_cmd(shm_control_t* shm, shm_control_cmd_t cmd){
+  uint32_t write = shm->cmd_write;
+  if(write-shm_control_load_acquire(&shm->cmd_read)>=SHM_CONTROL_CMD_QUEUE_SIZE)return false;
+  shm->cmds[write%SHM_CONTROL_CMD_QUEUE_SIZE] = cmd;
+  shm_control_store_release(&shm->cmd_write,write+1);
+  return true;
+}
+// Client: copies the latest slot without the unused part of its pixels and ram. Returns its
+// sequence number, or 0 if nothing was published or the emulator overwrote it while copying.
+static inline uint32_t shm_control_read_slot(shm_control_t* shm, shm_control_slot_t* out){
+  uint32_t seq = shm_control_load_acquire(&shm->seq);
+  if(!seq)return 0;
+  const shm_control_slot_t* slot = shm->slots+(seq&1);
+  memcpy(out,slot,offsetof(shm_control_slot_t,pixels));
+  uint64_t pixel_bytes = (uint64_t)out->width*out->height*4;
+  if(pixel_bytes>SHM_CONTROL_MAX_FRAME_BYTES||out->ram_bytes>SHM_CONTROL_MAX_RAM_BYTES)return 0;
+  memcpy(out->pixels,slot->pixels,pixel_bytes);
+  memcpy(out->ram,slot->ram,out->ram_bytes);
+  shm_control_fence();
+  return shm->writing-seq<=1? seq: 0;
+}
+#endif
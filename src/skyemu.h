@@ -0,0 +1,141 @@
+/*****************************************************************************
+ *
+ *   SkyEmu headless core library
+ *
+ *   Runs the GB, GBA and NDS cores without a window, GPU context or audio
+ *   device, for bots, test harnesses and servers. Built as the libskyemu
+ *   target; nothing in this header depends on the core headers.
+ *
+**/
+
+#ifndef SKYEMU_H
+#define SKYEMU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SKYEMU_SYSTEM_AUTO 0 // Detected from the ROM header
+#define SKYEMU_SYSTEM_GB 1
+#define SKYEMU_SYSTEM_GBA 2
+#define SKYEMU_SYSTEM_NDS 3
+
+// Bits of the buttons mask passed to skyemu_set_input
+#define SKYEMU_KEY_A (1u<<0)
+#define SKYEMU_KEY_B (1u<<1)
+#define SKYEMU_KEY_X (1u<<2)
+#define SKYEMU_KEY_Y (1u<<3)
+#define SKYEMU_KEY_UP (1u<<4)
+#define SKYEMU_KEY_DOWN (1u<<5)
+#define SKYEMU_KEY_LEFT (1u<<6)
+#define SKYEMU_KEY_RIGHT (1u<<7)
+#define SKYEMU_KEY_L (1u<<8)
+#define SKYEMU_KEY_R (1u<<9)
+#define SKYEMU_KEY_START (1u<<10)
+#define SKYEMU_KEY_SELECT (1u<<11)
+
+// Address spaces of skyemu_read_memory/skyemu_write_memory
+#define SKYEMU_BUS_MAIN 0 // SM83 on GB, ARM7TDMI on GBA, ARM9 on NDS
+#define SKYEMU_BUS_ARM7 1 // ARM7 of the NDS
+
+typedef struct skyemu_t skyemu_t;
+
+// Instances are independent, each owns a full core (tens of MB for the NDS).
+skyemu_t* skyemu_create(void);
+void skyemu_destroy(skyemu_t* emu);
+
+// Directory searched for BIOS/firmware files (gba_bios.bin, bios7.bin, ...) by the following
+// skyemu_load_rom calls. Without one the cores boot with their built-in HLE BIOS.
+void skyemu_set_bios_dir(skyemu_t* emu, const char* dir);
+// Copies the ROM and resets the core. Instances loading identical ROMs share one copy, pages
+// are only duplicated where a core writes to its ROM. Returns false if the system can't be
+// detected or the core rejects the ROM.
+bool skyemu_load_rom(skyemu_t* emu, const void* data, size_t size, int system);
+void skyemu_reset(skyemu_t* emu);
+int skyemu_system(const skyemu_t* emu);
+
+// Buttons is a mask of SKYEMU_KEY_*. The touch position is normalized to the NDS bottom screen.
+void skyemu_set_input(skyemu_t* emu, uint32_t buttons, float touch_x, float touch_y, bool touch_down);
+// Emulates one frame. Frames that aren't rendered skip the PPU work where the core allows it.
+void skyemu_run_frame(skyemu_t* emu, bool render);
+
+// RGBA8 framebuffer of the last rendered frame, owned by the instance. The NDS returns the top
+// screen above the bottom one.
+const uint8_t* skyemu_framebuffer(const skyemu_t* emu, int* width, int* height);
+// Interleaved stereo int16 audio at SKYEMU_AUDIO_SAMPLE_RATE queued by the frames run so far.
+// Returns the longest contiguous run of the queue and its length in frames, which stays valid
+// until skyemu_audio_consume. The queue holds a few frames of audio and drops samples once full,
+// which feeds back into the GB audio state, so drain it every frame when replays must be exact.
+#define SKYEMU_AUDIO_SAMPLE_RATE 48000
+const int16_t* skyemu_audio(skyemu_t* emu, size_t* num_frames);
+void skyemu_audio_consume(skyemu_t* emu, size_t num_frames);
+// Without audio the queue stays empty and the cores skip synthesizing samples, the sound registers
+// still behave the same for the game. Enabled by default except on batch instances.
+void skyemu_set_audio_enabled(skyemu_t* emu, bool enabled);
+// Speedups that trade timing accuracy for emulation speed, all off by default and kept across
+// skyemu_load_rom. Batched execution runs CPU instructions in bulk between hardware events and
+// idle loop skipping fast forwards busy wait loops as if the CPU was halted.
+void skyemu_set_cpu_speedups(skyemu_t* emu, bool batch_exec, bool idle_loop_skip);
+// Bus cycles the NDS CPUs may run ahead of the hardware and each other before syncing. Values <=1
+// (the default) run them in lockstep, larger slices are faster but less accurate.
+void skyemu_set_nds_cpu_slice(skyemu_t* emu, int cycles);
+
+// States hold the core's emulated state only and are tied to the build and ROM that made them.
+size_t skyemu_state_size(const skyemu_t* emu);
+bool skyemu_save_state(const skyemu_t* emu, void* data, size_t size);
+bool skyemu_load_state(skyemu_t* emu, const void* data, size_t size);
+
+// Forks are snapshots for tree search, cheaper than states when taken many times per second. A
+// fork shares the 4KB pages of the state that didn't change with the fork the instance was last
+// taken from or restored to, so memory and copying follow what the branch modified. Forks are
+// immutable and can be restored into any instance running the same ROM, also from several threads
+// at once. skyemu_fork returns NULL when out of memory.
+// From its first fork on an instance write protects its state to find the pages a branch touched.
+// This installs a SIGSEGV handler (a vectored exception handler on Windows) that passes faults
+// outside of instances on to the previous handler.
+typedef struct skyemu_fork_t skyemu_fork_t;
+skyemu_fork_t* skyemu_fork(skyemu_t* emu);
+bool skyemu_restore_fork(skyemu_t* emu, skyemu_fork_t* fork);
+void skyemu_fork_free(skyemu_fork_t* fork);
+
+// Byte accesses through the debugger paths of the cores, the same ones the memory viewer uses
+void skyemu_read_memory(skyemu_t* emu, int bus, uint64_t address, void* data, size_t size);
+void skyemu_write_memory(skyemu_t* emu, int bus, uint64_t address, const void* data, size_t size);
+
+// Batches of instances running the same ROM, stepped together across the job pool threads for
+// reinforcement learning style workloads. Observations and RAM views of every instance are
+// gathered into contiguous buffers, instance i at row i, so they can be handed over without copies.
+typedef struct skyemu_batch_t skyemu_batch_t;
+// Each instance starts from the state right after boot until skyemu_batch_set_initial_state
+skyemu_batch_t* skyemu_batch_create(const void* rom, size_t size, int system, int num_instances);
+void skyemu_batch_destroy(skyemu_batch_t* batch);
+int skyemu_batch_num_instances(const skyemu_batch_t* batch);
+// For per instance access with the single instance API, between steps only
+skyemu_t* skyemu_batch_instance(skyemu_batch_t* batch, int index);
+// Bytes [address,address+size) of bus are gathered after each step, views are stacked in the
+// order they were added. Returns false once the views reach SKYEMU_BATCH_MAX_RAM_BYTES per instance.
+#define SKYEMU_BATCH_MAX_RAM_BYTES (64*1024)
+bool skyemu_batch_add_ram_view(skyemu_batch_t* batch, int bus, uint64_t address, size_t size);
+// Snapshot that skyemu_batch_reset copies into the instances, from a skyemu_save_state buffer
+bool skyemu_batch_set_initial_state(skyemu_batch_t* batch, const void* data, size_t size);
+// Resets the instances whose reset entry is non zero (all with NULL) to the initial state
+// Their RAM views are refreshed right away, their frames with the next step since states don't
+// include the framebuffer.
+void skyemu_batch_reset(skyemu_batch_t* batch, const uint8_t* reset);
+// Holds buttons[i] on instance i for repeat frames (action repeat), rendering only the last one.
+// Audio is disabled.
+void skyemu_batch_step(skyemu_batch_t* batch, const uint32_t* buttons, int repeat);
+// num_instances x height x width x 4 RGBA8 frames of the last step
+const uint8_t* skyemu_batch_observations(const skyemu_batch_t* batch, int* width, int* height);
+// num_instances x bytes_per_instance stacked RAM views of the last step
+const uint8_t* skyemu_batch_ram(const skyemu_batch_t* batch, size_t* bytes_per_instance);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
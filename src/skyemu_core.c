@@ -0,0 +1,566 @@
+/*****************************************************************************
+ *
+ *   SkyEmu headless core library
+ *
+ *   Implements the C API of skyemu.h on top of the header only cores, with no
+ *   dependency on sokol, ImGui, SDL or the network code of the frontend.
+ *
+**/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared.h"
+#include "sb_types.h"
+#include "gb.h"
+#include "gba.h"
+#include "nds.h"
+#include "job_pool.h"
+#include "skyemu.h"
+
+_Static_assert(SKYEMU_SYSTEM_GB==SYSTEM_GB&&SKYEMU_SYSTEM_GBA==SYSTEM_GBA&&SKYEMU_SYSTEM_NDS==SYSTEM_NDS, "skyemu.h system ids out of sync");
+_Static_assert(SKYEMU_AUDIO_SAMPLE_RATE==SE_AUDIO_SAMPLE_RATE, "skyemu.h sample rate out of sync");
+
+struct skyemu_t{
+  sb_emu_state_t emu_state;
+  union{
+    sb_gb_t gb;
+    gba_t gba;
+    nds_t nds;
+  }core;
+  union{
+    gb_scratch_t gb;
+    gba_scratch_t gba;
+    nds_scratch_t nds;
+  }scratch;
+  char bios_dir[SB_FILE_PATH_SIZE];
+  // rom_data is a copy on write view of it, shared with the instances running the same ROM
+  se_shared_image_t* rom_image;
+  // Fork last taken from or restored into the instance, new forks share its unchanged pages
+  skyemu_fork_t* fork_base;
+  // Pages of the instance written since fork_base, NULL until the first fork or if unsupported
+  se_write_tracker_t* writes;
+};
+
+// States are the core struct minus the regions its rewind table skips, which hold host and
+// debug data and keep their current values on load
+#define SKYEMU_STATE_MAGIC 0x534b5945u /* "SKYE" */
+typedef struct{
+  uint32_t magic;
+  uint32_t system;
+  uint64_t size;
+}skyemu_state_header_t;
+
+// Frontend hook of the cores, unused since every instance installs skyemu_load_bios
+bool se_load_bios_file(const char* name, const char* base_path, const char* file_name, uint8_t* data, size_t data_size){
+  return false;
+}
+static bool skyemu_load_bios(void* user_data, const char* name, const char* file_name, uint8_t* data, size_t data_size){
+  skyemu_t* emu = (skyemu_t*)user_data;
+  if(!emu->bios_dir[0])return false;
+  char path[SB_FILE_PATH_SIZE];
+  se_join_path(path,SB_FILE_PATH_SIZE,emu->bios_dir,file_name,NULL);
+  size_t bytes = 0;
+  uint8_t* bios = sb_load_file_data(path,&bytes);
+  if(!bios)return false;
+  bool loaded = bytes<=data_size;
+  if(loaded){
+    memset(data,0,data_size);
+    memcpy(data,bios,bytes);
+  }
+  sb_free_file_data(bios);
+  return loaded;
+}
+
+skyemu_t* skyemu_create(void){
+  return (skyemu_t*)se_alloc_huge(sizeof(skyemu_t));
+}
+void skyemu_destroy(skyemu_t* emu){
+  if(!emu)return;
+  skyemu_fork_free(emu->fork_base);
+  se_write_tracker_destroy(emu->writes);
+  se_shared_image_release(emu->rom_image,emu->emu_state.rom_data);
+  se_free_huge(emu,sizeof(skyemu_t));
+}
+void skyemu_set_bios_dir(skyemu_t* emu, const char* dir){
+  strncpy(emu->bios_dir,dir?dir:"",SB_FILE_PATH_SIZE-1);
+  emu->bios_dir[SB_FILE_PATH_SIZE-1]=0;
+}
+
+// Checks the fixed bytes of each cartridge header
+static int skyemu_detect_system(const uint8_t* rom, size_t size){
+  // CRC16 of the Nintendo logo
+  if(size>=0x160&&rom[0x15c]==0x56&&rom[0x15d]==0xcf)return SYSTEM_NDS;
+  if(size>=0xc0&&rom[0xb2]==0x96)return SYSTEM_GBA;
+  // Start of the Nintendo logo
+  if(size>=0x150&&rom[0x104]==0xce&&rom[0x105]==0xed)return SYSTEM_GB;
+  return 0;
+}
+// Points the core at the scratch and ROM of this instance, which the ticks also do on entry
+static void skyemu_ptrs_init(skyemu_t* emu){
+  sb_emu_state_t* e = &emu->emu_state;
+  switch(e->system){
+    case SYSTEM_GB: sb_ptrs_init(&emu->core.gb,&emu->scratch.gb,e->rom_data); break;
+    case SYSTEM_GBA: gba_ptrs_init(&emu->core.gba,&emu->scratch.gba,e->rom_data); break;
+    case SYSTEM_NDS: nds_ptrs_init(&emu->core.nds,&emu->scratch.nds,e->rom_data,e->rom_size); break;
+  }
+}
+static bool skyemu_boot(skyemu_t* emu){
+  sb_emu_state_t* e = &emu->emu_state;
+  bool loaded = false;
+  e->bios_load = skyemu_load_bios;
+  e->bios_load_user_data = emu;
+  switch(e->system){
+    case SYSTEM_GB:{
+      loaded = sb_load_rom(e,&emu->core.gb,&emu->scratch.gb);
+      static const uint8_t palette[12]={0xff,0xff,0xff,0xaa,0xaa,0xaa,0x55,0x55,0x55,0x00,0x00,0x00};
+      memcpy(emu->core.gb.dmg_palette,palette,sizeof(palette));
+    }break;
+    case SYSTEM_GBA: loaded = gba_load_rom(e,&emu->core.gba,&emu->scratch.gba); break;
+    case SYSTEM_NDS: loaded = nds_load_rom(e,&emu->core.nds,&emu->scratch.nds); break;
+  }
+  if(loaded)skyemu_ptrs_init(emu);
+  e->rom_loaded = loaded;
+  e->run_mode = SB_MODE_RUN;
+  return loaded;
+}
+bool skyemu_load_rom(skyemu_t* emu, const void* data, size_t size, int system){
+  sb_emu_state_t* e = &emu->emu_state;
+  se_shared_image_release(emu->rom_image,e->rom_data);
+  e->rom_data = NULL;
+  emu->rom_image = NULL;
+  e->rom_loaded = false;
+  if(system==SKYEMU_SYSTEM_AUTO)system = skyemu_detect_system((const uint8_t*)data,size);
+  const char* ext = system==SYSTEM_GB? "gb": system==SYSTEM_GBA? "gba": system==SYSTEM_NDS? "nds": NULL;
+  if(!ext||!size)return false;
+  e->rom_data = se_shared_image_acquire(data,size,&emu->rom_image);
+  if(!e->rom_data)return false;
+  e->rom_size = size;
+  e->system = system;
+  // The cores pick their loader by extension, saves stay in memory since the save path is empty
+  snprintf(e->rom_path,SB_FILE_PATH_SIZE,"rom.%s",ext);
+  e->save_file_path[0] = 0;
+  memset(&e->audio_ring_buff,0,sizeof(e->audio_ring_buff));
+  return skyemu_boot(emu);
+}
+void skyemu_reset(skyemu_t* emu){
+  if(emu->emu_state.rom_data)skyemu_boot(emu);
+}
+int skyemu_system(const skyemu_t* emu){
+  return emu->emu_state.rom_loaded? emu->emu_state.system: 0;
+}
+
+void skyemu_set_input(skyemu_t* emu, uint32_t buttons, float touch_x, float touch_y, bool touch_down){
+  sb_joy_t* joy = &emu->emu_state.joy;
+  for(int i=0;i<=SE_KEY_SELECT;++i)joy->inputs[i]=(buttons>>i)&1;
+  joy->touch_pos[0] = touch_x;
+  joy->touch_pos[1] = touch_y;
+  joy->inputs[SE_KEY_PEN_DOWN] = touch_down;
+}
+void skyemu_run_frame(skyemu_t* emu, bool render){
+  sb_emu_state_t* e = &emu->emu_state;
+  if(!e->rom_loaded)return;
+  e->render_frame = render;
+  e->render_next_frame = true;
+  switch(e->system){
+    case SYSTEM_GB: sb_tick(e,&emu->core.gb,&emu->scratch.gb); break;
+    case SYSTEM_GBA: gba_tick(e,&emu->core.gba,&emu->scratch.gba); break;
+    case SYSTEM_NDS: nds_tick(e,&emu->core.nds,&emu->scratch.nds); break;
+  }
+  e->prev_frame_joy = e->joy;
+  e->frame++;
+}
+
+const uint8_t* skyemu_framebuffer(const skyemu_t* emu, int* width, int* height){
+  int w = 0, h = 0;
+  const uint8_t* fb = NULL;
+  if(emu->emu_state.rom_loaded)switch(emu->emu_state.system){
+    case SYSTEM_GB: w = SB_LCD_W; h = SB_LCD_H; fb = emu->scratch.gb.framebuffer; break;
+    case SYSTEM_GBA: w = GBA_LCD_W; h = GBA_LCD_H; fb = emu->scratch.gba.framebuffer; break;
+    case SYSTEM_NDS: w = NDS_LCD_W; h = NDS_LCD_H*2; fb = emu->scratch.nds.framebuffer_full; break;
+  }
+  if(width)*width = w;
+  if(height)*height = h;
+  return fb;
+}
+const int16_t* skyemu_audio(skyemu_t* emu, size_t* num_frames){
+  sb_ring_buffer_t* ring = &emu->emu_state.audio_ring_buff;
+  uint32_t samples = sb_ring_buffer_size(ring);
+  uint32_t start = ring->read_ptr%SB_AUDIO_RING_BUFFER_SIZE;
+  if(start+samples>SB_AUDIO_RING_BUFFER_SIZE)samples = SB_AUDIO_RING_BUFFER_SIZE-start;
+  *num_frames = samples/2;
+  return ring->data+start;
+}
+void skyemu_audio_consume(skyemu_t* emu, size_t num_frames){
+  sb_ring_buffer_t* ring = &emu->emu_state.audio_ring_buff;
+  uint32_t frames = sb_ring_buffer_size(ring)/2;
+  sb_ring_buffer_consume(ring,(num_frames<frames? num_frames: frames)*2);
+}
+void skyemu_set_audio_enabled(skyemu_t* emu, bool enabled){
+  emu->emu_state.audio_disabled = !enabled;
+}
+void skyemu_set_cpu_speedups(skyemu_t* emu, bool batch_exec, bool idle_loop_skip){
+  emu->emu_state.cpu_batch_exec = batch_exec;
+  emu->emu_state.cpu_idle_loop_skip = idle_loop_skip;
+}
+void skyemu_set_nds_cpu_slice(skyemu_t* emu, int cycles){
+  emu->emu_state.nds_cpu_slice_cycles = cycles;
+}
+
+static const sb_rewind_region_t* skyemu_state_regions(const skyemu_t* emu, int* num_regions, size_t* core_size){
+  *num_regions = 0;
+  *core_size = 0;
+  if(!emu->emu_state.rom_loaded)return NULL;
+  switch(emu->emu_state.system){
+    case SYSTEM_GB: *core_size = sizeof(sb_gb_t); return sb_rewind_regions(num_regions);
+    case SYSTEM_GBA: *core_size = sizeof(gba_t); return gba_rewind_regions(num_regions);
+    case SYSTEM_NDS: *core_size = sizeof(nds_t); return nds_rewind_regions(num_regions);
+  }
+  return NULL;
+}
+// Copies the saved bytes of the core to or from state, returns the number of bytes
+static size_t skyemu_copy_state(const skyemu_t* emu, uint8_t* core, uint8_t* state, bool save){
+  int num_regions;
+  size_t core_size;
+  const sb_rewind_region_t* regions = skyemu_state_regions(emu,&num_regions,&core_size);
+  if(!core_size)return 0;
+  size_t pos = 0, bytes = 0;
+  for(int i=0;i<=num_regions;++i){
+    bool last = i==num_regions;
+    if(!last&&regions[i].segment_size!=SB_REWIND_SKIP)continue;
+    size_t end = last? core_size: regions[i].offset;
+    if(end>pos&&state){
+      if(save)memcpy(state+bytes,core+pos,end-pos);
+      else memcpy(core+pos,state+bytes,end-pos);
+    }
+    if(end>pos)bytes+=end-pos;
+    if(!last)pos = regions[i].offset+regions[i].size;
+  }
+  return bytes;
+}
+size_t skyemu_state_size(const skyemu_t* emu){
+  size_t bytes = skyemu_copy_state(emu,NULL,NULL,true);
+  return bytes? sizeof(skyemu_state_header_t)+bytes: 0;
+}
+bool skyemu_save_state(const skyemu_t* emu, void* data, size_t size){
+  size_t state_size = skyemu_state_size(emu);
+  if(!state_size||size<state_size)return false;
+  skyemu_state_header_t header = {SKYEMU_STATE_MAGIC,emu->emu_state.system,state_size};
+  memcpy(data,&header,sizeof(header));
+  skyemu_copy_state(emu,(uint8_t*)&emu->core,(uint8_t*)data+sizeof(header),true);
+  return true;
+}
+bool skyemu_load_state(skyemu_t* emu, const void* data, size_t size){
+  size_t state_size = skyemu_state_size(emu);
+  skyemu_state_header_t header;
+  if(!state_size||size<state_size)return false;
+  memcpy(&header,data,sizeof(header));
+  if(header.magic!=SKYEMU_STATE_MAGIC||header.system!=(uint32_t)emu->emu_state.system||header.size!=state_size)return false;
+  skyemu_copy_state(emu,(uint8_t*)&emu->core,(uint8_t*)data+sizeof(header),false);
+  skyemu_ptrs_init(emu);
+  if(emu->emu_state.system==SYSTEM_NDS)nds_update_vram_mapping(&emu->core.nds);
+  return true;
+}
+
+// Forks split the saved bytes of the core into pages and share them by reference count. The
+// instance write protects itself from its first fork on, so pages that weren't written since its
+// base fork are shared and left alone on restore without looking at their bytes. Written pages are
+// still compared with the base since many writes store the value that was already there. Without
+// write protection every page is compared.
+#define SKYEMU_FORK_PAGE_SIZE 4096
+typedef struct{
+  volatile uint32_t refs;
+  uint8_t data[];
+}skyemu_fork_page_t;
+struct skyemu_fork_t{
+  volatile uint32_t refs; // The owner and every instance using it as its base
+  int system;
+  size_t num_pages;
+  skyemu_fork_page_t* pages[];
+};
+#if defined(_MSC_VER) && !defined(__clang__)
+static uint32_t skyemu_atomic_add(volatile uint32_t* p, int v){return (uint32_t)_InterlockedExchangeAdd((volatile long*)p,v)+v;}
+#else
+static uint32_t skyemu_atomic_add(volatile uint32_t* p, int v){return __atomic_add_fetch(p,v,__ATOMIC_ACQ_REL);}
+#endif
+// Calls fn on every page of the saved bytes of the core in order, returns the number of pages
+typedef bool (*skyemu_fork_page_fn)(void* ctx, size_t page, uint8_t* data, size_t size);
+static size_t skyemu_fork_walk(skyemu_t* emu, skyemu_fork_page_fn fn, void* ctx){
+  int num_regions;
+  size_t core_size;
+  const sb_rewind_region_t* regions = skyemu_state_regions(emu,&num_regions,&core_size);
+  uint8_t* core = (uint8_t*)&emu->core;
+  size_t pos = 0, page = 0;
+  for(int i=0;i<=num_regions;++i){
+    bool last = i==num_regions;
+    if(!last&&regions[i].segment_size!=SB_REWIND_SKIP)continue;
+    size_t end = last? core_size: regions[i].offset;
+    for(;pos<end;pos+=SKYEMU_FORK_PAGE_SIZE){
+      size_t size = end-pos<SKYEMU_FORK_PAGE_SIZE? end-pos: SKYEMU_FORK_PAGE_SIZE;
+      if(fn&&!fn(ctx,page,core+pos,size))return 0;
+      ++page;
+    }
+    if(!last)pos = regions[i].offset+regions[i].size;
+  }
+  return page;
+}
+typedef struct{
+  skyemu_t* emu;
+  skyemu_fork_t* fork;
+  skyemu_fork_t* base;
+  uint8_t* stale; // Pages a restore has to copy, NULL for all
+}skyemu_fork_walk_t;
+static bool skyemu_fork_page_written(skyemu_t* emu, uint8_t* data, size_t size){
+  return !emu->writes||se_write_tracker_dirty(emu->writes,data-(uint8_t*)emu,size);
+}
+static bool skyemu_fork_capture_page(void* ctx, size_t page, uint8_t* data, size_t size){
+  skyemu_fork_walk_t* walk = (skyemu_fork_walk_t*)ctx;
+  skyemu_fork_t* fork = walk->fork;
+  skyemu_fork_page_t* p = walk->base? walk->base->pages[page]: NULL;
+  if(p&&(!skyemu_fork_page_written(walk->emu,data,size)||memcmp(p->data,data,size)==0))skyemu_atomic_add(&p->refs,1);
+  else{
+    p = (skyemu_fork_page_t*)malloc(sizeof(skyemu_fork_page_t)+size);
+    if(!p)return false;
+    p->refs = 1;
+    memcpy(p->data,data,size);
+  }
+  fork->pages[page] = p;
+  return true;
+}
+// Found before copying anything, since fork pages straddle OS pages and copying one marks its
+// neighbours written
+static bool skyemu_fork_find_stale_page(void* ctx, size_t page, uint8_t* data, size_t size){
+  skyemu_fork_walk_t* walk = (skyemu_fork_walk_t*)ctx;
+  walk->stale[page] = walk->base->pages[page]!=walk->fork->pages[page]||skyemu_fork_page_written(walk->emu,data,size);
+  return true;
+}
+static bool skyemu_fork_restore_page(void* ctx, size_t page, uint8_t* data, size_t size){
+  skyemu_fork_walk_t* walk = (skyemu_fork_walk_t*)ctx;
+  if(!walk->stale||walk->stale[page])memcpy(data,walk->fork->pages[page]->data,size);
+  return true;
+}
+// The instance now matches the fork, start recording its writes from here
+static bool skyemu_fork_protect_page(void* ctx, size_t page, uint8_t* data, size_t size){
+  skyemu_t* emu = (skyemu_t*)ctx;
+  se_write_tracker_reset(emu->writes,data-(uint8_t*)emu,size);
+  return true;
+}
+static void skyemu_fork_set_base(skyemu_t* emu, skyemu_fork_t* fork){
+  skyemu_atomic_add(&fork->refs,1);
+  skyemu_fork_free(emu->fork_base);
+  emu->fork_base = fork;
+  if(emu->writes)skyemu_fork_walk(emu,skyemu_fork_protect_page,emu);
+}
+// Tracking starts with every page clean, so it can't begin while the instance has a base it
+// may have drifted from unnoticed
+static void skyemu_fork_track_writes(skyemu_t* emu){
+  if(!emu->writes&&!emu->fork_base)emu->writes = se_write_tracker_create(emu,offsetof(skyemu_t,core)+sizeof(emu->core));
+}
+// Base fork of the instance if fork can share its pages
+static skyemu_fork_t* skyemu_fork_compatible_base(skyemu_t* emu, int system, size_t num_pages){
+  skyemu_fork_t* base = emu->fork_base;
+  return base&&base->system==system&&base->num_pages==num_pages? base: NULL;
+}
+skyemu_fork_t* skyemu_fork(skyemu_t* emu){
+  if(!emu->emu_state.rom_loaded)return NULL;
+  size_t num_pages = skyemu_fork_walk(emu,NULL,NULL);
+  skyemu_fork_t* fork = (skyemu_fork_t*)calloc(1,sizeof(skyemu_fork_t)+num_pages*sizeof(skyemu_fork_page_t*));
+  if(!fork)return NULL;
+  fork->refs = 1;
+  fork->system = emu->emu_state.system;
+  fork->num_pages = num_pages;
+  skyemu_fork_track_writes(emu);
+  skyemu_fork_walk_t walk = {emu,fork,skyemu_fork_compatible_base(emu,fork->system,num_pages),NULL};
+  if(!skyemu_fork_walk(emu,skyemu_fork_capture_page,&walk)){
+    skyemu_fork_free(fork);
+    return NULL;
+  }
+  skyemu_fork_set_base(emu,fork);
+  return fork;
+}
+bool skyemu_restore_fork(skyemu_t* emu, skyemu_fork_t* fork){
+  if(!fork||!emu->emu_state.rom_loaded||fork->system!=emu->emu_state.system||
+     fork->num_pages!=skyemu_fork_walk(emu,NULL,NULL))return false;
+  skyemu_fork_track_writes(emu);
+  skyemu_fork_walk_t walk = {emu,fork,skyemu_fork_compatible_base(emu,fork->system,fork->num_pages),NULL};
+  if(walk.base&&emu->writes)walk.stale = (uint8_t*)malloc(fork->num_pages);
+  if(walk.stale)skyemu_fork_walk(emu,skyemu_fork_find_stale_page,&walk);
+  skyemu_fork_walk(emu,skyemu_fork_restore_page,&walk);
+  free(walk.stale);
+  skyemu_fork_set_base(emu,fork);
+  // Derived state the core rebuilds is recorded as written like any other change since the fork
+  skyemu_ptrs_init(emu);
+  if(emu->emu_state.system==SYSTEM_NDS)nds_update_vram_mapping(&emu->core.nds);
+  return true;
+}
+void skyemu_fork_free(skyemu_fork_t* fork){
+  if(!fork||skyemu_atomic_add(&fork->refs,-1))return;
+  for(size_t i=0;i<fork->num_pages;++i){
+    skyemu_fork_page_t* p = fork->pages[i];
+    // Pages past a failed capture are still NULL
+    if(p&&!skyemu_atomic_add(&p->refs,-1))free(p);
+  }
+  free(fork);
+}
+
+void skyemu_read_memory(skyemu_t* emu, int bus, uint64_t address, void* data, size_t size){
+  uint8_t* out = (uint8_t*)data;
+  for(size_t i=0;i<size;++i){
+    uint8_t v = 0;
+    if(emu->emu_state.rom_loaded)switch(emu->emu_state.system){
+      case SYSTEM_GB: v = sb_read8(&emu->core.gb,(address+i)&0xffff); break;
+      case SYSTEM_GBA: v = gba_read8_debug(&emu->core.gba,address+i); break;
+      case SYSTEM_NDS: v = bus==SKYEMU_BUS_ARM7? nds7_debug_read8(&emu->core.nds,address+i): nds9_debug_read8(&emu->core.nds,address+i); break;
+    }
+    out[i] = v;
+  }
+}
+void skyemu_write_memory(skyemu_t* emu, int bus, uint64_t address, const void* data, size_t size){
+  const uint8_t* in = (const uint8_t*)data;
+  if(!emu->emu_state.rom_loaded)return;
+  for(size_t i=0;i<size;++i){
+    switch(emu->emu_state.system){
+      case SYSTEM_GB: sb_store8(&emu->core.gb,(address+i)&0xffff,in[i]); break;
+      case SYSTEM_GBA: gba_store8_debug(&emu->core.gba,address+i,in[i]); break;
+      case SYSTEM_NDS:
+        if(bus==SKYEMU_BUS_ARM7)nds7_debug_write8(&emu->core.nds,address+i,in[i]);
+        else nds9_debug_write8(&emu->core.nds,address+i,in[i]);
+        break;
+    }
+  }
+}
+
+#define SKYEMU_BATCH_MAX_RAM_VIEWS 32
+typedef struct{
+  int bus;
+  uint64_t address;
+  size_t size;
+}skyemu_ram_view_t;
+struct skyemu_batch_t{
+  int num_instances;
+  skyemu_t** instances;
+  uint8_t* initial_state;
+  size_t state_size;
+  int width, height;
+  uint8_t* observations;
+  skyemu_ram_view_t ram_views[SKYEMU_BATCH_MAX_RAM_VIEWS];
+  int num_ram_views;
+  size_t ram_bytes;
+  uint8_t* ram;
+  // Arguments of the job running
+  const uint32_t* buttons;
+  const uint8_t* reset;
+  int repeat;
+};
+
+skyemu_batch_t* skyemu_batch_create(const void* rom, size_t size, int system, int num_instances){
+  if(num_instances<=0)return NULL;
+  skyemu_batch_t* b = (skyemu_batch_t*)calloc(1,sizeof(skyemu_batch_t));
+  if(!b)return NULL;
+  b->instances = (skyemu_t**)calloc(num_instances,sizeof(skyemu_t*));
+  bool ok = b->instances!=NULL;
+  if(ok)b->num_instances = num_instances;
+  // Loaded one at a time, the cores build their shared lookup tables on the first load
+  for(int i=0;ok&&i<num_instances;++i){
+    b->instances[i] = skyemu_create();
+    ok = b->instances[i]&&skyemu_load_rom(b->instances[i],rom,size,system);
+    if(ok)skyemu_set_audio_enabled(b->instances[i],false);
+  }
+  if(ok){
+    // Built on the first audio sample otherwise, which would race between the workers
+    if(!sb_resampler_filter_ready)sb_resampler_init_filter();
+    skyemu_framebuffer(b->instances[0],&b->width,&b->height);
+    b->state_size = skyemu_state_size(b->instances[0]);
+    b->initial_state = (uint8_t*)malloc(b->state_size);
+    b->observations = (uint8_t*)calloc((size_t)num_instances*b->width*b->height,4);
+    ok = b->initial_state&&b->observations&&skyemu_save_state(b->instances[0],b->initial_state,b->state_size);
+  }
+  if(!ok){
+    skyemu_batch_destroy(b);
+    return NULL;
+  }
+  return b;
+}
+void skyemu_batch_destroy(skyemu_batch_t* b){
+  if(!b)return;
+  for(int i=0;i<b->num_instances;++i)skyemu_destroy(b->instances[i]);
+  free(b->instances);
+  free(b->initial_state);
+  free(b->observations);
+  free(b->ram);
+  free(b);
+}
+int skyemu_batch_num_instances(const skyemu_batch_t* b){return b->num_instances;}
+skyemu_t* skyemu_batch_instance(skyemu_batch_t* b, int index){
+  return index>=0&&index<b->num_instances? b->instances[index]: NULL;
+}
+bool skyemu_batch_add_ram_view(skyemu_batch_t* b, int bus, uint64_t address, size_t size){
+  if(b->num_ram_views>=SKYEMU_BATCH_MAX_RAM_VIEWS||b->ram_bytes+size>SKYEMU_BATCH_MAX_RAM_BYTES)return false;
+  uint8_t* ram = (uint8_t*)realloc(b->ram,(size_t)b->num_instances*(b->ram_bytes+size));
+  if(!ram)return false;
+  b->ram = ram;
+  b->ram_views[b->num_ram_views++] = (skyemu_ram_view_t){bus,address,size};
+  b->ram_bytes+=size;
+  // Rows move with the new stride, refreshed by the next step
+  memset(b->ram,0,(size_t)b->num_instances*b->ram_bytes);
+  return true;
+}
+bool skyemu_batch_set_initial_state(skyemu_batch_t* b, const void* data, size_t size){
+  // Validated by loading it into the first instance
+  if(size<b->state_size||!skyemu_load_state(b->instances[0],data,size))return false;
+  memcpy(b->initial_state,data,b->state_size);
+  return true;
+}
+
+static void skyemu_batch_gather_ram(skyemu_batch_t* b, int i){
+  skyemu_t* emu = b->instances[i];
+  uint8_t* ram = b->ram+b->ram_bytes*i;
+  for(int v=0;v<b->num_ram_views;++v){
+    skyemu_ram_view_t* view = b->ram_views+v;
+    skyemu_read_memory(emu,view->bus,view->address,ram,view->size);
+    ram+=view->size;
+  }
+}
+static void skyemu_batch_reset_job(void* user_data, int i){
+  skyemu_batch_t* b = (skyemu_batch_t*)user_data;
+  if(b->reset&&!b->reset[i])return;
+  skyemu_t* emu = b->instances[i];
+  skyemu_load_state(emu,b->initial_state,b->state_size);
+  memset(&emu->emu_state.audio_ring_buff,0,sizeof(emu->emu_state.audio_ring_buff));
+  memset(&emu->emu_state.joy,0,sizeof(emu->emu_state.joy));
+  skyemu_batch_gather_ram(b,i);
+}
+void skyemu_batch_reset(skyemu_batch_t* b, const uint8_t* reset){
+  b->reset = reset;
+  job_pool_run(skyemu_batch_reset_job,b,b->num_instances);
+}
+static void skyemu_batch_step_job(void* user_data, int i){
+  skyemu_batch_t* b = (skyemu_batch_t*)user_data;
+  skyemu_t* emu = b->instances[i];
+  skyemu_set_input(emu,b->buttons?b->buttons[i]:0,0,0,false);
+  for(int r=0;r<b->repeat;++r){
+    skyemu_run_frame(emu,r==b->repeat-1);
+    sb_ring_buffer_t* ring = &emu->emu_state.audio_ring_buff;
+    sb_ring_buffer_consume(ring,sb_ring_buffer_size(ring));
+  }
+  size_t frame_bytes = (size_t)b->width*b->height*4;
+  memcpy(b->observations+frame_bytes*i,skyemu_framebuffer(emu,NULL,NULL),frame_bytes);
+  skyemu_batch_gather_ram(b,i);
+}
+void skyemu_batch_step(skyemu_batch_t* b, const uint32_t* buttons, int repeat){
+  b->buttons = buttons;
+  b->repeat = repeat<1? 1: repeat;
+  job_pool_run(skyemu_batch_step_job,b,b->num_instances);
+}
+const uint8_t* skyemu_batch_observations(const skyemu_batch_t* b, int* width, int* height){
+  if(width)*width = b->width;
+  if(height)*height = b->height;
+  return b->observations;
+}
+const uint8_t* skyemu_batch_ram(const skyemu_batch_t* b, size_t* bytes_per_instance){
+  if(bytes_per_instance)*bytes_per_instance = b->ram_bytes;
+  return b->ram;
+}
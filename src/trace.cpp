@@ -0,0 +1,170 @@
+extern "C" {
+#include "trace.h"
+}
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace {
+enum : uint8_t { TRACE_BEGIN, TRACE_END, TRACE_INSTANT, TRACE_COUNTER, TRACE_ASYNC_BEGIN, TRACE_ASYNC_END };
+
+struct trace_event_t {
+    uint64_t ts_ns;
+    const char* name;
+    uint64_t value; // Counter value or async id
+    uint8_t type;
+};
+
+// Only the owning thread writes, the exporter copies the ring and drops the slots that were
+// overwritten while it copied them
+struct trace_ring_t {
+    static const uint64_t size = 1 << 15;
+    std::atomic<uint64_t> write{0};
+    std::atomic<const char*> thread_name{nullptr};
+    int tid = 0;
+    trace_event_t events[size];
+};
+
+std::atomic<bool> trace_enabled{false};
+std::atomic<uint64_t> trace_start_ns{0};
+std::mutex registry_mutex;
+// Rings are never freed, the threads that record are the long lived pools of the frontend
+std::vector<trace_ring_t*> registry;
+thread_local trace_ring_t* thread_ring = nullptr;
+thread_local const char* thread_name = nullptr;
+
+uint64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+trace_ring_t* trace_thread_ring() {
+    if (thread_ring) return thread_ring;
+    trace_ring_t* ring = new trace_ring_t();
+    ring->thread_name = thread_name;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    ring->tid = (int)registry.size() + 1;
+    registry.push_back(ring);
+    thread_ring = ring;
+    return ring;
+}
+
+void trace_record(uint8_t type, const char* name, uint64_t value) {
+    if (!trace_enabled.load(std::memory_order_relaxed)) return;
+    trace_ring_t* ring = trace_thread_ring();
+    uint64_t w = ring->write.load(std::memory_order_relaxed);
+    trace_event_t& e = ring->events[w & (trace_ring_t::size - 1)];
+    e.ts_ns = trace_now_ns();
+    e.name = name;
+    e.value = value;
+    e.type = type;
+    ring->write.store(w + 1, std::memory_order_release);
+}
+
+void trace_append_string(std::string& out, const char* str) {
+    out += '"';
+    for (const char* c = str ? str : ""; *c; ++c) {
+        if (*c == '"' || *c == '\\') out += '\\';
+        if ((unsigned char)*c >= 0x20) out += *c;
+    }
+    out += '"';
+}
+}
+
+extern "C" {
+void trace_start(void) {
+    trace_start_ns = trace_now_ns();
+    trace_enabled = true;
+}
+void trace_stop(void) { trace_enabled = false; }
+bool trace_active(void) { return trace_enabled.load(std::memory_order_relaxed); }
+void trace_begin(const char* name) { trace_record(TRACE_BEGIN, name, 0); }
+void trace_end(void) { trace_record(TRACE_END, nullptr, 0); }
+void trace_instant(const char* name) { trace_record(TRACE_INSTANT, name, 0); }
+void trace_counter(const char* name, int64_t value) { trace_record(TRACE_COUNTER, name, (uint64_t)value); }
+void trace_async_begin(const char* name, uint64_t id) { trace_record(TRACE_ASYNC_BEGIN, name, id); }
+void trace_async_end(const char* name, uint64_t id) { trace_record(TRACE_ASYNC_END, name, id); }
+void trace_set_thread_name(const char* name) {
+    thread_name = name;
+    if (thread_ring) thread_ring->thread_name = name;
+}
+
+char* trace_export_json(size_t* size) {
+    std::vector<trace_ring_t*> rings;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        rings = registry;
+    }
+    uint64_t start_ns = trace_start_ns;
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    char buffer[256];
+    std::vector<trace_event_t> events;
+    for (trace_ring_t* ring : rings) {
+        const char* name = ring->thread_name;
+        snprintf(buffer, sizeof(buffer), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":",
+                 first ? "" : ",\n", ring->tid);
+        out += buffer;
+        if (name) trace_append_string(out, name);
+        else {
+            snprintf(buffer, sizeof(buffer), "\"Thread %d\"", ring->tid);
+            out += buffer;
+        }
+        out += "}}";
+        first = false;
+
+        uint64_t end = ring->write.load(std::memory_order_acquire);
+        uint64_t begin = end > trace_ring_t::size ? end - trace_ring_t::size : 0;
+        events.assign(ring->events, ring->events + trace_ring_t::size);
+        // The owner kept recording while the ring was copied, the slots it reached are newer events
+        uint64_t overwritten = ring->write.load(std::memory_order_acquire);
+        if (overwritten > trace_ring_t::size && overwritten - trace_ring_t::size > begin)
+            begin = overwritten - trace_ring_t::size;
+        for (uint64_t i = begin; i < end; ++i) {
+            const trace_event_t& e = events[i & (trace_ring_t::size - 1)];
+            if (e.ts_ns < start_ns) continue;
+            double ts = (e.ts_ns - start_ns) * 1e-3;
+            static const char* phases[] = {"B", "E", "i", "C", "b", "e"};
+            snprintf(buffer, sizeof(buffer), ",\n{\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", phases[e.type], ts, ring->tid);
+            out += buffer;
+            if (e.type != TRACE_END) {
+                out += ",\"name\":";
+                trace_append_string(out, e.name);
+            }
+            if (e.type == TRACE_INSTANT) out += ",\"s\":\"t\"";
+            else if (e.type == TRACE_COUNTER) {
+                snprintf(buffer, sizeof(buffer), ",\"args\":{\"value\":%lld}", (long long)(int64_t)e.value);
+                out += buffer;
+            } else if (e.type == TRACE_ASYNC_BEGIN || e.type == TRACE_ASYNC_END) {
+                snprintf(buffer, sizeof(buffer), ",\"cat\":\"async\",\"id\":\"0x%llx\"", (unsigned long long)e.value);
+                out += buffer;
+            }
+            out += '}';
+        }
+    }
+    out += "\n]}\n";
+    char* result = (char*)malloc(out.size() + 1);
+    if (!result) return nullptr;
+    memcpy(result, out.c_str(), out.size() + 1);
+    if (size) *size = out.size();
+    return result;
+}
+
+bool trace_save_json(const char* path) {
+    size_t size = 0;
+    char* json = trace_export_json(&size);
+    if (!json) return false;
+    FILE* f = fopen(path, "wb");
+    bool ok = f && fwrite(json, 1, size, f) == size;
+    if (f) fclose(f);
+    free(json);
+    if (!ok) printf("Failed to write trace to %s\n", path);
+    return ok;
+}
+}
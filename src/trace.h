@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Timeline recording for tracking down stutters. Every thread writes its events into its own ring so
+// recording never takes a lock, the oldest events are overwritten once a ring is full. Names must
+// be string literals (or otherwise outlive the recording), only the pointer is stored.
+// All calls are cheap no-ops while no recording is active.
+void trace_start(void);
+void trace_stop(void);
+bool trace_active(void);
+// Slices nest on the calling thread, every trace_begin needs a trace_end on the same thread
+void trace_begin(const char* name);
+void trace_end(void);
+void trace_instant(const char* name);
+void trace_counter(const char* name, int64_t value);
+// Spans that start and end on different threads or callbacks, matched by name and id
+void trace_async_begin(const char* name, uint64_t id);
+void trace_async_end(const char* name, uint64_t id);
+// Name shown for the calling thread in the timeline
+void trace_set_thread_name(const char* name);
+// Chrome trace event JSON (chrome://tracing, ui.perfetto.dev) of the events recorded since the last
+// trace_start. Returns a malloc'd null terminated string, size is set to its length if not NULL.
+char* trace_export_json(size_t* size);
+bool trace_save_json(const char* path);
+
+#endif
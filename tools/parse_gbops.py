@@ -49,6 +49,7 @@ typedef struct{
 const static sb_instr_t sb_decode_table[]={
 """)
   opcode_num = 0;
+  decoded_ops = []
   for op in opcode_list:
 
     # Rename problematic opcodes
@@ -118,12 +119,28 @@ const static sb_instr_t sb_decode_table[]={
         unique_src[p]=True;
 
     impl_name = "sb_"+op_name.lower()+"_impl";
+    decoded_ops+=[(impl_name, splits[0], splits[3], parameters[0], parameters[1])]
     f.write(f'  {{ {impl_name:16}, {instr_name:16}, "{splits[3]}", {length},'
             f'{non_taken_latency}, {taken_latency}, SB_OP_{parameters[0]}, '
             f'SB_OP_{parameters[1]} }},\n') 
 
   f.write("""
 };
+
+// Executes an already fetched opcode (+256 for CB prefixed ones). Each opcode gets its own case
+// with the operands and flag mask as constants, so the operand and flag switches fold away.
+static FORCE_INLINE void sb_execute_instr(sb_gb_t* gb, unsigned op){
+  switch(op){
+""")
+  for (i, (impl_name, instr_name, flags, src1, src2)) in enumerate(decoded_ops):
+    # Operands are loaded in order since indirect HL+/HL- loads have side effects
+    f.write(f'    case 0x{i:03x}: {{ /* {instr_name} */\n'
+            f'      int op1 = sb_load_operand(gb,SB_OP_{src1});\n'
+            f'      int op2 = sb_load_operand(gb,SB_OP_{src2});\n'
+            f'      {impl_name}(gb,op1,op2,SB_OP_{src1},SB_OP_{src2},(const uint8_t*)"{flags}");\n'
+            f'    }} break;\n')
+  f.write("""  }
+}
 #endif
 """);
 
@@ -156,7 +173,7 @@ with open("../src/sb_instr_impl_template.h","w") as f:
     f.write("uint8_t sb_read8(sb_gb_t *gb, int addr);\n\n");                                        
     f.write("void sb_store8(sb_gb_t *gb, int addr, int value);\n\n");                                        
                                          
-    f.write("int sb_load_operand(sb_gb_t* gb, int operand){\n")
+    f.write("static FORCE_INLINE int sb_load_operand(sb_gb_t* gb, int operand){\n")
     f.write("  switch(operand){\n");
 
     for (src,_) in sorted(unique_src.items()):
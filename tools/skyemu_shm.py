@@ -0,0 +1,151 @@
+import ctypes
+import mmap
+import os
+import struct
+import sys
+
+# Python client of the shared memory control channel, see src/shm_control.h for the layout.
+# Start SkyEmu with --shm <name>, e.g. "SkyEmu http_server 8080 game.gba --shm /skyemu", then:
+#
+#   emu = SkyEmuShm("/skyemu")
+#   emu.add_ram_window(0, 0x02000000, 256)
+#   emu.input(SkyEmuShm.key_bit("A"))
+#   emu.step(60)
+#   frame = emu.wait_frame()
+#   print(frame.frame, frame.width, frame.height, frame.ram[:16])
+
+MAGIC = 0x4d48534b
+VERSION = 1
+MAX_FRAME_BYTES = 256*192*2*4
+AUDIO_FRAMES = 16384
+MAX_RAM_WINDOWS = 16
+MAX_RAM_BYTES = 1024*1024
+CMD_QUEUE_SIZE = 256
+
+CMD_INPUT = 1
+CMD_TOUCH = 2
+CMD_RUN = 3
+CMD_PAUSE = 4
+CMD_STEP = 5
+CMD_WRITE_BYTE = 6
+CMD_ADD_RAM_WINDOW = 7
+CMD_CLEAR_RAM_WINDOWS = 8
+CMD_CAPTURE_SLOT = 9
+CMD_LOAD_SLOT = 10
+
+# First HCS /input keys, bit n of CMD_INPUT is the n'th key of se_keybind_names in src/main.c
+KEYS = ["A", "B", "X", "Y", "Up", "Down", "Left", "Right", "L", "R", "Start", "Select",
+        "Fold Screen (NDS)", "Tap Screen (NDS)"]
+
+class Cmd(ctypes.Structure):
+  _fields_ = [("type", ctypes.c_uint32), ("map", ctypes.c_uint32), ("address", ctypes.c_uint64), ("value", ctypes.c_uint64)]
+
+class RamWindow(ctypes.Structure):
+  _fields_ = [("map", ctypes.c_uint32), ("size", ctypes.c_uint32), ("address", ctypes.c_uint64),
+              ("offset", ctypes.c_uint32), ("padding", ctypes.c_uint32)]
+
+class Slot(ctypes.Structure):
+  _fields_ = [("frame", ctypes.c_uint64), ("width", ctypes.c_uint32), ("height", ctypes.c_uint32),
+              ("ram_bytes", ctypes.c_uint32), ("num_ram_windows", ctypes.c_uint32),
+              ("ram_windows", RamWindow*MAX_RAM_WINDOWS),
+              ("pixels", ctypes.c_uint8*MAX_FRAME_BYTES), ("ram", ctypes.c_uint8*MAX_RAM_BYTES)]
+
+class Channel(ctypes.Structure):
+  _fields_ = [("magic", ctypes.c_uint32), ("version", ctypes.c_uint32), ("size", ctypes.c_uint64),
+              ("sample_rate", ctypes.c_uint32), ("padding0", ctypes.c_uint8*44),
+              ("seq", ctypes.c_uint32), ("writing", ctypes.c_uint32), ("padding1", ctypes.c_uint8*56),
+              ("audio_write", ctypes.c_uint32), ("padding2", ctypes.c_uint8*60),
+              ("cmd_write", ctypes.c_uint32), ("padding3", ctypes.c_uint8*60),
+              ("cmd_read", ctypes.c_uint32), ("padding4", ctypes.c_uint8*60),
+              ("cmds", Cmd*CMD_QUEUE_SIZE), ("audio", ctypes.c_int16*(AUDIO_FRAMES*2)), ("slots", Slot*2)]
+
+class Frame:
+  def __init__(self, frame, width, height, pixels, ram, ram_windows):
+    self.frame = frame
+    self.width = width
+    self.height = height
+    self.pixels = pixels # bytes, height x width x RGBA8
+    self.ram = ram # bytes, the RAM windows stacked in the order they were added
+    self.ram_windows = ram_windows # (map, address, size, offset) tuples
+
+class SkyEmuShm:
+  # CPython gives no atomics, the client relies on the ordering of x86 and the fact that the
+  # interpreter doesn't reorder its accesses to the mapping. On weaker memory models use shm_control.h.
+  def __init__(self, name):
+    size = ctypes.sizeof(Channel)
+    if sys.platform == "win32":
+      self.map = mmap.mmap(-1, size, tagname=name)
+    else:
+      fd = os.open("/dev/shm/"+name.lstrip("/"), os.O_RDWR)
+      try:
+        self.map = mmap.mmap(fd, size)
+      finally:
+        os.close(fd)
+    self.shm = Channel.from_buffer(self.map)
+    if self.shm.magic != MAGIC or self.shm.version != VERSION or self.shm.size != size:
+      raise RuntimeError("%s is not a SkyEmu shared memory control channel of this version" % name)
+    self.audio_read = self.shm.audio_write
+
+  def close(self):
+    del self.shm
+    self.map.close()
+
+  @staticmethod
+  def key_bit(*names):
+    return sum(1 << KEYS.index(n) for n in names)
+
+  def push_cmd(self, type, map=0, address=0, value=0):
+    shm = self.shm
+    write = shm.cmd_write
+    while (write-shm.cmd_read) & 0xffffffff >= CMD_QUEUE_SIZE: pass
+    cmd = shm.cmds[write % CMD_QUEUE_SIZE]
+    cmd.type, cmd.map, cmd.address, cmd.value = type, map, address, value
+    shm.cmd_write = (write+1) & 0xffffffff
+
+  def input(self, buttons): self.push_cmd(CMD_INPUT, value=buttons)
+  def touch(self, x, y, down=True):
+    xy = struct.unpack("<Q", struct.pack("<ff", x, y))[0]
+    self.push_cmd(CMD_TOUCH, address=int(down), value=xy)
+  def run(self): self.push_cmd(CMD_RUN)
+  def pause(self): self.push_cmd(CMD_PAUSE)
+  def step(self, frames=1): self.push_cmd(CMD_STEP, value=frames)
+  def write_byte(self, map, address, value): self.push_cmd(CMD_WRITE_BYTE, map, address, value)
+  def add_ram_window(self, map, address, size): self.push_cmd(CMD_ADD_RAM_WINDOW, map, address, size)
+  def clear_ram_windows(self): self.push_cmd(CMD_CLEAR_RAM_WINDOWS)
+  def capture_slot(self, slot): self.push_cmd(CMD_CAPTURE_SLOT, value=slot)
+  def load_slot(self, slot): self.push_cmd(CMD_LOAD_SLOT, value=slot)
+
+  def commands_done(self):
+    return self.shm.cmd_read == self.shm.cmd_write
+
+  def read_frame(self):
+    # Same protocol as shm_control_read_slot, None if nothing was published or the copy was torn
+    shm = self.shm
+    seq = shm.seq
+    if seq == 0: return None
+    slot = shm.slots[seq & 1]
+    width, height, ram_bytes = slot.width, slot.height, slot.ram_bytes
+    if width*height*4 > MAX_FRAME_BYTES or ram_bytes > MAX_RAM_BYTES: return None
+    windows = [(w.map, w.address, w.size, w.offset) for w in slot.ram_windows[:slot.num_ram_windows]]
+    frame = Frame(slot.frame, width, height, bytes(slot.pixels[:width*height*4]), bytes(slot.ram[:ram_bytes]), windows)
+    if (shm.writing-seq) & 0xffffffff > 1: return None
+    return frame
+
+  def wait_frame(self, newer_than=0):
+    # Waits for the queued commands to be taken and a frame after newer_than to be published
+    while not self.commands_done(): pass
+    while True:
+      frame = self.read_frame()
+      if frame and frame.frame > newer_than: return frame
+
+  def read_audio(self):
+    # Interleaved stereo int16 samples written since the last call, the oldest are lost once
+    # more than AUDIO_FRAMES frames are pending
+    write = self.shm.audio_write
+    pending = min((write-self.audio_read) & 0xffffffff, AUDIO_FRAMES)
+    samples = []
+    for f in range(write-pending, write):
+      i = (f % AUDIO_FRAMES)*2
+      samples += self.shm.audio[i:i+2]
+    self.audio_read = write
+    return samples